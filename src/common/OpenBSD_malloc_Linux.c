@@ -286,6 +286,57 @@ static void	ifree(void *ptr);
 static void	*irealloc(void *ptr, size_t size);
 static void	*malloc_bytes(size_t size);
 
+#ifdef OPENBSD_MALLOC_THREAD_CACHE
+/*
+ * Per-thread front end for the small chunk buckets.
+ *
+ * Each thread keeps a few free chunks of every small size class in a
+ * private bin, so that most malloc() calls for sizes up to malloc_maxsize
+ * never touch gen_mutex.  Bins are refilled TCACHE_BATCH chunks at a time
+ * under the lock.  free() does not know the size of a chunk without
+ * looking in the page directory, which needs the lock, so frees are queued
+ * and handled TCACHE_PENDING_MAX at a time: small chunks go back into the
+ * thread's bins while there is room, everything else goes to ifree().
+ *
+ * Since chunks sitting in a bin are still "allocated" as far as the page
+ * bitmaps are concerned, a double free of a pointer that has not reached
+ * ifree() yet goes unnoticed.  The cache is therefore off whenever one of
+ * the debugging options (J, Z, G, P, F) is set.
+ */
+#define	TCACHE_MIN_SHIFT	4	/* log2(malloc_minsize) */
+#define	TCACHE_N_CLASSES	(malloc_pageshift - TCACHE_MIN_SHIFT)
+#define	TCACHE_CLASS_MAX	32	/* chunks kept per size class */
+#define	TCACHE_BATCH		16	/* chunks fetched per refill */
+#define	TCACHE_PENDING_MAX	64	/* frees queued before a flush */
+
+struct tcache {
+	struct tcache	*next;	/* all live caches, for statistics */
+	struct tcache	*prev;
+	int		n_bin[TCACHE_N_CLASSES];
+	void		*bin[TCACHE_N_CLASSES][TCACHE_CLASS_MAX];
+	int		n_pending;
+	void		*pending[TCACHE_PENDING_MAX];
+	u_long		hits;	/* allocations served without the lock */
+};
+
+/* Nonzero once malloc_init() decided the thread cache may be used. */
+static int	tcache_enabled;
+/* Used only to get a destructor run when a thread exits. */
+static pthread_key_t tcache_key;
+/* List of every live cache; protected by gen_mutex. */
+static struct tcache *tcache_list;
+/* Hits of caches belonging to threads that have exited. */
+static u_long	tcache_retired_hits;
+
+#define	TCACHE_NONE	0	/* no cache yet */
+#define	TCACHE_BUSY	1	/* creating one, or thread is exiting */
+#define	TCACHE_LIVE	2
+static __thread int tcache_state;
+static __thread struct tcache *tcache_self;
+
+static void	tcache_destroy(void *arg);
+#endif /* OPENBSD_MALLOC_THREAD_CACHE */
+
 /*
  * Function for page directory lookup.
  */
@@ -817,6 +868,12 @@ malloc_init(void)
 	/* Been here, done that. */
 	malloc_started++;
 
+#ifdef OPENBSD_MALLOC_THREAD_CACHE
+	if (!malloc_junk && !malloc_zero && !malloc_guard && !malloc_ptrguard &&
+	    !malloc_freeprot && pthread_key_create(&tcache_key, tcache_destroy) == 0)
+		tcache_enabled = 1;
+#endif /* OPENBSD_MALLOC_THREAD_CACHE */
+
 	/* Recalculate the cache size in bytes, and make sure it's nonzero. */
 	if (!malloc_cache)
 		malloc_cache++;
@@ -1868,6 +1925,200 @@ malloc_recurse(void)
 	errno = EDEADLK;
 }
 
+#ifdef OPENBSD_MALLOC_THREAD_CACHE
+/*
+ * Return the size class of the small chunk at ptr, or -1 if ptr is not a
+ * chunk of a cacheable size.  Called with the lock held.
+ */
+static int
+tcache_chunk_class(void *ptr)
+{
+	struct pginfo	*info;
+	struct pdinfo	*pi;
+	u_long		index, i;
+
+	index = ptr2index(ptr);
+	if (index < malloc_pageshift || index > last_index)
+		return (-1);
+	pdir_lookup(index, &pi);
+	if (pi == NULL || PD_IDX(pi->dirnum) != PI_IDX(index))
+		return (-1);
+	info = pi->base[PI_OFF(index)];
+	if (info < MALLOC_MAGIC || info->size == 0 ||
+	    info->shift < TCACHE_MIN_SHIFT)
+		return (-1);
+	if ((u_long) ptr & ((1UL << info->shift) - 1))
+		return (-1);
+	/* Let ifree() complain about chunks that are already free. */
+	i = ((u_long) ptr & malloc_pagemask) >> info->shift;
+	if (info->bits[i / MALLOC_BITS] & (1UL << (i % MALLOC_BITS)))
+		return (-1);
+	return (info->shift - TCACHE_MIN_SHIFT);
+}
+
+/*
+ * Hand every queued free of tc either to its bin or back to the
+ * allocator.  Called with the lock held.
+ */
+static void
+tcache_flush_pending(struct tcache *tc)
+{
+	int		i, c;
+	void		*ptr;
+
+	for (i = 0; i < tc->n_pending; i++) {
+		ptr = tc->pending[i];
+		c = tcache_chunk_class(ptr);
+		if (c >= 0 && tc->n_bin[c] < TCACHE_CLASS_MAX)
+			tc->bin[c][tc->n_bin[c]++] = ptr;
+		else
+			ifree(ptr);
+	}
+	tc->n_pending = 0;
+}
+
+/*
+ * pthread key destructor: give everything held by a thread's cache back
+ * to the allocator when the thread exits.
+ */
+static void
+tcache_destroy(void *arg)
+{
+	struct tcache	*tc = arg;
+	int		c, i;
+
+	tcache_state = TCACHE_BUSY;
+	tcache_self = NULL;
+
+	_MALLOC_LOCK();
+	malloc_active++;
+	for (i = 0; i < tc->n_pending; i++)
+		ifree(tc->pending[i]);
+	for (c = 0; c < TCACHE_N_CLASSES; c++)
+		for (i = 0; i < tc->n_bin[c]; i++)
+			ifree(tc->bin[c][i]);
+	if (tc->prev)
+		tc->prev->next = tc->next;
+	else
+		tcache_list = tc->next;
+	if (tc->next)
+		tc->next->prev = tc->prev;
+	tcache_retired_hits += tc->hits;
+	ifree(tc);
+	malloc_active--;
+	_MALLOC_UNLOCK();
+}
+
+/*
+ * Return the calling thread's cache, creating it if needed, or NULL if
+ * the thread cache cannot be used right now.
+ */
+static struct tcache *
+tcache_get(void)
+{
+	struct tcache	*tc;
+
+	if (tcache_state == TCACHE_LIVE)
+		return (tcache_self);
+	if (tcache_state == TCACHE_BUSY || !malloc_started || !tcache_enabled)
+		return (NULL);
+
+	tcache_state = TCACHE_BUSY;
+	_MALLOC_LOCK();
+	if (malloc_active++) {
+		malloc_recurse();
+		return (NULL);
+	}
+	tc = imalloc(sizeof *tc);
+	if (tc != NULL) {
+		memset(tc, 0, sizeof *tc);
+		tc->next = tcache_list;
+		if (tcache_list)
+			tcache_list->prev = tc;
+		tcache_list = tc;
+	}
+	malloc_active--;
+	_MALLOC_UNLOCK();
+	if (tc == NULL)
+		return (NULL);
+	/* pthread_setspecific() may allocate; we are still TCACHE_BUSY. */
+	if (pthread_setspecific(tcache_key, tc) != 0) {
+		tcache_destroy(tc);
+		return (NULL);
+	}
+	tcache_self = tc;
+	tcache_state = TCACHE_LIVE;
+	return (tc);
+}
+
+/*
+ * Allocate size bytes (0 < size <= malloc_maxsize) from tc, refilling
+ * the matching bin if it is empty.  Return NULL if the caller should fall
+ * back to the locked path.
+ */
+static void *
+tcache_malloc(struct tcache *tc, size_t size)
+{
+	int		c, i, j;
+	void		*p;
+
+	j = TCACHE_MIN_SHIFT;
+	if (size > malloc_minsize) {
+		j = 1;
+		i = size - 1;
+		while (i >>= 1)
+			j++;
+	}
+	c = j - TCACHE_MIN_SHIFT;
+
+	if (tc->n_bin[c] == 0) {
+		_MALLOC_LOCK();
+		if (malloc_active++) {
+			malloc_recurse();
+			return (NULL);
+		}
+		/* Recycle queued frees first; they may fill this bin. */
+		tcache_flush_pending(tc);
+		while (tc->n_bin[c] < TCACHE_BATCH) {
+			if ((p = imalloc((size_t)1 << j)) == NULL)
+				break;
+			tc->bin[c][tc->n_bin[c]++] = p;
+		}
+		malloc_active--;
+		_MALLOC_UNLOCK();
+		if (tc->n_bin[c] == 0)
+			return (NULL);
+	} else
+		tc->hits++;
+	return (tc->bin[c][--tc->n_bin[c]]);
+}
+
+/*
+ * Queue ptr to be freed by tc.  Return 0 if the caller should fall back
+ * to the locked path instead.
+ */
+static int
+tcache_free(struct tcache *tc, void *ptr)
+{
+	tc->pending[tc->n_pending++] = ptr;
+	if (tc->n_pending < TCACHE_PENDING_MAX)
+		return (1);
+
+	_MALLOC_LOCK();
+	if (malloc_active++) {
+		/* Leave the queue full; the next free will retry. */
+		tc->n_pending--;
+		malloc_recurse();
+		return (0);
+	}
+	malloc_func = " in free():";
+	tcache_flush_pending(tc);
+	malloc_active--;
+	_MALLOC_UNLOCK();
+	return (1);
+}
+#endif /* OPENBSD_MALLOC_THREAD_CACHE */
+
 /*
  * These are the public exported interface routines.
  */
@@ -1875,6 +2126,14 @@ void *
 malloc(size_t size)
 {
 	void		*r;
+#ifdef OPENBSD_MALLOC_THREAD_CACHE
+	struct tcache	*tc;
+
+	if (size != 0 && size <= malloc_maxsize && !align &&
+	    (tc = tcache_get()) != NULL &&
+	    (r = tcache_malloc(tc, size)) != NULL)
+		return (r);
+#endif /* OPENBSD_MALLOC_THREAD_CACHE */
 
 	if (!align)
 	_MALLOC_LOCK();
@@ -1898,10 +2157,19 @@ malloc(size_t size)
 void
 free(void *ptr)
 {
+#ifdef OPENBSD_MALLOC_THREAD_CACHE
+	struct tcache	*tc;
+#endif /* OPENBSD_MALLOC_THREAD_CACHE */
+
 	/* This is legal. XXX quick path */
 	if (ptr == NULL)
 		return;
 
+#ifdef OPENBSD_MALLOC_THREAD_CACHE
+	if ((tc = tcache_get()) != NULL && tcache_free(tc, ptr))
+		return;
+#endif /* OPENBSD_MALLOC_THREAD_CACHE */
+
 	_MALLOC_LOCK();
 	malloc_func = " in free():";
 	if (malloc_active++) {
@@ -2030,3 +2298,64 @@ size_t malloc_good_size(size_t size)
 		return pageround(size);
 	}
 }
+
+/*
+ * Report how the allocator is using its pages, so that callers can judge
+ * fragmentation: pages given to large allocations, pages carved into small
+ * chunks, free pages being kept around, how many bytes inside the chunk
+ * pages are free, and how many chunks are parked in thread caches.
+ */
+void
+malloc_get_stats(size_t *large_pages, size_t *chunk_pages,
+    size_t *free_pages, size_t *chunk_free_bytes, size_t *cached_chunks,
+    unsigned long *cache_hits)
+{
+	struct pdinfo	*pi;
+	struct pginfo	*info;
+	u_long		i, index;
+#ifdef OPENBSD_MALLOC_THREAD_CACHE
+	struct tcache	*tc;
+	int		c;
+#endif /* OPENBSD_MALLOC_THREAD_CACHE */
+
+	*large_pages = *chunk_pages = *free_pages = 0;
+	*chunk_free_bytes = *cached_chunks = 0;
+	*cache_hits = 0;
+
+	_MALLOC_LOCK();
+	if (!malloc_started) {
+		_MALLOC_UNLOCK();
+		return;
+	}
+	pi = (struct pdinfo *) ((caddr_t) page_dir + pdi_off);
+	for (; pi != NULL; pi = pi->next) {
+		for (i = 0; i < pdi_mod; i++) {
+			index = PD_IDX(pi->dirnum) * pdi_mod + i;
+			if (index > last_index)
+				break;
+			info = pi->base[i];
+			if (info == MALLOC_NOT_MINE)
+				continue;
+			else if (info == MALLOC_FREE)
+				++*free_pages;
+			else if (info < MALLOC_MAGIC)
+				++*large_pages;
+			else {
+				++*chunk_pages;
+				*chunk_free_bytes += (size_t)info->free << info->shift;
+			}
+		}
+	}
+#ifdef OPENBSD_MALLOC_THREAD_CACHE
+	/* Other threads update their own caches without the lock, so these
+	 * numbers are only approximate. */
+	*cache_hits = tcache_retired_hits;
+	for (tc = tcache_list; tc != NULL; tc = tc->next) {
+		for (c = 0; c < TCACHE_N_CLASSES; c++)
+			*cached_chunks += tc->n_bin[c];
+		*cached_chunks += tc->n_pending;
+		*cache_hits += tc->hits;
+	}
+#endif /* OPENBSD_MALLOC_THREAD_CACHE */
+	_MALLOC_UNLOCK();
+}
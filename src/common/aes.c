@@ -53,6 +53,14 @@
 /*======================================================================*/
 /* Interface to AES code, and counter implementation */
 
+#ifdef USE_OPENSSL_CTR
+/** How many counter blocks do we encrypt at once in aes_crypt_inplace_multi,
+ * or precompute for a cipher with a keystream buffer?  Big enough to keep a
+ * pipelined AES implementation busy and to cover a whole cell, small enough
+ * to live on the stack. */
+#define AES_BATCH_BLOCKS 32
+#endif
+
 /** Implements an AES counter-mode cipher. */
 struct aes_cnt_cipher {
 /** This next element (however it's defined) is the AES key. */
@@ -91,6 +99,17 @@ struct aes_cnt_cipher {
 
   /** True iff we're using the evp implementation of this cipher. */
   uint8_t using_evp;
+
+#ifdef USE_OPENSSL_CTR
+  /** If this cipher precomputes its keystream, a buffer holding
+   * AES_BATCH_BLOCKS blocks of it; otherwise NULL.  When this is set, it
+   * replaces <b>buf</b> and <b>pos</b>, and ctr_buf is the counter for the
+   * first block <em>after</em> the buffer. */
+  uint8_t *keystream;
+  /** How many bytes of <b>keystream</b> have we used up?  When this is
+   * 16*AES_BATCH_BLOCKS, the buffer needs refilling. */
+  unsigned int keystream_pos;
+#endif
 };
 
 /** True if we should prefer the EVP implementation for AES, either because
@@ -204,6 +223,7 @@ aes_set_key(aes_cnt_cipher_t *cipher, const char *key, int key_bits)
 
 #ifdef USE_OPENSSL_CTR
   memset(cipher->buf, 0, sizeof(cipher->buf));
+  cipher->keystream_pos = 16*AES_BATCH_BLOCKS;
 #else
   _aes_fill_buf(cipher);
 #endif
@@ -219,6 +239,12 @@ aes_free_cipher(aes_cnt_cipher_t *cipher)
   if (cipher->using_evp) {
     EVP_CIPHER_CTX_cleanup(&cipher->key.evp);
   }
+#ifdef USE_OPENSSL_CTR
+  if (cipher->keystream) {
+    memset(cipher->keystream, 0, 16*AES_BATCH_BLOCKS);
+    tor_free(cipher->keystream);
+  }
+#endif
   memset(cipher, 0, sizeof(aes_cnt_cipher_t));
   tor_free(cipher);
 }
@@ -241,6 +267,71 @@ static void evp_block128_fn(const uint8_t in[16],
   int inl=16, outl=16;
   EVP_EncryptUpdate(ctx, out, &outl, in, inl);
 }
+
+/** Helper: increment the 128-bit big-endian counter in <b>ctr</b>. */
+static INLINE void
+aes_ctr_increment(uint8_t *ctr)
+{
+  int i;
+  for (i = 15; i >= 0; --i) {
+    if (++ctr[i])
+      break;
+  }
+}
+
+/** Helper: encrypt <b>n_blocks</b> consecutive counter blocks, starting with
+ * <b>cipher</b>'s current counter, into <b>out</b>, and advance the counter
+ * past them.  When we're using EVP, this is a single ECB call over all the
+ * blocks, so that hardware implementations can work on several at once. */
+static void
+aes_fill_keystream(aes_cnt_cipher_t *cipher, uint8_t *out, int n_blocks)
+{
+  uint8_t ctrs[16*AES_BATCH_BLOCKS];
+  int i;
+  tor_assert(n_blocks <= AES_BATCH_BLOCKS);
+  for (i = 0; i < n_blocks; ++i) {
+    memcpy(ctrs + 16*i, cipher->ctr_buf.buf, 16);
+    aes_ctr_increment(cipher->ctr_buf.buf);
+  }
+  if (cipher->using_evp) {
+    int outl = 16*n_blocks;
+    EVP_EncryptUpdate(&cipher->key.evp, out, &outl, ctrs, 16*n_blocks);
+  } else {
+    for (i = 0; i < n_blocks; ++i)
+      AES_encrypt(ctrs + 16*i, out + 16*i, &cipher->key.aes);
+  }
+}
+
+/** Helper: encrypt <b>len</b> bytes from <b>input</b> into <b>output</b>
+ * (which may be the same buffer) using the precomputed keystream in
+ * <b>cipher</b>-&gt;keystream, refilling it a batch of blocks at a time
+ * whenever it runs out. */
+static void
+aes_crypt_buffered(aes_cnt_cipher_t *cipher, const char *input, size_t len,
+                   char *output)
+{
+  const unsigned int ks_len = 16*AES_BATCH_BLOCKS;
+  while (len) {
+    size_t i, n;
+    const uint8_t *ks;
+    if (cipher->keystream_pos == ks_len) {
+      aes_fill_keystream(cipher, cipher->keystream, AES_BATCH_BLOCKS);
+      cipher->keystream_pos = 0;
+    }
+    n = ks_len - cipher->keystream_pos;
+    if (n > len)
+      n = len;
+    ks = cipher->keystream + cipher->keystream_pos;
+    /* One straight pass with no block boundaries, so the compiler can
+     * vectorize it. */
+    for (i = 0; i < n; ++i)
+      output[i] = input[i] ^ ks[i];
+    cipher->keystream_pos += (unsigned)n;
+    input += n;
+    output += n;
+    len -= n;
+  }
+}
 #endif
 
 /** Encrypt <b>len</b> bytes from <b>input</b>, storing the result in
@@ -252,7 +343,9 @@ aes_crypt(aes_cnt_cipher_t *cipher, const char *input, size_t len,
           char *output)
 {
 #ifdef USE_OPENSSL_CTR
-  if (cipher->using_evp) {
+  if (cipher->keystream) {
+    aes_crypt_buffered(cipher, input, len, output);
+  } else if (cipher->using_evp) {
     /* In openssl 1.0.0, there's an if'd out EVP_aes_128_ctr in evp.h.  If
      * it weren't disabled, it might be better just to use that.
      */
@@ -334,6 +427,87 @@ aes_crypt_inplace(aes_cnt_cipher_t *cipher, char *data, size_t len)
 #endif
 }
 
+/** Encrypt, in place, the <b>n_chunks</b> buffers in <b>chunks</b>, each
+ * <b>len</b> bytes long, as if they were one contiguous stream: this has the
+ * same effect as calling aes_crypt_inplace on each of them in order, but
+ * generates the keystream many blocks at a time. */
+void
+aes_crypt_inplace_multi(aes_cnt_cipher_t *cipher, char **chunks, size_t len,
+                        int n_chunks)
+{
+#ifdef USE_OPENSSL_CTR
+  uint8_t keystream[16*AES_BATCH_BLOCKS];
+  size_t remaining, off = 0;
+  int idx = 0;
+
+  if (PREDICT_UNLIKELY(!len || n_chunks <= 0))
+    return;
+  if (cipher->keystream) {
+    /* The buffered keystream is already generated a batch at a time. */
+    for (idx = 0; idx < n_chunks; ++idx)
+      aes_crypt_buffered(cipher, chunks[idx], len, chunks[idx]);
+    return;
+  }
+  remaining = len * n_chunks;
+
+  /* Use up whatever is left of the current keystream block. */
+  while (cipher->pos && remaining) {
+    size_t n = 16 - cipher->pos;
+    if (n > len - off)
+      n = len - off;
+    aes_crypt_inplace(cipher, chunks[idx]+off, n);
+    off += n;
+    remaining -= n;
+    if (off == len) {
+      ++idx;
+      off = 0;
+    }
+  }
+
+  /* Now handle as many whole blocks as we can, a batch at a time. */
+  while (remaining >= 16) {
+    int n_blocks = (int)(remaining / 16);
+    size_t n, ks_pos = 0;
+    if (n_blocks > AES_BATCH_BLOCKS)
+      n_blocks = AES_BATCH_BLOCKS;
+    aes_fill_keystream(cipher, keystream, n_blocks);
+    n = 16*n_blocks;
+    remaining -= n;
+    while (n) {
+      size_t i, m = len - off;
+      char *cp = chunks[idx]+off;
+      if (m > n)
+        m = n;
+      for (i = 0; i < m; ++i)
+        cp[i] ^= keystream[ks_pos+i];
+      ks_pos += m;
+      n -= m;
+      off += m;
+      if (off == len) {
+        ++idx;
+        off = 0;
+      }
+    }
+  }
+
+  /* Anything left is less than a block; let the regular code do it. */
+  while (remaining) {
+    size_t n = len - off;
+    if (n > remaining)
+      n = remaining;
+    aes_crypt_inplace(cipher, chunks[idx]+off, n);
+    remaining -= n;
+    ++idx;
+    off = 0;
+  }
+  memset(keystream, 0, sizeof(keystream));
+#else
+  int i;
+  for (i = 0; i < n_chunks; ++i)
+    aes_crypt_inplace(cipher, chunks[i], len);
+#endif
+}
+
 /** Reset the 128-bit counter of <b>cipher</b> to the 16-bit big-endian value
  * in <b>iv</b>. */
 void
@@ -348,8 +522,35 @@ aes_set_iv(aes_cnt_cipher_t *cipher, const char *iv)
   cipher->pos = 0;
   memcpy(cipher->ctr_buf.buf, iv, 16);
 
-#ifndef USE_OPENSSL_CTR
+#ifdef USE_OPENSSL_CTR
+  /* Anything we precomputed was for the old counter. */
+  cipher->keystream_pos = 16*AES_BATCH_BLOCKS;
+#else
   _aes_fill_buf(cipher);
 #endif
 }
 
+/** Make <b>cipher</b> precompute its keystream AES_BATCH_BLOCKS blocks at a
+ * time into a buffer of its own, so that encrypting a cell is a single XOR
+ * pass over keystream generated by one multi-block call.  This only pays off
+ * when <b>cipher</b> uses EVP, where the batch can go to a pipelined (e.g.
+ * AES-NI or hardware) implementation.  Must be called after aes_set_key()
+ * and before any data is encrypted.  Return 0 if the buffer is now in use,
+ * or -1 if it isn't supported for this cipher. */
+int
+aes_cipher_enable_keystream_buffer(aes_cnt_cipher_t *cipher)
+{
+#ifdef USE_OPENSSL_CTR
+  tor_assert(cipher->pos == 0);
+  if (!cipher->using_evp)
+    return -1;
+  if (!cipher->keystream)
+    cipher->keystream = tor_malloc(16*AES_BATCH_BLOCKS);
+  cipher->keystream_pos = 16*AES_BATCH_BLOCKS;
+  return 0;
+#else
+  (void)cipher;
+  return -1;
+#endif
+}
+
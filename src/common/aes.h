@@ -22,7 +22,10 @@ void aes_set_key(aes_cnt_cipher_t *cipher, const char *key, int key_bits);
 void aes_crypt(aes_cnt_cipher_t *cipher, const char *input, size_t len,
                char *output);
 void aes_crypt_inplace(aes_cnt_cipher_t *cipher, char *data, size_t len);
+void aes_crypt_inplace_multi(aes_cnt_cipher_t *cipher, char **chunks,
+                             size_t len, int n_chunks);
 void aes_set_iv(aes_cnt_cipher_t *cipher, const char *iv);
+int aes_cipher_enable_keystream_buffer(aes_cnt_cipher_t *cipher);
 
 int evaluate_evp_for_aes(int force_value);
 
@@ -0,0 +1,24 @@
+"a36ad1dc2445ca257375154d8f3455dffc93567f  aes.c\n"
+"6dfa57cff511c1a723f7f6b48c717a0b597918d6  crypto.c\n"
+"f479f6cddb9de9480a1c4c4476372d598a8fe071  torgzip.c\n"
+"7206fb4ebe7ef4c1cdff3143d001db5907ef431a  tortls.c\n"
+"4da8a9beaa45160fb9b440de91cfc9308d17cf23  address.h\n"
+"14bdc0ca591b3f84f7148a80e9a0176502541c5b  aes.h\n"
+"d5a23f5ce3f8d4dff5b41fe128b744a7ea34bbd2  ciphers.inc\n"
+"a40cec879f99e13d9cb8b0cb3418ba8c79974c74  compat.h\n"
+"e5876a7e97316099e2f8cf80d6dc483fabc2547b  compat_libevent.h\n"
+"2e2f91d7d45a282af5013ef2e8a27e5bf458501e  container.h\n"
+"67fc4092121d9938e503f39a50dcb456233eadd4  crypto.h\n"
+"cc4fb0ea82a6796f3a3716efa18e756ada94d3ef  di_ops.h\n"
+"9647c79edf901e6f6f99d910691c8bca05b3bbb2  ht.h\n"
+"dd8d8eef9f7fecdf7bfe9ddc66803ce9ef3dac61  memarea.h\n"
+"32df9b885e8ed12922d8a59b933627f72d61d476  mempool.h\n"
+"8f2f760c49d356e9d40df04762662812f6cea78e  procmon.h\n"
+"f009567cb0708b2bfdff242353c07a7da6f4869f  strlcat.c\n"
+"7faeaf90301ad7d5d8db105590524a949a25dccf  strlcpy.c\n"
+"6941302b99ba78bbae1e7d0e1d06a7d3ca6670b3  torgzip.h\n"
+"0c3a14d0755d10e8d8b517643b6008b394f0f261  torint.h\n"
+"46d4f8c2f010fe4277f75d388de963b71eb93555  torlog.h\n"
+"ecbd9635d8a610ee09ed4ddf9f8b41c694c8af82  tortls.h\n"
+"c468b7dd93c6b1c871e74cdb70f5ec7069a5d3b5  tortls_states.h\n"
+"d2f15febbb4350816494dae7166abc5c86790e86  util.h\n"
@@ -140,14 +140,29 @@ tor_fopen_cloexec(const char *path, const char *mode)
   return result;
 }
 
-#ifdef HAVE_SYS_MMAN_H
 /** Try to create a memory mapping for <b>filename</b> and return it.  On
  * failure, return NULL.  Sets errno properly, using ERANGE to mean
  * "empty file". */
 tor_mmap_t *
 tor_mmap_file(const char *filename)
+{
+  return tor_mmap_file_flags(filename, 0);
+}
+
+#ifdef HAVE_SYS_MMAN_H
+/** Mappings at least this large are worth backing with huge pages, where
+ * the kernel can do so. */
+#define MMAP_HUGEPAGE_THRESHOLD (4*1024*1024)
+
+/** As tor_mmap_file(), but take a bitwise OR of TOR_MMAP_* flags saying how
+ * we're going to use the mapping, so that the kernel can read ahead or
+ * prefault accordingly.  The flags are only hints: platforms that don't
+ * support them ignore them. */
+tor_mmap_t *
+tor_mmap_file_flags(const char *filename, unsigned flags)
 {
   int fd; /* router file */
+  int mmap_flags = MAP_PRIVATE;
   char *string;
   int page_size;
   tor_mmap_t *res;
@@ -181,7 +196,18 @@ tor_mmap_file(const char *filename)
     return NULL;
   }
 
-  string = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+#ifdef POSIX_FADV_SEQUENTIAL
+  if (flags & TOR_MMAP_SEQUENTIAL)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  else if (flags & TOR_MMAP_RANDOM)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+#endif
+#ifdef MAP_POPULATE
+  if (flags & TOR_MMAP_POPULATE)
+    mmap_flags |= MAP_POPULATE;
+#endif
+
+  string = mmap(0, size, PROT_READ, mmap_flags, fd, 0);
   close(fd);
   if (string == MAP_FAILED) {
     int save_errno = errno;
@@ -196,8 +222,36 @@ tor_mmap_file(const char *filename)
   res->size = filesize;
   res->mapping_size = size;
 
+#ifdef MADV_HUGEPAGE
+  /* Only a hint: most kernels ignore it for file mappings, but those that
+   * can use huge pages here save us a lot of TLB misses. */
+  if (size >= MMAP_HUGEPAGE_THRESHOLD)
+    madvise(string, size, MADV_HUGEPAGE);
+#endif
+  tor_mmap_advise(res, flags);
+
   return res;
 }
+/** Tell the kernel how we're about to use the mapping in <b>handle</b>:
+ * <b>flags</b> is a bitwise OR of TOR_MMAP_SEQUENTIAL and TOR_MMAP_RANDOM.
+ * With neither, go back to the default behavior.  Only a hint. */
+void
+tor_mmap_advise(const tor_mmap_t *handle, unsigned flags)
+{
+#ifdef MADV_SEQUENTIAL
+  int advice = MADV_NORMAL;
+  if (flags & TOR_MMAP_SEQUENTIAL)
+    advice = MADV_SEQUENTIAL;
+  else if (flags & TOR_MMAP_RANDOM)
+    advice = MADV_RANDOM;
+  /* Cast away const: madvise takes a non-const pointer on some
+   * platforms. */
+  madvise((char*)handle->data, handle->mapping_size, advice);
+#else
+  (void)handle;
+  (void)flags;
+#endif
+}
 /** Release storage held for a memory mapping. */
 void
 tor_munmap_file(tor_mmap_t *handle)
@@ -207,11 +261,12 @@ tor_munmap_file(tor_mmap_t *handle)
 }
 #elif defined(MS_WINDOWS)
 tor_mmap_t *
-tor_mmap_file(const char *filename)
+tor_mmap_file_flags(const char *filename, unsigned flags)
 {
   TCHAR tfilename[MAX_PATH]= {0};
   tor_mmap_t *res = tor_malloc_zero(sizeof(tor_mmap_t));
   int empty = 0;
+  (void)flags;
   res->file_handle = INVALID_HANDLE_VALUE;
   res->mmap_handle = NULL;
 #ifdef UNICODE
@@ -275,6 +330,12 @@ tor_mmap_file(const char *filename)
   return NULL;
 }
 void
+tor_mmap_advise(const tor_mmap_t *handle, unsigned flags)
+{
+  (void)handle;
+  (void)flags;
+}
+void
 tor_munmap_file(tor_mmap_t *handle)
 {
   if (handle->data)
@@ -290,7 +351,7 @@ tor_munmap_file(tor_mmap_t *handle)
 }
 #else
 tor_mmap_t *
-tor_mmap_file(const char *filename)
+tor_mmap_file_flags(const char *filename, unsigned flags)
 {
   struct stat st;
   char *res = read_file_to_str(filename, RFTS_BIN|RFTS_IGNORE_MISSING, &st);
@@ -300,9 +361,16 @@ tor_mmap_file(const char *filename)
   handle = tor_malloc_zero(sizeof(tor_mmap_t));
   handle->data = res;
   handle->size = st.st_size;
+  (void)flags;
   return handle;
 }
 void
+tor_mmap_advise(const tor_mmap_t *handle, unsigned flags)
+{
+  (void)handle;
+  (void)flags;
+}
+void
 tor_munmap_file(tor_mmap_t *handle)
 {
   char *d = (char*)handle->data;
@@ -2248,6 +2316,34 @@ tor_gettimeofday(struct timeval *timeval)
   return;
 }
 
+/** Return the number of milliseconds since some arbitrary fixed point in the
+ * past.  Unlike tor_gettimeofday(), this never goes backwards when somebody
+ * sets the system clock.  Only call this from the main thread: the fallback
+ * implementation keeps state. */
+uint64_t
+tor_get_monotonic_msec(void)
+{
+  static uint64_t last_msec = 0, adjustment = 0;
+  uint64_t msec;
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return ((uint64_t)ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+#endif
+  {
+    struct timeval tv;
+    tor_gettimeofday(&tv);
+    msec = ((uint64_t)tv.tv_sec) * 1000 + tv.tv_usec / 1000 + adjustment;
+  }
+  /* The wall clock went backwards; pretend it didn't. */
+  if (msec < last_msec) {
+    adjustment += last_msec - msec;
+    msec = last_msec;
+  }
+  last_msec = msec;
+  return msec;
+}
+
 #if defined(TOR_IS_MULTITHREADED) && !defined(MS_WINDOWS)
 /** Defined iff we need to add locks when defining fake versions of reentrant
  * versions of time-related functions. */
@@ -2526,7 +2622,6 @@ tor_mutex_free(tor_mutex_t *m)
 
 /* Conditions. */
 #ifdef USE_PTHREADS
-#if 0
 /** Cross-platform condition implementation. */
 struct tor_cond_t {
   pthread_cond_t cond;
@@ -2574,7 +2669,6 @@ tor_cond_signal_all(tor_cond_t *cond)
 {
   pthread_cond_broadcast(&cond->cond);
 }
-#endif
 /** Set up common structures for use by threading. */
 void
 tor_threads_init(void)
@@ -2781,6 +2875,85 @@ in_main_thread(void)
   return main_thread_id == tor_get_thread_id();
 }
 
+#if defined(USE_WIN32_THREADS)
+/** Allocate a new thread-local slot in <b>threadlocal</b>; every thread
+ * starts out with a NULL value in it.  Return 0 on success, -1 on
+ * failure. */
+int
+tor_threadlocal_init(tor_threadlocal_t *threadlocal)
+{
+  threadlocal->index = TlsAlloc();
+  return (threadlocal->index == TLS_OUT_OF_INDEXES) ? -1 : 0;
+}
+/** Release the thread-local slot in <b>threadlocal</b>.  This does not free
+ * anything that any thread stored there. */
+void
+tor_threadlocal_destroy(tor_threadlocal_t *threadlocal)
+{
+  TlsFree(threadlocal->index);
+  memset(threadlocal, 0, sizeof(tor_threadlocal_t));
+}
+/** Return the value that the current thread stored in <b>threadlocal</b>,
+ * or NULL if it hasn't stored one. */
+void *
+tor_threadlocal_get(tor_threadlocal_t *threadlocal)
+{
+  return TlsGetValue(threadlocal->index);
+}
+/** Store <b>value</b> in <b>threadlocal</b> for the current thread. */
+void
+tor_threadlocal_set(tor_threadlocal_t *threadlocal, void *value)
+{
+  BOOL ok = TlsSetValue(threadlocal->index, value);
+  tor_assert(ok);
+}
+#elif defined(USE_PTHREADS)
+int
+tor_threadlocal_init(tor_threadlocal_t *threadlocal)
+{
+  return pthread_key_create(&threadlocal->key, NULL) ? -1 : 0;
+}
+void
+tor_threadlocal_destroy(tor_threadlocal_t *threadlocal)
+{
+  pthread_key_delete(threadlocal->key);
+  memset(threadlocal, 0, sizeof(tor_threadlocal_t));
+}
+void *
+tor_threadlocal_get(tor_threadlocal_t *threadlocal)
+{
+  return pthread_getspecific(threadlocal->key);
+}
+void
+tor_threadlocal_set(tor_threadlocal_t *threadlocal, void *value)
+{
+  int err = pthread_setspecific(threadlocal->key, value);
+  tor_assert(err == 0);
+}
+#else
+int
+tor_threadlocal_init(tor_threadlocal_t *threadlocal)
+{
+  threadlocal->value = NULL;
+  return 0;
+}
+void
+tor_threadlocal_destroy(tor_threadlocal_t *threadlocal)
+{
+  threadlocal->value = NULL;
+}
+void *
+tor_threadlocal_get(tor_threadlocal_t *threadlocal)
+{
+  return threadlocal->value;
+}
+void
+tor_threadlocal_set(tor_threadlocal_t *threadlocal, void *value)
+{
+  threadlocal->value = value;
+}
+#endif
+
 /**
  * On Windows, WSAEWOULDBLOCK is not always correct: when you see it,
  * you need to ask the socket for its actual errno.  Also, you need to
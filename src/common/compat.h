@@ -256,7 +256,21 @@ typedef struct tor_mmap_t {
 
 } tor_mmap_t;
 
+/** Flag for tor_mmap_file_flags() and tor_mmap_advise(): we're going to
+ * read the mapping from start to end, so read ahead aggressively. */
+#define TOR_MMAP_SEQUENTIAL (1u<<0)
+/** Flag for tor_mmap_file_flags() and tor_mmap_advise(): we're going to
+ * look at scattered parts of the mapping, so don't read ahead. */
+#define TOR_MMAP_RANDOM     (1u<<1)
+/** Flag for tor_mmap_file_flags(): fault in the whole file now, rather
+ * than one page at a time as we touch it. */
+#define TOR_MMAP_POPULATE   (1u<<2)
+
 tor_mmap_t *tor_mmap_file(const char *filename) ATTR_NONNULL((1));
+tor_mmap_t *tor_mmap_file_flags(const char *filename, unsigned flags)
+  ATTR_NONNULL((1));
+void tor_mmap_advise(const tor_mmap_t *handle, unsigned flags)
+  ATTR_NONNULL((1));
 void tor_munmap_file(tor_mmap_t *handle) ATTR_NONNULL((1));
 
 int tor_snprintf(char *str, size_t size, const char *format, ...)
@@ -325,6 +339,7 @@ struct timeval {
 #endif
 
 void tor_gettimeofday(struct timeval *timeval);
+uint64_t tor_get_monotonic_msec(void);
 
 struct tm *tor_localtime_r(const time_t *timep, struct tm *result);
 struct tm *tor_gmtime_r(const time_t *timep, struct tm *result);
@@ -633,8 +648,29 @@ void tor_threads_init(void);
 void set_main_thread(void);
 int in_main_thread(void);
 
-#ifdef TOR_IS_MULTITHREADED
-#if 0
+/** A slot that holds a separate pointer for every thread. */
+typedef struct tor_threadlocal_t {
+#if defined(USE_WIN32_THREADS)
+  /** Windows-only: the index returned by TlsAlloc(). */
+  DWORD index;
+#elif defined(USE_PTHREADS)
+  /** Pthreads-only: the key returned by pthread_key_create(). */
+  pthread_key_t key;
+#else
+  /** No-threads only: there is only one thread, so only one value. */
+  void *value;
+#endif
+} tor_threadlocal_t;
+
+int tor_threadlocal_init(tor_threadlocal_t *threadlocal);
+void tor_threadlocal_destroy(tor_threadlocal_t *threadlocal);
+void *tor_threadlocal_get(tor_threadlocal_t *threadlocal);
+void tor_threadlocal_set(tor_threadlocal_t *threadlocal, void *value);
+
+#ifdef USE_PTHREADS
+/** Defined iff we have a working implementation of tor_cond_t.  (The Windows
+ * version isn't finished yet.) */
+#define TOR_HAVE_COND
 typedef struct tor_cond_t tor_cond_t;
 tor_cond_t *tor_cond_new(void);
 void tor_cond_free(tor_cond_t *cond);
@@ -642,7 +678,6 @@ int tor_cond_wait(tor_cond_t *cond, tor_mutex_t *mutex);
 void tor_cond_signal_one(tor_cond_t *cond);
 void tor_cond_signal_all(tor_cond_t *cond);
 #endif
-#endif
 
 /** Macros for MIN/MAX.  Never use these when the arguments could have
  * side-effects.
@@ -31,10 +31,25 @@
 smartlist_t *
 smartlist_create(void)
 {
-  smartlist_t *sl = tor_malloc(sizeof(smartlist_t));
+  return smartlist_create_with_capacity(SMARTLIST_DEFAULT_CAPACITY);
+}
+
+/** Allocate and return an empty smartlist with room for <b>capacity</b>
+ * elements before it needs to grow.  The header and the first
+ * <b>capacity</b> slots share one allocation. */
+smartlist_t *
+smartlist_create_with_capacity(int capacity)
+{
+  smartlist_t *sl;
+  if (capacity < 1)
+    capacity = 1;
+  tor_assert((size_t)capacity < (SIZE_MAX - sizeof(smartlist_t)) /
+             sizeof(void*));
+  sl = tor_malloc(sizeof(smartlist_t) + sizeof(void *) * capacity);
   sl->num_used = 0;
-  sl->capacity = SMARTLIST_DEFAULT_CAPACITY;
-  sl->list = tor_malloc(sizeof(void *) * sl->capacity);
+  sl->capacity = capacity;
+  sl->list = (void **)(sl + 1);
+  sl->list_is_embedded = 1;
   return sl;
 }
 
@@ -46,10 +61,21 @@ smartlist_free(smartlist_t *sl)
 {
   if (!sl)
     return;
-  tor_free(sl->list);
+  if (!sl->list_is_embedded)
+    tor_free(sl->list);
   tor_free(sl);
 }
 
+/** Release any heap storage held by <b>sl</b>, a smartlist declared with
+ * SMARTLIST_DECLARE_LOCAL().  Does not release storage associated with the
+ * list's elements.  <b>sl</b> must not be used afterwards. */
+void
+smartlist_free_local(smartlist_t *sl)
+{
+  if (!sl->list_is_embedded)
+    tor_free(sl->list);
+}
+
 /** Remove all elements from the list.
  */
 void
@@ -58,8 +84,10 @@ smartlist_clear(smartlist_t *sl)
   sl->num_used = 0;
 }
 
-/** Make sure that <b>sl</b> can hold at least <b>size</b> entries. */
-static INLINE void
+/** Make sure that <b>sl</b> can hold at least <b>size</b> entries.  Callers
+ * that know roughly how big a list will get can use this to avoid growing
+ * it one doubling at a time. */
+void
 smartlist_ensure_capacity(smartlist_t *sl, int size)
 {
 #if SIZEOF_SIZE_T > SIZEOF_INT
@@ -76,8 +104,15 @@ smartlist_ensure_capacity(smartlist_t *sl, int size)
       while (size > higher)
         higher *= 2;
     }
+    if (sl->list_is_embedded) {
+      void **list = tor_malloc(sizeof(void*)*((size_t)higher));
+      memcpy(list, sl->list, sizeof(void*)*((size_t)sl->num_used));
+      sl->list = list;
+      sl->list_is_embedded = 0;
+    } else {
+      sl->list = tor_realloc(sl->list, sizeof(void*)*((size_t)higher));
+    }
     sl->capacity = higher;
-    sl->list = tor_realloc(sl->list, sizeof(void*)*((size_t)sl->capacity));
   }
 }
 
@@ -488,6 +523,84 @@ smartlist_sort(smartlist_t *sl, int (*compare)(const void **a, const void **b))
         (int (*)(const void *,const void*))compare);
 }
 
+/** Lists shorter than this aren't worth radix-sorting. */
+#define RADIX_SORT_MIN 64
+
+/** Sort the members of <b>sl</b>, each of which has a digest of at least 4
+ * bytes at offset <b>key_offset</b>, into the order defined by
+ * <b>compare</b>.  <b>compare</b> must order members by memcmp() of those
+ * digests first, and may break ties however it likes.
+ *
+ * For long lists this is much faster than smartlist_sort(): we radix-sort
+ * the members by the first 32 bits of their digests, which is almost always
+ * enough to order them, and only call <b>compare</b> on runs of members
+ * whose digests share those bits.
+ */
+void
+smartlist_sort_by_digest(smartlist_t *sl, size_t key_offset,
+                         int (*compare)(const void **a, const void **b))
+{
+  const int n = sl->num_used;
+  uint32_t *keys_mem, *keys, *keys_tmp, *ktmp;
+  void **list_mem, **list, **list_tmp, **ltmp;
+  unsigned counts[4][256];
+  int i, pass, run_start;
+
+  if (n < RADIX_SORT_MIN) {
+    smartlist_sort(sl, compare);
+    return;
+  }
+
+  keys = keys_mem = tor_malloc(sizeof(uint32_t)*n*2);
+  keys_tmp = keys + n;
+  list = sl->list;
+  list_tmp = list_mem = tor_malloc(sizeof(void*)*n);
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < n; ++i) {
+    uint32_t k = ntohl(get_uint32(((const char*)list[i]) + key_offset));
+    keys[i] = k;
+    ++counts[0][k & 0xff];
+    ++counts[1][(k >> 8) & 0xff];
+    ++counts[2][(k >> 16) & 0xff];
+    ++counts[3][k >> 24];
+  }
+
+  /* Least significant byte first; each pass is stable. */
+  for (pass = 0; pass < 4; ++pass) {
+    const int shift = pass * 8;
+    unsigned pos = 0, c;
+    if (counts[pass][(keys[0] >> shift) & 0xff] == (unsigned)n)
+      continue; /* Every key has the same byte here. */
+    for (c = 0; c < 256; ++c) {
+      unsigned cnt = counts[pass][c];
+      counts[pass][c] = pos;
+      pos += cnt;
+    }
+    for (i = 0; i < n; ++i) {
+      unsigned dest = counts[pass][(keys[i] >> shift) & 0xff]++;
+      keys_tmp[dest] = keys[i];
+      list_tmp[dest] = list[i];
+    }
+    ktmp = keys; keys = keys_tmp; keys_tmp = ktmp;
+    ltmp = list; list = list_tmp; list_tmp = ltmp;
+  }
+  if (list != sl->list)
+    memcpy(sl->list, list, sizeof(void*)*n);
+
+  /* Sort each run that shares a 32-bit prefix with the real comparison. */
+  for (run_start = 0, i = 1; i <= n; ++i) {
+    if (i == n || keys[i] != keys[run_start]) {
+      if (i - run_start > 1)
+        qsort(sl->list + run_start, i - run_start, sizeof(void*),
+              (int (*)(const void *,const void*))compare);
+      run_start = i;
+    }
+  }
+
+  tor_free(keys_mem);
+  tor_free(list_mem);
+}
+
 /** Given a smartlist <b>sl</b> sorted with the function <b>compare</b>,
  * return the most frequent member in the list.  Break ties in favor of
  * later elements.  If the list is empty, return NULL.
@@ -533,15 +646,21 @@ smartlist_uniq(smartlist_t *sl,
                int (*compare)(const void **a, const void **b),
                void (*free_fn)(void *a))
 {
-  int i;
-  for (i=1; i < sl->num_used; ++i) {
-    if (compare((const void **)&(sl->list[i-1]),
+  int i, n_kept;
+  if (!sl->num_used)
+    return;
+  /* Compact in one pass, rather than shifting the tail of the list down
+   * once per duplicate. */
+  for (i = n_kept = 1; i < sl->num_used; ++i) {
+    if (compare((const void **)&(sl->list[n_kept-1]),
                 (const void **)&(sl->list[i])) == 0) {
       if (free_fn)
         free_fn(sl->list[i]);
-      smartlist_del_keeporder(sl, i--);
+    } else {
+      sl->list[n_kept++] = sl->list[i];
     }
   }
+  sl->num_used = n_kept;
 }
 
 /** Assuming the members of <b>sl</b> are in order, return a pointer to the
@@ -735,6 +854,31 @@ smartlist_heapify(smartlist_t *sl,
   }
 }
 
+/** Helper. <b>sl</b> may have at most one violation of the heap property:
+ * the item at <b>idx</b> may be less than its parent.  Restore the heap
+ * property, and return the item's new index. */
+static INLINE int
+smartlist_heap_sift_up(smartlist_t *sl,
+                       int (*compare)(const void *a, const void *b),
+                       int idx_field_offset,
+                       int idx)
+{
+  while (idx) {
+    int parent = PARENT(idx);
+    if (compare(sl->list[idx], sl->list[parent]) < 0) {
+      void *tmp = sl->list[parent];
+      sl->list[parent] = sl->list[idx];
+      sl->list[idx] = tmp;
+      UPDATE_IDX(parent);
+      UPDATE_IDX(idx);
+      idx = parent;
+    } else {
+      break;
+    }
+  }
+  return idx;
+}
+
 /** Insert <b>item</b> into the heap stored in <b>sl</b>, where order is
  * determined by <b>compare</b> and the offset of the item in the heap is
  * stored in an int-typed field at position <b>idx_field_offset</b> within
@@ -746,23 +890,9 @@ smartlist_pqueue_add(smartlist_t *sl,
                      int idx_field_offset,
                      void *item)
 {
-  int idx;
   smartlist_add(sl,item);
   UPDATE_IDX(sl->num_used-1);
-
-  for (idx = sl->num_used - 1; idx; ) {
-    int parent = PARENT(idx);
-    if (compare(sl->list[idx], sl->list[parent]) < 0) {
-      void *tmp = sl->list[parent];
-      sl->list[parent] = sl->list[idx];
-      sl->list[idx] = tmp;
-      UPDATE_IDX(parent);
-      UPDATE_IDX(idx);
-      idx = parent;
-    } else {
-      return;
-    }
-  }
+  smartlist_heap_sift_up(sl, compare, idx_field_offset, sl->num_used-1);
 }
 
 /** Remove and return the top-priority item from the heap stored in <b>sl</b>,
@@ -807,6 +937,9 @@ smartlist_pqueue_remove(smartlist_t *sl,
   } else {
     sl->list[idx] = sl->list[sl->num_used];
     UPDATE_IDX(idx);
+    /* The item we moved here came from elsewhere in the heap, so it may
+     * belong above <b>idx</b> as well as below it. */
+    idx = smartlist_heap_sift_up(sl, compare, idx_field_offset, idx);
     smartlist_heapify(sl, compare, idx_field_offset, idx);
   }
 }
@@ -837,7 +970,7 @@ _compare_digests(const void **_a, const void **_b)
 void
 smartlist_sort_digests(smartlist_t *sl)
 {
-  smartlist_sort(sl, _compare_digests);
+  smartlist_sort_by_digest(sl, 0, _compare_digests);
 }
 
 /** Remove duplicate digests from a sorted list, and free them with tor_free().
@@ -859,7 +992,7 @@ _compare_digests256(const void **_a, const void **_b)
 void
 smartlist_sort_digests256(smartlist_t *sl)
 {
-  smartlist_sort(sl, _compare_digests256);
+  smartlist_sort_by_digest(sl, 0, _compare_digests256);
 }
 
 /** Return the most frequent member of the sorted list of DIGEST256_LEN
@@ -879,76 +1012,229 @@ smartlist_uniq_digests256(smartlist_t *sl)
   smartlist_uniq(sl, _compare_digests256, _tor_free);
 }
 
-/** Helper: Declare an entry type and a map type to implement a mapping using
- * ht.h.  The map type will be called <b>maptype</b>.  The key part of each
- * entry is declared using the C declaration <b>keydecl</b>.  All functions
- * and types associated with the map get prefixed with <b>prefix</b> */
+/* The maps below are flat open-addressing hash tables using Robin Hood
+ * insertion: every entry lives directly in the table's array, and an entry
+ * that is farther from its home bucket than the one it collides with takes
+ * that one's slot.  This keeps probe sequences short and lets a lookup stop
+ * as soon as it reaches an entry closer to home than the key would be.
+ *
+ * The table doesn't wrap around: it has MAP_OVERFLOW_SLOTS extra slots past
+ * the last bucket, and grows if an insert would run off the end.  Removal
+ * shifts the rest of the probe sequence back one slot, and since entries only
+ * move toward the front of the array, an iterator that removes its current
+ * entry will still see every remaining entry exactly once.
+ *
+ * An empty slot has a NULL val; maps never hold NULL values. */
+
+/** Smallest number of buckets in a map. */
+#define MAP_MIN_BUCKETS 16
+/** How many slots does every map have past its last bucket? */
+#define MAP_OVERFLOW_SLOTS 32
+/** Grow a map when it has more than MAP_LOAD_NUM / MAP_LOAD_DEN entries per
+ * bucket. */
+#define MAP_LOAD_NUM 3
+#define MAP_LOAD_DEN 4
+
+/** Helper: Declare an entry type and a map type to implement a flat mapping.
+ * The map type will be called <b>maptype</b>.  The key part of each entry is
+ * declared using the C declaration <b>keydecl</b>.  All functions and types
+ * associated with the map get prefixed with <b>prefix</b> */
 #define DEFINE_MAP_STRUCTS(maptype, keydecl, prefix)      \
-  typedef struct prefix ## entry_t {                      \
-    HT_ENTRY(prefix ## entry_t) node;                     \
+  struct prefix ## entry_t {                              \
     void *val;                                            \
+    unsigned hash;                                        \
     keydecl;                                              \
-  } prefix ## entry_t;                                    \
+  };                                                      \
   struct maptype {                                        \
-    HT_HEAD(prefix ## impl, prefix ## entry_t) head;      \
+    struct prefix ## entry_t *table;                      \
+    unsigned mask; /**< Number of buckets, minus one. */  \
+    unsigned n_slots; /**< Buckets plus overflow slots */ \
+    int size; /**< Number of entries. */                  \
   }
 
 DEFINE_MAP_STRUCTS(strmap_t, char *key, strmap_);
 DEFINE_MAP_STRUCTS(digestmap_t, char key[DIGEST_LEN], digestmap_);
 
-/** Helper: compare strmap_entry_t objects by key value. */
-static INLINE int
-strmap_entries_eq(const strmap_entry_t *a, const strmap_entry_t *b)
-{
-  return !strcmp(a->key, b->key);
-}
+typedef struct strmap_entry_t strmap_entry_t;
+typedef struct digestmap_entry_t digestmap_entry_t;
 
-/** Helper: return a hash value for a strmap_entry_t. */
+/** Helper: return a hash value for the string <b>key</b>. */
 static INLINE unsigned int
-strmap_entry_hash(const strmap_entry_t *a)
+strmap_key_hash(const char *key)
 {
-  return ht_string_hash(a->key);
+  return ht_improve_hash(ht_string_hash(key));
 }
 
-/** Helper: compare digestmap_entry_t objects by key value. */
-static INLINE int
-digestmap_entries_eq(const digestmap_entry_t *a, const digestmap_entry_t *b)
-{
-  return tor_memeq(a->key, b->key, DIGEST_LEN);
-}
-
-/** Helper: return a hash value for a digest_map_t. */
+/** Helper: return a hash value for the digest <b>key</b>. */
 static INLINE unsigned int
-digestmap_entry_hash(const digestmap_entry_t *a)
+digestmap_key_hash(const char *key)
 {
-#if SIZEOF_INT != 8
-  const uint32_t *p = (const uint32_t*)a->key;
+  uint32_t p[5];
+  memcpy(p, key, sizeof(p));
   return p[0] ^ p[1] ^ p[2] ^ p[3] ^ p[4];
-#else
-  const uint64_t *p = (const uint64_t*)a->key;
-  return p[0] ^ p[1];
-#endif
 }
 
-HT_PROTOTYPE(strmap_impl, strmap_entry_t, node, strmap_entry_hash,
-             strmap_entries_eq)
-HT_GENERATE(strmap_impl, strmap_entry_t, node, strmap_entry_hash,
-            strmap_entries_eq, 0.6, malloc, realloc, free)
+/** Helper: Implement the table operations for a flat map declared with
+ * DEFINE_MAP_STRUCTS.  <b>keyeq</b>(entry, key) must be true iff the entry
+ * has the key <b>key</b>.
+ *
+ * <ul>
+ * <li>prefix##find(map, key, hash) returns the entry for key, or NULL.
+ * <li>prefix##insert_new(map, entry) adds an entry whose key isn't in the
+ *    map, growing the map if needed.
+ * <li>prefix##remove_at(map, slot) removes the entry in slot.
+ * </ul> */
+#define IMPLEMENT_MAP_TABLE(maptype, prefix, keyeq)                     \
+  /** Return the distance of the entry in slot <b>idx</b> of <b>map</b>  \
+   * from its home bucket. */                                           \
+  static INLINE unsigned                                                \
+  prefix##dist(const maptype *map, unsigned idx)                        \
+  {                                                                     \
+    return idx - (map->table[idx].hash & map->mask);                    \
+  }                                                                     \
+  static struct prefix##entry_t *                                       \
+  prefix##find(const maptype *map, const char *key, unsigned hash)      \
+  {                                                                     \
+    unsigned idx = hash & map->mask, dist = 0;                          \
+    for ( ; idx < map->n_slots; ++idx, ++dist) {                        \
+      struct prefix##entry_t *ent = &map->table[idx];                   \
+      if (!ent->val || prefix##dist(map, idx) < dist)                   \
+        return NULL;                                                    \
+      if (ent->hash == hash && keyeq(ent, key))                         \
+        return ent;                                                     \
+    }                                                                   \
+    return NULL;                                                        \
+  }                                                                     \
+  static void prefix##resize(maptype *map, unsigned n_buckets);         \
+  /** Robin-Hood-insert <b>ent</b> into <b>map</b> without growing it.   \
+   * Return 0 on success, or -1 if some entry fell off the end of the    \
+   * table, in which case that entry is now in *<b>ent</b>. */           \
+  static int                                                            \
+  prefix##place(maptype *map, struct prefix##entry_t *ent)              \
+  {                                                                     \
+    unsigned idx = ent->hash & map->mask, dist = 0;                     \
+    struct prefix##entry_t tmp;                                         \
+    for ( ; idx < map->n_slots; ++idx, ++dist) {                        \
+      struct prefix##entry_t *slot = &map->table[idx];                  \
+      unsigned slot_dist;                                               \
+      if (!slot->val) {                                                 \
+        *slot = *ent;                                                   \
+        return 0;                                                       \
+      }                                                                 \
+      slot_dist = prefix##dist(map, idx);                               \
+      if (slot_dist < dist) {                                           \
+        tmp = *slot;                                                    \
+        *slot = *ent;                                                   \
+        *ent = tmp;                                                     \
+        dist = slot_dist;                                               \
+      }                                                                 \
+    }                                                                   \
+    return -1;                                                          \
+  }                                                                     \
+  /** Add <b>ent</b>, whose key is not yet present, to <b>map</b>,       \
+   * growing the map as needed. */                                      \
+  static void                                                           \
+  prefix##insert_new(maptype *map, const struct prefix##entry_t *ent)   \
+  {                                                                     \
+    struct prefix##entry_t carried = *ent;                              \
+    if ((unsigned)(map->size + 1) * MAP_LOAD_DEN >                      \
+        (map->mask + 1) * MAP_LOAD_NUM)                                 \
+      prefix##resize(map, (map->mask + 1) * 2);                         \
+    while (prefix##place(map, &carried) < 0)                            \
+      prefix##resize(map, (map->mask + 1) * 2);                         \
+    ++map->size;                                                        \
+  }                                                                     \
+  static void                                                           \
+  prefix##remove_at(maptype *map, struct prefix##entry_t *slot)         \
+  {                                                                     \
+    unsigned idx = (unsigned)(slot - map->table);                       \
+    while (idx + 1 < map->n_slots && map->table[idx+1].val &&           \
+           prefix##dist(map, idx+1) > 0) {                              \
+      map->table[idx] = map->table[idx+1];                              \
+      ++idx;                                                            \
+    }                                                                   \
+    memset(&map->table[idx], 0, sizeof(struct prefix##entry_t));        \
+    --map->size;                                                        \
+  }                                                                     \
+  /** Rebuild <b>map</b> with <b>n_buckets</b> buckets, doubling again   \
+   * if any entry would fall off the end. */                            \
+  static void                                                           \
+  prefix##resize(maptype *map, unsigned n_buckets)                      \
+  {                                                                     \
+    struct prefix##entry_t *old = map->table;                           \
+    unsigned old_n_slots = map->n_slots, i;                             \
+   again:                                                               \
+    map->mask = n_buckets - 1;                                          \
+    map->n_slots = n_buckets + MAP_OVERFLOW_SLOTS;                      \
+    map->table = tor_malloc_zero(map->n_slots *                         \
+                                 sizeof(struct prefix##entry_t));       \
+    for (i = 0; i < old_n_slots; ++i) {                                 \
+      struct prefix##entry_t ent = old[i];                              \
+      if (ent.val && prefix##place(map, &ent) < 0) {                       \
+        tor_free(map->table);                                           \
+        n_buckets *= 2;                                                 \
+        goto again;                                                     \
+      }                                                                 \
+    }                                                                   \
+    tor_free(old);                                                      \
+  }                                                                     \
+  /** Return the first occupied slot in <b>map</b> at or after           \
+   * <b>idx</b>, or NULL if there is none. */                           \
+  static INLINE struct prefix##entry_t *                                \
+  prefix##next_occupied(const maptype *map, unsigned idx)               \
+  {                                                                     \
+    for ( ; idx < map->n_slots; ++idx) {                                \
+      if (map->table[idx].val)                                          \
+        return &map->table[idx];                                        \
+    }                                                                   \
+    return NULL;                                                        \
+  }                                                                     \
+  /** Create a new empty map. */                                        \
+  static maptype *                                                      \
+  prefix##new_impl(void)                                                \
+  {                                                                     \
+    maptype *map = tor_malloc_zero(sizeof(maptype));                    \
+    map->mask = MAP_MIN_BUCKETS - 1;                                    \
+    map->n_slots = MAP_MIN_BUCKETS + MAP_OVERFLOW_SLOTS;                \
+    map->table = tor_malloc_zero(map->n_slots *                         \
+                                 sizeof(struct prefix##entry_t));       \
+    return map;                                                         \
+  }                                                                     \
+  /** Check the Robin Hood invariants of <b>map</b>. */                 \
+  static void                                                           \
+  prefix##check_table(const maptype *map)                               \
+  {                                                                     \
+    unsigned i;                                                         \
+    int n = 0;                                                          \
+    for (i = 0; i < map->n_slots; ++i) {                                \
+      const struct prefix##entry_t *ent = &map->table[i];               \
+      if (!ent->val)                                                    \
+        continue;                                                       \
+      ++n;                                                              \
+      tor_assert((ent->hash & map->mask) <= i);                         \
+      if (i > 0 && prefix##dist(map, i) > 0) {                          \
+        tor_assert(map->table[i-1].val);                                \
+        tor_assert(prefix##dist(map, i-1) + 1 >= prefix##dist(map, i)); \
+      }                                                                 \
+      tor_assert(prefix##find(map, ent->key, ent->hash) == ent);        \
+    }                                                                   \
+    tor_assert(n == map->size);                                         \
+  }
+
+/** Helper: true iff the strmap entry <b>ent</b> has key <b>key</b>. */
+#define STRMAP_KEYEQ(ent, k) (!strcmp((ent)->key, (k)))
+/** Helper: true iff the digestmap entry <b>ent</b> has key <b>key</b>. */
+#define DIGESTMAP_KEYEQ(ent, k) (tor_memeq((ent)->key, (k), DIGEST_LEN))
 
-HT_PROTOTYPE(digestmap_impl, digestmap_entry_t, node, digestmap_entry_hash,
-             digestmap_entries_eq)
-HT_GENERATE(digestmap_impl, digestmap_entry_t, node, digestmap_entry_hash,
-            digestmap_entries_eq, 0.6, malloc, realloc, free)
+IMPLEMENT_MAP_TABLE(strmap_t, strmap_, STRMAP_KEYEQ)
+IMPLEMENT_MAP_TABLE(digestmap_t, digestmap_, DIGESTMAP_KEYEQ)
 
 /** Constructor to create a new empty map from strings to void*'s.
  */
 strmap_t *
 strmap_new(void)
 {
-  strmap_t *result;
-  result = tor_malloc(sizeof(strmap_t));
-  HT_INIT(strmap_impl, &result->head);
-  return result;
+  return strmap_new_impl();
 }
 
 /** Constructor to create a new empty map from digests to void*'s.
@@ -956,10 +1242,7 @@ strmap_new(void)
 digestmap_t *
 digestmap_new(void)
 {
-  digestmap_t *result;
-  result = tor_malloc(sizeof(digestmap_t));
-  HT_INIT(digestmap_impl, &result->head);
-  return result;
+  return digestmap_new_impl();
 }
 
 /** Set the current value for <b>key</b> to <b>val</b>.  Returns the previous
@@ -972,79 +1255,51 @@ void *
 strmap_set(strmap_t *map, const char *key, void *val)
 {
   strmap_entry_t *resolve;
-  strmap_entry_t search;
+  strmap_entry_t ent;
+  unsigned hash;
   void *oldval;
   tor_assert(map);
   tor_assert(key);
   tor_assert(val);
-  search.key = (char*)key;
-  resolve = HT_FIND(strmap_impl, &map->head, &search);
+  hash = strmap_key_hash(key);
+  resolve = strmap_find(map, key, hash);
   if (resolve) {
     oldval = resolve->val;
     resolve->val = val;
     return oldval;
   } else {
-    resolve = tor_malloc_zero(sizeof(strmap_entry_t));
-    resolve->key = tor_strdup(key);
-    resolve->val = val;
-    tor_assert(!HT_FIND(strmap_impl, &map->head, resolve));
-    HT_INSERT(strmap_impl, &map->head, resolve);
+    ent.key = tor_strdup(key);
+    ent.val = val;
+    ent.hash = hash;
+    strmap_insert_new(map, &ent);
     return NULL;
   }
 }
 
-#define OPTIMIZED_DIGESTMAP_SET
-
 /** Like strmap_set() above but for digestmaps. */
 void *
 digestmap_set(digestmap_t *map, const char *key, void *val)
 {
-#ifndef OPTIMIZED_DIGESTMAP_SET
   digestmap_entry_t *resolve;
-#endif
-  digestmap_entry_t search;
+  digestmap_entry_t ent;
+  unsigned hash;
   void *oldval;
   tor_assert(map);
   tor_assert(key);
   tor_assert(val);
-  memcpy(&search.key, key, DIGEST_LEN);
-#ifndef OPTIMIZED_DIGESTMAP_SET
-  resolve = HT_FIND(digestmap_impl, &map->head, &search);
+  hash = digestmap_key_hash(key);
+  resolve = digestmap_find(map, key, hash);
   if (resolve) {
     oldval = resolve->val;
     resolve->val = val;
     return oldval;
   } else {
-    resolve = tor_malloc_zero(sizeof(digestmap_entry_t));
-    memcpy(resolve->key, key, DIGEST_LEN);
-    resolve->val = val;
-    HT_INSERT(digestmap_impl, &map->head, resolve);
+    memcpy(ent.key, key, DIGEST_LEN);
+    ent.val = val;
+    ent.hash = hash;
+    digestmap_insert_new(map, &ent);
     return NULL;
   }
-#else
-  /* We spend up to 5% of our time in this function, so the code below is
-   * meant to optimize the check/alloc/set cycle by avoiding the two trips to
-   * the hash table that we do in the unoptimized code above.  (Each of
-   * HT_INSERT and HT_FIND calls HT_SET_HASH and HT_FIND_P.)
-   */
-  _HT_FIND_OR_INSERT(digestmap_impl, node, digestmap_entry_hash, &(map->head),
-         digestmap_entry_t, &search, ptr,
-         {
-            /* we found an entry. */
-            oldval = (*ptr)->val;
-            (*ptr)->val = val;
-            return oldval;
-         },
-         {
-           /* We didn't find the entry. */
-           digestmap_entry_t *newent =
-             tor_malloc_zero(sizeof(digestmap_entry_t));
-           memcpy(newent->key, key, DIGEST_LEN);
-           newent->val = val;
-           _HT_FOI_INSERT(node, &(map->head), &search, newent, ptr);
-           return NULL;
-         });
-#endif
 }
 
 /** Return the current value associated with <b>key</b>, or NULL if no
@@ -1054,16 +1309,10 @@ void *
 strmap_get(const strmap_t *map, const char *key)
 {
   strmap_entry_t *resolve;
-  strmap_entry_t search;
   tor_assert(map);
   tor_assert(key);
-  search.key = (char*)key;
-  resolve = HT_FIND(strmap_impl, &map->head, &search);
-  if (resolve) {
-    return resolve->val;
-  } else {
-    return NULL;
-  }
+  resolve = strmap_find(map, key, strmap_key_hash(key));
+  return resolve ? resolve->val : NULL;
 }
 
 /** Like strmap_get() above but for digestmaps. */
@@ -1071,16 +1320,10 @@ void *
 digestmap_get(const digestmap_t *map, const char *key)
 {
   digestmap_entry_t *resolve;
-  digestmap_entry_t search;
   tor_assert(map);
   tor_assert(key);
-  memcpy(&search.key, key, DIGEST_LEN);
-  resolve = HT_FIND(digestmap_impl, &map->head, &search);
-  if (resolve) {
-    return resolve->val;
-  } else {
-    return NULL;
-  }
+  resolve = digestmap_find(map, key, digestmap_key_hash(key));
+  return resolve ? resolve->val : NULL;
 }
 
 /** Remove the value currently associated with <b>key</b> from the map.
@@ -1093,16 +1336,14 @@ void *
 strmap_remove(strmap_t *map, const char *key)
 {
   strmap_entry_t *resolve;
-  strmap_entry_t search;
   void *oldval;
   tor_assert(map);
   tor_assert(key);
-  search.key = (char*)key;
-  resolve = HT_REMOVE(strmap_impl, &map->head, &search);
+  resolve = strmap_find(map, key, strmap_key_hash(key));
   if (resolve) {
     oldval = resolve->val;
     tor_free(resolve->key);
-    tor_free(resolve);
+    strmap_remove_at(map, resolve);
     return oldval;
   } else {
     return NULL;
@@ -1114,15 +1355,13 @@ void *
 digestmap_remove(digestmap_t *map, const char *key)
 {
   digestmap_entry_t *resolve;
-  digestmap_entry_t search;
   void *oldval;
   tor_assert(map);
   tor_assert(key);
-  memcpy(&search.key, key, DIGEST_LEN);
-  resolve = HT_REMOVE(digestmap_impl, &map->head, &search);
+  resolve = digestmap_find(map, key, digestmap_key_hash(key));
   if (resolve) {
     oldval = resolve->val;
-    tor_free(resolve);
+    digestmap_remove_at(map, resolve);
     return oldval;
   } else {
     return NULL;
@@ -1197,7 +1436,7 @@ strmap_iter_t *
 strmap_iter_init(strmap_t *map)
 {
   tor_assert(map);
-  return HT_START(strmap_impl, &map->head);
+  return strmap_next_occupied(map, 0);
 }
 
 /** Start iterating through <b>map</b>.  See strmap_iter_init() for example. */
@@ -1205,7 +1444,7 @@ digestmap_iter_t *
 digestmap_iter_init(digestmap_t *map)
 {
   tor_assert(map);
-  return HT_START(digestmap_impl, &map->head);
+  return digestmap_next_occupied(map, 0);
 }
 
 /** Advance the iterator <b>iter</b> for <b>map</b> a single step to the next
@@ -1215,7 +1454,7 @@ strmap_iter_next(strmap_t *map, strmap_iter_t *iter)
 {
   tor_assert(map);
   tor_assert(iter);
-  return HT_NEXT(strmap_impl, &map->head, iter);
+  return strmap_next_occupied(map, (unsigned)(iter - map->table) + 1);
 }
 
 /** Advance the iterator <b>iter</b> for map a single step to the next entry,
@@ -1225,7 +1464,7 @@ digestmap_iter_next(digestmap_t *map, digestmap_iter_t *iter)
 {
   tor_assert(map);
   tor_assert(iter);
-  return HT_NEXT(digestmap_impl, &map->head, iter);
+  return digestmap_next_occupied(map, (unsigned)(iter - map->table) + 1);
 }
 
 /** Advance the iterator <b>iter</b> a single step to the next entry, removing
@@ -1234,15 +1473,13 @@ digestmap_iter_next(digestmap_t *map, digestmap_iter_t *iter)
 strmap_iter_t *
 strmap_iter_next_rmv(strmap_t *map, strmap_iter_t *iter)
 {
-  strmap_entry_t *rmv;
   tor_assert(map);
   tor_assert(iter);
-  tor_assert(*iter);
-  rmv = *iter;
-  iter = HT_NEXT_RMV(strmap_impl, &map->head, iter);
-  tor_free(rmv->key);
-  tor_free(rmv);
-  return iter;
+  tor_assert(iter->val);
+  tor_free(iter->key);
+  strmap_remove_at(map, iter);
+  /* Removal only moves later entries back; the next one may now be here. */
+  return strmap_next_occupied(map, (unsigned)(iter - map->table));
 }
 
 /** Advance the iterator <b>iter</b> a single step to the next entry, removing
@@ -1251,14 +1488,11 @@ strmap_iter_next_rmv(strmap_t *map, strmap_iter_t *iter)
 digestmap_iter_t *
 digestmap_iter_next_rmv(digestmap_t *map, digestmap_iter_t *iter)
 {
-  digestmap_entry_t *rmv;
   tor_assert(map);
   tor_assert(iter);
-  tor_assert(*iter);
-  rmv = *iter;
-  iter = HT_NEXT_RMV(digestmap_impl, &map->head, iter);
-  tor_free(rmv);
-  return iter;
+  tor_assert(iter->val);
+  digestmap_remove_at(map, iter);
+  return digestmap_next_occupied(map, (unsigned)(iter - map->table));
 }
 
 /** Set *<b>keyp</b> and *<b>valp</b> to the current entry pointed to by
@@ -1267,11 +1501,10 @@ void
 strmap_iter_get(strmap_iter_t *iter, const char **keyp, void **valp)
 {
   tor_assert(iter);
-  tor_assert(*iter);
   tor_assert(keyp);
   tor_assert(valp);
-  *keyp = (*iter)->key;
-  *valp = (*iter)->val;
+  *keyp = iter->key;
+  *valp = iter->val;
 }
 
 /** Set *<b>keyp</b> and *<b>valp</b> to the current entry pointed to by
@@ -1280,11 +1513,10 @@ void
 digestmap_iter_get(digestmap_iter_t *iter, const char **keyp, void **valp)
 {
   tor_assert(iter);
-  tor_assert(*iter);
   tor_assert(keyp);
   tor_assert(valp);
-  *keyp = (*iter)->key;
-  *valp = (*iter)->val;
+  *keyp = iter->key;
+  *valp = iter->val;
 }
 
 /** Return true iff <b>iter</b> has advanced past the last entry of
@@ -1310,20 +1542,19 @@ digestmap_iter_done(digestmap_iter_t *iter)
 void
 strmap_free(strmap_t *map, void (*free_val)(void*))
 {
-  strmap_entry_t **ent, **next, *this;
+  unsigned i;
   if (!map)
     return;
 
-  for (ent = HT_START(strmap_impl, &map->head); ent != NULL; ent = next) {
-    this = *ent;
-    next = HT_NEXT_RMV(strmap_impl, &map->head, ent);
-    tor_free(this->key);
+  for (i = 0; i < map->n_slots; ++i) {
+    strmap_entry_t *ent = &map->table[i];
+    if (!ent->val)
+      continue;
+    tor_free(ent->key);
     if (free_val)
-      free_val(this->val);
-    tor_free(this);
+      free_val(ent->val);
   }
-  tor_assert(HT_EMPTY(&map->head));
-  HT_CLEAR(strmap_impl, &map->head);
+  tor_free(map->table);
   tor_free(map);
 }
 
@@ -1334,18 +1565,16 @@ strmap_free(strmap_t *map, void (*free_val)(void*))
 void
 digestmap_free(digestmap_t *map, void (*free_val)(void*))
 {
-  digestmap_entry_t **ent, **next, *this;
+  unsigned i;
   if (!map)
     return;
-  for (ent = HT_START(digestmap_impl, &map->head); ent != NULL; ent = next) {
-    this = *ent;
-    next = HT_NEXT_RMV(digestmap_impl, &map->head, ent);
-    if (free_val)
-      free_val(this->val);
-    tor_free(this);
+  if (free_val) {
+    for (i = 0; i < map->n_slots; ++i) {
+      if (map->table[i].val)
+        free_val(map->table[i].val);
+    }
   }
-  tor_assert(HT_EMPTY(&map->head));
-  HT_CLEAR(digestmap_impl, &map->head);
+  tor_free(map->table);
   tor_free(map);
 }
 
@@ -1354,42 +1583,42 @@ digestmap_free(digestmap_t *map, void (*free_val)(void*))
 void
 strmap_assert_ok(const strmap_t *map)
 {
-  tor_assert(!_strmap_impl_HT_REP_IS_BAD(&map->head));
+  strmap_check_table(map);
 }
 /** Fail with an assertion error if anything has gone wrong with the internal
  * representation of <b>map</b>. */
 void
 digestmap_assert_ok(const digestmap_t *map)
 {
-  tor_assert(!_digestmap_impl_HT_REP_IS_BAD(&map->head));
+  digestmap_check_table(map);
 }
 
 /** Return true iff <b>map</b> has no entries. */
 int
 strmap_isempty(const strmap_t *map)
 {
-  return HT_EMPTY(&map->head);
+  return map->size == 0;
 }
 
 /** Return true iff <b>map</b> has no entries. */
 int
 digestmap_isempty(const digestmap_t *map)
 {
-  return HT_EMPTY(&map->head);
+  return map->size == 0;
 }
 
 /** Return the number of items in <b>map</b>. */
 int
 strmap_size(const strmap_t *map)
 {
-  return HT_SIZE(&map->head);
+  return map->size;
 }
 
 /** Return the number of items in <b>map</b>. */
 int
 digestmap_size(const digestmap_t *map)
 {
-  return HT_SIZE(&map->head);
+  return map->size;
 }
 
 /** Declare a function called <b>funcname</b> that acts as a find_nth_FOO
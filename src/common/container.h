@@ -23,11 +23,18 @@ typedef struct smartlist_t {
   void **list;
   int num_used;
   int capacity;
+  /** True iff <b>list</b> wasn't allocated on its own: it's either part of
+   * the same allocation as the smartlist_t, or on the stack.  Once the list
+   * outgrows it, we move to heap storage and clear this flag. */
+  int list_is_embedded;
   /** @} */
 } smartlist_t;
 
 smartlist_t *smartlist_create(void);
+smartlist_t *smartlist_create_with_capacity(int capacity);
 void smartlist_free(smartlist_t *sl);
+void smartlist_free_local(smartlist_t *sl);
+void smartlist_ensure_capacity(smartlist_t *sl, int size);
 void smartlist_clear(smartlist_t *sl);
 void smartlist_add(smartlist_t *sl, void *element);
 void smartlist_add_all(smartlist_t *sl, const smartlist_t *s2);
@@ -46,6 +53,20 @@ int smartlist_overlap(const smartlist_t *sl1, const smartlist_t *sl2);
 void smartlist_intersect(smartlist_t *sl1, const smartlist_t *sl2);
 void smartlist_subtract(smartlist_t *sl1, const smartlist_t *sl2);
 
+/** Declare <b>name</b> as a smartlist_t* pointing to an empty smartlist
+ * that lives on the stack, along with room for its first <b>n</b> elements.
+ * It can grow past <b>n</b> like any other smartlist.  This is a
+ * declaration, so it must come at the start of a block.  Release it with
+ * smartlist_free_local(), never with smartlist_free().
+ *
+ * Use this for short-lived lists on hot paths that are usually small, to
+ * avoid allocating anything at all.
+ */
+#define SMARTLIST_DECLARE_LOCAL(name, n)                        \
+  void *name##_storage[n];                                      \
+  smartlist_t name##_local = { name##_storage, 0, (n), 1 };     \
+  smartlist_t *name = &name##_local
+
 /* smartlist_choose() is defined in crypto.[ch] */
 #ifdef DEBUG_SMARTLIST
 /** Return the number of items in sl.
@@ -99,6 +120,8 @@ void smartlist_uniq(smartlist_t *sl,
                     void (*free_fn)(void *elt));
 
 void smartlist_sort_strings(smartlist_t *sl);
+void smartlist_sort_by_digest(smartlist_t *sl, size_t key_offset,
+                              int (*compare)(const void **a, const void **b));
 void smartlist_sort_digests(smartlist_t *sl);
 void smartlist_sort_digests256(smartlist_t *sl);
 
@@ -318,7 +341,7 @@ char *smartlist_join_strings2(smartlist_t *sl, const char *join,
 
 #define DECLARE_MAP_FNS(maptype, keytype, prefix)                       \
   typedef struct maptype maptype;                                       \
-  typedef struct prefix##entry_t *prefix##iter_t;                       \
+  typedef struct prefix##entry_t prefix##iter_t;                        \
   maptype* prefix##new(void);                                           \
   void* prefix##set(maptype *map, keytype key, void *val);              \
   void* prefix##get(const maptype *map, keytype key);                   \
@@ -128,6 +128,9 @@ struct crypto_dh_env_t {
 
 static int setup_openssl_threading(void);
 static int tor_check_dh_key(int severity, BIGNUM *bn);
+static int crypto_rng_init(void);
+static void crypto_rng_free_thread_state(void);
+static void crypto_rng_free_all(void);
 
 /** Return the number of bytes added by padding method <b>padding</b>.
  */
@@ -231,6 +234,7 @@ crypto_global_init(int useAccel, const char *accelName, const char *accelDir)
     OpenSSL_add_all_algorithms();
     _crypto_global_initialized = 1;
     setup_openssl_threading();
+    crypto_rng_init();
     if (useAccel > 0) {
 #ifdef DISABLE_ENGINES
       (void)accelName;
@@ -288,6 +292,7 @@ crypto_global_init(int useAccel, const char *accelName, const char *accelDir)
 void
 crypto_thread_cleanup(void)
 {
+  crypto_rng_free_thread_state();
   ERR_remove_state(0);
 }
 
@@ -972,6 +977,24 @@ crypto_pk_private_sign(crypto_pk_env_t *env, char *to, size_t tolen,
   return r;
 }
 
+/** Do a throwaway private-key operation with <b>env</b>, so that OpenSSL
+ * sets up and caches its Montgomery contexts and blinding values for the
+ * key now, rather than during the first real decryption or signature.
+ * Return 0 on success, -1 on failure. */
+int
+crypto_pk_prepare_private_key(crypto_pk_env_t *env)
+{
+  char buf[PK_BYTES*2];
+  static const char msg[] = "prepare";
+  int r;
+  tor_assert(env);
+  if (crypto_pk_keysize(env) > sizeof(buf))
+    return -1;
+  r = crypto_pk_private_sign(env, buf, sizeof(buf), msg, sizeof(msg));
+  memset(buf, 0, sizeof(buf));
+  return r < 0 ? -1 : 0;
+}
+
 /** Compute a SHA1 digest of <b>fromlen</b> bytes of data stored at
  * <b>from</b>; sign the data with the private key in <b>env</b>, and
  * store it in <b>to</b>.  Return the number of bytes written on
@@ -1430,6 +1453,32 @@ crypto_cipher_crypt_inplace(crypto_cipher_env_t *env, char *buf, size_t len)
   return 0;
 }
 
+/** Encrypt or decrypt, in place, the <b>n_bufs</b> buffers in <b>bufs</b>,
+ * each <b>len</b> bytes long, with the cipher in <b>env</b>, as if they were
+ * one contiguous stream.  Return 0 on success, -1 on failure.  This is
+ * faster than calling crypto_cipher_crypt_inplace() on each of them. */
+int
+crypto_cipher_crypt_inplace_multi(crypto_cipher_env_t *env, char **bufs,
+                                  size_t len, int n_bufs)
+{
+  tor_assert(env);
+  tor_assert(n_bufs >= 0);
+  tor_assert(len < SIZE_T_CEILING);
+  aes_crypt_inplace_multi(env->cipher, bufs, len, n_bufs);
+  return 0;
+}
+
+/** Have <b>env</b> precompute its keystream a cell or so at a time, if that
+ * is supported for its AES implementation.  Call this after initializing
+ * the cipher and before using it.  Return 0 if the keystream buffer is in
+ * use, -1 otherwise; either way, <b>env</b> keeps working. */
+int
+crypto_cipher_enable_keystream_buffer(crypto_cipher_env_t *env)
+{
+  tor_assert(env);
+  return aes_cipher_enable_keystream_buffer(env->cipher);
+}
+
 /** Encrypt <b>fromlen</b> bytes (at least 1) from <b>from</b> with the key in
  * <b>cipher</b> to the buffer in <b>to</b> of length
  * <b>tolen</b>. <b>tolen</b> must be at least <b>fromlen</b> plus
@@ -1518,6 +1567,36 @@ crypto_digest256(char *digest, const char *m, size_t len,
   return (SHA256((const unsigned char*)m,len,(unsigned char*)digest) == NULL);
 }
 
+/** Compute the <b>algorithm</b> digest of each of the <b>n</b> strings in
+ * <b>ms</b>, where the <b>i</b>th string is <b>lens</b>[i] bytes long, and
+ * write it into <b>digests_out</b>[i].  Each output buffer must hold
+ * DIGEST_LEN bytes for SHA1, or DIGEST256_LEN bytes otherwise.  Return 0 on
+ * success, -1 if any digest failed.
+ *
+ * Callers that have many documents to hash at once (a batch of
+ * microdescriptors, say) should use this rather than looping themselves, so
+ * that a multi-buffer implementation can take over the whole batch.  We
+ * don't need to pick a SHA implementation for the CPU here: OpenSSL's SHA1
+ * and SHA256 already choose their SHA-NI, AVX2 or ARMv8 code at runtime. */
+int
+crypto_digest_multi(char **digests_out, const char * const *ms,
+                    const size_t *lens, int n, digest_algorithm_t algorithm)
+{
+  int i, r = 0;
+  tor_assert(n >= 0);
+  tor_assert(n == 0 || (digests_out && ms && lens));
+  for (i = 0; i < n; ++i) {
+    if (algorithm == DIGEST_SHA1) {
+      if (crypto_digest(digests_out[i], ms[i], lens[i]) < 0)
+        r = -1;
+    } else {
+      if (crypto_digest256(digests_out[i], ms[i], lens[i], algorithm) < 0)
+        r = -1;
+    }
+  }
+  return r;
+}
+
 /** Set the digests_t in <b>ds_out</b> to contain every digest on the
  * <b>len</b> bytes in <b>m</b> that we know how to compute.  Return 0 on
  * success, -1 on failure. */
@@ -1696,6 +1775,29 @@ crypto_digest_assign(crypto_digest_env_t *into,
   memcpy(into,from,sizeof(crypto_digest_env_t));
 }
 
+/** Save the state of the digest object <b>digest</b> into
+ * <b>checkpoint</b>, so that crypto_digest_restore() can put it back. */
+void
+crypto_digest_checkpoint(crypto_digest_checkpoint_t *checkpoint,
+                         const crypto_digest_env_t *digest)
+{
+  tor_assert(checkpoint);
+  tor_assert(digest);
+  tor_assert(sizeof(crypto_digest_env_t) <= CRYPTO_DIGEST_CHECKPOINT_LEN);
+  memcpy(checkpoint->state.mem, digest, sizeof(crypto_digest_env_t));
+}
+
+/** Replace the state of the digest object <b>digest</b> with the state saved
+ * in <b>checkpoint</b> by crypto_digest_checkpoint(). */
+void
+crypto_digest_restore(crypto_digest_env_t *digest,
+                      const crypto_digest_checkpoint_t *checkpoint)
+{
+  tor_assert(checkpoint);
+  tor_assert(digest);
+  memcpy(digest, checkpoint->state.mem, sizeof(crypto_digest_env_t));
+}
+
 /** Compute the HMAC-SHA-1 of the <b>msg_len</b> bytes in <b>msg</b>, using
  * the <b>key</b> of length <b>key_len</b>.  Store the DIGEST_LEN-byte result
  * in <b>hmac_out</b>.
@@ -2384,6 +2486,188 @@ seed_weak_rng(void)
   tor_init_weak_random(seed);
 }
 
+/* Buffered random number generation.
+ *
+ * RAND_bytes() takes a global lock on every call, which hurts when we ask
+ * it for a few bytes at a time from path selection or from several
+ * cpuworker threads.  Instead, each thread keeps its own AES-CTR generator
+ * keyed from OpenSSL's RNG, and hands out bytes from a buffer of keystream.
+ * Each time we refill the buffer we take the first CIPHER_KEY_LEN bytes as
+ * the next key, and we wipe bytes as soon as we hand them out, so that
+ * anyone who captures a generator's state can't recover its earlier
+ * output. */
+
+/** How many bytes of keystream does a thread's generator make at once? */
+#define CRYPTO_RNG_BUF_LEN 1024
+/** How many bytes may a thread's generator hand out before we rekey it from
+ * OpenSSL? */
+#define CRYPTO_RNG_RESEED_AFTER (1<<20)
+
+#if !defined(USE_PTHREADS) && !defined(MS_WINDOWS)
+/** Defined if we can't hear about forks with pthread_atfork(), and so have
+ * to notice them by checking our pid. */
+#define CRYPTO_RNG_CHECK_PID
+#endif
+
+/** One thread's buffered random number generator. */
+typedef struct crypto_rng_t {
+  /** AES-CTR cipher whose keystream we hand out. */
+  crypto_cipher_env_t *cipher;
+  /** Keystream; bytes before <b>buf_pos</b> are used up and zeroed. */
+  char buf[CRYPTO_RNG_BUF_LEN];
+  /** Index of the first unused byte in <b>buf</b>. */
+  size_t buf_pos;
+  /** How many bytes have we handed out since we last keyed from OpenSSL? */
+  size_t output_since_seed;
+  /** Value of crypto_rng_generation when we last keyed from OpenSSL. */
+  unsigned generation;
+#ifdef CRYPTO_RNG_CHECK_PID
+  /** Process that last keyed this generator. */
+  pid_t pid;
+#endif
+} crypto_rng_t;
+
+/** Holds each thread's crypto_rng_t. */
+static tor_threadlocal_t crypto_rng_threadlocal;
+/** True iff crypto_rng_threadlocal is ready for use. */
+static int crypto_rng_threadlocal_initialized = 0;
+/** Incremented whenever every thread must rekey its generator from OpenSSL
+ * before using it again: when we add entropy to OpenSSL's RNG, and in the
+ * child process after a fork. */
+static volatile unsigned crypto_rng_generation = 1;
+
+#ifdef USE_PTHREADS
+/** Called in the child after a fork: make sure that parent and child don't
+ * hand out the same buffered bytes. */
+static void
+crypto_rng_note_fork(void)
+{
+  ++crypto_rng_generation;
+}
+#endif
+
+/** Set up the thread-local storage for buffered random number generation.
+ * Return 0 on success, -1 on failure; on failure, crypto_rand() uses
+ * OpenSSL directly. */
+static int
+crypto_rng_init(void)
+{
+  if (crypto_rng_threadlocal_initialized)
+    return 0;
+  if (tor_threadlocal_init(&crypto_rng_threadlocal) < 0) {
+    log_warn(LD_CRYPTO, "Couldn't allocate thread-local storage for "
+             "random number generation.");
+    return -1;
+  }
+#ifdef USE_PTHREADS
+  {
+    static int atfork_registered = 0;
+    if (!atfork_registered) {
+      if (pthread_atfork(NULL, NULL, crypto_rng_note_fork)) {
+        log_warn(LD_CRYPTO, "Couldn't register a fork handler for random "
+                 "number generation.");
+        tor_threadlocal_destroy(&crypto_rng_threadlocal);
+        return -1;
+      }
+      atfork_registered = 1;
+    }
+  }
+#endif
+  crypto_rng_threadlocal_initialized = 1;
+  return 0;
+}
+
+/** Key <b>rng</b> afresh from OpenSSL's RNG, discarding any keystream it
+ * has buffered.  Return 0 on success, -1 on failure. */
+static int
+crypto_rng_seed(crypto_rng_t *rng)
+{
+  char key[CIPHER_KEY_LEN];
+  if (RAND_bytes((unsigned char*)key, (int)sizeof(key)) != 1) {
+    crypto_log_errors(LOG_WARN, "seeding buffered random number generator");
+    return -1;
+  }
+  crypto_cipher_set_key(rng->cipher, key);
+  crypto_cipher_encrypt_init_cipher(rng->cipher);
+  memset(key, 0, sizeof(key));
+  memset(rng->buf, 0, sizeof(rng->buf));
+  rng->buf_pos = sizeof(rng->buf);
+  rng->output_since_seed = 0;
+  rng->generation = crypto_rng_generation;
+#ifdef CRYPTO_RNG_CHECK_PID
+  rng->pid = getpid();
+#endif
+  return 0;
+}
+
+/** Fill <b>rng</b>'s buffer with fresh keystream, and rekey it from the
+ * start of that keystream. */
+static void
+crypto_rng_refill(crypto_rng_t *rng)
+{
+  memset(rng->buf, 0, sizeof(rng->buf));
+  crypto_cipher_crypt_inplace(rng->cipher, rng->buf, sizeof(rng->buf));
+  crypto_cipher_set_key(rng->cipher, rng->buf);
+  crypto_cipher_encrypt_init_cipher(rng->cipher);
+  memset(rng->buf, 0, CIPHER_KEY_LEN);
+  rng->buf_pos = CIPHER_KEY_LEN;
+}
+
+/** Return the current thread's generator, creating or rekeying it as
+ * needed.  Return NULL if we can't use a buffered generator right now. */
+static crypto_rng_t *
+crypto_rng_get(void)
+{
+  crypto_rng_t *rng;
+  if (!crypto_rng_threadlocal_initialized)
+    return NULL;
+  rng = tor_threadlocal_get(&crypto_rng_threadlocal);
+  if (PREDICT_UNLIKELY(!rng)) {
+    rng = tor_malloc_zero(sizeof(crypto_rng_t));
+    rng->cipher = crypto_new_cipher_env();
+    rng->generation = crypto_rng_generation - 1;
+    tor_threadlocal_set(&crypto_rng_threadlocal, rng);
+  }
+  if (PREDICT_UNLIKELY(rng->generation != crypto_rng_generation ||
+                       rng->output_since_seed >= CRYPTO_RNG_RESEED_AFTER
+#ifdef CRYPTO_RNG_CHECK_PID
+                       || rng->pid != getpid()
+#endif
+                       )) {
+    if (crypto_rng_seed(rng) < 0)
+      return NULL;
+  }
+  return rng;
+}
+
+/** Release the current thread's generator, if it has one. */
+static void
+crypto_rng_free_thread_state(void)
+{
+  crypto_rng_t *rng;
+  if (!crypto_rng_threadlocal_initialized)
+    return;
+  rng = tor_threadlocal_get(&crypto_rng_threadlocal);
+  if (!rng)
+    return;
+  tor_threadlocal_set(&crypto_rng_threadlocal, NULL);
+  crypto_free_cipher_env(rng->cipher);
+  memset(rng, 0, sizeof(crypto_rng_t));
+  tor_free(rng);
+}
+
+/** Release the current thread's generator and the thread-local storage
+ * that holds every thread's generator. */
+static void
+crypto_rng_free_all(void)
+{
+  if (!crypto_rng_threadlocal_initialized)
+    return;
+  crypto_rng_free_thread_state();
+  tor_threadlocal_destroy(&crypto_rng_threadlocal);
+  crypto_rng_threadlocal_initialized = 0;
+}
+
 /** Seed OpenSSL's random number generator with bytes from the operating
  * system.  <b>startup</b> should be true iff we have just started Tor and
  * have not yet allocated a bunch of fds.  Return 0 on success, -1 on failure.
@@ -2435,6 +2719,7 @@ crypto_seed_rng(int startup)
   }
   RAND_seed(buf, sizeof(buf));
   memset(buf, 0, sizeof(buf));
+  ++crypto_rng_generation;
   seed_weak_rng();
   return 0;
 #else
@@ -2452,6 +2737,7 @@ crypto_seed_rng(int startup)
     }
     RAND_seed(buf, (int)sizeof(buf));
     memset(buf, 0, sizeof(buf));
+    ++crypto_rng_generation;
     seed_weak_rng();
     return 0;
   }
@@ -2468,8 +2754,26 @@ int
 crypto_rand(char *to, size_t n)
 {
   int r;
+  crypto_rng_t *rng;
   tor_assert(n < INT_MAX);
   tor_assert(to);
+
+  if ((rng = crypto_rng_get())) {
+    while (n) {
+      size_t k;
+      if (rng->buf_pos == sizeof(rng->buf))
+        crypto_rng_refill(rng);
+      k = MIN(n, sizeof(rng->buf) - rng->buf_pos);
+      memcpy(to, rng->buf + rng->buf_pos, k);
+      memset(rng->buf + rng->buf_pos, 0, k);
+      rng->buf_pos += k;
+      rng->output_since_seed += k;
+      to += k;
+      n -= k;
+    }
+    return 0;
+  }
+
   r = RAND_bytes((unsigned char*)to, (int)n);
   if (r == 0)
     crypto_log_errors(LOG_WARN, "generating random data");
@@ -2608,8 +2912,7 @@ smartlist_shuffle(smartlist_t *sl)
 int
 base64_encode(char *dest, size_t destlen, const char *src, size_t srclen)
 {
-  /* FFFF we might want to rewrite this along the lines of base64_decode, if
-   * it ever shows up in the profile. */
+#ifdef USE_OPENSSL_BASE64
   EVP_ENCODE_CTX ctx;
   int len, ret;
   tor_assert(srclen < INT_MAX);
@@ -2628,6 +2931,52 @@ base64_encode(char *dest, size_t destlen, const char *src, size_t srclen)
   EVP_EncodeFinal(&ctx, (unsigned char*)(dest+len), &ret);
   ret += len;
   return ret;
+#else
+  static const char b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  const uint8_t *s = (const uint8_t*)src, *eos = s + srclen;
+  char *d = dest;
+  tor_assert(srclen < INT_MAX);
+
+  /* Same bound as OpenSSL: 48 bytes of input -> 64 bytes of output plus
+   * newline, plus a NUL. */
+  if (destlen < ((srclen/48)+1)*66)
+    return -1;
+  if (destlen > SIZE_T_CEILING)
+    return -1;
+
+  /* Match the format of EVP_EncodeUpdate: a newline after every 64
+   * characters, and after the last line. */
+  while (s < eos) {
+    const uint8_t *eol = (eos - s > 48) ? s + 48 : eos;
+    /* Whole 3-byte groups: 24 bits in, 4 characters out. */
+    for ( ; eol - s >= 3; s += 3) {
+      uint32_t n = (((uint32_t)s[0])<<16) | (((uint32_t)s[1])<<8) | s[2];
+      d[0] = b64[n >> 18];
+      d[1] = b64[(n >> 12) & 63];
+      d[2] = b64[(n >> 6) & 63];
+      d[3] = b64[n & 63];
+      d += 4;
+    }
+    if (s < eol) {
+      /* 1 or 2 bytes left over: pad with =. */
+      uint32_t n = ((uint32_t)s[0])<<16;
+      if (eol - s == 2)
+        n |= ((uint32_t)s[1])<<8;
+      d[0] = b64[n >> 18];
+      d[1] = b64[(n >> 12) & 63];
+      d[2] = (eol - s == 2) ? b64[(n >> 6) & 63] : '=';
+      d[3] = '=';
+      d += 4;
+      s = eol;
+    }
+    *d++ = '\n';
+  }
+  *d = '\0';
+
+  tor_assert((size_t)(d-dest) < destlen);
+  return (int)(d-dest);
+#endif
 }
 
 /** @{ */
@@ -2711,8 +3060,31 @@ base64_decode(char *dest, size_t destlen, const char *src, size_t srclen)
    * 24 bits, batch them into 3 bytes and flush those bytes to dest.
    */
   for ( ; src < eos; ++src) {
-    unsigned char c = (unsigned char) *src;
-    uint8_t v = base64_decode_table[c];
+    unsigned char c;
+    uint8_t v;
+    if (n_idx == 0) {
+      /* Fast path: as long as the next 4 characters are all base64 digits,
+       * turn them into 3 bytes at once.  Whitespace, padding and invalid
+       * characters all have one of the top two bits set. */
+      while (eos - src >= 4) {
+        const uint8_t a = base64_decode_table[(uint8_t)src[0]];
+        const uint8_t b = base64_decode_table[(uint8_t)src[1]];
+        const uint8_t c2 = base64_decode_table[(uint8_t)src[2]];
+        const uint8_t d = base64_decode_table[(uint8_t)src[3]];
+        if ((a|b|c2|d) & 0xc0)
+          break;
+        n = (((uint32_t)a)<<18) | (((uint32_t)b)<<12) | (c2<<6) | d;
+        *dest++ = (n>>16);
+        *dest++ = (n>>8) & 0xff;
+        *dest++ = (n) & 0xff;
+        src += 4;
+      }
+      n = 0;
+      if (src == eos)
+        break;
+    }
+    c = (unsigned char) *src;
+    v = base64_decode_table[c];
     switch (v) {
       case X:
         /* This character isn't allowed in base64. */
@@ -2762,6 +3134,43 @@ base64_decode(char *dest, size_t destlen, const char *src, size_t srclen)
   return (int)(dest-dest_orig);
 #endif
 }
+
+/** Return the number of bytes that base64_decode() would produce when
+ * decoding <b>srclen</b> bytes of base64 data from <b>src</b>, or -1 if
+ * the data is not valid base64.  Accepts exactly the same inputs as
+ * base64_decode(), but writes nothing, so callers can validate an object
+ * and learn its size before deciding whether to decode it at all. */
+int
+base64_decoded_len(const char *src, size_t srclen)
+{
+  const char *eos = src+srclen;
+  size_t n_bytes = 0;
+  int n_idx = 0;
+
+  if (srclen > SIZE_T_CEILING)
+    return -1;
+
+  for ( ; src < eos; ++src) {
+    uint8_t v = base64_decode_table[(unsigned char) *src];
+    if (v == X)
+      return -1;
+    else if (v == SP)
+      continue;
+    else if (v == PAD)
+      break;
+    if (++n_idx == 4) {
+      n_bytes += 3;
+      n_idx = 0;
+    }
+  }
+  if (n_idx == 1)
+    return -1;
+  if (n_idx > 1)
+    n_bytes += n_idx - 1;
+
+  tor_assert(n_bytes <= INT_MAX);
+  return (int)n_bytes;
+}
 #undef X
 #undef SP
 #undef PAD
@@ -2848,24 +3257,54 @@ digest256_from_base64(char *digest, const char *d64)
 void
 base32_encode(char *dest, size_t destlen, const char *src, size_t srclen)
 {
-  unsigned int i, v, u;
-  size_t nbits = srclen * 8, bit;
+  const uint8_t *s = (const uint8_t*)src, *eos = s + srclen;
+  size_t nbits = srclen * 8;
 
   tor_assert(srclen < SIZE_T_CEILING/8);
   tor_assert((nbits%5) == 0); /* We need an even multiple of 5 bits. */
   tor_assert((nbits/5)+1 <= destlen); /* We need enough space. */
   tor_assert(destlen < SIZE_T_CEILING);
 
-  for (i=0,bit=0; bit < nbits; ++i, bit+=5) {
-    /* set v to the 16-bit value starting at src[bits/8], 0-padded. */
-    v = ((uint8_t)src[bit/8]) << 8;
-    if (bit+5<nbits) v += (uint8_t)src[(bit/8)+1];
-    /* set u to the 5-bit value at the bit'th bit of src. */
-    u = (v >> (11-(bit%8))) & 0x1F;
-    dest[i] = BASE32_CHARS[u];
-  }
-  dest[i] = '\0';
-}
+  /* Since srclen*8 is a multiple of 5, srclen is a multiple of 5: turn each
+   * 40-bit group into 8 characters. */
+  for ( ; s < eos; s += 5) {
+    uint64_t v = (((uint64_t)s[0])<<32) | (((uint64_t)s[1])<<24) |
+                 (((uint64_t)s[2])<<16) | (((uint64_t)s[3])<<8) | s[4];
+    dest[0] = BASE32_CHARS[(v >> 35) & 0x1F];
+    dest[1] = BASE32_CHARS[(v >> 30) & 0x1F];
+    dest[2] = BASE32_CHARS[(v >> 25) & 0x1F];
+    dest[3] = BASE32_CHARS[(v >> 20) & 0x1F];
+    dest[4] = BASE32_CHARS[(v >> 15) & 0x1F];
+    dest[5] = BASE32_CHARS[(v >> 10) & 0x1F];
+    dest[6] = BASE32_CHARS[(v >> 5) & 0x1F];
+    dest[7] = BASE32_CHARS[v & 0x1F];
+    dest += 8;
+  }
+  *dest = '\0';
+}
+
+/** Marks bytes that aren't base32 digits in base32_decode_table. */
+#define X 255
+/** Internal table mapping byte values to the 5-bit values they represent in
+ * base32, or X.  We accept both upper and lower case. */
+static const uint8_t base32_decode_table[256] = {
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, 26, 27, 28, 29, 30, 31, X, X, X, X, X, X, X, X,
+  X, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+  15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, X, X, X, X, X,
+  X, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+  15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
 
 /** Implements base32 decoding as in rfc3548.  Limitation: Requires
  * that srclen*5 is a multiple of 8. Returns 0 if successful, -1 otherwise.
@@ -2873,64 +3312,40 @@ base32_encode(char *dest, size_t destlen, const char *src, size_t srclen)
 int
 base32_decode(char *dest, size_t destlen, const char *src, size_t srclen)
 {
-  /* XXXX we might want to rewrite this along the lines of base64_decode, if
-   * it ever shows up in the profile. */
-  unsigned int i;
-  size_t nbits, j, bit;
-  char *tmp;
-  nbits = srclen * 5;
+  const uint8_t *s = (const uint8_t*)src, *eos = s + srclen;
+  uint8_t *d = (uint8_t*)dest;
+  size_t nbits = srclen * 5;
 
   tor_assert(srclen < SIZE_T_CEILING / 5);
   tor_assert((nbits%8) == 0); /* We need an even multiple of 8 bits. */
   tor_assert((nbits/8) <= destlen); /* We need enough space. */
   tor_assert(destlen < SIZE_T_CEILING);
 
-  /* Convert base32 encoded chars to the 5-bit values that they represent. */
-  tmp = tor_malloc_zero(srclen);
-  for (j = 0; j < srclen; ++j) {
-    if (src[j] > 0x60 && src[j] < 0x7B) tmp[j] = src[j] - 0x61;
-    else if (src[j] > 0x31 && src[j] < 0x38) tmp[j] = src[j] - 0x18;
-    else if (src[j] > 0x40 && src[j] < 0x5B) tmp[j] = src[j] - 0x41;
-    else {
+  /* Since srclen*5 is a multiple of 8, srclen is a multiple of 8: turn each
+   * group of 8 characters into 5 bytes. */
+  for ( ; s < eos; s += 8, d += 5) {
+    uint64_t v = 0;
+    uint8_t bad = 0;
+    int j;
+    for (j = 0; j < 8; ++j) {
+      const uint8_t u = base32_decode_table[s[j]];
+      bad |= u;
+      v = (v << 5) | (u & 0x1F);
+    }
+    if (bad & 0xe0) {
       log_warn(LD_BUG, "illegal character in base32 encoded string");
-      tor_free(tmp);
       return -1;
     }
+    d[0] = (uint8_t)(v >> 32);
+    d[1] = (uint8_t)(v >> 24);
+    d[2] = (uint8_t)(v >> 16);
+    d[3] = (uint8_t)(v >> 8);
+    d[4] = (uint8_t)v;
   }
 
-  /* Assemble result byte-wise by applying five possible cases. */
-  for (i = 0, bit = 0; bit < nbits; ++i, bit += 8) {
-    switch (bit % 40) {
-    case 0:
-      dest[i] = (((uint8_t)tmp[(bit/5)]) << 3) +
-                (((uint8_t)tmp[(bit/5)+1]) >> 2);
-      break;
-    case 8:
-      dest[i] = (((uint8_t)tmp[(bit/5)]) << 6) +
-                (((uint8_t)tmp[(bit/5)+1]) << 1) +
-                (((uint8_t)tmp[(bit/5)+2]) >> 4);
-      break;
-    case 16:
-      dest[i] = (((uint8_t)tmp[(bit/5)]) << 4) +
-                (((uint8_t)tmp[(bit/5)+1]) >> 1);
-      break;
-    case 24:
-      dest[i] = (((uint8_t)tmp[(bit/5)]) << 7) +
-                (((uint8_t)tmp[(bit/5)+1]) << 2) +
-                (((uint8_t)tmp[(bit/5)+2]) >> 3);
-      break;
-    case 32:
-      dest[i] = (((uint8_t)tmp[(bit/5)]) << 5) +
-                ((uint8_t)tmp[(bit/5)+1]);
-      break;
-    }
-  }
-
-  memset(tmp, 0, srclen);
-  tor_free(tmp);
-  tmp = NULL;
   return 0;
 }
+#undef X
 
 /** Implement RFC2440-style iterated-salted S2K conversion: convert the
  * <b>secret_len</b>-byte <b>secret</b> into a <b>key_out_len</b> byte
@@ -3071,6 +3486,7 @@ setup_openssl_threading(void)
 int
 crypto_global_cleanup(void)
 {
+  crypto_rng_free_all();
   EVP_cleanup();
   ERR_remove_state(0);
   ERR_free_strings();
@@ -80,6 +80,19 @@ typedef struct crypto_cipher_env_t crypto_cipher_env_t;
 typedef struct crypto_digest_env_t crypto_digest_env_t;
 typedef struct crypto_dh_env_t crypto_dh_env_t;
 
+/** How many bytes do we need to hold a saved crypto_digest_env_t state? */
+#define CRYPTO_DIGEST_CHECKPOINT_LEN 256
+/** A saved copy of the state of a crypto_digest_env_t.  Unlike
+ * crypto_digest_dup(), saving one needs no heap allocation, so these can
+ * live on the stack.  See crypto_digest_checkpoint(). */
+typedef struct crypto_digest_checkpoint_t {
+  union {
+    uint64_t u64; /**< Force alignment. */
+    void *ptr; /**< Force alignment. */
+    char mem[CRYPTO_DIGEST_CHECKPOINT_LEN]; /**< The saved state. */
+  } state;
+} crypto_digest_checkpoint_t;
+
 /* global state */
 int crypto_global_init(int hardwareAccel,
                        const char *accelName,
@@ -138,6 +151,7 @@ int crypto_pk_public_checksig_digest(crypto_pk_env_t *env, const char *data,
                                size_t datalen, const char *sig, size_t siglen);
 int crypto_pk_private_sign(crypto_pk_env_t *env, char *to, size_t tolen,
                            const char *from, size_t fromlen);
+int crypto_pk_prepare_private_key(crypto_pk_env_t *env);
 int crypto_pk_private_sign_digest(crypto_pk_env_t *env, char *to, size_t tolen,
                                   const char *from, size_t fromlen);
 int crypto_pk_public_hybrid_encrypt(crypto_pk_env_t *env, char *to,
@@ -170,6 +184,9 @@ int crypto_cipher_encrypt(crypto_cipher_env_t *env, char *to,
 int crypto_cipher_decrypt(crypto_cipher_env_t *env, char *to,
                           const char *from, size_t fromlen);
 int crypto_cipher_crypt_inplace(crypto_cipher_env_t *env, char *d, size_t len);
+int crypto_cipher_crypt_inplace_multi(crypto_cipher_env_t *env, char **bufs,
+                                      size_t len, int n_bufs);
+int crypto_cipher_enable_keystream_buffer(crypto_cipher_env_t *env);
 
 int crypto_cipher_encrypt_with_iv(crypto_cipher_env_t *env,
                                   char *to, size_t tolen,
@@ -183,6 +200,9 @@ int crypto_digest(char *digest, const char *m, size_t len);
 int crypto_digest256(char *digest, const char *m, size_t len,
                      digest_algorithm_t algorithm);
 int crypto_digest_all(digests_t *ds_out, const char *m, size_t len);
+int crypto_digest_multi(char **digests_out, const char * const *ms,
+                        const size_t *lens, int n,
+                        digest_algorithm_t algorithm);
 const char *crypto_digest_algorithm_get_name(digest_algorithm_t alg);
 int crypto_digest_algorithm_parse_name(const char *name);
 crypto_digest_env_t *crypto_new_digest_env(void);
@@ -195,6 +215,10 @@ void crypto_digest_get_digest(crypto_digest_env_t *digest,
 crypto_digest_env_t *crypto_digest_dup(const crypto_digest_env_t *digest);
 void crypto_digest_assign(crypto_digest_env_t *into,
                           const crypto_digest_env_t *from);
+void crypto_digest_checkpoint(crypto_digest_checkpoint_t *checkpoint,
+                              const crypto_digest_env_t *digest);
+void crypto_digest_restore(crypto_digest_env_t *digest,
+                           const crypto_digest_checkpoint_t *checkpoint);
 void crypto_hmac_sha1(char *hmac_out,
                       const char *key, size_t key_len,
                       const char *msg, size_t msg_len);
@@ -234,6 +258,7 @@ void smartlist_shuffle(struct smartlist_t *sl);
 
 int base64_encode(char *dest, size_t destlen, const char *src, size_t srclen);
 int base64_decode(char *dest, size_t destlen, const char *src, size_t srclen);
+int base64_decoded_len(const char *src, size_t srclen);
 /** Characters that can appear (case-insensitively) in a base-32 encoding. */
 #define BASE32_CHARS "abcdefghijklmnopqrstuvwxyz234567"
 void base32_encode(char *dest, size_t destlen, const char *src, size_t srclen);
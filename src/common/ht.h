@@ -20,10 +20,17 @@
     unsigned hth_load_limit;                                            \
     /* Position of hth_table_length in the primes table. */             \
     int hth_prime_idx;                                                  \
+    /* While an incremental resize is in progress, the table we're       \
+     * moving elements out of; otherwise NULL. */                       \
+    struct type **hth_old_table;                                        \
+    /* How long is the old table? */                                    \
+    unsigned hth_old_length;                                            \
+    /* Buckets of the old table before this index have been moved. */   \
+    unsigned hth_migrate_idx;                                           \
   }
 
 #define HT_INITIALIZER()                        \
-  { NULL, 0, 0, 0, -1 }
+  { NULL, 0, 0, 0, -1, NULL, 0, 0 }
 
 #define HT_ENTRY(type)                          \
   struct {                                      \
@@ -34,17 +41,20 @@
 #define HT_EMPTY(head)                          \
   ((head)->hth_n_entries == 0)
 
-/* Helper: alias for the bucket containing 'elm'. */
-#define _HT_BUCKET(head, field, elm)                                    \
-  ((head)->hth_table[elm->field.hte_hash % head->hth_table_length])
-
 /* How many elements in 'head'? */
 #define HT_SIZE(head)                           \
   ((head)->hth_n_entries)
 
 /* Return memory usage for a hashtable (not counting the entries themselves) */
-#define HT_MEM_USAGE(head)                         \
-  (sizeof(*head) + (head)->hth_table_length * sizeof(void*))
+#define HT_MEM_USAGE(head)                                             \
+  (sizeof(*head) + ((head)->hth_table_length + (head)->hth_old_length) * \
+   sizeof(void*))
+
+/* How many buckets of the old table does each insert into a table generated
+ * with HT_GENERATE_INCREMENTAL move into the new one? This needs to be
+ * comfortably more than 1/load, so that every resize finishes before the
+ * next one starts. */
+#define HT_MIGRATE_STEP 4
 
 #define HT_FIND(name, head, elm)     name##_HT_FIND((head), (elm))
 #define HT_INSERT(name, head, elm)   name##_HT_INSERT((head), (elm))
@@ -108,6 +118,7 @@ ht_string_hash(const char *s)
 
 #define HT_PROTOTYPE(name, type, field, hashfn, eqfn)                   \
   int name##_HT_GROW(struct name *ht, unsigned min_capacity);           \
+  void name##_HT_MIGRATE(struct name *ht, unsigned n_buckets);          \
   void name##_HT_CLEAR(struct name *ht);                                \
   int _##name##_HT_REP_IS_BAD(const struct name *ht);                   \
   static INLINE void                                                    \
@@ -117,6 +128,53 @@ ht_string_hash(const char *s)
     head->hth_n_entries = 0;                                            \
     head->hth_load_limit = 0;                                           \
     head->hth_prime_idx = -1;                                           \
+    head->hth_old_table = NULL;                                         \
+    head->hth_old_length = 0;                                           \
+    head->hth_migrate_idx = 0;                                          \
+  }                                                                     \
+  /* Helper: return the bucket of 'head' that holds elements with hash  \
+   * 'h'.  During an incremental resize, that's the old table's bucket  \
+   * if it hasn't been moved yet, and the new table's bucket otherwise. */ \
+  static INLINE struct type **                                          \
+  _##name##_HT_BUCKET_P(const struct name *head, unsigned h)            \
+  {                                                                     \
+    if (head->hth_old_table) {                                          \
+      unsigned ob = h % head->hth_old_length;                           \
+      if (ob >= head->hth_migrate_idx)                                  \
+        return &head->hth_old_table[ob];                                \
+    }                                                                   \
+    return &head->hth_table[h % head->hth_table_length];                \
+  }                                                                     \
+  /* Helper: return the first nonempty bucket of 'head' after the one   \
+   * holding elements with hash 'h', or after no bucket at all if        \
+   * 'start' is true.  New-table buckets come before unmoved old-table  \
+   * buckets. */                                                        \
+  static INLINE struct type **                                          \
+  _##name##_HT_NEXT_BUCKET(struct name *head, unsigned h, int start)    \
+  {                                                                     \
+    unsigned b = 0;                                                     \
+    if (!start && head->hth_old_table &&                                \
+        h % head->hth_old_length >= head->hth_migrate_idx) {            \
+      b = head->hth_table_length + 1 + h % head->hth_old_length;        \
+    } else if (!start) {                                                \
+      b = (h % head->hth_table_length) + 1;                             \
+    }                                                                   \
+    while (b < head->hth_table_length) {                                \
+      if (head->hth_table[b])                                           \
+        return &head->hth_table[b];                                     \
+      ++b;                                                              \
+    }                                                                   \
+    if (!head->hth_old_table)                                           \
+      return NULL;                                                      \
+    b -= head->hth_table_length;                                        \
+    if (b < head->hth_migrate_idx)                                      \
+      b = head->hth_migrate_idx;                                        \
+    while (b < head->hth_old_length) {                                  \
+      if (head->hth_old_table[b])                                       \
+        return &head->hth_old_table[b];                                 \
+      ++b;                                                              \
+    }                                                                   \
+    return NULL;                                                        \
   }                                                                     \
   /* Helper: returns a pointer to the right location in the table       \
    * 'head' to find or insert the element 'elm'. */                     \
@@ -126,7 +184,7 @@ ht_string_hash(const char *s)
     struct type **p;                                                    \
     if (!head->hth_table)                                               \
       return NULL;                                                      \
-    p = &_HT_BUCKET(head, field, elm);                                  \
+    p = _##name##_HT_BUCKET_P(head, elm->field.hte_hash);               \
     while (*p) {                                                        \
       if (eqfn(*p, elm))                                                \
         return p;                                                       \
@@ -153,9 +211,11 @@ ht_string_hash(const char *s)
     struct type **p;                                                    \
     if (!head->hth_table || head->hth_n_entries >= head->hth_load_limit) \
       name##_HT_GROW(head, head->hth_n_entries+1);                      \
+    if (head->hth_old_table)                                            \
+      name##_HT_MIGRATE(head, HT_MIGRATE_STEP);                         \
     ++head->hth_n_entries;                                              \
     _HT_SET_HASH(elm, field, hashfn);                                   \
-    p = &_HT_BUCKET(head, field, elm);                                  \
+    p = _##name##_HT_BUCKET_P(head, elm->field.hte_hash);               \
     elm->field.hte_next = *p;                                           \
     *p = elm;                                                           \
   }                                                                     \
@@ -168,6 +228,8 @@ ht_string_hash(const char *s)
     struct type **p, *r;                                                \
     if (!head->hth_table || head->hth_n_entries >= head->hth_load_limit) \
       name##_HT_GROW(head, head->hth_n_entries+1);                      \
+    if (head->hth_old_table)                                            \
+      name##_HT_MIGRATE(head, HT_MIGRATE_STEP);                         \
     _HT_SET_HASH(elm, field, hashfn);                                   \
     p = _##name##_HT_FIND_P(head, elm);                                 \
     r = *p;                                                             \
@@ -206,13 +268,19 @@ ht_string_hash(const char *s)
                        int (*fn)(struct type *, void *),                \
                        void *data)                                      \
   {                                                                     \
-    unsigned idx;                                                       \
+    unsigned idx, n_buckets;                                            \
     int remove;                                                         \
     struct type **p, **nextp, *next;                                    \
     if (!head->hth_table)                                               \
       return;                                                           \
-    for (idx=0; idx < head->hth_table_length; ++idx) {                  \
-      p = &head->hth_table[idx];                                        \
+    n_buckets = head->hth_table_length + head->hth_old_length;          \
+    for (idx=0; idx < n_buckets; ++idx) {                               \
+      if (idx < head->hth_table_length)                                 \
+        p = &head->hth_table[idx];                                      \
+      else if (idx - head->hth_table_length >= head->hth_migrate_idx)   \
+        p = &head->hth_old_table[idx - head->hth_table_length];         \
+      else                                                              \
+        continue;                                                       \
       while (*p) {                                                      \
         nextp = &(*p)->field.hte_next;                                  \
         next = *nextp;                                                  \
@@ -232,13 +300,7 @@ ht_string_hash(const char *s)
   static INLINE struct type **                                          \
   name##_HT_START(struct name *head)                                    \
   {                                                                     \
-    unsigned b = 0;                                                     \
-    while (b < head->hth_table_length) {                                \
-      if (head->hth_table[b])                                           \
-        return &head->hth_table[b];                                     \
-      ++b;                                                              \
-    }                                                                   \
-    return NULL;                                                        \
+    return _##name##_HT_NEXT_BUCKET(head, 0, 1);                        \
   }                                                                     \
   /* Return the next element in 'head' after 'elm', under the arbitrary \
    * order used by HT_START.  If there are no more elements, return     \
@@ -251,13 +313,7 @@ ht_string_hash(const char *s)
     if ((*elm)->field.hte_next) {                                       \
       return &(*elm)->field.hte_next;                                   \
     } else {                                                            \
-      unsigned b = ((*elm)->field.hte_hash % head->hth_table_length)+1; \
-      while (b < head->hth_table_length) {                              \
-        if (head->hth_table[b])                                         \
-          return &head->hth_table[b];                                   \
-        ++b;                                                            \
-      }                                                                 \
-      return NULL;                                                      \
+      return _##name##_HT_NEXT_BUCKET(head, (*elm)->field.hte_hash, 0); \
     }                                                                   \
   }                                                                     \
   static INLINE struct type **                                          \
@@ -269,18 +325,27 @@ ht_string_hash(const char *s)
     if (*elm) {                                                         \
       return elm;                                                       \
     } else {                                                            \
-      unsigned b = (h % head->hth_table_length)+1;                      \
-      while (b < head->hth_table_length) {                              \
-        if (head->hth_table[b])                                         \
-          return &head->hth_table[b];                                   \
-        ++b;                                                            \
-      }                                                                 \
-      return NULL;                                                      \
+      return _##name##_HT_NEXT_BUCKET(head, h, 0);                      \
     }                                                                   \
   }
 
 #define HT_GENERATE(name, type, field, hashfn, eqfn, load, mallocfn,    \
                     reallocfn, freefn)                                  \
+  _HT_GENERATE_IMPL(name, type, field, hashfn, eqfn, load, mallocfn,    \
+                    reallocfn, freefn, 0)
+
+/* Like HT_GENERATE, but when the table needs to grow, move its elements
+ * into the new table a few buckets per insert instead of all at once.  Use
+ * this for tables big enough that a full rehash would stall the main loop.
+ * Finds are slightly slower while a resize is in progress, and the old and
+ * new tables are both allocated until it finishes. */
+#define HT_GENERATE_INCREMENTAL(name, type, field, hashfn, eqfn, load,   \
+                                mallocfn, reallocfn, freefn)            \
+  _HT_GENERATE_IMPL(name, type, field, hashfn, eqfn, load, mallocfn,    \
+                    reallocfn, freefn, 1)
+
+#define _HT_GENERATE_IMPL(name, type, field, hashfn, eqfn, load, mallocfn, \
+                          reallocfn, freefn, incremental)               \
   static unsigned name##_PRIMES[] = {                                   \
     53, 97, 193, 389,                                                   \
     769, 1543, 3079, 6151,                                              \
@@ -292,6 +357,31 @@ ht_string_hash(const char *s)
   };                                                                    \
   static unsigned name##_N_PRIMES =                                     \
     (unsigned)(sizeof(name##_PRIMES)/sizeof(name##_PRIMES[0]));         \
+  /* Move up to 'n_buckets' buckets of the old table of 'head' into the \
+   * current one, and free the old table once it's empty. */            \
+  void                                                                  \
+  name##_HT_MIGRATE(struct name *head, unsigned n_buckets)              \
+  {                                                                     \
+    while (head->hth_old_table && n_buckets--) {                        \
+      struct type *elm, *next;                                          \
+      unsigned b2;                                                      \
+      elm = head->hth_old_table[head->hth_migrate_idx];                 \
+      head->hth_old_table[head->hth_migrate_idx] = NULL;                \
+      while (elm) {                                                     \
+        next = elm->field.hte_next;                                     \
+        b2 = elm->field.hte_hash % head->hth_table_length;              \
+        elm->field.hte_next = head->hth_table[b2];                      \
+        head->hth_table[b2] = elm;                                      \
+        elm = next;                                                     \
+      }                                                                 \
+      if (++head->hth_migrate_idx == head->hth_old_length) {            \
+        freefn(head->hth_old_table);                                    \
+        head->hth_old_table = NULL;                                     \
+        head->hth_old_length = 0;                                       \
+        head->hth_migrate_idx = 0;                                      \
+      }                                                                 \
+    }                                                                   \
+  }                                                                     \
   /* Expand the internal table of 'head' until it is large enough to    \
    * hold 'size' elements.  Return 0 on success, -1 on allocation       \
    * failure. */                                                        \
@@ -305,6 +395,9 @@ ht_string_hash(const char *s)
       return 0;                                                         \
     if (head->hth_load_limit > size)                                    \
       return 0;                                                         \
+    /* Finish any resize that's still under way. */                     \
+    if (head->hth_old_table)                                            \
+      name##_HT_MIGRATE(head, head->hth_old_length);                    \
     prime_idx = head->hth_prime_idx;                                    \
     do {                                                                \
       new_len = name##_PRIMES[++prime_idx];                             \
@@ -314,6 +407,17 @@ ht_string_hash(const char *s)
     if ((new_table = mallocfn(new_len*sizeof(struct type*)))) {         \
       unsigned b;                                                       \
       memset(new_table, 0, new_len*sizeof(struct type*));               \
+      if ((incremental) && head->hth_n_entries) {                       \
+        /* Leave the elements where they are; inserts will move them. */ \
+        head->hth_old_table = head->hth_table;                          \
+        head->hth_old_length = head->hth_table_length;                  \
+        head->hth_migrate_idx = 0;                                      \
+        head->hth_table = new_table;                                    \
+        head->hth_table_length = new_len;                               \
+        head->hth_prime_idx = prime_idx;                                \
+        head->hth_load_limit = new_load_limit;                          \
+        return 0;                                                       \
+      }                                                                 \
       for (b = 0; b < head->hth_table_length; ++b) {                    \
         struct type *elm, *next;                                        \
         unsigned b2;                                                    \
@@ -362,6 +466,8 @@ ht_string_hash(const char *s)
   {                                                                     \
     if (head->hth_table)                                                \
       freefn(head->hth_table);                                          \
+    if (head->hth_old_table)                                            \
+      freefn(head->hth_old_table);                                      \
     head->hth_table_length = 0;                                         \
     name##_HT_INIT(head);                                               \
   }                                                                     \
@@ -374,7 +480,8 @@ ht_string_hash(const char *s)
     struct type *elm;                                                   \
     if (!head->hth_table_length) {                                      \
       if (!head->hth_table && !head->hth_n_entries &&                   \
-          !head->hth_load_limit && head->hth_prime_idx == -1)           \
+          !head->hth_load_limit && head->hth_prime_idx == -1 &&         \
+          !head->hth_old_table)                                         \
         return 0;                                                       \
       else                                                              \
         return 1;                                                       \
@@ -388,15 +495,30 @@ ht_string_hash(const char *s)
       return 4;                                                         \
     if (head->hth_load_limit != (unsigned)(load*head->hth_table_length)) \
       return 5;                                                         \
+    if (head->hth_old_table &&                                          \
+        (!head->hth_old_length ||                                       \
+         head->hth_migrate_idx >= head->hth_old_length))                \
+      return 7;                                                         \
     for (n = i = 0; i < head->hth_table_length; ++i) {                  \
       for (elm = head->hth_table[i]; elm; elm = elm->field.hte_next) {  \
         if (elm->field.hte_hash != hashfn(elm))                         \
           return 1000 + i;                                              \
-        if ((elm->field.hte_hash % head->hth_table_length) != i)        \
+        if (_##name##_HT_BUCKET_P(head, elm->field.hte_hash) !=         \
+            &head->hth_table[i])                                        \
           return 10000 + i;                                             \
         ++n;                                                            \
       }                                                                 \
     }                                                                   \
+    for (i = 0; i < head->hth_old_length; ++i) {                        \
+      for (elm = head->hth_old_table[i]; elm; elm = elm->field.hte_next) { \
+        if (elm->field.hte_hash != hashfn(elm))                         \
+          return 1000 + i;                                              \
+        if (_##name##_HT_BUCKET_P(head, elm->field.hte_hash) !=         \
+            &head->hth_old_table[i])                                    \
+          return 20000 + i;                                             \
+        ++n;                                                            \
+      }                                                                 \
+    }                                                                   \
     if (n != head->hth_n_entries)                                       \
       return 6;                                                         \
     return 0;                                                           \
@@ -412,6 +534,8 @@ ht_string_hash(const char *s)
     if (!_##var##_head->hth_table ||                                    \
         _##var##_head->hth_n_entries >= _##var##_head->hth_load_limit)  \
       name##_HT_GROW(_##var##_head, _##var##_head->hth_n_entries+1);     \
+    if (_##var##_head->hth_old_table)                                   \
+      name##_HT_MIGRATE(_##var##_head, HT_MIGRATE_STEP);                \
     _HT_SET_HASH((elm), field, hashfn);                                \
     var = _##name##_HT_FIND_P(_##var##_head, (elm));                    \
     if (*var) {                                                         \
@@ -15,6 +15,7 @@
 // #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
@@ -30,6 +31,9 @@
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 #include "compat.h"
 #include "util.h"
 #define LOG_PRIVATE
@@ -55,6 +59,9 @@ typedef struct logfile_t {
   log_callback callback; /**< If not NULL, send messages to this function. */
   log_severity_list_t *severities; /**< Which severity of messages should we
                                     * log for each log domain? */
+  /** How many messages for this log have we dropped because the writer
+   * thread's queue was full, since we last said so in the log? */
+  int n_async_dropped;
 } logfile_t;
 
 static void log_free(logfile_t *victim);
@@ -131,9 +138,22 @@ static smartlist_t *pending_cb_messages = NULL;
 /** What's the lowest log level anybody cares about?  Checking this lets us
  * bail out early from log_debug if we aren't debugging.  */
 int _log_global_min_severity = LOG_NOTICE;
+/** Union of the domains each severity is logged in by any log; see
+ * log_global_domain_enabled().  Until we have logs, assume everything
+ * at notice or above is wanted. */
+log_domain_mask_t _log_global_domain_masks[LOG_DEBUG-LOG_ERR+1] = {
+  ~0u, ~0u, ~0u, 0, 0
+};
 
 static void delete_log(logfile_t *victim);
+static void update_global_log_levels(void);
 static void close_log(logfile_t *victim);
+static void log_async_flush(void);
+static int log_async_enqueue(logfile_t *lf, const char *msg, size_t len);
+
+/** Boolean: do we hand messages for file and stream logs to the writer
+ * thread, rather than writing them ourselves?  Protected by log_mutex. */
+static int log_async_enabled = 0;
 
 static char *domain_to_string(log_domain_mask_t domain,
                              char *buf, size_t buflen);
@@ -336,6 +356,11 @@ logv(int severity, log_domain_mask_t domain, const char *funcname,
   if ((! (domain & LD_NOCB)) && smartlist_len(pending_cb_messages))
     flush_pending_log_callbacks();
 
+  /* We might be about to die: get everything queued before this message
+   * onto the disk, and write this one ourselves. */
+  if (log_async_enabled && severity == LOG_ERR)
+    log_async_flush();
+
   lf = logfiles;
   while (lf) {
     if (! (lf->severities->masks[SEVERITY_MASK_IDX(severity)] & domain)) {
@@ -397,6 +422,12 @@ logv(int severity, log_domain_mask_t domain, const char *funcname,
       lf = lf->next;
       continue;
     }
+    if (log_async_enabled && severity != LOG_ERR) {
+      if (log_async_enqueue(lf, buf, msg_len) < 0)
+        ++lf->n_async_dropped;
+      lf = lf->next;
+      continue;
+    }
     if (write_all(lf->fd, buf, msg_len, 0) < 0) { /* error */
       /* don't log the error! mark this log entry to be blown away, and
        * continue. */
@@ -461,7 +492,7 @@ _log_debug(log_domain_mask_t domain, const char *format, ...)
 {
   va_list ap;
   /* For GCC we do this check in the macro. */
-  if (PREDICT_LIKELY(LOG_DEBUG > _log_global_min_severity))
+  if (PREDICT_LIKELY(!log_global_domain_enabled(LOG_DEBUG, domain)))
     return;
   va_start(ap,format);
   logv(LOG_DEBUG, domain, _log_fn_function_name, format, ap);
@@ -472,7 +503,7 @@ void
 _log_info(log_domain_mask_t domain, const char *format, ...)
 {
   va_list ap;
-  if (LOG_INFO > _log_global_min_severity)
+  if (!log_global_domain_enabled(LOG_INFO, domain))
     return;
   va_start(ap,format);
   logv(LOG_INFO, domain, _log_fn_function_name, format, ap);
@@ -521,6 +552,8 @@ log_free(logfile_t *victim)
 {
   if (!victim)
     return;
+  /* The writer thread may still hold messages for this log. */
+  log_async_flush();
   tor_free(victim->severities);
   tor_free(victim->filename);
   tor_free(victim);
@@ -532,6 +565,7 @@ logs_free_all(void)
 {
   logfile_t *victim, *next;
   smartlist_t *messages;
+  logs_set_async(0);
   LOCK_LOGS();
   next = logfiles;
   logfiles = NULL;
@@ -586,6 +620,7 @@ delete_log(logfile_t *victim)
 static void
 close_log(logfile_t *victim)
 {
+  log_async_flush();
   if (victim->needs_close && victim->fd >= 0) {
     close(victim->fd);
     victim->fd = -1;
@@ -599,6 +634,279 @@ close_log(logfile_t *victim)
   }
 }
 
+/* ===== Asynchronous logging ===== */
+
+#ifdef TOR_HAVE_COND
+/** How many messages may wait for the writer thread?  Once the queue is
+ * full, we drop messages rather than make the logging thread wait. */
+#define ASYNC_LOG_QUEUE_LEN 4096
+/** Most messages that the writer thread passes to one writev() call. */
+#define ASYNC_LOG_MAX_BATCH 64
+
+/** A formatted log message waiting for the writer thread. */
+typedef struct async_log_entry_t {
+  logfile_t *lf; /**< The log to write the message to. */
+  char *msg; /**< The message, including its newline; not NUL-terminated. */
+  size_t len; /**< Length of <b>msg</b>. */
+} async_log_entry_t;
+
+/** Protects the queue indices and flags below.  Never held while we do any
+ * I/O, and never held while we acquire log_mutex. */
+static tor_mutex_t *async_lock = NULL;
+/** Signalled when the writer thread has something to do. */
+static tor_cond_t *async_wakeup = NULL;
+/** Signalled when the writer thread has written a batch, or exited. */
+static tor_cond_t *async_progress = NULL;
+/** Ring buffer of ASYNC_LOG_QUEUE_LEN queued messages.  Only the logging
+ * thread (holding log_mutex) fills entries, and only the writer thread
+ * empties them. */
+static async_log_entry_t *async_queue = NULL;
+/** Number of messages ever queued, and ever written.  The entries waiting
+ * to be written are those from async_tail to async_head, modulo
+ * ASYNC_LOG_QUEUE_LEN. */
+static unsigned async_head = 0, async_tail = 0;
+/** Boolean: is the writer thread running? */
+static int async_running = 0;
+/** Boolean: is the writer thread waiting on async_wakeup? */
+static int async_writer_idle = 0;
+/** Boolean: should the writer thread exit once the queue is empty? */
+static int async_shutdown = 0;
+/** Total number of messages dropped because the queue was full. */
+static uint64_t async_n_dropped = 0;
+
+/** Write the <b>n</b> buffers in <b>iov</b> to <b>fd</b>, retrying short
+ * writes.  Return 0 on success, -1 on failure. */
+static int
+write_iov_all(int fd, struct iovec *iov, int n)
+{
+  while (n) {
+#ifdef HAVE_WRITEV
+    ssize_t r = writev(fd, iov, n);
+#else
+    ssize_t r = write(fd, iov[0].iov_base, iov[0].iov_len);
+#endif
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (n && (size_t)r >= iov->iov_len) {
+      r -= iov->iov_len;
+      ++iov;
+      --n;
+    }
+    if (n) {
+      iov->iov_base = ((char*)iov->iov_base) + r;
+      iov->iov_len -= r;
+    }
+  }
+  return 0;
+}
+
+/** Main function for the log writer thread: write queued messages in
+ * batches, with one writev() call for every run of messages bound for the
+ * same log. */
+static void
+log_async_writer_main(void *arg)
+{
+  struct iovec iov[ASYNC_LOG_MAX_BATCH];
+  (void)arg;
+
+  tor_mutex_acquire(async_lock);
+  for (;;) {
+    unsigned start, n, i, j;
+    while (async_head == async_tail && !async_shutdown) {
+      async_writer_idle = 1;
+      tor_cond_wait(async_wakeup, async_lock);
+      async_writer_idle = 0;
+    }
+    if (async_head == async_tail)
+      break; /* Shutting down, and nothing left to write. */
+    start = async_tail;
+    n = async_head - async_tail;
+    if (n > ASYNC_LOG_MAX_BATCH)
+      n = ASYNC_LOG_MAX_BATCH;
+    tor_mutex_release(async_lock);
+
+    /* The logging thread never touches entries between async_tail and
+     * async_head, so we can use them without the lock. */
+    for (i = 0; i < n; i = j) {
+      async_log_entry_t *first = &async_queue[(start+i)%ASYNC_LOG_QUEUE_LEN];
+      int n_iov = 0;
+      for (j = i; j < n; ++j) {
+        async_log_entry_t *ent = &async_queue[(start+j)%ASYNC_LOG_QUEUE_LEN];
+        if (ent->lf != first->lf)
+          break;
+        iov[n_iov].iov_base = ent->msg;
+        iov[n_iov].iov_len = ent->len;
+        ++n_iov;
+      }
+      if (!first->lf->seems_dead &&
+          write_iov_all(first->lf->fd, iov, n_iov) < 0) {
+        /* As in logv(): don't log the error, just stop using this log. */
+        first->lf->seems_dead = 1;
+      }
+    }
+    for (i = 0; i < n; ++i)
+      tor_free(async_queue[(start+i)%ASYNC_LOG_QUEUE_LEN].msg);
+
+    tor_mutex_acquire(async_lock);
+    async_tail += n;
+    tor_cond_signal_all(async_progress);
+  }
+  async_running = 0;
+  tor_cond_signal_all(async_progress);
+  tor_mutex_release(async_lock);
+  spawn_exit();
+}
+
+/** Queue <b>len</b> bytes of <b>msg</b> for the writer thread to write to
+ * <b>lf</b>.  If we dropped messages for <b>lf</b> earlier, queue a note
+ * saying so first.  Return 0 on success, -1 if the queue is full.  Must
+ * be called with log_mutex held. */
+static int
+log_async_enqueue(logfile_t *lf, const char *msg, size_t len)
+{
+  char note[128];
+  size_t note_len = 0;
+  unsigned room;
+
+  if (lf->n_async_dropped) {
+    note_len = _log_prefix(note, sizeof(note), LOG_WARN);
+    tor_snprintf(note+note_len, sizeof(note)-note_len,
+                 "Log writer fell behind; dropped %d messages.\n",
+                 lf->n_async_dropped);
+    note_len = strlen(note);
+  }
+
+  tor_mutex_acquire(async_lock);
+  room = ASYNC_LOG_QUEUE_LEN - (async_head - async_tail);
+  if (room < (note_len ? 2u : 1u)) {
+    ++async_n_dropped;
+    tor_mutex_release(async_lock);
+    return -1;
+  }
+  tor_mutex_release(async_lock);
+
+  /* Only we add entries, so the room we saw can't shrink; fill the entries
+   * without the lock, so that we never call malloc while holding it. */
+  if (note_len) {
+    async_log_entry_t *ent = &async_queue[async_head % ASYNC_LOG_QUEUE_LEN];
+    ent->lf = lf;
+    ent->msg = tor_memdup(note, note_len);
+    ent->len = note_len;
+    lf->n_async_dropped = 0;
+  }
+  {
+    async_log_entry_t *ent =
+      &async_queue[(async_head + (note_len?1:0)) % ASYNC_LOG_QUEUE_LEN];
+    ent->lf = lf;
+    ent->msg = tor_memdup(msg, len);
+    ent->len = len;
+  }
+
+  tor_mutex_acquire(async_lock);
+  async_head += note_len ? 2 : 1;
+  if (async_writer_idle)
+    tor_cond_signal_one(async_wakeup);
+  tor_mutex_release(async_lock);
+  return 0;
+}
+
+/** Wait until the writer thread has written every queued message. */
+static void
+log_async_flush(void)
+{
+  if (!async_lock)
+    return;
+  tor_mutex_acquire(async_lock);
+  while (async_running && async_head != async_tail)
+    tor_cond_wait(async_progress, async_lock);
+  tor_mutex_release(async_lock);
+}
+
+/** If <b>enabled</b>, start handing messages for file and stream logs to a
+ * separate writer thread, so that a slow disk never stalls the thread that
+ * logs.  Otherwise, write everything still queued and stop the writer
+ * thread.  Return 0 on success, -1 if we can't log asynchronously. */
+int
+logs_set_async(int enabled)
+{
+  if (enabled) {
+    int ok = 0;
+    LOCK_LOGS();
+    if (!log_async_enabled) {
+      if (!async_lock) {
+        async_lock = tor_mutex_new();
+        async_wakeup = tor_cond_new();
+        async_progress = tor_cond_new();
+        async_queue = tor_malloc_zero(sizeof(async_log_entry_t) *
+                                      ASYNC_LOG_QUEUE_LEN);
+      }
+      async_shutdown = 0;
+      async_running = 1;
+      if (spawn_func(log_async_writer_main, NULL) < 0) {
+        async_running = 0;
+        ok = -1;
+      } else {
+        log_async_enabled = 1;
+      }
+    }
+    UNLOCK_LOGS();
+    return ok;
+  } else {
+    LOCK_LOGS();
+    log_async_enabled = 0;
+    UNLOCK_LOGS();
+    if (!async_lock)
+      return 0;
+    tor_mutex_acquire(async_lock);
+    async_shutdown = 1;
+    tor_cond_signal_one(async_wakeup);
+    while (async_running)
+      tor_cond_wait(async_progress, async_lock);
+    tor_mutex_release(async_lock);
+    return 0;
+  }
+}
+
+/** Return the number of log messages we have dropped because the log writer
+ * thread couldn't keep up. */
+uint64_t
+logs_get_n_async_dropped(void)
+{
+  uint64_t n;
+  if (!async_lock)
+    return 0;
+  tor_mutex_acquire(async_lock);
+  n = async_n_dropped;
+  tor_mutex_release(async_lock);
+  return n;
+}
+#else
+/* Without condition variables, we have no way to run a writer thread. */
+static void
+log_async_flush(void)
+{
+}
+static int
+log_async_enqueue(logfile_t *lf, const char *msg, size_t len)
+{
+  (void)lf; (void)msg; (void)len;
+  return -1;
+}
+int
+logs_set_async(int enabled)
+{
+  return enabled ? -1 : 0;
+}
+uint64_t
+logs_get_n_async_dropped(void)
+{
+  return 0;
+}
+#endif
+
 /** Adjust a log severity configuration in <b>severity_out</b> to contain
  * every domain between <b>loglevelMin</b> and <b>loglevelMax</b>, inclusive.
  */
@@ -630,7 +938,7 @@ add_stream_log_impl(const log_severity_list_t *severity,
   lf->next = logfiles;
 
   logfiles = lf;
-  _log_global_min_severity = get_min_log_level();
+  update_global_log_levels();
 }
 
 /** Add a log handler named <b>name</b> to send all messages in <b>severity</b>
@@ -698,7 +1006,7 @@ add_callback_log(const log_severity_list_t *severity, log_callback cb)
 
   LOCK_LOGS();
   logfiles = lf;
-  _log_global_min_severity = get_min_log_level();
+  update_global_log_levels();
   UNLOCK_LOGS();
   return 0;
 }
@@ -718,7 +1026,7 @@ change_callback_log_severity(int loglevelMin, int loglevelMax,
       memcpy(lf->severities, &severities, sizeof(severities));
     }
   }
-  _log_global_min_severity = get_min_log_level();
+  update_global_log_levels();
   UNLOCK_LOGS();
 }
 
@@ -784,7 +1092,7 @@ close_temp_logs(void)
     }
   }
 
-  _log_global_min_severity = get_min_log_level();
+  update_global_log_levels();
   UNLOCK_LOGS();
 }
 
@@ -832,7 +1140,7 @@ add_file_log(const log_severity_list_t *severity, const char *filename)
   add_stream_log_impl(severity, filename, fd);
   logfiles->needs_close = 1;
   lf = logfiles;
-  _log_global_min_severity = get_min_log_level();
+  update_global_log_levels();
 
   if (log_tor_version(lf, 0) < 0) {
     delete_log(lf);
@@ -863,7 +1171,7 @@ add_syslog_log(const log_severity_list_t *severity)
   LOCK_LOGS();
   lf->next = logfiles;
   logfiles = lf;
-  _log_global_min_severity = get_min_log_level();
+  update_global_log_levels();
   UNLOCK_LOGS();
   return 0;
 }
@@ -1088,6 +1396,23 @@ get_min_log_level(void)
   return min;
 }
 
+/** Recompute _log_global_min_severity and _log_global_domain_masks from the
+ * current set of logs.  Must be called with log_mutex held. */
+static void
+update_global_log_levels(void)
+{
+  logfile_t *lf;
+  int i;
+  log_domain_mask_t masks[LOG_DEBUG-LOG_ERR+1];
+  memset(masks, 0, sizeof(masks));
+  for (lf = logfiles; lf; lf = lf->next) {
+    for (i = 0; i < LOG_DEBUG-LOG_ERR+1; ++i)
+      masks[i] |= lf->severities->masks[i];
+  }
+  memcpy(_log_global_domain_masks, masks, sizeof(masks));
+  _log_global_min_severity = get_min_log_level();
+}
+
 /** Switch all logs to output at most verbose level. */
 void
 switch_logs_debug(void)
@@ -1099,7 +1424,7 @@ switch_logs_debug(void)
     for (i = LOG_DEBUG; i >= LOG_ERR; --i)
       lf->severities->masks[SEVERITY_MASK_IDX(i)] = ~0u;
   }
-  _log_global_min_severity = get_min_log_level();
+  update_global_log_levels();
   UNLOCK_LOGS();
 }
 
@@ -8,6 +8,7 @@
 
 #include "orconfig.h"
 #include <stdlib.h>
+#include "torint.h"
 #include "memarea.h"
 #include "util.h"
 #include "compat.h"
@@ -72,6 +73,9 @@ typedef struct memarea_chunk_t {
   /** Next chunk in this area. Only kept around so we can free it. */
   struct memarea_chunk_t *next_chunk;
   size_t mem_size; /**< How much RAM is available in u.mem, total? */
+  /** Index of this chunk's size class, or -1 if it was allocated to hold
+   * one oversized object. */
+  int chunk_class;
   char *next_mem; /**< Next position in u.mem to allocate data at.  If it's
                    * greater than or equal to mem+mem_size, this chunk is
                    * full. */
@@ -88,71 +92,137 @@ typedef struct memarea_chunk_t {
 /** What's the smallest that we'll allocate a chunk? */
 #define CHUNK_SIZE 4096
 
+/** How many chunk sizes are there?  Each area starts out with CHUNK_SIZE
+ * chunks and doubles the size of every chunk it allocates after that, up
+ * to CHUNK_SIZE << (N_CHUNK_CLASSES-1), so that parsing a consensus takes
+ * a few dozen mallocs rather than hundreds, while a microdescriptor still
+ * fits in one small chunk. */
+#define N_CHUNK_CLASSES 7
+/** How large are the chunks of class <b>cls</b>? */
+#define CHUNK_CLASS_SIZE(cls) (((size_t)CHUNK_SIZE) << (cls))
+
 /** A memarea_t is an allocation region for a set of small memory requests
  * that will all be freed at once. */
 struct memarea_t {
   memarea_chunk_t *first; /**< Top of the chunk stack: never NULL. */
+  /** True iff this area takes chunks from and returns them to the shared
+   * freelist.  Areas that might be used outside the main thread must not. */
+  int use_freelist;
+  /** Size class of the next regular chunk this area will allocate. */
+  int next_class;
 };
 
-/** How many chunks will we put into the freelist before freeing them? */
+/** How many chunks will we put into each freelist before freeing them? */
 #define MAX_FREELIST_LEN 4
-/** The number of memarea chunks currently in our freelist. */
-static int freelist_len=0;
-/** A linked list of unused memory area chunks.  Used to prevent us from
- * spinning in malloc/free loops. */
-static memarea_chunk_t *freelist = NULL;
+/** Don't keep more than this many bytes of chunks in one freelist, unless
+ * it holds only one chunk. */
+#define MAX_FREELIST_BYTES (64*1024)
+/** The number of memarea chunks currently in each size class's
+ * freelist. */
+static int freelist_len[N_CHUNK_CLASSES];
+/** For each size class, a linked list of unused memory area chunks.  Used to
+ * prevent us from spinning in malloc/free loops.  Since each class has its
+ * own list, the chunks kept around for small documents are never evicted by
+ * the large ones, and vice versa. */
+static memarea_chunk_t *freelist[N_CHUNK_CLASSES];
+
+/** Totals across all areas that use the freelists; see
+ * memarea_get_totals(). */
+static memarea_totals_t totals;
 
-/** Helper: allocate a new memarea chunk of around <b>chunk_size</b> bytes. */
+/** Return true iff we may keep another chunk of class <b>cls</b> in its
+ * freelist. */
+static INLINE int
+freelist_has_room(int cls)
+{
+  int len = freelist_len[cls];
+  return len < MAX_FREELIST_LEN &&
+    (len == 0 || (len+1) * CHUNK_CLASS_SIZE(cls) <= MAX_FREELIST_BYTES);
+}
+
+/** Helper: allocate a new memarea chunk of around <b>sz</b> bytes, to
+ * belong to size class <b>cls</b> (or to no class, if <b>cls</b> is -1).  If
+ * <b>freelist_ok</b>, we may take a chunk from the freelist instead, and we
+ * count the chunk in the totals. */
 static memarea_chunk_t *
-alloc_chunk(size_t sz, int freelist_ok)
+alloc_chunk(size_t sz, int cls, int freelist_ok)
 {
+  memarea_chunk_t *res;
   tor_assert(sz < SIZE_T_CEILING);
-  if (freelist && freelist_ok) {
-    memarea_chunk_t *res = freelist;
-    freelist = res->next_chunk;
+  if (cls >= 0 && freelist[cls] && freelist_ok) {
+    res = freelist[cls];
+    freelist[cls] = res->next_chunk;
     res->next_chunk = NULL;
-    --freelist_len;
+    --freelist_len[cls];
     CHECK_SENTINEL(res);
-    return res;
+    ++totals.n_chunk_reuses;
   } else {
-    size_t chunk_size = freelist_ok ? CHUNK_SIZE : sz;
-    memarea_chunk_t *res;
+    size_t chunk_size = sz;
     chunk_size += SENTINEL_LEN;
     res = tor_malloc_roundup(&chunk_size);
     res->next_chunk = NULL;
     res->mem_size = chunk_size - CHUNK_HEADER_SIZE - SENTINEL_LEN;
+    res->chunk_class = cls;
     res->next_mem = res->u.mem;
     tor_assert(res->next_mem+res->mem_size+SENTINEL_LEN ==
                ((char*)res)+chunk_size);
     tor_assert(realign_pointer(res->next_mem) == res->next_mem);
     SET_SENTINEL(res);
-    return res;
+    if (freelist_ok)
+      ++totals.n_chunk_allocs;
   }
+  if (freelist_ok)
+    totals.live_bytes += CHUNK_HEADER_SIZE + res->mem_size;
+  return res;
 }
 
 /** Release <b>chunk</b> from a memarea, either by adding it to the freelist
- * or by freeing it if the freelist is already too big. */
+ * or by freeing it if the freelist is already too big or we may not use it
+ * (<b>freelist_ok</b> is false). */
 static void
-chunk_free_unchecked(memarea_chunk_t *chunk)
+chunk_free_unchecked(memarea_chunk_t *chunk, int freelist_ok)
 {
+  int cls = chunk->chunk_class;
   CHECK_SENTINEL(chunk);
-  if (freelist_len < MAX_FREELIST_LEN) {
-    ++freelist_len;
-    chunk->next_chunk = freelist;
-    freelist = chunk;
+  if (freelist_ok)
+    totals.live_bytes -= CHUNK_HEADER_SIZE + chunk->mem_size;
+  if (freelist_ok && cls >= 0 && freelist_has_room(cls)) {
+    ++freelist_len[cls];
+    chunk->next_chunk = freelist[cls];
+    freelist[cls] = chunk;
     chunk->next_mem = chunk->u.mem;
   } else {
     tor_free(chunk);
   }
 }
 
+/** Helper: allocate and return a new memarea; <b>use_freelist</b> is as
+ * for memarea_t. */
+static memarea_t *
+memarea_new_impl(int use_freelist)
+{
+  memarea_t *head = tor_malloc(sizeof(memarea_t));
+  head->use_freelist = use_freelist;
+  head->next_class = 1;
+  head->first = alloc_chunk(CHUNK_SIZE, 0, use_freelist);
+  if (use_freelist)
+    ++totals.n_live_areas;
+  return head;
+}
+
 /** Allocate and return new memarea. */
 memarea_t *
 memarea_new(void)
 {
-  memarea_t *head = tor_malloc(sizeof(memarea_t));
-  head->first = alloc_chunk(CHUNK_SIZE, 1);
-  return head;
+  return memarea_new_impl(1);
+}
+
+/** Allocate and return a new memarea that never touches the shared chunk
+ * freelist, so that a thread other than the main thread may use it. */
+memarea_t *
+memarea_new_unshared(void)
+{
+  return memarea_new_impl(0);
 }
 
 /** Free <b>area</b>, invalidating all pointers returned from memarea_alloc()
@@ -163,8 +233,10 @@ memarea_drop_all(memarea_t *area)
   memarea_chunk_t *chunk, *next;
   for (chunk = area->first; chunk; chunk = next) {
     next = chunk->next_chunk;
-    chunk_free_unchecked(chunk);
+    chunk_free_unchecked(chunk, area->use_freelist);
   }
+  if (area->use_freelist)
+    --totals.n_live_areas;
   area->first = NULL; /*fail fast on */
   tor_free(area);
 }
@@ -179,7 +251,7 @@ memarea_clear(memarea_t *area)
   if (area->first->next_chunk) {
     for (chunk = area->first->next_chunk; chunk; chunk = next) {
       next = chunk->next_chunk;
-      chunk_free_unchecked(chunk);
+      chunk_free_unchecked(chunk, area->use_freelist);
     }
     area->first->next_chunk = NULL;
   }
@@ -191,12 +263,15 @@ void
 memarea_clear_freelist(void)
 {
   memarea_chunk_t *chunk, *next;
-  freelist_len = 0;
-  for (chunk = freelist; chunk; chunk = next) {
-    next = chunk->next_chunk;
-    tor_free(chunk);
+  int cls;
+  for (cls = 0; cls < N_CHUNK_CLASSES; ++cls) {
+    freelist_len[cls] = 0;
+    for (chunk = freelist[cls]; chunk; chunk = next) {
+      next = chunk->next_chunk;
+      tor_free(chunk);
+    }
+    freelist[cls] = NULL;
   }
-  freelist = NULL;
 }
 
 /** Return true iff <b>p</b> is in a range that has been returned by an
@@ -227,17 +302,22 @@ memarea_alloc(memarea_t *area, size_t sz)
   if (sz == 0)
     sz = 1;
   if (chunk->next_mem+sz > chunk->u.mem+chunk->mem_size) {
-    if (sz+CHUNK_HEADER_SIZE >= CHUNK_SIZE) {
+    int cls = area->next_class;
+    if (sz+CHUNK_HEADER_SIZE >= CHUNK_CLASS_SIZE(cls)) {
       /* This allocation is too big.  Stick it in a special chunk, and put
        * that chunk second in the list. */
-      memarea_chunk_t *new_chunk = alloc_chunk(sz+CHUNK_HEADER_SIZE, 0);
+      memarea_chunk_t *new_chunk = alloc_chunk(sz+CHUNK_HEADER_SIZE, -1,
+                                               area->use_freelist);
       new_chunk->next_chunk = chunk->next_chunk;
       chunk->next_chunk = new_chunk;
       chunk = new_chunk;
     } else {
-      memarea_chunk_t *new_chunk = alloc_chunk(CHUNK_SIZE, 1);
+      memarea_chunk_t *new_chunk = alloc_chunk(CHUNK_CLASS_SIZE(cls), cls,
+                                               area->use_freelist);
       new_chunk->next_chunk = chunk;
       area->first = chunk = new_chunk;
+      if (cls < N_CHUNK_CLASSES - 1)
+        area->next_class = cls + 1;
     }
     tor_assert(chunk->mem_size >= sz);
   }
@@ -282,12 +362,11 @@ memarea_strndup(memarea_t *area, const char *s, size_t n)
 {
   size_t ln;
   char *result;
-  const char *cp, *end = s+n;
+  const char *cp;
   tor_assert(n < SIZE_T_CEILING);
-  for (cp = s; cp < end && *cp; ++cp)
-    ;
-  /* cp now points to s+n, or to the 0 in the string. */
-  ln = cp-s;
+  cp = memchr(s, '\0', n);
+  /* The copy ends at s+n, or at the 0 in the string. */
+  ln = cp ? (size_t)(cp-s) : n;
   result = memarea_alloc(area, ln+1);
   memcpy(result, s, ln);
   result[ln]='\0';
@@ -311,6 +390,24 @@ memarea_get_stats(memarea_t *area, size_t *allocated_out, size_t *used_out)
   *used_out = u;
 }
 
+/** Set *<b>totals_out</b> to the totals for all areas that use the shared
+ * freelists (those from memarea_new()). */
+void
+memarea_get_totals(memarea_totals_t *totals_out)
+{
+  int cls;
+  memcpy(totals_out, &totals, sizeof(totals));
+  totals_out->freelist_chunks = 0;
+  totals_out->freelist_bytes = 0;
+  for (cls = 0; cls < N_CHUNK_CLASSES; ++cls) {
+    memarea_chunk_t *chunk;
+    for (chunk = freelist[cls]; chunk; chunk = chunk->next_chunk) {
+      ++totals_out->freelist_chunks;
+      totals_out->freelist_bytes += CHUNK_HEADER_SIZE + chunk->mem_size;
+    }
+  }
+}
+
 /** Assert that <b>area</b> is okay. */
 void
 memarea_assert_ok(memarea_t *area)
@@ -7,7 +7,24 @@
 
 typedef struct memarea_t memarea_t;
 
+/** Totals for all the areas that use the shared chunk freelists, as
+ * returned by memarea_get_totals(). */
+typedef struct memarea_totals_t {
+  /** Number of areas that have been created and not yet dropped. */
+  int n_live_areas;
+  /** Number of bytes in chunks that belong to live areas. */
+  size_t live_bytes;
+  /** Number of chunks we have had to get from malloc, ever. */
+  uint64_t n_chunk_allocs;
+  /** Number of chunks we have taken from a freelist instead, ever. */
+  uint64_t n_chunk_reuses;
+  /** Number of chunks, and of bytes in them, sitting in the freelists. */
+  int freelist_chunks;
+  size_t freelist_bytes;
+} memarea_totals_t;
+
 memarea_t *memarea_new(void);
+memarea_t *memarea_new_unshared(void);
 void memarea_drop_all(memarea_t *area);
 void memarea_clear(memarea_t *area);
 int memarea_owns_ptr(const memarea_t *area, const void *ptr);
@@ -18,6 +35,7 @@ char *memarea_strdup(memarea_t *area, const char *s);
 char *memarea_strndup(memarea_t *area, const char *s, size_t n);
 void memarea_get_stats(memarea_t *area,
                        size_t *allocated_out, size_t *used_out);
+void memarea_get_totals(memarea_totals_t *totals_out);
 void memarea_clear_freelist(void);
 void memarea_assert_ok(memarea_t *area);
 
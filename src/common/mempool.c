@@ -48,8 +48,18 @@
  *       - We keep a list of full chunks (so we can have a "nuke everything"
  *         function).  Obmalloc's pools leave full chunks to float unanchored.
  *
+ * THREADS:
+ *
+ *     A pool is not threadsafe unless you call mp_pool_enable_threads() on
+ *     it.  After that, every thread gets a small "magazine" of free items
+ *     for that pool, and mp_pool_get() and mp_pool_release() work out of the
+ *     magazine without locking.  Only when a magazine runs empty or full do
+ *     we lock the pool (the "depot") and move half a magazine's worth of
+ *     items in or out.  This is the scheme from Bonwick and Adams's
+ *     "Magazines and Vmem", minus the separate depot of full magazines.
+ *
  * LIMITATIONS:
- *   - Not even slightly threadsafe.
+ *   - Not threadsafe unless you ask.
  *   - Likes to have lots of items per chunks.
  *   - One pointer overhead per allocated thing.  (The alternative is
  *     something like glib's use of an RB-tree to keep track of what
@@ -97,6 +107,8 @@
 #define MAX_CHUNK (8*(1L<<20))
 /** Smallest memory chunk size that we should allocate. */
 #define MIN_CHUNK 4096
+/** How many free items can each thread hold for a threadsafe pool? */
+#define MAGAZINE_SIZE 64
 
 typedef struct mp_allocated_t mp_allocated_t;
 typedef struct mp_chunk_t mp_chunk_t;
@@ -139,6 +151,48 @@ struct mp_chunk_t {
   char mem[FLEXIBLE_ARRAY_MEMBER]; /**< Storage for this chunk. */
 };
 
+/** A thread's cache of free items for one threadsafe pool. */
+typedef struct mp_magazine_t {
+  /** Previous and next magazine for the same pool. */
+  struct mp_magazine_t *prev, *next;
+  int n_items; /**< How many items are in <b>items</b>? */
+  void *items[MAGAZINE_SIZE]; /**< Free items, ready to hand out. */
+} mp_magazine_t;
+
+/** The extra state that a pool needs once mp_pool_enable_threads() has been
+ * called on it. */
+struct mp_pool_threads_t {
+  /** Protects every field of the pool, and the list of magazines. */
+  tor_mutex_t *lock;
+  /** Holds each thread's mp_magazine_t for this pool. */
+  tor_threadlocal_t magazine;
+  /** Every thread's magazine, so we can free them with the pool. */
+  mp_magazine_t *magazines;
+  /** Next pool on the threadsafe_pools list. */
+  mp_pool_t *next_pool;
+};
+
+/** Lock held while we modify the list of threadsafe pools, or walk it from a
+ * thread other than the main thread. */
+static tor_mutex_t *threadsafe_pools_lock = NULL;
+/** Every pool that mp_pool_enable_threads() was called on. */
+static mp_pool_t *threadsafe_pools = NULL;
+
+/** Lock <b>pool</b> if it is threadsafe. */
+#define POOL_LOCK(pool) STMT_BEGIN                         \
+    if ((pool)->threads)                                   \
+      tor_mutex_acquire((pool)->threads->lock);            \
+  STMT_END
+/** Unlock <b>pool</b> if it is threadsafe. */
+#define POOL_UNLOCK(pool) STMT_BEGIN                       \
+    if ((pool)->threads)                                   \
+      tor_mutex_release((pool)->threads->lock);            \
+  STMT_END
+
+static void mp_pool_clean_unlocked(mp_pool_t *pool, int n_to_keep,
+                                   int keep_recently_used);
+static void mp_pool_assert_ok_unlocked(mp_pool_t *pool);
+
 /** Number of extra bytes needed beyond mem_size to allocate a chunk. */
 #define CHUNK_OVERHEAD STRUCT_OFFSET(mp_chunk_t, mem[0])
 
@@ -202,9 +256,10 @@ add_newly_used_chunk_to_used_list(mp_pool_t *pool, mp_chunk_t *chunk)
   ASSERT(!chunk->prev);
 }
 
-/** Return a newly allocated item from <b>pool</b>. */
-void *
-mp_pool_get(mp_pool_t *pool)
+/** Return a newly allocated item from <b>pool</b>, which must be locked if
+ * it is threadsafe. */
+static void *
+mp_pool_get_unlocked(mp_pool_t *pool)
 {
   mp_chunk_t *chunk;
   mp_allocated_t *allocated;
@@ -288,15 +343,14 @@ mp_pool_get(mp_pool_t *pool)
   return A2M(allocated);
 }
 
-/** Return an allocated memory item to its memory pool. */
-void
-mp_pool_release(void *item)
+/** Return an allocated memory item to its memory pool, which must be locked
+ * if it is threadsafe. */
+static void
+mp_pool_release_unlocked(void *item)
 {
   mp_allocated_t *allocated = (void*) M2A(item);
   mp_chunk_t *chunk = allocated->in_chunk;
 
-  ASSERT(chunk);
-  ASSERT(chunk->magic == MP_CHUNK_MAGIC);
   ASSERT(chunk->n_allocated > 0);
 
   allocated->u.next_free = chunk->first_free;
@@ -331,6 +385,18 @@ mp_pool_release(void *item)
     if (chunk == pool->used_chunks)
       pool->used_chunks = chunk->next;
 
+    if (pool->max_empty_chunks >= 0 &&
+        pool->n_empty_chunks >= pool->max_empty_chunks) {
+      /* We already have as many empty chunks as we want to keep; give this
+       * one back to the allocator. */
+      chunk->magic = 0xdeadbeef;
+      FREE(chunk);
+#ifdef MEMPOOL_STATS
+      ++pool->total_chunks_freed;
+#endif
+      return;
+    }
+
     /* Link to the empty list */
     chunk->next = pool->empty_chunks;
     chunk->prev = NULL;
@@ -348,6 +414,167 @@ mp_pool_release(void *item)
   --chunk->n_allocated;
 }
 
+/** Return the calling thread's magazine for the threadsafe pool
+ * <b>pool</b>, creating it if necessary. */
+static INLINE mp_magazine_t *
+mp_pool_get_magazine(mp_pool_t *pool)
+{
+  mp_magazine_t *mag = tor_threadlocal_get(&pool->threads->magazine);
+  if (PREDICT_UNLIKELY(!mag)) {
+    mag = ALLOC(sizeof(mp_magazine_t));
+    mag->n_items = 0;
+    mag->prev = NULL;
+    tor_mutex_acquire(pool->threads->lock);
+    mag->next = pool->threads->magazines;
+    if (mag->next)
+      mag->next->prev = mag;
+    pool->threads->magazines = mag;
+    tor_mutex_release(pool->threads->lock);
+    tor_threadlocal_set(&pool->threads->magazine, mag);
+  }
+  return mag;
+}
+
+/** Return a newly allocated item from <b>pool</b>. */
+void *
+mp_pool_get(mp_pool_t *pool)
+{
+  mp_magazine_t *mag;
+  if (PREDICT_LIKELY(!pool->threads))
+    return mp_pool_get_unlocked(pool);
+
+  mag = mp_pool_get_magazine(pool);
+  if (PREDICT_UNLIKELY(mag->n_items == 0)) {
+    /* Refill half the magazine from the depot, so that alternating gets and
+     * releases don't take the lock every time. */
+    tor_mutex_acquire(pool->threads->lock);
+    while (mag->n_items < MAGAZINE_SIZE/2)
+      mag->items[mag->n_items++] = mp_pool_get_unlocked(pool);
+    tor_mutex_release(pool->threads->lock);
+  }
+  return mag->items[--mag->n_items];
+}
+
+/** Return an allocated memory item to its memory pool. */
+void
+mp_pool_release(void *item)
+{
+  mp_allocated_t *allocated = (void*) M2A(item);
+  mp_chunk_t *chunk = allocated->in_chunk;
+  mp_pool_t *pool;
+  mp_magazine_t *mag;
+
+  ASSERT(chunk);
+  ASSERT(chunk->magic == MP_CHUNK_MAGIC);
+  pool = chunk->pool;
+  if (PREDICT_LIKELY(!pool->threads)) {
+    mp_pool_release_unlocked(item);
+    return;
+  }
+
+  mag = mp_pool_get_magazine(pool);
+  if (PREDICT_UNLIKELY(mag->n_items == MAGAZINE_SIZE)) {
+    /* Give the older half of the magazine back to the depot. */
+    int i;
+    tor_mutex_acquire(pool->threads->lock);
+    for (i = 0; i < MAGAZINE_SIZE/2; ++i)
+      mp_pool_release_unlocked(mag->items[i]);
+    tor_mutex_release(pool->threads->lock);
+    memmove(mag->items, mag->items + MAGAZINE_SIZE/2,
+            sizeof(void*) * (MAGAZINE_SIZE - MAGAZINE_SIZE/2));
+    mag->n_items = MAGAZINE_SIZE - MAGAZINE_SIZE/2;
+  }
+  mag->items[mag->n_items++] = item;
+}
+
+/** Make <b>pool</b> safe to use from more than one thread at once, by
+ * giving each thread a magazine of free items for it.  Call this from the
+ * main thread, before any other thread uses the pool.  Return 0 on success,
+ * -1 on failure (in which case the pool stays single-threaded). */
+int
+mp_pool_enable_threads(mp_pool_t *pool)
+{
+  mp_pool_threads_t *threads;
+  if (pool->threads)
+    return 0;
+  threads = ALLOC(sizeof(mp_pool_threads_t));
+  memset(threads, 0, sizeof(mp_pool_threads_t));
+  if (tor_threadlocal_init(&threads->magazine) < 0) {
+    FREE(threads);
+    return -1;
+  }
+  threads->lock = tor_mutex_new();
+  if (!threadsafe_pools_lock)
+    threadsafe_pools_lock = tor_mutex_new();
+  tor_mutex_acquire(threadsafe_pools_lock);
+  threads->next_pool = threadsafe_pools;
+  threadsafe_pools = pool;
+  tor_mutex_release(threadsafe_pools_lock);
+  pool->threads = threads;
+  return 0;
+}
+
+/** Give the items in the calling thread's magazine for every threadsafe
+ * pool back to their pools, and free the magazines.  Threads other than the
+ * main thread should call this before they exit. */
+void
+mp_pool_thread_cleanup(void)
+{
+  mp_pool_t *pool;
+  if (!threadsafe_pools_lock)
+    return;
+  tor_mutex_acquire(threadsafe_pools_lock);
+  for (pool = threadsafe_pools; pool; pool = pool->threads->next_pool) {
+    mp_magazine_t *mag = tor_threadlocal_get(&pool->threads->magazine);
+    int i;
+    if (!mag)
+      continue;
+    tor_threadlocal_set(&pool->threads->magazine, NULL);
+    tor_mutex_acquire(pool->threads->lock);
+    for (i = 0; i < mag->n_items; ++i)
+      mp_pool_release_unlocked(mag->items[i]);
+    if (mag->prev)
+      mag->prev->next = mag->next;
+    else
+      pool->threads->magazines = mag->next;
+    if (mag->next)
+      mag->next->prev = mag->prev;
+    tor_mutex_release(pool->threads->lock);
+    FREE(mag);
+  }
+  tor_mutex_release(threadsafe_pools_lock);
+}
+
+/** Helper: release the thread state of the threadsafe pool <b>pool</b>,
+ * which is about to be destroyed.  Items in any thread's magazine are
+ * simply forgotten, since their chunks are going away too. */
+static void
+mp_pool_free_threads(mp_pool_t *pool)
+{
+  mp_pool_threads_t *threads = pool->threads;
+  mp_magazine_t *mag, *next;
+  mp_pool_t **pp;
+
+  tor_mutex_acquire(threadsafe_pools_lock);
+  for (pp = &threadsafe_pools; *pp; pp = &(*pp)->threads->next_pool) {
+    if (*pp == pool) {
+      *pp = threads->next_pool;
+      break;
+    }
+  }
+  tor_mutex_release(threadsafe_pools_lock);
+
+  for (mag = threads->magazines; mag; mag = next) {
+    next = mag->next;
+    FREE(mag);
+  }
+  tor_threadlocal_set(&threads->magazine, NULL);
+  tor_threadlocal_destroy(&threads->magazine);
+  tor_mutex_free(threads->lock);
+  FREE(threads);
+  pool->threads = NULL;
+}
+
 /** Allocate a new memory pool to hold items of size <b>item_size</b>. We'll
  * try to fit about <b>chunk_capacity</b> bytes in each chunk. */
 mp_pool_t *
@@ -398,6 +625,7 @@ mp_pool_new(size_t item_size, size_t chunk_capacity)
   pool->new_chunk_capacity = (int)new_chunk_cap;
 
   pool->item_alloc_size = alloc_size;
+  pool->max_empty_chunks = -1;
 
   log_debug(LD_MM, "Capacity is %lu, item size is %lu, alloc size is %lu",
             (unsigned long)pool->new_chunk_capacity,
@@ -448,7 +676,7 @@ mp_pool_sort_used_chunks(mp_pool_t *pool)
   }
   chunks[n-1]->next = NULL;
   FREE(chunks);
-  mp_pool_assert_ok(pool);
+  mp_pool_assert_ok_unlocked(pool);
 }
 
 /** If there are more than <b>n</b> empty chunks in <b>pool</b>, free the
@@ -458,6 +686,17 @@ mp_pool_sort_used_chunks(mp_pool_t *pool)
  **/
 void
 mp_pool_clean(mp_pool_t *pool, int n_to_keep, int keep_recently_used)
+{
+  POOL_LOCK(pool);
+  mp_pool_clean_unlocked(pool, n_to_keep, keep_recently_used);
+  POOL_UNLOCK(pool);
+}
+
+/** As mp_pool_clean(), but <b>pool</b> must already be locked if it is
+ * threadsafe. */
+static void
+mp_pool_clean_unlocked(mp_pool_t *pool, int n_to_keep,
+                       int keep_recently_used)
 {
   mp_chunk_t *chunk, **first_to_free;
 
@@ -498,6 +737,53 @@ mp_pool_clean(mp_pool_t *pool, int n_to_keep, int keep_recently_used)
   *first_to_free = NULL;
 }
 
+/** Never keep more than <b>max_empty</b> empty chunks in <b>pool</b>: once
+ * we have that many, free chunks as soon as they become empty.  If
+ * <b>max_empty</b> is negative, keep empty chunks until mp_pool_clean() is
+ * called. */
+void
+mp_pool_set_max_empty_chunks(mp_pool_t *pool, int max_empty)
+{
+  POOL_LOCK(pool);
+  pool->max_empty_chunks = max_empty;
+  if (max_empty >= 0 && pool->n_empty_chunks > max_empty)
+    mp_pool_clean_unlocked(pool, max_empty, 0);
+  POOL_UNLOCK(pool);
+}
+
+/** Helper: add the sizes of every chunk in the list starting with
+ * <b>chunk</b> to *<b>stats</b>, and return the number of chunks. */
+static int
+mp_pool_add_chunk_stats(const mp_pool_t *pool, const mp_chunk_t *chunk,
+                        mp_pool_stats_t *stats)
+{
+  int n = 0;
+  for ( ; chunk; chunk = chunk->next) {
+    ++n;
+    stats->n_items_used += chunk->n_allocated;
+    stats->bytes_used += chunk->n_allocated * pool->item_alloc_size;
+    stats->bytes_allocated += chunk->mem_size;
+  }
+  return n;
+}
+
+/** Set *<b>stats_out</b> to a summary of the memory held by <b>pool</b>. */
+void
+mp_pool_get_stats(const mp_pool_t *pool, mp_pool_stats_t *stats_out)
+{
+  ASSERT(pool);
+  memset(stats_out, 0, sizeof(mp_pool_stats_t));
+  POOL_LOCK(pool);
+  stats_out->item_alloc_size = pool->item_alloc_size;
+  stats_out->n_empty_chunks =
+    mp_pool_add_chunk_stats(pool, pool->empty_chunks, stats_out);
+  stats_out->n_used_chunks =
+    mp_pool_add_chunk_stats(pool, pool->used_chunks, stats_out);
+  stats_out->n_full_chunks =
+    mp_pool_add_chunk_stats(pool, pool->full_chunks, stats_out);
+  POOL_UNLOCK(pool);
+}
+
 /** Helper: Given a list of chunks, free all the chunks in the list. */
 static void
 destroy_chunks(mp_chunk_t *chunk)
@@ -516,6 +802,8 @@ destroy_chunks(mp_chunk_t *chunk)
 void
 mp_pool_destroy(mp_pool_t *pool)
 {
+  if (pool->threads)
+    mp_pool_free_threads(pool);
   destroy_chunks(pool->empty_chunks);
   destroy_chunks(pool->used_chunks);
   destroy_chunks(pool->full_chunks);
@@ -563,9 +851,10 @@ assert_chunks_ok(mp_pool_t *pool, mp_chunk_t *chunk, int empty, int full)
   return n;
 }
 
-/** Fail with an assertion if <b>pool</b> is not internally consistent. */
-void
-mp_pool_assert_ok(mp_pool_t *pool)
+/** As mp_pool_assert_ok(), but <b>pool</b> must already be locked if it is
+ * threadsafe. */
+static void
+mp_pool_assert_ok_unlocked(mp_pool_t *pool)
 {
   int n_empty;
 
@@ -576,6 +865,15 @@ mp_pool_assert_ok(mp_pool_t *pool)
   ASSERT(pool->n_empty_chunks == n_empty);
 }
 
+/** Fail with an assertion if <b>pool</b> is not internally consistent. */
+void
+mp_pool_assert_ok(mp_pool_t *pool)
+{
+  POOL_LOCK(pool);
+  mp_pool_assert_ok_unlocked(pool);
+  POOL_UNLOCK(pool);
+}
+
 #ifdef TOR
 /** Dump information about <b>pool</b>'s memory usage to the Tor log at level
  * <b>severity</b>. */
@@ -590,6 +888,7 @@ mp_pool_log_status(mp_pool_t *pool, int severity)
   int n_full = 0, n_used = 0;
 
   ASSERT(pool);
+  POOL_LOCK(pool);
 
   for (chunk = pool->empty_chunks; chunk; chunk = chunk->next) {
     bytes_allocated += chunk->mem_size;
@@ -632,6 +931,7 @@ mp_pool_log_status(mp_pool_t *pool, int severity)
          U64_PRINTF_ARG(pool->total_chunks_allocated),
          U64_PRINTF_ARG(pool->total_chunks_freed));
 #endif
+  POOL_UNLOCK(pool);
 }
 #endif
 
@@ -13,14 +13,38 @@
 * objects can be allocated efficiently.  See mempool.c for implementation
 * details. */
 typedef struct mp_pool_t mp_pool_t;
+/** Extra state for a pool that can be used from more than one thread. */
+typedef struct mp_pool_threads_t mp_pool_threads_t;
+
+/** A summary of the memory held by a memory pool, as returned by
+ * mp_pool_get_stats(). */
+typedef struct mp_pool_stats_t {
+  /** Number of bytes we allocate for each item, including overhead. */
+  size_t item_alloc_size;
+  /** Number of chunks with no, some, and no more room for items. */
+  int n_empty_chunks, n_used_chunks, n_full_chunks;
+  /** Number of items currently handed out by the pool. */
+  uint64_t n_items_used;
+  /** Total number of bytes in the pool's chunks. */
+  uint64_t bytes_allocated;
+  /** Number of bytes in items that are currently handed out. */
+  uint64_t bytes_used;
+} mp_pool_stats_t;
+
+/** Number of bytes of bookkeeping overhead that a pool adds to each item. */
+#define MP_POOL_ITEM_OVERHEAD (sizeof(void*))
 
 void *mp_pool_get(mp_pool_t *pool);
 void mp_pool_release(void *item);
 mp_pool_t *mp_pool_new(size_t item_size, size_t chunk_capacity);
 void mp_pool_clean(mp_pool_t *pool, int n_to_keep, int keep_recently_used);
+void mp_pool_set_max_empty_chunks(mp_pool_t *pool, int max_empty);
+void mp_pool_get_stats(const mp_pool_t *pool, mp_pool_stats_t *stats_out);
 void mp_pool_destroy(mp_pool_t *pool);
 void mp_pool_assert_ok(mp_pool_t *pool);
 void mp_pool_log_status(mp_pool_t *pool, int severity);
+int mp_pool_enable_threads(mp_pool_t *pool);
+void mp_pool_thread_cleanup(void);
 
 #define MEMPOOL_STATS
 
@@ -43,6 +67,9 @@ struct mp_pool_t {
   /** Lowest value of <b>empty_chunks</b> since last call to
    * mp_pool_clean(-1). */
   int min_empty_chunks;
+  /** If nonnegative, never keep more than this many empty chunks: free any
+   * chunk that becomes empty beyond this limit right away. */
+  int max_empty_chunks;
   /** Size of each chunk (in items). */
   int new_chunk_capacity;
   /** Size to allocate for each item, including overhead and alignment
@@ -56,6 +83,9 @@ struct mp_pool_t {
   /** Total number of chunks freed ever. */
   uint64_t total_chunks_freed;
 #endif
+  /** If this pool is threadsafe, the lock and per-thread magazines that make
+   * it so; otherwise NULL. */
+  mp_pool_threads_t *threads;
 };
 #endif
 
@@ -46,6 +46,10 @@
 
 #include <zlib.h>
 
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+
 /** Set to 1 if zlib is a version that supports gzip; set to 0 if it doesn't;
  * set to -1 if we haven't checked yet. */
 static int gzip_is_supported = -1;
@@ -68,6 +72,67 @@ is_gzip_supported(void)
   return gzip_is_supported;
 }
 
+/** Return true iff we can compress and uncompress with <b>method</b>. */
+int
+tor_compress_supports_method(compress_method_t method)
+{
+  switch (method) {
+    case GZIP_METHOD:
+      return is_gzip_supported();
+    case ZLIB_METHOD:
+      return 1;
+    case LZMA_METHOD:
+#ifdef HAVE_LZMA
+      return 1;
+#else
+      return 0;
+#endif
+    default:
+      return 0;
+  }
+}
+
+/** Table of HTTP Content-Encoding names for our compression methods.  The
+ * first name listed for each method is the one we send. */
+static const struct {
+  const char *name;
+  compress_method_t method;
+} compression_method_names[] = {
+  { "identity", NO_METHOD },
+  { "deflate", ZLIB_METHOD },
+  { "x-deflate", ZLIB_METHOD },
+  { "gzip", GZIP_METHOD },
+  { "x-gzip", GZIP_METHOD },
+  { "x-tor-lzma", LZMA_METHOD },
+  { NULL, UNKNOWN_METHOD },
+};
+
+/** Return the Content-Encoding name for <b>method</b>, or NULL if it has
+ * none. */
+const char *
+compression_method_get_name(compress_method_t method)
+{
+  int i;
+  for (i = 0; compression_method_names[i].name; ++i) {
+    if (compression_method_names[i].method == method)
+      return compression_method_names[i].name;
+  }
+  return NULL;
+}
+
+/** Return the compression method whose Content-Encoding name is
+ * <b>name</b>, or UNKNOWN_METHOD if we don't recognize it. */
+compress_method_t
+compression_method_get_by_name(const char *name)
+{
+  int i;
+  for (i = 0; compression_method_names[i].name; ++i) {
+    if (!strcmp(compression_method_names[i].name, name))
+      return compression_method_names[i].method;
+  }
+  return UNKNOWN_METHOD;
+}
+
 /** Return the 'bits' value to tell zlib to use <b>method</b>.*/
 static INLINE int
 method_bits(compress_method_t method)
@@ -76,6 +141,37 @@ method_bits(compress_method_t method)
   return method == GZIP_METHOD ? 15+16 : 15;
 }
 
+/** Return the 'bits' value to tell zlib to compress with <b>method</b>,
+ * using a window suited to <b>level</b>. */
+static INLINE int
+method_bits_for_level(compress_method_t method,
+                      zlib_compression_level_t level)
+{
+  switch (level) {
+    case MEDIUM_COMPRESSION: return method_bits(method) - 2;
+    case LOW_COMPRESSION: return method_bits(method) - 4;
+    case HIGH_COMPRESSION:
+    default:
+      return method_bits(method);
+  }
+}
+
+/** Return the zlib memLevel to compress with at <b>level</b>.  A deflate
+ * stream needs about (1 \<\< (bits+2)) + (1 \<\< (memlevel+9)) bytes: 256KB
+ * at HIGH_COMPRESSION, 96KB at MEDIUM_COMPRESSION, and 40KB at
+ * LOW_COMPRESSION. */
+static INLINE int
+get_memlevel(zlib_compression_level_t level)
+{
+  switch (level) {
+    case MEDIUM_COMPRESSION: return 7;
+    case LOW_COMPRESSION: return 6;
+    case HIGH_COMPRESSION:
+    default:
+      return 8;
+  }
+}
+
 /** @{ */
 /* These macros define the maximum allowable compression factor.  Anything of
  * size greater than CHECK_FOR_COMPRESSION_BOMB_AFTER is not allowed to
@@ -105,6 +201,122 @@ is_compression_bomb(size_t size_in, size_t size_out)
   return (size_out / size_in > MAX_UNCOMPRESSION_FACTOR);
 }
 
+#ifdef HAVE_LZMA
+/** LZMA preset for compressing a whole document at once.  Such documents
+ * are usually compressed once and served many times, so we can afford to
+ * work hard. */
+#define TOR_LZMA_PRESET 6
+/** LZMA preset for incremental compression, where every stream has its own
+ * encoder: keep the memory cost down. */
+#define TOR_LZMA_STREAM_PRESET 1
+/** Most memory we let an LZMA decoder use. */
+#define TOR_LZMA_MEMLIMIT (16<<20)
+
+/** Set up <b>stream</b> to compress (if <b>compress</b>) with
+ * <b>preset</b>, or to uncompress.  Return 0 on success, -1 on failure. */
+static int
+tor_lzma_init(lzma_stream *stream, int compress, uint32_t preset)
+{
+  lzma_ret r;
+  if (compress)
+    r = lzma_easy_encoder(stream, preset, LZMA_CHECK_CRC32);
+  else
+    r = lzma_stream_decoder(stream, TOR_LZMA_MEMLIMIT, LZMA_CONCATENATED);
+  if (r != LZMA_OK) {
+    log_warn(LD_GENERAL, "Error %d setting up LZMA %s.", (int)r,
+             compress ? "encoder" : "decoder");
+    return -1;
+  }
+  return 0;
+}
+
+/** As tor_gzip_compress (if <b>compress</b>) or tor_gzip_uncompress, but
+ * using LZMA. */
+static int
+tor_lzma_process_all(char **out, size_t *out_len,
+                     const char *in, size_t in_len,
+                     int compress, int complete_only,
+                     int protocol_warn_level)
+{
+  lzma_stream stream = LZMA_STREAM_INIT;
+  size_t out_size, old_size, offset;
+  lzma_ret r;
+
+  *out = NULL;
+  if (tor_lzma_init(&stream, compress, TOR_LZMA_PRESET) < 0)
+    return -1;
+
+  /* Guess 50% compression. */
+  out_size = compress ? in_len / 2 : in_len * 2;
+  if (out_size < 1024) out_size = 1024;
+  if (out_size >= SIZE_T_CEILING)
+    goto err;
+  *out = tor_malloc(out_size);
+  stream.next_in = (const uint8_t*) in;
+  stream.avail_in = in_len;
+  stream.next_out = (uint8_t*) *out;
+  stream.avail_out = out_size;
+
+  while (1) {
+    r = lzma_code(&stream, LZMA_FINISH);
+    if (r == LZMA_STREAM_END)
+      break;
+    if (r != LZMA_OK && r != LZMA_BUF_ERROR) {
+      log_fn(compress ? LOG_WARN : protocol_warn_level, LD_GENERAL,
+             "LZMA %s returned an error: %d",
+             compress ? "compression" : "decompression", (int)r);
+      goto err;
+    }
+    if (stream.avail_out > 0) {
+      /* We ran out of input before the end of the stream. */
+      if (!compress && !complete_only && stream.avail_in == 0)
+        break;
+      log_fn(protocol_warn_level, LD_PROTOCOL,
+             "possible truncated or corrupt LZMA data");
+      goto err;
+    }
+    offset = stream.next_out - (uint8_t*)*out;
+    old_size = out_size;
+    out_size *= 2;
+    if (out_size < old_size || out_size >= SIZE_T_CEILING) {
+      log_warn(LD_GENERAL, "Size overflow in LZMA %s.",
+               compress ? "compression" : "decompression");
+      goto err;
+    }
+    if (!compress && is_compression_bomb(in_len, out_size)) {
+      log_warn(LD_GENERAL, "Input looks like a possible LZMA bomb; "
+               "not proceeding.");
+      goto err;
+    }
+    *out = tor_realloc(*out, out_size);
+    stream.next_out = (uint8_t*)(*out + offset);
+    stream.avail_out = out_size - offset;
+  }
+
+  *out_len = stream.next_out - (uint8_t*)*out;
+  lzma_end(&stream);
+  if (compress) {
+    if (is_compression_bomb(*out_len, in_len)) {
+      log_warn(LD_BUG, "We compressed something and got an insanely high "
+               "compression factor; other Tors would think this was an "
+               "LZMA bomb.");
+      tor_free(*out);
+      return -1;
+    }
+  } else {
+    /* NUL-terminate output. */
+    if (out_size == *out_len)
+      *out = tor_realloc(*out, out_size + 1);
+    (*out)[*out_len] = '\0';
+  }
+  return 0;
+ err:
+  lzma_end(&stream);
+  tor_free(*out);
+  return -1;
+}
+#endif
+
 /** Given <b>in_len</b> bytes at <b>in</b>, compress them into a newly
  * allocated buffer, using the method described in <b>method</b>.  Store the
  * compressed string in *<b>out</b>, and its length in *<b>out_len</b>.
@@ -126,6 +338,15 @@ tor_gzip_compress(char **out, size_t *out_len,
 
   *out = NULL;
 
+  if (method == LZMA_METHOD) {
+#ifdef HAVE_LZMA
+    return tor_lzma_process_all(out, out_len, in, in_len, 1, 1, LOG_WARN);
+#else
+    log_warn(LD_BUG, "LZMA not supported in this build");
+    return -1;
+#endif
+  }
+
   if (method == GZIP_METHOD && !is_gzip_supported()) {
     /* Old zlib version don't support gzip in deflateInit2 */
     log_warn(LD_BUG, "Gzip not supported with zlib %s", ZLIB_VERSION);
@@ -251,6 +472,16 @@ tor_gzip_uncompress(char **out, size_t *out_len,
   tor_assert(in);
   tor_assert(in_len < UINT_MAX);
 
+  if (method == LZMA_METHOD) {
+#ifdef HAVE_LZMA
+    return tor_lzma_process_all(out, out_len, in, in_len, 0, complete_only,
+                                protocol_warn_level);
+#else
+    log_warn(LD_BUG, "LZMA not supported in this build");
+    return -1;
+#endif
+  }
+
   if (method == GZIP_METHOD && !is_gzip_supported()) {
     /* Old zlib version don't support gzip in inflateInit2 */
     log_warn(LD_BUG, "Gzip not supported with zlib %s", ZLIB_VERSION);
@@ -375,7 +606,9 @@ tor_gzip_uncompress(char **out, size_t *out_len,
 compress_method_t
 detect_compression_method(const char *in, size_t in_len)
 {
-  if (in_len > 2 && fast_memeq(in, "\x1f\x8b", 2)) {
+  if (in_len > 6 && fast_memeq(in, "\xfd" "7zXZ\x00", 6)) {
+    return LZMA_METHOD;
+  } else if (in_len > 2 && fast_memeq(in, "\x1f\x8b", 2)) {
     return GZIP_METHOD;
   } else if (in_len > 2 && (in[0] & 0x0f) == 8 &&
              (ntohs(get_uint16(in)) % 31) == 0) {
@@ -389,6 +622,10 @@ detect_compression_method(const char *in, size_t in_len)
  * body of this struct is not exposed. */
 struct tor_zlib_state_t {
   struct z_stream_s stream; /**< The zlib stream */
+#ifdef HAVE_LZMA
+  lzma_stream lzma; /**< The LZMA stream, if method is LZMA_METHOD. */
+#endif
+  compress_method_t method; /**< How are we compressing? */
   int compress; /**< True if we are compressing; false if we are inflating */
 
   /** Number of bytes read so far.  Used to detect zlib bombs. */
@@ -398,13 +635,31 @@ struct tor_zlib_state_t {
 };
 
 /** Construct and return a tor_zlib_state_t object using <b>method</b>.  If
- * <b>compress</b>, it's for compression; otherwise it's for
- * decompression. */
+ * <b>compress</b>, it's for compression, trading memory for compression
+ * ratio as <b>level</b> says; otherwise it's for decompression, and
+ * <b>level</b> is ignored. */
 tor_zlib_state_t *
-tor_zlib_new(int compress, compress_method_t method)
+tor_zlib_new(int compress, compress_method_t method,
+             zlib_compression_level_t level)
 {
   tor_zlib_state_t *out;
 
+  if (method == LZMA_METHOD) {
+#ifdef HAVE_LZMA
+    lzma_stream init = LZMA_STREAM_INIT;
+    out = tor_malloc_zero(sizeof(tor_zlib_state_t));
+    out->method = method;
+    out->compress = compress;
+    out->lzma = init;
+    if (tor_lzma_init(&out->lzma, compress, TOR_LZMA_STREAM_PRESET) < 0)
+      tor_free(out);
+    return out;
+#else
+    log_warn(LD_BUG, "LZMA not supported in this build");
+    return NULL;
+#endif
+  }
+
   if (method == GZIP_METHOD && !is_gzip_supported()) {
     /* Old zlib version don't support gzip in inflateInit2 */
     log_warn(LD_BUG, "Gzip not supported with zlib %s", ZLIB_VERSION);
@@ -415,10 +670,12 @@ tor_zlib_new(int compress, compress_method_t method)
  out->stream.zalloc = Z_NULL;
  out->stream.zfree = Z_NULL;
  out->stream.opaque = NULL;
+ out->method = method;
  out->compress = compress;
  if (compress) {
    if (deflateInit2(&out->stream, Z_BEST_COMPRESSION, Z_DEFLATED,
-                    method_bits(method), 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                    method_bits_for_level(method, level),
+                    get_memlevel(level), Z_DEFAULT_STRATEGY) != Z_OK)
      goto err;
  } else {
    if (inflateInit2(&out->stream, method_bits(method)) != Z_OK)
@@ -431,6 +688,62 @@ tor_zlib_new(int compress, compress_method_t method)
  return NULL;
 }
 
+#ifdef HAVE_LZMA
+/** As tor_zlib_process, for a <b>state</b> using LZMA_METHOD. */
+static tor_zlib_output_t
+tor_lzma_process(tor_zlib_state_t *state,
+                 char **out, size_t *out_len,
+                 const char **in, size_t *in_len,
+                 int finish)
+{
+  lzma_ret r;
+  lzma_action action;
+  if (finish)
+    action = LZMA_FINISH;
+  else
+    action = state->compress ? LZMA_SYNC_FLUSH : LZMA_RUN;
+  state->lzma.next_in = (const uint8_t*) *in;
+  state->lzma.avail_in = *in_len;
+  state->lzma.next_out = (uint8_t*) *out;
+  state->lzma.avail_out = *out_len;
+
+  r = lzma_code(&state->lzma, action);
+
+  state->input_so_far += state->lzma.next_in - ((const uint8_t*)*in);
+  state->output_so_far += state->lzma.next_out - ((uint8_t*)*out);
+
+  *out = (char*) state->lzma.next_out;
+  *out_len = state->lzma.avail_out;
+  *in = (const char *) state->lzma.next_in;
+  *in_len = state->lzma.avail_in;
+
+  if (! state->compress &&
+      is_compression_bomb(state->input_so_far, state->output_so_far)) {
+    log_warn(LD_DIR, "Possible LZMA bomb; abandoning stream.");
+    return TOR_ZLIB_ERR;
+  }
+
+  switch (r)
+    {
+    case LZMA_STREAM_END:
+      /* A finished sync flush also ends with LZMA_STREAM_END. */
+      return (action == LZMA_SYNC_FLUSH) ? TOR_ZLIB_OK : TOR_ZLIB_DONE;
+    case LZMA_BUF_ERROR:
+      if (state->lzma.avail_in == 0 && state->lzma.avail_out > 0)
+        return TOR_ZLIB_OK;
+      return TOR_ZLIB_BUF_FULL;
+    case LZMA_OK:
+      /* Once we start flushing, we have to keep going until it's done. */
+      if (state->lzma.avail_out == 0 || action != LZMA_RUN)
+        return TOR_ZLIB_BUF_FULL;
+      return TOR_ZLIB_OK;
+    default:
+      log_warn(LD_GENERAL, "LZMA returned an error: %d", (int)r);
+      return TOR_ZLIB_ERR;
+    }
+}
+#endif
+
 /** Compress/decompress some bytes using <b>state</b>.  Read up to
  * *<b>in_len</b> bytes from *<b>in</b>, and write up to *<b>out_len</b> bytes
  * to *<b>out</b>, adjusting the values as we go.  If <b>finish</b> is true,
@@ -448,6 +761,10 @@ tor_zlib_process(tor_zlib_state_t *state,
                  int finish)
 {
   int err;
+#ifdef HAVE_LZMA
+  if (state->method == LZMA_METHOD)
+    return tor_lzma_process(state, out, out_len, in, in_len, finish);
+#endif
   tor_assert(*in_len <= UINT_MAX);
   tor_assert(*out_len <= UINT_MAX);
   state->stream.next_in = (unsigned char*) *in;
@@ -501,6 +818,13 @@ tor_zlib_free(tor_zlib_state_t *state)
   if (!state)
     return;
 
+#ifdef HAVE_LZMA
+  if (state->method == LZMA_METHOD) {
+    lzma_end(&state->lzma);
+    tor_free(state);
+    return;
+  }
+#endif
   if (state->compress)
     deflateEnd(&state->stream);
   else
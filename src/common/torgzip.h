@@ -14,9 +14,10 @@
 /** Enumeration of what kind of compression to use.  Only ZLIB_METHOD is
  * guaranteed to be supported by the compress/uncompress functions here;
  * GZIP_METHOD may be supported if we built against zlib version 1.2 or later
- * and is_gzip_supported() returns true. */
+ * and is_gzip_supported() returns true; LZMA_METHOD is supported if we built
+ * with liblzma.  Use tor_compress_supports_method() to check. */
 typedef enum {
-  NO_METHOD=0, GZIP_METHOD=1, ZLIB_METHOD=2, UNKNOWN_METHOD=3
+  NO_METHOD=0, GZIP_METHOD=1, ZLIB_METHOD=2, UNKNOWN_METHOD=3, LZMA_METHOD=4
 } compress_method_t;
 
 int
@@ -31,6 +32,9 @@ tor_gzip_uncompress(char **out, size_t *out_len,
                     int protocol_warn_level);
 
 int is_gzip_supported(void);
+int tor_compress_supports_method(compress_method_t method);
+const char *compression_method_get_name(compress_method_t method);
+compress_method_t compression_method_get_by_name(const char *name);
 
 compress_method_t detect_compression_method(const char *in, size_t in_len);
 
@@ -39,9 +43,16 @@ compress_method_t detect_compression_method(const char *in, size_t in_len);
 typedef enum {
   TOR_ZLIB_OK, TOR_ZLIB_DONE, TOR_ZLIB_BUF_FULL, TOR_ZLIB_ERR
 } tor_zlib_output_t;
+/** Enumeration to define tradeoffs for compression: how much memory a
+ * zlib compressor may use, and so how well it compresses. */
+typedef enum {
+  HIGH_COMPRESSION, MEDIUM_COMPRESSION, LOW_COMPRESSION
+} zlib_compression_level_t;
+
 /** Internal state for an incremental zlib compression/decompression. */
 typedef struct tor_zlib_state_t tor_zlib_state_t;
-tor_zlib_state_t *tor_zlib_new(int compress, compress_method_t method);
+tor_zlib_state_t *tor_zlib_new(int compress, compress_method_t method,
+                               zlib_compression_level_t level);
 
 tor_zlib_output_t tor_zlib_process(tor_zlib_state_t *state,
                                    char **out, size_t *out_len,
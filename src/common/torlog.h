@@ -136,6 +136,8 @@ int add_syslog_log(const log_severity_list_t *severity);
 #endif
 int add_callback_log(const log_severity_list_t *severity, log_callback cb);
 void logs_set_domain_logging(int enabled);
+int logs_set_async(int enabled);
+uint64_t logs_get_n_async_dropped(void);
 int get_min_log_level(void);
 void switch_logs_debug(void);
 void logs_free_all(void);
@@ -153,9 +155,19 @@ void tor_log(int severity, log_domain_mask_t domain, const char *format, ...)
   CHECK_PRINTF(3,4);
 #define log tor_log /* hack it so we don't conflict with log() as much */
 
-#ifdef __GNUC__
+/** The most verbose severity that any log is currently accepting. */
 extern int _log_global_min_severity;
+/** For each severity, the union of the domains that any log is currently
+ * accepting at that severity, indexed by severity minus LOG_ERR. */
+extern log_domain_mask_t _log_global_domain_masks[LOG_DEBUG-LOG_ERR+1];
+
+/** Return true iff any log might want a message at <b>severity</b> in
+ * <b>domain</b>.  Use this to skip building arguments that exist only to
+ * be logged. */
+#define log_global_domain_enabled(severity, domain)                     \
+  (_log_global_domain_masks[(severity)-LOG_ERR] & (domain))
 
+#ifdef __GNUC__
 void _log_fn(int severity, log_domain_mask_t domain,
              const char *funcname, const char *format, ...)
   CHECK_PRINTF(4,5);
@@ -163,13 +175,18 @@ void _log_fn(int severity, log_domain_mask_t domain,
  * of the current function name. */
 #define log_fn(severity, domain, args...)               \
   _log_fn(severity, domain, __PRETTY_FUNCTION__, args)
+/* For debug and info messages, check the domain here, so that a disabled
+ * message costs one test and never evaluates its arguments. */
 #define log_debug(domain, args...)                                      \
   STMT_BEGIN                                                            \
-    if (PREDICT_UNLIKELY(_log_global_min_severity == LOG_DEBUG))        \
+    if (PREDICT_UNLIKELY(log_global_domain_enabled(LOG_DEBUG, domain))) \
       _log_fn(LOG_DEBUG, domain, __PRETTY_FUNCTION__, args);            \
   STMT_END
-#define log_info(domain, args...)                           \
-  _log_fn(LOG_INFO, domain, __PRETTY_FUNCTION__, args)
+#define log_info(domain, args...)                                       \
+  STMT_BEGIN                                                            \
+    if (PREDICT_UNLIKELY(log_global_domain_enabled(LOG_INFO, domain)))  \
+      _log_fn(LOG_INFO, domain, __PRETTY_FUNCTION__, args);             \
+  STMT_END
 #define log_notice(domain, args...)                         \
   _log_fn(LOG_NOTICE, domain, __PRETTY_FUNCTION__, args)
 #define log_warn(domain, args...)                           \
@@ -154,11 +154,19 @@ struct tor_tls_t {
    */
   unsigned long last_write_count;
   unsigned long last_read_count;
+  /** Bytes we've written straight to the socket since the last call to
+   * tor_tls_get_n_raw_bytes(), bypassing OpenSSL; see
+   * tor_tls_get_kernel_send_socket(). */
+  unsigned long kernel_write_count;
   /** If set, a callback to invoke whenever the client tries to renegotiate
    * the handshake. */
   void (*negotiated_callback)(tor_tls_t *tls, void *arg);
   /** Argument to pass to negotiated_callback. */
   void *callback_arg;
+  /** Client only: if we're caching TLS sessions, the session from our
+   * initial handshake, kept until we know whether the peer's identity
+   * checks out.  See tor_tls_remember_session(). */
+  SSL_SESSION *initial_session;
 };
 
 #ifdef V2_HANDSHAKE_CLIENT
@@ -223,6 +231,24 @@ static tor_tls_context_t *client_tls_context = NULL;
 /** True iff tor_tls_init() has been called. */
 static int tls_library_is_initialized = 0;
 
+/** True iff we should let peers resume earlier TLS sessions with us, and
+ * try to resume our own earlier sessions with peers we reconnect to. */
+static int tls_session_cache_enabled = 0;
+/** Client side: map from a peer's identity digest to the SSL_SESSION from
+ * our most recent verified connection to it. */
+static digestmap_t *client_sessions = NULL;
+/** True iff we should ask OpenSSL to hand the session keys of new
+ * connections to the kernel once their handshakes are done. */
+static int tls_kernel_offload_enabled = 0;
+/** How many entries are in client_sessions? */
+static int n_client_sessions = 0;
+/** How many peers do we remember client sessions for, at most? */
+#define MAX_CLIENT_SESSIONS 1024
+/** How many sessions do we let the server side of a TLS context cache? */
+#define SERVER_SESSION_CACHE_SIZE 4096
+
+static void tor_tls_forget_sessions(void);
+
 /* Module-internal error codes. */
 #define _TOR_TLS_SYSCALL    (_MIN_TOR_TLS_ERROR_VAL - 2)
 #define _TOR_TLS_ZERORETURN (_MIN_TOR_TLS_ERROR_VAL - 1)
@@ -527,6 +553,9 @@ tor_tls_free_all(void)
     client_tls_context = NULL;
     tor_tls_context_decref(ctx);
   }
+  tor_tls_forget_sessions();
+  digestmap_free(client_sessions, NULL);
+  client_sessions = NULL;
 #ifdef V2_HANDSHAKE_CLIENT
   if (CLIENT_CIPHER_DUMMIES)
     tor_free(CLIENT_CIPHER_DUMMIES);
@@ -1030,6 +1059,9 @@ tor_tls_context_init(int is_public_server,
   int rv1 = 0;
   int rv2 = 0;
 
+  /* Sessions we got under our old link keys are as stale as the keys. */
+  tor_tls_forget_sessions();
+
   if (is_public_server) {
     tor_tls_context_t *new_ctx;
     tor_tls_context_t *old_ctx;
@@ -1209,7 +1241,20 @@ tor_tls_context_new(crypto_pk_env_t *identity, unsigned int key_lifetime,
       idcert = NULL;
     }
   }
-  SSL_CTX_set_session_cache_mode(result->ctx, SSL_SESS_CACHE_OFF);
+  if (tls_session_cache_enabled) {
+    /* We keep client sessions ourselves, keyed by peer identity, so only the
+     * server side goes in OpenSSL's cache.  Either way, a session is good
+     * for no longer than the link key it was made under. */
+    static const unsigned char sid_ctx[] = "tor";
+    SSL_CTX_set_session_cache_mode(result->ctx,
+                             is_client ? SSL_SESS_CACHE_OFF :
+                             SSL_SESS_CACHE_SERVER|SSL_SESS_CACHE_NO_AUTO_CLEAR);
+    SSL_CTX_sess_set_cache_size(result->ctx, SERVER_SESSION_CACHE_SIZE);
+    SSL_CTX_set_session_id_context(result->ctx, sid_ctx, sizeof(sid_ctx)-1);
+    SSL_CTX_set_timeout(result->ctx, key_lifetime);
+  } else {
+    SSL_CTX_set_session_cache_mode(result->ctx, SSL_SESS_CACHE_OFF);
+  }
   if (!is_client) {
     tor_assert(rsa);
     if (!(pkey = _crypto_pk_env_get_evp_pkey(rsa,1)))
@@ -1487,6 +1532,10 @@ tor_tls_new(int sock, int isServer)
   }
   if (!isServer)
     rectify_client_ciphers(&result->ssl->cipher_list);
+#ifdef SSL_OP_ENABLE_KTLS
+  if (tls_kernel_offload_enabled)
+    SSL_set_options(result->ssl, SSL_OP_ENABLE_KTLS);
+#endif
   result->socket = sock;
   bio = BIO_new_socket(sock, BIO_NOCLOSE);
   if (! bio) {
@@ -1627,6 +1676,10 @@ tor_tls_free(tor_tls_t *tls)
 #endif
   SSL_free(tls->ssl);
   tls->ssl = NULL;
+  if (tls->initial_session) {
+    SSL_SESSION_free(tls->initial_session);
+    tls->initial_session = NULL;
+  }
   tls->negotiated_callback = NULL;
   if (tls->context)
     tor_tls_context_decref(tls->context);
@@ -1801,6 +1854,11 @@ tor_tls_finish_handshake(tor_tls_t *tls)
     if (cert)
       X509_free(cert);
 #endif
+    /* Hold on to the session from this handshake, not any renegotiation:
+     * resuming it later has to give us the same certificates back, or we
+     * would misjudge which link protocol the server speaks. */
+    if (tls_session_cache_enabled && !tls->initial_session)
+      tls->initial_session = SSL_get1_session(tls->ssl);
     if (SSL_set_cipher_list(tls->ssl, SERVER_CIPHER_LIST) == 0) {
       tls_log_errors(NULL, LOG_WARN, LD_HANDSHAKE, "re-setting ciphers");
       r = TOR_TLS_ERROR_MISC;
@@ -2182,7 +2240,7 @@ tor_tls_get_n_raw_bytes(tor_tls_t *tls, size_t *n_read, size_t *n_written)
    * this function.
    */
   *n_read = (size_t)(r - tls->last_read_count);
-  *n_written = (size_t)(w - tls->last_write_count);
+  *n_written = (size_t)(w - tls->last_write_count + tls->kernel_write_count);
   if (*n_read > INT_MAX || *n_written > INT_MAX) {
     log_warn(LD_BUG, "Preposterously large value in tor_tls_get_n_raw_bytes. "
              "r=%lu, last_read=%lu, w=%lu, last_written=%lu",
@@ -2190,6 +2248,7 @@ tor_tls_get_n_raw_bytes(tor_tls_t *tls, size_t *n_read, size_t *n_written)
   }
   tls->last_read_count = r;
   tls->last_write_count = w;
+  tls->kernel_write_count = 0;
 }
 
 /** Implement check_no_tls_errors: If there are any pending OpenSSL
@@ -2323,6 +2382,164 @@ tor_tls_server_got_renegotiate(tor_tls_t *tls)
   return tls->got_renegotiate;
 }
 
+/** Enable TLS session resumption if <b>enabled</b> is true, or disable it
+ * otherwise.  This only affects TLS contexts created after the call, so
+ * callers should follow it with tor_tls_context_init(). */
+void
+tor_tls_set_session_cache(int enabled)
+{
+  tls_session_cache_enabled = enabled != 0;
+  if (!tls_session_cache_enabled)
+    tor_tls_forget_sessions();
+}
+
+/** If <b>enabled</b> is true, ask OpenSSL to move the record layer of the
+ * connections we create from now on into the kernel after their
+ * handshakes, where both OpenSSL and the kernel support that.  Return 0 on
+ * success, or -1 if we were asked to enable it and this OpenSSL can't. */
+int
+tor_tls_set_kernel_offload(int enabled)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+  tls_kernel_offload_enabled = enabled != 0;
+  return 0;
+#else
+  tls_kernel_offload_enabled = 0;
+  return enabled ? -1 : 0;
+#endif
+}
+
+/** If the kernel is encrypting everything we send on <b>tls</b>, and we
+ * don't owe OpenSSL the rest of a partial SSL_write(), return the socket
+ * for <b>tls</b>: plaintext written to it goes out as TLS records.
+ * Otherwise return -1.  Callers that write to the socket must report how
+ * much they wrote with tor_tls_note_kernel_write(). */
+int
+tor_tls_get_kernel_send_socket(tor_tls_t *tls)
+{
+  tor_assert(tls);
+#ifdef SSL_OP_ENABLE_KTLS
+  if (tls->state == TOR_TLS_ST_OPEN && !tls->wantwrite_n &&
+      BIO_get_ktls_send(SSL_get_wbio(tls->ssl)))
+    return tls->socket;
+#endif
+  return -1;
+}
+
+/** Remember that we wrote <b>n</b> bytes directly to the socket for
+ * <b>tls</b>, so that tor_tls_get_n_raw_bytes() can count them. */
+void
+tor_tls_note_kernel_write(tor_tls_t *tls, size_t n)
+{
+  tls->kernel_write_count += (unsigned long)n;
+}
+
+/** Helper: return true iff <b>sess</b> will have expired by <b>now</b>. */
+static int
+session_is_expired(const SSL_SESSION *sess, time_t now)
+{
+  return SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess) <= now;
+}
+
+/** Client only: if we're caching TLS sessions and we have one from an
+ * earlier connection to the peer with identity <b>peer_id</b>, offer to
+ * resume it in the handshake on <b>tls</b>, which must not have started
+ * yet.  Return 1 if we offered a session, 0 otherwise. */
+int
+tor_tls_resume_session(tor_tls_t *tls, const char *peer_id)
+{
+  SSL_SESSION *sess;
+  tor_assert(tls);
+  tor_assert(peer_id);
+  if (!tls_session_cache_enabled || tls->isServer || !client_sessions)
+    return 0;
+  if (!(sess = digestmap_get(client_sessions, peer_id)))
+    return 0;
+  if (session_is_expired(sess, time(NULL))) {
+    digestmap_remove(client_sessions, peer_id);
+    --n_client_sessions;
+    SSL_SESSION_free(sess);
+    return 0;
+  }
+  if (!SSL_set_session(tls->ssl, sess)) {
+    tls_log_errors(tls, LOG_INFO, LD_HANDSHAKE, "offering a TLS session");
+    return 0;
+  }
+  return 1;
+}
+
+/** Client only: we've finished the handshake on <b>tls</b>, and the peer has
+ * proven it has identity <b>peer_id</b>.  If we're caching TLS sessions,
+ * remember the session from our initial handshake so that we can resume it
+ * next time we connect to the same peer. */
+void
+tor_tls_remember_session(tor_tls_t *tls, const char *peer_id)
+{
+  SSL_SESSION *old;
+  tor_assert(tls);
+  tor_assert(peer_id);
+  if (!tls_session_cache_enabled || tls->isServer || !tls->initial_session)
+    return;
+  if (!client_sessions)
+    client_sessions = digestmap_new();
+
+  if (!digestmap_get(client_sessions, peer_id) &&
+      n_client_sessions >= MAX_CLIENT_SESSIONS) {
+    /* We're full.  Throw out everything that has expired, or if nothing
+     * has, the oldest session we have. */
+    time_t now = time(NULL);
+    SSL_SESSION *oldest = NULL;
+    char oldest_id[DIGEST_LEN];
+    DIGESTMAP_FOREACH_MODIFY(client_sessions, id, SSL_SESSION *, s) {
+      if (session_is_expired(s, now)) {
+        SSL_SESSION_free(s);
+        --n_client_sessions;
+        MAP_DEL_CURRENT(id);
+      } else if (!oldest ||
+                 SSL_SESSION_get_time(s) < SSL_SESSION_get_time(oldest)) {
+        oldest = s;
+        memcpy(oldest_id, id, DIGEST_LEN);
+      }
+    } DIGESTMAP_FOREACH_END;
+    if (n_client_sessions >= MAX_CLIENT_SESSIONS) {
+      tor_assert(oldest);
+      digestmap_remove(client_sessions, oldest_id);
+      --n_client_sessions;
+      SSL_SESSION_free(oldest);
+    }
+  }
+
+  old = digestmap_set(client_sessions, peer_id, tls->initial_session);
+  if (old)
+    SSL_SESSION_free(old);
+  else
+    ++n_client_sessions;
+  tls->initial_session = NULL;
+}
+
+/** Return true iff the handshake on <b>tls</b> resumed an earlier TLS
+ * session rather than doing a full key exchange. */
+int
+tor_tls_session_was_resumed(tor_tls_t *tls)
+{
+  tor_assert(tls);
+  tor_assert(tls->ssl);
+  return SSL_session_reused(tls->ssl) ? 1 : 0;
+}
+
+/** Release every client-side TLS session we've been keeping. */
+static void
+tor_tls_forget_sessions(void)
+{
+  if (!client_sessions)
+    return;
+  DIGESTMAP_FOREACH_MODIFY(client_sessions, id, SSL_SESSION *, s) {
+    SSL_SESSION_free(s);
+    MAP_DEL_CURRENT(id);
+  } DIGESTMAP_FOREACH_END;
+  n_client_sessions = 0;
+}
+
 /** Set the DIGEST256_LEN buffer at <b>secrets_out</b> to the value used in
  * the v3 handshake to prove that the client knows the TLS secrets for the
  * connection <b>tls</b>.  Return 0 on success, -1 on failure.
@@ -95,6 +95,13 @@ int tor_tls_received_v3_certificate(tor_tls_t *tls);
 int tor_tls_get_num_server_handshakes(tor_tls_t *tls);
 int tor_tls_server_got_renegotiate(tor_tls_t *tls);
 int tor_tls_get_tlssecrets(tor_tls_t *tls, uint8_t *secrets_out);
+void tor_tls_set_session_cache(int enabled);
+int tor_tls_set_kernel_offload(int enabled);
+int tor_tls_get_kernel_send_socket(tor_tls_t *tls);
+void tor_tls_note_kernel_write(tor_tls_t *tls, size_t n);
+int tor_tls_resume_session(tor_tls_t *tls, const char *peer_id);
+void tor_tls_remember_session(tor_tls_t *tls, const char *peer_id);
+int tor_tls_session_was_resumed(tor_tls_t *tls);
 
 /* Log and abort if there are unhandled TLS errors in OpenSSL's error stack.
  */
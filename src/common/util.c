@@ -94,6 +94,13 @@
 #include <sys/wait.h>
 #endif
 
+#ifdef USE_OPENBSD_MALLOC
+/* Defined in OpenBSD_malloc_Linux.c, which has no header of its own. */
+void malloc_get_stats(size_t *large_pages, size_t *chunk_pages,
+                      size_t *free_pages, size_t *chunk_free_bytes,
+                      size_t *cached_chunks, unsigned long *cache_hits);
+#endif
+
 /* =====
  * Memory management
  * ===== */
@@ -308,6 +315,22 @@ tor_log_mallinfo(int severity)
       mi.arena, mi.ordblks, mi.smblks, mi.hblks,
       mi.hblkhd, mi.usmblks, mi.fsmblks, mi.uordblks, mi.fordblks,
       mi.keepcost);
+#elif defined(USE_OPENBSD_MALLOC)
+  {
+    size_t large_pages, chunk_pages, free_pages, chunk_free, cached;
+    unsigned long cache_hits;
+    size_t page_size = (size_t)getpagesize();
+    malloc_get_stats(&large_pages, &chunk_pages, &free_pages, &chunk_free,
+                     &cached, &cache_hits);
+    tor_log(severity, LD_MM,
+        "malloc: %lu pages for large allocations, %lu pages of small chunks "
+        "(%lu bytes of which are free: %d%% fragmented), %lu free pages "
+        "kept for reuse; %lu chunks in thread caches, %lu cache hits.",
+        (unsigned long)large_pages, (unsigned long)chunk_pages,
+        (unsigned long)chunk_free,
+        chunk_pages ? (int)(100.0 * chunk_free / (chunk_pages*page_size)) : 0,
+        (unsigned long)free_pages, (unsigned long)cached, cache_hits);
+  }
 #else
   (void)severity;
 #endif
@@ -756,6 +779,19 @@ const char *
 find_str_at_start_of_line(const char *haystack, const char *needle)
 {
   size_t needle_len = strlen(needle);
+  char nl_needle[64];
+
+  if (!strncmp(haystack, needle, needle_len))
+    return haystack;
+  if (needle_len && needle_len < sizeof(nl_needle)-1) {
+    /* Let strstr(), which is much faster than we are, look for the needle
+     * after a newline. */
+    const char *cp;
+    nl_needle[0] = '\n';
+    memcpy(nl_needle+1, needle, needle_len+1);
+    cp = strstr(haystack, nl_needle);
+    return cp ? cp+1 : NULL;
+  }
 
   do {
     if (!strncmp(haystack, needle, needle_len))
@@ -957,30 +993,36 @@ base16_encode(char *dest, size_t destlen, const char *src, size_t srclen)
   *cp = '\0';
 }
 
+/** Marks bytes that aren't hex digits in hex_decode_table. */
+#define X 255
+/** Internal table mapping byte values to the hex digits they represent, or
+ * X. */
+static const uint8_t hex_decode_table[256] = {
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,
+  X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
+#undef X
+
 /** Helper: given a hex digit, return its value, or -1 if it isn't hex. */
 static INLINE int
 _hex_decode_digit(char c)
 {
-  switch (c) {
-    case '0': return 0;
-    case '1': return 1;
-    case '2': return 2;
-    case '3': return 3;
-    case '4': return 4;
-    case '5': return 5;
-    case '6': return 6;
-    case '7': return 7;
-    case '8': return 8;
-    case '9': return 9;
-    case 'A': case 'a': return 10;
-    case 'B': case 'b': return 11;
-    case 'C': case 'c': return 12;
-    case 'D': case 'd': return 13;
-    case 'E': case 'e': return 14;
-    case 'F': case 'f': return 15;
-    default:
-      return -1;
-  }
+  uint8_t v = hex_decode_table[(uint8_t)c];
+  return (v == 255) ? -1 : v;
 }
 
 /** Helper: given a hex digit, return its value, or -1 if it isn't hex. */
@@ -1005,9 +1047,10 @@ base16_decode(char *dest, size_t destlen, const char *src, size_t srclen)
     return -1;
   end = src+srclen;
   while (src<end) {
-    v1 = _hex_decode_digit(*src);
-    v2 = _hex_decode_digit(*(src+1));
-    if (v1<0||v2<0)
+    /* Invalid digits have their high bit set, so one test covers both. */
+    v1 = hex_decode_table[(uint8_t)src[0]];
+    v2 = hex_decode_table[(uint8_t)src[1]];
+    if ((v1|v2) & 0x80)
       return -1;
     *(uint8_t*)dest = (v1<<4)|v2;
     ++dest;
@@ -1601,6 +1644,30 @@ update_approx_time(time_t now)
 {
   cached_approx_time = now;
 }
+
+/** Cached value of tor_get_monotonic_msec(). */
+static uint64_t cached_approx_monotonic_msec = 0;
+
+/** Return a cached value of tor_get_monotonic_msec() from when
+ * update_approx_monotonic_msec() was last called: that is, from when
+ * libevent last called us.  Like approx_time(), this is for hot paths that
+ * want millisecond timestamps without a clock syscall apiece, and that
+ * want every timestamp they take while handling one event to agree. */
+uint64_t
+approx_monotonic_msec(void)
+{
+  if (PREDICT_UNLIKELY(cached_approx_monotonic_msec == 0))
+    update_approx_monotonic_msec();
+  return cached_approx_monotonic_msec;
+}
+
+/** Update the value that approx_monotonic_msec() returns.  Call this
+ * whenever libevent hands us control. */
+void
+update_approx_monotonic_msec(void)
+{
+  cached_approx_monotonic_msec = tor_get_monotonic_msec();
+}
 #endif
 
 /* =====
@@ -1922,6 +1989,8 @@ struct open_file_t {
   FILE *stdio_file; /**< stdio wrapper for <b>fd</b>. */
 };
 
+static void file_writer_wait_for(const char *fname);
+
 /** Try to start writing to the file in <b>fname</b>, passing the flags
  * <b>open_flags</b> to the open() syscall, creating the file (if needed) with
  * access value <b>mode</b>.  If the O_APPEND flag is set, we append to the
@@ -2108,6 +2177,8 @@ write_chunks_to_file_impl(const char *fname, const smartlist_t *chunks,
   open_file_t *file = NULL;
   int fd;
   ssize_t result;
+  /* Let any queued write to this file land first, so ours wins. */
+  file_writer_wait_for(fname);
   fd = start_writing_to_file(fname, open_flags, 0600, &file);
   if (fd<0)
     return -1;
@@ -2183,6 +2254,305 @@ write_bytes_to_new_file(const char *fname, const char *str, size_t len,
                                   (bin?O_BINARY:O_TEXT));
 }
 
+/* ===== Background file writer ===== */
+
+/* Files that we rewrite periodically (our state file, statistics, caches
+ * that nobody mmaps) don't need to hit the disk before we go on.  When the
+ * file writer thread is running, write_*_to_file_async() hand their contents
+ * to it: it replaces the files in batches, fsync()s them before renaming
+ * them into place, and never stalls the main thread while it does so.  A
+ * file that is queued twice before the writer gets to it is written once,
+ * with the newer contents. */
+
+#ifdef TOR_HAVE_COND
+/** A file that the file writer thread should replace. */
+typedef struct pending_file_write_t {
+  char *fname; /**< Name of the file to replace. */
+  char *body; /**< New contents of the file. */
+  size_t len; /**< Length of <b>body</b>. */
+  int bin; /**< True iff we should write <b>body</b> in binary mode. */
+} pending_file_write_t;
+
+/** Protects all the file_writer_* variables below. */
+static tor_mutex_t *file_writer_lock = NULL;
+/** Signalled when there are new writes to do, or we want the thread to
+ * exit. */
+static tor_cond_t *file_writer_wakeup = NULL;
+/** Signalled when the file writer thread finishes a batch, or exits. */
+static tor_cond_t *file_writer_done = NULL;
+/** List of pending_file_write_t that the file writer thread hasn't started;
+ * at most one per filename. */
+static smartlist_t *file_writer_queue = NULL;
+/** List of pending_file_write_t that the file writer thread is writing
+ * now. */
+static smartlist_t *file_writer_batch = NULL;
+/** Boolean: is the file writer thread running? */
+static int file_writer_running = 0;
+/** Boolean: should the file writer thread exit once it is out of work? */
+static int file_writer_exiting = 0;
+
+/** Release all storage held in <b>w</b>. */
+static void
+pending_file_write_free(pending_file_write_t *w)
+{
+  if (!w)
+    return;
+  tor_free(w->fname);
+  tor_free(w->body);
+  tor_free(w);
+}
+
+/** Replace every file in <b>batch</b>: write all the temporary files, then
+ * sync them, then rename them into place, so that a batch costs one trip
+ * through the disk's write cache rather than one per file. */
+static void
+file_writer_write_batch(smartlist_t *batch)
+{
+  int n = smartlist_len(batch), i;
+  open_file_t **files = tor_malloc_zero(sizeof(open_file_t*) * n);
+
+  for (i = 0; i < n; ++i) {
+    pending_file_write_t *w = smartlist_get(batch, i);
+    int flags = OPEN_FLAGS_REPLACE|(w->bin?O_BINARY:O_TEXT);
+    int fd = start_writing_to_file(w->fname, flags, 0600, &files[i]);
+    if (fd < 0)
+      continue;
+    if (write_all(fd, w->body, w->len, 0) < 0) {
+      log_warn(LD_FS, "Error writing to \"%s\": %s", w->fname,
+               strerror(errno));
+      abort_writing_to_file(files[i]);
+      files[i] = NULL;
+    }
+  }
+#ifndef MS_WINDOWS
+  for (i = 0; i < n; ++i) {
+    pending_file_write_t *w = smartlist_get(batch, i);
+    if (files[i] && fsync(files[i]->fd) < 0) {
+      log_warn(LD_FS, "Error syncing \"%s\": %s", w->fname,
+               strerror(errno));
+      abort_writing_to_file(files[i]);
+      files[i] = NULL;
+    }
+  }
+#endif
+  for (i = 0; i < n; ++i) {
+    if (files[i])
+      finish_writing_to_file(files[i]);
+  }
+  tor_free(files);
+}
+
+/** Main function for the file writer thread. */
+static void
+file_writer_main(void *arg)
+{
+  (void)arg;
+  tor_mutex_acquire(file_writer_lock);
+  for (;;) {
+    smartlist_t *batch;
+    while (!smartlist_len(file_writer_queue) && !file_writer_exiting)
+      tor_cond_wait(file_writer_wakeup, file_writer_lock);
+    if (!smartlist_len(file_writer_queue))
+      break;
+    batch = file_writer_batch = file_writer_queue;
+    file_writer_queue = smartlist_create();
+    tor_mutex_release(file_writer_lock);
+
+    file_writer_write_batch(batch);
+
+    tor_mutex_acquire(file_writer_lock);
+    file_writer_batch = NULL;
+    SMARTLIST_FOREACH(batch, pending_file_write_t *, w,
+                      pending_file_write_free(w));
+    smartlist_free(batch);
+    tor_cond_signal_all(file_writer_done);
+  }
+  file_writer_running = 0;
+  tor_cond_signal_all(file_writer_done);
+  tor_mutex_release(file_writer_lock);
+  spawn_exit();
+}
+
+/** Start a thread to handle write_*_to_file_async() requests.  Return 0 on
+ * success, -1 on failure. */
+int
+file_writer_start(void)
+{
+  int r = 0;
+  if (!file_writer_lock) {
+    file_writer_lock = tor_mutex_new();
+    file_writer_wakeup = tor_cond_new();
+    file_writer_done = tor_cond_new();
+    file_writer_queue = smartlist_create();
+  }
+  tor_mutex_acquire(file_writer_lock);
+  if (!file_writer_running) {
+    file_writer_exiting = 0;
+    file_writer_running = 1;
+    if (spawn_func(file_writer_main, NULL) < 0) {
+      file_writer_running = 0;
+      r = -1;
+    }
+  }
+  tor_mutex_release(file_writer_lock);
+  return r;
+}
+
+/** Return true iff <b>lst</b> has a write to <b>fname</b>. */
+static int
+file_write_list_has(const smartlist_t *lst, const char *fname)
+{
+  if (!lst)
+    return 0;
+  SMARTLIST_FOREACH(lst, const pending_file_write_t *, w,
+                    if (!strcmp(w->fname, fname)) return 1);
+  return 0;
+}
+
+/** Wait until the file writer thread has written <b>fname</b>, if it has a
+ * write to it pending; or until it has finished every pending write, if
+ * <b>fname</b> is NULL. */
+static void
+file_writer_wait_for(const char *fname)
+{
+  if (!file_writer_lock)
+    return;
+  tor_mutex_acquire(file_writer_lock);
+  while (file_writer_running &&
+         (fname ? (file_write_list_has(file_writer_queue, fname) ||
+                   file_write_list_has(file_writer_batch, fname))
+                : (smartlist_len(file_writer_queue) ||
+                   file_writer_batch != NULL)))
+    tor_cond_wait(file_writer_done, file_writer_lock);
+  tor_mutex_release(file_writer_lock);
+}
+
+/** Wait until the file writer thread has written every file queued for
+ * it. */
+void
+file_writer_flush(void)
+{
+  file_writer_wait_for(NULL);
+}
+
+/** Write every file queued for the file writer thread, and stop the
+ * thread. */
+void
+file_writer_shutdown(void)
+{
+  if (!file_writer_lock)
+    return;
+  tor_mutex_acquire(file_writer_lock);
+  file_writer_exiting = 1;
+  tor_cond_signal_one(file_writer_wakeup);
+  while (file_writer_running)
+    tor_cond_wait(file_writer_done, file_writer_lock);
+  tor_mutex_release(file_writer_lock);
+}
+
+/** Queue <b>len</b> bytes from <b>body</b> (which we take ownership of) to
+ * replace <b>fname</b>.  If the file writer thread isn't running, write
+ * the file now.  Return 0 on success, -1 on failure. */
+static int
+file_writer_queue_write(const char *fname, char *body, size_t len, int bin)
+{
+  int queued = 0;
+  if (file_writer_lock) {
+    tor_mutex_acquire(file_writer_lock);
+    if (file_writer_running && !file_writer_exiting) {
+      pending_file_write_t *w = NULL;
+      SMARTLIST_FOREACH(file_writer_queue, pending_file_write_t *, p,
+                        if (!strcmp(p->fname, fname)) { w = p; break; });
+      if (w) {
+        /* Nobody will ever see the contents we queued before. */
+        tor_free(w->body);
+      } else {
+        w = tor_malloc_zero(sizeof(pending_file_write_t));
+        w->fname = tor_strdup(fname);
+        smartlist_add(file_writer_queue, w);
+        tor_cond_signal_one(file_writer_wakeup);
+      }
+      w->body = body;
+      w->len = len;
+      w->bin = bin;
+      queued = 1;
+    }
+    tor_mutex_release(file_writer_lock);
+  }
+  if (!queued) {
+    int r = write_bytes_to_file(fname, body, len, bin);
+    tor_free(body);
+    return r;
+  }
+  return 0;
+}
+#else
+/* Without condition variables, we have no file writer thread, and the
+ * async functions write synchronously. */
+int
+file_writer_start(void)
+{
+  return -1;
+}
+void
+file_writer_flush(void)
+{
+}
+void
+file_writer_shutdown(void)
+{
+}
+static void
+file_writer_wait_for(const char *fname)
+{
+  (void)fname;
+}
+static int
+file_writer_queue_write(const char *fname, char *body, size_t len, int bin)
+{
+  int r = write_bytes_to_file(fname, body, len, bin);
+  tor_free(body);
+  return r;
+}
+#endif
+
+/** As write_str_to_file(), but if the file writer thread is running, let
+ * it write the file in the background.  In that case, return 0 once the
+ * write is queued; the thread logs any error. */
+int
+write_str_to_file_async(const char *fname, const char *str, int bin)
+{
+  return write_bytes_to_file_async(fname, str, strlen(str), bin);
+}
+
+/** As write_bytes_to_file(), but if the file writer thread is running, let
+ * it write the file in the background.  In that case, return 0 once the
+ * write is queued; the thread logs any error. */
+int
+write_bytes_to_file_async(const char *fname, const char *str, size_t len,
+                          int bin)
+{
+  return file_writer_queue_write(fname, tor_memdup(str, len), len, bin);
+}
+
+/** As write_chunks_to_file(), but if the file writer thread is running,
+ * let it write the file in the background.  In that case, return 0 once
+ * the write is queued; the thread logs any error. */
+int
+write_chunks_to_file_async(const char *fname, const smartlist_t *chunks,
+                           int bin)
+{
+  size_t len = 0;
+  char *body, *cp;
+  SMARTLIST_FOREACH(chunks, const sized_chunk_t *, c, len += c->len);
+  cp = body = tor_malloc(len+1);
+  SMARTLIST_FOREACH(chunks, const sized_chunk_t *, c, {
+      memcpy(cp, c->bytes, c->len);
+      cp += c->len;
+    });
+  return file_writer_queue_write(fname, body, len, bin);
+}
+
 /** Read the contents of <b>filename</b> into a newly allocated
  * string; return the string on success or NULL on failure.
  *
@@ -2211,6 +2581,9 @@ read_file_to_str(const char *filename, int flags, struct stat *stat_out)
 
   tor_assert(filename);
 
+  /* Don't read an old version of a file that we're about to replace. */
+  file_writer_wait_for(filename);
+
   fd = tor_open_cloexec(filename,O_RDONLY|(bin?O_BINARY:O_TEXT),0);
   if (fd<0) {
     int severity = LOG_WARN;
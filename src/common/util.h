@@ -248,9 +248,13 @@ int format_time_interval(char *out, size_t out_len, long interval);
 #ifdef TIME_IS_FAST
 #define approx_time() time(NULL)
 #define update_approx_time(t) STMT_NIL
+#define approx_monotonic_msec() tor_get_monotonic_msec()
+#define update_approx_monotonic_msec() STMT_NIL
 #else
 time_t approx_time(void);
 void update_approx_time(time_t now);
+uint64_t approx_monotonic_msec(void);
+void update_approx_monotonic_msec(void);
 #endif
 
 /* Rate-limiter */
@@ -335,6 +339,14 @@ int append_bytes_to_file(const char *fname, const char *str, size_t len,
                          int bin);
 int write_bytes_to_new_file(const char *fname, const char *str, size_t len,
                             int bin);
+int write_str_to_file_async(const char *fname, const char *str, int bin);
+int write_bytes_to_file_async(const char *fname, const char *str, size_t len,
+                              int bin);
+int write_chunks_to_file_async(const char *fname,
+                               const struct smartlist_t *chunks, int bin);
+int file_writer_start(void);
+void file_writer_flush(void);
+void file_writer_shutdown(void);
 
 /** Flag for read_file_to_str: open the file in binary mode. */
 #define RFTS_BIN            1
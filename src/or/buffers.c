@@ -18,11 +18,15 @@
 #include "connection_or.h"
 #include "control.h"
 #include "reasons.h"
+#include "mempool.h"
 #include "../common/util.h"
 #include "../common/torlog.h"
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 
 //#define PARANOIA
 
@@ -74,6 +78,20 @@ typedef struct chunk_t {
 
 #define CHUNK_HEADER_LEN STRUCT_OFFSET(chunk_t, mem[0])
 
+/** Stored in the mem field of a chunk that refers to memory it doesn't own:
+ * how to release that memory once the chunk is done with it. */
+typedef struct chunk_ref_t {
+  void (*release_fn)(void *); /**< Called with <b>arg</b> on release. */
+  void *arg; /**< Argument for <b>release_fn</b>. */
+} chunk_ref_t;
+
+/** Return true iff <b>chunk</b>'s data lives in memory owned by someone else
+ * (see write_to_buf_ref()).  Such chunks have no space of their own, so
+ * nothing is ever appended to them. */
+#define CHUNK_IS_REF(chunk) ((chunk)->memlen == 0)
+
+static chunk_t *chunk_copy(const chunk_t *in_chunk);
+
 /** Return the number of bytes needed to allocate a chunk to hold
  * <b>memlen</b> bytes. */
 #define CHUNK_ALLOC_SIZE(memlen) (CHUNK_HEADER_LEN + (memlen))
@@ -94,122 +112,184 @@ CHUNK_WRITE_PTR(chunk_t *chunk)
 static INLINE size_t
 CHUNK_REMAINING_CAPACITY(const chunk_t *chunk)
 {
+  if (PREDICT_UNLIKELY(CHUNK_IS_REF(chunk)))
+    return 0;
   return (chunk->mem + chunk->memlen) - (chunk->data + chunk->datalen);
 }
 
+/** Free the reference chunk <b>chunk</b>, and release the memory it refers
+ * to. */
+static void
+chunk_free_ref(chunk_t *chunk)
+{
+  chunk_ref_t ref;
+  memcpy(&ref, chunk->mem, sizeof(ref));
+  tor_free(chunk);
+  ref.release_fn(ref.arg);
+}
+
+/** Running totals of the chunks our buffers have allocated and freed, and
+ * of the bytes they've copied. */
+static buf_stats_t buf_stats;
+
+/** Note that we're about to copy <b>n</b> bytes into, out of, or within a
+ * buffer. */
+#define NOTE_COPY(n) STMT_BEGIN buf_stats.n_bytes_copied += (n); STMT_END
+
 /** Move all bytes stored in <b>chunk</b> to the front of <b>chunk</b>->mem,
  * to free up space at the end. */
 static INLINE void
 chunk_repack(chunk_t *chunk)
 {
   if (chunk->datalen && chunk->data != &chunk->mem[0]) {
+    NOTE_COPY(chunk->datalen);
     memmove(chunk->mem, chunk->data, chunk->datalen);
   }
   chunk->data = &chunk->mem[0];
 }
 
+/** How many bytes, in total, are currently allocated for the chunks of all
+ * our buffers? */
+static size_t total_bytes_allocated_in_chunks = 0;
+
 #ifdef ENABLE_BUF_FREELISTS
-/** A freelist of chunks. */
-typedef struct chunk_freelist_t {
-  size_t alloc_size; /**< What size chunks does this freelist hold? */
-  int max_length; /**< Never allow more than this number of chunks in the
-                   * freelist. */
-  int slack; /**< When trimming the freelist, leave this number of extra
-              * chunks beyond lowest_length.*/
-  int cur_length; /**< How many chunks on the freelist now? */
-  int lowest_length; /**< What's the smallest value of cur_length since the
-                      * last time we cleaned this freelist? */
-  uint64_t n_alloc;
-  uint64_t n_free;
-  uint64_t n_hit;
-  chunk_t *head; /**< First chunk on the freelist. */
-} chunk_freelist_t;
-
-/** Macro to help define freelists. */
-#define FL(a,m,s) { a, m, s, 0, 0, 0, 0, 0, NULL }
-
-/** Static array of freelists, sorted by alloc_len, terminated by an entry
+/** A size class for chunk allocations.  Every chunk whose allocation size
+ * matches a size class comes from that class's memory pool, which carves
+ * chunks out of larger slabs and keeps emptied slabs around for reuse. */
+typedef struct chunk_size_class_t {
+  size_t alloc_size; /**< What size chunks does this class hold? */
+  size_t slab_size; /**< About how many bytes go in each slab? */
+  int low_water; /**< When trimming this class, keep at least this many
+                  * empty slabs beyond the ones we've used recently. */
+  int high_water; /**< Never keep more than this many empty slabs. */
+  mp_pool_t *pool; /**< Pool we allocate this class from, or NULL if we
+                    * haven't needed it yet. */
+  int n_in_use; /**< How many chunks of this class are allocated now? */
+  int peak_in_use; /**< What's the largest value of n_in_use since the last
+                    * time we trimmed this class? */
+  uint64_t n_alloc; /**< How many chunks have we allocated in this class? */
+  uint64_t n_free; /**< How many chunks have we released in this class? */
+} chunk_size_class_t;
+
+/** Macro to help define size classes. */
+#define SC(a,s,l,h) { a, s, l, h, NULL, 0, 0, 0, 0 }
+
+/** Static array of size classes, sorted by alloc_size, terminated by an entry
  * with alloc_size of 0. */
-static chunk_freelist_t freelists[] = {
-  FL(4096, 256, 8), FL(8192, 128, 4), FL(16384, 64, 4), FL(32768, 32, 2),
-  FL(0, 0, 0)
+static chunk_size_class_t size_classes[] = {
+  SC(256, 65536, 0, 2), SC(512, 65536, 0, 2), SC(1024, 65536, 0, 2),
+  SC(2048, 65536, 0, 2), SC(4096, 65536, 2, 16), SC(8192, 131072, 1, 8),
+  SC(16384, 262144, 1, 4), SC(32768, 524288, 0, 2),
+  SC(65536, 1048576, 0, 2),
+  SC(0, 0, 0, 0)
 };
-#undef FL
-/** How many times have we looked for a chunk of a size that no freelist
+#undef SC
+/** How many times have we allocated a chunk of a size that no size class
  * could help with? */
-static uint64_t n_freelist_miss = 0;
-
-static void assert_freelist_ok(chunk_freelist_t *fl);
+static uint64_t n_size_class_miss = 0;
 
-/** Return the freelist to hold chunks of size <b>alloc</b>, or NULL if
- * no freelist exists for that size. */
-static INLINE chunk_freelist_t *
-get_freelist(size_t alloc)
+/** Return the size class to hold chunks of size <b>alloc</b>, or NULL if
+ * no size class exists for that size. */
+static INLINE chunk_size_class_t *
+get_size_class(size_t alloc)
 {
   int i;
-  for (i=0; freelists[i].alloc_size <= alloc; ++i) {
-    if (freelists[i].alloc_size == alloc) {
-      return &freelists[i];
+  for (i=0; size_classes[i].alloc_size && size_classes[i].alloc_size <= alloc;
+       ++i) {
+    if (size_classes[i].alloc_size == alloc) {
+      return &size_classes[i];
     }
   }
   return NULL;
 }
 
-/** Deallocate a chunk or put it on a freelist */
+/** Deallocate a chunk, returning it to its size class if it has one. */
 static void
 chunk_free_unchecked(chunk_t *chunk)
 {
   size_t alloc;
-  chunk_freelist_t *freelist;
-
+  chunk_size_class_t *sc;
+  if (CHUNK_IS_REF(chunk)) {
+    chunk_free_ref(chunk);
+    return;
+  }
   alloc = CHUNK_ALLOC_SIZE(chunk->memlen);
-  freelist = get_freelist(alloc);
-  if (freelist && freelist->cur_length < freelist->max_length) {
-    chunk->next = freelist->head;
-    freelist->head = chunk;
-    ++freelist->cur_length;
+  sc = get_size_class(alloc);
+  tor_assert(total_bytes_allocated_in_chunks >= alloc);
+  total_bytes_allocated_in_chunks -= alloc;
+  ++buf_stats.n_chunks_freed;
+  if (sc) {
+    tor_assert(sc->n_in_use > 0);
+    --sc->n_in_use;
+    ++sc->n_free;
+    mp_pool_release(chunk);
   } else {
-    if (freelist)
-      ++freelist->n_free;
     tor_free(chunk);
   }
 }
 
-/** Allocate a new chunk with a given allocation size, or get one from the
- * freelist.  Note that a chunk with allocation size A can actually hold only
- * CHUNK_SIZE_WITH_ALLOC(A) bytes in its mem field. */
+/** Allocate a new chunk with a given allocation size, from its size class if
+ * it has one.  Note that a chunk with allocation size A can actually hold
+ * only CHUNK_SIZE_WITH_ALLOC(A) bytes in its mem field. */
 static INLINE chunk_t *
 chunk_new_with_alloc_size(size_t alloc)
 {
   chunk_t *ch;
-  chunk_freelist_t *freelist;
+  chunk_size_class_t *sc;
   tor_assert(alloc >= sizeof(chunk_t));
-  freelist = get_freelist(alloc);
-  if (freelist && freelist->head) {
-    ch = freelist->head;
-    freelist->head = ch->next;
-    if (--freelist->cur_length < freelist->lowest_length)
-      freelist->lowest_length = freelist->cur_length;
-    ++freelist->n_hit;
+  sc = get_size_class(alloc);
+  if (sc) {
+    if (PREDICT_UNLIKELY(!sc->pool)) {
+      sc->pool = mp_pool_new(sc->alloc_size, sc->slab_size);
+      mp_pool_set_max_empty_chunks(sc->pool, sc->high_water);
+    }
+    ch = mp_pool_get(sc->pool);
+    ++sc->n_alloc;
+    if (++sc->n_in_use > sc->peak_in_use)
+      sc->peak_in_use = sc->n_in_use;
   } else {
-    /* XXXX take advantage of tor_malloc_roundup, once we know how that
-     * affects freelists. */
-    if (freelist)
-      ++freelist->n_alloc;
-    else
-      ++n_freelist_miss;
+    ++n_size_class_miss;
     ch = tor_malloc(alloc);
   }
+  total_bytes_allocated_in_chunks += alloc;
+  ++buf_stats.n_chunks_allocated;
+  buf_stats.n_bytes_allocated += alloc;
   ch->next = NULL;
   ch->datalen = 0;
   ch->memlen = CHUNK_SIZE_WITH_ALLOC(alloc);
   ch->data = &ch->mem[0];
   return ch;
 }
+
+/** Expand <b>chunk</b> until it can hold <b>sz</b> bytes, and return a
+ * new pointer to <b>chunk</b>.  Old pointers are no longer valid. */
+static INLINE chunk_t *
+chunk_grow(chunk_t *chunk, size_t sz)
+{
+  chunk_t *newchunk;
+  off_t offset;
+  tor_assert(sz > chunk->memlen);
+  /* Pooled chunks can't be realloc()ed, so move the data to a new chunk. */
+  offset = chunk->data - chunk->mem;
+  newchunk = chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(sz));
+  newchunk->next = chunk->next;
+  newchunk->data = newchunk->mem + offset;
+  newchunk->datalen = chunk->datalen;
+  NOTE_COPY(chunk->datalen);
+  memcpy(newchunk->data, chunk->data, chunk->datalen);
+  chunk_free_unchecked(chunk);
+  return newchunk;
+}
 #else
 static void
 chunk_free_unchecked(chunk_t *chunk)
 {
+  if (CHUNK_IS_REF(chunk)) {
+    chunk_free_ref(chunk);
+    return;
+  }
+  total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
+  ++buf_stats.n_chunks_freed;
   tor_free(chunk);
 }
 static INLINE chunk_t *
@@ -217,13 +297,15 @@ chunk_new_with_alloc_size(size_t alloc)
 {
   chunk_t *ch;
   ch = tor_malloc_roundup(&alloc);
+  total_bytes_allocated_in_chunks += alloc;
+  ++buf_stats.n_chunks_allocated;
+  buf_stats.n_bytes_allocated += alloc;
   ch->next = NULL;
   ch->datalen = 0;
   ch->memlen = CHUNK_SIZE_WITH_ALLOC(alloc);
   ch->data = &ch->mem[0];
   return ch;
 }
-#endif
 
 /** Expand <b>chunk</b> until it can hold <b>sz</b> bytes, and return a
  * new pointer to <b>chunk</b>.  Old pointers are no longer valid. */
@@ -233,11 +315,18 @@ chunk_grow(chunk_t *chunk, size_t sz)
   off_t offset;
   tor_assert(sz > chunk->memlen);
   offset = chunk->data - chunk->mem;
+  total_bytes_allocated_in_chunks += sz - chunk->memlen;
+  /* realloc() may or may not copy; count the worst case. */
+  ++buf_stats.n_chunks_allocated;
+  ++buf_stats.n_chunks_freed;
+  buf_stats.n_bytes_allocated += CHUNK_ALLOC_SIZE(sz);
+  NOTE_COPY(chunk->datalen);
   chunk = tor_realloc(chunk, CHUNK_ALLOC_SIZE(sz));
   chunk->memlen = sz;
   chunk->data = chunk->mem + offset;
   return chunk;
 }
+#endif
 
 /** If a read onto the end of a chunk would be smaller than this number, then
  * just start a new chunk. */
@@ -247,6 +336,15 @@ chunk_grow(chunk_t *chunk, size_t sz)
 /** No chunk should take up more than this many bytes. */
 #define MAX_CHUNK_ALLOC 65536
 
+#if defined(HAVE_READV) && defined(HAVE_WRITEV) && defined(HAVE_SYS_UIO_H)
+/** Defined if we can read into, and flush from, several chunks of a buffer
+ * with a single readv() or writev() call. */
+#define USE_VECTORED_IO
+/** Never hand more than this many chunks to a single readv() or writev()
+ * call. */
+#define MAX_IOVECS 16
+#endif
+
 /** Return the allocation size we'd like to use to hold <b>target</b>
  * bytes. */
 static INLINE size_t
@@ -259,100 +357,120 @@ preferred_chunk_size(size_t target)
   return sz;
 }
 
-/** Remove from the freelists most chunks that have not been used since the
- * last call to buf_shrink_freelists(). */
+/** Give back to the system the empty slabs in each size class that have not
+ * been used since the last call to buf_shrink_freelists(), beyond the
+ * class's low watermark.  If <b>free_all</b>, release every empty slab,
+ * and every size class that has no chunks in use. */
 void
 buf_shrink_freelists(int free_all)
 {
 #ifdef ENABLE_BUF_FREELISTS
   int i;
   disable_control_logging();
-  for (i = 0; freelists[i].alloc_size; ++i) {
-    int slack = freelists[i].slack;
-    assert_freelist_ok(&freelists[i]);
-    if (free_all || freelists[i].lowest_length > slack) {
-      int n_to_free = free_all ? freelists[i].cur_length :
-        (freelists[i].lowest_length - slack);
-      int n_to_skip = freelists[i].cur_length - n_to_free;
-      int orig_length = freelists[i].cur_length;
-      int orig_n_to_free = n_to_free, n_freed=0;
-      int orig_n_to_skip = n_to_skip;
-      int new_length = n_to_skip;
-      chunk_t **chp = &freelists[i].head;
-      chunk_t *chunk;
-      while (n_to_skip) {
-        if (! (*chp)->next) {
-          log_warn(LD_BUG, "I wanted to skip %d chunks in the freelist for "
-                   "%d-byte chunks, but only found %d. (Length %d)",
-                   orig_n_to_skip, (int)freelists[i].alloc_size,
-                   orig_n_to_skip-n_to_skip, freelists[i].cur_length);
-          assert_freelist_ok(&freelists[i]);
-          goto done;
-        }
-        // tor_assert((*chp)->next);
-        chp = &(*chp)->next;
-        --n_to_skip;
+  for (i = 0; size_classes[i].alloc_size; ++i) {
+    chunk_size_class_t *sc = &size_classes[i];
+    if (!sc->pool)
+      continue;
+    if (free_all) {
+      mp_pool_clean(sc->pool, 0, 0);
+      if (!sc->n_in_use) {
+        mp_pool_destroy(sc->pool);
+        sc->pool = NULL;
       }
-      chunk = *chp;
-      *chp = NULL;
-      while (chunk) {
-        chunk_t *next = chunk->next;
-        tor_free(chunk);
-        chunk = next;
-        --n_to_free;
-        ++n_freed;
-        ++freelists[i].n_free;
-      }
-      if (n_to_free) {
-        log_warn(LD_BUG, "Freelist length for %d-byte chunks may have been "
-                 "messed up somehow.", (int)freelists[i].alloc_size);
-        log_warn(LD_BUG, "There were %d chunks at the start.  I decided to "
-                 "keep %d. I wanted to free %d.  I freed %d.  I somehow think "
-                 "I have %d left to free.",
-                 freelists[i].cur_length, n_to_skip, orig_n_to_free,
-                 n_freed, n_to_free);
-      }
-      // tor_assert(!n_to_free);
-      freelists[i].cur_length = new_length;
-      log_info(LD_MM, "Cleaned freelist for %d-byte chunks: original "
-               "length %d, kept %d, dropped %d.",
-               (int)freelists[i].alloc_size, orig_length,
-               orig_n_to_skip, orig_n_to_free);
+    } else {
+      mp_pool_clean(sc->pool, sc->low_water, 1);
     }
-    freelists[i].lowest_length = freelists[i].cur_length;
-    assert_freelist_ok(&freelists[i]);
+    if (sc->pool)
+      mp_pool_assert_ok(sc->pool);
+    sc->peak_in_use = sc->n_in_use;
   }
- done:
   enable_control_logging();
 #else
   (void) free_all;
 #endif
 }
 
-/** Describe the current status of the freelists at log level <b>severity</b>.
+/** Describe the current status of the chunk size classes at log level
+ * <b>severity</b>.
  */
 void
 buf_dump_freelist_sizes(int severity)
 {
 #ifdef ENABLE_BUF_FREELISTS
   int i;
-  log(severity, LD_MM, "====== Buffer freelists:");
-  for (i = 0; freelists[i].alloc_size; ++i) {
-    uint64_t total = ((uint64_t)freelists[i].cur_length) *
-      freelists[i].alloc_size;
+  log(severity, LD_MM, "====== Buffer chunk pools:");
+  for (i = 0; size_classes[i].alloc_size; ++i) {
+    const chunk_size_class_t *sc = &size_classes[i];
+    mp_pool_stats_t stats;
+    if (sc->pool)
+      mp_pool_get_stats(sc->pool, &stats);
+    else
+      memset(&stats, 0, sizeof(stats));
     log(severity, LD_MM,
-        U64_FORMAT" bytes in %d %d-byte chunks ["U64_FORMAT
-        " misses; "U64_FORMAT" frees; "U64_FORMAT" hits]",
-        U64_PRINTF_ARG(total),
-        freelists[i].cur_length, (int)freelists[i].alloc_size,
-        U64_PRINTF_ARG(freelists[i].n_alloc),
-        U64_PRINTF_ARG(freelists[i].n_free),
-        U64_PRINTF_ARG(freelists[i].n_hit));
-  }
-  log(severity, LD_MM, U64_FORMAT" allocations in non-freelist sizes",
-      U64_PRINTF_ARG(n_freelist_miss));
+        U64_FORMAT" bytes in %d slabs for %d %d-byte chunks "
+        "(%d empty slabs; peak %d chunks) ["U64_FORMAT" allocations; "
+        U64_FORMAT" frees]",
+        U64_PRINTF_ARG(stats.bytes_allocated),
+        stats.n_empty_chunks+stats.n_used_chunks+stats.n_full_chunks,
+        sc->n_in_use, (int)sc->alloc_size, stats.n_empty_chunks,
+        sc->peak_in_use, U64_PRINTF_ARG(sc->n_alloc),
+        U64_PRINTF_ARG(sc->n_free));
+  }
+  log(severity, LD_MM, U64_FORMAT" allocations in non-pooled sizes",
+      U64_PRINTF_ARG(n_size_class_miss));
+#endif
+  log(severity, LD_MM, "Buffers have allocated "U64_FORMAT" chunks ("
+      U64_FORMAT" bytes), freed "U64_FORMAT", and copied "U64_FORMAT
+      " bytes.",
+      U64_PRINTF_ARG(buf_stats.n_chunks_allocated),
+      U64_PRINTF_ARG(buf_stats.n_bytes_allocated),
+      U64_PRINTF_ARG(buf_stats.n_chunks_freed),
+      U64_PRINTF_ARG(buf_stats.n_bytes_copied));
+}
+
+/** Set *<b>out</b> to the running totals of how many chunks our buffers
+ * have allocated and freed, and how many bytes they've copied. */
+void
+buf_get_stats(buf_stats_t *out)
+{
+  memcpy(out, &buf_stats, sizeof(buf_stats_t));
+}
+
+/** Return a newly allocated string describing the chunk size classes, one
+ * line per class, for use by the controller. */
+char *
+buf_get_chunk_pool_stats(void)
+{
+#ifdef ENABLE_BUF_FREELISTS
+  smartlist_t *lines = smartlist_create();
+  char *result;
+  int i;
+  for (i = 0; size_classes[i].alloc_size; ++i) {
+    const chunk_size_class_t *sc = &size_classes[i];
+    mp_pool_stats_t stats;
+    char *line;
+    if (sc->pool)
+      mp_pool_get_stats(sc->pool, &stats);
+    else
+      memset(&stats, 0, sizeof(stats));
+    tor_asprintf(&line,
+        "%d in-use=%d peak=%d slabs=%d empty-slabs=%d slab-bytes="U64_FORMAT
+        " allocations="U64_FORMAT" frees="U64_FORMAT"\n",
+        (int)sc->alloc_size, sc->n_in_use, sc->peak_in_use,
+        stats.n_empty_chunks+stats.n_used_chunks+stats.n_full_chunks,
+        stats.n_empty_chunks, U64_PRINTF_ARG(stats.bytes_allocated),
+        U64_PRINTF_ARG(sc->n_alloc), U64_PRINTF_ARG(sc->n_free));
+    smartlist_add(lines, line);
+  }
+  tor_asprintf(&result, "other allocations="U64_FORMAT"\n",
+               U64_PRINTF_ARG(n_size_class_miss));
+  smartlist_add(lines, result);
+  result = smartlist_join_strings(lines, "", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
 #else
-  (void)severity;
+  return tor_strdup("");
 #endif
 }
 
@@ -367,15 +485,36 @@ struct buf_t {
                               * this for this buffer. */
   chunk_t *head; /**< First chunk in the list, or NULL for none. */
   chunk_t *tail; /**< Last chunk in the list, or NULL for none. */
+
+  /** How many bytes at the start of this buffer have we already searched
+   * for the end of an HTTP header, without finding it? */
+  size_t http_scan_pos;
+  /** If nonzero, the length of the complete HTTP header (including its
+   * terminating CRLFCRLF) at the start of this buffer. */
+  size_t http_header_len;
+  /** If http_header_len is set, the Content-Length of the HTTP message at
+   * the start of this buffer, or -1 if it had none. */
+  int http_content_len;
 };
 
+/** Forget any partial HTTP parsing state for <b>buf</b>; we call this
+ * whenever data is removed from the front of the buffer, since the cached
+ * offsets no longer mean anything then. */
+static INLINE void
+buf_http_state_clear(buf_t *buf)
+{
+  buf->http_scan_pos = 0;
+  buf->http_header_len = 0;
+  buf->http_content_len = 0;
+}
+
 /** Collapse data from the first N chunks from <b>buf</b> into buf->head,
  * growing it as necessary, until buf->head has the first <b>bytes</b> bytes
  * of data from the buffer, or until buf->head has all the data in <b>buf</b>.
  *
  * If <b>nulterminate</b> is true, ensure that there is a 0 byte in
  * buf->head->mem right after all the data. */
-static void
+void
 buf_pullup(buf_t *buf, size_t bytes, int nulterminate)
 {
   chunk_t *dest, *src;
@@ -387,6 +526,17 @@ buf_pullup(buf_t *buf, size_t bytes, int nulterminate)
   if (buf->datalen < bytes)
     bytes = buf->datalen;
 
+  if (CHUNK_IS_REF(buf->head) &&
+      (nulterminate || buf->head->datalen < bytes)) {
+    /* We're going to write into the head chunk, so it has to be ours. */
+    chunk_t *newhead = chunk_copy(buf->head);
+    newhead->next = buf->head->next;
+    if (buf->tail == buf->head)
+      buf->tail = newhead;
+    chunk_free_unchecked(buf->head);
+    buf->head = newhead;
+  }
+
   if (nulterminate) {
     capacity = bytes + 1;
     if (buf->head->datalen >= bytes && CHUNK_REMAINING_CAPACITY(buf->head)) {
@@ -425,7 +575,8 @@ buf_pullup(buf_t *buf, size_t bytes, int nulterminate)
     size_t n = bytes - dest->datalen;
     src = dest->next;
     tor_assert(src);
-    if (n > src->datalen) {
+    if (n >= src->datalen) {
+      NOTE_COPY(src->datalen);
       memcpy(CHUNK_WRITE_PTR(dest), src->data, src->datalen);
       dest->datalen += src->datalen;
       dest->next = src->next;
@@ -433,6 +584,7 @@ buf_pullup(buf_t *buf, size_t bytes, int nulterminate)
         buf->tail = dest;
       chunk_free_unchecked(src);
     } else {
+      NOTE_COPY(n);
       memcpy(CHUNK_WRITE_PTR(dest), src->data, n);
       dest->datalen += n;
       src->data += n;
@@ -463,6 +615,8 @@ static INLINE void
 buf_remove_from_front(buf_t *buf, size_t n)
 {
   tor_assert(buf->datalen >= n);
+  if (n)
+    buf_http_state_clear(buf);
   while (n) {
     tor_assert(buf->head);
     if (buf->head->datalen > n) {
@@ -509,6 +663,7 @@ buf_clear(buf_t *buf)
 {
   chunk_t *chunk, *next;
   buf->datalen = 0;
+  buf_http_state_clear(buf);
   for (chunk = buf->head; chunk; chunk = next) {
     next = chunk->next;
     chunk_free_unchecked(chunk);
@@ -535,6 +690,39 @@ buf_allocation(const buf_t *buf)
   return total;
 }
 
+/** Return the total number of bytes allocated for the chunks of all
+ * buffers. */
+size_t
+buf_get_total_allocation(void)
+{
+  return total_bytes_allocated_in_chunks;
+}
+
+/** Set *<b>stats_out</b> to the totals, across all chunk size classes, of
+ * the memory pools that buffer chunks come from. */
+void
+buf_get_pool_stats(struct mp_pool_stats_t *stats_out)
+{
+#ifdef ENABLE_BUF_FREELISTS
+  int i;
+  mp_pool_stats_t stats;
+#endif
+  memset(stats_out, 0, sizeof(*stats_out));
+#ifdef ENABLE_BUF_FREELISTS
+  for (i = 0; size_classes[i].alloc_size; ++i) {
+    if (!size_classes[i].pool)
+      continue;
+    mp_pool_get_stats(size_classes[i].pool, &stats);
+    stats_out->n_empty_chunks += stats.n_empty_chunks;
+    stats_out->n_used_chunks += stats.n_used_chunks;
+    stats_out->n_full_chunks += stats.n_full_chunks;
+    stats_out->n_items_used += stats.n_items_used;
+    stats_out->bytes_allocated += stats.bytes_allocated;
+    stats_out->bytes_used += stats.bytes_used;
+  }
+#endif
+}
+
 /** Return the number of bytes that can be added to <b>buf</b> without
  * performing any additional allocation. */
 size_t
@@ -562,12 +750,23 @@ buf_free(buf_t *buf)
 static chunk_t *
 chunk_copy(const chunk_t *in_chunk)
 {
-  chunk_t *newch = tor_memdup(in_chunk, CHUNK_ALLOC_SIZE(in_chunk->memlen));
-  newch->next = NULL;
-  if (in_chunk->data) {
-    off_t offset = in_chunk->data - in_chunk->mem;
-    newch->data = newch->mem + offset;
+  chunk_t *newch;
+  off_t offset;
+  if (CHUNK_IS_REF(in_chunk)) {
+    /* Copies of reference chunks own their data. */
+    newch = chunk_new_with_alloc_size(
+                               preferred_chunk_size(in_chunk->datalen));
+    newch->datalen = in_chunk->datalen;
+    NOTE_COPY(in_chunk->datalen);
+    memcpy(newch->data, in_chunk->data, in_chunk->datalen);
+    return newch;
   }
+  newch = chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(in_chunk->memlen));
+  offset = in_chunk->data - in_chunk->mem;
+  newch->data = newch->mem + offset;
+  newch->datalen = in_chunk->datalen;
+  NOTE_COPY(in_chunk->datalen);
+  memcpy(newch->data, in_chunk->data, in_chunk->datalen);
   return newch;
 }
 
@@ -672,6 +871,92 @@ read_to_chunk_tls(buf_t *buf, chunk_t *chunk, tor_tls_t *tls,
   return read_result;
 }
 
+#ifdef USE_VECTORED_IO
+/** As read_to_chunk(), but read up to <b>at_most</b> bytes from <b>fd</b>
+ * with a single readv() call that covers the free space at the end of
+ * <b>buf</b>'s tail chunk and as many new chunks as we need (up to
+ * MAX_IOVECS).  Chunks that received no data are freed again afterwards.
+ * Set *<b>readlen_out</b> to the number of bytes we tried to read. */
+static INLINE int
+read_to_buf_vectored(buf_t *buf, tor_socket_t fd, size_t at_most,
+                     size_t *readlen_out, int *reached_eof,
+                     int *socket_error)
+{
+  struct iovec iov[MAX_IOVECS];
+  chunk_t *chunks[MAX_IOVECS];
+  chunk_t *old_tail = buf->tail;
+  ssize_t read_result;
+  size_t readlen = 0, left;
+  int n_iov = 0, i;
+
+  if (old_tail && CHUNK_REMAINING_CAPACITY(old_tail) >= MIN_READ_LEN) {
+    chunks[n_iov] = old_tail;
+    iov[n_iov].iov_base = CHUNK_WRITE_PTR(old_tail);
+    iov[n_iov].iov_len = CHUNK_REMAINING_CAPACITY(old_tail);
+    if (iov[n_iov].iov_len > at_most)
+      iov[n_iov].iov_len = at_most;
+    readlen += iov[n_iov].iov_len;
+    ++n_iov;
+  }
+  while (readlen < at_most && n_iov < MAX_IOVECS) {
+    chunk_t *chunk = buf_add_chunk_with_capacity(buf, at_most - readlen, 1);
+    chunks[n_iov] = chunk;
+    iov[n_iov].iov_base = CHUNK_WRITE_PTR(chunk);
+    iov[n_iov].iov_len = CHUNK_REMAINING_CAPACITY(chunk);
+    if (iov[n_iov].iov_len > at_most - readlen)
+      iov[n_iov].iov_len = at_most - readlen;
+    readlen += iov[n_iov].iov_len;
+    ++n_iov;
+  }
+  *readlen_out = readlen;
+
+  read_result = readv(fd, iov, n_iov);
+
+  /* Hand the bytes we got to the chunks that got them, then drop any
+   * chunks we added that are still empty: only the tail may be empty. */
+  left = read_result > 0 ? (size_t)read_result : 0;
+  buf->datalen += left;
+  for (i = 0; i < n_iov && left; ++i) {
+    size_t n = iov[i].iov_len < left ? iov[i].iov_len : left;
+    chunks[i]->datalen += n;
+    left -= n;
+  }
+  if (buf->tail != old_tail) {
+    chunk_t *keep = old_tail, *chunk, *next;
+    if (i > 0 && chunks[i-1] != old_tail)
+      keep = chunks[i-1];
+    chunk = keep ? keep->next : buf->head;
+    for ( ; chunk; chunk = next) {
+      next = chunk->next;
+      chunk_free_unchecked(chunk);
+    }
+    if (keep)
+      keep->next = NULL;
+    else
+      buf->head = NULL;
+    buf->tail = keep;
+  }
+
+  if (read_result < 0) {
+    int e = tor_socket_errno(fd);
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      *socket_error = e;
+      return -1;
+    }
+    return 0; /* would block. */
+  } else if (read_result == 0) {
+    log_debug(LD_NET,"Encountered eof on fd %d", (int)fd);
+    *reached_eof = 1;
+    return 0;
+  } else { /* actually got bytes. */
+    log_debug(LD_NET,"Read %ld bytes into %d chunks. %d on inbuf.",
+              (long)read_result, i, (int)buf->datalen);
+    tor_assert(read_result < INT_MAX);
+    return (int)read_result;
+  }
+}
+#endif
+
 /** Read from socket <b>s</b>, writing onto end of <b>buf</b>.  Read at most
  * <b>at_most</b> bytes, growing the buffer as necessary.  If recv() returns 0
  * (because of EOF), set *<b>reached_eof</b> to 1 and return 0. Return -1 on
@@ -692,6 +977,20 @@ read_to_buf(tor_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
   tor_assert(reached_eof);
   tor_assert(s >= 0);
 
+#ifdef USE_VECTORED_IO
+  while (at_most > total_read) {
+    size_t readlen;
+    r = read_to_buf_vectored(buf, s, at_most - total_read, &readlen,
+                             reached_eof, socket_error);
+    check();
+    if (r < 0)
+      return r; /* Error */
+    tor_assert(total_read+r < INT_MAX);
+    total_read += r;
+    if ((size_t)r < readlen) /* eof, block, or no more to read. */
+      break;
+  }
+#else
   while (at_most > total_read) {
     size_t readlen = at_most - total_read;
     chunk_t *chunk;
@@ -716,6 +1015,7 @@ read_to_buf(tor_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
       break;
     }
   }
+#endif
   return (int)total_read;
 }
 
@@ -806,6 +1106,52 @@ flush_chunk(tor_socket_t s, buf_t *buf, chunk_t *chunk, size_t sz,
   }
 }
 
+#ifdef USE_VECTORED_IO
+/** Helper for flush_buf(): try to write <b>sz</b> bytes from the first
+ * chunks of <b>buf</b> (up to MAX_IOVECS of them) onto socket <b>s</b> with
+ * a single writev() call.  Set *<b>writelen_out</b> to the number of bytes
+ * we tried to write.  Otherwise behaves as flush_chunk().
+ */
+static INLINE int
+flush_chunks_vectored(tor_socket_t s, buf_t *buf, size_t sz,
+                      size_t *writelen_out, size_t *buf_flushlen)
+{
+  struct iovec iov[MAX_IOVECS];
+  chunk_t *chunk;
+  ssize_t write_result;
+  size_t writelen = 0;
+  int n_iov = 0;
+
+  for (chunk = buf->head; chunk && writelen < sz && n_iov < MAX_IOVECS;
+       chunk = chunk->next) {
+    size_t n = chunk->datalen;
+    if (n > sz - writelen)
+      n = sz - writelen;
+    iov[n_iov].iov_base = chunk->data;
+    iov[n_iov].iov_len = n;
+    writelen += n;
+    ++n_iov;
+  }
+  *writelen_out = writelen;
+
+  write_result = writev(s, iov, n_iov);
+
+  if (write_result < 0) {
+    int e = tor_socket_errno(s);
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      return -1;
+    }
+    log_debug(LD_NET,"write() would block, returning.");
+    return 0;
+  } else {
+    *buf_flushlen -= write_result;
+    buf_remove_from_front(buf, write_result);
+    tor_assert(write_result < INT_MAX);
+    return (int)write_result;
+  }
+}
+#endif
+
 /** Helper for flush_buf_tls(): try to write <b>sz</b> bytes from chunk
  * <b>chunk</b> of buffer <b>buf</b> onto socket <b>s</b>.  (Tries to write
  * more if there is a forced pending write size.)  On success, deduct the
@@ -866,12 +1212,16 @@ flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen)
   while (sz) {
     size_t flushlen0;
     tor_assert(buf->head);
+#ifdef USE_VECTORED_IO
+    r = flush_chunks_vectored(s, buf, sz, &flushlen0, buf_flushlen);
+#else
     if (buf->head->datalen >= sz)
       flushlen0 = sz;
     else
       flushlen0 = buf->head->datalen;
 
     r = flush_chunk(s, buf, buf->head, flushlen0, buf_flushlen);
+#endif
     check();
     if (r < 0)
       return r;
@@ -884,8 +1234,21 @@ flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen)
   return (int)flushed;
 }
 
+/** When CoalesceTLSWrites is set, try to hand this many bytes at a time to
+ * each TLS write: close to the largest TLS record, while still fitting in a
+ * 16K chunk allocation. */
+#define TLS_COALESCE_BYTES CHUNK_SIZE_WITH_ALLOC(16384)
+
 /** As flush_buf(), but writes data to a TLS connection.  Can write more than
  * <b>flushlen</b> bytes.
+ *
+ * If the kernel is doing the TLS record layer for <b>tls</b>, we skip
+ * OpenSSL and hand our chunks to the socket with flush_buf().
+ *
+ * If CoalesceTLSWrites is set, and the first chunk holds less than we are
+ * allowed to flush, first pull data from the following chunks into it, so
+ * that we emit one large TLS record rather than one per chunk.  We only
+ * coalesce data that is already waiting, so this never delays a write.
  */
 int
 flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
@@ -903,6 +1266,27 @@ flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
    * have a partial record pending */
   check_no_tls_errors();
 
+  {
+    int s = tor_tls_get_kernel_send_socket(tls);
+    if (s >= 0) {
+      r = flush_buf(s, buf, flushlen, buf_flushlen);
+      if (r < 0)
+        return TOR_TLS_ERROR_IO;
+      tor_tls_note_kernel_write(tls, r);
+      return r;
+    }
+  }
+
+  if (get_options()->CoalesceTLSWrites && buf->head &&
+      buf->head->datalen < flushlen && buf->head->datalen < buf->datalen) {
+    size_t want = flushlen, forced = tor_tls_get_forced_write_size(tls);
+    if (want > TLS_COALESCE_BYTES)
+      want = TLS_COALESCE_BYTES;
+    if (want < forced)
+      want = forced;
+    buf_pullup(buf, want, 0);
+  }
+
   check();
   do {
     size_t flushlen0;
@@ -948,6 +1332,7 @@ write_to_buf(const char *string, size_t string_len, buf_t *buf)
     copy = CHUNK_REMAINING_CAPACITY(buf->tail);
     if (copy > string_len)
       copy = string_len;
+    NOTE_COPY(copy);
     memcpy(CHUNK_WRITE_PTR(buf->tail), string, copy);
     string_len -= copy;
     string += copy;
@@ -960,6 +1345,53 @@ write_to_buf(const char *string, size_t string_len, buf_t *buf)
   return (int)buf->datalen;
 }
 
+/** Append <b>len</b> bytes at <b>data</b> to the end of <b>buf</b> without
+ * copying them: the buffer refers to <b>data</b> until it has flushed or
+ * discarded those bytes, and then calls <b>release_fn</b>(<b>arg</b>).
+ * The caller must keep <b>data</b> unchanged until then.
+ *
+ * Return the new length of the buffer on success, -1 on failure.
+ */
+int
+write_to_buf_ref(const char *data, size_t len, buf_t *buf,
+                 void (*release_fn)(void *), void *arg)
+{
+  chunk_t *chunk;
+  chunk_ref_t ref;
+  if (!len) {
+    release_fn(arg);
+    return (int)buf->datalen;
+  }
+  check();
+
+  ref.release_fn = release_fn;
+  ref.arg = arg;
+  chunk = tor_malloc(CHUNK_ALLOC_SIZE(sizeof(ref)));
+  memcpy(chunk->mem, &ref, sizeof(ref));
+  chunk->next = NULL;
+  chunk->memlen = 0;
+  chunk->data = (char *)data;
+  chunk->datalen = len;
+
+  if (buf->tail && !buf->tail->datalen) {
+    /* Only the tail may be empty; drop it before it stops being one. */
+    tor_assert(buf->head == buf->tail);
+    chunk_free_unchecked(buf->head);
+    buf->head = buf->tail = NULL;
+  }
+  if (buf->tail) {
+    buf->tail->next = chunk;
+    buf->tail = chunk;
+  } else {
+    buf->head = buf->tail = chunk;
+  }
+  buf->datalen += len;
+
+  check();
+  tor_assert(buf->datalen < INT_MAX);
+  return (int)buf->datalen;
+}
+
 /** Helper: copy the first <b>string_len</b> bytes from <b>buf</b>
  * onto <b>string</b>.
  */
@@ -979,6 +1411,7 @@ peek_from_buf(char *string, size_t string_len, const buf_t *buf)
     tor_assert(chunk);
     if (chunk->datalen < copy)
       copy = chunk->datalen;
+    NOTE_COPY(copy);
     memcpy(string, chunk->data, copy);
     string_len -= copy;
     string += copy;
@@ -1006,6 +1439,36 @@ fetch_from_buf(char *string, size_t string_len, buf_t *buf)
   return (int)buf->datalen;
 }
 
+/** Return a pointer to the first <b>n</b> bytes of <b>buf</b>, arranged as
+ * a contiguous string, without removing them from <b>buf</b>.  If they all
+ * fit in the first chunk of <b>buf</b>, the pointer is into that chunk;
+ * otherwise, we copy them into <b>tmp</b>, which must have room for
+ * <b>n</b> bytes, and return <b>tmp</b>.  Either way, the pointer is only
+ * valid until <b>buf</b> is next modified.  <b>n</b> must be \<= the number
+ * of bytes on the buffer.
+ */
+const char *
+buf_peek_contiguous(const buf_t *buf, size_t n, char *tmp)
+{
+  tor_assert(n <= buf->datalen);
+  if (n == 0)
+    return tmp;
+  if (buf->head->datalen >= n)
+    return buf->head->data;
+  peek_from_buf(tmp, n, buf);
+  return tmp;
+}
+
+/** Remove the first <b>n</b> bytes from <b>buf</b> without copying them
+ * anywhere.  <b>n</b> must be \<= the number of bytes on the buffer. */
+void
+buf_drain(buf_t *buf, size_t n)
+{
+  check();
+  buf_remove_from_front(buf, n);
+  check();
+}
+
 /** True iff the cell command <b>command</b> is one that implies a
  * variable-length cell in Tor link protocol <b>linkproto</b>. */
 static inline int
@@ -1158,29 +1621,85 @@ fetch_var_cell_from_evbuffer(struct evbuffer *buf, var_cell_t **out,
 }
 #endif
 
+/** Helper for move_buf_to_buf(): return true iff we should move the first
+ * chunk of <b>buf_in</b> onto <b>buf_out</b> by pointer rather than copying
+ * its contents, given that we want to move <b>len</b> more bytes. */
+static INLINE int
+buf_should_steal_head_chunk(const buf_t *buf_out, const buf_t *buf_in,
+                            size_t len)
+{
+  const chunk_t *chunk = buf_in->head, *tail = buf_out->tail;
+  if (chunk->datalen > len)
+    return 0; /* We only want part of this chunk. */
+  if (!tail)
+    return 1;
+  if (!tail->datalen && tail != buf_out->head)
+    return 0; /* Only the tail may be empty, and we can't unlink it cheaply. */
+  /* Copying is cheaper than wasting the rest of buf_out's tail. */
+  return CHUNK_REMAINING_CAPACITY(tail) < chunk->datalen;
+}
+
+/** Helper for move_buf_to_buf(): unlink the first chunk of <b>buf_in</b> and
+ * append it to the end of <b>buf_out</b> without copying its data. */
+static INLINE void
+buf_steal_head_chunk(buf_t *buf_out, buf_t *buf_in)
+{
+  chunk_t *chunk = buf_in->head;
+  tor_assert(chunk);
+
+  buf_in->head = chunk->next;
+  if (buf_in->tail == chunk)
+    buf_in->tail = NULL;
+  buf_in->datalen -= chunk->datalen;
+  buf_http_state_clear(buf_in);
+  chunk->next = NULL;
+
+  if (buf_out->tail && !buf_out->tail->datalen) {
+    /* An empty chunk can only be the tail, so drop it before it stops being
+     * one. */
+    tor_assert(buf_out->head == buf_out->tail);
+    chunk_free_unchecked(buf_out->head);
+    buf_out->head = buf_out->tail = NULL;
+  }
+  if (buf_out->tail) {
+    buf_out->tail->next = chunk;
+    buf_out->tail = chunk;
+  } else {
+    buf_out->head = buf_out->tail = chunk;
+  }
+  buf_out->datalen += chunk->datalen;
+}
+
 /** Move up to *<b>buf_flushlen</b> bytes from <b>buf_in</b> to
  * <b>buf_out</b>, and modify *<b>buf_flushlen</b> appropriately.
  * Return the number of bytes actually copied.
+ *
+ * Whole chunks are relinked from one buffer to the other; we only copy a
+ * partial chunk at the end of the range, or a chunk small enough to fit into
+ * the free space at the end of <b>buf_out</b>.
  */
 int
 move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
 {
-  /* We can do way better here, but this doesn't turn up in any profiles. */
-  char b[4096];
   size_t cp, len;
   len = *buf_flushlen;
   if (len > buf_in->datalen)
     len = buf_in->datalen;
 
-  cp = len; /* Remember the number of bytes we intend to copy. */
+  cp = len; /* Remember the number of bytes we intend to move. */
   tor_assert(cp < INT_MAX);
   while (len) {
-    /* This isn't the most efficient implementation one could imagine, since
-     * it does two copies instead of 1, but I kinda doubt that this will be
-     * critical path. */
-    size_t n = len > sizeof(b) ? sizeof(b) : len;
-    fetch_from_buf(b, n, buf_in);
-    write_to_buf(b, n, buf_out);
+    size_t n;
+    tor_assert(buf_in->head);
+    n = buf_in->head->datalen;
+    if (buf_should_steal_head_chunk(buf_out, buf_in, len)) {
+      buf_steal_head_chunk(buf_out, buf_in);
+    } else {
+      if (n > len)
+        n = len;
+      write_to_buf(buf_in->head->data, n, buf_out);
+      buf_remove_from_front(buf_in, n);
+    }
     len -= n;
   }
   *buf_flushlen -= cp;
@@ -1203,6 +1722,24 @@ buf_pos_init(const buf_t *buf, buf_pos_t *out)
   out->chunk_pos = 0;
 }
 
+/** Initialize <b>out</b> to point to the character at offset <b>offset</b>
+ * of <b>buf</b>.  Return 0 on success, or -1 if <b>buf</b> holds no more
+ * than <b>offset</b> bytes. */
+static int
+buf_pos_init_at(const buf_t *buf, size_t offset, buf_pos_t *out)
+{
+  buf_pos_init(buf, out);
+  if (offset >= buf->datalen)
+    return -1;
+  while (offset >= out->chunk->datalen) {
+    offset -= out->chunk->datalen;
+    out->chunk_pos += out->chunk->datalen;
+    out->chunk = out->chunk->next;
+  }
+  out->pos = (int)offset;
+  return 0;
+}
+
 /** Advance <b>out</b> to the first appearance of <b>ch</b> at the current
  * position of <b>out</b>, or later.  Return -1 if no instances are found;
  * otherwise returns the absolute position of the character. */
@@ -1277,13 +1814,16 @@ buf_matches_at_pos(const buf_pos_t *pos, const char *s, size_t n)
   }
 }
 
-/** Return the first position in <b>buf</b> at which the <b>n</b>-character
- * string <b>s</b> occurs, or -1 if it does not occur. */
-/*private*/ int
-buf_find_string_offset(const buf_t *buf, const char *s, size_t n)
+/** Return the first position at or after <b>start</b> in <b>buf</b> at which
+ * the <b>n</b>-character string <b>s</b> occurs, or -1 if it does not occur
+ * there. */
+static int
+buf_find_string_offset_from(const buf_t *buf, size_t start,
+                            const char *s, size_t n)
 {
   buf_pos_t pos;
-  buf_pos_init(buf, &pos);
+  if (buf_pos_init_at(buf, start, &pos) < 0)
+    return -1;
   while (buf_find_pos_of_char(*s, &pos) >= 0) {
     if (buf_matches_at_pos(&pos, s, n)) {
       tor_assert(pos.chunk_pos + pos.pos < INT_MAX);
@@ -1296,6 +1836,14 @@ buf_find_string_offset(const buf_t *buf, const char *s, size_t n)
   return -1;
 }
 
+/** Return the first position in <b>buf</b> at which the <b>n</b>-character
+ * string <b>s</b> occurs, or -1 if it does not occur. */
+/*private*/ int
+buf_find_string_offset(const buf_t *buf, const char *s, size_t n)
+{
+  return buf_find_string_offset_from(buf, 0, s, n);
+}
+
 /** There is a (possibly incomplete) http statement on <b>buf</b>, of the
  * form "\%s\\r\\n\\r\\n\%s", headers, body. (body may contain NULs.)
  * If a) the headers include a Content-Length field and all bytes in
@@ -1329,20 +1877,28 @@ fetch_from_buf_http(buf_t *buf,
   if (!buf->head)
     return 0;
 
-  crlf_offset = buf_find_string_offset(buf, "\r\n\r\n", 4);
-  if (crlf_offset > (int)max_headerlen ||
-      (crlf_offset < 0 && buf->datalen > max_headerlen)) {
-    log_debug(LD_HTTP,"headers too long.");
-    return -1;
-  } else if (crlf_offset < 0) {
-    log_debug(LD_HTTP,"headers not all here yet.");
-    return 0;
+  if (!buf->http_header_len) {
+    /* Resume the search where we left off last time, backing up far enough
+     * to catch a CRLFCRLF that straddles the old end of the data. */
+    size_t start = buf->http_scan_pos > 3 ? buf->http_scan_pos - 3 : 0;
+    crlf_offset = buf_find_string_offset_from(buf, start, "\r\n\r\n", 4);
+    if (crlf_offset > (int)max_headerlen ||
+        (crlf_offset < 0 && buf->datalen > max_headerlen)) {
+      log_debug(LD_HTTP,"headers too long.");
+      return -1;
+    } else if (crlf_offset < 0) {
+      buf->http_scan_pos = buf->datalen;
+      log_debug(LD_HTTP,"headers not all here yet.");
+      return 0;
+    }
+    headerlen = crlf_offset + 4;
+  } else {
+    headerlen = buf->http_header_len;
   }
   /* Okay, we have a full header.  Make sure it all appears in the first
    * chunk. */
-  if ((int)buf->head->datalen < crlf_offset + 4)
-    buf_pullup(buf, crlf_offset+4, 0);
-  headerlen = crlf_offset + 4;
+  if (buf->head->datalen < headerlen)
+    buf_pullup(buf, headerlen, 0);
 
   headers = buf->head->data;
   bodylen = buf->datalen - headerlen;
@@ -1359,18 +1915,29 @@ fetch_from_buf_http(buf_t *buf,
     return -1;
   }
 
+  if (!buf->http_header_len) {
+    /* Only look for the Content-Length the first time we see the whole
+     * header; remember it for when we're waiting for the body. */
 #define CONTENT_LENGTH "\r\nContent-Length: "
-  p = (char*) tor_memstr(headers, headerlen, CONTENT_LENGTH);
-  if (p) {
-    int i;
-    i = atoi(p+strlen(CONTENT_LENGTH));
-    if (i < 0) {
-      log_warn(LD_PROTOCOL, "Content-Length is less than zero; it looks like "
-               "someone is trying to crash us.");
-      return -1;
+    p = (char*) tor_memstr(headers, headerlen, CONTENT_LENGTH);
+    if (p) {
+      int i;
+      i = atoi(p+strlen(CONTENT_LENGTH));
+      if (i < 0) {
+        log_warn(LD_PROTOCOL, "Content-Length is less than zero; it looks "
+                 "like someone is trying to crash us.");
+        return -1;
+      }
+      /* if content-length is malformed, then our body length is 0. fine. */
+      buf->http_content_len = i;
+    } else {
+      buf->http_content_len = -1;
     }
-    contentlen = i;
-    /* if content-length is malformed, then our body length is 0. fine. */
+    buf->http_header_len = headerlen;
+  }
+
+  if (buf->http_content_len >= 0) {
+    contentlen = buf->http_content_len;
     log_debug(LD_HTTP,"Got a contentlen of %d.",(int)contentlen);
     if (bodylen < contentlen) {
       if (!force_complete) {
@@ -1388,6 +1955,9 @@ fetch_from_buf_http(buf_t *buf,
     *headers_out = tor_malloc(headerlen+1);
     fetch_from_buf(*headers_out, headerlen, buf);
     (*headers_out)[headerlen] = 0; /* NUL terminate it */
+    /* The headers are gone, so anything else on the buffer is body. */
+    buf->http_scan_pos = buf->http_header_len = 0;
+    buf->http_content_len = 0;
   }
   if (body_out) {
     tor_assert(body_used);
@@ -2477,6 +3047,12 @@ assert_buf_ok(buf_t *buf)
     tor_assert(buf->tail);
     for (ch = buf->head; ch; ch = ch->next) {
       total += ch->datalen;
+      if (CHUNK_IS_REF(ch)) {
+        tor_assert(ch->datalen);
+        if (!ch->next)
+          tor_assert(ch == buf->tail);
+        continue;
+      }
       tor_assert(ch->datalen <= ch->memlen);
       tor_assert(ch->data >= &ch->mem[0]);
       tor_assert(ch->data < &ch->mem[0]+ch->memlen);
@@ -2487,24 +3063,3 @@ assert_buf_ok(buf_t *buf)
     tor_assert(buf->datalen == total);
   }
 }
-
-#ifdef ENABLE_BUF_FREELISTS
-/** Log an error and exit if <b>fl</b> is corrupted.
- */
-static void
-assert_freelist_ok(chunk_freelist_t *fl)
-{
-  chunk_t *ch;
-  int n;
-  tor_assert(fl->alloc_size > 0);
-  n = 0;
-  for (ch = fl->head; ch; ch = ch->next) {
-    tor_assert(CHUNK_ALLOC_SIZE(ch->memlen) == fl->alloc_size);
-    ++n;
-  }
-  tor_assert(n == fl->cur_length);
-  tor_assert(n >= fl->lowest_length);
-  tor_assert(n <= fl->max_length);
-}
-#endif
-
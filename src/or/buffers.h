@@ -20,10 +20,27 @@ buf_t *buf_copy(const buf_t *buf);
 void buf_shrink(buf_t *buf);
 void buf_shrink_freelists(int free_all);
 void buf_dump_freelist_sizes(int severity);
+char *buf_get_chunk_pool_stats(void);
+
+/** Running totals of how much work our buffers have done, for comparing
+ * changes to the buffer code. */
+typedef struct buf_stats_t {
+  uint64_t n_chunks_allocated; /**< How many chunks have we allocated? */
+  uint64_t n_chunks_freed; /**< How many chunks have we freed? */
+  uint64_t n_bytes_allocated; /**< Total size of the chunks we allocated. */
+  /** How many bytes have we copied into, out of, or within buffers?  This
+   * doesn't count bytes that came straight from the network or from
+   * zlib. */
+  uint64_t n_bytes_copied;
+} buf_stats_t;
+void buf_get_stats(buf_stats_t *out);
 
 size_t buf_datalen(const buf_t *buf);
 size_t buf_allocation(const buf_t *buf);
 size_t buf_slack(const buf_t *buf);
+size_t buf_get_total_allocation(void);
+struct mp_pool_stats_t;
+void buf_get_pool_stats(struct mp_pool_stats_t *stats_out);
 
 int read_to_buf(tor_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
                 int *socket_error);
@@ -33,10 +50,14 @@ int flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen);
 int flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t sz, size_t *buf_flushlen);
 
 int write_to_buf(const char *string, size_t string_len, buf_t *buf);
+int write_to_buf_ref(const char *data, size_t len, buf_t *buf,
+                     void (*release_fn)(void *), void *arg);
 int write_to_buf_zlib(buf_t *buf, tor_zlib_state_t *state,
                       const char *data, size_t data_len, int done);
 int move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen);
 int fetch_from_buf(char *string, size_t string_len, buf_t *buf);
+const char *buf_peek_contiguous(const buf_t *buf, size_t n, char *tmp);
+void buf_drain(buf_t *buf, size_t n);
 int fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto);
 int fetch_from_buf_http(buf_t *buf,
                         char **headers_out, size_t max_headerlen,
@@ -89,6 +110,7 @@ int generic_buffer_set_to_copy(generic_buffer_t **output,
 void assert_buf_ok(buf_t *buf);
 
 #ifdef BUFFERS_PRIVATE
+void buf_pullup(buf_t *buf, size_t bytes, int nulterminate);
 int buf_find_string_offset(const buf_t *buf, const char *s, size_t n);
 #endif
 
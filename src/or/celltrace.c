@@ -0,0 +1,207 @@
+/* Copyright (c) 2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file celltrace.c
+ * \brief Follow a sample of the cells we relay through our queues.
+ *
+ * When CellTraceSampleInterval is set, we pick one in every that many cells
+ * that we read from an OR connection, and note when we read it, when we put
+ * it on a circuit queue, and when we flushed it from that queue onto an OR
+ * connection.  The traces go into a fixed-size ring buffer, so the newest
+ * ones overwrite the oldest, and a controller can fetch them with the
+ * "cell-trace" GETINFO key.
+ *
+ * All of this happens in the main thread, so the ring buffer needs no
+ * locking.
+ **/
+
+#include "or.h"
+#include "celltrace.h"
+#include "config.h"
+
+/** How many cell traces do we remember? */
+#define CELL_TRACE_RING_SIZE 1024
+
+/** What we know about the path of one sampled cell through our queues. */
+typedef struct cell_trace_t {
+  /** Which trace is this?  0 if this slot has never been used. */
+  uint32_t id;
+  circid_t circ_id; /**< Circuit ID of the cell as we read it. */
+  uint8_t command; /**< Command of the cell as we read it. */
+  /** When did we read the cell, in microseconds since the epoch? */
+  uint64_t read_usec;
+  /** How many microseconds after reading the cell did we queue it?  -1 if we
+   * haven't queued it. */
+  int32_t queued_usec;
+  /** How many microseconds after reading the cell did we flush it?  -1 if we
+   * haven't flushed it. */
+  int32_t flushed_usec;
+} cell_trace_t;
+
+/** Ring buffer of recent cell traces.  Trace <i>id</i> lives in slot
+ * <i>id</i> % CELL_TRACE_RING_SIZE. */
+static cell_trace_t cell_traces[CELL_TRACE_RING_SIZE];
+/** The ID we'll give the next trace we start.  Never 0. */
+static uint32_t next_trace_id = 1;
+/** How many more cells do we read before we sample the next one? */
+static uint32_t cells_until_next_trace = 0;
+/** The ID of the trace for the cell we're handling right now, or 0 if we
+ * aren't tracing it. */
+static uint32_t current_trace_id = 0;
+
+/** Return the current time in microseconds since the epoch. */
+static uint64_t
+cell_trace_now_usec(void)
+{
+  struct timeval now;
+  tor_gettimeofday(&now);
+  return ((uint64_t)now.tv_sec) * 1000000 + now.tv_usec;
+}
+
+/** Return the trace with ID <b>id</b>, or NULL if it has been overwritten
+ * or <b>id</b> is 0. */
+static cell_trace_t *
+cell_trace_get(uint32_t id)
+{
+  cell_trace_t *trace;
+  if (!id)
+    return NULL;
+  trace = &cell_traces[id % CELL_TRACE_RING_SIZE];
+  return trace->id == id ? trace : NULL;
+}
+
+/** Return the number of microseconds between when we read the cell traced
+ * by <b>trace</b> and now, clipped to fit an int32_t. */
+static int32_t
+cell_trace_elapsed_usec(const cell_trace_t *trace)
+{
+  uint64_t now = cell_trace_now_usec();
+  if (now < trace->read_usec)
+    return 0;
+  if (now - trace->read_usec > INT32_MAX)
+    return INT32_MAX;
+  return (int32_t)(now - trace->read_usec);
+}
+
+/** We have just read <b>cell</b> from an OR connection, and we're about to
+ * process it.  If we're sampling cells and this is a cell we should sample,
+ * start a trace for it. */
+void
+cell_trace_note_read(const cell_t *cell)
+{
+  uint32_t interval = (uint32_t)get_options()->CellTraceSampleInterval;
+  cell_trace_t *trace;
+
+  current_trace_id = 0;
+  if (PREDICT_LIKELY(!interval))
+    return;
+  if (cells_until_next_trace) {
+    --cells_until_next_trace;
+    return;
+  }
+  cells_until_next_trace = interval - 1;
+
+  current_trace_id = next_trace_id++;
+  if (!next_trace_id)
+    next_trace_id = 1;
+  trace = &cell_traces[current_trace_id % CELL_TRACE_RING_SIZE];
+  trace->id = current_trace_id;
+  trace->circ_id = cell->circ_id;
+  trace->command = cell->command;
+  trace->read_usec = cell_trace_now_usec();
+  trace->queued_usec = trace->flushed_usec = -1;
+}
+
+/** We're done processing the cell we last passed to
+ * cell_trace_note_read(). */
+void
+cell_trace_done_processing(void)
+{
+  current_trace_id = 0;
+}
+
+/** We have just put <b>cell</b> on a circuit queue.  If it's the cell we
+ * are currently tracing, note the time and tag <b>cell</b> so we notice
+ * when it gets flushed. */
+void
+cell_trace_note_queued(packed_cell_t *cell)
+{
+  cell_trace_t *trace;
+  if (PREDICT_LIKELY(!current_trace_id))
+    return;
+  trace = cell_trace_get(current_trace_id);
+  /* Only the first cell we queue while handling a traced cell can be the
+   * traced cell itself; anything after that is a reply. */
+  current_trace_id = 0;
+  if (!trace)
+    return;
+  trace->queued_usec = cell_trace_elapsed_usec(trace);
+  cell->trace_id = trace->id;
+}
+
+/** We have just flushed <b>cell</b> from its circuit queue onto an OR
+ * connection.  If we were tracing it, note the time. */
+void
+cell_trace_note_flushed(const packed_cell_t *cell)
+{
+  cell_trace_t *trace;
+  if (PREDICT_LIKELY(!cell->trace_id))
+    return;
+  trace = cell_trace_get(cell->trace_id);
+  if (trace)
+    trace->flushed_usec = cell_trace_elapsed_usec(trace);
+}
+
+/** Return a newly allocated string listing the traces in our ring buffer,
+ * oldest first, one per line, in the form "id=N circ=C command=C
+ * read=SECONDS.USEC queued-usec=N flushed-usec=N".  Cells that haven't been
+ * queued or flushed (yet) have "-" for those times. */
+char *
+cell_trace_format(void)
+{
+  smartlist_t *lines = smartlist_create();
+  char *result;
+  uint32_t id, oldest;
+
+  oldest = next_trace_id > CELL_TRACE_RING_SIZE ?
+    next_trace_id - CELL_TRACE_RING_SIZE : 1;
+  for (id = oldest; id != next_trace_id; id = id + 1 ? id + 1 : 1) {
+    const cell_trace_t *trace = cell_trace_get(id);
+    char queued[16], flushed[16];
+    char *line;
+    if (!trace)
+      continue;
+    if (trace->queued_usec < 0)
+      strlcpy(queued, "-", sizeof(queued));
+    else
+      tor_snprintf(queued, sizeof(queued), "%d", (int)trace->queued_usec);
+    if (trace->flushed_usec < 0)
+      strlcpy(flushed, "-", sizeof(flushed));
+    else
+      tor_snprintf(flushed, sizeof(flushed), "%d", (int)trace->flushed_usec);
+    tor_asprintf(&line, "id=%u circ=%u command=%u read="U64_FORMAT".%06u "
+                 "queued-usec=%s flushed-usec=%s\n",
+                 (unsigned)trace->id, (unsigned)trace->circ_id,
+                 (unsigned)trace->command,
+                 U64_PRINTF_ARG(trace->read_usec / 1000000),
+                 (unsigned)(trace->read_usec % 1000000), queued, flushed);
+    smartlist_add(lines, line);
+  }
+
+  result = smartlist_join_strings(lines, "", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/** Forget all our cell traces, and start sampling again from scratch. */
+void
+cell_trace_clear(void)
+{
+  memset(cell_traces, 0, sizeof(cell_traces));
+  next_trace_id = 1;
+  cells_until_next_trace = 0;
+  current_trace_id = 0;
+}
+
@@ -0,0 +1,20 @@
+/* Copyright (c) 2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file celltrace.h
+ * \brief Header file for celltrace.c.
+ **/
+
+#ifndef _TOR_CELLTRACE_H
+#define _TOR_CELLTRACE_H
+
+void cell_trace_note_read(const cell_t *cell);
+void cell_trace_done_processing(void);
+void cell_trace_note_queued(packed_cell_t *cell);
+void cell_trace_note_flushed(const packed_cell_t *cell);
+char *cell_trace_format(void);
+void cell_trace_clear(void);
+
+#endif
+
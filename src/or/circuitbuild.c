@@ -104,6 +104,9 @@ typedef struct {
 
 /** A list of our chosen entry guards. */
 static smartlist_t *entry_guards = NULL;
+/** Map from identity digest to the first member of entry_guards with that
+ * identity. */
+static digestmap_t *entry_guards_by_id = NULL;
 /** A value of 1 means that the entry_guards list has changed
  * and those changes need to be flushed to disk. */
 static int entry_guards_dirty = 0;
@@ -114,17 +117,39 @@ static int unit_tests = 0;
 
 /********* END VARIABLES ************/
 
+/** Candidate nodes for every hop of the circuits in one batch, gathered
+ * once by path_batch_new() and shared by every circuit built with
+ * circuit_establish_circuit_from_batch(). */
+struct path_batch_t {
+  /** Purpose and CIRCLAUNCH_* flags of the circuits in this batch. */
+  uint8_t purpose;
+  int flags;
+  /** Number of hops each circuit should have. */
+  int route_len;
+  /** Nodes to pick exits from, and how to weight them. */
+  smartlist_t *exits;
+  bandwidth_weight_rule_t exit_rule;
+  /** Nodes to pick middle hops from. */
+  smartlist_t *middles;
+  /** Nodes to pick first hops from, and how to weight them; or NULL if we
+   * use entry guards. */
+  smartlist_t *entries;
+  bandwidth_weight_rule_t entry_rule;
+};
+
 static int circuit_deliver_create_cell(circuit_t *circ,
                                        uint8_t cell_type, const char *payload);
-static int onion_pick_cpath_exit(origin_circuit_t *circ, extend_info_t *exit);
+static int onion_pick_cpath_exit(origin_circuit_t *circ, extend_info_t *exit,
+                                 path_batch_t *batch);
 static crypt_path_t *onion_next_hop_in_cpath(crypt_path_t *cpath);
-static int onion_extend_cpath(origin_circuit_t *circ);
+static int onion_extend_cpath(origin_circuit_t *circ, path_batch_t *batch);
 static int count_acceptable_nodes(smartlist_t *routers);
 static int onion_append_hop(crypt_path_t **head_ptr, extend_info_t *choice);
 
 static void entry_guards_changed(void);
 
 static void bridge_free(bridge_info_t *bridge);
+static bridge_info_t *find_bridge_by_digest(const char *digest);
 
 /**
  * This function decides if CBT learning should be disabled. It returns
@@ -353,6 +378,7 @@ circuit_build_times_new_consensus_params(circuit_build_times_t *cbt,
                                          networkstatus_t *ns)
 {
   int32_t num = circuit_build_times_recent_circuit_count(ns);
+  int i;
 
   if (num > 0 && num != cbt->liveness.num_recent_circs) {
     int8_t *recent_circs;
@@ -387,6 +413,11 @@ circuit_build_times_new_consensus_params(circuit_build_times_t *cbt,
     tor_free(cbt->liveness.timeouts_after_firsthop);
     cbt->liveness.timeouts_after_firsthop = recent_circs;
     cbt->liveness.num_recent_circs = num;
+
+    /* Some of the slots we were counting may have been dropped. */
+    cbt->liveness.num_timeouts_after_firsthop = 0;
+    for (i = 0; i < num; i++)
+      cbt->liveness.num_timeouts_after_firsthop += recent_circs[i];
   }
 }
 
@@ -418,6 +449,105 @@ circuit_build_times_get_initial_timeout(void)
   return timeout;
 }
 
+/**
+ * Make sure <b>cbt</b>'s histogram has room for at least <b>nbins</b> bins.
+ */
+static void
+circuit_build_times_grow_histogram(circuit_build_times_t *cbt,
+                                   build_time_t nbins)
+{
+  build_time_t new_len;
+  if (nbins <= cbt->histogram_len)
+    return;
+
+  new_len = MAX(nbins, cbt->histogram_len*2);
+  cbt->histogram = tor_realloc(cbt->histogram, new_len*sizeof(uint32_t));
+  cbt->histogram_log_sum = tor_realloc(cbt->histogram_log_sum,
+                                       new_len*sizeof(double));
+  memset(cbt->histogram + cbt->histogram_len, 0,
+         (new_len - cbt->histogram_len)*sizeof(uint32_t));
+  memset(cbt->histogram_log_sum + cbt->histogram_len, 0,
+         (new_len - cbt->histogram_len)*sizeof(double));
+  cbt->histogram_len = new_len;
+}
+
+/**
+ * Forget every value counted in <b>cbt</b>'s histogram, without freeing it.
+ */
+static void
+circuit_build_times_clear_histogram(circuit_build_times_t *cbt)
+{
+  if (cbt->histogram_len) {
+    memset(cbt->histogram, 0, cbt->histogram_len*sizeof(uint32_t));
+    memset(cbt->histogram_log_sum, 0, cbt->histogram_len*sizeof(double));
+  }
+  cbt->abandoned_count = 0;
+  cbt->max_build_time = 0;
+  cbt->max_build_time_is_stale = 0;
+}
+
+/**
+ * Count the build time <b>time</b> in <b>cbt</b>'s histogram.
+ */
+static void
+circuit_build_times_histogram_add(circuit_build_times_t *cbt,
+                                  build_time_t time)
+{
+  build_time_t bin;
+  if (time == CBT_BUILD_ABANDONED) {
+    cbt->abandoned_count++;
+    return;
+  }
+
+  bin = time / CBT_BIN_WIDTH;
+  circuit_build_times_grow_histogram(cbt, bin+1);
+  cbt->histogram[bin]++;
+  cbt->histogram_log_sum[bin] += tor_mathlog(time);
+  if (time > cbt->max_build_time)
+    cbt->max_build_time = time;
+}
+
+/**
+ * Stop counting the build time <b>time</b> in <b>cbt</b>'s histogram.
+ */
+static void
+circuit_build_times_histogram_remove(circuit_build_times_t *cbt,
+                                     build_time_t time)
+{
+  build_time_t bin;
+  if (time == CBT_BUILD_ABANDONED) {
+    tor_assert(cbt->abandoned_count > 0);
+    cbt->abandoned_count--;
+    return;
+  }
+
+  bin = time / CBT_BIN_WIDTH;
+  tor_assert(bin < cbt->histogram_len && cbt->histogram[bin] > 0);
+  if (--cbt->histogram[bin] == 0) {
+    /* Don't let rounding error pile up in empty bins. */
+    cbt->histogram_log_sum[bin] = 0;
+  } else {
+    cbt->histogram_log_sum[bin] -= tor_mathlog(time);
+  }
+  if (time == cbt->max_build_time)
+    cbt->max_build_time_is_stale = 1;
+}
+
+/**
+ * Recount <b>cbt</b>'s histogram from its circular array. Only needed
+ * after the array has been modified in place.
+ */
+static void
+circuit_build_times_rebuild_histogram(circuit_build_times_t *cbt)
+{
+  int i;
+  circuit_build_times_clear_histogram(cbt);
+  for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++) {
+    if (cbt->circuit_build_times[i]) /* 0 <-> uninitialized */
+      circuit_build_times_histogram_add(cbt, cbt->circuit_build_times[i]);
+  }
+}
+
 /**
  * Reset the build time state.
  *
@@ -431,6 +561,7 @@ circuit_build_times_reset(circuit_build_times_t *cbt)
   cbt->total_build_times = 0;
   cbt->build_times_idx = 0;
   cbt->have_computed_timeout = 0;
+  circuit_build_times_clear_histogram(cbt);
 }
 
 /**
@@ -499,6 +630,10 @@ circuit_build_times_add_time(circuit_build_times_t *cbt, build_time_t time)
 
   log_debug(LD_CIRC, "Adding circuit build time %u", time);
 
+  if (cbt->circuit_build_times[cbt->build_times_idx])
+    circuit_build_times_histogram_remove(cbt,
+                              cbt->circuit_build_times[cbt->build_times_idx]);
+  circuit_build_times_histogram_add(cbt, time);
   cbt->circuit_build_times[cbt->build_times_idx] = time;
   cbt->build_times_idx = (cbt->build_times_idx + 1) % CBT_NCIRCUITS_TO_OBSERVE;
   if (cbt->total_build_times < CBT_NCIRCUITS_TO_OBSERVE)
@@ -515,17 +650,25 @@ circuit_build_times_add_time(circuit_build_times_t *cbt, build_time_t time)
 
 /**
  * Return maximum circuit build time
+ *
+ * We only need to look through the array if the previous maximum
+ * has been pushed out of it.
  */
 static build_time_t
 circuit_build_times_max(circuit_build_times_t *cbt)
 {
   int i = 0;
   build_time_t max_build_time = 0;
+  if (!cbt->max_build_time_is_stale)
+    return cbt->max_build_time;
+
   for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++) {
     if (cbt->circuit_build_times[i] > max_build_time
             && cbt->circuit_build_times[i] != CBT_BUILD_ABANDONED)
       max_build_time = cbt->circuit_build_times[i];
   }
+  cbt->max_build_time = max_build_time;
+  cbt->max_build_time_is_stale = 0;
   return max_build_time;
 }
 
@@ -549,36 +692,15 @@ circuit_build_times_min(circuit_build_times_t *cbt)
 #endif
 
 /**
- * Calculate and return a histogram for the set of build times.
- *
- * Returns an allocated array of histrogram bins representing
- * the frequency of index*CBT_BIN_WIDTH millisecond
- * build times. Also outputs the number of bins in nbins.
- *
- * The return value must be freed by the caller.
+ * Return the number of bins of <b>cbt</b>'s histogram that are in use:
+ * enough to hold the largest build time we have observed.
  */
-static uint32_t *
-circuit_build_times_create_histogram(circuit_build_times_t *cbt,
-                                     build_time_t *nbins)
+static build_time_t
+circuit_build_times_histogram_nbins(circuit_build_times_t *cbt)
 {
-  uint32_t *histogram;
-  build_time_t max_build_time = circuit_build_times_max(cbt);
-  int i, c;
-
-  *nbins = 1 + (max_build_time / CBT_BIN_WIDTH);
-  histogram = tor_malloc_zero(*nbins * sizeof(build_time_t));
-
-  // calculate histogram
-  for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++) {
-    if (cbt->circuit_build_times[i] == 0
-            || cbt->circuit_build_times[i] == CBT_BUILD_ABANDONED)
-      continue; /* 0 <-> uninitialized */
-
-    c = (cbt->circuit_build_times[i] / CBT_BIN_WIDTH);
-    histogram[c]++;
-  }
-
-  return histogram;
+  build_time_t nbins = 1 + (circuit_build_times_max(cbt) / CBT_BIN_WIDTH);
+  circuit_build_times_grow_histogram(cbt, nbins);
+  return nbins;
 }
 
 /**
@@ -596,10 +718,12 @@ circuit_build_times_get_xm(circuit_build_times_t *cbt)
   build_time_t *nth_max_bin;
   int32_t bin_counts=0;
   build_time_t ret = 0;
-  uint32_t *histogram = circuit_build_times_create_histogram(cbt, &nbins);
+  uint32_t *histogram;
   int n=0;
   int num_modes = circuit_build_times_default_num_xm_modes();
 
+  nbins = circuit_build_times_histogram_nbins(cbt);
+  histogram = cbt->histogram;
   tor_assert(nbins > 0);
   tor_assert(num_modes > 0);
 
@@ -637,7 +761,6 @@ circuit_build_times_get_xm(circuit_build_times_t *cbt)
   tor_assert(bin_counts > 0);
 
   ret /= bin_counts;
-  tor_free(histogram);
   tor_free(nth_max_bin);
 
   return ret;
@@ -656,19 +779,15 @@ circuit_build_times_update_state(circuit_build_times_t *cbt,
   build_time_t nbins = 0;
   config_line_t **next, *line;
 
-  histogram = circuit_build_times_create_histogram(cbt, &nbins);
+  nbins = circuit_build_times_histogram_nbins(cbt);
+  histogram = cbt->histogram;
   // write to state
   config_free_lines(state->BuildtimeHistogram);
   next = &state->BuildtimeHistogram;
   *next = NULL;
 
   state->TotalBuildTimes = cbt->total_build_times;
-  state->CircuitBuildAbandonedCount = 0;
-
-  for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++) {
-    if (cbt->circuit_build_times[i] == CBT_BUILD_ABANDONED)
-      state->CircuitBuildAbandonedCount++;
-  }
+  state->CircuitBuildAbandonedCount = cbt->abandoned_count;
 
   for (i = 0; i < nbins; i++) {
     // compress the histogram by skipping the blanks
@@ -685,8 +804,6 @@ circuit_build_times_update_state(circuit_build_times_t *cbt,
     if (!get_options()->AvoidDiskWrites)
       or_state_mark_dirty(get_or_state(), 0);
   }
-
-  tor_free(histogram);
 }
 
 /**
@@ -758,6 +875,9 @@ circuit_build_times_filter_timeouts(circuit_build_times_t *cbt)
     }
   }
 
+  if (num_filtered)
+    circuit_build_times_rebuild_histogram(cbt);
+
   log_info(LD_CIRC,
            "We had %d timeouts out of %d build times, "
            "and filtered %d above the max of %u",
@@ -913,10 +1033,10 @@ circuit_build_times_parse_state(circuit_build_times_t *cbt,
 int
 circuit_build_times_update_alpha(circuit_build_times_t *cbt)
 {
-  build_time_t *x=cbt->circuit_build_times;
   double a = 0;
-  int n=0,i=0,abandoned_count=0;
+  int n=0,abandoned_count=cbt->abandoned_count;
   build_time_t max_time=0;
+  build_time_t i, nbins, xm_bin;
 
   /* http://en.wikipedia.org/wiki/Pareto_distribution#Parameter_estimation */
   /* We sort of cheat here and make our samples slightly more pareto-like
@@ -925,22 +1045,24 @@ circuit_build_times_update_alpha(circuit_build_times_t *cbt)
 
   tor_assert(cbt->Xm > 0);
 
-  for (i=0; i< CBT_NCIRCUITS_TO_OBSERVE; i++) {
-    if (!x[i]) {
+  /* Work from the histogram rather than the raw build times, so that this
+   * costs one step per bin. Every value in a bin below the one holding Xm
+   * is treated as Xm; bins from Xm's on contribute their actual logs. */
+  nbins = circuit_build_times_histogram_nbins(cbt);
+  xm_bin = cbt->Xm / CBT_BIN_WIDTH;
+  for (i = 0; i < nbins; i++) {
+    if (!cbt->histogram[i])
       continue;
-    }
-
-    if (x[i] < cbt->Xm) {
-      a += tor_mathlog(cbt->Xm);
-    } else if (x[i] == CBT_BUILD_ABANDONED) {
-      abandoned_count++;
-    } else {
-      a += tor_mathlog(x[i]);
-      if (x[i] > max_time)
-        max_time = x[i];
-    }
-    n++;
+    if (i < xm_bin)
+      a += cbt->histogram[i]*tor_mathlog(cbt->Xm);
+    else
+      a += cbt->histogram_log_sum[i];
+    n += cbt->histogram[i];
   }
+  n += abandoned_count;
+  max_time = circuit_build_times_max(cbt);
+  if (max_time < cbt->Xm)
+    max_time = 0;
 
   /*
    * We are erring and asserting here because this can only happen
@@ -1134,6 +1256,8 @@ circuit_build_times_network_is_live(circuit_build_times_t *cbt)
 void
 circuit_build_times_network_circ_success(circuit_build_times_t *cbt)
 {
+  cbt->liveness.num_timeouts_after_firsthop -=
+    cbt->liveness.timeouts_after_firsthop[cbt->liveness.after_firsthop_idx];
   cbt->liveness.timeouts_after_firsthop[cbt->liveness.after_firsthop_idx] = 0;
   cbt->liveness.after_firsthop_idx++;
   cbt->liveness.after_firsthop_idx %= cbt->liveness.num_recent_circs;
@@ -1152,6 +1276,8 @@ circuit_build_times_network_timeout(circuit_build_times_t *cbt,
                                     int did_onehop)
 {
   if (did_onehop) {
+    cbt->liveness.num_timeouts_after_firsthop +=
+     1-cbt->liveness.timeouts_after_firsthop[cbt->liveness.after_firsthop_idx];
     cbt->liveness.timeouts_after_firsthop[cbt->liveness.after_firsthop_idx]=1;
     cbt->liveness.after_firsthop_idx++;
     cbt->liveness.after_firsthop_idx %= cbt->liveness.num_recent_circs;
@@ -1237,14 +1363,9 @@ int
 circuit_build_times_network_check_changed(circuit_build_times_t *cbt)
 {
   int total_build_times = cbt->total_build_times;
-  int timeout_count=0;
-  int i;
-
   /* how many of our recent circuits made it to the first hop but then
    * timed out? */
-  for (i = 0; i < cbt->liveness.num_recent_circs; i++) {
-    timeout_count += cbt->liveness.timeouts_after_firsthop[i];
-  }
+  int timeout_count = cbt->liveness.num_timeouts_after_firsthop;
 
   /* If 80% of our recent circuits are timing out after the first hop,
    * we need to re-estimate a new initial alpha and timeout. */
@@ -1257,6 +1378,7 @@ circuit_build_times_network_check_changed(circuit_build_times_t *cbt)
           sizeof(*cbt->liveness.timeouts_after_firsthop)*
           cbt->liveness.num_recent_circs);
   cbt->liveness.after_firsthop_idx = 0;
+  cbt->liveness.num_timeouts_after_firsthop = 0;
 
   /* Check to see if this has happened before. If so, double the timeout
    * to give people on abysmally bad network connections a shot at access */
@@ -1310,12 +1432,7 @@ circuit_build_times_timeout_rate(const circuit_build_times_t *cbt)
 double
 circuit_build_times_close_rate(const circuit_build_times_t *cbt)
 {
-  int i=0,closed=0;
-  for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++) {
-    if (cbt->circuit_build_times[i] == CBT_BUILD_ABANDONED) {
-       closed++;
-    }
-  }
+  int closed = cbt->abandoned_count;
 
   if (!cbt->total_build_times)
     return 0;
@@ -1683,14 +1800,14 @@ circuit_rep_hist_note_result(origin_circuit_t *circ)
   } while (hop!=circ->cpath);
 }
 
-/** Pick all the entries in our cpath. Stop and return 0 when we're
- * happy, or return -1 if an error occurs. */
+/** Pick all the entries in our cpath, from <b>batch</b> if it is set. Stop
+ * and return 0 when we're happy, or return -1 if an error occurs. */
 static int
-onion_populate_cpath(origin_circuit_t *circ)
+onion_populate_cpath(origin_circuit_t *circ, path_batch_t *batch)
 {
   int r;
  again:
-  r = onion_extend_cpath(circ);
+  r = onion_extend_cpath(circ, batch);
   if (r < 0) {
     log_info(LD_CIRC,"Generating cpath hop failed.");
     return -1;
@@ -1722,23 +1839,20 @@ origin_circuit_init(uint8_t purpose, int flags)
   return circ;
 }
 
-/** Build a new circuit for <b>purpose</b>. If <b>exit</b>
- * is defined, then use that as your exit router, else choose a suitable
- * exit node.
- *
- * Also launch a connection to the first OR in the chosen path, if
- * it's not open already.
- */
-origin_circuit_t *
-circuit_establish_circuit(uint8_t purpose, extend_info_t *exit, int flags)
+/** Helper for circuit_establish_circuit() and
+ * circuit_establish_circuit_from_batch(): build a new circuit, choosing
+ * its path from <b>batch</b> if it is set. */
+static origin_circuit_t *
+circuit_establish_circuit_impl(uint8_t purpose, extend_info_t *exit,
+                               int flags, path_batch_t *batch)
 {
   origin_circuit_t *circ;
   int err_reason = 0;
 
   circ = origin_circuit_init(purpose, flags);
 
-  if (onion_pick_cpath_exit(circ, exit) < 0 ||
-      onion_populate_cpath(circ) < 0) {
+  if (onion_pick_cpath_exit(circ, exit, batch) < 0 ||
+      onion_populate_cpath(circ, batch) < 0) {
     circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_NOPATH);
     return NULL;
   }
@@ -1752,6 +1866,32 @@ circuit_establish_circuit(uint8_t purpose, extend_info_t *exit, int flags)
   return circ;
 }
 
+/** Build a new circuit for <b>purpose</b>. If <b>exit</b>
+ * is defined, then use that as your exit router, else choose a suitable
+ * exit node.
+ *
+ * Also launch a connection to the first OR in the chosen path, if
+ * it's not open already.
+ */
+origin_circuit_t *
+circuit_establish_circuit(uint8_t purpose, extend_info_t *exit, int flags)
+{
+  return circuit_establish_circuit_impl(purpose, exit, flags, NULL);
+}
+
+/** Build a new circuit with the purpose and flags that <b>batch</b> was
+ * made for, choosing every hop from <b>batch</b>'s candidates.
+ *
+ * Also launch a connection to the first OR in the chosen path, if
+ * it's not open already.
+ */
+origin_circuit_t *
+circuit_establish_circuit_from_batch(path_batch_t *batch)
+{
+  return circuit_establish_circuit_impl(batch->purpose, NULL, batch->flags,
+                                        batch);
+}
+
 /** Start establishing the first hop of our circuit. Figure out what
  * OR we should connect to, and if necessary start the connection to
  * it. If we're already connected, then send the 'create' cell.
@@ -2349,6 +2489,10 @@ circuit_init_cpath_crypto(crypt_path_t *cpath, const char *key_data,
     log_warn(LD_BUG,"Backward cipher initialization failed.");
     return -1;
   }
+  /* Relay ciphers crypt a whole cell at a time; let them generate keystream
+   * in cell-sized batches where that helps. */
+  crypto_cipher_enable_keystream_buffer(cpath->f_crypto);
+  crypto_cipher_enable_keystream_buffer(cpath->b_crypto);
 
   if (reverse) {
     tmp_digest = cpath->f_digest;
@@ -2478,34 +2622,35 @@ circuit_truncated(origin_circuit_t *circ, crypt_path_t *layer)
 #endif
 }
 
-/** Given a response payload and keys, initialize, then send a created
- * cell back.
+/** Given the response payload and keys from answering <b>handshake</b>,
+ * initialize <b>circ</b>, then send a created cell back.
  */
 int
-onionskin_answer(or_circuit_t *circ, uint8_t cell_type, const char *payload,
-                 const char *keys)
+onionskin_answer(or_circuit_t *circ, const onion_handshake_t *handshake,
+                 const char *payload, const char *keys)
 {
   cell_t cell;
-  crypt_path_t *tmp_cpath;
+  crypt_path_t tmp_cpath_s, *tmp_cpath = &tmp_cpath_s;
 
-  tmp_cpath = tor_malloc_zero(sizeof(crypt_path_t));
+  /* We only need this long enough to set up the keys, so keep it on the
+   * stack. */
+  memset(tmp_cpath, 0, sizeof(crypt_path_t));
   tmp_cpath->magic = CRYPT_PATH_MAGIC;
 
   memset(&cell, 0, sizeof(cell_t));
-  cell.command = cell_type;
+  cell.command = handshake->created_cell_type;
   cell.circ_id = circ->p_circ_id;
 
   circuit_set_state(TO_CIRCUIT(circ), CIRCUIT_STATE_OPEN);
 
-  memcpy(cell.payload, payload,
-         cell_type == CELL_CREATED ? ONIONSKIN_REPLY_LEN : DIGEST_LEN*2);
+  tor_assert(handshake->reply_len <= CELL_PAYLOAD_SIZE);
+  memcpy(cell.payload, payload, handshake->reply_len);
 
   log_debug(LD_CIRC,"init digest forward 0x%.8x, backward 0x%.8x.",
             (unsigned int)get_uint32(keys),
             (unsigned int)get_uint32(keys+20));
   if (circuit_init_cpath_crypto(tmp_cpath, keys, 0)<0) {
     log_warn(LD_BUG,"Circuit initialization failed");
-    tor_free(tmp_cpath);
     return -1;
   }
   circ->n_digest = tmp_cpath->f_digest;
@@ -2513,19 +2658,19 @@ onionskin_answer(or_circuit_t *circ, uint8_t cell_type, const char *payload,
   circ->p_digest = tmp_cpath->b_digest;
   circ->p_crypto = tmp_cpath->b_crypto;
   tmp_cpath->magic = 0;
-  tor_free(tmp_cpath);
 
-  if (cell_type == CELL_CREATED)
-    memcpy(circ->handshake_digest, cell.payload+DH_KEY_LEN, DIGEST_LEN);
-  else
-    memcpy(circ->handshake_digest, cell.payload+DIGEST_LEN, DIGEST_LEN);
+  memcpy(circ->handshake_digest,
+         cell.payload+handshake->handshake_digest_offset, DIGEST_LEN);
 
-  circ->is_first_hop = (cell_type == CELL_CREATED_FAST);
+  circ->is_first_hop = handshake->first_hop_only;
+  if (circ->is_first_hop)
+    circuit_schedule_idle_check(circ,
+                                approx_time() + IDLE_ONE_HOP_CIRC_TIMEOUT);
 
   append_cell_to_circuit_queue(TO_CIRCUIT(circ),
                                circ->p_conn, &cell, CELL_DIRECTION_IN, 0);
-  log_debug(LD_CIRC,"Finished sending '%s' cell.",
-            circ->is_first_hop ? "created_fast" : "created");
+  log_debug(LD_CIRC,"Finished sending reply to %s handshake.",
+            handshake->name);
 
   if (!is_local_addr(&circ->p_conn->_base.addr) &&
       !connection_or_nonopen_was_started_here(circ->p_conn)) {
@@ -2619,29 +2764,39 @@ circuit_all_predicted_ports_handled(time_t now, int *need_uptime,
   return enough;
 }
 
-/** Return 1 if <b>node</b> can handle one or more of the ports in
- * <b>needed_ports</b>, else return 0.
+/** Return a newly allocated bitarray, indexed like the nodelist, with a
+ * bit set for each node that can handle one or more of the ports in
+ * <b>needed_ports</b>.
  */
-static int
-node_handles_some_port(const node_t *node, smartlist_t *needed_ports)
-{ /* XXXX MOVE */
+static bitarray_t *
+nodes_handling_some_port(smartlist_t *needed_ports)
+{
+  const smartlist_t *nodes = nodelist_get_list();
+  const int n_words = (smartlist_len(nodes)+BITARRAY_MASK) >> BITARRAY_SHIFT;
+  bitarray_t *result = bitarray_init_zero(smartlist_len(nodes));
   int i;
-  uint16_t port;
 
-  for (i = 0; i < smartlist_len(needed_ports); ++i) {
-    addr_policy_result_t r;
+  SMARTLIST_FOREACH_BEGIN(needed_ports, uint16_t *, portp) {
     /* alignment issues aren't a worry for this dereference, since
        needed_ports is explicitly a smartlist of uint16_t's */
-    port = *(uint16_t *)smartlist_get(needed_ports, i);
-    tor_assert(port);
-    if (node)
-      r = compare_tor_addr_to_node_policy(NULL, port, node);
-    else
-      continue;
-    if (r != ADDR_POLICY_REJECTED && r != ADDR_POLICY_PROBABLY_REJECTED)
-      return 1;
-  }
-  return 0;
+    const bitarray_t *accepts = nodelist_get_exit_port_set(*portp);
+    for (i = 0; i < n_words; ++i)
+      result[i] |= accepts[i];
+  } SMARTLIST_FOREACH_END(portp);
+  return result;
+}
+
+/** Return true iff connection_ap_can_use_exit() will say the same thing
+ * about <b>conn</b> as the exit port set for its port does, for every exit
+ * that add_exit_server_candidates_general() might consider. */
+static int
+ap_stream_can_use_exit_port_set(const entry_connection_t *conn)
+{
+  struct in_addr in;
+  return conn->socks_request->command == SOCKS_COMMAND_CONNECT &&
+    !conn->use_begindir && !conn->chosen_exit_name &&
+    conn->socks_request->port &&
+    !tor_inet_aton(conn->socks_request->address, &in);
 }
 
 /** Return true iff <b>conn</b> needs another general circuit to be
@@ -2666,36 +2821,51 @@ ap_stream_wants_exit_attention(connection_t *conn)
   return 0;
 }
 
-/** Return a pointer to a suitable router to be the exit node for the
- * general-purpose circuit we're about to build.
+/** Add to <b>out</b> the nodes that a general-purpose circuit we're about
+ * to build should choose its exit from, weighted by bandwidth.
  *
- * Look through the connection array, and choose a router that maximizes
- * the number of pending streams that can exit from this router.
- *
- * Return NULL if we can't find any suitable routers.
+ * Look through the connection array, and prefer the routers that maximize
+ * the number of pending streams that can exit from them.
  */
-static const node_t *
-choose_good_exit_server_general(int need_uptime, int need_capacity)
+static void
+add_exit_server_candidates_general(smartlist_t *out,
+                                   int need_uptime, int need_capacity)
 {
   int *n_supported;
   int n_pending_connections = 0;
   smartlist_t *connections;
+  smartlist_t *pending, *pending_sets;
+  int n_port_sets = 0;
   int best_support = -1;
   int n_best_support=0;
   const or_options_t *options = get_options();
   const smartlist_t *the_nodes;
-  const node_t *node=NULL;
 
   connections = get_connection_array();
 
   /* Count how many connections are waiting for a circuit to be built.
    * We use this for log messages now, but in the future we may depend on it.
    */
-  SMARTLIST_FOREACH(connections, connection_t *, conn,
-  {
-    if (ap_stream_wants_exit_attention(conn))
-      ++n_pending_connections;
-  });
+  pending = smartlist_create();
+  pending_sets = smartlist_create();
+  SMARTLIST_FOREACH_BEGIN(connections, connection_t *, conn) {
+    entry_connection_t *entry;
+    bitarray_t *set = NULL;
+    if (!ap_stream_wants_exit_attention(conn))
+      continue;
+    ++n_pending_connections;
+    entry = TO_ENTRY_CONN(conn);
+    /* For a stream to a hostname, whether an exit will take it comes down
+     * to the cached set of exits that might accept its port.  Don't look
+     * up more sets than the nodelist keeps, or we'd evict our own. */
+    if (ap_stream_can_use_exit_port_set(entry) &&
+        n_port_sets < NODELIST_MAX_EXIT_PORT_SETS) {
+      set = nodelist_get_exit_port_set(entry->socks_request->port);
+      ++n_port_sets;
+    }
+    smartlist_add(pending, entry);
+    smartlist_add(pending_sets, set);
+  } SMARTLIST_FOREACH_END(conn);
 //  log_fn(LOG_DEBUG, "Choosing exit node; %d connections are pending",
 //         n_pending_connections);
   /* Now we count, for each of the routers in the directory, how many
@@ -2761,11 +2931,11 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
       continue; /* skip routers that reject all */
     }
     n_supported[i] = 0;
-    /* iterate over connections */
-    SMARTLIST_FOREACH_BEGIN(connections, connection_t *, conn) {
-      if (!ap_stream_wants_exit_attention(conn))
-        continue; /* Skip everything but APs in CIRCUIT_WAIT */
-      if (connection_ap_can_use_exit(TO_ENTRY_CONN(conn), node)) {
+    /* iterate over pending connections */
+    SMARTLIST_FOREACH_BEGIN(pending, entry_connection_t *, entry) {
+      bitarray_t *set = smartlist_get(pending_sets, entry_sl_idx);
+      if (set ? bitarray_is_set(set, i) != 0 :
+                connection_ap_can_use_exit(entry, node)) {
         ++n_supported[i];
 //        log_fn(LOG_DEBUG,"%s is supported. n_supported[%d] now %d.",
 //               router->nickname, i, n_supported[i]);
@@ -2773,7 +2943,7 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
 //        log_fn(LOG_DEBUG,"%s (index %d) would reject this stream.",
 //               router->nickname, i);
       }
-    } SMARTLIST_FOREACH_END(conn);
+    } SMARTLIST_FOREACH_END(entry);
     if (n_pending_connections > 0 && n_supported[i] == 0) {
       /* Leave best_support at -1 if that's where it is, so we can
        * distinguish it later. */
@@ -2797,24 +2967,20 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
            n_pending_connections);
 
   /* If any routers definitely support any pending connections, choose one
-   * at random. */
+   * of those. */
   if (best_support > 0) {
-    smartlist_t *supporting = smartlist_create();
-
     SMARTLIST_FOREACH(the_nodes, const node_t *, node, {
       if (n_supported[node_sl_idx] == best_support)
-        smartlist_add(supporting, (void*)node);
+        smartlist_add(out, (void*)node);
     });
-
-    node = node_sl_choose_by_bandwidth(supporting, WEIGHT_FOR_EXIT);
-    smartlist_free(supporting);
   } else {
     /* Either there are no pending connections, or no routers even seem to
      * possibly support any of them.  Choose a router at random that satisfies
      * at least one predicted exit port. */
 
     int attempt;
-    smartlist_t *needed_ports, *supporting;
+    smartlist_t *needed_ports;
+    bitarray_t *handles_some_port;
 
     if (best_support == -1) {
       if (need_uptime || need_capacity) {
@@ -2824,37 +2990,57 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
                  need_capacity?", fast":"",
                  need_uptime?", stable":"");
         tor_free(n_supported);
-        return choose_good_exit_server_general(0, 0);
+        smartlist_free(pending);
+        smartlist_free(pending_sets);
+        add_exit_server_candidates_general(out, 0, 0);
+        return;
       }
       log_notice(LD_CIRC, "All routers are down or won't exit%s -- "
                  "choosing a doomed exit at random.",
                  options->_ExcludeExitNodesUnion ? " or are Excluded" : "");
     }
-    supporting = smartlist_create();
     needed_ports = circuit_get_unhandled_ports(time(NULL));
+    handles_some_port = nodes_handling_some_port(needed_ports);
     for (attempt = 0; attempt < 2; attempt++) {
       /* try once to pick only from routers that satisfy a needed port,
        * then if there are none, pick from any that support exiting. */
       SMARTLIST_FOREACH_BEGIN(the_nodes, const node_t *, node) {
         if (n_supported[node_sl_idx] != -1 &&
-            (attempt || node_handles_some_port(node, needed_ports))) {
+            (attempt || bitarray_is_set(handles_some_port, node_sl_idx))) {
 //          log_fn(LOG_DEBUG,"Try %d: '%s' is a possibility.",
 //                 try, router->nickname);
-          smartlist_add(supporting, (void*)node);
+          smartlist_add(out, (void*)node);
         }
       } SMARTLIST_FOREACH_END(node);
 
-      node = node_sl_choose_by_bandwidth(supporting, WEIGHT_FOR_EXIT);
-      if (node)
+      if (smartlist_len(out))
         break;
-      smartlist_clear(supporting);
     }
     SMARTLIST_FOREACH(needed_ports, uint16_t *, cp, tor_free(cp));
     smartlist_free(needed_ports);
-    smartlist_free(supporting);
+    bitarray_free(handles_some_port);
   }
 
   tor_free(n_supported);
+  smartlist_free(pending);
+  smartlist_free(pending_sets);
+}
+
+/** Return a pointer to a suitable router to be the exit node for the
+ * general-purpose circuit we're about to build.
+ *
+ * Return NULL if we can't find any suitable routers.
+ */
+static const node_t *
+choose_good_exit_server_general(int need_uptime, int need_capacity)
+{
+  const or_options_t *options = get_options();
+  smartlist_t *candidates = smartlist_create();
+  const node_t *node;
+
+  add_exit_server_candidates_general(candidates, need_uptime, need_capacity);
+  node = node_sl_choose_by_bandwidth(candidates, WEIGHT_FOR_EXIT);
+  smartlist_free(candidates);
   if (node) {
     log_info(LD_CIRC, "Chose exit server '%s'", node_describe(node));
     return node;
@@ -2982,11 +3168,212 @@ warn_if_last_router_excluded(origin_circuit_t *circ, const extend_info_t *exit)
   return;
 }
 
+/** How many times do we draw from a batch's candidates and throw away a
+ * node that conflicts with the rest of the path, before we filter the
+ * candidates properly? */
+#define PATH_BATCH_MAX_REDRAWS 16
+
+/** Add to <b>sl</b> the candidates that router_choose_random_node() would
+ * consider for <b>flags</b>, dropping the CRN_NEED_* flags if nothing
+ * meets them, just as router_choose_random_node() does. Return the rule
+ * to weight the result with. */
+static bandwidth_weight_rule_t
+path_batch_add_candidates(smartlist_t *sl, smartlist_t *excluded,
+                          router_crn_flags_t flags)
+{
+  const or_options_t *options = get_options();
+  router_add_random_node_candidates(sl, excluded, options->ExcludeNodes,
+                                    flags);
+  if (!smartlist_len(sl) &&
+      (flags & (CRN_NEED_UPTIME|CRN_NEED_CAPACITY|CRN_NEED_GUARD))) {
+    flags &= ~(CRN_NEED_UPTIME|CRN_NEED_CAPACITY|CRN_NEED_GUARD);
+    router_add_random_node_candidates(sl, excluded, options->ExcludeNodes,
+                                      flags);
+  }
+  return (flags & CRN_NEED_GUARD) ? WEIGHT_FOR_GUARD : WEIGHT_FOR_MID;
+}
+
+/** Gather the candidates for every hop of general-purpose circuits with
+ * CIRCLAUNCH_* <b>flags</b>, so that several can be built without looking
+ * through the whole nodelist for each hop of each one. Return NULL if we
+ * can't build such circuits from a batch; the caller should build them one
+ * at a time instead. */
+path_batch_t *
+path_batch_new(uint8_t purpose, int flags)
+{
+  const or_options_t *options = get_options();
+  int need_uptime = (flags & CIRCLAUNCH_NEED_UPTIME) != 0;
+  int need_capacity = (flags & CIRCLAUNCH_NEED_CAPACITY) != 0;
+  router_crn_flags_t crn_flags = CRN_NEED_DESC;
+  path_batch_t *batch;
+
+  if (purpose != CIRCUIT_PURPOSE_C_GENERAL ||
+      (flags & CIRCLAUNCH_ONEHOP_TUNNEL))
+    return NULL;
+
+  batch = tor_malloc_zero(sizeof(path_batch_t));
+  batch->purpose = purpose;
+  batch->flags = flags;
+  batch->route_len = new_route_len(purpose, NULL, nodelist_get_list());
+
+  if (need_uptime)
+    crn_flags |= CRN_NEED_UPTIME;
+  if (need_capacity)
+    crn_flags |= CRN_NEED_CAPACITY;
+
+  /* Middle hops, and exits of internal circuits; see
+   * choose_good_middle_server() and choose_good_exit_server(). */
+  batch->middles = smartlist_create();
+  path_batch_add_candidates(batch->middles, NULL,
+                (options->_AllowInvalid & ALLOW_INVALID_MIDDLE) ?
+                            crn_flags|CRN_ALLOW_INVALID : crn_flags);
+
+  batch->exits = smartlist_create();
+  if (flags & CIRCLAUNCH_IS_INTERNAL) {
+    smartlist_add_all(batch->exits, batch->middles);
+    batch->exit_rule = WEIGHT_FOR_MID;
+  } else {
+    add_exit_server_candidates_general(batch->exits,
+                                       need_uptime, need_capacity);
+    batch->exit_rule = WEIGHT_FOR_EXIT;
+  }
+
+  /* First hops, unless we use entry guards; see
+   * choose_good_entry_server(). */
+  if (!options->UseEntryGuards) {
+    smartlist_t *excluded = smartlist_create();
+    if (firewall_is_fascist_or()) {
+      SMARTLIST_FOREACH(nodelist_get_list(), const node_t *, node, {
+        if (!fascist_firewall_allows_node(node))
+          smartlist_add(excluded, (void*)node);
+      });
+    }
+    batch->entries = smartlist_create();
+    batch->entry_rule = path_batch_add_candidates(batch->entries, excluded,
+                 CRN_NEED_GUARD |
+                 ((options->_AllowInvalid & ALLOW_INVALID_ENTRY) ?
+                  crn_flags|CRN_ALLOW_INVALID : crn_flags));
+    smartlist_free(excluded);
+  }
+
+  return batch;
+}
+
+/** Release all storage held by <b>batch</b>. */
+void
+path_batch_free(path_batch_t *batch)
+{
+  if (!batch)
+    return;
+  smartlist_free(batch->exits);
+  smartlist_free(batch->middles);
+  smartlist_free(batch->entries);
+  tor_free(batch);
+}
+
+/** Return true iff <b>node</b> is one of the nodes in <b>path</b>, or in
+ * the same family or subnet as one of them. */
+static int
+path_batch_node_conflicts(const node_t *node, const smartlist_t *path)
+{
+  SMARTLIST_FOREACH(path, const node_t *, other, {
+    if (node == other || nodes_in_same_family(node, other))
+      return 1;
+  });
+  return 0;
+}
+
+/** Choose a node from <b>candidates</b>, weighted by bandwidth according to
+ * <b>rule</b>, that doesn't conflict with any node in <b>path</b>. Return
+ * NULL if every candidate conflicts.
+ *
+ * We redraw a few times before filtering the whole list, since usually
+ * only a handful of candidates share a family or subnet with the path. */
+static const node_t *
+path_batch_choose(smartlist_t *candidates, bandwidth_weight_rule_t rule,
+                  const smartlist_t *path)
+{
+  const node_t *node;
+  smartlist_t *allowed;
+  int i;
+
+  for (i = 0; i < PATH_BATCH_MAX_REDRAWS; ++i) {
+    if (!(node = node_sl_choose_by_bandwidth(candidates, rule)))
+      return NULL;
+    if (!path_batch_node_conflicts(node, path))
+      return node;
+  }
+
+  allowed = smartlist_create_with_capacity(smartlist_len(candidates));
+  SMARTLIST_FOREACH(candidates, const node_t *, n, {
+    if (!path_batch_node_conflicts(n, path))
+      smartlist_add(allowed, (void*)n);
+  });
+  node = node_sl_choose_by_bandwidth(allowed, rule);
+  smartlist_free(allowed);
+  return node;
+}
+
+/** Choose an exit for the next circuit in <b>batch</b>. */
+static const node_t *
+path_batch_choose_exit(path_batch_t *batch)
+{
+  const node_t *node = node_sl_choose_by_bandwidth(batch->exits,
+                                                   batch->exit_rule);
+  if (node)
+    log_info(LD_CIRC, "Chose exit server '%s'", node_describe(node));
+  return node;
+}
+
+/** Choose a first hop from <b>batch</b> for the circuit being built
+ * according to <b>state</b>, avoiding its exit and the exit's family. */
+static const node_t *
+path_batch_choose_entry(path_batch_t *batch, cpath_build_state_t *state)
+{
+  SMARTLIST_DECLARE_LOCAL(path, 1);
+  const node_t *node;
+
+  if (!batch->entries)
+    return choose_random_entry(state);
+
+  if ((node = build_state_get_exit_node(state)))
+    smartlist_add(path, (void*)node);
+  node = path_batch_choose(batch->entries, batch->entry_rule, path);
+  smartlist_free_local(path);
+  return node;
+}
+
+/** Choose a middle hop from <b>batch</b> for the circuit being built
+ * according to <b>state</b>, whose cpath <b>head</b> has <b>cur_len</b>
+ * hops so far. Avoid the exit, the hops we already have, and their
+ * families. */
+static const node_t *
+path_batch_choose_middle(path_batch_t *batch, cpath_build_state_t *state,
+                         crypt_path_t *head, int cur_len)
+{
+  SMARTLIST_DECLARE_LOCAL(path, 8);
+  const node_t *node;
+  crypt_path_t *cpath;
+  int i;
+
+  if ((node = build_state_get_exit_node(state)))
+    smartlist_add(path, (void*)node);
+  for (i = 0, cpath = head; i < cur_len; ++i, cpath=cpath->next) {
+    if ((node = node_get_by_id(cpath->extend_info->identity_digest)))
+      smartlist_add(path, (void*)node);
+  }
+  node = path_batch_choose(batch->middles, WEIGHT_FOR_MID, path);
+  smartlist_free_local(path);
+  return node;
+}
+
 /** Decide a suitable length for circ's cpath, and pick an exit
- * router (or use <b>exit</b> if provided). Store these in the
- * cpath. Return 0 if ok, -1 if circuit should be closed. */
+ * router (or use <b>exit</b> if provided, or choose one from <b>batch</b>
+ * if that is set). Store these in the cpath. Return 0 if ok, -1 if circuit
+ * should be closed. */
 static int
-onion_pick_cpath_exit(origin_circuit_t *circ, extend_info_t *exit)
+onion_pick_cpath_exit(origin_circuit_t *circ, extend_info_t *exit,
+                      path_batch_t *batch)
 {
   cpath_build_state_t *state = circ->build_state;
 
@@ -2994,7 +3381,8 @@ onion_pick_cpath_exit(origin_circuit_t *circ, extend_info_t *exit)
     log_debug(LD_CIRC, "Launching a one-hop circuit for dir tunnel.");
     state->desired_path_len = 1;
   } else {
-    int r = new_route_len(circ->_base.purpose, exit, nodelist_get_list());
+    int r = batch ? batch->route_len :
+      new_route_len(circ->_base.purpose, exit, nodelist_get_list());
     if (r < 1) /* must be at least 1 */
       return -1;
     state->desired_path_len = r;
@@ -3006,7 +3394,7 @@ onion_pick_cpath_exit(origin_circuit_t *circ, extend_info_t *exit)
              extend_info_describe(exit));
     exit = extend_info_dup(exit);
   } else { /* we have to decide one */
-    const node_t *node =
+    const node_t *node = batch ? path_batch_choose_exit(batch) :
       choose_good_exit_server(circ->_base.purpose, state->need_uptime,
                               state->need_capacity, state->is_internal);
     if (!node) {
@@ -3231,10 +3619,11 @@ onion_next_hop_in_cpath(crypt_path_t *cpath)
 }
 
 /** Choose a suitable next hop in the cpath <b>head_ptr</b>,
- * based on <b>state</b>. Append the hop info to head_ptr.
+ * based on <b>state</b>, from <b>batch</b>'s candidates if it is set.
+ * Append the hop info to head_ptr.
  */
 static int
-onion_extend_cpath(origin_circuit_t *circ)
+onion_extend_cpath(origin_circuit_t *circ, path_batch_t *batch)
 {
   uint8_t purpose = circ->_base.purpose;
   cpath_build_state_t *state = circ->build_state;
@@ -3253,7 +3642,8 @@ onion_extend_cpath(origin_circuit_t *circ)
   if (cur_len == state->desired_path_len - 1) { /* Picking last node */
     info = extend_info_dup(state->chosen_exit);
   } else if (cur_len == 0) { /* picking first node */
-    const node_t *r = choose_good_entry_server(purpose, state);
+    const node_t *r = batch ? path_batch_choose_entry(batch, state) :
+      choose_good_entry_server(purpose, state);
     if (r) {
       /* If we're extending to a bridge, use the preferred address
          rather than the primary, for potentially extending to an IPv6
@@ -3264,7 +3654,8 @@ onion_extend_cpath(origin_circuit_t *circ)
       tor_assert(info);
     }
   } else {
-    const node_t *r =
+    const node_t *r = batch ?
+      path_batch_choose_middle(batch, state, circ->cpath, cur_len) :
       choose_good_middle_server(purpose, state, circ->cpath, cur_len);
     if (r) {
       info = extend_info_from_node(r, 0);
@@ -3293,12 +3684,11 @@ onion_extend_cpath(origin_circuit_t *circ)
 static int
 onion_append_hop(crypt_path_t **head_ptr, extend_info_t *choice)
 {
-  crypt_path_t *hop = tor_malloc_zero(sizeof(crypt_path_t));
+  crypt_path_t *hop = crypt_path_new();
 
   /* link hop into the cpath, at the end. */
   onion_append_to_cpath(head_ptr, hop);
 
-  hop->magic = CRYPT_PATH_MAGIC;
   hop->state = CPATH_STATE_CLOSED;
 
   hop->extend_info = extend_info_dup(choice);
@@ -3329,19 +3719,23 @@ extend_info_alloc(const char *nickname, const char *digest,
 /** Allocate and return a new extend_info_t that can be used to build
  * a circuit to or through the router <b>r</b>. Use the primary
  * address of the router unless <b>for_direct_connect</b> is true, in
- * which case the preferred address is used instead. */
+ * which case the preferred address is used instead.  Return NULL if we
+ * can't get the router's onion key. */
 extend_info_t *
 extend_info_from_router(const routerinfo_t *r, int for_direct_connect)
 {
   tor_addr_port_t ap;
+  crypto_pk_env_t *onion_pkey;
   tor_assert(r);
 
+  if (!(onion_pkey = router_get_onion_pkey(r)))
+    return NULL;
   if (for_direct_connect)
     router_get_pref_orport(r, &ap);
   else
     router_get_prim_orport(r, &ap);
   return extend_info_alloc(r->nickname, r->cache_info.identity_digest,
-                           r->onion_pkey, &ap.addr, ap.port);
+                           onion_pkey, &ap.addr, ap.port);
 }
 
 /** Allocate and return a new extend_info that can be used to build a
@@ -3581,11 +3975,48 @@ num_live_entry_guards(void)
 static INLINE entry_guard_t *
 is_an_entry_guard(const char *digest)
 {
-  SMARTLIST_FOREACH(entry_guards, entry_guard_t *, entry,
-                    if (tor_memeq(digest, entry->identity, DIGEST_LEN))
-                      return entry;
-                   );
-  return NULL;
+  if (!entry_guards_by_id)
+    return NULL;
+  return digestmap_get(entry_guards_by_id, digest);
+}
+
+/** Note that <b>entry</b> has just been added to entry_guards. */
+static void
+entry_guards_index_add(entry_guard_t *entry)
+{
+  if (!entry_guards_by_id)
+    entry_guards_by_id = digestmap_new();
+  if (!digestmap_get(entry_guards_by_id, entry->identity))
+    digestmap_set(entry_guards_by_id, entry->identity, entry);
+}
+
+/** Note that <b>entry</b> is about to be removed from entry_guards. */
+static void
+entry_guards_index_remove(entry_guard_t *entry)
+{
+  if (!entry_guards_by_id ||
+      digestmap_get(entry_guards_by_id, entry->identity) != entry)
+    return;
+  digestmap_remove(entry_guards_by_id, entry->identity);
+  /* If some other guard has the same identity, it's the one to find now. */
+  SMARTLIST_FOREACH(entry_guards, entry_guard_t *, e,
+    if (e != entry && tor_memeq(e->identity, entry->identity, DIGEST_LEN)) {
+      digestmap_set(entry_guards_by_id, e->identity, e);
+      break;
+    });
+}
+
+/** Rebuild the index of entry_guards from scratch, after replacing or
+ * reordering its contents. */
+static void
+entry_guards_index_rebuild(void)
+{
+  if (entry_guards_by_id)
+    digestmap_free(entry_guards_by_id, NULL);
+  entry_guards_by_id = NULL;
+  if (entry_guards)
+    SMARTLIST_FOREACH(entry_guards, entry_guard_t *, e,
+                      entry_guards_index_add(e));
 }
 
 /** Dump a description of our list of entry guards to the log at level
@@ -3696,6 +4127,7 @@ add_an_entry_guard(const node_t *chosen, int reset_status, int prepend)
     smartlist_insert(entry_guards, 0, entry);
   else
     smartlist_add(entry_guards, entry);
+  entry_guards_index_add(entry);
   control_event_guard(entry->nickname, entry->identity, "NEW");
   control_event_guard_deferred();
   log_entry_guards(LOG_INFO);
@@ -3786,6 +4218,7 @@ remove_obsolete_entry_guards(time_t now)
              "Entry guard '%s' (%s) %s. (Version=%s.) Replacing it.",
              entry->nickname, dbuf, msg, ver?escaped(ver):"none");
       control_event_guard(entry->nickname, entry->identity, "DROPPED");
+      entry_guards_index_remove(entry);
       entry_guard_free(entry);
       smartlist_del_keeporder(entry_guards, i--);
       log_entry_guards(LOG_INFO);
@@ -3818,6 +4251,7 @@ remove_dead_entry_guards(time_t now)
                "since %s local time; removing.",
                entry->nickname, dbuf, tbuf);
       control_event_guard(entry->nickname, entry->identity, "DROPPED");
+      entry_guards_index_remove(entry);
       entry_guard_free(entry);
       smartlist_del_keeporder(entry_guards, i);
       log_entry_guards(LOG_INFO);
@@ -3909,21 +4343,12 @@ entry_guard_register_connect_status(const char *digest, int succeeded,
   int refuse_conn = 0;
   int first_contact = 0;
   entry_guard_t *entry = NULL;
-  int idx = -1;
   char buf[HEX_DIGEST_LEN+1];
 
   if (! entry_guards)
     return 0;
 
-  SMARTLIST_FOREACH(entry_guards, entry_guard_t *, e,
-    {
-      if (tor_memeq(e->identity, digest, DIGEST_LEN)) {
-        entry = e;
-        idx = e_sl_idx;
-        break;
-      }
-    });
-
+  entry = is_an_entry_guard(digest);
   if (!entry)
     return 0;
 
@@ -3952,8 +4377,13 @@ entry_guard_register_connect_status(const char *digest, int succeeded,
                entry->nickname, buf,
                num_live_entry_guards()-1, smartlist_len(entry_guards)-1);
       control_event_guard(entry->nickname, entry->identity, "DROPPED");
+      entry_guards_index_remove(entry);
+      SMARTLIST_FOREACH(entry_guards, entry_guard_t *, e,
+        if (e == entry) {
+          smartlist_del_keeporder(entry_guards, e_sl_idx);
+          break;
+        });
       entry_guard_free(entry);
-      smartlist_del_keeporder(entry_guards, idx);
       log_entry_guards(LOG_INFO);
       changed = 1;
     } else if (!entry->unreachable_since) {
@@ -4092,6 +4522,7 @@ entry_guards_set_from_config(const or_options_t *options)
   smartlist_clear(entry_guards);
   /* First, the previously configured guards that are in EntryNodes. */
   smartlist_add_all(entry_guards, old_entry_guards_on_list);
+  entry_guards_index_rebuild();
   /* Next, scramble the rest of EntryNodes, putting the guards first. */
   smartlist_shuffle(entry_nodes);
   smartlist_shuffle(worse_entry_nodes);
@@ -4396,6 +4827,7 @@ entry_guards_parse_state(or_state_t *state, int set, char **msg)
       smartlist_free(entry_guards);
     }
     entry_guards = new_entry_guards;
+    entry_guards_index_rebuild();
     entry_guards_dirty = 0;
     /* XXX023 hand new_entry_guards to this func, and move it up a
      * few lines, so we don't have to re-dirty it */
@@ -4557,6 +4989,111 @@ getinfo_helper_entry_guards(control_connection_t *conn,
  * in this list does not necessarily correspond to the order of bridges
  * in the torrc. */
 static smartlist_t *bridge_list = NULL;
+/** Map from identity digest to the first member of bridge_list that has
+ * that identity.  Bridges whose identity we don't know aren't in it. */
+static digestmap_t *bridges_by_id = NULL;
+/** Map from "address:port" strings to smartlists of the members of
+ * bridge_list at that address and port, in the order we added them. */
+static strmap_t *bridges_by_addrport = NULL;
+
+/** Write into <b>buf</b> the key for <b>addr</b>:<b>port</b> in
+ * bridges_by_addrport. */
+static void
+bridge_addrport_key(char *buf, size_t buflen,
+                    const tor_addr_t *addr, uint16_t port)
+{
+  char addrbuf[TOR_ADDR_BUF_LEN];
+  if (!tor_addr_to_str(addrbuf, addr, sizeof(addrbuf), 1))
+    strlcpy(addrbuf, "?", sizeof(addrbuf));
+  tor_snprintf(buf, buflen, "%s:%u", addrbuf, (unsigned)port);
+}
+
+/** Return the list of bridges at <b>addr</b>:<b>port</b>, or NULL if there
+ * are none. */
+static smartlist_t *
+bridges_get_by_addrport(const tor_addr_t *addr, uint16_t port)
+{
+  char key[TOR_ADDR_BUF_LEN+8];
+  if (!bridges_by_addrport)
+    return NULL;
+  bridge_addrport_key(key, sizeof(key), addr, port);
+  return strmap_get(bridges_by_addrport, key);
+}
+
+/** Add <b>bridge</b>'s identity, if we know it, to bridges_by_id. */
+static void
+bridge_index_add_identity(bridge_info_t *bridge)
+{
+  if (tor_digest_is_zero(bridge->identity))
+    return;
+  if (!bridges_by_id)
+    bridges_by_id = digestmap_new();
+  if (!digestmap_get(bridges_by_id, bridge->identity))
+    digestmap_set(bridges_by_id, bridge->identity, bridge);
+}
+
+/** Note that <b>bridge</b> has just been added to bridge_list. */
+static void
+bridge_index_add(bridge_info_t *bridge)
+{
+  char key[TOR_ADDR_BUF_LEN+8];
+  smartlist_t *sl;
+  if (!bridges_by_addrport)
+    bridges_by_addrport = strmap_new();
+  bridge_addrport_key(key, sizeof(key), &bridge->addr, bridge->port);
+  if (!(sl = strmap_get(bridges_by_addrport, key))) {
+    sl = smartlist_create();
+    strmap_set(bridges_by_addrport, key, sl);
+  }
+  smartlist_add(sl, bridge);
+  bridge_index_add_identity(bridge);
+}
+
+/** Note that <b>bridge</b> is about to be removed from bridge_list. */
+static void
+bridge_index_remove(bridge_info_t *bridge)
+{
+  char key[TOR_ADDR_BUF_LEN+8];
+  smartlist_t *sl;
+  if (!bridges_by_addrport)
+    return;
+  bridge_addrport_key(key, sizeof(key), &bridge->addr, bridge->port);
+  if ((sl = strmap_get(bridges_by_addrport, key))) {
+    SMARTLIST_FOREACH(sl, bridge_info_t *, b,
+      if (b == bridge) {
+        smartlist_del_keeporder(sl, b_sl_idx);
+        break;
+      });
+    if (!smartlist_len(sl)) {
+      strmap_remove(bridges_by_addrport, key);
+      smartlist_free(sl);
+    }
+  }
+
+  if (bridges_by_id &&
+      digestmap_get(bridges_by_id, bridge->identity) == bridge) {
+    digestmap_remove(bridges_by_id, bridge->identity);
+    /* If another bridge has the same identity, it's the one to find now. */
+    SMARTLIST_FOREACH(bridge_list, bridge_info_t *, b,
+      if (b != bridge && tor_memeq(b->identity, bridge->identity,
+                                   DIGEST_LEN)) {
+        digestmap_set(bridges_by_id, b->identity, b);
+        break;
+      });
+  }
+}
+
+/** Release the bridge_list indexes. */
+static void
+bridge_index_free_all(void)
+{
+  if (bridges_by_addrport)
+    strmap_free(bridges_by_addrport, (void (*)(void*))smartlist_free);
+  bridges_by_addrport = NULL;
+  if (bridges_by_id)
+    digestmap_free(bridges_by_id, NULL);
+  bridges_by_id = NULL;
+}
 
 /** Mark every entry of the bridge list to be removed on our next call to
  * sweep_bridge_list unless it has first been un-marked. */
@@ -4578,6 +5115,7 @@ sweep_bridge_list(void)
     bridge_list = smartlist_create();
   SMARTLIST_FOREACH_BEGIN(bridge_list, bridge_info_t *, b) {
     if (b->marked_for_removal) {
+      bridge_index_remove(b);
       SMARTLIST_DEL_CURRENT(bridge_list, b);
       bridge_free(b);
     }
@@ -4590,6 +5128,7 @@ clear_bridge_list(void)
 {
   if (!bridge_list)
     bridge_list = smartlist_create();
+  bridge_index_free_all();
   SMARTLIST_FOREACH(bridge_list, bridge_info_t *, b, bridge_free(b));
   smartlist_clear(bridge_list);
 }
@@ -4835,18 +5374,17 @@ get_configured_bridge_by_addr_port_digest(const tor_addr_t *addr,
                                           uint16_t port,
                                           const char *digest)
 {
+  bridge_info_t *bridge;
+  smartlist_t *at_addrport;
   if (!bridge_list)
     return NULL;
-  SMARTLIST_FOREACH_BEGIN(bridge_list, bridge_info_t *, bridge)
-    {
-      if (tor_digest_is_zero(bridge->identity) &&
-          !tor_addr_compare(&bridge->addr, addr, CMP_EXACT) &&
-          bridge->port == port)
-        return bridge;
-      if (digest && tor_memeq(bridge->identity, digest, DIGEST_LEN))
-        return bridge;
-    }
-  SMARTLIST_FOREACH_END(bridge);
+  if (digest && (bridge = find_bridge_by_digest(digest)))
+    return bridge;
+  if ((at_addrport = bridges_get_by_addrport(addr, port))) {
+    SMARTLIST_FOREACH(at_addrport, bridge_info_t *, b,
+                      if (tor_digest_is_zero(b->identity))
+                        return b);
+  }
   return NULL;
 }
 
@@ -4912,6 +5450,7 @@ learned_router_identity(const tor_addr_t *addr, uint16_t port,
     get_configured_bridge_by_addr_port_digest(addr, port, digest);
   if (bridge && tor_digest_is_zero(bridge->identity)) {
     memcpy(bridge->identity, digest, DIGEST_LEN);
+    bridge_index_add_identity(bridge);
     log_notice(LD_DIR, "Learned fingerprint %s for bridge %s:%d",
                hex_str(digest, DIGEST_LEN), fmt_addr(addr), port);
   }
@@ -4945,6 +5484,7 @@ bridge_add_from_config(const tor_addr_t *addr, uint16_t port,
     bridge_list = smartlist_create();
 
   smartlist_add(bridge_list, b);
+  bridge_index_add(b);
 }
 
 /** Return true iff <b>routerset</b> contains the bridge <b>bridge</b>. */
@@ -4969,12 +5509,9 @@ routerset_contains_bridge(const routerset_t *routerset,
 static bridge_info_t *
 find_bridge_by_digest(const char *digest)
 {
-  SMARTLIST_FOREACH(bridge_list, bridge_info_t *, bridge,
-    {
-      if (tor_memeq(bridge->identity, digest, DIGEST_LEN))
-        return bridge;
-    });
-  return NULL;
+  if (!bridges_by_id)
+    return NULL;
+  return digestmap_get(bridges_by_id, digest);
 }
 
 /** If <b>addr</b> and <b>port</b> match the address and port of a
@@ -4989,25 +5526,26 @@ int
 find_transport_by_bridge_addrport(const tor_addr_t *addr, uint16_t port,
                                   const transport_t **transport)
 {
+  const bridge_info_t *bridge;
+  smartlist_t *at_addrport;
+
   *transport = NULL;
   if (!bridge_list)
     return 0;
 
-  SMARTLIST_FOREACH_BEGIN(bridge_list, const bridge_info_t *, bridge) {
-    if (tor_addr_eq(&bridge->addr, addr) &&
-        (bridge->port == port)) { /* bridge matched */
-      if (bridge->transport_name) { /* it also uses pluggable transports */
-        *transport = transport_get_by_name(bridge->transport_name);
-        if (*transport == NULL) { /* it uses pluggable transports, but
-                                     the transport could not be found! */
-          return -1;
-        }
-        return 0;
-      } else { /* bridge matched, but it doesn't use transports. */
-        break;
+  at_addrport = bridges_get_by_addrport(addr, port);
+  if (at_addrport && smartlist_len(at_addrport)) {
+    bridge = smartlist_get(at_addrport, 0); /* bridge matched */
+    if (bridge->transport_name) { /* it also uses pluggable transports */
+      *transport = transport_get_by_name(bridge->transport_name);
+      if (*transport == NULL) { /* it uses pluggable transports, but
+                                   the transport could not be found! */
+        return -1;
       }
+      return 0;
     }
-  } SMARTLIST_FOREACH_END(bridge);
+    /* bridge matched, but it doesn't use transports. */
+  }
 
   *transport = NULL;
   return 0;
@@ -5357,6 +5895,7 @@ entry_guards_free_all(void)
     smartlist_free(entry_guards);
     entry_guards = NULL;
   }
+  entry_guards_index_rebuild();
   clear_bridge_list();
   clear_transport_list();
   smartlist_free(bridge_list);
@@ -36,6 +36,10 @@ origin_circuit_t *origin_circuit_init(uint8_t purpose, int flags);
 origin_circuit_t *circuit_establish_circuit(uint8_t purpose,
                                             extend_info_t *exit,
                                             int flags);
+typedef struct path_batch_t path_batch_t;
+path_batch_t *path_batch_new(uint8_t purpose, int flags);
+void path_batch_free(path_batch_t *batch);
+origin_circuit_t *circuit_establish_circuit_from_batch(path_batch_t *batch);
 int circuit_handle_first_hop(origin_circuit_t *circ);
 void circuit_n_conn_done(or_connection_t *or_conn, int status);
 int inform_testing_reachability(void);
@@ -48,7 +52,9 @@ int circuit_init_cpath_crypto(crypt_path_t *cpath, const char *key_data,
 int circuit_finish_handshake(origin_circuit_t *circ, uint8_t cell_type,
                              const uint8_t *reply);
 int circuit_truncated(origin_circuit_t *circ, crypt_path_t *layer);
-int onionskin_answer(or_circuit_t *circ, uint8_t cell_type,
+struct onion_handshake_t;
+int onionskin_answer(or_circuit_t *circ,
+                     const struct onion_handshake_t *handshake,
                      const char *payload, const char *keys);
 int circuit_all_predicted_ports_handled(time_t now, int *need_uptime,
                                         int *need_capacity);
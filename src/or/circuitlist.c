@@ -10,6 +10,7 @@
  **/
 
 #include "or.h"
+#include "buffers.h"
 #include "circuitbuild.h"
 #include "circuitlist.h"
 #include "circuituse.h"
@@ -18,12 +19,14 @@
 #include "connection_edge.h"
 #include "connection_or.h"
 #include "control.h"
+#include "mempool.h"
 #include "networkstatus.h"
 #include "nodelist.h"
 #include "onion.h"
 #include "relay.h"
 #include "rendclient.h"
 #include "rendcommon.h"
+#include "rendservice.h"
 #include "rephist.h"
 #include "routerlist.h"
 #include "ht.h"
@@ -40,49 +43,434 @@ static void circuit_free(circuit_t *circ);
 static void circuit_free_cpath(crypt_path_t *cpath);
 static void circuit_free_cpath_node(crypt_path_t *victim);
 
+/** Memory pools for the circuit and crypt_path_t objects we allocate
+ * and free with every circuit we build or relay.  Created on first use. */
+static mp_pool_t *origin_circuit_pool = NULL;
+static mp_pool_t *or_circuit_pool = NULL;
+static mp_pool_t *crypt_path_pool = NULL;
+
 /********* END VARIABLES ************/
 
-/** A map from OR connection and circuit ID to circuit.  (Lookup performance is
- * very important here, since we need to do it every time a cell arrives.) */
-typedef struct orconn_circid_circuit_map_t {
-  HT_ENTRY(orconn_circid_circuit_map_t) node;
-  or_connection_t *or_conn;
+/** One slot in an or_connection_t's circuit ID table.  A slot is empty iff
+ * its <b>circuit</b> is NULL. */
+struct circid_table_ent_t {
   circid_t circ_id;
   circuit_t *circuit;
-} orconn_circid_circuit_map_t;
+};
 
-/** Helper for hash tables: compare the OR connection and circuit ID for a and
- * b, and return less than, equal to, or greater than zero appropriately.
- */
+/** Smallest number of slots we allocate for a circuit ID table. Must be a
+ * power of two. */
+#define CIRCID_TABLE_MIN_SIZE 16
+
+/** Return the slot to start probing from for <b>id</b> in a circuit ID
+ * table of <b>size</b> slots.  Circuit IDs are chosen sequentially from a
+ * random start, so a multiplicative hash spreads them well enough. */
+static INLINE unsigned
+circid_table_start(circid_t id, unsigned size)
+{
+  return (((unsigned)id) * 2654435761u) & (size - 1);
+}
+
+/** Return the index of the slot holding <b>id</b> in the circuit ID table
+ * of <b>conn</b>, or -1 if there is none. */
+static int
+circid_table_find(const or_connection_t *conn, circid_t id)
+{
+  unsigned mask, i;
+  const struct circid_table_ent_t *tab = conn->circid_table;
+  if (!conn->circid_table_used)
+    return -1;
+  mask = conn->circid_table_size - 1;
+  for (i = circid_table_start(id, conn->circid_table_size); tab[i].circuit;
+       i = (i+1) & mask) {
+    if (tab[i].circ_id == id)
+      return (int)i;
+  }
+  return -1;
+}
+
+/** Put <b>circ</b> in the circuit ID table <b>tab</b> (of <b>size</b>
+ * slots) under <b>id</b>, replacing any circuit already there.  Return 1 if
+ * we used a new slot, 0 if we replaced an entry. */
+static int
+circid_table_put(struct circid_table_ent_t *tab, unsigned size,
+                 circid_t id, circuit_t *circ)
+{
+  unsigned mask = size - 1, i;
+  for (i = circid_table_start(id, size); tab[i].circuit; i = (i+1) & mask) {
+    if (tab[i].circ_id == id) {
+      tab[i].circuit = circ;
+      return 0;
+    }
+  }
+  tab[i].circ_id = id;
+  tab[i].circuit = circ;
+  return 1;
+}
+
+/** Resize the circuit ID table of <b>conn</b> to <b>new_size</b> slots,
+ * rehashing every entry. */
+static void
+circid_table_resize(or_connection_t *conn, unsigned new_size)
+{
+  struct circid_table_ent_t *old = conn->circid_table;
+  unsigned old_size = conn->circid_table_size, i;
+  conn->circid_table = tor_malloc_zero(new_size * sizeof(*old));
+  conn->circid_table_size = new_size;
+  for (i = 0; i < old_size; ++i) {
+    if (old[i].circuit)
+      circid_table_put(conn->circid_table, new_size,
+                       old[i].circ_id, old[i].circuit);
+  }
+  tor_free(old);
+}
+
+/** Map <b>id</b> to <b>circ</b> in the circuit ID table of <b>conn</b>,
+ * growing the table to keep its load factor at or below one half. */
+static void
+circid_table_insert(or_connection_t *conn, circid_t id, circuit_t *circ)
+{
+  if ((conn->circid_table_used + 1) * 2 > conn->circid_table_size) {
+    unsigned new_size = conn->circid_table_size ?
+      conn->circid_table_size * 2 : CIRCID_TABLE_MIN_SIZE;
+    circid_table_resize(conn, new_size);
+  }
+  conn->circid_table_used +=
+    circid_table_put(conn->circid_table, conn->circid_table_size, id, circ);
+}
+
+/** Remove the entry for <b>id</b> from the circuit ID table of <b>conn</b>.
+ * Return 1 if there was such an entry, 0 otherwise.  We use backward-shift
+ * deletion rather than tombstones, so a busy connection's table never
+ * fills up with dead slots. */
+static int
+circid_table_remove(or_connection_t *conn, circid_t id)
+{
+  struct circid_table_ent_t *tab = conn->circid_table;
+  unsigned mask, i, j;
+  int idx = circid_table_find(conn, id);
+  if (idx < 0)
+    return 0;
+  mask = conn->circid_table_size - 1;
+  i = (unsigned)idx;
+  for (j = (i+1) & mask; tab[j].circuit; j = (j+1) & mask) {
+    unsigned k = circid_table_start(tab[j].circ_id, conn->circid_table_size);
+    /* Move entry j into the hole at i unless its home slot k lies
+     * cyclically within (i, j]. */
+    if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+    tab[i] = tab[j];
+    i = j;
+  }
+  tab[i].circuit = NULL;
+  tab[i].circ_id = 0;
+  if (--conn->circid_table_used == 0) {
+    tor_free(conn->circid_table);
+    conn->circid_table_size = 0;
+  }
+  return 1;
+}
+
+/** Release all storage held by the circuit ID table of <b>conn</b>. */
+void
+circuit_free_circid_table(or_connection_t *conn)
+{
+  tor_free(conn->circid_table);
+  conn->circid_table_size = conn->circid_table_used = 0;
+}
+
+/** Map from rendezvous cookie to the or_circuit_t waiting at this
+ * rendezvous point with that cookie. */
+static digestmap_t *rend_cookie_map = NULL;
+/** Map from hidden service key digest to the or_circuit_t acting as an
+ * introduction point for that service. */
+static digestmap_t *intro_point_map = NULL;
+/** Map from hidden service key digest to a smartlist of the
+ * origin_circuit_t whose rend_data names that service. */
+static digestmap_t *rend_pk_circ_map = NULL;
+/** Map from lowercased onion address to a smartlist of the
+ * origin_circuit_t whose rend_data names that address. */
+static strmap_t *rend_query_circ_map = NULL;
+
+/** Remove <b>circ</b> from whichever of rend_cookie_map and intro_point_map
+ * it is in, and clear its rend_token. */
+void
+circuit_clear_rend_token(or_circuit_t *circ)
+{
+  digestmap_t *map;
+  if (circ->rend_token_type == REND_TOKEN_COOKIE)
+    map = rend_cookie_map;
+  else if (circ->rend_token_type == REND_TOKEN_INTRO)
+    map = intro_point_map;
+  else
+    return;
+  /* Only drop the entry if it is still ours: a newer circuit may have
+   * replaced us. */
+  if (map && digestmap_get(map, circ->rend_token) == circ)
+    digestmap_remove(map, circ->rend_token);
+  circ->rend_token_type = REND_TOKEN_NONE;
+  memset(circ->rend_token, 0, sizeof(circ->rend_token));
+}
+
+/** Helper: set the rend_token of <b>circ</b> to <b>token</b>, of type
+ * <b>type</b>, and index it in <b>*mapp</b>. */
+static void
+circuit_set_rend_token(or_circuit_t *circ, int type, digestmap_t **mapp,
+                       const char *token)
+{
+  or_circuit_t *old;
+  circuit_clear_rend_token(circ);
+  if (!*mapp)
+    *mapp = digestmap_new();
+  memcpy(circ->rend_token, token, DIGEST_LEN);
+  circ->rend_token_type = type;
+  old = digestmap_set(*mapp, token, circ);
+  if (old && old != circ)
+    old->rend_token_type = REND_TOKEN_NONE;
+}
+
+/** Set <b>circ</b>'s rendezvous cookie to <b>cookie</b>, so that
+ * circuit_get_rendezvous() can find it. */
+void
+circuit_set_rendezvous_cookie(or_circuit_t *circ, const char *cookie)
+{
+  circuit_set_rend_token(circ, REND_TOKEN_COOKIE, &rend_cookie_map, cookie);
+}
+
+/** Set <b>circ</b>'s introduction point key digest to <b>digest</b>, so
+ * that circuit_get_intro_point() can find it. */
+void
+circuit_set_intro_point_digest(or_circuit_t *circ, const char *digest)
+{
+  circuit_set_rend_token(circ, REND_TOKEN_INTRO, &intro_point_map, digest);
+}
+
+/** Helper: return a newly allocated lowercased copy of <b>onion_address</b>
+ * for use as a key in rend_query_circ_map. */
+static char *
+rend_query_key(const char *onion_address)
+{
+  char *key = tor_strdup(onion_address);
+  tor_strlower(key);
+  return key;
+}
+
+/** Remove <b>circ</b> from rend_pk_circ_map and rend_query_circ_map. */
+static void
+circuit_unindex_rend_data(origin_circuit_t *circ)
+{
+  rend_data_t *rd = circ->rend_data;
+  smartlist_t *sl;
+  if (!rd)
+    return;
+  if (rend_pk_circ_map &&
+      (sl = digestmap_get(rend_pk_circ_map, rd->rend_pk_digest))) {
+    smartlist_remove(sl, circ);
+    if (!smartlist_len(sl)) {
+      digestmap_remove(rend_pk_circ_map, rd->rend_pk_digest);
+      smartlist_free(sl);
+    }
+  }
+  if (rend_query_circ_map && rd->onion_address[0]) {
+    char *key = rend_query_key(rd->onion_address);
+    if ((sl = strmap_get(rend_query_circ_map, key))) {
+      smartlist_remove(sl, circ);
+      if (!smartlist_len(sl)) {
+        strmap_remove(rend_query_circ_map, key);
+        smartlist_free(sl);
+      }
+    }
+    tor_free(key);
+  }
+}
+
+/** Add <b>circ</b> to rend_pk_circ_map and rend_query_circ_map according
+ * to its rend_data. */
+static void
+circuit_index_rend_data(origin_circuit_t *circ)
+{
+  rend_data_t *rd = circ->rend_data;
+  smartlist_t *sl;
+  if (!rd)
+    return;
+  if (!tor_digest_is_zero(rd->rend_pk_digest)) {
+    if (!rend_pk_circ_map)
+      rend_pk_circ_map = digestmap_new();
+    if (!(sl = digestmap_get(rend_pk_circ_map, rd->rend_pk_digest))) {
+      sl = smartlist_create();
+      digestmap_set(rend_pk_circ_map, rd->rend_pk_digest, sl);
+    }
+    smartlist_add(sl, circ);
+  }
+  if (rd->onion_address[0]) {
+    char *key = rend_query_key(rd->onion_address);
+    if (!rend_query_circ_map)
+      rend_query_circ_map = strmap_new();
+    if (!(sl = strmap_get(rend_query_circ_map, key))) {
+      sl = smartlist_create();
+      strmap_set(rend_query_circ_map, key, sl);
+    }
+    smartlist_add(sl, circ);
+    tor_free(key);
+  }
+}
+
+/** Number of buckets in cannibalize_index: one per combination of
+ * need_uptime, need_capacity and is_internal. */
+#define N_CANNIBALIZE_BUCKETS 8
+/** Open, general-purpose origin circuits that circuit_find_to_cannibalize()
+ * might be able to use, bucketed by cannibalize_bucket_idx().  Entries stop
+ * being usable when they get dirty, marked, or repurposed; we drop those
+ * lazily when a lookup runs into them. */
+static smartlist_t *cannibalize_index[N_CANNIBALIZE_BUCKETS];
+
+/** Return the cannibalize_index bucket for circuits with the given build
+ * flags. */
 static INLINE int
-_orconn_circid_entries_eq(orconn_circid_circuit_map_t *a,
-                          orconn_circid_circuit_map_t *b)
+cannibalize_bucket_idx(int need_uptime, int need_capacity, int internal)
 {
-  return a->or_conn == b->or_conn && a->circ_id == b->circ_id;
+  return (need_uptime ? 4 : 0) | (need_capacity ? 2 : 0) | (internal ? 1 : 0);
 }
 
-/** Helper: return a hash based on circuit ID and the pointer value of
- * or_conn in <b>a</b>. */
-static INLINE unsigned int
-_orconn_circid_entry_hash(orconn_circid_circuit_map_t *a)
+/** Add <b>circ</b> to the cannibalize_index, if it is an open general
+ * circuit that could ever be cannibalized and isn't there already. */
+void
+circuit_add_to_cannibalize_index(origin_circuit_t *circ)
 {
-  return (((unsigned)a->circ_id)<<8) ^ (unsigned)(uintptr_t)(a->or_conn);
+  cpath_build_state_t *state = circ->build_state;
+  smartlist_t *sl;
+  int bucket;
+  if (circ->in_cannibalize_index ||
+      TO_CIRCUIT(circ)->state != CIRCUIT_STATE_OPEN ||
+      TO_CIRCUIT(circ)->purpose != CIRCUIT_PURPOSE_C_GENERAL ||
+      !state || state->onehop_tunnel)
+    return;
+
+  bucket = cannibalize_bucket_idx(state->need_uptime, state->need_capacity,
+                                  state->is_internal);
+  if (!cannibalize_index[bucket])
+    cannibalize_index[bucket] = smartlist_create();
+  sl = cannibalize_index[bucket];
+  circ->in_cannibalize_index = 1;
+  circ->cannibalize_bucket = bucket;
+  circ->cannibalize_idx = smartlist_len(sl);
+  smartlist_add(sl, circ);
 }
 
-/** Map from [orconn,circid] to circuit. */
-static HT_HEAD(orconn_circid_map, orconn_circid_circuit_map_t)
-     orconn_circid_circuit_map = HT_INITIALIZER();
-HT_PROTOTYPE(orconn_circid_map, orconn_circid_circuit_map_t, node,
-             _orconn_circid_entry_hash, _orconn_circid_entries_eq)
-HT_GENERATE(orconn_circid_map, orconn_circid_circuit_map_t, node,
-            _orconn_circid_entry_hash, _orconn_circid_entries_eq, 0.6,
-            malloc, realloc, free)
+/** Remove <b>circ</b> from the cannibalize_index, if it is there. */
+static void
+circuit_remove_from_cannibalize_index(origin_circuit_t *circ)
+{
+  smartlist_t *sl;
+  int idx = circ->cannibalize_idx;
+  if (!circ->in_cannibalize_index)
+    return;
 
-/** The most recently returned entry from circuit_get_by_circid_orconn;
- * used to improve performance when many cells arrive in a row from the
- * same circuit.
- */
-orconn_circid_circuit_map_t *_last_circid_orconn_ent = NULL;
+  sl = cannibalize_index[circ->cannibalize_bucket];
+  tor_assert(sl && smartlist_get(sl, idx) == circ);
+  smartlist_del(sl, idx);
+  if (idx < smartlist_len(sl)) {
+    /* smartlist_del moved the last entry into our slot. */
+    origin_circuit_t *moved = smartlist_get(sl, idx);
+    moved->cannibalize_idx = idx;
+  }
+  circ->in_cannibalize_index = 0;
+}
+
+/** Every origin circuit, in no particular order, so that the client-side
+ * expiry functions needn't walk all the OR circuits on a busy relay. */
+static smartlist_t *global_origin_circuit_list = NULL;
+
+/** Return a list of every origin circuit.  The caller must not modify it,
+ * though it's safe to mark circuits while iterating over it. */
+smartlist_t *
+circuit_get_global_origin_circuit_list(void)
+{
+  if (!global_origin_circuit_list)
+    global_origin_circuit_list = smartlist_create();
+  return global_origin_circuit_list;
+}
+
+/** Remove <b>circ</b> from the global_origin_circuit_list. */
+static void
+circuit_remove_from_origin_circuit_list(origin_circuit_t *circ)
+{
+  smartlist_t *sl = global_origin_circuit_list;
+  int idx = circ->global_origin_circuit_list_idx;
+  tor_assert(sl && smartlist_get(sl, idx) == circ);
+  smartlist_del(sl, idx);
+  if (idx < smartlist_len(sl)) {
+    /* smartlist_del moved the last entry into our slot. */
+    origin_circuit_t *moved = smartlist_get(sl, idx);
+    moved->global_origin_circuit_list_idx = idx;
+  }
+}
+
+/** First-hop OR circuits, as a priority queue ordered by idle_check_time,
+ * so that circuit_expire_old_circuits_serverside() only has to look at the
+ * ones that might have been idle long enough. */
+static smartlist_t *idle_check_queue = NULL;
+
+/** Helper for idle_check_queue: compare the idle_check_time of two
+ * or_circuit_t. */
+static int
+_compare_or_circs_by_idle_check(const void *_a, const void *_b)
+{
+  const or_circuit_t *a = _a, *b = _b;
+  if (a->idle_check_time < b->idle_check_time)
+    return -1;
+  else if (a->idle_check_time > b->idle_check_time)
+    return 1;
+  else
+    return 0;
+}
+
+/** Arrange for circuit_pop_due_idle_check() to return <b>circ</b> once it
+ * is <b>when</b>, replacing any time we'd previously scheduled. */
+void
+circuit_schedule_idle_check(or_circuit_t *circ, time_t when)
+{
+  if (!idle_check_queue)
+    idle_check_queue = smartlist_create();
+  if (circ->idle_check_idx >= 0)
+    smartlist_pqueue_remove(idle_check_queue, _compare_or_circs_by_idle_check,
+                            STRUCT_OFFSET(or_circuit_t, idle_check_idx),
+                            circ);
+  circ->idle_check_time = when;
+  smartlist_pqueue_add(idle_check_queue, _compare_or_circs_by_idle_check,
+                       STRUCT_OFFSET(or_circuit_t, idle_check_idx), circ);
+}
+
+/** If some circuit's idle check was scheduled for <b>now</b> or earlier,
+ * remove it from the queue and return it.  Otherwise return NULL. */
+or_circuit_t *
+circuit_pop_due_idle_check(time_t now)
+{
+  or_circuit_t *circ;
+  if (!idle_check_queue || !smartlist_len(idle_check_queue))
+    return NULL;
+  circ = smartlist_get(idle_check_queue, 0);
+  if (circ->idle_check_time > now)
+    return NULL;
+  smartlist_pqueue_pop(idle_check_queue, _compare_or_circs_by_idle_check,
+                       STRUCT_OFFSET(or_circuit_t, idle_check_idx));
+  circ->idle_check_idx = -1;
+  return circ;
+}
+
+/** Replace the rend_data of <b>circ</b> with <b>rend_data</b> (which may be
+ * NULL), taking ownership of it and freeing the old one.  Always use this
+ * rather than assigning rend_data directly, so that the lookup indexes for
+ * hidden service circuits stay correct. */
+void
+circuit_set_rend_data(origin_circuit_t *circ, rend_data_t *rend_data)
+{
+  circuit_unindex_rend_data(circ);
+  if (circ->rend_data != rend_data)
+    rend_data_free(circ->rend_data);
+  circ->rend_data = rend_data;
+  circuit_index_rend_data(circ);
+}
 
 /** Implementation helper for circuit_set_{p,n}_circid_orconn: A circuit ID
  * and/or or_connection for circ has just changed from <b>old_conn, old_id</b>
@@ -93,8 +481,6 @@ circuit_set_circid_orconn_helper(circuit_t *circ, int direction,
                                  circid_t id,
                                  or_connection_t *conn)
 {
-  orconn_circid_circuit_map_t search;
-  orconn_circid_circuit_map_t *found;
   or_connection_t *old_conn, **conn_ptr;
   circid_t old_id, *circid_ptr;
   int was_active, make_active;
@@ -117,23 +503,11 @@ circuit_set_circid_orconn_helper(circuit_t *circ, int direction,
   if (id == old_id && conn == old_conn)
     return;
 
-  if (_last_circid_orconn_ent &&
-      ((old_id == _last_circid_orconn_ent->circ_id &&
-        old_conn == _last_circid_orconn_ent->or_conn) ||
-       (id == _last_circid_orconn_ent->circ_id &&
-        conn == _last_circid_orconn_ent->or_conn))) {
-    _last_circid_orconn_ent = NULL;
-  }
-
   if (old_conn) { /* we may need to remove it from the conn-circid map */
     tor_assert(old_conn->_base.magic == OR_CONNECTION_MAGIC);
-    search.circ_id = old_id;
-    search.or_conn = old_conn;
-    found = HT_REMOVE(orconn_circid_map, &orconn_circid_circuit_map, &search);
-    if (found) {
-      tor_free(found);
-      --old_conn->n_circuits;
-    }
+    if (circid_table_remove(old_conn, old_id) &&
+        --old_conn->n_circuits == 0)
+      connection_or_clear_best_for_extend(old_conn);
     if (was_active && old_conn != conn)
       make_circuit_inactive_on_conn(circ,old_conn);
   }
@@ -146,23 +520,13 @@ circuit_set_circid_orconn_helper(circuit_t *circ, int direction,
   if (conn == NULL)
     return;
 
-  /* now add the new one to the conn-circid map */
-  search.circ_id = id;
-  search.or_conn = conn;
-  found = HT_FIND(orconn_circid_map, &orconn_circid_circuit_map, &search);
-  if (found) {
-    found->circuit = circ;
-  } else {
-    found = tor_malloc_zero(sizeof(orconn_circid_circuit_map_t));
-    found->circ_id = id;
-    found->or_conn = conn;
-    found->circuit = circ;
-    HT_INSERT(orconn_circid_map, &orconn_circid_circuit_map, found);
-  }
+  /* now add the new one to the conn's circuit ID table */
+  circid_table_insert(conn, id, circ);
   if (make_active && old_conn != conn)
     make_circuit_active_on_conn(circ,conn);
 
-  ++conn->n_circuits;
+  if (++conn->n_circuits == 1)
+    connection_or_clear_best_for_extend(conn);
 }
 
 /** Set the p_conn field of a circuit <b>circ</b>, along
@@ -213,6 +577,12 @@ circuit_set_state(circuit_t *circ, uint8_t state)
   if (state == CIRCUIT_STATE_OPEN)
     tor_assert(!circ->n_conn_onionskin);
   circ->state = state;
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    if (state == CIRCUIT_STATE_OPEN)
+      circuit_add_to_cannibalize_index(TO_ORIGIN_CIRCUIT(circ));
+    else
+      circuit_remove_from_cannibalize_index(TO_ORIGIN_CIRCUIT(circ));
+  }
 }
 
 /** Add <b>circ</b> to the global list of circuits. This is called only from
@@ -525,6 +895,65 @@ init_circuit_base(circuit_t *circ)
   circuit_add(circ);
 }
 
+/** Return a new zeroed object of <b>size</b> bytes from <b>*poolp</b>,
+ * creating the pool if we haven't yet. */
+static void *
+circuit_pool_alloc(mp_pool_t **poolp, size_t size)
+{
+  void *mem;
+  if (!*poolp)
+    *poolp = mp_pool_new(size, 64*1024);
+  mem = mp_pool_get(*poolp);
+  memset(mem, 0, size);
+  return mem;
+}
+
+/** Allocate and return a new zeroed crypt_path_t, with its magic set. */
+crypt_path_t *
+crypt_path_new(void)
+{
+  crypt_path_t *cpath = circuit_pool_alloc(&crypt_path_pool,
+                                           sizeof(crypt_path_t));
+  cpath->magic = CRYPT_PATH_MAGIC;
+  return cpath;
+}
+
+/** Give any empty chunks in the circuit and crypt_path_t pools back to the
+ * system allocator. */
+void
+circuit_clean_pools(void)
+{
+  if (origin_circuit_pool)
+    mp_pool_clean(origin_circuit_pool, 0, 1);
+  if (or_circuit_pool)
+    mp_pool_clean(or_circuit_pool, 0, 1);
+  if (crypt_path_pool)
+    mp_pool_clean(crypt_path_pool, 0, 1);
+}
+
+/** Set *<b>stats_out</b> to a summary of <b>pool</b>, which may be NULL. */
+static void
+circuit_pool_get_stats(const mp_pool_t *pool, mp_pool_stats_t *stats_out)
+{
+  if (pool)
+    mp_pool_get_stats(pool, stats_out);
+  else
+    memset(stats_out, 0, sizeof(*stats_out));
+}
+
+/** Set *<b>origin_out</b>, *<b>or_out</b>, and *<b>cpath_out</b> to
+ * summaries of the pools that origin circuits, OR circuits, and
+ * crypt_path_t objects come from. */
+void
+circuit_get_pool_stats(struct mp_pool_stats_t *origin_out,
+                       struct mp_pool_stats_t *or_out,
+                       struct mp_pool_stats_t *cpath_out)
+{
+  circuit_pool_get_stats(origin_circuit_pool, origin_out);
+  circuit_pool_get_stats(or_circuit_pool, or_out);
+  circuit_pool_get_stats(crypt_path_pool, cpath_out);
+}
+
 /** Allocate space for a new circuit, initializing with <b>p_circ_id</b>
  * and <b>p_conn</b>. Add it to the global circuit list.
  */
@@ -536,7 +965,7 @@ origin_circuit_new(void)
    * controller */
   static uint32_t n_circuits_allocated = 1;
 
-  circ = tor_malloc_zero(sizeof(origin_circuit_t));
+  circ = circuit_pool_alloc(&origin_circuit_pool, sizeof(origin_circuit_t));
   circ->_base.magic = ORIGIN_CIRCUIT_MAGIC;
 
   circ->next_stream_id = crypto_rand_int(1<<16);
@@ -546,6 +975,10 @@ origin_circuit_new(void)
 
   init_circuit_base(TO_CIRCUIT(circ));
 
+  circ->global_origin_circuit_list_idx =
+    smartlist_len(circuit_get_global_origin_circuit_list());
+  smartlist_add(global_origin_circuit_list, circ);
+
   circ_times.last_circ_at = approx_time();
 
   return circ;
@@ -559,13 +992,14 @@ or_circuit_new(circid_t p_circ_id, or_connection_t *p_conn)
   /* CircIDs */
   or_circuit_t *circ;
 
-  circ = tor_malloc_zero(sizeof(or_circuit_t));
+  circ = circuit_pool_alloc(&or_circuit_pool, sizeof(or_circuit_t));
   circ->_base.magic = OR_CIRCUIT_MAGIC;
 
   if (p_conn)
     circuit_set_p_circid_orconn(circ, p_circ_id, p_conn);
 
   circ->remaining_relay_early_cells = MAX_RELAY_EARLY_CELLS_PER_CIRCUIT;
+  circ->idle_check_idx = -1;
 
   init_circuit_base(TO_CIRCUIT(circ));
 
@@ -597,6 +1031,8 @@ circuit_free(circuit_t *circ)
     mem = ocirc;
     memlen = sizeof(origin_circuit_t);
     tor_assert(circ->magic == ORIGIN_CIRCUIT_MAGIC);
+    circuit_remove_from_cannibalize_index(ocirc);
+    circuit_remove_from_origin_circuit_list(ocirc);
     if (ocirc->build_state) {
         extend_info_free(ocirc->build_state->chosen_exit);
         circuit_free_cpath_node(ocirc->build_state->pending_final_cpath);
@@ -606,7 +1042,7 @@ circuit_free(circuit_t *circ)
     circuit_free_cpath(ocirc->cpath);
 
     crypto_free_pk_env(ocirc->intro_key);
-    rend_data_free(ocirc->rend_data);
+    circuit_set_rend_data(ocirc, NULL);
 
     tor_free(ocirc->dest_address);
     if (ocirc->socks_username) {
@@ -631,6 +1067,14 @@ circuit_free(circuit_t *circ)
     crypto_free_cipher_env(ocirc->n_crypto);
     crypto_free_digest_env(ocirc->n_digest);
 
+    circuit_clear_rend_token(ocirc);
+
+    if (ocirc->idle_check_idx >= 0)
+      smartlist_pqueue_remove(idle_check_queue,
+                              _compare_or_circs_by_idle_check,
+                              STRUCT_OFFSET(or_circuit_t, idle_check_idx),
+                              ocirc);
+
     if (ocirc->rend_splice) {
       or_circuit_t *other = ocirc->rend_splice;
       tor_assert(other->_base.magic == OR_CIRCUIT_MAGIC);
@@ -656,7 +1100,7 @@ circuit_free(circuit_t *circ)
   cell_queue_clear(&circ->n_conn_cells);
 
   memset(mem, 0xAA, memlen); /* poison memory */
-  tor_free(mem);
+  mp_pool_release(mem);
 }
 
 /** Deallocate space associated with the linked list <b>cpath</b>. */
@@ -701,8 +1145,40 @@ circuit_free_all(void)
 
   smartlist_free(circuits_pending_or_conns);
   circuits_pending_or_conns = NULL;
+  smartlist_free(global_origin_circuit_list);
+  global_origin_circuit_list = NULL;
+  smartlist_free(idle_check_queue);
+  idle_check_queue = NULL;
+
+  /* Freeing the circuits emptied these. */
+  digestmap_free(rend_cookie_map, NULL);
+  rend_cookie_map = NULL;
+  digestmap_free(intro_point_map, NULL);
+  intro_point_map = NULL;
+  digestmap_free(rend_pk_circ_map, NULL);
+  rend_pk_circ_map = NULL;
+  strmap_free(rend_query_circ_map, NULL);
+  rend_query_circ_map = NULL;
+  {
+    int i;
+    for (i = 0; i < N_CANNIBALIZE_BUCKETS; ++i) {
+      smartlist_free(cannibalize_index[i]);
+      cannibalize_index[i] = NULL;
+    }
+  }
 
-  HT_CLEAR(orconn_circid_map, &orconn_circid_circuit_map);
+  if (origin_circuit_pool) {
+    mp_pool_destroy(origin_circuit_pool);
+    origin_circuit_pool = NULL;
+  }
+  if (or_circuit_pool) {
+    mp_pool_destroy(or_circuit_pool);
+    or_circuit_pool = NULL;
+  }
+  if (crypt_path_pool) {
+    mp_pool_destroy(crypt_path_pool);
+    crypt_path_pool = NULL;
+  }
 }
 
 /** Deallocate space associated with the cpath node <b>victim</b>. */
@@ -720,7 +1196,7 @@ circuit_free_cpath_node(crypt_path_t *victim)
   extend_info_free(victim->extend_info);
 
   memset(victim, 0xBB, sizeof(crypt_path_t)); /* poison memory */
-  tor_free(victim);
+  mp_pool_release(victim);
 }
 
 /** A helper function for circuit_dump_by_conn() below. Log a bunch
@@ -823,21 +1299,9 @@ circuit_get_by_global_id(uint32_t id)
 static INLINE circuit_t *
 circuit_get_by_circid_orconn_impl(circid_t circ_id, or_connection_t *conn)
 {
-  orconn_circid_circuit_map_t search;
-  orconn_circid_circuit_map_t *found;
-
-  if (_last_circid_orconn_ent &&
-      circ_id == _last_circid_orconn_ent->circ_id &&
-      conn == _last_circid_orconn_ent->or_conn) {
-    found = _last_circid_orconn_ent;
-  } else {
-    search.circ_id = circ_id;
-    search.or_conn = conn;
-    found = HT_FIND(orconn_circid_map, &orconn_circid_circuit_map, &search);
-    _last_circid_orconn_ent = found;
-  }
-  if (found && found->circuit)
-    return found->circuit;
+  int idx = circid_table_find(conn, circ_id);
+  if (idx >= 0)
+    return conn->circid_table[idx].circuit;
 
   return NULL;
   /* The rest of this checks for bugs. Disabled by default. */
@@ -849,13 +1313,13 @@ circuit_get_by_circid_orconn_impl(circid_t circ_id, or_connection_t *conn)
         or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
         if (or_circ->p_conn == conn && or_circ->p_circ_id == circ_id) {
           log_warn(LD_BUG,
-                   "circuit matches p_conn, but not in hash table (Bug!)");
+                   "circuit matches p_conn, but not in circid table (Bug!)");
           return circ;
         }
       }
       if (circ->n_conn == conn && circ->n_circ_id == circ_id) {
         log_warn(LD_BUG,
-                 "circuit matches n_conn, but not in hash table (Bug!)");
+                 "circuit matches n_conn, but not in circid table (Bug!)");
         return circ;
       }
     }
@@ -902,17 +1366,29 @@ circuit_get_by_edge_conn(edge_connection_t *conn)
 }
 
 /** For each circuit that has <b>conn</b> as n_conn or p_conn, unlink the
- * circuit from the orconn,circid map, and mark it for close if it hasn't
- * been marked already.
+ * circuit from <b>conn</b>'s circuit ID table, and mark it for close if it
+ * hasn't been marked already.  This only looks at the circuits on
+ * <b>conn</b>, not at the whole circuit list.
  */
 void
 circuit_unlink_all_from_or_conn(or_connection_t *conn, int reason)
 {
-  circuit_t *circ;
+  smartlist_t *circs;
+  unsigned i;
 
   connection_or_unlink_all_active_circs(conn);
 
-  for (circ = global_circuitlist; circ; circ = circ->next) {
+  /* Unlinking changes the table under us, so collect the circuits first.
+   * A circuit that uses conn in both directions shows up twice; the second
+   * visit finds it already unlinked and does nothing. */
+  circs = smartlist_create();
+  for (i = 0; i < conn->circid_table_size; ++i) {
+    circuit_t *circ = conn->circid_table[i].circuit;
+    if (circ)
+      smartlist_add(circs, circ);
+  }
+
+  SMARTLIST_FOREACH_BEGIN(circs, circuit_t *, circ) {
     int mark = 0;
     if (circ->n_conn == conn) {
         circuit_set_n_circid_orconn(circ, 0, NULL);
@@ -927,7 +1403,8 @@ circuit_unlink_all_from_or_conn(or_connection_t *conn, int reason)
     }
     if (mark && !circ->marked_for_close)
       circuit_mark_for_close(circ, reason);
-  }
+  } SMARTLIST_FOREACH_END(circ);
+  smartlist_free(circs);
 }
 
 /** Return a circ such that:
@@ -939,27 +1416,32 @@ circuit_unlink_all_from_or_conn(or_connection_t *conn, int reason)
 origin_circuit_t *
 circuit_get_by_rend_query_and_purpose(const char *rend_query, uint8_t purpose)
 {
-  circuit_t *circ;
+  smartlist_t *sl;
+  char *key;
 
   tor_assert(CIRCUIT_PURPOSE_IS_ORIGIN(purpose));
 
-  for (circ = global_circuitlist; circ; circ = circ->next) {
-    if (!circ->marked_for_close &&
-        circ->purpose == purpose) {
-      origin_circuit_t *ocirc = TO_ORIGIN_CIRCUIT(circ);
-      if (ocirc->rend_data &&
-          !rend_cmp_service_ids(rend_query,
-                                ocirc->rend_data->onion_address))
-        return ocirc;
-    }
-  }
+  if (!rend_query_circ_map)
+    return NULL;
+  key = rend_query_key(rend_query);
+  sl = strmap_get(rend_query_circ_map, key);
+  tor_free(key);
+  if (!sl)
+    return NULL;
+
+  SMARTLIST_FOREACH(sl, origin_circuit_t *, ocirc, {
+    if (!TO_CIRCUIT(ocirc)->marked_for_close &&
+        TO_CIRCUIT(ocirc)->purpose == purpose)
+      return ocirc;
+  });
   return NULL;
 }
 
-/** Return the first circuit originating here in global_circuitlist after
- * <b>start</b> whose purpose is <b>purpose</b>, and where
- * <b>digest</b> (if set) matches the rend_pk_digest field. Return NULL if no
- * circuit is found.  If <b>start</b> is NULL, begin at the start of the list.
+/** Return the first circuit originating here after <b>start</b> whose
+ * purpose is <b>purpose</b>, and where <b>digest</b> (if set) matches the
+ * rend_pk_digest field. Return NULL if no circuit is found.  If <b>start</b>
+ * is NULL, begin at the start of the list.  When <b>digest</b> is set we
+ * only look at the circuits indexed under it, in no particular order.
  */
 origin_circuit_t *
 circuit_get_next_by_pk_and_purpose(origin_circuit_t *start,
@@ -967,6 +1449,29 @@ circuit_get_next_by_pk_and_purpose(origin_circuit_t *start,
 {
   circuit_t *circ;
   tor_assert(CIRCUIT_PURPOSE_IS_ORIGIN(purpose));
+
+  if (digest) {
+    smartlist_t *sl;
+    int i = 0;
+    if (!rend_pk_circ_map ||
+        !(sl = digestmap_get(rend_pk_circ_map, digest)))
+      return NULL;
+    if (start) {
+      for (i = 0; i < smartlist_len(sl); ++i) {
+        if (smartlist_get(sl, i) == start)
+          break;
+      }
+      ++i; /* If start isn't there, this runs us off the end. */
+    }
+    for ( ; i < smartlist_len(sl); ++i) {
+      origin_circuit_t *ocirc = smartlist_get(sl, i);
+      if (!TO_CIRCUIT(ocirc)->marked_for_close &&
+          TO_CIRCUIT(ocirc)->purpose == purpose)
+        return ocirc;
+    }
+    return NULL;
+  }
+
   if (start == NULL)
     circ = global_circuitlist;
   else
@@ -977,31 +1482,24 @@ circuit_get_next_by_pk_and_purpose(origin_circuit_t *start,
       continue;
     if (circ->purpose != purpose)
       continue;
-    if (!digest)
-      return TO_ORIGIN_CIRCUIT(circ);
-    else if (TO_ORIGIN_CIRCUIT(circ)->rend_data &&
-             tor_memeq(TO_ORIGIN_CIRCUIT(circ)->rend_data->rend_pk_digest,
-                     digest, DIGEST_LEN))
-      return TO_ORIGIN_CIRCUIT(circ);
+    return TO_ORIGIN_CIRCUIT(circ);
   }
   return NULL;
 }
 
-/** Return the first OR circuit in the global list whose purpose is
- * <b>purpose</b>, and whose rend_token is the <b>len</b>-byte
- * <b>token</b>. */
+/** Return the OR circuit in <b>map</b> under <b>token</b>, if it is not
+ * marked for close and its purpose is <b>purpose</b>. */
 static or_circuit_t *
-circuit_get_by_rend_token_and_purpose(uint8_t purpose, const char *token,
-                                      size_t len)
+circuit_get_by_rend_token_and_purpose(uint8_t purpose, digestmap_t *map,
+                                      const char *token)
 {
-  circuit_t *circ;
-  for (circ = global_circuitlist; circ; circ = circ->next) {
-    if (! circ->marked_for_close &&
-        circ->purpose == purpose &&
-        tor_memeq(TO_OR_CIRCUIT(circ)->rend_token, token, len))
-      return TO_OR_CIRCUIT(circ);
-  }
-  return NULL;
+  or_circuit_t *circ;
+  if (!map || !(circ = digestmap_get(map, token)))
+    return NULL;
+  if (TO_CIRCUIT(circ)->marked_for_close ||
+      TO_CIRCUIT(circ)->purpose != purpose)
+    return NULL;
+  return circ;
 }
 
 /** Return the circuit waiting for a rendezvous with the provided cookie.
@@ -1012,7 +1510,7 @@ circuit_get_rendezvous(const char *cookie)
 {
   return circuit_get_by_rend_token_and_purpose(
                                      CIRCUIT_PURPOSE_REND_POINT_WAITING,
-                                     cookie, REND_COOKIE_LEN);
+                                     rend_cookie_map, cookie);
 }
 
 /** Return the circuit waiting for intro cells of the given digest.
@@ -1022,8 +1520,8 @@ or_circuit_t *
 circuit_get_intro_point(const char *digest)
 {
   return circuit_get_by_rend_token_and_purpose(
-                                     CIRCUIT_PURPOSE_INTRO_POINT, digest,
-                                     DIGEST_LEN);
+                                     CIRCUIT_PURPOSE_INTRO_POINT,
+                                     intro_point_map, digest);
 }
 
 /** Return a circuit that is open, is CIRCUIT_PURPOSE_C_GENERAL,
@@ -1041,8 +1539,7 @@ origin_circuit_t *
 circuit_find_to_cannibalize(uint8_t purpose, extend_info_t *info,
                             int flags)
 {
-  circuit_t *_circ;
-  origin_circuit_t *best=NULL;
+  int uptime, capacity;
   int need_uptime = (flags & CIRCLAUNCH_NEED_UPTIME) != 0;
   int need_capacity = (flags & CIRCLAUNCH_NEED_CAPACITY) != 0;
   int internal = (flags & CIRCLAUNCH_IS_INTERNAL) != 0;
@@ -1057,19 +1554,28 @@ circuit_find_to_cannibalize(uint8_t purpose, extend_info_t *info,
             "capacity %d, internal %d",
             purpose, need_uptime, need_capacity, internal);
 
-  for (_circ=global_circuitlist; _circ; _circ = _circ->next) {
-    if (CIRCUIT_IS_ORIGIN(_circ) &&
-        _circ->state == CIRCUIT_STATE_OPEN &&
-        !_circ->marked_for_close &&
-        _circ->purpose == CIRCUIT_PURPOSE_C_GENERAL &&
-        !_circ->timestamp_dirty) {
-      origin_circuit_t *circ = TO_ORIGIN_CIRCUIT(_circ);
-      if ((!need_uptime || circ->build_state->need_uptime) &&
-          (!need_capacity || circ->build_state->need_capacity) &&
-          (internal == circ->build_state->is_internal) &&
-          circ->remaining_relay_early_cells &&
-          !circ->build_state->onehop_tunnel &&
-          !circ->isolation_values_set) {
+  /* Look through circuits that don't need uptime first, since we'd rather
+   * not spend a stable circuit on something that doesn't need it. */
+  for (uptime = need_uptime; uptime <= 1; ++uptime) {
+    for (capacity = need_capacity; capacity <= 1; ++capacity) {
+      smartlist_t *sl = cannibalize_index[
+                   cannibalize_bucket_idx(uptime, capacity, internal)];
+      int i = 0;
+      while (sl && i < smartlist_len(sl)) {
+        origin_circuit_t *circ = smartlist_get(sl, i);
+        circuit_t *_circ = TO_CIRCUIT(circ);
+        if (_circ->marked_for_close ||
+            _circ->purpose != CIRCUIT_PURPOSE_C_GENERAL ||
+            _circ->timestamp_dirty ||
+            !circ->remaining_relay_early_cells) {
+          /* This circuit can never be cannibalized again; drop it.
+           * Removal moves another circuit into slot i, so don't advance. */
+          circuit_remove_from_cannibalize_index(circ);
+          continue;
+        }
+        ++i;
+        if (circ->isolation_values_set)
+          continue;
         if (info) {
           /* need to make sure we don't duplicate hops */
           crypt_path_t *hop = circ->cpath;
@@ -1099,13 +1605,12 @@ circuit_find_to_cannibalize(uint8_t purpose, extend_info_t *info,
             hop = hop->next;
           } while (hop != circ->cpath);
         }
-        if (!best || (best->build_state->need_uptime && !need_uptime))
-          best = circ;
+        return circ;
       next: ;
       }
     }
   }
-  return best;
+  return NULL;
 }
 
 /** Return the number of hops in circuit's path. */
@@ -1285,6 +1790,11 @@ _circuit_mark_for_close(circuit_t *circ, int reason, int line,
     rend_client_report_intro_point_failure(ocirc->build_state->chosen_exit,
                                            ocirc->rend_data,
                                            INTRO_POINT_FAILURE_UNREACHABLE);
+  } else if ((circ->purpose == CIRCUIT_PURPOSE_S_ESTABLISH_INTRO ||
+              circ->purpose == CIRCUIT_PURPOSE_S_INTRO) &&
+             TO_ORIGIN_CIRCUIT(circ)->rend_data) {
+    /* Let the service know it may need a new intro point. */
+    rend_service_intro_circ_closed(TO_ORIGIN_CIRCUIT(circ));
   }
   if (circ->n_conn) {
     circuit_clear_cell_queue(circ, circ->n_conn);
@@ -1340,6 +1850,149 @@ _circuit_mark_for_close(circuit_t *circ, int reason, int line,
   }
 }
 
+/** Helper for circuits_handle_oom(): the current time, in milliseconds, as
+ * a masked 32-bit value like packed_cell_t.inserted_time. */
+static uint32_t circcomp_now_tmp;
+
+/** Return the age, in milliseconds, of the oldest cell queued on
+ * <b>circ</b>, as of <b>now</b>.  Return 0 if no cells are queued. */
+static uint32_t
+circuit_max_queued_cell_age(const circuit_t *c, uint32_t now)
+{
+  uint32_t age = 0;
+  const packed_cell_t *cell;
+  if ((cell = cell_queue_peek(&c->n_conn_cells)))
+    age = now - cell->inserted_time;
+
+  if (! CIRCUIT_IS_ORIGIN(c)) {
+    const or_circuit_t *orcirc = TO_OR_CIRCUIT((circuit_t*)c);
+    if ((cell = cell_queue_peek(&orcirc->p_conn_cells))) {
+      uint32_t age2 = now - cell->inserted_time;
+      if (age2 > age)
+        age = age2;
+    }
+  }
+  return age;
+}
+
+/** Helper to sort a list of circuit_t by the age of their oldest queued
+ * cell, oldest first. */
+static int
+_circuits_compare_by_oldest_queued_cell(const void **a_, const void **b_)
+{
+  const circuit_t *a = *a_;
+  const circuit_t *b = *b_;
+  uint32_t age_a = circuit_max_queued_cell_age(a, circcomp_now_tmp);
+  uint32_t age_b = circuit_max_queued_cell_age(b, circcomp_now_tmp);
+
+  if (age_a < age_b)
+    return 1;
+  else if (age_a == age_b)
+    return 0;
+  else
+    return -1;
+}
+
+/** Return the number of bytes held in cell queues on <b>circ</b>. */
+static size_t
+circuit_queued_cell_bytes(const circuit_t *circ)
+{
+  size_t n = circ->n_conn_cells.n;
+  if (! CIRCUIT_IS_ORIGIN(circ))
+    n += TO_OR_CIRCUIT((circuit_t*)circ)->p_conn_cells.n;
+  return n * packed_cell_mem_cost();
+}
+
+/** Helper for circuits_handle_oom(): free the data buffered on every stream
+ * in the list starting at <b>stream</b>, and return the number of bytes
+ * that freed. */
+static size_t
+marked_circuit_free_stream_bytes(edge_connection_t *stream)
+{
+  size_t result = 0;
+  for ( ; stream; stream = stream->next_stream) {
+    connection_t *conn = TO_CONN(stream);
+    if (conn->inbuf) {
+      result += buf_allocation(conn->inbuf);
+      buf_clear(conn->inbuf);
+    }
+    if (conn->outbuf) {
+      result += buf_allocation(conn->outbuf);
+      buf_clear(conn->outbuf);
+      conn->outbuf_flushlen = 0;
+    }
+  }
+  return result;
+}
+
+/** We're out of memory for cells and buffers, having allocated
+ * <b>current_allocation</b> bytes.  Kill the circuits whose oldest queued
+ * cells have been waiting the longest, together with their streams, until
+ * we're back under a safe fraction of MaxMemInQueues. */
+void
+circuits_handle_oom(size_t current_allocation)
+{
+  /** When we kill circuits to reclaim memory, try to get down to this
+   * fraction of MaxMemInQueues. */
+#define FRACTION_OF_DATA_TO_RETAIN_ON_OOM 0.90
+  smartlist_t *circlist;
+  circuit_t *circ;
+  size_t mem_target, mem_to_recover, mem_recovered = 0;
+  int n_circuits_killed = 0;
+
+  mem_target = (size_t)(get_options()->MaxMemInQueues *
+                        FRACTION_OF_DATA_TO_RETAIN_ON_OOM);
+  if (current_allocation <= mem_target)
+    return;
+  mem_to_recover = current_allocation - mem_target;
+
+  log_notice(LD_GENERAL, "We're low on memory.  Killing circuits with "
+             "over-long queues. (This behavior is controlled by "
+             "MaxMemInQueues.)");
+
+  /* This algorithm itself assumes that you've got enough memory slack
+   * to actually run it. */
+  circlist = smartlist_create();
+  for (circ = global_circuitlist; circ; circ = circ->next)
+    smartlist_add(circlist, circ);
+
+  /* Set circcomp_now_tmp so that the sort can access it. */
+  circcomp_now_tmp = (uint32_t)approx_monotonic_msec();
+
+  /* This is O(n log n); there are faster algorithms we could use instead.
+   * Let's hope this doesn't happen enough to be in the critical path. */
+  smartlist_sort(circlist, _circuits_compare_by_oldest_queued_cell);
+
+  /* Okay, now the worst circuits are at the front of the list.  Mark them,
+   * and reclaim their storage aggressively. */
+  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, c) {
+    if (c->marked_for_close)
+      continue;
+    mem_recovered += circuit_queued_cell_bytes(c);
+    if (CIRCUIT_IS_ORIGIN(c))
+      mem_recovered +=
+        marked_circuit_free_stream_bytes(TO_ORIGIN_CIRCUIT(c)->p_streams);
+    else
+      mem_recovered +=
+        marked_circuit_free_stream_bytes(TO_OR_CIRCUIT(c)->n_streams);
+    /* Marking the circuit clears its cell queues. */
+    circuit_mark_for_close(c, END_CIRC_REASON_RESOURCELIMIT);
+
+    ++n_circuits_killed;
+    if (mem_recovered >= mem_to_recover)
+      break;
+  } SMARTLIST_FOREACH_END(c);
+
+  clean_cell_pool(); /* In case this helps. */
+  buf_shrink_freelists(1); /* This is necessary to actually release buffer
+                              chunks. */
+
+  log_notice(LD_GENERAL, "Removed "U64_FORMAT" bytes by killing %d circuits.",
+             U64_PRINTF_ARG(mem_recovered), n_circuits_killed);
+
+  smartlist_free(circlist);
+}
+
 /** Verify that cpath layer <b>cp</b> has all of its invariants
  * correct. Trigger an assert if anything is invalid.
  */
@@ -13,6 +13,7 @@
 #define _TOR_CIRCUITLIST_H
 
 circuit_t * _circuit_get_global_list(void);
+smartlist_t *circuit_get_global_origin_circuit_list(void);
 const char *circuit_state_to_string(int state);
 const char *circuit_purpose_to_controller_string(uint8_t purpose);
 const char *circuit_purpose_to_controller_hs_state_string(uint8_t purpose);
@@ -32,6 +33,7 @@ circuit_t *circuit_get_by_circid_orconn(circid_t circ_id,
 int circuit_id_in_use_on_orconn(circid_t circ_id, or_connection_t *conn);
 circuit_t *circuit_get_by_edge_conn(edge_connection_t *conn);
 void circuit_unlink_all_from_or_conn(or_connection_t *conn, int reason);
+void circuit_free_circid_table(or_connection_t *conn);
 origin_circuit_t *circuit_get_by_global_id(uint32_t id);
 origin_circuit_t *circuit_get_by_rend_query_and_purpose(const char *rend_query,
                                                         uint8_t purpose);
@@ -39,6 +41,13 @@ origin_circuit_t *circuit_get_next_by_pk_and_purpose(origin_circuit_t *start,
                                          const char *digest, uint8_t purpose);
 or_circuit_t *circuit_get_rendezvous(const char *cookie);
 or_circuit_t *circuit_get_intro_point(const char *digest);
+void circuit_set_rendezvous_cookie(or_circuit_t *circ, const char *cookie);
+void circuit_set_intro_point_digest(or_circuit_t *circ, const char *digest);
+void circuit_clear_rend_token(or_circuit_t *circ);
+void circuit_set_rend_data(origin_circuit_t *circ, rend_data_t *rend_data);
+void circuit_add_to_cannibalize_index(origin_circuit_t *circ);
+void circuit_schedule_idle_check(or_circuit_t *circ, time_t when);
+or_circuit_t *circuit_pop_due_idle_check(time_t now);
 origin_circuit_t *circuit_find_to_cannibalize(uint8_t purpose,
                                               extend_info_t *info, int flags);
 void circuit_mark_all_unused_circs(void);
@@ -50,6 +59,7 @@ crypt_path_t *circuit_get_cpath_hop(origin_circuit_t *circ, int hopnum);
 void circuit_get_all_pending_on_or_conn(smartlist_t *out,
                                         or_connection_t *or_conn);
 int circuit_count_pending_on_or_conn(or_connection_t *or_conn);
+void circuits_handle_oom(size_t current_allocation);
 
 #define circuit_mark_for_close(c, reason)                               \
   _circuit_mark_for_close((c), (reason), __LINE__, _SHORT_FILE_)
@@ -57,6 +67,12 @@ int circuit_count_pending_on_or_conn(or_connection_t *or_conn);
 void assert_cpath_layer_ok(const crypt_path_t *cp);
 void assert_circuit_ok(const circuit_t *c);
 void circuit_free_all(void);
+crypt_path_t *crypt_path_new(void);
+void circuit_clean_pools(void);
+struct mp_pool_stats_t;
+void circuit_get_pool_stats(struct mp_pool_stats_t *origin_out,
+                            struct mp_pool_stats_t *or_out,
+                            struct mp_pool_stats_t *cpath_out);
 
 #endif
 
@@ -346,7 +346,7 @@ circuit_conforms_to_options(const origin_circuit_t *circ,
 void
 circuit_expire_building(void)
 {
-  circuit_t *victim, *next_circ = global_circuitlist;
+  circuit_t *victim;
   /* circ_times.timeout_ms and circ_times.close_ms are from
    * circuit_build_times_get_initial_timeout() if we haven't computed
    * custom timeouts yet */
@@ -371,12 +371,11 @@ circuit_expire_building(void)
   SET_CUTOFF(close_cutoff, circ_times.close_ms);
   SET_CUTOFF(extremely_old_cutoff, circ_times.close_ms*2 + 1000);
 
-  while (next_circ) {
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_origin_circuit_list(),
+                          origin_circuit_t *, origin_victim) {
     struct timeval cutoff;
-    victim = next_circ;
-    next_circ = next_circ->next;
-    if (!CIRCUIT_IS_ORIGIN(victim) || /* didn't originate here */
-        victim->marked_for_close) /* don't mess with marked circs */
+    victim = TO_CIRCUIT(origin_victim);
+    if (victim->marked_for_close) /* don't mess with marked circs */
       continue;
 
     build_state = TO_ORIGIN_CIRCUIT(victim)->build_state;
@@ -513,7 +512,7 @@ circuit_expire_building(void)
       circuit_mark_for_close(victim, END_CIRC_REASON_MEASUREMENT_EXPIRED);
     else
       circuit_mark_for_close(victim, END_CIRC_REASON_TIMEOUT);
-  }
+  } SMARTLIST_FOREACH_END(origin_victim);
 }
 
 /** Remove any elements in <b>needed_ports</b> that are handled by an
@@ -585,9 +584,33 @@ circuit_stream_is_being_handled(entry_connection_t *conn,
   return 0;
 }
 
-/** Don't keep more than this many unused open circuits around. */
+/** Don't keep more than this many unused open circuits around, unless
+ * PreemptiveCircuitPool asks for more. */
 #define MAX_UNUSED_OPEN_CIRCUITS 14
 
+/** Launch at most this many circuits each time we top up the preemptive
+ * circuit pool. */
+#define MAX_PREEMPTIVE_LAUNCHES_PER_CALL 4
+
+/** Return how many clean exit circuits we should keep ready for streams
+ * that do (if <b>need_uptime</b>) or don't need uptime, if
+ * PreemptiveCircuitPool is set: enough to cover twice the demand we expect
+ * while one circuit builds, plus one, but no more than
+ * PreemptiveCircuitPool.  Return 0 if there has been no recent demand. */
+static int
+circuit_preemptive_pool_target(time_t now, int need_uptime)
+{
+  const or_options_t *options = get_options();
+  double per_sec = rep_hist_get_clean_circ_rate(now, need_uptime);
+  double want;
+  if (per_sec <= 0)
+    return 0;
+  want = 1 + 2 * per_sec * circ_times.timeout_ms / 1000.0;
+  if (want >= options->PreemptiveCircuitPool)
+    return options->PreemptiveCircuitPool;
+  return (int)(want + 0.999);
+}
+
 /** Figure out how many circuits we have open that are clean. Make
  * sure it's enough for all the upcoming behaviors we predict we'll have.
  * But put an upper bound on the total number of circuits.
@@ -596,11 +619,14 @@ static void
 circuit_predict_and_launch_new(void)
 {
   circuit_t *circ;
-  int num=0, num_internal=0, num_uptime_internal=0;
+  int num=0, num_internal=0, num_uptime_internal=0, num_uptime_exit=0;
   int hidserv_needs_uptime=0, hidserv_needs_capacity=1;
   int port_needs_uptime=0, port_needs_capacity=1;
   time_t now = time(NULL);
   int flags = 0;
+  const or_options_t *options = get_options();
+  int max_unused = MAX(MAX_UNUSED_OPEN_CIRCUITS,
+                       options->PreemptiveCircuitPool);
 
   /* First, count how many of each type of circuit we have already. */
   for (circ=global_circuitlist;circ;circ = circ->next) {
@@ -621,12 +647,42 @@ circuit_predict_and_launch_new(void)
       num_internal++;
     if (build_state->need_uptime && build_state->is_internal)
       num_uptime_internal++;
+    if (build_state->need_uptime && !build_state->is_internal)
+      num_uptime_exit++;
   }
 
   /* If that's enough, then stop now. */
-  if (num >= MAX_UNUSED_OPEN_CIRCUITS)
+  if (num >= max_unused)
     return; /* we already have many, making more probably will hurt */
 
+  /* If we're keeping a preemptive pool, top it up to match recent demand,
+   * serving streams that need uptime first: their circuits can carry other
+   * streams too. */
+  if (options->PreemptiveCircuitPool) {
+    int want_uptime = circuit_preemptive_pool_target(now, 1);
+    int want_exit = want_uptime + circuit_preemptive_pool_target(now, 0);
+    int num_exit = num - num_internal, n_launched = 0;
+    int room = MIN(max_unused - num, MAX_PREEMPTIVE_LAUNCHES_PER_CALL);
+    int n_uptime = MIN(room, MAX(0, want_uptime - num_uptime_exit));
+    int n_plain = MIN(room - n_uptime,
+                      MAX(0, want_exit - num_exit - n_uptime));
+    if (n_uptime + n_plain > 0) {
+      log_info(LD_CIRC, "Have %d clean exit circs (%d with uptime), want "
+               "%d (%d); topping up the preemptive pool.",
+               num_exit, num_uptime_exit, want_exit, want_uptime);
+      /* Launch each kind in one batch, so that we only gather the
+       * candidate nodes for their paths once. */
+      if (n_uptime)
+        n_launched = circuit_launch_batch(CIRCUIT_PURPOSE_C_GENERAL,
+                    CIRCLAUNCH_NEED_CAPACITY|CIRCLAUNCH_NEED_UPTIME, n_uptime);
+      if (n_plain && n_launched == n_uptime)
+        n_launched += circuit_launch_batch(CIRCUIT_PURPOSE_C_GENERAL,
+                                        CIRCLAUNCH_NEED_CAPACITY, n_plain);
+    }
+    if (n_launched)
+      return;
+  }
+
   /* Second, see if we need any more exit circuits. */
   /* check if we know of a port that's been requested recently
    * and no circuit is currently available that can handle it. */
@@ -677,7 +733,7 @@ circuit_predict_and_launch_new(void)
    * a good build timeout. But if we're close to our max number we
    * want, don't do another -- we want to leave a few slots open so
    * we can still build circuits preemptively as needed. */
-  if (num < MAX_UNUSED_OPEN_CIRCUITS-2 &&
+  if (num < max_unused-2 &&
       circuit_build_times_needs_circuits_now(&circ_times)) {
     flags = CIRCLAUNCH_NEED_CAPACITY;
     log_info(LD_CIRC,
@@ -821,8 +877,10 @@ circuit_expire_old_circuits_clientside(void)
     cutoff.tv_sec -= get_options()->CircuitIdleTimeout;
   }
 
-  for (circ = global_circuitlist; circ; circ = circ->next) {
-    if (circ->marked_for_close || !CIRCUIT_IS_ORIGIN(circ))
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_origin_circuit_list(),
+                          origin_circuit_t *, origin_circ) {
+    circ = TO_CIRCUIT(origin_circ);
+    if (circ->marked_for_close)
       continue;
     /* If the circuit has been dirty for too long, and there are no streams
      * on it, mark it for close.
@@ -869,53 +927,50 @@ circuit_expire_old_circuits_clientside(void)
         }
       }
     }
-  }
+  } SMARTLIST_FOREACH_END(origin_circ);
 }
 
-/** How long do we wait before killing circuits with the properties
- * described below?
- *
- * Probably we could choose a number here as low as 5 to 10 seconds,
- * since these circs are used for begindir, and a) generally you either
- * ask another begindir question right after or you don't for a long time,
- * b) clients at least through 0.2.1.x choose from the whole set of
- * directory mirrors at each choice, and c) re-establishing a one-hop
- * circuit via create-fast is a light operation assuming the TLS conn is
- * still there.
- *
- * I expect "b" to go away one day when we move to using directory
- * guards, but I think "a" and "c" are good enough reasons that a low
- * number is safe even then.
- */
-#define IDLE_ONE_HOP_CIRC_TIMEOUT 60
-
 /** Find each non-origin circuit that has been unused for too long,
  * has no streams on it, used a create_fast, and ends here: mark it
  * for close.
+ *
+ * We only look at circuits whose idle check is due; see
+ * circuit_schedule_idle_check().  A circuit's idle check time is never
+ * later than the time it could first be closed, so when one turns out
+ * not to be idle yet we just push its check back.
  */
 void
 circuit_expire_old_circuits_serverside(time_t now)
 {
   circuit_t *circ;
   or_circuit_t *or_circ;
-  time_t cutoff = now - IDLE_ONE_HOP_CIRC_TIMEOUT;
+  time_t last_used;
 
-  for (circ = global_circuitlist; circ; circ = circ->next) {
-    if (circ->marked_for_close || CIRCUIT_IS_ORIGIN(circ))
+  while ((or_circ = circuit_pop_due_idle_check(now))) {
+    circ = TO_CIRCUIT(or_circ);
+    /* Once one of these is true, it stays true for the rest of the
+     * circuit's life, so we needn't look at it again. */
+    if (circ->marked_for_close || circ->n_conn || !or_circ->p_conn)
       continue;
-    or_circ = TO_OR_CIRCUIT(circ);
+    if (or_circ->n_streams || or_circ->resolving_streams) {
+      /* We can't tell when the streams will go away; look again on the
+       * next pass. */
+      circuit_schedule_idle_check(or_circ,
+                                  now + IDLE_ONE_HOP_CIRC_RECHECK_INTERVAL);
+      continue;
+    }
     /* If the circuit has been idle for too long, and there are no streams
      * on it, and it ends here, and it used a create_fast, mark it for close.
      */
-    if (or_circ->is_first_hop && !circ->n_conn &&
-        !or_circ->n_streams && !or_circ->resolving_streams &&
-        or_circ->p_conn &&
-        or_circ->p_conn->timestamp_last_added_nonpadding <= cutoff) {
-      log_info(LD_CIRC, "Closing circ_id %d (empty %d secs ago)",
-               or_circ->p_circ_id,
-               (int)(now - or_circ->p_conn->timestamp_last_added_nonpadding));
-      circuit_mark_for_close(circ, END_CIRC_REASON_FINISHED);
+    last_used = or_circ->p_conn->timestamp_last_added_nonpadding;
+    if (last_used > now - IDLE_ONE_HOP_CIRC_TIMEOUT) {
+      circuit_schedule_idle_check(or_circ,
+                                  last_used + IDLE_ONE_HOP_CIRC_TIMEOUT);
+      continue;
     }
+    log_info(LD_CIRC, "Closing circ_id %d (empty %d secs ago)",
+             or_circ->p_circ_id, (int)(now - last_used));
+    circuit_mark_for_close(circ, END_CIRC_REASON_FINISHED);
   }
 }
 
@@ -1015,7 +1070,7 @@ circuit_has_opened(origin_circuit_t *circ)
     case CIRCUIT_PURPOSE_C_ESTABLISH_REND:
       rend_client_rendcirc_has_opened(circ);
       /* Start building an intro circ if we don't have one yet. */
-      connection_ap_attach_pending();
+      connection_ap_attach_pending_for_circ(circ);
       /* This isn't a call to circuit_try_attaching_streams because a
        * circuit in _C_ESTABLISH_REND state isn't connected to its
        * hidden service yet, thus we can't attach streams to it yet,
@@ -1077,14 +1132,14 @@ void
 circuit_try_attaching_streams(origin_circuit_t *circ)
 {
   /* Attach streams to this circuit if we can. */
-  connection_ap_attach_pending();
+  connection_ap_attach_pending_for_circ(circ);
 
   /* The call to circuit_try_clearing_isolation_state here will do
    * nothing and return 0 if we didn't attach any streams to circ
    * above. */
   if (circuit_try_clearing_isolation_state(circ)) {
     /* Maybe *now* we can attach some streams to this circuit. */
-    connection_ap_attach_pending();
+    connection_ap_attach_pending_for_circ(circ);
   }
 }
 
@@ -1211,6 +1266,42 @@ circuit_launch(uint8_t purpose, int flags)
   return circuit_launch_by_extend_info(purpose, NULL, flags);
 }
 
+/** Launch up to <b>n</b> new circuits with purpose <b>purpose</b> and
+ * CIRCLAUNCH_* <b>flags</b>, choosing all of their paths from a single
+ * snapshot of the candidate nodes (see path_batch_new()). Return the number
+ * of circuits we launched; stop at the first one that fails. */
+int
+circuit_launch_batch(uint8_t purpose, int flags, int n)
+{
+  path_batch_t *batch;
+  int n_launched = 0;
+
+  if (n <= 0)
+    return 0;
+  if (!router_have_minimum_dir_info()) {
+    log_debug(LD_CIRC,"Haven't fetched enough directory info yet; canceling "
+              "circuit launch.");
+    return 0;
+  }
+
+  if (n == 1 || !(batch = path_batch_new(purpose, flags))) {
+    while (n_launched < n && circuit_launch(purpose, flags))
+      ++n_launched;
+    return n_launched;
+  }
+
+  while (n_launched < n) {
+    if (did_circs_fail_last_period &&
+        n_circuit_failures > MAX_CIRCUIT_FAILURES)
+      break; /* too many failed circs in a row. don't try. */
+    if (!circuit_establish_circuit_from_batch(batch))
+      break;
+    ++n_launched;
+  }
+  path_batch_free(batch);
+  return n_launched;
+}
+
 /** Launch a new circuit with purpose <b>purpose</b> and exit node
  * <b>extend_info</b> (or NULL to select a random exit node).  If flags
  * contains CIRCLAUNCH_NEED_UPTIME, choose among routers with high uptime.  If
@@ -1549,7 +1640,8 @@ circuit_get_open_circ_or_launch(entry_connection_t *conn,
       rep_hist_note_used_internal(time(NULL), need_uptime, 1);
       if (circ) {
         /* write the service_id into circ */
-        circ->rend_data = rend_data_dup(ENTRY_TO_EDGE_CONN(conn)->rend_data);
+        circuit_set_rend_data(circ,
+                      rend_data_dup(ENTRY_TO_EDGE_CONN(conn)->rend_data));
         if (circ->_base.purpose == CIRCUIT_PURPOSE_C_ESTABLISH_REND &&
             circ->_base.state == CIRCUIT_STATE_OPEN)
           rend_client_rendcirc_has_opened(circ);
@@ -1593,15 +1685,28 @@ optimistic_data_enabled(void)
 {
   const or_options_t *options = get_options();
   if (options->OptimisticData < 0) {
-    /* XXX023 consider having auto default to 1 rather than 0 before
-     * the 0.2.3 branch goes stable. See bug 3617. -RD */
+    /* "auto" means on, unless the consensus tells us otherwise. */
     const int32_t enabled =
-      networkstatus_get_param(NULL, "UseOptimisticData", 0, 0, 1);
+      networkstatus_get_param(NULL, "UseOptimisticData", 1, 0, 1);
     return (int)enabled;
   }
   return options->OptimisticData;
 }
 
+/** Return true iff our configuration allows optimistic data on streams to
+ * <b>port</b>. */
+int
+optimistic_data_allowed_for_port(uint16_t port)
+{
+  const or_options_t *options = get_options();
+  if (smartlist_string_num_isin(options->NoOptimisticDataPorts, port))
+    return 0;
+  if (smartlist_len(options->OptimisticDataPorts) &&
+      !smartlist_string_num_isin(options->OptimisticDataPorts, port))
+    return 0;
+  return 1;
+}
+
 /** Attach the AP stream <b>apconn</b> to circ's linked list of
  * p_streams. Also set apconn's cpath_layer to <b>cpath</b>, or to the last
  * hop in circ's cpath if <b>cpath</b> is NULL.
@@ -1651,7 +1756,8 @@ link_apconn_to_circ(entry_connection_t *apconn, origin_circuit_t *circ,
     /* Okay; we know what exit node this is. */
     if (optimistic_data_enabled() &&
         circ->_base.purpose == CIRCUIT_PURPOSE_C_GENERAL &&
-        exitnode->rs->version_supports_optimistic_data)
+        exitnode->rs->version_supports_optimistic_data &&
+        optimistic_data_allowed_for_port(apconn->socks_request->port))
       apconn->may_use_optimistic_data = 1;
     else
       apconn->may_use_optimistic_data = 0;
@@ -1740,8 +1846,15 @@ connection_ap_handshake_attach_chosen_circuit(entry_connection_t *conn,
 
   base_conn->state = AP_CONN_STATE_CIRCUIT_WAIT;
 
-  if (!circ->_base.timestamp_dirty)
+  if (!circ->_base.timestamp_dirty) {
     circ->_base.timestamp_dirty = time(NULL);
+    if (circ->_base.purpose == CIRCUIT_PURPOSE_C_GENERAL &&
+        !circ->build_state->is_internal &&
+        !circ->build_state->onehop_tunnel)
+      rep_hist_note_clean_circ_used(circ->_base.timestamp_dirty,
+                 smartlist_string_num_isin(get_options()->LongLivedPorts,
+                                           conn->socks_request->port));
+  }
 
   link_apconn_to_circ(conn, circ, cpath);
   tor_assert(conn->socks_request);
@@ -1767,8 +1880,8 @@ connection_ap_handshake_attach_chosen_circuit(entry_connection_t *conn,
  */
 /* XXXX this function should mark for close whenever it returns -1;
  * its callers shouldn't have to worry about that. */
-int
-connection_ap_handshake_attach_circuit(entry_connection_t *conn)
+static int
+connection_ap_handshake_attach_circuit_impl(entry_connection_t *conn)
 {
   connection_t *base_conn = ENTRY_TO_CONN(conn);
   int retval;
@@ -1958,3 +2071,20 @@ connection_ap_handshake_attach_circuit(entry_connection_t *conn)
   }
 }
 
+/** Try to attach <b>conn</b> as connection_ap_handshake_attach_circuit_impl()
+ * does.  If it is left waiting for a circuit, file it in the pending-stream
+ * index so that the circuit it is waiting for can find it; otherwise drop
+ * it from the index. */
+int
+connection_ap_handshake_attach_circuit(entry_connection_t *conn)
+{
+  connection_t *base_conn = ENTRY_TO_CONN(conn);
+  int r = connection_ap_handshake_attach_circuit_impl(conn);
+  if (r == 0 && !base_conn->marked_for_close &&
+      base_conn->state == AP_CONN_STATE_CIRCUIT_WAIT)
+    connection_ap_mark_as_pending_circuit(conn);
+  else
+    connection_ap_forget_pending(conn);
+  return r;
+}
+
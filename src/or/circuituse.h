@@ -23,6 +23,28 @@ int circuit_conforms_to_options(const origin_circuit_t *circ,
 void circuit_build_needed_circs(time_t now);
 void circuit_detach_stream(circuit_t *circ, edge_connection_t *conn);
 
+/** How long do we wait before circuit_expire_old_circuits_serverside()
+ * kills an idle first-hop circuit that ends here?
+ *
+ * Probably we could choose a number here as low as 5 to 10 seconds,
+ * since these circs are used for begindir, and a) generally you either
+ * ask another begindir question right after or you don't for a long time,
+ * b) clients at least through 0.2.1.x choose from the whole set of
+ * directory mirrors at each choice, and c) re-establishing a one-hop
+ * circuit via create-fast is a light operation assuming the TLS conn is
+ * still there.
+ *
+ * I expect "b" to go away one day when we move to using directory
+ * guards, but I think "a" and "c" are good enough reasons that a low
+ * number is safe even then.
+ */
+#define IDLE_ONE_HOP_CIRC_TIMEOUT 60
+
+/** How often do we look again at a first-hop circuit that wasn't idle
+ * because it had streams on it?  This matches how often main.c calls
+ * circuit_expire_old_circuits_serverside(). */
+#define IDLE_ONE_HOP_CIRC_RECHECK_INTERVAL 10
+
 void circuit_expire_old_circuits_serverside(time_t now);
 
 void reset_bandwidth_test(void);
@@ -30,6 +52,7 @@ int circuit_enough_testing_circs(void);
 
 void circuit_has_opened(origin_circuit_t *circ);
 void circuit_try_attaching_streams(origin_circuit_t *circ);
+int optimistic_data_allowed_for_port(uint16_t port);
 void circuit_build_failed(origin_circuit_t *circ);
 
 /** Flag to set when a circuit should have only a single hop. */
@@ -45,6 +68,7 @@ origin_circuit_t *circuit_launch_by_extend_info(uint8_t purpose,
                                                 extend_info_t *info,
                                                 int flags);
 origin_circuit_t *circuit_launch(uint8_t purpose, int flags);
+int circuit_launch_batch(uint8_t purpose, int flags, int n);
 void circuit_reset_failure_count(int timeout);
 int connection_ap_handshake_attach_chosen_circuit(entry_connection_t *conn,
                                                   origin_circuit_t *circ,
@@ -28,6 +28,7 @@
 #include "nodelist.h"
 #include "onion.h"
 #include "relay.h"
+#include "rephist.h"
 #include "router.h"
 #include "routerlist.h"
 
@@ -70,83 +71,26 @@ static void command_process_auth_challenge_cell(var_cell_t *cell,
 static void command_process_authenticate_cell(var_cell_t *cell,
                                           or_connection_t *conn);
 
-#ifdef KEEP_TIMING_STATS
-/** This is a wrapper function around the actual function that processes the
- * <b>cell</b> that just arrived on <b>conn</b>. Increment <b>*time</b>
- * by the number of microseconds used by the call to <b>*func(cell, conn)</b>.
- */
-static void
-command_time_process_cell(cell_t *cell, or_connection_t *conn, int *time,
-                               void (*func)(cell_t *, or_connection_t *))
-{
-  struct timeval start, end;
-  long time_passed;
-
-  tor_gettimeofday(&start);
-
-  (*func)(cell, conn);
-
-  tor_gettimeofday(&end);
-  time_passed = tv_udiff(&start, &end) ;
-
-  if (time_passed > 10000) { /* more than 10ms */
-    log_debug(LD_OR,"That call just took %ld ms.",time_passed/1000);
-  }
-  if (time_passed < 0) {
-    log_info(LD_GENERAL,"That call took us back in time!");
-    time_passed = 0;
-  }
-  *time += time_passed;
-}
-#endif
+/** Handle <b>cell</b>, which just arrived on <b>conn</b>, with the
+ * command_process_<b>tp</b>_cell() function, and remember how long that
+ * took. */
+#define PROCESS_CELL(tp, cl, cn) STMT_BEGIN {                     \
+    struct timeval process_start;                                 \
+    uint8_t process_command = (cl)->command;                      \
+    tor_gettimeofday(&process_start);                             \
+    command_process_ ## tp ## _cell(cl, cn);                      \
+    rep_hist_note_cell_processing_time(process_command,           \
+                                       &process_start);           \
+  } STMT_END
 
 /** Process a <b>cell</b> that was just received on <b>conn</b>. Keep internal
- * statistics about how many of each cell we've processed so far
- * this second, and the total number of microseconds it took to
- * process each type of cell.
+ * statistics about how many of each cell we've processed so far, and how
+ * long it took to process each type of cell.
  */
 void
 command_process_cell(cell_t *cell, or_connection_t *conn)
 {
   int handshaking = (conn->_base.state != OR_CONN_STATE_OPEN);
-#ifdef KEEP_TIMING_STATS
-  /* how many of each cell have we seen so far this second? needs better
-   * name. */
-  static int num_create=0, num_created=0, num_relay=0, num_destroy=0;
-  /* how long has it taken to process each type of cell? */
-  static int create_time=0, created_time=0, relay_time=0, destroy_time=0;
-  static time_t current_second = 0; /* from previous calls to time */
-
-  time_t now = time(NULL);
-
-  if (now > current_second) { /* the second has rolled over */
-    /* print stats */
-    log_info(LD_OR,
-         "At end of second: %d creates (%d ms), %d createds (%d ms), "
-         "%d relays (%d ms), %d destroys (%d ms)",
-         num_create, create_time/1000,
-         num_created, created_time/1000,
-         num_relay, relay_time/1000,
-         num_destroy, destroy_time/1000);
-
-    /* zero out stats */
-    num_create = num_created = num_relay = num_destroy = 0;
-    create_time = created_time = relay_time = destroy_time = 0;
-
-    /* remember which second it is, for next time */
-    current_second = now;
-  }
-#endif
-
-#ifdef KEEP_TIMING_STATS
-#define PROCESS_CELL(tp, cl, cn) STMT_BEGIN {                   \
-    ++num ## tp;                                                \
-    command_time_process_cell(cl, cn, & tp ## time ,            \
-                              command_process_ ## tp ## _cell);  \
-  } STMT_END
-#else
-#define PROCESS_CELL(tp, cl, cn) command_process_ ## tp ## _cell(cl, cn)
-#endif
 
   if (conn->_base.marked_for_close)
     return;
@@ -204,35 +148,12 @@ command_process_cell(cell_t *cell, or_connection_t *conn)
 }
 
 /** Process a <b>cell</b> that was just received on <b>conn</b>. Keep internal
- * statistics about how many of each cell we've processed so far
- * this second, and the total number of microseconds it took to
- * process each type of cell.
+ * statistics about how many of each cell we've processed so far, and how
+ * long it took to process each type of cell.
  */
 void
 command_process_var_cell(var_cell_t *cell, or_connection_t *conn)
 {
-#ifdef KEEP_TIMING_STATS
-  /* how many of each cell have we seen so far this second? needs better
-   * name. */
-  static int num_versions=0, num_certs=0;
-
-  time_t now = time(NULL);
-
-  if (now > current_second) { /* the second has rolled over */
-    /* print stats */
-    log_info(LD_OR,
-             "At end of second: %d versions (%d ms), %d certs (%d ms)",
-             num_versions, versions_time/1000,
-             num_certs, certs_time/1000);
-
-    num_versions = num_certs = 0;
-    versions_time = certs_time = 0;
-
-    /* remember which second it is, for next time */
-    current_second = now;
-  }
-#endif
-
   if (conn->_base.marked_for_close)
     return;
 
@@ -322,6 +243,7 @@ static void
 command_process_create_cell(cell_t *cell, or_connection_t *conn)
 {
   or_circuit_t *circ;
+  const onion_handshake_t *handshake;
   const or_options_t *options = get_options();
   int id_is_high;
 
@@ -378,12 +300,21 @@ command_process_create_cell(cell_t *cell, or_connection_t *conn)
   circ = or_circuit_new(cell->circ_id, conn);
   circ->_base.purpose = CIRCUIT_PURPOSE_OR;
   circuit_set_state(TO_CIRCUIT(circ), CIRCUIT_STATE_ONIONSKIN_PENDING);
-  if (cell->command == CELL_CREATE) {
-    char *onionskin = tor_malloc(ONIONSKIN_CHALLENGE_LEN);
-    memcpy(onionskin, cell->payload, ONIONSKIN_CHALLENGE_LEN);
+  handshake = onion_handshake_by_create_cell(cell->command);
+  tor_assert(handshake);
+  tor_assert(handshake->onionskin_len <= CELL_PAYLOAD_SIZE);
+
+  if (handshake->first_hop_only) {
+    /* Make sure we never try to use the OR connection on which we
+     * received this cell to satisfy an EXTEND request,  */
+    conn->is_connection_with_client = 1;
+  }
+
+  if (handshake->use_cpuworker) {
+    char *onionskin = tor_memdup(cell->payload, handshake->onionskin_len);
 
     /* hand it off to the cpuworkers, and then return. */
-    if (assign_onionskin_to_cpuworker(NULL, circ, onionskin) < 0) {
+    if (assign_onionskin_to_cpuworker(NULL, circ, handshake, onionskin) < 0) {
 #define WARN_HANDOFF_FAILURE_INTERVAL (6*60*60)
       static ratelim_t handoff_warning =
         RATELIM_INIT(WARN_HANDOFF_FAILURE_INTERVAL);
@@ -397,25 +328,25 @@ command_process_create_cell(cell_t *cell, or_connection_t *conn)
     }
     log_debug(LD_OR,"success: handed off onionskin.");
   } else {
-    /* This is a CREATE_FAST cell; we can handle it immediately without using
-     * a CPU worker. */
+    /* This handshake is cheap (e.g. CREATE_FAST); we can handle it
+     * immediately without using a CPU worker. */
     char keys[CPATH_KEY_MATERIAL_LEN];
-    char reply[DIGEST_LEN*2];
-
-    tor_assert(cell->command == CELL_CREATE_FAST);
-
-    /* Make sure we never try to use the OR connection on which we
-     * received this cell to satisfy an EXTEND request,  */
-    conn->is_connection_with_client = 1;
+    char reply[MAX_ONIONSKIN_REPLY_LEN];
+    struct timeval start, end;
 
-    if (fast_server_handshake(cell->payload, (uint8_t*)reply,
-                              (uint8_t*)keys, sizeof(keys))<0) {
+    tor_gettimeofday(&start);
+    if (handshake->server_handshake((const char*)cell->payload, NULL, NULL,
+                                    reply, keys, sizeof(keys))<0) {
       log_warn(LD_OR,"Failed to generate key material. Closing.");
       circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_INTERNAL);
       return;
     }
-    if (onionskin_answer(circ, CELL_CREATED_FAST, reply, keys)<0) {
-      log_warn(LD_OR,"Failed to reply to CREATE_FAST cell. Closing.");
+    tor_gettimeofday(&end);
+    /* These never wait for a cpuworker. */
+    rep_hist_note_onionskin_timing(handshake->stats_type, -1, 0,
+                                   (int)tv_udiff(&start, &end), 0);
+    if (onionskin_answer(circ, handshake, reply, keys)<0) {
+      log_warn(LD_OR,"Failed to reply to %s cell. Closing.", handshake->name);
       circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_INTERNAL);
       return;
     }
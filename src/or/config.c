@@ -170,8 +170,11 @@ typedef struct config_var_t {
 static config_var_t _option_vars[] = {
   OBSOLETE("AccountingMaxKB"),
   V(AccountingMax,               MEMUNIT,  "0 bytes"),
+  V(AccountingPacing,            BOOL,     "0"),
   V(AccountingStart,             STRING,   NULL),
   V(Address,                     STRING,   NULL),
+  V(AdaptiveCPUWorkers,          BOOL,     "0"),
+  V(AdaptiveFlowControl,         BOOL,     "0"),
   V(AllowDotExit,                BOOL,     "0"),
   V(AllowInvalidNodes,           CSV,      "middle,rendezvous"),
   V(AllowNonRFC953Hostnames,     BOOL,     "0"),
@@ -181,6 +184,7 @@ static config_var_t _option_vars[] = {
   V(AlternateDirAuthority,       LINELIST, NULL),
   V(AlternateHSAuthority,        LINELIST, NULL),
   V(AssumeReachable,             BOOL,     "0"),
+  V(AsyncLogging,                BOOL,     "0"),
   V(AuthDirBadDir,               LINELIST, NULL),
   V(AuthDirBadExit,              LINELIST, NULL),
   V(AuthDirInvalid,              LINELIST, NULL),
@@ -197,23 +201,30 @@ static config_var_t _option_vars[] = {
   V(AutomapHostsSuffixes,        CSV,      ".onion,.exit"),
   V(AvoidDiskWrites,             BOOL,     "0"),
   V(BandwidthBurst,              MEMUNIT,  "10 MB"),
+  V(BandwidthClassWeights,       CSV,      NULL),
   V(BandwidthRate,               MEMUNIT,  "5 MB"),
+  V(BatchConnectionEvents,       BOOL,     "0"),
   V(BridgeAuthoritativeDir,      BOOL,     "0"),
   VAR("Bridge",                  LINELIST, Bridges,    NULL),
   V(BridgePassword,              STRING,   NULL),
   V(BridgeRecordUsageByCountry,  BOOL,     "1"),
   V(BridgeRelay,                 BOOL,     "0"),
   V(CellStatistics,              BOOL,     "0"),
+  V(CellTraceSampleInterval,     UINT,     "0"),
   V(LearnCircuitBuildTimeout,    BOOL,     "1"),
   V(CircuitBuildTimeout,         INTERVAL, "0"),
   V(CircuitIdleTimeout,          INTERVAL, "1 hour"),
   V(CircuitStreamTimeout,        INTERVAL, "0"),
   V(CircuitPriorityHalflife,     DOUBLE,  "-100.0"), /*negative:'Use default'*/
+  V(ClientCountSketch,           BOOL,     "0"),
   V(ClientDNSRejectInternalAddresses, BOOL,"1"),
   V(ClientOnly,                  BOOL,     "0"),
+  V(CoalesceTLSWrites,           BOOL,     "0"),
+  V(CompactRouterDescriptors,    BOOL,     "0"),
   V(ClientRejectInternalAddresses, BOOL,   "1"),
   V(ClientTransportPlugin,       LINELIST, NULL),
   V(ConsensusParams,             STRING,   NULL),
+  V(ConsensusSnapshot,           BOOL,     "0"),
   V(ConnLimit,                   UINT,     "1000"),
   V(ConnDirectionStatistics,     BOOL,     "0"),
   V(ConstrainedSockets,          BOOL,     "0"),
@@ -230,6 +241,7 @@ static config_var_t _option_vars[] = {
   V(CookieAuthFile,              STRING,   NULL),
   V(CountPrivateBandwidth,       BOOL,     "0"),
   V(DataDirectory,               FILENAME, NULL),
+  V(DescriptorDigestFilter,      AUTOBOOL, "auto"),
   OBSOLETE("DebugLogFile"),
   V(DisableNetwork,              BOOL,     "0"),
   V(DirAllowPrivateAddresses,    BOOL,     "0"),
@@ -245,6 +257,7 @@ static config_var_t _option_vars[] = {
   OBSOLETE("DirRecordUsageRetainIPs"),
   OBSOLETE("DirRecordUsageSaveInterval"),
   V(DirReqStatistics,            BOOL,     "1"),
+  V(DirSpoolBufferLimit,         MEMUNIT,  "16 MB"),
   VAR("DirServer",               LINELIST, DirServers, NULL),
   V(DisableAllSwap,              BOOL,     "0"),
   V(DisableDebuggerAttachment,   BOOL,     "1"),
@@ -253,6 +266,7 @@ static config_var_t _option_vars[] = {
   V(DNSPort,                     LINELIST, NULL),
   V(DNSListenAddress,            LINELIST, NULL),
   V(DownloadExtraInfo,           BOOL,     "0"),
+  V(EdgeCoalesceDelay,           MSEC_INTERVAL, "0"),
   V(EnforceDistinctSubnets,      BOOL,     "1"),
   V(EntryNodes,                  ROUTERSET,   NULL),
   V(EntryStatistics,             BOOL,     "0"),
@@ -261,9 +275,11 @@ static config_var_t _option_vars[] = {
   V(ExcludeExitNodes,            ROUTERSET, NULL),
   V(ExcludeSingleHopRelays,      BOOL,     "1"),
   V(ExitNodes,                   ROUTERSET, NULL),
+  V(ExitConnectFailureCacheTime, INTERVAL, "0"),
   V(ExitPolicy,                  LINELIST, NULL),
   V(ExitPolicyRejectPrivate,     BOOL,     "1"),
   V(ExitPortStatistics,          BOOL,     "0"),
+  V(ExitTCPFastOpen,             BOOL,     "0"),
   V(ExtraInfoStatistics,         BOOL,     "1"),
 
 #if defined (WINCE)
@@ -275,6 +291,7 @@ static config_var_t _option_vars[] = {
   V(FascistFirewall,             BOOL,     "0"),
   V(FirewallPorts,               CSV,      ""),
   V(FastFirstHopPK,              BOOL,     "1"),
+  V(FetchConsensusDiffs,         BOOL,     "1"),
   V(FetchDirInfoEarly,           BOOL,     "0"),
   V(FetchDirInfoExtraEarly,      BOOL,     "0"),
   V(FetchServerDescriptors,      BOOL,     "1"),
@@ -289,12 +306,14 @@ static config_var_t _option_vars[] = {
 #endif
   V(GiveGuardFlagTo_CVE_2011_2768_VulnerableRelays,
                                  BOOL,     "0"),
+  V(GlobalCircuitScheduler,      BOOL,     "0"),
   OBSOLETE("Group"),
   V(HardwareAccel,               BOOL,     "0"),
   V(HeartbeatPeriod,             INTERVAL, "6 hours"),
   V(AccelName,                   STRING,   NULL),
   V(AccelDir,                    FILENAME, NULL),
   V(HashedControlPassword,       LINELIST, NULL),
+  V(HidServDirectoryCacheSize,   MEMUNIT,  "32 MB"),
   V(HidServDirectoryV2,          BOOL,     "1"),
   VAR("HiddenServiceDir",    LINELIST_S, RendConfigLines,    NULL),
   OBSOLETE("HiddenServiceExcludeNodes"),
@@ -317,6 +336,7 @@ static config_var_t _option_vars[] = {
   V(Socks5ProxyPassword,         STRING,   NULL),
   OBSOLETE("IgnoreVersion"),
   V(KeepalivePeriod,             INTERVAL, "5 minutes"),
+  V(KernelTLS,                   BOOL,     "0"),
   VAR("Log",                     LINELIST, Logs,             NULL),
   V(LogMessageDomains,           BOOL,     "0"),
   OBSOLETE("LinkPadding"),
@@ -326,10 +346,16 @@ static config_var_t _option_vars[] = {
   V(LongLivedPorts,              CSV,
         "21,22,706,1863,5050,5190,5222,5223,6523,6667,6697,8300"),
   VAR("MapAddress",              LINELIST, AddressMap,           NULL),
+  V(MaxAcceptsPerRead,           UINT,     "16"),
   V(MaxAdvertisedBandwidth,      MEMUNIT,  "1 GB"),
   V(MaxCircuitDirtiness,         INTERVAL, "10 minutes"),
+  V(MaxMemInQueues,              MEMUNIT,  "8 GB"),
   V(MaxClientCircuitsPending,    UINT,     "32"),
+  V(MaxConcurrentORConnects,     UINT,     "0"),
   V(MaxOnionsPending,            UINT,     "100"),
+  V(MaxORConnectsPerSecond,      UINT,     "0"),
+  V(MetricsFile,                 FILENAME, NULL),
+  V(MetricsPeriod,               INTERVAL, "1 minute"),
   OBSOLETE("MonthlyAccountingStart"),
   V(MyFamily,                    STRING,   NULL),
   V(NewCircuitPeriod,            INTERVAL, "30 seconds"),
@@ -340,6 +366,7 @@ static config_var_t _option_vars[] = {
   V(WarnUnsafeSocks,              BOOL,     "1"),
   OBSOLETE("NoPublish"),
   VAR("NodeFamily",              LINELIST, NodeFamilies,         NULL),
+  V(NoOptimisticDataPorts,       CSV,      ""),
   V(NumCPUs,                     UINT,     "0"),
   V(NumEntryGuards,              UINT,     "3"),
   V(ORListenAddress,             LINELIST, NULL),
@@ -351,8 +378,10 @@ static config_var_t _option_vars[] = {
   V(PidFile,                     STRING,   NULL),
   V(TestingTorNetwork,           BOOL,     "0"),
   V(OptimisticData,              AUTOBOOL, "auto"),
+  V(OptimisticDataPorts,         CSV,      ""),
   V(PortForwarding,              BOOL,     "0"),
   V(PortForwardingHelper,        FILENAME, "tor-fw-helper"),
+  V(PreemptiveCircuitPool,       UINT,     "0"),
   V(PreferTunneledDirConns,      BOOL,     "1"),
   V(ProtocolWarnings,            BOOL,     "0"),
   V(PublishServerDescriptor,     CSV,      "1"),
@@ -381,11 +410,15 @@ static config_var_t _option_vars[] = {
   V(ServerDNSAllowBrokenConfig,  BOOL,     "1"),
   V(ServerDNSAllowNonRFC953Hostnames, BOOL,"0"),
   V(ServerDNSDetectHijacking,    BOOL,     "1"),
+  V(ServerDNSNegativeCacheTTL,   INTERVAL, "60 seconds"),
+  V(ServerDNSPrefetch,           BOOL,     "1"),
+  V(ServerDNSResolveIPv6,        BOOL,     "0"),
   V(ServerDNSRandomizeCase,      BOOL,     "1"),
   V(ServerDNSResolvConfFile,     STRING,   NULL),
   V(ServerDNSSearchDomains,      BOOL,     "0"),
   V(ServerDNSTestAddresses,      CSV,
       "www.google.com,www.mit.edu,www.yahoo.com,www.slashdot.org"),
+  V(SharedMicrodescCacheFile,    FILENAME, NULL),
   V(ShutdownWaitLength,          INTERVAL, "30 seconds"),
   V(SocksListenAddress,          LINELIST, NULL),
   V(SocksPolicy,                 LINELIST, NULL),
@@ -396,6 +429,7 @@ static config_var_t _option_vars[] = {
   OBSOLETE("SysLog"),
   V(TestSocks,                   BOOL,     "0"),
   OBSOLETE("TestVia"),
+  V(TLSSessionCache,             BOOL,     "0"),
   V(TokenBucketRefillInterval,   MSEC_INTERVAL, "100 msec"),
   V(Tor2webMode,                 BOOL,     "0"),
   V(TrackHostExits,              CSV,      NULL),
@@ -403,6 +437,7 @@ static config_var_t _option_vars[] = {
   OBSOLETE("TrafficShaping"),
   V(TransListenAddress,          LINELIST, NULL),
   V(TransPort,                   LINELIST, NULL),
+  V(TuneSocketsByType,           BOOL,     "0"),
   V(TunnelDirConns,              BOOL,     "1"),
   V(UpdateBridgesFromAuthority,  BOOL,     "0"),
   V(UseBridges,                  BOOL,     "0"),
@@ -553,6 +588,9 @@ typedef struct {
   /** If present, extra is a LINELIST variable for unrecognized
    * lines.  Otherwise, unrecognized lines are an error. */
   config_var_t *extra;
+  /** Where to keep a map from lowercased variable name to config_var_t,
+   * which config_find_option() builds the first time it needs it. */
+  strmap_t **name_index;
 } config_format_t;
 
 /** Macro: assert that <b>cfg</b> has the right magic field for format
@@ -577,6 +615,8 @@ static int config_lines_eq(config_line_t *a, config_line_t *b);
 static int option_is_same(const config_format_t *fmt,
                           const or_options_t *o1, const or_options_t *o2,
                           const char *name);
+static int options_any_changed(const or_options_t *o1,
+                               const or_options_t *o2);
 static or_options_t *options_dup(const config_format_t *fmt,
                                  const or_options_t *old);
 static int options_validate(or_options_t *old_options,
@@ -628,6 +668,9 @@ static int opt_streq(const char *s1, const char *s2);
 #define OR_OPTIONS_MAGIC 9090909
 
 /** Configuration format for or_options_t. */
+/** Name index for options_format. */
+static strmap_t *options_name_index = NULL;
+
 static config_format_t options_format = {
   sizeof(or_options_t),
   OR_OPTIONS_MAGIC,
@@ -635,7 +678,8 @@ static config_format_t options_format = {
   _option_abbrevs,
   _option_vars,
   (validate_fn_t)options_validate,
-  NULL
+  NULL,
+  &options_name_index
 };
 
 /** Magic value for or_state_t. */
@@ -648,6 +692,9 @@ static config_var_t state_extra_var = {
 };
 
 /** Configuration format for or_state_t. */
+/** Name index for state_format. */
+static strmap_t *state_name_index = NULL;
+
 static const config_format_t state_format = {
   sizeof(or_state_t),
   OR_STATE_MAGIC,
@@ -656,6 +703,7 @@ static const config_format_t state_format = {
   _state_vars,
   (validate_fn_t)or_state_validate,
   &state_extra_var,
+  &state_name_index
 };
 
 /*
@@ -833,6 +881,11 @@ config_free_all(void)
   tor_free(torrc_defaults_fname);
   tor_free(_version);
   tor_free(global_dirfrontpagecontents);
+
+  strmap_free(options_name_index, NULL);
+  options_name_index = NULL;
+  strmap_free(state_name_index, NULL);
+  state_name_index = NULL;
 }
 
 /** Make <b>address</b> -- a piece of information related to our operation as
@@ -1302,6 +1355,10 @@ options_transition_requires_fresh_tls_context(const or_options_t *old_options,
     return 1;
   }
 
+  if (old_options->TLSSessionCache != new_options->TLSSessionCache) {
+    return 1;
+  }
+
   return 0;
 }
 
@@ -1430,6 +1487,13 @@ options_act(const or_options_t *old_options)
     finish_daemon(options->DataDirectory);
   }
 
+  /* Start or stop the log writer thread.  We do this after we fork, since
+   * the child doesn't get our threads. */
+  if (logs_set_async(options->AsyncLogging) < 0) {
+    log_warn(LD_CONFIG, "AsyncLogging is not supported on this platform; "
+             "writing log messages synchronously.");
+  }
+
   /* If needed, generate a new TLS DH prime according to the current torrc. */
   if (server_mode(options)) {
     if (!old_options) {
@@ -1453,6 +1517,14 @@ options_act(const or_options_t *old_options)
     crypto_set_tls_dh_prime(NULL);
   }
 
+  /* This has to be set before we make our TLS contexts. */
+  tor_tls_set_session_cache(options->TLSSessionCache);
+  if (tor_tls_set_kernel_offload(options->KernelTLS) < 0 &&
+      (!old_options || !old_options->KernelTLS))
+    log_notice(LD_CONFIG, "KernelTLS is set, but this Tor was built with an "
+               "OpenSSL that can't hand TLS connections to the kernel. "
+               "Ignoring it.");
+
   /* We want to reinit keys as needed before we do much of anything else:
      keys are important, and other things can depend on them. */
   if (transition_affects_workers ||
@@ -1519,6 +1591,8 @@ options_act(const or_options_t *old_options)
     connection_bucket_init();
 #endif
 
+  connection_bucket_set_class_weights(options);
+
   /* Change the cell EWMA settings */
   cell_ewma_set_scale_factor(options, networkstatus_get_latest_consensus());
 
@@ -1751,6 +1825,10 @@ options_act(const or_options_t *old_options)
        * we had expected. */
       update_consensus_networkstatus_fetch_time(time(NULL));
     }
+
+    /* Our periodic events might have work to do now that they didn't
+     * before. */
+    periodic_events_reschedule_all();
   }
 
   /* Load the webpage we're going to serve every time someone asks for '/' on
@@ -1980,14 +2058,21 @@ config_find_option_mutable(config_format_t *fmt, const char *key)
 {
   int i;
   size_t keylen = strlen(key);
+  config_var_t *var;
   if (!keylen)
     return NULL; /* if they say "--" on the command line, it's not an option */
   /* First, check for an exact (case-insensitive) match */
-  for (i=0; fmt->vars[i].name; ++i) {
-    if (!strcasecmp(key, fmt->vars[i].name)) {
-      return &fmt->vars[i];
+  if (!*fmt->name_index) {
+    strmap_t *index = strmap_new();
+    for (i=0; fmt->vars[i].name; ++i) {
+      /* Keep the first of any duplicates, as a linear search would. */
+      if (!strmap_get_lc(index, fmt->vars[i].name))
+        strmap_set_lc(index, fmt->vars[i].name, &fmt->vars[i]);
     }
+    *fmt->name_index = index;
   }
+  if ((var = strmap_get_lc(*fmt->name_index, key)))
+    return var;
   /* If none, check for an abbreviated match */
   for (i=0; fmt->vars[i].name; ++i) {
     if (!strncasecmp(key, fmt->vars[i].name, keylen)) {
@@ -2640,6 +2725,13 @@ options_trial_assign(config_line_t *list, int use_defaults,
     return r;
   }
 
+  /* If nothing changed, there's nothing to validate or act on: our current
+   * options already passed. */
+  if (!options_any_changed(get_options(), trial_options)) {
+    config_free(&options_format, trial_options);
+    return SETOPT_OK;
+  }
+
   if (options_validate(get_options_mutable(), trial_options, 1, msg) < 0) {
     config_free(&options_format, trial_options);
     return SETOPT_ERR_PARSE; /*XXX make this a separate return value. */
@@ -3013,6 +3105,23 @@ option_is_same(const config_format_t *fmt,
   return r;
 }
 
+/** Return true iff some option has a different value in <b>o1</b> than in
+ * <b>o2</b>. */
+static int
+options_any_changed(const or_options_t *o1, const or_options_t *o2)
+{
+  int i;
+  for (i=0; options_format.vars[i].name; ++i) {
+    const config_var_t *var = &options_format.vars[i];
+    if (var->type == CONFIG_TYPE_LINELIST_S ||
+        var->type == CONFIG_TYPE_OBSOLETE)
+      continue;
+    if (!option_is_same(&options_format, o1, o2, var->name))
+      return 1;
+  }
+  return 0;
+}
+
 /** Copy storage held by <b>old</b> into a new or_options_t and return it. */
 static or_options_t *
 options_dup(const config_format_t *fmt, const or_options_t *old)
@@ -3255,6 +3364,10 @@ compute_publishserverdescriptor(or_options_t *options)
  * will generate too many circuits and potentially overload the network. */
 #define MIN_MAX_CIRCUIT_DIRTINESS 10
 
+/** Highest allowable value for PreemptiveCircuitPool; more clean circuits
+ * than this is just a load on the network. */
+#define MAX_PREEMPTIVE_CIRCUIT_POOL 64
+
 /** Lowest allowable value for CircuitStreamTimeout; if this is too low, Tor
  * will generate too many circuits and potentially overload the network. */
 #define MIN_CIRCUIT_STREAM_TIMEOUT 10
@@ -3263,6 +3376,10 @@ compute_publishserverdescriptor(or_options_t *options)
  * expose more information than we're comfortable with. */
 #define MIN_HEARTBEAT_PERIOD (30*60)
 
+/** Lowest allowable value for MetricsPeriod; rewriting the file more often
+ * than this is just disk churn. */
+#define MIN_METRICS_PERIOD 5
+
 /** Return 0 if every setting in <b>options</b> is reasonable, and a
  * permissible transition from <b>old_options</b>. Else return -1.
  * Should have no side effects, except for normalizing the contents of
@@ -3459,6 +3576,12 @@ options_validate(or_options_t *old_options, or_options_t *options,
     return -1;
   }
 
+  if (options->MaxMemInQueues < (U64_LITERAL(256) << 20)) {
+    log_warn(LD_CONFIG, "MaxMemInQueues must be at least 256 MB for now. "
+             "Ideally, have it as large as you can afford.");
+    options->MaxMemInQueues = (U64_LITERAL(256) << 20);
+  }
+
   if (validate_ports_csv(options->FirewallPorts, "FirewallPorts", msg) < 0)
     return -1;
 
@@ -3473,6 +3596,14 @@ options_validate(or_options_t *old_options, or_options_t *options,
                          "WarnPlaintextPorts", msg) < 0)
     return -1;
 
+  if (validate_ports_csv(options->OptimisticDataPorts,
+                         "OptimisticDataPorts", msg) < 0)
+    return -1;
+
+  if (validate_ports_csv(options->NoOptimisticDataPorts,
+                         "NoOptimisticDataPorts", msg) < 0)
+    return -1;
+
   if (options->FascistFirewall && !options->ReachableAddresses) {
     if (options->FirewallPorts && smartlist_len(options->FirewallPorts)) {
       /* We already have firewall ports set, so migrate them to
@@ -3668,6 +3799,12 @@ options_validate(or_options_t *old_options, or_options_t *options,
     options->MaxCircuitDirtiness = MIN_MAX_CIRCUIT_DIRTINESS;
   }
 
+  if (options->PreemptiveCircuitPool > MAX_PREEMPTIVE_CIRCUIT_POOL) {
+    log_warn(LD_CONFIG, "PreemptiveCircuitPool option is too high; "
+             "lowering to %d.", MAX_PREEMPTIVE_CIRCUIT_POOL);
+    options->PreemptiveCircuitPool = MAX_PREEMPTIVE_CIRCUIT_POOL;
+  }
+
   if (options->CircuitStreamTimeout &&
       options->CircuitStreamTimeout < MIN_CIRCUIT_STREAM_TIMEOUT) {
     log_warn(LD_CONFIG, "CircuitStreamTimeout option is too short; "
@@ -3682,6 +3819,12 @@ options_validate(or_options_t *old_options, or_options_t *options,
     options->HeartbeatPeriod = MIN_HEARTBEAT_PERIOD;
   }
 
+  if (options->MetricsPeriod < MIN_METRICS_PERIOD) {
+    log_warn(LD_CONFIG, "MetricsPeriod option is too short; "
+             "raising to %d seconds.", MIN_METRICS_PERIOD);
+    options->MetricsPeriod = MIN_METRICS_PERIOD;
+  }
+
   if (options->KeepalivePeriod < 1)
     REJECT("KeepalivePeriod option must be positive.");
 
@@ -3753,6 +3896,11 @@ options_validate(or_options_t *old_options, or_options_t *options,
   if (options->BandwidthRate > options->BandwidthBurst)
     REJECT("BandwidthBurst must be at least equal to BandwidthRate.");
 
+  if (options->BandwidthClassWeights &&
+      connection_bucket_parse_class_weights(options->BandwidthClassWeights,
+                                            NULL, msg) < 0)
+    return -1;
+
   /* if they set relaybandwidth* really high but left bandwidth*
    * at the default, raise the defaults. */
   if (options->RelayBandwidthRate > options->BandwidthRate)
@@ -4179,6 +4327,7 @@ options_transition_affects_workers(const or_options_t *old_options,
 {
   if (!opt_streq(old_options->DataDirectory, new_options->DataDirectory) ||
       old_options->NumCPUs != new_options->NumCPUs ||
+      old_options->AdaptiveCPUWorkers != new_options->AdaptiveCPUWorkers ||
       !config_lines_eq(old_options->ORPort, new_options->ORPort) ||
       old_options->ServerDNSSearchDomains !=
                                        new_options->ServerDNSSearchDomains ||
@@ -4186,6 +4335,8 @@ options_transition_affects_workers(const or_options_t *old_options,
       old_options->ClientOnly != new_options->ClientOnly ||
       public_server_mode(old_options) != public_server_mode(new_options) ||
       !config_lines_eq(old_options->Logs, new_options->Logs) ||
+      !config_lines_eq(old_options->RendConfigLines,
+                       new_options->RendConfigLines) ||
       old_options->LogMessageDomains != new_options->LogMessageDomains)
     return 1;
 
@@ -5590,7 +5741,7 @@ parse_port_config(smartlist_t *out,
     uint16_t ptmp=0;
     int ok;
     int no_listen = 0, no_advertise = 0, all_addrs = 0,
-      ipv4_only = 0, ipv6_only = 0;
+      ipv4_only = 0, ipv6_only = 0, reuse_port = 0;
 
     smartlist_split_string(elts, ports->value, NULL,
                            SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
@@ -5658,6 +5809,8 @@ parse_port_config(smartlist_t *out,
           ipv4_only = 1;
         } else if (!strcasecmp(elt, "IPv6Only")) {
           ipv6_only = 1;
+        } else if (!strcasecmp(elt, "ReusePort")) {
+          reuse_port = 1;
         } else {
           log_warn(LD_CONFIG, "Unrecognized %sPort option '%s'",
                    portname, escaped(elt));
@@ -5752,6 +5905,7 @@ parse_port_config(smartlist_t *out,
       cfg->all_addrs = all_addrs;
       cfg->ipv4_only = ipv4_only;
       cfg->ipv6_only = ipv6_only;
+      cfg->reuse_port = reuse_port;
 
       smartlist_add(out, cfg);
     }
@@ -6752,7 +6906,7 @@ or_state_save(time_t now)
                tbuf, state);
   tor_free(state);
   fname = get_datadir_fname("state");
-  if (write_str_to_file(fname, contents, 0)<0) {
+  if (write_str_to_file_async(fname, contents, 0)<0) {
     log_warn(LD_FS, "Unable to write state to file \"%s\"; "
              "will try again later", fname);
     last_state_file_write_failed = 1;
@@ -26,6 +26,7 @@
 #include "dns.h"
 #include "dnsserv.h"
 #include "geoip.h"
+#include "hibernate.h"
 #include "main.h"
 #include "policies.h"
 #include "reasons.h"
@@ -40,6 +41,9 @@
 #include <event2/event.h>
 #endif
 
+#ifdef HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
 #ifdef HAVE_PWD_H
 #include <pwd.h>
 #endif
@@ -57,7 +61,11 @@ static int connection_handle_listener_read(connection_t *conn, int new_type);
 #ifndef USE_BUFFEREVENTS
 static int connection_bucket_should_increase(int bucket,
                                              or_connection_t *conn);
+static void connection_bucket_refill_helper(int *bucket, int rate, int burst,
+                                            int milliseconds_elapsed,
+                                            const char *name);
 #endif
+static void connection_note_blocked_on_bw(connection_t *conn);
 static int connection_finished_flushing(connection_t *conn);
 static int connection_flushed_some(connection_t *conn);
 static int connection_finished_connecting(connection_t *conn);
@@ -67,6 +75,7 @@ static int connection_read_to_buf(connection_t *conn, ssize_t *max_to_read,
 static int connection_process_inbuf(connection_t *conn, int package_partial);
 static void client_check_address_changed(tor_socket_t sock);
 static void set_constrained_socket_buffers(tor_socket_t sock, int size);
+static void tune_socket_for_conn_type(tor_socket_t sock, int conn_type);
 
 static const char *connection_proxy_state_to_string(int state);
 static int connection_read_https_proxy_response(connection_t *conn);
@@ -81,6 +90,19 @@ static uint32_t last_interface_ip = 0;
  * Used to detect IP address changes. */
 static smartlist_t *outgoing_addrs = NULL;
 
+#ifndef USE_BUFFEREVENTS
+/** How many milliseconds of refills have we done since we started?  Each
+ * OR connection's buckets catch up to this when we next look at them, so
+ * that a refill doesn't need to visit every connection. */
+static uint64_t bucket_refill_msec = 0;
+
+/** The connections that have stopped reading or writing until their
+ * buckets or the global ones have more tokens: those with
+ * read_blocked_on_bw or write_blocked_on_bw set.  A refill only needs to
+ * look at these. */
+static smartlist_t *conns_blocked_on_bw = NULL;
+#endif
+
 #define CASE_ANY_LISTENER_TYPE \
     case CONN_TYPE_OR_LISTENER: \
     case CONN_TYPE_AP_LISTENER: \
@@ -178,6 +200,7 @@ conn_state_to_string(int type, int state)
         case DIR_CONN_STATE_CLIENT_FINISHED: return "client finished";
         case DIR_CONN_STATE_SERVER_COMMAND_WAIT: return "waiting for command";
         case DIR_CONN_STATE_SERVER_WRITING: return "writing";
+        case DIR_CONN_STATE_CLIENT_IDLE: return "client idle";
       }
       break;
     case CONN_TYPE_CPUWORKER:
@@ -246,6 +269,7 @@ or_connection_new(int socket_family)
 
   or_conn->active_circuit_pqueue = smartlist_create();
   or_conn->active_circuit_pqueue_last_recalibrated = cell_ewma_get_tick();
+  or_conn->sched_heap_idx = -1;
 
   return or_conn;
 }
@@ -374,6 +398,7 @@ connection_init(time_t now, connection_t *conn, int type, int socket_family)
 
   conn->s = -1; /* give it a default of 'not used' */
   conn->conn_array_index = -1; /* also default to 'not used' */
+  conn->conn_type_index = -1;
   conn->global_identifier = n_connections_allocated++;
 
   conn->type = type;
@@ -487,11 +512,16 @@ _connection_free(connection_t *conn)
     or_conn->tls = NULL;
     or_handshake_state_free(or_conn->handshake_state);
     or_conn->handshake_state = NULL;
+    circuit_scheduler_forget_conn(or_conn);
+    connection_or_forget_deferred_connect(or_conn);
+    circuit_free_circid_table(or_conn);
+    rep_hist_note_or_conn_closed(or_conn);
     smartlist_free(or_conn->active_circuit_pqueue);
     tor_free(or_conn->nickname);
   }
   if (conn->type == CONN_TYPE_AP) {
     entry_connection_t *entry_conn = TO_ENTRY_CONN(conn);
+    connection_ap_forget_pending(entry_conn);
     tor_free(entry_conn->chosen_exit_name);
     tor_free(entry_conn->original_dest_address);
     if (entry_conn->socks_request)
@@ -504,11 +534,13 @@ _connection_free(connection_t *conn)
     }
   }
   if (CONN_IS_EDGE(conn)) {
+    connection_edge_forget_coalescing(TO_EDGE_CONN(conn));
     rend_data_free(TO_EDGE_CONN(conn)->rend_data);
   }
   if (conn->type == CONN_TYPE_CONTROL) {
     control_connection_t *control_conn = TO_CONTROL_CONN(conn);
     tor_free(control_conn->incoming_cmd);
+    control_connection_free_spool(control_conn);
   }
 
   tor_free(conn->read_event); /* Probably already freed by connection_free. */
@@ -528,6 +560,7 @@ _connection_free(connection_t *conn)
     tor_free(dir_conn->requested_resource);
 
     tor_zlib_free(dir_conn->zlib_state);
+    dir_body_stream_free(dir_conn->body_stream);
     if (dir_conn->fingerprint_stack) {
       SMARTLIST_FOREACH(dir_conn->fingerprint_stack, char *, cp, tor_free(cp));
       smartlist_free(dir_conn->fingerprint_stack);
@@ -585,6 +618,10 @@ connection_free(connection_t *conn)
   if (conn->type == CONN_TYPE_CONTROL) {
     connection_control_closed(TO_CONTROL_CONN(conn));
   }
+#ifndef USE_BUFFEREVENTS
+  if (conn->read_blocked_on_bw || conn->write_blocked_on_bw)
+    smartlist_remove(conns_blocked_on_bw, conn);
+#endif
   connection_unregister_events(conn);
   _connection_free(conn);
 }
@@ -851,6 +888,24 @@ make_socket_reuseable(tor_socket_t sock)
 #endif
 }
 
+/** Let other sockets that also set this option listen on the same address
+ * and port as <b>sock</b>, so that the kernel spreads incoming connections
+ * among them.  Warn if we can't. */
+static void
+make_socket_port_shareable(tor_socket_t sock)
+{
+#ifdef SO_REUSEPORT
+  int one=1;
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void*) &one,
+                 (socklen_t)sizeof(one)) < 0)
+    log_warn(LD_NET, "Couldn't set SO_REUSEPORT on listener: %s",
+             tor_socket_strerror(tor_socket_errno(sock)));
+#else
+  (void) sock;
+  log_warn(LD_NET, "ReusePort is not supported on this platform.");
+#endif
+}
+
 /** Bind a new non-blocking socket listening to the socket described
  * by <b>listensockaddr</b>.
  *
@@ -901,6 +956,8 @@ connection_create_listener(const struct sockaddr *listensockaddr,
     }
 
     make_socket_reuseable(s);
+    if (port_cfg && port_cfg->reuse_port && is_tcp)
+      make_socket_port_shareable(s);
 
     if (bind(s,listensockaddr,socklen) < 0) {
       const char *helpfulhint = "";
@@ -1113,11 +1170,13 @@ check_sockaddr_family_match(sa_family_t got, connection_t *listener)
   return 0;
 }
 
-/** The listener connection <b>conn</b> told poll() it wanted to read.
- * Call accept() on conn-\>s, and add the new connection if necessary.
+/** Call accept() once on the listener connection <b>conn</b>, and add the
+ * new connection if necessary.  Return 1 if we might be able to accept
+ * another connection right away, 0 if we shouldn't try again until poll()
+ * says so, and -1 if the listener broke and we marked it for close.
  */
 static int
-connection_handle_listener_read(connection_t *conn, int new_type)
+connection_accept_one(connection_t *conn, int new_type)
 {
   tor_socket_t news; /* the new socket */
   connection_t *newconn;
@@ -1135,7 +1194,9 @@ connection_handle_listener_read(connection_t *conn, int new_type)
   if (!SOCKET_OK(news)) { /* accept() error */
     int e = tor_socket_errno(conn->s);
     if (ERRNO_IS_ACCEPT_EAGAIN(e)) {
-      return 0; /* he hung up before we could accept(). that's fine. */
+      /* Nothing left to accept, or he hung up before we could accept().
+       * That's fine. */
+      return 0;
     } else if (ERRNO_IS_ACCEPT_RESOURCE_LIMIT(e)) {
       warn_too_many_conns();
       return 0;
@@ -1158,7 +1219,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
 
   if (check_sockaddr_family_match(remote->sa_family, conn) < 0) {
     tor_close_socket(news);
-    return 0;
+    return 1;
   }
 
   if (conn->socket_family == AF_INET || conn->socket_family == AF_INET6) {
@@ -1168,12 +1229,12 @@ connection_handle_listener_read(connection_t *conn, int new_type)
       log_info(LD_NET,
                "accept() returned a strange address; closing connection.");
       tor_close_socket(news);
-      return 0;
+      return 1;
     }
 
     if (check_sockaddr_family_match(remote->sa_family, conn) < 0) {
       tor_close_socket(news);
-      return 0;
+      return 1;
     }
 
     tor_addr_from_sockaddr(&addr, remote, &port);
@@ -1186,7 +1247,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
                    "Denying socks connection from untrusted address %s.",
                    fmt_addr(&addr));
         tor_close_socket(news);
-        return 0;
+        return 1;
       }
     }
     if (new_type == CONN_TYPE_DIR) {
@@ -1195,12 +1256,14 @@ connection_handle_listener_read(connection_t *conn, int new_type)
         log_notice(LD_DIRSERV,"Denying dir connection from address %s.",
                    fmt_addr(&addr));
         tor_close_socket(news);
-        return 0;
+        return 1;
       }
     }
 
     newconn = connection_new(new_type, conn->socket_family);
     newconn->s = news;
+    if (options->TuneSocketsByType)
+      tune_socket_for_conn_type(news, new_type);
 
     /* remember the remote address */
     tor_addr_copy(&newconn->addr, &addr);
@@ -1231,9 +1294,24 @@ connection_handle_listener_read(connection_t *conn, int new_type)
   if (connection_init_accepted_conn(newconn, TO_LISTENER_CONN(conn)) < 0) {
     if (! newconn->marked_for_close)
       connection_mark_for_close(newconn);
-    return 0;
   }
-  return 0;
+  return 1;
+}
+
+/** The listener connection <b>conn</b> told poll() it wanted to read.
+ * Accept up to MaxAcceptsPerRead new connections from it.
+ */
+static int
+connection_handle_listener_read(connection_t *conn, int new_type)
+{
+  int max_accepts = get_options()->MaxAcceptsPerRead;
+  int i, r = 1;
+
+  if (max_accepts < 1)
+    max_accepts = 1;
+  for (i = 0; i < max_accepts && r > 0; ++i)
+    r = connection_accept_one(conn, new_type);
+  return r < 0 ? -1 : 0;
 }
 
 /** Initialize states for newly accepted connection <b>conn</b>.
@@ -1273,6 +1351,10 @@ connection_init_accepted_conn(connection_t *conn,
     case CONN_TYPE_DIR:
       conn->purpose = DIR_PURPOSE_SERVER;
       conn->state = DIR_CONN_STATE_SERVER_COMMAND_WAIT;
+#ifdef USE_BUFFEREVENTS
+      /* Now that we know it's a server, it's in the "dir" class. */
+      connection_enable_rate_limiting(conn);
+#endif
       break;
     case CONN_TYPE_CONTROL:
       conn->state = CONTROL_CONN_STATE_NEEDAUTH;
@@ -1363,6 +1445,8 @@ connection_connect(connection_t *conn, const char *address,
 
   if (options->ConstrainedSockets)
     set_constrained_socket_buffers(s, (int)options->ConstrainedSockSize);
+  if (options->TuneSocketsByType)
+    tune_socket_for_conn_type(s, conn->type);
 
   memset(&addrbuf,0,sizeof(addrbuf));
   dest_addr = (struct sockaddr*) &addrbuf;
@@ -1374,6 +1458,18 @@ connection_connect(connection_t *conn, const char *address,
 
   make_socket_reuseable(s);
 
+#if defined(HAVE_NETINET_TCP_H) && defined(TCP_FASTOPEN_CONNECT)
+  if (conn->type == CONN_TYPE_EXIT && options->ExitTCPFastOpen) {
+    /* Let the kernel put the first data we write into the SYN, if it has
+     * a Fast Open cookie for this destination. */
+    int one = 1;
+    if (setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (void*)&one,
+                   (socklen_t)sizeof(one)) < 0)
+      log_debug(LD_NET, "Unable to enable TCP Fast Open: %s",
+                tor_socket_strerror(tor_socket_errno(s)));
+  }
+#endif
+
   if (connect(s, dest_addr, (socklen_t)dest_addr_len) < 0) {
     int e = tor_socket_errno(s);
     if (!ERRNO_IS_CONN_EINPROGRESS(e)) {
@@ -2011,6 +2107,222 @@ extern int global_relayed_read_bucket, global_relayed_write_bucket;
 static int write_buckets_empty_last_second = 0;
 #endif
 
+/** Names of the bandwidth classes, for BandwidthClassWeights, indexed by
+ * bw_class_t. */
+static const char *bw_class_names[N_BANDWIDTH_CLASSES] = {
+  "relay", "dir", "exit", "interactive"
+};
+
+/** Parse <b>weights</b>, a list of "class=weight" strings from
+ * BandwidthClassWeights, into <b>weights_out</b> (if it is non-NULL), an
+ * array of N_BANDWIDTH_CLASSES weights indexed by bw_class_t.  Classes that
+ * aren't listed get weight 0.  Return 0 on success.  On failure, set
+ * *<b>msg</b> to a newly allocated error message and return -1. */
+int
+connection_bucket_parse_class_weights(const smartlist_t *weights,
+                                      int *weights_out, char **msg)
+{
+  int parsed[N_BANDWIDTH_CLASSES];
+  int i, total = 0;
+
+  memset(parsed, 0, sizeof(parsed));
+  SMARTLIST_FOREACH_BEGIN(weights, const char *, item) {
+    const char *eq = strchr(item, '=');
+    int ok, found = 0;
+    long weight;
+    if (!eq) {
+      tor_asprintf(msg, "BandwidthClassWeights entry \"%s\" is not of the "
+                   "form class=weight.", item);
+      return -1;
+    }
+    weight = tor_parse_long(eq+1, 10, 0, 100000, &ok, NULL);
+    if (!ok) {
+      tor_asprintf(msg, "BandwidthClassWeights entry \"%s\" has a bad "
+                   "weight.", item);
+      return -1;
+    }
+    for (i = 0; i < N_BANDWIDTH_CLASSES; ++i) {
+      if (!strcmpstart(item, bw_class_names[i]) &&
+          item + strlen(bw_class_names[i]) == eq) {
+        parsed[i] = (int)weight;
+        found = 1;
+      }
+    }
+    if (!found) {
+      tor_asprintf(msg, "BandwidthClassWeights entry \"%s\" names an "
+                   "unknown class.", item);
+      return -1;
+    }
+  } SMARTLIST_FOREACH_END(item);
+
+  for (i = 0; i < N_BANDWIDTH_CLASSES; ++i)
+    total += parsed[i];
+  if (smartlist_len(weights) && !total) {
+    *msg = tor_strdup("BandwidthClassWeights must give some class a "
+                      "nonzero weight.");
+    return -1;
+  }
+
+  if (weights_out)
+    memcpy(weights_out, parsed, sizeof(parsed));
+  return 0;
+}
+
+/** Weight of each bandwidth class, by bw_class_t, from
+ * BandwidthClassWeights. */
+static int bw_class_weights[N_BANDWIDTH_CLASSES];
+/** Sum of bw_class_weights, or 0 if we aren't dividing our bandwidth into
+ * classes. */
+static int bw_class_weight_total = 0;
+#ifndef USE_BUFFEREVENTS
+/** How many bytes has each bandwidth class earned the right to read from
+ * the global read bucket, ahead of the other classes? */
+static int bw_class_read_buckets[N_BANDWIDTH_CLASSES];
+/** How many bytes has each bandwidth class earned the right to write from
+ * the global write bucket, ahead of the other classes? */
+static int bw_class_write_buckets[N_BANDWIDTH_CLASSES];
+#else
+/** Libevent rate-limit group for each bandwidth class, by bw_class_t, if
+ * we're dividing our bandwidth into classes. */
+static struct bufferevent_rate_limit_group *
+  class_rate_limits[N_BANDWIDTH_CLASSES];
+/** How many bytes did the rate-limit groups that we've freed read and
+ * write, so that connection_get_rate_limit_totals() never goes backwards? */
+static uint64_t freed_rate_limit_read = 0, freed_rate_limit_written = 0;
+static void connection_bucket_configure_class_groups(void);
+static void connection_bucket_free_class_groups(void);
+static void connection_regroup_rate_limited_conns(void);
+#endif
+
+/** Set our bandwidth class weights from <b>options</b>-\>
+ * BandwidthClassWeights.  If the weights changed, refill each class's
+ * buckets to their share of BandwidthBurst, or with bufferevents, move
+ * every rate-limited connection into its class's rate-limit group. */
+void
+connection_bucket_set_class_weights(const or_options_t *options)
+{
+  int weights[N_BANDWIDTH_CLASSES];
+  char *msg = NULL;
+  int i;
+
+  memset(weights, 0, sizeof(weights));
+  if (options->BandwidthClassWeights &&
+      connection_bucket_parse_class_weights(options->BandwidthClassWeights,
+                                            weights, &msg) < 0) {
+    log_warn(LD_BUG, "%s", msg);
+    tor_free(msg);
+    memset(weights, 0, sizeof(weights));
+  }
+  if (!memcmp(weights, bw_class_weights, sizeof(weights)))
+    return;
+
+  memcpy(bw_class_weights, weights, sizeof(weights));
+  bw_class_weight_total = 0;
+  for (i = 0; i < N_BANDWIDTH_CLASSES; ++i)
+    bw_class_weight_total += weights[i];
+#ifndef USE_BUFFEREVENTS
+  for (i = 0; i < N_BANDWIDTH_CLASSES; ++i) {
+    bw_class_read_buckets[i] = bw_class_write_buckets[i] =
+      bw_class_weight_total ?
+      (int)(options->BandwidthBurst * weights[i] / bw_class_weight_total) : 0;
+  }
+#else
+  if (!global_rate_limit)
+    return; /* connection_bucket_init() will set up the groups. */
+  if (bw_class_weight_total) {
+    connection_bucket_configure_class_groups();
+    connection_regroup_rate_limited_conns();
+  } else {
+    /* Move everybody back to the global group before we free theirs. */
+    connection_regroup_rate_limited_conns();
+    connection_bucket_free_class_groups();
+  }
+#endif
+}
+
+/** Return the bandwidth class whose share of our bandwidth <b>conn</b>
+ * uses.  Onion service and interactive traffic that we relay over OR
+ * connections is indistinguishable here from everything else we relay, so
+ * it's all in BW_CLASS_RELAY. */
+static bw_class_t
+connection_bw_class(connection_t *conn)
+{
+  if (conn->type == CONN_TYPE_DIR && DIR_CONN_IS_SERVER(conn))
+    return BW_CLASS_DIR;
+  if (conn->type == CONN_TYPE_EXIT) {
+    if (smartlist_string_num_isin(get_options()->LongLivedPorts, conn->port))
+      return BW_CLASS_INTERACTIVE;
+    return BW_CLASS_EXIT;
+  }
+  return BW_CLASS_RELAY;
+}
+
+#ifndef USE_BUFFEREVENTS
+/** Return how many bytes <b>conn</b>'s bandwidth class lets it write (if
+ * <b>is_write</b>) or read right now: the tokens its class has earned, plus
+ * any tokens in the global bucket that no class has earned yet.  If we
+ * aren't dividing our bandwidth into classes, return INT_MAX. */
+static int
+connection_bw_class_room(connection_t *conn, int is_write)
+{
+  const int *buckets = is_write ? bw_class_write_buckets :
+                                  bw_class_read_buckets;
+  int global_bucket = is_write ? global_write_bucket : global_read_bucket;
+  int i, own, spare;
+
+  if (PREDICT_LIKELY(!bw_class_weight_total))
+    return INT_MAX;
+
+  spare = global_bucket;
+  for (i = 0; i < N_BANDWIDTH_CLASSES; ++i) {
+    if (buckets[i] > 0)
+      spare -= buckets[i];
+  }
+  own = buckets[connection_bw_class(conn)];
+  return (own > 0 ? own : 0) + (spare > 0 ? spare : 0);
+}
+
+/** We just read or wrote <b>n</b> bytes on <b>conn</b>: take them from the
+ * tokens its bandwidth class has earned in <b>buckets</b>.  Anything beyond
+ * those came from the unearned tokens in the global bucket. */
+static void
+connection_bw_class_decrement(connection_t *conn, int *buckets, int n)
+{
+  int *bucket = &buckets[connection_bw_class(conn)];
+  if (*bucket > 0)
+    *bucket -= n < *bucket ? n : *bucket;
+}
+
+/** Add the tokens that <b>conn</b>'s read and write buckets have earned
+ * since we last looked at them. */
+static INLINE void
+connection_or_buckets_catch_up(or_connection_t *conn)
+{
+  uint64_t elapsed = bucket_refill_msec - conn->buckets_refilled_at;
+  if (!elapsed)
+    return;
+  conn->buckets_refilled_at = bucket_refill_msec;
+  if (elapsed > INT_MAX)
+    elapsed = INT_MAX;
+  if (connection_bucket_should_increase(conn->read_bucket, conn))
+    connection_bucket_refill_helper(&conn->read_bucket,
+                                    conn->bandwidthrate, conn->bandwidthburst,
+                                    (int)elapsed, "or_conn->read_bucket");
+  if (connection_bucket_should_increase(conn->write_bucket, conn))
+    connection_bucket_refill_helper(&conn->write_bucket,
+                                    conn->bandwidthrate, conn->bandwidthburst,
+                                    (int)elapsed, "or_conn->write_bucket");
+}
+
+/** Bring <b>conn</b>'s read and write buckets up to date, so that the
+ * caller can change them. */
+void
+connection_or_buckets_update(or_connection_t *conn)
+{
+  connection_or_buckets_catch_up(conn);
+}
+#endif
+
 /** How many seconds of no active local circuits will make the
  * connection revert to the "relayed" bandwidth class? */
 #define CLIENT_IDLE_TIME_FOR_PRIORITY 30
@@ -2077,8 +2389,10 @@ connection_bucket_read_limit(connection_t *conn, time_t now)
 
   if (connection_speaks_cells(conn)) {
     or_connection_t *or_conn = TO_OR_CONN(conn);
-    if (conn->state == OR_CONN_STATE_OPEN)
+    if (conn->state == OR_CONN_STATE_OPEN) {
+      connection_or_buckets_catch_up(or_conn);
       conn_bucket = or_conn->read_bucket;
+    }
   }
 
   if (!connection_is_rate_limited(conn)) {
@@ -2089,6 +2403,7 @@ connection_bucket_read_limit(connection_t *conn, time_t now)
   if (connection_counts_as_relayed_traffic(conn, now) &&
       global_relayed_read_bucket <= global_read_bucket)
     global_bucket = global_relayed_read_bucket;
+  global_bucket = MIN(global_bucket, connection_bw_class_room(conn, 0));
 
   return connection_bucket_round_robin(base, priority,
                                        global_bucket, conn_bucket);
@@ -2113,19 +2428,61 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
     /* use the per-conn write limit if it's lower, but if it's less
      * than zero just use zero */
     or_connection_t *or_conn = TO_OR_CONN(conn);
-    if (conn->state == OR_CONN_STATE_OPEN)
+    if (conn->state == OR_CONN_STATE_OPEN) {
+      connection_or_buckets_catch_up(or_conn);
       if (or_conn->write_bucket < conn_bucket)
         conn_bucket = or_conn->write_bucket >= 0 ?
                         or_conn->write_bucket : 0;
+    }
   }
 
   if (connection_counts_as_relayed_traffic(conn, now) &&
       global_relayed_write_bucket <= global_write_bucket)
     global_bucket = global_relayed_write_bucket;
+  global_bucket = MIN(global_bucket, connection_bw_class_room(conn, 1));
 
   return connection_bucket_round_robin(base, priority,
                                        global_bucket, conn_bucket);
 }
+
+/** How many more bytes could we add to <b>conn</b>'s outbuf without
+ * queueing more than its token bucket and the global ones would let us
+ * write right now? */
+ssize_t
+connection_bucket_write_room(connection_t *conn, time_t now)
+{
+  int bucket = global_write_bucket;
+  size_t pending = connection_get_outbuf_len(conn);
+
+  if (!connection_is_rate_limited(conn))
+    return pending < INT_MAX ? (ssize_t)(INT_MAX - pending) : 0;
+
+  if (connection_counts_as_relayed_traffic(conn, now) &&
+      global_relayed_write_bucket < bucket)
+    bucket = global_relayed_write_bucket;
+  bucket = MIN(bucket, connection_bw_class_room(conn, 1));
+
+  if (connection_speaks_cells(conn) && conn->state == OR_CONN_STATE_OPEN) {
+    or_connection_t *or_conn = TO_OR_CONN(conn);
+    connection_or_buckets_catch_up(or_conn);
+    if (or_conn->write_bucket < bucket)
+      bucket = or_conn->write_bucket;
+  }
+
+  if (bucket <= 0 || (size_t)bucket <= pending)
+    return 0;
+  return bucket - pending;
+}
+
+/** How many bytes can we write in total, to all connections, before the
+ * global write bucket runs dry?  (Relayed traffic may run out sooner; see
+ * connection_bucket_write_room().) */
+ssize_t
+connection_bucket_global_write_room(time_t now)
+{
+  (void) now;
+  return global_write_bucket > 0 ? global_write_bucket : 0;
+}
 #else
 static ssize_t
 connection_bucket_read_limit(connection_t *conn, time_t now)
@@ -2139,6 +2496,18 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
   (void) now;
   return bufferevent_get_max_to_write(conn->bufev);
 }
+ssize_t
+connection_bucket_write_room(connection_t *conn, time_t now)
+{
+  (void) now;
+  return bufferevent_get_max_to_write(conn->bufev);
+}
+ssize_t
+connection_bucket_global_write_room(time_t now)
+{
+  (void) now;
+  return INT_MAX;
+}
 #endif
 
 /** Return 1 if the global write buckets are low enough that we
@@ -2169,6 +2538,7 @@ global_write_bucket_low(connection_t *conn, size_t attempt, int priority)
 #else
   int smaller_bucket = global_write_bucket < global_relayed_write_bucket ?
                        global_write_bucket : global_relayed_write_bucket;
+  smaller_bucket = MIN(smaller_bucket, connection_bw_class_room(conn, 1));
 #endif
   if (authdir_mode(get_options()) && priority>1)
     return 0; /* there's always room to answer v2 if we're an auth dir */
@@ -2215,7 +2585,7 @@ record_num_bytes_transferred_impl(connection_t *conn,
     return; /* local IPs are free */
 
   if (conn->type == CONN_TYPE_OR)
-    rep_hist_note_or_conn_bytes(conn->global_identifier, num_read,
+    rep_hist_note_or_conn_bytes(TO_OR_CONN(conn), num_read,
                                 num_written, now);
 
   if (num_read > 0) {
@@ -2277,9 +2647,15 @@ connection_buckets_decrement(connection_t *conn, time_t now,
     global_relayed_read_bucket -= (int)num_read;
     global_relayed_write_bucket -= (int)num_written;
   }
+  if (bw_class_weight_total) {
+    connection_bw_class_decrement(conn, bw_class_read_buckets, (int)num_read);
+    connection_bw_class_decrement(conn, bw_class_write_buckets,
+                                  (int)num_written);
+  }
   global_read_bucket -= (int)num_read;
   global_write_bucket -= (int)num_written;
   if (connection_speaks_cells(conn) && conn->state == OR_CONN_STATE_OPEN) {
+    connection_or_buckets_catch_up(TO_OR_CONN(conn));
     TO_OR_CONN(conn)->read_bucket -= (int)num_read;
     TO_OR_CONN(conn)->write_bucket -= (int)num_written;
   }
@@ -2297,6 +2673,8 @@ connection_consider_empty_read_buckets(connection_t *conn)
   } else if (connection_counts_as_relayed_traffic(conn, approx_time()) &&
              global_relayed_read_bucket <= 0) {
     reason = "global relayed read bucket exhausted. Pausing.";
+  } else if (connection_bw_class_room(conn, 0) <= 0) {
+    reason = "bandwidth class read bucket exhausted. Pausing.";
   } else if (connection_speaks_cells(conn) &&
              conn->state == OR_CONN_STATE_OPEN &&
              TO_OR_CONN(conn)->read_bucket <= 0) {
@@ -2305,6 +2683,7 @@ connection_consider_empty_read_buckets(connection_t *conn)
     return; /* all good, no need to stop it */
 
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
+  connection_note_blocked_on_bw(conn);
   conn->read_blocked_on_bw = 1;
   connection_stop_reading(conn);
 }
@@ -2321,6 +2700,8 @@ connection_consider_empty_write_buckets(connection_t *conn)
   } else if (connection_counts_as_relayed_traffic(conn, approx_time()) &&
              global_relayed_write_bucket <= 0) {
     reason = "global relayed write bucket exhausted. Pausing.";
+  } else if (connection_bw_class_room(conn, 1) <= 0) {
+    reason = "bandwidth class write bucket exhausted. Pausing.";
   } else if (connection_speaks_cells(conn) &&
              conn->state == OR_CONN_STATE_OPEN &&
              TO_OR_CONN(conn)->write_bucket <= 0) {
@@ -2329,10 +2710,23 @@ connection_consider_empty_write_buckets(connection_t *conn)
     return; /* all good, no need to stop it */
 
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
+  connection_note_blocked_on_bw(conn);
   conn->write_blocked_on_bw = 1;
   connection_stop_writing(conn);
 }
 
+/** Remember that <b>conn</b> is about to stop reading or writing until it
+ * has more tokens, so that connection_bucket_refill() will wake it. */
+static void
+connection_note_blocked_on_bw(connection_t *conn)
+{
+  if (conn->read_blocked_on_bw || conn->write_blocked_on_bw)
+    return; /* Already listed. */
+  if (!conns_blocked_on_bw)
+    conns_blocked_on_bw = smartlist_create();
+  smartlist_add(conns_blocked_on_bw, conn);
+}
+
 /** Initialize the global read bucket to options-\>BandwidthBurst. */
 void
 connection_bucket_init(void)
@@ -2348,6 +2742,7 @@ connection_bucket_init(void)
     global_relayed_read_bucket = (int)options->BandwidthBurst;
     global_relayed_write_bucket = (int)options->BandwidthBurst;
   }
+  connection_bucket_set_class_weights(options);
 }
 
 /** Refill a single <b>bucket</b> called <b>name</b> with bandwidth rate per
@@ -2384,8 +2779,8 @@ void
 connection_bucket_refill(int milliseconds_elapsed, time_t now)
 {
   const or_options_t *options = get_options();
-  smartlist_t *conns = get_connection_array();
   int bandwidthrate, bandwidthburst, relayrate, relayburst;
+  uint32_t paced_rate;
 
   bandwidthrate = (int)options->BandwidthRate;
   bandwidthburst = (int)options->BandwidthBurst;
@@ -2398,6 +2793,15 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
     relayburst = bandwidthburst;
   }
 
+  paced_rate = accounting_get_paced_rate();
+  if (paced_rate) {
+    /* AccountingPacing: don't refill faster than our quota allows. */
+    if ((uint32_t)bandwidthrate > paced_rate)
+      bandwidthrate = (int)paced_rate;
+    if ((uint32_t)relayrate > paced_rate)
+      relayrate = (int)paced_rate;
+  }
+
   tor_assert(milliseconds_elapsed >= 0);
 
   write_buckets_empty_last_second =
@@ -2421,56 +2825,67 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
                                   milliseconds_elapsed,
                                   "global_relayed_write_bucket");
 
-  /* refill the per-connection buckets */
-  SMARTLIST_FOREACH(conns, connection_t *, conn,
-  {
-    if (connection_speaks_cells(conn)) {
-      or_connection_t *or_conn = TO_OR_CONN(conn);
-      int orbandwidthrate = or_conn->bandwidthrate;
-      int orbandwidthburst = or_conn->bandwidthburst;
-      if (connection_bucket_should_increase(or_conn->read_bucket, or_conn)) {
-        connection_bucket_refill_helper(&or_conn->read_bucket,
-                                        orbandwidthrate,
-                                        orbandwidthburst,
-                                        milliseconds_elapsed,
-                                        "or_conn->read_bucket");
+  /* Refill each bandwidth class's share of the global buckets. */
+  if (bw_class_weight_total) {
+    int i;
+    for (i = 0; i < N_BANDWIDTH_CLASSES; ++i) {
+      int w = bw_class_weights[i];
+      int rate = (int)(((int64_t)bandwidthrate) * w / bw_class_weight_total);
+      int burst =
+        (int)(((int64_t)bandwidthburst) * w / bw_class_weight_total);
+      connection_bucket_refill_helper(&bw_class_read_buckets[i], rate, burst,
+                                      milliseconds_elapsed,
+                                      "bw_class_read_bucket");
+      connection_bucket_refill_helper(&bw_class_write_buckets[i], rate,
+                                      burst, milliseconds_elapsed,
+                                      "bw_class_write_bucket");
+    }
+  }
+
+  /* The per-connection buckets catch up when we next look at them. */
+  bucket_refill_msec += milliseconds_elapsed;
+
+  /* Wake the connections that were waiting for tokens. */
+  if (conns_blocked_on_bw) {
+    SMARTLIST_FOREACH_BEGIN(conns_blocked_on_bw, connection_t *, conn) {
+      int cell_conn_open = connection_speaks_cells(conn) &&
+                           conn->state == OR_CONN_STATE_OPEN;
+      if (cell_conn_open)
+        connection_or_buckets_catch_up(TO_OR_CONN(conn));
+
+      if (conn->read_blocked_on_bw == 1 /* marked to turn reading back on */
+          && global_read_bucket > 0 /* and we're allowed to read */
+          && (!connection_counts_as_relayed_traffic(conn, now) ||
+              global_relayed_read_bucket > 0) /* even if we're relayed */
+          && connection_bw_class_room(conn, 0) > 0 /* and in our class */
+          && (!cell_conn_open || TO_OR_CONN(conn)->read_bucket > 0)) {
+          /* and either a non-cell conn or a cell conn with non-empty bucket */
+        LOG_FN_CONN(conn, (LOG_DEBUG,LD_NET,
+                           "waking up conn (fd %d) for read", (int)conn->s));
+        conn->read_blocked_on_bw = 0;
+        connection_start_reading(conn);
       }
-      if (connection_bucket_should_increase(or_conn->write_bucket, or_conn)) {
-        connection_bucket_refill_helper(&or_conn->write_bucket,
-                                        orbandwidthrate,
-                                        orbandwidthburst,
-                                        milliseconds_elapsed,
-                                        "or_conn->write_bucket");
+
+      if (conn->write_blocked_on_bw == 1
+          && global_write_bucket > 0 /* and we're allowed to write */
+          && (!connection_counts_as_relayed_traffic(conn, now) ||
+              global_relayed_write_bucket > 0) /* even if it's relayed */
+          && connection_bw_class_room(conn, 1) > 0 /* and in its class */
+          && (!cell_conn_open || TO_OR_CONN(conn)->write_bucket > 0)) {
+        LOG_FN_CONN(conn, (LOG_DEBUG,LD_NET,
+                           "waking up conn (fd %d) for write", (int)conn->s));
+        conn->write_blocked_on_bw = 0;
+        connection_start_writing(conn);
       }
-    }
 
-    if (conn->read_blocked_on_bw == 1 /* marked to turn reading back on now */
-        && global_read_bucket > 0 /* and we're allowed to read */
-        && (!connection_counts_as_relayed_traffic(conn, now) ||
-            global_relayed_read_bucket > 0) /* even if we're relayed traffic */
-        && (!connection_speaks_cells(conn) ||
-            conn->state != OR_CONN_STATE_OPEN ||
-            TO_OR_CONN(conn)->read_bucket > 0)) {
-        /* and either a non-cell conn or a cell conn with non-empty bucket */
-      LOG_FN_CONN(conn, (LOG_DEBUG,LD_NET,
-                         "waking up conn (fd %d) for read", (int)conn->s));
-      conn->read_blocked_on_bw = 0;
-      connection_start_reading(conn);
-    }
+      if (!conn->read_blocked_on_bw && !conn->write_blocked_on_bw)
+        SMARTLIST_DEL_CURRENT(conns_blocked_on_bw, conn);
+    } SMARTLIST_FOREACH_END(conn);
+  }
 
-    if (conn->write_blocked_on_bw == 1
-        && global_write_bucket > 0 /* and we're allowed to write */
-        && (!connection_counts_as_relayed_traffic(conn, now) ||
-            global_relayed_write_bucket > 0) /* even if it's relayed traffic */
-        && (!connection_speaks_cells(conn) ||
-            conn->state != OR_CONN_STATE_OPEN ||
-            TO_OR_CONN(conn)->write_bucket > 0)) {
-      LOG_FN_CONN(conn, (LOG_DEBUG,LD_NET,
-                         "waking up conn (fd %d) for write", (int)conn->s));
-      conn->write_blocked_on_bw = 0;
-      connection_start_writing(conn);
-    }
-  });
+  /* Now that there are tokens again, let waiting connections have cells. */
+  if (options->GlobalCircuitScheduler)
+    circuit_scheduler_schedule();
 }
 
 /** Is the <b>bucket</b> for connection <b>conn</b> low enough that we
@@ -2507,29 +2922,53 @@ connection_bucket_refill(int seconds_elapsed, time_t now)
   (void) now;
   /* Libevent does this for us. */
 }
-void
-connection_bucket_init(void)
+/** Return a newly allocated token bucket configuration that lets us use
+ * <b>rate</b> out of our bandwidth rate and <b>burst</b> out of our
+ * burst, with weight <b>weight</b> out of <b>total</b>. */
+static struct ev_token_bucket_cfg *
+connection_bucket_cfg_new(uint64_t rate, uint64_t burst, int weight,
+                          int total)
 {
   const or_options_t *options = get_options();
   const struct timeval *tick = tor_libevent_get_one_tick_timeout();
-  struct ev_token_bucket_cfg *bucket_cfg;
 
-  uint64_t rate, burst;
+  rate = rate * weight / total;
+  burst = burst * weight / total;
+  /* This can't overflow, since TokenBucketRefillInterval <= 1000,
+   * and rate started out less than INT32_MAX. */
+  rate = (rate * options->TokenBucketRefillInterval) / 1000;
+
+  return ev_token_bucket_cfg_new((uint32_t)rate, (uint32_t)burst,
+                                 (uint32_t)rate, (uint32_t)burst,
+                                 tick);
+}
+
+/** Set *<b>rate_out</b> and *<b>burst_out</b> to the bandwidth rate and
+ * burst that our rate-limit groups share. */
+static void
+connection_bucket_get_rate(uint64_t *rate_out, uint64_t *burst_out)
+{
+  const or_options_t *options = get_options();
+  uint32_t paced_rate = accounting_get_paced_rate();
   if (options->RelayBandwidthRate) {
-    rate = options->RelayBandwidthRate;
-    burst = options->RelayBandwidthBurst;
+    *rate_out = options->RelayBandwidthRate;
+    *burst_out = options->RelayBandwidthBurst;
   } else {
-    rate = options->BandwidthRate;
-    burst = options->BandwidthBurst;
+    *rate_out = options->BandwidthRate;
+    *burst_out = options->BandwidthBurst;
   }
+  if (paced_rate && *rate_out > paced_rate)
+    *rate_out = paced_rate;
+}
 
-  /* This can't overflow, since TokenBucketRefillInterval <= 1000,
-   * and rate started out less than INT32_MAX. */
-  rate = (rate * options->TokenBucketRefillInterval) / 1000;
+void
+connection_bucket_init(void)
+{
+  struct ev_token_bucket_cfg *bucket_cfg;
+  uint64_t rate, burst;
 
-  bucket_cfg = ev_token_bucket_cfg_new((uint32_t)rate, (uint32_t)burst,
-                                       (uint32_t)rate, (uint32_t)burst,
-                                       tick);
+  connection_bucket_get_rate(&rate, &burst);
+  bucket_cfg = connection_bucket_cfg_new(rate, burst, 1, 1);
 
   if (!global_rate_limit) {
     global_rate_limit =
@@ -2538,28 +2977,105 @@ connection_bucket_init(void)
     bufferevent_rate_limit_group_set_cfg(global_rate_limit, bucket_cfg);
   }
   ev_token_bucket_cfg_free(bucket_cfg);
+
+  connection_bucket_set_class_weights(get_options());
+  if (bw_class_weight_total)
+    connection_bucket_configure_class_groups();
+}
+
+/** Create or reconfigure a rate-limit group for each bandwidth class, with
+ * that class's share of our bandwidth.  Libevent can't lend one group's
+ * unused tokens to another, so classes without a weight count as having
+ * weight 1 here, rather than getting nothing. */
+static void
+connection_bucket_configure_class_groups(void)
+{
+  uint64_t rate, burst;
+  int i, total = 0;
+
+  connection_bucket_get_rate(&rate, &burst);
+  for (i = 0; i < N_BANDWIDTH_CLASSES; ++i)
+    total += bw_class_weights[i] ? bw_class_weights[i] : 1;
+
+  for (i = 0; i < N_BANDWIDTH_CLASSES; ++i) {
+    int weight = bw_class_weights[i] ? bw_class_weights[i] : 1;
+    struct ev_token_bucket_cfg *cfg =
+      connection_bucket_cfg_new(rate, burst, weight, total);
+    if (!class_rate_limits[i]) {
+      class_rate_limits[i] =
+        bufferevent_rate_limit_group_new(tor_libevent_get_base(), cfg);
+    } else {
+      bufferevent_rate_limit_group_set_cfg(class_rate_limits[i], cfg);
+    }
+    ev_token_bucket_cfg_free(cfg);
+  }
+}
+
+/** Free our per-class rate-limit groups, remembering how much they read
+ * and wrote.  They must not have any members. */
+static void
+connection_bucket_free_class_groups(void)
+{
+  int i;
+  for (i = 0; i < N_BANDWIDTH_CLASSES; ++i) {
+    uint64_t r, w;
+    if (!class_rate_limits[i])
+      continue;
+    bufferevent_rate_limit_group_get_totals(class_rate_limits[i], &r, &w);
+    freed_rate_limit_read += r;
+    freed_rate_limit_written += w;
+    bufferevent_rate_limit_group_free(class_rate_limits[i]);
+    class_rate_limits[i] = NULL;
+  }
+}
+
+/** Put every rate-limited connection into the rate-limit group that it
+ * should be in now. */
+static void
+connection_regroup_rate_limited_conns(void)
+{
+  smartlist_t *conns = get_connection_array();
+  SMARTLIST_FOREACH(conns, connection_t *, conn,
+                    connection_enable_rate_limiting(conn));
 }
 
 void
 connection_get_rate_limit_totals(uint64_t *read_out, uint64_t *written_out)
 {
-  if (global_rate_limit == NULL) {
-    *read_out = *written_out = 0;
-  } else {
-    bufferevent_rate_limit_group_get_totals(
-      global_rate_limit, read_out, written_out);
+  int i;
+  *read_out = freed_rate_limit_read;
+  *written_out = freed_rate_limit_written;
+  if (global_rate_limit) {
+    uint64_t r, w;
+    bufferevent_rate_limit_group_get_totals(global_rate_limit, &r, &w);
+    *read_out += r;
+    *written_out += w;
+  }
+  for (i = 0; i < N_BANDWIDTH_CLASSES; ++i) {
+    uint64_t r, w;
+    if (!class_rate_limits[i])
+      continue;
+    bufferevent_rate_limit_group_get_totals(class_rate_limits[i], &r, &w);
+    *read_out += r;
+    *written_out += w;
   }
 }
 
-/** DOCDOC */
+/** If <b>conn</b> has a bufferevent and isn't exempt from rate limiting, put
+ * it in the rate-limit group for its bandwidth class, or in the global one
+ * if we aren't dividing our bandwidth into classes. */
 void
 connection_enable_rate_limiting(connection_t *conn)
 {
-  if (conn->bufev) {
-    if (!global_rate_limit)
-      connection_bucket_init();
-    tor_add_bufferevent_to_rate_limit_group(conn->bufev, global_rate_limit);
-  }
+  struct bufferevent_rate_limit_group *group;
+  if (!conn->bufev || !connection_is_rate_limited(conn))
+    return;
+  if (!global_rate_limit)
+    connection_bucket_init();
+  group = global_rate_limit;
+  if (bw_class_weight_total && class_rate_limits[connection_bw_class(conn)])
+    group = class_rate_limits[connection_bw_class(conn)];
+  tor_add_bufferevent_to_rate_limit_group(conn->bufev, group);
 }
 
 static void
@@ -2572,6 +3088,11 @@ connection_consider_empty_read_buckets(connection_t *conn)
 {
   (void) conn;
 }
+static void
+connection_note_blocked_on_bw(connection_t *conn)
+{
+  (void) conn;
+}
 #endif
 
 /** Read bytes from conn-\>s and process them.
@@ -2694,10 +3215,20 @@ connection_handle_read(connection_t *conn)
   int res;
 
   tor_gettimeofday_cache_clear();
+  update_approx_monotonic_msec();
   res = connection_handle_read_impl(conn);
   return res;
 }
 
+/** As connection_handle_read(), but keep using the cached high-resolution
+ * time, so that a caller handling a batch of connections reads the clock
+ * only once. */
+int
+connection_handle_read_with_cached_time(connection_t *conn)
+{
+  return connection_handle_read_impl(conn);
+}
+
 /** Pull in new bytes from conn-\>s or conn-\>linked_conn onto conn-\>inbuf,
  * either directly or via TLS. Reduce the token buckets by the number of bytes
  * read.
@@ -3146,6 +3677,9 @@ connection_handle_write_impl(connection_t *conn, int force)
                  tor_socket_strerror(e));
         if (CONN_IS_EDGE(conn))
           connection_edge_end_errno(TO_EDGE_CONN(conn));
+        if (conn->type == CONN_TYPE_EXIT)
+          connection_exit_note_connect_failed(&conn->addr, conn->port,
+                                              errno_to_stream_end_reason(e));
         if (conn->type == CONN_TYPE_OR)
           connection_or_connect_failed(TO_OR_CONN(conn),
                                        errno_to_orconn_end_reason(e),
@@ -3212,6 +3746,7 @@ connection_handle_write_impl(connection_t *conn, int force)
         log_debug(LD_NET,"wanted read.");
         if (!connection_is_reading(conn)) {
           connection_stop_writing(conn);
+          connection_note_blocked_on_bw(conn);
           conn->write_blocked_on_bw = 1;
           /* we'll start reading again when we get more tokens in our
            * read bucket; then we'll start writing again too.
@@ -3285,10 +3820,19 @@ connection_handle_write(connection_t *conn, int force)
 {
     int res;
     tor_gettimeofday_cache_clear();
+    update_approx_monotonic_msec();
     res = connection_handle_write_impl(conn, force);
     return res;
 }
 
+/** As connection_handle_write(), but keep using the cached high-resolution
+ * time, as for connection_handle_read_with_cached_time(). */
+int
+connection_handle_write_with_cached_time(connection_t *conn, int force)
+{
+  return connection_handle_write_impl(conn, force);
+}
+
 /**
  * Try to flush data that's waiting for a write on <b>conn</b>.  Return
  * -1 on failure, 0 on success.
@@ -3384,6 +3928,10 @@ _connection_write_to_buf_impl(const char *string, size_t len,
     return;
   }
 
+  if (conn->type == CONN_TYPE_DIR)
+    TO_DIR_CONN(conn)->response_bytes += buf_datalen(conn->outbuf) -
+      old_datalen;
+
   /* If we receive optimistic data in the EXIT_CONN_STATE_RESOLVING
    * state, we don't want to try to write it right away, since
    * conn->write_event won't be set yet.  Otherwise, write data from
@@ -3438,6 +3986,43 @@ _connection_write_to_buf_impl(const char *string, size_t len,
   }
 }
 
+/** Queue <b>len</b> bytes at <b>data</b> for writing on <b>conn</b> without
+ * copying them into the outbuf.  <b>release_fn</b>(<b>arg</b>) is called
+ * once the bytes are no longer needed, which may be immediately; until then
+ * the caller must keep <b>data</b> alive and unchanged. */
+void
+connection_write_to_buf_ref(const char *data, size_t len,
+                            connection_t *conn,
+                            void (*release_fn)(void *), void *arg)
+{
+  int r;
+  if (conn->marked_for_close && !conn->hold_open_until_flushed) {
+    release_fn(arg);
+    return;
+  }
+
+  IF_HAS_BUFFEREVENT(conn, {
+    /* Bufferevents copy anyway. */
+    if (bufferevent_write(conn->bufev, data, len) < 0)
+      log_warn(LD_NET, "bufferevent_write failed! That shouldn't happen.");
+    release_fn(arg);
+    return;
+  });
+
+  CONN_LOG_PROTECT(conn,
+                   r = write_to_buf_ref(data, len, conn->outbuf,
+                                        release_fn, arg));
+  if (r < 0) {
+    log_warn(LD_NET, "write_to_buf_ref failed. Closing connection (fd %d).",
+             (int)conn->s);
+    connection_mark_for_close(conn);
+    return;
+  }
+  conn->outbuf_flushlen += len;
+  if (conn->write_event)
+    connection_start_writing(conn);
+}
+
 /** Return a connection with given type, address, port, and purpose;
  * or NULL if no such connection exists. */
 connection_t *
@@ -3445,11 +4030,10 @@ connection_get_by_type_addr_port_purpose(int type,
                                          const tor_addr_t *addr, uint16_t port,
                                          int purpose)
 {
-  smartlist_t *conns = get_connection_array();
+  const smartlist_t *conns = get_connection_array_by_type(type);
   SMARTLIST_FOREACH(conns, connection_t *, conn,
   {
-    if (conn->type == type &&
-        tor_addr_eq(&conn->addr, addr) &&
+    if (tor_addr_eq(&conn->addr, addr) &&
         conn->port == port &&
         conn->purpose == purpose &&
         !conn->marked_for_close)
@@ -3464,13 +4048,7 @@ connection_get_by_type_addr_port_purpose(int type,
 connection_t *
 connection_get_by_global_id(uint64_t id)
 {
-  smartlist_t *conns = get_connection_array();
-  SMARTLIST_FOREACH(conns, connection_t *, conn,
-  {
-    if (conn->global_identifier == id)
-      return conn;
-  });
-  return NULL;
+  return get_connection_by_global_id(id);
 }
 
 /** Return a connection of type <b>type</b> that is not marked for close.
@@ -3478,10 +4056,10 @@ connection_get_by_global_id(uint64_t id)
 connection_t *
 connection_get_by_type(int type)
 {
-  smartlist_t *conns = get_connection_array();
+  const smartlist_t *conns = get_connection_array_by_type(type);
   SMARTLIST_FOREACH(conns, connection_t *, conn,
   {
-    if (conn->type == type && !conn->marked_for_close)
+    if (!conn->marked_for_close)
       return conn;
   });
   return NULL;
@@ -3493,10 +4071,10 @@ connection_get_by_type(int type)
 connection_t *
 connection_get_by_type_state(int type, int state)
 {
-  smartlist_t *conns = get_connection_array();
+  const smartlist_t *conns = get_connection_array_by_type(type);
   SMARTLIST_FOREACH(conns, connection_t *, conn,
   {
-    if (conn->type == type && conn->state == state && !conn->marked_for_close)
+    if (conn->state == state && !conn->marked_for_close)
       return conn;
   });
   return NULL;
@@ -3510,15 +4088,15 @@ connection_t *
 connection_get_by_type_state_rendquery(int type, int state,
                                        const char *rendquery)
 {
-  smartlist_t *conns = get_connection_array();
+  const smartlist_t *conns;
 
   tor_assert(type == CONN_TYPE_DIR ||
              type == CONN_TYPE_AP || type == CONN_TYPE_EXIT);
   tor_assert(rendquery);
 
+  conns = get_connection_array_by_type(type);
   SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
-    if (conn->type == type &&
-        !conn->marked_for_close &&
+    if (!conn->marked_for_close &&
         (!state || state == conn->state)) {
       if (type == CONN_TYPE_DIR &&
           TO_DIR_CONN(conn)->rend_data &&
@@ -3541,12 +4119,11 @@ dir_connection_t *
 connection_dir_get_by_purpose_and_resource(int purpose,
                                            const char *resource)
 {
-  smartlist_t *conns = get_connection_array();
+  const smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_DIR);
 
   SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
     dir_connection_t *dirconn;
-    if (conn->type != CONN_TYPE_DIR || conn->marked_for_close ||
-        conn->purpose != purpose)
+    if (conn->marked_for_close || conn->purpose != purpose)
       continue;
     dirconn = TO_DIR_CONN(conn);
     if (dirconn->requested_resource == NULL) {
@@ -3566,11 +4143,10 @@ connection_dir_get_by_purpose_and_resource(int purpose,
 connection_t *
 connection_get_by_type_purpose(int type, int purpose)
 {
-  smartlist_t *conns = get_connection_array();
+  const smartlist_t *conns = get_connection_array_by_type(type);
   SMARTLIST_FOREACH(conns, connection_t *, conn,
   {
-    if (conn->type == type &&
-        !conn->marked_for_close &&
+    if (!conn->marked_for_close &&
         (purpose == conn->purpose))
       return conn;
   });
@@ -3744,6 +4320,61 @@ set_constrained_socket_buffers(tor_socket_t sock, int size)
   }
 }
 
+/** With TuneSocketsByType, how many bytes that the peer hasn't been sent yet
+ * do we let the kernel hold for an edge connection?  Keeping this small
+ * keeps interactive streams from sitting behind a deep kernel queue. */
+#define EDGE_NOTSENT_LOWAT (16*1024)
+/** With TuneSocketsByType, how many not-yet-sent bytes do we let the kernel
+ * hold for an OR connection?  This is enough to keep a fast link busy
+ * between our writes, while leaving the rest of the backlog in our own
+ * cell queues, where the circuit scheduler can still reorder it. */
+#define OR_NOTSENT_LOWAT (128*1024)
+
+/** Adjust the TCP options on <b>sock</b>, a new socket for a connection of
+ * type <b>conn_type</b>, to suit the traffic it will carry.  Edge
+ * connections get TCP_NODELAY and a short unsent queue.  OR connections
+ * keep the kernel's buffer auto-tuning (unless ConstrainedSockets overrode
+ * it), and get a longer unsent queue.  The kernel grows and shrinks its
+ * buffers to match each connection's rate, and only wakes us to write when
+ * the unsent data drops below the mark, so the queue inside the kernel
+ * stays bounded however large the buffers get. */
+static void
+tune_socket_for_conn_type(tor_socket_t sock, int conn_type)
+{
+#ifdef HAVE_NETINET_TCP_H
+  int lowat;
+  switch (conn_type) {
+    case CONN_TYPE_AP:
+    case CONN_TYPE_EXIT:
+      {
+        int one = 1;
+        if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void*)&one,
+                       (socklen_t)sizeof(one)) < 0)
+          log_debug(LD_NET, "Unable to set TCP_NODELAY: %s",
+                    tor_socket_strerror(tor_socket_errno(sock)));
+      }
+      lowat = EDGE_NOTSENT_LOWAT;
+      break;
+    case CONN_TYPE_OR:
+      lowat = OR_NOTSENT_LOWAT;
+      break;
+    default:
+      return;
+  }
+#ifdef TCP_NOTSENT_LOWAT
+  if (setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (void*)&lowat,
+                 (socklen_t)sizeof(lowat)) < 0)
+    log_debug(LD_NET, "Unable to set TCP_NOTSENT_LOWAT: %s",
+              tor_socket_strerror(tor_socket_errno(sock)));
+#else
+  (void)lowat;
+#endif
+#else
+  (void)sock;
+  (void)conn_type;
+#endif
+}
+
 /** Process new bytes that have arrived on conn-\>inbuf.
  *
  * This function just passes conn to the connection-specific
@@ -3789,6 +4420,8 @@ connection_flushed_some(connection_t *conn)
     r = connection_or_flushed_some(TO_OR_CONN(conn));
   } else if (CONN_IS_EDGE(conn)) {
     r = connection_edge_flushed_some(TO_EDGE_CONN(conn));
+  } else if (conn->type == CONN_TYPE_CONTROL) {
+    r = connection_control_flushed_some(TO_CONTROL_CONN(conn));
   }
   conn->in_flushed_some = 0;
   return r;
@@ -3929,6 +4562,48 @@ connection_dump_buffer_mem_stats(int severity)
   }
 }
 
+/** Return the size of the structure we allocate for a connection of type
+ * <b>type</b>. */
+static size_t
+connection_struct_size(int type)
+{
+  switch (type) {
+    case CONN_TYPE_OR:
+      return sizeof(or_connection_t);
+    case CONN_TYPE_AP:
+      return sizeof(entry_connection_t);
+    case CONN_TYPE_EXIT:
+      return sizeof(edge_connection_t);
+    case CONN_TYPE_DIR:
+      return sizeof(dir_connection_t);
+    case CONN_TYPE_CONTROL:
+      return sizeof(control_connection_t);
+    CASE_ANY_LISTENER_TYPE:
+      return sizeof(listener_connection_t);
+    default:
+      return sizeof(connection_t);
+  }
+}
+
+/** Set *<b>n_out</b> to the number of open connections,
+ * *<b>struct_bytes_out</b> to the memory taken by their structures, and
+ * *<b>buf_bytes_out</b> to the memory allocated for their buffers. */
+void
+connection_get_mem_usage(int *n_out, uint64_t *struct_bytes_out,
+                         uint64_t *buf_bytes_out)
+{
+  smartlist_t *conns = get_connection_array();
+  *n_out = smartlist_len(conns);
+  *struct_bytes_out = *buf_bytes_out = 0;
+  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, c) {
+    *struct_bytes_out += connection_struct_size(c->type);
+    if (c->inbuf)
+      *buf_bytes_out += buf_allocation(c->inbuf);
+    if (c->outbuf)
+      *buf_bytes_out += buf_allocation(c->outbuf);
+  } SMARTLIST_FOREACH_END(c);
+}
+
 /** Verify that connection <b>conn</b> has all of its invariants
  * correct. Trigger an assert if anything is invalid.
  */
@@ -4208,11 +4883,19 @@ connection_free_all(void)
   /* Unlink everything from the identity map. */
   connection_or_clear_identity_map();
 
+  /* Free the OR connections that never made it into the array. */
+  connection_or_deferred_connects_free_all();
+
   /* Clear out our list of broken connections */
   clear_broken_connection_map(0);
 
   SMARTLIST_FOREACH(conns, connection_t *, conn, _connection_free(conn));
 
+#ifndef USE_BUFFEREVENTS
+  smartlist_free(conns_blocked_on_bw);
+  conns_blocked_on_bw = NULL;
+#endif
+
   if (outgoing_addrs) {
     SMARTLIST_FOREACH(outgoing_addrs, void*, addr, tor_free(addr));
     smartlist_free(outgoing_addrs);
@@ -4220,6 +4903,7 @@ connection_free_all(void)
   }
 
 #ifdef USE_BUFFEREVENTS
+  connection_bucket_free_class_groups();
   if (global_rate_limit)
     bufferevent_rate_limit_group_free(global_rate_limit);
 #endif
@@ -70,11 +70,29 @@ void connection_mark_all_noncontrol_listeners(void);
 void connection_mark_all_noncontrol_connections(void);
 
 ssize_t connection_bucket_write_limit(connection_t *conn, time_t now);
+ssize_t connection_bucket_write_room(connection_t *conn, time_t now);
+ssize_t connection_bucket_global_write_room(time_t now);
 int global_write_bucket_low(connection_t *conn, size_t attempt, int priority);
+
+/** Kinds of traffic that can each get a share of our bandwidth; see
+ * BandwidthClassWeights. */
+typedef enum {
+  BW_CLASS_RELAY=0, BW_CLASS_DIR=1, BW_CLASS_EXIT=2, BW_CLASS_INTERACTIVE=3,
+} bw_class_t;
+/** How many bw_class_t values are there? */
+#define N_BANDWIDTH_CLASSES 4
+
+int connection_bucket_parse_class_weights(const smartlist_t *weights,
+                                          int *weights_out, char **msg);
+void connection_bucket_set_class_weights(const or_options_t *options);
 void connection_bucket_init(void);
 void connection_bucket_refill(int seconds_elapsed, time_t now);
+#ifndef USE_BUFFEREVENTS
+void connection_or_buckets_update(or_connection_t *conn);
+#endif
 
 int connection_handle_read(connection_t *conn);
+int connection_handle_read_with_cached_time(connection_t *conn);
 
 int connection_fetch_from_buf(char *string, size_t len, connection_t *conn);
 int connection_fetch_from_buf_line(connection_t *conn, char *data,
@@ -87,10 +105,14 @@ int connection_fetch_from_buf_http(connection_t *conn,
 int connection_wants_to_flush(connection_t *conn);
 int connection_outbuf_too_full(connection_t *conn);
 int connection_handle_write(connection_t *conn, int force);
+int connection_handle_write_with_cached_time(connection_t *conn, int force);
 int connection_flush(connection_t *conn);
 
 void _connection_write_to_buf_impl(const char *string, size_t len,
                                    connection_t *conn, int zlib);
+void connection_write_to_buf_ref(const char *data, size_t len,
+                                 connection_t *conn,
+                                 void (*release_fn)(void *), void *arg);
 static void connection_write_to_buf(const char *string, size_t len,
                                     connection_t *conn);
 static void connection_write_to_buf_zlib(const char *string, size_t len,
@@ -153,6 +175,8 @@ char *alloc_http_authenticator(const char *authenticator);
 void assert_connection_ok(connection_t *conn, time_t now);
 int connection_or_nonopen_was_started_here(or_connection_t *conn);
 void connection_dump_buffer_mem_stats(int severity);
+void connection_get_mem_usage(int *n_out, uint64_t *struct_bytes_out,
+                              uint64_t *buf_bytes_out);
 void remove_file_if_very_old(const char *fname, time_t now);
 
 #ifdef USE_BUFFEREVENTS
@@ -11,6 +11,7 @@
 
 #include "or.h"
 #include "buffers.h"
+#include "circuitbuild.h"
 #include "circuitlist.h"
 #include "circuituse.h"
 #include "config.h"
@@ -34,6 +35,12 @@
 #include "router.h"
 #include "routerlist.h"
 
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
 #ifdef HAVE_LINUX_TYPES_H
 #include <linux/types.h>
 #endif
@@ -54,10 +61,14 @@
 static int connection_ap_handshake_process_socks(entry_connection_t *conn);
 static int connection_ap_process_natd(entry_connection_t *conn);
 static int connection_exit_connect_dir(edge_connection_t *exitconn);
+static void connection_edge_coalesce_cb(evutil_socket_t fd, short events,
+                                        void *arg);
 static int address_is_in_virtual_range(const char *addr);
 static int consider_plaintext_ports(entry_connection_t *conn, uint16_t port);
 static void clear_trackexithost_mappings(const char *exitname);
 static int connection_ap_supports_optimistic_data(const entry_connection_t *);
+static void connection_exit_note_connect_succeeded(const tor_addr_t *addr,
+                                                   uint16_t port);
 
 /** An AP stream has failed/finished. If it hasn't already sent back
  * a socks reply, send one now (based on endreason). Also set
@@ -137,6 +148,138 @@ connection_edge_reached_eof(edge_connection_t *conn)
   return 0;
 }
 
+/** Edge connections holding back a partial cell under EdgeCoalesceDelay,
+ * in order of deadline. */
+static smartlist_t *coalescing_edge_conns = NULL;
+/** Timer that fires at the first deadline in coalescing_edge_conns. */
+static struct event *coalescing_edge_event = NULL;
+
+/** Return the port at the far end of the stream <b>conn</b>. */
+static uint16_t
+connection_edge_get_dest_port(edge_connection_t *conn)
+{
+  if (conn->_base.type == CONN_TYPE_AP) {
+    const entry_connection_t *entry_conn = EDGE_TO_ENTRY_CONN(conn);
+    return entry_conn->socks_request ? entry_conn->socks_request->port : 0;
+  }
+  return conn->_base.port;
+}
+
+/** Return true iff we should hold back a partial cell of data on the open
+ * stream <b>conn</b> in the hope that more data arrives to fill it.  We
+ * only do this for bulk streams: interactive protocols, as listed in
+ * LongLivedPorts, and streams that have seen EOF are never delayed. */
+static int
+connection_edge_should_coalesce(edge_connection_t *conn)
+{
+  const or_options_t *options = get_options();
+  if (!options->EdgeCoalesceDelay || conn->_base.inbuf_reached_eof)
+    return 0;
+  if (connection_get_inbuf_len(TO_CONN(conn)) >= RELAY_PAYLOAD_SIZE)
+    return 0;
+  return !smartlist_string_num_isin(options->LongLivedPorts,
+                                    connection_edge_get_dest_port(conn));
+}
+
+/** Package whatever data each coalescing stream whose deadline has passed
+ * is still holding, and rearm the timer for the rest. */
+static void
+connection_edge_flush_coalesced(void)
+{
+  struct timeval now;
+  tor_gettimeofday(&now);
+  while (smartlist_len(coalescing_edge_conns)) {
+    edge_connection_t *conn = smartlist_get(coalescing_edge_conns, 0);
+    if (tv_udiff(&now, &conn->coalesce_deadline) > 0) {
+      struct timeval timeout;
+      long usec = tv_udiff(&now, &conn->coalesce_deadline);
+      timeout.tv_sec = usec / 1000000;
+      timeout.tv_usec = usec % 1000000;
+      if (!coalescing_edge_event)
+        coalescing_edge_event = tor_evtimer_new(tor_libevent_get_base(),
+                                          connection_edge_coalesce_cb, NULL);
+      if (evtimer_add(coalescing_edge_event, &timeout)<0)
+        log_warn(LD_BUG, "Couldn't add timer for coalescing edge data");
+      return;
+    }
+    smartlist_del_keeporder(coalescing_edge_conns, 0);
+    conn->edge_coalesce_pending = 0;
+    if (conn->_base.marked_for_close ||
+        (conn->_base.state != AP_CONN_STATE_OPEN &&
+         conn->_base.state != EXIT_CONN_STATE_OPEN))
+      continue;
+    if (connection_edge_package_raw_inbuf(conn, 1, NULL) < 0)
+      connection_mark_for_close(TO_CONN(conn));
+  }
+}
+
+/** Libevent callback: package the data that coalescing streams have been
+ * holding back for too long. */
+static void
+connection_edge_coalesce_cb(evutil_socket_t fd, short events, void *arg)
+{
+  (void)fd;
+  (void)events;
+  (void)arg;
+  connection_edge_flush_coalesced();
+}
+
+/** Remember that <b>conn</b> is holding back a partial cell, and arrange to
+ * package it within EdgeCoalesceDelay msec if no more data arrives. */
+static void
+connection_edge_start_coalescing(edge_connection_t *conn)
+{
+  int delay_msec = get_options()->EdgeCoalesceDelay;
+  int first;
+  if (conn->edge_coalesce_pending)
+    return;
+  if (!coalescing_edge_conns)
+    coalescing_edge_conns = smartlist_create();
+  first = smartlist_len(coalescing_edge_conns) == 0;
+  tor_gettimeofday_cached(&conn->coalesce_deadline);
+  conn->coalesce_deadline.tv_usec += (delay_msec % 1000) * 1000;
+  conn->coalesce_deadline.tv_sec += delay_msec / 1000 +
+    conn->coalesce_deadline.tv_usec / 1000000;
+  conn->coalesce_deadline.tv_usec %= 1000000;
+  conn->edge_coalesce_pending = 1;
+  smartlist_add(coalescing_edge_conns, conn);
+  if (first)
+    connection_edge_flush_coalesced();
+}
+
+/** Stop holding back data on <b>conn</b>; we call this when <b>conn</b> is
+ * about to be freed. */
+void
+connection_edge_forget_coalescing(edge_connection_t *conn)
+{
+  int i;
+  if (!conn->edge_coalesce_pending)
+    return;
+  conn->edge_coalesce_pending = 0;
+  for (i = 0; i < smartlist_len(coalescing_edge_conns); ++i) {
+    if (smartlist_get(coalescing_edge_conns, i) == conn) {
+      smartlist_del_keeporder(coalescing_edge_conns, i);
+      break;
+    }
+  }
+}
+
+/** Free all storage used to coalesce edge data. */
+void
+connection_edge_coalescing_free_all(void)
+{
+  if (coalescing_edge_conns) {
+    SMARTLIST_FOREACH(coalescing_edge_conns, edge_connection_t *, conn,
+                      conn->edge_coalesce_pending = 0);
+    smartlist_free(coalescing_edge_conns);
+    coalescing_edge_conns = NULL;
+  }
+  if (coalescing_edge_event) {
+    tor_event_free(coalescing_edge_event);
+    coalescing_edge_event = NULL;
+  }
+}
+
 /** Handle new bytes on conn->inbuf based on state:
  *   - If it's waiting for socks info, try to read another step of the
  *     socks handshake out of conn->inbuf.
@@ -167,11 +310,16 @@ connection_edge_process_inbuf(edge_connection_t *conn, int package_partial)
       return 0;
     case AP_CONN_STATE_OPEN:
     case EXIT_CONN_STATE_OPEN:
+      if (package_partial && connection_edge_should_coalesce(conn))
+        package_partial = 0;
       if (connection_edge_package_raw_inbuf(conn, package_partial, NULL) < 0) {
         /* (We already sent an end cell if possible) */
         connection_mark_for_close(TO_CONN(conn));
         return -1;
       }
+      if (!package_partial && connection_get_inbuf_len(TO_CONN(conn)) &&
+          connection_edge_should_coalesce(conn))
+        connection_edge_start_coalescing(conn);
       return 0;
     case AP_CONN_STATE_CONNECT_WAIT:
       if (connection_ap_supports_optimistic_data(EDGE_TO_ENTRY_CONN(conn))) {
@@ -408,6 +556,7 @@ connection_edge_finished_connecting(edge_connection_t *edge_conn)
            safe_str(fmt_addr(&conn->addr)));
 
   rep_hist_note_exit_stream_opened(conn->port);
+  connection_exit_note_connect_succeeded(&conn->addr, conn->port);
 
   conn->state = EXIT_CONN_STATE_OPEN;
   IF_HAS_NO_BUFFEREVENT(conn)
@@ -639,8 +788,182 @@ connection_ap_expire_beginning(void)
   } SMARTLIST_FOREACH_END(base_conn);
 }
 
+/** Map from a pending-stream key (see connection_ap_pending_key()) to a
+ * smartlist of entry_connection_t that are waiting in
+ * AP_CONN_STATE_CIRCUIT_WAIT for a circuit that could carry them.  Lets a
+ * newly usable circuit wake only the streams it might serve, rather than
+ * every pending stream we have.  Entries may be stale (the stream may have
+ * attached or changed state since); readers check before using them. */
+static strmap_t *pending_entry_connections = NULL;
+
+/** Write into <b>buf</b> the key under which the pending stream <b>conn</b>
+ * waits: "rend/" plus the onion address for rendezvous streams, "any" for
+ * streams that don't want an ordinary exit to a single port, and "port/"
+ * plus the destination port otherwise.  Onion addresses are compared
+ * case-insensitively, so we lowercase them here. */
+static void
+connection_ap_pending_key(const entry_connection_t *conn, char *buf,
+                          size_t buflen)
+{
+  const edge_connection_t *edge_conn = ENTRY_TO_EDGE_CONN(conn);
+  if (edge_conn->rend_data) {
+    tor_snprintf(buf, buflen, "rend/%s", edge_conn->rend_data->onion_address);
+    tor_strlower(buf);
+  } else if (conn->want_onehop || conn->use_begindir ||
+             conn->chosen_exit_name ||
+             conn->socks_request->command != SOCKS_COMMAND_CONNECT) {
+    strlcpy(buf, "any", buflen);
+  } else {
+    tor_snprintf(buf, buflen, "port/%d", (int)conn->socks_request->port);
+  }
+}
+
+/** Remove <b>conn</b> from whatever pending-stream bucket holds it, if
+ * any.  Empty buckets are freed by connection_ap_attach_pending(). */
+void
+connection_ap_forget_pending(entry_connection_t *conn)
+{
+  smartlist_t *bucket = conn->pending_bucket;
+  int idx = conn->pending_bucket_idx;
+  if (!bucket)
+    return;
+  tor_assert(idx >= 0 && idx < smartlist_len(bucket));
+  tor_assert(smartlist_get(bucket, idx) == conn);
+  smartlist_del(bucket, idx);
+  if (idx < smartlist_len(bucket)) {
+    entry_connection_t *moved = smartlist_get(bucket, idx);
+    moved->pending_bucket_idx = idx;
+  }
+  conn->pending_bucket = NULL;
+}
+
+/** Record that <b>conn</b> is waiting in AP_CONN_STATE_CIRCUIT_WAIT for a
+ * circuit, filing it under its current pending-stream key. */
+void
+connection_ap_mark_as_pending_circuit(entry_connection_t *conn)
+{
+  char key[REND_SERVICE_ID_LEN_BASE32+16];
+  smartlist_t *bucket;
+
+  tor_assert(ENTRY_TO_CONN(conn)->state == AP_CONN_STATE_CIRCUIT_WAIT);
+  connection_ap_pending_key(conn, key, sizeof(key));
+
+  if (!pending_entry_connections)
+    pending_entry_connections = strmap_new();
+  bucket = strmap_get(pending_entry_connections, key);
+  if (conn->pending_bucket && conn->pending_bucket == bucket)
+    return;
+  connection_ap_forget_pending(conn);
+  if (!bucket) {
+    bucket = smartlist_create();
+    strmap_set(pending_entry_connections, key, bucket);
+  }
+  conn->pending_bucket = bucket;
+  conn->pending_bucket_idx = smartlist_len(bucket);
+  smartlist_add(bucket, conn);
+}
+
+/** Append to <b>out</b> every connection in the pending-stream bucket
+ * <b>key</b>, if there is one. */
+static void
+connection_ap_pending_collect(const char *key, smartlist_t *out)
+{
+  smartlist_t *bucket = strmap_get(pending_entry_connections, key);
+  if (bucket)
+    smartlist_add_all(out, bucket);
+}
+
+/** Try to attach each connection in <b>conns</b> that is still waiting for
+ * a circuit, marking the ones that can never attach. */
+static void
+connection_ap_attach_list(smartlist_t *conns)
+{
+  SMARTLIST_FOREACH_BEGIN(conns, entry_connection_t *, entry_conn) {
+    connection_t *conn = ENTRY_TO_CONN(entry_conn);
+    if (conn->marked_for_close ||
+        conn->state != AP_CONN_STATE_CIRCUIT_WAIT) {
+      connection_ap_forget_pending(entry_conn);
+      continue;
+    }
+    if (connection_ap_handshake_attach_circuit(entry_conn) < 0) {
+      if (!conn->marked_for_close)
+        connection_mark_unattached_ap(entry_conn,
+                                      END_STREAM_REASON_CANT_ATTACH);
+    }
+  } SMARTLIST_FOREACH_END(entry_conn);
+}
+
+/** Called when <b>circ</b> has become usable for streams: tell the pending
+ * AP streams that <b>circ</b> might serve to try again.  Streams for other
+ * onion services, or for ports that <b>circ</b>'s exit definitely rejects,
+ * are left alone; connection_ap_attach_pending() still retries every
+ * pending stream once a second. */
+void
+connection_ap_attach_pending_for_circ(origin_circuit_t *circ)
+{
+  smartlist_t *conns;
+  const node_t *exit = NULL;
+
+  if (!pending_entry_connections)
+    return;
+
+  if (!circ->rend_data &&
+      (TO_CIRCUIT(circ)->purpose != CIRCUIT_PURPOSE_C_GENERAL ||
+       !circ->build_state || circ->build_state->is_internal)) {
+    /* Internal circuits get cannibalized for rendezvous use, so we can't
+     * easily tell which streams they might help. */
+    connection_ap_attach_pending();
+    return;
+  }
+
+  conns = smartlist_create();
+  if (circ->rend_data) {
+    char key[REND_SERVICE_ID_LEN_BASE32+16];
+    tor_snprintf(key, sizeof(key), "rend/%s", circ->rend_data->onion_address);
+    tor_strlower(key);
+    connection_ap_pending_collect(key, conns);
+  } else {
+    connection_ap_pending_collect("any", conns);
+    if (!circ->build_state->onehop_tunnel)
+      exit = build_state_get_exit_node(circ->build_state);
+    STRMAP_FOREACH(pending_entry_connections, key, smartlist_t *, bucket) {
+      int port;
+      if (circ->build_state->onehop_tunnel || strcmpstart(key, "port/"))
+        continue;
+      port = atoi(key+strlen("port/"));
+      if (exit && compare_tor_addr_to_node_policy(NULL, (uint16_t)port,
+                                       exit) == ADDR_POLICY_REJECTED)
+        continue;
+      smartlist_add_all(conns, bucket);
+    } STRMAP_FOREACH_END;
+  }
+
+  connection_ap_attach_list(conns);
+  smartlist_free(conns);
+}
+
+/** Release all storage held by the pending-stream index. */
+void
+connection_ap_pending_free_all(void)
+{
+  if (!pending_entry_connections)
+    return;
+  STRMAP_FOREACH_MODIFY(pending_entry_connections, key, smartlist_t *, sl) {
+    SMARTLIST_FOREACH(sl, entry_connection_t *, conn,
+                      conn->pending_bucket = NULL);
+    smartlist_free(sl);
+    MAP_DEL_CURRENT(key);
+  } STRMAP_FOREACH_END;
+  strmap_free(pending_entry_connections, NULL);
+  pending_entry_connections = NULL;
+}
+
 /** Tell any AP streams that are waiting for a new circuit to try again,
- * either attaching to an available circ or launching a new one.
+ * either attaching to an available circ or launching a new one.  This
+ * walks the whole connection array, so it also catches any waiting stream
+ * that has not been filed in the pending-stream index; run it from
+ * periodic housekeeping, and use connection_ap_attach_pending_for_circ()
+ * when a single circuit becomes ready.
  */
 void
 connection_ap_attach_pending(void)
@@ -660,6 +983,16 @@ connection_ap_attach_pending(void)
                                       END_STREAM_REASON_CANT_ATTACH);
     }
   });
+
+  if (pending_entry_connections) {
+    STRMAP_FOREACH_MODIFY(pending_entry_connections, key,
+                          smartlist_t *, bucket) {
+      if (smartlist_len(bucket) == 0) {
+        smartlist_free(bucket);
+        MAP_DEL_CURRENT(key);
+      }
+    } STRMAP_FOREACH_END;
+  }
 }
 
 /** Tell any AP streams that are waiting for a one-hop tunnel to
@@ -766,8 +1099,11 @@ connection_ap_detach_retriable(entry_connection_t *conn,
   ENTRY_TO_CONN(conn)->timestamp_lastread = time(NULL);
 
   if (conn->pending_optimistic_data) {
+    /* The exit never accepted this stream, so whatever we sent it
+     * optimistically is lost: replay it on the next circuit we try. */
     generic_buffer_set_to_copy(&conn->sending_optimistic_data,
                                conn->pending_optimistic_data);
+    ++stats_n_optimistic_retries;
   }
 
   if (!get_options()->LeaveStreamsUnattached || conn->use_begindir) {
@@ -816,6 +1152,10 @@ typedef struct {
   unsigned src_wildcard:1;
   unsigned dst_wildcard:1;
   short num_resolve_failures;
+  /** The address we're mapping from: our key in addressmap. */
+  char *address;
+  /** Our position in addressmap_expiry_pqueue, or -1 if we never expire. */
+  int expiry_heap_idx;
 } addressmap_entry_t;
 
 /** Entry for mapping addresses to which virtual address we mapped them to. */
@@ -838,12 +1178,66 @@ static strmap_t *addressmap=NULL;
  **/
 static strmap_t *virtaddress_reversemap=NULL;
 
+/** Priority queue of the addressmap entries that can expire, with the one
+ * that expires first at the front. */
+static smartlist_t *addressmap_expiry_pqueue=NULL;
+
+static void virtual_addr_note_mapped(const char *address, int mapped);
+static void virtual_addr_blocks_free(void);
+
 /** Initialize addressmap. */
 void
 addressmap_init(void)
 {
   addressmap = strmap_new();
   virtaddress_reversemap = strmap_new();
+  addressmap_expiry_pqueue = smartlist_create();
+}
+
+/** Helper for the expiry pqueue: order addressmap entries by expiry
+ * time. */
+static int
+_compare_addressmap_ent_expiry(const void *_a, const void *_b)
+{
+  const addressmap_entry_t *a = _a, *b = _b;
+  if (a->expires < b->expires)
+    return -1;
+  else if (a->expires == b->expires)
+    return 0;
+  else
+    return 1;
+}
+
+/** Set the expiry time of <b>ent</b> to <b>expires</b>, and put it in the
+ * expiry queue if it can expire. */
+static void
+addressmap_ent_set_expires(addressmap_entry_t *ent, time_t expires)
+{
+  if (ent->expiry_heap_idx >= 0)
+    smartlist_pqueue_remove(addressmap_expiry_pqueue,
+                            _compare_addressmap_ent_expiry,
+                            STRUCT_OFFSET(addressmap_entry_t, expiry_heap_idx),
+                            ent);
+  ent->expires = expires;
+  /* 0 and 1 mean "never expires"; see addressmap_register(). */
+  if (expires > 1)
+    smartlist_pqueue_add(addressmap_expiry_pqueue,
+                         _compare_addressmap_ent_expiry,
+                         STRUCT_OFFSET(addressmap_entry_t, expiry_heap_idx),
+                         ent);
+}
+
+/** Return a new addressmap entry for <b>address</b>, and add it to the
+ * addressmap. */
+static addressmap_entry_t *
+addressmap_ent_new(const char *address)
+{
+  addressmap_entry_t *ent = tor_malloc_zero(sizeof(addressmap_entry_t));
+  ent->address = tor_strdup(address);
+  ent->expiry_heap_idx = -1;
+  strmap_set(addressmap, address, ent);
+  virtual_addr_note_mapped(address, 1);
+  return ent;
 }
 
 /** Free the memory associated with the addressmap entry <b>_ent</b>. */
@@ -856,6 +1250,7 @@ addressmap_ent_free(void *_ent)
 
   ent = _ent;
   tor_free(ent->new_address);
+  tor_free(ent->address);
   tor_free(ent);
 }
 
@@ -901,6 +1296,12 @@ static void
 addressmap_ent_remove(const char *address, addressmap_entry_t *ent)
 {
   addressmap_virtaddress_remove(address, ent);
+  if (ent->expiry_heap_idx >= 0)
+    smartlist_pqueue_remove(addressmap_expiry_pqueue,
+                            _compare_addressmap_ent_expiry,
+                            STRUCT_OFFSET(addressmap_entry_t, expiry_heap_idx),
+                            ent);
+  virtual_addr_note_mapped(address, 0);
   addressmap_ent_free(ent);
 }
 
@@ -1046,7 +1447,15 @@ addressmap_clear_transient(void)
 void
 addressmap_clean(time_t now)
 {
-  addressmap_get_mappings(NULL, 2, now, 0);
+  if (!addressmap)
+    return;
+  while (smartlist_len(addressmap_expiry_pqueue)) {
+    addressmap_entry_t *ent = smartlist_get(addressmap_expiry_pqueue, 0);
+    if (ent->expires > now)
+      break;
+    strmap_remove(addressmap, ent->address);
+    addressmap_ent_remove(ent->address, ent);
+  }
 }
 
 /** Free all the elements in the addressmap, and free the addressmap
@@ -1059,6 +1468,10 @@ addressmap_free_all(void)
 
   strmap_free(virtaddress_reversemap, addressmap_virtaddress_ent_free);
   virtaddress_reversemap = NULL;
+
+  smartlist_free(addressmap_expiry_pqueue);
+  addressmap_expiry_pqueue = NULL;
+  virtual_addr_blocks_free();
 }
 
 /** Try to find a match for AddressMap expressions that use
@@ -1198,7 +1611,7 @@ addressmap_have_mapping(const char *address, int update_expiry)
   if (!(ent=strmap_get_lc(addressmap, address)))
     return 0;
   if (update_expiry && ent->source==ADDRMAPSRC_TRACKEXIT)
-    ent->expires=time(NULL) + update_expiry;
+    addressmap_ent_set_expires(ent, time(NULL) + update_expiry);
   return 1;
 }
 
@@ -1247,8 +1660,7 @@ addressmap_register(const char *address, char *new_address, time_t expires,
     return;
   }
   if (!ent) { /* make a new one and register it */
-    ent = tor_malloc_zero(sizeof(addressmap_entry_t));
-    strmap_set(addressmap, address, ent);
+    ent = addressmap_ent_new(address);
   } else if (ent->new_address) { /* we need to clean up the old mapping. */
     if (expires > 1) {
       log_info(LD_APP,"Temporary addressmap ('%s' to '%s') not performed, "
@@ -1269,7 +1681,7 @@ addressmap_register(const char *address, char *new_address, time_t expires,
   } /* else { we have an in-progress resolve with no mapping. } */
 
   ent->new_address = new_address;
-  ent->expires = expires==2 ? 1 : expires;
+  addressmap_ent_set_expires(ent, expires==2 ? 1 : expires);
   ent->num_resolve_failures = 0;
   ent->source = source;
   ent->src_wildcard = wildcard_addr ? 1 : 0;
@@ -1290,9 +1702,8 @@ client_dns_incr_failures(const char *address)
 {
   addressmap_entry_t *ent = strmap_get(addressmap, address);
   if (!ent) {
-    ent = tor_malloc_zero(sizeof(addressmap_entry_t));
-    ent->expires = time(NULL) + MAX_DNS_ENTRY_AGE;
-    strmap_set(addressmap,address,ent);
+    ent = addressmap_ent_new(address);
+    addressmap_ent_set_expires(ent, time(NULL) + MAX_DNS_ENTRY_AGE);
   }
   if (ent->num_resolve_failures < SHORT_MAX)
     ++ent->num_resolve_failures; /* don't overflow */
@@ -1425,6 +1836,155 @@ static maskbits_t virtual_addr_netmask_bits = 10;
 /** What's the next virtual address we will hand out? */
 static uint32_t next_virtual_addr    = 0x7fc00000u;
 
+/** How many addresses are in each block of the virtual address
+ * allocator? */
+#define VIRTUAL_ADDR_BLOCK_SIZE 65536
+/** How many addresses in each block can we hand out?  We never use .0 or
+ * .255 addresses. */
+#define VIRTUAL_ADDR_BLOCK_USABLE (VIRTUAL_ADDR_BLOCK_SIZE / 256 * 254)
+
+/** Which IPv4 addresses in one /16 of the virtual network are mapped. */
+typedef struct virtual_addr_block_t {
+  /** How many usable addresses in this block are mapped? */
+  int n_used;
+  /** One bit per address in the block: set if the address is mapped, or
+   * if it's a .0 or .255 address. */
+  bitarray_t *used;
+} virtual_addr_block_t;
+
+/** One entry for each /16 in the virtual network, so that finding an
+ * unmapped address doesn't need to probe the addressmap.  NULL until we
+ * first map an address in the network. */
+static virtual_addr_block_t *virtual_addr_blocks = NULL;
+/** How many entries are in <b>virtual_addr_blocks</b>? */
+static int virtual_addr_n_blocks = 0;
+
+/** Free all storage held by the virtual address allocator. */
+static void
+virtual_addr_blocks_free(void)
+{
+  int i;
+  for (i = 0; i < virtual_addr_n_blocks; ++i)
+    bitarray_free(virtual_addr_blocks[i].used);
+  tor_free(virtual_addr_blocks);
+  virtual_addr_n_blocks = 0;
+}
+
+/** Return the allocator block for <b>addr</b>, creating it if need be, or
+ * NULL if <b>addr</b> is not in the virtual network. */
+static virtual_addr_block_t *
+virtual_addr_get_block(uint32_t addr)
+{
+  virtual_addr_block_t *block;
+  if (addr_mask_cmp_bits(addr, virtual_addr_network,
+                         virtual_addr_netmask_bits))
+    return NULL;
+  if (!virtual_addr_blocks) {
+    virtual_addr_n_blocks = 1 << (16 - virtual_addr_netmask_bits);
+    virtual_addr_blocks = tor_malloc_zero(sizeof(virtual_addr_block_t) *
+                                          virtual_addr_n_blocks);
+  }
+  block = &virtual_addr_blocks[(addr - virtual_addr_network) >> 16];
+  if (!block->used) {
+    int i;
+    block->used = bitarray_init_zero(VIRTUAL_ADDR_BLOCK_SIZE);
+    for (i = 0; i < VIRTUAL_ADDR_BLOCK_SIZE; i += 256) {
+      bitarray_set(block->used, i);
+      bitarray_set(block->used, i + 255);
+    }
+  }
+  return block;
+}
+
+/** Note that <b>address</b> has become mapped (if <b>mapped</b>) or
+ * unmapped in the addressmap.  Does nothing unless <b>address</b> is an
+ * IPv4 address in the virtual network. */
+static void
+virtual_addr_note_mapped(const char *address, int mapped)
+{
+  struct in_addr in;
+  uint32_t addr;
+  virtual_addr_block_t *block;
+  int bit;
+  if (!tor_inet_aton(address, &in))
+    return;
+  addr = ntohl(in.s_addr);
+  if ((addr & 0xff) == 0 || (addr & 0xff) == 0xff)
+    return;
+  if (!(block = virtual_addr_get_block(addr)))
+    return;
+  bit = addr & (VIRTUAL_ADDR_BLOCK_SIZE - 1);
+  if (mapped && !bitarray_is_set(block->used, bit)) {
+    bitarray_set(block->used, bit);
+    ++block->n_used;
+  } else if (!mapped && bitarray_is_set(block->used, bit)) {
+    bitarray_clear(block->used, bit);
+    --block->n_used;
+  }
+}
+
+/** Rebuild the virtual address allocator from the addressmap, after the
+ * virtual network has changed. */
+static void
+virtual_addr_blocks_rebuild(void)
+{
+  virtual_addr_blocks_free();
+  if (!addressmap)
+    return;
+  STRMAP_FOREACH(addressmap, address, addressmap_entry_t *, ent) {
+    (void)ent;
+    virtual_addr_note_mapped(address, 1);
+  } STRMAP_FOREACH_END;
+}
+
+/** Set *<b>addr_out</b> to the first unmapped address in the virtual
+ * network at or after <b>next_virtual_addr</b>, wrapping around at the end
+ * of the network.  Return 0 on success, or -1 if every address is mapped. */
+static int
+virtual_addr_find_unused(uint32_t *addr_out)
+{
+  const int words_per_block = VIRTUAL_ADDR_BLOCK_SIZE >> BITARRAY_SHIFT;
+  uint32_t start = next_virtual_addr;
+  virtual_addr_block_t *block;
+  int b, i, first_block, start_word;
+
+  if (addr_mask_cmp_bits(start, virtual_addr_network,
+                         virtual_addr_netmask_bits))
+    start = virtual_addr_network;
+  virtual_addr_get_block(start); /* Make sure the block array exists. */
+  first_block = (start - virtual_addr_network) >> 16;
+  start_word = (start & (VIRTUAL_ADDR_BLOCK_SIZE-1)) >> BITARRAY_SHIFT;
+
+  /* Look at every block once, starting with the one holding start, then
+   * look at the beginning of that block again. */
+  for (i = 0; i <= virtual_addr_n_blocks; ++i) {
+    const int w_min = (i == 0) ? start_word : 0;
+    const int w_max = (i == virtual_addr_n_blocks) ?
+      start_word + 1 : words_per_block;
+    int w;
+    b = (first_block + i) % virtual_addr_n_blocks;
+    block = &virtual_addr_blocks[b];
+    if (block->n_used == VIRTUAL_ADDR_BLOCK_USABLE)
+      continue;
+    if (!block->used)
+      block = virtual_addr_get_block(virtual_addr_network + (b << 16));
+    for (w = w_min; w < w_max; ++w) {
+      bitarray_t free_bits = ~block->used[w];
+      if (i == 0 && w == start_word)
+        free_bits &= ~0u << (start & BITARRAY_MASK);
+      if (free_bits) {
+        int bit = 0;
+        while (!(free_bits & (1u << bit)))
+          ++bit;
+        *addr_out = virtual_addr_network + (b << 16) +
+          (w << BITARRAY_SHIFT) + bit;
+        return 0;
+      }
+    }
+  }
+  return -1;
+}
+
 /** Read a netmask of the form 127.192.0.0/10 from "val", and check whether
  * it's a valid set of virtual addresses to hand out in response to MAPADDRESS
  * requests.  Return 0 on success; set *msg (if provided) to a newly allocated
@@ -1463,6 +2023,8 @@ parse_virtual_addr_network(const char *val, int validate_only,
   if (addr_mask_cmp_bits(next_virtual_addr, addr, bits))
     next_virtual_addr = addr;
 
+  virtual_addr_blocks_rebuild();
+
   return 0;
 }
 
@@ -1519,34 +2081,24 @@ addressmap_get_virtual_address(int type)
     } while (strmap_get(addressmap, buf));
     return tor_strdup(buf);
   } else if (type == RESOLVED_TYPE_IPV4) {
-    // This is an imperfect estimate of how many addresses are available, but
-    // that's ok.
     struct in_addr in;
-    uint32_t available = 1u << (32-virtual_addr_netmask_bits);
-    while (available) {
-      /* Don't hand out any .0 or .255 address. */
-      while ((next_virtual_addr & 0xff) == 0 ||
-             (next_virtual_addr & 0xff) == 0xff) {
-        increment_virtual_addr();
-        if (! --available) {
-          log_warn(LD_CONFIG, "Ran out of virtual addresses!");
-          return NULL;
-        }
-      }
-      in.s_addr = htonl(next_virtual_addr);
-      tor_inet_ntoa(&in, buf, sizeof(buf));
-      if (!strmap_get(addressmap, buf)) {
-        increment_virtual_addr();
-        break;
-      }
-
-      increment_virtual_addr();
-      --available;
-      // log_info(LD_CONFIG, "%d addrs available", (int)available);
-      if (! available) {
+    uint32_t addr;
+    while (1) {
+      if (virtual_addr_find_unused(&addr) < 0) {
         log_warn(LD_CONFIG, "Ran out of virtual addresses!");
         return NULL;
       }
+      next_virtual_addr = addr;
+      increment_virtual_addr();
+      in.s_addr = htonl(addr);
+      tor_inet_ntoa(&in, buf, sizeof(buf));
+      if (!strmap_get(addressmap, buf))
+        break;
+      /* The allocator missed this mapping somehow; remember it and keep
+       * looking. */
+      log_warn(LD_BUG, "Virtual address %s was mapped, but the allocator "
+               "didn't know.", buf);
+      virtual_addr_note_mapped(buf, 1);
     }
     return tor_strdup(buf);
   } else {
@@ -3191,6 +3743,132 @@ connection_exit_begin_resolve(cell_t *cell, or_circuit_t *circ)
   return 0;
 }
 
+/** An entry in the exit-side cache of destinations that recently refused
+ * or could not route our connections. */
+typedef struct exit_connect_failure_t {
+  /** Until when do we fail new streams to this destination at once? */
+  time_t expires;
+  /** The END_STREAM_REASON_* to report for those streams. */
+  uint8_t reason;
+} exit_connect_failure_t;
+
+/** Map from "address:port" to exit_connect_failure_t, for destinations that
+ * recently refused our connections.  Only used when
+ * ExitConnectFailureCacheTime is nonzero. */
+static strmap_t *exit_connect_failures = NULL;
+
+/** Most entries we keep in exit_connect_failures. */
+#define MAX_EXIT_CONNECT_FAILURES 8192
+
+/** Write the exit_connect_failures key for <b>addr</b>:<b>port</b> into
+ * <b>buf</b>. */
+static void
+exit_connect_failure_key(const tor_addr_t *addr, uint16_t port,
+                         char *buf, size_t buflen)
+{
+  char addrbuf[TOR_ADDR_BUF_LEN];
+  tor_addr_to_str(addrbuf, addr, sizeof(addrbuf), 1);
+  tor_snprintf(buf, buflen, "%s:%d", addrbuf, (int)port);
+}
+
+/** Remove every expired entry from exit_connect_failures. */
+static void
+exit_connect_failures_expire(time_t now)
+{
+  if (!exit_connect_failures)
+    return;
+  STRMAP_FOREACH_MODIFY(exit_connect_failures, key,
+                        exit_connect_failure_t *, ent) {
+    if (ent->expires <= now) {
+      MAP_DEL_CURRENT(key);
+      tor_free(ent);
+    }
+  } STRMAP_FOREACH_END;
+}
+
+/** Our exit connection to <b>addr</b>:<b>port</b> just failed with the
+ * stream end reason <b>reason</b>.  If the destination refused us or
+ * can't be routed to, remember that for ExitConnectFailureCacheTime
+ * seconds so we can fail new streams to it without another connect. */
+void
+connection_exit_note_connect_failed(const tor_addr_t *addr, uint16_t port,
+                                    int reason)
+{
+  char key[TOR_ADDR_BUF_LEN+8];
+  exit_connect_failure_t *ent;
+  int lifetime = get_options()->ExitConnectFailureCacheTime;
+  time_t now = time(NULL);
+
+  if (lifetime <= 0)
+    return;
+  if (reason != END_STREAM_REASON_CONNECTREFUSED &&
+      reason != END_STREAM_REASON_NOROUTE)
+    return;
+
+  if (!exit_connect_failures)
+    exit_connect_failures = strmap_new();
+  exit_connect_failure_key(addr, port, key, sizeof(key));
+  ent = strmap_get(exit_connect_failures, key);
+  if (!ent) {
+    if (strmap_size(exit_connect_failures) >= MAX_EXIT_CONNECT_FAILURES) {
+      exit_connect_failures_expire(now);
+      if (strmap_size(exit_connect_failures) >= MAX_EXIT_CONNECT_FAILURES)
+        return;
+    }
+    ent = tor_malloc_zero(sizeof(exit_connect_failure_t));
+    strmap_set(exit_connect_failures, key, ent);
+  }
+  ent->expires = now + lifetime;
+  ent->reason = (uint8_t)reason;
+}
+
+/** Our exit connection to <b>addr</b>:<b>port</b> succeeded; forget any
+ * failure we had cached for it. */
+static void
+connection_exit_note_connect_succeeded(const tor_addr_t *addr, uint16_t port)
+{
+  char key[TOR_ADDR_BUF_LEN+8];
+  exit_connect_failure_t *ent;
+  if (!exit_connect_failures)
+    return;
+  exit_connect_failure_key(addr, port, key, sizeof(key));
+  ent = strmap_remove(exit_connect_failures, key);
+  tor_free(ent);
+}
+
+/** If a connection to <b>addr</b>:<b>port</b> failed recently enough that
+ * we shouldn't try again yet, return the stream end reason it failed with.
+ * Otherwise return 0. */
+int
+connection_exit_connect_recently_failed(const tor_addr_t *addr,
+                                        uint16_t port, time_t now)
+{
+  char key[TOR_ADDR_BUF_LEN+8];
+  exit_connect_failure_t *ent;
+  if (!exit_connect_failures)
+    return 0;
+  exit_connect_failure_key(addr, port, key, sizeof(key));
+  ent = strmap_get(exit_connect_failures, key);
+  if (!ent)
+    return 0;
+  if (ent->expires <= now) {
+    strmap_remove(exit_connect_failures, key);
+    tor_free(ent);
+    return 0;
+  }
+  return ent->reason;
+}
+
+/** Release all storage held by the cache of failed exit connections. */
+void
+connection_exit_connect_failures_free_all(void)
+{
+  if (!exit_connect_failures)
+    return;
+  strmap_free(exit_connect_failures, _tor_free);
+  exit_connect_failures = NULL;
+}
+
 /** Connect to conn's specified addr and port. If it worked, conn
  * has now been added to the connection_array.
  *
@@ -3205,6 +3883,7 @@ connection_exit_connect(edge_connection_t *edge_conn)
   uint16_t port;
   connection_t *conn = TO_CONN(edge_conn);
   int socket_error = 0;
+  int reason;
 
   if (!connection_edge_is_rendezvous_stream(edge_conn) &&
       router_compare_to_my_exit_policy(edge_conn)) {
@@ -3219,10 +3898,21 @@ connection_exit_connect(edge_connection_t *edge_conn)
   addr = &conn->addr;
   port = conn->port;
 
+  if ((reason = connection_exit_connect_recently_failed(addr, port,
+                                                        time(NULL)))) {
+    log_info(LD_EXIT,"%s:%d failed a connect recently. Not retrying yet.",
+             escaped_safe_str_client(conn->address), conn->port);
+    connection_edge_end(edge_conn, reason);
+    circuit_detach_stream(circuit_get_by_edge_conn(edge_conn), edge_conn);
+    connection_free(conn);
+    return;
+  }
+
   log_debug(LD_EXIT,"about to try connecting");
   switch (connection_connect(conn, conn->address, addr, port, &socket_error)) {
     case -1: {
-      int reason = errno_to_stream_end_reason(socket_error);
+      reason = errno_to_stream_end_reason(socket_error);
+      connection_exit_note_connect_failed(addr, port, reason);
       connection_edge_end(edge_conn, reason);
       circuit_detach_stream(circuit_get_by_edge_conn(edge_conn), edge_conn);
       connection_free(conn);
@@ -3238,6 +3928,7 @@ connection_exit_connect(edge_connection_t *edge_conn)
     /* case 1: fall through */
   }
 
+  connection_exit_note_connect_succeeded(addr, port);
   conn->state = EXIT_CONN_STATE_OPEN;
   if (connection_get_outbuf_len(conn)) {
     /* in case there are any queued data cells */
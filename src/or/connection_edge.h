@@ -52,11 +52,22 @@ void connection_ap_handshake_socks_resolved(entry_connection_t *conn,
 int connection_exit_begin_conn(cell_t *cell, circuit_t *circ);
 int connection_exit_begin_resolve(cell_t *cell, or_circuit_t *circ);
 void connection_exit_connect(edge_connection_t *conn);
+void connection_edge_forget_coalescing(edge_connection_t *conn);
+void connection_edge_coalescing_free_all(void);
+void connection_exit_note_connect_failed(const tor_addr_t *addr,
+                                         uint16_t port, int reason);
+int connection_exit_connect_recently_failed(const tor_addr_t *addr,
+                                            uint16_t port, time_t now);
+void connection_exit_connect_failures_free_all(void);
 int connection_edge_is_rendezvous_stream(edge_connection_t *conn);
 int connection_ap_can_use_exit(const entry_connection_t *conn,
                                const node_t *exit);
 void connection_ap_expire_beginning(void);
 void connection_ap_attach_pending(void);
+void connection_ap_attach_pending_for_circ(origin_circuit_t *circ);
+void connection_ap_mark_as_pending_circuit(entry_connection_t *conn);
+void connection_ap_forget_pending(entry_connection_t *conn);
+void connection_ap_pending_free_all(void);
 void connection_ap_fail_onehop(const char *failed_digest,
                                cpath_build_state_t *build_state);
 void circuit_discard_optional_exit_enclaves(extend_info_t *info);
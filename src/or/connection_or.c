@@ -12,6 +12,7 @@
 
 #include "or.h"
 #include "buffers.h"
+#include "celltrace.h"
 #include "circuitbuild.h"
 #include "circuitlist.h"
 #include "command.h"
@@ -30,6 +31,12 @@
 #include "router.h"
 #include "routerlist.h"
 
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
 #ifdef USE_BUFFEREVENTS
 #include <event2/bufferevent_ssl.h>
 #endif
@@ -42,6 +49,8 @@ static int connection_or_check_valid_tls_handshake(or_connection_t *conn,
                                                    char *digest_rcvd_out);
 
 static void connection_or_tls_renegotiated_cb(tor_tls_t *tls, void *_conn);
+static int connection_or_launch(or_connection_t *conn);
+static int connection_or_should_defer_connect(void);
 
 #ifdef USE_BUFFEREVENTS
 static void connection_or_handle_event_cb(struct bufferevent *bufev,
@@ -56,6 +65,28 @@ static void connection_or_handle_event_cb(struct bufferevent *bufev,
  * they form a linked list, with next_with_same_id as the next pointer. */
 static digestmap_t *orconn_identity_map = NULL;
 
+/** Map from identity digest to the canonical OR connection that
+ * connection_or_get_for_extend() last chose for that identity.  We drop an
+ * entry whenever something happens that could make another connection
+ * better: a connection with that identity appears, disappears, opens, or
+ * gains or loses its last circuit.  Everything else that would make the
+ * cached connection unusable, we check when we look it up. */
+static digestmap_t *orconn_best_for_extend_map = NULL;
+
+/** Outgoing OR connections that we've created, but haven't called
+ * connect() for yet, because of MaxConcurrentORConnects or
+ * MaxORConnectsPerSecond.  They aren't in the connection array yet, but
+ * they are in orconn_identity_map, so that circuits wait for them. */
+static smartlist_t *deferred_or_connects = NULL;
+/** Event to launch members of deferred_or_connects. */
+static struct event *deferred_or_connects_event = NULL;
+/** The second during which we launched n_or_connects_this_second outgoing
+ * OR connections. */
+static time_t or_connects_second = 0;
+/** How many outgoing OR connections did we launch during
+ * or_connects_second? */
+static int n_or_connects_this_second = 0;
+
 /** If conn is listed in orconn_identity_map, remove it, and clear
  * conn->identity_digest.  Otherwise do nothing. */
 void
@@ -65,6 +96,7 @@ connection_or_remove_from_identity_map(or_connection_t *conn)
   tor_assert(conn);
   if (!orconn_identity_map)
     return;
+  connection_or_clear_best_for_extend(conn);
   tmp = digestmap_get(orconn_identity_map, conn->identity_digest);
   if (!tmp) {
     if (!tor_digest_is_zero(conn->identity_digest)) {
@@ -110,6 +142,18 @@ connection_or_clear_identity_map(void)
 
   digestmap_free(orconn_identity_map, NULL);
   orconn_identity_map = NULL;
+  digestmap_free(orconn_best_for_extend_map, NULL);
+  orconn_best_for_extend_map = NULL;
+}
+
+/** Forget which connection connection_or_get_for_extend() prefers for
+ * <b>conn</b>'s identity, because <b>conn</b> might now be better or worse
+ * than it was. */
+void
+connection_or_clear_best_for_extend(const or_connection_t *conn)
+{
+  if (orconn_best_for_extend_map)
+    digestmap_remove(orconn_best_for_extend_map, conn->identity_digest);
 }
 
 /** Change conn->identity_digest to digest, and add conn into
@@ -136,6 +180,7 @@ connection_or_set_identity_digest(or_connection_t *conn, const char *digest)
   if (tor_digest_is_zero(digest))
     return;
 
+  connection_or_clear_best_for_extend(conn);
   tmp = digestmap_set(orconn_identity_map, digest, conn);
   conn->next_with_same_id = tmp;
 
@@ -387,20 +432,19 @@ connection_or_process_inbuf(or_connection_t *conn)
     case OR_CONN_STATE_OPEN:
     case OR_CONN_STATE_OR_HANDSHAKING_V2:
     case OR_CONN_STATE_OR_HANDSHAKING_V3:
-      return connection_or_process_cells_from_inbuf(conn);
+      {
+        struct timeval start;
+        int r;
+        tor_gettimeofday(&start);
+        r = connection_or_process_cells_from_inbuf(conn);
+        rep_hist_note_handler_time(HANDLER_OR_CELLS, &start);
+        return r;
+      }
     default:
       return 0; /* don't do anything */
   }
 }
 
-/** When adding cells to an OR connection's outbuf, keep adding until the
- * outbuf is at least this long, or we run out of cells. */
-#define OR_CONN_HIGHWATER (32*1024)
-
-/** Add cells to an OR connection's outbuf whenever the outbuf's data length
- * drops below this size. */
-#define OR_CONN_LOWWATER (16*1024)
-
 /** Called whenever we have flushed some data on an or_conn: add more data
  * from active circuits. */
 int
@@ -412,6 +456,12 @@ connection_or_flushed_some(or_connection_t *conn)
   if (datalen < OR_CONN_LOWWATER) {
     ssize_t n = CEIL_DIV(OR_CONN_HIGHWATER - datalen, CELL_NETWORK_SIZE);
     time_t now = approx_time();
+    if (get_options()->GlobalCircuitScheduler) {
+      /* Let the scheduler decide which connection's circuits go first. */
+      if (conn->active_circuits)
+        circuit_scheduler_conn_wants_cells(conn);
+      return 0;
+    }
     while (conn->active_circuits && n > 0) {
       int flushed;
       flushed = connection_or_flush_from_first_active_circuit(conn, 1, now);
@@ -527,6 +577,10 @@ connection_or_about_to_close(or_connection_t *or_conn)
   /* Now close all the attached circuits on it. */
   circuit_unlink_all_from_or_conn(TO_OR_CONN(conn),
                                   END_CIRC_REASON_OR_CONN_CLOSED);
+
+  /* If this was a connect in progress, there's room for another. */
+  if (or_conn->is_outgoing)
+    connection_or_schedule_deferred_connects();
 }
 
 /** Return 1 if identity digest <b>id_digest</b> is known to be a
@@ -574,6 +628,10 @@ connection_or_update_token_buckets_helper(or_connection_t *conn, int reset,
                                 (int)options->BandwidthBurst, 1, INT32_MAX);
   }
 
+#ifndef USE_BUFFEREVENTS
+  /* Settle what the buckets earned at the old rate before we change it. */
+  connection_or_buckets_update(conn);
+#endif
   conn->bandwidthrate = rate;
   conn->bandwidthburst = burst;
 #ifdef USE_BUFFEREVENTS
@@ -762,6 +820,24 @@ connection_or_get_for_extend(const char *digest,
     return NULL;
   }
 
+  /* A canonical connection beats every non-canonical one, no matter what
+   * address we wanted, so if the one we chose last time is still usable
+   * it's still the best. */
+  if (orconn_best_for_extend_map &&
+      (best = digestmap_get(orconn_best_for_extend_map, digest))) {
+    if (!best->_base.marked_for_close &&
+        !best->is_connection_with_client &&
+        best->_base.state == OR_CONN_STATE_OPEN &&
+        !best->is_bad_for_new_circs) {
+      tor_assert(best->is_canonical);
+      *msg_out = "Connection is fine; using it.";
+      *launch_out = 0;
+      return best;
+    }
+    digestmap_remove(orconn_best_for_extend_map, digest);
+    best = NULL;
+  }
+
   conn = digestmap_get(orconn_identity_map, digest);
 
   for (; conn; conn = conn->next_with_same_id) {
@@ -813,6 +889,11 @@ connection_or_get_for_extend(const char *digest,
   }
 
   if (best) {
+    if (best->is_canonical) {
+      if (!orconn_best_for_extend_map)
+        orconn_best_for_extend_map = digestmap_new();
+      digestmap_set(orconn_best_for_extend_map, digest, best);
+    }
     *msg_out = "Connection is fine; using it.";
     *launch_out = 0;
     return best;
@@ -974,9 +1055,15 @@ connection_or_set_bad_connections(const char *digest, int force)
   if (!orconn_identity_map)
     return;
 
+  if (digest) {
+    or_connection_t *head = digestmap_get(orconn_identity_map, digest);
+    if (head)
+      connection_or_group_set_badness(head, force);
+    return;
+  }
+
   DIGESTMAP_FOREACH(orconn_identity_map, identity, or_connection_t *, conn) {
-    if (!digest || tor_memeq(digest, conn->identity_digest, DIGEST_LEN))
-      connection_or_group_set_badness(conn, force);
+    connection_or_group_set_badness(conn, force);
   } DIGESTMAP_FOREACH_END;
 }
 
@@ -1015,14 +1102,8 @@ connection_or_connect(const tor_addr_t *_addr, uint16_t port,
 {
   or_connection_t *conn;
   const or_options_t *options = get_options();
-  int socket_error = 0;
   tor_addr_t addr;
 
-  int r;
-  tor_addr_t proxy_addr;
-  uint16_t proxy_port;
-  int proxy_type;
-
   tor_assert(_addr);
   tor_assert(id_digest);
   tor_addr_copy(&addr, _addr);
@@ -1041,6 +1122,43 @@ connection_or_connect(const tor_addr_t *_addr, uint16_t port,
 
   conn->is_outgoing = 1;
 
+  if (connection_or_should_defer_connect()) {
+    log_info(LD_OR, "Deferring connection to %s:%d: too many connections "
+             "in progress.", conn->_base.address, conn->_base.port);
+    if (!deferred_or_connects)
+      deferred_or_connects = smartlist_create();
+    smartlist_add(deferred_or_connects, conn);
+    conn->connect_deferred = 1;
+    connection_or_schedule_deferred_connects();
+    return conn;
+  }
+
+  if (connection_or_launch(conn) < 0) {
+    connection_free(TO_CONN(conn));
+    return NULL;
+  }
+  return conn;
+}
+
+/** Call connect() for the new outgoing OR connection <b>conn</b>, through
+ * our proxy if we have one.  Return 0 if the connect is in progress or
+ * done, and -1 if it failed and <b>conn</b> should be freed.  If the
+ * connect got as far as starting a TLS handshake and then failed, return
+ * 0: <b>conn</b> is already marked for close. */
+static int
+connection_or_launch(or_connection_t *conn)
+{
+  int socket_error = 0;
+  tor_addr_t addr;
+  uint16_t port = conn->_base.port;
+  int r;
+  tor_addr_t proxy_addr;
+  uint16_t proxy_port;
+  int proxy_type;
+
+  tor_addr_copy(&addr, &conn->_base.addr);
+  ++n_or_connects_this_second;
+
   /* If we are using a proxy server, find it and use it. */
   r = get_proxy_addrport(&proxy_addr, &proxy_port, &proxy_type, TO_CONN(conn));
   if (r == 0) {
@@ -1053,8 +1171,7 @@ connection_or_connect(const tor_addr_t *_addr, uint16_t port,
   } else {
     log_warn(LD_GENERAL, "Tried to connect through proxy, but proxy address "
              "could not be found.");
-    connection_free(TO_CONN(conn));
-    return NULL;
+    return -1;
   }
 
   switch (connection_connect(TO_CONN(conn), conn->_base.address,
@@ -1068,21 +1185,234 @@ connection_or_connect(const tor_addr_t *_addr, uint16_t port,
       connection_or_connect_failed(conn,
                                    errno_to_orconn_end_reason(socket_error),
                                    tor_socket_strerror(socket_error));
-      connection_free(TO_CONN(conn));
-      return NULL;
+      return -1;
     case 0:
       connection_watch_events(TO_CONN(conn), READ_EVENT | WRITE_EVENT);
       /* writable indicates finish, readable indicates broken link,
          error indicates broken link on windows */
-      return conn;
+      return 0;
     /* case 1: fall through */
   }
 
-  if (connection_or_finished_connecting(conn) < 0) {
-    /* already marked for close */
-    return NULL;
+  /* If this fails, conn is already marked for close. */
+  connection_or_finished_connecting(conn);
+  return 0;
+}
+
+/** Return the number of outgoing OR connections that we've launched, but
+ * that haven't finished their handshakes. */
+static int
+connection_or_count_connects_in_progress(void)
+{
+  int n = 0;
+  SMARTLIST_FOREACH(get_connection_array_by_type(CONN_TYPE_OR),
+                    connection_t *, conn,
+    if (!conn->marked_for_close && TO_OR_CONN(conn)->is_outgoing &&
+        conn->state != OR_CONN_STATE_OPEN)
+      ++n);
+  return n;
+}
+
+/** Return the number of outgoing OR connections we may launch right now
+ * without going over MaxConcurrentORConnects or MaxORConnectsPerSecond,
+ * or INT_MAX if there's no limit.  If <b>rate_limited_out</b> is
+ * provided, set it to true iff MaxORConnectsPerSecond is what's holding
+ * us back. */
+static int
+connection_or_get_connect_budget(int *rate_limited_out)
+{
+  const or_options_t *options = get_options();
+  time_t now = approx_time();
+  int budget = INT_MAX;
+
+  if (rate_limited_out)
+    *rate_limited_out = 0;
+  if (now != or_connects_second) {
+    or_connects_second = now;
+    n_or_connects_this_second = 0;
+  }
+
+  if (options->MaxORConnectsPerSecond) {
+    budget = options->MaxORConnectsPerSecond - n_or_connects_this_second;
+    if (budget <= 0 && rate_limited_out)
+      *rate_limited_out = 1;
+  }
+  if (options->MaxConcurrentORConnects && budget > 0) {
+    int slots = options->MaxConcurrentORConnects -
+      connection_or_count_connects_in_progress();
+    if (slots < budget)
+      budget = slots;
+  }
+  return budget > 0 ? budget : 0;
+}
+
+/** Return true iff we shouldn't call connect() for a new outgoing OR
+ * connection yet. */
+static int
+connection_or_should_defer_connect(void)
+{
+  const or_options_t *options = get_options();
+  if (!options->MaxConcurrentORConnects && !options->MaxORConnectsPerSecond)
+    return 0;
+  /* Don't jump ahead of connections that are already waiting. */
+  if (deferred_or_connects && smartlist_len(deferred_or_connects))
+    return 1;
+  return connection_or_get_connect_budget(NULL) == 0;
+}
+
+/** Return true iff some circuit that's waiting for the deferred connection
+ * <b>conn</b> has a user waiting on it: either it's a circuit we're
+ * extending for somebody else, or it's one of ours and
+ * <b>streams_waiting</b> says that streams are waiting for a circuit. */
+static int
+connection_or_deferred_connect_is_urgent(or_connection_t *conn,
+                                         int streams_waiting)
+{
+  smartlist_t *circs = smartlist_create();
+  int urgent = 0;
+  circuit_get_all_pending_on_or_conn(circs, conn);
+  SMARTLIST_FOREACH(circs, circuit_t *, circ,
+    if (!CIRCUIT_IS_ORIGIN(circ) || streams_waiting)
+      urgent = 1);
+  smartlist_free(circs);
+  return urgent;
+}
+
+/** Launch as many of the deferred outgoing OR connections as our limits
+ * allow, starting with the ones that users are waiting for.  Within each
+ * group, launch the oldest first. */
+static void
+connection_or_launch_deferred_connects(void)
+{
+  smartlist_t *to_launch;
+  int budget, rate_limited, streams_waiting = 0, pass;
+
+  if (!deferred_or_connects || !smartlist_len(deferred_or_connects))
+    return;
+  budget = connection_or_get_connect_budget(&rate_limited);
+  if (!budget) {
+    /* If we're waiting on connections in progress, we'll hear about it
+     * when they finish. */
+    if (rate_limited)
+      connection_or_schedule_deferred_connects();
+    return;
+  }
+
+  SMARTLIST_FOREACH(get_connection_array_by_type(CONN_TYPE_AP),
+                    connection_t *, conn,
+    if (!conn->marked_for_close &&
+        conn->state == AP_CONN_STATE_CIRCUIT_WAIT)
+      streams_waiting = 1);
+
+  /* Pick everything we're going to launch before launching any of it, so
+   * that nothing we call can change the list under us. */
+  to_launch = smartlist_create();
+  for (pass = 0; pass < 2 && smartlist_len(to_launch) < budget; ++pass) {
+    SMARTLIST_FOREACH_BEGIN(deferred_or_connects, or_connection_t *, conn) {
+      if (smartlist_len(to_launch) >= budget)
+        break;
+      if (conn->_base.marked_for_close || !conn->connect_deferred)
+        continue;
+      if (pass == 0 &&
+          !connection_or_deferred_connect_is_urgent(conn, streams_waiting))
+        continue;
+      conn->connect_deferred = 0;
+      smartlist_add(to_launch, conn);
+    } SMARTLIST_FOREACH_END(conn);
+  }
+  {
+    /* Keep the rest in order. */
+    smartlist_t *remaining = smartlist_create();
+    SMARTLIST_FOREACH(deferred_or_connects, or_connection_t *, conn,
+                      if (conn->connect_deferred)
+                        smartlist_add(remaining, conn));
+    smartlist_free(deferred_or_connects);
+    deferred_or_connects = remaining;
+  }
+
+  SMARTLIST_FOREACH_BEGIN(to_launch, or_connection_t *, conn) {
+    log_info(LD_OR, "Launching deferred connection to %s:%d.",
+             conn->_base.address, conn->_base.port);
+    if (connection_or_launch(conn) < 0)
+      connection_mark_for_close(TO_CONN(conn));
+  } SMARTLIST_FOREACH_END(conn);
+  smartlist_free(to_launch);
+
+  if (smartlist_len(deferred_or_connects))
+    connection_or_schedule_deferred_connects();
+}
+
+/** Libevent callback: launch what deferred OR connections we can. */
+static void
+deferred_or_connects_cb(evutil_socket_t fd, short events, void *arg)
+{
+  (void)fd;
+  (void)events;
+  (void)arg;
+  connection_or_launch_deferred_connects();
+}
+
+/** Arrange to launch deferred OR connections once we get back to the main
+ * loop: right away if our limits allow it, or else at the start of the
+ * next second. */
+void
+connection_or_schedule_deferred_connects(void)
+{
+  struct timeval timeout = { 0, 0 };
+  int rate_limited;
+  if (!deferred_or_connects || !smartlist_len(deferred_or_connects))
+    return;
+  if (!connection_or_get_connect_budget(&rate_limited)) {
+    if (!rate_limited)
+      return;
+    /* Wake up just after the second rolls over. */
+    tor_gettimeofday_cached(&timeout);
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 1000000 - timeout.tv_usec;
+  }
+  if (!deferred_or_connects_event)
+    deferred_or_connects_event = tor_evtimer_new(tor_libevent_get_base(),
+                                               deferred_or_connects_cb, NULL);
+  if (evtimer_add(deferred_or_connects_event, &timeout)<0) {
+    log_warn(LD_BUG, "Couldn't add timer for deferred OR connections");
+  }
+}
+
+/** Stop remembering that <b>conn</b> is waiting to be launched; we call
+ * this when <b>conn</b> is about to be freed. */
+void
+connection_or_forget_deferred_connect(or_connection_t *conn)
+{
+  int i;
+  if (!conn->connect_deferred)
+    return;
+  conn->connect_deferred = 0;
+  for (i = 0; i < smartlist_len(deferred_or_connects); ++i) {
+    if (smartlist_get(deferred_or_connects, i) == conn) {
+      smartlist_del_keeporder(deferred_or_connects, i);
+      break;
+    }
+  }
+}
+
+/** Free every deferred OR connection, and all other storage held for
+ * deferring OR connections. */
+void
+connection_or_deferred_connects_free_all(void)
+{
+  if (deferred_or_connects) {
+    SMARTLIST_FOREACH_BEGIN(deferred_or_connects, or_connection_t *, conn) {
+      conn->connect_deferred = 0;
+      if (!connection_is_on_closeable_list(TO_CONN(conn)))
+        connection_free(TO_CONN(conn));
+    } SMARTLIST_FOREACH_END(conn);
+    smartlist_free(deferred_or_connects);
+    deferred_or_connects = NULL;
+  }
+  if (deferred_or_connects_event) {
+    tor_event_free(deferred_or_connects_event);
+    deferred_or_connects_event = NULL;
   }
-  return conn;
 }
 
 /** Begin the tls handshake with <b>conn</b>. <b>receiving</b> is 0 if
@@ -1105,6 +1435,8 @@ connection_tls_start_handshake(or_connection_t *conn, int receiving)
   }
   tor_tls_set_logged_address(conn->tls, // XXX client and relay?
       escaped_safe_str(conn->_base.address));
+  if (!receiving && !tor_digest_is_zero(conn->identity_digest))
+    tor_tls_resume_session(conn->tls, conn->identity_digest);
 
 #ifdef USE_BUFFEREVENTS
   if (connection_type_uses_bufferevent(TO_CONN(conn))) {
@@ -1688,7 +2020,10 @@ connection_or_set_state_open(or_connection_t *conn)
   int started_here = connection_or_nonopen_was_started_here(conn);
   time_t now = time(NULL);
   conn->_base.state = OR_CONN_STATE_OPEN;
+  connection_or_clear_best_for_extend(conn);
   control_event_or_conn_status(conn, OR_CONN_EVENT_CONNECTED, 0);
+  if (conn->is_outgoing)
+    connection_or_schedule_deferred_connects();
 
   if (started_here) {
     circuit_build_times_network_is_live(&circ_times);
@@ -1706,6 +2041,9 @@ connection_or_set_state_open(or_connection_t *conn)
       return -1;
     }
     router_set_status(conn->identity_digest, 1);
+    /* The peer has proven its identity, so its session is worth keeping. */
+    if (conn->tls)
+      tor_tls_remember_session(conn->tls, conn->identity_digest);
   } else {
     /* only report it to the geoip module if it's not a known router */
     if (!router_get_by_id_digest(conn->identity_digest)) {
@@ -1730,6 +2068,45 @@ connection_or_set_state_open(or_connection_t *conn)
   return 0;
 }
 
+/** Add up the memory that OpenSSL holds for read and write buffers across
+ * all our OR connections.  Set *<b>rbuf_out</b> and *<b>wbuf_out</b> to
+ * the bytes allocated for read and write buffers, *<b>n_conns_out</b> to
+ * the number of OR connections with a TLS object, and
+ * *<b>n_holding_out</b> to how many of them currently hold a buffer.  (When
+ * OpenSSL supports SSL_MODE_RELEASE_BUFFERS, idle connections give their
+ * buffers back, so the last number should be much smaller than the one
+ * before it.) */
+void
+connection_or_get_tls_buffer_usage(size_t *rbuf_out, size_t *wbuf_out,
+                                   int *n_conns_out, int *n_holding_out)
+{
+  smartlist_t *conns = get_connection_array();
+  size_t rbuf_total = 0, wbuf_total = 0;
+  int n_conns = 0, n_holding = 0;
+
+  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, base_conn) {
+    size_t rbuf_cap, rbuf_len, wbuf_cap, wbuf_len;
+    or_connection_t *or_conn;
+    if (base_conn->type != CONN_TYPE_OR)
+      continue;
+    or_conn = TO_OR_CONN(base_conn);
+    if (!or_conn->tls)
+      continue;
+    tor_tls_get_buffer_sizes(or_conn->tls, &rbuf_cap, &rbuf_len,
+                             &wbuf_cap, &wbuf_len);
+    rbuf_total += rbuf_cap;
+    wbuf_total += wbuf_cap;
+    ++n_conns;
+    if (rbuf_cap || wbuf_cap)
+      ++n_holding;
+  } SMARTLIST_FOREACH_END(base_conn);
+
+  *rbuf_out = rbuf_total;
+  *wbuf_out = wbuf_total;
+  *n_conns_out = n_conns;
+  *n_holding_out = n_holding;
+}
+
 /** Pack <b>cell</b> into wire-format, and write it onto <b>conn</b>'s outbuf.
  * For cells that use or affect a circuit, this should only be called by
  * connection_or_flush_from_first_active_circuit().
@@ -1788,6 +2165,30 @@ connection_fetch_var_cell_from_buf(or_connection_t *or_conn, var_cell_t **out)
   }
 }
 
+/** See whether there's a whole fixed-length cell waiting on
+ * <b>or_conn</b>'s inbuf.  If so, unpack it into *<b>cell_out</b>, remove
+ * it from the inbuf, and return 1.  Otherwise return 0.
+ *
+ * When the cell lies entirely within one chunk of the inbuf, we unpack it
+ * straight from there rather than copying it out first. */
+static int
+connection_fetch_cell_from_buf(or_connection_t *or_conn, cell_t *cell_out)
+{
+  connection_t *conn = TO_CONN(or_conn);
+  char buf[CELL_NETWORK_SIZE];
+  if (connection_get_inbuf_len(conn) < CELL_NETWORK_SIZE)
+    return 0;
+  IF_HAS_BUFFEREVENT(conn, {
+    connection_fetch_from_buf(buf, CELL_NETWORK_SIZE, conn);
+    cell_unpack(cell_out, buf);
+  }) ELSE_IF_NO_BUFFEREVENT {
+    const char *cp = buf_peek_contiguous(conn->inbuf, CELL_NETWORK_SIZE, buf);
+    cell_unpack(cell_out, cp);
+    buf_drain(conn->inbuf, CELL_NETWORK_SIZE);
+  }
+  return 1;
+}
+
 /** Process cells from <b>conn</b>'s inbuf.
  *
  * Loop: while inbuf contains a cell, pull it off the inbuf, unpack it,
@@ -1812,20 +2213,16 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
       command_process_var_cell(var_cell, conn);
       var_cell_free(var_cell);
     } else {
-      char buf[CELL_NETWORK_SIZE];
       cell_t cell;
-      if (connection_get_inbuf_len(TO_CONN(conn))
-          < CELL_NETWORK_SIZE) /* whole response available? */
+      /* retrieve cell info from the inbuf (create the host-order struct from
+       * the network-order string) */
+      if (!connection_fetch_cell_from_buf(conn, &cell))
         return 0; /* not yet */
 
       circuit_build_times_network_is_live(&circ_times);
-      connection_fetch_from_buf(buf, CELL_NETWORK_SIZE, TO_CONN(conn));
-
-      /* retrieve cell info from buf (create the host-order struct from the
-       * network-order string) */
-      cell_unpack(&cell, buf);
-
+      cell_trace_note_read(&cell);
       command_process_cell(&cell, conn);
+      cell_trace_done_processing();
     }
   }
 }
@@ -12,8 +12,17 @@
 #ifndef _TOR_CONNECTION_OR_H
 #define _TOR_CONNECTION_OR_H
 
+/** When adding cells to an OR connection's outbuf, keep adding until the
+ * outbuf is at least this long, or we run out of cells. */
+#define OR_CONN_HIGHWATER (32*1024)
+
+/** Add cells to an OR connection's outbuf whenever the outbuf's data length
+ * drops below this size. */
+#define OR_CONN_LOWWATER (16*1024)
+
 void connection_or_remove_from_identity_map(or_connection_t *conn);
 void connection_or_clear_identity_map(void);
+void connection_or_clear_best_for_extend(const or_connection_t *conn);
 void clear_broken_connection_map(int disable);
 or_connection_t *connection_or_get_for_extend(const char *digest,
                                               const tor_addr_t *target_addr,
@@ -31,6 +40,9 @@ int connection_or_digest_is_known_relay(const char *id_digest);
 void connection_or_update_token_buckets(smartlist_t *conns,
                                         const or_options_t *options);
 
+void connection_or_schedule_deferred_connects(void);
+void connection_or_forget_deferred_connect(or_connection_t *conn);
+void connection_or_deferred_connects_free_all(void);
 void connection_or_connect_failed(or_connection_t *conn,
                                   int reason, const char *msg);
 or_connection_t *connection_or_connect(const tor_addr_t *addr, uint16_t port,
@@ -61,6 +73,8 @@ void or_handshake_state_record_var_cell(or_handshake_state_t *state,
                                         int incoming);
 
 int connection_or_set_state_open(or_connection_t *conn);
+void connection_or_get_tls_buffer_usage(size_t *rbuf_out, size_t *wbuf_out,
+                                        int *n_conns_out, int *n_holding_out);
 void connection_or_write_cell_to_buf(const cell_t *cell,
                                      or_connection_t *conn);
 void connection_or_write_var_cell_to_buf(const var_cell_t *cell,
@@ -0,0 +1,438 @@
+/* Copyright (c) 2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file consdiff.c
+ * \brief Generate and apply diffs between consensus documents, so that a
+ * client holding a recent consensus can fetch just what changed since then.
+ *
+ * A diff looks like this:
+ * <pre>
+ *   network-status-diff-version 1
+ *   hash <base digest> <target digest>
+ *   <ed-style commands>
+ * </pre>
+ * The digests are the hex SHA256 digests of the signed part of each
+ * consensus, as stored in networkstatus_t.digests.  The commands are "Nd"
+ * or "N,Md" to delete lines, "Nc" or "N,Mc" to replace them, and "Na" to
+ * add lines after line N; the latter two are followed by the new lines and
+ * a line holding a single ".".  Line numbers refer to the base document
+ * with its signatures cut off, and the commands run from the end of the
+ * document backwards, so each can be applied without renumbering the rest.
+ *
+ * Router entries in a consensus are sorted by identity, so rather than
+ * comparing whole documents we line up the "r" lines of routers that
+ * appear in both, and only search for a longest common subsequence within
+ * the short stretches between them.
+ **/
+
+#include "or.h"
+#include "consdiff.h"
+#include "routerparse.h"
+
+/** First line of every consensus diff. */
+#define CONSDIFF_HEADER "network-status-diff-version 1"
+
+/** If a stretch of changed lines would need an LCS table bigger than this
+ * many cells, just replace the whole stretch. */
+#define CONSDIFF_MAX_LCS_CELLS (1<<20)
+
+/** One run of changed lines: base lines [base_start, base_end) become
+ * target lines [target_start, target_end). */
+typedef struct consdiff_hunk_t {
+  int base_start;
+  int base_end;
+  int target_start;
+  int target_end;
+} consdiff_hunk_t;
+
+/** Split <b>s</b> into a newly allocated list of newly allocated lines.  If
+ * <b>unsigned_only</b>, stop before the first signature. */
+static smartlist_t *
+consdiff_split_lines(const char *s, int unsigned_only)
+{
+  smartlist_t *lines = smartlist_create();
+  int i;
+  smartlist_split_string(lines, s, "\n", 0, 0);
+  /* A final newline doesn't start another line. */
+  if (smartlist_len(lines) && !*(char*)smartlist_get(lines,
+                                                smartlist_len(lines)-1)) {
+    tor_free(lines->list[smartlist_len(lines)-1]);
+    smartlist_del(lines, smartlist_len(lines)-1);
+  }
+  if (unsigned_only) {
+    for (i = 0; i < smartlist_len(lines); ++i) {
+      if (!strcmpstart(smartlist_get(lines, i), "directory-signature "))
+        break;
+    }
+    while (smartlist_len(lines) > i) {
+      tor_free(lines->list[smartlist_len(lines)-1]);
+      smartlist_del(lines, smartlist_len(lines)-1);
+    }
+  }
+  return lines;
+}
+
+/** Free a list of lines as returned by consdiff_split_lines(). */
+static void
+consdiff_free_lines(smartlist_t *lines)
+{
+  if (!lines)
+    return;
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+}
+
+/** If <b>line</b> begins a router entry, return a newly allocated copy of
+ * its identity field.  Otherwise return NULL. */
+static char *
+consdiff_router_key(const char *line)
+{
+  const char *cp, *end;
+  if (strcmpstart(line, "r "))
+    return NULL;
+  cp = eat_whitespace(find_whitespace(eat_whitespace(line+2)));
+  end = find_whitespace(cp);
+  if (end == cp)
+    return NULL;
+  return tor_strndup(cp, end-cp);
+}
+
+/** Add a hunk turning base lines [<b>b0</b>, <b>b1</b>) into target lines
+ * [<b>t0</b>, <b>t1</b>) to <b>hunks</b>, merging it with the previous hunk
+ * if they touch. */
+static void
+consdiff_add_hunk(smartlist_t *hunks, int b0, int b1, int t0, int t1)
+{
+  consdiff_hunk_t *h;
+  if (b0 == b1 && t0 == t1)
+    return;
+  if (smartlist_len(hunks)) {
+    h = smartlist_get(hunks, smartlist_len(hunks)-1);
+    if (h->base_end == b0 && h->target_end == t0) {
+      h->base_end = b1;
+      h->target_end = t1;
+      return;
+    }
+  }
+  h = tor_malloc(sizeof(consdiff_hunk_t));
+  h->base_start = b0;
+  h->base_end = b1;
+  h->target_start = t0;
+  h->target_end = t1;
+  smartlist_add(hunks, h);
+}
+
+/** Append to <b>hunks</b> the changes that turn lines [<b>b0</b>,
+ * <b>b1</b>) of <b>base</b> into lines [<b>t0</b>, <b>t1</b>) of
+ * <b>target</b>. */
+static void
+consdiff_diff_range(const smartlist_t *base, int b0, int b1,
+                    const smartlist_t *target, int t0, int t1,
+                    smartlist_t *hunks)
+{
+  int n, m, i, j;
+  int *lcs;
+  /* Most stretches are unchanged or change a line or two: trim off
+   * whatever matches at either end first. */
+  while (b0 < b1 && t0 < t1 &&
+         !strcmp(smartlist_get(base, b0), smartlist_get(target, t0))) {
+    ++b0;
+    ++t0;
+  }
+  while (b0 < b1 && t0 < t1 &&
+         !strcmp(smartlist_get(base, b1-1), smartlist_get(target, t1-1))) {
+    --b1;
+    --t1;
+  }
+  n = b1 - b0;
+  m = t1 - t0;
+  if (!n || !m || (uint64_t)(n+1)*(m+1) > CONSDIFF_MAX_LCS_CELLS) {
+    consdiff_add_hunk(hunks, b0, b1, t0, t1);
+    return;
+  }
+
+#define LINES_EQ(i,j) \
+  (!strcmp(smartlist_get(base, b0+(i)), smartlist_get(target, t0+(j))))
+#define LCS(i,j) lcs[(i)*(m+1)+(j)]
+  lcs = tor_malloc(sizeof(int)*(n+1)*(m+1));
+  for (i = n; i >= 0; --i) {
+    for (j = m; j >= 0; --j) {
+      if (i == n || j == m)
+        LCS(i,j) = 0;
+      else if (LINES_EQ(i,j))
+        LCS(i,j) = LCS(i+1,j+1) + 1;
+      else
+        LCS(i,j) = MAX(LCS(i+1,j), LCS(i,j+1));
+    }
+  }
+  i = j = 0;
+  while (i < n || j < m) {
+    int hi = i, hj = j;
+    while ((i < n || j < m) && !(i < n && j < m && LINES_EQ(i,j))) {
+      if (j == m || (i < n && LCS(i+1,j) >= LCS(i,j+1)))
+        ++i;
+      else
+        ++j;
+    }
+    consdiff_add_hunk(hunks, b0+hi, b0+i, t0+hj, t0+j);
+    while (i < n && j < m && LINES_EQ(i,j)) {
+      ++i;
+      ++j;
+    }
+  }
+#undef LCS
+#undef LINES_EQ
+  tor_free(lcs);
+}
+
+/** Append to <b>out</b> a newly allocated ed-style range for the 1-based
+ * lines <b>first</b> through <b>last</b>, followed by <b>cmd</b>. */
+static void
+consdiff_add_range(smartlist_t *out, int first, int last, char cmd)
+{
+  char *cp;
+  if (first == last)
+    tor_asprintf(&cp, "%d%c", first, cmd);
+  else
+    tor_asprintf(&cp, "%d,%d%c", first, last, cmd);
+  smartlist_add(out, cp);
+}
+
+/** Return a newly allocated diff that turns the consensus <b>base</b> into
+ * the consensus <b>target</b>, or NULL if we can't make one. */
+char *
+consdiff_gen_diff(const char *base, const char *target)
+{
+  digests_t base_digests, target_digests;
+  smartlist_t *base_lines = NULL, *target_lines = NULL;
+  smartlist_t *hunks = NULL, *out = NULL;
+  strmap_t *base_routers = NULL;
+  char base_hex[HEX_DIGEST256_LEN+1], target_hex[HEX_DIGEST256_LEN+1];
+  char *cp, *result = NULL;
+  int prev_b = 0, prev_t = 0, i;
+
+  if (router_get_networkstatus_v3_hashes(base, &base_digests) < 0 ||
+      router_get_networkstatus_v3_hashes(target, &target_digests) < 0)
+    return NULL;
+
+  /* Only the signed part of the base matters; the target's signatures are
+   * just more lines to add. */
+  base_lines = consdiff_split_lines(base, 1);
+  target_lines = consdiff_split_lines(target, 0);
+  hunks = smartlist_create();
+  out = smartlist_create();
+
+  base_routers = strmap_new();
+  SMARTLIST_FOREACH_BEGIN(base_lines, const char *, line) {
+    char *key = consdiff_router_key(line);
+    if (key) {
+      strmap_set(base_routers, key, (void*)(intptr_t)(line_sl_idx+1));
+      tor_free(key);
+    }
+  } SMARTLIST_FOREACH_END(line);
+
+  /* Each router present in both documents starts a stretch that we can
+   * diff on its own. */
+  SMARTLIST_FOREACH_BEGIN(target_lines, const char *, line) {
+    char *key = consdiff_router_key(line);
+    int b;
+    if (!key)
+      continue;
+    b = (int)(intptr_t)strmap_get(base_routers, key) - 1;
+    tor_free(key);
+    if (b <= prev_b || line_sl_idx <= prev_t)
+      continue;
+    consdiff_diff_range(base_lines, prev_b, b, target_lines, prev_t,
+                        line_sl_idx, hunks);
+    prev_b = b;
+    prev_t = line_sl_idx;
+  } SMARTLIST_FOREACH_END(line);
+  consdiff_diff_range(base_lines, prev_b, smartlist_len(base_lines),
+                      target_lines, prev_t, smartlist_len(target_lines),
+                      hunks);
+
+  smartlist_add(out, tor_strdup(CONSDIFF_HEADER));
+  base16_encode(base_hex, sizeof(base_hex),
+                base_digests.d[DIGEST_SHA256], DIGEST256_LEN);
+  base16_encode(target_hex, sizeof(target_hex),
+                target_digests.d[DIGEST_SHA256], DIGEST256_LEN);
+  tor_asprintf(&cp, "hash %s %s", base_hex, target_hex);
+  smartlist_add(out, cp);
+
+  for (i = smartlist_len(hunks)-1; i >= 0; --i) {
+    consdiff_hunk_t *h = smartlist_get(hunks, i);
+    int j;
+    if (h->target_start == h->target_end) {
+      consdiff_add_range(out, h->base_start+1, h->base_end, 'd');
+      continue;
+    } else if (h->base_start == h->base_end) {
+      tor_asprintf(&cp, "%da", h->base_start);
+      smartlist_add(out, cp);
+    } else {
+      consdiff_add_range(out, h->base_start+1, h->base_end, 'c');
+    }
+    for (j = h->target_start; j < h->target_end; ++j) {
+      const char *line = smartlist_get(target_lines, j);
+      if (!strcmp(line, "."))
+        goto done; /* We can't express this line. */
+      smartlist_add(out, tor_strdup(line));
+    }
+    smartlist_add(out, tor_strdup("."));
+  }
+
+  result = smartlist_join_strings(out, "\n", 1, NULL);
+
+ done:
+  consdiff_free_lines(base_lines);
+  consdiff_free_lines(target_lines);
+  SMARTLIST_FOREACH(hunks, consdiff_hunk_t *, h, tor_free(h));
+  smartlist_free(hunks);
+  SMARTLIST_FOREACH(out, char *, s, tor_free(s));
+  smartlist_free(out);
+  strmap_free(base_routers, NULL);
+  return result;
+}
+
+/** Parse the "hash" line of a diff into <b>base_out</b> and
+ * <b>target_out</b>.  Return 0 on success, -1 on failure. */
+static int
+consdiff_parse_hash_line(const char *line, char *base_out,
+                         char *target_out)
+{
+  if (strcmpstart(line, "hash ") ||
+      strlen(line) != strlen("hash ")+2*HEX_DIGEST256_LEN+1 ||
+      line[strlen("hash ")+HEX_DIGEST256_LEN] != ' ')
+    return -1;
+  line += strlen("hash ");
+  if (base16_decode(base_out, DIGEST256_LEN, line, HEX_DIGEST256_LEN) < 0 ||
+      base16_decode(target_out, DIGEST256_LEN, line+HEX_DIGEST256_LEN+1,
+                    HEX_DIGEST256_LEN) < 0)
+    return -1;
+  return 0;
+}
+
+/** Apply <b>diff</b> to the consensus <b>base</b>.  Return the resulting
+ * consensus as a newly allocated string, or NULL if the diff is malformed,
+ * is for some other consensus, or doesn't produce the one it promised. */
+char *
+consdiff_apply_diff(const char *base, const char *diff)
+{
+  smartlist_t *diff_lines = NULL, *base_lines = NULL;
+  smartlist_t *hunks = NULL, *pieces = NULL;
+  char base_digest[DIGEST256_LEN], target_digest[DIGEST256_LEN];
+  digests_t digests;
+  char *result = NULL;
+  int i, n_diff, limit, pos;
+
+  diff_lines = consdiff_split_lines(diff, 0);
+  n_diff = smartlist_len(diff_lines);
+  if (n_diff < 2 || strcmp(smartlist_get(diff_lines, 0), CONSDIFF_HEADER) ||
+      consdiff_parse_hash_line(smartlist_get(diff_lines, 1),
+                               base_digest, target_digest) < 0) {
+    log_info(LD_DIR, "Malformed consensus diff header.");
+    goto done;
+  }
+  if (router_get_networkstatus_v3_hashes(base, &digests) < 0 ||
+      tor_memneq(digests.d[DIGEST_SHA256], base_digest, DIGEST256_LEN)) {
+    log_info(LD_DIR, "Consensus diff is not for the consensus we have.");
+    goto done;
+  }
+
+  base_lines = consdiff_split_lines(base, 1);
+  hunks = smartlist_create();
+  limit = smartlist_len(base_lines) + 1;
+  i = 2;
+  while (i < n_diff) {
+    const char *line = smartlist_get(diff_lines, i++);
+    char *next;
+    int ok, first, last;
+    consdiff_hunk_t *h;
+    first = last = (int)tor_parse_long(line, 10, 0, INT_MAX, &ok, &next);
+    if (ok && *next == ',')
+      last = (int)tor_parse_long(next+1, 10, 0, INT_MAX, &ok, &next);
+    if (!ok || !*next || next[1]) {
+      log_info(LD_DIR, "Malformed consensus diff command %s",
+               escaped(line));
+      goto done;
+    }
+    /* Commands must run backwards through the document without
+     * overlapping. */
+    if (*next == 'a') {
+      if (first != last || first >= limit)
+        goto bad_range;
+    } else if (*next == 'c' || *next == 'd') {
+      if (first < 1 || first > last || last >= limit)
+        goto bad_range;
+    } else {
+      log_info(LD_DIR, "Unrecognized consensus diff command %s",
+               escaped(line));
+      goto done;
+    }
+    h = tor_malloc_zero(sizeof(consdiff_hunk_t));
+    smartlist_add(hunks, h);
+    if (*next == 'a') {
+      h->base_start = h->base_end = first;
+      limit = first;
+    } else {
+      h->base_start = first - 1;
+      h->base_end = last;
+      limit = first;
+    }
+    if (*next == 'd')
+      continue;
+    h->target_start = i;
+    while (i < n_diff && strcmp(smartlist_get(diff_lines, i), "."))
+      ++i;
+    if (i == n_diff) {
+      log_info(LD_DIR, "Unterminated consensus diff command %s",
+               escaped(line));
+      goto done;
+    }
+    h->target_end = i++;
+  }
+
+  pieces = smartlist_create();
+  pos = 0;
+  for (i = smartlist_len(hunks)-1; i >= 0; --i) {
+    consdiff_hunk_t *h = smartlist_get(hunks, i);
+    int j;
+    for (j = pos; j < h->base_start; ++j)
+      smartlist_add(pieces, smartlist_get(base_lines, j));
+    for (j = h->target_start; j < h->target_end; ++j)
+      smartlist_add(pieces, smartlist_get(diff_lines, j));
+    pos = h->base_end;
+  }
+  for (i = pos; i < smartlist_len(base_lines); ++i)
+    smartlist_add(pieces, smartlist_get(base_lines, i));
+  result = smartlist_join_strings(pieces, "\n", 1, NULL);
+
+  if (router_get_networkstatus_v3_hashes(result, &digests) < 0 ||
+      tor_memneq(digests.d[DIGEST_SHA256], target_digest, DIGEST256_LEN)) {
+    log_info(LD_DIR, "Consensus diff didn't produce the consensus it "
+             "promised.");
+    tor_free(result);
+  }
+  goto done;
+
+ bad_range:
+  log_info(LD_DIR, "Out-of-order or out-of-range consensus diff command.");
+ done:
+  consdiff_free_lines(diff_lines);
+  consdiff_free_lines(base_lines);
+  if (hunks) {
+    SMARTLIST_FOREACH(hunks, consdiff_hunk_t *, h, tor_free(h));
+    smartlist_free(hunks);
+  }
+  smartlist_free(pieces);
+  return result;
+}
+
+/** Return true iff <b>body</b> looks like a consensus diff rather than a
+ * consensus. */
+int
+consdiff_is_diff(const char *body)
+{
+  return !strcmpstart(body, CONSDIFF_HEADER "\n");
+}
+
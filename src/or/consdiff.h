@@ -0,0 +1,17 @@
+/* Copyright (c) 2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file consdiff.h
+ * \brief Header file for consdiff.c.
+ **/
+
+#ifndef _TOR_CONSDIFF_H
+#define _TOR_CONSDIFF_H
+
+char *consdiff_gen_diff(const char *base, const char *target);
+char *consdiff_apply_diff(const char *base, const char *diff);
+int consdiff_is_diff(const char *body);
+
+#endif
+
@@ -12,6 +12,7 @@
 
 #include "or.h"
 #include "buffers.h"
+#include "celltrace.h"
 #include "circuitbuild.h"
 #include "circuitlist.h"
 #include "circuituse.h"
@@ -20,16 +21,21 @@
 #include "connection_edge.h"
 #include "connection_or.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
+#include "dns.h"
 #include "dnsserv.h"
 #include "geoip.h"
 #include "hibernate.h"
 #include "main.h"
+#include "memarea.h"
 #include "networkstatus.h"
 #include "nodelist.h"
 #include "policies.h"
 #include "reasons.h"
+#include "relay.h"
+#include "rephist.h"
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
@@ -41,6 +47,12 @@
 
 #include "procmon.h"
 
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
 /** Yield true iff <b>s</b> is the state of a control_connection_t that has
  * finished authentication and is accepting commands. */
 #define STATE_IS_OPEN(s) ((s) == CONTROL_CONN_STATE_OPEN)
@@ -51,7 +63,7 @@
  */
 #define _EVENT_MIN             0x0001
 #define EVENT_CIRCUIT_STATUS   0x0001
-#define EVENT_STREAM_STATUS    0x0002
+// #define EVENT_STREAM_STATUS    0x0002
 #define EVENT_OR_CONN_STATUS   0x0003
 #define EVENT_BANDWIDTH_USED   0x0004
 #define EVENT_LOG_OBSOLETE     0x0005 /* Can reclaim this. */
@@ -75,7 +87,8 @@
 #define EVENT_BUILDTIMEOUT_SET     0x0017
 #define EVENT_SIGNAL           0x0018
 #define EVENT_CONF_CHANGED     0x0019
-#define _EVENT_MAX             0x0019
+#define EVENT_CIRC_BANDWIDTH_USED     0x001A
+#define _EVENT_MAX             0x001A
 /* If _EVENT_MAX ever hits 0x0020, we need to make the mask wider. */
 
 /** Bitfield: The bit 1&lt;&lt;e is set if <b>any</b> open control
@@ -237,7 +250,20 @@ control_update_global_event_mask(void)
    * we want to hear...*/
   control_adjust_event_log_severity();
 
-  /* ...then, if we've started logging stream bw, clear the appropriate
+  /* ...then, if we've started logging circuit bw, start counting from
+   * now... */
+  if (!(old_mask & (1<<EVENT_CIRC_BANDWIDTH_USED)) &&
+      (new_mask & (1<<EVENT_CIRC_BANDWIDTH_USED))) {
+    circuit_t *circ;
+    for (circ = _circuit_get_global_list(); circ; circ = circ->next) {
+      if (CIRCUIT_IS_ORIGIN(circ)) {
+        origin_circuit_t *ocirc = TO_ORIGIN_CIRCUIT(circ);
+        ocirc->n_read_circ_bw = ocirc->n_written_circ_bw = 0;
+      }
+    }
+  }
+
+  /* ...and if we've started logging stream bw, clear the appropriate
    * fields. */
   if (! (old_mask & EVENT_STREAM_BANDWIDTH_USED) &&
       (new_mask & EVENT_STREAM_BANDWIDTH_USED)) {
@@ -308,15 +334,12 @@ connection_write_str_to_buf(const char *s, control_connection_t *conn)
   connection_write_to_buf(s, len, TO_CONN(conn));
 }
 
-/** Given a <b>len</b>-character string in <b>data</b>, made of lines
- * terminated by CRLF, allocate a new string in *<b>out</b>, and copy the
- * contents of <b>data</b> into *<b>out</b>, adding a period before any period
- * that appears at the start of a line, and adding a period-CRLF line at
- * the end. Replace all LF characters sequences with CRLF.  Return the number
- * of bytes in *<b>out</b>.
- */
-/* static */ size_t
-write_escaped_data(const char *data, size_t len, char **out)
+/** Helper for write_escaped_data: as write_escaped_data, but only add the
+ * final period-CRLF line if <b>add_terminator</b> is true.  Without it, the
+ * output is one piece of a longer escaped answer. */
+static size_t
+write_escaped_data_impl(const char *data, size_t len, char **out,
+                        int add_terminator)
 {
   size_t sz_out = len+8;
   char *outp;
@@ -349,14 +372,29 @@ write_escaped_data(const char *data, size_t len, char **out)
     *outp++ = '\r';
     *outp++ = '\n';
   }
-  *outp++ = '.';
-  *outp++ = '\r';
-  *outp++ = '\n';
+  if (add_terminator) {
+    *outp++ = '.';
+    *outp++ = '\r';
+    *outp++ = '\n';
+  }
   *outp = '\0'; /* NUL-terminate just in case. */
   tor_assert((outp - *out) <= (int)sz_out);
   return outp - *out;
 }
 
+/** Given a <b>len</b>-character string in <b>data</b>, made of lines
+ * terminated by CRLF, allocate a new string in *<b>out</b>, and copy the
+ * contents of <b>data</b> into *<b>out</b>, adding a period before any period
+ * that appears at the start of a line, and adding a period-CRLF line at
+ * the end. Replace all LF characters sequences with CRLF.  Return the number
+ * of bytes in *<b>out</b>.
+ */
+/* static */ size_t
+write_escaped_data(const char *data, size_t len, char **out)
+{
+  return write_escaped_data_impl(data, len, out, 1);
+}
+
 /** Given a <b>len</b>-character string in <b>data</b>, made of lines
  * terminated by CRLF, allocate a new string in *<b>out</b>, and copy
  * the contents of <b>data</b> into *<b>out</b>, removing any period
@@ -566,8 +604,187 @@ send_control_done(control_connection_t *conn)
   connection_write_str_to_buf("250 OK\r\n", conn);
 }
 
+/** How long do we hold queued events before writing them to controllers,
+ * in msec? */
+#define CONTROL_EVENT_FLUSH_MSEC 10
+/** If this many events are queued, write them out without waiting for the
+ * flush timer. */
+#define CONTROL_EVENT_QUEUE_MAX 1024
+/** If a controller has this many bytes waiting on its outbuf, it isn't
+ * keeping up: drop its events rather than buffering them without limit. */
+#define CONTROL_EVENT_MAX_OUTBUF (16*1024*1024)
+
+/** An event that we've formatted once, and will deliver to every
+ * controller listening for it the next time we flush the event queue. */
+typedef struct queued_event_t {
+  uint16_t event; /**< Which event is this? */
+  unsigned int is_err:1; /**< True iff this event reports an error. */
+  char *msg; /**< The formatted event, ready to be written. */
+} queued_event_t;
+
+/** List of queued_event_t, in the order in which they were generated. */
+static smartlist_t *queued_control_events = NULL;
+/** Timer to write out queued_control_events. */
+static struct event *flush_control_events_event = NULL;
+/** True iff flush_control_events_event is pending. */
+static int flush_control_events_scheduled = 0;
+/** Timer to go back to the commands that controllers sent while we were
+ * spooling answers to them. */
+static struct event *resume_control_conns_event = NULL;
+/** How many events have we dropped on all control connections because
+ * their controllers weren't reading fast enough? */
+static uint64_t n_control_events_dropped = 0;
+
+static void flush_queued_control_events(void);
+
+/** Free all storage held by the queued event <b>qe</b>. */
+static void
+queued_event_free(queued_event_t *qe)
+{
+  if (!qe)
+    return;
+  tor_free(qe->msg);
+  tor_free(qe);
+}
+
+/** Libevent callback: write out the events we've queued. */
+static void
+flush_control_events_cb(evutil_socket_t fd, short events, void *arg)
+{
+  (void)fd;
+  (void)events;
+  (void)arg;
+  flush_control_events_scheduled = 0;
+  flush_queued_control_events();
+}
+
+/** Append to <b>out</b> the queued events in <b>batch</b> that are
+ * selected by <b>mask</b>.  Return the number of events added. */
+static int
+batch_events_for_mask(smartlist_t *out, const smartlist_t *batch,
+                      event_mask_t mask)
+{
+  int n = 0;
+  SMARTLIST_FOREACH(batch, queued_event_t *, qe,
+    if (mask & (1<<qe->event)) {
+      smartlist_add(out, qe->msg);
+      ++n;
+    });
+  return n;
+}
+
+/** Write every queued event to every open controller that is listening for
+ * it.  All the events for a controller go onto its outbuf in one write;
+ * controllers with the same interest in this batch share one copy of the
+ * joined text.  Controllers that have fallen too far behind lose their
+ * events instead. */
+static void
+flush_queued_control_events(void)
+{
+  smartlist_t *batch, *conns, *texts;
+  event_mask_t batch_mask = 0;
+  /* Parallel arrays: a mask and the text we built for it. */
+#define N_JOINED_BATCHES 8
+  event_mask_t masks[N_JOINED_BATCHES];
+  char *joined[N_JOINED_BATCHES];
+  size_t joined_len[N_JOINED_BATCHES];
+  int n_joined = 0, any_err = 0, i;
+
+  if (!queued_control_events || !smartlist_len(queued_control_events))
+    return;
+
+  /* Take the queue, so that anything we log while flushing lands in a
+   * fresh batch. */
+  batch = queued_control_events;
+  queued_control_events = smartlist_create();
+  SMARTLIST_FOREACH(batch, queued_event_t *, qe, {
+    batch_mask |= (1<<qe->event);
+    any_err |= qe->is_err;
+  });
+
+  conns = get_connection_array();
+  texts = smartlist_create();
+  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
+    control_connection_t *control_conn;
+    event_mask_t mask;
+    const char *text = NULL;
+    size_t text_len = 0;
+    if (conn->type != CONN_TYPE_CONTROL || conn->marked_for_close ||
+        conn->state != CONTROL_CONN_STATE_OPEN)
+      continue;
+    control_conn = TO_CONTROL_CONN(conn);
+    mask = control_conn->event_mask & batch_mask;
+    if (!mask)
+      continue;
+
+    for (i = 0; i < n_joined; ++i) {
+      if (masks[i] == mask) {
+        text = joined[i];
+        text_len = joined_len[i];
+        break;
+      }
+    }
+    if (connection_get_outbuf_len(conn) + control_conn->held_events_len >
+        CONTROL_EVENT_MAX_OUTBUF) {
+      int n = batch_events_for_mask(texts, batch, mask);
+      smartlist_clear(texts);
+      if (!control_conn->n_events_dropped)
+        log_notice(LD_CONTROL, "Controller on connection %d isn't reading "
+                   "its events; dropping them until it catches up.",
+                   (int)conn->s);
+      control_conn->n_events_dropped += n;
+      n_control_events_dropped += n;
+      continue;
+    }
+    if (!text) {
+      char *s;
+      batch_events_for_mask(texts, batch, mask);
+      s = smartlist_join_strings(texts, "", 0, &text_len);
+      smartlist_clear(texts);
+      if (n_joined == N_JOINED_BATCHES) {
+        /* Rare: too many distinct interests to cache them all. */
+        --n_joined;
+        tor_free(joined[n_joined]);
+      }
+      masks[n_joined] = mask;
+      joined[n_joined] = s;
+      joined_len[n_joined] = text_len;
+      ++n_joined;
+      text = s;
+    }
+    if (control_conn->getinfo_spool_src != CONTROL_SPOOL_NONE) {
+      /* Don't break up a GETINFO answer we're spooling: send these events
+       * once it's done. */
+      if (!control_conn->held_events)
+        control_conn->held_events = smartlist_create();
+      smartlist_add(control_conn->held_events, tor_strndup(text, text_len));
+      control_conn->held_events_len += text_len;
+      continue;
+    }
+    connection_write_to_buf(text, text_len, conn);
+    if (any_err) {
+      SMARTLIST_FOREACH(batch, queued_event_t *, qe,
+        if (qe->is_err && (mask & (1<<qe->event))) {
+          connection_flush(conn);
+          break;
+        });
+    }
+  } SMARTLIST_FOREACH_END(conn);
+
+  for (i = 0; i < n_joined; ++i)
+    tor_free(joined[i]);
+  smartlist_free(texts);
+  SMARTLIST_FOREACH(batch, queued_event_t *, qe, queued_event_free(qe));
+  smartlist_free(batch);
+}
+
 /** Send an event to all v1 controllers that are listening for code
- * <b>event</b>.  The event's body is given by <b>msg</b>.
+ * <b>event</b>.  The event's body is given by <b>msg</b>, which we take
+ * ownership of.
+ *
+ * We don't write the event right away: it joins a queue that we write out
+ * every CONTROL_EVENT_FLUSH_MSEC, or as soon as it gets long.  Errors are
+ * written out, and flushed, immediately.
  *
  * If <b>which</b> & SHORT_NAMES, the event contains short-format names: send
  * it to controllers that haven't enabled the VERBOSE_NAMES feature.  If
@@ -577,35 +794,60 @@ send_control_done(control_connection_t *conn)
  * The EXTENDED_FORMAT and NONEXTENDED_FORMAT flags behave similarly with
  * respect to the EXTENDED_EVENTS feature. */
 static void
-send_control_event_string(uint16_t event, event_format_t which,
-                          const char *msg)
+queue_control_event_string(uint16_t event, event_format_t which, char *msg)
 {
-  smartlist_t *conns = get_connection_array();
+  queued_event_t *qe;
   (void)which;
   tor_assert(event >= _EVENT_MIN && event <= _EVENT_MAX);
 
-  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
-    if (conn->type == CONN_TYPE_CONTROL &&
-        !conn->marked_for_close &&
-        conn->state == CONTROL_CONN_STATE_OPEN) {
-      control_connection_t *control_conn = TO_CONTROL_CONN(conn);
-
-      if (control_conn->event_mask & (1<<event)) {
-        int is_err = 0;
-        connection_write_to_buf(msg, strlen(msg), TO_CONN(control_conn));
-        if (event == EVENT_ERR_MSG)
-          is_err = 1;
-        else if (event == EVENT_STATUS_GENERAL)
-          is_err = !strcmpstart(msg, "STATUS_GENERAL ERR ");
-        else if (event == EVENT_STATUS_CLIENT)
-          is_err = !strcmpstart(msg, "STATUS_CLIENT ERR ");
-        else if (event == EVENT_STATUS_SERVER)
-          is_err = !strcmpstart(msg, "STATUS_SERVER ERR ");
-        if (is_err)
-          connection_flush(TO_CONN(control_conn));
-      }
+  qe = tor_malloc_zero(sizeof(queued_event_t));
+  qe->event = event;
+  qe->msg = msg;
+  if (event == EVENT_ERR_MSG)
+    qe->is_err = 1;
+  else if (event == EVENT_STATUS_GENERAL)
+    qe->is_err = !strcmpstart(msg, "STATUS_GENERAL ERR ");
+  else if (event == EVENT_STATUS_CLIENT)
+    qe->is_err = !strcmpstart(msg, "STATUS_CLIENT ERR ");
+  else if (event == EVENT_STATUS_SERVER)
+    qe->is_err = !strcmpstart(msg, "STATUS_SERVER ERR ");
+
+  if (!queued_control_events)
+    queued_control_events = smartlist_create();
+  smartlist_add(queued_control_events, qe);
+
+  if (qe->is_err ||
+      smartlist_len(queued_control_events) >= CONTROL_EVENT_QUEUE_MAX) {
+    flush_queued_control_events();
+    return;
+  }
+  if (!flush_control_events_scheduled) {
+    struct timeval tv;
+    struct event_base *base = tor_libevent_get_base();
+    if (!base) {
+      /* No event loop yet: nothing to wait for. */
+      flush_queued_control_events();
+      return;
     }
-  } SMARTLIST_FOREACH_END(conn);
+    if (!flush_control_events_event)
+      flush_control_events_event = tor_evtimer_new(base,
+                                           flush_control_events_cb, NULL);
+    tv.tv_sec = 0;
+    tv.tv_usec = CONTROL_EVENT_FLUSH_MSEC * 1000;
+    if (evtimer_add(flush_control_events_event, &tv) < 0) {
+      flush_queued_control_events();
+      return;
+    }
+    flush_control_events_scheduled = 1;
+  }
+}
+
+/** As queue_control_event_string, but copies <b>msg</b>. */
+static void
+send_control_event_string(uint16_t event, event_format_t which,
+                          const char *msg)
+{
+  queue_control_event_string(event, which, tor_strdup(msg));
 }
 
 /** Helper for send_control_event and control_event_status:
@@ -625,9 +867,7 @@ send_control_event_impl(uint16_t event, event_format_t which,
     return;
   }
 
-  send_control_event_string(event, which|ALL_FORMATS, buf);
-
-  tor_free(buf);
+  queue_control_event_string(event, which|ALL_FORMATS, buf);
 }
 
 /** Send an event to all v1 controllers that are listening for code
@@ -643,6 +883,35 @@ send_control_event(uint16_t event, event_format_t which,
   va_end(ap);
 }
 
+/** Return how many events we have dropped, on all control connections,
+ * because their controllers weren't reading fast enough. */
+uint64_t
+control_get_n_events_dropped(void)
+{
+  return n_control_events_dropped;
+}
+
+/** Free all storage held for queued controller events. */
+void
+control_free_all(void)
+{
+  if (queued_control_events) {
+    SMARTLIST_FOREACH(queued_control_events, queued_event_t *, qe,
+                      queued_event_free(qe));
+    smartlist_free(queued_control_events);
+    queued_control_events = NULL;
+  }
+  if (flush_control_events_event) {
+    tor_event_free(flush_control_events_event);
+    flush_control_events_event = NULL;
+  }
+  if (resume_control_conns_event) {
+    tor_event_free(resume_control_conns_event);
+    resume_control_conns_event = NULL;
+  }
+  flush_control_events_scheduled = 0;
+}
+
 /** Given a text circuit <b>id</b>, return the corresponding circuit. */
 static origin_circuit_t *
 get_circ(const char *id)
@@ -948,6 +1217,7 @@ static const struct control_event_t control_event_table[] = {
   { EVENT_BUILDTIMEOUT_SET, "BUILDTIMEOUT_SET" },
   { EVENT_SIGNAL, "SIGNAL" },
   { EVENT_CONF_CHANGED, "CONF_CHANGED"},
+  { EVENT_CIRC_BANDWIDTH_USED, "CIRC_BW" },
   { 0, NULL },
 };
 
@@ -1397,6 +1667,9 @@ getinfo_helper_misc(control_connection_t *conn, const char *question,
     *answer = smartlist_join_strings(event_names, " ", 0, NULL);
 
     smartlist_free(event_names);
+  } else if (!strcmp(question, "events/dropped")) {
+    tor_asprintf(answer, U64_FORMAT,
+                 U64_PRINTF_ARG(conn->n_events_dropped));
   } else if (!strcmp(question, "features/names")) {
     *answer = tor_strdup("VERBOSE_NAMES EXTENDED_EVENTS");
   } else if (!strcmp(question, "address")) {
@@ -1406,10 +1679,29 @@ getinfo_helper_misc(control_connection_t *conn, const char *question,
       return -1;
     }
     *answer = tor_dup_ip(addr);
+  } else if (!strcmp(question, "memory/buffer-chunks")) {
+    *answer = buf_get_chunk_pool_stats();
+  } else if (!strcmp(question, "memory/memarea")) {
+    memarea_totals_t t;
+    memarea_get_totals(&t);
+    tor_asprintf(answer, "areas=%d live-bytes="U64_FORMAT
+                 " freelist-chunks=%d freelist-bytes="U64_FORMAT
+                 " chunk-allocs="U64_FORMAT" chunk-reuses="U64_FORMAT,
+                 t.n_live_areas, U64_PRINTF_ARG(t.live_bytes),
+                 t.freelist_chunks, U64_PRINTF_ARG(t.freelist_bytes),
+                 U64_PRINTF_ARG(t.n_chunk_allocs),
+                 U64_PRINTF_ARG(t.n_chunk_reuses));
   } else if (!strcmp(question, "traffic/read")) {
     tor_asprintf(answer, U64_FORMAT, U64_PRINTF_ARG(get_bytes_read()));
   } else if (!strcmp(question, "traffic/written")) {
     tor_asprintf(answer, U64_FORMAT, U64_PRINTF_ARG(get_bytes_written()));
+  } else if (!strcmp(question, "traffic/optimistic")) {
+    tor_asprintf(answer, "streams="U64_FORMAT" bytes="U64_FORMAT
+                 " retries="U64_FORMAT" bytes-resent="U64_FORMAT,
+                 U64_PRINTF_ARG(stats_n_optimistic_streams),
+                 U64_PRINTF_ARG(stats_n_optimistic_bytes),
+                 U64_PRINTF_ARG(stats_n_optimistic_retries),
+                 U64_PRINTF_ARG(stats_n_optimistic_bytes_resent));
   } else if (!strcmp(question, "process/pid")) {
     int myPid = -1;
 
@@ -1463,6 +1755,24 @@ getinfo_helper_misc(control_connection_t *conn, const char *question,
     #endif
   } else if (!strcmp(question, "dir-usage")) {
     *answer = directory_dump_request_log();
+  } else if (!strcmp(question, "dir-endpoint-stats")) {
+    *answer = rep_hist_format_dir_endpoint_stats();
+  } else if (!strcmp(question, "onionskin-latency")) {
+    *answer = rep_hist_format_onionskin_latency();
+  } else if (!strcmp(question, "handler-latency")) {
+    *answer = rep_hist_format_handler_latency();
+  } else if (!strcmp(question, "cell-latency")) {
+    *answer = rep_hist_format_cell_processing_latency();
+  } else if (!strcmp(question, "exit-port-stats")) {
+    *answer = rep_hist_format_exit_stats(time(NULL));
+    if (!*answer) {
+      *errmsg = "Not collecting exit port statistics";
+      return -1;
+    }
+  } else if (!strcmp(question, "cell-trace")) {
+    *answer = cell_trace_format();
+  } else if (!strcmp(question, "memory-usage")) {
+    *answer = format_memory_usage_report();
   } else if (!strcmp(question, "fingerprint")) {
     crypto_pk_env_t *server_key;
     if (!server_mode(get_options())) {
@@ -1984,6 +2294,38 @@ getinfo_helper_events(control_connection_t *control_conn,
     *answer = smartlist_join_strings(status, "\r\n", 0, NULL);
     SMARTLIST_FOREACH(status, char *, cp, tor_free(cp));
     smartlist_free(status);
+  } else if (!strcmp(question, "tls-memory/total")) {
+    size_t rbuf, wbuf;
+    int n_conns, n_holding;
+    connection_or_get_tls_buffer_usage(&rbuf, &wbuf, &n_conns, &n_holding);
+    tor_asprintf(answer, "read-buffers=%lu write-buffers=%lu "
+                 "connections=%d holding-buffers=%d",
+                 (unsigned long)rbuf, (unsigned long)wbuf,
+                 n_conns, n_holding);
+  } else if (!strcmp(question, "tls-memory/orconns")) {
+    smartlist_t *conns = get_connection_array();
+    smartlist_t *status = smartlist_create();
+    SMARTLIST_FOREACH_BEGIN(conns, connection_t *, base_conn) {
+      size_t rbuf_cap, rbuf_len, wbuf_cap, wbuf_len;
+      char name[128];
+      char *s;
+      or_connection_t *conn;
+      if (base_conn->type != CONN_TYPE_OR || base_conn->marked_for_close)
+        continue;
+      conn = TO_OR_CONN(base_conn);
+      if (!conn->tls)
+        continue;
+      tor_tls_get_buffer_sizes(conn->tls, &rbuf_cap, &rbuf_len,
+                               &wbuf_cap, &wbuf_len);
+      orconn_target_get_name(name, sizeof(name), conn);
+      tor_asprintf(&s, "%s read=%lu/%lu write=%lu/%lu", name,
+                   (unsigned long)rbuf_len, (unsigned long)rbuf_cap,
+                   (unsigned long)wbuf_len, (unsigned long)wbuf_cap);
+      smartlist_add(status, s);
+    } SMARTLIST_FOREACH_END(base_conn);
+    *answer = smartlist_join_strings(status, "\r\n", 0, NULL);
+    SMARTLIST_FOREACH(status, char *, cp, tor_free(cp));
+    smartlist_free(status);
   } else if (!strcmpstart(question, "address-mappings/")) {
     time_t min_e, max_e;
     smartlist_t *mappings;
@@ -2118,6 +2460,8 @@ static const getinfo_item_t getinfo_items[] = {
       "Number of bytes left to write/read so far in the accounting interval."),
   ITEM("accounting/enabled", accounting, "Is accounting currently enabled?"),
   ITEM("accounting/hibernating", accounting, "Are we hibernating or awake?"),
+  ITEM("accounting/paced-rate", accounting,
+       "Bytes per second AccountingPacing allows us, or 0 if not pacing."),
   ITEM("accounting/interval-start", accounting,
        "Time when the accounting period starts."),
   ITEM("accounting/interval-end", accounting,
@@ -2135,6 +2479,8 @@ static const getinfo_item_t getinfo_items[] = {
        "List of GETINFO options, types, and documentation."),
   ITEM("events/names", misc,
        "Events that the controller can ask for with SETEVENTS."),
+  ITEM("events/dropped", misc,
+       "How many events were dropped because this controller fell behind?"),
   ITEM("features/names", misc, "What arguments can USEFEATURE take?"),
   PREFIX("desc/id/", dir, "Router descriptors by ID."),
   PREFIX("desc/name/", dir, "Router descriptors by nickname."),
@@ -2159,6 +2505,11 @@ static const getinfo_item_t getinfo_items[] = {
   ITEM("circuit-status", events, "List of current circuits originating here."),
   ITEM("stream-status", events,"List of current streams."),
   ITEM("orconn-status", events, "A list of current OR connections."),
+  PREFIX("tls-memory/", events, NULL),
+  DOC("tls-memory/total",
+      "OpenSSL buffer memory held by all OR connections."),
+  DOC("tls-memory/orconns",
+      "OpenSSL buffer memory used and held by each OR connection."),
   PREFIX("address-mappings/", events, NULL),
   DOC("address-mappings/all", "Current address mappings."),
   DOC("address-mappings/cache", "Current cached DNS replies."),
@@ -2182,24 +2533,60 @@ static const getinfo_item_t getinfo_items[] = {
       "Number of versioning authorities agreeing on the status of the "
       "current version"),
   ITEM("address", misc, "IP address of this Tor host, if we can guess it."),
+  ITEM("memory/buffer-chunks", misc,
+       "Memory held by each size class of buffer chunks."),
+  ITEM("memory/memarea", misc,
+       "Chunks used and recycled by the parsers' memory areas."),
   ITEM("traffic/read", misc,"Bytes read since the process was started."),
   ITEM("traffic/written", misc,
        "Bytes written since the process was started."),
+  ITEM("traffic/optimistic", misc,
+       "Streams and bytes sent before the exit connected, and retries."),
   ITEM("process/pid", misc, "Process id belonging to the main tor process."),
   ITEM("process/uid", misc, "User id running the tor process."),
   ITEM("process/user", misc,
        "Username under which the tor process is running."),
   ITEM("process/descriptor-limit", misc, "File descriptor limit."),
   ITEM("dir-usage", misc, "Breakdown of bytes transferred over DirPort."),
+  ITEM("dir-endpoint-stats", misc,
+       "Requests, bytes, and latency for each kind of DirPort request."),
+  ITEM("onionskin-latency", misc,
+       "Histograms of onionskin queue, crypto, and reply times."),
+  ITEM("handler-latency", misc,
+       "Histograms of time spent in main loop event handlers."),
+  ITEM("cell-latency", misc,
+       "Histograms of time spent handling each kind of incoming cell."),
+  ITEM("exit-port-stats", misc,
+       "Exit port statistics for the current interval so far."),
+  ITEM("cell-trace", misc, "Queueing times of recently sampled cells."),
+  ITEM("memory-usage", misc, "Estimated memory use of each subsystem."),
   PREFIX("desc-annotations/id/", dir, "Router annotations by hexdigest."),
   PREFIX("dir/server/", dir,"Router descriptors as retrieved from a DirPort."),
   PREFIX("dir/status/", dir,
          "v2 networkstatus docs as retrieved from a DirPort."),
+  ITEM("dir/flag-thresholds", dirserv,
+       "Thresholds this authority uses to assign the Stable, Fast, and "
+       "Guard flags."),
   ITEM("dir/status-vote/current/consensus", dir,
        "v3 Networkstatus consensus as retrieved from a DirPort."),
   ITEM("exit-policy/default", policies,
        "The default value appended to the configured exit policy."),
   PREFIX("ip-to-country/", geoip, "Perform a GEOIP lookup"),
+  ITEM("dns/cache-stats", dns,
+       "Hits, misses, prefetches, and waiting streams for this exit's "
+       "DNS cache."),
+  ITEM("dns/resolve-latency", dns,
+       "Latency percentiles and failure counts for this exit's lookups."),
+  ITEM("dns/nameserver-stats", dns,
+       "Replies, timeouts, and reply latencies for each nameserver."),
+  PREFIX("cpuworker/", cpuworker, NULL),
+  DOC("cpuworker/count", "Number of cpuworkers running."),
+  DOC("cpuworker/jobs-outstanding",
+      "Onionskins handed to cpuworkers and not yet answered."),
+  DOC("cpuworker/queue-wait",
+      "Average microseconds an onionskin waits for a free cpuworker."),
+  DOC("cpuworker/utilization",
+      "Percent of cpuworker time spent on handshakes recently."),
   { NULL, NULL, NULL, 0 }
 };
 
@@ -2257,8 +2644,218 @@ handle_getinfo_helper(control_connection_t *control_conn,
   return 0; /* unrecognized */
 }
 
+/** How many bytes do we try to keep on a control connection's outbuf while
+ * we're spooling a GETINFO answer to it? */
+#define CONTROL_SPOOL_BUFFER_MIN 16384
+
+/** Return the spool source we use to answer the GETINFO question
+ * <b>question</b> a piece at a time, or CONTROL_SPOOL_NONE if we answer it
+ * all at once. */
+static int
+getinfo_spool_src_for_question(const char *question)
+{
+  if (!strcmp(question, "ns/all"))
+    return CONTROL_SPOOL_NS;
+  else if (!strcmp(question, "desc/all-recent"))
+    return CONTROL_SPOOL_DESC;
+  else if (!strcmp(question, "desc/all-recent-extrainfo-hack"))
+    return CONTROL_SPOOL_DESC_EXTRAINFO;
+  return CONTROL_SPOOL_NONE;
+}
+
+/** Remember the routers whose entries we'll spool to <b>conn</b> to answer
+ * a question with spool source <b>src</b>.  Return 0 on success, or -1 if
+ * there's nothing to spool, in which case the caller should answer the
+ * question all at once. */
+static int
+control_getinfo_spool_prepare(control_connection_t *conn, int src)
+{
+  smartlist_t *stack = smartlist_create();
+  if (src == CONTROL_SPOOL_NS) {
+    networkstatus_t *consensus = networkstatus_get_latest_consensus();
+    if (consensus)
+      SMARTLIST_FOREACH(consensus->routerstatus_list,
+                        const routerstatus_t *, rs,
+        smartlist_add(stack, tor_memdup(rs->identity_digest, DIGEST_LEN)));
+  } else {
+    routerlist_t *routerlist = router_get_routerlist();
+    if (routerlist && routerlist->routers)
+      SMARTLIST_FOREACH(routerlist->routers, const routerinfo_t *, ri,
+        smartlist_add(stack,
+                      tor_memdup(ri->cache_info.identity_digest, DIGEST_LEN)));
+  }
+  if (!smartlist_len(stack)) {
+    smartlist_free(stack);
+    return -1;
+  }
+  smartlist_reverse(stack);
+  conn->getinfo_spool_stack = stack;
+  conn->getinfo_spool_src = src;
+  return 0;
+}
+
+/** Write to <b>conn</b> the escaped entry for the router with identity
+ * <b>digest</b> in the answer we're spooling.  If the router has gone away
+ * since we started, write nothing. */
+static void
+control_getinfo_spool_write_entry(control_connection_t *conn,
+                                  const char *digest)
+{
+  char *s = NULL, *esc = NULL;
+  const char *body = NULL;
+  size_t len = 0, esc_len;
+
+  if (conn->getinfo_spool_src == CONTROL_SPOOL_NS) {
+    const routerstatus_t *rs = router_get_consensus_status_by_id(digest);
+    if (rs && (s = networkstatus_getinfo_helper_single(rs))) {
+      body = s;
+      len = strlen(s);
+    }
+  } else {
+    const routerinfo_t *ri = router_get_by_id_digest(digest);
+    if (ri && (body = signed_descriptor_get_body(&ri->cache_info))) {
+      signed_descriptor_t *ei = NULL;
+      len = ri->cache_info.signed_descriptor_len;
+      if (conn->getinfo_spool_src == CONTROL_SPOOL_DESC_EXTRAINFO)
+        ei = extrainfo_get_by_descriptor_digest(
+                                     ri->cache_info.extra_info_digest);
+      if (ei) {
+        body = s = munge_extrainfo_into_routerinfo(body, &ri->cache_info, ei);
+        len = strlen(s);
+      }
+    }
+  }
+  if (body && len) {
+    esc_len = write_escaped_data_impl(body, len, &esc, 0);
+    connection_write_to_buf(esc, esc_len, TO_CONN(conn));
+    tor_free(esc);
+  }
+  tor_free(s);
+}
+
+/** Libevent callback: handle the commands that arrived on control
+ * connections while we were spooling GETINFO answers to them. */
+static void
+resume_control_conns_cb(evutil_socket_t fd, short events, void *arg)
+{
+  smartlist_t *conns = get_connection_array();
+  (void)fd;
+  (void)events;
+  (void)arg;
+  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
+    control_connection_t *control_conn;
+    if (conn->type != CONN_TYPE_CONTROL)
+      continue;
+    control_conn = TO_CONTROL_CONN(conn);
+    if (!control_conn->getinfo_resume_pending)
+      continue;
+    control_conn->getinfo_resume_pending = 0;
+    if (conn->marked_for_close)
+      continue;
+    if (connection_control_process_inbuf(control_conn) < 0)
+      connection_mark_for_close(conn);
+  } SMARTLIST_FOREACH_END(conn);
+}
+
+/** We've spooled the last entry of a GETINFO answer to <b>conn</b>: end it,
+ * send the rest of the reply and any events we held back, and arrange to
+ * look at whatever commands arrived in the meantime. */
+static void
+control_getinfo_spool_finish(control_connection_t *conn)
+{
+  connection_write_str_to_buf(".\r\n", conn);
+  if (conn->getinfo_spool_trailer) {
+    connection_write_str_to_buf(conn->getinfo_spool_trailer, conn);
+    tor_free(conn->getinfo_spool_trailer);
+  }
+  smartlist_free(conn->getinfo_spool_stack);
+  conn->getinfo_spool_stack = NULL;
+  conn->getinfo_spool_src = CONTROL_SPOOL_NONE;
+
+  if (conn->held_events) {
+    SMARTLIST_FOREACH(conn->held_events, char *, cp, {
+      connection_write_str_to_buf(cp, conn);
+      tor_free(cp);
+    });
+    smartlist_free(conn->held_events);
+    conn->held_events = NULL;
+    conn->held_events_len = 0;
+  }
+
+  if (connection_get_inbuf_len(TO_CONN(conn))) {
+    struct timeval tv = { 0, 0 };
+    conn->getinfo_resume_pending = 1;
+    if (!resume_control_conns_event)
+      resume_control_conns_event = tor_evtimer_new(tor_libevent_get_base(),
+                                              resume_control_conns_cb, NULL);
+    if (evtimer_add(resume_control_conns_event, &tv) < 0)
+      log_warn(LD_BUG, "Couldn't add timer to resume control connections");
+  }
+}
+
+/** Called when <b>conn</b> has flushed some of its outbuf.  If we're
+ * spooling a GETINFO answer to it, write more of the answer until the
+ * outbuf holds CONTROL_SPOOL_BUFFER_MIN bytes, and finish the reply once
+ * there's nothing left.  Always return 0. */
+int
+connection_control_flushed_some(control_connection_t *conn)
+{
+  if (conn->getinfo_spool_src == CONTROL_SPOOL_NONE)
+    return 0;
+  while (smartlist_len(conn->getinfo_spool_stack) &&
+         connection_get_outbuf_len(TO_CONN(conn)) < CONTROL_SPOOL_BUFFER_MIN) {
+    char *digest = smartlist_pop_last(conn->getinfo_spool_stack);
+    control_getinfo_spool_write_entry(conn, digest);
+    tor_free(digest);
+  }
+  if (!smartlist_len(conn->getinfo_spool_stack))
+    control_getinfo_spool_finish(conn);
+  return 0;
+}
+
+/** Free all storage held by <b>conn</b> for spooling GETINFO answers. */
+void
+control_connection_free_spool(control_connection_t *conn)
+{
+  if (conn->getinfo_spool_stack) {
+    SMARTLIST_FOREACH(conn->getinfo_spool_stack, char *, cp, tor_free(cp));
+    smartlist_free(conn->getinfo_spool_stack);
+    conn->getinfo_spool_stack = NULL;
+  }
+  tor_free(conn->getinfo_spool_trailer);
+  if (conn->held_events) {
+    SMARTLIST_FOREACH(conn->held_events, char *, cp, tor_free(cp));
+    smartlist_free(conn->held_events);
+    conn->held_events = NULL;
+  }
+  conn->held_events_len = 0;
+  conn->getinfo_spool_src = CONTROL_SPOOL_NONE;
+}
+
+/** Append to <b>out</b> the lines that give the answer <b>v</b> to the
+ * GETINFO question <b>k</b>. */
+static void
+getinfo_format_answer(smartlist_t *out, const char *k, const char *v)
+{
+  char *line = NULL;
+  if (!strchr(v, '\n') && !strchr(v, '\r')) {
+    tor_asprintf(&line, "250-%s=%s\r\n", k, v);
+    smartlist_add(out, line);
+  } else {
+    char *esc = NULL;
+    tor_asprintf(&line, "250+%s=\r\n", k);
+    smartlist_add(out, line);
+    write_escaped_data(v, strlen(v), &esc);
+    smartlist_add(out, esc);
+  }
+}
+
 /** Called when we receive a GETINFO command.  Try to fetch all requested
- * information, and reply with information or error message. */
+ * information, and reply with information or error message.
+ *
+ * The first question whose answer can be very large (see
+ * getinfo_spool_src_for_question) isn't answered here: we spool its answer
+ * to the outbuf as it drains, and send the rest of the reply after it. */
 static int
 handle_control_getinfo(control_connection_t *conn, uint32_t len,
                        const char *body)
@@ -2266,14 +2863,25 @@ handle_control_getinfo(control_connection_t *conn, uint32_t len,
   smartlist_t *questions = smartlist_create();
   smartlist_t *answers = smartlist_create();
   smartlist_t *unrecognized = smartlist_create();
+  smartlist_t *lines = NULL;
   char *msg = NULL, *ans = NULL;
-  int i;
+  int i, spool_src = CONTROL_SPOOL_NONE, spool_idx = -1, spooling = 0;
   (void) len; /* body is NUL-terminated, so it's safe to ignore the length. */
 
   smartlist_split_string(questions, body, " ",
                          SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
   SMARTLIST_FOREACH_BEGIN(questions, const char *, q) {
     const char *errmsg = NULL;
+    if (spool_src == CONTROL_SPOOL_NONE &&
+        (spool_src = getinfo_spool_src_for_question(q))) {
+      if (control_getinfo_spool_prepare(conn, spool_src) == 0) {
+        spool_idx = smartlist_len(answers);
+        smartlist_add(answers, tor_strdup(q));
+        smartlist_add(answers, NULL);
+        continue;
+      }
+      spool_src = CONTROL_SPOOL_NONE;
+    }
     if (handle_getinfo_helper(conn, q, &ans, &errmsg) < 0) {
       if (!errmsg)
         errmsg = "Internal error";
@@ -2298,25 +2906,37 @@ handle_control_getinfo(control_connection_t *conn, uint32_t len,
     goto done;
   }
 
+  lines = smartlist_create();
   for (i = 0; i < smartlist_len(answers); i += 2) {
     char *k = smartlist_get(answers, i);
     char *v = smartlist_get(answers, i+1);
-    if (!strchr(v, '\n') && !strchr(v, '\r')) {
-      connection_printf_to_buf(conn, "250-%s=", k);
-      connection_write_str_to_buf(v, conn);
-      connection_write_str_to_buf("\r\n", conn);
-    } else {
-      char *esc = NULL;
-      size_t esc_len;
-      esc_len = write_escaped_data(v, strlen(v), &esc);
+    if (i == spool_idx) {
+      char *before = smartlist_join_strings(lines, "", 0, NULL);
+      connection_write_str_to_buf(before, conn);
       connection_printf_to_buf(conn, "250+%s=\r\n", k);
-      connection_write_to_buf(esc, esc_len, TO_CONN(conn));
-      tor_free(esc);
+      tor_free(before);
+      SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+      smartlist_clear(lines);
+    } else {
+      getinfo_format_answer(lines, k, v);
     }
   }
-  connection_write_str_to_buf("250 OK\r\n", conn);
+  smartlist_add(lines, tor_strdup("250 OK\r\n"));
+  if (spool_idx >= 0) {
+    conn->getinfo_spool_trailer = smartlist_join_strings(lines, "", 0, NULL);
+    spooling = 1;
+    connection_control_flushed_some(conn);
+  } else {
+    SMARTLIST_FOREACH(lines, char *, cp, connection_write_str_to_buf(cp, conn));
+  }
 
  done:
+  if (spool_idx >= 0 && !spooling)
+    control_connection_free_spool(conn); /* We never started spooling. */
+  if (lines) {
+    SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+    smartlist_free(lines);
+  }
   SMARTLIST_FOREACH(answers, char *, cp, tor_free(cp));
   smartlist_free(answers);
   SMARTLIST_FOREACH(questions, char *, cp, tor_free(cp));
@@ -3101,6 +3721,88 @@ peek_connection_has_control0_command(connection_t *conn)
   }
 }
 
+/** Run the control command in <b>conn</b>->incoming_cmd, whose arguments
+ * are the <b>cmd_data_len</b> bytes at <b>args</b>.  Return -1 if the
+ * handler wants us to stop processing <b>conn</b>, and 0 otherwise. */
+static int
+control_dispatch_command(control_connection_t *conn, uint32_t cmd_data_len,
+                         char *args)
+{
+  /* XXXX Why is this not implemented as a table like the GETINFO
+   * items are?  Even handling the plus signs at the beginnings of
+   * commands wouldn't be very hard with proper macros. */
+  if (!strcasecmp(conn->incoming_cmd, "SETCONF")) {
+    if (handle_control_setconf(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "RESETCONF")) {
+    if (handle_control_resetconf(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "GETCONF")) {
+    if (handle_control_getconf(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "+LOADCONF")) {
+    if (handle_control_loadconf(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "SETEVENTS")) {
+    if (handle_control_setevents(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "AUTHENTICATE")) {
+    if (handle_control_authenticate(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "SAVECONF")) {
+    if (handle_control_saveconf(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "SIGNAL")) {
+    if (handle_control_signal(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "TAKEOWNERSHIP")) {
+    if (handle_control_takeownership(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "MAPADDRESS")) {
+    if (handle_control_mapaddress(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "GETINFO")) {
+    if (handle_control_getinfo(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "EXTENDCIRCUIT")) {
+    if (handle_control_extendcircuit(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "SETCIRCUITPURPOSE")) {
+    if (handle_control_setcircuitpurpose(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "SETROUTERPURPOSE")) {
+    connection_write_str_to_buf("511 SETROUTERPURPOSE is obsolete.\r\n", conn);
+  } else if (!strcasecmp(conn->incoming_cmd, "ATTACHSTREAM")) {
+    if (handle_control_attachstream(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "+POSTDESCRIPTOR")) {
+    if (handle_control_postdescriptor(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "REDIRECTSTREAM")) {
+    if (handle_control_redirectstream(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "CLOSESTREAM")) {
+    if (handle_control_closestream(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "CLOSECIRCUIT")) {
+    if (handle_control_closecircuit(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "USEFEATURE")) {
+    if (handle_control_usefeature(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "RESOLVE")) {
+    if (handle_control_resolve(conn, cmd_data_len, args))
+      return -1;
+  } else if (!strcasecmp(conn->incoming_cmd, "PROTOCOLINFO")) {
+    if (handle_control_protocolinfo(conn, cmd_data_len, args))
+      return -1;
+  } else {
+    connection_printf_to_buf(conn, "510 Unrecognized command \"%s\"\r\n",
+                             conn->incoming_cmd);
+  }
+  return 0;
+}
+
 /** Called when data has arrived on a v1 control connection: Try to fetch
  * commands from conn->inbuf, and execute them.
  */
@@ -3109,8 +3811,9 @@ connection_control_process_inbuf(control_connection_t *conn)
 {
   size_t data_len;
   uint32_t cmd_data_len;
-  int cmd_len;
+  int cmd_len, r;
   char *args;
+  struct timeval cmd_start;
 
   tor_assert(conn);
   tor_assert(conn->_base.state == CONTROL_CONN_STATE_OPEN ||
@@ -3141,6 +3844,11 @@ connection_control_process_inbuf(control_connection_t *conn)
   }
 
  again:
+  /* Don't start on the next command until we've finished spooling the answer
+   * to the last one. */
+  if (conn->getinfo_spool_src != CONTROL_SPOOL_NONE)
+    return 0;
+
   while (1) {
     size_t last_idx;
     int r;
@@ -3234,79 +3942,12 @@ connection_control_process_inbuf(control_connection_t *conn)
     return 0;
   }
 
-  /* XXXX Why is this not implemented as a table like the GETINFO
-   * items are?  Even handling the plus signs at the beginnings of
-   * commands wouldn't be very hard with proper macros. */
   cmd_data_len = (uint32_t)data_len;
-  if (!strcasecmp(conn->incoming_cmd, "SETCONF")) {
-    if (handle_control_setconf(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "RESETCONF")) {
-    if (handle_control_resetconf(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "GETCONF")) {
-    if (handle_control_getconf(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "+LOADCONF")) {
-    if (handle_control_loadconf(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "SETEVENTS")) {
-    if (handle_control_setevents(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "AUTHENTICATE")) {
-    if (handle_control_authenticate(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "SAVECONF")) {
-    if (handle_control_saveconf(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "SIGNAL")) {
-    if (handle_control_signal(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "TAKEOWNERSHIP")) {
-    if (handle_control_takeownership(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "MAPADDRESS")) {
-    if (handle_control_mapaddress(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "GETINFO")) {
-    if (handle_control_getinfo(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "EXTENDCIRCUIT")) {
-    if (handle_control_extendcircuit(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "SETCIRCUITPURPOSE")) {
-    if (handle_control_setcircuitpurpose(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "SETROUTERPURPOSE")) {
-    connection_write_str_to_buf("511 SETROUTERPURPOSE is obsolete.\r\n", conn);
-  } else if (!strcasecmp(conn->incoming_cmd, "ATTACHSTREAM")) {
-    if (handle_control_attachstream(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "+POSTDESCRIPTOR")) {
-    if (handle_control_postdescriptor(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "REDIRECTSTREAM")) {
-    if (handle_control_redirectstream(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "CLOSESTREAM")) {
-    if (handle_control_closestream(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "CLOSECIRCUIT")) {
-    if (handle_control_closecircuit(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "USEFEATURE")) {
-    if (handle_control_usefeature(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "RESOLVE")) {
-    if (handle_control_resolve(conn, cmd_data_len, args))
-      return -1;
-  } else if (!strcasecmp(conn->incoming_cmd, "PROTOCOLINFO")) {
-    if (handle_control_protocolinfo(conn, cmd_data_len, args))
-      return -1;
-  } else {
-    connection_printf_to_buf(conn, "510 Unrecognized command \"%s\"\r\n",
-                             conn->incoming_cmd);
-  }
+  tor_gettimeofday(&cmd_start);
+  r = control_dispatch_command(conn, cmd_data_len, args);
+  rep_hist_note_handler_time(HANDLER_CONTROL_COMMAND, &cmd_start);
+  if (r < 0)
+    return -1;
 
   conn->incoming_cmd_cur_len = 0;
   goto again;
@@ -3625,6 +4266,42 @@ control_event_stream_bandwidth_used(void)
   return 0;
 }
 
+/** A second or more has elapsed: tell any interested control
+ * connections how much bandwidth each of our origin circuits has used.
+ * We send one CIRC_BW line per circuit that saw any traffic, all queued
+ * as a single batch. */
+int
+control_event_circuit_bandwidth_used(void)
+{
+  smartlist_t *lines;
+  circuit_t *circ;
+  if (!EVENT_IS_INTERESTING(EVENT_CIRC_BANDWIDTH_USED))
+    return 0;
+
+  lines = smartlist_create();
+  for (circ = _circuit_get_global_list(); circ; circ = circ->next) {
+    origin_circuit_t *ocirc;
+    char *line = NULL;
+    if (!CIRCUIT_IS_ORIGIN(circ))
+      continue;
+    ocirc = TO_ORIGIN_CIRCUIT(circ);
+    if (!ocirc->n_read_circ_bw && !ocirc->n_written_circ_bw)
+      continue;
+    tor_asprintf(&line, "650 CIRC_BW ID=%lu READ=%lu WRITTEN=%lu\r\n",
+                 (unsigned long)ocirc->global_identifier,
+                 (unsigned long)ocirc->n_read_circ_bw,
+                 (unsigned long)ocirc->n_written_circ_bw);
+    smartlist_add(lines, line);
+    ocirc->n_read_circ_bw = ocirc->n_written_circ_bw = 0;
+  }
+  if (smartlist_len(lines))
+    queue_control_event_string(EVENT_CIRC_BANDWIDTH_USED, ALL_FORMATS,
+                               smartlist_join_strings(lines, "", 0, NULL));
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return 0;
+}
+
 /** A second or more has elapsed: tell any interested control
  * connections how much bandwidth we used. */
 int
@@ -3732,9 +4409,8 @@ control_event_descriptors_changed(smartlist_t *routers)
     names_len = strlen(ids)+32;
     msg = tor_malloc(names_len);
     tor_snprintf(msg, names_len, "650 NEWDESC %s\r\n", ids);
-    send_control_event_string(EVENT_NEW_DESC, ALL_FORMATS, msg);
+    queue_control_event_string(EVENT_NEW_DESC, ALL_FORMATS, msg);
     tor_free(ids);
-    tor_free(msg);
     SMARTLIST_FOREACH(names, char *, cp, tor_free(cp));
     smartlist_free(names);
   }
@@ -3804,12 +4480,10 @@ control_event_or_authdir_new_descriptor(const char *action,
   buf = tor_malloc(totallen);
   strlcpy(buf, firstline, totallen);
   strlcpy(buf+strlen(firstline), esc, totallen);
-  send_control_event_string(EVENT_AUTHDIR_NEWDESCS, ALL_FORMATS,
-                            buf);
+  queue_control_event_string(EVENT_AUTHDIR_NEWDESCS, ALL_FORMATS, buf);
   send_control_event_string(EVENT_AUTHDIR_NEWDESCS, ALL_FORMATS,
                             "650 OK\r\n");
   tor_free(esc);
-  tor_free(buf);
 
   return 0;
 }
@@ -3844,11 +4518,10 @@ control_event_networkstatus_changed_helper(smartlist_t *statuses,
   SMARTLIST_FOREACH(strs, char *, cp, tor_free(cp));
   smartlist_free(strs);
   tor_free(s);
-  send_control_event_string(event, ALL_FORMATS, esc);
+  queue_control_event_string(event, ALL_FORMATS, esc);
   send_control_event_string(event, ALL_FORMATS,
                             "650 OK\r\n");
 
-  tor_free(esc);
   return 0;
 }
 
@@ -26,11 +26,14 @@ void control_ports_write_to_file(void);
   CONN_LOG_PROTECT(conn, log_fn args)
 
 int connection_control_finished_flushing(control_connection_t *conn);
+int connection_control_flushed_some(control_connection_t *conn);
+void control_connection_free_spool(control_connection_t *conn);
 int connection_control_reached_eof(control_connection_t *conn);
 void connection_control_closed(control_connection_t *conn);
 
 int connection_control_process_inbuf(control_connection_t *conn);
 
+#define EVENT_STREAM_STATUS 0x0002
 #define EVENT_AUTHDIR_NEWDESCS 0x000D
 #define EVENT_NS 0x000F
 int control_event_is_interesting(int event);
@@ -45,6 +48,7 @@ int control_event_or_conn_status(or_connection_t *conn,
 int control_event_bandwidth_used(uint32_t n_read, uint32_t n_written);
 int control_event_stream_bandwidth(edge_connection_t *edge_conn);
 int control_event_stream_bandwidth_used(void);
+int control_event_circuit_bandwidth_used(void);
 void control_event_logmsg(int severity, unsigned int domain, const char *msg);
 int control_event_descriptors_changed(smartlist_t *routers);
 int control_event_address_mapped(const char *from, const char *to,
@@ -83,6 +87,9 @@ void control_event_bootstrap_problem(const char *warn, int reason);
 
 void control_event_clients_seen(const char *controller_str);
 
+uint64_t control_get_n_events_dropped(void);
+void control_free_all(void);
+
 #ifdef CONTROL_PRIVATE
 /* Used only by control.c and test.c */
 size_t write_escaped_data(const char *data, size_t len, char **out);
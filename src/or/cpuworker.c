@@ -9,7 +9,15 @@
  * CPU-intensive tasks in another thread or process, to not
  * interrupt the main thread.
  *
- * Right now, we only use this for processing onionskins.
+ * We use this for processing onionskins, and, where we have a pool of
+ * threads, for other CPU-heavy work that the rest of Tor hands us with
+ * cpuworker_queue_work().
+ *
+ * Where we have pthreads, the workers are a pool of threads that take jobs
+ * from a shared queue, guarded by a mutex and a condition, and put their
+ * answers on a reply queue; a single eventfd (or socketpair) tells the main
+ * thread when there are answers to collect.  Elsewhere, each worker is a
+ * separate thread or process that we talk to over its own socketpair.
  **/
 
 #include "or.h"
@@ -20,33 +28,44 @@
 #include "connection.h"
 #include "cpuworker.h"
 #include "main.h"
+#include "mempool.h"
 #include "onion.h"
+#include "rendservice.h"
+#include "rephist.h"
 #include "router.h"
 
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#ifdef TOR_HAVE_COND
+/** Defined iff our cpuworkers are a pool of threads sharing a job queue. */
+#define USE_CPUWORKER_THREADPOOL
+#if defined(HAVE_EVENTFD) && defined(HAVE_SYS_EVENTFD_H)
+/** Defined iff we wake up the main thread with an eventfd rather than a
+ * socketpair. */
+#define USE_EVENTFD
+#endif
+#endif
+
 /** The maximum number of cpuworker processes we will keep around. */
 #define MAX_CPUWORKERS 16
 /** The minimum number of cpuworker processes we will keep around. */
 #define MIN_CPUWORKERS 1
 
-/** The tag specifies which circuit this onionskin was from. */
-#define TAG_LEN 10
-/** How many bytes are sent from the cpuworker back to tor? */
-#define LEN_ONION_RESPONSE \
-  (1+TAG_LEN+ONIONSKIN_REPLY_LEN+CPATH_KEY_MATERIAL_LEN)
-
 /** How many cpuworkers we have running right now. */
 static int num_cpuworkers=0;
-/** How many of the running cpuworkers have an assigned task right now. */
-static int num_cpuworkers_busy=0;
-/** We need to spawn new cpuworkers whenever we rotate the onion keys
- * on platforms where execution contexts==processes.  This variable stores
- * the last time we got a key rotation event. */
-static time_t last_rotation_time=0;
 
-static void cpuworker_main(void *data) ATTR_NORETURN;
 static int spawn_cpuworker(void);
 static void spawn_enough_cpuworkers(void);
-static void process_pending_task(connection_t *cpuworker);
+#ifdef USE_CPUWORKER_THREADPOOL
+static void retire_cpuworkers(int n);
+#endif
 
 /** Initialize the cpuworker subsystem.
  */
@@ -65,6 +84,959 @@ connection_cpu_finished_flushing(connection_t *conn)
   return 0;
 }
 
+/** A cpuworker has finished with the onionskin for the circuit with ID
+ * <b>circ_id</b> on the OR connection whose global identifier is
+ * <b>conn_id</b>.  If <b>success</b> is true, <b>reply</b> holds the
+ * answer to <b>handshake</b> and <b>keys</b> the negotiated key material:
+ * answer the circuit if it's still there. */
+static void
+cpuworker_onion_answer(int success, uint64_t conn_id, circid_t circ_id,
+                       const onion_handshake_t *handshake,
+                       const char *reply, const char *keys)
+{
+  connection_t *tmp_conn;
+  or_connection_t *p_conn = NULL;
+  circuit_t *circ = NULL;
+
+  /* find the circ it was talking about */
+  tmp_conn = connection_get_by_global_id(conn_id);
+  if (tmp_conn && !tmp_conn->marked_for_close &&
+      tmp_conn->type == CONN_TYPE_OR)
+    p_conn = TO_OR_CONN(tmp_conn);
+
+  if (p_conn)
+    circ = circuit_get_by_circid_orconn(circ_id, p_conn);
+
+  if (!success) {
+    log_debug(LD_OR,
+              "decoding onionskin failed. "
+              "(Old key or bad software.) Closing.");
+    if (circ)
+      circuit_mark_for_close(circ, END_CIRC_REASON_TORPROTOCOL);
+    return;
+  }
+  if (!circ) {
+    /* This happens because somebody sends us a destroy cell and the
+     * circuit goes away, while the cpuworker is working. This is also
+     * why our tag doesn't include a pointer to the circ, because we'd
+     * never know if it's still valid.
+     */
+    log_debug(LD_OR,"processed onion for a circ that's gone. Dropping.");
+    return;
+  }
+  tor_assert(! CIRCUIT_IS_ORIGIN(circ));
+  if (onionskin_answer(TO_OR_CIRCUIT(circ), handshake, reply, keys) < 0) {
+    log_warn(LD_OR,"onionskin_answer failed. Closing.");
+    circuit_mark_for_close(circ, END_CIRC_REASON_INTERNAL);
+    return;
+  }
+  log_debug(LD_OR,"onionskin_answer succeeded. Yay.");
+}
+
+/** Return the largest number of cpuworkers our configuration allows. */
+static int
+max_cpuworkers(void)
+{
+  int n = get_num_cpus(get_options());
+  if (n < MIN_CPUWORKERS)
+    n = MIN_CPUWORKERS;
+  if (n > MAX_CPUWORKERS)
+    n = MAX_CPUWORKERS;
+  return n;
+}
+
+#ifdef USE_CPUWORKER_THREADPOOL
+/** If AdaptiveCPUWorkers is set, how many cpuworkers do we currently want,
+ * based on how busy they've been? */
+static int adaptive_cpuworker_target = MIN_CPUWORKERS;
+#endif
+
+/** Return how many cpuworkers we want to be running right now. */
+static int
+num_cpuworkers_wanted(void)
+{
+  int n = max_cpuworkers();
+#ifdef USE_CPUWORKER_THREADPOOL
+  if (get_options()->AdaptiveCPUWorkers && adaptive_cpuworker_target < n)
+    n = adaptive_cpuworker_target;
+#endif
+  return n;
+}
+
+/** If we have too few or too many active cpuworkers, try to spawn new ones
+ * or kill idle ones.
+ */
+static void
+spawn_enough_cpuworkers(void)
+{
+  int num_cpuworkers_needed = num_cpuworkers_wanted();
+
+#ifdef USE_CPUWORKER_THREADPOOL
+  if (num_cpuworkers > num_cpuworkers_needed)
+    retire_cpuworkers(num_cpuworkers - num_cpuworkers_needed);
+#endif
+
+  while (num_cpuworkers < num_cpuworkers_needed) {
+    if (spawn_cpuworker() < 0) {
+      log_warn(LD_GENERAL,"Cpuworker spawn failed. Will try again later.");
+      return;
+    }
+    num_cpuworkers++;
+  }
+}
+
+#ifdef USE_CPUWORKER_THREADPOOL
+
+/** An onionskin for a pool cpuworker to answer, and, once it has, the
+ * answer.  If <b>work_fn</b> is set, this is instead a job from
+ * cpuworker_queue_work(), and only the <b>work_fn</b>, <b>reply_fn</b>, and
+ * <b>work_arg</b> fields matter. */
+typedef struct cpuworker_job_t {
+  struct cpuworker_job_t *next; /**< Next job on the same queue. */
+  /** Function for a cpuworker to call with <b>work_arg</b>. */
+  void (*work_fn)(void *arg);
+  /** Function for the main thread to call with <b>work_arg</b> once
+   * <b>work_fn</b> is done. */
+  void (*reply_fn)(void *arg);
+  void *work_arg; /**< Argument for work_fn and reply_fn. */
+  uint64_t conn_id; /**< Global identifier of the circuit's p_conn. */
+  circid_t circ_id; /**< The circuit's p_circ_id. */
+  const onion_handshake_t *handshake; /**< Which handshake to answer. */
+  char onionskin[MAX_ONIONSKIN_CHALLENGE_LEN]; /**< The question. */
+  int success; /**< True iff the handshake succeeded. */
+  char reply[MAX_ONIONSKIN_REPLY_LEN]; /**< The reply to send to the client. */
+  char keys[CPATH_KEY_MATERIAL_LEN]; /**< The negotiated key material. */
+  struct timeval when_queued; /**< When did we add this to pending_jobs? */
+  /** How many microseconds did this job wait before a worker started it? */
+  uint32_t wait_usec;
+  /** How many microseconds did the worker spend on the handshake? */
+  uint32_t work_usec;
+  struct timeval when_done; /**< When did the worker finish this job? */
+  int worker_id; /**< Which worker did this job? */
+} cpuworker_job_t;
+
+/** A first-in, first-out list of cpuworker_job_t. */
+typedef struct cpuworker_job_queue_t {
+  cpuworker_job_t *head; /**< The oldest job, or NULL if empty. */
+  cpuworker_job_t *tail; /**< The newest job, or NULL if empty. */
+  int n; /**< How many jobs are in this queue? */
+} cpuworker_job_queue_t;
+
+/** The largest number of onionskins a pool cpuworker will take from the
+ * job queue each time it wakes up.  We also allow this many jobs per
+ * cpuworker to be outstanding at once, so that a worker usually finds a
+ * whole batch waiting for it. */
+#define CPUWORKER_MAX_BATCH 8
+
+/** Lock protecting pending_jobs, finished_jobs, onion_key_generation,
+ * pool_size, workers_to_retire, and worker_ids_in_use. */
+static tor_mutex_t *pool_lock = NULL;
+/** Condition that pool cpuworkers wait on for jobs to appear. */
+static tor_cond_t *pool_cond = NULL;
+/** Jobs waiting for a pool cpuworker to pick them up. */
+static cpuworker_job_queue_t pending_jobs = { NULL, NULL, 0 };
+/** Jobs that pool cpuworkers have answered, waiting for the main thread. */
+static cpuworker_job_queue_t finished_jobs = { NULL, NULL, 0 };
+/** Incremented every time the onion keys change, so that pool cpuworkers
+ * know to fetch new copies. */
+static unsigned onion_key_generation = 0;
+/** How many pool cpuworker threads have we started? */
+static int pool_size = 0;
+/** How many pool cpuworker threads should exit the next time they look
+ * for a job? */
+static int workers_to_retire = 0;
+/** Bit <i>i</i> is set iff a running pool cpuworker has ID <i>i</i>. */
+static unsigned worker_ids_in_use = 0;
+/** How many jobs have we handed to the pool that the main thread hasn't
+ * collected the answers for?  Only the main thread touches this. */
+static int num_jobs_outstanding = 0;
+
+/** How often, in seconds, do we recompute cpuworker utilization and, with
+ * AdaptiveCPUWorkers, reconsider how many cpuworkers to run? */
+#define CPUWORKER_ADJUST_INTERVAL 10
+/** Add a cpuworker when utilization is above this fraction... */
+#define CPUWORKER_GROW_UTILIZATION 0.8
+/** ...or when jobs wait on average more than this many microseconds. */
+#define CPUWORKER_GROW_WAIT_USEC 50000
+/** Remove a cpuworker when utilization is below this fraction and jobs
+ * wait on average less than CPUWORKER_SHRINK_WAIT_USEC. */
+#define CPUWORKER_SHRINK_UTILIZATION 0.3
+/** See CPUWORKER_SHRINK_UTILIZATION. */
+#define CPUWORKER_SHRINK_WAIT_USEC 5000
+
+/** Moving average of how many microseconds a job waits in pending_jobs
+ * before a cpuworker starts on it. */
+static double avg_job_wait_usec = 0.0;
+/** How many microseconds have cpuworkers spent on handshakes since
+ * last_adjust_time? */
+static uint64_t work_usec_since_adjust = 0;
+/** How many jobs have we collected since last_adjust_time? */
+static int jobs_since_adjust = 0;
+/** When did we last compute cpuworker_utilization? */
+static time_t last_adjust_time = 0;
+/** Fraction of the available cpuworker time spent on handshakes during
+ * the last CPUWORKER_ADJUST_INTERVAL. */
+static double cpuworker_utilization = 0.0;
+
+#ifdef USE_EVENTFD
+/** An eventfd that pool cpuworkers write to when there are answers. */
+static int wakeup_fd = -1;
+#else
+/** A socketpair: pool cpuworkers write to wakeup_fds[1] when there are
+ * answers; the main thread reads from wakeup_fds[0]. */
+static tor_socket_t wakeup_fds[2] = { -1, -1 };
+#endif
+/** Event to tell the main thread that the wakeup fd is readable. */
+static struct event *wakeup_event = NULL;
+
+/** Add <b>job</b> to the end of <b>queue</b>. */
+static INLINE void
+job_queue_push(cpuworker_job_queue_t *queue, cpuworker_job_t *job)
+{
+  job->next = NULL;
+  if (queue->tail)
+    queue->tail->next = job;
+  else
+    queue->head = job;
+  queue->tail = job;
+  ++queue->n;
+}
+
+/** Move every job in <b>from</b> onto the end of <b>to</b>, leaving
+ * <b>from</b> empty. */
+static INLINE void
+job_queue_append(cpuworker_job_queue_t *to, cpuworker_job_queue_t *from)
+{
+  if (!from->head)
+    return;
+  if (to->tail)
+    to->tail->next = from->head;
+  else
+    to->head = from->head;
+  to->tail = from->tail;
+  to->n += from->n;
+  from->head = from->tail = NULL;
+  from->n = 0;
+}
+
+/** Remove and return the first job in <b>queue</b>, or NULL if it's
+ * empty. */
+static INLINE cpuworker_job_t *
+job_queue_pop(cpuworker_job_queue_t *queue)
+{
+  cpuworker_job_t *job = queue->head;
+  if (job) {
+    queue->head = job->next;
+    if (!queue->head)
+      queue->tail = NULL;
+    job->next = NULL;
+    --queue->n;
+  }
+  return job;
+}
+
+/** Called from a pool cpuworker: tell the main thread that there are
+ * answers on finished_jobs. */
+static void
+cpuworker_wake_main_thread(void)
+{
+#ifdef USE_EVENTFD
+  uint64_t one = 1;
+  if (write(wakeup_fd, &one, sizeof(one)) < 0) {
+    /* The counter can only fill up if nobody reads it for a very long
+     * time; one way or another, the main thread will notice. */
+  }
+#else
+  /* If the socketpair is full, the main thread has a wakeup coming. */
+  if (send(wakeup_fds[1], "w", 1, 0) < 0) {
+  }
+#endif
+}
+
+/** Called from the main thread: clear any pending wakeups. */
+static void
+cpuworker_drain_wakeups(void)
+{
+#ifdef USE_EVENTFD
+  uint64_t val;
+  if (read(wakeup_fd, &val, sizeof(val)) < 0) {
+  }
+#else
+  char buf[64];
+  while (recv(wakeup_fds[0], buf, sizeof(buf), 0) > 0)
+    ;
+#endif
+}
+
+/** Replace the onion keys in *<b>onion_key</b> and *<b>last_onion_key</b>
+ * with fresh private copies of the current ones, and do the per-key
+ * OpenSSL setup for them now, so that no handshake has to wait for it. */
+static void
+cpuworker_refresh_keys(crypto_pk_env_t **onion_key,
+                       crypto_pk_env_t **last_onion_key)
+{
+  if (*onion_key)
+    crypto_free_pk_env(*onion_key);
+  if (*last_onion_key)
+    crypto_free_pk_env(*last_onion_key);
+  *onion_key = *last_onion_key = NULL;
+  dup_onion_keys(onion_key, last_onion_key);
+  if (*onion_key)
+    crypto_pk_prepare_private_key(*onion_key);
+  if (*last_onion_key)
+    crypto_pk_prepare_private_key(*last_onion_key);
+}
+
+/** Main function for a pool cpuworker thread: forever take batches of jobs
+ * from pending_jobs, answer them, and put them on finished_jobs. */
+static void
+cpuworker_thread_main(void *arg)
+{
+  crypto_pk_env_t *onion_key = NULL, *last_onion_key = NULL;
+  unsigned my_key_generation = 0;
+  int have_keys = 0;
+  int my_id;
+  (void)arg;
+
+  /* Take the lowest free ID, so that IDs stay small as workers come and
+   * go. */
+  tor_mutex_acquire(pool_lock);
+  for (my_id = 0; my_id < MAX_CPUWORKERS; ++my_id) {
+    if (!(worker_ids_in_use & (1u<<my_id)))
+      break;
+  }
+  tor_assert(my_id < MAX_CPUWORKERS);
+  worker_ids_in_use |= (1u<<my_id);
+  tor_mutex_release(pool_lock);
+
+  for (;;) {
+    cpuworker_job_queue_t batch = { NULL, NULL, 0 };
+    cpuworker_job_t *job;
+    unsigned generation;
+    int n_to_take, was_empty;
+
+    tor_mutex_acquire(pool_lock);
+    while (!pending_jobs.head && !workers_to_retire) {
+      if (!have_keys || onion_key_generation != my_key_generation) {
+        /* The keys changed while we were idle: get ready for them before
+         * any onionskins that need them show up. */
+        generation = onion_key_generation;
+        tor_mutex_release(pool_lock);
+        cpuworker_refresh_keys(&onion_key, &last_onion_key);
+        my_key_generation = generation;
+        have_keys = 1;
+        tor_mutex_acquire(pool_lock);
+        continue;
+      }
+      if (!onion_dh_pool_is_full()) {
+        /* Nothing to do right now: spend the time making a DH keypair for
+         * a later handshake. */
+        int r;
+        tor_mutex_release(pool_lock);
+        r = onion_dh_pool_fill_one();
+        tor_mutex_acquire(pool_lock);
+        if (r >= 0)
+          continue;
+      }
+      tor_cond_wait(pool_cond, pool_lock);
+    }
+    if (workers_to_retire) {
+      --workers_to_retire;
+      --pool_size;
+      worker_ids_in_use &= ~(1u<<my_id);
+      tor_mutex_release(pool_lock);
+      break;
+    }
+    /* Take our share of what's waiting, so that one worker doesn't grab a
+     * whole batch while the others sit idle. */
+    n_to_take = pending_jobs.n / pool_size;
+    if (n_to_take < 1)
+      n_to_take = 1;
+    else if (n_to_take > CPUWORKER_MAX_BATCH)
+      n_to_take = CPUWORKER_MAX_BATCH;
+    while (n_to_take-- && (job = job_queue_pop(&pending_jobs)))
+      job_queue_push(&batch, job);
+    generation = onion_key_generation;
+    tor_mutex_release(pool_lock);
+
+    if (!have_keys || generation != my_key_generation) {
+      cpuworker_refresh_keys(&onion_key, &last_onion_key);
+      my_key_generation = generation;
+      have_keys = 1;
+    }
+
+    for (job = batch.head; job; job = job->next) {
+      struct timeval start, end;
+      if (job->work_fn) {
+        job->work_fn(job->work_arg);
+        continue;
+      }
+      tor_gettimeofday(&start);
+      job->wait_usec = (uint32_t) tv_udiff(&job->when_queued, &start);
+      if (job->handshake->server_handshake(job->onionskin, onion_key,
+                                           last_onion_key, job->reply,
+                                           job->keys,
+                                           CPATH_KEY_MATERIAL_LEN) < 0) {
+        log_debug(LD_OR,"%s server handshake failed.", job->handshake->name);
+        job->success = 0;
+        memset(job->reply, 0, sizeof(job->reply));
+        memset(job->keys, 0, sizeof(job->keys));
+      } else {
+        log_debug(LD_OR,"%s server handshake succeeded.",
+                  job->handshake->name);
+        job->success = 1;
+      }
+      tor_gettimeofday(&end);
+      job->work_usec = (uint32_t) tv_udiff(&start, &end);
+      job->when_done = end;
+      job->worker_id = my_id;
+    }
+
+    tor_mutex_acquire(pool_lock);
+    was_empty = (finished_jobs.head == NULL);
+    job_queue_append(&finished_jobs, &batch);
+    tor_mutex_release(pool_lock);
+    /* Only the first answers in a batch need to wake the main thread. */
+    if (was_empty)
+      cpuworker_wake_main_thread();
+  }
+
+  log_debug(LD_OR,"Pool cpuworker exiting because we have too many.");
+  if (onion_key)
+    crypto_free_pk_env(onion_key);
+  if (last_onion_key)
+    crypto_free_pk_env(last_onion_key);
+  crypto_thread_cleanup();
+  mp_pool_thread_cleanup();
+  spawn_exit();
+}
+
+/** Tell <b>n</b> pool cpuworkers to exit once they finish what they're
+ * doing. */
+static void
+retire_cpuworkers(int n)
+{
+  if (!pool_lock || n <= 0)
+    return;
+  log_info(LD_OR, "Retiring %d cpuworker(s).", n);
+  num_cpuworkers -= n;
+  tor_mutex_acquire(pool_lock);
+  workers_to_retire += n;
+  tor_cond_signal_all(pool_cond);
+  tor_mutex_release(pool_lock);
+}
+
+/** Hand onionskins from the pending onion queue to the pool until every
+ * cpuworker has something to do. */
+static void
+cpuworker_queue_pending_tasks(void)
+{
+  or_circuit_t *circ;
+  const onion_handshake_t *handshake = NULL;
+  char *onionskin = NULL;
+
+  while (num_jobs_outstanding < num_cpuworkers * CPUWORKER_MAX_BATCH &&
+         (circ = onion_next_task(&handshake, &onionskin))) {
+    if (assign_onionskin_to_cpuworker(NULL, circ, handshake, onionskin))
+      log_warn(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+  }
+}
+
+/** Libevent callback: pool cpuworkers have answers for us.  Collect all of
+ * them, answer their circuits, and give the cpuworkers more work. */
+static void
+cpuworker_replies_cb(evutil_socket_t fd, short events, void *arg)
+{
+  cpuworker_job_t *job, *next;
+  struct timeval now;
+  (void)fd;
+  (void)events;
+  (void)arg;
+
+  cpuworker_drain_wakeups();
+
+  tor_mutex_acquire(pool_lock);
+  job = finished_jobs.head;
+  finished_jobs.head = finished_jobs.tail = NULL;
+  finished_jobs.n = 0;
+  tor_mutex_release(pool_lock);
+
+  for ( ; job; job = next) {
+    next = job->next;
+    if (job->work_fn) {
+      job->reply_fn(job->work_arg);
+      tor_free(job);
+      continue;
+    }
+    tor_gettimeofday(&now);
+    rep_hist_note_onionskin_timing(job->handshake->stats_type, job->worker_id,
+                                   (int)job->wait_usec, (int)job->work_usec,
+                                   (int)tv_udiff(&job->when_done, &now));
+    --num_jobs_outstanding;
+    ++jobs_since_adjust;
+    work_usec_since_adjust += job->work_usec;
+    avg_job_wait_usec += (job->wait_usec - avg_job_wait_usec) / 16;
+    cpuworker_onion_answer(job->success, job->conn_id, job->circ_id,
+                           job->handshake, job->reply, job->keys);
+    memset(job, 0, sizeof(cpuworker_job_t));
+    tor_free(job);
+  }
+
+  cpuworker_queue_pending_tasks();
+}
+
+/** Set up the shared state for the cpuworker pool, if we haven't already.
+ * Return 0 on success, -1 on failure. */
+static int
+cpuworker_pool_init(void)
+{
+  evutil_socket_t fd;
+  if (pool_lock)
+    return 0;
+
+#ifdef USE_EVENTFD
+  wakeup_fd = eventfd(0, 0);
+  if (wakeup_fd < 0) {
+    log_warn(LD_GENERAL, "Couldn't create eventfd for cpuworkers: %s",
+             strerror(errno));
+    return -1;
+  }
+  set_socket_nonblocking(wakeup_fd);
+  fd = wakeup_fd;
+#else
+  {
+    int err;
+    if ((err = tor_socketpair(AF_UNIX, SOCK_STREAM, 0, wakeup_fds)) < 0) {
+      log_warn(LD_NET, "Couldn't construct socketpair for cpuworkers: %s",
+               tor_socket_strerror(-err));
+      return -1;
+    }
+    set_socket_nonblocking(wakeup_fds[0]);
+    set_socket_nonblocking(wakeup_fds[1]);
+    fd = wakeup_fds[0];
+  }
+#endif
+
+  wakeup_event = tor_event_new(tor_libevent_get_base(), fd,
+                               EV_READ|EV_PERSIST, cpuworker_replies_cb,
+                               NULL);
+  if (!wakeup_event || event_add(wakeup_event, NULL) < 0) {
+    log_warn(LD_GENERAL, "Couldn't add event for cpuworker answers.");
+    return -1;
+  }
+
+  pool_lock = tor_mutex_new();
+  pool_cond = tor_cond_new();
+  onion_dh_pool_init();
+  return 0;
+}
+
+/** Called when the onion key has changed: tell the pool cpuworkers to pick
+ * up the new keys before their next job.
+ */
+void
+cpuworkers_rotate(void)
+{
+  if (pool_lock) {
+    tor_mutex_acquire(pool_lock);
+    ++onion_key_generation;
+    /* Wake idle workers so they pick up the new keys right away. */
+    tor_cond_signal_all(pool_cond);
+    tor_mutex_release(pool_lock);
+  }
+  /* Hidden services hand their INTRODUCE2 cells to the pool too. */
+  if (server_mode(get_options()) || num_rend_services())
+    spawn_enough_cpuworkers();
+}
+
+/** We never make cpuworker connections when we have a cpuworker pool. */
+int
+connection_cpu_reached_eof(connection_t *conn)
+{
+  log_warn(LD_BUG, "Got EOF on a cpuworker connection, but we use a pool.");
+  connection_mark_for_close(conn);
+  return 0;
+}
+
+/** We never make cpuworker connections when we have a cpuworker pool. */
+int
+connection_cpu_process_inbuf(connection_t *conn)
+{
+  log_warn(LD_BUG, "Got data on a cpuworker connection, but we use a pool.");
+  connection_mark_for_close(conn);
+  return 0;
+}
+
+/** Launch a new pool cpuworker. Return 0 if we're happy, -1 if we failed.
+ */
+static int
+spawn_cpuworker(void)
+{
+  if (cpuworker_pool_init() < 0)
+    return -1;
+  tor_mutex_acquire(pool_lock);
+  ++pool_size;
+  tor_mutex_release(pool_lock);
+  if (spawn_func(cpuworker_thread_main, NULL) < 0) {
+    tor_mutex_acquire(pool_lock);
+    --pool_size;
+    tor_mutex_release(pool_lock);
+    return -1;
+  }
+  log_debug(LD_OR,"just spawned a cpu worker.");
+  return 0;
+}
+
+/** Try to have a pool cpuworker perform the public key operations necessary
+ * to respond to <b>onionskin</b>, the start of <b>handshake</b>, for the
+ * circuit <b>circ</b>.  If every cpuworker already has a job, queue the
+ * task onto the pending onion list instead.  <b>cpuworker</b> must be NULL.
+ * Return 0 if we successfully assign the task, or -1 on failure.
+ */
+int
+assign_onionskin_to_cpuworker(connection_t *cpuworker,
+                              or_circuit_t *circ,
+                              const onion_handshake_t *handshake,
+                              char *onionskin)
+{
+  cpuworker_job_t *job;
+  tor_assert(!cpuworker);
+  tor_assert(handshake->onionskin_len <= MAX_ONIONSKIN_CHALLENGE_LEN);
+
+  if (num_jobs_outstanding >= num_cpuworkers * CPUWORKER_MAX_BATCH) {
+    log_debug(LD_OR,"No idle cpuworkers. Queuing.");
+    if (onion_pending_add(circ, handshake, onionskin) < 0) {
+      tor_free(onionskin);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (!circ->p_conn) {
+    log_info(LD_OR,"circ->p_conn gone. Failing circ.");
+    tor_free(onionskin);
+    return -1;
+  }
+
+  job = tor_malloc_zero(sizeof(cpuworker_job_t));
+  job->conn_id = circ->p_conn->_base.global_identifier;
+  job->circ_id = circ->p_circ_id;
+  job->handshake = handshake;
+  memcpy(job->onionskin, onionskin, handshake->onionskin_len);
+  tor_free(onionskin);
+  tor_gettimeofday(&job->when_queued);
+
+  ++num_jobs_outstanding;
+  tor_mutex_acquire(pool_lock);
+  job_queue_push(&pending_jobs, job);
+  tor_cond_signal_one(pool_cond);
+  tor_mutex_release(pool_lock);
+  return 0;
+}
+
+/** Return true iff cpuworker_queue_work() will accept jobs. */
+int
+cpuworker_can_queue_work(void)
+{
+  return pool_lock != NULL && num_cpuworkers > 0;
+}
+
+/** Return how many pool cpuworkers might be running jobs from
+ * cpuworker_queue_work() at once, or 0 if it won't accept jobs. */
+int
+cpuworker_n_pool_workers(void)
+{
+  return cpuworker_can_queue_work() ? num_cpuworkers : 0;
+}
+
+/** Have a pool cpuworker call <b>work_fn</b>(<b>arg</b>), and then have the
+ * main thread call <b>reply_fn</b>(<b>arg</b>) once it's done.
+ * <b>work_fn</b> must be safe to call from another thread, and must not
+ * touch anything that the main thread might be using.  These jobs go
+ * behind any queued onionskins, but don't count toward the limit on how
+ * many onionskins we hand the pool at once.  Return 0 on success, or -1 if
+ * we have no pool to hand the job to. */
+int
+cpuworker_queue_work(void (*work_fn)(void *arg), void (*reply_fn)(void *arg),
+                     void *arg)
+{
+  cpuworker_job_t *job;
+  tor_assert(work_fn);
+  tor_assert(reply_fn);
+  if (!cpuworker_can_queue_work())
+    return -1;
+
+  job = tor_malloc_zero(sizeof(cpuworker_job_t));
+  job->work_fn = work_fn;
+  job->reply_fn = reply_fn;
+  job->work_arg = arg;
+
+  tor_mutex_acquire(pool_lock);
+  job_queue_push(&pending_jobs, job);
+  tor_cond_signal_one(pool_cond);
+  tor_mutex_release(pool_lock);
+  return 0;
+}
+
+/** Lists shorter than this aren't worth sorting in parallel. */
+#define PARALLEL_SORT_MIN 8192
+/** Don't split a parallel sort into chunks smaller than this. */
+#define PARALLEL_SORT_MIN_CHUNK 2048
+/** Most chunks we split a parallel sort into. */
+#define PARALLEL_SORT_MAX_CHUNKS 8
+
+#ifdef TOR_HAVE_COND
+typedef struct sort_batch_t sort_batch_t;
+
+/** A run of a list that cpuworker_sort_smartlist() is sorting, to be
+ * sorted on its own by whichever thread claims it first. */
+typedef struct sort_chunk_t {
+  sort_batch_t *batch; /**< The sort this chunk belongs to. */
+  int first; /**< Index of the first member of the run. */
+  int n; /**< Number of members in the run. */
+  int claimed; /**< Has some thread started sorting this? */
+} sort_chunk_t;
+
+/** A list being sorted in chunks by cpuworker_sort_smartlist(). */
+struct sort_batch_t {
+  tor_mutex_t *lock; /**< Protects claimed and n_unfinished. */
+  tor_cond_t *cond; /**< Signalled once n_unfinished reaches zero. */
+  int n_unfinished; /**< How many chunks haven't been sorted yet? */
+  /** How many references are there to this batch: one from the sorter,
+   * and one from each job we queued.  Only the main thread touches this. */
+  int refcnt;
+  void **list; /**< The members being sorted. */
+  int (*compare)(const void **a, const void **b); /**< The ordering. */
+  int n_chunks; /**< How many members of chunks are in use? */
+  sort_chunk_t chunks[PARALLEL_SORT_MAX_CHUNKS]; /**< The chunks. */
+};
+
+/** Sort the members in <b>chunk</b> unless another thread has already
+ * started on them.  Safe to call from any thread. */
+static void
+sort_chunk_run(void *arg)
+{
+  sort_chunk_t *chunk = arg;
+  sort_batch_t *batch = chunk->batch;
+
+  tor_mutex_acquire(batch->lock);
+  if (chunk->claimed) {
+    tor_mutex_release(batch->lock);
+    return;
+  }
+  chunk->claimed = 1;
+  tor_mutex_release(batch->lock);
+
+  qsort(batch->list + chunk->first, chunk->n, sizeof(void*),
+        (int (*)(const void *,const void*))batch->compare);
+
+  tor_mutex_acquire(batch->lock);
+  if (--batch->n_unfinished == 0)
+    tor_cond_signal_all(batch->cond);
+  tor_mutex_release(batch->lock);
+}
+
+/** Drop a reference to <b>batch</b>, and free it if that was the last. */
+static void
+sort_batch_decref(sort_batch_t *batch)
+{
+  if (--batch->refcnt)
+    return;
+  tor_mutex_free(batch->lock);
+  tor_cond_free(batch->cond);
+  tor_free(batch);
+}
+
+/** Runs in the main thread once a cpuworker is done with the chunk in
+ * <b>arg</b>. */
+static void
+sort_chunk_reply(void *arg)
+{
+  sort_chunk_t *chunk = arg;
+  sort_batch_decref(chunk->batch);
+}
+
+/** Merge the <b>n_runs</b> sorted runs of the <b>n</b>-member array
+ * <b>list</b>, where run <i>i</i> starts at <b>bounds</b>[<i>i</i>] and
+ * <b>bounds</b>[<b>n_runs</b>] is <b>n</b>, into one sorted array.
+ * Overwrites <b>bounds</b>. */
+static void
+sort_merge_runs(void **list, int n, int *bounds, int n_runs,
+                int (*compare)(const void **a, const void **b))
+{
+  void **tmp = tor_malloc(sizeof(void*)*n), **src = list, **dst = tmp, **t;
+  while (n_runs > 1) {
+    int r, n_out = 0;
+    for (r = 0; r < n_runs; r += 2) {
+      int lo = bounds[r], mid = bounds[r+1];
+      int hi = (r+1 < n_runs) ? bounds[r+2] : mid;
+      int a = lo, b = mid, out = lo;
+      while (a < mid && b < hi) {
+        if (compare((const void**)&src[a], (const void**)&src[b]) <= 0)
+          dst[out++] = src[a++];
+        else
+          dst[out++] = src[b++];
+      }
+      memcpy(dst+out, src+a, sizeof(void*)*(mid-a));
+      out += mid-a;
+      memcpy(dst+out, src+b, sizeof(void*)*(hi-b));
+      bounds[n_out++] = lo;
+    }
+    bounds[n_out] = n;
+    n_runs = n_out;
+    t = src; src = dst; dst = t;
+  }
+  if (src != list)
+    memcpy(list, src, sizeof(void*)*n);
+  tor_free(tmp);
+}
+#endif
+
+/** Sort <b>sl</b> the way smartlist_sort() would, but if it's long and we
+ * have a pool of cpuworkers, split it into chunks that the pool sorts
+ * while we sort others, and then merge them.  <b>compare</b> must be safe
+ * to call from another thread while the main thread waits; it may read,
+ * but not change, global state. */
+void
+cpuworker_sort_smartlist(smartlist_t *sl,
+                         int (*compare)(const void **a, const void **b))
+{
+#ifdef TOR_HAVE_COND
+  sort_batch_t *batch;
+  int bounds[PARALLEL_SORT_MAX_CHUNKS+1];
+  const int n = smartlist_len(sl);
+  int i, n_chunks;
+
+  n_chunks = MIN(cpuworker_n_pool_workers() + 1, PARALLEL_SORT_MAX_CHUNKS);
+  n_chunks = MIN(n_chunks, n / PARALLEL_SORT_MIN_CHUNK);
+  if (n < PARALLEL_SORT_MIN || n_chunks < 2) {
+    smartlist_sort(sl, compare);
+    return;
+  }
+
+  batch = tor_malloc_zero(sizeof(sort_batch_t));
+  batch->lock = tor_mutex_new();
+  batch->cond = tor_cond_new();
+  batch->refcnt = 1;
+  batch->list = sl->list;
+  batch->compare = compare;
+  batch->n_chunks = batch->n_unfinished = n_chunks;
+  for (i = 0; i < n_chunks; ++i) {
+    sort_chunk_t *chunk = &batch->chunks[i];
+    chunk->batch = batch;
+    chunk->first = bounds[i] = (int)(((int64_t)n * i) / n_chunks);
+    chunk->n = (int)(((int64_t)n * (i+1)) / n_chunks) - chunk->first;
+  }
+  bounds[n_chunks] = n;
+
+  for (i = 1; i < n_chunks; ++i) {
+    if (cpuworker_queue_work(sort_chunk_run, sort_chunk_reply,
+                             &batch->chunks[i]) == 0)
+      ++batch->refcnt;
+  }
+  for (i = 0; i < n_chunks; ++i)
+    sort_chunk_run(&batch->chunks[i]);
+  tor_mutex_acquire(batch->lock);
+  while (batch->n_unfinished)
+    tor_cond_wait(batch->cond, batch->lock);
+  tor_mutex_release(batch->lock);
+
+  batch->list = NULL;
+  sort_batch_decref(batch);
+  sort_merge_runs(sl->list, n, bounds, n_chunks, compare);
+#else
+  smartlist_sort(sl, compare);
+#endif
+}
+
+/** Called once a second: every CPUWORKER_ADJUST_INTERVAL, recompute how
+ * busy the pool cpuworkers have been, and if AdaptiveCPUWorkers is set, add
+ * a worker when they're overloaded or remove one when they're mostly
+ * idle. */
+void
+cpuworkers_adjust(time_t now)
+{
+  int elapsed;
+  int target = adaptive_cpuworker_target;
+
+  if (!last_adjust_time || now < last_adjust_time) {
+    last_adjust_time = now;
+    return;
+  }
+  elapsed = (int)(now - last_adjust_time);
+  if (elapsed < CPUWORKER_ADJUST_INTERVAL)
+    return;
+
+  cpuworker_utilization = num_cpuworkers ?
+    U64_TO_DBL(work_usec_since_adjust) /
+      (elapsed * 1000000.0 * num_cpuworkers) : 0.0;
+  /* Nobody waits when there's no work. */
+  if (!jobs_since_adjust)
+    avg_job_wait_usec = 0.0;
+  work_usec_since_adjust = 0;
+  jobs_since_adjust = 0;
+  last_adjust_time = now;
+
+  if (!get_options()->AdaptiveCPUWorkers || !server_mode(get_options()))
+    return;
+
+  if ((cpuworker_utilization > CPUWORKER_GROW_UTILIZATION ||
+       avg_job_wait_usec > CPUWORKER_GROW_WAIT_USEC) &&
+      num_cpuworkers < max_cpuworkers()) {
+    target = num_cpuworkers + 1;
+  } else if (cpuworker_utilization < CPUWORKER_SHRINK_UTILIZATION &&
+             avg_job_wait_usec < CPUWORKER_SHRINK_WAIT_USEC &&
+             num_cpuworkers > MIN_CPUWORKERS) {
+    target = num_cpuworkers - 1;
+  }
+  if (target != adaptive_cpuworker_target) {
+    log_info(LD_OR, "Cpuworker utilization %.0f%%, average wait %.1f msec: "
+             "changing to %d cpuworkers.", cpuworker_utilization*100,
+             avg_job_wait_usec/1000, target);
+    adaptive_cpuworker_target = target;
+    spawn_enough_cpuworkers();
+  }
+}
+
+/** Implementation helper for GETINFO: answers queries about the
+ * cpuworkers. */
+int
+getinfo_helper_cpuworker(control_connection_t *conn,
+                         const char *question, char **answer,
+                         const char **errmsg)
+{
+  (void) conn;
+  (void) errmsg;
+  if (!strcmp(question, "cpuworker/count")) {
+    tor_asprintf(answer, "%d", num_cpuworkers);
+  } else if (!strcmp(question, "cpuworker/jobs-outstanding")) {
+    tor_asprintf(answer, "%d", num_jobs_outstanding);
+  } else if (!strcmp(question, "cpuworker/queue-wait")) {
+    tor_asprintf(answer, "%d", (int)avg_job_wait_usec);
+  } else if (!strcmp(question, "cpuworker/utilization")) {
+    tor_asprintf(answer, "%d", (int)(cpuworker_utilization*100));
+  }
+  return 0;
+}
+
+#else /* !USE_CPUWORKER_THREADPOOL */
+
+/** The tag specifies which circuit this onionskin was from. */
+#define TAG_LEN 10
+/** How many bytes are sent from the cpuworker back to tor? */
+#define LEN_ONION_RESPONSE \
+  (1+TAG_LEN+1+MAX_ONIONSKIN_REPLY_LEN+CPATH_KEY_MATERIAL_LEN)
+
+/** How many of the running cpuworkers have an assigned task right now. */
+static int num_cpuworkers_busy=0;
+/** We need to spawn new cpuworkers whenever we rotate the onion keys
+ * on platforms where execution contexts==processes.  This variable stores
+ * the last time we got a key rotation event. */
+static time_t last_rotation_time=0;
+
+static void cpuworker_main(void *data) ATTR_NORETURN;
+static void process_pending_task(connection_t *cpuworker);
+
 /** Pack global_id and circ_id; set *tag to the result. (See note on
  * cpuworker_main for wire format.) */
 static void
@@ -133,9 +1105,7 @@ connection_cpu_process_inbuf(connection_t *conn)
   char buf[LEN_ONION_RESPONSE];
   uint64_t conn_id;
   circid_t circ_id;
-  connection_t *tmp_conn;
-  or_connection_t *p_conn = NULL;
-  circuit_t *circ;
+  const onion_handshake_t *handshake;
 
   tor_assert(conn);
   tor_assert(conn->type == CONN_TYPE_CPUWORKER);
@@ -153,45 +1123,15 @@ connection_cpu_process_inbuf(connection_t *conn)
 
     /* parse out the circ it was talking about */
     tag_unpack(buf, &conn_id, &circ_id);
-    circ = NULL;
-    tmp_conn = connection_get_by_global_id(conn_id);
-    if (tmp_conn && !tmp_conn->marked_for_close &&
-        tmp_conn->type == CONN_TYPE_OR)
-      p_conn = TO_OR_CONN(tmp_conn);
-
-    if (p_conn)
-      circ = circuit_get_by_circid_orconn(circ_id, p_conn);
-
-    if (success == 0) {
-      log_debug(LD_OR,
-                "decoding onionskin failed. "
-                "(Old key or bad software.) Closing.");
-      if (circ)
-        circuit_mark_for_close(circ, END_CIRC_REASON_TORPROTOCOL);
-      goto done_processing;
-    }
-    if (!circ) {
-      /* This happens because somebody sends us a destroy cell and the
-       * circuit goes away, while the cpuworker is working. This is also
-       * why our tag doesn't include a pointer to the circ, because we'd
-       * never know if it's still valid.
-       */
-      log_debug(LD_OR,"processed onion for a circ that's gone. Dropping.");
-      goto done_processing;
-    }
-    tor_assert(! CIRCUIT_IS_ORIGIN(circ));
-    if (onionskin_answer(TO_OR_CIRCUIT(circ), CELL_CREATED, buf+TAG_LEN,
-                         buf+TAG_LEN+ONIONSKIN_REPLY_LEN) < 0) {
-      log_warn(LD_OR,"onionskin_answer failed. Closing.");
-      circuit_mark_for_close(circ, END_CIRC_REASON_INTERNAL);
-      goto done_processing;
-    }
-    log_debug(LD_OR,"onionskin_answer succeeded. Yay.");
+    handshake = onion_handshake_by_create_cell((uint8_t)buf[TAG_LEN]);
+    tor_assert(handshake);
+    cpuworker_onion_answer(success, conn_id, circ_id, handshake,
+                           buf+TAG_LEN+1,
+                           buf+TAG_LEN+1+MAX_ONIONSKIN_REPLY_LEN);
   } else {
     tor_assert(0); /* don't ask me to do handshakes yet */
   }
 
- done_processing:
   conn->state = CPUWORKER_STATE_IDLE;
   num_cpuworkers_busy--;
   if (conn->timestamp_created < last_rotation_time) {
@@ -210,11 +1150,13 @@ connection_cpu_process_inbuf(connection_t *conn)
  *   Request format:
  *          Task type           [1 byte, always CPUWORKER_TASK_ONION]
  *          Opaque tag          TAG_LEN
- *          Onionskin challenge ONIONSKIN_CHALLENGE_LEN
+ *          Create cell type    [1 byte, selects the onion_handshake_t]
+ *          Onionskin challenge that handshake's onionskin_len
  *   Response format:
  *          Success/failure     [1 byte, boolean.]
  *          Opaque tag          TAG_LEN
- *          Onionskin challenge ONIONSKIN_REPLY_LEN
+ *          Create cell type    [1 byte, as in the request]
+ *          Onionskin reply     MAX_ONIONSKIN_REPLY_LEN
  *          Negotiated keys     KEY_LEN*2+DIGEST_LEN*2
  *
  *  (Note: this _should_ be by addr/port, since we're concerned with specific
@@ -223,14 +1165,15 @@ connection_cpu_process_inbuf(connection_t *conn)
 static void
 cpuworker_main(void *data)
 {
-  char question[ONIONSKIN_CHALLENGE_LEN];
-  uint8_t question_type;
+  char question[MAX_ONIONSKIN_CHALLENGE_LEN];
+  uint8_t question_type, create_type;
+  const onion_handshake_t *handshake;
   tor_socket_t *fdarray = data;
   tor_socket_t fd;
 
   /* variables for onion processing */
   char keys[CPATH_KEY_MATERIAL_LEN];
-  char reply_to_proxy[ONIONSKIN_REPLY_LEN];
+  char reply_to_proxy[MAX_ONIONSKIN_REPLY_LEN];
   char buf[LEN_ONION_RESPONSE];
   char tag[TAG_LEN];
   crypto_pk_env_t *onion_key = NULL, *last_onion_key = NULL;
@@ -245,6 +1188,9 @@ cpuworker_main(void *data)
   tor_free(data);
 
   dup_onion_keys(&onion_key, &last_onion_key);
+  crypto_pk_prepare_private_key(onion_key);
+  if (last_onion_key)
+    crypto_pk_prepare_private_key(last_onion_key);
 
   for (;;) {
     ssize_t r;
@@ -271,28 +1217,34 @@ cpuworker_main(void *data)
       goto end;
     }
 
-    if (read_all(fd, question, ONIONSKIN_CHALLENGE_LEN, 1) !=
-        ONIONSKIN_CHALLENGE_LEN) {
+    if (read_all(fd, (char*)&create_type, 1, 1) != 1 ||
+        !(handshake = onion_handshake_by_create_cell(create_type))) {
+      log_err(LD_BUG,"read handshake type failed. Exiting.");
+      goto end;
+    }
+
+    if (read_all(fd, question, handshake->onionskin_len, 1) !=
+        (ssize_t)handshake->onionskin_len) {
       log_err(LD_BUG,"read question failed. Exiting.");
       goto end;
     }
 
     if (question_type == CPUWORKER_TASK_ONION) {
-      if (onion_skin_server_handshake(question, onion_key, last_onion_key,
-          reply_to_proxy, keys, CPATH_KEY_MATERIAL_LEN) < 0) {
-        /* failure */
-        log_debug(LD_OR,"onion_skin_server_handshake failed.");
+      memset(buf, 0, sizeof(buf));
+      memcpy(buf+1,tag,TAG_LEN);
+      buf[1+TAG_LEN] = (char)create_type;
+      if (handshake->server_handshake(question, onion_key, last_onion_key,
+                       reply_to_proxy, keys, CPATH_KEY_MATERIAL_LEN) < 0) {
+        /* failure; the rest of the answer stays all zeros */
+        log_debug(LD_OR,"%s server handshake failed.", handshake->name);
         *buf = 0; /* indicate failure in first byte */
-        memcpy(buf+1,tag,TAG_LEN);
-        /* send all zeros as answer */
-        memset(buf+1+TAG_LEN, 0, LEN_ONION_RESPONSE-(1+TAG_LEN));
       } else {
         /* success */
-        log_debug(LD_OR,"onion_skin_server_handshake succeeded.");
+        log_debug(LD_OR,"%s server handshake succeeded.", handshake->name);
         buf[0] = 1; /* 1 means success */
-        memcpy(buf+1,tag,TAG_LEN);
-        memcpy(buf+1+TAG_LEN,reply_to_proxy,ONIONSKIN_REPLY_LEN);
-        memcpy(buf+1+TAG_LEN+ONIONSKIN_REPLY_LEN,keys,CPATH_KEY_MATERIAL_LEN);
+        memcpy(buf+1+TAG_LEN+1,reply_to_proxy,handshake->reply_len);
+        memcpy(buf+1+TAG_LEN+1+MAX_ONIONSKIN_REPLY_LEN,keys,
+               CPATH_KEY_MATERIAL_LEN);
       }
       if (write_all(fd, buf, LEN_ONION_RESPONSE, 1) != LEN_ONION_RESPONSE) {
         log_err(LD_BUG,"writing response buf failed. Exiting.");
@@ -308,6 +1260,7 @@ cpuworker_main(void *data)
     crypto_free_pk_env(last_onion_key);
   tor_close_socket(fd);
   crypto_thread_cleanup();
+  mp_pool_thread_cleanup();
   spawn_exit();
 }
 
@@ -361,43 +1314,22 @@ spawn_cpuworker(void)
   return 0; /* success */
 }
 
-/** If we have too few or too many active cpuworkers, try to spawn new ones
- * or kill idle ones.
- */
-static void
-spawn_enough_cpuworkers(void)
-{
-  int num_cpuworkers_needed = get_num_cpus(get_options());
-
-  if (num_cpuworkers_needed < MIN_CPUWORKERS)
-    num_cpuworkers_needed = MIN_CPUWORKERS;
-  if (num_cpuworkers_needed > MAX_CPUWORKERS)
-    num_cpuworkers_needed = MAX_CPUWORKERS;
-
-  while (num_cpuworkers < num_cpuworkers_needed) {
-    if (spawn_cpuworker() < 0) {
-      log_warn(LD_GENERAL,"Cpuworker spawn failed. Will try again later.");
-      return;
-    }
-    num_cpuworkers++;
-  }
-}
-
 /** Take a pending task from the queue and assign it to 'cpuworker'. */
 static void
 process_pending_task(connection_t *cpuworker)
 {
   or_circuit_t *circ;
+  const onion_handshake_t *handshake = NULL;
   char *onionskin = NULL;
 
   tor_assert(cpuworker);
 
   /* for now only process onion tasks */
 
-  circ = onion_next_task(&onionskin);
+  circ = onion_next_task(&handshake, &onionskin);
   if (!circ)
     return;
-  if (assign_onionskin_to_cpuworker(cpuworker, circ, onionskin))
+  if (assign_onionskin_to_cpuworker(cpuworker, circ, handshake, onionskin))
     log_warn(LD_OR,"assign_to_cpuworker failed. Ignoring.");
 }
 
@@ -433,7 +1365,8 @@ cull_wedged_cpuworkers(void)
 }
 
 /** Try to tell a cpuworker to perform the public key operations necessary to
- * respond to <b>onionskin</b> for the circuit <b>circ</b>.
+ * respond to <b>onionskin</b>, the start of <b>handshake</b>, for the
+ * circuit <b>circ</b>.
  *
  * If <b>cpuworker</b> is defined, assert that he's idle, and use him. Else,
  * look for an idle cpuworker and use him. If none idle, queue task onto the
@@ -442,7 +1375,9 @@ cull_wedged_cpuworkers(void)
  */
 int
 assign_onionskin_to_cpuworker(connection_t *cpuworker,
-                              or_circuit_t *circ, char *onionskin)
+                              or_circuit_t *circ,
+                              const onion_handshake_t *handshake,
+                              char *onionskin)
 {
   char qbuf[1];
   char tag[TAG_LEN];
@@ -463,7 +1398,7 @@ assign_onionskin_to_cpuworker(connection_t *cpuworker,
   if (1) {
     if (num_cpuworkers_busy == num_cpuworkers) {
       log_debug(LD_OR,"No idle cpuworkers. Queuing.");
-      if (onion_pending_add(circ, onionskin) < 0) {
+      if (onion_pending_add(circ, handshake, onionskin) < 0) {
         tor_free(onionskin);
         return -1;
       }
@@ -494,9 +1429,62 @@ assign_onionskin_to_cpuworker(connection_t *cpuworker,
     qbuf[0] = CPUWORKER_TASK_ONION;
     connection_write_to_buf(qbuf, 1, cpuworker);
     connection_write_to_buf(tag, sizeof(tag), cpuworker);
-    connection_write_to_buf(onionskin, ONIONSKIN_CHALLENGE_LEN, cpuworker);
+    qbuf[0] = (char)handshake->create_cell_type;
+    connection_write_to_buf(qbuf, 1, cpuworker);
+    connection_write_to_buf(onionskin, handshake->onionskin_len, cpuworker);
     tor_free(onionskin);
   }
   return 0;
 }
 
+/** The socketpair cpuworkers only know how to answer onionskins. */
+int
+cpuworker_can_queue_work(void)
+{
+  return 0;
+}
+
+/** The socketpair cpuworkers only know how to answer onionskins. */
+int
+cpuworker_n_pool_workers(void)
+{
+  return 0;
+}
+
+/** The socketpair cpuworkers only know how to answer onionskins, so we
+ * can't hand them other work. */
+int
+cpuworker_queue_work(void (*work_fn)(void *arg), void (*reply_fn)(void *arg),
+                     void *arg)
+{
+  (void)work_fn;
+  (void)reply_fn;
+  (void)arg;
+  return -1;
+}
+
+/** The socketpair cpuworkers don't report how busy they are, so there is
+ * nothing to adjust. */
+void
+cpuworkers_adjust(time_t now)
+{
+  (void)now;
+}
+
+/** Implementation helper for GETINFO: answers queries about the
+ * cpuworkers. */
+int
+getinfo_helper_cpuworker(control_connection_t *conn,
+                         const char *question, char **answer,
+                         const char **errmsg)
+{
+  (void) conn;
+  (void) errmsg;
+  if (!strcmp(question, "cpuworker/count"))
+    tor_asprintf(answer, "%d", num_cpuworkers);
+  else if (!strcmp(question, "cpuworker/jobs-outstanding"))
+    tor_asprintf(answer, "%d", num_cpuworkers_busy);
+  return 0;
+}
+
+#endif
@@ -17,9 +17,21 @@ void cpuworkers_rotate(void);
 int connection_cpu_finished_flushing(connection_t *conn);
 int connection_cpu_reached_eof(connection_t *conn);
 int connection_cpu_process_inbuf(connection_t *conn);
+struct onion_handshake_t;
 int assign_onionskin_to_cpuworker(connection_t *cpuworker,
                                   or_circuit_t *circ,
+                                  const struct onion_handshake_t *handshake,
                                   char *onionskin);
+int cpuworker_can_queue_work(void);
+int cpuworker_n_pool_workers(void);
+int cpuworker_queue_work(void (*work_fn)(void *arg),
+                         void (*reply_fn)(void *arg), void *arg);
+void cpuworker_sort_smartlist(smartlist_t *sl,
+                         int (*compare)(const void **a, const void **b));
+void cpuworkers_adjust(time_t now);
+int getinfo_helper_cpuworker(control_connection_t *conn,
+                             const char *question, char **answer,
+                             const char **errmsg);
 
 #endif
 
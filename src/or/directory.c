@@ -3,13 +3,16 @@
  * Copyright (c) 2007-2011, The Tor Project, Inc. */
 /* See LICENSE for licensing information */
 
+#define DIRECTORY_PRIVATE
 #include "or.h"
 #include "buffers.h"
 #include "circuitbuild.h"
 #include "config.h"
 #include "connection.h"
 #include "connection_edge.h"
+#include "consdiff.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -25,6 +28,7 @@
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
+#include "sigcache.h"
 
 #if defined(EXPORTMALLINFO) && defined(HAVE_MALLOC_H) && defined(HAVE_MALLINFO)
 #ifndef OPENBSD
@@ -61,6 +65,12 @@ static void directory_send_command(dir_connection_t *conn,
                              int supports_conditional_consensus,
                              time_t if_modified_since);
 static int directory_handle_command(dir_connection_t *conn);
+static int connection_dir_client_finished_response(dir_connection_t *conn);
+static dir_connection_t *connection_dir_get_idle(const char *digest,
+                                                 int use_begindir);
+static void connection_dir_note_descriptor_fetch(dir_connection_t *conn,
+                                                 int n_descs, size_t n_bytes);
+static void connection_dir_note_response_done(dir_connection_t *conn);
 static int body_is_plausible(const char *body, size_t body_len, int purpose);
 static int purpose_needs_anonymity(uint8_t dir_purpose,
                                    uint8_t router_purpose);
@@ -84,6 +94,8 @@ static void dir_microdesc_download_failed(smartlist_t *failed,
                                           int status_code);
 static void note_client_request(int purpose, int compressed, size_t bytes);
 static int client_likes_consensus(networkstatus_t *v, const char *want_url);
+static char *dir_partial_download_range_headers(const char *flavor,
+                                                time_t now);
 
 static void directory_initiate_command_rend(const char *address,
                                             const tor_addr_t *addr,
@@ -209,6 +221,8 @@ dir_conn_purpose_to_string(int purpose)
       return "hidden-service v2 descriptor upload";
     case DIR_PURPOSE_FETCH_MICRODESC:
       return "microdescriptor fetch";
+    case DIR_PURPOSE_IDLE:
+      return "idle connection";
     }
 
   log_warn(LD_BUG, "Called with unknown purpose %d", purpose);
@@ -226,8 +240,8 @@ router_supports_extrainfo(const char *identity_digest, int is_authority)
   if (node && node->ri) {
     if (node->ri->caches_extra_info)
       return 1;
-    if (is_authority && node->ri->platform &&
-        tor_version_as_new_as(node->ri->platform,
+    if (is_authority && router_get_platform(node->ri) &&
+        tor_version_as_new_as(router_get_platform(node->ri),
                               "Tor 0.2.0.0-alpha-dev (r10070)"))
       return 1;
   }
@@ -923,6 +937,23 @@ directory_initiate_command_rend(const char *address, const tor_addr_t *_addr,
     return;
   }
 
+  /* If we already have an open connection to this directory that's done
+   * with its last request, send this request on it too. */
+  if (!anonymized_connection && !payload && !rend_query &&
+      (conn = connection_dir_get_idle(digest, use_begindir))) {
+    log_debug(LD_DIR, "Reusing idle connection to '%s:%d' for %s",
+              conn->_base.address, conn->_base.port,
+              dir_conn_purpose_to_string(dir_purpose));
+    conn->_base.purpose = dir_purpose;
+    conn->router_purpose = router_purpose;
+    conn->_base.state = DIR_CONN_STATE_CLIENT_SENDING;
+    directory_send_command(conn, dir_purpose, !use_begindir, resource,
+                           payload, payload_len,
+                           supports_conditional_consensus,
+                           if_modified_since);
+    return;
+  }
+
   conn = dir_connection_new(tor_addr_family(&addr));
 
   /* set up conn so it's got all the data we need to remember */
@@ -1134,6 +1165,7 @@ directory_send_command(dir_connection_t *conn,
   tor_free(conn->requested_resource);
   if (resource)
     conn->requested_resource = tor_strdup(resource);
+  conn->resumed_download = 0;
 
   /* come up with a string for which Host: we want */
   if (conn->_base.port == 80) {
@@ -1189,6 +1221,30 @@ directory_send_command(dir_connection_t *conn,
                                         resource);
       log_info(LD_DIR, "Downloading consensus from %s using %s",
                hoststring, url);
+      {
+        char digest[DIGEST256_LEN];
+        char *range = dir_partial_download_range_headers(
+                                   resource ? resource : "ns", time(NULL));
+        /* Let the directory say "not modified" if ours is its newest. */
+        if (networkstatus_get_latest_consensus_digest(
+                                   resource ? resource : "ns", digest)) {
+          char hex[HEX_DIGEST256_LEN+1];
+          base16_encode(hex, sizeof(hex), digest, DIGEST256_LEN);
+          tor_asprintf(&header, "If-None-Match: \"%s\"\r\n", hex);
+          smartlist_add(headers, header);
+        }
+        if (range) {
+          /* Ask for the rest of the one we were getting, if the directory
+           * still has it.  That's likely to be less than a diff. */
+          smartlist_add(headers, range);
+        } else if (networkstatus_get_consensus_diff_base(
+                                   resource ? resource : "ns", digest)) {
+          char hex[HEX_DIGEST256_LEN+1];
+          base16_encode(hex, sizeof(hex), digest, DIGEST256_LEN);
+          tor_asprintf(&header, "X-Or-Diff-From-Consensus: %s\r\n", hex);
+          smartlist_add(headers, header);
+        }
+      }
       break;
     case DIR_PURPOSE_FETCH_CERTIFICATE:
       tor_assert(resource);
@@ -1297,6 +1353,18 @@ directory_send_command(dir_connection_t *conn,
     tor_asprintf(&header, "Content-Length: %lu\r\n",
                  payload ? (unsigned long)payload_len : 0);
     smartlist_add(headers, header);
+  } else {
+    if (tor_compress_supports_method(LZMA_METHOD)) {
+      /* Caches that know how can send us smaller documents. */
+      smartlist_add(headers, tor_strdup("Accept-Encoding: x-tor-lzma, "
+                                        "deflate, identity\r\n"));
+    }
+    /* Ask to keep non-anonymous connections open for our next request,
+     * unless there's an HTTP proxy in the way that might not know how. */
+    conn->keep_alive = conn->dirconn_direct && !conn->rend_data &&
+      !(direct && get_options()->HTTPProxy);
+    if (conn->keep_alive)
+      smartlist_add(headers, tor_strdup("Connection: keep-alive\r\n"));
   }
 
   header = smartlist_join_strings(headers, "", 0, NULL);
@@ -1387,6 +1455,17 @@ http_get_header(const char *headers, const char *which)
   return NULL;
 }
 
+/** Return true iff the HTTP message with headers <b>headers</b> asks for
+ * its connection to stay open afterwards. */
+static int
+http_headers_want_keep_alive(const char *headers)
+{
+  char *header = http_get_header(headers, "Connection: ");
+  int r = header && !strcasecmp(header, "keep-alive");
+  tor_free(header);
+  return r;
+}
+
 /** If <b>headers</b> indicates that a proxy was involved, then rewrite
  * <b>conn</b>-\>address to describe our best guess of the address that
  * originated this HTTP request. */
@@ -1483,16 +1562,12 @@ parse_http_response(const char *headers, int *code, time_t *date,
       if (!strcmpstart(s, "Content-Encoding: ")) {
         enc = s+18; break;
       });
-    if (!enc || !strcmp(enc, "identity")) {
+    if (!enc) {
       *compression = NO_METHOD;
-    } else if (!strcmp(enc, "deflate") || !strcmp(enc, "x-deflate")) {
-      *compression = ZLIB_METHOD;
-    } else if (!strcmp(enc, "gzip") || !strcmp(enc, "x-gzip")) {
-      *compression = GZIP_METHOD;
-    } else {
+    } else if ((*compression = compression_method_get_by_name(enc))
+               == UNKNOWN_METHOD) {
       log_info(LD_HTTP, "Unrecognized content encoding: %s. Trying to deal.",
                escaped(enc));
-      *compression = UNKNOWN_METHOD;
     }
   }
   SMARTLIST_FOREACH(parsed_headers, char *, s, tor_free(s));
@@ -1568,6 +1643,502 @@ load_downloaded_routers(const char *body, smartlist_t *which,
   return added;
 }
 
+/** State for a directory response whose body we move off the inbuf as it
+ * arrives, decompressing it on the way if the server compressed it.  We do
+ * this for consensus downloads, so that we never hold the whole compressed
+ * consensus and its decompressed form at the same time, and so that most of
+ * the decompression is done by the time the last byte arrives.  We also do
+ * it on connections we hope to keep open, so we can tell where each
+ * response ends. */
+struct dir_body_stream_t {
+  /** The response headers, already removed from the inbuf. */
+  char *headers;
+  /** The Content-Length of the response, or -1 if it didn't say. */
+  ssize_t content_length;
+  /** True iff we may decompress the body as it arrives. */
+  unsigned int may_decompress:1;
+  /** True iff the server said it would keep the connection open after
+   * this response. */
+  unsigned int keep_alive:1;
+  /** Decompressor for the body, or NULL if we're keeping it verbatim. */
+  tor_zlib_state_t *zlib_state;
+  /** The body we've got so far, with room for <b>body_alloc</b> bytes. */
+  char *body;
+  /** How many bytes of <b>body</b> are used? */
+  size_t body_len;
+  /** How many bytes are allocated for <b>body</b>? */
+  size_t body_alloc;
+  /** How many bytes of body have come in off the network? */
+  size_t raw_len;
+  /** True iff we've seen enough of the body to choose whether to
+   * decompress it. */
+  unsigned int decided:1;
+  /** True iff the decompressor has reached the end of its stream. */
+  unsigned int done:1;
+};
+
+/** How many bytes of body do we look at before deciding whether it's
+ * really compressed the way the headers say? */
+#define DIR_BODY_STREAM_PREFIX_LEN 8
+/** How much space do we allocate for a streamed body at first? */
+#define DIR_BODY_STREAM_INITIAL_ALLOC 16384
+
+/** Return a new dir_body_stream_t for a response with the headers
+ * <b>headers</b>, taking ownership of <b>headers</b>.  If
+ * <b>may_decompress</b>, decompress the body as it arrives when we can. */
+dir_body_stream_t *
+dir_body_stream_new(char *headers, int may_decompress)
+{
+  dir_body_stream_t *stream = tor_malloc_zero(sizeof(dir_body_stream_t));
+  char *length;
+  stream->headers = headers;
+  stream->may_decompress = may_decompress ? 1 : 0;
+  stream->content_length = -1;
+  if ((length = http_get_header(headers, "Content-Length: "))) {
+    int ok;
+    long n = tor_parse_long(length, 10, 0, MAX_DIR_DL_SIZE, &ok, NULL);
+    if (ok)
+      stream->content_length = n;
+    tor_free(length);
+  }
+  /* We can only find the end of a response that tells us its length. */
+  stream->keep_alive = stream->content_length >= 0 &&
+    http_headers_want_keep_alive(headers);
+  return stream;
+}
+
+/** Return the number of bytes of body we still expect to arrive for
+ * <b>stream</b>, or SIZE_T_MAX if we're reading until EOF. */
+static size_t
+dir_body_stream_bytes_wanted(const dir_body_stream_t *stream)
+{
+  if (stream->content_length < 0)
+    return SIZE_T_MAX;
+  if (stream->raw_len >= (size_t)stream->content_length)
+    return 0;
+  return stream->content_length - stream->raw_len;
+}
+
+/** Return true iff all of the response in <b>stream</b> has arrived, and
+ * the server will keep the connection open for another request. */
+int
+dir_body_stream_is_complete(const dir_body_stream_t *stream)
+{
+  return stream->keep_alive && dir_body_stream_bytes_wanted(stream) == 0;
+}
+
+/** Release all storage held by <b>stream</b>. */
+void
+dir_body_stream_free(dir_body_stream_t *stream)
+{
+  if (!stream)
+    return;
+  tor_free(stream->headers);
+  tor_zlib_free(stream->zlib_state);
+  tor_free(stream->body);
+  tor_free(stream);
+}
+
+/** Make sure that <b>stream</b> has room for at least <b>n</b> more bytes
+ * of body, plus a terminating NUL.  Return 0 on success, or -1 if the body
+ * would grow too large. */
+static int
+dir_body_stream_reserve(dir_body_stream_t *stream, size_t n)
+{
+  size_t want = stream->body_len + n + 1;
+  size_t alloc = stream->body_alloc;
+  if (want <= alloc)
+    return 0;
+  if (want >= MAX_DIR_DL_SIZE) {
+    log_warn(LD_HTTP, "Directory response body is too large. Failing.");
+    return -1;
+  }
+  if (alloc < DIR_BODY_STREAM_INITIAL_ALLOC)
+    alloc = DIR_BODY_STREAM_INITIAL_ALLOC;
+  while (alloc < want)
+    alloc *= 2;
+  if (alloc > MAX_DIR_DL_SIZE)
+    alloc = MAX_DIR_DL_SIZE;
+  stream->body = tor_realloc(stream->body, alloc);
+  stream->body_alloc = alloc;
+  return 0;
+}
+
+/** Run <b>len</b> bytes of body at <b>data</b> through the decompressor
+ * in <b>stream</b>, appending the output to the body.  If <b>finish</b>,
+ * this is the end of the input.  Return 0 on success, -1 on failure. */
+static int
+dir_body_stream_process(dir_body_stream_t *stream, const char *data,
+                        size_t len, int finish)
+{
+  char *out;
+  size_t out_len;
+
+  if (stream->done)
+    return 0; /* Ignore anything after the end of the compressed data. */
+
+  while (1) {
+    if (dir_body_stream_reserve(stream, 1) < 0)
+      return -1;
+    out = stream->body + stream->body_len;
+    out_len = stream->body_alloc - stream->body_len - 1;
+    switch (tor_zlib_process(stream->zlib_state, &out, &out_len,
+                             &data, &len, finish)) {
+      case TOR_ZLIB_DONE:
+        stream->body_len = out - stream->body;
+        stream->done = 1;
+        return 0;
+      case TOR_ZLIB_OK:
+        stream->body_len = out - stream->body;
+        /* If we ran out of input while finishing, the body was cut short. */
+        return finish ? -1 : 0;
+      case TOR_ZLIB_BUF_FULL:
+        stream->body_len = out - stream->body;
+        break;
+      case TOR_ZLIB_ERR:
+      default:
+        return -1;
+    }
+  }
+}
+
+/** Now that <b>stream</b> holds the start of the body, decide whether to
+ * decompress it: we do so only for a successful response that's labeled
+ * with a compression method we support and that looks like it's really
+ * compressed that way.  (Otherwise, we keep the body verbatim and let
+ * connection_dir_client_reached_eof() sort it out as usual.)  Return 0 on
+ * success, -1 on failure. */
+static int
+dir_body_stream_decide(dir_body_stream_t *stream)
+{
+  int status_code;
+  compress_method_t compression;
+  char prefix[DIR_BODY_STREAM_PREFIX_LEN];
+  size_t prefix_len = stream->body_len;
+
+  stream->decided = 1;
+  if (!stream->may_decompress)
+    return 0;
+  if (parse_http_response(stream->headers, &status_code, NULL,
+                          &compression, NULL) < 0 ||
+      status_code != 200)
+    return 0;
+  if (compression == NO_METHOD ||
+      !tor_compress_supports_method(compression) ||
+      detect_compression_method(stream->body, stream->body_len) !=
+        compression)
+    return 0;
+  if (!(stream->zlib_state = tor_zlib_new(0, compression,
+                                          HIGH_COMPRESSION)))
+    return 0;
+
+  tor_assert(prefix_len <= sizeof(prefix));
+  memcpy(prefix, stream->body, prefix_len);
+  stream->body_len = 0;
+  return dir_body_stream_process(stream, prefix, prefix_len, 0);
+}
+
+/** Add <b>len</b> bytes of body at <b>data</b> to <b>stream</b>.  Return
+ * 0 on success, -1 on failure. */
+int
+dir_body_stream_add(dir_body_stream_t *stream, const char *data, size_t len)
+{
+  stream->raw_len += len;
+  while (!stream->decided && len) {
+    size_t n = DIR_BODY_STREAM_PREFIX_LEN - stream->body_len;
+    if (n > len)
+      n = len;
+    if (dir_body_stream_reserve(stream, n) < 0)
+      return -1;
+    memcpy(stream->body + stream->body_len, data, n);
+    stream->body_len += n;
+    data += n;
+    len -= n;
+    if (stream->body_len == DIR_BODY_STREAM_PREFIX_LEN &&
+        dir_body_stream_decide(stream) < 0)
+      return -1;
+  }
+  if (!len)
+    return 0;
+
+  if (stream->zlib_state)
+    return dir_body_stream_process(stream, data, len, 0);
+
+  if (dir_body_stream_reserve(stream, len) < 0)
+    return -1;
+  memcpy(stream->body + stream->body_len, data, len);
+  stream->body_len += len;
+  return 0;
+}
+
+/** We've reached the end of the response in <b>stream</b>.  On success,
+ * set *<b>headers_out</b> and *<b>body_out</b> to newly allocated
+ * NUL-terminated copies of the headers and the (decompressed) body,
+ * *<b>body_len_out</b> to the length of the body, *<b>raw_len_out</b> to
+ * the number of bytes that came in over the network, and
+ * *<b>decompressed_out</b> to true iff we decompressed the body; and return
+ * 0.  On failure, return -1.  Either way, free <b>stream</b>. */
+int
+dir_body_stream_finish(dir_body_stream_t *stream,
+                       char **headers_out, char **body_out,
+                       size_t *body_len_out, size_t *raw_len_out,
+                       int *decompressed_out)
+{
+  int r = -1;
+
+  if (!stream->decided && dir_body_stream_decide(stream) < 0)
+    goto done;
+  if (stream->zlib_state &&
+      dir_body_stream_process(stream, "", 0, 1) < 0)
+    goto done;
+  if (dir_body_stream_reserve(stream, 0) < 0)
+    goto done;
+  stream->body[stream->body_len] = '\0';
+
+  *headers_out = stream->headers;
+  *body_out = stream->body;
+  *body_len_out = stream->body_len;
+  *raw_len_out = stream->raw_len;
+  *decompressed_out = stream->zlib_state != NULL;
+  stream->headers = stream->body = NULL;
+  r = 0;
+ done:
+  dir_body_stream_free(stream);
+  return r;
+}
+
+/** A consensus download that broke off partway through.  We keep it,
+ * decompressor state and all, in case a directory can send us the rest of
+ * the same document. */
+typedef struct dir_partial_download_t {
+  /** The response so far. */
+  dir_body_stream_t *stream;
+  /** When did the download break off? */
+  time_t saved_at;
+} dir_partial_download_t;
+
+/** Map from consensus flavor name to the dir_partial_download_t we're
+ * keeping for it. */
+static strmap_t *partial_consensus_downloads = NULL;
+
+/** Don't bother keeping a broken-off consensus download unless we got at
+ * least this many bytes of it. */
+#define DIR_PARTIAL_DOWNLOAD_MIN_BYTES 32768
+/** Forget a broken-off consensus download after this many seconds; by then
+ * there may well be a newer consensus to fetch instead. */
+#define DIR_PARTIAL_DOWNLOAD_MAX_AGE (10*60)
+
+/** Release all storage held by the dir_partial_download_t <b>arg</b>. */
+static void
+dir_partial_download_free(void *arg)
+{
+  dir_partial_download_t *partial = arg;
+  if (!partial)
+    return;
+  dir_body_stream_free(partial->stream);
+  tor_free(partial);
+}
+
+/** Forget any broken-off download of the <b>flavor</b> consensus. */
+static void
+dir_partial_download_discard(const char *flavor)
+{
+  if (partial_consensus_downloads)
+    dir_partial_download_free(strmap_remove(partial_consensus_downloads,
+                                            flavor));
+}
+
+/** Return the broken-off download of the <b>flavor</b> consensus that we
+ * could still resume as of <b>now</b>, or NULL if there is none. */
+static dir_partial_download_t *
+dir_partial_download_get(const char *flavor, time_t now)
+{
+  dir_partial_download_t *partial;
+  if (!partial_consensus_downloads)
+    return NULL;
+  partial = strmap_get(partial_consensus_downloads, flavor);
+  if (partial && partial->saved_at + DIR_PARTIAL_DOWNLOAD_MAX_AGE < now) {
+    dir_partial_download_discard(flavor);
+    partial = NULL;
+  }
+  return partial;
+}
+
+/** A download of the <b>flavor</b> consensus into <b>stream</b> broke off
+ * at <b>now</b>.  If we got enough of it, and know enough about it, to ask
+ * for the rest later, keep it, taking ownership of <b>stream</b>, and
+ * return 1.  Otherwise return 0. */
+int
+dir_partial_download_save(const char *flavor, dir_body_stream_t *stream,
+                          time_t now)
+{
+  dir_partial_download_t *partial;
+  char *etag;
+  int status_code;
+
+  if (stream->done || stream->content_length < 0 ||
+      stream->raw_len < DIR_PARTIAL_DOWNLOAD_MIN_BYTES ||
+      stream->raw_len >= (size_t)stream->content_length)
+    return 0;
+  if (parse_http_response(stream->headers, &status_code, NULL, NULL,
+                          NULL) < 0 || status_code != 200)
+    return 0;
+  /* Without an entity tag, we can't make sure the rest we get is the rest
+   * of the same consensus. */
+  if (!(etag = http_get_header(stream->headers, "ETag: ")))
+    return 0;
+  tor_free(etag);
+
+  if (!partial_consensus_downloads)
+    partial_consensus_downloads = strmap_new();
+  partial = tor_malloc_zero(sizeof(dir_partial_download_t));
+  partial->stream = stream;
+  partial->saved_at = now;
+  dir_partial_download_free(strmap_set(partial_consensus_downloads, flavor,
+                                       partial));
+  log_info(LD_DIR, "Keeping the first %lu of %lu bytes of a %s consensus "
+           "download, so we can ask for the rest.",
+           (unsigned long)stream->raw_len,
+           (unsigned long)stream->content_length, flavor);
+  return 1;
+}
+
+/** If we can resume a broken-off download of the <b>flavor</b> consensus
+ * as of <b>now</b>, return a newly allocated string holding the request
+ * headers to ask for the rest of it.  Otherwise return NULL. */
+static char *
+dir_partial_download_range_headers(const char *flavor, time_t now)
+{
+  dir_partial_download_t *partial = dir_partial_download_get(flavor, now);
+  char *etag, *result;
+  if (!partial)
+    return NULL;
+  etag = http_get_header(partial->stream->headers, "ETag: ");
+  tor_assert(etag);
+  tor_asprintf(&result, "Range: bytes=%lu-\r\nIf-Range: %s\r\n",
+               (unsigned long)partial->stream->raw_len, etag);
+  tor_free(etag);
+  return result;
+}
+
+/** Return true iff the headers <b>h1</b> and <b>h2</b> have the same value
+ * for the header <b>which</b>, or both lack it. */
+static int
+http_headers_agree(const char *h1, const char *h2, const char *which)
+{
+  char *v1 = http_get_header(h1, which);
+  char *v2 = http_get_header(h2, which);
+  int r = (!v1 && !v2) || (v1 && v2 && !strcmp(v1, v2));
+  tor_free(v1);
+  tor_free(v2);
+  return r;
+}
+
+/** We asked for the rest of the <b>flavor</b> consensus, and got a
+ * response with <b>headers</b>.  If it carries the rest of the download
+ * we kept for that flavor, return that download's body stream, taking
+ * ownership of <b>headers</b>, so the body can go on arriving where it
+ * left off.  Otherwise return NULL and leave <b>headers</b> alone; if the
+ * response makes the download we kept useless, forget it. */
+dir_body_stream_t *
+dir_partial_download_resume(const char *flavor, char *headers, time_t now)
+{
+  dir_partial_download_t *partial = dir_partial_download_get(flavor, now);
+  dir_body_stream_t *stream;
+  char *value;
+  size_t start, end, total;
+  int status_code, ok;
+
+  if (!partial ||
+      parse_http_response(headers, &status_code, NULL, NULL, NULL) < 0)
+    return NULL;
+  if (status_code == 200) {
+    /* They're sending us all of some consensus; we'll use that. */
+    dir_partial_download_discard(flavor);
+    return NULL;
+  }
+  if (status_code != 206)
+    return NULL; /* Maybe somebody else can send us the rest. */
+
+  stream = partial->stream;
+  value = http_get_header(headers, "Content-Range: ");
+  ok = value && http_parse_content_range(value, &start, &end, &total) == 0 &&
+    start == stream->raw_len && end == total &&
+    total == (size_t)stream->content_length;
+  tor_free(value);
+  if (ok && (value = http_get_header(headers, "Content-Length: "))) {
+    ok = tor_parse_uint64(value, 10, 0, MAX_DIR_DL_SIZE, NULL, NULL) ==
+      end - start;
+    tor_free(value);
+  }
+  if (!ok || !http_headers_agree(stream->headers, headers, "ETag: ") ||
+      !http_headers_agree(stream->headers, headers, "Content-Encoding: ")) {
+    log_info(LD_DIR, "Partial %s consensus response doesn't continue the "
+             "download we kept. Discarding that download.", flavor);
+    dir_partial_download_discard(flavor);
+    return NULL;
+  }
+
+  partial->stream = NULL;
+  dir_partial_download_discard(flavor);
+  tor_free(stream->headers);
+  stream->headers = headers;
+  stream->keep_alive = http_headers_want_keep_alive(headers);
+  return stream;
+}
+
+/** Release all storage held by directory.c. */
+void
+directory_free_all(void)
+{
+  strmap_free(partial_consensus_downloads, dir_partial_download_free);
+  partial_consensus_downloads = NULL;
+}
+
+/** Called when more of a response has arrived on <b>conn</b>.  Once all
+ * the response headers are here, take them off the inbuf, and from then on
+ * move body bytes off the inbuf into conn-\>body_stream as they arrive.
+ * Return 0 on success, or -1 if the response is unusable. */
+static int
+connection_dir_client_stream_body(dir_connection_t *conn)
+{
+  char buf[4096];
+  size_t n, wanted;
+
+  if (!conn->body_stream) {
+    char *headers = NULL;
+    /* If the headers are too long, we'll notice at EOF. */
+    if (connection_fetch_from_buf_http(TO_CONN(conn),
+                                       &headers, MAX_HEADERS_SIZE,
+                                       NULL, NULL, MAX_DIR_DL_SIZE, 1) != 1)
+      return 0;
+    if (conn->_base.purpose == DIR_PURPOSE_FETCH_CONSENSUS &&
+        conn->requested_resource &&
+        (conn->body_stream = dir_partial_download_resume(
+                       conn->requested_resource, headers, time(NULL)))) {
+      log_info(LD_DIR, "Resuming %s consensus download from '%s:%d' at "
+               "byte %lu.", conn->requested_resource, conn->_base.address,
+               conn->_base.port, (unsigned long)conn->body_stream->raw_len);
+      conn->resumed_download = 1;
+    } else {
+      conn->body_stream = dir_body_stream_new(headers,
+                    conn->_base.purpose == DIR_PURPOSE_FETCH_CONSENSUS);
+    }
+  }
+
+  while ((n = connection_get_inbuf_len(TO_CONN(conn))) &&
+         (wanted = dir_body_stream_bytes_wanted(conn->body_stream))) {
+    if (n > wanted)
+      n = wanted;
+    if (n > sizeof(buf))
+      n = sizeof(buf);
+    connection_fetch_from_buf(buf, n, TO_CONN(conn));
+    if (dir_body_stream_add(conn->body_stream, buf, n) < 0)
+      return -1;
+  }
+  return 0;
+}
+
 /** We are a client, and we've finished reading the server's
  * response. Parse it and act appropriately.
  *
@@ -1596,22 +2167,43 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
   int was_compressed=0;
   time_t now = time(NULL);
 
-  switch (connection_fetch_from_buf_http(TO_CONN(conn),
-                              &headers, MAX_HEADERS_SIZE,
-                              &body, &body_len, MAX_DIR_DL_SIZE,
-                              allow_partial)) {
-    case -1: /* overflow */
-      log_warn(LD_PROTOCOL,
-               "'fetch' response too large (server '%s:%d'). Closing.",
-               conn->_base.address, conn->_base.port);
-      return -1;
-    case 0:
-      log_info(LD_HTTP,
-               "'fetch' response not all here, but we're at eof. Closing.");
+  if (conn->body_stream &&
+      conn->_base.purpose == DIR_PURPOSE_FETCH_CONSENSUS &&
+      dir_body_stream_bytes_wanted(conn->body_stream) != 0 &&
+      conn->body_stream->content_length >= 0) {
+    /* Leave what we got for connection_dir_about_to_close() to keep. */
+    log_info(LD_HTTP, "Consensus response from server '%s:%d' was cut "
+             "short.", conn->_base.address, conn->_base.port);
+    return -1;
+  }
+  if (conn->body_stream) {
+    dir_body_stream_t *stream = conn->body_stream;
+    conn->body_stream = NULL;
+    if (dir_body_stream_finish(stream, &headers, &body, &body_len,
+                               &orig_len, &was_compressed) < 0) {
+      log_fn(LOG_PROTOCOL_WARN, LD_HTTP,
+             "Unable to decompress HTTP body (server '%s:%d').",
+             conn->_base.address, conn->_base.port);
       return -1;
-    /* case 1, fall through */
+    }
+  } else {
+    switch (connection_fetch_from_buf_http(TO_CONN(conn),
+                                &headers, MAX_HEADERS_SIZE,
+                                &body, &body_len, MAX_DIR_DL_SIZE,
+                                allow_partial)) {
+      case -1: /* overflow */
+        log_warn(LD_PROTOCOL,
+                 "'fetch' response too large (server '%s:%d'). Closing.",
+                 conn->_base.address, conn->_base.port);
+        return -1;
+      case 0:
+        log_info(LD_HTTP,
+                 "'fetch' response not all here, but we're at eof. Closing.");
+        return -1;
+      /* case 1, fall through */
+    }
+    orig_len = body_len;
   }
-  orig_len = body_len;
 
   if (parse_http_response(headers, &status_code, &date_header,
                           &compression, &reason) < 0) {
@@ -1621,6 +2213,15 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
     return -1;
   }
   if (!reason) reason = tor_strdup("[no reason given]");
+  if (status_code == 206 && conn->resumed_download) {
+    /* The body now holds the whole document, not just the part this
+     * response carried. */
+    status_code = 200;
+  }
+  if (was_compressed) {
+    /* We already decompressed the body as it arrived. */
+    compression = NO_METHOD;
+  }
 
   log_debug(LD_DIR,
             "Received response from directory server '%s:%d': %d %s "
@@ -1699,6 +2300,8 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
         description1 = "as deflated";
       else if (compression == GZIP_METHOD)
         description1 = "as gzipped";
+      else if (compression == LZMA_METHOD)
+        description1 = "as LZMA-compressed";
       else if (compression == NO_METHOD)
         description1 = "as uncompressed";
       else
@@ -1707,6 +2310,8 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
         description2 = "deflated";
       else if (guessed == GZIP_METHOD)
         description2 = "gzipped";
+      else if (guessed == LZMA_METHOD)
+        description2 = "LZMA-compressed";
       else if (!plausible)
         description2 = "confusing binary junk";
       else
@@ -1719,13 +2324,12 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
                (compression>0 && guessed>0)?"  Trying both.":"");
     }
     /* Try declared compression first if we can. */
-    if (compression == GZIP_METHOD  || compression == ZLIB_METHOD)
+    if (tor_compress_supports_method(compression))
       tor_gzip_uncompress(&new_body, &new_len, body, body_len, compression,
                           !allow_partial, LOG_PROTOCOL_WARN);
     /* Okay, if that didn't work, and we think that it was compressed
      * differently, try that. */
-    if (!new_body &&
-        (guessed == GZIP_METHOD || guessed == ZLIB_METHOD) &&
+    if (!new_body && tor_compress_supports_method(guessed) &&
         compression != guessed)
       tor_gzip_uncompress(&new_body, &new_len, body, body_len, guessed,
                           !allow_partial, LOG_PROTOCOL_WARN);
@@ -1820,9 +2424,15 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
   if (conn->_base.purpose == DIR_PURPOSE_FETCH_CONSENSUS) {
     int r;
     const char *flavname = conn->requested_resource;
+    if (status_code == 304) {
+      log_info(LD_DIR, "Server '%s:%d' has no %s consensus newer than ours.",
+               conn->_base.address, conn->_base.port, flavname);
+      tor_free(body); tor_free(headers); tor_free(reason);
+      networkstatus_consensus_not_modified(flavname, now);
+      return 0;
+    }
     if (status_code != 200) {
-      int severity = (status_code == 304) ? LOG_INFO : LOG_WARN;
-      log(severity, LD_DIR,
+      log_warn(LD_DIR,
           "Received http status code %d (%s) from server "
           "'%s:%d' while fetching consensus directory.",
            status_code, escaped(reason), conn->_base.address,
@@ -1833,6 +2443,20 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
     }
     log_info(LD_DIR,"Received consensus directory (size %d) from server "
              "'%s:%d'", (int)body_len, conn->_base.address, conn->_base.port);
+    if (consdiff_is_diff(body)) {
+      char *applied = networkstatus_apply_consensus_diff(flavname, body);
+      if (!applied) {
+        log_info(LD_DIR, "Unusable consensus diff from server '%s:%d'. "
+                 "I'll try again soon.",
+                 conn->_base.address, conn->_base.port);
+        tor_free(body); tor_free(headers); tor_free(reason);
+        networkstatus_consensus_download_failed(0, flavname);
+        return -1;
+      }
+      tor_free(body);
+      body = applied;
+      body_len = strlen(body);
+    }
     if ((r=networkstatus_set_current_consensus(body, flavname, 0))<0) {
       log_fn(r<-1?LOG_WARN:LOG_INFO, LD_DIR,
              "Unable to load %s consensus directory downloaded from "
@@ -1984,6 +2608,9 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
                n_asked_for-smartlist_len(which), n_asked_for,
                was_ei ? "extra-info documents" : "router descriptors",
                conn->_base.address, (int)conn->_base.port);
+      if (!was_ei)
+        connection_dir_note_descriptor_fetch(conn,
+                                   n_asked_for-smartlist_len(which), orig_len);
       if (smartlist_len(which)) {
         dir_routerdesc_download_failed(which, status_code,
                                        conn->router_purpose,
@@ -2020,9 +2647,12 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
       return 0;
     } else {
       smartlist_t *mds;
+      int n_asked_for = smartlist_len(which);
       mds = microdescs_add_to_cache(get_microdesc_cache(),
                                     body, body+body_len, SAVED_NOWHERE, 0,
                                     now, which);
+      connection_dir_note_descriptor_fetch(conn,
+                                   n_asked_for-smartlist_len(which), orig_len);
       if (smartlist_len(which)) {
         /* Mark remaining ones as failed. */
         dir_microdesc_download_failed(which, status_code);
@@ -2276,6 +2906,127 @@ connection_dir_reached_eof(dir_connection_t *conn)
   return retval;
 }
 
+/** How long do we keep an idle directory connection around in case we
+ * want to make another request on it? */
+#define DIR_CONN_MAX_IDLE 60
+
+/** We're a client, and the whole of a response the server promised to
+ * follow with a kept-open connection has arrived on <b>conn</b>.  Handle
+ * the response, and if that went well, keep <b>conn</b> around for our
+ * next request to the same directory. */
+static int
+connection_dir_client_finished_response(dir_connection_t *conn)
+{
+  int retval = connection_dir_client_reached_eof(conn);
+  if (retval < 0 || conn->_base.marked_for_close) {
+    if (!conn->_base.marked_for_close)
+      connection_mark_for_close(TO_CONN(conn));
+    return retval;
+  }
+  log_debug(LD_DIR, "Finished a response from '%s:%d'; keeping the "
+            "connection open.", conn->_base.address, conn->_base.port);
+  if (conn->_base.purpose == DIR_PURPOSE_FETCH_SERVERDESC ||
+      conn->_base.purpose == DIR_PURPOSE_FETCH_MICRODESC)
+    router_descriptor_fetch_finished(conn->_base.purpose);
+  /* Don't let anybody mistake this for a fetch in progress. */
+  conn->_base.purpose = DIR_PURPOSE_IDLE;
+  conn->_base.state = DIR_CONN_STATE_CLIENT_IDLE;
+  tor_free(conn->requested_resource);
+  return 0;
+}
+
+/** Return true iff <b>conn</b> is a directory connection that we kept
+ * open after a response, and that has been idle for too long since. */
+int
+connection_dir_is_idle_expired(connection_t *conn, time_t now)
+{
+  time_t last_active;
+  if (conn->type != CONN_TYPE_DIR)
+    return 0;
+  last_active = MAX(conn->timestamp_lastread, conn->timestamp_lastwritten);
+  if (conn->state == DIR_CONN_STATE_CLIENT_IDLE)
+    return last_active + DIR_CONN_MAX_IDLE < now;
+  /* Give clients a while longer, so that they're the ones who close. */
+  if (conn->state == DIR_CONN_STATE_SERVER_COMMAND_WAIT &&
+      TO_DIR_CONN(conn)->answered_request)
+    return last_active + 2*DIR_CONN_MAX_IDLE < now;
+  return 0;
+}
+
+/** Tell the router list how quickly <b>conn</b>, a descriptor fetch,
+ * gave us <b>n_descs</b> descriptors in <b>n_bytes</b> bytes on the wire. */
+static void
+connection_dir_note_descriptor_fetch(dir_connection_t *conn, int n_descs,
+                                     size_t n_bytes)
+{
+  struct timeval now;
+  if (n_descs <= 0 || !conn->request_sent.tv_sec)
+    return;
+  tor_gettimeofday(&now);
+  router_note_descriptor_fetch(conn->_base.purpose, n_descs, n_bytes,
+                               tv_udiff(&conn->request_sent, &now));
+}
+
+/** Don't give up on a descriptor fetch for being slow until it has been
+ * going for at least this many seconds. */
+#define DESC_FETCH_MIN_TIME_BEFORE_SLOW 15
+/** A descriptor fetch is slow if it has received less than one part in this
+ * many of what we'd expect from our recent fetches. */
+#define DESC_FETCH_SLOW_FRACTION 8
+
+/** Return true iff <b>conn</b> is a descriptor fetch that has been getting
+ * its answer at a small fraction of the rate our recent fetches have seen,
+ * so that we'd do better to ask somebody else. */
+int
+connection_dir_is_slow_descriptor_fetch(connection_t *conn, time_t now)
+{
+  dir_connection_t *dir_conn;
+  double rate;
+  size_t received;
+  time_t elapsed;
+  if (conn->type != CONN_TYPE_DIR ||
+      conn->state != DIR_CONN_STATE_CLIENT_READING ||
+      (conn->purpose != DIR_PURPOSE_FETCH_SERVERDESC &&
+       conn->purpose != DIR_PURPOSE_FETCH_MICRODESC))
+    return 0;
+  dir_conn = TO_DIR_CONN(conn);
+  if (!dir_conn->request_sent.tv_sec)
+    return 0;
+  elapsed = now - dir_conn->request_sent.tv_sec;
+  if (elapsed < DESC_FETCH_MIN_TIME_BEFORE_SLOW)
+    return 0;
+  rate = router_get_descriptor_fetch_rate(conn->purpose);
+  if (rate <= 0)
+    return 0;
+  received = connection_get_inbuf_len(conn);
+  if (dir_conn->body_stream)
+    received += dir_conn->body_stream->raw_len;
+  return received * DESC_FETCH_SLOW_FRACTION < rate * elapsed;
+}
+
+/** Return an open, idle directory connection to the directory with
+ * identity <b>digest</b> on which we can make another request, or NULL if
+ * there is none.  If <b>use_begindir</b>, the connection must be tunneled
+ * over an OR connection; otherwise it must be a direct connection to the
+ * DirPort. */
+static dir_connection_t *
+connection_dir_get_idle(const char *digest, int use_begindir)
+{
+  smartlist_t *conns = get_connection_array();
+  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, c) {
+    if (c->type != CONN_TYPE_DIR ||
+        c->purpose != DIR_PURPOSE_IDLE ||
+        c->state != DIR_CONN_STATE_CLIENT_IDLE ||
+        c->marked_for_close || c->inbuf_reached_eof ||
+        !c->linked != !use_begindir ||
+        connection_get_inbuf_len(c))
+      continue;
+    if (tor_memeq(TO_DIR_CONN(c)->identity_digest, digest, DIGEST_LEN))
+      return TO_DIR_CONN(c);
+  } SMARTLIST_FOREACH_END(c);
+  return NULL;
+}
+
 /** If any directory object is arriving, and it's over 10MB large, we're
  * getting DoS'd.  (As of 0.1.2.x, raw directories are about 1MB, and we never
  * ask for more than 96 router descriptors at a time.)
@@ -2299,13 +3050,36 @@ connection_dir_process_inbuf(dir_connection_t *conn)
 
   /* If we're on the dirserver side, look for a command. */
   if (conn->_base.state == DIR_CONN_STATE_SERVER_COMMAND_WAIT) {
-    if (directory_handle_command(conn) < 0) {
+    struct timeval start;
+    int r;
+    tor_gettimeofday(&start);
+    r = directory_handle_command(conn);
+    rep_hist_note_handler_time(HANDLER_DIR_COMMAND, &start);
+    if (r < 0) {
       connection_mark_for_close(TO_CONN(conn));
       return -1;
     }
     return 0;
   }
 
+  /* Consensus documents are big: handle them as they arrive, rather than
+   * letting the whole compressed body pile up on the inbuf.  On connections
+   * we hope to reuse, we need to find where each response ends. */
+  if (conn->_base.state == DIR_CONN_STATE_CLIENT_READING &&
+      (conn->_base.purpose == DIR_PURPOSE_FETCH_CONSENSUS ||
+       conn->keep_alive)) {
+    if (connection_dir_client_stream_body(conn) < 0) {
+      log_fn(LOG_PROTOCOL_WARN, LD_HTTP,
+             "Unable to handle HTTP body (server '%s:%d'). Closing.",
+             conn->_base.address, conn->_base.port);
+      connection_mark_for_close(TO_CONN(conn));
+      return -1;
+    }
+    if (conn->keep_alive && conn->body_stream &&
+        dir_body_stream_is_complete(conn->body_stream))
+      return connection_dir_client_finished_response(conn);
+  }
+
   if (connection_get_inbuf_len(TO_CONN(conn)) > MAX_DIRECTORY_OBJECT_SIZE) {
     log_warn(LD_HTTP, "Too much data received from directory connection: "
              "denial of service attempt, or you need to upgrade?");
@@ -2330,6 +3104,25 @@ connection_dir_about_to_close(dir_connection_t *dir_conn)
      * failed: forget about this router, and maybe try again. */
     connection_dir_request_failed(dir_conn);
   }
+  if (conn->purpose == DIR_PURPOSE_FETCH_SERVERDESC ||
+      conn->purpose == DIR_PURPOSE_FETCH_MICRODESC)
+    router_descriptor_fetch_finished(conn->purpose);
+  /* If a consensus download broke off partway, maybe we can get the rest
+   * of it next time. */
+  if (conn->purpose == DIR_PURPOSE_FETCH_CONSENSUS &&
+      dir_conn->body_stream && dir_conn->requested_resource &&
+      dir_partial_download_save(dir_conn->requested_resource,
+                                dir_conn->body_stream, time(NULL)))
+    dir_conn->body_stream = NULL;
+  connection_dirserv_stop_spooling(dir_conn);
+  /* Count a response the client hung up on, too. */
+  connection_dir_note_response_done(dir_conn);
+  /* Let any other streams waiting on this fetch launch their own. */
+  if ((conn->purpose == DIR_PURPOSE_FETCH_RENDDESC_V2 ||
+       conn->purpose == DIR_PURPOSE_HAS_FETCHED_RENDDESC) &&
+      dir_conn->rend_data)
+    rend_client_desc_fetch_done(dir_conn->rend_data,
+                       conn->purpose == DIR_PURPOSE_HAS_FETCHED_RENDDESC);
   /* If we were trying to fetch a v2 rend desc and did not succeed,
    * retry as needed. (If a fetch is successful, the connection state
    * is changed to DIR_PURPOSE_HAS_FETCHED_RENDDESC to mark that
@@ -2348,23 +3141,27 @@ write_http_status_line(dir_connection_t *conn, int status,
                        const char *reason_phrase)
 {
   char buf[256];
-  if (tor_snprintf(buf, sizeof(buf), "HTTP/1.0 %d %s\r\n\r\n",
-      status, reason_phrase ? reason_phrase : "OK") < 0) {
+  if (tor_snprintf(buf, sizeof(buf), "HTTP/1.0 %d %s\r\n%s\r\n",
+      status, reason_phrase ? reason_phrase : "OK",
+      conn->keep_alive ?
+        "Connection: keep-alive\r\nContent-Length: 0\r\n" : "") < 0) {
     log_warn(LD_BUG,"status line too long.");
     return;
   }
   connection_write_to_buf(buf, strlen(buf), TO_CONN(conn));
 }
 
-/** Write the header for an HTTP/1.0 response onto <b>conn</b>-\>outbuf,
- * with <b>type</b> as the Content-Type.
+/** Write the header for an HTTP/1.0 response with status <b>status</b>
+ * and <b>reason_phrase</b> onto <b>conn</b>-\>outbuf, with <b>type</b> as
+ * the Content-Type.
  *
  * If <b>length</b> is nonnegative, it is the Content-Length.
  * If <b>encoding</b> is provided, it is the Content-Encoding.
  * If <b>cache_lifetime</b> is greater than 0, the content may be cached for
  * up to cache_lifetime seconds.  Otherwise, the content may not be cached. */
 static void
-write_http_response_header_impl(dir_connection_t *conn, ssize_t length,
+write_http_response_header_status(dir_connection_t *conn, int status,
+                           const char *reason_phrase, ssize_t length,
                            const char *type, const char *encoding,
                            const char *extra_headers,
                            long cache_lifetime)
@@ -2379,8 +3176,8 @@ write_http_response_header_impl(dir_connection_t *conn, ssize_t length,
   format_rfc1123_time(date, now);
   cp = tmp;
   tor_snprintf(cp, sizeof(tmp),
-               "HTTP/1.0 200 OK\r\nDate: %s\r\n",
-               date);
+               "HTTP/1.0 %d %s\r\nDate: %s\r\n",
+               status, reason_phrase, date);
   cp += strlen(tmp);
   if (type) {
     tor_snprintf(cp, sizeof(tmp)-(cp-tmp), "Content-Type: %s\r\n", type);
@@ -2403,6 +3200,13 @@ write_http_response_header_impl(dir_connection_t *conn, ssize_t length,
     tor_snprintf(cp, sizeof(tmp)-(cp-tmp),
                  "Content-Length: %ld\r\n", (long)length);
     cp += strlen(cp);
+  } else {
+    /* The client can only find the end of the response at EOF. */
+    conn->keep_alive = 0;
+  }
+  if (conn->keep_alive) {
+    strlcpy(cp, "Connection: keep-alive\r\n", sizeof(tmp)-(cp-tmp));
+    cp += strlen(cp);
   }
   if (cache_lifetime > 0) {
     char expbuf[RFC1123_TIME_LEN+1];
@@ -2429,40 +3233,282 @@ write_http_response_header_impl(dir_connection_t *conn, ssize_t length,
   connection_write_to_buf(tmp, strlen(tmp), TO_CONN(conn));
 }
 
-/** As write_http_response_header_impl, but sets encoding and content-typed
- * based on whether the response will be <b>compressed</b> or not. */
+/** As write_http_response_header_status, for a 200 OK response. */
 static void
-write_http_response_header(dir_connection_t *conn, ssize_t length,
-                           int compressed, long cache_lifetime)
+write_http_response_header_impl(dir_connection_t *conn, ssize_t length,
+                           const char *type, const char *encoding,
+                           const char *extra_headers,
+                           long cache_lifetime)
 {
-  write_http_response_header_impl(conn, length,
-                          compressed?"application/octet-stream":"text/plain",
-                          compressed?"deflate":"identity",
-                             NULL,
-                             cache_lifetime);
+  write_http_response_header_status(conn, 200, "OK", length, type, encoding,
+                                    extra_headers, cache_lifetime);
 }
 
-#ifdef INSTRUMENT_DOWNLOADS
-typedef struct request_t {
-  uint64_t bytes; /**< How many bytes have we transferred? */
-  uint64_t count; /**< How many requests have we made? */
-} request_t;
-
-/** Map used to keep track of how much data we've up/downloaded in what kind
- * of request.  Maps from request type to pointer to request_t. */
-static strmap_t *request_map = NULL;
+/** If the client that sent us the request <b>headers</b> accepts LZMA and
+ * we can make it, return LZMA_METHOD.  Otherwise return ZLIB_METHOD. */
+static compress_method_t
+parse_accept_encoding(const char *headers)
+{
+  char *header = http_get_header(headers, "Accept-Encoding: ");
+  compress_method_t result = ZLIB_METHOD;
+  smartlist_t *encodings;
+  if (!header)
+    return ZLIB_METHOD;
+  encodings = smartlist_create();
+  smartlist_split_string(encodings, header, ",",
+                         SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+  SMARTLIST_FOREACH(encodings, char *, e, {
+    if (compression_method_get_by_name(e) == LZMA_METHOD &&
+        tor_compress_supports_method(LZMA_METHOD))
+      result = LZMA_METHOD;
+    tor_free(e);
+  });
+  smartlist_free(encodings);
+  tor_free(header);
+  return result;
+}
 
-/** Record that a client request of <b>purpose</b> was made, and that
- * <b>bytes</b> bytes of possibly <b>compressed</b> data were sent/received.
- * Used to keep track of how much we've up/downloaded in what kind of
- * request. */
+/** We're about to spool the cached body <b>d</b> on <b>conn</b>,
+ * compressed.  If the client asked for <b>method</b> and we have or can
+ * make <b>d</b> compressed that way, use it for this response. */
 static void
-note_client_request(int purpose, int compressed, size_t bytes)
+dir_choose_spool_method(dir_connection_t *conn, cached_dir_t *d,
+                        compress_method_t method)
 {
-  char *key;
-  const char *kind = NULL;
-  switch (purpose) {
-    case DIR_PURPOSE_FETCH_V2_NETWORKSTATUS: kind = "dl/status"; break;
+  size_t len;
+  if (method == LZMA_METHOD && d &&
+      cached_dir_get_compressed(d, LZMA_METHOD, &len))
+    conn->spool_method = LZMA_METHOD;
+}
+
+/** <b>conn</b> is about to spool the documents listed in its
+ * fingerprint_stack, compressed, for a client that prefers <b>method</b>.
+ * If we have (or can make) a compressed copy of that whole batch, spool
+ * that instead, and return 1.  Otherwise return 0 and leave <b>conn</b>
+ * alone. */
+static int
+dir_spool_compressed_batch(dir_connection_t *conn, compress_method_t method)
+{
+  cached_dir_t *d = dirserv_get_compressed_spool_batch(
+                             conn->dir_spool_src, conn->fingerprint_stack,
+                             connection_dir_is_encrypted(conn));
+  if (!d)
+    return 0;
+  dir_choose_spool_method(conn, d, method);
+  SMARTLIST_FOREACH(conn->fingerprint_stack, char *, fp, tor_free(fp));
+  smartlist_free(conn->fingerprint_stack);
+  conn->fingerprint_stack = NULL;
+  conn->cached_dir = d;
+  conn->cached_dir_offset = 0;
+  conn->dir_spool_src = DIR_SPOOL_CACHED_DIR;
+  return 1;
+}
+
+/** Return how much memory a zlib compressor for a response of about
+ * <b>n_bytes</b> bytes (or -1 if we can't tell) should use.  We use as
+ * much as helps, unless so many connections are spooling that they're
+ * short of buffer space; then we use less, especially for small
+ * responses, where a big window buys little. */
+static zlib_compression_level_t
+choose_compression_level(ssize_t n_bytes)
+{
+  if (! dirserv_spool_is_congested())
+    return HIGH_COMPRESSION;
+  else if (n_bytes >= 0 && n_bytes < 2048)
+    return LOW_COMPRESSION;
+  else
+    return MEDIUM_COMPRESSION;
+}
+
+/** Return the number of bytes we'll send if we spool the cached body
+ * <b>d</b> on <b>conn</b>, or -1 if we can't tell in advance. */
+static ssize_t
+dir_cached_dir_spool_len(dir_connection_t *conn, cached_dir_t *d,
+                         int compressed)
+{
+  size_t len;
+  if (!compressed)
+    return d->dir ? (ssize_t)d->dir_len : -1;
+  if (!cached_dir_get_compressed(d, conn->spool_method == LZMA_METHOD ?
+                                 LZMA_METHOD : ZLIB_METHOD, &len))
+    return -1;
+  return len;
+}
+
+/** Return the number of bytes <b>conn</b> will spool in response to the
+ * current request, or -1 if we can't tell in advance. */
+static ssize_t
+dir_spool_len(dir_connection_t *conn, int compressed)
+{
+  if (conn->dir_spool_src != DIR_SPOOL_CACHED_DIR || !conn->cached_dir)
+    return -1;
+  return dir_cached_dir_spool_len(conn, conn->cached_dir, compressed);
+}
+
+/** As write_http_response_header_impl, but sets encoding and content-typed
+ * based on whether the response will be <b>compressed</b> or not, and if so,
+ * on conn-\>spool_method.  If <b>extra_headers</b> is provided, it's
+ * added to the response header.  If <b>partial</b>, the response is a 206
+ * carrying only part of the document. */
+static void
+write_http_response_headers(dir_connection_t *conn, ssize_t length,
+                            int compressed, const char *extra_headers,
+                            long cache_lifetime, int partial)
+{
+  write_http_response_header_status(conn, partial ? 206 : 200,
+                          partial ? "Partial Content" : "OK", length,
+                          compressed?"application/octet-stream":"text/plain",
+                          compressed?compression_method_get_name(
+                                       conn->spool_method == LZMA_METHOD ?
+                                       LZMA_METHOD : ZLIB_METHOD):"identity",
+                             extra_headers,
+                             cache_lifetime);
+}
+
+/** As write_http_response_headers, with no extra headers. */
+static void
+write_http_response_header(dir_connection_t *conn, ssize_t length,
+                           int compressed, long cache_lifetime)
+{
+  write_http_response_headers(conn, length, compressed, NULL,
+                              cache_lifetime, 0);
+}
+
+/** Return true iff <b>tag</b> is the entity tag we'd give a document whose
+ * SHA256 digest is <b>digest</b>: that is, the quoted hex digest. */
+static int
+http_etag_matches(const char *tag, const char *digest)
+{
+  char want[DIGEST256_LEN];
+  return strlen(tag) == HEX_DIGEST256_LEN+2 && tag[0] == '"' &&
+    tag[HEX_DIGEST256_LEN+1] == '"' &&
+    base16_decode(want, sizeof(want), tag+1, HEX_DIGEST256_LEN) == 0 &&
+    tor_memeq(want, digest, DIGEST256_LEN);
+}
+
+/** Return true iff <b>if_none_match</b>, the value of an If-None-Match
+ * header, names the entity tag we'd give a document whose SHA256 digest is
+ * <b>digest</b>, possibly marked weak.  "*" matches any document. */
+int
+http_etag_list_matches(const char *if_none_match, const char *digest)
+{
+  smartlist_t *tags = smartlist_create();
+  int found = 0;
+  smartlist_split_string(tags, if_none_match, ",",
+                         SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+  SMARTLIST_FOREACH_BEGIN(tags, char *, tag) {
+    if (!strcmp(tag, "*") ||
+        http_etag_matches(strcmpstart(tag, "W/") ? tag : tag+2, digest))
+      found = 1;
+    tor_free(tag);
+  } SMARTLIST_FOREACH_END(tag);
+  smartlist_free(tags);
+  return found;
+}
+
+/** Parse <b>range</b>, the value of a Range header.  If it asks for
+ * everything from some byte offset to the end of the document
+ * ("bytes=N-"), set *<b>start_out</b> to that offset and return 0.  Return
+ * -1 for anything else, including the kinds of range we don't serve. */
+int
+http_parse_range_start(const char *range, size_t *start_out)
+{
+  uint64_t start;
+  char *next;
+  int ok;
+  if (strcmpstart(range, "bytes="))
+    return -1;
+  range += strlen("bytes=");
+  if (!TOR_ISDIGIT(*range))
+    return -1;
+  start = tor_parse_uint64(range, 10, 0, SIZE_T_MAX, &ok, &next);
+  if (!ok || strcmp(next, "-"))
+    return -1;
+  *start_out = (size_t)start;
+  return 0;
+}
+
+/** Parse <b>value</b>, the value of a Content-Range header of the form
+ * "bytes FIRST-LAST/TOTAL".  On success, set *<b>start_out</b>,
+ * *<b>end_out</b>, and *<b>total_out</b> to the offset of the first byte
+ * sent, one past the offset of the last byte sent, and the length of the
+ * whole document, and return 0.  Return -1 on failure. */
+int
+http_parse_content_range(const char *value, size_t *start_out,
+                         size_t *end_out, size_t *total_out)
+{
+  uint64_t first, last, total;
+  char *next;
+  int ok;
+  if (strcmpstart(value, "bytes "))
+    return -1;
+  value += strlen("bytes ");
+  if (!TOR_ISDIGIT(*value))
+    return -1;
+  first = tor_parse_uint64(value, 10, 0, MAX_DIR_DL_SIZE, &ok, &next);
+  if (!ok || *next != '-' || !TOR_ISDIGIT(next[1]))
+    return -1;
+  last = tor_parse_uint64(next+1, 10, first, MAX_DIR_DL_SIZE, &ok, &next);
+  if (!ok || *next != '/' || !TOR_ISDIGIT(next[1]))
+    return -1;
+  total = tor_parse_uint64(next+1, 10, last+1, MAX_DIR_DL_SIZE, &ok, &next);
+  if (!ok || *next)
+    return -1;
+  *start_out = (size_t)first;
+  *end_out = (size_t)last + 1;
+  *total_out = (size_t)total;
+  return 0;
+}
+
+/** The client that sent us the request <b>headers</b> wants the document
+ * <b>d</b>, which we'll send as <b>body_len</b> bytes.  If it asked for
+ * just the end of it, starting at an offset we can serve, and it's still
+ * talking about the same document, set *<b>start_out</b> to that offset and
+ * return 1.  If it asked for a range past the end of <b>d</b>, return -1.
+ * Otherwise, return 0 to send the whole document. */
+static int
+dir_get_range_start(const char *headers, const cached_dir_t *d,
+                    size_t body_len, size_t *start_out)
+{
+  char *range, *if_range;
+  int r = 0;
+  if (!(range = http_get_header(headers, "Range: ")))
+    return 0;
+  if (http_parse_range_start(range, start_out) == 0) {
+    if_range = http_get_header(headers, "If-Range: ");
+    if (if_range && !http_etag_matches(if_range, d->digests.d[DIGEST_SHA256]))
+      r = 0; /* They have part of some other consensus. */
+    else if (*start_out >= body_len)
+      r = -1;
+    else
+      r = 1;
+    tor_free(if_range);
+  }
+  tor_free(range);
+  return r;
+}
+
+#ifdef INSTRUMENT_DOWNLOADS
+typedef struct request_t {
+  uint64_t bytes; /**< How many bytes have we transferred? */
+  uint64_t count; /**< How many requests have we made? */
+} request_t;
+
+/** Map used to keep track of how much data we've up/downloaded in what kind
+ * of request.  Maps from request type to pointer to request_t. */
+static strmap_t *request_map = NULL;
+
+/** Record that a client request of <b>purpose</b> was made, and that
+ * <b>bytes</b> bytes of possibly <b>compressed</b> data were sent/received.
+ * Used to keep track of how much we've up/downloaded in what kind of
+ * request. */
+static void
+note_client_request(int purpose, int compressed, size_t bytes)
+{
+  char *key;
+  const char *kind = NULL;
+  switch (purpose) {
+    case DIR_PURPOSE_FETCH_V2_NETWORKSTATUS: kind = "dl/status"; break;
     case DIR_PURPOSE_FETCH_CONSENSUS:     kind = "dl/consensus"; break;
     case DIR_PURPOSE_FETCH_CERTIFICATE:   kind = "dl/cert"; break;
     case DIR_PURPOSE_FETCH_STATUS_VOTE:   kind = "dl/vote"; break;
@@ -2624,21 +3670,124 @@ client_likes_consensus(networkstatus_t *v, const char *want_url)
   return (have >= need_at_least);
 }
 
+/** If <b>conn</b> is answering a GET request, record how long that took
+ * and how much we sent, and forget about the request. */
+static void
+connection_dir_note_response_done(dir_connection_t *conn)
+{
+  struct timeval now;
+  if (!conn->serving_endpoint)
+    return;
+  tor_gettimeofday(&now);
+  rep_hist_note_dir_response(conn->serving_endpoint,
+                             conn->response_compressed, conn->response_bytes,
+                             tv_udiff(&conn->request_received, &now));
+  conn->serving_endpoint = NULL;
+}
+
+/** Everything a handler for a directory GET request needs to know about the
+ * request, besides the connection it came in on. */
+typedef struct get_handler_args_t {
+  /** The request's HTTP headers. */
+  const char *headers;
+  /** The URL that was requested, without any ".z" suffix. */
+  const char *url;
+  /** The time in the If-Modified-Since header, or 0 if there was none. */
+  time_t if_modified_since;
+  /** True iff the client asked for a compressed (".z") document. */
+  int compressed;
+  /** The best compression method the client says it will accept. */
+  compress_method_t accept_method;
+} get_handler_args_t;
+
+/** An entry in url_table: which handler answers requests for which URL. */
+typedef struct url_table_ent_t {
+  /** The URL, or URL prefix, that this entry handles.  This is also the
+   * name under which we record the entry's serving statistics. */
+  const char *string;
+  /** True iff <b>string</b> is a prefix rather than a whole URL. */
+  int is_prefix;
+  /** The function that writes the response into conn-\>outbuf.  Always
+   * returns 0. */
+  int (*handler)(dir_connection_t *conn, const get_handler_args_t *args);
+} url_table_ent_t;
+
+static int handle_get_frontpage(dir_connection_t *conn,
+                                const get_handler_args_t *args);
+static int handle_get_v1_directory(dir_connection_t *conn,
+                                   const get_handler_args_t *args);
+static int handle_get_running_routers(dir_connection_t *conn,
+                                      const get_handler_args_t *args);
+static int handle_get_networkstatus(dir_connection_t *conn,
+                                    const get_handler_args_t *args);
+static int handle_get_status_vote(dir_connection_t *conn,
+                                  const get_handler_args_t *args);
+static int handle_get_microdesc(dir_connection_t *conn,
+                                const get_handler_args_t *args);
+static int handle_get_descriptor(dir_connection_t *conn,
+                                 const get_handler_args_t *args);
+static int handle_get_keys(dir_connection_t *conn,
+                           const get_handler_args_t *args);
+static int handle_get_rendezvous2(dir_connection_t *conn,
+                                  const get_handler_args_t *args);
+static int handle_get_rendezvous(dir_connection_t *conn,
+                                 const get_handler_args_t *args);
+static int handle_get_networkstatus_bridges(dir_connection_t *conn,
+                                            const get_handler_args_t *args);
+static int handle_get_bytes(dir_connection_t *conn,
+                            const get_handler_args_t *args);
+static int handle_get_robots(dir_connection_t *conn,
+                             const get_handler_args_t *args);
+static int handle_get_stability(dir_connection_t *conn,
+                                const get_handler_args_t *args);
+#if defined(EXPORTMALLINFO) && defined(HAVE_MALLOC_H) && defined(HAVE_MALLINFO)
+static int handle_get_mallinfo(dir_connection_t *conn,
+                               const get_handler_args_t *args);
+#endif
+
+/** The URLs we know how to answer GET requests for.  We use the first entry
+ * that matches, so more specific prefixes must come before less specific
+ * ones. */
+static const url_table_ent_t url_table[] = {
+  { "/tor/", 0, handle_get_frontpage },
+  { "/tor/dir", 0, handle_get_v1_directory },
+  { "/tor/running-routers", 0, handle_get_running_routers },
+  { "/tor/status/", 1, handle_get_networkstatus },
+  { "/tor/status-vote/current/consensus", 1, handle_get_networkstatus },
+  { "/tor/status-vote/current/", 1, handle_get_status_vote },
+  { "/tor/status-vote/next/", 1, handle_get_status_vote },
+  { "/tor/micro/d/", 1, handle_get_microdesc },
+  { "/tor/server/", 1, handle_get_descriptor },
+  { "/tor/extra/", 1, handle_get_descriptor },
+  { "/tor/keys/", 1, handle_get_keys },
+  { "/tor/rendezvous2/", 1, handle_get_rendezvous2 },
+  { "/tor/rendezvous/", 1, handle_get_rendezvous },
+  { "/tor/networkstatus-bridges", 0, handle_get_networkstatus_bridges },
+  { "/tor/bytes.txt", 1, handle_get_bytes },
+  { "/tor/robots.txt", 0, handle_get_robots },
+  { "/tor/dbg-stability.txt", 0, handle_get_stability },
+#if defined(EXPORTMALLINFO) && defined(HAVE_MALLOC_H) && defined(HAVE_MALLINFO)
+  { "/tor/mallinfo.txt", 0, handle_get_mallinfo },
+#endif
+  { NULL, 0, NULL },
+};
+
+/** Name under which we record requests that match nothing in url_table. */
+#define UNRECOGNIZED_URL_NAME "unrecognized"
+
 /** Helper function: called when a dirserver gets a complete HTTP GET
  * request.  Look for a request for a directory or for a rendezvous
  * service descriptor.  On finding one, write a response into
- * conn-\>outbuf.  If the request is unrecognized, send a 400.
+ * conn-\>outbuf.  If the request is unrecognized, send a 404.
  * Always return 0. */
 static int
 directory_handle_command_get(dir_connection_t *conn, const char *headers,
                              const char *req_body, size_t req_body_len)
 {
-  size_t dlen;
-  char *url, *url_mem, *header;
-  const or_options_t *options = get_options();
-  time_t if_modified_since = 0;
-  int compressed;
+  char *url, *header;
+  get_handler_args_t args;
   size_t url_len;
+  int i;
 
   /* We ignore the body of a GET request. */
   (void)req_body;
@@ -2647,578 +3796,768 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
   log_debug(LD_DIRSERV,"Received GET command.");
 
   conn->_base.state = DIR_CONN_STATE_SERVER_WRITING;
+  /* Count everything we write from here on against the URL we match. */
+  conn->serving_endpoint = UNRECOGNIZED_URL_NAME;
+  conn->response_bytes = 0;
+  conn->response_compressed = 0;
+  tor_gettimeofday(&conn->request_received);
 
   if (parse_http_url(headers, &url) < 0) {
     write_http_status_line(conn, 400, "Bad request");
     return 0;
   }
+  memset(&args, 0, sizeof(args));
   if ((header = http_get_header(headers, "If-Modified-Since: "))) {
     struct tm tm;
     if (parse_http_time(header, &tm) == 0) {
-      if_modified_since = tor_timegm(&tm);
+      args.if_modified_since = tor_timegm(&tm);
     }
     /* The correct behavior on a malformed If-Modified-Since header is to
      * act as if no If-Modified-Since header had been given. */
     tor_free(header);
   }
+  args.accept_method = parse_accept_encoding(headers);
   log_debug(LD_DIRSERV,"rewritten url as '%s'.", url);
 
-  url_mem = url;
   url_len = strlen(url);
-  compressed = url_len > 2 && !strcmp(url+url_len-2, ".z");
-  if (compressed) {
+  args.compressed = url_len > 2 && !strcmp(url+url_len-2, ".z");
+  if (args.compressed) {
     url[url_len-2] = '\0';
     url_len -= 2;
   }
-
-  if (!strcmp(url,"/tor/")) {
-    const char *frontpage = get_dirportfrontpage();
-
-    if (frontpage) {
-      dlen = strlen(frontpage);
-      /* Let's return a disclaimer page (users shouldn't use V1 anymore,
-         and caches don't fetch '/', so this is safe). */
-
-      /* [We don't check for write_bucket_low here, since we want to serve
-       *  this page no matter what.] */
-      note_request(url, dlen);
-      write_http_response_header_impl(conn, dlen, "text/html", "identity",
-                                      NULL, DIRPORTFRONTPAGE_CACHE_LIFETIME);
-      connection_write_to_buf(frontpage, dlen, TO_CONN(conn));
+  args.headers = headers;
+  args.url = url;
+  conn->response_compressed = args.compressed;
+
+  for (i = 0; url_table[i].string; ++i) {
+    const url_table_ent_t *ent = &url_table[i];
+    if (ent->is_prefix ? !strcmpstart(url, ent->string)
+                       : !strcmp(url, ent->string)) {
+      conn->serving_endpoint = ent->string;
+      ent->handler(conn, &args);
       goto done;
     }
-    /* if no disclaimer file, fall through and continue */
   }
 
-  if (!strcmp(url,"/tor/") || !strcmp(url,"/tor/dir")) { /* v1 dir fetch */
-    cached_dir_t *d = dirserv_get_directory();
+  /* we didn't recognize the url */
+  write_http_status_line(conn, 404, "Not found");
 
-    if (!d) {
-      log_info(LD_DIRSERV,"Client asked for the mirrored directory, but we "
-               "don't have a good one yet. Sending 503 Dir not available.");
-      write_http_status_line(conn, 503, "Directory unavailable");
-      goto done;
-    }
-    if (d->published < if_modified_since) {
-      write_http_status_line(conn, 304, "Not modified");
-      goto done;
-    }
+ done:
+  tor_free(url);
+  return 0;
+}
 
-    dlen = compressed ? d->dir_z_len : d->dir_len;
+/** Helper function for GET / or GET /tor/: send the DirPortFrontPage if we
+ * have one; otherwise, treat it as a v1 directory fetch. */
+static int
+handle_get_frontpage(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  const char *frontpage = get_dirportfrontpage();
+  size_t dlen;
 
-    if (global_write_bucket_low(TO_CONN(conn), dlen, 1)) {
-      log_debug(LD_DIRSERV,
-               "Client asked for the mirrored directory, but we've been "
-               "writing too many bytes lately. Sending 503 Dir busy.");
-      write_http_status_line(conn, 503, "Directory busy, try again later");
-      goto done;
-    }
+  if (!frontpage)
+    return handle_get_v1_directory(conn, args);
 
-    note_request(url, dlen);
+  dlen = strlen(frontpage);
+  /* Let's return a disclaimer page (users shouldn't use V1 anymore,
+     and caches don't fetch '/', so this is safe). */
 
-    log_debug(LD_DIRSERV,"Dumping %sdirectory to client.",
-              compressed?"compressed ":"");
-    write_http_response_header(conn, dlen, compressed,
-                          FULL_DIR_CACHE_LIFETIME);
-    conn->cached_dir = d;
-    conn->cached_dir_offset = 0;
-    if (!compressed)
-      conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD);
-    ++d->refcnt;
+  /* [We don't check for write_bucket_low here, since we want to serve
+   *  this page no matter what.] */
+  note_request(args->url, dlen);
+  write_http_response_header_impl(conn, dlen, "text/html", "identity",
+                                  NULL, DIRPORTFRONTPAGE_CACHE_LIFETIME);
+  connection_write_to_buf(frontpage, dlen, TO_CONN(conn));
+  return 0;
+}
 
-    /* Prime the connection with some data. */
-    conn->dir_spool_src = DIR_SPOOL_CACHED_DIR;
-    connection_dirserv_flushed_some(conn);
-    goto done;
+/** Helper function for GET /tor/dir: send the v1 directory, if we have a
+ * good one. */
+static int
+handle_get_v1_directory(dir_connection_t *conn,
+                        const get_handler_args_t *args)
+{
+  const int compressed = args->compressed;
+  cached_dir_t *d = dirserv_get_directory();
+  size_t dlen;
+
+  if (!d) {
+    log_info(LD_DIRSERV,"Client asked for the mirrored directory, but we "
+             "don't have a good one yet. Sending 503 Dir not available.");
+    write_http_status_line(conn, 503, "Directory unavailable");
+    return 0;
+  }
+  if (d->published < args->if_modified_since) {
+    write_http_status_line(conn, 304, "Not modified");
+    return 0;
   }
 
-  if (!strcmp(url,"/tor/running-routers")) { /* running-routers fetch */
-    cached_dir_t *d = dirserv_get_runningrouters();
-    if (!d) {
-      write_http_status_line(conn, 503, "Directory unavailable");
-      goto done;
-    }
-    if (d->published < if_modified_since) {
-      write_http_status_line(conn, 304, "Not modified");
-      goto done;
-    }
-    dlen = compressed ? d->dir_z_len : d->dir_len;
+  dlen = compressed ? d->dir_z_len : d->dir_len;
 
-    if (global_write_bucket_low(TO_CONN(conn), dlen, 1)) {
-      log_info(LD_DIRSERV,
-               "Client asked for running-routers, but we've been "
-               "writing too many bytes lately. Sending 503 Dir busy.");
-      write_http_status_line(conn, 503, "Directory busy, try again later");
-      goto done;
-    }
-    note_request(url, dlen);
-    write_http_response_header(conn, dlen, compressed,
-                 RUNNINGROUTERS_CACHE_LIFETIME);
-    connection_write_to_buf(compressed ? d->dir_z : d->dir, dlen,
-                            TO_CONN(conn));
-    goto done;
+  if (global_write_bucket_low(TO_CONN(conn), dlen, 1)) {
+    log_debug(LD_DIRSERV,
+             "Client asked for the mirrored directory, but we've been "
+             "writing too many bytes lately. Sending 503 Dir busy.");
+    write_http_status_line(conn, 503, "Directory busy, try again later");
+    return 0;
   }
 
-  if (!strcmpstart(url,"/tor/status/")
-      || !strcmpstart(url, "/tor/status-vote/current/consensus")) {
-    /* v2 or v3 network status fetch. */
-    smartlist_t *dir_fps = smartlist_create();
-    int is_v3 = !strcmpstart(url, "/tor/status-vote");
-    geoip_client_action_t act =
-        is_v3 ? GEOIP_CLIENT_NETWORKSTATUS : GEOIP_CLIENT_NETWORKSTATUS_V2;
-    const char *request_type = NULL;
-    const char *key = url + strlen("/tor/status/");
-    long lifetime = NETWORKSTATUS_CACHE_LIFETIME;
-
-    if (!is_v3) {
-      dirserv_get_networkstatus_v2_fingerprints(dir_fps, key);
-      if (!strcmpstart(key, "fp/"))
-        request_type = compressed?"/tor/status/fp.z":"/tor/status/fp";
-      else if (!strcmpstart(key, "authority"))
-        request_type = compressed?"/tor/status/authority.z":
-          "/tor/status/authority";
-      else if (!strcmpstart(key, "all"))
-        request_type = compressed?"/tor/status/all.z":"/tor/status/all";
-      else
-        request_type = "/tor/status/?";
-    } else {
-      networkstatus_t *v = networkstatus_get_latest_consensus();
-      time_t now = time(NULL);
-      const char *want_fps = NULL;
-      char *flavor = NULL;
-      #define CONSENSUS_URL_PREFIX "/tor/status-vote/current/consensus/"
-      #define CONSENSUS_FLAVORED_PREFIX "/tor/status-vote/current/consensus-"
-      /* figure out the flavor if any, and who we wanted to sign the thing */
-      if (!strcmpstart(url, CONSENSUS_FLAVORED_PREFIX)) {
-        const char *f, *cp;
-        f = url + strlen(CONSENSUS_FLAVORED_PREFIX);
-        cp = strchr(f, '/');
-        if (cp) {
-          want_fps = cp+1;
-          flavor = tor_strndup(f, cp-f);
-        } else {
-          flavor = tor_strdup(f);
-        }
+  note_request(args->url, dlen);
+
+  log_debug(LD_DIRSERV,"Dumping %sdirectory to client.",
+            compressed?"compressed ":"");
+  write_http_response_header(conn, dlen, compressed,
+                        FULL_DIR_CACHE_LIFETIME);
+  conn->cached_dir = d;
+  conn->cached_dir_offset = 0;
+  if (!compressed)
+    conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD, HIGH_COMPRESSION);
+  ++d->refcnt;
+
+  /* Prime the connection with some data. */
+  conn->dir_spool_src = DIR_SPOOL_CACHED_DIR;
+  connection_dirserv_flushed_some(conn);
+  return 0;
+}
+
+/** Helper function for GET /tor/running-routers: send the v1
+ * running-routers list. */
+static int
+handle_get_running_routers(dir_connection_t *conn,
+                           const get_handler_args_t *args)
+{
+  const int compressed = args->compressed;
+  cached_dir_t *d = dirserv_get_runningrouters();
+  size_t dlen;
+  if (!d) {
+    write_http_status_line(conn, 503, "Directory unavailable");
+    return 0;
+  }
+  if (d->published < args->if_modified_since) {
+    write_http_status_line(conn, 304, "Not modified");
+    return 0;
+  }
+  dlen = compressed ? d->dir_z_len : d->dir_len;
+
+  if (global_write_bucket_low(TO_CONN(conn), dlen, 1)) {
+    log_info(LD_DIRSERV,
+             "Client asked for running-routers, but we've been "
+             "writing too many bytes lately. Sending 503 Dir busy.");
+    write_http_status_line(conn, 503, "Directory busy, try again later");
+    return 0;
+  }
+  note_request(args->url, dlen);
+  write_http_response_header(conn, dlen, compressed,
+               RUNNINGROUTERS_CACHE_LIFETIME);
+  connection_write_to_buf(compressed ? d->dir_z : d->dir, dlen,
+                          TO_CONN(conn));
+  return 0;
+}
+
+/** Helper function for GET /tor/status/... and
+ * GET /tor/status-vote/current/consensus...: send v2 networkstatus
+ * documents, or the current v3 consensus or a diff to it. */
+static int
+handle_get_networkstatus(dir_connection_t *conn,
+                         const get_handler_args_t *args)
+{
+  const char *url = args->url;
+  const int compressed = args->compressed;
+  smartlist_t *dir_fps = smartlist_create();
+  int is_v3 = !strcmpstart(url, "/tor/status-vote");
+  geoip_client_action_t act =
+      is_v3 ? GEOIP_CLIENT_NETWORKSTATUS : GEOIP_CLIENT_NETWORKSTATUS_V2;
+  const char *request_type = NULL;
+  const char *key = url + strlen("/tor/status/");
+  long lifetime = NETWORKSTATUS_CACHE_LIFETIME;
+  cached_dir_t *diff = NULL;
+  ssize_t body_len = -1;
+  size_t dlen;
+  char *header = NULL;
+
+  if (!is_v3) {
+    dirserv_get_networkstatus_v2_fingerprints(dir_fps, key);
+    if (!strcmpstart(key, "fp/"))
+      request_type = compressed?"/tor/status/fp.z":"/tor/status/fp";
+    else if (!strcmpstart(key, "authority"))
+      request_type = compressed?"/tor/status/authority.z":
+        "/tor/status/authority";
+    else if (!strcmpstart(key, "all"))
+      request_type = compressed?"/tor/status/all.z":"/tor/status/all";
+    else
+      request_type = "/tor/status/?";
+  } else {
+    networkstatus_t *v = networkstatus_get_latest_consensus();
+    time_t now = time(NULL);
+    const char *want_fps = NULL;
+    char *flavor = NULL;
+    #define CONSENSUS_URL_PREFIX "/tor/status-vote/current/consensus/"
+    #define CONSENSUS_FLAVORED_PREFIX "/tor/status-vote/current/consensus-"
+    /* figure out the flavor if any, and who we wanted to sign the thing */
+    if (!strcmpstart(url, CONSENSUS_FLAVORED_PREFIX)) {
+      const char *f, *cp;
+      f = url + strlen(CONSENSUS_FLAVORED_PREFIX);
+      cp = strchr(f, '/');
+      if (cp) {
+        want_fps = cp+1;
+        flavor = tor_strndup(f, cp-f);
       } else {
-        if (!strcmpstart(url, CONSENSUS_URL_PREFIX))
-          want_fps = url+strlen(CONSENSUS_URL_PREFIX);
+        flavor = tor_strdup(f);
       }
+    } else {
+      if (!strcmpstart(url, CONSENSUS_URL_PREFIX))
+        want_fps = url+strlen(CONSENSUS_URL_PREFIX);
+    }
 
-      /* XXXX MICRODESC NM NM should check document of correct flavor */
-      if (v && want_fps &&
-          !client_likes_consensus(v, want_fps)) {
-        write_http_status_line(conn, 404, "Consensus not signed by sufficient "
-                                          "number of requested authorities");
-        smartlist_free(dir_fps);
-        geoip_note_ns_response(act, GEOIP_REJECT_NOT_ENOUGH_SIGS);
-        tor_free(flavor);
-        goto done;
-      }
+    /* XXXX MICRODESC NM NM should check document of correct flavor */
+    if (v && want_fps &&
+        !client_likes_consensus(v, want_fps)) {
+      write_http_status_line(conn, 404, "Consensus not signed by sufficient "
+                                        "number of requested authorities");
+      smartlist_free(dir_fps);
+      geoip_note_ns_response(act, GEOIP_REJECT_NOT_ENOUGH_SIGS);
+      tor_free(flavor);
+      return 0;
+    }
 
-      {
-        char *fp = tor_malloc_zero(DIGEST_LEN);
-        if (flavor)
-          strlcpy(fp, flavor, DIGEST_LEN);
+    /* Does the client have our consensus already?  Answer from the
+     * digest we keep, without looking at the document itself. */
+    if ((header = http_get_header(args->headers, "If-None-Match: "))) {
+      cached_dir_t *d = dirserv_get_consensus(flavor ? flavor : "ns");
+      int match = d && http_etag_list_matches(header,
+                                            d->digests.d[DIGEST_SHA256]);
+      tor_free(header);
+      if (match) {
+        write_http_status_line(conn, 304, "Not modified");
+        smartlist_free(dir_fps);
+        geoip_note_ns_response(act, GEOIP_REJECT_NOT_MODIFIED);
         tor_free(flavor);
-        smartlist_add(dir_fps, fp);
+        return 0;
       }
-      request_type = compressed?"v3.z":"v3";
-      lifetime = (v && v->fresh_until > now) ? v->fresh_until - now : 0;
     }
 
-    if (!smartlist_len(dir_fps)) { /* we failed to create/cache cp */
-      write_http_status_line(conn, 503, "Network status object unavailable");
-      smartlist_free(dir_fps);
-      geoip_note_ns_response(act, GEOIP_REJECT_UNAVAILABLE);
-      goto done;
+    /* Can we send a diff from the consensus the client already has? */
+    if ((header = http_get_header(args->headers,
+                                  "X-Or-Diff-From-Consensus: "))) {
+      char from[DIGEST256_LEN];
+      if (strlen(header) == HEX_DIGEST256_LEN &&
+          base16_decode(from, sizeof(from), header, HEX_DIGEST256_LEN) == 0)
+        diff = dirserv_get_consensus_diff(flavor ? flavor : "ns", from);
+      tor_free(header);
     }
 
-    if (!dirserv_remove_old_statuses(dir_fps, if_modified_since)) {
-      write_http_status_line(conn, 404, "Not found");
-      SMARTLIST_FOREACH(dir_fps, char *, cp, tor_free(cp));
-      smartlist_free(dir_fps);
-      geoip_note_ns_response(act, GEOIP_REJECT_NOT_FOUND);
-      goto done;
-    } else if (!smartlist_len(dir_fps)) {
-      write_http_status_line(conn, 304, "Not modified");
-      SMARTLIST_FOREACH(dir_fps, char *, cp, tor_free(cp));
-      smartlist_free(dir_fps);
-      geoip_note_ns_response(act, GEOIP_REJECT_NOT_MODIFIED);
-      goto done;
+    {
+      char *fp = tor_malloc_zero(DIGEST_LEN);
+      if (flavor)
+        strlcpy(fp, flavor, DIGEST_LEN);
+      tor_free(flavor);
+      smartlist_add(dir_fps, fp);
     }
+    request_type = compressed?"v3.z":"v3";
+    lifetime = (v && v->fresh_until > now) ? v->fresh_until - now : 0;
+  }
 
+  if (!smartlist_len(dir_fps)) { /* we failed to create/cache cp */
+    write_http_status_line(conn, 503, "Network status object unavailable");
+    smartlist_free(dir_fps);
+    geoip_note_ns_response(act, GEOIP_REJECT_UNAVAILABLE);
+    return 0;
+  }
+
+  if (!dirserv_remove_old_statuses(dir_fps, args->if_modified_since)) {
+    write_http_status_line(conn, 404, "Not found");
+    SMARTLIST_FOREACH(dir_fps, char *, cp, tor_free(cp));
+    smartlist_free(dir_fps);
+    geoip_note_ns_response(act, GEOIP_REJECT_NOT_FOUND);
+    return 0;
+  } else if (!smartlist_len(dir_fps)) {
+    write_http_status_line(conn, 304, "Not modified");
+    SMARTLIST_FOREACH(dir_fps, char *, cp, tor_free(cp));
+    smartlist_free(dir_fps);
+    geoip_note_ns_response(act, GEOIP_REJECT_NOT_MODIFIED);
+    return 0;
+  }
+
+  if (diff)
+    dlen = compressed ? diff->dir_z_len : diff->dir_len;
+  else
     dlen = dirserv_estimate_data_size(dir_fps, 0, compressed);
-    if (global_write_bucket_low(TO_CONN(conn), dlen, 2)) {
-      log_debug(LD_DIRSERV,
-               "Client asked for network status lists, but we've been "
-               "writing too many bytes lately. Sending 503 Dir busy.");
-      write_http_status_line(conn, 503, "Directory busy, try again later");
-      SMARTLIST_FOREACH(dir_fps, char *, fp, tor_free(fp));
-      smartlist_free(dir_fps);
-      geoip_note_ns_response(act, GEOIP_REJECT_BUSY);
-      goto done;
-    }
+  if (global_write_bucket_low(TO_CONN(conn), dlen, 2)) {
+    log_debug(LD_DIRSERV,
+             "Client asked for network status lists, but we've been "
+             "writing too many bytes lately. Sending 503 Dir busy.");
+    write_http_status_line(conn, 503, "Directory busy, try again later");
+    SMARTLIST_FOREACH(dir_fps, char *, fp, tor_free(fp));
+    smartlist_free(dir_fps);
+    geoip_note_ns_response(act, GEOIP_REJECT_BUSY);
+    return 0;
+  }
 
-    {
-      struct in_addr in;
-      if (tor_inet_aton((TO_CONN(conn))->address, &in)) {
-        geoip_note_client_seen(act, ntohl(in.s_addr), time(NULL));
-        geoip_note_ns_response(act, GEOIP_SUCCESS);
-        /* Note that a request for a network status has started, so that we
-         * can measure the download time later on. */
-        if (TO_CONN(conn)->dirreq_id)
-          geoip_start_dirreq(TO_CONN(conn)->dirreq_id, dlen, act,
-                             DIRREQ_TUNNELED);
-        else
-          geoip_start_dirreq(TO_CONN(conn)->global_identifier, dlen, act,
-                             DIRREQ_DIRECT);
-      }
+  {
+    struct in_addr in;
+    if (tor_inet_aton((TO_CONN(conn))->address, &in)) {
+      geoip_note_client_seen(act, ntohl(in.s_addr), time(NULL));
+      geoip_note_ns_response(act, GEOIP_SUCCESS);
+      /* Note that a request for a network status has started, so that we
+       * can measure the download time later on.  Measurements are keyed
+       * by connection, so only the first request on one counts. */
+      if (conn->answered_request)
+        ;
+      else if (TO_CONN(conn)->dirreq_id)
+        geoip_start_dirreq(TO_CONN(conn)->dirreq_id, dlen, act,
+                           DIRREQ_TUNNELED);
+      else
+        geoip_start_dirreq(TO_CONN(conn)->global_identifier, dlen, act,
+                           DIRREQ_DIRECT);
     }
+  }
 
-    // note_request(request_type,dlen);
-    (void) request_type;
-    write_http_response_header(conn, -1, compressed,
-                               smartlist_len(dir_fps) == 1 ? lifetime : 0);
-    conn->fingerprint_stack = dir_fps;
+  // note_request(request_type,dlen);
+  (void) request_type;
+  if (is_v3) {
+    const char *fp = smartlist_get(dir_fps, 0);
+    cached_dir_t *d = diff ? diff : dirserv_get_consensus(*fp ? fp : "ns");
+    if (compressed)
+      dir_choose_spool_method(conn, d, args->accept_method);
+    if (d && smartlist_len(dir_fps) == 1)
+      body_len = dir_cached_dir_spool_len(conn, d, compressed);
+  }
+  if (diff) {
+    /* The diff is only any use to clients with the same consensus as this
+     * one, so don't let anybody cache it. */
+    SMARTLIST_FOREACH(dir_fps, char *, fp, tor_free(fp));
+    smartlist_free(dir_fps);
+    write_http_response_header(conn, body_len, compressed, 0);
+    ++diff->refcnt;
+    conn->cached_dir = diff;
+    conn->cached_dir_offset = 0;
     if (! compressed)
-      conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD);
-
-    /* Prime the connection with some data. */
-    conn->dir_spool_src = DIR_SPOOL_NETWORKSTATUS;
+      conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD,
+                                      HIGH_COMPRESSION);
+    conn->dir_spool_src = DIR_SPOOL_CACHED_DIR;
     connection_dirserv_flushed_some(conn);
-    goto done;
+    return 0;
   }
-
-  if (!strcmpstart(url,"/tor/status-vote/current/") ||
-      !strcmpstart(url,"/tor/status-vote/next/")) {
-    /* XXXX If-modified-since is only implemented for the current
-     * consensus: that's probably fine, since it's the only vote document
-     * people fetch much. */
-    int current;
-    ssize_t body_len = 0;
-    ssize_t estimated_len = 0;
-    smartlist_t *items = smartlist_create();
-    smartlist_t *dir_items = smartlist_create();
-    int lifetime = 60; /* XXXX023 should actually use vote intervals. */
-    url += strlen("/tor/status-vote/");
-    current = !strcmpstart(url, "current/");
-    url = strchr(url, '/');
-    tor_assert(url);
-    ++url;
-    if (!strcmp(url, "consensus")) {
-      const char *item;
-      tor_assert(!current); /* we handle current consensus specially above,
-                             * since it wants to be spooled. */
-      if ((item = dirvote_get_pending_consensus(FLAV_NS)))
-        smartlist_add(items, (char*)item);
-    } else if (!current && !strcmp(url, "consensus-signatures")) {
-      /* XXXX the spec says that we should implement
-       * current/consensus-signatures too.  It doesn't seem to be needed,
-       * though. */
-      const char *item;
-      if ((item=dirvote_get_pending_detached_signatures()))
-        smartlist_add(items, (char*)item);
-    } else if (!strcmp(url, "authority")) {
-      const cached_dir_t *d;
-      int flags = DGV_BY_ID |
-        (current ? DGV_INCLUDE_PREVIOUS : DGV_INCLUDE_PENDING);
-      if ((d=dirvote_get_vote(NULL, flags)))
-        smartlist_add(dir_items, (cached_dir_t*)d);
-    } else {
-      const cached_dir_t *d;
-      smartlist_t *fps = smartlist_create();
-      int flags;
-      if (!strcmpstart(url, "d/")) {
-        url += 2;
-        flags = DGV_INCLUDE_PENDING | DGV_INCLUDE_PREVIOUS;
-      } else {
-        flags = DGV_BY_ID |
-          (current ? DGV_INCLUDE_PREVIOUS : DGV_INCLUDE_PENDING);
+  if (is_v3 && smartlist_len(dir_fps) == 1) {
+    /* Tell the client how to name this consensus when it asks again. */
+    const char *fp = smartlist_get(dir_fps, 0);
+    cached_dir_t *d = dirserv_get_consensus(*fp ? fp : "ns");
+    if (d) {
+      char hex[HEX_DIGEST256_LEN+1];
+      size_t start = 0;
+      int r = 0;
+      base16_encode(hex, sizeof(hex), d->digests.d[DIGEST_SHA256],
+                    DIGEST256_LEN);
+      /* We can send the rest of a compressed body that a client lost
+       * partway through; we don't keep offsets into the uncompressed one. */
+      if (compressed && body_len > 0)
+        r = dir_get_range_start(args->headers, d, body_len, &start);
+      if (r < 0) {
+        write_http_status_line(conn, 416, "Requested range not satisfiable");
+        SMARTLIST_FOREACH(dir_fps, char *, cp, tor_free(cp));
+        smartlist_free(dir_fps);
+        return 0;
+      } else if (r > 0) {
+        tor_asprintf(&header, "ETag: \"%s\"\r\n"
+                     "Content-Range: bytes %lu-%lu/%lu\r\n", hex,
+                     (unsigned long)start, (unsigned long)body_len-1,
+                     (unsigned long)body_len);
+        write_http_response_headers(conn, body_len - start, compressed,
+                                    header, lifetime, 1);
+        tor_free(header);
+        SMARTLIST_FOREACH(dir_fps, char *, cp, tor_free(cp));
+        smartlist_free(dir_fps);
+        ++d->refcnt;
+        conn->cached_dir = d;
+        conn->cached_dir_offset = start;
+        conn->dir_spool_src = DIR_SPOOL_CACHED_DIR;
+        connection_dirserv_flushed_some(conn);
+        return 0;
       }
-      dir_split_resource_into_fingerprints(url, fps, NULL,
-                                           DSR_HEX|DSR_SORT_UNIQ);
-      SMARTLIST_FOREACH(fps, char *, fp, {
-          if ((d = dirvote_get_vote(fp, flags)))
-            smartlist_add(dir_items, (cached_dir_t*)d);
-          tor_free(fp);
-        });
-      smartlist_free(fps);
+      tor_asprintf(&header, "ETag: \"%s\"\r\n", hex);
     }
-    if (!smartlist_len(dir_items) && !smartlist_len(items)) {
-      write_http_status_line(conn, 404, "Not found");
-      goto vote_done;
-    }
-    SMARTLIST_FOREACH(dir_items, cached_dir_t *, d,
-                      body_len += compressed ? d->dir_z_len : d->dir_len);
-    estimated_len += body_len;
-    SMARTLIST_FOREACH(items, const char *, item, {
-        size_t ln = strlen(item);
-        if (compressed) {
-          estimated_len += ln/2;
-        } else {
-          body_len += ln; estimated_len += ln;
-        }
-      });
+  }
+  write_http_response_headers(conn, body_len, compressed, header,
+                              smartlist_len(dir_fps) == 1 ? lifetime : 0, 0);
+  tor_free(header);
+  conn->fingerprint_stack = dir_fps;
+  if (! compressed)
+    conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD, HIGH_COMPRESSION);
 
-    if (global_write_bucket_low(TO_CONN(conn), estimated_len, 2)) {
-      write_http_status_line(conn, 503, "Directory busy, try again later.");
-      goto vote_done;
-    }
-    write_http_response_header(conn, body_len ? body_len : -1, compressed,
-                 lifetime);
+  /* Prime the connection with some data. */
+  conn->dir_spool_src = DIR_SPOOL_NETWORKSTATUS;
+  connection_dirserv_flushed_some(conn);
+  return 0;
+}
 
-    if (smartlist_len(items)) {
+/** Helper function for GET /tor/status-vote/{current,next}/...: send
+ * votes, pending consensuses, or detached signatures. */
+static int
+handle_get_status_vote(dir_connection_t *conn,
+                       const get_handler_args_t *args)
+{
+  const char *url = args->url;
+  const int compressed = args->compressed;
+  /* XXXX If-modified-since is only implemented for the current
+   * consensus: that's probably fine, since it's the only vote document
+   * people fetch much. */
+  int current;
+  ssize_t body_len = 0;
+  ssize_t estimated_len = 0;
+  smartlist_t *items = smartlist_create();
+  smartlist_t *dir_items = smartlist_create();
+  int lifetime = 60; /* XXXX023 should actually use vote intervals. */
+  url += strlen("/tor/status-vote/");
+  current = !strcmpstart(url, "current/");
+  url = strchr(url, '/');
+  tor_assert(url);
+  ++url;
+  if (!strcmp(url, "consensus")) {
+    const char *item;
+    tor_assert(!current); /* we handle current consensus specially above,
+                           * since it wants to be spooled. */
+    if ((item = dirvote_get_pending_consensus(FLAV_NS)))
+      smartlist_add(items, (char*)item);
+  } else if (!current && !strcmp(url, "consensus-signatures")) {
+    /* XXXX the spec says that we should implement
+     * current/consensus-signatures too.  It doesn't seem to be needed,
+     * though. */
+    const char *item;
+    if ((item=dirvote_get_pending_detached_signatures()))
+      smartlist_add(items, (char*)item);
+  } else if (!strcmp(url, "authority")) {
+    const cached_dir_t *d;
+    int flags = DGV_BY_ID |
+      (current ? DGV_INCLUDE_PREVIOUS : DGV_INCLUDE_PENDING);
+    if ((d=dirvote_get_vote(NULL, flags)))
+      smartlist_add(dir_items, (cached_dir_t*)d);
+  } else {
+    const cached_dir_t *d;
+    smartlist_t *fps = smartlist_create();
+    int flags;
+    if (!strcmpstart(url, "d/")) {
+      url += 2;
+      flags = DGV_INCLUDE_PENDING | DGV_INCLUDE_PREVIOUS;
+    } else {
+      flags = DGV_BY_ID |
+        (current ? DGV_INCLUDE_PREVIOUS : DGV_INCLUDE_PENDING);
+    }
+    dir_split_resource_into_fingerprints(url, fps, NULL,
+                                         DSR_HEX|DSR_SORT_UNIQ);
+    SMARTLIST_FOREACH(fps, char *, fp, {
+        if ((d = dirvote_get_vote(fp, flags)))
+          smartlist_add(dir_items, (cached_dir_t*)d);
+        tor_free(fp);
+      });
+    smartlist_free(fps);
+  }
+  if (!smartlist_len(dir_items) && !smartlist_len(items)) {
+    write_http_status_line(conn, 404, "Not found");
+    goto vote_done;
+  }
+  SMARTLIST_FOREACH(dir_items, cached_dir_t *, d,
+                    body_len += compressed ? d->dir_z_len : d->dir_len);
+  estimated_len += body_len;
+  SMARTLIST_FOREACH(items, const char *, item, {
+      size_t ln = strlen(item);
       if (compressed) {
-        conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD);
-        SMARTLIST_FOREACH(items, const char *, c,
-                 connection_write_to_buf_zlib(c, strlen(c), conn, 0));
-        connection_write_to_buf_zlib("", 0, conn, 1);
+        estimated_len += ln/2;
       } else {
-        SMARTLIST_FOREACH(items, const char *, c,
-                         connection_write_to_buf(c, strlen(c), TO_CONN(conn)));
+        body_len += ln; estimated_len += ln;
       }
+    });
+
+  if (global_write_bucket_low(TO_CONN(conn), estimated_len, 2)) {
+    write_http_status_line(conn, 503, "Directory busy, try again later.");
+    goto vote_done;
+  }
+  write_http_response_header(conn, body_len ? body_len : -1, compressed,
+               lifetime);
+
+  if (smartlist_len(items)) {
+    if (compressed) {
+      conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD,
+                                 choose_compression_level(estimated_len));
+      SMARTLIST_FOREACH(items, const char *, c,
+               connection_write_to_buf_zlib(c, strlen(c), conn, 0));
+      connection_write_to_buf_zlib("", 0, conn, 1);
     } else {
-      SMARTLIST_FOREACH(dir_items, cached_dir_t *, d,
-          connection_write_to_buf(compressed ? d->dir_z : d->dir,
-                                  compressed ? d->dir_z_len : d->dir_len,
-                                  TO_CONN(conn)));
+      SMARTLIST_FOREACH(items, const char *, c,
+                       connection_write_to_buf(c, strlen(c), TO_CONN(conn)));
     }
-  vote_done:
-    smartlist_free(items);
-    smartlist_free(dir_items);
-    goto done;
+  } else {
+    SMARTLIST_FOREACH(dir_items, cached_dir_t *, d,
+        connection_write_to_buf(compressed ? d->dir_z : d->dir,
+                                compressed ? d->dir_z_len : d->dir_len,
+                                TO_CONN(conn)));
   }
+ vote_done:
+  smartlist_free(items);
+  smartlist_free(dir_items);
+  return 0;
+}
 
-  if (!strcmpstart(url, "/tor/micro/d/")) {
-    smartlist_t *fps = smartlist_create();
+/** Helper function for GET /tor/micro/d/...: send microdescriptors by
+ * digest. */
+static int
+handle_get_microdesc(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  const int compressed = args->compressed;
+  smartlist_t *fps = smartlist_create();
+  size_t dlen;
 
-    dir_split_resource_into_fingerprints(url+strlen("/tor/micro/d/"),
-                                      fps, NULL,
-                                      DSR_DIGEST256|DSR_BASE64|DSR_SORT_UNIQ);
+  dir_split_resource_into_fingerprints(args->url+strlen("/tor/micro/d/"),
+                                    fps, NULL,
+                                    DSR_DIGEST256|DSR_BASE64|DSR_SORT_UNIQ);
 
-    if (!dirserv_have_any_microdesc(fps)) {
-      write_http_status_line(conn, 404, "Not found");
-      SMARTLIST_FOREACH(fps, char *, fp, tor_free(fp));
-      smartlist_free(fps);
-      goto done;
-    }
-    dlen = dirserv_estimate_microdesc_size(fps, compressed);
+  if (!dirserv_have_any_microdesc(fps)) {
+    write_http_status_line(conn, 404, "Not found");
+    SMARTLIST_FOREACH(fps, char *, fp, tor_free(fp));
+    smartlist_free(fps);
+    return 0;
+  }
+  dlen = dirserv_estimate_microdesc_size(fps, compressed);
+  if (global_write_bucket_low(TO_CONN(conn), dlen, 2)) {
+    log_info(LD_DIRSERV,
+             "Client asked for server descriptors, but we've been "
+             "writing too many bytes lately. Sending 503 Dir busy.");
+    write_http_status_line(conn, 503, "Directory busy, try again later");
+    SMARTLIST_FOREACH(fps, char *, fp, tor_free(fp));
+    smartlist_free(fps);
+    return 0;
+  }
+
+  conn->dir_spool_src = DIR_SPOOL_MICRODESC;
+  conn->fingerprint_stack = fps;
+
+  if (compressed && !dir_spool_compressed_batch(conn, args->accept_method))
+    conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD,
+                                    choose_compression_level(dlen));
+  write_http_response_header(conn, dir_spool_len(conn, compressed),
+                             compressed, MICRODESC_CACHE_LIFETIME);
+
+  connection_dirserv_flushed_some(conn);
+  return 0;
+}
+
+/** Helper function for GET /tor/server/... and GET /tor/extra/...: send
+ * router descriptors or extra-info documents. */
+static int
+handle_get_descriptor(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  const char *url = args->url;
+  const int compressed = args->compressed;
+  const or_options_t *options = get_options();
+  int res;
+  const char *msg;
+  const char *request_type = NULL;
+  int cache_lifetime = 0;
+  int is_extra = !strcmpstart(url,"/tor/extra/");
+  size_t dlen;
+
+  if (is_extra &&
+      (options->BridgeAuthoritativeDir || options->BridgeRelay)) {
+    write_http_status_line(conn, 404, "Not found");
+    return 0;
+  }
+
+  url += is_extra ? strlen("/tor/extra/") : strlen("/tor/server/");
+  conn->fingerprint_stack = smartlist_create();
+  res = dirserv_get_routerdesc_fingerprints(conn->fingerprint_stack, url,
+                                        &msg,
+                                        !connection_dir_is_encrypted(conn),
+                                        is_extra);
+
+  if (!strcmpstart(url, "fp/")) {
+    request_type = compressed?"/tor/server/fp.z":"/tor/server/fp";
+    if (smartlist_len(conn->fingerprint_stack) == 1)
+      cache_lifetime = ROUTERDESC_CACHE_LIFETIME;
+  } else if (!strcmpstart(url, "authority")) {
+    request_type = compressed?"/tor/server/authority.z":
+      "/tor/server/authority";
+    cache_lifetime = ROUTERDESC_CACHE_LIFETIME;
+  } else if (!strcmpstart(url, "all")) {
+    request_type = compressed?"/tor/server/all.z":"/tor/server/all";
+    cache_lifetime = FULL_DIR_CACHE_LIFETIME;
+  } else if (!strcmpstart(url, "d/")) {
+    request_type = compressed?"/tor/server/d.z":"/tor/server/d";
+    if (smartlist_len(conn->fingerprint_stack) == 1)
+      cache_lifetime = ROUTERDESC_BY_DIGEST_CACHE_LIFETIME;
+  } else {
+    request_type = "/tor/server/?";
+  }
+  (void) request_type; /* usable for note_request. */
+  if (!strcmpstart(url, "d/"))
+    conn->dir_spool_src =
+      is_extra ? DIR_SPOOL_EXTRA_BY_DIGEST : DIR_SPOOL_SERVER_BY_DIGEST;
+  else
+    conn->dir_spool_src =
+      is_extra ? DIR_SPOOL_EXTRA_BY_FP : DIR_SPOOL_SERVER_BY_FP;
+
+  if (!dirserv_have_any_serverdesc(conn->fingerprint_stack,
+                                   conn->dir_spool_src)) {
+    res = -1;
+    msg = "Not found";
+  }
+
+  if (res < 0)
+    write_http_status_line(conn, 404, msg);
+  else {
+    dlen = dirserv_estimate_data_size(conn->fingerprint_stack,
+                                      1, compressed);
     if (global_write_bucket_low(TO_CONN(conn), dlen, 2)) {
       log_info(LD_DIRSERV,
                "Client asked for server descriptors, but we've been "
                "writing too many bytes lately. Sending 503 Dir busy.");
       write_http_status_line(conn, 503, "Directory busy, try again later");
-      SMARTLIST_FOREACH(fps, char *, fp, tor_free(fp));
-      smartlist_free(fps);
-      goto done;
+      conn->dir_spool_src = DIR_SPOOL_NONE;
+      return 0;
     }
-
-    write_http_response_header(conn, -1, compressed, MICRODESC_CACHE_LIFETIME);
-    conn->dir_spool_src = DIR_SPOOL_MICRODESC;
-    conn->fingerprint_stack = fps;
-
-    if (compressed)
-      conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD);
-
+    if (compressed && !dir_spool_compressed_batch(conn, args->accept_method))
+      conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD,
+                                      choose_compression_level(dlen));
+    write_http_response_header(conn, dir_spool_len(conn, compressed),
+                               compressed, cache_lifetime);
+    /* Prime the connection with some data. */
     connection_dirserv_flushed_some(conn);
-    goto done;
   }
+  return 0;
+}
 
-  if (!strcmpstart(url,"/tor/server/") ||
-      (!options->BridgeAuthoritativeDir &&
-       !options->BridgeRelay && !strcmpstart(url,"/tor/extra/"))) {
-    int res;
-    const char *msg;
-    const char *request_type = NULL;
-    int cache_lifetime = 0;
-    int is_extra = !strcmpstart(url,"/tor/extra/");
-    url += is_extra ? strlen("/tor/extra/") : strlen("/tor/server/");
-    conn->fingerprint_stack = smartlist_create();
-    res = dirserv_get_routerdesc_fingerprints(conn->fingerprint_stack, url,
-                                          &msg,
-                                          !connection_dir_is_encrypted(conn),
-                                          is_extra);
-
-    if (!strcmpstart(url, "fp/")) {
-      request_type = compressed?"/tor/server/fp.z":"/tor/server/fp";
-      if (smartlist_len(conn->fingerprint_stack) == 1)
-        cache_lifetime = ROUTERDESC_CACHE_LIFETIME;
-    } else if (!strcmpstart(url, "authority")) {
-      request_type = compressed?"/tor/server/authority.z":
-        "/tor/server/authority";
-      cache_lifetime = ROUTERDESC_CACHE_LIFETIME;
-    } else if (!strcmpstart(url, "all")) {
-      request_type = compressed?"/tor/server/all.z":"/tor/server/all";
-      cache_lifetime = FULL_DIR_CACHE_LIFETIME;
-    } else if (!strcmpstart(url, "d/")) {
-      request_type = compressed?"/tor/server/d.z":"/tor/server/d";
-      if (smartlist_len(conn->fingerprint_stack) == 1)
-        cache_lifetime = ROUTERDESC_BY_DIGEST_CACHE_LIFETIME;
-    } else {
-      request_type = "/tor/server/?";
-    }
-    (void) request_type; /* usable for note_request. */
-    if (!strcmpstart(url, "d/"))
-      conn->dir_spool_src =
-        is_extra ? DIR_SPOOL_EXTRA_BY_DIGEST : DIR_SPOOL_SERVER_BY_DIGEST;
-    else
-      conn->dir_spool_src =
-        is_extra ? DIR_SPOOL_EXTRA_BY_FP : DIR_SPOOL_SERVER_BY_FP;
-
-    if (!dirserv_have_any_serverdesc(conn->fingerprint_stack,
-                                     conn->dir_spool_src)) {
-      res = -1;
-      msg = "Not found";
-    }
-
-    if (res < 0)
-      write_http_status_line(conn, 404, msg);
-    else {
-      dlen = dirserv_estimate_data_size(conn->fingerprint_stack,
-                                        1, compressed);
-      if (global_write_bucket_low(TO_CONN(conn), dlen, 2)) {
-        log_info(LD_DIRSERV,
-                 "Client asked for server descriptors, but we've been "
-                 "writing too many bytes lately. Sending 503 Dir busy.");
-        write_http_status_line(conn, 503, "Directory busy, try again later");
-        conn->dir_spool_src = DIR_SPOOL_NONE;
-        goto done;
-      }
-      write_http_response_header(conn, -1, compressed, cache_lifetime);
-      if (compressed)
-        conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD);
-      /* Prime the connection with some data. */
-      connection_dirserv_flushed_some(conn);
-    }
-    goto done;
+/** Helper function for GET /tor/keys/...: send v3 authority key
+ * certificates. */
+static int
+handle_get_keys(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  const char *url = args->url;
+  const int compressed = args->compressed;
+  smartlist_t *certs = smartlist_create();
+  ssize_t len = -1;
+  if (!strcmp(url, "/tor/keys/all")) {
+    authority_cert_get_all(certs);
+  } else if (!strcmp(url, "/tor/keys/authority")) {
+    authority_cert_t *cert = get_my_v3_authority_cert();
+    if (cert)
+      smartlist_add(certs, cert);
+  } else if (!strcmpstart(url, "/tor/keys/fp/")) {
+    smartlist_t *fps = smartlist_create();
+    dir_split_resource_into_fingerprints(url+strlen("/tor/keys/fp/"),
+                                         fps, NULL,
+                                         DSR_HEX|DSR_SORT_UNIQ);
+    SMARTLIST_FOREACH(fps, char *, d, {
+        authority_cert_t *c = authority_cert_get_newest_by_id(d);
+        if (c) smartlist_add(certs, c);
+        tor_free(d);
+    });
+    smartlist_free(fps);
+  } else if (!strcmpstart(url, "/tor/keys/sk/")) {
+    smartlist_t *fps = smartlist_create();
+    dir_split_resource_into_fingerprints(url+strlen("/tor/keys/sk/"),
+                                         fps, NULL,
+                                         DSR_HEX|DSR_SORT_UNIQ);
+    SMARTLIST_FOREACH(fps, char *, d, {
+        authority_cert_t *c = authority_cert_get_by_sk_digest(d);
+        if (c) smartlist_add(certs, c);
+        tor_free(d);
+    });
+    smartlist_free(fps);
+  } else if (!strcmpstart(url, "/tor/keys/fp-sk/")) {
+    smartlist_t *fp_sks = smartlist_create();
+    dir_split_resource_into_fingerprint_pairs(url+strlen("/tor/keys/fp-sk/"),
+                                              fp_sks);
+    SMARTLIST_FOREACH(fp_sks, fp_pair_t *, pair, {
+        authority_cert_t *c = authority_cert_get_by_digests(pair->first,
+                                                            pair->second);
+        if (c) smartlist_add(certs, c);
+        tor_free(pair);
+    });
+    smartlist_free(fp_sks);
+  } else {
+    write_http_status_line(conn, 400, "Bad request");
+    goto keys_done;
+  }
+  if (!smartlist_len(certs)) {
+    write_http_status_line(conn, 404, "Not found");
+    goto keys_done;
   }
+  SMARTLIST_FOREACH(certs, authority_cert_t *, c,
+    if (c->cache_info.published_on < args->if_modified_since)
+      SMARTLIST_DEL_CURRENT(certs, c));
+  if (!smartlist_len(certs)) {
+    write_http_status_line(conn, 304, "Not modified");
+    goto keys_done;
+  }
+  len = 0;
+  SMARTLIST_FOREACH(certs, authority_cert_t *, c,
+                    len += c->cache_info.signed_descriptor_len);
 
-  if (!strcmpstart(url,"/tor/keys/")) {
-    smartlist_t *certs = smartlist_create();
-    ssize_t len = -1;
-    if (!strcmp(url, "/tor/keys/all")) {
-      authority_cert_get_all(certs);
-    } else if (!strcmp(url, "/tor/keys/authority")) {
-      authority_cert_t *cert = get_my_v3_authority_cert();
-      if (cert)
-        smartlist_add(certs, cert);
-    } else if (!strcmpstart(url, "/tor/keys/fp/")) {
-      smartlist_t *fps = smartlist_create();
-      dir_split_resource_into_fingerprints(url+strlen("/tor/keys/fp/"),
-                                           fps, NULL,
-                                           DSR_HEX|DSR_SORT_UNIQ);
-      SMARTLIST_FOREACH(fps, char *, d, {
-          authority_cert_t *c = authority_cert_get_newest_by_id(d);
-          if (c) smartlist_add(certs, c);
-          tor_free(d);
-      });
-      smartlist_free(fps);
-    } else if (!strcmpstart(url, "/tor/keys/sk/")) {
-      smartlist_t *fps = smartlist_create();
-      dir_split_resource_into_fingerprints(url+strlen("/tor/keys/sk/"),
-                                           fps, NULL,
-                                           DSR_HEX|DSR_SORT_UNIQ);
-      SMARTLIST_FOREACH(fps, char *, d, {
-          authority_cert_t *c = authority_cert_get_by_sk_digest(d);
-          if (c) smartlist_add(certs, c);
-          tor_free(d);
-      });
-      smartlist_free(fps);
-    } else if (!strcmpstart(url, "/tor/keys/fp-sk/")) {
-      smartlist_t *fp_sks = smartlist_create();
-      dir_split_resource_into_fingerprint_pairs(url+strlen("/tor/keys/fp-sk/"),
-                                                fp_sks);
-      SMARTLIST_FOREACH(fp_sks, fp_pair_t *, pair, {
-          authority_cert_t *c = authority_cert_get_by_digests(pair->first,
-                                                              pair->second);
-          if (c) smartlist_add(certs, c);
-          tor_free(pair);
+  if (global_write_bucket_low(TO_CONN(conn), compressed?len/2:len, 2)) {
+    write_http_status_line(conn, 503, "Directory busy, try again later.");
+    goto keys_done;
+  }
+
+  if (compressed && conn->keep_alive) {
+    /* Compress the certificates all at once, so that we can say how long
+     * the response is and keep the connection open. */
+    char *body = tor_malloc(len), *cp = body, *z = NULL;
+    size_t z_len = 0;
+    SMARTLIST_FOREACH(certs, authority_cert_t *, c, {
+        memcpy(cp, c->cache_info.signed_descriptor_body,
+               c->cache_info.signed_descriptor_len);
+        cp += c->cache_info.signed_descriptor_len;
       });
-      smartlist_free(fp_sks);
+    if (tor_gzip_compress(&z, &z_len, body, len, ZLIB_METHOD) < 0) {
+      write_http_status_line(conn, 503, "Internal error");
     } else {
-      write_http_status_line(conn, 400, "Bad request");
-      goto keys_done;
-    }
-    if (!smartlist_len(certs)) {
-      write_http_status_line(conn, 404, "Not found");
-      goto keys_done;
+      write_http_response_header(conn, z_len, 1, 60*60);
+      connection_write_to_buf(z, z_len, TO_CONN(conn));
     }
+    tor_free(body);
+    tor_free(z);
+    goto keys_done;
+  }
+
+  write_http_response_header(conn, compressed?-1:len, compressed, 60*60);
+  if (compressed) {
+    conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD,
+                                    choose_compression_level(len));
     SMARTLIST_FOREACH(certs, authority_cert_t *, c,
-      if (c->cache_info.published_on < if_modified_since)
-        SMARTLIST_DEL_CURRENT(certs, c));
-    if (!smartlist_len(certs)) {
-      write_http_status_line(conn, 304, "Not modified");
-      goto keys_done;
-    }
-    len = 0;
+          connection_write_to_buf_zlib(c->cache_info.signed_descriptor_body,
+                                       c->cache_info.signed_descriptor_len,
+                                       conn, 0));
+    connection_write_to_buf_zlib("", 0, conn, 1);
+  } else {
     SMARTLIST_FOREACH(certs, authority_cert_t *, c,
-                      len += c->cache_info.signed_descriptor_len);
-
-    if (global_write_bucket_low(TO_CONN(conn), compressed?len/2:len, 2)) {
-      write_http_status_line(conn, 503, "Directory busy, try again later.");
-      goto keys_done;
-    }
-
-    write_http_response_header(conn, compressed?-1:len, compressed, 60*60);
-    if (compressed) {
-      conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD);
-      SMARTLIST_FOREACH(certs, authority_cert_t *, c,
-            connection_write_to_buf_zlib(c->cache_info.signed_descriptor_body,
-                                         c->cache_info.signed_descriptor_len,
-                                         conn, 0));
-      connection_write_to_buf_zlib("", 0, conn, 1);
-    } else {
-      SMARTLIST_FOREACH(certs, authority_cert_t *, c,
-            connection_write_to_buf(c->cache_info.signed_descriptor_body,
-                                    c->cache_info.signed_descriptor_len,
-                                    TO_CONN(conn)));
-    }
-  keys_done:
-    smartlist_free(certs);
-    goto done;
+          connection_write_to_buf(c->cache_info.signed_descriptor_body,
+                                  c->cache_info.signed_descriptor_len,
+                                  TO_CONN(conn)));
   }
+ keys_done:
+  smartlist_free(certs);
+  return 0;
+}
 
-  if (options->HidServDirectoryV2 &&
-       !strcmpstart(url,"/tor/rendezvous2/")) {
-    /* Handle v2 rendezvous descriptor fetch request. */
-    const char *descp;
-    const char *query = url + strlen("/tor/rendezvous2/");
-    if (strlen(query) == REND_DESC_ID_V2_LEN_BASE32) {
-      log_info(LD_REND, "Got a v2 rendezvous descriptor request for ID '%s'",
-               safe_str(query));
-      switch (rend_cache_lookup_v2_desc_as_dir(query, &descp)) {
-        case 1: /* valid */
-          write_http_response_header(conn, strlen(descp), 0, 0);
-          connection_write_to_buf(descp, strlen(descp), TO_CONN(conn));
-          break;
-        case 0: /* well-formed but not present */
-          write_http_status_line(conn, 404, "Not found");
-          break;
-        case -1: /* not well-formed */
-          write_http_status_line(conn, 400, "Bad request");
-          break;
-      }
-    } else { /* not well-formed */
-      write_http_status_line(conn, 400, "Bad request");
-    }
-    goto done;
-  }
+/** Helper function for GET /tor/rendezvous2/...: send a v2 rendezvous
+ * service descriptor, if we're a hidden service directory. */
+static int
+handle_get_rendezvous2(dir_connection_t *conn,
+                       const get_handler_args_t *args)
+{
+  const char *descp;
+  const char *query = args->url + strlen("/tor/rendezvous2/");
 
-  if (options->HSAuthoritativeDir && !strcmpstart(url,"/tor/rendezvous/")) {
-    /* rendezvous descriptor fetch */
-    const char *descp;
-    size_t desc_len;
-    const char *query = url+strlen("/tor/rendezvous/");
+  if (!get_options()->HidServDirectoryV2) {
+    write_http_status_line(conn, 404, "Not found");
+    return 0;
+  }
 
-    log_info(LD_REND, "Handling rendezvous descriptor get");
-    switch (rend_cache_lookup_desc(query, 0, &descp, &desc_len)) {
+  if (strlen(query) == REND_DESC_ID_V2_LEN_BASE32) {
+    log_info(LD_REND, "Got a v2 rendezvous descriptor request for ID '%s'",
+             safe_str(query));
+    switch (rend_cache_lookup_v2_desc_as_dir(query, &descp)) {
       case 1: /* valid */
-        write_http_response_header_impl(conn, desc_len,
-                                        "application/octet-stream",
-                                        NULL, NULL, 0);
-        note_request("/tor/rendezvous?/", desc_len);
-        /* need to send descp separately, because it may include NULs */
-        connection_write_to_buf(descp, desc_len, TO_CONN(conn));
+        write_http_response_header(conn, strlen(descp), 0, 0);
+        connection_write_to_buf(descp, strlen(descp), TO_CONN(conn));
         break;
       case 0: /* well-formed but not present */
         write_http_status_line(conn, 404, "Not found");
@@ -3227,117 +4566,332 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
         write_http_status_line(conn, 400, "Bad request");
         break;
     }
-    goto done;
+  } else { /* not well-formed */
+    write_http_status_line(conn, 400, "Bad request");
   }
+  return 0;
+}
 
-  if (options->BridgeAuthoritativeDir &&
-      options->BridgePassword &&
-      connection_dir_is_encrypted(conn) &&
-      !strcmp(url,"/tor/networkstatus-bridges")) {
-    char *status;
-    char *secret = alloc_http_authenticator(options->BridgePassword);
+/** Helper function for GET /tor/rendezvous/...: send a v0 rendezvous
+ * service descriptor, if we're a hidden service authority. */
+static int
+handle_get_rendezvous(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  const char *descp;
+  size_t desc_len;
+  const char *query = args->url+strlen("/tor/rendezvous/");
 
-    header = http_get_header(headers, "Authorization: Basic ");
+  if (!get_options()->HSAuthoritativeDir) {
+    write_http_status_line(conn, 404, "Not found");
+    return 0;
+  }
 
-    /* now make sure the password is there and right */
-    if (!header || strcmp(header, secret)) {
+  log_info(LD_REND, "Handling rendezvous descriptor get");
+  switch (rend_cache_lookup_desc(query, 0, &descp, &desc_len)) {
+    case 1: /* valid */
+      write_http_response_header_impl(conn, desc_len,
+                                      "application/octet-stream",
+                                      NULL, NULL, 0);
+      note_request("/tor/rendezvous?/", desc_len);
+      /* need to send descp separately, because it may include NULs */
+      connection_write_to_buf(descp, desc_len, TO_CONN(conn));
+      break;
+    case 0: /* well-formed but not present */
       write_http_status_line(conn, 404, "Not found");
-      tor_free(secret);
-      tor_free(header);
-      goto done;
-    }
-    tor_free(secret);
-    tor_free(header);
-
-    /* all happy now. send an answer. */
-    status = networkstatus_getinfo_by_purpose("bridge", time(NULL));
-    dlen = strlen(status);
-    write_http_response_header(conn, dlen, 0, 0);
-    connection_write_to_buf(status, dlen, TO_CONN(conn));
-    tor_free(status);
-    goto done;
+      break;
+    case -1: /* not well-formed */
+      write_http_status_line(conn, 400, "Bad request");
+      break;
   }
+  return 0;
+}
 
-  if (!strcmpstart(url,"/tor/bytes.txt")) {
-    char *bytes = directory_dump_request_log();
-    size_t len = strlen(bytes);
-    write_http_response_header(conn, len, 0, 0);
-    connection_write_to_buf(bytes, len, TO_CONN(conn));
-    tor_free(bytes);
-    goto done;
+/** Helper function for GET /tor/networkstatus-bridges: send the bridge
+ * networkstatus to somebody who knows our BridgePassword. */
+static int
+handle_get_networkstatus_bridges(dir_connection_t *conn,
+                                 const get_handler_args_t *args)
+{
+  const or_options_t *options = get_options();
+  char *status, *secret, *header;
+  size_t dlen;
+
+  if (!options->BridgeAuthoritativeDir ||
+      !options->BridgePassword ||
+      !connection_dir_is_encrypted(conn)) {
+    write_http_status_line(conn, 404, "Not found");
+    return 0;
   }
 
-  if (!strcmp(url,"/tor/robots.txt")) { /* /robots.txt will have been
-                                           rewritten to /tor/robots.txt */
-    char robots[] = "User-agent: *\r\nDisallow: /\r\n";
-    size_t len = strlen(robots);
-    write_http_response_header(conn, len, 0, ROBOTS_CACHE_LIFETIME);
-    connection_write_to_buf(robots, len, TO_CONN(conn));
-    goto done;
+  secret = alloc_http_authenticator(options->BridgePassword);
+  header = http_get_header(args->headers, "Authorization: Basic ");
+
+  /* now make sure the password is there and right */
+  if (!header || strcmp(header, secret)) {
+    write_http_status_line(conn, 404, "Not found");
+    tor_free(secret);
+    tor_free(header);
+    return 0;
   }
+  tor_free(secret);
+  tor_free(header);
 
-  if (!strcmp(url,"/tor/dbg-stability.txt")) {
-    const char *stability;
-    size_t len;
-    if (options->BridgeAuthoritativeDir ||
-        ! authdir_mode_tests_reachability(options) ||
-        ! (stability = rep_hist_get_router_stability_doc(time(NULL)))) {
-      write_http_status_line(conn, 404, "Not found.");
-      goto done;
-    }
+  /* all happy now. send an answer. */
+  status = networkstatus_getinfo_by_purpose("bridge", time(NULL));
+  dlen = strlen(status);
+  write_http_response_header(conn, dlen, 0, 0);
+  connection_write_to_buf(status, dlen, TO_CONN(conn));
+  tor_free(status);
+  return 0;
+}
 
-    len = strlen(stability);
-    write_http_response_header(conn, len, 0, 0);
-    connection_write_to_buf(stability, len, TO_CONN(conn));
-    goto done;
+/** Helper function for GET /tor/bytes.txt: send our download
+ * instrumentation, if we have any. */
+static int
+handle_get_bytes(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  char *bytes = directory_dump_request_log();
+  size_t len = strlen(bytes);
+  (void) args;
+  write_http_response_header(conn, len, 0, 0);
+  connection_write_to_buf(bytes, len, TO_CONN(conn));
+  tor_free(bytes);
+  return 0;
+}
+
+/** Helper function for GET /tor/robots.txt (which /robots.txt will have
+ * been rewritten to): ask crawlers to go away. */
+static int
+handle_get_robots(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  char robots[] = "User-agent: *\r\nDisallow: /\r\n";
+  size_t len = strlen(robots);
+  (void) args;
+  write_http_response_header(conn, len, 0, ROBOTS_CACHE_LIFETIME);
+  connection_write_to_buf(robots, len, TO_CONN(conn));
+  return 0;
+}
+
+/** Helper function for GET /tor/dbg-stability.txt: send our router
+ * stability document, if we're an authority that tests reachability. */
+static int
+handle_get_stability(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  const or_options_t *options = get_options();
+  const char *stability;
+  size_t len;
+  (void) args;
+  if (options->BridgeAuthoritativeDir ||
+      ! authdir_mode_tests_reachability(options) ||
+      ! (stability = rep_hist_get_router_stability_doc(time(NULL)))) {
+    write_http_status_line(conn, 404, "Not found.");
+    return 0;
   }
 
+  len = strlen(stability);
+  write_http_response_header(conn, len, 0, 0);
+  connection_write_to_buf(stability, len, TO_CONN(conn));
+  return 0;
+}
+
 #if defined(EXPORTMALLINFO) && defined(HAVE_MALLOC_H) && defined(HAVE_MALLINFO)
 #define ADD_MALLINFO_LINE(x) do {                               \
     tor_snprintf(tmp, sizeof(tmp), "%s %d\n", #x, mi.x);        \
     smartlist_add(lines, tor_strdup(tmp));                      \
   }while(0);
 
-  if (!strcmp(url,"/tor/mallinfo.txt") &&
-      (tor_addr_eq_ipv4h(&conn->_base.addr, 0x7f000001ul))) {
-    char *result;
-    size_t len;
-    struct mallinfo mi;
-    smartlist_t *lines;
-    char tmp[256];
-
-    memset(&mi, 0, sizeof(mi));
-    mi = mallinfo();
-    lines = smartlist_create();
-
-    ADD_MALLINFO_LINE(arena)
-    ADD_MALLINFO_LINE(ordblks)
-    ADD_MALLINFO_LINE(smblks)
-    ADD_MALLINFO_LINE(hblks)
-    ADD_MALLINFO_LINE(hblkhd)
-    ADD_MALLINFO_LINE(usmblks)
-    ADD_MALLINFO_LINE(fsmblks)
-    ADD_MALLINFO_LINE(uordblks)
-    ADD_MALLINFO_LINE(fordblks)
-    ADD_MALLINFO_LINE(keepcost)
-
-    result = smartlist_join_strings(lines, "", 0, NULL);
-    SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
-    smartlist_free(lines);
-
-    len = strlen(result);
-    write_http_response_header(conn, len, 0, 0);
-    connection_write_to_buf(result, len, TO_CONN(conn));
-    tor_free(result);
-    goto done;
+/** Helper function for GET /tor/mallinfo.txt: send our malloc statistics
+ * to a request from localhost. */
+static int
+handle_get_mallinfo(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  char *result;
+  size_t len;
+  struct mallinfo mi;
+  smartlist_t *lines;
+  char tmp[256];
+  (void) args;
+
+  if (!tor_addr_eq_ipv4h(&conn->_base.addr, 0x7f000001ul)) {
+    write_http_status_line(conn, 404, "Not found");
+    return 0;
   }
+
+  memset(&mi, 0, sizeof(mi));
+  mi = mallinfo();
+  lines = smartlist_create();
+
+  ADD_MALLINFO_LINE(arena)
+  ADD_MALLINFO_LINE(ordblks)
+  ADD_MALLINFO_LINE(smblks)
+  ADD_MALLINFO_LINE(hblks)
+  ADD_MALLINFO_LINE(hblkhd)
+  ADD_MALLINFO_LINE(usmblks)
+  ADD_MALLINFO_LINE(fsmblks)
+  ADD_MALLINFO_LINE(uordblks)
+  ADD_MALLINFO_LINE(fordblks)
+  ADD_MALLINFO_LINE(keepcost)
+
+  result = smartlist_join_strings(lines, "", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+
+  len = strlen(result);
+  write_http_response_header(conn, len, 0, 0);
+  connection_write_to_buf(result, len, TO_CONN(conn));
+  tor_free(result);
+  return 0;
+}
 #endif
 
-  /* we didn't recognize the url */
-  write_http_status_line(conn, 404, "Not found");
+/** A POST of router descriptors and extra-info documents whose signatures a
+ * cpuworker is checking, so that we can add them without doing any public
+ * key operations in the main thread. */
+typedef struct descriptor_upload_t {
+  /** Global identifier of the connection that we'll answer. */
+  uint64_t conn_id;
+  /** The uploaded documents, nul-terminated. */
+  char *body;
+  /** Length of <b>body</b>. */
+  size_t body_len;
+  /** The purpose to give the routers that we add. */
+  uint8_t purpose;
+  /** The address of the uploader, for annotations and log messages. */
+  char *source;
+  /** Set by the cpuworker: digests of the documents with good signatures. */
+  smartlist_t *digests;
+  /** Set by the cpuworker: for each digest, the key that signed it. */
+  smartlist_t *keys;
+} descriptor_upload_t;
+
+/** How many descriptor POSTs may the cpuworkers be checking at once?  Past
+ * this, we handle more POSTs as they arrive. */
+#define MAX_DESCRIPTOR_UPLOADS_PENDING 128
+
+/** How many descriptor POSTs are the cpuworkers checking now? */
+static int n_descriptor_uploads_pending = 0;
+
+/** Add the router descriptors and extra-info documents in <b>body</b>,
+ * POSTed by <b>source</b>, with purpose <b>purpose</b>.  If <b>conn</b> is
+ * set, answer it with how that went. */
+static void
+directory_handle_descriptor_post(dir_connection_t *conn, const char *body,
+                                 uint8_t purpose, const char *source)
+{
+  const char *msg = "[None]";
+  was_router_added_t r = dirserv_add_multiple_descriptors(body, purpose,
+                                                          source, &msg);
+  tor_assert(msg);
+  if (WRA_WAS_ADDED(r))
+    dirserv_get_directory(); /* rebuild and write to disk */
+
+  if (!conn)
+    return;
 
- done:
-  tor_free(url_mem);
+  if (r == ROUTER_ADDED_NOTIFY_GENERATOR) {
+    /* Accepted with a message. */
+    log_info(LD_DIRSERV,
+             "Problematic router descriptor or extra-info from %s "
+             "(\"%s\").",
+             source, msg);
+    write_http_status_line(conn, 400, msg);
+  } else if (r == ROUTER_ADDED_SUCCESSFULLY) {
+    write_http_status_line(conn, 200, msg);
+  } else if (WRA_WAS_OUTDATED(r)) {
+    write_http_response_header_impl(conn, -1, NULL, NULL,
+                                    "X-Descriptor-Not-New: Yes\r\n", -1);
+  } else {
+    log_info(LD_DIRSERV,
+             "Rejected router descriptor or extra-info from %s "
+             "(\"%s\").",
+             source, msg);
+    write_http_status_line(conn, 400, msg);
+  }
+}
+
+/** Runs in a cpuworker: check the signatures in <b>arg</b>, a
+ * descriptor_upload_t. */
+static void
+descriptor_upload_check_work(void *arg)
+{
+  descriptor_upload_t *upload = arg;
+  router_check_uploaded_signatures(upload->body, upload->body_len,
+                                   upload->digests, upload->keys);
+}
+
+/** Runs in the main thread once a cpuworker has checked the signatures in
+ * <b>arg</b>, a descriptor_upload_t.  Remember the good ones, then add the
+ * documents and answer the uploader if it's still around.  The cpuworkers
+ * hand back every upload they've finished each time they wake us, so a
+ * burst of uploads gets added in batches. */
+static void
+descriptor_upload_check_done(void *arg)
+{
+  descriptor_upload_t *upload = arg;
+  connection_t *conn;
+  dir_connection_t *dir_conn = NULL;
+  int i;
+
+  --n_descriptor_uploads_pending;
+  for (i = 0; i < smartlist_len(upload->digests); ++i)
+    sigcache_add(smartlist_get(upload->digests, i), DIGEST_LEN,
+                 smartlist_get(upload->keys, i));
+
+  conn = connection_get_by_global_id(upload->conn_id);
+  if (conn && conn->type == CONN_TYPE_DIR && !conn->marked_for_close)
+    dir_conn = TO_DIR_CONN(conn);
+  else
+    log_info(LD_DIRSERV, "Connection that POSTed descriptors from %s closed "
+             "while we checked them; adding them anyway.", upload->source);
+  directory_handle_descriptor_post(dir_conn, upload->body, upload->purpose,
+                                   upload->source);
+
+  SMARTLIST_FOREACH(upload->digests, char *, d, tor_free(d));
+  SMARTLIST_FOREACH(upload->keys, crypto_pk_env_t *, k,
+                    crypto_free_pk_env(k));
+  smartlist_free(upload->digests);
+  smartlist_free(upload->keys);
+  tor_free(upload->body);
+  tor_free(upload->source);
+  tor_free(upload);
+}
+
+/** If we have cpuworkers and they aren't too busy, have them check the
+ * signatures on the <b>body_len</b>-byte POST of descriptors in
+ * <b>body</b>, and stop reading from <b>conn</b> until we've added them and
+ * answered it.  Return 0 if the cpuworkers have the POST, or -1 if we should
+ * handle it ourselves. */
+static int
+directory_queue_descriptor_post(dir_connection_t *conn, const char *body,
+                                size_t body_len, uint8_t purpose)
+{
+  descriptor_upload_t *upload;
+
+  if (!cpuworker_can_queue_work() ||
+      n_descriptor_uploads_pending >= MAX_DESCRIPTOR_UPLOADS_PENDING)
+    return -1;
+
+  upload = tor_malloc_zero(sizeof(descriptor_upload_t));
+  upload->conn_id = TO_CONN(conn)->global_identifier;
+  upload->body = tor_strndup(body, body_len);
+  upload->body_len = body_len;
+  upload->purpose = purpose;
+  upload->source = tor_strdup(conn->_base.address);
+  upload->digests = smartlist_create();
+  upload->keys = smartlist_create();
+  if (cpuworker_queue_work(descriptor_upload_check_work,
+                           descriptor_upload_check_done, upload) < 0) {
+    smartlist_free(upload->digests);
+    smartlist_free(upload->keys);
+    tor_free(upload->body);
+    tor_free(upload->source);
+    tor_free(upload);
+    return -1;
+  }
+  ++n_descriptor_uploads_pending;
+  connection_stop_reading(TO_CONN(conn));
+  log_debug(LD_DIRSERV, "Handed %d-byte descriptor POST from %s to the "
+            "cpuworkers.", (int)body_len, conn->_base.address);
   return 0;
 }
 
@@ -3397,34 +4951,11 @@ directory_handle_command_post(dir_connection_t *conn, const char *headers,
 
   if (authdir_mode_handles_descs(options, -1) &&
       !strcmp(url,"/tor/")) { /* server descriptor post */
-    const char *msg = "[None]";
     uint8_t purpose = authdir_mode_bridge(options) ?
                       ROUTER_PURPOSE_BRIDGE : ROUTER_PURPOSE_GENERAL;
-    was_router_added_t r = dirserv_add_multiple_descriptors(body, purpose,
-                                             conn->_base.address, &msg);
-    tor_assert(msg);
-    if (WRA_WAS_ADDED(r))
-      dirserv_get_directory(); /* rebuild and write to disk */
-
-    if (r == ROUTER_ADDED_NOTIFY_GENERATOR) {
-      /* Accepted with a message. */
-      log_info(LD_DIRSERV,
-               "Problematic router descriptor or extra-info from %s "
-               "(\"%s\").",
-               conn->_base.address, msg);
-      write_http_status_line(conn, 400, msg);
-    } else if (r == ROUTER_ADDED_SUCCESSFULLY) {
-      write_http_status_line(conn, 200, msg);
-    } else if (WRA_WAS_OUTDATED(r)) {
-      write_http_response_header_impl(conn, -1, NULL, NULL,
-                                      "X-Descriptor-Not-New: Yes\r\n", -1);
-    } else {
-      log_info(LD_DIRSERV,
-               "Rejected router descriptor or extra-info from %s "
-               "(\"%s\").",
-               conn->_base.address, msg);
-      write_http_status_line(conn, 400, msg);
-    }
+    if (directory_queue_descriptor_post(conn, body, body_len, purpose) < 0)
+      directory_handle_descriptor_post(conn, body, purpose,
+                                       conn->_base.address);
     goto done;
   }
 
@@ -3512,6 +5043,10 @@ directory_handle_command(dir_connection_t *conn)
   http_set_address_origin(headers, TO_CONN(conn));
   //log_debug(LD_DIRSERV,"headers %s, body %s.", headers, body);
 
+  /* We only keep connections open after answering a GET. */
+  conn->keep_alive = !strncasecmp(headers,"GET",3) &&
+    http_headers_want_keep_alive(headers);
+
   if (!strncasecmp(headers,"GET",3))
     r = directory_handle_command_get(conn, headers, body, body_len);
   else if (!strncasecmp(headers,"POST",4))
@@ -3552,9 +5087,24 @@ connection_dir_finished_flushing(dir_connection_t *conn)
     case DIR_CONN_STATE_CLIENT_SENDING:
       log_debug(LD_DIR,"client finished sending command.");
       conn->_base.state = DIR_CONN_STATE_CLIENT_READING;
+      tor_gettimeofday(&conn->request_sent);
       return 0;
     case DIR_CONN_STATE_SERVER_WRITING:
-      if (conn->dir_spool_src != DIR_SPOOL_NONE) {
+      if (conn->dir_spool_src == DIR_SPOOL_NONE)
+        connection_dir_note_response_done(conn);
+      if (conn->dir_spool_src == DIR_SPOOL_NONE && conn->keep_alive) {
+        log_debug(LD_DIRSERV, "Finished writing server response. Waiting "
+                  "for another request.");
+        tor_zlib_free(conn->zlib_state);
+        conn->zlib_state = NULL;
+        conn->spool_method = NO_METHOD;
+        conn->answered_request = 1;
+        conn->_base.state = DIR_CONN_STATE_SERVER_COMMAND_WAIT;
+        /* The client may have sent its next request already.  (If it's
+         * bad, connection_dir_process_inbuf() will close us.) */
+        if (connection_get_inbuf_len(TO_CONN(conn)))
+          connection_dir_process_inbuf(conn);
+      } else if (conn->dir_spool_src != DIR_SPOOL_NONE) {
 #ifdef USE_BUFFEREVENTS
         /* This can happen with paired bufferevents, since a paired connection
          * can flush immediately when you write to it, making the subsequent
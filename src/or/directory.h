@@ -43,8 +43,13 @@ void directory_initiate_command_routerstatus_rend(const routerstatus_t *status,
 int parse_http_response(const char *headers, int *code, time_t *date,
                         compress_method_t *compression, char **response);
 
+void dir_body_stream_free(dir_body_stream_t *stream);
+void directory_free_all(void);
+
 int connection_dir_is_encrypted(dir_connection_t *conn);
 int connection_dir_reached_eof(dir_connection_t *conn);
+int connection_dir_is_idle_expired(connection_t *conn, time_t now);
+int connection_dir_is_slow_descriptor_fetch(connection_t *conn, time_t now);
 int connection_dir_process_inbuf(dir_connection_t *conn);
 int connection_dir_finished_flushing(dir_connection_t *conn);
 int connection_dir_finished_connecting(dir_connection_t *conn);
@@ -105,5 +110,24 @@ download_status_mark_impossible(download_status_t *dl)
 
 int download_status_get_n_failures(const download_status_t *dls);
 
+#ifdef DIRECTORY_PRIVATE
+dir_body_stream_t *dir_body_stream_new(char *headers, int may_decompress);
+int dir_body_stream_is_complete(const dir_body_stream_t *stream);
+int dir_body_stream_add(dir_body_stream_t *stream, const char *data,
+                        size_t len);
+int dir_body_stream_finish(dir_body_stream_t *stream,
+                           char **headers_out, char **body_out,
+                           size_t *body_len_out, size_t *raw_len_out,
+                           int *decompressed_out);
+int http_etag_list_matches(const char *if_none_match, const char *digest);
+int dir_partial_download_save(const char *flavor, dir_body_stream_t *stream,
+                              time_t now);
+dir_body_stream_t *dir_partial_download_resume(const char *flavor,
+                                               char *headers, time_t now);
+int http_parse_range_start(const char *range, size_t *start_out);
+int http_parse_content_range(const char *value, size_t *start_out,
+                             size_t *end_out, size_t *total_out);
+#endif
+
 #endif
 
@@ -9,7 +9,9 @@
 #include "config.h"
 #include "connection.h"
 #include "connection_or.h"
+#include "consdiff.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -75,6 +77,10 @@ dirserv_get_status_impl(const char *fp, const char *nickname,
                         const char *platform, const char *contact,
                         const char **msg, int should_log);
 static void clear_cached_dir(cached_dir_t *d);
+static void cached_dir_compress(cached_dir_t *d, int all_methods);
+static void dirserv_update_consensus_diffs(const char *flavor_name,
+                                           cached_dir_t *old,
+                                           cached_dir_t *current);
 static const signed_descriptor_t *get_signed_descriptor_by_fp(
                                                         const char *fp,
                                                         int extrainfo,
@@ -320,7 +326,8 @@ dirserv_router_get_status(const routerinfo_t *router, const char **msg)
   return dirserv_get_status_impl(d, router->nickname,
                                  router->address,
                                  router->addr, router->or_port,
-                                 router->platform, router->contact_info,
+                                 router_get_platform(router),
+                                 router_get_contact_info(router),
                                  msg, 1);
 }
 
@@ -547,7 +554,8 @@ authdir_wants_to_reject_router(routerinfo_t *ri, const char **msg,
   /* Okay.  Now check whether the fingerprint is recognized. */
   uint32_t status = dirserv_router_get_status(ri, msg);
   time_t now;
-  int severity = (complain && ri->contact_info) ? LOG_NOTICE : LOG_INFO;
+  int severity = (complain && router_get_contact_info(ri)) ?
+    LOG_NOTICE : LOG_INFO;
   tor_assert(msg);
   if (status & FP_REJECT)
     return -1; /* msg is already set. */
@@ -1318,6 +1326,19 @@ static digestmap_t *cached_v2_networkstatus = NULL;
  * currently serving. */
 static strmap_t *cached_consensuses = NULL;
 
+/** How long do we keep superseded consensuses around to make diffs from? */
+#define CONSENSUS_DIFF_MAX_AGE (3*60*60)
+
+/** Map from flavor name to a smartlist of cached_dir_t for the consensuses
+ * of that flavor that we served recently, oldest first, not counting the
+ * current one. */
+static strmap_t *old_consensuses = NULL;
+
+/** Map from a flavor name, a slash, and the hex SHA256 digest of one of the
+ * consensuses in old_consensuses to a cached_dir_t holding a diff from that
+ * consensus to the current consensus of that flavor. */
+static strmap_t *consensus_diffs = NULL;
+
 /** Possibly replace the contents of <b>d</b> with the value of
  * <b>directory</b> published on <b>when</b>, unless <b>when</b> is older than
  * the last value, or too far in the future.
@@ -1341,6 +1362,7 @@ set_cached_dir(cached_dir_t *d, char *directory, time_t when)
     d->dir = directory;
     d->dir_len = strlen(directory);
     tor_free(d->dir_z);
+    tor_free(d->dir_lzma);
     if (tor_gzip_compress(&(d->dir_z), &(d->dir_z_len), d->dir, d->dir_len,
                           ZLIB_METHOD)) {
       log_warn(LD_BUG,"Error compressing cached directory");
@@ -1370,11 +1392,58 @@ new_cached_dir(char *s, time_t published)
   d->dir = s;
   d->dir_len = strlen(s);
   d->published = published;
+  cached_dir_compress(d, 0);
+  return d;
+}
+
+/** Compress the contents of <b>d</b> with zlib, and if <b>all_methods</b>
+ * is true, with every other method we support too.  This only touches
+ * <b>d</b>, so a cpuworker can do it for a cached_dir_t that nobody else
+ * has seen yet. */
+static void
+cached_dir_compress(cached_dir_t *d, int all_methods)
+{
   if (tor_gzip_compress(&(d->dir_z), &(d->dir_z_len), d->dir, d->dir_len,
                         ZLIB_METHOD)) {
     log_warn(LD_BUG, "Error compressing directory");
   }
-  return d;
+  if (all_methods && tor_compress_supports_method(LZMA_METHOD) &&
+      tor_gzip_compress(&d->dir_lzma, &d->dir_lzma_len, d->dir, d->dir_len,
+                        LZMA_METHOD) < 0) {
+    log_warn(LD_BUG, "Error compressing directory with LZMA");
+  }
+}
+
+/** Return the contents of <b>d</b> compressed with <b>method</b>, which
+ * must be ZLIB_METHOD or LZMA_METHOD, and set *<b>len_out</b> to their
+ * length.  We only compress with LZMA the first time somebody asks.  Return
+ * NULL if we can't compress it that way. */
+const char *
+cached_dir_get_compressed(cached_dir_t *d, compress_method_t method,
+                          size_t *len_out)
+{
+  if (method != LZMA_METHOD) {
+    *len_out = d->dir_z_len;
+    return d->dir_z;
+  }
+  if (!d->dir_lzma && tor_compress_supports_method(LZMA_METHOD)) {
+    char *body = d->dir;
+    size_t body_len = d->dir_len;
+    /* Spooled batches only keep their compressed form. */
+    if (!body && d->dir_z &&
+        tor_gzip_uncompress(&body, &body_len, d->dir_z, d->dir_z_len,
+                            ZLIB_METHOD, 1, LOG_WARN) < 0)
+      body = NULL;
+    if (body &&
+        tor_gzip_compress(&d->dir_lzma, &d->dir_lzma_len, body, body_len,
+                          LZMA_METHOD) < 0) {
+      log_warn(LD_BUG, "Error compressing directory with LZMA");
+    }
+    if (body != d->dir)
+      tor_free(body);
+  }
+  *len_out = d->dir_lzma_len;
+  return d->dir_lzma;
 }
 
 /** Remove all storage held in <b>d</b>, but do not free <b>d</b> itself. */
@@ -1383,6 +1452,7 @@ clear_cached_dir(cached_dir_t *d)
 {
   tor_free(d->dir);
   tor_free(d->dir_z);
+  tor_free(d->dir_lzma);
   memset(d, 0, sizeof(cached_dir_t));
 }
 
@@ -1488,26 +1558,177 @@ dirserv_set_cached_networkstatus_v2(const char *networkstatus,
   }
 }
 
+/** Start serving <b>current</b>, which we now hold the only reference to,
+ * as our v3 consensus networkstatus of type <b>flavor_name</b>, unless we
+ * already serve a newer one. */
+static void
+dirserv_publish_cached_consensus(const char *flavor_name,
+                                 cached_dir_t *current)
+{
+  cached_dir_t *old;
+  if (!cached_consensuses)
+    cached_consensuses = strmap_new();
+
+  old = strmap_get(cached_consensuses, flavor_name);
+  if (old && old->published > current->published) {
+    log_info(LD_DIRSERV, "We started serving a newer %s consensus while we "
+             "compressed this one; discarding it.", flavor_name);
+    cached_dir_decref(current);
+    return;
+  }
+  strmap_set(cached_consensuses, flavor_name, current);
+  dirserv_update_consensus_diffs(flavor_name, old, current);
+}
+
+/** A consensus that a cpuworker is compressing before we serve it. */
+typedef struct consensus_compress_job_t {
+  /** Which flavor of consensus is this? */
+  char *flavor_name;
+  /** The consensus.  Only the cpuworker touches this until it's done. */
+  cached_dir_t *dir;
+} consensus_compress_job_t;
+
+/** Runs in a cpuworker: compress <b>arg</b>, a consensus_compress_job_t,
+ * every way that a client might ask for it. */
+static void
+consensus_compress_work(void *arg)
+{
+  consensus_compress_job_t *job = arg;
+  cached_dir_compress(job->dir, 1);
+}
+
+/** Runs in the main thread once a cpuworker has compressed <b>arg</b>, a
+ * consensus_compress_job_t: start serving the consensus. */
+static void
+consensus_compress_done(void *arg)
+{
+  consensus_compress_job_t *job = arg;
+  dirserv_publish_cached_consensus(job->flavor_name, job->dir);
+  tor_free(job->flavor_name);
+  tor_free(job);
+}
+
 /** Replace the v3 consensus networkstatus of type <b>flavor_name</b> that
  * we're serving with <b>networkstatus</b>, published at <b>published</b>.  No
- * validation is performed. */
+ * validation is performed.
+ *
+ * If we have cpuworkers, we keep serving the old consensus while one of
+ * them compresses the new one, and switch over once it's done. */
 void
 dirserv_set_cached_consensus_networkstatus(const char *networkstatus,
                                            const char *flavor_name,
                                            const digests_t *digests,
                                            time_t published)
 {
-  cached_dir_t *new_networkstatus;
-  cached_dir_t *old_networkstatus;
-  if (!cached_consensuses)
-    cached_consensuses = strmap_new();
+  cached_dir_t *d = tor_malloc_zero(sizeof(cached_dir_t));
+  consensus_compress_job_t *job;
+
+  d->refcnt = 1;
+  d->dir = tor_strdup(networkstatus);
+  d->dir_len = strlen(networkstatus);
+  d->published = published;
+  memcpy(&d->digests, digests, sizeof(digests_t));
+
+  if (cpuworker_can_queue_work()) {
+    job = tor_malloc_zero(sizeof(consensus_compress_job_t));
+    job->flavor_name = tor_strdup(flavor_name);
+    job->dir = d;
+    if (cpuworker_queue_work(consensus_compress_work,
+                             consensus_compress_done, job) == 0) {
+      log_debug(LD_DIRSERV, "Handed %d-byte %s consensus to the cpuworkers "
+                "for compression.", (int)d->dir_len, flavor_name);
+      return;
+    }
+    tor_free(job->flavor_name);
+    tor_free(job);
+  }
+
+  /* Compress it ourselves; LZMA waits until somebody asks for it. */
+  cached_dir_compress(d, 0);
+  dirserv_publish_cached_consensus(flavor_name, d);
+}
+
+/** Return a newly allocated key for consensus_diffs for the diff from the
+ * <b>flavor_name</b> consensus whose SHA256 digest is <b>digest</b>. */
+static char *
+consensus_diff_key(const char *flavor_name, const char *digest)
+{
+  char hex[HEX_DIGEST256_LEN+1];
+  char *key;
+  base16_encode(hex, sizeof(hex), digest, DIGEST256_LEN);
+  tor_asprintf(&key, "%s/%s", flavor_name, hex);
+  return key;
+}
+
+/** We've just replaced the <b>flavor_name</b> consensus <b>old</b> (if any)
+ * with <b>current</b>.  Remember <b>old</b>, taking over its reference,
+ * forget any consensuses too old to bother with, and regenerate the diffs
+ * from those we kept to <b>current</b>. */
+static void
+dirserv_update_consensus_diffs(const char *flavor_name, cached_dir_t *old,
+                               cached_dir_t *current)
+{
+  smartlist_t *olds;
+  size_t prefix_len = strlen(flavor_name);
+  int i;
+
+  if (!old_consensuses)
+    old_consensuses = strmap_new();
+  if (!consensus_diffs)
+    consensus_diffs = strmap_new();
+  if (!(olds = strmap_get(old_consensuses, flavor_name))) {
+    olds = smartlist_create();
+    strmap_set(old_consensuses, flavor_name, olds);
+  }
+  if (old)
+    smartlist_add(olds, old);
+
+  for (i = 0; i < smartlist_len(olds); ) {
+    cached_dir_t *d = smartlist_get(olds, i);
+    if (d->published + CONSENSUS_DIFF_MAX_AGE < current->published ||
+        d->published >= current->published) {
+      cached_dir_decref(d);
+      smartlist_del_keeporder(olds, i);
+    } else {
+      ++i;
+    }
+  }
+
+  STRMAP_FOREACH_MODIFY(consensus_diffs, key, cached_dir_t *, d) {
+    if (!strcmpstart(key, flavor_name) && key[prefix_len] == '/') {
+      cached_dir_decref(d);
+      MAP_DEL_CURRENT(key);
+    }
+  } STRMAP_FOREACH_END;
+
+  SMARTLIST_FOREACH_BEGIN(olds, cached_dir_t *, d) {
+    char *diff = consdiff_gen_diff(d->dir, current->dir);
+    char *key;
+    if (!diff) {
+      log_info(LD_DIRSERV, "Couldn't make a diff between two %s consensuses.",
+               flavor_name);
+      continue;
+    }
+    key = consensus_diff_key(flavor_name, d->digests.d[DIGEST_SHA256]);
+    strmap_set(consensus_diffs, key, new_cached_dir(diff, current->published));
+    tor_free(key);
+  } SMARTLIST_FOREACH_END(d);
+}
 
-  new_networkstatus = new_cached_dir(tor_strdup(networkstatus), published);
-  memcpy(&new_networkstatus->digests, digests, sizeof(digests_t));
-  old_networkstatus = strmap_set(cached_consensuses, flavor_name,
-                                 new_networkstatus);
-  if (old_networkstatus)
-    cached_dir_decref(old_networkstatus);
+/** Return a diff from the <b>flavor_name</b> consensus whose SHA256 digest
+ * is <b>from_digest</b> to the current consensus of that flavor, or NULL if
+ * we don't have one. */
+cached_dir_t *
+dirserv_get_consensus_diff(const char *flavor_name, const char *from_digest)
+{
+  cached_dir_t *d;
+  char *key;
+  if (!consensus_diffs)
+    return NULL;
+  key = consensus_diff_key(flavor_name, from_digest);
+  d = strmap_get(consensus_diffs, key);
+  tor_free(key);
+  return d;
 }
 
 /** Remove any v2 networkstatus from the directory cache that was published
@@ -1758,6 +1979,8 @@ static uint32_t guard_bandwidth_excluding_exits = 0;
 static uint64_t total_bandwidth = 0;
 /** Total bandwidth of all the exit routers we're considering. */
 static uint64_t total_exit_bandwidth = 0;
+/** When did we last set the thresholds above?  0 if we never have. */
+static time_t flag_thresholds_computed_at = 0;
 
 /** Helper: estimate the uptime of a router given its stated uptime and the
  * amount of time since it last stated its stated uptime. */
@@ -1861,8 +2084,9 @@ dirserv_compute_performance_thresholds(routerlist_t *rl)
 {
   int n_active, n_active_nonexit, n_familiar;
   uint32_t *uptimes, *bandwidths, *bandwidths_excluding_exits;
-  long *tks;
+  long *tks, *tks_sorted;
   double *mtbfs, *wfus;
+  int i;
   time_t now = time(NULL);
   const or_options_t *options = get_options();
 
@@ -1893,6 +2117,8 @@ dirserv_compute_performance_thresholds(routerlist_t *rl)
   tks = tor_malloc(sizeof(long)*smartlist_len(rl->routers));
   /* Weighted fractional uptime for each active router. */
   wfus = tor_malloc(sizeof(double)*smartlist_len(rl->routers));
+  /* A copy of tks that find_nth_long() can reorder. */
+  tks_sorted = tor_malloc(sizeof(long)*smartlist_len(rl->routers));
 
   nodelist_assert_ok();
 
@@ -1907,6 +2133,7 @@ dirserv_compute_performance_thresholds(routerlist_t *rl)
       uptimes[n_active] = (uint32_t)real_uptime(ri, now);
       mtbfs[n_active] = rep_hist_get_stability(id, now);
       tks  [n_active] = rep_hist_get_weighted_time_known(id, now);
+      wfus [n_active] = rep_hist_get_weighted_fractional_uptime(id, now);
       bandwidths[n_active] = bw = router_get_advertised_bandwidth(ri);
       total_bandwidth += bw;
       if (node->is_exit && !node->is_bad_exit) {
@@ -1931,7 +2158,8 @@ dirserv_compute_performance_thresholds(routerlist_t *rl)
     if (fast_bandwidth < ROUTER_REQUIRED_MIN_BANDWIDTH/2)
       fast_bandwidth = bandwidths[n_active/4];
     guard_bandwidth_including_exits = bandwidths[(n_active-1)/2];
-    guard_tk = find_nth_long(tks, n_active, n_active/8);
+    memcpy(tks_sorted, tks, sizeof(long)*n_active);
+    guard_tk = find_nth_long(tks_sorted, n_active, n_active/8);
   }
 
   if (guard_tk > TIME_KNOWN_TO_GUARANTEE_FAMILIAR)
@@ -1944,19 +2172,13 @@ dirserv_compute_performance_thresholds(routerlist_t *rl)
     fast_bandwidth = (uint32_t)options->AuthDirFastGuarantee;
 
   /* Now that we have a time-known that 7/8 routers are known longer than,
-   * fill wfus with the wfu of every such "familiar" router. */
+   * keep the wfu of every such "familiar" router.  We looked up everything
+   * we need on the first pass, so we don't walk the nodelist again. */
   n_familiar = 0;
-
-  SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), node_t *, node) {
-      routerinfo_t *ri = node->ri;
-      if (ri && router_is_active(ri, node, now)) {
-        const char *id = ri->cache_info.identity_digest;
-        long tk = rep_hist_get_weighted_time_known(id, now);
-        if (tk < guard_tk)
-          continue;
-        wfus[n_familiar++] = rep_hist_get_weighted_fractional_uptime(id, now);
-      }
-  } SMARTLIST_FOREACH_END(node);
+  for (i = 0; i < n_active; ++i) {
+    if (tks[i] >= guard_tk)
+      wfus[n_familiar++] = wfus[i];
+  }
   if (n_familiar)
     guard_wfu = median_double(wfus, n_familiar);
   if (guard_wfu > WFU_TO_GUARANTEE_GUARD)
@@ -1988,7 +2210,57 @@ dirserv_compute_performance_thresholds(routerlist_t *rl)
   tor_free(bandwidths);
   tor_free(bandwidths_excluding_exits);
   tor_free(tks);
+  tor_free(tks_sorted);
   tor_free(wfus);
+
+  flag_thresholds_computed_at = now;
+}
+
+/** Return a newly allocated string describing the thresholds we last
+ * computed for the Stable, Fast, and Guard flags, as space-separated
+ * key=value pairs. */
+char *
+dirserv_get_flag_thresholds_line(void)
+{
+  char *result = NULL;
+  tor_asprintf(&result,
+      "stable-uptime=%lu stable-mtbf=%lu fast-speed=%lu "
+      "guard-wfu=%.03f%% guard-tk=%lu guard-bw-inc-exits=%lu "
+      "guard-bw-exc-exits=%lu enough-mtbf=%d computed-at=%ld",
+      (unsigned long)stable_uptime,
+      (unsigned long)stable_mtbf,
+      (unsigned long)fast_bandwidth,
+      guard_wfu*100,
+      (unsigned long)guard_tk,
+      (unsigned long)guard_bandwidth_including_exits,
+      (unsigned long)guard_bandwidth_excluding_exits,
+      enough_mtbf_info ? 1 : 0,
+      (long)flag_thresholds_computed_at);
+  return result;
+}
+
+/** If we haven't computed the flag thresholds in this many seconds, a
+ * GETINFO for them computes them afresh. */
+#define FLAG_THRESHOLDS_MAX_AGE (10*60)
+
+/** Implementation helper for GETINFO: answers queries about how this
+ * authority assigns flags. */
+int
+getinfo_helper_dirserv(control_connection_t *conn,
+                       const char *question, char **answer,
+                       const char **errmsg)
+{
+  (void) conn;
+  if (!strcmp(question, "dir/flag-thresholds")) {
+    if (!authdir_mode(get_options())) {
+      *errmsg = "Not a directory authority";
+      return -1;
+    }
+    if (flag_thresholds_computed_at + FLAG_THRESHOLDS_MAX_AGE < time(NULL))
+      dirserv_compute_performance_thresholds(router_get_routerlist());
+    *answer = dirserv_get_flag_thresholds_line();
+  }
+  return 0;
 }
 
 /** Given a platform string as in a routerinfo_t (possibly null), return a
@@ -2037,10 +2309,15 @@ routerstatus_format_entry(char *buf, size_t buf_len,
   char published[ISO_TIME_LEN+1];
   char identity64[BASE64_DIGEST_LEN+1];
   char digest64[BASE64_DIGEST_LEN+1];
+  char ipaddr[INET_NTOA_BUF_LEN];
+  struct in_addr in;
 
   format_iso_time(published, rs->published_on);
   digest_to_base64(identity64, rs->identity_digest);
   digest_to_base64(digest64, rs->descriptor_digest);
+  /* Not fmt_addr32(): this gets called from consensus worker threads. */
+  in.s_addr = htonl(rs->addr);
+  tor_inet_ntoa(&in, ipaddr, sizeof(ipaddr));
 
   r = tor_snprintf(buf, buf_len,
                    "r %s %s %s%s%s %s %d %d\n",
@@ -2049,7 +2326,7 @@ routerstatus_format_entry(char *buf, size_t buf_len,
                    (format==NS_V3_CONSENSUS_MICRODESC)?"":digest64,
                    (format==NS_V3_CONSENSUS_MICRODESC)?"":" ",
                    published,
-                   fmt_addr32(rs->addr),
+                   ipaddr,
                    (int)rs->or_port,
                    (int)rs->dir_port);
   if (r<0) {
@@ -2244,17 +2521,31 @@ _compare_routerinfo_by_ip_and_bw(const void **a, const void **b)
                      DIGEST_LEN);
 }
 
+/** Helper for sorting and bsearching bare IPv4 addresses. */
+static int
+_compare_uint32s(const void *a, const void *b)
+{
+  uint32_t first = *(const uint32_t *)a, second = *(const uint32_t *)b;
+  if (first < second)
+    return -1;
+  else if (first > second)
+    return 1;
+  else
+    return 0;
+}
+
 /** Given a list of routerinfo_t in <b>routers</b>, return a new digestmap_t
  * whose keys are the identity digests of those routers that we're going to
  * exclude for Sybil-like appearance. */
-static digestmap_t *
+digestmap_t *
 get_possible_sybil_list(const smartlist_t *routers)
 {
   const or_options_t *options = get_options();
   digestmap_t *omit_as_sybil;
   smartlist_t *routers_by_ip = smartlist_create();
   uint32_t last_addr;
-  int addr_count;
+  uint32_t *addrs;
+  int addr_count, i, n_addrs, n_crowded;
   /* Allow at most this number of Tor servers on a single IP address, ... */
   int max_with_same_addr = options->AuthDirMaxServersPerAddr;
   /* ... unless it's a directory authority, in which case allow more. */
@@ -2264,10 +2555,35 @@ get_possible_sybil_list(const smartlist_t *routers)
   if (max_with_same_addr_on_authority <= 0)
     max_with_same_addr_on_authority = INT_MAX;
 
-  smartlist_add_all(routers_by_ip, routers);
-  smartlist_sort(routers_by_ip, _compare_routerinfo_by_ip_and_bw);
   omit_as_sybil = digestmap_new();
 
+  /* Nearly every address has only one router.  Find the addresses with more
+   * than max_with_same_addr by sorting the bare addresses, which is cheap,
+   * so that we only have to rank the routers that share those. */
+  n_addrs = smartlist_len(routers);
+  addrs = tor_malloc(sizeof(uint32_t)*(n_addrs+1));
+  SMARTLIST_FOREACH(routers, const routerinfo_t *, ri,
+                    addrs[ri_sl_idx] = ri->addr);
+  qsort(addrs, n_addrs, sizeof(uint32_t), _compare_uint32s);
+  n_crowded = 0;
+  for (i = 0; i < n_addrs; i += addr_count) {
+    addr_count = 1;
+    while (i+addr_count < n_addrs && addrs[i+addr_count] == addrs[i])
+      ++addr_count;
+    if (addr_count > max_with_same_addr)
+      addrs[n_crowded++] = addrs[i];
+  }
+  if (n_crowded) {
+    SMARTLIST_FOREACH(routers, routerinfo_t *, ri, {
+      if (bsearch(&ri->addr, addrs, n_crowded, sizeof(uint32_t),
+                  _compare_uint32s))
+        smartlist_add(routers_by_ip, ri);
+    });
+  }
+  tor_free(addrs);
+
+  smartlist_sort(routers_by_ip, _compare_routerinfo_by_ip_and_bw);
+
   last_addr = 0;
   addr_count = 0;
   SMARTLIST_FOREACH(routers_by_ip, routerinfo_t *, ri,
@@ -2372,7 +2688,7 @@ set_routerstatus_from_routerinfo(routerstatus_t *rs,
 {
   const or_options_t *options = get_options();
   int unstable_version =
-    !tor_version_as_new_as(ri->platform,"0.1.1.16-rc-cvs");
+    !tor_version_as_new_as(router_get_platform(ri),"0.1.1.16-rc-cvs");
   uint32_t routerbw = router_get_advertised_bandwidth(ri);
 
   memset(rs, 0, sizeof(routerstatus_t));
@@ -2405,7 +2721,8 @@ set_routerstatus_from_routerinfo(routerstatus_t *rs,
        routerbw >= MIN(guard_bandwidth_including_exits,
                        guard_bandwidth_excluding_exits)) &&
       (options->GiveGuardFlagTo_CVE_2011_2768_VulnerableRelays ||
-       is_router_version_good_for_possible_guard(ri->platform))) {
+       is_router_version_good_for_possible_guard(
+                                             router_get_platform(ri)))) {
     long tk = rep_hist_get_weighted_time_known(
                                       node->identity, now);
     double wfu = rep_hist_get_weighted_fractional_uptime(
@@ -2558,19 +2875,67 @@ measured_bw_line_apply(measured_bw_line_t *parsed_line,
   return rs != NULL;
 }
 
+/** Map from node identity digest to a uint32_t* holding the bandwidth we
+ * last read for it from the measured bandwidth file, or NULL if we haven't
+ * read a good file. */
+static digestmap_t *mbw_cache = NULL;
+/** The file we read mbw_cache from. */
+static char *mbw_cache_fname = NULL;
+/** The modification time and size of mbw_cache_fname when we read it.  If
+ * neither has changed, we don't read the file again. */
+static time_t mbw_cache_mtime = 0;
+static off_t mbw_cache_size = 0;
+/** The time that the measured bandwidth file says it was written. */
+static time_t mbw_cache_file_time = 0;
+
+/** Forget everything we've read from the measured bandwidth file. */
+static void
+dirserv_clear_measured_bw_cache(void)
+{
+  digestmap_free(mbw_cache, _tor_free);
+  mbw_cache = NULL;
+  tor_free(mbw_cache_fname);
+  mbw_cache_mtime = 0;
+  mbw_cache_size = 0;
+  mbw_cache_file_time = 0;
+}
+
 /**
- * Read the measured bandwidth file and apply it to the list of
- * routerstatuses. Returns -1 on error, 0 otherwise.
+ * Make sure our cache of the measured bandwidth file <b>from_file</b> is up
+ * to date: if the file's modification time or size has changed since we
+ * last read it, parse it again into a fresh digestmap.  Doing this ahead of
+ * time means that voting only has to look up each router.  Returns -1 if
+ * we have no usable measurements, 0 otherwise.
  */
 int
-dirserv_read_measured_bandwidths(const char *from_file,
-                                 smartlist_t *routerstatuses)
+dirserv_refresh_measured_bw_cache(const char *from_file)
 {
   char line[256];
-  FILE *fp = tor_fopen_cloexec(from_file, "r");
-  int applied_lines = 0;
+  struct stat st;
+  FILE *fp;
+  digestmap_t *new_cache;
+  int n_lines = 0;
   time_t file_time;
   int ok;
+
+  if (stat(from_file, &st)) {
+    log_warn(LD_CONFIG, "Can't open bandwidth file at configured location: %s",
+             from_file);
+    dirserv_clear_measured_bw_cache();
+    return -1;
+  }
+  if (mbw_cache_fname && !strcmp(mbw_cache_fname, from_file) &&
+      st.st_mtime == mbw_cache_mtime && st.st_size == mbw_cache_size) {
+    /* Nothing new; whatever we decided last time still holds. */
+    return mbw_cache ? 0 : -1;
+  }
+
+  dirserv_clear_measured_bw_cache();
+  mbw_cache_fname = tor_strdup(from_file);
+  mbw_cache_mtime = st.st_mtime;
+  mbw_cache_size = st.st_size;
+
+  fp = tor_fopen_cloexec(from_file, "r");
   if (fp == NULL) {
     log_warn(LD_CONFIG, "Can't open bandwidth file at configured location: %s",
              from_file);
@@ -2594,27 +2959,60 @@ dirserv_read_measured_bandwidths(const char *from_file,
     return -1;
   }
 
-  if ((time(NULL) - file_time) > MAX_MEASUREMENT_AGE) {
-    log_warn(LD_DIRSERV, "Bandwidth measurement file stale. Age: %u",
-             (unsigned)(time(NULL) - file_time));
-    fclose(fp);
-    return -1;
-  }
-
-  if (routerstatuses)
-    smartlist_sort(routerstatuses, compare_routerstatus_entries);
-
+  new_cache = digestmap_new();
   while (!feof(fp)) {
     measured_bw_line_t parsed_line;
     if (fgets(line, sizeof(line), fp) && strlen(line)) {
       if (measured_bw_line_parse(&parsed_line, line) != -1) {
-        if (measured_bw_line_apply(&parsed_line, routerstatuses) > 0)
-          applied_lines++;
+        uint32_t *bw = digestmap_get(new_cache, parsed_line.node_id);
+        if (!bw) {
+          bw = tor_malloc(sizeof(uint32_t));
+          digestmap_set(new_cache, parsed_line.node_id, bw);
+          ++n_lines;
+        }
+        *bw = (uint32_t)parsed_line.bw;
       }
     }
   }
-
   fclose(fp);
+
+  mbw_cache = new_cache;
+  mbw_cache_file_time = file_time;
+  log_info(LD_DIRSERV, "Read %d measurements from bandwidth file.", n_lines);
+  return 0;
+}
+
+/**
+ * Read the measured bandwidth file, if it has changed, and apply it to the
+ * list of routerstatuses. Returns -1 on error, 0 otherwise.
+ */
+int
+dirserv_read_measured_bandwidths(const char *from_file,
+                                 smartlist_t *routerstatuses)
+{
+  int applied_lines = 0;
+  time_t now = time(NULL);
+
+  if (dirserv_refresh_measured_bw_cache(from_file) < 0)
+    return -1;
+
+  if ((now - mbw_cache_file_time) > MAX_MEASUREMENT_AGE) {
+    log_warn(LD_DIRSERV, "Bandwidth measurement file stale. Age: %u",
+             (unsigned)(now - mbw_cache_file_time));
+    return -1;
+  }
+
+  if (routerstatuses) {
+    SMARTLIST_FOREACH_BEGIN(routerstatuses, routerstatus_t *, rs) {
+      const uint32_t *bw = digestmap_get(mbw_cache, rs->identity_digest);
+      if (bw) {
+        rs->has_measured_bw = 1;
+        rs->measured_bw = *bw;
+        ++applied_lines;
+      }
+    } SMARTLIST_FOREACH_END(rs);
+  }
+
   log_info(LD_DIRSERV,
            "Bandwidth measurement file successfully read. "
            "Applied %d measurements.", applied_lines);
@@ -2714,7 +3112,7 @@ dirserv_generate_networkstatus_vote_obj(crypto_pk_env_t *private_key,
       if (!vote_on_reachability)
         rs->is_flagged_running = 0;
 
-      vrs->version = version_from_platform(ri->platform);
+      vrs->version = version_from_platform(router_get_platform(ri));
       md = dirvote_create_microdescriptor(ri);
       if (md) {
         char buf[128];
@@ -2947,7 +3345,7 @@ generate_v2_networkstatus_opinion(void)
   SMARTLIST_FOREACH(routers, routerinfo_t *, ri, {
     if (ri->cache_info.published_on >= cutoff) {
       routerstatus_t rs;
-      char *version = version_from_platform(ri->platform);
+      char *version = version_from_platform(router_get_platform(ri));
       node_t *node = node_get_mutable_by_id(ri->cache_info.identity_digest);
       if (!node) {
         tor_free(version);
@@ -3528,9 +3926,234 @@ dirserv_estimate_microdesc_size(const smartlist_t *fps, int compressed)
   return result;
 }
 
+/** How long do we keep a compressed batch of descriptors around after it
+ * was last requested? */
+#define SPOOL_BATCH_CACHE_LIFETIME (10*60)
+/** How many bytes of compressed batches do we keep at most? */
+#define SPOOL_BATCH_CACHE_MAX_BYTES (8*1024*1024)
+
+/** An entry in spool_batch_cache. */
+typedef struct spool_batch_t {
+  cached_dir_t *dir; /**< The compressed batch; <b>dir</b> itself is NULL. */
+  time_t last_used; /**< When did we last serve this batch? */
+} spool_batch_t;
+
+/** Map from a digest of a request for server descriptors, extra-info
+ * documents or microdescriptors by digest to a spool_batch_t holding the
+ * compressed response.  Mirrors get the same batches asked of them over
+ * and over, so this saves running zlib for each request.  Since the
+ * requests name documents by digest, a cached batch never goes stale. */
+static digestmap_t *spool_batch_cache = NULL;
+/** Total dir_z_len of all batches in spool_batch_cache. */
+static size_t spool_batch_cache_bytes = 0;
+
+/** Remove the batch with key <b>key</b> from spool_batch_cache. */
+static void
+spool_batch_cache_remove(const char *key)
+{
+  spool_batch_t *b = digestmap_remove(spool_batch_cache, key);
+  if (!b)
+    return;
+  spool_batch_cache_bytes -= b->dir->dir_z_len;
+  cached_dir_decref(b->dir);
+  tor_free(b);
+}
+
+/** Drop batches unused since before <b>cutoff</b>, then the least recently
+ * used batches until the cache has room for <b>needed</b> more bytes. */
+static void
+spool_batch_cache_shrink(time_t cutoff, size_t needed)
+{
+  char oldest_key[DIGEST_LEN];
+  time_t oldest;
+  DIGESTMAP_FOREACH_MODIFY(spool_batch_cache, key, spool_batch_t *, b) {
+    if (b->last_used < cutoff) {
+      spool_batch_cache_bytes -= b->dir->dir_z_len;
+      cached_dir_decref(b->dir);
+      tor_free(b);
+      MAP_DEL_CURRENT(key);
+    }
+  } DIGESTMAP_FOREACH_END;
+
+  while (spool_batch_cache_bytes + needed > SPOOL_BATCH_CACHE_MAX_BYTES &&
+         !digestmap_isempty(spool_batch_cache)) {
+    oldest = TIME_MAX;
+    DIGESTMAP_FOREACH(spool_batch_cache, key, spool_batch_t *, b) {
+      if (b->last_used < oldest) {
+        oldest = b->last_used;
+        memcpy(oldest_key, key, DIGEST_LEN);
+      }
+    } DIGESTMAP_FOREACH_END;
+    spool_batch_cache_remove(oldest_key);
+  }
+}
+
+/** Return a cached_dir_t holding the compressed concatenation of the
+ * documents that a connection spooling from <b>spool_src</b> would send
+ * for the digests in <b>fps</b>, in the order it would send them, or NULL
+ * if we can't or won't cache this kind of request.  <b>encrypted</b> is
+ * true iff the connection is encrypted.  The caller must release the
+ * result with cached_dir_decref(). */
+cached_dir_t *
+dirserv_get_compressed_spool_batch(int spool_src, const smartlist_t *fps,
+                                   int encrypted)
+{
+  char key[DIGEST_LEN];
+  crypto_digest_env_t *d;
+  spool_batch_t *b;
+  smartlist_t *chunks;
+  size_t digest_len;
+  char *body;
+  uint8_t hdr[2];
+  int i;
+  time_t now = time(NULL);
+  microdesc_cache_t *mc = NULL;
+
+  if (spool_src == DIR_SPOOL_MICRODESC)
+    digest_len = DIGEST256_LEN;
+  else if (spool_src == DIR_SPOOL_SERVER_BY_DIGEST ||
+           spool_src == DIR_SPOOL_EXTRA_BY_DIGEST)
+    digest_len = DIGEST_LEN;
+  else
+    return NULL;
+
+  hdr[0] = (uint8_t)spool_src;
+  hdr[1] = encrypted ? 1 : 0;
+  d = crypto_new_digest_env();
+  crypto_digest_add_bytes(d, (const char *)hdr, sizeof(hdr));
+  SMARTLIST_FOREACH(fps, const char *, fp,
+                    crypto_digest_add_bytes(d, fp, digest_len));
+  crypto_digest_get_digest(d, key, DIGEST_LEN);
+  crypto_free_digest_env(d);
+
+  if (!spool_batch_cache)
+    spool_batch_cache = digestmap_new();
+  b = digestmap_get(spool_batch_cache, key);
+  if (b && b->last_used >= now - SPOOL_BATCH_CACHE_LIFETIME) {
+    b->last_used = now;
+    ++b->dir->refcnt;
+    return b->dir;
+  } else if (b) {
+    spool_batch_cache_remove(key);
+  }
+
+  /* Spooling pops digests off the end of the list, so go backwards. */
+  chunks = smartlist_create();
+  if (spool_src == DIR_SPOOL_MICRODESC)
+    mc = get_microdesc_cache();
+  for (i = smartlist_len(fps)-1; i >= 0; --i) {
+    const char *fp = smartlist_get(fps, i);
+    if (mc) {
+      microdesc_t *md = microdesc_cache_lookup_by_digest256(mc, fp);
+      if (md)
+        smartlist_add(chunks, tor_strndup(md->body, md->bodylen));
+    } else {
+      const signed_descriptor_t *sd =
+        spool_src == DIR_SPOOL_EXTRA_BY_DIGEST ?
+          extrainfo_get_by_descriptor_digest(fp) :
+          router_get_by_descriptor_digest(fp);
+      if (sd && (encrypted || sd->send_unencrypted))
+        smartlist_add(chunks, tor_strndup(signed_descriptor_get_body(sd),
+                                          sd->signed_descriptor_len));
+    }
+  }
+
+  if (!smartlist_len(chunks)) {
+    smartlist_free(chunks);
+    return NULL;
+  }
+  body = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, c, tor_free(c));
+  smartlist_free(chunks);
+
+  b = tor_malloc_zero(sizeof(spool_batch_t));
+  b->dir = new_cached_dir(body, now);
+  b->last_used = now;
+  /* We only ever serve the compressed form. */
+  tor_free(b->dir->dir);
+  b->dir->dir_len = 0;
+  if (!b->dir->dir_z) {
+    cached_dir_decref(b->dir);
+    tor_free(b);
+    return NULL;
+  }
+
+  spool_batch_cache_shrink(now - SPOOL_BATCH_CACHE_LIFETIME,
+                           b->dir->dir_z_len);
+  if (b->dir->dir_z_len > SPOOL_BATCH_CACHE_MAX_BYTES) {
+    /* Too big to keep; hand our reference to the caller. */
+    cached_dir_t *result = b->dir;
+    tor_free(b);
+    return result;
+  }
+  digestmap_set(spool_batch_cache, key, b);
+  spool_batch_cache_bytes += b->dir->dir_z_len;
+  ++b->dir->refcnt;
+  return b->dir;
+}
+
 /** When we're spooling data onto our outbuf, add more whenever we dip
- * below this threshold. */
+ * below this threshold, unless the spool buffer budget is tight. */
 #define DIRSERV_BUFFER_MIN 16384
+/** However many connections are spooling, let each one keep at least this
+ * many bytes on its outbuf. */
+#define DIRSERV_BUFFER_FLOOR 4096
+
+/** How many connections are spooling directory data right now? */
+static int n_spooling_conns = 0;
+
+/** Count <b>conn</b> among the connections spooling directory data iff it
+ * still has something to spool. */
+void
+connection_dirserv_count_spooling(dir_connection_t *conn)
+{
+  int spooling = conn->dir_spool_src != DIR_SPOOL_NONE;
+  if (spooling && !conn->counted_as_spooling)
+    ++n_spooling_conns;
+  else if (!spooling && conn->counted_as_spooling)
+    --n_spooling_conns;
+  conn->counted_as_spooling = spooling;
+}
+
+/** Called when <b>conn</b> is about to close: stop counting it among the
+ * connections spooling directory data. */
+void
+connection_dirserv_stop_spooling(dir_connection_t *conn)
+{
+  if (conn->counted_as_spooling) {
+    --n_spooling_conns;
+    conn->counted_as_spooling = 0;
+  }
+}
+
+/** Return how many bytes of spooled data each spooling connection may keep
+ * on its outbuf right now.  That's DIRSERV_BUFFER_MIN, unless so many
+ * connections are spooling that they'd hold more than DirSpoolBufferLimit
+ * between them: then they share that limit evenly, down to
+ * DIRSERV_BUFFER_FLOOR each. */
+size_t
+dirserv_spool_buffer_target(void)
+{
+  uint64_t share;
+  if (n_spooling_conns <= 0)
+    return DIRSERV_BUFFER_MIN;
+  share = get_options()->DirSpoolBufferLimit / n_spooling_conns;
+  if (share >= DIRSERV_BUFFER_MIN)
+    return DIRSERV_BUFFER_MIN;
+  else if (share < DIRSERV_BUFFER_FLOOR)
+    return DIRSERV_BUFFER_FLOOR;
+  else
+    return (size_t)share;
+}
+
+/** Return true iff so many connections are spooling directory data that
+ * they're sharing the spool buffer budget, so that each should use as
+ * little memory as it can. */
+int
+dirserv_spool_is_congested(void)
+{
+  return dirserv_spool_buffer_target() < DIRSERV_BUFFER_MIN;
+}
 
 /** Spooling helper: called when we have no more data to spool to <b>conn</b>.
  * Flushes any remaining data to be (un)compressed, and changes the spool
@@ -3554,7 +4177,8 @@ connection_dirserv_finish_spooling(dir_connection_t *conn)
  * NONE.  Returns 0 on success, negative on failure.
  */
 static int
-connection_dirserv_add_servers_to_outbuf(dir_connection_t *conn)
+connection_dirserv_add_servers_to_outbuf(dir_connection_t *conn,
+                                         size_t target)
 {
   int by_fp = (conn->dir_spool_src == DIR_SPOOL_SERVER_BY_FP ||
                conn->dir_spool_src == DIR_SPOOL_EXTRA_BY_FP);
@@ -3565,7 +4189,7 @@ connection_dirserv_add_servers_to_outbuf(dir_connection_t *conn)
   const or_options_t *options = get_options();
 
   while (smartlist_len(conn->fingerprint_stack) &&
-         connection_get_outbuf_len(TO_CONN(conn)) < DIRSERV_BUFFER_MIN) {
+         connection_get_outbuf_len(TO_CONN(conn)) < target) {
     const char *body;
     char *fp = smartlist_pop_last(conn->fingerprint_stack);
     const signed_descriptor_t *sd = NULL;
@@ -3630,11 +4254,12 @@ connection_dirserv_add_servers_to_outbuf(dir_connection_t *conn)
  * NONE.  Returns 0 on success, negative on failure.
  */
 static int
-connection_dirserv_add_microdescs_to_outbuf(dir_connection_t *conn)
+connection_dirserv_add_microdescs_to_outbuf(dir_connection_t *conn,
+                                            size_t target)
 {
   microdesc_cache_t *cache = get_microdesc_cache();
   while (smartlist_len(conn->fingerprint_stack) &&
-         connection_get_outbuf_len(TO_CONN(conn)) < DIRSERV_BUFFER_MIN) {
+         connection_get_outbuf_len(TO_CONN(conn)) < target) {
     char *fp256 = smartlist_pop_last(conn->fingerprint_stack);
     microdesc_t *md = microdesc_cache_lookup_by_digest256(cache, fp256);
     tor_free(fp256);
@@ -3661,6 +4286,13 @@ connection_dirserv_add_microdescs_to_outbuf(dir_connection_t *conn)
   return 0;
 }
 
+/** Release callback for outbuf chunks that refer into a cached_dir_t. */
+static void
+cached_dir_release_cb(void *arg)
+{
+  cached_dir_decref(arg);
+}
+
 /** Spooling helper: Called when we're sending a directory or networkstatus,
  * and the outbuf has become too empty.  Pulls some bytes from
  * <b>conn</b>-\>cached_dir-\>dir_z, uncompresses them if appropriate, and
@@ -3668,30 +4300,44 @@ connection_dirserv_add_microdescs_to_outbuf(dir_connection_t *conn)
  * and sets the spool source to NONE.  Returns 0 on success, negative on
  * failure. */
 static int
-connection_dirserv_add_dir_bytes_to_outbuf(dir_connection_t *conn)
+connection_dirserv_add_dir_bytes_to_outbuf(dir_connection_t *conn,
+                                           size_t target)
 {
   ssize_t bytes;
   int64_t remaining;
+  const char *body;
+  size_t body_len;
+  compress_method_t method;
 
-  bytes = DIRSERV_BUFFER_MIN - connection_get_outbuf_len(TO_CONN(conn));
+  bytes = target - connection_get_outbuf_len(TO_CONN(conn));
   tor_assert(bytes > 0);
   tor_assert(conn->cached_dir);
-  if (bytes < 8192)
-    bytes = 8192;
-  remaining = conn->cached_dir->dir_z_len - conn->cached_dir_offset;
+  method = (conn->spool_method == LZMA_METHOD) ? LZMA_METHOD : ZLIB_METHOD;
+  body = cached_dir_get_compressed(conn->cached_dir, method, &body_len);
+  if (!body)
+    return -1;
+  if (bytes < (ssize_t)target/2)
+    bytes = target/2;
+  remaining = body_len - conn->cached_dir_offset;
   if (bytes > remaining)
     bytes = (ssize_t) remaining;
 
   if (conn->zlib_state) {
-    connection_write_to_buf_zlib(
-                             conn->cached_dir->dir_z + conn->cached_dir_offset,
-                             bytes, conn, bytes == remaining);
+    connection_write_to_buf_zlib(body + conn->cached_dir_offset,
+                                 bytes, conn, bytes == remaining);
+  } else if (!TO_CONN(conn)->linked) {
+    /* Point the outbuf at the cached body rather than copying it; the
+     * reference we take keeps it alive until those bytes are flushed. */
+    ++conn->cached_dir->refcnt;
+    connection_write_to_buf_ref(body + conn->cached_dir_offset,
+                                bytes, TO_CONN(conn),
+                                cached_dir_release_cb, conn->cached_dir);
   } else {
-    connection_write_to_buf(conn->cached_dir->dir_z + conn->cached_dir_offset,
+    connection_write_to_buf(body + conn->cached_dir_offset,
                             bytes, TO_CONN(conn));
   }
   conn->cached_dir_offset += bytes;
-  if (conn->cached_dir_offset == (int)conn->cached_dir->dir_z_len) {
+  if (conn->cached_dir_offset == (int)body_len) {
     /* We just wrote the last one; finish up. */
     connection_dirserv_finish_spooling(conn);
     cached_dir_decref(conn->cached_dir);
@@ -3709,13 +4355,14 @@ connection_dirserv_add_dir_bytes_to_outbuf(dir_connection_t *conn)
  * flushes the zlib state and sets the spool source to NONE.  Returns 0 on
  * success, negative on failure. */
 static int
-connection_dirserv_add_networkstatus_bytes_to_outbuf(dir_connection_t *conn)
+connection_dirserv_add_networkstatus_bytes_to_outbuf(dir_connection_t *conn,
+                                                     size_t target)
 {
 
-  while (connection_get_outbuf_len(TO_CONN(conn)) < DIRSERV_BUFFER_MIN) {
+  while (connection_get_outbuf_len(TO_CONN(conn)) < target) {
     if (conn->cached_dir) {
       int uncompressing = (conn->zlib_state != NULL);
-      int r = connection_dirserv_add_dir_bytes_to_outbuf(conn);
+      int r = connection_dirserv_add_dir_bytes_to_outbuf(conn, target);
       if (conn->dir_spool_src == DIR_SPOOL_NONE) {
         /* add_dir_bytes thinks we're done with the cached_dir.  But we
          * may have more cached_dirs! */
@@ -3726,7 +4373,8 @@ connection_dirserv_add_networkstatus_bytes_to_outbuf(dir_connection_t *conn)
         if (uncompressing && ! conn->zlib_state &&
             conn->fingerprint_stack &&
             smartlist_len(conn->fingerprint_stack)) {
-          conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD);
+          conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD,
+                                          HIGH_COMPRESSION);
         }
       }
       if (r) return r;
@@ -3756,9 +4404,13 @@ connection_dirserv_add_networkstatus_bytes_to_outbuf(dir_connection_t *conn)
 int
 connection_dirserv_flushed_some(dir_connection_t *conn)
 {
+  size_t target;
+  int r;
   tor_assert(conn->_base.state == DIR_CONN_STATE_SERVER_WRITING);
 
-  if (connection_get_outbuf_len(TO_CONN(conn)) >= DIRSERV_BUFFER_MIN)
+  connection_dirserv_count_spooling(conn);
+  target = dirserv_spool_buffer_target();
+  if (connection_get_outbuf_len(TO_CONN(conn)) >= target)
     return 0;
 
   switch (conn->dir_spool_src) {
@@ -3766,17 +4418,24 @@ connection_dirserv_flushed_some(dir_connection_t *conn)
     case DIR_SPOOL_EXTRA_BY_FP:
     case DIR_SPOOL_SERVER_BY_DIGEST:
     case DIR_SPOOL_SERVER_BY_FP:
-      return connection_dirserv_add_servers_to_outbuf(conn);
+      r = connection_dirserv_add_servers_to_outbuf(conn, target);
+      break;
     case DIR_SPOOL_MICRODESC:
-      return connection_dirserv_add_microdescs_to_outbuf(conn);
+      r = connection_dirserv_add_microdescs_to_outbuf(conn, target);
+      break;
     case DIR_SPOOL_CACHED_DIR:
-      return connection_dirserv_add_dir_bytes_to_outbuf(conn);
+      r = connection_dirserv_add_dir_bytes_to_outbuf(conn, target);
+      break;
     case DIR_SPOOL_NETWORKSTATUS:
-      return connection_dirserv_add_networkstatus_bytes_to_outbuf(conn);
+      r = connection_dirserv_add_networkstatus_bytes_to_outbuf(conn, target);
+      break;
     case DIR_SPOOL_NONE:
     default:
-      return 0;
+      r = 0;
+      break;
   }
+  connection_dirserv_count_spooling(conn);
+  return r;
 }
 
 /** Release all storage used by the directory server. */
@@ -3784,6 +4443,7 @@ void
 dirserv_free_all(void)
 {
   dirserv_free_fingerprint_list();
+  dirserv_clear_measured_bw_cache();
 
   cached_dir_decref(the_directory);
   clear_cached_dir(&the_runningrouters);
@@ -3795,5 +4455,27 @@ dirserv_free_all(void)
   cached_v2_networkstatus = NULL;
   strmap_free(cached_consensuses, _free_cached_dir);
   cached_consensuses = NULL;
+  if (old_consensuses) {
+    STRMAP_FOREACH_MODIFY(old_consensuses, key, smartlist_t *, olds) {
+      SMARTLIST_FOREACH(olds, cached_dir_t *, d, cached_dir_decref(d));
+      smartlist_free(olds);
+      MAP_DEL_CURRENT(key);
+    } STRMAP_FOREACH_END;
+    strmap_free(old_consensuses, NULL);
+    old_consensuses = NULL;
+  }
+  strmap_free(consensus_diffs, _free_cached_dir);
+  consensus_diffs = NULL;
+
+  if (spool_batch_cache) {
+    DIGESTMAP_FOREACH_MODIFY(spool_batch_cache, key, spool_batch_t *, b) {
+      cached_dir_decref(b->dir);
+      tor_free(b);
+      MAP_DEL_CURRENT(key);
+    } DIGESTMAP_FOREACH_END;
+    digestmap_free(spool_batch_cache, NULL);
+    spool_batch_cache = NULL;
+    spool_batch_cache_bytes = 0;
+  }
 }
 
@@ -53,6 +53,8 @@
    )
 
 int connection_dirserv_flushed_some(dir_connection_t *conn);
+void connection_dirserv_stop_spooling(dir_connection_t *conn);
+int dirserv_spool_is_congested(void);
 
 int dirserv_add_own_fingerprint(const char *nickname, crypto_pk_env_t *pk);
 int dirserv_load_fingerprint_file(void);
@@ -86,6 +88,11 @@ void directory_set_dirty(void);
 cached_dir_t *dirserv_get_directory(void);
 cached_dir_t *dirserv_get_runningrouters(void);
 cached_dir_t *dirserv_get_consensus(const char *flavor_name);
+const char *cached_dir_get_compressed(cached_dir_t *d,
+                                      compress_method_t method,
+                                      size_t *len_out);
+cached_dir_t *dirserv_get_consensus_diff(const char *flavor_name,
+                                         const char *from_digest);
 void dirserv_set_cached_directory(const char *directory, time_t when,
                                   int is_running_routers);
 void dirserv_set_cached_networkstatus_v2(const char *directory,
@@ -129,21 +136,32 @@ int dirserv_have_any_microdesc(const smartlist_t *fps);
 size_t dirserv_estimate_data_size(smartlist_t *fps, int is_serverdescs,
                                   int compressed);
 size_t dirserv_estimate_microdesc_size(const smartlist_t *fps, int compressed);
+cached_dir_t *dirserv_get_compressed_spool_batch(int spool_src,
+                                                 const smartlist_t *fps,
+                                                 int encrypted);
 
 int routerstatus_format_entry(char *buf, size_t buf_len,
                               const routerstatus_t *rs, const char *platform,
                               routerstatus_format_type_t format);
+char *dirserv_get_flag_thresholds_line(void);
+int getinfo_helper_dirserv(control_connection_t *conn,
+                           const char *question, char **answer,
+                           const char **errmsg);
 void dirserv_free_all(void);
 void cached_dir_decref(cached_dir_t *d);
 cached_dir_t *new_cached_dir(char *s, time_t published);
 
 #ifdef DIRSERV_PRIVATE
+void connection_dirserv_count_spooling(dir_connection_t *conn);
+size_t dirserv_spool_buffer_target(void);
 int measured_bw_line_parse(measured_bw_line_t *out, const char *line);
 
 int measured_bw_line_apply(measured_bw_line_t *parsed_line,
                            smartlist_t *routerstatuses);
+digestmap_t *get_possible_sybil_list(const smartlist_t *routers);
 #endif
 
+int dirserv_refresh_measured_bw_cache(const char *from_file);
 int dirserv_read_measured_bandwidths(const char *from_file,
                                      smartlist_t *routerstatuses);
 
@@ -6,6 +6,7 @@
 #define DIRVOTE_PRIVATE
 #include "or.h"
 #include "config.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -1345,6 +1346,601 @@ networkstatus_compute_bw_weights_v9(smartlist_t *chunks, int64_t G, int64_t M,
              I64_PRINTF_ARG(D), I64_PRINTF_ARG(T));
 }
 
+/** Don't split the routerstatus entries of a consensus across threads unless
+ * every thread would get at least this many routers. */
+#define CONSENSUS_RS_MIN_RANGE 256
+/** Never split the routerstatus entries of a consensus into more than this
+ * many ranges. */
+#define CONSENSUS_RS_MAX_RANGES 16
+
+/** Everything networkstatus_compute_consensus() has worked out about the
+ * votes before it merges their routerstatus entries.  Only read while the
+ * entries are being computed, so any number of threads may share it. */
+typedef struct consensus_rs_ctx_t {
+  smartlist_t *votes; /**< The votes, sorted by authority identity. */
+  smartlist_t *flags; /**< Every flag that any vote knows, sorted. */
+  int consensus_method; /**< The consensus method we're using. */
+  int total_authorities; /**< How many authorities we believe exist. */
+  consensus_flavor_t flavor; /**< Which consensus flavor we're making. */
+  routerstatus_format_type_t rs_format; /**< Format for the "r" lines. */
+  int *n_voter_flags; /**< n_voter_flags[j] is the number of flags that
+                       * votes[j] knows about. */
+  int *n_flag_voters; /**< n_flag_voters[f] is the number of votes that care
+                       * about flags[f]. */
+  int **flag_map; /**< flag_map[j][b] is an index f such that flags[f] is the
+                   * same flag as votes[j]->known_flags[b]. */
+  int *named_flag; /**< Index of the flag "Named" for votes[j] */
+  int chosen_named_idx; /**< Index of "Named" in flags, or -1. */
+  /** Map from nickname to the identity it's bound to, or to a conflict or
+   * unknown marker. */
+  strmap_t *name_to_id_map;
+} consensus_rs_ctx_t;
+
+struct consensus_rs_batch_t;
+
+/** The routers in one run of the identity space, and the consensus entries
+ * we generate for them. */
+typedef struct consensus_rs_range_t {
+  /** The batch this range is part of, or NULL if we're not using threads. */
+  struct consensus_rs_batch_t *batch;
+  int *start; /**< start[j] is the index in votes[j] of our first entry. */
+  int *end; /**< end[j] is the index in votes[j] just past our last entry. */
+  smartlist_t *chunks; /**< The strings we generated for this range. */
+  int64_t G, M, E, D, T; /**< Bandwidth totals for this range's routers. */
+  /** True once some thread has started on this range.  Protected by
+   * batch-\>lock. */
+  int claimed;
+} consensus_rs_range_t;
+
+/** Helper for bsearching a vote's routerstatus_list by identity. */
+static int
+_compare_digest_to_vote_rs(const void *_key, const void **_member)
+{
+  const char *key = _key;
+  const vote_routerstatus_t *rs = *_member;
+  return fast_memcmp(key, rs->status.identity_digest, DIGEST_LEN);
+}
+
+/** Merge the vote entries in <b>range</b> into consensus entries as
+ * described by <b>ctx</b>, adding the text to range-\>chunks and the
+ * bandwidths to range's totals.  Safe to call from any thread. */
+static void
+compute_consensus_rs_range(const consensus_rs_ctx_t *ctx,
+                           consensus_rs_range_t *range)
+{
+  smartlist_t *votes = ctx->votes;
+  smartlist_t *flags = ctx->flags;
+  const int consensus_method = ctx->consensus_method;
+  const int total_authorities = ctx->total_authorities;
+  const consensus_flavor_t flavor = ctx->flavor;
+  const routerstatus_format_type_t rs_format = ctx->rs_format;
+  int *n_voter_flags = ctx->n_voter_flags;
+  int *n_flag_voters = ctx->n_flag_voters;
+  int **flag_map = ctx->flag_map;
+  int *named_flag = ctx->named_flag;
+  const int chosen_named_idx = ctx->chosen_named_idx;
+  strmap_t *name_to_id_map = ctx->name_to_id_map;
+  smartlist_t *chunks = range->chunks;
+  int64_t G=0, M=0, E=0, D=0, T=0;
+
+  int *index; /* index[j] is the current index into votes[j]. */
+  const int *size = range->end; /* We stop at size[j] in votes[j]. */
+  int *flag_counts; /* The number of voters that list flag[j] for the
+                     * currently considered router. */
+  smartlist_t *matching_descs = smartlist_create();
+  smartlist_t *chosen_flags = smartlist_create();
+  smartlist_t *versions = smartlist_create();
+  smartlist_t *exitsummaries = smartlist_create();
+  uint32_t *bandwidths = tor_malloc(sizeof(uint32_t) * smartlist_len(votes));
+  uint32_t *measured_bws = tor_malloc(sizeof(uint32_t) *
+                                      smartlist_len(votes));
+  int num_bandwidths;
+  int num_mbws;
+
+  index = tor_memdup(range->start, sizeof(int)*smartlist_len(votes));
+  flag_counts = tor_malloc(sizeof(int) * smartlist_len(flags));
+  while (1) {
+    vote_routerstatus_t *rs;
+    routerstatus_t rs_out;
+    const char *lowest_id = NULL;
+    const char *chosen_version;
+    const char *chosen_name = NULL;
+    int exitsummary_disagreement = 0;
+    int is_named = 0, is_unnamed = 0, is_running = 0;
+    int is_guard = 0, is_exit = 0, is_bad_exit = 0;
+    int naming_conflict = 0;
+    int n_listing = 0;
+    int i;
+    char *buf=NULL;
+    char microdesc_digest[DIGEST256_LEN];
+
+    /* Of the next-to-be-considered digest in each voter, which is first? */
+    SMARTLIST_FOREACH(votes, networkstatus_t *, v, {
+      if (index[v_sl_idx] < size[v_sl_idx]) {
+        rs = smartlist_get(v->routerstatus_list, index[v_sl_idx]);
+        if (!lowest_id ||
+            fast_memcmp(rs->status.identity_digest,
+                        lowest_id, DIGEST_LEN) < 0)
+          lowest_id = rs->status.identity_digest;
+      }
+    });
+    if (!lowest_id) /* we're out of routers. */
+      break;
+
+    memset(flag_counts, 0, sizeof(int)*smartlist_len(flags));
+    smartlist_clear(matching_descs);
+    smartlist_clear(chosen_flags);
+    smartlist_clear(versions);
+    num_bandwidths = 0;
+    num_mbws = 0;
+
+    /* Okay, go through all the entries for this digest. */
+    SMARTLIST_FOREACH_BEGIN(votes, networkstatus_t *, v) {
+      if (index[v_sl_idx] >= size[v_sl_idx])
+        continue; /* out of entries. */
+      rs = smartlist_get(v->routerstatus_list, index[v_sl_idx]);
+      if (fast_memcmp(rs->status.identity_digest, lowest_id, DIGEST_LEN))
+        continue; /* doesn't include this router. */
+      /* At this point, we know that we're looking at a routerstatus with
+       * identity "lowest".
+       */
+      ++index[v_sl_idx];
+      ++n_listing;
+
+      smartlist_add(matching_descs, rs);
+      if (rs->version && rs->version[0])
+        smartlist_add(versions, rs->version);
+
+      /* Tally up all the flags. */
+      for (i = 0; i < n_voter_flags[v_sl_idx]; ++i) {
+        if (rs->flags & (U64_LITERAL(1) << i))
+          ++flag_counts[flag_map[v_sl_idx][i]];
+      }
+      if (rs->flags & (U64_LITERAL(1) << named_flag[v_sl_idx])) {
+        if (chosen_name && strcmp(chosen_name, rs->status.nickname)) {
+          log_notice(LD_DIR, "Conflict on naming for router: %s vs %s",
+                     chosen_name, rs->status.nickname);
+          naming_conflict = 1;
+        }
+        chosen_name = rs->status.nickname;
+      }
+
+      /* count bandwidths */
+      if (rs->status.has_measured_bw)
+        measured_bws[num_mbws++] = rs->status.measured_bw;
+
+      if (rs->status.has_bandwidth)
+        bandwidths[num_bandwidths++] = rs->status.bandwidth;
+    } SMARTLIST_FOREACH_END(v);
+
+    /* We don't include this router at all unless more than half of
+     * the authorities we believe in list it. */
+    if (n_listing <= total_authorities/2)
+      continue;
+
+    /* Figure out the most popular opinion of what the most recent
+     * routerinfo and its contents are. */
+    memset(microdesc_digest, 0, sizeof(microdesc_digest));
+    rs = compute_routerstatus_consensus(matching_descs, consensus_method,
+                                        microdesc_digest);
+    /* Copy bits of that into rs_out. */
+    tor_assert(fast_memeq(lowest_id, rs->status.identity_digest,DIGEST_LEN));
+    memcpy(rs_out.identity_digest, lowest_id, DIGEST_LEN);
+    memcpy(rs_out.descriptor_digest, rs->status.descriptor_digest,
+           DIGEST_LEN);
+    rs_out.addr = rs->status.addr;
+    rs_out.published_on = rs->status.published_on;
+    rs_out.dir_port = rs->status.dir_port;
+    rs_out.or_port = rs->status.or_port;
+    rs_out.has_bandwidth = 0;
+    rs_out.has_exitsummary = 0;
+
+    if (chosen_name && !naming_conflict) {
+      strlcpy(rs_out.nickname, chosen_name, sizeof(rs_out.nickname));
+    } else {
+      strlcpy(rs_out.nickname, rs->status.nickname, sizeof(rs_out.nickname));
+    }
+
+    if (consensus_method == 1) {
+      is_named = chosen_named_idx >= 0 &&
+        (!naming_conflict && flag_counts[chosen_named_idx]);
+    } else {
+      const char *d = strmap_get_lc(name_to_id_map, rs_out.nickname);
+      if (!d) {
+        is_named = is_unnamed = 0;
+      } else if (fast_memeq(d, lowest_id, DIGEST_LEN)) {
+        is_named = 1; is_unnamed = 0;
+      } else {
+        is_named = 0; is_unnamed = 1;
+      }
+    }
+
+    /* Set the flags. */
+    smartlist_add(chosen_flags, (char*)"s"); /* for the start of the line. */
+    SMARTLIST_FOREACH(flags, const char *, fl,
+    {
+      if (!strcmp(fl, "Named")) {
+        if (is_named)
+          smartlist_add(chosen_flags, (char*)fl);
+      } else if (!strcmp(fl, "Unnamed") && consensus_method >= 2) {
+        if (is_unnamed)
+          smartlist_add(chosen_flags, (char*)fl);
+      } else {
+        if (flag_counts[fl_sl_idx] > n_flag_voters[fl_sl_idx]/2) {
+          smartlist_add(chosen_flags, (char*)fl);
+          if (!strcmp(fl, "Exit"))
+            is_exit = 1;
+          else if (!strcmp(fl, "Guard"))
+            is_guard = 1;
+          else if (!strcmp(fl, "Running"))
+            is_running = 1;
+          else if (!strcmp(fl, "BadExit"))
+            is_bad_exit = 1;
+        }
+      }
+    });
+
+    /* Starting with consensus method 4 we do not list servers
+     * that are not running in a consensus.  See Proposal 138 */
+    if (consensus_method >= 4 && !is_running)
+      continue;
+
+    /* Pick the version. */
+    if (smartlist_len(versions)) {
+      sort_version_list(versions, 0);
+      chosen_version = get_most_frequent_member(versions);
+    } else {
+      chosen_version = NULL;
+    }
+
+    /* Pick a bandwidth */
+    if (consensus_method >= 6 && num_mbws > 2) {
+      rs_out.has_bandwidth = 1;
+      rs_out.bandwidth = median_uint32(measured_bws, num_mbws);
+    } else if (consensus_method >= 5 && num_bandwidths > 0) {
+      rs_out.has_bandwidth = 1;
+      rs_out.bandwidth = median_uint32(bandwidths, num_bandwidths);
+    }
+
+    /* Fix bug 2203: Do not count BadExit nodes as Exits for bw weights */
+    if (consensus_method >= 11) {
+      is_exit = is_exit && !is_bad_exit;
+    }
+
+    if (consensus_method >= MIN_METHOD_FOR_BW_WEIGHTS) {
+      if (rs_out.has_bandwidth) {
+        T += rs_out.bandwidth;
+        if (is_exit && is_guard)
+          D += rs_out.bandwidth;
+        else if (is_exit)
+          E += rs_out.bandwidth;
+        else if (is_guard)
+          G += rs_out.bandwidth;
+        else
+          M += rs_out.bandwidth;
+      } else {
+        log_warn(LD_BUG, "Missing consensus bandwidth for router %s",
+            rs_out.nickname);
+      }
+    }
+
+    /* Ok, we already picked a descriptor digest we want to list
+     * previously.  Now we want to use the exit policy summary from
+     * that descriptor.  If everybody plays nice all the voters who
+     * listed that descriptor will have the same summary.  If not then
+     * something is fishy and we'll use the most common one (breaking
+     * ties in favor of lexicographically larger one (only because it
+     * lets me reuse more existing code.
+     *
+     * The other case that can happen is that no authority that voted
+     * for that descriptor has an exit policy summary.  That's
+     * probably quite unlikely but can happen.  In that case we use
+     * the policy that was most often listed in votes, again breaking
+     * ties like in the previous case.
+     */
+    if (consensus_method >= 5) {
+      /* Okay, go through all the votes for this router.  We prepared
+       * that list previously */
+      const char *chosen_exitsummary = NULL;
+      smartlist_clear(exitsummaries);
+      SMARTLIST_FOREACH(matching_descs, vote_routerstatus_t *, vsr, {
+        /* Check if the vote where this status comes from had the
+         * proper descriptor */
+        tor_assert(fast_memeq(rs_out.identity_digest,
+                           vsr->status.identity_digest,
+                           DIGEST_LEN));
+        if (vsr->status.has_exitsummary &&
+             fast_memeq(rs_out.descriptor_digest,
+                     vsr->status.descriptor_digest,
+                     DIGEST_LEN)) {
+          tor_assert(vsr->status.exitsummary);
+          smartlist_add(exitsummaries, vsr->status.exitsummary);
+          if (!chosen_exitsummary) {
+            chosen_exitsummary = vsr->status.exitsummary;
+          } else if (strcmp(chosen_exitsummary, vsr->status.exitsummary)) {
+            /* Great.  There's disagreement among the voters.  That
+             * really shouldn't be */
+            exitsummary_disagreement = 1;
+          }
+        }
+      });
+
+      if (exitsummary_disagreement) {
+        char id[HEX_DIGEST_LEN+1];
+        char dd[HEX_DIGEST_LEN+1];
+        base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
+        base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
+        log_warn(LD_DIR, "The voters disagreed on the exit policy summary "
+                 " for router %s with descriptor %s.  This really shouldn't"
+                 " have happened.", id, dd);
+
+        smartlist_sort_strings(exitsummaries);
+        chosen_exitsummary = get_most_frequent_member(exitsummaries);
+      } else if (!chosen_exitsummary) {
+        char id[HEX_DIGEST_LEN+1];
+        char dd[HEX_DIGEST_LEN+1];
+        base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
+        base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
+        log_warn(LD_DIR, "Not one of the voters that made us select"
+                 "descriptor %s for router %s had an exit policy"
+                 "summary", dd, id);
+
+        /* Ok, none of those voting for the digest we chose had an
+         * exit policy for us.  Well, that kinda sucks.
+         */
+        smartlist_clear(exitsummaries);
+        SMARTLIST_FOREACH(matching_descs, vote_routerstatus_t *, vsr, {
+          if (vsr->status.has_exitsummary)
+            smartlist_add(exitsummaries, vsr->status.exitsummary);
+        });
+        smartlist_sort_strings(exitsummaries);
+        chosen_exitsummary = get_most_frequent_member(exitsummaries);
+
+        if (!chosen_exitsummary)
+          log_warn(LD_DIR, "Wow, not one of the voters had an exit "
+                   "policy summary for %s.  Wow.", id);
+      }
+
+      if (chosen_exitsummary) {
+        rs_out.has_exitsummary = 1;
+        /* yea, discards the const */
+        rs_out.exitsummary = (char *)chosen_exitsummary;
+      }
+    }
+
+    {
+      char buf[4096];
+      /* Okay!! Now we can write the descriptor... */
+      /*     First line goes into "buf". */
+      routerstatus_format_entry(buf, sizeof(buf), &rs_out, NULL,
+                                rs_format);
+      smartlist_add(chunks, tor_strdup(buf));
+    }
+    /*     Now an m line, if applicable. */
+    if (flavor == FLAV_MICRODESC &&
+        !tor_digest256_is_zero(microdesc_digest)) {
+      char m[BASE64_DIGEST256_LEN+1], *cp;
+      digest256_to_base64(m, microdesc_digest);
+      tor_asprintf(&cp, "m %s\n", m);
+      smartlist_add(chunks, cp);
+    }
+    /*     Next line is all flags.  The "\n" is missing. */
+    smartlist_add(chunks,
+                  smartlist_join_strings(chosen_flags, " ", 0, NULL));
+    /*     Now the version line. */
+    if (chosen_version) {
+      smartlist_add(chunks, tor_strdup("\nv "));
+      smartlist_add(chunks, tor_strdup(chosen_version));
+    }
+    smartlist_add(chunks, tor_strdup("\n"));
+    /*     Now the weight line. */
+    if (rs_out.has_bandwidth) {
+      char *cp=NULL;
+      tor_asprintf(&cp, "w Bandwidth=%d\n", rs_out.bandwidth);
+      smartlist_add(chunks, cp);
+    }
+
+    /*     Now the exitpolicy summary line. */
+    if (rs_out.has_exitsummary && flavor == FLAV_NS) {
+      tor_asprintf(&buf, "p %s\n", rs_out.exitsummary);
+      smartlist_add(chunks, buf);
+    }
+
+    /* And the loop is over and we move on to the next router */
+  }
+
+  range->G += G;
+  range->M += M;
+  range->E += E;
+  range->D += D;
+  range->T += T;
+
+  tor_free(index);
+  tor_free(flag_counts);
+  smartlist_free(matching_descs);
+  smartlist_free(chosen_flags);
+  smartlist_free(versions);
+  smartlist_free(exitsummaries);
+  tor_free(bandwidths);
+  tor_free(measured_bws);
+}
+
+#ifdef TOR_HAVE_COND
+/** The routerstatus entries of a consensus, split into ranges of identities
+ * so that pool cpuworkers can compute some of them while the main thread
+ * computes the rest. */
+typedef struct consensus_rs_batch_t {
+  tor_mutex_t *lock; /**< Protects claimed and n_unfinished. */
+  tor_cond_t *cond; /**< Signalled once n_unfinished reaches zero. */
+  int n_unfinished; /**< How many ranges haven't been computed yet? */
+  /** How many references are there to this batch: one from
+   * compute_consensus_rs_entries(), and one from each job we queued.  Only
+   * the main thread touches this. */
+  int refcnt;
+  const consensus_rs_ctx_t *ctx; /**< What we know about the votes. */
+  /** The ranges.  They live in the batch so that a cpuworker that gets to
+   * one late can still see that it was claimed. */
+  consensus_rs_range_t ranges[CONSENSUS_RS_MAX_RANGES];
+} consensus_rs_batch_t;
+
+/** Compute the entries for the range in <b>arg</b> unless another thread
+ * has already started on them.  Safe to call from any thread. */
+static void
+consensus_rs_range_run(void *arg)
+{
+  consensus_rs_range_t *range = arg;
+  consensus_rs_batch_t *batch = range->batch;
+
+  tor_mutex_acquire(batch->lock);
+  if (range->claimed) {
+    tor_mutex_release(batch->lock);
+    return;
+  }
+  range->claimed = 1;
+  tor_mutex_release(batch->lock);
+
+  compute_consensus_rs_range(batch->ctx, range);
+
+  tor_mutex_acquire(batch->lock);
+  if (--batch->n_unfinished == 0)
+    tor_cond_signal_all(batch->cond);
+  tor_mutex_release(batch->lock);
+}
+
+/** Drop a reference to <b>batch</b>, and free it if that was the last. */
+static void
+consensus_rs_batch_decref(consensus_rs_batch_t *batch)
+{
+  if (--batch->refcnt)
+    return;
+  tor_mutex_free(batch->lock);
+  tor_cond_free(batch->cond);
+  tor_free(batch);
+}
+
+/** Runs in the main thread once a cpuworker is done with the range in
+ * <b>arg</b>.  We may have finished the consensus long ago, and freed the
+ * range, so all we do here is let go of the batch. */
+static void
+consensus_rs_range_reply(void *arg)
+{
+  consensus_rs_range_t *range = arg;
+  consensus_rs_batch_decref(range->batch);
+}
+#endif
+
+/** Generate the routerstatus entries for the consensus described by
+ * <b>ctx</b>, using up to <b>n_threads</b> threads: split the identity
+ * space into ranges, let pool cpuworkers compute some of them while we
+ * compute the others, and then add all the text to <b>chunks</b> in
+ * identity order.  Add the bandwidth totals to *<b>G</b>, *<b>M</b>,
+ * *<b>E</b>, *<b>D</b>, and *<b>T</b>. */
+static void
+compute_consensus_rs_entries(const consensus_rs_ctx_t *ctx, int n_threads,
+                             smartlist_t *chunks, int64_t *G, int64_t *M,
+                             int64_t *E, int64_t *D, int64_t *T)
+{
+  const int n_votes = smartlist_len(ctx->votes);
+  networkstatus_t *biggest = NULL;
+  consensus_rs_range_t serial_range, *ranges;
+  int i, n_biggest, n_ranges;
+#ifdef TOR_HAVE_COND
+  consensus_rs_batch_t *batch = NULL;
+#endif
+
+  /* Pick the range boundaries out of the longest vote: its entries are
+   * the likeliest to be spread like the routers we'll list. */
+  SMARTLIST_FOREACH(ctx->votes, networkstatus_t *, v, {
+    if (!biggest || smartlist_len(v->routerstatus_list) >
+                    smartlist_len(biggest->routerstatus_list))
+      biggest = v;
+  });
+  n_biggest = smartlist_len(biggest->routerstatus_list);
+  n_ranges = MIN(n_threads, n_biggest / CONSENSUS_RS_MIN_RANGE);
+  n_ranges = MIN(n_ranges, CONSENSUS_RS_MAX_RANGES);
+
+#ifdef TOR_HAVE_COND
+  if (n_ranges > 1) {
+    batch = tor_malloc_zero(sizeof(consensus_rs_batch_t));
+    batch->lock = tor_mutex_new();
+    batch->cond = tor_cond_new();
+    batch->refcnt = 1;
+    batch->ctx = ctx;
+    batch->n_unfinished = n_ranges;
+    ranges = batch->ranges;
+  } else
+#endif
+  {
+    n_ranges = 1;
+    memset(&serial_range, 0, sizeof(serial_range));
+    ranges = &serial_range;
+  }
+
+  for (i = 0; i < n_ranges; ++i) {
+    consensus_rs_range_t *range = &ranges[i];
+    const char *boundary = NULL;
+#ifdef TOR_HAVE_COND
+    range->batch = batch;
+#endif
+    range->start = tor_malloc_zero(sizeof(int) * n_votes);
+    range->end = tor_malloc_zero(sizeof(int) * n_votes);
+    range->chunks = smartlist_create();
+    if (i) {
+      const vote_routerstatus_t *rs = smartlist_get(
+         biggest->routerstatus_list, (int)(((int64_t)n_biggest*i)/n_ranges));
+      boundary = rs->status.identity_digest;
+    }
+    SMARTLIST_FOREACH_BEGIN(ctx->votes, networkstatus_t *, v) {
+      int found;
+      if (boundary) {
+        range->start[v_sl_idx] = smartlist_bsearch_idx(v->routerstatus_list,
+                                      boundary, _compare_digest_to_vote_rs,
+                                      &found);
+        ranges[i-1].end[v_sl_idx] = range->start[v_sl_idx];
+      }
+      range->end[v_sl_idx] = smartlist_len(v->routerstatus_list);
+    } SMARTLIST_FOREACH_END(v);
+  }
+
+#ifdef TOR_HAVE_COND
+  if (batch) {
+    /* Hand every range but the first to the pool, then work through them
+     * ourselves, skipping any a cpuworker has already started. */
+    for (i = 1; i < n_ranges; ++i) {
+      if (cpuworker_queue_work(consensus_rs_range_run,
+                               consensus_rs_range_reply, &ranges[i]) == 0)
+        ++batch->refcnt;
+    }
+    for (i = 0; i < n_ranges; ++i)
+      consensus_rs_range_run(&ranges[i]);
+    tor_mutex_acquire(batch->lock);
+    while (batch->n_unfinished)
+      tor_cond_wait(batch->cond, batch->lock);
+    tor_mutex_release(batch->lock);
+  } else
+#endif
+  {
+    compute_consensus_rs_range(ctx, &ranges[0]);
+  }
+
+  for (i = 0; i < n_ranges; ++i) {
+    consensus_rs_range_t *range = &ranges[i];
+    smartlist_add_all(chunks, range->chunks);
+    smartlist_free(range->chunks);
+    *G += range->G;
+    *M += range->M;
+    *E += range->E;
+    *D += range->D;
+    *T += range->T;
+    tor_free(range->start);
+    tor_free(range->end);
+  }
+#ifdef TOR_HAVE_COND
+  if (batch)
+    consensus_rs_batch_decref(batch);
+#endif
+}
+
 /** Given a list of vote networkstatus_t in <b>votes</b>, our public
  * authority <b>identity_key</b>, our private authority <b>signing_key</b>,
  * and the number of <b>total_authorities</b> that we believe exist in our
@@ -1578,20 +2174,8 @@ networkstatus_compute_consensus(smartlist_t *votes,
 
   /* Add the actual router entries. */
   {
-    int *index; /* index[j] is the current index into votes[j]. */
-    int *size; /* size[j] is the number of routerstatuses in votes[j]. */
-    int *flag_counts; /* The number of voters that list flag[j] for the
-                       * currently considered router. */
+    consensus_rs_ctx_t ctx;
     int i;
-    smartlist_t *matching_descs = smartlist_create();
-    smartlist_t *chosen_flags = smartlist_create();
-    smartlist_t *versions = smartlist_create();
-    smartlist_t *exitsummaries = smartlist_create();
-    uint32_t *bandwidths = tor_malloc(sizeof(uint32_t) * smartlist_len(votes));
-    uint32_t *measured_bws = tor_malloc(sizeof(uint32_t) *
-                                        smartlist_len(votes));
-    int num_bandwidths;
-    int num_mbws;
 
     int *n_voter_flags; /* n_voter_flags[j] is the number of flags that
                          * votes[j] knows about. */
@@ -1609,8 +2193,6 @@ networkstatus_compute_consensus(smartlist_t *votes,
     memset(conflict, 0, sizeof(conflict));
     memset(unknown, 0xff, sizeof(conflict));
 
-    index = tor_malloc_zero(sizeof(int)*smartlist_len(votes));
-    size = tor_malloc_zero(sizeof(int)*smartlist_len(votes));
     n_voter_flags = tor_malloc_zero(sizeof(int) * smartlist_len(votes));
     n_flag_voters = tor_malloc_zero(sizeof(int) * smartlist_len(flags));
     flag_map = tor_malloc_zero(sizeof(int*) * smartlist_len(votes));
@@ -1637,7 +2219,6 @@ networkstatus_compute_consensus(smartlist_t *votes,
           unnamed_flag[v_sl_idx] = fl_sl_idx;
       });
       n_voter_flags[v_sl_idx] = smartlist_len(v->known_flags);
-      size[v_sl_idx] = smartlist_len(v->routerstatus_list);
     });
 
     /* Named and Unnamed get treated specially */
@@ -1693,334 +2274,30 @@ networkstatus_compute_consensus(smartlist_t *votes,
     }
 
     /* Now go through all the votes */
-    flag_counts = tor_malloc(sizeof(int) * smartlist_len(flags));
-    while (1) {
-      vote_routerstatus_t *rs;
-      routerstatus_t rs_out;
-      const char *lowest_id = NULL;
-      const char *chosen_version;
-      const char *chosen_name = NULL;
-      int exitsummary_disagreement = 0;
-      int is_named = 0, is_unnamed = 0, is_running = 0;
-      int is_guard = 0, is_exit = 0, is_bad_exit = 0;
-      int naming_conflict = 0;
-      int n_listing = 0;
-      int i;
-      char *buf=NULL;
-      char microdesc_digest[DIGEST256_LEN];
-
-      /* Of the next-to-be-considered digest in each voter, which is first? */
-      SMARTLIST_FOREACH(votes, networkstatus_t *, v, {
-        if (index[v_sl_idx] < size[v_sl_idx]) {
-          rs = smartlist_get(v->routerstatus_list, index[v_sl_idx]);
-          if (!lowest_id ||
-              fast_memcmp(rs->status.identity_digest,
-                          lowest_id, DIGEST_LEN) < 0)
-            lowest_id = rs->status.identity_digest;
-        }
-      });
-      if (!lowest_id) /* we're out of routers. */
-        break;
-
-      memset(flag_counts, 0, sizeof(int)*smartlist_len(flags));
-      smartlist_clear(matching_descs);
-      smartlist_clear(chosen_flags);
-      smartlist_clear(versions);
-      num_bandwidths = 0;
-      num_mbws = 0;
-
-      /* Okay, go through all the entries for this digest. */
-      SMARTLIST_FOREACH_BEGIN(votes, networkstatus_t *, v) {
-        if (index[v_sl_idx] >= size[v_sl_idx])
-          continue; /* out of entries. */
-        rs = smartlist_get(v->routerstatus_list, index[v_sl_idx]);
-        if (fast_memcmp(rs->status.identity_digest, lowest_id, DIGEST_LEN))
-          continue; /* doesn't include this router. */
-        /* At this point, we know that we're looking at a routerstatus with
-         * identity "lowest".
-         */
-        ++index[v_sl_idx];
-        ++n_listing;
-
-        smartlist_add(matching_descs, rs);
-        if (rs->version && rs->version[0])
-          smartlist_add(versions, rs->version);
-
-        /* Tally up all the flags. */
-        for (i = 0; i < n_voter_flags[v_sl_idx]; ++i) {
-          if (rs->flags & (U64_LITERAL(1) << i))
-            ++flag_counts[flag_map[v_sl_idx][i]];
-        }
-        if (rs->flags & (U64_LITERAL(1) << named_flag[v_sl_idx])) {
-          if (chosen_name && strcmp(chosen_name, rs->status.nickname)) {
-            log_notice(LD_DIR, "Conflict on naming for router: %s vs %s",
-                       chosen_name, rs->status.nickname);
-            naming_conflict = 1;
-          }
-          chosen_name = rs->status.nickname;
-        }
-
-        /* count bandwidths */
-        if (rs->status.has_measured_bw)
-          measured_bws[num_mbws++] = rs->status.measured_bw;
-
-        if (rs->status.has_bandwidth)
-          bandwidths[num_bandwidths++] = rs->status.bandwidth;
-      } SMARTLIST_FOREACH_END(v);
-
-      /* We don't include this router at all unless more than half of
-       * the authorities we believe in list it. */
-      if (n_listing <= total_authorities/2)
-        continue;
-
-      /* Figure out the most popular opinion of what the most recent
-       * routerinfo and its contents are. */
-      memset(microdesc_digest, 0, sizeof(microdesc_digest));
-      rs = compute_routerstatus_consensus(matching_descs, consensus_method,
-                                          microdesc_digest);
-      /* Copy bits of that into rs_out. */
-      tor_assert(fast_memeq(lowest_id, rs->status.identity_digest,DIGEST_LEN));
-      memcpy(rs_out.identity_digest, lowest_id, DIGEST_LEN);
-      memcpy(rs_out.descriptor_digest, rs->status.descriptor_digest,
-             DIGEST_LEN);
-      rs_out.addr = rs->status.addr;
-      rs_out.published_on = rs->status.published_on;
-      rs_out.dir_port = rs->status.dir_port;
-      rs_out.or_port = rs->status.or_port;
-      rs_out.has_bandwidth = 0;
-      rs_out.has_exitsummary = 0;
-
-      if (chosen_name && !naming_conflict) {
-        strlcpy(rs_out.nickname, chosen_name, sizeof(rs_out.nickname));
-      } else {
-        strlcpy(rs_out.nickname, rs->status.nickname, sizeof(rs_out.nickname));
-      }
-
-      if (consensus_method == 1) {
-        is_named = chosen_named_idx >= 0 &&
-          (!naming_conflict && flag_counts[chosen_named_idx]);
-      } else {
-        const char *d = strmap_get_lc(name_to_id_map, rs_out.nickname);
-        if (!d) {
-          is_named = is_unnamed = 0;
-        } else if (fast_memeq(d, lowest_id, DIGEST_LEN)) {
-          is_named = 1; is_unnamed = 0;
-        } else {
-          is_named = 0; is_unnamed = 1;
-        }
-      }
-
-      /* Set the flags. */
-      smartlist_add(chosen_flags, (char*)"s"); /* for the start of the line. */
-      SMARTLIST_FOREACH(flags, const char *, fl,
-      {
-        if (!strcmp(fl, "Named")) {
-          if (is_named)
-            smartlist_add(chosen_flags, (char*)fl);
-        } else if (!strcmp(fl, "Unnamed") && consensus_method >= 2) {
-          if (is_unnamed)
-            smartlist_add(chosen_flags, (char*)fl);
-        } else {
-          if (flag_counts[fl_sl_idx] > n_flag_voters[fl_sl_idx]/2) {
-            smartlist_add(chosen_flags, (char*)fl);
-            if (!strcmp(fl, "Exit"))
-              is_exit = 1;
-            else if (!strcmp(fl, "Guard"))
-              is_guard = 1;
-            else if (!strcmp(fl, "Running"))
-              is_running = 1;
-            else if (!strcmp(fl, "BadExit"))
-              is_bad_exit = 1;
-          }
-        }
-      });
-
-      /* Starting with consensus method 4 we do not list servers
-       * that are not running in a consensus.  See Proposal 138 */
-      if (consensus_method >= 4 && !is_running)
-        continue;
-
-      /* Pick the version. */
-      if (smartlist_len(versions)) {
-        sort_version_list(versions, 0);
-        chosen_version = get_most_frequent_member(versions);
-      } else {
-        chosen_version = NULL;
-      }
-
-      /* Pick a bandwidth */
-      if (consensus_method >= 6 && num_mbws > 2) {
-        rs_out.has_bandwidth = 1;
-        rs_out.bandwidth = median_uint32(measured_bws, num_mbws);
-      } else if (consensus_method >= 5 && num_bandwidths > 0) {
-        rs_out.has_bandwidth = 1;
-        rs_out.bandwidth = median_uint32(bandwidths, num_bandwidths);
-      }
-
-      /* Fix bug 2203: Do not count BadExit nodes as Exits for bw weights */
-      if (consensus_method >= 11) {
-        is_exit = is_exit && !is_bad_exit;
-      }
-
-      if (consensus_method >= MIN_METHOD_FOR_BW_WEIGHTS) {
-        if (rs_out.has_bandwidth) {
-          T += rs_out.bandwidth;
-          if (is_exit && is_guard)
-            D += rs_out.bandwidth;
-          else if (is_exit)
-            E += rs_out.bandwidth;
-          else if (is_guard)
-            G += rs_out.bandwidth;
-          else
-            M += rs_out.bandwidth;
-        } else {
-          log_warn(LD_BUG, "Missing consensus bandwidth for router %s",
-              rs_out.nickname);
-        }
-      }
-
-      /* Ok, we already picked a descriptor digest we want to list
-       * previously.  Now we want to use the exit policy summary from
-       * that descriptor.  If everybody plays nice all the voters who
-       * listed that descriptor will have the same summary.  If not then
-       * something is fishy and we'll use the most common one (breaking
-       * ties in favor of lexicographically larger one (only because it
-       * lets me reuse more existing code.
-       *
-       * The other case that can happen is that no authority that voted
-       * for that descriptor has an exit policy summary.  That's
-       * probably quite unlikely but can happen.  In that case we use
-       * the policy that was most often listed in votes, again breaking
-       * ties like in the previous case.
-       */
-      if (consensus_method >= 5) {
-        /* Okay, go through all the votes for this router.  We prepared
-         * that list previously */
-        const char *chosen_exitsummary = NULL;
-        smartlist_clear(exitsummaries);
-        SMARTLIST_FOREACH(matching_descs, vote_routerstatus_t *, vsr, {
-          /* Check if the vote where this status comes from had the
-           * proper descriptor */
-          tor_assert(fast_memeq(rs_out.identity_digest,
-                             vsr->status.identity_digest,
-                             DIGEST_LEN));
-          if (vsr->status.has_exitsummary &&
-               fast_memeq(rs_out.descriptor_digest,
-                       vsr->status.descriptor_digest,
-                       DIGEST_LEN)) {
-            tor_assert(vsr->status.exitsummary);
-            smartlist_add(exitsummaries, vsr->status.exitsummary);
-            if (!chosen_exitsummary) {
-              chosen_exitsummary = vsr->status.exitsummary;
-            } else if (strcmp(chosen_exitsummary, vsr->status.exitsummary)) {
-              /* Great.  There's disagreement among the voters.  That
-               * really shouldn't be */
-              exitsummary_disagreement = 1;
-            }
-          }
-        });
-
-        if (exitsummary_disagreement) {
-          char id[HEX_DIGEST_LEN+1];
-          char dd[HEX_DIGEST_LEN+1];
-          base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
-          base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
-          log_warn(LD_DIR, "The voters disagreed on the exit policy summary "
-                   " for router %s with descriptor %s.  This really shouldn't"
-                   " have happened.", id, dd);
-
-          smartlist_sort_strings(exitsummaries);
-          chosen_exitsummary = get_most_frequent_member(exitsummaries);
-        } else if (!chosen_exitsummary) {
-          char id[HEX_DIGEST_LEN+1];
-          char dd[HEX_DIGEST_LEN+1];
-          base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
-          base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
-          log_warn(LD_DIR, "Not one of the voters that made us select"
-                   "descriptor %s for router %s had an exit policy"
-                   "summary", dd, id);
-
-          /* Ok, none of those voting for the digest we chose had an
-           * exit policy for us.  Well, that kinda sucks.
-           */
-          smartlist_clear(exitsummaries);
-          SMARTLIST_FOREACH(matching_descs, vote_routerstatus_t *, vsr, {
-            if (vsr->status.has_exitsummary)
-              smartlist_add(exitsummaries, vsr->status.exitsummary);
-          });
-          smartlist_sort_strings(exitsummaries);
-          chosen_exitsummary = get_most_frequent_member(exitsummaries);
-
-          if (!chosen_exitsummary)
-            log_warn(LD_DIR, "Wow, not one of the voters had an exit "
-                     "policy summary for %s.  Wow.", id);
-        }
-
-        if (chosen_exitsummary) {
-          rs_out.has_exitsummary = 1;
-          /* yea, discards the const */
-          rs_out.exitsummary = (char *)chosen_exitsummary;
-        }
-      }
-
-      {
-        char buf[4096];
-        /* Okay!! Now we can write the descriptor... */
-        /*     First line goes into "buf". */
-        routerstatus_format_entry(buf, sizeof(buf), &rs_out, NULL,
-                                  rs_format);
-        smartlist_add(chunks, tor_strdup(buf));
-      }
-      /*     Now an m line, if applicable. */
-      if (flavor == FLAV_MICRODESC &&
-          !tor_digest256_is_zero(microdesc_digest)) {
-        char m[BASE64_DIGEST256_LEN+1], *cp;
-        digest256_to_base64(m, microdesc_digest);
-        tor_asprintf(&cp, "m %s\n", m);
-        smartlist_add(chunks, cp);
-      }
-      /*     Next line is all flags.  The "\n" is missing. */
-      smartlist_add(chunks,
-                    smartlist_join_strings(chosen_flags, " ", 0, NULL));
-      /*     Now the version line. */
-      if (chosen_version) {
-        smartlist_add(chunks, tor_strdup("\nv "));
-        smartlist_add(chunks, tor_strdup(chosen_version));
-      }
-      smartlist_add(chunks, tor_strdup("\n"));
-      /*     Now the weight line. */
-      if (rs_out.has_bandwidth) {
-        char *cp=NULL;
-        tor_asprintf(&cp, "w Bandwidth=%d\n", rs_out.bandwidth);
-        smartlist_add(chunks, cp);
-      }
-
-      /*     Now the exitpolicy summary line. */
-      if (rs_out.has_exitsummary && flavor == FLAV_NS) {
-        tor_asprintf(&buf, "p %s\n", rs_out.exitsummary);
-        smartlist_add(chunks, buf);
-      }
-
-      /* And the loop is over and we move on to the next router */
-    }
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.votes = votes;
+    ctx.flags = flags;
+    ctx.consensus_method = consensus_method;
+    ctx.total_authorities = total_authorities;
+    ctx.flavor = flavor;
+    ctx.rs_format = rs_format;
+    ctx.n_voter_flags = n_voter_flags;
+    ctx.n_flag_voters = n_flag_voters;
+    ctx.flag_map = flag_map;
+    ctx.named_flag = named_flag;
+    ctx.chosen_named_idx = chosen_named_idx;
+    ctx.name_to_id_map = name_to_id_map;
+    compute_consensus_rs_entries(&ctx, cpuworker_n_pool_workers()+1, chunks,
+                                 &G, &M, &E, &D, &T);
 
-    tor_free(index);
-    tor_free(size);
     tor_free(n_voter_flags);
     tor_free(n_flag_voters);
     for (i = 0; i < smartlist_len(votes); ++i)
       tor_free(flag_map[i]);
     tor_free(flag_map);
-    tor_free(flag_counts);
     tor_free(named_flag);
     tor_free(unnamed_flag);
     strmap_free(name_to_id_map, NULL);
-    smartlist_free(matching_descs);
-    smartlist_free(chosen_flags);
-    smartlist_free(versions);
-    smartlist_free(exitsummaries);
-    tor_free(bandwidths);
-    tor_free(measured_bws);
   }
 
   if (consensus_method >= MIN_METHOD_FOR_FOOTER) {
@@ -3530,7 +3807,8 @@ dirvote_create_microdescriptor(const routerinfo_t *ri)
   size_t keylen;
   char *out = buf, *end = buf+sizeof(buf);
 
-  if (crypto_pk_write_public_key_to_string(ri->onion_pkey, &key, &keylen)<0)
+  if (crypto_pk_write_public_key_to_string(router_get_onion_pkey(ri),
+                                           &key, &keylen)<0)
     goto done;
   summary = policy_summarize(ri->exit_policy);
   if (ri->declared_family)
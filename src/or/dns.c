@@ -61,6 +61,9 @@ struct evdns_request;
 #define evdns_base_resolve_ipv4(base, addr, options, cb, ptr) \
   ((evdns_resolve_ipv4((addr), (options), (cb), (ptr))!=0)    \
    ? NULL : ((void*)1))
+#define evdns_base_resolve_ipv6(base, addr, options, cb, ptr) \
+  ((evdns_resolve_ipv6((addr), (options), (cb), (ptr))!=0)    \
+   ? NULL : ((void*)1))
 #define evdns_base_resolve_reverse(base, addr, options, cb, ptr)        \
   ((evdns_resolve_reverse((addr), (options), (cb), (ptr))!=0)           \
    ? NULL : ((void*)1))
@@ -104,12 +107,6 @@ static char *resolv_conf_fname = NULL;
  * the nameservers?  Used to check whether we need to reconfigure. */
 static time_t resolv_conf_mtime = 0;
 
-/** Linked list of connections waiting for a DNS answer. */
-typedef struct pending_connection_t {
-  edge_connection_t *conn;
-  struct pending_connection_t *next;
-} pending_connection_t;
-
 /** Value of 'magic' field for cached_resolve_t.  Used to try to catch bad
  * pointers and memory stomping. */
 #define CACHED_RESOLVE_MAGIC 0x1234F00D
@@ -152,23 +149,47 @@ typedef struct cached_resolve_t {
   uint8_t is_reverse; /**< Is this a reverse (addr-to-hostname) lookup? */
   time_t expire; /**< Remove items from cache after this time. */
   uint32_t ttl; /**< What TTL did the nameserver tell us? */
-  /** Connections that want to know when we get an answer for this resolve. */
-  pending_connection_t *pending_connections;
+  /** Connections that want to know when we get an answer for this resolve,
+   * linked through their dns_pending_next fields. */
+  edge_connection_t *pending_connections;
+  /** How many connections are on <b>pending_connections</b>? */
+  int n_pending;
   /** Position of this element in the heap*/
   int minheap_idx;
+  /** How many streams have used this answer since we cached it? */
+  uint32_t n_hits;
+  /** True iff we've asked for a fresh answer before this one expires. */
+  unsigned int prefetch_launched:1;
+  /** True iff result.a.addr6 holds an IPv6 address for <b>address</b>, from
+   * the AAAA lookup we launch alongside the A lookup. */
+  unsigned int have_ipv6:1;
+  /** True iff we're still waiting for an answer to that AAAA lookup. */
+  unsigned int ipv6_pending:1;
+  /** What TTL did the nameserver give us for the IPv6 address? */
+  uint32_t ttl_ipv6;
+  /** Stop using the IPv6 address after this time. */
+  time_t expire_ipv6;
+  /** When did we launch the lookup for this pending resolve? */
+  struct timeval launched_at;
 } cached_resolve_t;
 
 static void purge_expired_resolves(time_t now);
 static void dns_found_answer(const char *address, uint8_t is_reverse,
                              uint32_t addr, const char *hostname, char outcome,
                              uint32_t ttl);
-static void send_resolved_cell(edge_connection_t *conn, uint8_t answer_type);
-static int launch_resolve(edge_connection_t *exitconn);
+static void send_resolved_cell(edge_connection_t *conn, uint8_t answer_type,
+                               const cached_resolve_t *resolve);
+static int launch_resolve(const char *address);
+static void launch_ipv6_resolve(cached_resolve_t *resolve);
 static void add_wildcarded_test_address(const char *address);
+static void dns_wildcard_round_finished(void);
+static void pending_conn_remove(edge_connection_t *conn);
+static void wildcard_sets_free(void);
 static int configure_nameservers(int force);
-static int answer_is_wildcarded(const char *ip);
+static int answer_is_wildcarded(uint32_t addr);
 static int dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
-                            or_circuit_t *oncirc, char **resolved_to_hostname);
+                            or_circuit_t *oncirc, char **resolved_to_hostname,
+                            const cached_resolve_t **resolve_out);
 #ifdef DEBUG_DNS_CACHE
 static void _assert_cache_ok(void);
 #define assert_cache_ok() _assert_cache_ok()
@@ -199,8 +220,9 @@ cached_resolve_hash(cached_resolve_t *a)
 
 HT_PROTOTYPE(cache_map, cached_resolve_t, node, cached_resolve_hash,
              cached_resolves_eq)
-HT_GENERATE(cache_map, cached_resolve_t, node, cached_resolve_hash,
-            cached_resolves_eq, 0.6, malloc, realloc, free)
+HT_GENERATE_INCREMENTAL(cache_map, cached_resolve_t, node,
+                        cached_resolve_hash, cached_resolves_eq, 0.6,
+                        malloc, realloc, free)
 
 /** Initialize the DNS cache. */
 static void
@@ -339,11 +361,8 @@ _free_cached_resolve(cached_resolve_t *r)
 {
   if (!r)
     return;
-  while (r->pending_connections) {
-    pending_connection_t *victim = r->pending_connections;
-    r->pending_connections = victim->next;
-    tor_free(victim);
-  }
+  while (r->pending_connections)
+    pending_conn_remove(r->pending_connections);
   if (r->is_reverse)
     tor_free(r->result.hostname);
   r->magic = 0xFF00FF00;
@@ -369,6 +388,96 @@ _compare_cached_resolves_by_expiry(const void *_a, const void *_b)
  * will expire. */
 static smartlist_t *cached_resolve_pqueue = NULL;
 
+/** How many streams got an answer from the cache? */
+static uint64_t n_dns_cache_hits = 0;
+/** How many streams got a cached error from the cache? */
+static uint64_t n_dns_cache_negative_hits = 0;
+/** How many streams waited on a lookup that somebody else started? */
+static uint64_t n_dns_cache_pending_hits = 0;
+/** How many streams had to launch a lookup of their own? */
+static uint64_t n_dns_cache_misses = 0;
+/** How many streams are waiting on a pending lookup right now? */
+static int n_dns_streams_pending = 0;
+/** How many streams stopped waiting on a lookup before it came back? */
+static uint64_t n_dns_pending_cancelled = 0;
+/** What's the most streams we've had waiting on a single lookup? */
+static int dns_max_streams_per_lookup = 0;
+/** How many lookups have we launched to refresh a popular answer early? */
+static uint64_t n_dns_prefetches_launched = 0;
+/** How many of those brought back an answer that replaced the old one? */
+static uint64_t n_dns_prefetches_answered = 0;
+/** How many AAAA lookups have come back with an IPv6 address? */
+static uint64_t n_dns_ipv6_answers = 0;
+
+/** Add <b>conn</b> to the streams waiting on the pending lookup
+ * <b>resolve</b>. */
+static void
+pending_conn_add(cached_resolve_t *resolve, edge_connection_t *conn)
+{
+  tor_assert(!conn->dns_pending_prevp);
+  conn->dns_pending_resolve = resolve;
+  conn->dns_pending_next = resolve->pending_connections;
+  if (conn->dns_pending_next)
+    conn->dns_pending_next->dns_pending_prevp = &conn->dns_pending_next;
+  conn->dns_pending_prevp = &resolve->pending_connections;
+  resolve->pending_connections = conn;
+  ++n_dns_streams_pending;
+  if (++resolve->n_pending > dns_max_streams_per_lookup)
+    dns_max_streams_per_lookup = resolve->n_pending;
+}
+
+/** Remove <b>conn</b> from the streams waiting on its pending lookup, if it
+ * is waiting on one. */
+static void
+pending_conn_remove(edge_connection_t *conn)
+{
+  if (!conn->dns_pending_prevp)
+    return;
+  *conn->dns_pending_prevp = conn->dns_pending_next;
+  if (conn->dns_pending_next)
+    conn->dns_pending_next->dns_pending_prevp = conn->dns_pending_prevp;
+  --conn->dns_pending_resolve->n_pending;
+  --n_dns_streams_pending;
+  conn->dns_pending_resolve = NULL;
+  conn->dns_pending_next = NULL;
+  conn->dns_pending_prevp = NULL;
+}
+
+/** Remove and return the first stream waiting on <b>resolve</b>, or NULL if
+ * there are none. */
+static INLINE edge_connection_t *
+pending_conn_pop(cached_resolve_t *resolve)
+{
+  edge_connection_t *conn = resolve->pending_connections;
+  if (conn)
+    pending_conn_remove(conn);
+  return conn;
+}
+
+/** How many recent stream lookups do we remember the latency of? */
+#define DNS_LATENCY_SAMPLES 1024
+/** Ring buffer holding how long, in msec, our most recent lookups on
+ * behalf of streams took to come back. */
+static uint32_t dns_latency_msec[DNS_LATENCY_SAMPLES];
+/** How many entries of dns_latency_msec hold samples? */
+static int n_dns_latency_samples = 0;
+/** Where in dns_latency_msec does the next sample go? */
+static int dns_latency_next = 0;
+/** How many lookups on behalf of streams came back with a permanent
+ * error? */
+static uint64_t n_dns_lookups_failed = 0;
+/** How many came back with a transient error? */
+static uint64_t n_dns_lookups_transient = 0;
+/** How many never came back at all before we gave up on them? */
+static uint64_t n_dns_lookups_timed_out = 0;
+
+/** Don't prefetch an answer unless at least this many streams have used
+ * it since we cached it. */
+#define DNS_PREFETCH_MIN_HITS 4
+/** Prefetch a popular answer once it's in the last 1/DNS_PREFETCH_FRACTION
+ * of its time in the cache. */
+#define DNS_PREFETCH_FRACTION 8
+
 /** Set an expiry time for a cached_resolve_t, and add it to the expiry
  * priority queue */
 static void
@@ -406,6 +515,7 @@ dns_free_all(void)
   smartlist_free(cached_resolve_pqueue);
   cached_resolve_pqueue = NULL;
   tor_free(resolv_conf_fname);
+  wildcard_sets_free();
 }
 
 /** Remove every cached_resolve whose <b>expire</b> time is before or
@@ -414,7 +524,6 @@ static void
 purge_expired_resolves(time_t now)
 {
   cached_resolve_t *resolve, *removed;
-  pending_connection_t *pend;
   edge_connection_t *pendconn;
 
   assert_cache_ok();
@@ -434,6 +543,7 @@ purge_expired_resolves(time_t now)
                 "Expiring a dns resolve %s that's still pending. Forgot to "
                 "cull it? DNS resolve didn't tell us about the timeout?",
                 escaped_safe_str(resolve->address));
+      ++n_dns_lookups_timed_out;
     } else if (resolve->state == CACHE_STATE_CACHED_VALID ||
                resolve->state == CACHE_STATE_CACHED_FAILED) {
       log_debug(LD_EXIT,
@@ -450,16 +560,12 @@ purge_expired_resolves(time_t now)
       log_debug(LD_EXIT,
                 "Closing pending connections on timed-out DNS resolve!");
       tor_fragile_assert();
-      while (resolve->pending_connections) {
-        pend = resolve->pending_connections;
-        resolve->pending_connections = pend->next;
+      while ((pendconn = pending_conn_pop(resolve))) {
         /* Connections should only be pending if they have no socket. */
-        tor_assert(pend->conn->_base.s == -1);
-        pendconn = pend->conn;
+        tor_assert(pendconn->_base.s == -1);
         connection_edge_end(pendconn, END_STREAM_REASON_TIMEOUT);
         circuit_detach_stream(circuit_get_by_edge_conn(pendconn), pendconn);
         connection_free(TO_CONN(pendconn));
-        tor_free(pend);
       }
     }
 
@@ -488,16 +594,37 @@ purge_expired_resolves(time_t now)
   assert_cache_ok();
 }
 
+/** Return true iff <b>resolve</b> holds an IPv6 address that we can still
+ * hand out at <b>now</b>. */
+static INLINE int
+cached_resolve_has_ipv6(const cached_resolve_t *resolve, time_t now)
+{
+  return resolve && resolve->have_ipv6 && resolve->expire_ipv6 > now;
+}
+
+/** Write a RESOLVED_TYPE_IPV6 answer for the IPv6 address cached in
+ * <b>resolve</b> to <b>buf</b>, and return its length. */
+static size_t
+write_ipv6_answer(char *buf, const cached_resolve_t *resolve)
+{
+  buf[0] = RESOLVED_TYPE_IPV6;
+  buf[1] = 16;
+  memcpy(buf+2, &resolve->result.a.addr6, 16);
+  set_uint32(buf+18, htonl(dns_clip_ttl(resolve->ttl_ipv6)));
+  return 22;
+}
+
 /** Send a response to the RESOLVE request of a connection.
  * <b>answer_type</b> must be one of
- * RESOLVED_TYPE_(IPV4|ERROR|ERROR_TRANSIENT).
+ * RESOLVED_TYPE_(IPV4|IPV6|ERROR|ERROR_TRANSIENT).
  *
- * If <b>circ</b> is provided, and we have a cached answer, send the
- * answer back along circ; otherwise, send the answer back along
- * <b>conn</b>'s attached circuit.
+ * If <b>resolve</b> is provided and holds a live IPv6 address, an IPV4
+ * answer is followed by an IPV6 answer for the same name.  An IPV6 answer
+ * requires such a <b>resolve</b>.
  */
 static void
-send_resolved_cell(edge_connection_t *conn, uint8_t answer_type)
+send_resolved_cell(edge_connection_t *conn, uint8_t answer_type,
+                   const cached_resolve_t *resolve)
 {
   char buf[RELAY_PAYLOAD_SIZE];
   size_t buflen;
@@ -513,8 +640,13 @@ send_resolved_cell(edge_connection_t *conn, uint8_t answer_type)
       set_uint32(buf+2, tor_addr_to_ipv4n(&conn->_base.addr));
       set_uint32(buf+6, htonl(ttl));
       buflen = 10;
+      if (cached_resolve_has_ipv6(resolve, time(NULL)))
+        buflen += write_ipv6_answer(buf+buflen, resolve);
+      break;
+    case RESOLVED_TYPE_IPV6:
+      tor_assert(cached_resolve_has_ipv6(resolve, time(NULL)));
+      buflen = write_ipv6_answer(buf, resolve);
       break;
-    /*XXXX IP6 need ipv6 implementation */
     case RESOLVED_TYPE_ERROR_TRANSIENT:
     case RESOLVED_TYPE_ERROR:
       {
@@ -597,9 +729,10 @@ dns_resolve(edge_connection_t *exitconn)
   or_circuit_t *oncirc = TO_OR_CIRCUIT(exitconn->on_circuit);
   int is_resolve, r;
   char *hostname = NULL;
+  const cached_resolve_t *resolve = NULL;
   is_resolve = exitconn->_base.purpose == EXIT_PURPOSE_RESOLVE;
 
-  r = dns_resolve_impl(exitconn, is_resolve, oncirc, &hostname);
+  r = dns_resolve_impl(exitconn, is_resolve, oncirc, &hostname, &resolve);
 
   switch (r) {
     case 1:
@@ -609,8 +742,10 @@ dns_resolve(edge_connection_t *exitconn)
         /* Send the answer back right now, and detach. */
         if (hostname)
           send_resolved_hostname_cell(exitconn, hostname);
+        else if (resolve && resolve->state == CACHE_STATE_CACHED_FAILED)
+          send_resolved_cell(exitconn, RESOLVED_TYPE_IPV6, resolve);
         else
-          send_resolved_cell(exitconn, RESOLVED_TYPE_IPV4);
+          send_resolved_cell(exitconn, RESOLVED_TYPE_IPV4, resolve);
         exitconn->on_circuit = NULL;
       } else {
         /* Add to the n_streams list; the calling function will send back a
@@ -632,7 +767,8 @@ dns_resolve(edge_connection_t *exitconn)
        * and stop everybody waiting for the same connection. */
       if (is_resolve) {
         send_resolved_cell(exitconn,
-             (r == -1) ? RESOLVED_TYPE_ERROR : RESOLVED_TYPE_ERROR_TRANSIENT);
+             (r == -1) ? RESOLVED_TYPE_ERROR : RESOLVED_TYPE_ERROR_TRANSIENT,
+             NULL);
       }
 
       exitconn->on_circuit = NULL;
@@ -659,6 +795,32 @@ dns_resolve(edge_connection_t *exitconn)
   return r;
 }
 
+/** If the cached answer in <b>resolve</b> is popular and about to expire,
+ * ask our nameservers for a fresh one now, so that the streams asking for
+ * it after it expires don't have to wait.  The answer replaces <b>resolve</b>
+ * when it arrives; see dns_found_answer(). */
+static void
+dns_maybe_prefetch(cached_resolve_t *resolve, time_t now)
+{
+  uint32_t lifetime;
+  if (resolve->prefetch_launched ||
+      resolve->n_hits < DNS_PREFETCH_MIN_HITS ||
+      !get_options()->ServerDNSPrefetch)
+    return;
+  lifetime = dns_get_expiry_ttl(resolve->ttl);
+  if ((resolve->expire - now) * DNS_PREFETCH_FRACTION > (time_t)lifetime)
+    return;
+
+  log_debug(LD_EXIT, "Prefetching popular address %s (%lu hits).",
+            escaped_safe_str(resolve->address),
+            (unsigned long)resolve->n_hits);
+  if (launch_resolve(resolve->address) == 0) {
+    resolve->prefetch_launched = 1;
+    ++n_dns_prefetches_launched;
+    launch_ipv6_resolve(resolve);
+  }
+}
+
 /** Helper function for dns_resolve: same functionality, but does not handle:
  *     - marking connections on error and clearing their on_circuit
  *     - linking connections to n_streams/resolving_streams,
@@ -666,15 +828,18 @@ dns_resolve(edge_connection_t *exitconn)
  *
  * Return -2 on a transient error. If it's a reverse resolve and it's
  * successful, sets *<b>hostname_out</b> to a newly allocated string
- * holding the cached reverse DNS value.
+ * holding the cached reverse DNS value.  If we answer from the cache, set
+ * *<b>resolve_out</b> to the cache entry we used.  (As a special case, a
+ * RESOLVE request for a name whose IPv4 lookup failed but whose IPv6 lookup
+ * succeeded gets an answer from a CACHED_FAILED entry.)
  */
 static int
 dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
-                 or_circuit_t *oncirc, char **hostname_out)
+                 or_circuit_t *oncirc, char **hostname_out,
+                 const cached_resolve_t **resolve_out)
 {
   cached_resolve_t *resolve;
   cached_resolve_t search;
-  pending_connection_t *pending_connection;
   const routerinfo_t *me;
   tor_addr_t addr;
   time_t now = time(NULL);
@@ -751,12 +916,9 @@ dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
   if (resolve && resolve->expire > now) { /* already there */
     switch (resolve->state) {
       case CACHE_STATE_PENDING:
+        ++n_dns_cache_pending_hits;
         /* add us to the pending list */
-        pending_connection = tor_malloc_zero(
-                                      sizeof(pending_connection_t));
-        pending_connection->conn = exitconn;
-        pending_connection->next = resolve->pending_connections;
-        resolve->pending_connections = pending_connection;
+        pending_conn_add(resolve, exitconn);
         log_debug(LD_EXIT,"Connection (fd %d) waiting for pending DNS "
                   "resolve of %s", exitconn->_base.s,
                   escaped_safe_str(exitconn->_base.address));
@@ -772,11 +934,24 @@ dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
         } else {
           tor_addr_from_ipv4h(&exitconn->_base.addr, resolve->result.a.addr);
         }
+        ++n_dns_cache_hits;
+        ++resolve->n_hits;
+        dns_maybe_prefetch(resolve, now);
+        *resolve_out = resolve;
         return 1;
       case CACHE_STATE_CACHED_FAILED:
+        if (is_resolve && cached_resolve_has_ipv6(resolve, now)) {
+          log_debug(LD_EXIT,"Connection (fd %d) found cached IPv6-only "
+                    "answer for %s", exitconn->_base.s,
+                    escaped_safe_str(resolve->address));
+          ++n_dns_cache_hits;
+          *resolve_out = resolve;
+          return 1;
+        }
         log_debug(LD_EXIT,"Connection (fd %d) found cached error for %s",
                   exitconn->_base.s,
                   escaped_safe_str(exitconn->_base.address));
+        ++n_dns_cache_negative_hits;
         return -1;
       case CACHE_STATE_DONE:
         log_err(LD_BUG, "Found a 'DONE' dns resolve still in the cache.");
@@ -792,11 +967,10 @@ dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
   resolve->minheap_idx = -1;
   resolve->is_reverse = is_reverse;
   strlcpy(resolve->address, exitconn->_base.address, sizeof(resolve->address));
+  tor_gettimeofday(&resolve->launched_at);
 
   /* add this connection to the pending list */
-  pending_connection = tor_malloc_zero(sizeof(pending_connection_t));
-  pending_connection->conn = exitconn;
-  resolve->pending_connections = pending_connection;
+  pending_conn_add(resolve, exitconn);
 
   /* Add this resolve to the cache and priority queue. */
   HT_INSERT(cache_map, &cache_root, resolve);
@@ -806,7 +980,11 @@ dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
             escaped_safe_str(exitconn->_base.address));
   assert_cache_ok();
 
-  return launch_resolve(exitconn);
+  ++n_dns_cache_misses;
+  r = launch_resolve(exitconn->_base.address);
+  if (r == 0 && !is_reverse)
+    launch_ipv6_resolve(resolve);
+  return r;
 }
 
 /** Log an error and abort if conn is waiting for a DNS resolve.
@@ -814,26 +992,8 @@ dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
 void
 assert_connection_edge_not_dns_pending(edge_connection_t *conn)
 {
-  pending_connection_t *pend;
-  cached_resolve_t search;
-
-#if 1
-  cached_resolve_t *resolve;
-  strlcpy(search.address, conn->_base.address, sizeof(search.address));
-  resolve = HT_FIND(cache_map, &cache_root, &search);
-  if (!resolve)
-    return;
-  for (pend = resolve->pending_connections; pend; pend = pend->next) {
-    tor_assert(pend->conn != conn);
-  }
-#else
-  cached_resolve_t **resolve;
-  HT_FOREACH(resolve, cache_map, &cache_root) {
-    for (pend = (*resolve)->pending_connections; pend; pend = pend->next) {
-      tor_assert(pend->conn != conn);
-    }
-  }
-#endif
+  tor_assert(!conn->dns_pending_prevp);
+  tor_assert(!conn->dns_pending_resolve);
 }
 
 /** Log an error and abort if any connection waiting for a DNS resolve is
@@ -841,17 +1001,22 @@ assert_connection_edge_not_dns_pending(edge_connection_t *conn)
 void
 assert_all_pending_dns_resolves_ok(void)
 {
-  pending_connection_t *pend;
+  edge_connection_t *pend;
   cached_resolve_t **resolve;
 
   HT_FOREACH(resolve, cache_map, &cache_root) {
+    int n = 0;
     for (pend = (*resolve)->pending_connections;
          pend;
-         pend = pend->next) {
-      assert_connection_ok(TO_CONN(pend->conn), 0);
-      tor_assert(pend->conn->_base.s == -1);
-      tor_assert(!connection_in_array(TO_CONN(pend->conn)));
+         pend = pend->dns_pending_next) {
+      assert_connection_ok(TO_CONN(pend), 0);
+      tor_assert(pend->_base.s == -1);
+      tor_assert(!connection_in_array(TO_CONN(pend)));
+      tor_assert(pend->dns_pending_resolve == *resolve);
+      tor_assert(*pend->dns_pending_prevp == pend);
+      ++n;
     }
+    tor_assert(n == (*resolve)->n_pending);
   }
 }
 
@@ -860,49 +1025,21 @@ assert_all_pending_dns_resolves_ok(void)
 void
 connection_dns_remove(edge_connection_t *conn)
 {
-  pending_connection_t *pend, *victim;
-  cached_resolve_t search;
-  cached_resolve_t *resolve;
-
   tor_assert(conn->_base.type == CONN_TYPE_EXIT);
   tor_assert(conn->_base.state == EXIT_CONN_STATE_RESOLVING);
 
-  strlcpy(search.address, conn->_base.address, sizeof(search.address));
-
-  resolve = HT_FIND(cache_map, &cache_root, &search);
-  if (!resolve) {
+  if (!conn->dns_pending_prevp) {
     log_notice(LD_BUG, "Address %s is not pending. Dropping.",
                escaped_safe_str(conn->_base.address));
     return;
   }
-
-  tor_assert(resolve->pending_connections);
   assert_connection_ok(TO_CONN(conn),0);
+  tor_assert(conn->dns_pending_resolve->state == CACHE_STATE_PENDING);
 
-  pend = resolve->pending_connections;
-
-  if (pend->conn == conn) {
-    resolve->pending_connections = pend->next;
-    tor_free(pend);
-    log_debug(LD_EXIT, "First connection (fd %d) no longer waiting "
-              "for resolve of %s",
-              conn->_base.s,
-              escaped_safe_str(conn->_base.address));
-    return;
-  } else {
-    for ( ; pend->next; pend = pend->next) {
-      if (pend->next->conn == conn) {
-        victim = pend->next;
-        pend->next = victim->next;
-        tor_free(victim);
-        log_debug(LD_EXIT,
-                  "Connection (fd %d) no longer waiting for resolve of %s",
-                  conn->_base.s, escaped_safe_str(conn->_base.address));
-        return; /* more are pending */
-      }
-    }
-    tor_assert(0); /* not reachable unless onlyconn not in pending list */
-  }
+  pending_conn_remove(conn);
+  ++n_dns_pending_cancelled;
+  log_debug(LD_EXIT, "Connection (fd %d) no longer waiting for resolve of %s",
+            conn->_base.s, escaped_safe_str(conn->_base.address));
 }
 
 /** Mark all connections waiting for <b>address</b> for close.  Then cancel
@@ -912,7 +1049,6 @@ connection_dns_remove(edge_connection_t *conn)
 void
 dns_cancel_pending_resolve(const char *address)
 {
-  pending_connection_t *pend;
   cached_resolve_t search;
   cached_resolve_t *resolve, *tmp;
   edge_connection_t *pendconn;
@@ -950,10 +1086,8 @@ dns_cancel_pending_resolve(const char *address)
   log_debug(LD_EXIT,
              "Failing all connections waiting on DNS resolve of %s",
              escaped_safe_str(address));
-  while (resolve->pending_connections) {
-    pend = resolve->pending_connections;
-    pend->conn->_base.state = EXIT_CONN_STATE_RESOLVEFAILED;
-    pendconn = pend->conn;
+  while ((pendconn = pending_conn_pop(resolve))) {
+    pendconn->_base.state = EXIT_CONN_STATE_RESOLVEFAILED;
     assert_connection_ok(TO_CONN(pendconn), 0);
     tor_assert(pendconn->_base.s == -1);
     if (!pendconn->_base.marked_for_close) {
@@ -964,8 +1098,6 @@ dns_cancel_pending_resolve(const char *address)
       circuit_detach_stream(circ, pendconn);
     if (!pendconn->_base.marked_for_close)
       connection_free(TO_CONN(pendconn));
-    resolve->pending_connections = pend->next;
-    tor_free(pend);
   }
 
   tmp = HT_REMOVE(cache_map, &cache_root, resolve);
@@ -983,15 +1115,22 @@ dns_cancel_pending_resolve(const char *address)
 /** Helper: adds an entry to the DNS cache mapping <b>address</b> to the ipv4
  * address <b>addr</b> (if is_reverse is 0) or the hostname <b>hostname</b> (if
  * is_reverse is 1).  <b>ttl</b> is a cache ttl; <b>outcome</b> is one of
- * DNS_RESOLVE_{FAILED_TRANSIENT|FAILED_PERMANENT|SUCCEEDED}.
+ * DNS_RESOLVE_{FAILED_TRANSIENT|FAILED_PERMANENT|SUCCEEDED}.  If
+ * <b>oldresolve</b> is provided, carry over any IPv6 answer it holds.
+ * Return the new entry, or NULL if we didn't cache anything.
  **/
-static void
+static cached_resolve_t *
 add_answer_to_cache(const char *address, uint8_t is_reverse, uint32_t addr,
-                    const char *hostname, char outcome, uint32_t ttl)
+                    const char *hostname, char outcome, uint32_t ttl,
+                    const cached_resolve_t *oldresolve)
 {
   cached_resolve_t *resolve;
+  int negative_ttl = get_options()->ServerDNSNegativeCacheTTL;
   if (outcome == DNS_RESOLVE_FAILED_TRANSIENT)
-    return;
+    return NULL;
+  if (outcome == DNS_RESOLVE_FAILED_PERMANENT && negative_ttl <= 0 &&
+      !cached_resolve_has_ipv6(oldresolve, time(NULL)))
+    return NULL; /* Negative caching is off. */
 
   //log_notice(LD_EXIT, "Adding to cache: %s -> %s (%lx, %s), %d",
   //           address, is_reverse?"(reverse)":"", (unsigned long)addr,
@@ -1014,11 +1153,144 @@ add_answer_to_cache(const char *address, uint8_t is_reverse, uint32_t addr,
   } else {
     tor_assert(!hostname);
     resolve->result.a.addr = addr;
+    if (oldresolve) {
+      resolve->have_ipv6 = oldresolve->have_ipv6;
+      resolve->ipv6_pending = oldresolve->ipv6_pending;
+      memcpy(&resolve->result.a.addr6, &oldresolve->result.a.addr6,
+             sizeof(resolve->result.a.addr6));
+      resolve->ttl_ipv6 = oldresolve->ttl_ipv6;
+      resolve->expire_ipv6 = oldresolve->expire_ipv6;
+    }
   }
   resolve->ttl = ttl;
   assert_resolve_ok(resolve);
   HT_INSERT(cache_map, &cache_root, resolve);
-  set_expiry(resolve, time(NULL) + dns_get_expiry_ttl(ttl));
+  if (outcome == DNS_RESOLVE_SUCCEEDED)
+    set_expiry(resolve, time(NULL) + dns_get_expiry_ttl(ttl));
+  else if (cached_resolve_has_ipv6(resolve, time(NULL)))
+    set_expiry(resolve, resolve->expire_ipv6);
+  else
+    set_expiry(resolve, time(NULL) + MIN(negative_ttl, MAX_DNS_ENTRY_AGE));
+  return resolve;
+}
+
+/** Record how long the lookup for the pending resolve <b>resolve</b> took,
+ * and whether it failed; <b>outcome</b> is one of
+ * DNS_RESOLVE_{FAILED_TRANSIENT|FAILED_PERMANENT|SUCCEEDED}. */
+static void
+dns_note_lookup_done(const cached_resolve_t *resolve, char outcome)
+{
+  struct timeval now;
+  long msec;
+
+  if (outcome == DNS_RESOLVE_FAILED_TRANSIENT) {
+    ++n_dns_lookups_transient;
+    return;
+  } else if (outcome == DNS_RESOLVE_FAILED_PERMANENT) {
+    ++n_dns_lookups_failed;
+  }
+
+  tor_gettimeofday(&now);
+  msec = tv_mdiff(&resolve->launched_at, &now);
+  if (msec < 0)
+    msec = 0;
+  dns_latency_msec[dns_latency_next] = (uint32_t)msec;
+  dns_latency_next = (dns_latency_next + 1) % DNS_LATENCY_SAMPLES;
+  if (n_dns_latency_samples < DNS_LATENCY_SAMPLES)
+    ++n_dns_latency_samples;
+}
+
+/** Set *<b>p50_out</b>, *<b>p90_out</b> and *<b>p99_out</b> to the median,
+ * 90th and 99th percentile time, in msec, that our recent lookups on behalf
+ * of streams took.  Return the number of lookups they describe. */
+int
+dns_get_latency_percentiles(uint32_t *p50_out, uint32_t *p90_out,
+                            uint32_t *p99_out)
+{
+  uint32_t *samples;
+  int n = n_dns_latency_samples;
+
+  *p50_out = *p90_out = *p99_out = 0;
+  if (!n)
+    return 0;
+  samples = tor_memdup(dns_latency_msec, n * sizeof(uint32_t));
+  *p50_out = find_nth_uint32(samples, n, (n-1)/2);
+  *p90_out = find_nth_uint32(samples, n, (n-1)*9/10);
+  *p99_out = find_nth_uint32(samples, n, (n-1)*99/100);
+  tor_free(samples);
+  return n;
+}
+
+/** Set *<b>failed_out</b>, *<b>transient_out</b> and
+ * *<b>timed_out_out</b> to the number of lookups on behalf of streams that
+ * failed permanently, failed transiently, or never came back. */
+void
+dns_get_lookup_failure_counts(uint64_t *failed_out, uint64_t *transient_out,
+                              uint64_t *timed_out_out)
+{
+  *failed_out = n_dns_lookups_failed;
+  *transient_out = n_dns_lookups_transient;
+  *timed_out_out = n_dns_lookups_timed_out;
+}
+
+#ifndef HAVE_EVENT2_DNS_H
+/** Helper for dns_get_nameserver_stats: add a line describing the
+ * nameserver at <b>address</b> to the smartlist <b>arg</b>. */
+static void
+dns_format_nameserver_stats(const struct sockaddr *address,
+                            const struct evdns_nameserver_stats *stats,
+                            void *arg)
+{
+  static const int limits[] = EVDNS_LATENCY_BUCKET_LIMITS_MSEC;
+  smartlist_t *lines = arg;
+  smartlist_t *buckets = smartlist_create();
+  char addrbuf[TOR_ADDR_BUF_LEN];
+  char *hist, *line;
+  tor_addr_t addr;
+  uint16_t port = 0;
+  int i;
+
+  if (tor_addr_from_sockaddr(&addr, address, &port) < 0)
+    tor_addr_make_unspec(&addr);
+  tor_addr_to_str(addrbuf, &addr, sizeof(addrbuf), 1);
+  for (i = 0; i < EVDNS_LATENCY_BUCKETS; ++i) {
+    char *bucket;
+    if (i < EVDNS_LATENCY_BUCKETS - 1)
+      tor_asprintf(&bucket, "%d=%lu", limits[i],
+                   (unsigned long)stats->latency[i]);
+    else
+      tor_asprintf(&bucket, "inf=%lu", (unsigned long)stats->latency[i]);
+    smartlist_add(buckets, bucket);
+  }
+  hist = smartlist_join_strings(buckets, ",", 0, NULL);
+  tor_asprintf(&line, "%s:%d up=%d sent=%lu replies=%lu timeouts=%lu "
+               "failures=%lu inflight=%d latency-msec=%s",
+               addrbuf, (int)port, stats->is_up,
+               (unsigned long)stats->requests_sent,
+               (unsigned long)stats->replies,
+               (unsigned long)stats->timeouts,
+               (unsigned long)stats->failures,
+               stats->inflight, hist);
+  smartlist_add(lines, line);
+  SMARTLIST_FOREACH(buckets, char *, cp, tor_free(cp));
+  smartlist_free(buckets);
+  tor_free(hist);
+}
+#endif
+
+/** Return a newly allocated list of newly allocated strings, each
+ * describing how one of our nameservers has been doing.  The list is empty
+ * if our resolver doesn't keep per-nameserver statistics (as with
+ * Libevent 2's evdns). */
+smartlist_t *
+dns_get_nameserver_stats(void)
+{
+  smartlist_t *lines = smartlist_create();
+#ifndef HAVE_EVENT2_DNS_H
+  if (nameservers_configured)
+    evdns_get_nameserver_stats(dns_format_nameserver_stats, lines);
+#endif
+  return lines;
 }
 
 /** Return true iff <b>address</b> is one of the addresses we use to verify
@@ -1042,7 +1314,6 @@ static void
 dns_found_answer(const char *address, uint8_t is_reverse, uint32_t addr,
                  const char *hostname, char outcome, uint32_t ttl)
 {
-  pending_connection_t *pend;
   cached_resolve_t search;
   cached_resolve_t *resolve, *removed;
   edge_connection_t *pendconn;
@@ -1058,11 +1329,30 @@ dns_found_answer(const char *address, uint8_t is_reverse, uint32_t addr,
     if (!is_test_addr)
       log_info(LD_EXIT,"Resolved unasked address %s; caching anyway.",
                escaped_safe_str(address));
-    add_answer_to_cache(address, is_reverse, addr, hostname, outcome, ttl);
+    add_answer_to_cache(address, is_reverse, addr, hostname, outcome, ttl,
+                        NULL);
     return;
   }
   assert_resolve_ok(resolve);
 
+  if (resolve->state != CACHE_STATE_PENDING && resolve->prefetch_launched) {
+    /* This is the answer to a prefetch.  Unless it's a transient failure,
+     * it replaces the answer we had; the old one stays in the priority
+     * queue as DONE until it would have expired. */
+    resolve->prefetch_launched = 0;
+    if (outcome == DNS_RESOLVE_FAILED_TRANSIENT)
+      return;
+    tor_assert(resolve->pending_connections == NULL);
+    resolve->state = CACHE_STATE_DONE;
+    removed = HT_REMOVE(cache_map, &cache_root, resolve);
+    tor_assert(removed == resolve);
+    ++n_dns_prefetches_answered;
+    add_answer_to_cache(address, is_reverse, addr, hostname, outcome, ttl,
+                        resolve);
+    assert_cache_ok();
+    return;
+  }
+
   if (resolve->state != CACHE_STATE_PENDING) {
     /* XXXX Maybe update addr? or check addr for consistency? Or let
      * VALID replace FAILED? */
@@ -1074,16 +1364,15 @@ dns_found_answer(const char *address, uint8_t is_reverse, uint32_t addr,
     tor_assert(resolve->pending_connections == NULL);
     return;
   }
+  dns_note_lookup_done(resolve, outcome);
+
   /* Removed this assertion: in fact, we'll sometimes get a double answer
    * to the same question.  This can happen when we ask one worker to resolve
    * X.Y.Z., then we cancel the request, and then we ask another worker to
    * resolve X.Y.Z. */
   /* tor_assert(resolve->state == CACHE_STATE_PENDING); */
 
-  while (resolve->pending_connections) {
-    pend = resolve->pending_connections;
-    pendconn = pend->conn; /* don't pass complex things to the
-                              connection_mark_for_close macro */
+  while ((pendconn = pending_conn_pop(resolve))) {
     assert_connection_ok(TO_CONN(pendconn),time(NULL));
     tor_addr_from_ipv4h(&pendconn->_base.addr, addr);
     pendconn->address_ttl = ttl;
@@ -1095,9 +1384,14 @@ dns_found_answer(const char *address, uint8_t is_reverse, uint32_t addr,
         connection_edge_end(pendconn, END_STREAM_REASON_RESOLVEFAILED);
         /* This detach must happen after we send the end cell. */
         circuit_detach_stream(circuit_get_by_edge_conn(pendconn), pendconn);
+      } else if (cached_resolve_has_ipv6(resolve, time(NULL))) {
+        /* No IPv4 address, but the AAAA lookup already came back. */
+        send_resolved_cell(pendconn, RESOLVED_TYPE_IPV6, resolve);
+        circuit_detach_stream(circuit_get_by_edge_conn(pendconn), pendconn);
       } else {
         send_resolved_cell(pendconn, outcome == DNS_RESOLVE_FAILED_PERMANENT ?
-                          RESOLVED_TYPE_ERROR : RESOLVED_TYPE_ERROR_TRANSIENT);
+                          RESOLVED_TYPE_ERROR : RESOLVED_TYPE_ERROR_TRANSIENT,
+                          NULL);
         /* This detach must happen after we send the resolved cell. */
         circuit_detach_stream(circuit_get_by_edge_conn(pendconn), pendconn);
       }
@@ -1106,19 +1400,19 @@ dns_found_answer(const char *address, uint8_t is_reverse, uint32_t addr,
       if (pendconn->_base.purpose == EXIT_PURPOSE_CONNECT) {
         tor_assert(!is_reverse);
         /* prevent double-remove. */
-        pend->conn->_base.state = EXIT_CONN_STATE_CONNECTING;
+        pendconn->_base.state = EXIT_CONN_STATE_CONNECTING;
 
-        circ = circuit_get_by_edge_conn(pend->conn);
+        circ = circuit_get_by_edge_conn(pendconn);
         tor_assert(circ);
         tor_assert(!CIRCUIT_IS_ORIGIN(circ));
-        /* unlink pend->conn from resolving_streams, */
-        circuit_detach_stream(circ, pend->conn);
+        /* unlink pendconn from resolving_streams, */
+        circuit_detach_stream(circ, pendconn);
         /* and link it to n_streams */
-        pend->conn->next_stream = TO_OR_CIRCUIT(circ)->n_streams;
-        pend->conn->on_circuit = circ;
-        TO_OR_CIRCUIT(circ)->n_streams = pend->conn;
+        pendconn->next_stream = TO_OR_CIRCUIT(circ)->n_streams;
+        pendconn->on_circuit = circ;
+        TO_OR_CIRCUIT(circ)->n_streams = pendconn;
 
-        connection_exit_connect(pend->conn);
+        connection_exit_connect(pendconn);
       } else {
         /* prevent double-remove.  This isn't really an accurate state,
          * but it does the right thing. */
@@ -1126,15 +1420,13 @@ dns_found_answer(const char *address, uint8_t is_reverse, uint32_t addr,
         if (is_reverse)
           send_resolved_hostname_cell(pendconn, hostname);
         else
-          send_resolved_cell(pendconn, RESOLVED_TYPE_IPV4);
+          send_resolved_cell(pendconn, RESOLVED_TYPE_IPV4, resolve);
         circ = circuit_get_by_edge_conn(pendconn);
         tor_assert(circ);
         circuit_detach_stream(circ, pendconn);
         connection_free(TO_CONN(pendconn));
       }
     }
-    resolve->pending_connections = pend->next;
-    tor_free(pend);
   }
 
   resolve->state = CACHE_STATE_DONE;
@@ -1148,10 +1440,38 @@ dns_found_answer(const char *address, uint8_t is_reverse, uint32_t addr,
   assert_resolve_ok(resolve);
   assert_cache_ok();
 
-  add_answer_to_cache(address, is_reverse, addr, hostname, outcome, ttl);
+  add_answer_to_cache(address, is_reverse, addr, hostname, outcome, ttl,
+                      resolve);
   assert_cache_ok();
 }
 
+/** Called when the AAAA lookup we launched alongside the A lookup for
+ * <b>address</b> finishes.  <b>addr6</b> is the first address we got back,
+ * or NULL if the lookup failed.  Record the answer in whichever entry for
+ * <b>address</b> is in the cache now. */
+static void
+dns_found_ipv6_answer(const char *address, const struct in6_addr *addr6,
+                      uint32_t ttl)
+{
+  cached_resolve_t search;
+  cached_resolve_t *resolve;
+
+  strlcpy(search.address, address, sizeof(search.address));
+  resolve = HT_FIND(cache_map, &cache_root, &search);
+  if (!resolve || resolve->is_reverse)
+    return;
+  assert_resolve_ok(resolve);
+
+  resolve->ipv6_pending = 0;
+  if (!addr6)
+    return; /* Keep any answer we already had until it expires. */
+  memcpy(&resolve->result.a.addr6, addr6, sizeof(resolve->result.a.addr6));
+  resolve->have_ipv6 = 1;
+  resolve->ttl_ipv6 = ttl;
+  resolve->expire_ipv6 = time(NULL) + dns_get_expiry_ttl(ttl);
+  ++n_dns_ipv6_answers;
+}
+
 /** Eventdns helper: return true iff the eventdns result <b>err</b> is
  * a transient failure. */
 static int
@@ -1326,30 +1646,35 @@ evdns_callback(int result, char type, int count, int ttl, void *addresses,
 
   if (result == DNS_ERR_NONE) {
     if (type == DNS_IPv4_A && count) {
-      char answer_buf[INET_NTOA_BUF_LEN+1];
-      struct in_addr in;
-      char *escaped_address;
       uint32_t *addrs = addresses;
-      in.s_addr = addrs[0];
       addr = ntohl(addrs[0]);
       status = DNS_RESOLVE_SUCCEEDED;
-      tor_inet_ntoa(&in, answer_buf, sizeof(answer_buf));
-      escaped_address = esc_for_log(string_address);
 
-      if (answer_is_wildcarded(answer_buf)) {
-        log_debug(LD_EXIT, "eventdns said that %s resolves to ISP-hijacked "
-                  "address %s; treating as a failure.",
-                  safe_str(escaped_address),
-                  escaped_safe_str(answer_buf));
+      if (answer_is_wildcarded(addr)) {
         was_wildcarded = 1;
-        addr = 0;
         status = DNS_RESOLVE_FAILED_PERMANENT;
-      } else {
-        log_debug(LD_EXIT, "eventdns said that %s resolves to %s",
-                  safe_str(escaped_address),
-                  escaped_safe_str(answer_buf));
       }
-      tor_free(escaped_address);
+      /* Only build the printable forms if somebody will see them: this is
+       * called for every answer we get. */
+      if (PREDICT_UNLIKELY(log_global_domain_enabled(LOG_DEBUG, LD_EXIT))) {
+        char answer_buf[INET_NTOA_BUF_LEN+1];
+        struct in_addr in;
+        char *escaped_address = esc_for_log(string_address);
+        in.s_addr = addrs[0];
+        tor_inet_ntoa(&in, answer_buf, sizeof(answer_buf));
+        if (was_wildcarded)
+          log_debug(LD_EXIT, "eventdns said that %s resolves to ISP-hijacked "
+                    "address %s; treating as a failure.",
+                    safe_str(escaped_address),
+                    escaped_safe_str(answer_buf));
+        else
+          log_debug(LD_EXIT, "eventdns said that %s resolves to %s",
+                    safe_str(escaped_address),
+                    escaped_safe_str(answer_buf));
+        tor_free(escaped_address);
+      }
+      if (was_wildcarded)
+        addr = 0;
     } else if (type == DNS_PTR && count) {
       char *escaped_address;
       is_reverse = 1;
@@ -1383,13 +1708,13 @@ evdns_callback(int result, char type, int count, int ttl, void *addresses,
   tor_free(string_address);
 }
 
-/** For eventdns: start resolving as necessary to find the target for
- * <b>exitconn</b>.  Returns -1 on error, -2 on transient error,
+/** For eventdns: start resolving <b>address</b>, a lowercased hostname or
+ * in-addr.arpa name.  Returns -1 on error, -2 on transient error,
  * 0 on "resolve launched." */
 static int
-launch_resolve(edge_connection_t *exitconn)
+launch_resolve(const char *address)
 {
-  char *addr = tor_strdup(exitconn->_base.address);
+  char *addr = tor_strdup(address);
   struct evdns_request *req = NULL;
   tor_addr_t a;
   int r;
@@ -1409,18 +1734,18 @@ launch_resolve(edge_connection_t *exitconn)
   }
 
   r = tor_addr_parse_PTR_name(
-                            &a, exitconn->_base.address, AF_UNSPEC, 0);
+                            &a, address, AF_UNSPEC, 0);
 
   tor_assert(the_evdns_base);
   if (r == 0) {
     log_info(LD_EXIT, "Launching eventdns request for %s",
-             escaped_safe_str(exitconn->_base.address));
+             escaped_safe_str(address));
     req = evdns_base_resolve_ipv4(the_evdns_base,
-                                exitconn->_base.address, options,
+                                address, options,
                                 evdns_callback, addr);
   } else if (r == 1) {
     log_info(LD_EXIT, "Launching eventdns reverse request for %s",
-             escaped_safe_str(exitconn->_base.address));
+             escaped_safe_str(address));
     if (tor_addr_family(&a) == AF_INET)
       req = evdns_base_resolve_reverse(the_evdns_base,
                                 tor_addr_to_in(&a), DNS_QUERY_NO_SEARCH,
@@ -1444,19 +1769,87 @@ launch_resolve(edge_connection_t *exitconn)
   return r;
 }
 
-/** How many requests for bogus addresses have we launched so far? */
+/** For eventdns: Called when we get an answer for an AAAA request we
+ * launched with launch_ipv6_resolve().  'arg' holds the address we tried to
+ * resolve. */
+static void
+evdns_ipv6_callback(int result, char type, int count, int ttl,
+                    void *addresses, void *arg)
+{
+  char *string_address = arg;
+  const struct in6_addr *addr6 = NULL;
+
+  if (result == DNS_ERR_NONE && type == DNS_IPv6_AAAA && count) {
+    addr6 = addresses;
+    if (tor_mem_is_zero((const char*)addr6, sizeof(*addr6)))
+      addr6 = NULL; /* "::" is no use to anybody. */
+  }
+  if (addr6) {
+    char answer_buf[TOR_ADDR_BUF_LEN];
+    tor_inet_ntop(AF_INET6, addr6, answer_buf, sizeof(answer_buf));
+    log_debug(LD_EXIT, "eventdns said that %s has IPv6 address %s",
+              escaped_safe_str(string_address), escaped_safe_str(answer_buf));
+  }
+  if (result != DNS_ERR_SHUTDOWN)
+    dns_found_ipv6_answer(string_address, addr6, ttl);
+  tor_free(string_address);
+}
+
+/** If ServerDNSResolveIPv6 is set, start an AAAA lookup for the forward
+ * resolve <b>resolve</b>, alongside the A lookup that launch_resolve() has
+ * just started for it.  The IPv4 answer doesn't wait for this one. */
+static void
+launch_ipv6_resolve(cached_resolve_t *resolve)
+{
+  char *addr;
+  int options = get_options()->ServerDNSSearchDomains ? 0
+    : DNS_QUERY_NO_SEARCH;
+
+  if (!get_options()->ServerDNSResolveIPv6 || resolve->is_reverse ||
+      resolve->ipv6_pending)
+    return;
+
+  addr = tor_strdup(resolve->address);
+  log_info(LD_EXIT, "Launching eventdns AAAA request for %s",
+           escaped_safe_str(addr));
+  if (evdns_base_resolve_ipv6(the_evdns_base, addr, options,
+                              evdns_ipv6_callback, addr)) {
+    resolve->ipv6_pending = 1;
+  } else {
+    log_info(LD_EXIT, "eventdns rejected AAAA request for %s.",
+             escaped_safe_str(addr));
+    tor_free(addr);
+  }
+}
+
+/** How many answers for bogus addresses have we received in the current
+ * round of wildcard checks? */
 static int n_wildcard_requests = 0;
 
 /** Map from dotted-quad IP address in response to an int holding how many
- * times we've seen it for a randomly generated (hopefully bogus) address.  It
- * would be easier to use definitely-invalid addresses (as specified by
- * RFC2606), but see comment in dns_launch_wildcard_checks(). */
+ * times we've seen it for a randomly generated (hopefully bogus) address in
+ * the current round of checks.  It would be easier to use definitely-invalid
+ * addresses (as specified by RFC2606), but see comment in
+ * dns_launch_wildcard_checks(). */
 static strmap_t *dns_wildcard_response_count = NULL;
 
-/** If present, a list of dotted-quad IP addresses that we are pretty sure our
+/** A small open-addressing hash set of IPv4 addresses in host order.  We
+ * consult one of these on every answer we get, so it must be cheap. */
+typedef struct dns_addr_set_t {
+  uint32_t *addrs; /**< Hash table slots, n_slots long. */
+  bitarray_t *used; /**< Which slots in <b>addrs</b> are occupied? */
+  int n_slots; /**< Number of slots; always a power of two. */
+  int n; /**< Number of addresses in the set. */
+} dns_addr_set_t;
+
+/** If present, the set of IP addresses that we are pretty sure our
  * nameserver wants to return in response to requests for nonexistent domains.
  */
-static smartlist_t *dns_wildcard_list = NULL;
+static dns_addr_set_t *dns_wildcard_set = NULL;
+/** The wildcarded addresses we've confirmed in the current round of checks;
+ * replaces <b>dns_wildcard_set</b> once the round is over, so that addresses
+ * our nameserver stops returning are forgotten. */
+static dns_addr_set_t *dns_wildcard_round_set = NULL;
 /** True iff we've logged about a single address getting wildcarded.
  * Subsequent warnings will be less severe.  */
 static int dns_wildcard_one_notice_given = 0;
@@ -1472,10 +1865,94 @@ static int dns_wildcarded_test_address_notice_given = 0;
 /** True iff all addresses seem to be getting wildcarded. */
 static int dns_is_completely_invalid = 0;
 
-/** Called when we see <b>id</b> (a dotted quad) in response to a request for
- * a hopefully bogus address. */
+/** Return the slot in <b>set</b> that holds <b>addr</b>, or the empty slot
+ * where it would go. */
+static INLINE int
+dns_addr_set_slot(const dns_addr_set_t *set, uint32_t addr)
+{
+  unsigned mask = set->n_slots - 1;
+  unsigned idx = (addr * 2654435761u) & mask;
+  while (bitarray_is_set(set->used, idx) && set->addrs[idx] != addr)
+    idx = (idx + 1) & mask;
+  return (int)idx;
+}
+
+/** Return a newly allocated, empty address set. */
+static dns_addr_set_t *
+dns_addr_set_new(void)
+{
+  dns_addr_set_t *set = tor_malloc_zero(sizeof(dns_addr_set_t));
+  set->n_slots = 16;
+  set->addrs = tor_malloc_zero(sizeof(uint32_t)*set->n_slots);
+  set->used = bitarray_init_zero(set->n_slots);
+  return set;
+}
+
+/** Release all storage held by <b>set</b>. */
+static void
+dns_addr_set_free(dns_addr_set_t *set)
+{
+  if (!set)
+    return;
+  tor_free(set->addrs);
+  bitarray_free(set->used);
+  tor_free(set);
+}
+
+/** Return true iff <b>addr</b> is in <b>set</b>. */
+static INLINE int
+dns_addr_set_contains(const dns_addr_set_t *set, uint32_t addr)
+{
+  return bitarray_is_set(set->used, dns_addr_set_slot(set, addr));
+}
+
+/** Add <b>addr</b> to <b>set</b>, growing it as needed.  Return true iff
+ * the address was not already present. */
+static int
+dns_addr_set_add(dns_addr_set_t *set, uint32_t addr)
+{
+  int idx = dns_addr_set_slot(set, addr);
+  if (bitarray_is_set(set->used, idx))
+    return 0;
+  if ((set->n + 1) * 2 > set->n_slots) {
+    /* Keep the table at most half full, so probe chains stay short. */
+    uint32_t *old_addrs = set->addrs;
+    bitarray_t *old_used = set->used;
+    int i, old_n_slots = set->n_slots;
+    set->n_slots *= 2;
+    set->addrs = tor_malloc_zero(sizeof(uint32_t)*set->n_slots);
+    set->used = bitarray_init_zero(set->n_slots);
+    for (i = 0; i < old_n_slots; ++i) {
+      if (bitarray_is_set(old_used, i)) {
+        int j = dns_addr_set_slot(set, old_addrs[i]);
+        set->addrs[j] = old_addrs[i];
+        bitarray_set(set->used, j);
+      }
+    }
+    tor_free(old_addrs);
+    bitarray_free(old_used);
+    idx = dns_addr_set_slot(set, addr);
+  }
+  set->addrs[idx] = addr;
+  bitarray_set(set->used, idx);
+  ++set->n;
+  return 1;
+}
+
+/** Forget every wildcarded address we know about. */
 static void
-wildcard_increment_answer(const char *id)
+wildcard_sets_free(void)
+{
+  dns_addr_set_free(dns_wildcard_set);
+  dns_wildcard_set = NULL;
+  dns_addr_set_free(dns_wildcard_round_set);
+  dns_wildcard_round_set = NULL;
+}
+
+/** Called when we see <b>addr</b> (whose dotted-quad form is <b>id</b>) in
+ * response to a request for a hopefully bogus address. */
+static void
+wildcard_increment_answer(const char *id, uint32_t addr)
 {
   int *ip;
   if (!dns_wildcard_response_count)
@@ -1489,14 +1966,17 @@ wildcard_increment_answer(const char *id)
   ++*ip;
 
   if (*ip > 5 && n_wildcard_requests > 10) {
-    if (!dns_wildcard_list) dns_wildcard_list = smartlist_create();
-    if (!smartlist_string_isin(dns_wildcard_list, id)) {
+    if (!dns_wildcard_round_set)
+      dns_wildcard_round_set = dns_addr_set_new();
+    dns_addr_set_add(dns_wildcard_round_set, addr);
+    if (!dns_wildcard_set)
+      dns_wildcard_set = dns_addr_set_new();
+    if (dns_addr_set_add(dns_wildcard_set, addr)) {
     log(dns_wildcard_notice_given ? LOG_INFO : LOG_NOTICE, LD_EXIT,
         "Your DNS provider has given \"%s\" as an answer for %d different "
         "invalid addresses. Apparently they are hijacking DNS failures. "
         "I'll try to correct for this by treating future occurrences of "
         "\"%s\" as 'not found'.", id, *ip, id);
-      smartlist_add(dns_wildcard_list, tor_strdup(id));
     }
     if (!dns_wildcard_notice_given)
       control_event_server_status(LOG_NOTICE, "DNS_HIJACKED");
@@ -1554,7 +2034,7 @@ evdns_wildcard_check_callback(int result, char type, int count, int ttl,
       struct in_addr in;
       in.s_addr = addrs[i];
       tor_inet_ntoa(&in, answer_buf, sizeof(answer_buf));
-      wildcard_increment_answer(answer_buf);
+      wildcard_increment_answer(answer_buf, ntohl(addrs[i]));
     }
     log(dns_wildcard_one_notice_given ? LOG_INFO : LOG_NOTICE, LD_EXIT,
         "Your DNS provider gave an answer for \"%s\", which "
@@ -1594,6 +2074,28 @@ launch_wildcard_check(int min_len, int max_len, const char *suffix)
   }
 }
 
+/** Called once the answers from a round of wildcard checks should be in:
+ * replace our set of wildcarded addresses with the ones this round
+ * confirmed. If too few of our bogus requests got answered to tell, keep the
+ * old set. */
+static void
+dns_wildcard_round_finished(void)
+{
+  int n_before = dns_wildcard_set ? dns_wildcard_set->n : 0;
+  if (n_wildcard_requests <= 10)
+    return;
+  dns_addr_set_free(dns_wildcard_set);
+  dns_wildcard_set = dns_wildcard_round_set;
+  dns_wildcard_round_set = NULL;
+  if (dns_wildcard_set && dns_wildcard_set->n < n_before)
+    log_info(LD_EXIT, "%d address(es) that our DNS provider used to give "
+             "for nonexistent domains no longer seem to be hijacked.",
+             n_before - dns_wildcard_set->n);
+  else if (!dns_wildcard_set && n_before)
+    log_info(LD_EXIT, "Our DNS provider no longer seems to be hijacking "
+             "DNS failures.");
+}
+
 /** Launch attempts to resolve a bunch of known-good addresses (configured in
  * ServerDNSTestAddresses).  [Callback for a libevent timer] */
 static void
@@ -1605,6 +2107,8 @@ launch_test_addresses(int fd, short event, void *args)
   (void)event;
   (void)args;
 
+  dns_wildcard_round_finished();
+
   if (options->DisableNetwork)
     return;
 
@@ -1642,6 +2146,13 @@ dns_launch_wildcard_checks(void)
   int i;
   log_info(LD_EXIT, "Launching checks to see whether our nameservers like "
            "to hijack DNS failures.");
+  /* Start a fresh round.  The addresses we already know about stay in effect
+   * until this round is over. */
+  strmap_free(dns_wildcard_response_count, _tor_free);
+  dns_wildcard_response_count = NULL;
+  n_wildcard_requests = 0;
+  dns_addr_set_free(dns_wildcard_round_set);
+  dns_wildcard_round_set = NULL;
   for (i = 0; i < N_WILDCARD_CHECKS; ++i) {
     /* RFC2606 reserves these.  Sadly, some DNS hijackers, in a silly attempt
      * to 'comply' with rfc2606, refrain from giving A records for these.
@@ -1702,10 +2213,7 @@ dns_reset_correctness_checks(void)
 
   n_wildcard_requests = 0;
 
-  if (dns_wildcard_list) {
-    SMARTLIST_FOREACH(dns_wildcard_list, char *, cp, tor_free(cp));
-    smartlist_clear(dns_wildcard_list);
-  }
+  wildcard_sets_free();
   if (dns_wildcarded_test_address_list) {
     SMARTLIST_FOREACH(dns_wildcarded_test_address_list, char *, cp,
                       tor_free(cp));
@@ -1715,12 +2223,13 @@ dns_reset_correctness_checks(void)
     dns_wildcarded_test_address_notice_given = dns_is_completely_invalid = 0;
 }
 
-/** Return true iff we have noticed that the dotted-quad <b>ip</b> has been
- * returned in response to requests for nonexistent hostnames. */
+/** Return true iff we have noticed that <b>addr</b> (an IPv4 address in host
+ * order) has been returned in response to requests for nonexistent
+ * hostnames. */
 static int
-answer_is_wildcarded(const char *ip)
+answer_is_wildcarded(uint32_t addr)
 {
-  return dns_wildcard_list && smartlist_string_isin(dns_wildcard_list, ip);
+  return dns_wildcard_set && dns_addr_set_contains(dns_wildcard_set, addr);
 }
 
 /** Exit with an assertion if <b>resolve</b> is corrupt. */
@@ -1751,14 +2260,25 @@ dns_cache_entry_count(void)
    return HT_SIZE(&cache_root);
 }
 
+/** Set *<b>n_entries_out</b> to the number of entries in our DNS cache, and
+ * *<b>bytes_out</b> to an estimate of how much memory they take.  This
+ * undercounts hostnames in cached reverse resolves. */
+void
+dns_get_cache_usage(int *n_entries_out, size_t *bytes_out)
+{
+  /* This should never be larger than INT_MAX. */
+  *n_entries_out = dns_cache_entry_count();
+  *bytes_out = sizeof(struct cached_resolve_t) * *n_entries_out +
+    HT_MEM_USAGE(&cache_root);
+}
+
 /** Log memory information about our internal DNS cache at level 'severity'. */
 void
 dump_dns_mem_usage(int severity)
 {
-  /* This should never be larger than INT_MAX. */
-  int hash_count = dns_cache_entry_count();
-  size_t hash_mem = sizeof(struct cached_resolve_t) * hash_count;
-  hash_mem += HT_MEM_USAGE(&cache_root);
+  int hash_count;
+  size_t hash_mem;
+  dns_get_cache_usage(&hash_count, &hash_mem);
 
   /* Print out the count and estimated size of our &cache_root.  It undercounts
      hostnames in cached reverse resolves.
@@ -1766,6 +2286,67 @@ dump_dns_mem_usage(int severity)
   log(severity, LD_MM, "Our DNS cache has %d entries.", hash_count);
   log(severity, LD_MM, "Our DNS cache size is approximately %u bytes.",
       (unsigned)hash_mem);
+  log(severity, LD_MM, "Our DNS cache has answered "U64_FORMAT" streams ("
+      U64_FORMAT" with errors), joined "U64_FORMAT" to pending lookups, "
+      "and missed "U64_FORMAT" times. We launched "U64_FORMAT" prefetches; "
+      U64_FORMAT" replaced their answers. "U64_FORMAT" AAAA lookups found "
+      "an IPv6 address.",
+      U64_PRINTF_ARG(n_dns_cache_hits),
+      U64_PRINTF_ARG(n_dns_cache_negative_hits),
+      U64_PRINTF_ARG(n_dns_cache_pending_hits),
+      U64_PRINTF_ARG(n_dns_cache_misses),
+      U64_PRINTF_ARG(n_dns_prefetches_launched),
+      U64_PRINTF_ARG(n_dns_prefetches_answered),
+      U64_PRINTF_ARG(n_dns_ipv6_answers));
+  log(severity, LD_MM, "%d streams are waiting on pending lookups; at most "
+      "%d have shared one lookup. "U64_FORMAT" streams stopped waiting "
+      "before their answer came back.",
+      n_dns_streams_pending, dns_max_streams_per_lookup,
+      U64_PRINTF_ARG(n_dns_pending_cancelled));
+}
+
+/** Implementation helper for GETINFO: answers queries about our DNS
+ * cache. */
+int
+getinfo_helper_dns(control_connection_t *conn,
+                   const char *question, char **answer,
+                   const char **errmsg)
+{
+  (void) conn;
+  (void) errmsg;
+  if (!strcmp(question, "dns/cache-stats")) {
+    tor_asprintf(answer, "entries=%d hits="U64_FORMAT" negative-hits="
+                 U64_FORMAT" pending-hits="U64_FORMAT" misses="U64_FORMAT
+                 " prefetches="U64_FORMAT" prefetches-answered="U64_FORMAT
+                 " ipv6-answers="U64_FORMAT" waiting=%d max-waiting=%d"
+                 " cancelled="U64_FORMAT,
+                 dns_cache_entry_count(),
+                 U64_PRINTF_ARG(n_dns_cache_hits),
+                 U64_PRINTF_ARG(n_dns_cache_negative_hits),
+                 U64_PRINTF_ARG(n_dns_cache_pending_hits),
+                 U64_PRINTF_ARG(n_dns_cache_misses),
+                 U64_PRINTF_ARG(n_dns_prefetches_launched),
+                 U64_PRINTF_ARG(n_dns_prefetches_answered),
+                 U64_PRINTF_ARG(n_dns_ipv6_answers),
+                 n_dns_streams_pending, dns_max_streams_per_lookup,
+                 U64_PRINTF_ARG(n_dns_pending_cancelled));
+  } else if (!strcmp(question, "dns/resolve-latency")) {
+    uint32_t p50, p90, p99;
+    int n = dns_get_latency_percentiles(&p50, &p90, &p99);
+    tor_asprintf(answer, "samples=%d p50=%lu p90=%lu p99=%lu failed="
+                 U64_FORMAT" transient="U64_FORMAT" timed-out="U64_FORMAT,
+                 n, (unsigned long)p50, (unsigned long)p90,
+                 (unsigned long)p99,
+                 U64_PRINTF_ARG(n_dns_lookups_failed),
+                 U64_PRINTF_ARG(n_dns_lookups_transient),
+                 U64_PRINTF_ARG(n_dns_lookups_timed_out));
+  } else if (!strcmp(question, "dns/nameserver-stats")) {
+    smartlist_t *lines = dns_get_nameserver_stats();
+    *answer = smartlist_join_strings(lines, "\n", 0, NULL);
+    SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+    smartlist_free(lines);
+  }
+  return 0;
 }
 
 #ifdef DEBUG_DNS_CACHE
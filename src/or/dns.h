@@ -26,6 +26,16 @@ void dns_launch_correctness_checks(void);
 int dns_seems_to_be_broken(void);
 void dns_reset_correctness_checks(void);
 void dump_dns_mem_usage(int severity);
+void dns_get_cache_usage(int *n_entries_out, size_t *bytes_out);
+int dns_get_latency_percentiles(uint32_t *p50_out, uint32_t *p90_out,
+                                uint32_t *p99_out);
+void dns_get_lookup_failure_counts(uint64_t *failed_out,
+                                   uint64_t *transient_out,
+                                   uint64_t *timed_out_out);
+smartlist_t *dns_get_nameserver_stats(void);
+int getinfo_helper_dns(control_connection_t *conn,
+                       const char *question, char **answer,
+                       const char **errmsg);
 
 #endif
 
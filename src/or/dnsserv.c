@@ -25,6 +25,99 @@
 #include "eventdns.h"
 #endif
 
+/** A DNSPort lookup that is in flight, along with the identical DNSPort
+ * requests that arrived while we waited for its answer. */
+typedef struct dnsserv_pending_t {
+  /** Our key in dnsserv_pending_map; see dnsserv_pending_key(). */
+  char *key;
+  /** The connection that is doing the lookup. */
+  entry_connection_t *conn;
+  /** The evdns_server_request for each identical request that is waiting
+   * for <b>conn</b>'s answer. */
+  smartlist_t *waiters;
+} dnsserv_pending_t;
+
+/** Map from dnsserv_pending_key() to dnsserv_pending_t for every DNSPort
+ * lookup that is in flight. */
+static strmap_t *dnsserv_pending_map = NULL;
+
+/** Return a newly allocated string that is the same for two DNSPort
+ * requests exactly when one of them may share the other's answer: they ask
+ * the same question, and they'd be allowed on the same circuit. */
+static char *
+dnsserv_pending_key(int command, const listener_connection_t *listener,
+                    unsigned nym_epoch, const tor_addr_t *client_addr,
+                    const char *name)
+{
+  char *key;
+  char addrbuf[TOR_ADDR_BUF_LEN] = "";
+  if (listener->isolation_flags & ISO_CLIENTADDR)
+    tor_addr_to_str(addrbuf, client_addr, sizeof(addrbuf), 0);
+  tor_asprintf(&key, "%d %d %d %u %s %s", command, listener->session_group,
+               (int)listener->isolation_flags, nym_epoch, addrbuf, name);
+  tor_strlower(key);
+  return key;
+}
+
+/** Stop tracking the in-flight lookup on <b>conn</b>; forget any requests
+ * that were waiting on it. */
+static void
+dnsserv_pending_remove(entry_connection_t *conn)
+{
+  dnsserv_pending_t *pending = conn->dns_pending;
+  if (!pending)
+    return;
+  if (dnsserv_pending_map &&
+      strmap_get(dnsserv_pending_map, pending->key) == pending)
+    strmap_remove(dnsserv_pending_map, pending->key);
+  smartlist_free(pending->waiters);
+  tor_free(pending->key);
+  tor_free(pending);
+  conn->dns_pending = NULL;
+}
+
+/** Return true iff we may answer DNSPort requests without giving each one
+ * a connection of its own: that is, unless a controller wants to see or
+ * attach every stream. */
+static int
+dnsserv_may_skip_connection(void)
+{
+  return !get_options()->LeaveStreamsUnattached &&
+    !control_event_is_interesting(EVENT_STREAM_STATUS);
+}
+
+/** If the addressmap holds a live IPv4 answer for the A question <b>q</b>
+ * in <b>req</b>, answer <b>req</b> with it and return 1.  Otherwise return
+ * 0.  (connection_ap_handshake_rewrite_and_attach() would find the same
+ * answer, but only after we'd built a connection for it.) */
+static int
+dnsserv_answer_from_addressmap(struct evdns_server_request *req,
+                               const struct evdns_server_question *q)
+{
+  char address[MAX_SOCKS_ADDR_LEN];
+  time_t expires = TIME_MAX, now = time(NULL);
+  struct in_addr in;
+  int ttl;
+
+  strlcpy(address, q->name, sizeof(address));
+  tor_strlower(address);
+  if (!strcasecmpend(address, ".exit") || tor_inet_aton(address, &in))
+    return 0;
+  if (!addressmap_rewrite(address, sizeof(address), &expires) ||
+      !tor_inet_aton(address, &in) || expires <= now)
+    return 0;
+
+  if (expires == TIME_MAX || expires - now < 60)
+    ttl = 60;
+  else
+    ttl = (int) MIN(expires - now, INT_MAX);
+  log_info(LD_APP, "Answering DNS request for %s from the addressmap.",
+           escaped_safe_str_client(q->name));
+  evdns_server_request_add_a_reply(req, q->name, 1, &in.s_addr, ttl);
+  evdns_server_request_respond(req, DNS_ERR_NONE);
+  return 1;
+}
+
 /** Helper function: called by evdns whenever the client sends a request to our
  * DNSPort.  We need to eventually answer the request <b>req</b>.
  */
@@ -43,6 +136,8 @@ evdns_server_callback(struct evdns_server_request *req, void *data_)
   uint16_t port;
   int err = DNS_ERR_NONE;
   char *q_name;
+  char *key = NULL;
+  dnsserv_pending_t *pending;
 
   tor_assert(req);
 
@@ -115,6 +210,26 @@ evdns_server_callback(struct evdns_server_request *req, void *data_)
     return;
   }
 
+  if (dnsserv_may_skip_connection()) {
+    /* Maybe we know the answer already... */
+    if (q->type == EVDNS_TYPE_A && dnsserv_answer_from_addressmap(req, q))
+      return;
+    /* ...or somebody else is already asking. */
+    key = dnsserv_pending_key(q->type == EVDNS_TYPE_A ?
+                              SOCKS_COMMAND_RESOLVE :
+                              SOCKS_COMMAND_RESOLVE_PTR,
+                              listener, get_signewnym_epoch(),
+                              &tor_addr, q->name);
+    if (dnsserv_pending_map &&
+        (pending = strmap_get(dnsserv_pending_map, key))) {
+      log_info(LD_APP, "Already resolving %s; waiting for that answer.",
+               escaped_safe_str_client(q->name));
+      smartlist_add(pending->waiters, req);
+      tor_free(key);
+      return;
+    }
+  }
+
   /* Make a new dummy AP connection, and attach the request to it. */
   entry_conn = entry_connection_new(CONN_TYPE_AP, AF_INET);
   conn = ENTRY_TO_EDGE_CONN(entry_conn);
@@ -143,9 +258,22 @@ evdns_server_callback(struct evdns_server_request *req, void *data_)
     log_warn(LD_APP, "Couldn't register dummy connection for DNS request");
     evdns_server_request_respond(req, DNS_ERR_SERVERFAILED);
     connection_free(ENTRY_TO_CONN(entry_conn));
+    tor_free(key);
     return;
   }
 
+  if (key) {
+    /* Let identical requests wait for this one's answer. */
+    pending = tor_malloc_zero(sizeof(dnsserv_pending_t));
+    pending->key = key;
+    pending->conn = entry_conn;
+    pending->waiters = smartlist_create();
+    if (!dnsserv_pending_map)
+      dnsserv_pending_map = strmap_new();
+    strmap_set(dnsserv_pending_map, key, pending);
+    entry_conn->dns_pending = pending;
+  }
+
   control_event_stream_status(entry_conn, STREAM_EVENT_NEW, 0);
 
   /* Now, unless a controller asked us to leave streams unattached,
@@ -219,7 +347,8 @@ dnsserv_launch_request(const char *name, int reverse)
 }
 
 /** If there is a pending request on <b>conn</b> that's waiting for an answer,
- * send back an error and free the request. */
+ * send back an error and free the request.  Do the same for any identical
+ * requests that were waiting on it. */
 void
 dnsserv_reject_request(entry_connection_t *conn)
 {
@@ -228,6 +357,13 @@ dnsserv_reject_request(entry_connection_t *conn)
                                  DNS_ERR_SERVERFAILED);
     conn->dns_server_request = NULL;
   }
+  if (conn->dns_pending) {
+    SMARTLIST_FOREACH(conn->dns_pending->waiters,
+                      struct evdns_server_request *, req,
+                      evdns_server_request_respond(req,
+                                                   DNS_ERR_SERVERFAILED));
+    dnsserv_pending_remove(conn);
+  }
 }
 
 /** Look up the original name that corresponds to 'addr' in req.  We use this
@@ -262,24 +398,18 @@ evdns_get_orig_address(const struct evdns_server_request *req,
   return addr;
 }
 
-/** Tell the dns request waiting for an answer on <b>conn</b> that we have an
- * answer of type <b>answer_type</b> (RESOLVE_TYPE_IPV4/IPV6/ERR), of length
- * <b>answer_len</b>, in <b>answer</b>, with TTL <b>ttl</b>.  Doesn't do
- * any caching; that's handled elsewhere. */
-void
-dnsserv_resolved(entry_connection_t *conn,
-                 int answer_type,
-                 size_t answer_len,
-                 const char *answer,
-                 int ttl)
+/** Answer the DNSPort request <b>req</b>, which asked a question of
+ * type <b>command</b> (a SOCKS_COMMAND_RESOLVE*) about <b>address</b>: we
+ * have an answer of type <b>answer_type</b> (RESOLVE_TYPE_IPV4/IPV6/ERR), of
+ * length <b>answer_len</b>, in <b>answer</b>, with TTL <b>ttl</b>. */
+static void
+dnsserv_answer_request(struct evdns_server_request *req, int command,
+                       const char *address, int answer_type,
+                       size_t answer_len, const char *answer, int ttl)
 {
-  struct evdns_server_request *req = conn->dns_server_request;
   const char *name;
   int err = DNS_ERR_NONE;
-  if (!req)
-    return;
-  name = evdns_get_orig_address(req, answer_type,
-                                conn->socks_request->address);
+  name = evdns_get_orig_address(req, answer_type, address);
 
   /* XXXX Re-do; this is dumb. */
   if (ttl < 60)
@@ -292,13 +422,13 @@ dnsserv_resolved(entry_connection_t *conn,
     log_info(LD_APP, "Got an IPv6 answer; that's not implemented.");
     err = DNS_ERR_NOTIMPL;
   } else if (answer_type == RESOLVED_TYPE_IPV4 && answer_len == 4 &&
-             conn->socks_request->command == SOCKS_COMMAND_RESOLVE) {
+             command == SOCKS_COMMAND_RESOLVE) {
     evdns_server_request_add_a_reply(req,
                                      name,
                                      1, answer, ttl);
   } else if (answer_type == RESOLVED_TYPE_HOSTNAME &&
              answer_len < 256 &&
-             conn->socks_request->command == SOCKS_COMMAND_RESOLVE_PTR) {
+             command == SOCKS_COMMAND_RESOLVE_PTR) {
     char *ans = tor_strndup(answer, answer_len);
     evdns_server_request_add_ptr_reply(req, NULL,
                                        name,
@@ -311,8 +441,37 @@ dnsserv_resolved(entry_connection_t *conn,
   }
 
   evdns_server_request_respond(req, err);
+}
 
+/** Tell the dns request waiting for an answer on <b>conn</b>, and any
+ * identical requests waiting on it, that we have an answer of type
+ * <b>answer_type</b> (RESOLVE_TYPE_IPV4/IPV6/ERR), of length
+ * <b>answer_len</b>, in <b>answer</b>, with TTL <b>ttl</b>.  Doesn't do
+ * any caching; that's handled elsewhere. */
+void
+dnsserv_resolved(entry_connection_t *conn,
+                 int answer_type,
+                 size_t answer_len,
+                 const char *answer,
+                 int ttl)
+{
+  struct evdns_server_request *req = conn->dns_server_request;
+  const socks_request_t *socks = conn->socks_request;
+  if (!req)
+    return;
+
+  dnsserv_answer_request(req, socks->command, socks->address,
+                         answer_type, answer_len, answer, ttl);
   conn->dns_server_request = NULL;
+
+  if (conn->dns_pending) {
+    SMARTLIST_FOREACH(conn->dns_pending->waiters,
+                      struct evdns_server_request *, waiter,
+                      dnsserv_answer_request(waiter, socks->command,
+                                             socks->address, answer_type,
+                                             answer_len, answer, ttl));
+    dnsserv_pending_remove(conn);
+  }
 }
 
 /** Set up the evdns server port for the UDP socket on <b>conn</b>, which
@@ -348,3 +507,24 @@ dnsserv_close_listener(connection_t *conn)
   }
 }
 
+
+/** Helper: free a dnsserv_pending_t, dropping the requests waiting on it. */
+static void
+dnsserv_pending_free_(void *arg)
+{
+  dnsserv_pending_t *pending = arg;
+  SMARTLIST_FOREACH(pending->waiters, struct evdns_server_request *, req,
+                    evdns_server_request_drop(req));
+  pending->conn->dns_pending = NULL;
+  smartlist_free(pending->waiters);
+  tor_free(pending->key);
+  tor_free(pending);
+}
+
+/** Release all storage held by the DNSPort code. */
+void
+dnsserv_free_all(void)
+{
+  strmap_free(dnsserv_pending_map, dnsserv_pending_free_);
+  dnsserv_pending_map = NULL;
+}
@@ -21,6 +21,7 @@ void dnsserv_resolved(entry_connection_t *conn,
                       int ttl);
 void dnsserv_reject_request(entry_connection_t *conn);
 int dnsserv_launch_request(const char *name, int is_reverse);
+void dnsserv_free_all(void);
 
 #endif
 
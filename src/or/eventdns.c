@@ -36,6 +36,9 @@
  * Version: 0.1b
  */
 
+/* This must come before any system header, so that we get recvmmsg(). */
+#define _GNU_SOURCE
+
 #include "eventdns_tor.h"
 #include "../common/util.h"
 #include <sys/types.h>
@@ -51,7 +54,6 @@
 #endif
 
 /* #define _POSIX_C_SOURCE 200507 */
-#define _GNU_SOURCE
 
 #ifdef DNS_USE_CPU_CLOCK_FOR_ID
 #ifdef DNS_USE_OPENSSL_FOR_ID
@@ -170,6 +172,10 @@ struct evdns_request {
 	void *user_pointer;	 /* the pointer given to us for this request */
 	evdns_callback_type user_callback;
 	struct nameserver *ns;	/* the server which we last sent it */
+	/* the socket of ns that we send it on; replies on any other */
+	/* socket are ignored */
+	struct nameserver_socket *sock;
+	struct timeval sent_at;  /* when we last transmitted it */
 
 	/* elements used by the searching code */
 	int search_index;
@@ -211,20 +217,34 @@ struct reply {
 	} data;
 };
 
+/* How many UDP sockets we open to each nameserver.  Each one gets its own */
+/* source port from the kernel, so a blind attacker trying to spoof a reply */
+/* has to guess the port as well as the transaction id, and a busy resolver */
+/* doesn't funnel every request through a single socket buffer. */
+#define NAMESERVER_SOCKETS 8
+
+/* one of the connected UDP sockets we use to talk to a nameserver */
+struct nameserver_socket {
+	int fd;
+	struct event event;
+	struct nameserver *ns;	/* the server this socket is connected to */
+	char choked;  /* true if we have an EAGAIN from this socket */
+	char write_waiting;	 /* true if we are waiting for EV_WRITE events */
+};
+
 struct nameserver {
-	int socket;	 /* a connected UDP socket */
+	struct nameserver_socket sockets[NAMESERVER_SOCKETS];
+	int n_sockets;	/* number of entries of sockets that are open */
 	struct sockaddr_storage address;
 	int failed_times;  /* number of times which we have given this server a chance */
 	int timedout;  /* number of times in a row a request has timed out */
-	struct event event;
 	/* these objects are kept in a circular list */
 	struct nameserver *next, *prev;
 	struct event timeout_event; /* used to keep the timeout for */
 								/* when we next probe this server. */
 								/* Valid if state == 0 */
 	char state;	 /* zero if we think that this server is down */
-	char choked;  /* true if we have an EAGAIN from this server's socket */
-	char write_waiting;	 /* true if we are waiting for EV_WRITE events */
+	struct evdns_nameserver_stats stats;
 };
 
 static struct evdns_request *req_head = NULL, *req_waiting_head = NULL;
@@ -306,7 +326,7 @@ static int global_requests_inflight = 0;
 /* and are counted here */
 static int global_requests_waiting = 0;
 
-static int global_max_requests_inflight = 64;
+static int global_max_requests_inflight = 512;
 
 static struct timeval global_timeout = {5, 0};	/* 5 seconds */
 static int global_max_reissues = 1;	/* a reissue occurs when we get some errors from the server */
@@ -325,6 +345,8 @@ static const int global_nameserver_timeouts_length = (int)(sizeof(global_nameser
 static struct nameserver *nameserver_pick(void);
 static void evdns_request_insert(struct evdns_request *req, struct evdns_request **head);
 static void nameserver_ready_callback(int fd, short events, void *arg);
+static void nameserver_sockets_close(struct nameserver *ns);
+static void nameserver_note_reply(struct nameserver *ns, const struct timeval *sent_at);
 static int evdns_transmit(void);
 static int evdns_request_transmit(struct evdns_request *req);
 static void nameserver_send_probe(struct nameserver *const ns);
@@ -548,6 +570,7 @@ nameserver_failed(struct nameserver *const ns, const char *msg) {
 
 	log(EVDNS_LOG_WARN, "Nameserver %s has failed: %s",
 		debug_ntop((struct sockaddr *)&ns->address), msg);
+	ns->stats.failures++;
 	global_good_nameservers--;
 	assert(global_good_nameservers >= 0);
 	if (global_good_nameservers == 0) {
@@ -861,7 +884,7 @@ name_parse(u8 *packet, int length, int *idx, char *name_out, size_t name_out_len
 
 /* parses a raw reply from a nameserver. */
 static int
-reply_parse(u8 *packet, int length) {
+reply_parse(struct nameserver_socket *sock, u8 *packet, int length) {
 	int j = 0;	/* index into packet */
 	int k;
 	u16 _t;	 /* used by the macros */
@@ -888,6 +911,14 @@ reply_parse(u8 *packet, int length) {
 	req = request_find_from_trans_id(trans_id);
 	/* if no request, can't do anything. */
 	if (!req) return -1;
+	/* a reply for this id can only legitimately come back on the port */
+	/* we sent the request from. */
+	if (req->sock != sock) {
+		log(EVDNS_LOG_DEBUG, "Reply for request %lx arrived on the wrong "
+			"socket; ignoring it.", (unsigned long) req);
+		return -1;
+	}
+	nameserver_note_reply(req->ns, &req->sent_at);
 
 	memset(&reply, 0, sizeof(reply));
 
@@ -1243,9 +1274,87 @@ nameserver_pick(void) {
 	}
 }
 
+/* Number of packets we try to pull off a nameserver socket per recvmmsg() */
+/* call. */
+#define NAMESERVER_READ_BATCH 16
+
+/* choose which of a nameserver's sockets to send a new request on.  We */
+/* pick at random, preferring sockets that aren't choked. */
+static struct nameserver_socket *
+nameserver_socket_pick(struct nameserver *ns) {
+	int i, start;
+	assert(ns->n_sockets > 0);
+	start = trans_id_function() % ns->n_sockets;
+	for (i = 0; i < ns->n_sockets; ++i) {
+		struct nameserver_socket *sock =
+			&ns->sockets[(start + i) % ns->n_sockets];
+		if (!sock->choked)
+			return sock;
+	}
+	return &ns->sockets[start];
+}
+
+/* Record that ns answered a request we last sent at sent_at. */
+static void
+nameserver_note_reply(struct nameserver *ns, const struct timeval *sent_at) {
+	static const int limits[] = EVDNS_LATENCY_BUCKET_LIMITS_MSEC;
+	struct timeval now;
+	long msec;
+	int i;
+
+	tor_gettimeofday(&now);
+	msec = (now.tv_sec - sent_at->tv_sec) * 1000 +
+		(now.tv_usec - sent_at->tv_usec) / 1000;
+	for (i = 0; i < EVDNS_LATENCY_BUCKETS - 1; ++i) {
+		if (msec <= limits[i])
+			break;
+	}
+	ns->stats.latency[i]++;
+	ns->stats.replies++;
+}
+
 /* this is called when a namesever socket is ready for reading */
 static void
-nameserver_read(struct nameserver *ns) {
+nameserver_read(struct nameserver_socket *sock) {
+	struct nameserver *const ns = sock->ns;
+#ifdef HAVE_RECVMMSG
+	static u8 packets[NAMESERVER_READ_BATCH][1500];
+	struct sockaddr_storage addrs[NAMESERVER_READ_BATCH];
+	struct mmsghdr msgs[NAMESERVER_READ_BATCH];
+	struct iovec iovs[NAMESERVER_READ_BATCH];
+	int i, r;
+
+	for (;;) {
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < NAMESERVER_READ_BATCH; ++i) {
+			iovs[i].iov_base = packets[i];
+			iovs[i].iov_len = sizeof(packets[i]);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+		}
+		r = recvmmsg(sock->fd, msgs, NAMESERVER_READ_BATCH, 0, NULL);
+		if (r < 0) {
+			int err = last_error(sock->fd);
+			if (error_is_eagain(err)) return;
+			nameserver_failed(ns, tor_socket_strerror(err));
+			return;
+		}
+		for (i = 0; i < r; ++i) {
+			struct sockaddr *sa = (struct sockaddr *) &addrs[i];
+			if (!sockaddr_eq(sa, (struct sockaddr*)&ns->address, 1)) {
+				log(EVDNS_LOG_WARN,
+					"Address mismatch on received DNS packet.  Address was %s",
+					debug_ntop(sa));
+				return;
+			}
+			ns->timedout = 0;
+			reply_parse(sock, packets[i], (int)msgs[i].msg_len);
+		}
+		if (r < NAMESERVER_READ_BATCH) return;
+	}
+#else
 	struct sockaddr_storage ss;
 	struct sockaddr *sa = (struct sockaddr *) &ss;
 	socklen_t addrlen = sizeof(ss);
@@ -1253,25 +1362,25 @@ nameserver_read(struct nameserver *ns) {
 
 	for (;;) {
 		const int r =
-            (int)recvfrom(ns->socket, (void*)packet,
+            (int)recvfrom(sock->fd, (void*)packet,
 						  (socklen_t)sizeof(packet), 0,
 						  sa, &addrlen);
 		if (r < 0) {
-			int err = last_error(ns->socket);
+			int err = last_error(sock->fd);
 			if (error_is_eagain(err)) return;
 			nameserver_failed(ns, tor_socket_strerror(err));
 			return;
 		}
-		/* XXX Match port too? */
-		if (!sockaddr_eq(sa, (struct sockaddr*)&ns->address, 0)) {
+		if (!sockaddr_eq(sa, (struct sockaddr*)&ns->address, 1)) {
 			log(EVDNS_LOG_WARN,
 				"Address mismatch on received DNS packet.  Address was %s",
 				debug_ntop(sa));
 			return;
 		}
 		ns->timedout = 0;
-		reply_parse(packet, r);
+		reply_parse(sock, packet, r);
 	}
+#endif
 }
 
 /* Read a packet from a DNS client on a server port s, parse it, and */
@@ -1332,21 +1441,21 @@ server_port_flush(struct evdns_server_port *port)
 	}
 }
 
-/* set if we are waiting for the ability to write to this server. */
+/* set if we are waiting for the ability to write to this socket. */
 /* if waiting is true then we ask libevent for EV_WRITE events, otherwise */
 /* we stop these events. */
 static void
-nameserver_write_waiting(struct nameserver *ns, char waiting) {
-	if (ns->write_waiting == waiting) return;
-
-	ns->write_waiting = waiting;
-	(void) event_del(&ns->event);
-	CLEAR(&ns->event);
-	event_set(&ns->event, ns->socket, EV_READ | (waiting ? EV_WRITE : 0) | EV_PERSIST,
-			  nameserver_ready_callback, ns);
-	if (event_add(&ns->event, NULL) < 0) {
+nameserver_write_waiting(struct nameserver_socket *sock, char waiting) {
+	if (sock->write_waiting == waiting) return;
+
+	sock->write_waiting = waiting;
+	(void) event_del(&sock->event);
+	CLEAR(&sock->event);
+	event_set(&sock->event, sock->fd, EV_READ | (waiting ? EV_WRITE : 0) | EV_PERSIST,
+			  nameserver_ready_callback, sock);
+	if (event_add(&sock->event, NULL) < 0) {
 		log(EVDNS_LOG_WARN, "Error from libevent when adding event for %s",
-			debug_ntop((struct sockaddr *)&ns->address));
+			debug_ntop((struct sockaddr *)&sock->ns->address));
 		/* ???? Do more? */
 	}
 }
@@ -1355,17 +1464,17 @@ nameserver_write_waiting(struct nameserver *ns, char waiting) {
 /* a nameserver socket is ready for writing or reading */
 static void
 nameserver_ready_callback(int fd, short events, void *arg) {
-	struct nameserver *ns = (struct nameserver *) arg;
+	struct nameserver_socket *sock = (struct nameserver_socket *) arg;
 	(void)fd;
 
 	if (events & EV_WRITE) {
-		ns->choked = 0;
+		sock->choked = 0;
 		if (!evdns_transmit()) {
-			nameserver_write_waiting(ns, 0);
+			nameserver_write_waiting(sock, 0);
 		}
 	}
 	if (events & EV_READ) {
-		nameserver_read(ns);
+		nameserver_read(sock);
 	}
 }
 
@@ -1993,6 +2102,7 @@ evdns_request_timeout_callback(int fd, short events, void *arg) {
 
 	log(EVDNS_LOG_DEBUG, "Request %lx timed out", (unsigned long) arg);
 
+	req->ns->stats.timeouts++;
 	req->ns->timedout++;
 	if (req->ns->timedout > global_max_nameserver_timeout) {
 		req->ns->timedout = 0;
@@ -2020,11 +2130,11 @@ evdns_request_timeout_callback(int fd, short events, void *arg) {
 /* 1 temporary failure */
 /* 2 other failure */
 static int
-evdns_request_transmit_to(struct evdns_request *req, struct nameserver *server) {
-	const ssize_t r = send(server->socket, (void*)req->request,
+evdns_request_transmit_to(struct evdns_request *req, struct nameserver_socket *sock) {
+	const ssize_t r = send(sock->fd, (void*)req->request,
                          req->request_len, 0);
 	if (r < 0) {
-		int err = last_error(server->socket);
+		int err = last_error(sock->fd);
 		if (error_is_eagain(err)) return 1;
 		nameserver_failed(req->ns, tor_socket_strerror(err));
 		return 2;
@@ -2050,18 +2160,23 @@ evdns_request_transmit(struct evdns_request *req) {
 	req->transmit_me = 1;
 	if (req->trans_id == 0xffff) abort();
 
-	if (req->ns->choked) {
+	/* a request keeps its socket for as long as it stays with the same */
+	/* server, so that a late reply to an earlier transmission still counts. */
+	if (!req->sock || req->sock->ns != req->ns)
+		req->sock = nameserver_socket_pick(req->ns);
+
+	if (req->sock->choked) {
 		/* don't bother trying to write to a socket */
 		/* which we have had EAGAIN from */
 		return 1;
 	}
 
-	r = evdns_request_transmit_to(req, req->ns);
+	r = evdns_request_transmit_to(req, req->sock);
 	switch (r) {
 	case 1:
 		/* temp failure */
-		req->ns->choked = 1;
-		nameserver_write_waiting(req->ns, 1);
+		req->sock->choked = 1;
+		nameserver_write_waiting(req->sock, 1);
 		return 1;
 	case 2:
 		/* failed to transmit the request entirely. */
@@ -2081,6 +2196,8 @@ evdns_request_transmit(struct evdns_request *req) {
 		}
 		req->tx_count++;
 		req->transmit_me = 0;
+		req->ns->stats.requests_sent++;
+		tor_gettimeofday(&req->sent_at);
 		return retcode;
 	}
 }
@@ -2158,6 +2275,31 @@ evdns_transmit(void) {
 	return did_try_to_transmit;
 }
 
+/* exported function */
+void
+evdns_get_nameserver_stats(evdns_nameserver_stats_fn_type fn, void *arg)
+{
+	struct nameserver *server = server_head;
+	const struct evdns_request *req;
+	struct evdns_nameserver_stats stats;
+	if (!server)
+		return;
+	do {
+		memcpy(&stats, &server->stats, sizeof(stats));
+		stats.inflight = 0;
+		stats.is_up = server->state != 0;
+		if ((req = req_head)) {
+			do {
+				if (req->ns == server)
+					stats.inflight++;
+				req = req->next;
+			} while (req != req_head);
+		}
+		fn((struct sockaddr *)&server->address, &stats, arg);
+		server = server->next;
+	} while (server != server_head);
+}
+
 /* exported function */
 int
 evdns_count_nameservers(void)
@@ -2184,11 +2326,8 @@ evdns_clear_nameservers_and_suspend(void)
 		return 0;
 	while (1) {
 		struct nameserver *next = server->next;
-		(void) event_del(&server->event);
-		CLEAR(&server->event);
+		nameserver_sockets_close(server);
 		del_timeout_event(server);
-		if (server->socket >= 0)
-			CLOSE_SOCKET(server->socket);
 		CLEAR(server);
 		mm_free(server);
 		if (next == started_at)
@@ -2202,6 +2341,7 @@ evdns_clear_nameservers_and_suspend(void)
 		struct evdns_request *next = req->next;
 		req->tx_count = req->reissue_count = 0;
 		req->ns = NULL;
+		req->sock = NULL;
 		/* ???? What to do about searches? */
 		del_timeout_event(req);
 		req->trans_id = 0;
@@ -2266,6 +2406,70 @@ sockaddr_is_loopback(const struct sockaddr *addr)
 	return 0;
 }
 
+/* Open, bind, and connect one UDP socket to the nameserver at address, and */
+/* start listening for replies on it.  Returns 0 on success, 1 if we couldn't */
+/* get a socket, and 2 on other failures. */
+static int
+nameserver_socket_open(struct nameserver *ns, struct nameserver_socket *sock,
+					   const struct sockaddr *address, socklen_t addrlen)
+{
+	memset(sock, 0, sizeof(*sock));
+	sock->ns = ns;
+	sock->fd = tor_open_socket(address->sa_family, SOCK_DGRAM, 0);
+	if (sock->fd < 0) return 1;
+#ifdef WIN32
+	{
+		u_long nonblocking = 1;
+		ioctlsocket(sock->fd, FIONBIO, &nonblocking);
+	}
+#else
+	fcntl(sock->fd, F_SETFL, O_NONBLOCK);
+#endif
+
+	/* Binding to port 0 (or not binding at all) leaves the choice of source */
+	/* port to the kernel, which picks it at random. */
+	if (global_bind_addr_is_set &&
+	    !sockaddr_is_loopback((struct sockaddr*)&global_bind_address)) {
+		if (bind(sock->fd, (struct sockaddr *)&global_bind_address,
+				 global_bind_addrlen) < 0) {
+			log(EVDNS_LOG_DEBUG, "Couldn't bind to outgoing address.");
+			goto err;
+		}
+	}
+
+	if (connect(sock->fd, address, addrlen) != 0) {
+		log(EVDNS_LOG_DEBUG, "Couldn't open socket to nameserver.");
+		goto err;
+	}
+
+	event_set(&sock->event, sock->fd, EV_READ | EV_PERSIST,
+			  nameserver_ready_callback, sock);
+	if (event_add(&sock->event, NULL) < 0) {
+		log(EVDNS_LOG_DEBUG, "Couldn't add event for nameserver.");
+		goto err;
+	}
+	return 0;
+ err:
+	CLOSE_SOCKET(sock->fd);
+	sock->fd = -1;
+	return 2;
+}
+
+/* Stop listening on and close every socket we have open to ns. */
+static void
+nameserver_sockets_close(struct nameserver *ns)
+{
+	int i;
+	for (i = 0; i < ns->n_sockets; ++i) {
+		struct nameserver_socket *sock = &ns->sockets[i];
+		(void) event_del(&sock->event);
+		CLEAR(&sock->event);
+		if (sock->fd >= 0)
+			CLOSE_SOCKET(sock->fd);
+	}
+	ns->n_sockets = 0;
+}
+
 static int
 _evdns_nameserver_add_impl(const struct sockaddr *address,
 						   socklen_t addrlen) {
@@ -2274,7 +2478,7 @@ _evdns_nameserver_add_impl(const struct sockaddr *address,
 	const struct nameserver *server = server_head, *const started_at = server_head;
 	struct nameserver *ns;
 
-	int err = 0;
+	int i, err = 0;
 	if (server) {
 		do {
 			if (sockaddr_eq(address, (struct sockaddr *)&server->address, 1)) {
@@ -2296,41 +2500,22 @@ _evdns_nameserver_add_impl(const struct sockaddr *address,
 
 	evtimer_set(&ns->timeout_event, nameserver_prod_callback, ns);
 
-	ns->socket = tor_open_socket(address->sa_family, SOCK_DGRAM, 0);
-	if (ns->socket < 0) { err = 1; goto out1; }
-#ifdef WIN32
-	{
-		u_long nonblocking = 1;
-		ioctlsocket(ns->socket, FIONBIO, &nonblocking);
-	}
-#else
-	fcntl(ns->socket, F_SETFL, O_NONBLOCK);
-#endif
-
-	if (global_bind_addr_is_set &&
-	    !sockaddr_is_loopback((struct sockaddr*)&global_bind_address)) {
-		if (bind(ns->socket, (struct sockaddr *)&global_bind_address,
-				 global_bind_addrlen) < 0) {
-			log(EVDNS_LOG_DEBUG, "Couldn't bind to outgoing address.");
-			err = 2;
-			goto out2;
-		}
+	memcpy(&ns->address, address, addrlen);
+	for (i = 0; i < NAMESERVER_SOCKETS; ++i) {
+		err = nameserver_socket_open(ns, &ns->sockets[i], address, addrlen);
+		if (err)
+			break;
+		ns->n_sockets++;
 	}
-
-	if (connect(ns->socket, address, addrlen) != 0) {
-		log(EVDNS_LOG_DEBUG, "Couldn't open socket to nameserver.");
-		err = 2;
-		goto out2;
+	if (ns->n_sockets == 0)
+		goto out1;
+	if (err) {
+		/* we got some sockets; that'll do. */
+		log(EVDNS_LOG_DEBUG, "Only opened %d sockets to nameserver %s",
+			ns->n_sockets, debug_ntop(address));
+		err = 0;
 	}
-
-	memcpy(&ns->address, address, addrlen);
 	ns->state = 1;
-	event_set(&ns->event, ns->socket, EV_READ | EV_PERSIST, nameserver_ready_callback, ns);
-	if (event_add(&ns->event, NULL) < 0) {
-		log(EVDNS_LOG_DEBUG, "Couldn't add event for nameserver.");
-		err = 2;
-		goto out2;
-	}
 
 	log(EVDNS_LOG_DEBUG, "Added nameserver %s", debug_ntop(address));
 
@@ -2351,8 +2536,6 @@ _evdns_nameserver_add_impl(const struct sockaddr *address,
 
 	return 0;
 
-out2:
-	CLOSE_SOCKET(ns->socket);
 out1:
 	CLEAR(ns);
 	mm_free(ns);
@@ -3357,9 +3540,7 @@ evdns_shutdown(int fail_requests)
 
 	for (server = server_head; server; server = server_next) {
 		server_next = server->next;
-		if (server->socket >= 0)
-			CLOSE_SOCKET(server->socket);
-		(void) event_del(&server->event);
+		nameserver_sockets_close(server);
 		del_timeout_event(server);
 		CLEAR(server);
 		mm_free(server);
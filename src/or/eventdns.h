@@ -286,6 +286,24 @@ void evdns_set_log_fn(evdns_debug_log_fn_type fn);
 void evdns_set_transaction_id_fn(uint16_t (*fn)(void));
 void evdns_set_random_bytes_fn(void (*fn)(char *, size_t));
 
+/* Upper bounds, in msec, of the reply latency buckets in */
+/* evdns_nameserver_stats; the last bucket holds every slower reply. */
+#define EVDNS_LATENCY_BUCKET_LIMITS_MSEC { 10, 25, 50, 100, 250, 500, 1000, 2500 }
+#define EVDNS_LATENCY_BUCKETS 9
+
+/* What we know about how well a nameserver has been answering. */
+struct evdns_nameserver_stats {
+	uint32_t requests_sent; /* transmissions, counting retransmits */
+	uint32_t replies; /* replies we matched to a request */
+	uint32_t timeouts; /* transmissions that got no reply in time */
+	uint32_t failures; /* times we decided the server was down */
+	int inflight; /* requests waiting on this server right now */
+	int is_up; /* true iff we think the server is up */
+	uint32_t latency[EVDNS_LATENCY_BUCKETS]; /* reply latency histogram */
+};
+typedef void (*evdns_nameserver_stats_fn_type)(const struct sockaddr *address, const struct evdns_nameserver_stats *stats, void *arg);
+void evdns_get_nameserver_stats(evdns_nameserver_stats_fn_type fn, void *arg);
+
 #define DNS_NO_SEARCH 1
 
 /* Structures and functions used to implement a DNS server. */
@@ -17,17 +17,29 @@
 #include "dnsserv.h"
 #include "geoip.h"
 #include "routerlist.h"
+#undef log
+#include <math.h>
 
 static void clear_geoip_db(void);
 static void init_geoip_countries(void);
+static void geoip_index_build(void);
 
-/** An entry from the GeoIP file: maps an IP range to a country. */
+/** An entry from the GeoIP file: maps an IPv4 range to a country.  We only
+ * keep these while loading the file; lookups use the geoip_index_t built
+ * from them. */
 typedef struct geoip_entry_t {
   uint32_t ip_low; /**< The lowest IP in the range, in host order */
   uint32_t ip_high; /**< The highest IP in the range, in host order */
   intptr_t country; /**< An index into geoip_countries */
 } geoip_entry_t;
 
+/** An entry from the GeoIP file that maps an IPv6 range to a country. */
+typedef struct geoip_ipv6_entry_t {
+  uint8_t ip_low[16]; /**< The lowest IP in the range, in network order */
+  uint8_t ip_high[16]; /**< The highest IP in the range, in network order */
+  intptr_t country; /**< An index into geoip_countries */
+} geoip_ipv6_entry_t;
+
 /** A per-country record for GeoIP request history. */
 typedef struct geoip_country_t {
   char countrycode[3];
@@ -41,12 +53,77 @@ static smartlist_t *geoip_countries = NULL;
  * The index is encoded in the pointer, and 1 is added so that NULL can mean
  * not found. */
 static strmap_t *country_idxplus1_by_lc_code = NULL;
-/** A list of all known geoip_entry_t, sorted by ip_low. */
+/** How many different characters can appear in a country code that fits
+ * in country_idxplus1_by_code? */
+#define GEOIP_CODE_CHARS 37
+/** Like country_idxplus1_by_lc_code, but indexed directly by the two
+ * characters of a country code (see geoip_country_code_slot()), so that
+ * loading the GeoIP file doesn't need a strmap lookup per line.  0 means
+ * not found. */
+static uint16_t country_idxplus1_by_code[GEOIP_CODE_CHARS*GEOIP_CODE_CHARS];
+/** A list of geoip_entry_t that we've parsed but not yet added to
+ * geoip_index. */
 static smartlist_t *geoip_entries = NULL;
+/** A list of geoip_ipv6_entry_t that we've parsed but not yet added to
+ * geoip_index. */
+static smartlist_t *geoip_ipv6_entries = NULL;
 
 /** SHA1 digest of the GeoIP file to include in extra-info descriptors. */
 static char geoip_digest[DIGEST_LEN];
 
+/** Magic string at the start of a compiled GeoIP index. */
+#define GEOIP_INDEX_MAGIC "TorGeoI1"
+/** How many first-level buckets does the IPv4 part of the index have?  We
+ * use one per /16. */
+#define GEOIP_V4_BUCKETS (1<<16)
+/** Round <b>n</b> up to the alignment of each table in a GeoIP index. */
+#define GEOIP_ALIGN(n) (((n)+7) & ~(uint64_t)7)
+
+/** Header of a compiled GeoIP index.
+ *
+ * An index is one block of memory: this header, then the country code
+ * table, the IPv4 bucket table, the IPv4 range tables, and the IPv6 range
+ * tables, each starting on an 8-byte boundary.  We build it when we parse
+ * the GeoIP file, save it as DataDirectory/cached-geoip-index, and on later
+ * startups map that file instead of parsing the GeoIP file again.  Numbers
+ * are in host order; IPv6 addresses are in network order. */
+typedef struct geoip_index_header_t {
+  char magic[8]; /**< GEOIP_INDEX_MAGIC */
+  char digest[DIGEST_LEN]; /**< SHA1 of the GeoIP file we were built from. */
+  uint32_t n_countries; /**< Number of entries in the country table. */
+  uint32_t n_v4; /**< Number of IPv4 ranges. */
+  uint32_t n_v6; /**< Number of IPv6 ranges. */
+  uint32_t total_len; /**< Length of the whole index, in bytes. */
+} geoip_index_header_t;
+
+/** A compiled GeoIP index, either built in RAM or mapped from disk. */
+typedef struct geoip_index_t {
+  const geoip_index_header_t *hdr;
+  /** Two-letter country code (NUL-padded) for each country index. */
+  const char (*countries)[4];
+  /** For each /16 <b>b</b>, the first IPv4 range whose high end is at least
+   * b&lt;&lt;16.  Has GEOIP_V4_BUCKETS+1 entries. */
+  const uint32_t *v4_start;
+  /** Lowest address of each IPv4 range, sorted. */
+  const uint32_t *v4_low;
+  /** Highest address of each IPv4 range, sorted. */
+  const uint32_t *v4_high;
+  /** Country index of each IPv4 range. */
+  const uint16_t *v4_country;
+  /** Lowest and highest address of each IPv6 range, sorted. */
+  const uint8_t (*v6_low)[16];
+  const uint8_t (*v6_high)[16];
+  /** Country index of each IPv6 range. */
+  const uint16_t *v6_country;
+  /** If we built this index ourselves, its storage. */
+  char *mem;
+  /** If we mapped this index from disk, the mapping. */
+  tor_mmap_t *map;
+} geoip_index_t;
+
+/** The index we answer lookups from, or NULL if we have none. */
+static geoip_index_t *geoip_index = NULL;
+
 /** Return the index of the <b>country</b>'s entry in the GeoIP DB
  * if it is a valid 2-letter country code, otherwise return -1.
  */
@@ -64,18 +141,48 @@ geoip_get_country(const char *country)
   return (country_t)idx;
 }
 
-/** Add an entry to the GeoIP table, mapping all IPs between <b>low</b> and
- * <b>high</b>, inclusive, to the 2-letter country code <b>country</b>.
- */
-static void
-geoip_add_entry(uint32_t low, uint32_t high, const char *country)
+/** Return the position of the character <b>c</b> in the alphabet of
+ * country codes that fit in country_idxplus1_by_code, or -1 if it isn't
+ * part of that alphabet. */
+static INLINE int
+geoip_country_char_slot(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  else if (c >= 'a' && c <= 'z')
+    return c - 'a' + 10;
+  else if (c >= 'A' && c <= 'Z')
+    return c - 'A' + 10;
+  else if (c == '?')
+    return 36;
+  else
+    return -1;
+}
+
+/** Return the slot for <b>country</b> in country_idxplus1_by_code, or -1
+ * if it doesn't have one. */
+static INLINE int
+geoip_country_code_slot(const char *country)
+{
+  int a, b;
+  if ((a = geoip_country_char_slot(country[0])) < 0 ||
+      (b = geoip_country_char_slot(country[1])) < 0 ||
+      country[2] != '\0')
+    return -1;
+  return a*GEOIP_CODE_CHARS + b;
+}
+
+/** Return the index of <b>country</b> in geoip_countries, adding it if it
+ * isn't there yet. */
+static intptr_t
+geoip_get_or_add_country(const char *country)
 {
   intptr_t idx;
-  geoip_entry_t *ent;
   void *_idxplus1;
+  int slot = geoip_country_code_slot(country);
 
-  if (high < low)
-    return;
+  if (slot >= 0 && country_idxplus1_by_code[slot])
+    return country_idxplus1_by_code[slot] - 1;
 
   _idxplus1 = strmap_get_lc(country_idxplus1_by_lc_code, country);
 
@@ -93,13 +200,77 @@ geoip_add_entry(uint32_t low, uint32_t high, const char *country)
     geoip_country_t *c = smartlist_get(geoip_countries, idx);
     tor_assert(!strcasecmp(c->countrycode, country));
   }
+  if (slot >= 0 && idx < UINT16_MAX)
+    country_idxplus1_by_code[slot] = (uint16_t)(idx+1);
+  return idx;
+}
+
+/** Add an entry to the GeoIP table, mapping all IPs between <b>low</b> and
+ * <b>high</b>, inclusive, to the 2-letter country code <b>country</b>.
+ */
+static void
+geoip_add_entry(uint32_t low, uint32_t high, const char *country)
+{
+  geoip_entry_t *ent;
+
+  if (high < low)
+    return;
+
+  if (!geoip_entries)
+    geoip_entries = smartlist_create();
   ent = tor_malloc_zero(sizeof(geoip_entry_t));
   ent->ip_low = low;
   ent->ip_high = high;
-  ent->country = idx;
+  ent->country = geoip_get_or_add_country(country);
   smartlist_add(geoip_entries, ent);
 }
 
+/** Add an entry to the GeoIP table, mapping all IPv6 addresses between
+ * <b>low</b> and <b>high</b>, inclusive, to the 2-letter country code
+ * <b>country</b>. */
+static void
+geoip_add_ipv6_entry(const struct in6_addr *low, const struct in6_addr *high,
+                     const char *country)
+{
+  geoip_ipv6_entry_t *ent;
+
+  if (memcmp(high->s6_addr, low->s6_addr, 16) < 0)
+    return;
+
+  if (!geoip_ipv6_entries)
+    geoip_ipv6_entries = smartlist_create();
+  ent = tor_malloc_zero(sizeof(geoip_ipv6_entry_t));
+  memcpy(ent->ip_low, low->s6_addr, 16);
+  memcpy(ent->ip_high, high->s6_addr, 16);
+  ent->country = geoip_get_or_add_country(country);
+  smartlist_add(geoip_ipv6_entries, ent);
+}
+
+/** Try to parse <b>line</b> as an IPv6 GeoIP entry of the form
+ * IPV6LOW,IPV6HIGH,CC and add it.  Return 0 on success, -1 on failure. */
+static int
+geoip_parse_ipv6_entry(const char *line)
+{
+  char low_buf[TOR_ADDR_BUF_LEN], high_buf[TOR_ADDR_BUF_LEN];
+  struct in6_addr low, high;
+  const char *comma1, *comma2;
+  char b[3];
+
+  if (!(comma1 = strchr(line, ',')) || !(comma2 = strchr(comma1+1, ',')))
+    return -1;
+  if ((size_t)(comma1-line) >= sizeof(low_buf) ||
+      (size_t)(comma2-comma1-1) >= sizeof(high_buf))
+    return -1;
+  strlcpy(low_buf, line, comma1-line+1);
+  strlcpy(high_buf, comma1+1, comma2-comma1);
+  if (tor_inet_pton(AF_INET6, low_buf, &low) != 1 ||
+      tor_inet_pton(AF_INET6, high_buf, &high) != 1 ||
+      tor_sscanf(comma2+1, "%2s", b) != 1)
+    return -1;
+  geoip_add_ipv6_entry(&low, &high, b);
+  return 0;
+}
+
 /** Add an entry to the GeoIP table, parsing it from <b>line</b>.  The
  * format is as for geoip_load_file(). */
 /*private*/ int
@@ -109,12 +280,10 @@ geoip_parse_entry(const char *line)
   char b[3];
   if (!geoip_countries)
     init_geoip_countries();
-  if (!geoip_entries)
-    geoip_entries = smartlist_create();
 
   while (TOR_ISSPACE(*line))
     ++line;
-  if (*line == '#')
+  if (*line == '#' || *line == '\0')
     return 0;
   if (tor_sscanf(line,"%u,%u,%2s", &low, &high, b) == 3) {
     geoip_add_entry(low, high, b);
@@ -122,6 +291,8 @@ geoip_parse_entry(const char *line)
   } else if (tor_sscanf(line,"\"%u\",\"%u\",\"%2s\",", &low, &high, b) == 3) {
     geoip_add_entry(low, high, b);
     return 0;
+  } else if (geoip_parse_ipv6_entry(line) == 0) {
+    return 0;
   } else {
     log_warn(LD_GENERAL, "Unable to parse line from GEOIP file: %s",
              escaped(line));
@@ -129,6 +300,92 @@ geoip_parse_entry(const char *line)
   }
 }
 
+/** Parse a decimal number, optionally in double quotes, from *<b>cp</b>
+ * (reading no further than <b>end</b>) into *<b>out</b>, and advance
+ * *<b>cp</b> past it.  Return 0 on success, -1 on failure. */
+static INLINE int
+geoip_parse_uint32(const char **cp, const char *end, uint32_t *out)
+{
+  const char *s = *cp;
+  uint64_t v = 0;
+  int quoted = 0, n_digits = 0;
+  if (s < end && *s == '"') {
+    quoted = 1;
+    ++s;
+  }
+  while (s < end && TOR_ISDIGIT(*s)) {
+    v = v*10 + (*s++ - '0');
+    if (v > UINT32_MAX)
+      return -1;
+    ++n_digits;
+  }
+  if (!n_digits)
+    return -1;
+  if (quoted && (s >= end || *s++ != '"'))
+    return -1;
+  *cp = s;
+  *out = (uint32_t)v;
+  return 0;
+}
+
+/** Try to add the IPv4 entry in the line from <b>line</b> up to
+ * <b>end</b>, in either of the formats geoip_parse_entry() accepts for
+ * IPv4, without going through tor_sscanf().  Return 0 on success, or -1 if
+ * the caller should hand the line to geoip_parse_entry() instead. */
+static int
+geoip_parse_entry_fast(const char *line, const char *end)
+{
+  const char *cp = line;
+  uint32_t low, high;
+  char b[3];
+
+  if (geoip_parse_uint32(&cp, end, &low) < 0 || cp >= end || *cp++ != ',')
+    return -1;
+  if (geoip_parse_uint32(&cp, end, &high) < 0 || cp >= end || *cp++ != ',')
+    return -1;
+  if (cp < end && *cp == '"')
+    ++cp;
+  if (end - cp < 2 ||
+      geoip_country_char_slot(cp[0]) < 0 || geoip_country_char_slot(cp[1]) < 0)
+    return -1;
+  b[0] = cp[0];
+  b[1] = cp[1];
+  b[2] = '\0';
+  geoip_add_entry(low, high, b);
+  return 0;
+}
+
+/** Add every entry in the <b>len</b>-byte GeoIP file contents at
+ * <b>data</b>.  Lines in the common IPv4 formats take a fast path; anything
+ * else goes through geoip_parse_entry(). */
+/*private*/ void
+geoip_parse_buf(const char *data, size_t len)
+{
+  const char *cp = data, *end = data + len;
+  if (!geoip_countries)
+    init_geoip_countries();
+  while (cp < end) {
+    const char *eol = memchr(cp, '\n', end-cp);
+    const char *line = cp, *line_end = eol ? eol : end;
+    cp = eol ? eol+1 : end;
+
+    while (line < line_end && TOR_ISSPACE(*line))
+      ++line;
+    if (line == line_end || *line == '#')
+      continue;
+    if (geoip_parse_entry_fast(line, line_end) < 0) {
+      char buf[512];
+      size_t n = line_end - line;
+      if (n >= sizeof(buf))
+        n = sizeof(buf)-1;
+      memcpy(buf, line, n);
+      buf[n] = '\0';
+      /* FFFF track full country name. */
+      geoip_parse_entry(buf);
+    }
+  }
+}
+
 /** Sorting helper: return -1, 1, or 0 based on comparison of two
  * geoip_entry_t */
 static int
@@ -143,20 +400,246 @@ _geoip_compare_entries(const void **_a, const void **_b)
     return 0;
 }
 
-/** bsearch helper: return -1, 1, or 0 based on comparison of an IP (a pointer
- * to a uint32_t in host order) to a geoip_entry_t */
+/** Sorting helper: return -1, 1, or 0 based on comparison of two
+ * geoip_ipv6_entry_t */
+static int
+_geoip_compare_ipv6_entries(const void **_a, const void **_b)
+{
+  const geoip_ipv6_entry_t *a = *_a, *b = *_b;
+  return memcmp(a->ip_low, b->ip_low, 16);
+}
+
+/** Set the table pointers of <b>idx</b> to point into the index whose
+ * memory starts at <b>base</b> and whose header says it has
+ * <b>n_countries</b> countries, <b>n_v4</b> IPv4 ranges, and <b>n_v6</b>
+ * IPv6 ranges.  If <b>base</b> is NULL, just compute the size.  Return the
+ * total size of such an index. */
+static uint64_t
+geoip_index_layout(geoip_index_t *idx, const char *base,
+                   uint32_t n_countries, uint32_t n_v4, uint32_t n_v6)
+{
+  uint64_t off = GEOIP_ALIGN(sizeof(geoip_index_header_t));
+#define TABLE(field, type, n)                           \
+  STMT_BEGIN                                            \
+    if (base)                                           \
+      idx->field = (type) (base + off);                 \
+    off = GEOIP_ALIGN(off + (uint64_t)(n));             \
+  STMT_END
+  TABLE(countries, const char (*)[4], 4*(uint64_t)n_countries);
+  TABLE(v4_start, const uint32_t *, 4*(uint64_t)(GEOIP_V4_BUCKETS+1));
+  TABLE(v4_low, const uint32_t *, 4*(uint64_t)n_v4);
+  TABLE(v4_high, const uint32_t *, 4*(uint64_t)n_v4);
+  TABLE(v4_country, const uint16_t *, 2*(uint64_t)n_v4);
+  TABLE(v6_low, const uint8_t (*)[16], 16*(uint64_t)n_v6);
+  TABLE(v6_high, const uint8_t (*)[16], 16*(uint64_t)n_v6);
+  TABLE(v6_country, const uint16_t *, 2*(uint64_t)n_v6);
+#undef TABLE
+  if (base)
+    idx->hdr = (const geoip_index_header_t *) base;
+  return off;
+}
+
+/** Release all storage held by <b>idx</b>. */
+static void
+geoip_index_free(geoip_index_t *idx)
+{
+  if (!idx)
+    return;
+  tor_free(idx->mem);
+  if (idx->map)
+    tor_munmap_file(idx->map);
+  tor_free(idx);
+}
+
+/** Add each entry of the sorted list <b>list</b> to <b>out</b>, except for
+ * entries that <b>overlaps</b> says overlap the previous one we kept: a
+ * lookup can only give one answer. */
+#define GEOIP_KEEP_SORTED(out, list, type, overlaps)                 \
+  STMT_BEGIN                                                         \
+    const type *_prev = NULL;                                        \
+    SMARTLIST_FOREACH_BEGIN(list, const type *, ent) {               \
+      if (_prev && overlaps(_prev, ent)) {                           \
+        log_info(LD_GENERAL, "Ignoring overlapping GEOIP entry.");   \
+        continue;                                                    \
+      }                                                              \
+      smartlist_add(out, (void*)ent);                                \
+      _prev = ent;                                                   \
+    } SMARTLIST_FOREACH_END(ent);                                    \
+  STMT_END
+#define V4_OVERLAPS(a,b) ((b)->ip_low <= (a)->ip_high)
+#define V6_OVERLAPS(a,b) (memcmp((b)->ip_low, (a)->ip_high, 16) <= 0)
+
+/** Move every entry from <b>idx</b> back onto geoip_entries and
+ * geoip_ipv6_entries, so that we can build a new index holding them and
+ * whatever else we've parsed since. */
+static void
+geoip_index_to_entries(const geoip_index_t *idx)
+{
+  uint32_t i;
+  for (i = 0; i < idx->hdr->n_v4; ++i) {
+    geoip_entry_t *ent = tor_malloc_zero(sizeof(geoip_entry_t));
+    ent->ip_low = idx->v4_low[i];
+    ent->ip_high = idx->v4_high[i];
+    ent->country = idx->v4_country[i];
+    if (!geoip_entries)
+      geoip_entries = smartlist_create();
+    smartlist_add(geoip_entries, ent);
+  }
+  for (i = 0; i < idx->hdr->n_v6; ++i) {
+    geoip_ipv6_entry_t *ent = tor_malloc_zero(sizeof(geoip_ipv6_entry_t));
+    memcpy(ent->ip_low, idx->v6_low[i], 16);
+    memcpy(ent->ip_high, idx->v6_high[i], 16);
+    ent->country = idx->v6_country[i];
+    if (!geoip_ipv6_entries)
+      geoip_ipv6_entries = smartlist_create();
+    smartlist_add(geoip_ipv6_entries, ent);
+  }
+}
+
+/** Replace geoip_index with a new index holding every entry in it and in
+ * geoip_entries and geoip_ipv6_entries, and free the parsed entries. */
+static void
+geoip_index_build(void)
+{
+  smartlist_t *v4 = smartlist_create(), *v6 = smartlist_create();
+  geoip_index_t *idx = tor_malloc_zero(sizeof(geoip_index_t));
+  geoip_index_header_t *hdr;
+  uint32_t n_countries, j, b;
+  uint64_t len;
+
+  if (!geoip_countries)
+    init_geoip_countries();
+  if (geoip_index) {
+    geoip_index_to_entries(geoip_index);
+    geoip_index_free(geoip_index);
+    geoip_index = NULL;
+  }
+  if (geoip_entries) {
+    smartlist_sort(geoip_entries, _geoip_compare_entries);
+    GEOIP_KEEP_SORTED(v4, geoip_entries, geoip_entry_t, V4_OVERLAPS);
+  }
+  if (geoip_ipv6_entries) {
+    smartlist_sort(geoip_ipv6_entries, _geoip_compare_ipv6_entries);
+    GEOIP_KEEP_SORTED(v6, geoip_ipv6_entries, geoip_ipv6_entry_t,
+                      V6_OVERLAPS);
+  }
+
+  n_countries = smartlist_len(geoip_countries);
+  len = geoip_index_layout(idx, NULL, n_countries,
+                           smartlist_len(v4), smartlist_len(v6));
+  tor_assert(len < UINT32_MAX);
+  idx->mem = tor_malloc_zero((size_t)len);
+  geoip_index_layout(idx, idx->mem, n_countries,
+                     smartlist_len(v4), smartlist_len(v6));
+
+  hdr = (geoip_index_header_t *) idx->mem;
+  memcpy(hdr->magic, GEOIP_INDEX_MAGIC, sizeof(hdr->magic));
+  memcpy(hdr->digest, geoip_digest, DIGEST_LEN);
+  hdr->n_countries = n_countries;
+  hdr->n_v4 = smartlist_len(v4);
+  hdr->n_v6 = smartlist_len(v6);
+  hdr->total_len = (uint32_t)len;
+
+  /* The tables are const to everybody but us. */
+  SMARTLIST_FOREACH(geoip_countries, const geoip_country_t *, c,
+    strlcpy((char*)idx->countries[c_sl_idx], c->countrycode, 4));
+  SMARTLIST_FOREACH_BEGIN(v4, const geoip_entry_t *, ent) {
+    ((uint32_t*)idx->v4_low)[ent_sl_idx] = ent->ip_low;
+    ((uint32_t*)idx->v4_high)[ent_sl_idx] = ent->ip_high;
+    ((uint16_t*)idx->v4_country)[ent_sl_idx] = (uint16_t)ent->country;
+  } SMARTLIST_FOREACH_END(ent);
+  for (b = 0, j = 0; b < GEOIP_V4_BUCKETS; ++b) {
+    while (j < hdr->n_v4 && idx->v4_high[j] < (b << 16))
+      ++j;
+    ((uint32_t*)idx->v4_start)[b] = j;
+  }
+  ((uint32_t*)idx->v4_start)[GEOIP_V4_BUCKETS] = hdr->n_v4;
+  SMARTLIST_FOREACH_BEGIN(v6, const geoip_ipv6_entry_t *, ent) {
+    memcpy((uint8_t*)idx->v6_low[ent_sl_idx], ent->ip_low, 16);
+    memcpy((uint8_t*)idx->v6_high[ent_sl_idx], ent->ip_high, 16);
+    ((uint16_t*)idx->v6_country)[ent_sl_idx] = (uint16_t)ent->country;
+  } SMARTLIST_FOREACH_END(ent);
+
+  smartlist_free(v4);
+  smartlist_free(v6);
+  if (geoip_entries) {
+    SMARTLIST_FOREACH(geoip_entries, geoip_entry_t *, e, tor_free(e));
+    smartlist_free(geoip_entries);
+    geoip_entries = NULL;
+  }
+  if (geoip_ipv6_entries) {
+    SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
+                      tor_free(e));
+    smartlist_free(geoip_ipv6_entries);
+    geoip_ipv6_entries = NULL;
+  }
+  geoip_index = idx;
+}
+
+/** Try to use the compiled index in <b>fname</b>, which must have been built
+ * from a GeoIP file whose digest is geoip_digest.  On success, set
+ * geoip_index and the country list from it and return 0.  Otherwise return
+ * -1. */
 static int
-_geoip_compare_key_to_entry(const void *_key, const void **_member)
+geoip_index_load(const char *fname)
 {
-  /* No alignment issue here, since _key really is a pointer to uint32_t */
-  const uint32_t addr = *(uint32_t *)_key;
-  const geoip_entry_t *entry = *_member;
-  if (addr < entry->ip_low)
+  /* Every lookup binary-searches this: bring it all in now. */
+  tor_mmap_t *mm = tor_mmap_file_flags(fname,
+                                       TOR_MMAP_RANDOM|TOR_MMAP_POPULATE);
+  geoip_index_t *idx;
+  const geoip_index_header_t *hdr;
+  uint32_t i;
+
+  if (!mm)
     return -1;
-  else if (addr > entry->ip_high)
-    return 1;
-  else
-    return 0;
+  hdr = (const geoip_index_header_t *) mm->data;
+  if (mm->size < sizeof(geoip_index_header_t) ||
+      memcmp(hdr->magic, GEOIP_INDEX_MAGIC, sizeof(hdr->magic)) ||
+      tor_memneq(hdr->digest, geoip_digest, DIGEST_LEN) ||
+      hdr->total_len != mm->size || hdr->n_countries < 1 ||
+      hdr->n_countries > UINT16_MAX ||
+      geoip_index_layout(NULL, NULL, hdr->n_countries, hdr->n_v4,
+                         hdr->n_v6) != mm->size) {
+    log_info(LD_GENERAL, "Compiled GEOIP index in %s is stale or invalid.",
+             fname);
+    tor_munmap_file(mm);
+    return -1;
+  }
+  idx = tor_malloc_zero(sizeof(geoip_index_t));
+  idx->map = mm;
+  geoip_index_layout(idx, mm->data, hdr->n_countries, hdr->n_v4, hdr->n_v6);
+
+  /* Make sure that lookups can't wander off the end of a table. */
+  for (i = 0; i < hdr->n_countries; ++i) {
+    if (idx->countries[i][2] != '\0')
+      goto bad;
+  }
+  if (strcmp(idx->countries[0], "??"))
+    goto bad;
+  for (i = 0; i <= GEOIP_V4_BUCKETS; ++i) {
+    if (idx->v4_start[i] > hdr->n_v4 ||
+        (i && idx->v4_start[i] < idx->v4_start[i-1]))
+      goto bad;
+  }
+  for (i = 0; i < hdr->n_v4; ++i) {
+    if (idx->v4_country[i] >= hdr->n_countries)
+      goto bad;
+  }
+  for (i = 0; i < hdr->n_v6; ++i) {
+    if (idx->v6_country[i] >= hdr->n_countries)
+      goto bad;
+  }
+
+  for (i = 1; i < hdr->n_countries; ++i)
+    geoip_get_or_add_country(idx->countries[i]);
+  if ((uint32_t)smartlist_len(geoip_countries) != hdr->n_countries)
+    goto bad;
+  geoip_index = idx;
+  return 0;
+ bad:
+  log_info(LD_GENERAL, "Compiled GEOIP index in %s is corrupt.", fname);
+  geoip_index_free(idx);
+  return -1;
 }
 
 /** Return 1 if we should collect geoip stats on bridge users, and
@@ -183,6 +666,8 @@ init_geoip_countries(void)
   smartlist_add(geoip_countries, geoip_unresolved);
   country_idxplus1_by_lc_code = strmap_new();
   strmap_set_lc(country_idxplus1_by_lc_code, "??", (void*)(1));
+  memset(country_idxplus1_by_code, 0, sizeof(country_idxplus1_by_code));
+  country_idxplus1_by_code[geoip_country_code_slot("??")] = 1;
 }
 
 /** Clear the GeoIP database and reload it from the file
@@ -193,55 +678,56 @@ init_geoip_countries(void)
  * and
  *   "INTIPLOW","INTIPHIGH","CC","CC3","COUNTRY NAME"
  * where INTIPLOW and INTIPHIGH are IPv4 addresses encoded as 4-byte unsigned
- * integers, and CC is a country code.
+ * integers, and CC is a country code; and
+ *   IPV6LOW,IPV6HIGH,CC
+ * where IPV6LOW and IPV6HIGH are IPv6 addresses.
  *
  * It also recognizes, and skips over, blank lines and lines that start
  * with '#' (comments).
+ *
+ * If DataDirectory/cached-geoip-index holds an index compiled from a file
+ * with the same digest, we map that instead of parsing the file; otherwise
+ * we parse the file and save the index we build there.
  */
 int
 geoip_load_file(const char *filename, const or_options_t *options)
 {
-  FILE *f;
+  tor_mmap_t *mm;
   const char *msg = "";
   int severity = options_need_geoip_info(options, &msg) ? LOG_WARN : LOG_INFO;
-  crypto_digest_env_t *geoip_digest_env = NULL;
+  char *index_fname;
   clear_geoip_db();
-  if (!(f = tor_fopen_cloexec(filename, "r"))) {
+  if (!(mm = tor_mmap_file_flags(filename, TOR_MMAP_SEQUENTIAL))) {
     log_fn(severity, LD_GENERAL, "Failed to open GEOIP file %s.  %s",
            filename, msg);
     return -1;
   }
-  if (!geoip_countries)
-    init_geoip_countries();
-  if (geoip_entries) {
-    SMARTLIST_FOREACH(geoip_entries, geoip_entry_t *, e, tor_free(e));
-    smartlist_free(geoip_entries);
-  }
-  geoip_entries = smartlist_create();
-  geoip_digest_env = crypto_new_digest_env();
-  log_notice(LD_GENERAL, "Parsing GEOIP file %s.", filename);
-  while (!feof(f)) {
-    char buf[512];
-    if (fgets(buf, (int)sizeof(buf), f) == NULL)
-      break;
-    crypto_digest_add_bytes(geoip_digest_env, buf, strlen(buf));
-    /* FFFF track full country name. */
-    geoip_parse_entry(buf);
-  }
-  /*XXXX abort and return -1 if no entries/illformed?*/
-  fclose(f);
+  /* Remember file digest so that we can include it in our extra-info
+   * descriptors. */
+  crypto_digest(geoip_digest, mm->data, mm->size);
+  init_geoip_countries();
 
-  smartlist_sort(geoip_entries, _geoip_compare_entries);
+  index_fname = get_datadir_fname("cached-geoip-index");
+  if (geoip_index_load(index_fname) == 0) {
+    log_info(LD_GENERAL, "Loaded compiled index for GEOIP file %s.",
+             filename);
+  } else {
+    log_notice(LD_GENERAL, "Parsing GEOIP file %s.", filename);
+    geoip_parse_buf(mm->data, mm->size);
+    /*XXXX abort and return -1 if no entries/illformed?*/
+    geoip_index_build();
+    if (write_bytes_to_file(index_fname, geoip_index->mem,
+                            geoip_index->hdr->total_len, 1) < 0)
+      log_info(LD_GENERAL, "Couldn't save compiled GEOIP index to %s.",
+               index_fname);
+  }
+  tor_free(index_fname);
+  tor_munmap_file(mm);
 
   /* Okay, now we need to maybe change our mind about what is in which
    * country. */
   refresh_all_country_info();
 
-  /* Remember file digest so that we can include it in our extra-info
-   * descriptors. */
-  crypto_digest_get_digest(geoip_digest_env, geoip_digest, DIGEST_LEN);
-  crypto_free_digest_env(geoip_digest_env);
-
   return 0;
 }
 
@@ -254,11 +740,64 @@ geoip_load_file(const char *filename, const or_options_t *options)
 int
 geoip_get_country_by_ip(uint32_t ipaddr)
 {
-  geoip_entry_t *ent;
-  if (!geoip_entries)
+  uint32_t lo, hi;
+  if (geoip_entries || geoip_ipv6_entries)
+    geoip_index_build();
+  if (!geoip_index)
     return -1;
-  ent = smartlist_bsearch(geoip_entries, &ipaddr, _geoip_compare_key_to_entry);
-  return ent ? (int)ent->country : 0;
+  /* Find the first range whose high end is at least ipaddr.  It must be
+   * among the ranges that reach into ipaddr's /16, or be the first one after
+   * them. */
+  lo = geoip_index->v4_start[ipaddr >> 16];
+  hi = geoip_index->v4_start[(ipaddr >> 16) + 1];
+  while (lo < hi) {
+    uint32_t mid = lo + (hi-lo)/2;
+    if (geoip_index->v4_high[mid] < ipaddr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo < geoip_index->hdr->n_v4 && geoip_index->v4_low[lo] <= ipaddr)
+    return geoip_index->v4_country[lo];
+  return 0;
+}
+
+/** As geoip_get_country_by_ip(), but for the IPv6 address <b>addr</b>. */
+int
+geoip_get_country_by_ipv6(const struct in6_addr *addr)
+{
+  uint32_t lo = 0, hi;
+  if (geoip_entries || geoip_ipv6_entries)
+    geoip_index_build();
+  if (!geoip_index)
+    return -1;
+  hi = geoip_index->hdr->n_v6;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi-lo)/2;
+    if (memcmp(geoip_index->v6_high[mid], addr->s6_addr, 16) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo < geoip_index->hdr->n_v6 &&
+      memcmp(geoip_index->v6_low[lo], addr->s6_addr, 16) <= 0)
+    return geoip_index->v6_country[lo];
+  return 0;
+}
+
+/** As geoip_get_country_by_ip(), but for the IPv4 or IPv6 address
+ * <b>addr</b>. */
+int
+geoip_get_country_by_addr(const tor_addr_t *addr)
+{
+  switch (tor_addr_family(addr)) {
+    case AF_INET:
+      return geoip_get_country_by_ip(tor_addr_to_ipv4h(addr));
+    case AF_INET6:
+      return geoip_get_country_by_ipv6(tor_addr_to_in6(addr));
+    default:
+      return 0;
+  }
 }
 
 /** Return the number of countries recognized by the GeoIP database. */
@@ -286,7 +825,9 @@ geoip_get_country_name(country_t num)
 int
 geoip_is_loaded(void)
 {
-  return geoip_countries != NULL && geoip_entries != NULL;
+  return geoip_countries != NULL &&
+    (geoip_index != NULL || geoip_entries != NULL ||
+     geoip_ipv6_entries != NULL);
 }
 
 /** Return the hex-encoded SHA1 digest of the loaded GeoIP file. The
@@ -336,14 +877,178 @@ clientmap_entries_eq(const clientmap_entry_t *a, const clientmap_entry_t *b)
 
 HT_PROTOTYPE(clientmap, clientmap_entry_t, node, clientmap_entry_hash,
              clientmap_entries_eq);
-HT_GENERATE(clientmap, clientmap_entry_t, node, clientmap_entry_hash,
-            clientmap_entries_eq, 0.6, malloc, realloc, free);
+HT_GENERATE_INCREMENTAL(clientmap, clientmap_entry_t, node,
+                        clientmap_entry_hash, clientmap_entries_eq, 0.6,
+                        malloc, realloc, free);
+
+/* Sketch-based client counting.
+ *
+ * When ClientCountSketch is set, we don't remember client addresses.
+ * Instead, for each action and country, we keep a sliding-window
+ * HyperLogLog sketch: each register remembers the observations that could
+ * still be its maximum for some cutoff time, so that
+ * geoip_remove_old_clients() still works. */
+
+/** How many registers does each client sketch have? Estimates are within
+ * about 1.04/sqrt(CLIENT_SKETCH_REGISTERS) of the true count. */
+#define CLIENT_SKETCH_REGISTERS 128
+/** log2(CLIENT_SKETCH_REGISTERS) */
+#define CLIENT_SKETCH_REGISTER_BITS 7
+/** How many observations do we remember per register?  If we run out, we
+ * forget the oldest, which can only make counts for long windows low. */
+#define CLIENT_SKETCH_HISTORY 4
+
+/** One register of a client sketch: up to CLIENT_SKETCH_HISTORY
+ * observations, oldest first, with strictly decreasing ranks. */
+typedef struct client_sketch_register_t {
+  uint32_t minute[CLIENT_SKETCH_HISTORY]; /**< When, in minutes. */
+  uint8_t rank[CLIENT_SKETCH_HISTORY]; /**< Rank of the hashed address. */
+  uint8_t n; /**< How many observations are there? */
+} client_sketch_register_t;
+
+/** A sliding-window HyperLogLog sketch of the clients from one country. */
+typedef struct client_sketch_t {
+  client_sketch_register_t reg[CLIENT_SKETCH_REGISTERS];
+} client_sketch_t;
+
+/** For each geoip_client_action_t, a map from country code to the
+ * client_sketch_t for that country, or NULL. */
+static strmap_t *client_sketches[GEOIP_CLIENT_NETWORKSTATUS_V2+1];
+/** Secret key for hashing client addresses into sketches. */
+static uint64_t client_sketch_key = 0;
+
+/** Return a 64-bit keyed hash of <b>addr</b>. */
+static INLINE uint64_t
+client_sketch_hash(uint32_t addr)
+{
+  uint64_t h;
+  if (!client_sketch_key)
+    crypto_rand((char*)&client_sketch_key, sizeof(client_sketch_key));
+  /* The splitmix64 finalizer. */
+  h = client_sketch_key ^ addr;
+  h = (h ^ (h >> 30)) * U64_LITERAL(0xbf58476d1ce4e5b9);
+  h = (h ^ (h >> 27)) * U64_LITERAL(0x94d049bb133111eb);
+  return h ^ (h >> 31);
+}
+
+/** Record in <b>sketch</b> that we saw client <b>addr</b> at minute
+ * <b>minute</b>. */
+static void
+client_sketch_add(client_sketch_t *sketch, uint32_t addr, uint32_t minute)
+{
+  const int tail_bits = 64 - CLIENT_SKETCH_REGISTER_BITS;
+  uint64_t h = client_sketch_hash(addr);
+  uint64_t tail = h & ((U64_LITERAL(1) << tail_bits) - 1);
+  client_sketch_register_t *reg = &sketch->reg[h >> tail_bits];
+  uint8_t rank = tail ? (uint8_t)(tail_bits - tor_log2(tail))
+                      : (uint8_t)(tail_bits + 1);
+  int i, j;
+
+  /* If a newer observation has at least this rank, this one can never be
+   * the maximum. */
+  for (i = 0; i < reg->n; ++i) {
+    if (reg->minute[i] >= minute && reg->rank[i] >= rank)
+      return;
+  }
+  /* Drop the observations that this one makes useless. */
+  for (i = j = 0; i < reg->n; ++i) {
+    if (reg->minute[i] <= minute && reg->rank[i] <= rank)
+      continue;
+    reg->minute[j] = reg->minute[i];
+    reg->rank[j] = reg->rank[i];
+    ++j;
+  }
+  reg->n = j;
+  if (reg->n == CLIENT_SKETCH_HISTORY) {
+    memmove(reg->minute, reg->minute+1, sizeof(uint32_t)*(reg->n-1));
+    memmove(reg->rank, reg->rank+1, reg->n-1);
+    --reg->n;
+  }
+  /* Keep the observations in time order. */
+  for (i = reg->n; i > 0 && reg->minute[i-1] > minute; --i) {
+    reg->minute[i] = reg->minute[i-1];
+    reg->rank[i] = reg->rank[i-1];
+  }
+  reg->minute[i] = minute;
+  reg->rank[i] = rank;
+  ++reg->n;
+}
+
+/** Forget every observation in <b>sketch</b> from before minute
+ * <b>cutoff</b>.  Return true iff the sketch is now empty. */
+static int
+client_sketch_expire(client_sketch_t *sketch, uint32_t cutoff)
+{
+  int i, empty = 1;
+  for (i = 0; i < CLIENT_SKETCH_REGISTERS; ++i) {
+    client_sketch_register_t *reg = &sketch->reg[i];
+    int j = 0;
+    while (j < reg->n && reg->minute[j] < cutoff)
+      ++j;
+    if (j) {
+      memmove(reg->minute, reg->minute+j, sizeof(uint32_t)*(reg->n-j));
+      memmove(reg->rank, reg->rank+j, reg->n-j);
+      reg->n -= j;
+    }
+    if (reg->n)
+      empty = 0;
+  }
+  return empty;
+}
+
+/** Return our estimate of how many different clients <b>sketch</b> has
+ * seen. */
+static unsigned
+client_sketch_estimate(const client_sketch_t *sketch)
+{
+  const double m = CLIENT_SKETCH_REGISTERS;
+  double sum = 0.0, estimate;
+  int i, n_zero = 0;
+  for (i = 0; i < CLIENT_SKETCH_REGISTERS; ++i) {
+    /* The oldest observation left in a register has its highest rank. */
+    const client_sketch_register_t *reg = &sketch->reg[i];
+    int rank = reg->n ? reg->rank[0] : 0;
+    if (!rank)
+      ++n_zero;
+    sum += ldexp(1.0, -rank);
+  }
+  estimate = (0.7213 / (1.0 + 1.079/m)) * m * m / sum;
+  if (estimate <= 2.5 * m && n_zero)
+    estimate = m * log(m / n_zero); /* Linear counting for small counts. */
+  return (unsigned)(estimate + 0.5);
+}
+
+/** Record that we saw client <b>addr</b> doing <b>action</b> at minute
+ * <b>minute</b>. */
+static void
+client_sketch_note(geoip_client_action_t action, uint32_t addr,
+                   uint32_t minute)
+{
+  const char *cc = geoip_get_country_name(geoip_get_country_by_ip(addr));
+  client_sketch_t *sketch;
+  if (!client_sketches[action])
+    client_sketches[action] = strmap_new();
+  if (!(sketch = strmap_get(client_sketches[action], cc))) {
+    sketch = tor_malloc_zero(sizeof(client_sketch_t));
+    strmap_set(client_sketches[action], cc, sketch);
+  }
+  client_sketch_add(sketch, addr, minute);
+}
+
+/** Forget every client we've seen doing <b>action</b>. */
+static void
+client_sketches_clear(geoip_client_action_t action)
+{
+  strmap_free(client_sketches[action], _tor_free);
+  client_sketches[action] = NULL;
+}
 
 /** Clear history of connecting clients used by entry and bridge stats. */
 static void
 client_history_clear(void)
 {
   clientmap_entry_t **ent, **next, *this;
+  client_sketches_clear(GEOIP_CLIENT_CONNECT);
   for (ent = HT_START(clientmap, &client_history); ent != NULL;
        ent = next) {
     if ((*ent)->action == GEOIP_CLIENT_CONNECT) {
@@ -437,19 +1142,25 @@ geoip_note_client_seen(geoip_client_action_t action,
       return;
   }
 
-  lookup.ipaddr = addr;
-  lookup.action = (int)action;
-  ent = HT_FIND(clientmap, &client_history, &lookup);
-  if (! ent) {
-    ent = tor_malloc_zero(sizeof(clientmap_entry_t));
-    ent->ipaddr = addr;
-    ent->action = (int)action;
-    HT_INSERT(clientmap, &client_history, ent);
+  if (options->ClientCountSketch) {
+    client_sketch_note(action, addr,
+        (now / 60 <= (int)MAX_LAST_SEEN_IN_MINUTES && now >= 0) ?
+        (uint32_t)(now/60) : 0);
+  } else {
+    lookup.ipaddr = addr;
+    lookup.action = (int)action;
+    ent = HT_FIND(clientmap, &client_history, &lookup);
+    if (! ent) {
+      ent = tor_malloc_zero(sizeof(clientmap_entry_t));
+      ent->ipaddr = addr;
+      ent->action = (int)action;
+      HT_INSERT(clientmap, &client_history, ent);
+    }
+    if (now / 60 <= (int)MAX_LAST_SEEN_IN_MINUTES && now >= 0)
+      ent->last_seen_in_minutes = (unsigned)(now/60);
+    else
+      ent->last_seen_in_minutes = 0;
   }
-  if (now / 60 <= (int)MAX_LAST_SEEN_IN_MINUTES && now >= 0)
-    ent->last_seen_in_minutes = (unsigned)(now/60);
-  else
-    ent->last_seen_in_minutes = 0;
 
   if (action == GEOIP_CLIENT_NETWORKSTATUS ||
       action == GEOIP_CLIENT_NETWORKSTATUS_V2) {
@@ -488,9 +1199,37 @@ _remove_old_client_helper(struct clientmap_entry_t *ent, void *_cutoff)
 void
 geoip_remove_old_clients(time_t cutoff)
 {
+  int action;
   clientmap_HT_FOREACH_FN(&client_history,
                           _remove_old_client_helper,
                           &cutoff);
+  for (action = 0; action <= GEOIP_CLIENT_NETWORKSTATUS_V2; ++action) {
+    if (!client_sketches[action])
+      continue;
+    STRMAP_FOREACH_MODIFY(client_sketches[action], cc, client_sketch_t *,
+                          sketch) {
+      if (client_sketch_expire(sketch, (uint32_t)(cutoff / 60))) {
+        tor_free(sketch);
+        MAP_DEL_CURRENT(cc);
+      }
+    } STRMAP_FOREACH_END;
+  }
+}
+
+/** Set *<b>n_out</b> to the number of clients we remember having seen,
+ * and *<b>bytes_out</b> to an estimate of how much memory we use to do so. */
+void
+geoip_get_client_history_usage(int *n_out, size_t *bytes_out)
+{
+  int action;
+  *n_out = HT_SIZE(&client_history);
+  *bytes_out = sizeof(clientmap_entry_t) * *n_out +
+    HT_MEM_USAGE(&client_history);
+  for (action = 0; action <= GEOIP_CLIENT_NETWORKSTATUS_V2; ++action) {
+    if (client_sketches[action])
+      *bytes_out += sizeof(client_sketch_t) *
+        strmap_size(client_sketches[action]);
+  }
 }
 
 /** How many responses are we giving to clients requesting v2 network
@@ -607,8 +1346,9 @@ dirreq_map_ent_hash(const dirreq_map_entry_t *entry)
 
 HT_PROTOTYPE(dirreqmap, dirreq_map_entry_t, node, dirreq_map_ent_hash,
              dirreq_map_ent_eq);
-HT_GENERATE(dirreqmap, dirreq_map_entry_t, node, dirreq_map_ent_hash,
-            dirreq_map_ent_eq, 0.6, malloc, realloc, free);
+HT_GENERATE_INCREMENTAL(dirreqmap, dirreq_map_entry_t, node,
+                        dirreq_map_ent_hash, dirreq_map_ent_eq, 0.6,
+                        malloc, realloc, free);
 
 /** Helper: Put <b>entry</b> into map of directory requests using
  * <b>type</b> and <b>dirreq_id</b> as key parts. If there is
@@ -819,6 +1559,17 @@ geoip_get_client_history(geoip_client_action_t action)
     return NULL;
 
   counts = tor_malloc_zero(sizeof(unsigned)*n_countries);
+  if (client_sketches[action]) {
+    STRMAP_FOREACH(client_sketches[action], cc, const client_sketch_t *,
+                   sketch) {
+      int country = geoip_get_country(cc);
+      unsigned n = client_sketch_estimate(sketch);
+      if (country < 0)
+        country = 0;
+      counts[country] += n;
+      total += n;
+    } STRMAP_FOREACH_END;
+  }
   HT_FOREACH(ent, clientmap, &client_history) {
     int country;
     if ((*ent)->action != (int)action)
@@ -937,6 +1688,8 @@ geoip_reset_dirreq_stats(time_t now)
   SMARTLIST_FOREACH(geoip_countries, geoip_country_t *, c, {
       c->n_v2_ns_requests = c->n_v3_ns_requests = 0;
   });
+  client_sketches_clear(GEOIP_CLIENT_NETWORKSTATUS);
+  client_sketches_clear(GEOIP_CLIENT_NETWORKSTATUS_V2);
   {
     clientmap_entry_t **ent, **next, *this;
     for (ent = HT_START(clientmap, &client_history); ent != NULL;
@@ -1111,7 +1864,7 @@ geoip_dirreq_stats_write(time_t now)
     goto done;
   }
   filename = get_datadir_fname2("stats", "dirreq-stats");
-  if (write_str_to_file(filename, str, 0) < 0)
+  if (write_str_to_file_async(filename, str, 0) < 0)
     log_warn(LD_HIST, "Unable to write dirreq statistics to disk!");
 
   /* Reset measurement interval start. */
@@ -1275,7 +2028,7 @@ geoip_bridge_stats_write(time_t now)
     goto done;
   filename = get_datadir_fname2("stats", "bridge-stats");
 
-  write_str_to_file(filename, bridge_stats_extrainfo, 0);
+  write_str_to_file_async(filename, bridge_stats_extrainfo, 0);
 
   /* Tell the controller, "hey, there are clients!" */
   {
@@ -1404,7 +2157,7 @@ geoip_entry_stats_write(time_t now)
     goto done;
   }
   filename = get_datadir_fname2("stats", "entry-stats");
-  if (write_str_to_file(filename, str, 0) < 0)
+  if (write_str_to_file_async(filename, str, 0) < 0)
     log_warn(LD_HIST, "Unable to write entry statistics to disk!");
 
   /* Reset measurement interval start. */
@@ -1456,15 +2209,26 @@ clear_geoip_db(void)
     SMARTLIST_FOREACH(geoip_entries, geoip_entry_t *, ent, tor_free(ent));
     smartlist_free(geoip_entries);
   }
+  if (geoip_ipv6_entries) {
+    SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, ent,
+                      tor_free(ent));
+    smartlist_free(geoip_ipv6_entries);
+  }
+  geoip_index_free(geoip_index);
   geoip_countries = NULL;
   country_idxplus1_by_lc_code = NULL;
   geoip_entries = NULL;
+  geoip_ipv6_entries = NULL;
+  geoip_index = NULL;
 }
 
 /** Release all storage held in this file. */
 void
 geoip_free_all(void)
 {
+  int action;
+  for (action = 0; action <= GEOIP_CLIENT_NETWORKSTATUS_V2; ++action)
+    client_sketches_clear(action);
   {
     clientmap_entry_t **ent, **next, *this;
     for (ent = HT_START(clientmap, &client_history); ent != NULL; ent = next) {
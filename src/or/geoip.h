@@ -14,10 +14,13 @@
 
 #ifdef GEOIP_PRIVATE
 int geoip_parse_entry(const char *line);
+void geoip_parse_buf(const char *data, size_t len);
 #endif
 int should_record_bridge_info(const or_options_t *options);
 int geoip_load_file(const char *filename, const or_options_t *options);
 int geoip_get_country_by_ip(uint32_t ipaddr);
+int geoip_get_country_by_ipv6(const struct in6_addr *addr);
+int geoip_get_country_by_addr(const tor_addr_t *addr);
 int geoip_get_n_countries(void);
 const char *geoip_get_country_name(country_t num);
 int geoip_is_loaded(void);
@@ -27,6 +30,7 @@ country_t geoip_get_country(const char *countrycode);
 void geoip_note_client_seen(geoip_client_action_t action,
                             uint32_t addr, time_t now);
 void geoip_remove_old_clients(time_t cutoff);
+void geoip_get_client_history_usage(int *n_out, size_t *bytes_out);
 
 void geoip_note_ns_response(geoip_client_action_t action,
                             geoip_ns_response_t response);
@@ -97,6 +97,9 @@ static time_t interval_wakeup_time = 0;
 /** How much bandwidth do we 'expect' to use per minute?  (0 if we have no
  * info from the last period.) */
 static uint64_t expected_bandwidth_usage = 0;
+/** If AccountingPacing is set, the most bytes per second we should read or
+ * write to make our remaining quota last until interval_end_time; else 0. */
+static uint32_t paced_bandwidth_rate = 0;
 /** What unit are we using for our accounting? */
 static time_unit_t cfg_unit = UNIT_MONTH;
 
@@ -478,6 +481,46 @@ time_to_record_bandwidth_usage(time_t now)
   return 0;
 }
 
+/** If AccountingPacing is set, recompute paced_bandwidth_rate from the
+ * bytes left in this interval and the time until it ends. */
+static void
+accounting_update_paced_rate(time_t now)
+{
+  const or_options_t *options = get_options();
+  uint64_t used, left, rate;
+  time_t secs_left;
+
+  if (!options->AccountingPacing || !accounting_is_enabled(options) ||
+      !interval_end_time) {
+    paced_bandwidth_rate = 0;
+    return;
+  }
+  /* We hibernate when either direction reaches AccountingMax, so pace both
+   * directions by the busier one. */
+  used = MAX(n_bytes_read_in_interval, n_bytes_written_in_interval);
+  left = used < options->AccountingMax ? options->AccountingMax - used : 0;
+  secs_left = interval_end_time - now;
+  if (secs_left < 1)
+    secs_left = 1;
+  rate = left / secs_left;
+  /* Zero means "not pacing"; once we're out of bytes, the hard limit puts us
+   * to sleep anyway. */
+  if (rate < 1)
+    rate = 1;
+  if (rate > INT32_MAX)
+    rate = INT32_MAX;
+  paced_bandwidth_rate = (uint32_t)rate;
+}
+
+/** Return the most bytes per second we should read or write in order to
+ * spread our remaining AccountingMax evenly over the rest of the accounting
+ * interval, or 0 if we aren't pacing. */
+uint32_t
+accounting_get_paced_rate(void)
+{
+  return paced_bandwidth_rate;
+}
+
 /** Invoked once per second.  Checks whether it is time to hibernate,
  * record bandwidth used, etc.  */
 void
@@ -486,6 +529,7 @@ accounting_run_housekeeping(time_t now)
   if (now >= interval_end_time) {
     configure_accounting(now);
   }
+  accounting_update_paced_rate(now);
   if (time_to_record_bandwidth_usage(now)) {
     if (accounting_record_bandwidth_usage(now, get_or_state())) {
       log_warn(LD_FS, "Couldn't record bandwidth usage to disk.");
@@ -530,6 +574,21 @@ accounting_set_wakeup_time(void)
     crypto_rand(digest, DIGEST_LEN);
   }
 
+  if (get_options()->AccountingPacing) {
+    char buf1[ISO_TIME_LEN+1];
+    char buf2[ISO_TIME_LEN+1];
+    format_local_iso_time(buf1, interval_start_time);
+    format_local_iso_time(buf2, interval_end_time);
+    interval_wakeup_time = interval_start_time;
+
+    log_notice(LD_ACCT,
+           "Configured hibernation.  This interval begins at %s "
+           "and ends at %s.  We will stay awake and limit our bandwidth "
+           "so that our quota lasts the whole interval.",
+           buf1, buf2);
+    return;
+  }
+
   if (!expected_bandwidth_usage) {
     char buf1[ISO_TIME_LEN+1];
     char buf2[ISO_TIME_LEN+1];
@@ -984,6 +1043,8 @@ getinfo_helper_accounting(control_connection_t *conn,
     *answer = tor_malloc(64);
     tor_snprintf(*answer, 64, U64_FORMAT" "U64_FORMAT,
                  U64_PRINTF_ARG(read_left), U64_PRINTF_ARG(write_left));
+  } else if (!strcmp(question, "accounting/paced-rate")) {
+    tor_asprintf(answer, "%lu", (unsigned long)paced_bandwidth_rate);
   } else if (!strcmp(question, "accounting/interval-start")) {
     *answer = tor_malloc(ISO_TIME_LEN+1);
     format_iso_time(*answer, interval_start_time);
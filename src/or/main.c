@@ -45,13 +45,17 @@
 #include "rephist.h"
 #include "router.h"
 #include "routerlist.h"
+#include "periodic.h"
 #include "routerparse.h"
+#include "sigcache.h"
 #include "status.h"
 #ifdef USE_DMALLOC
 #include <dmalloc.h>
 #include <openssl/crypto.h>
 #endif
 #include "memarea.h"
+#include "mempool.h"
+#include "ht.h"
 
 #ifdef HAVE_EVENT2_EVENT_H
 #include <event2/event.h>
@@ -120,12 +124,58 @@ static unsigned newnym_epoch = 0;
 
 /** Smartlist of all open connections. */
 static smartlist_t *connection_array = NULL;
+/** For each connection type, a list of the connections in connection_array
+ * with that type, so that looking for a connection of one type doesn't
+ * need to look at every connection.  Each connection's conn_type_index is
+ * its index in its list. */
+static smartlist_t *connections_by_type[_CONN_TYPE_MAX+1];
+
+/** An entry in conn_id_map: the connection in connection_array whose
+ * global_identifier is <b>global_identifier</b>. */
+typedef struct conn_id_entry_t {
+  HT_ENTRY(conn_id_entry_t) node;
+  uint64_t global_identifier;
+  connection_t *conn;
+} conn_id_entry_t;
+
+/** Helper for hash tables: return true iff <b>a</b> and <b>b</b> are for
+ * the same global identifier. */
+static INLINE int
+conn_id_entries_eq(conn_id_entry_t *a, conn_id_entry_t *b)
+{
+  return a->global_identifier == b->global_identifier;
+}
+
+/** Helper for hash tables: return a hash of the global identifier in
+ * <b>a</b>. */
+static INLINE unsigned int
+conn_id_entry_hash(conn_id_entry_t *a)
+{
+  return (unsigned)(a->global_identifier ^ (a->global_identifier >> 32));
+}
+
+/** Map from global identifier to connection, for every connection in
+ * connection_array. */
+static HT_HEAD(conn_id_map, conn_id_entry_t) conn_id_map = HT_INITIALIZER();
+HT_PROTOTYPE(conn_id_map, conn_id_entry_t, node, conn_id_entry_hash,
+             conn_id_entries_eq)
+HT_GENERATE(conn_id_map, conn_id_entry_t, node, conn_id_entry_hash,
+            conn_id_entries_eq, 0.6, malloc, realloc, free)
+
 /** List of connections that have been marked for close and need to be freed
  * and removed from connection_array. */
 static smartlist_t *closeable_connection_lst = NULL;
 /** List of linked connections that are currently reading data into their
  * inbuf from their partner's outbuf. */
 static smartlist_t *active_linked_connection_lst = NULL;
+/** If BatchConnectionEvents is set: list of connections that libevent has
+ * said are ready to read or write, which we'll handle once the current
+ * trip through the event loop is done.  See dispatch_batched_connections().
+ */
+static smartlist_t *batched_connection_lst = NULL;
+/** True iff BatchConnectionEvents was set when we last started the event
+ * loop. */
+static int batch_connection_events = 0;
 /** Flag: Set to true iff we entered the current libevent main loop via
  * <b>loop_once</b>. If so, there's no need to trigger a loopexit in order
  * to handle linked connections. */
@@ -216,6 +266,51 @@ set_buffer_lengths_to_zero(tor_socket_t s)
 }
 #endif
 
+/** Add <b>conn</b>, which was just added to connection_array, to the
+ * indexes on connection_array. */
+static void
+connection_add_to_indexes(connection_t *conn)
+{
+  smartlist_t *same_type;
+  conn_id_entry_t *ent;
+
+  tor_assert(conn->type <= _CONN_TYPE_MAX);
+  if (!connections_by_type[conn->type])
+    connections_by_type[conn->type] = smartlist_create();
+  same_type = connections_by_type[conn->type];
+  conn->conn_type_index = smartlist_len(same_type);
+  smartlist_add(same_type, conn);
+
+  ent = tor_malloc_zero(sizeof(conn_id_entry_t));
+  ent->global_identifier = conn->global_identifier;
+  ent->conn = conn;
+  ent = HT_REPLACE(conn_id_map, &conn_id_map, ent);
+  tor_assert(!ent); /* Global identifiers are unique. */
+}
+
+/** Remove <b>conn</b>, which is leaving connection_array, from the indexes
+ * on connection_array. */
+static void
+connection_remove_from_indexes(connection_t *conn)
+{
+  smartlist_t *same_type = connections_by_type[conn->type];
+  conn_id_entry_t search, *ent;
+
+  tor_assert(same_type);
+  tor_assert(smartlist_get(same_type, conn->conn_type_index) == conn);
+  smartlist_del(same_type, conn->conn_type_index);
+  if (conn->conn_type_index < smartlist_len(same_type)) {
+    connection_t *moved = smartlist_get(same_type, conn->conn_type_index);
+    moved->conn_type_index = conn->conn_type_index;
+  }
+  conn->conn_type_index = -1;
+
+  search.global_identifier = conn->global_identifier;
+  ent = HT_REMOVE(conn_id_map, &conn_id_map, &search);
+  tor_assert(ent && ent->conn == conn);
+  tor_free(ent);
+}
+
 /** Add <b>conn</b> to the array of connections that we can poll on.  The
  * connection's socket must be set; the connection starts out
  * non-reading and non-writing.
@@ -260,6 +355,10 @@ connection_add_impl(connection_t *conn, int is_connecting)
         bufferevent_socket_connect(conn->bufev, NULL, 0);
       }
       connection_configure_bufferevent_callbacks(conn);
+      /* OR connections get rate-limited once they have their TLS
+       * bufferevent. */
+      if (conn->type != CONN_TYPE_OR)
+        connection_enable_rate_limiting(conn);
     } else if (conn->linked && conn->linked_conn &&
                connection_type_uses_bufferevent(conn->linked_conn)) {
       tor_assert(!(SOCKET_OK(conn->s)));
@@ -300,6 +399,8 @@ connection_add_impl(connection_t *conn, int is_connecting)
     /* XXXX CHECK FOR NULL RETURN! */
   }
 
+  connection_add_to_indexes(conn);
+
   log_debug(LD_NET,"new conn type %s, socket %d, address %s, n_conns %d.",
             conn_type_to_string(conn->type), (int)conn->s, conn->address,
             smartlist_len(connection_array));
@@ -351,6 +452,11 @@ connection_remove(connection_t *conn)
   tor_assert(conn->conn_array_index >= 0);
   current_index = conn->conn_array_index;
   connection_unregister_events(conn); /* This is redundant, but cheap. */
+  connection_remove_from_indexes(conn);
+  if (conn->batched_read || conn->batched_write) {
+    smartlist_remove(batched_connection_lst, conn);
+    conn->batched_read = conn->batched_write = 0;
+  }
   if (current_index == smartlist_len(connection_array)-1) { /* at the end */
     smartlist_del(connection_array, current_index);
     return 0;
@@ -413,14 +519,17 @@ add_connection_to_closeable_list(connection_t *conn)
 int
 connection_is_on_closeable_list(connection_t *conn)
 {
-  return smartlist_isin(closeable_connection_lst, conn);
+  return closeable_connection_lst &&
+    smartlist_isin(closeable_connection_lst, conn);
 }
 
 /** Return true iff conn is in the current poll array. */
 int
 connection_in_array(connection_t *conn)
 {
-  return smartlist_isin(connection_array, conn);
+  return conn->conn_array_index >= 0 &&
+    conn->conn_array_index < smartlist_len(connection_array) &&
+    smartlist_get(connection_array, conn->conn_array_index) == conn;
 }
 
 /** Set <b>*array</b> to an array of all connections, and <b>*n</b>
@@ -435,6 +544,29 @@ get_connection_array(void)
   return connection_array;
 }
 
+/** Return a list of all the connections in the connection array that have
+ * type <b>type</b>.  The list must not be modified, and is only good until
+ * a connection is added or removed. */
+const smartlist_t *
+get_connection_array_by_type(int type)
+{
+  tor_assert(type >= _CONN_TYPE_MIN && type <= _CONN_TYPE_MAX);
+  if (!connections_by_type[type])
+    connections_by_type[type] = smartlist_create();
+  return connections_by_type[type];
+}
+
+/** Return the connection in the connection array whose global identifier
+ * is <b>id</b>, or NULL if there is none. */
+connection_t *
+get_connection_by_global_id(uint64_t id)
+{
+  conn_id_entry_t search, *ent;
+  search.global_identifier = id;
+  ent = HT_FIND(conn_id_map, &conn_id_map, &search);
+  return ent ? ent->conn : NULL;
+}
+
 /** Provides the traffic read and written over the life of the process. */
 
 uint64_t
@@ -686,20 +818,23 @@ close_closeable_connections(void)
   }
 }
 
-/** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
- * some data to read. */
+/** Handle a read event on <b>conn</b>: read what we can, and close
+ * <b>conn</b> if that fails.  If <b>batched</b>, we're handling a batch of
+ * connections, so use the cached time. */
 static void
-conn_read_callback(evutil_socket_t fd, short event, void *_conn)
+conn_handle_read_event(connection_t *conn, int batched)
 {
-  connection_t *conn = _conn;
-  (void)fd;
-  (void)event;
+  int r;
+  struct timeval start;
 
+  tor_gettimeofday(&start);
   log_debug(LD_NET,"socket %d wants to read.",(int)conn->s);
 
   /* assert_connection_ok(conn, time(NULL)); */
 
-  if (connection_handle_read(conn) < 0) {
+  r = batched ? connection_handle_read_with_cached_time(conn) :
+                connection_handle_read(conn);
+  if (r < 0) {
     if (!conn->marked_for_close) {
 #ifndef MS_WINDOWS
       log_warn(LD_BUG,"Unhandled error on read for %s connection "
@@ -712,27 +847,28 @@ conn_read_callback(evutil_socket_t fd, short event, void *_conn)
       connection_mark_for_close(conn);
     }
   }
-  assert_connection_ok(conn, time(NULL));
-
-  if (smartlist_len(closeable_connection_lst))
-    close_closeable_connections();
+  assert_connection_ok(conn, batched ? approx_time() : time(NULL));
+  rep_hist_note_handler_time(HANDLER_CONN_READ, &start);
 }
 
-/** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
- * some data to write. */
+/** Handle a write event on <b>conn</b>: flush what we can, and close
+ * <b>conn</b> if that fails.  If <b>batched</b>, we're handling a batch of
+ * connections, so use the cached time. */
 static void
-conn_write_callback(evutil_socket_t fd, short events, void *_conn)
+conn_handle_write_event(connection_t *conn, int batched)
 {
-  connection_t *conn = _conn;
-  (void)fd;
-  (void)events;
+  int r;
+  struct timeval start;
 
+  tor_gettimeofday(&start);
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "socket %d wants to write.",
                      (int)conn->s));
 
   /* assert_connection_ok(conn, time(NULL)); */
 
-  if (connection_handle_write(conn, 0) < 0) {
+  r = batched ? connection_handle_write_with_cached_time(conn, 0) :
+                connection_handle_write(conn, 0);
+  if (r < 0) {
     if (!conn->marked_for_close) {
       /* this connection is broken. remove it. */
       log_fn(LOG_WARN,LD_BUG,
@@ -750,7 +886,122 @@ conn_write_callback(evutil_socket_t fd, short events, void *_conn)
       connection_mark_for_close(conn);
     }
   }
-  assert_connection_ok(conn, time(NULL));
+  assert_connection_ok(conn, batched ? approx_time() : time(NULL));
+  rep_hist_note_handler_time(HANDLER_CONN_WRITE, &start);
+}
+
+/** Remember that <b>conn</b> is ready to read (if <b>read</b>) or write
+ * (if <b>write</b>), so that dispatch_batched_connections() will handle
+ * it. */
+static void
+connection_add_to_batch(connection_t *conn, int read, int write)
+{
+  if (!conn->batched_read && !conn->batched_write)
+    smartlist_add(batched_connection_lst, conn);
+  if (read)
+    conn->batched_read = 1;
+  if (write)
+    conn->batched_write = 1;
+}
+
+/** Return the rank of <b>conn</b> when we handle a batch of connections:
+ * lower ranks go first.  Cells come first, since they're most of what a
+ * relay does and their latency matters most. */
+static int
+connection_batch_rank(const connection_t *conn)
+{
+  switch (conn->type) {
+    case CONN_TYPE_OR:
+    case CONN_TYPE_CPUWORKER:
+      return 0;
+    case CONN_TYPE_EXIT:
+    case CONN_TYPE_AP:
+      return 1;
+    case CONN_TYPE_DIR:
+      return 2;
+    default:
+      return 3;
+  }
+}
+
+/** Helper for smartlist_sort: order connections by connection_batch_rank().
+ * */
+static int
+_compare_conns_by_batch_rank(const void **a, const void **b)
+{
+  const connection_t *conn_a = *a, *conn_b = *b;
+  return connection_batch_rank(conn_a) - connection_batch_rank(conn_b);
+}
+
+/** Handle every connection that libevent told us was ready since we last
+ * got here, in order of connection_batch_rank(), reading the clock only
+ * once for all of them.  For each, do any reading before any writing. */
+static void
+dispatch_batched_connections(void)
+{
+  int i;
+
+  if (!smartlist_len(batched_connection_lst))
+    return;
+
+  update_approx_time(time(NULL));
+  tor_gettimeofday_cache_clear();
+  update_approx_monotonic_msec();
+  smartlist_sort(batched_connection_lst, _compare_conns_by_batch_rank);
+
+  /* Nothing here can remove a connection from connection_array until we
+   * close_closeable_connections() at the end, so none of these go away
+   * while we're looking at them. */
+  for (i = 0; i < smartlist_len(batched_connection_lst); ++i) {
+    connection_t *conn = smartlist_get(batched_connection_lst, i);
+    int read = conn->batched_read, write = conn->batched_write;
+    conn->batched_read = conn->batched_write = 0;
+    if (read)
+      conn_handle_read_event(conn, 1);
+    if (write)
+      conn_handle_write_event(conn, 1);
+  }
+  smartlist_clear(batched_connection_lst);
+
+  if (smartlist_len(closeable_connection_lst))
+    close_closeable_connections();
+}
+
+/** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
+ * some data to read. */
+static void
+conn_read_callback(evutil_socket_t fd, short event, void *_conn)
+{
+  connection_t *conn = _conn;
+  (void)fd;
+  (void)event;
+
+  if (batch_connection_events) {
+    connection_add_to_batch(conn, 1, 0);
+    return;
+  }
+
+  conn_handle_read_event(conn, 0);
+
+  if (smartlist_len(closeable_connection_lst))
+    close_closeable_connections();
+}
+
+/** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
+ * some data to write. */
+static void
+conn_write_callback(evutil_socket_t fd, short events, void *_conn)
+{
+  connection_t *conn = _conn;
+  (void)fd;
+  (void)events;
+
+  if (batch_connection_events) {
+    connection_add_to_batch(conn, 0, 1);
+    return;
+  }
+
+  conn_handle_write_event(conn, 0);
 
   if (smartlist_len(closeable_connection_lst))
     close_closeable_connections();
@@ -970,6 +1221,21 @@ run_connection_housekeeping(int i, time_t now)
     return;
   }
 
+  if (connection_dir_is_idle_expired(conn, now)) {
+    log_info(LD_DIR,"Closing idle directory conn (fd %d)", (int)conn->s);
+    connection_mark_for_close(conn);
+    return;
+  }
+
+  if (connection_dir_is_slow_descriptor_fetch(conn, now)) {
+    /* Closing it counts as a failure, so the descriptors we asked for
+     * become downloadable again and go to somebody faster. */
+    log_info(LD_DIR,"Giving up on slow descriptor download from %s:%d "
+             "(fd %d)", conn->address, conn->port, (int)conn->s);
+    connection_mark_for_close(conn);
+    return;
+  }
+
   /* Expire any directory connections that haven't been active (sent
    * if a server or received if a client) for 5 min */
   if (conn->type == CONN_TYPE_DIR &&
@@ -1087,104 +1353,90 @@ get_signewnym_epoch(void)
   return newnym_epoch;
 }
 
-/** Perform regular maintenance tasks.  This function gets run once per
- * second by second_elapsed_callback().
- */
-static void
-run_scheduled_events(time_t now)
+/** Return the number of seconds from <b>now</b> until the first second after
+ * <b>when</b>, or 1 if that has already passed.  Periodic events that used
+ * to check "time_to_x &lt; now" every second use this to sleep until they'd
+ * next have found something to do. */
+static int
+seconds_until_after(time_t now, time_t when)
 {
-  static time_t last_rotated_x509_certificate = 0;
-  static time_t time_to_check_v3_certificate = 0;
-  static time_t time_to_check_listeners = 0;
-  static time_t time_to_check_descriptor = 0;
-  static time_t time_to_check_ipaddress = 0;
-  static time_t time_to_shrink_memory = 0;
-  static time_t time_to_try_getting_descriptors = 0;
-  static time_t time_to_reset_descriptor_failures = 0;
-  static time_t time_to_add_entropy = 0;
-  static time_t time_to_write_bridge_status_file = 0;
-  static time_t time_to_downrate_stability = 0;
-  static time_t time_to_save_stability = 0;
-  static time_t time_to_clean_caches = 0;
-  static time_t time_to_recheck_bandwidth = 0;
-  static time_t time_to_check_for_expired_networkstatus = 0;
-  static time_t time_to_write_stats_files = 0;
-  static time_t time_to_write_bridge_stats = 0;
-  static time_t time_to_check_port_forwarding = 0;
-  static time_t time_to_launch_reachability_tests = 0;
-  static int should_init_bridge_stats = 1;
-  static time_t time_to_retry_dns_init = 0;
-  static time_t time_to_next_heartbeat = 0;
-  static int has_validated_pt = 0;
-  const or_options_t *options = get_options();
-
-  int is_server = server_mode(options);
-  int i;
-  int have_dir_info;
+  if (when < now)
+    return 1;
+  if (when - now >= INT_MAX)
+    return INT_MAX;
+  return (int)(when - now) + 1;
+}
 
-  /** 0. See if we've been asked to shut down and our timeout has
-   * expired; or if our bandwidth limits are exhausted and we
-   * should hibernate; or if it's time to wake up from hibernation.
-   */
-  consider_hibernation(now);
+/** How long do periodic events whose work our options have turned off wait
+ * before checking again?  We reschedule every event whenever our options
+ * change, so this only matters if something else turns the work back on. */
+#define PERIODIC_EVENT_IDLE_INTERVAL (60*60)
 
-#if 0
-  {
-    static time_t nl_check_time = 0;
-    if (nl_check_time <= now) {
-      nodelist_assert_ok();
-      nl_check_time = now + 30;
-    }
-  }
-#endif
-
-  /* 0b. If we've deferred a signewnym, make sure it gets handled
-   * eventually. */
-  if (signewnym_is_pending &&
-      time_of_last_signewnym + MAX_SIGNEWNYM_RATE <= now) {
-    log(LOG_INFO, LD_CONTROL, "Honoring delayed NEWNYM request");
-    signewnym_impl(now);
-  }
+/** Periodic event: every MIN_ONION_KEY_LIFETIME seconds, rotate the onion
+ * keys, shut down and restart all cpuworkers, and update the directory if
+ * necessary. */
+static int
+rotate_onion_key_callback(time_t now, const or_options_t *options)
+{
+  time_t rotation_time;
+  if (!server_mode(options))
+    return PERIODIC_EVENT_IDLE_INTERVAL;
+
+  rotation_time = get_onion_key_set_at()+MIN_ONION_KEY_LIFETIME;
+  if (rotation_time >= now)
+    return seconds_until_after(now, rotation_time);
+
+  log_info(LD_GENERAL,"Rotating onion key.");
+  rotate_onion_key();
+  cpuworkers_rotate();
+  if (router_rebuild_descriptor(1)<0) {
+    log_info(LD_CONFIG, "Couldn't rebuild router descriptor");
+  }
+  if (advertised_server_mode() & !options->DisableNetwork)
+    router_upload_dir_desc_to_dirservers(0);
+  return seconds_until_after(now, get_onion_key_set_at() +
+                             MIN_ONION_KEY_LIFETIME);
+}
 
-  /* 0c. If we've deferred log messages for the controller, handle them now */
-  flush_pending_log_callbacks();
+/** Periodic event: launch any router descriptor downloads we need. */
+static int
+launch_descriptor_fetches_callback(time_t now, const or_options_t *options)
+{
+  if (options->DisableNetwork)
+    return PERIODIC_EVENT_IDLE_INTERVAL;
 
-  /** 1a. Every MIN_ONION_KEY_LIFETIME seconds, rotate the onion keys,
-   *  shut down and restart all cpuworkers, and update the directory if
-   *  necessary.
-   */
-  if (is_server &&
-      get_onion_key_set_at()+MIN_ONION_KEY_LIFETIME < now) {
-    log_info(LD_GENERAL,"Rotating onion key.");
-    rotate_onion_key();
-    cpuworkers_rotate();
-    if (router_rebuild_descriptor(1)<0) {
-      log_info(LD_CONFIG, "Couldn't rebuild router descriptor");
-    }
-    if (advertised_server_mode() & !options->DisableNetwork)
-      router_upload_dir_desc_to_dirservers(0);
-  }
+  update_all_descriptor_downloads(now);
+  update_extrainfo_downloads(now);
+  if (router_have_minimum_dir_info())
+    return LAZY_DESCRIPTOR_RETRY_INTERVAL + 1;
+  else
+    return GREEDY_DESCRIPTOR_RETRY_INTERVAL + 1;
+}
 
-  if (!options->DisableNetwork && time_to_try_getting_descriptors < now) {
-    update_all_descriptor_downloads(now);
-    update_extrainfo_downloads(now);
-    if (router_have_minimum_dir_info())
-      time_to_try_getting_descriptors = now + LAZY_DESCRIPTOR_RETRY_INTERVAL;
-    else
-      time_to_try_getting_descriptors = now + GREEDY_DESCRIPTOR_RETRY_INTERVAL;
-  }
+/** Periodic event: forget which descriptor downloads have failed, so that
+ * we retry them. */
+static int
+reset_descriptor_failures_callback(time_t now, const or_options_t *options)
+{
+  static time_t time_to_reset_descriptor_failures = 0;
+  (void)options;
 
   if (time_to_reset_descriptor_failures < now) {
     router_reset_descriptor_download_failures();
     time_to_reset_descriptor_failures =
       now + DESCRIPTOR_FAILURE_RESET_INTERVAL;
   }
+  return seconds_until_after(now, time_to_reset_descriptor_failures);
+}
 
-  if (options->UseBridges)
-    fetch_bridge_descriptors(options, now);
+/** Periodic event: every MAX_SSL_KEY_LIFETIME_INTERNAL seconds, we change
+ * our TLS context. */
+static int
+rotate_x509_certificate_callback(time_t now, const or_options_t *options)
+{
+  static time_t last_rotated_x509_certificate = 0;
+  (void)options;
 
-  /** 1b. Every MAX_SSL_KEY_LIFETIME_INTERNAL seconds, we change our
-   * TLS context. */
   if (!last_rotated_x509_certificate)
     last_rotated_x509_certificate = now;
   if (last_rotated_x509_certificate+MAX_SSL_KEY_LIFETIME_INTERNAL < now) {
@@ -1198,6 +1450,16 @@ run_scheduled_events(time_t now)
      * been up for too long -- but that's done via is_bad_for_new_circs in
      * connection_run_housekeeping() above. */
   }
+  return seconds_until_after(now, last_rotated_x509_certificate +
+                             MAX_SSL_KEY_LIFETIME_INTERNAL);
+}
+
+/** Periodic event: add more entropy to OpenSSL's RNG pool. */
+static int
+add_entropy_callback(time_t now, const or_options_t *options)
+{
+  static time_t time_to_add_entropy = 0;
+  (void)options;
 
   if (time_to_add_entropy < now) {
     if (time_to_add_entropy) {
@@ -1208,61 +1470,90 @@ run_scheduled_events(time_t now)
 #define ENTROPY_INTERVAL (60*60)
     time_to_add_entropy = now + ENTROPY_INTERVAL;
   }
+  return seconds_until_after(now, time_to_add_entropy);
+}
 
-  /** 1c. If we have to change the accounting interval or record
-   * bandwidth used in this accounting interval, do so. */
-  if (accounting_is_enabled(options))
-    accounting_run_housekeeping(now);
+/** Periodic event: if we're an authority that tests reachability, try to
+ * determine reachability of the other Tor relays. */
+static int
+launch_reachability_tests_callback(time_t now, const or_options_t *options)
+{
+  if (!authdir_mode_tests_reachability(options))
+    return PERIODIC_EVENT_IDLE_INTERVAL;
+  if (net_is_disabled())
+    return 1;
 
-  if (time_to_launch_reachability_tests < now &&
-      (authdir_mode_tests_reachability(options)) &&
-       !net_is_disabled()) {
-    time_to_launch_reachability_tests = now + REACHABILITY_TEST_INTERVAL;
-    /* try to determine reachability of the other Tor relays */
-    dirserv_test_reachability(now);
-  }
-
-  /** 1d. Periodically, we discount older stability information so that new
-   * stability info counts more, and save the stability information to disk as
-   * appropriate. */
-  if (time_to_downrate_stability < now)
-    time_to_downrate_stability = rep_hist_downrate_old_runs(now);
-  if (authdir_mode_tests_reachability(options)) {
-    if (time_to_save_stability < now) {
-      if (time_to_save_stability && rep_hist_record_mtbf_data(now, 1)<0) {
-        log_warn(LD_GENERAL, "Couldn't store mtbf data.");
-      }
-#define SAVE_STABILITY_INTERVAL (30*60)
-      time_to_save_stability = now + SAVE_STABILITY_INTERVAL;
+  dirserv_test_reachability(now);
+  return REACHABILITY_TEST_INTERVAL + 1;
+}
+
+/** Periodic event: discount older stability information so that new
+ * stability info counts more. */
+static int
+downrate_stability_callback(time_t now, const or_options_t *options)
+{
+  (void)options;
+  return seconds_until_after(now, rep_hist_downrate_old_runs(now));
+}
+
+/** Periodic event: if we're an authority that tests reachability, save the
+ * stability information to disk. */
+static int
+save_stability_callback(time_t now, const or_options_t *options)
+{
+  static time_t time_to_save_stability = 0;
+
+  if (!authdir_mode_tests_reachability(options))
+    return PERIODIC_EVENT_IDLE_INTERVAL;
+
+  if (time_to_save_stability < now) {
+    if (time_to_save_stability && rep_hist_record_mtbf_data(now, 1)<0) {
+      log_warn(LD_GENERAL, "Couldn't store mtbf data.");
     }
+#define SAVE_STABILITY_INTERVAL (30*60)
+    time_to_save_stability = now + SAVE_STABILITY_INTERVAL;
   }
+  return seconds_until_after(now, time_to_save_stability);
+}
+
+/** Periodic event: if we're a v3 authority, check whether our cert is close
+ * to expiring and warn the admin if it is. */
+static int
+check_authority_cert_callback(time_t now, const or_options_t *options)
+{
+  (void)now;
+  (void)options;
 
-  /* 1e. Periodically, if we're a v3 authority, we check whether our cert is
-   * close to expiring and warn the admin if it is. */
-  if (time_to_check_v3_certificate < now) {
-    v3_authority_check_key_expiry();
+  v3_authority_check_key_expiry();
 #define CHECK_V3_CERTIFICATE_INTERVAL (5*60)
-    time_to_check_v3_certificate = now + CHECK_V3_CERTIFICATE_INTERVAL;
-  }
+  return CHECK_V3_CERTIFICATE_INTERVAL + 1;
+}
 
-  /* 1f. Check whether our networkstatus has expired.
-   */
-  if (time_to_check_for_expired_networkstatus < now) {
-    networkstatus_t *ns = networkstatus_get_latest_consensus();
-    /*XXXX RD: This value needs to be the same as REASONABLY_LIVE_TIME in
-     * networkstatus_get_reasonably_live_consensus(), but that value is way
-     * way too high.  Arma: is the bridge issue there resolved yet? -NM */
+/** Periodic event: check whether our networkstatus has expired. */
+static int
+check_expired_networkstatus_callback(time_t now, const or_options_t *options)
+{
+  networkstatus_t *ns = networkstatus_get_latest_consensus();
+  (void)options;
+
+  /*XXXX RD: This value needs to be the same as REASONABLY_LIVE_TIME in
+   * networkstatus_get_reasonably_live_consensus(), but that value is way
+   * way too high.  Arma: is the bridge issue there resolved yet? -NM */
 #define NS_EXPIRY_SLOP (24*60*60)
-    if (ns && ns->valid_until < now+NS_EXPIRY_SLOP &&
-        router_have_minimum_dir_info()) {
-      router_dir_info_changed();
-    }
-#define CHECK_EXPIRED_NS_INTERVAL (2*60)
-    time_to_check_for_expired_networkstatus = now + CHECK_EXPIRED_NS_INTERVAL;
+  if (ns && ns->valid_until < now+NS_EXPIRY_SLOP &&
+      router_have_minimum_dir_info()) {
+    router_dir_info_changed();
   }
+#define CHECK_EXPIRED_NS_INTERVAL (2*60)
+  return CHECK_EXPIRED_NS_INTERVAL + 1;
+}
+
+/** Periodic event: write statistics to disk when they're due. */
+static int
+write_stats_file_callback(time_t now, const or_options_t *options)
+{
+  static time_t time_to_write_stats_files = 0;
 
-  /* 1g. Check whether we should write statistics to disk.
-   */
   if (time_to_write_stats_files < now) {
 #define CHECK_WRITE_STATS_INTERVAL (60*60)
     time_t next_time_to_write_stats_files = (time_to_write_stats_files > 0 ?
@@ -1300,49 +1591,72 @@ run_scheduled_events(time_t now)
     }
     time_to_write_stats_files = next_time_to_write_stats_files;
   }
+  return seconds_until_after(now, time_to_write_stats_files);
+}
 
-  /* 1h. Check whether we should write bridge statistics to disk.
-   */
-  if (should_record_bridge_info(options)) {
-    if (time_to_write_bridge_stats < now) {
-      if (should_init_bridge_stats) {
-        /* (Re-)initialize bridge statistics. */
-        geoip_bridge_stats_init(now);
-        time_to_write_bridge_stats = now + WRITE_STATS_INTERVAL;
-        should_init_bridge_stats = 0;
-      } else {
-        /* Possibly write bridge statistics to disk and ask when to write
-         * them next time. */
-        time_to_write_bridge_stats = geoip_bridge_stats_write(
-                                           time_to_write_bridge_stats);
-      }
-    }
-  } else if (!should_init_bridge_stats) {
+/** Periodic event: if we're a bridge, write bridge statistics to disk when
+ * they're due. */
+static int
+record_bridge_stats_callback(time_t now, const or_options_t *options)
+{
+  static time_t time_to_write_bridge_stats = 0;
+  static int should_init_bridge_stats = 1;
+
+  if (!should_record_bridge_info(options)) {
     /* Bridge mode was turned off. Ensure that stats are re-initialized
      * next time bridge mode is turned on. */
     should_init_bridge_stats = 1;
+    return PERIODIC_EVENT_IDLE_INTERVAL;
   }
 
-  /* Remove old information from rephist and the rend cache. */
-  if (time_to_clean_caches < now) {
-    rep_history_clean(now - options->RephistTrackTime);
-    rend_cache_clean(now);
-    rend_cache_clean_v2_descs_as_dir(now);
-    microdesc_cache_rebuild(NULL, 0);
-#define CLEAN_CACHES_INTERVAL (30*60)
-    time_to_clean_caches = now + CLEAN_CACHES_INTERVAL;
+  if (time_to_write_bridge_stats < now) {
+    if (should_init_bridge_stats) {
+      /* (Re-)initialize bridge statistics. */
+      geoip_bridge_stats_init(now);
+      time_to_write_bridge_stats = now + WRITE_STATS_INTERVAL;
+      should_init_bridge_stats = 0;
+    } else {
+      /* Possibly write bridge statistics to disk and ask when to write
+       * them next time. */
+      time_to_write_bridge_stats = geoip_bridge_stats_write(
+                                         time_to_write_bridge_stats);
+    }
   }
+  return seconds_until_after(now, time_to_write_bridge_stats);
+}
 
-#define RETRY_DNS_INTERVAL (10*60)
-  /* If we're a server and initializing dns failed, retry periodically. */
-  if (time_to_retry_dns_init < now) {
-    time_to_retry_dns_init = now + RETRY_DNS_INTERVAL;
-    if (is_server && has_dns_init_failed())
-      dns_init();
-  }
+/** Periodic event: remove old information from the rend cache. */
+static int
+clean_caches_callback(time_t now, const or_options_t *options)
+{
+  (void)options;
+  rend_cache_clean(now);
+  rend_cache_clean_v2_descs_as_dir(now);
+  microdesc_cache_rebuild(NULL, 0);
+#define CLEAN_CACHES_INTERVAL (30*60)
+  return CLEAN_CACHES_INTERVAL + 1;
+}
 
-  /** 2. Periodically, we consider force-uploading our descriptor
-   * (if we've passed our internal checks). */
+/** Periodic event: remove old information from rephist.  Each call only
+ * does a bounded amount of work, so we run it often. */
+static int
+clean_rephist_callback(time_t now, const or_options_t *options)
+{
+  rep_history_clean(now - options->RephistTrackTime);
+#define CLEAN_REPHIST_INTERVAL 60
+  return CLEAN_REPHIST_INTERVAL + 1;
+}
+
+/** Periodic event: if we're a server and initializing dns failed, retry. */
+static int
+retry_dns_callback(time_t now, const or_options_t *options)
+{
+  (void)now;
+#define RETRY_DNS_INTERVAL (10*60)
+  if (server_mode(options) && has_dns_init_failed())
+    dns_init();
+  return RETRY_DNS_INTERVAL + 1;
+}
 
 /** How often do we check whether part of our router info has changed in a way
  * that would require an upload? */
@@ -1350,56 +1664,318 @@ run_scheduled_events(time_t now)
 /** How often do we (as a router) check whether our IP address has changed? */
 #define CHECK_IPADDRESS_INTERVAL (15*60)
 
-  /* 2b. Once per minute, regenerate and upload the descriptor if the old
-   * one is inaccurate. */
-  if (time_to_check_descriptor < now && !options->DisableNetwork) {
-    static int dirport_reachability_count = 0;
-    time_to_check_descriptor = now + CHECK_DESCRIPTOR_INTERVAL;
-    check_descriptor_bandwidth_changed(now);
-    if (time_to_check_ipaddress < now) {
-      time_to_check_ipaddress = now + CHECK_IPADDRESS_INTERVAL;
-      check_descriptor_ipaddress_changed(now);
-    }
-    mark_my_descriptor_dirty_if_too_old(now);
-    consider_publishable_server(0);
-    /* also, check religiously for reachability, if it's within the first
-     * 20 minutes of our uptime. */
-    if (is_server &&
-        (can_complete_circuit || !any_predicted_circuits(now)) &&
-        !we_are_hibernating()) {
-      if (stats_n_seconds_working < TIMEOUT_UNTIL_UNREACHABILITY_COMPLAINT) {
-        consider_testing_reachability(1, dirport_reachability_count==0);
-        if (++dirport_reachability_count > 5)
-          dirport_reachability_count = 0;
-      } else if (time_to_recheck_bandwidth < now) {
-        /* If we haven't checked for 12 hours and our bandwidth estimate is
-         * low, do another bandwidth test. This is especially important for
-         * bridges, since they might go long periods without much use. */
-        const routerinfo_t *me = router_get_my_routerinfo();
-        if (time_to_recheck_bandwidth && me &&
-            me->bandwidthcapacity < me->bandwidthrate &&
-            me->bandwidthcapacity < 51200) {
-          reset_bandwidth_test();
-        }
-#define BANDWIDTH_RECHECK_INTERVAL (12*60*60)
-        time_to_recheck_bandwidth = now + BANDWIDTH_RECHECK_INTERVAL;
+/** Periodic event: once per minute, regenerate and upload the descriptor if
+ * the old one is inaccurate, and check whether we want to download any
+ * networkstatus documents. */
+static int
+check_descriptor_callback(time_t now, const or_options_t *options)
+{
+  static int dirport_reachability_count = 0;
+  static time_t time_to_check_ipaddress = 0;
+  static time_t time_to_recheck_bandwidth = 0;
+
+  if (options->DisableNetwork)
+    return PERIODIC_EVENT_IDLE_INTERVAL;
+
+  check_descriptor_bandwidth_changed(now);
+  if (time_to_check_ipaddress < now) {
+    time_to_check_ipaddress = now + CHECK_IPADDRESS_INTERVAL;
+    check_descriptor_ipaddress_changed(now);
+  }
+  mark_my_descriptor_dirty_if_too_old(now);
+  consider_publishable_server(0);
+  /* also, check religiously for reachability, if it's within the first
+   * 20 minutes of our uptime. */
+  if (server_mode(options) &&
+      (can_complete_circuit || !any_predicted_circuits(now)) &&
+      !we_are_hibernating()) {
+    if (stats_n_seconds_working < TIMEOUT_UNTIL_UNREACHABILITY_COMPLAINT) {
+      consider_testing_reachability(1, dirport_reachability_count==0);
+      if (++dirport_reachability_count > 5)
+        dirport_reachability_count = 0;
+    } else if (time_to_recheck_bandwidth < now) {
+      /* If we haven't checked for 12 hours and our bandwidth estimate is
+       * low, do another bandwidth test. This is especially important for
+       * bridges, since they might go long periods without much use. */
+      const routerinfo_t *me = router_get_my_routerinfo();
+      if (time_to_recheck_bandwidth && me &&
+          me->bandwidthcapacity < me->bandwidthrate &&
+          me->bandwidthcapacity < 51200) {
+        reset_bandwidth_test();
       }
+#define BANDWIDTH_RECHECK_INTERVAL (12*60*60)
+      time_to_recheck_bandwidth = now + BANDWIDTH_RECHECK_INTERVAL;
     }
+  }
+
+  /* If any networkstatus documents are no longer recent, we need to
+   * update all the descriptors' running status. */
+  /* purge obsolete entries */
+  networkstatus_v2_list_clean(now);
+  /* Remove dead routers. */
+  routerlist_remove_old_routers();
+
+  /* Also, once per minute, check whether we want to download any
+   * networkstatus documents.
+   */
+  update_networkstatus_downloads(now);
+  return CHECK_DESCRIPTOR_INTERVAL + 1;
+}
 
-    /* If any networkstatus documents are no longer recent, we need to
-     * update all the descriptors' running status. */
-    /* purge obsolete entries */
-    networkstatus_v2_list_clean(now);
-    /* Remove dead routers. */
-    routerlist_remove_old_routers();
+/** Periodic event: every 60 seconds, we relaunch listeners if any died. */
+static int
+check_listeners_callback(time_t now, const or_options_t *options)
+{
+  (void)now;
+  (void)options;
+  if (net_is_disabled())
+    return 1;
+  retry_all_listeners(NULL, NULL);
+  return 60 + 1;
+}
 
-    /* Also, once per minute, check whether we want to download any
-     * networkstatus documents.
-     */
-    update_networkstatus_downloads(now);
+/** Periodic event: check buffers and pools for empty space that can be
+ * deallocated. */
+static int
+shrink_memory_callback(time_t now, const or_options_t *options)
+{
+  (void)now;
+  (void)options;
+  SMARTLIST_FOREACH(connection_array, connection_t *, conn, {
+      if (conn->outbuf)
+        buf_shrink(conn->outbuf);
+      if (conn->inbuf)
+        buf_shrink(conn->inbuf);
+    });
+  clean_cell_pool();
+  circuit_clean_pools();
+  buf_shrink_freelists(0);
+/** How often do we check buffers and pools for empty space that can be
+ * deallocated? */
+#define MEM_SHRINK_INTERVAL (60)
+  return MEM_SHRINK_INTERVAL + 1;
+}
+
+/** Periodic event: if we're a server, check whether our DNS is telling
+ * stories to us. */
+static int
+check_dns_honesty_callback(time_t now, const or_options_t *options)
+{
+  if (!public_server_mode(options))
+    return PERIODIC_EVENT_IDLE_INTERVAL;
+  if (net_is_disabled())
+    return 1;
+
+  if (time_to_check_for_correct_dns < now) {
+    if (!time_to_check_for_correct_dns) {
+      time_to_check_for_correct_dns = now + 60 + crypto_rand_int(120);
+    } else {
+      dns_launch_correctness_checks();
+      time_to_check_for_correct_dns = now + 12*3600 +
+        crypto_rand_int(12*3600);
+    }
   }
+  return seconds_until_after(now, time_to_check_for_correct_dns);
+}
+
+/** Periodic event: if we're a bridge authority, write the bridge
+ * networkstatus file to disk. */
+static int
+write_bridge_ns_callback(time_t now, const or_options_t *options)
+{
+  if (!options->BridgeAuthoritativeDir)
+    return PERIODIC_EVENT_IDLE_INTERVAL;
+
+  networkstatus_dump_bridge_status_to_file(now);
+#define BRIDGE_STATUSFILE_INTERVAL (30*60)
+  return BRIDGE_STATUSFILE_INTERVAL + 1;
+}
+
+/** Periodic event: if we're a v3 authority with a measured bandwidth file,
+ * read it again whenever it changes, so that it's ready when we vote. */
+static int
+refresh_measured_bw_callback(time_t now, const or_options_t *options)
+{
+  (void)now;
+  if (!authdir_mode_v3(options) || !options->V3BandwidthsFile)
+    return PERIODIC_EVENT_IDLE_INTERVAL;
+
+  dirserv_refresh_measured_bw_cache(options->V3BandwidthsFile);
+#define MEASURED_BW_REFRESH_INTERVAL 60
+  return MEASURED_BW_REFRESH_INTERVAL + 1;
+}
 
-  /** 2c. Let directory voting happen. */
+/** Periodic event: check the port forwarding app. */
+static int
+check_fw_helper_app_callback(time_t now, const or_options_t *options)
+{
+  if (!options->PortForwarding || !server_mode(options))
+    return PERIODIC_EVENT_IDLE_INTERVAL;
+  if (net_is_disabled())
+    return 1;
+
+#define PORT_FORWARDING_CHECK_INTERVAL 5
+  /* XXXXX this should take a list of ports, not just two! */
+  tor_check_port_forwarding(options->PortForwardingHelper,
+                            get_primary_dir_port(),
+                            get_primary_or_port(),
+                            now);
+  return PORT_FORWARDING_CHECK_INTERVAL + 1;
+}
+
+/** Periodic event: write the heartbeat message. */
+static int
+heartbeat_callback(time_t now, const or_options_t *options)
+{
+  static time_t time_to_next_heartbeat = 0;
+
+  if (!options->HeartbeatPeriod)
+    return PERIODIC_EVENT_IDLE_INTERVAL;
+
+  if (time_to_next_heartbeat < now) {
+    log_heartbeat(now);
+    time_to_next_heartbeat = now+options->HeartbeatPeriod;
+  }
+  return seconds_until_after(now, time_to_next_heartbeat);
+}
+
+/** Periodic event: if MetricsFile is set, rewrite it. */
+static int
+write_metrics_callback(time_t now, const or_options_t *options)
+{
+  if (!options->MetricsFile)
+    return PERIODIC_EVENT_IDLE_INTERVAL;
+  write_metrics_file(now);
+  return options->MetricsPeriod;
+}
+
+/** Every housekeeping task that doesn't need to run every second, each on
+ * its own schedule. */
+static periodic_event_item_t periodic_events[] = {
+  PERIODIC_EVENT(rotate_onion_key),
+  PERIODIC_EVENT(launch_descriptor_fetches),
+  PERIODIC_EVENT(reset_descriptor_failures),
+  PERIODIC_EVENT(rotate_x509_certificate),
+  PERIODIC_EVENT(add_entropy),
+  PERIODIC_EVENT(launch_reachability_tests),
+  PERIODIC_EVENT(downrate_stability),
+  PERIODIC_EVENT(save_stability),
+  PERIODIC_EVENT(check_authority_cert),
+  PERIODIC_EVENT(check_expired_networkstatus),
+  PERIODIC_EVENT(write_stats_file),
+  PERIODIC_EVENT(record_bridge_stats),
+  PERIODIC_EVENT(clean_caches),
+  PERIODIC_EVENT(clean_rephist),
+  PERIODIC_EVENT(retry_dns),
+  PERIODIC_EVENT(check_descriptor),
+  PERIODIC_EVENT(check_listeners),
+  PERIODIC_EVENT(shrink_memory),
+  PERIODIC_EVENT(check_dns_honesty),
+  PERIODIC_EVENT(write_bridge_ns),
+  PERIODIC_EVENT(refresh_measured_bw),
+  PERIODIC_EVENT(check_fw_helper_app),
+  PERIODIC_EVENT(heartbeat),
+  PERIODIC_EVENT(write_metrics),
+  END_OF_PERIODIC_EVENTS
+};
+
+/** The periodic event for check_dns_honesty_callback(), so that
+ * dns_servers_relaunch_checks() can hurry it up. */
+static periodic_event_item_t *check_dns_honesty_event = NULL;
+/** The periodic event for launch_descriptor_fetches_callback(), so that
+ * reschedule_descriptor_fetches() can hurry it up. */
+static periodic_event_item_t *launch_descriptor_fetches_event = NULL;
+
+/** Start every periodic event. */
+static void
+periodic_events_launch_all(void)
+{
+  int i;
+  for (i = 0; periodic_events[i].fn; ++i) {
+    periodic_event_launch(&periodic_events[i]);
+    if (periodic_events[i].fn == check_dns_honesty_callback)
+      check_dns_honesty_event = &periodic_events[i];
+    else if (periodic_events[i].fn == launch_descriptor_fetches_callback)
+      launch_descriptor_fetches_event = &periodic_events[i];
+  }
+}
+
+/** Make every periodic event check again soon whether it has anything to
+ * do.  We call this when our options change, or when the clock jumps. */
+void
+periodic_events_reschedule_all(void)
+{
+  int i;
+  for (i = 0; periodic_events[i].fn; ++i)
+    periodic_event_reschedule(&periodic_events[i]);
+}
+
+/** Stop every periodic event, and release their timers. */
+static void
+periodic_events_free_all(void)
+{
+  int i;
+  for (i = 0; periodic_events[i].fn; ++i)
+    periodic_event_stop(&periodic_events[i]);
+  check_dns_honesty_event = NULL;
+  launch_descriptor_fetches_event = NULL;
+}
+
+/** Perform the maintenance tasks that need to happen every second.  This
+ * function gets run once per second by second_elapsed_callback().
+ * Everything on a slower schedule is in periodic_events.
+ */
+static void
+run_scheduled_events(time_t now)
+{
+  static int has_validated_pt = 0;
+  const or_options_t *options = get_options();
+
+  int is_server = server_mode(options);
+  int i;
+  int have_dir_info;
+
+  /** 0. See if we've been asked to shut down and our timeout has
+   * expired; or if our bandwidth limits are exhausted and we
+   * should hibernate; or if it's time to wake up from hibernation.
+   */
+  consider_hibernation(now);
+
+#if 0
+  {
+    static time_t nl_check_time = 0;
+    if (nl_check_time <= now) {
+      nodelist_assert_ok();
+      nl_check_time = now + 30;
+    }
+  }
+#endif
+
+  /* 0b. If we've deferred a signewnym, make sure it gets handled
+   * eventually. */
+  if (signewnym_is_pending &&
+      time_of_last_signewnym + MAX_SIGNEWNYM_RATE <= now) {
+    log(LOG_INFO, LD_CONTROL, "Honoring delayed NEWNYM request");
+    signewnym_impl(now);
+  }
+
+  /* 0c. If we've deferred log messages for the controller, handle them now */
+  flush_pending_log_callbacks();
+
+  /** 1a. Keep track of how busy our cpuworkers are, and adjust how many
+   * we run if we're supposed to. */
+  if (is_server)
+    cpuworkers_adjust(now);
+
+  if (options->UseBridges)
+    fetch_bridge_descriptors(options, now);
+
+  /** 1b. If we have to change the accounting interval or record
+   * bandwidth used in this accounting interval, do so. */
+  if (accounting_is_enabled(options))
+    accounting_run_housekeeping(now);
+
+  /** 2. Let directory voting happen. */
   if (authdir_mode_v3(options))
     dirvote_act(options, now);
 
@@ -1426,12 +2002,6 @@ run_scheduled_events(time_t now)
    */
   connection_expire_held_open();
 
-  /** 3d. And every 60 seconds, we relaunch listeners if any died. */
-  if (!net_is_disabled() && time_to_check_listeners < now) {
-    retry_all_listeners(NULL, NULL);
-    time_to_check_listeners = now+60;
-  }
-
   /** 4. Every second, we try a new circuit if there are no valid
    *    circuits. Every NewCircuitPeriod seconds, we expire circuits
    *    that became dirty more than MaxCircuitDirtiness seconds ago,
@@ -1450,20 +2020,6 @@ run_scheduled_events(time_t now)
   for (i=0;i<smartlist_len(connection_array);i++) {
     run_connection_housekeeping(i, now);
   }
-  if (time_to_shrink_memory < now) {
-    SMARTLIST_FOREACH(connection_array, connection_t *, conn, {
-        if (conn->outbuf)
-          buf_shrink(conn->outbuf);
-        if (conn->inbuf)
-          buf_shrink(conn->inbuf);
-      });
-    clean_cell_pool();
-    buf_shrink_freelists(0);
-/** How often do we check buffers and pools for empty space that can be
- * deallocated? */
-#define MEM_SHRINK_INTERVAL (60)
-    time_to_shrink_memory = now + MEM_SHRINK_INTERVAL;
-  }
 
   /** 6. And remove any marked circuits... */
   circuit_close_all_marked();
@@ -1483,60 +2039,19 @@ run_scheduled_events(time_t now)
   /** 8b. And if anything in our state is ready to get flushed to disk, we
    * flush it. */
   or_state_save(now);
+  sigcache_save(now, 0);
 
-  /** 9. and if we're a server, check whether our DNS is telling stories to
-   * us. */
-  if (!net_is_disabled() &&
-      public_server_mode(options) && time_to_check_for_correct_dns < now) {
-    if (!time_to_check_for_correct_dns) {
-      time_to_check_for_correct_dns = now + 60 + crypto_rand_int(120);
-    } else {
-      dns_launch_correctness_checks();
-      time_to_check_for_correct_dns = now + 12*3600 +
-        crypto_rand_int(12*3600);
-    }
-  }
-
-  /** 10. write bridge networkstatus file to disk */
-  if (options->BridgeAuthoritativeDir &&
-      time_to_write_bridge_status_file < now) {
-    networkstatus_dump_bridge_status_to_file(now);
-#define BRIDGE_STATUSFILE_INTERVAL (30*60)
-    time_to_write_bridge_status_file = now+BRIDGE_STATUSFILE_INTERVAL;
-  }
-
-  /** 11. check the port forwarding app */
-  if (!net_is_disabled() &&
-      time_to_check_port_forwarding < now &&
-      options->PortForwarding &&
-      is_server) {
-#define PORT_FORWARDING_CHECK_INTERVAL 5
-    /* XXXXX this should take a list of ports, not just two! */
-    tor_check_port_forwarding(options->PortForwardingHelper,
-                              get_primary_dir_port(),
-                              get_primary_or_port(),
-                              now);
-    time_to_check_port_forwarding = now+PORT_FORWARDING_CHECK_INTERVAL;
-  }
-
-  /** 11b. check pending unconfigured managed proxies */
+  /** 9. check pending unconfigured managed proxies */
   if (!net_is_disabled() && pt_proxies_configuration_pending())
     pt_configure_remaining_proxies();
 
-  /** 11c. validate pluggable transports configuration if we need to */
+  /** 9b. validate pluggable transports configuration if we need to */
   if (!has_validated_pt &&
       (options->Bridges || options->ClientTransportPlugin)) {
     if (validate_pluggable_transports_config() == 0) {
       has_validated_pt = 1;
     }
   }
-
-  /** 12. write the heartbeat message */
-  if (options->HeartbeatPeriod &&
-      time_to_next_heartbeat < now) {
-    log_heartbeat(now);
-    time_to_next_heartbeat = now+options->HeartbeatPeriod;
-  }
 }
 
 /** Timer: used to invoke second_elapsed_callback() once per second. */
@@ -1556,15 +2071,18 @@ second_elapsed_callback(periodic_timer_t *timer, void *arg)
   size_t bytes_written;
   size_t bytes_read;
   int seconds_elapsed;
+  struct timeval start;
   const or_options_t *options = get_options();
   (void)timer;
   (void)arg;
 
+  tor_gettimeofday(&start);
   n_libevent_errors = 0;
 
   /* log_notice(LD_GENERAL, "Tick."); */
   now = time(NULL);
   update_approx_time(now);
+  update_approx_monotonic_msec();
 
   /* the second has rolled over. check more stuff. */
   seconds_elapsed = current_second ? (int)(now - current_second) : 0;
@@ -1588,8 +2106,10 @@ second_elapsed_callback(periodic_timer_t *timer, void *arg)
   stats_prev_n_written = stats_n_bytes_written;
 #endif
 
+  rep_hist_flush_bandwidth();
   control_event_bandwidth_used((uint32_t)bytes_read,(uint32_t)bytes_written);
   control_event_stream_bandwidth_used();
+  control_event_circuit_bandwidth_used();
 
   if (server_mode(options) &&
       !net_is_disabled() &&
@@ -1628,14 +2148,17 @@ second_elapsed_callback(periodic_timer_t *timer, void *arg)
   if (seconds_elapsed < -NUM_JUMPED_SECONDS_BEFORE_WARN ||
       seconds_elapsed >= NUM_JUMPED_SECONDS_BEFORE_WARN) {
     circuit_note_clock_jumped(seconds_elapsed);
-    /* XXX if the time jumps *back* many months, do our events in
-     * run_scheduled_events() recover? I don't think they do. -RD */
+    /* XXX if the time jumps *back* many months, do our periodic events
+     * recover? Some of them count from the last time they acted, so they
+     * may not. -RD */
+    periodic_events_reschedule_all();
   } else if (seconds_elapsed > 0)
     stats_n_seconds_working += seconds_elapsed;
 
   run_scheduled_events(now);
 
   current_second = now; /* remember which second it is, for next time */
+  rep_hist_note_handler_time(HANDLER_SECOND_ELAPSED, &start);
 }
 
 #ifndef USE_BUFFEREVENTS
@@ -1686,6 +2209,7 @@ refill_callback(periodic_timer_t *timer, void *arg)
   stats_prev_global_write_bucket = global_write_bucket;
 
   current_millisecond = now; /* remember what time it is, for next time */
+  rep_hist_note_handler_time(HANDLER_REFILL, &now);
 }
 #endif
 
@@ -1741,9 +2265,21 @@ dns_servers_relaunch_checks(void)
   if (server_mode(get_options())) {
     dns_reset_correctness_checks();
     time_to_check_for_correct_dns = 0;
+    if (check_dns_honesty_event)
+      periodic_event_reschedule(check_dns_honesty_event);
   }
 }
 
+/** Make launch_descriptor_fetches_callback() run again soon, so that
+ * descriptor downloads we held back can go out as soon as a slot frees up
+ * instead of waiting for the next scheduled pass. */
+void
+reschedule_descriptor_fetches(void)
+{
+  if (launch_descriptor_fetches_event)
+    periodic_event_reschedule(launch_descriptor_fetches_event);
+}
+
 /** Called when we get a SIGHUP: reload configuration files and keys,
  * retry all connections, and so on. */
 static int
@@ -1840,6 +2376,11 @@ do_main_loop(void)
   /* Set up the packed_cell_t memory pool. */
   init_cell_pool();
 
+  /* Write state and statistics files in the background. */
+  if (file_writer_start() < 0)
+    log_info(LD_GENERAL, "No file writer thread; writing files in the "
+             "main thread.");
+
   /* Set up our buckets */
   connection_bucket_init();
 #ifndef USE_BUFFEREVENTS
@@ -1850,6 +2391,9 @@ do_main_loop(void)
   /* initialize the bootstrap status events to know we're starting up */
   control_event_bootstrap(BOOTSTRAP_STATUS_STARTING, 0);
 
+  /* Load the signature cache first, so we can skip checking signatures on
+   * the cached documents that we load next. */
+  sigcache_load();
   if (trusted_dirs_reload_certs()) {
     log_warn(LD_DIR,
              "Couldn't load all cached v3 certificates. Starting anyway.");
@@ -1870,10 +2414,9 @@ do_main_loop(void)
   now = time(NULL);
   directory_info_has_arrived(now, 1);
 
-  if (server_mode(get_options())) {
-    /* launch cpuworkers. Need to do this *after* we've read the onion key. */
-    cpu_init();
-  }
+  /* launch cpuworkers, if we're a server or a hidden service. Need to do
+   * this *after* we've read the onion key. */
+  cpu_init();
 
   /* set up once-a-second callback. */
   if (! second_timer) {
@@ -1886,6 +2429,7 @@ do_main_loop(void)
                                       second_elapsed_callback,
                                       NULL);
     tor_assert(second_timer);
+    periodic_events_launch_all();
   }
 
 #ifndef USE_BUFFEREVENTS
@@ -1917,13 +2461,22 @@ do_main_loop(void)
                       event_active(conn->read_event, EV_READ, 1));
     called_loop_once = smartlist_len(active_linked_connection_lst) ? 1 : 0;
 
+    /* When we're batching connection events, we need to come back here
+     * after each trip through the loop to handle them. */
+    batch_connection_events = get_options()->BatchConnectionEvents;
+    if (batch_connection_events)
+      called_loop_once = 1;
+
     update_approx_time(time(NULL));
+    update_approx_monotonic_msec();
 
     /* poll until we have an event, or the second ends, or until we have
      * some active linked connections to trigger events for. */
     loop_result = event_base_loop(tor_libevent_get_base(),
                                   called_loop_once ? EVLOOP_ONCE : 0);
 
+    dispatch_batched_connections();
+
     /* let catch() handle things like ^c, and otherwise don't worry about it */
     if (loop_result < 0) {
       int e = tor_socket_errno(-1);
@@ -2043,15 +2596,121 @@ get_uptime(void)
 extern uint64_t rephist_total_alloc;
 extern uint32_t rephist_total_num;
 
+/** Add a line to <b>lines</b> describing the memory pool stats in
+ * <b>st</b>, under the name <b>name</b>. */
+static void
+add_mempool_usage_line(smartlist_t *lines, const char *name,
+                       const mp_pool_stats_t *st)
+{
+  char *cp;
+  tor_asprintf(&cp,
+      "mempool/%s items="U64_FORMAT" used="U64_FORMAT
+      " allocated="U64_FORMAT" empty-chunks=%d used-chunks=%d"
+      " full-chunks=%d",
+      name, U64_PRINTF_ARG(st->n_items_used), U64_PRINTF_ARG(st->bytes_used),
+      U64_PRINTF_ARG(st->bytes_allocated), st->n_empty_chunks,
+      st->n_used_chunks, st->n_full_chunks);
+  smartlist_add(lines, cp);
+}
+
+/** Return a newly allocated string breaking down, one subsystem per line,
+ * roughly how much memory we're using.  The numbers come from the counters
+ * each subsystem already keeps, so they are estimates: they leave out
+ * malloc overhead, and most strings hanging off the structures counted. */
+char *
+format_memory_usage_report(void)
+{
+  smartlist_t *lines = smartlist_create();
+  mp_pool_stats_t st, origin_st, or_st, cpath_st;
+  memarea_totals_t areas;
+  int n;
+  uint64_t a, b;
+  size_t sz;
+  char *cp, *result;
+
+  tor_asprintf(&cp, "buffers allocated="U64_FORMAT,
+               U64_PRINTF_ARG(buf_get_total_allocation()));
+  smartlist_add(lines, cp);
+  tor_asprintf(&cp, "cell-queues cells=%d bytes="U64_FORMAT,
+      cell_queues_get_n_cells(),
+      U64_PRINTF_ARG(cell_queues_get_total_allocation() -
+                     buf_get_total_allocation()));
+  smartlist_add(lines, cp);
+
+  cell_pool_get_stats(&st);
+  add_mempool_usage_line(lines, "cells", &st);
+  buf_get_pool_stats(&st);
+  add_mempool_usage_line(lines, "buffer-chunks", &st);
+  circuit_get_pool_stats(&origin_st, &or_st, &cpath_st);
+  add_mempool_usage_line(lines, "origin-circuits", &origin_st);
+  add_mempool_usage_line(lines, "or-circuits", &or_st);
+  add_mempool_usage_line(lines, "crypt-paths", &cpath_st);
+
+  memarea_get_totals(&areas);
+  tor_asprintf(&cp,
+      "memarea areas=%d live="U64_FORMAT" freelist-chunks=%d"
+      " freelist="U64_FORMAT,
+      areas.n_live_areas, U64_PRINTF_ARG(areas.live_bytes),
+      areas.freelist_chunks, U64_PRINTF_ARG(areas.freelist_bytes));
+  smartlist_add(lines, cp);
+
+  routerlist_get_body_usage(&n, &a, &b);
+  tor_asprintf(&cp, "routerlist descriptors=%d heap="U64_FORMAT
+               " mapped="U64_FORMAT,
+               n, U64_PRINTF_ARG(a), U64_PRINTF_ARG(b));
+  smartlist_add(lines, cp);
+  microdesc_cache_get_body_usage(&n, &a, &b);
+  tor_asprintf(&cp, "microdescs descriptors=%d heap="U64_FORMAT
+               " mapped="U64_FORMAT,
+               n, U64_PRINTF_ARG(a), U64_PRINTF_ARG(b));
+  smartlist_add(lines, cp);
+
+  connection_get_mem_usage(&n, &a, &b);
+  tor_asprintf(&cp, "connections count=%d structs="U64_FORMAT
+               " buffers="U64_FORMAT,
+               n, U64_PRINTF_ARG(a), U64_PRINTF_ARG(b));
+  smartlist_add(lines, cp);
+
+  dns_get_cache_usage(&n, &sz);
+  tor_asprintf(&cp, "dns-cache entries=%d bytes="U64_FORMAT,
+               n, U64_PRINTF_ARG(sz));
+  smartlist_add(lines, cp);
+  geoip_get_client_history_usage(&n, &sz);
+  tor_asprintf(&cp, "geoip-clients entries=%d bytes="U64_FORMAT,
+               n, U64_PRINTF_ARG(sz));
+  smartlist_add(lines, cp);
+  rend_cache_get_usage(&n, &sz);
+  tor_asprintf(&cp, "rend-cache entries=%d bytes="U64_FORMAT,
+               n, U64_PRINTF_ARG(sz));
+  smartlist_add(lines, cp);
+  tor_asprintf(&cp, "rephist routers=%d bytes="U64_FORMAT,
+               (int)rephist_total_num,
+               U64_PRINTF_ARG(rephist_total_alloc));
+  smartlist_add(lines, cp);
+
+  result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, line, tor_free(line));
+  smartlist_free(lines);
+  return result;
+}
+
 /**
  * Write current memory usage information to the log.
  */
 static void
 dumpmemusage(int severity)
 {
+  char *report = format_memory_usage_report();
+  smartlist_t *lines = smartlist_create();
+  log(severity, LD_MM, "Memory usage by subsystem:");
+  smartlist_split_string(lines, report, "\n", 0, 0);
+  SMARTLIST_FOREACH(lines, char *, cp, {
+    log(severity, LD_MM, "  %s", cp);
+    tor_free(cp);
+  });
+  smartlist_free(lines);
+  tor_free(report);
   connection_dump_buffer_mem_stats(severity);
-  log(severity, LD_GENERAL, "In rephist: "U64_FORMAT" used by %d Tors.",
-      U64_PRINTF_ARG(rephist_total_alloc), rephist_total_num);
   dump_routerlist_mem_usage(severity);
   dump_cell_pool_usage(severity);
   dump_dns_mem_usage(severity);
@@ -2110,6 +2769,16 @@ dumpstats(int severity)
     circuit_dump_by_conn(conn, severity); /* dump info about all the circuits
                                            * using this conn */
   });
+  {
+    int n_conns, n_holding;
+    connection_or_get_tls_buffer_usage(&rbuf_cap, &wbuf_cap,
+                                       &n_conns, &n_holding);
+    log(severity, LD_NET,
+        "OpenSSL buffers: %lu bytes for reading, %lu bytes for writing, "
+        "held by %d of %d OR connections.",
+        (unsigned long)rbuf_cap, (unsigned long)wbuf_cap,
+        n_holding, n_conns);
+  }
   log(severity, LD_NET,
       "Cells processed: "U64_FORMAT" padding\n"
       "                 "U64_FORMAT" create\n"
@@ -2133,6 +2802,15 @@ dumpstats(int severity)
     log(severity,LD_NET,"Average delivered cell fullness: %2.3f%%",
         100*(U64_TO_DBL(stats_n_data_bytes_received) /
              U64_TO_DBL(stats_n_data_cells_received*RELAY_PAYLOAD_SIZE)) );
+  if (stats_n_optimistic_streams)
+    log(severity,LD_NET,
+        "Optimistic data: "U64_FORMAT" streams sent "U64_FORMAT" bytes "
+        "before connecting; "U64_FORMAT" retries re-sent "U64_FORMAT
+        " bytes.",
+        U64_PRINTF_ARG(stats_n_optimistic_streams),
+        U64_PRINTF_ARG(stats_n_optimistic_bytes),
+        U64_PRINTF_ARG(stats_n_optimistic_retries),
+        U64_PRINTF_ARG(stats_n_optimistic_bytes_resent));
 
   if (now - time_of_process_start >= 0)
     elapsed = now - time_of_process_start;
@@ -2152,13 +2830,33 @@ dumpstats(int severity)
         (int) (stats_n_bytes_written/elapsed));
   }
 
+  if (logs_get_n_async_dropped())
+    log(severity, LD_GENERAL,
+        "Log writer thread fell behind: "U64_FORMAT" messages dropped.",
+        U64_PRINTF_ARG(logs_get_n_async_dropped()));
+  if (control_get_n_events_dropped())
+    log(severity, LD_CONTROL,
+        "Slow controllers: "U64_FORMAT" events dropped.",
+        U64_PRINTF_ARG(control_get_n_events_dropped()));
+
   log(severity, LD_NET, "--------------- Dumping memory information:");
   dumpmemusage(severity);
 
   rep_hist_dump_stats(now,severity);
   rend_service_dump_stats(severity);
+  rend_client_dump_stats(severity);
   dump_pk_ops(severity);
+  rep_hist_dump_onionskin_latency(severity);
+  rep_hist_dump_handler_latency(severity);
+  rep_hist_dump_cell_processing_latency(severity);
+  dump_onion_pending_stats(severity);
   dump_distinct_digest_count(severity);
+
+  {
+    int i;
+    for (i = 0; periodic_events[i].fn; ++i)
+      periodic_event_log_stats(&periodic_events[i], severity);
+  }
 }
 
 /** Called by exit() as we shut down the process.
@@ -2235,6 +2933,8 @@ tor_init(int argc, char *argv[])
     closeable_connection_lst = smartlist_create();
   if (!active_linked_connection_lst)
     active_linked_connection_lst = smartlist_create();
+  if (!batched_connection_lst)
+    batched_connection_lst = smartlist_create();
   /* Have the log set up with our application name. */
   tor_snprintf(buf, sizeof(buf), "Tor %s", get_version());
   log_set_application_name(buf);
@@ -2398,25 +3098,34 @@ tor_free_all(int postfork)
   networkstatus_free_all();
   addressmap_free_all();
   dirserv_free_all();
+  directory_free_all();
   rend_service_free_all();
   rend_cache_free_all();
   rend_service_authorization_free_all();
+  rend_client_purge_desc_fetches();
   rep_hist_free_all();
   dns_free_all();
+  dnsserv_free_all();
   clear_pending_onions();
   circuit_free_all();
   entry_guards_free_all();
   pt_free_all();
   connection_free_all();
+  connection_ap_pending_free_all();
+  connection_exit_connect_failures_free_all();
+  connection_edge_coalescing_free_all();
+  control_free_all();
   buf_shrink_freelists(1);
   memarea_clear_freelist();
   nodelist_free_all();
   microdesc_free_all();
+  sigcache_free_all();
   if (!postfork) {
     config_free_all();
     router_free_all();
     policies_free_all();
   }
+  circuit_scheduler_free_all();
   free_cell_pool();
   if (!postfork) {
     tor_tls_free_all();
@@ -2424,9 +3133,25 @@ tor_free_all(int postfork)
   /* stuff in main.c */
 
   smartlist_free(connection_array);
+  {
+    int i;
+    conn_id_entry_t **ent, **next, *this;
+    for (i = 0; i <= _CONN_TYPE_MAX; ++i) {
+      smartlist_free(connections_by_type[i]);
+      connections_by_type[i] = NULL;
+    }
+    for (ent = HT_START(conn_id_map, &conn_id_map); ent; ent = next) {
+      this = *ent;
+      next = HT_NEXT_RMV(conn_id_map, &conn_id_map, ent);
+      tor_free(this);
+    }
+    HT_CLEAR(conn_id_map, &conn_id_map);
+  }
   smartlist_free(closeable_connection_lst);
   smartlist_free(active_linked_connection_lst);
+  smartlist_free(batched_connection_lst);
   periodic_timer_free(second_timer);
+  periodic_events_free_all();
   if (!postfork) {
     release_lockfile();
   }
@@ -2455,9 +3180,12 @@ tor_cleanup(void)
       accounting_record_bandwidth_usage(now, get_or_state());
     or_state_mark_dirty(get_or_state(), 0); /* force an immediate save. */
     or_state_save(now);
+    sigcache_save(now, 1);
     if (authdir_mode_tests_reachability(options))
       rep_hist_record_mtbf_data(now, 0);
   }
+  /* Get everything we queued onto the disk before we exit. */
+  file_writer_shutdown();
 #ifdef USE_DMALLOC
   dmalloc_log_stats();
 #endif
@@ -24,6 +24,8 @@ void add_connection_to_closeable_list(connection_t *conn);
 int connection_is_on_closeable_list(connection_t *conn);
 
 smartlist_t *get_connection_array(void);
+const smartlist_t *get_connection_array_by_type(int type);
+connection_t *get_connection_by_global_id(uint64_t id);
 uint64_t get_bytes_read(void);
 uint64_t get_bytes_written(void);
 
@@ -50,8 +52,11 @@ void directory_info_has_arrived(time_t now, int from_cache);
 
 void ip_address_changed(int at_interface);
 void dns_servers_relaunch_checks(void);
+void reschedule_descriptor_fetches(void);
+void periodic_events_reschedule_all(void);
 
 long get_uptime(void);
+char *format_memory_usage_report(void);
 unsigned get_signewnym_epoch(void);
 
 void handle_signals(int is_parent);
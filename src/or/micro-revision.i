@@ -0,0 +1 @@
+"109bcf2df040b240"
@@ -1,6 +1,7 @@
 /* Copyright (c) 2009-2011, The Tor Project, Inc. */
 /* See LICENSE for licensing information */
 
+#define MICRODESC_PRIVATE
 #include "or.h"
 #include "config.h"
 #include "directory.h"
@@ -14,9 +15,16 @@
 #include "routerparse.h"
 
 /** A data structure to hold a bunch of cached microdescriptors.  There are
- * two active files in the cache: a "cache file" that we mmap, and a "journal
- * file" that we append to.  Periodically, we rebuild the cache file to hold
- * only the microdescriptors that we want to keep */
+ * three kinds of active files in the cache: a "cache file" that we mmap, a
+ * "journal file" that we append to, and any number of "segments" that we
+ * also mmap.  When the journal gets big enough, we seal it: it becomes the
+ * next segment, as-is.  Only when the segments pile up, or hold too many
+ * microdescriptors we've dropped, do we merge everything into a new cache
+ * file that holds only the microdescriptors that we want to keep.
+ *
+ * Sealing doesn't rewrite any "@last-listed" annotations, so we keep
+ * every microdescriptor's last-listed time in a separate "times file"
+ * as well, and believe it over the annotations when we reload. */
 struct microdesc_cache_t {
   /** Map from sha256-digest to microdesc_t for every microdesc_t in the
    * cache. */
@@ -30,9 +38,33 @@ struct microdesc_cache_t {
   tor_mmap_t *cache_content;
   /** Number of bytes used in the journal file. */
   size_t journal_len;
+  /** Mmap'd contents of each segment, oldest first.  Segment i (counting
+   * from 1) is in the cache file name with ".seg<i>" appended. */
+  smartlist_t *segments;
+  /** Name of the times file. */
+  char *times_fname;
+
+  /** If DescriptorDigestFilter is in effect, a Bloom filter holding the
+   * digest of every microdescriptor in map, and maybe of some that have
+   * left it; else NULL.  Built when we first need it. */
+  digestset_t *filter;
+  /** How many digests have we added to filter? */
+  int filter_n;
+  /** How many digests can we add to filter before we should build a
+   * bigger one? */
+  int filter_max;
   /** Number of bytes in descriptors removed as too old. */
   size_t bytes_dropped;
 
+  /** Name of a cache file that other Tor instances share with us, which we
+   * read but never write; or NULL if we don't share one. */
+  char *shared_fname;
+  /** Mmap'd contents of the shared cache file, or NULL. */
+  tor_mmap_t *shared_content;
+  /** When was the shared cache file last changed, as of when we mapped
+   * it? */
+  time_t shared_mtime;
+
   /** Total bytes of microdescriptor bodies we have added to this cache */
   uint64_t total_len_seen;
   /** Total number of microdescriptors we have added to this cache */
@@ -112,6 +144,12 @@ get_microdesc_cache(void)
     HT_INIT(microdesc_map, &cache->map);
     cache->cache_fname = get_datadir_fname("cached-microdescs");
     cache->journal_fname = get_datadir_fname("cached-microdescs.new");
+    cache->times_fname = get_datadir_fname("cached-microdescs.times");
+    cache->segments = smartlist_create();
+    if (get_options()->SharedMicrodescCacheFile &&
+        strcmp(get_options()->SharedMicrodescCacheFile, cache->cache_fname))
+      cache->shared_fname =
+        tor_strdup(get_options()->SharedMicrodescCacheFile);
     microdesc_cache_reload(cache);
     the_microdesc_cache = cache;
   }
@@ -214,9 +252,11 @@ microdescs_add_list_to_cache(microdesc_cache_t *cache,
       /* We already had this one. */
       if (md2->last_listed < md->last_listed)
         md2->last_listed = md->last_listed;
-      microdesc_free(md);
       if (where != SAVED_NOWHERE)
-        cache->bytes_dropped += size;
+        cache->bytes_dropped += md->bodylen;
+      if (where == SAVED_IN_CACHE)
+        md->saved_location = SAVED_IN_CACHE; /* Its body is in the mmap. */
+      microdesc_free(md);
       continue;
     }
 
@@ -229,6 +269,9 @@ microdescs_add_list_to_cache(microdesc_cache_t *cache,
         /* log?  return -1?  die?  coredump the universe? */
         continue;
       }
+      /* ftell() on an append-mode stream doesn't tell us where the body
+       * really landed; the journal length does. */
+      md->off = (off_t)(cache->journal_len + annotation_len);
       md->saved_location = SAVED_IN_JOURNAL;
       cache->journal_len += size;
     } else {
@@ -238,6 +281,15 @@ microdescs_add_list_to_cache(microdesc_cache_t *cache,
     md->no_save = no_save;
 
     HT_INSERT(microdesc_map, &cache->map, md);
+    if (cache->filter) {
+      if (++cache->filter_n > cache->filter_max) {
+        /* Too full to be much use; build a bigger one when we need it. */
+        digestset_free(cache->filter);
+        cache->filter = NULL;
+      } else {
+        digestset_add(cache->filter, md->digest);
+      }
+    }
     md->held_in_map = 1;
     smartlist_add(added, md);
     ++cache->n_seen;
@@ -275,11 +327,252 @@ microdesc_cache_clear(microdesc_cache_t *cache)
     tor_munmap_file(cache->cache_content);
     cache->cache_content = NULL;
   }
+  SMARTLIST_FOREACH(cache->segments, tor_mmap_t *, mm,
+                    tor_munmap_file(mm));
+  smartlist_clear(cache->segments);
+  if (cache->shared_content) {
+    tor_munmap_file(cache->shared_content);
+    cache->shared_content = NULL;
+  }
+  cache->shared_mtime = 0;
+  digestset_free(cache->filter);
+  cache->filter = NULL;
   cache->total_len_seen = 0;
   cache->n_seen = 0;
   cache->bytes_dropped = 0;
 }
 
+/** Return a newly allocated string holding the filename for segment
+ * <b>idx</b> (counting from 1) of <b>cache</b>. */
+static char *
+microdesc_cache_segment_fname(microdesc_cache_t *cache, int idx)
+{
+  char *fname = NULL;
+  tor_asprintf(&fname, "%s.seg%d", cache->cache_fname, idx);
+  return fname;
+}
+
+/** Size of one record in the times file: a sha256 digest, then a
+ * last-listed time as a 4-byte big-endian integer. */
+#define MD_TIMES_RECORD_LEN (DIGEST256_LEN+4)
+
+/** Write the last-listed time of every microdescriptor in <b>cache</b> to
+ * the times file.  Return 0 on success, -1 on failure. */
+static int
+microdesc_cache_save_times(microdesc_cache_t *cache)
+{
+  microdesc_t **mdp;
+  char *buf, *cp;
+  int r;
+
+  buf = cp = tor_malloc(MD_TIMES_RECORD_LEN *
+                        (HT_SIZE(&cache->map)+1));
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    const microdesc_t *md = *mdp;
+    if (md->no_save || md->last_listed <= 0)
+      continue;
+    memcpy(cp, md->digest, DIGEST256_LEN);
+    set_uint32(cp+DIGEST256_LEN, htonl((uint32_t)md->last_listed));
+    cp += MD_TIMES_RECORD_LEN;
+  }
+  r = write_bytes_to_file(cache->times_fname, buf, cp-buf, 1);
+  tor_free(buf);
+  return r;
+}
+
+/** Read the times file for <b>cache</b>, and update the last-listed time
+ * of every microdescriptor that the file says was listed more recently
+ * than its annotation does. */
+static void
+microdesc_cache_load_times(microdesc_cache_t *cache)
+{
+  struct stat st;
+  char *content;
+  const char *cp, *end;
+  microdesc_t search, *md;
+
+  content = read_file_to_str(cache->times_fname,
+                             RFTS_BIN|RFTS_IGNORE_MISSING, &st);
+  if (!content)
+    return;
+  if (st.st_size % MD_TIMES_RECORD_LEN) {
+    log_warn(LD_DIR, "Microdescriptor times file %s has a partial record; "
+             "ignoring it.", escaped(cache->times_fname));
+    tor_free(content);
+    return;
+  }
+  end = content + st.st_size;
+  for (cp = content; cp < end; cp += MD_TIMES_RECORD_LEN) {
+    time_t listed = (time_t) ntohl(get_uint32(cp+DIGEST256_LEN));
+    memcpy(search.digest, cp, DIGEST256_LEN);
+    md = HT_FIND(microdesc_map, &cache->map, &search);
+    if (md && md->last_listed < listed)
+      md->last_listed = listed;
+  }
+  tor_free(content);
+}
+
+/** Turn the journal of <b>cache</b> into its next segment without copying
+ * anything: rename the file, mmap it, and point every microdescriptor that
+ * was in the journal at the mmap.  Return 0 on success.  On failure,
+ * return -1; the caller should merge the whole cache, which will pick up
+ * whatever we left behind. */
+int
+microdesc_cache_seal_journal(microdesc_cache_t *cache)
+{
+  microdesc_t **mdp;
+  tor_mmap_t *mm;
+  char *fname;
+  int ok = 1;
+
+  fname = microdesc_cache_segment_fname(cache,
+                                        smartlist_len(cache->segments)+1);
+  if (replace_file(cache->journal_fname, fname) < 0) {
+    log_warn(LD_FS, "Couldn't rename %s to %s: %s",
+             escaped(cache->journal_fname), escaped(fname), strerror(errno));
+    tor_free(fname);
+    return -1;
+  }
+  cache->journal_len = 0;
+  mm = tor_mmap_file_flags(fname, TOR_MMAP_RANDOM);
+  if (!mm) {
+    log_warn(LD_FS, "Couldn't map new microdescriptor segment %s.",
+             escaped(fname));
+    tor_free(fname);
+    return -1;
+  }
+  tor_free(fname);
+  smartlist_add(cache->segments, mm);
+
+  /* Check every body before we trust any offset. */
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    const microdesc_t *md = *mdp;
+    if (md->saved_location != SAVED_IN_JOURNAL)
+      continue;
+    if (md->off < 0 || (size_t)md->off + md->bodylen > mm->size ||
+        tor_memneq(mm->data + md->off, md->body, md->bodylen)) {
+      ok = 0;
+      break;
+    }
+  }
+  if (!ok) {
+    log_info(LD_DIR, "Microdescriptor journal offsets didn't match; "
+             "merging the cache instead.");
+    return -1;
+  }
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    microdesc_t *md = *mdp;
+    if (md->saved_location != SAVED_IN_JOURNAL)
+      continue;
+    tor_free(md->body);
+    md->body = (char*)mm->data + md->off;
+    md->saved_location = SAVED_IN_CACHE;
+  }
+
+  write_str_to_file(cache->journal_fname, "", 1);
+  if (microdesc_cache_save_times(cache) < 0)
+    log_warn(LD_FS, "Couldn't save microdescriptor times to %s.",
+             escaped(cache->times_fname));
+  log_info(LD_DIR, "Sealed microdescriptor journal as segment %d.",
+           smartlist_len(cache->segments));
+  return 0;
+}
+
+/** Return true iff the body of <b>md</b> lies within <b>mm</b>. */
+static INLINE int
+microdesc_body_is_in_mmap(const microdesc_t *md, const tor_mmap_t *mm)
+{
+  return mm && md->body >= mm->data && md->body < mm->data + mm->size;
+}
+
+/** If <b>cache</b> has a shared cache file that we haven't mapped yet, or
+ * that has changed since we mapped it, map it and take every
+ * microdescriptor we can from it: point the ones we have at the shared
+ * copy, and add the ones we lack.  Any microdescriptor whose body was
+ * only in the old shared file gets a copy of its body, to save in our own
+ * cache.  Return the number of bodies we copied. */
+static int
+microdesc_cache_map_shared(microdesc_cache_t *cache)
+{
+  struct stat st;
+  tor_mmap_t *old_mm = cache->shared_content, *mm;
+  smartlist_t *descriptors, *fresh, *added;
+  microdesc_t **mdp;
+  int n_shared = 0, n_copied = 0;
+
+  if (!cache->shared_fname)
+    return 0;
+  if (stat(cache->shared_fname, &st) < 0) {
+    if (!old_mm)
+      log_warn(LD_FS, "Couldn't find shared microdescriptor cache %s: %s",
+               escaped(cache->shared_fname), strerror(errno));
+    return 0;
+  }
+  if (old_mm && st.st_mtime == cache->shared_mtime &&
+      (size_t)st.st_size == old_mm->size)
+    return 0;
+  mm = tor_mmap_file_flags(cache->shared_fname, TOR_MMAP_SEQUENTIAL);
+  if (!mm) {
+    if (!old_mm)
+      log_warn(LD_FS, "Couldn't map shared microdescriptor cache %s.",
+               escaped(cache->shared_fname));
+    return 0;
+  }
+  cache->shared_content = mm;
+  cache->shared_mtime = st.st_mtime;
+
+  /* The new file decides which microdescriptors are shared. */
+  HT_FOREACH(mdp, microdesc_map, &cache->map)
+    (*mdp)->in_shared_cache = 0;
+
+  descriptors = microdescs_parse_from_string(mm->data, mm->data+mm->size,
+                                             1, 0);
+  tor_mmap_advise(mm, TOR_MMAP_RANDOM);
+  fresh = smartlist_create();
+  SMARTLIST_FOREACH_BEGIN(descriptors, microdesc_t *, md) {
+    microdesc_t *md2 = HT_FIND(microdesc_map, &cache->map, md);
+    md->saved_location = SAVED_IN_CACHE;
+    md->in_shared_cache = 1;
+    ++n_shared;
+    if (!md2) {
+      smartlist_add(fresh, md);
+      continue;
+    }
+    if (md2->saved_location != SAVED_IN_CACHE)
+      tor_free(md2->body);
+    else if (!microdesc_body_is_in_mmap(md2, old_mm))
+      cache->bytes_dropped += md2->bodylen; /* Our own copy is dead weight */
+    md2->body = md->body;
+    md2->off = md->off;
+    md2->saved_location = SAVED_IN_CACHE;
+    md2->in_shared_cache = 1;
+    if (md2->last_listed < md->last_listed)
+      md2->last_listed = md->last_listed;
+    microdesc_free(md);
+  } SMARTLIST_FOREACH_END(md);
+  smartlist_free(descriptors);
+
+  added = microdescs_add_list_to_cache(cache, fresh, SAVED_IN_CACHE, 0);
+  smartlist_free(added);
+  smartlist_free(fresh);
+
+  if (old_mm) {
+    HT_FOREACH(mdp, microdesc_map, &cache->map) {
+      microdesc_t *md = *mdp;
+      if (!md->in_shared_cache && microdesc_body_is_in_mmap(md, old_mm)) {
+        md->body = tor_memdup(md->body, md->bodylen);
+        md->saved_location = SAVED_NOWHERE;
+        ++n_copied;
+      }
+    }
+    tor_munmap_file(old_mm);
+  }
+
+  log_info(LD_DIR, "Mapped shared microdescriptor cache %s with %d "
+           "descriptors.", escaped(cache->shared_fname), n_shared);
+  return n_copied;
+}
+
 /** Reload the contents of <b>cache</b> from disk.  If it is empty, load it
  * for the first time.  Return 0 on success, -1 on failure. */
 int
@@ -293,10 +586,37 @@ microdesc_cache_reload(microdesc_cache_t *cache)
 
   microdesc_cache_clear(cache);
 
-  mm = cache->cache_content = tor_mmap_file(cache->cache_fname);
+  /* Take everything we can from the shared cache first, so that we use its
+   * copy of any microdescriptor that's in both. */
+  microdesc_cache_map_shared(cache);
+
+  /* We parse each file from start to end, then look up bodies in it only
+   * when somebody asks for them. */
+  mm = cache->cache_content =
+    tor_mmap_file_flags(cache->cache_fname,
+                        TOR_MMAP_SEQUENTIAL|TOR_MMAP_POPULATE);
   if (mm) {
     added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
                                     SAVED_IN_CACHE, 0, -1, NULL);
+    tor_mmap_advise(mm, TOR_MMAP_RANDOM);
+    if (added) {
+      total += smartlist_len(added);
+      smartlist_free(added);
+    }
+  }
+
+  /* Load segments until we run out of them. */
+  for (;;) {
+    char *fname = microdesc_cache_segment_fname(cache,
+                                      smartlist_len(cache->segments)+1);
+    mm = tor_mmap_file_flags(fname, TOR_MMAP_SEQUENTIAL|TOR_MMAP_POPULATE);
+    tor_free(fname);
+    if (!mm)
+      break;
+    smartlist_add(cache->segments, mm);
+    added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
+                                    SAVED_IN_CACHE, 0, -1, NULL);
+    tor_mmap_advise(mm, TOR_MMAP_RANDOM);
     if (added) {
       total += smartlist_len(added);
       smartlist_free(added);
@@ -316,8 +636,9 @@ microdesc_cache_reload(microdesc_cache_t *cache)
     }
     tor_free(journal_content);
   }
-  log_notice(LD_DIR, "Reloaded microdescriptor cache.  Found %d descriptors.",
-             total);
+  microdesc_cache_load_times(cache);
+  log_notice(LD_DIR, "Reloaded microdescriptor cache.  Found %d descriptors "
+             "in %d segments.", total, smartlist_len(cache->segments));
 
   microdesc_cache_rebuild(cache, 0 /* don't force */);
 
@@ -357,7 +678,8 @@ microdesc_cache_clean(microdesc_cache_t *cache, time_t cutoff, int force)
       victim = *mdp;
       mdp = HT_NEXT_RMV(microdesc_map, &cache->map, mdp);
       victim->held_in_map = 0;
-      bytes_dropped += victim->bodylen;
+      if (!victim->in_shared_cache)
+        bytes_dropped += victim->bodylen;
       microdesc_free(victim);
     } else {
       ++kept;
@@ -372,28 +694,43 @@ microdesc_cache_clean(microdesc_cache_t *cache, time_t cutoff, int force)
   }
 }
 
+/** The most segments we'll keep before merging them into the cache file. */
+#define MAX_MD_CACHE_SEGMENTS 16
+
+/** Possible answers from should_rebuild_md_cache(). */
+#define MD_CACHE_KEEP 0
+#define MD_CACHE_SEAL 1
+#define MD_CACHE_MERGE 2
+
+/** Decide what to do with the journal of <b>cache</b>: nothing yet
+ * (MD_CACHE_KEEP), seal it as a new segment (MD_CACHE_SEAL), or merge
+ * everything into a new cache file (MD_CACHE_MERGE). */
 static int
 should_rebuild_md_cache(microdesc_cache_t *cache)
 {
-    const size_t old_len =
+    size_t old_len =
       cache->cache_content ? cache->cache_content->size : 0;
     const size_t journal_len = cache->journal_len;
     const size_t dropped = cache->bytes_dropped;
+    SMARTLIST_FOREACH(cache->segments, tor_mmap_t *, mm,
+                      old_len += mm->size);
 
-    if (journal_len < 16384)
-      return 0; /* Don't bother, not enough has happened yet. */
-    if (dropped > (journal_len + old_len) / 3)
-      return 1; /* We could save 1/3 or more of the currently used space. */
-    if (journal_len > old_len / 2)
-      return 1; /* We should append to the regular file */
+    if (journal_len < 16384 || journal_len < old_len / 8)
+      return MD_CACHE_KEEP; /* Don't bother, not enough has happened yet. */
+    if (dropped > (journal_len + old_len) / 2)
+      return MD_CACHE_MERGE; /* We could save half the used space. */
+    if (smartlist_len(cache->segments) >= MAX_MD_CACHE_SEGMENTS)
+      return MD_CACHE_MERGE;
 
-    return 0;
+    return MD_CACHE_SEAL;
 }
 
 /** Regenerate the main cache file for <b>cache</b>, clear the journal file,
- * and update every microdesc_t in the cache with pointers to its new
- * location.  If <b>force</b> is true, do this unconditionally.  If
- * <b>force</b> is false, do it only if we expect to save space on disk. */
+ * remove all segments, and update every microdesc_t in the cache with
+ * pointers to its new location.  If <b>force</b> is true, do this
+ * unconditionally.  If <b>force</b> is false, do it only if we expect to
+ * save space on disk, and just seal the journal as a new segment if
+ * that's enough. */
 int
 microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
 {
@@ -403,7 +740,7 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
   smartlist_t *wrote;
   ssize_t size;
   off_t off = 0;
-  int orig_size, new_size;
+  int orig_size, new_size, i;
 
   if (cache == NULL) {
     cache = the_microdesc_cache;
@@ -411,16 +748,27 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
       return 0;
   }
 
+  /* If the shared cache has changed, save what it no longer holds. */
+  if (microdesc_cache_map_shared(cache))
+    force = 1;
+
   /* Remove dead descriptors */
   microdesc_cache_clean(cache, 0/*cutoff*/, 0/*force*/);
 
-  if (!force && !should_rebuild_md_cache(cache))
-    return 0;
+  if (!force) {
+    int action = should_rebuild_md_cache(cache);
+    if (action == MD_CACHE_KEEP)
+      return 0;
+    if (action == MD_CACHE_SEAL && microdesc_cache_seal_journal(cache) == 0)
+      return 0;
+  }
 
   log_info(LD_DIR, "Rebuilding the microdescriptor cache...");
 
   orig_size = (int)(cache->cache_content ? cache->cache_content->size : 0);
   orig_size += (int)cache->journal_len;
+  SMARTLIST_FOREACH(cache->segments, tor_mmap_t *, mm,
+                    orig_size += (int)mm->size);
 
   f = start_writing_to_stdio_file(cache->cache_fname,
                                   OPEN_FLAGS_REPLACE|O_BINARY,
@@ -433,7 +781,7 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
   HT_FOREACH(mdp, microdesc_map, &cache->map) {
     microdesc_t *md = *mdp;
     size_t annotation_len;
-    if (md->no_save)
+    if (md->no_save || md->in_shared_cache)
       continue;
 
     size = dump_microdescriptor(f, md, &annotation_len);
@@ -457,7 +805,8 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
 
   finish_writing_to_file(open_file); /*XXX Check me.*/
 
-  cache->cache_content = tor_mmap_file(cache->cache_fname);
+  cache->cache_content = tor_mmap_file_flags(cache->cache_fname,
+                                             TOR_MMAP_RANDOM);
 
   if (!cache->cache_content && smartlist_len(wrote)) {
     log_err(LD_DIR, "Couldn't map file that we just wrote to %s!",
@@ -487,6 +836,20 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
 
   smartlist_free(wrote);
 
+  /* Everything in the segments is in the new cache file now. */
+  SMARTLIST_FOREACH(cache->segments, tor_mmap_t *, mm,
+                    tor_munmap_file(mm));
+  smartlist_clear(cache->segments);
+  for (i = 1; ; ++i) {
+    char *fname = microdesc_cache_segment_fname(cache, i);
+    int gone = file_status(fname) != FN_FILE || unlink(fname) < 0;
+    tor_free(fname);
+    if (gone)
+      break;
+  }
+  /* The annotations are current again. */
+  unlink(cache->times_fname);
+
   write_str_to_file(cache->journal_fname, "", 1);
   cache->journal_len = 0;
   cache->bytes_dropped = 0;
@@ -551,6 +914,7 @@ microdesc_free(microdesc_t *md)
         if (node->md == md) {
           ++found;
           node->md = NULL;
+          nodelist_hot_fields_update_node(node);
         }
       });
     if (found) {
@@ -587,10 +951,37 @@ microdesc_free_all(void)
     microdesc_cache_clear(the_microdesc_cache);
     tor_free(the_microdesc_cache->cache_fname);
     tor_free(the_microdesc_cache->journal_fname);
+    tor_free(the_microdesc_cache->shared_fname);
+    tor_free(the_microdesc_cache->times_fname);
+    smartlist_free(the_microdesc_cache->segments);
     tor_free(the_microdesc_cache);
   }
 }
 
+/** Return false if no microdescriptor with the digest <b>d</b> is in
+ * <b>cache</b>.  Return true if there may be one. */
+static int
+microdesc_cache_may_contain(microdesc_cache_t *cache, const char *d)
+{
+  microdesc_t **mdp;
+  if (!should_use_desc_digest_filter(get_options())) {
+    digestset_free(cache->filter);
+    cache->filter = NULL;
+    return 1;
+  }
+  if (!cache->filter) {
+    /* Leave room for as many more as we have now, since removals don't take
+     * anything out of the filter. */
+    int n = HT_SIZE(&cache->map);
+    cache->filter_max = MAX(2*n, 1024);
+    cache->filter = digestset_new(cache->filter_max);
+    HT_FOREACH(mdp, microdesc_map, &cache->map)
+      digestset_add(cache->filter, (*mdp)->digest);
+    cache->filter_n = n;
+  }
+  return digestset_isin(cache->filter, d);
+}
+
 /** If there is a microdescriptor in <b>cache</b> whose sha256 digest is
  * <b>d</b>, return it.  Otherwise return NULL. */
 microdesc_t *
@@ -599,6 +990,8 @@ microdesc_cache_lookup_by_digest256(microdesc_cache_t *cache, const char *d)
   microdesc_t *md, search;
   if (!cache)
     cache = get_microdesc_cache();
+  if (!microdesc_cache_may_contain(cache, d))
+    return NULL;
   memcpy(search.digest, d, DIGEST256_LEN);
   md = HT_FIND(microdesc_map, &cache->map, &search);
   return md;
@@ -616,6 +1009,28 @@ microdesc_average_size(microdesc_cache_t *cache)
   return (size_t)(cache->total_len_seen / cache->n_seen);
 }
 
+/** Set *<b>n_out</b> to the number of microdescriptors in the cache, and
+ * *<b>heap_bytes_out</b> and *<b>mapped_bytes_out</b> to the total length of
+ * their bodies held in RAM and in the mmap'd cache file respectively.  Don't
+ * load the cache if we haven't already. */
+void
+microdesc_cache_get_body_usage(int *n_out, uint64_t *heap_bytes_out,
+                               uint64_t *mapped_bytes_out)
+{
+  microdesc_t **mdp;
+  *n_out = 0;
+  *heap_bytes_out = *mapped_bytes_out = 0;
+  if (!the_microdesc_cache)
+    return;
+  HT_FOREACH(mdp, microdesc_map, &the_microdesc_cache->map) {
+    ++*n_out;
+    if ((*mdp)->saved_location == SAVED_IN_CACHE)
+      *mapped_bytes_out += (*mdp)->bodylen;
+    else
+      *heap_bytes_out += (*mdp)->bodylen;
+  }
+}
+
 /** Return a smartlist of all the sha256 digest of the microdescriptors that
  * are listed in <b>ns</b> but not present in <b>cache</b>. Returns pointers
  * to internals of <b>ns</b>; you should not free the members of the resulting
@@ -27,12 +27,17 @@ smartlist_t *microdescs_add_list_to_cache(microdesc_cache_t *cache,
 void microdesc_cache_clean(microdesc_cache_t *cache, time_t cutoff, int force);
 int microdesc_cache_rebuild(microdesc_cache_t *cache, int force);
 int microdesc_cache_reload(microdesc_cache_t *cache);
+#ifdef MICRODESC_PRIVATE
+int microdesc_cache_seal_journal(microdesc_cache_t *cache);
+#endif
 void microdesc_cache_clear(microdesc_cache_t *cache);
 
 microdesc_t *microdesc_cache_lookup_by_digest256(microdesc_cache_t *cache,
                                                  const char *d);
 
 size_t microdesc_average_size(microdesc_cache_t *cache);
+void microdesc_cache_get_body_usage(int *n_out, uint64_t *heap_bytes_out,
+                                    uint64_t *mapped_bytes_out);
 
 smartlist_t *microdesc_list_missing_digest256(networkstatus_t *ns,
                                               microdesc_cache_t *cache,
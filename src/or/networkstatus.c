@@ -10,12 +10,15 @@
  * client or cache.
  */
 
+#define NETWORKSTATUS_PRIVATE
 #include "or.h"
 #include "circuitbuild.h"
 #include "config.h"
 #include "connection.h"
 #include "connection_or.h"
+#include "consdiff.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -27,6 +30,7 @@
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
+#include "sigcache.h"
 
 /* For tracking v2 networkstatus documents.  Only caches do this now. */
 
@@ -42,9 +46,13 @@ static int networkstatus_v2_list_has_changed = 0;
 
 /** Map from lowercase nickname to identity digest of named server, if any. */
 static strmap_t *named_server_map = NULL;
-/** Map from lowercase nickname to (void*)1 for all names that are listed
- * as unnamed for some server in the consensus. */
+/** Map from lowercase nickname to the number of servers listed as unnamed
+ * with that nickname in the consensus, cast to void*. */
 static strmap_t *unnamed_server_map = NULL;
+/** The consensus that the nodelist and the named server maps were last
+ * built from, if we still have it.  When we replace this one, we only
+ * need to apply the differences. */
+static const networkstatus_t *applied_consensus = NULL;
 
 /** Most recently received and validated v3 consensus network status,
  * of whichever type we are using for our own circuits.  This will be the same
@@ -81,6 +89,48 @@ typedef struct consensus_waiting_for_certs_t {
 static consensus_waiting_for_certs_t
        consensus_waiting_for_certs[N_CONSENSUS_FLAVORS];
 
+/** A v3 consensus networkstatus that we've received, whose signatures the
+ * cpuworkers are checking before we try to use it. */
+typedef struct consensus_sigs_pending_t {
+  /** The encoded version of the consensus, nul-terminated. */
+  char *body;
+  /** Digests of the consensus, so we notice if it arrives again. */
+  digests_t digests;
+  /** The flavor of the consensus. */
+  consensus_flavor_t flavor;
+  /** The flags we got with the consensus, for
+   * networkstatus_set_current_consensus(). */
+  unsigned flags;
+  /** How many signatures are the cpuworkers still checking? */
+  int n_outstanding;
+  /** True iff we no longer want this consensus, because a newer one has
+   * arrived or we're shutting down. */
+  int cancelled;
+} consensus_sigs_pending_t;
+
+/** One signature on a consensus for a cpuworker to check. */
+typedef struct consensus_sig_check_t {
+  /** The consensus that carries this signature. */
+  consensus_sigs_pending_t *pending;
+  /** Our own copy of the signing key, since the cpuworker can't share the
+   * main thread's. */
+  crypto_pk_env_t *signing_key;
+  /** The digest of the consensus that the signature should cover. */
+  char digest[DIGEST256_LEN];
+  /** Length of <b>digest</b>. */
+  int digest_len;
+  /** The signature itself. */
+  char *signature;
+  /** Length of <b>signature</b>. */
+  size_t signature_len;
+  /** Set by the cpuworker: true iff the signature is good. */
+  int good;
+} consensus_sig_check_t;
+
+/** For each flavor, the consensus whose signatures the cpuworkers are
+ * checking, if any. */
+static consensus_sigs_pending_t *consensus_sigs_pending[N_CONSENSUS_FLAVORS];
+
 /** The last time we tried to download a networkstatus, or 0 for "never".  We
  * use this to rate-limit download attempts for directory caches (including
  * mirrors).  Clients don't use this now. */
@@ -92,6 +142,9 @@ static time_t last_networkstatus_download_attempted = 0;
 static time_t time_to_download_next_consensus = 0;
 /** Download status for the current consensus networkstatus. */
 static download_status_t consensus_dl_status[N_CONSENSUS_FLAVORS];
+/** True for each flavor where the last consensus diff we got didn't apply,
+ * so that we should fetch the whole consensus next time. */
+static int consensus_diff_failed[N_CONSENSUS_FLAVORS];
 
 /** True iff we have logged a warning about this OR's version being older than
  * listed by the authorities. */
@@ -101,7 +154,8 @@ static int have_warned_about_old_version = 0;
 static int have_warned_about_new_version = 0;
 
 static void download_status_map_update_from_v2_networkstatus(void);
-static void routerstatus_list_update_named_server_map(void);
+static void routerstatus_list_update_named_server_map(
+                                               const networkstatus_t *old_c);
 
 /** Forget that we've warned about anything networkstatus-related, so we will
  * give fresh warnings if the same behavior happens again. */
@@ -206,6 +260,207 @@ router_reload_v2_networkstatus(void)
   return 0;
 }
 
+/** Magic string at the start of every consensus snapshot. */
+#define CONSENSUS_SNAPSHOT_MAGIC "tor-snap"
+/** Version of the consensus snapshot layout.  Bump this whenever the layout
+ * changes in a way that a sizeof() check wouldn't catch. */
+#define CONSENSUS_SNAPSHOT_VERSION 1
+/** Written in host byte order, so that we can tell when a snapshot comes
+ * from a host with a different one. */
+#define CONSENSUS_SNAPSHOT_BYTE_ORDER 0x01020304
+
+/** The header of a consensus snapshot.  It's followed by
+ * <b>n_entries</b> raw routerstatus_t structures, and then by
+ * <b>strings_len</b> bytes of NUL-terminated strings that the entries
+ * refer to.  A snapshot is only good on the host that wrote it, and only
+ * for the consensus whose SHA256 digest is <b>source_digest</b>. */
+typedef struct consensus_snapshot_header_t {
+  char magic[8]; /**< CONSENSUS_SNAPSHOT_MAGIC, without a NUL. */
+  uint32_t version; /**< CONSENSUS_SNAPSHOT_VERSION. */
+  uint32_t byte_order; /**< CONSENSUS_SNAPSHOT_BYTE_ORDER. */
+  uint32_t record_len; /**< sizeof(routerstatus_t) when this was written. */
+  uint32_t flavor; /**< The consensus_flavor_t of the consensus. */
+  uint32_t n_entries; /**< How many routerstatus_t follow? */
+  uint32_t strings_len; /**< How many bytes of strings follow them? */
+  char source_digest[DIGEST256_LEN]; /**< Digest of the consensus text. */
+} consensus_snapshot_header_t;
+
+/** Encode the routerstatus_t entries in <b>rs_list</b>, from a consensus
+ * of flavor <b>flav</b> whose text has the SHA256 digest
+ * <b>source_digest</b>, as a consensus snapshot.  Return a newly allocated
+ * buffer, and set *<b>len_out</b> to its length. */
+char *
+networkstatus_snapshot_encode(const smartlist_t *rs_list,
+                              consensus_flavor_t flav,
+                              const char *source_digest, size_t *len_out)
+{
+  consensus_snapshot_header_t hdr;
+  size_t strings_len = 0, len;
+  char *buf, *rec, *strings;
+
+  SMARTLIST_FOREACH(rs_list, const routerstatus_t *, rs,
+    if (rs->exitsummary)
+      strings_len += strlen(rs->exitsummary)+1);
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CONSENSUS_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+  hdr.version = CONSENSUS_SNAPSHOT_VERSION;
+  hdr.byte_order = CONSENSUS_SNAPSHOT_BYTE_ORDER;
+  hdr.record_len = sizeof(routerstatus_t);
+  hdr.flavor = flav;
+  hdr.n_entries = smartlist_len(rs_list);
+  hdr.strings_len = (uint32_t)strings_len;
+  memcpy(hdr.source_digest, source_digest, DIGEST256_LEN);
+
+  len = sizeof(hdr) + sizeof(routerstatus_t)*hdr.n_entries + strings_len;
+  buf = tor_malloc_zero(len);
+  memcpy(buf, &hdr, sizeof(hdr));
+  rec = buf + sizeof(hdr);
+  strings = rec + sizeof(routerstatus_t)*hdr.n_entries;
+  strings_len = 0;
+  SMARTLIST_FOREACH_BEGIN(rs_list, const routerstatus_t *, rs) {
+    routerstatus_t tmp;
+    memcpy(&tmp, rs, sizeof(tmp));
+    if (rs->exitsummary) {
+      /* Store an offset into the strings, plus one so that 0 means NULL. */
+      size_t n = strlen(rs->exitsummary)+1;
+      memcpy(strings+strings_len, rs->exitsummary, n);
+      tmp.exitsummary = (char*)(uintptr_t)(strings_len+1);
+      strings_len += n;
+    }
+    memcpy(rec, &tmp, sizeof(tmp));
+    rec += sizeof(tmp);
+  } SMARTLIST_FOREACH_END(rs);
+
+  *len_out = len;
+  return buf;
+}
+
+/** Decode the consensus snapshot of <b>len</b> bytes in <b>body</b>.  If
+ * it was written by this version of Tor on this kind of host, for a
+ * consensus of flavor <b>flav</b> whose text has the SHA256 digest
+ * <b>source_digest</b>, return a newly allocated list of the
+ * routerstatus_t entries it holds.  Otherwise return NULL. */
+smartlist_t *
+networkstatus_snapshot_decode(const char *body, size_t len,
+                              consensus_flavor_t flav,
+                              const char *source_digest)
+{
+  consensus_snapshot_header_t hdr;
+  const char *rec, *strings;
+  smartlist_t *result;
+  uint32_t i;
+
+  if (len < sizeof(hdr))
+    return NULL;
+  memcpy(&hdr, body, sizeof(hdr));
+  if (fast_memneq(hdr.magic, CONSENSUS_SNAPSHOT_MAGIC, sizeof(hdr.magic)) ||
+      hdr.version != CONSENSUS_SNAPSHOT_VERSION ||
+      hdr.byte_order != CONSENSUS_SNAPSHOT_BYTE_ORDER ||
+      hdr.record_len != sizeof(routerstatus_t) ||
+      hdr.flavor != (uint32_t)flav)
+    return NULL;
+  if (tor_memneq(hdr.source_digest, source_digest, DIGEST256_LEN))
+    return NULL;
+  if (hdr.n_entries > (len - sizeof(hdr)) / sizeof(routerstatus_t) ||
+      len != sizeof(hdr) + (size_t)hdr.n_entries*sizeof(routerstatus_t)
+                         + hdr.strings_len)
+    return NULL;
+  rec = body + sizeof(hdr);
+  strings = rec + (size_t)hdr.n_entries*sizeof(routerstatus_t);
+  if (hdr.strings_len && strings[hdr.strings_len-1] != '\0')
+    return NULL;
+
+  result = smartlist_create();
+  for (i = 0; i < hdr.n_entries; ++i) {
+    routerstatus_t *rs = tor_malloc(sizeof(routerstatus_t));
+    uintptr_t off;
+    memcpy(rs, rec, sizeof(routerstatus_t));
+    rec += sizeof(routerstatus_t);
+    off = (uintptr_t)rs->exitsummary;
+    rs->exitsummary = NULL;
+    /* The fields below aren't from the consensus; start them afresh. */
+    rs->need_to_mirror = 0;
+    rs->last_dir_503_at = 0;
+    memset(&rs->dl_status, 0, sizeof(rs->dl_status));
+    smartlist_add(result, rs);
+    if (off) {
+      if (off > hdr.strings_len)
+        goto err;
+      rs->exitsummary = tor_strdup(strings+off-1);
+    }
+  }
+  return result;
+ err:
+  SMARTLIST_FOREACH(result, routerstatus_t *, rs, routerstatus_free(rs));
+  smartlist_free(result);
+  return NULL;
+}
+
+/** Return a newly allocated string holding the name of the snapshot file
+ * for the cached consensus in <b>consensus_fname</b>. */
+static char *
+networkstatus_snapshot_fname(const char *consensus_fname)
+{
+  char *fname = NULL;
+  tor_asprintf(&fname, "%s.snapshot", consensus_fname);
+  return fname;
+}
+
+/** Try to load the routerstatus_t entries for the consensus of flavor
+ * <b>flav</b> whose text, <b>consensus</b>, we read from
+ * <b>consensus_fname</b>, from the snapshot next to it.  Return a list of
+ * them on success, or NULL if there's no usable snapshot. */
+static smartlist_t *
+networkstatus_load_snapshot(const char *consensus_fname,
+                            const char *consensus, consensus_flavor_t flav)
+{
+  char digest[DIGEST256_LEN];
+  char *fname, *body;
+  struct stat st;
+  smartlist_t *result = NULL;
+
+  fname = networkstatus_snapshot_fname(consensus_fname);
+  body = read_file_to_str(fname, RFTS_BIN|RFTS_IGNORE_MISSING, &st);
+  if (body) {
+    crypto_digest256(digest, consensus, strlen(consensus), DIGEST_SHA256);
+    result = networkstatus_snapshot_decode(body, (size_t)st.st_size, flav,
+                                           digest);
+    if (!result)
+      log_info(LD_DIR, "Consensus snapshot %s doesn't match the consensus "
+               "it's next to; ignoring it.", escaped(fname));
+    tor_free(body);
+  }
+  tor_free(fname);
+  return result;
+}
+
+/** Write a snapshot of the parsed consensus <b>c</b>, whose text is
+ * <b>consensus</b>, next to the cached copy in <b>consensus_fname</b>. */
+static void
+networkstatus_write_snapshot(const char *consensus_fname,
+                             const char *consensus, const networkstatus_t *c)
+{
+  char digest[DIGEST256_LEN];
+  char *fname, *body;
+  size_t len;
+
+  crypto_digest256(digest, consensus, strlen(consensus), DIGEST_SHA256);
+  body = networkstatus_snapshot_encode(c->routerstatus_list, c->flavor,
+                                       digest, &len);
+  fname = networkstatus_snapshot_fname(consensus_fname);
+  if (write_bytes_to_file(fname, body, len, 1) < 0)
+    log_warn(LD_FS, "Couldn't write consensus snapshot to %s.",
+             escaped(fname));
+  tor_free(fname);
+  tor_free(body);
+}
+
+static int networkstatus_set_current_consensus_impl(const char *consensus,
+                                                    const char *flavor,
+                                                    unsigned flags,
+                                                    smartlist_t *rs_list);
+
 /** Read every cached v3 consensus networkstatus from the disk. */
 int
 router_reload_consensus_networkstatus(void)
@@ -229,7 +484,11 @@ router_reload_consensus_networkstatus(void)
     }
     s = read_file_to_str(filename, RFTS_IGNORE_MISSING, NULL);
     if (s) {
-      if (networkstatus_set_current_consensus(s, flavor, flags) < -1) {
+      smartlist_t *rs_list = NULL;
+      if (options->ConsensusSnapshot)
+        rs_list = networkstatus_load_snapshot(filename, s, flav);
+      if (networkstatus_set_current_consensus_impl(s, flavor, flags,
+                                                   rs_list) < -1) {
         log_warn(LD_FS, "Couldn't load consensus %s networkstatus from \"%s\"",
                  flavor, filename);
       }
@@ -450,6 +709,12 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
                  DIGEST_LEN))
     return -1;
 
+  if (sigcache_lookup(consensus->digests.d[sig->alg], dlen,
+                      cert->signing_key)) {
+    sig->good_signature = 1;
+    return 0;
+  }
+
   signed_digest_len = crypto_pk_keysize(cert->signing_key);
   signed_digest = tor_malloc(signed_digest_len);
   if (crypto_pk_public_checksig(cert->signing_key,
@@ -462,6 +727,7 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
     sig->bad_signature = 1;
   } else {
     sig->good_signature = 1;
+    sigcache_add(consensus->digests.d[sig->alg], dlen, cert->signing_key);
   }
   tor_free(signed_digest);
   return 0;
@@ -1269,6 +1535,106 @@ networkstatus_consensus_download_failed(int status_code, const char *flavname)
   }
 }
 
+/** How long do we wait before asking again for a consensus after a
+ * directory tells us it has nothing newer than ours? */
+#define CONSENSUS_NOT_MODIFIED_RETRY_DELAY 60
+
+/** Called when a directory answers our request for a <b>flavname</b>
+ * consensus by saying it has nothing newer than the one we have.  That's
+ * no fault of the directory's, so don't count it as a failure; but give the
+ * caches a little while to catch up before we ask again. */
+void
+networkstatus_consensus_not_modified(const char *flavname, time_t now)
+{
+  int flav = networkstatus_parse_flavor_name(flavname);
+  if (flav < 0)
+    return;
+  tor_assert(flav < N_CONSENSUS_FLAVORS);
+  consensus_dl_status[flav].next_attempt_at =
+    now + CONSENSUS_NOT_MODIFIED_RETRY_DELAY;
+}
+
+/** If we have a <b>flavname</b> consensus, set <b>digest_out</b> to its
+ * SHA256 digest and return 1.  Otherwise return 0. */
+int
+networkstatus_get_latest_consensus_digest(const char *flavname,
+                                          char *digest_out)
+{
+  int flav = networkstatus_parse_flavor_name(flavname);
+  if (flav >= 0) {
+    networkstatus_t *c = networkstatus_get_latest_consensus_by_flavor(flav);
+    if (!c)
+      return 0;
+    memcpy(digest_out, c->digests.d[DIGEST_SHA256], DIGEST256_LEN);
+    return 1;
+  } else {
+    /* A flavor we don't parse, but might cache. */
+    cached_dir_t *cd = dirserv_get_consensus(flavname);
+    if (!cd)
+      return 0;
+    memcpy(digest_out, cd->digests.d[DIGEST_SHA256], DIGEST256_LEN);
+    return 1;
+  }
+}
+
+/** If we should ask for the next <b>flavname</b> consensus as a diff from
+ * the one we have, set <b>digest_out</b> to the SHA256 digest of the one we
+ * have and return 1.  Otherwise return 0. */
+int
+networkstatus_get_consensus_diff_base(const char *flavname, char *digest_out)
+{
+  int flav = networkstatus_parse_flavor_name(flavname);
+  networkstatus_t *c;
+  if (!get_options()->FetchConsensusDiffs || flav < 0 ||
+      consensus_diff_failed[flav])
+    return 0;
+  c = networkstatus_get_latest_consensus_by_flavor(flav);
+  if (!c)
+    return 0;
+  memcpy(digest_out, c->digests.d[DIGEST_SHA256], DIGEST256_LEN);
+  return 1;
+}
+
+/** We got <b>diff</b> in response to a request for a <b>flavname</b>
+ * consensus.  Return the consensus it yields when applied to the one we
+ * have, as a newly allocated string, or NULL if it doesn't apply; in that
+ * case, we'll ask for the whole consensus next time. */
+char *
+networkstatus_apply_consensus_diff(const char *flavname, const char *diff)
+{
+  int flav = networkstatus_parse_flavor_name(flavname);
+  cached_dir_t *cached;
+  networkstatus_t *current;
+  char *base = NULL, *result = NULL;
+  if (flav < 0)
+    return NULL;
+
+  /* Caches have the text in memory; everyone else reads it back.  (The
+   * cache may still be serving the previous consensus while a cpuworker
+   * compresses the one we have, so make sure it's the right one.) */
+  cached = dirserv_get_consensus(flavname);
+  current = networkstatus_get_latest_consensus_by_flavor(flav);
+  if (cached && current &&
+      tor_memeq(cached->digests.d[DIGEST_SHA256],
+                current->digests.d[DIGEST_SHA256], DIGEST256_LEN)) {
+    result = consdiff_apply_diff(cached->dir, diff);
+  } else {
+    char *fname = get_datadir_fname(flav == FLAV_NS ? "cached-consensus" :
+                                    "cached-microdesc-consensus");
+    base = read_file_to_str(fname, RFTS_IGNORE_MISSING, NULL);
+    tor_free(fname);
+    if (base)
+      result = consdiff_apply_diff(base, diff);
+    tor_free(base);
+  }
+  if (!result) {
+    log_info(LD_DIR, "Couldn't apply %s consensus diff; will fetch the whole "
+             "consensus instead.", flavname);
+    consensus_diff_failed[flav] = 1;
+  }
+  return result;
+}
+
 /** How long do we (as a cache) wait after a consensus becomes non-fresh
  * before trying to fetch another? */
 #define CONSENSUS_MIN_SECONDS_BEFORE_CACHING 120
@@ -1564,6 +1930,140 @@ networkstatus_copy_old_consensus_info(networkstatus_t *new_c,
   } SMARTLIST_FOREACH_JOIN_END(rs_old, rs_new);
 }
 
+/** Runs in a cpuworker: check the signature in <b>arg</b>, a
+ * consensus_sig_check_t. */
+static void
+consensus_sig_check_work(void *arg)
+{
+  consensus_sig_check_t *check = arg;
+  size_t keysize = crypto_pk_keysize(check->signing_key);
+  char *signed_digest = tor_malloc(keysize);
+  int r = crypto_pk_public_checksig(check->signing_key, signed_digest,
+                                    keysize, check->signature,
+                                    check->signature_len);
+  check->good = (r >= check->digest_len &&
+                 tor_memeq(signed_digest, check->digest, check->digest_len));
+  tor_free(signed_digest);
+}
+
+/** Runs in the main thread once a cpuworker has checked the signature in
+ * <b>arg</b>, a consensus_sig_check_t.  Remember good signatures, and once
+ * every signature on the consensus is checked, try to use it. */
+static void
+consensus_sig_check_done(void *arg)
+{
+  consensus_sig_check_t *check = arg;
+  consensus_sigs_pending_t *pending = check->pending;
+
+  if (check->good)
+    sigcache_add(check->digest, check->digest_len, check->signing_key);
+  crypto_free_pk_env(check->signing_key);
+  tor_free(check->signature);
+  tor_free(check);
+
+  if (--pending->n_outstanding)
+    return;
+
+  if (!pending->cancelled) {
+    const char *flavname = networkstatus_get_flavor_name(pending->flavor);
+    time_t now = time(NULL);
+    tor_assert(consensus_sigs_pending[pending->flavor] == pending);
+    consensus_sigs_pending[pending->flavor] = NULL;
+    /* Anything good is in the signature cache now, so this won't need to
+     * do any public key operations for it. */
+    if (networkstatus_set_current_consensus(pending->body, flavname,
+                                 pending->flags|NSSET_SIGS_CHECKED) < 0) {
+      log_info(LD_DIR, "Unable to load %s consensus after checking its "
+               "signatures. I'll try again soon.", flavname);
+      networkstatus_consensus_download_failed(0, flavname);
+    } else {
+      /* launches router downloads as needed */
+      routers_update_all_from_networkstatus(now, 3);
+      update_microdescs_from_networkstatus(now);
+      update_microdesc_downloads(now);
+      directory_info_has_arrived(now, 0);
+    }
+  }
+  tor_free(pending->body);
+  tor_free(pending);
+}
+
+/** If we have cpuworkers, hand them the signatures on <b>c</b> that we
+ * can check but haven't checked yet, and remember <b>body</b> and
+ * <b>flags</b> so that we can call networkstatus_set_current_consensus()
+ * again once they're done.  Return 0 if the cpuworkers are checking
+ * signatures on this consensus, or -1 if we should go ahead and check
+ * them ourselves. */
+static int
+networkstatus_check_signatures_in_background(networkstatus_t *c,
+                                             const char *body,
+                                             unsigned flags)
+{
+  consensus_sigs_pending_t *pending = consensus_sigs_pending[c->flavor];
+  smartlist_t *checks;
+  time_t now = time(NULL);
+
+  if (!cpuworker_can_queue_work())
+    return -1;
+  if (pending && !pending->cancelled &&
+      tor_memeq(&pending->digests, &c->digests, sizeof(digests_t)))
+    return 0; /* We're already checking this one. */
+
+  checks = smartlist_create();
+  SMARTLIST_FOREACH_BEGIN(c->voters, networkstatus_voter_info_t *, voter) {
+    SMARTLIST_FOREACH_BEGIN(voter->sigs, document_signature_t *, sig) {
+      authority_cert_t *cert;
+      consensus_sig_check_t *check;
+      const int dlen = sig->alg == DIGEST_SHA1 ? DIGEST_LEN : DIGEST256_LEN;
+      if (sig->good_signature || sig->bad_signature || !sig->signature)
+        continue;
+      if (!trusteddirserver_get_by_v3_auth_digest(sig->identity_digest))
+        continue;
+      cert = authority_cert_get_by_digests(sig->identity_digest,
+                                           sig->signing_key_digest);
+      if (!cert || cert->expires < now)
+        continue;
+      if (sigcache_lookup(c->digests.d[sig->alg], dlen, cert->signing_key))
+        continue;
+      check = tor_malloc_zero(sizeof(consensus_sig_check_t));
+      check->signing_key = crypto_pk_copy_full(cert->signing_key);
+      memcpy(check->digest, c->digests.d[sig->alg], dlen);
+      check->digest_len = dlen;
+      check->signature = tor_memdup(sig->signature, sig->signature_len);
+      check->signature_len = sig->signature_len;
+      smartlist_add(checks, check);
+    } SMARTLIST_FOREACH_END(sig);
+  } SMARTLIST_FOREACH_END(voter);
+
+  if (!smartlist_len(checks)) {
+    smartlist_free(checks);
+    return -1;
+  }
+
+  if (pending)
+    pending->cancelled = 1;
+  pending = tor_malloc_zero(sizeof(consensus_sigs_pending_t));
+  pending->body = tor_strdup(body);
+  memcpy(&pending->digests, &c->digests, sizeof(digests_t));
+  pending->flavor = c->flavor;
+  pending->flags = flags;
+  pending->n_outstanding = smartlist_len(checks);
+  consensus_sigs_pending[c->flavor] = pending;
+
+  log_info(LD_DIR, "Handing %d signatures on a %s consensus to the "
+           "cpuworkers.", smartlist_len(checks),
+           networkstatus_get_flavor_name(c->flavor));
+  SMARTLIST_FOREACH_BEGIN(checks, consensus_sig_check_t *, check) {
+    int r;
+    check->pending = pending;
+    r = cpuworker_queue_work(consensus_sig_check_work,
+                             consensus_sig_check_done, check);
+    tor_assert(r == 0);
+  } SMARTLIST_FOREACH_END(check);
+  smartlist_free(checks);
+  return 0;
+}
+
 /** Try to replace the current cached v3 networkstatus with the one in
  * <b>consensus</b>.  If we don't have enough certificates to validate it,
  * store it in consensus_waiting_for_certs and launch a certificate fetch.
@@ -1573,7 +2073,10 @@ networkstatus_copy_old_consensus_info(networkstatus_t *new_c,
  * already received, but we were waiting for certificates on it.  If flags &
  * NSSET_DONT_DOWNLOAD_CERTS, do not launch certificate downloads as needed.
  * If flags & NSSET_ACCEPT_OBSOLETE, then we should be willing to take this
- * consensus, even if it comes from many days in the past.
+ * consensus, even if it comes from many days in the past.  Unless flags &
+ * NSSET_SIGS_CHECKED, a consensus that isn't from the cache may have its
+ * signatures checked by the cpuworkers: in that case we return 0, and try
+ * to use it again once they're done.
  *
  * Return 0 on success, <0 on failure.  On failure, caller should increment
  * the failure count as appropriate.
@@ -1585,6 +2088,20 @@ int
 networkstatus_set_current_consensus(const char *consensus,
                                     const char *flavor,
                                     unsigned flags)
+{
+  return networkstatus_set_current_consensus_impl(consensus, flavor, flags,
+                                                  NULL);
+}
+
+/** As networkstatus_set_current_consensus(), but if <b>rs_list</b> is
+ * provided, it holds the routerstatus_t entries of <b>consensus</b>, from
+ * a snapshot we wrote earlier: use them instead of parsing the entries
+ * again.  We take ownership of <b>rs_list</b>. */
+static int
+networkstatus_set_current_consensus_impl(const char *consensus,
+                                         const char *flavor,
+                                         unsigned flags,
+                                         smartlist_t *rs_list)
 {
   networkstatus_t *c=NULL;
   int r, result = -1;
@@ -1597,19 +2114,36 @@ networkstatus_set_current_consensus(const char *consensus,
   const unsigned dl_certs = !(flags & NSSET_DONT_DOWNLOAD_CERTS);
   const unsigned accept_obsolete = flags & NSSET_ACCEPT_OBSOLETE;
   const unsigned require_flavor = flags & NSSET_REQUIRE_FLAVOR;
+  const unsigned sigs_checked = flags & NSSET_SIGS_CHECKED;
   const digests_t *current_digests = NULL;
   consensus_waiting_for_certs_t *waiting = NULL;
   time_t current_valid_after = 0;
   int free_consensus = 1; /* Free 'c' at the end of the function */
+  int from_snapshot = 0;
+  networkstatus_t *old_c = NULL; /* The consensus 'c' replaces, if any. */
 
   if (flav < 0) {
     /* XXXX we don't handle unrecognized flavors yet. */
     log_warn(LD_BUG, "Unrecognized consensus flavor %s", flavor);
+    if (rs_list) {
+      SMARTLIST_FOREACH(rs_list, routerstatus_t *, rs, routerstatus_free(rs));
+      smartlist_free(rs_list);
+    }
     return -2;
   }
 
   /* Make sure it's parseable. */
-  c = networkstatus_parse_vote_from_string(consensus, NULL, NS_TYPE_CONSENSUS);
+  if (rs_list) {
+    c = networkstatus_parse_consensus_with_routerstatuses(consensus, rs_list);
+    if (c) {
+      from_snapshot = 1;
+      log_info(LD_DIR, "Loaded %d %s consensus entries from snapshot.",
+               smartlist_len(c->routerstatus_list), flavor);
+    }
+  }
+  if (!c)
+    c = networkstatus_parse_vote_from_string(consensus, NULL,
+                                             NS_TYPE_CONSENSUS);
   if (!c) {
     log_warn(LD_DIR, "Unable to parse networkstatus consensus");
     result = -2;
@@ -1686,6 +2220,15 @@ networkstatus_set_current_consensus(const char *consensus,
     goto done;
   }
 
+  /* Don't hold up the main thread checking signatures that the cpuworkers
+   * can check for us. */
+  if (!from_cache && !was_waiting_for_certs && !sigs_checked &&
+      networkstatus_check_signatures_in_background(c, consensus, flags) == 0) {
+    /* This isn't a success or a failure until they're done. */
+    result = 0;
+    goto done;
+  }
+
   /* Make sure it's signed enough. */
   if ((r=networkstatus_check_consensus_signature(c, 1))<0) {
     if (r == -1) {
@@ -1745,10 +2288,11 @@ networkstatus_set_current_consensus(const char *consensus,
   if (flav == FLAV_NS) {
     if (current_ns_consensus) {
       networkstatus_copy_old_consensus_info(c, current_ns_consensus);
-      networkstatus_vote_free(current_ns_consensus);
+      /* We free this at the end, once we're done comparing it to c. */
+      old_c = current_ns_consensus;
       /* Defensive programming : we should set current_consensus very soon,
        * but we're about to call some stuff in the meantime, and leaving this
-       * dangling pointer around has proven to be trouble. */
+       * stale pointer around has proven to be trouble. */
       current_ns_consensus = NULL;
     }
     current_ns_consensus = c;
@@ -1756,7 +2300,7 @@ networkstatus_set_current_consensus(const char *consensus,
   } else if (flav == FLAV_MICRODESC) {
     if (current_md_consensus) {
       networkstatus_copy_old_consensus_info(c, current_md_consensus);
-      networkstatus_vote_free(current_md_consensus);
+      old_c = current_md_consensus;
       /* more defensive programming */
       current_md_consensus = NULL;
     }
@@ -1787,13 +2331,19 @@ networkstatus_set_current_consensus(const char *consensus,
   }
 
   if (flav == usable_consensus_flavor()) {
+    /* If the nodelist and the name maps came from the consensus we're
+     * replacing, only look at the entries that changed. */
+    const networkstatus_t *diff_from =
+      (old_c && old_c == applied_consensus) ? old_c : NULL;
+
     /* XXXXNM Microdescs: needs a non-ns variant. ???? NM*/
     update_consensus_networkstatus_fetch_time(now);
 
-    nodelist_set_consensus(current_consensus);
+    nodelist_set_consensus(current_consensus, diff_from);
 
     dirvote_recalculate_timing(options, now);
-    routerstatus_list_update_named_server_map();
+    routerstatus_list_update_named_server_map(diff_from);
+    applied_consensus = current_consensus;
     cell_ewma_set_scale_factor(options, current_consensus);
 
     /* XXXX023 this call might be unnecessary here: can changing the
@@ -1812,8 +2362,15 @@ networkstatus_set_current_consensus(const char *consensus,
 
   if (!from_cache) {
     write_str_to_file(consensus_fname, consensus, 0);
+    consensus_diff_failed[flav] = 0;
   }
 
+  /* Snapshot what's now in consensus_fname, unless we just loaded it from
+   * a snapshot. */
+  if (options->ConsensusSnapshot && !from_snapshot &&
+      (!from_cache || (!was_waiting_for_certs && !accept_obsolete)))
+    networkstatus_write_snapshot(consensus_fname, consensus, c);
+
 /** If a consensus appears more than this many seconds before its declared
  * valid-after time, declare that our clock is skewed. */
 #define EARLY_CONSENSUS_NOTICE_SKEW 60
@@ -1838,6 +2395,11 @@ networkstatus_set_current_consensus(const char *consensus,
  done:
   if (free_consensus)
     networkstatus_vote_free(c);
+  if (old_c) {
+    if (applied_consensus == old_c)
+      applied_consensus = NULL;
+    networkstatus_vote_free(old_c);
+  }
   tor_free(consensus_fname);
   tor_free(unverified_fname);
   return result;
@@ -1962,29 +2524,95 @@ download_status_map_update_from_v2_networkstatus(void)
   networkstatus_v2_list_has_changed = 0;
 }
 
+/** Return true iff <b>a</b> and <b>b</b>, two entries for the same router,
+ * differ in anything that goes into the named server maps. */
+static int
+routerstatus_names_changed(const routerstatus_t *a, const routerstatus_t *b)
+{
+  return strcmp(a->nickname, b->nickname) ||
+    a->is_named != b->is_named ||
+    a->is_unnamed != b->is_unnamed;
+}
+
+/** Add whatever <b>rs</b> says about its nickname to the named server
+ * maps. */
+static void
+named_server_map_learn(const routerstatus_t *rs)
+{
+  if (rs->is_named) {
+    _tor_free(strmap_set_lc(named_server_map, rs->nickname,
+                            tor_memdup(rs->identity_digest, DIGEST_LEN)));
+  }
+  if (rs->is_unnamed) {
+    uintptr_t n = (uintptr_t)strmap_get_lc(unnamed_server_map, rs->nickname);
+    strmap_set_lc(unnamed_server_map, rs->nickname, (void*)(n+1));
+  }
+}
+
+/** Remove whatever <b>rs</b> said about its nickname from the named server
+ * maps. */
+static void
+named_server_map_forget(const routerstatus_t *rs)
+{
+  if (rs->is_named) {
+    char *d = strmap_get_lc(named_server_map, rs->nickname);
+    if (d && tor_memeq(d, rs->identity_digest, DIGEST_LEN)) {
+      strmap_remove_lc(named_server_map, rs->nickname);
+      tor_free(d);
+    }
+  }
+  if (rs->is_unnamed) {
+    uintptr_t n = (uintptr_t)strmap_get_lc(unnamed_server_map, rs->nickname);
+    if (n > 1)
+      strmap_set_lc(unnamed_server_map, rs->nickname, (void*)(n-1));
+    else
+      strmap_remove_lc(unnamed_server_map, rs->nickname);
+  }
+}
+
 /** Update our view of the list of named servers from the most recently
- * retrieved networkstatus consensus. */
+ * retrieved networkstatus consensus.  If <b>old_c</b> is set, our view
+ * came from it, so only apply the entries that differ between it and the
+ * current consensus. */
 static void
-routerstatus_list_update_named_server_map(void)
+routerstatus_list_update_named_server_map(const networkstatus_t *old_c)
 {
   if (!current_consensus)
     return;
 
+  if (old_c && named_server_map && unnamed_server_map) {
+    /* Forget the entries that left or changed, then learn the ones that
+     * arrived or changed, so that a name moving between routers works. */
+    SMARTLIST_FOREACH_JOIN(current_consensus->routerstatus_list,
+                           const routerstatus_t *, rs_new,
+                           old_c->routerstatus_list,
+                           const routerstatus_t *, rs_old,
+                           tor_memcmp(rs_new->identity_digest,
+                                      rs_old->identity_digest, DIGEST_LEN),
+                           named_server_map_forget(rs_old)) {
+      if (routerstatus_names_changed(rs_old, rs_new))
+        named_server_map_forget(rs_old);
+    } SMARTLIST_FOREACH_JOIN_END(rs_new, rs_old);
+    SMARTLIST_FOREACH_JOIN(old_c->routerstatus_list,
+                           const routerstatus_t *, rs_old,
+                           current_consensus->routerstatus_list,
+                           const routerstatus_t *, rs_new,
+                           tor_memcmp(rs_old->identity_digest,
+                                      rs_new->identity_digest, DIGEST_LEN),
+                           named_server_map_learn(rs_new)) {
+      if (routerstatus_names_changed(rs_old, rs_new))
+        named_server_map_learn(rs_new);
+    } SMARTLIST_FOREACH_JOIN_END(rs_old, rs_new);
+    return;
+  }
+
   strmap_free(named_server_map, _tor_free);
   named_server_map = strmap_new();
   strmap_free(unnamed_server_map, NULL);
   unnamed_server_map = strmap_new();
   SMARTLIST_FOREACH(current_consensus->routerstatus_list,
-                                                   const routerstatus_t *, rs,
-    {
-      if (rs->is_named) {
-        strmap_set_lc(named_server_map, rs->nickname,
-                      tor_memdup(rs->identity_digest, DIGEST_LEN));
-      }
-      if (rs->is_unnamed) {
-        strmap_set_lc(unnamed_server_map, rs->nickname, (void*)1);
-      }
-    });
+                    const routerstatus_t *, rs,
+                    named_server_map_learn(rs));
 }
 
 /** Given a list <b>routers</b> of routerinfo_t *, update each status field
@@ -2339,6 +2967,7 @@ networkstatus_free_all(void)
   networkstatus_vote_free(current_ns_consensus);
   networkstatus_vote_free(current_md_consensus);
   current_md_consensus = current_ns_consensus = NULL;
+  applied_consensus = NULL;
 
   for (i=0; i < N_CONSENSUS_FLAVORS; ++i) {
     consensus_waiting_for_certs_t *waiting = &consensus_waiting_for_certs[i];
@@ -2347,6 +2976,12 @@ networkstatus_free_all(void)
       waiting->consensus = NULL;
     }
     tor_free(waiting->body);
+    /* Any signature checks still running will free this when they're
+     * done. */
+    if (consensus_sigs_pending[i]) {
+      consensus_sigs_pending[i]->cancelled = 1;
+      consensus_sigs_pending[i] = NULL;
+    }
   }
 
   strmap_free(named_server_map, _tor_free);
@@ -64,8 +64,15 @@ const routerstatus_t *router_get_consensus_status_by_nickname(
                                    int warn_if_unnamed);
 const char *networkstatus_get_router_digest_by_nickname(const char *nickname);
 int networkstatus_nickname_is_unnamed(const char *nickname);
+int networkstatus_get_consensus_diff_base(const char *flavname,
+                                          char *digest_out);
+char *networkstatus_apply_consensus_diff(const char *flavname,
+                                         const char *diff);
 void networkstatus_consensus_download_failed(int status_code,
                                              const char *flavname);
+void networkstatus_consensus_not_modified(const char *flavname, time_t now);
+int networkstatus_get_latest_consensus_digest(const char *flavname,
+                                              char *digest_out);
 void update_consensus_networkstatus_fetch_time(time_t now);
 int should_delay_dir_fetches(const or_options_t *options);
 void update_networkstatus_downloads(time_t now);
@@ -83,6 +90,7 @@ networkstatus_t *networkstatus_get_reasonably_live_consensus(time_t now,
 #define NSSET_DONT_DOWNLOAD_CERTS 4
 #define NSSET_ACCEPT_OBSOLETE 8
 #define NSSET_REQUIRE_FLAVOR 16
+#define NSSET_SIGS_CHECKED 32
 int networkstatus_set_current_consensus(const char *consensus,
                                         const char *flavor,
                                         unsigned flags);
@@ -111,5 +119,15 @@ void document_signature_free(document_signature_t *sig);
 document_signature_t *document_signature_dup(const document_signature_t *sig);
 void networkstatus_free_all(void);
 
+#ifdef NETWORKSTATUS_PRIVATE
+char *networkstatus_snapshot_encode(const smartlist_t *rs_list,
+                                    consensus_flavor_t flav,
+                                    const char *source_digest,
+                                    size_t *len_out);
+smartlist_t *networkstatus_snapshot_decode(const char *body, size_t len,
+                                           consensus_flavor_t flav,
+                                           const char *source_digest);
+#endif
+
 #endif
 
@@ -57,6 +57,41 @@ HT_GENERATE(nodelist_map, node_t, ht_ent, node_id_hash, node_id_eq,
 /** The global nodelist. */
 static nodelist_t *the_nodelist=NULL;
 
+/** Incremented whenever we add or remove a node, or take in a new
+ * consensus: anything that caches facts about the set of nodes can compare
+ * this to notice that it has gone stale. */
+static unsigned nodelist_generation = 1;
+
+/** Hot fields for every node in the_nodelist, when they're current. */
+static node_hot_fields_t node_hot_fields;
+
+/** A set of the nodes whose exit policies might accept connections to one
+ * port at an unknown address: bit <b>i</b> of <b>accepts</b> is set iff
+ * the node with nodelist_idx <b>i</b> might. */
+typedef struct exit_port_set_t {
+  /** The port this set describes, or 0 if the slot is unused. */
+  uint16_t port;
+  /** The nodelist generation this set matches. */
+  unsigned generation;
+  /** Value of exit_port_set_clock when we last looked this set up. */
+  unsigned last_used;
+  /** How many nodes <b>accepts</b> has room for. */
+  int capacity;
+  bitarray_t *accepts;
+} exit_port_set_t;
+
+/** Exit port sets for the ports we've been asked about most recently. */
+static exit_port_set_t exit_port_sets[NODELIST_MAX_EXIT_PORT_SETS];
+/** Incremented on every exit port set lookup. */
+static unsigned exit_port_set_clock = 0;
+
+/** Return the current nodelist generation; see nodelist_generation. */
+unsigned
+nodelist_get_generation(void)
+{
+  return nodelist_generation;
+}
+
 /** Create an empty nodelist if we haven't done so already. */
 static void
 init_nodelist(void)
@@ -109,12 +144,188 @@ node_get_or_create(const char *identity_digest)
 
   smartlist_add(the_nodelist->nodes, node);
   node->nodelist_idx = smartlist_len(the_nodelist->nodes) - 1;
+  ++nodelist_generation;
 
   node->country = -1;
 
   return node;
 }
 
+/** Return the NODE_HOT_* flags for <b>node</b>. */
+static uint16_t
+node_compute_hot_flags(const node_t *node)
+{
+  uint16_t flags = 0;
+  tor_addr_t addr;
+  if (node->is_running) flags |= NODE_HOT_RUNNING;
+  if (node->is_valid) flags |= NODE_HOT_VALID;
+  if (node->is_fast) flags |= NODE_HOT_FAST;
+  if (node->is_stable) flags |= NODE_HOT_STABLE;
+  if (node->is_possible_guard) flags |= NODE_HOT_GUARD;
+  if (node->is_exit) flags |= NODE_HOT_EXIT;
+  if (node->is_bad_exit) flags |= NODE_HOT_BAD_EXIT;
+  if (node_is_dir(node)) flags |= NODE_HOT_DIR;
+  if (node->rs) {
+    flags |= NODE_HOT_IN_CONSENSUS;
+    if (node->rs->has_bandwidth)
+      flags |= NODE_HOT_HAS_BW;
+  }
+  if (node->ri || (node->rs && node->md))
+    flags |= NODE_HOT_HAS_DESC;
+  if (!node->ri || node->ri->purpose == ROUTER_PURPOSE_GENERAL)
+    flags |= NODE_HOT_GENERAL;
+  node_get_addr(node, &addr);
+  if (tor_addr_family(&addr) == AF_INET)
+    flags |= NODE_HOT_HAS_IPV4;
+  return flags;
+}
+
+/** Copy the hot fields of <b>node</b> into slot <b>idx</b> of
+ * <b>hot</b>. */
+static void
+node_hot_fields_set(node_hot_fields_t *hot, int idx, const node_t *node)
+{
+  hot->flags[idx] = node_compute_hot_flags(node);
+  hot->bandwidth[idx] = node->rs ? node->rs->bandwidth : 0;
+  hot->net16[idx] = (uint16_t)(node_get_prim_addr_ipv4h(node) >> 16);
+}
+
+/** Rebuild node_hot_fields from every node in the nodelist. */
+static void
+nodelist_rebuild_hot_fields(void)
+{
+  node_hot_fields_t *hot = &node_hot_fields;
+  int n = smartlist_len(the_nodelist->nodes);
+  if (n > hot->capacity) {
+    hot->capacity = n + n/8 + 16;
+    hot->flags = tor_realloc(hot->flags, sizeof(uint16_t)*hot->capacity);
+    hot->bandwidth = tor_realloc(hot->bandwidth,
+                                 sizeof(uint32_t)*hot->capacity);
+    hot->net16 = tor_realloc(hot->net16, sizeof(uint16_t)*hot->capacity);
+  }
+  SMARTLIST_FOREACH(the_nodelist->nodes, const node_t *, node,
+                    node_hot_fields_set(hot, node_sl_idx, node));
+  hot->n = n;
+  hot->generation = nodelist_generation;
+}
+
+/** Return the hot fields for every node in the nodelist, rebuilding them
+ * if the nodelist has changed, or NULL if we shouldn't use them.
+ * Authorities set node flags in too many places to keep the arrays
+ * current, so they get NULL. */
+const node_hot_fields_t *
+nodelist_get_hot_fields(void)
+{
+  init_nodelist();
+  if (authdir_mode(get_options())) {
+    node_hot_fields.generation = 0;
+    return NULL;
+  }
+  if (node_hot_fields.generation != nodelist_generation)
+    nodelist_rebuild_hot_fields();
+  return &node_hot_fields;
+}
+
+/** Return true iff <b>node</b>'s exit policy might accept connections to
+ * <b>port</b> at an address we don't know yet. */
+static INLINE int
+node_might_accept_port(const node_t *node, uint16_t port)
+{
+  addr_policy_result_t r = compare_tor_addr_to_node_policy(NULL, port, node);
+  return r != ADDR_POLICY_REJECTED && r != ADDR_POLICY_PROBABLY_REJECTED;
+}
+
+/** Set or clear <b>node</b>'s bit in every current exit port set. */
+static void
+exit_port_sets_update_node(const node_t *node)
+{
+  int i;
+  if (node->nodelist_idx < 0)
+    return;
+  for (i = 0; i < NODELIST_MAX_EXIT_PORT_SETS; ++i) {
+    exit_port_set_t *set = &exit_port_sets[i];
+    if (!set->port || set->generation != nodelist_generation ||
+        node->nodelist_idx >= set->capacity)
+      continue;
+    if (node_might_accept_port(node, set->port))
+      bitarray_set(set->accepts, node->nodelist_idx);
+    else
+      bitarray_clear(set->accepts, node->nodelist_idx);
+  }
+}
+
+/** Return a bitarray, indexed by nodelist_idx, with a bit set for each
+ * node whose exit policy might accept connections to <b>port</b> at an
+ * address we don't know yet.  We keep the sets for the
+ * NODELIST_MAX_EXIT_PORT_SETS most recently requested ports, and rebuild
+ * them whenever the set of nodes changes.  The caller must not modify the
+ * result, and it stays valid only until the nodelist changes or
+ * NODELIST_MAX_EXIT_PORT_SETS other ports are looked up. */
+bitarray_t *
+nodelist_get_exit_port_set(uint16_t port)
+{
+  exit_port_set_t *set = NULL;
+  int i, n_nodes;
+  tor_assert(port);
+  init_nodelist();
+  ++exit_port_set_clock;
+
+  for (i = 0; i < NODELIST_MAX_EXIT_PORT_SETS; ++i) {
+    exit_port_set_t *s = &exit_port_sets[i];
+    if (s->port == port) {
+      set = s;
+      break;
+    }
+    if (!set || !s->port ||
+        (set->port && s->last_used < set->last_used))
+      set = s; /* Least recently used so far; replace it if we must. */
+  }
+  set->last_used = exit_port_set_clock;
+  if (set->port == port && set->generation == nodelist_generation)
+    return set->accepts;
+
+  n_nodes = smartlist_len(the_nodelist->nodes);
+  if (!set->accepts || n_nodes > set->capacity) {
+    bitarray_free(set->accepts);
+    set->capacity = n_nodes + n_nodes/8 + 32;
+    set->accepts = bitarray_init_zero(set->capacity);
+  } else {
+    memset(set->accepts, 0,
+           ((set->capacity+BITARRAY_MASK) >> BITARRAY_SHIFT) *
+           sizeof(bitarray_t));
+  }
+  set->port = port;
+  set->generation = nodelist_generation;
+  SMARTLIST_FOREACH(the_nodelist->nodes, const node_t *, node,
+                    if (node_might_accept_port(node, port))
+                      bitarray_set(set->accepts, node_sl_idx));
+  return set->accepts;
+}
+
+/** Free every exit port set. */
+static void
+exit_port_sets_free_all(void)
+{
+  int i;
+  for (i = 0; i < NODELIST_MAX_EXIT_PORT_SETS; ++i)
+    bitarray_free(exit_port_sets[i].accepts);
+  memset(exit_port_sets, 0, sizeof(exit_port_sets));
+}
+
+/** Call this whenever any field of <b>node</b> that goes into its hot
+ * fields or its exit policy may have changed without a new nodelist
+ * generation. */
+void
+nodelist_hot_fields_update_node(const node_t *node)
+{
+  node_hot_fields_t *hot = &node_hot_fields;
+  exit_port_sets_update_node(node);
+  if (hot->generation != nodelist_generation ||
+      node->nodelist_idx < 0 || node->nodelist_idx >= hot->n)
+    return;
+  node_hot_fields_set(hot, node->nodelist_idx, node);
+}
+
 /** Add <b>ri</b> to the nodelist. */
 node_t *
 nodelist_add_routerinfo(routerinfo_t *ri)
@@ -133,6 +344,7 @@ nodelist_add_routerinfo(routerinfo_t *ri)
     dirserv_set_node_flags_from_authoritative_status(node, status);
   }
 
+  nodelist_hot_fields_update_node(node);
   return node;
 }
 
@@ -163,6 +375,72 @@ nodelist_add_microdesc(microdesc_t *md)
       node->md->held_by_nodes--;
     node->md = md;
     md->held_by_nodes++;
+    nodelist_hot_fields_update_node(node);
+  }
+  return node;
+}
+
+/** Given two routerstatus entries for the same router, return true iff
+ * they differ in anything that we copy into its node_t or derive from its
+ * routerstatus. */
+static int
+routerstatus_changed_for_node(const routerstatus_t *a,
+                              const routerstatus_t *b)
+{
+  return a->addr != b->addr ||
+    a->or_port != b->or_port ||
+    a->dir_port != b->dir_port ||
+    a->bandwidth != b->bandwidth ||
+    a->has_bandwidth != b->has_bandwidth ||
+    a->is_valid != b->is_valid ||
+    a->is_flagged_running != b->is_flagged_running ||
+    a->is_fast != b->is_fast ||
+    a->is_stable != b->is_stable ||
+    a->is_possible_guard != b->is_possible_guard ||
+    a->is_exit != b->is_exit ||
+    a->is_bad_directory != b->is_bad_directory ||
+    a->is_bad_exit != b->is_bad_exit ||
+    a->is_hs_dir != b->is_hs_dir ||
+    a->is_v2_dir != b->is_v2_dir ||
+    fast_memneq(a->descriptor_digest, b->descriptor_digest, DIGEST256_LEN);
+}
+
+/** Helper for nodelist_set_consensus(): make <b>rs</b>, from a consensus of
+ * flavor <b>flav</b>, the routerstatus of its node, and return the node.
+ * If <b>changed</b> is false, the node's last routerstatus said the same
+ * thing, so skip the work that depends only on what it says. */
+static node_t *
+nodelist_set_routerstatus(routerstatus_t *rs, consensus_flavor_t flav,
+                          int authdir, int changed)
+{
+  node_t *node = node_get_or_create(rs->identity_digest);
+  node->rs = rs;
+  if (flav == FLAV_MICRODESC) {
+    if (node->md == NULL ||
+        tor_memneq(node->md->digest,rs->descriptor_digest,DIGEST256_LEN)) {
+      if (node->md)
+        node->md->held_by_nodes--;
+      node->md = microdesc_cache_lookup_by_digest256(NULL,
+                                                     rs->descriptor_digest);
+      if (node->md)
+        node->md->held_by_nodes++;
+    }
+  }
+
+  if (changed || node->country == -1)
+    node_set_country(node);
+
+  /* If we're not an authdir, believe others. */
+  if (!authdir) {
+    node->is_valid = rs->is_valid;
+    node->is_running = rs->is_flagged_running;
+    node->is_fast = rs->is_fast;
+    node->is_stable = rs->is_stable;
+    node->is_possible_guard = rs->is_possible_guard;
+    node->is_exit = rs->is_exit;
+    node->is_bad_directory = rs->is_bad_directory;
+    node->is_bad_exit = rs->is_bad_exit;
+    node->is_hs_dir = rs->is_hs_dir;
   }
   return node;
 }
@@ -171,51 +449,49 @@ nodelist_add_microdesc(microdesc_t *md)
  * This makes the nodelist change all of the routerstatus entries for
  * the nodes, drop nodes that no longer have enough info to get used,
  * and grab microdescriptors into nodes as appropriate.
+ *
+ * If <b>old_ns</b> is set, it's the consensus that the nodelist was last
+ * set from, and it's still allocated: compare the two by identity, and
+ * only redo per-node work for the entries that changed.
  */
 void
-nodelist_set_consensus(networkstatus_t *ns)
+nodelist_set_consensus(networkstatus_t *ns, const networkstatus_t *old_ns)
 {
   const or_options_t *options = get_options();
   int authdir = authdir_mode_v2(options) || authdir_mode_v3(options);
+  const consensus_flavor_t flav = ns->flavor;
+  smartlist_t *changed = NULL;
+  int hot_was_current;
+  unsigned generation;
 
   init_nodelist();
-  if (ns->flavor == FLAV_MICRODESC)
+  if (flav == FLAV_MICRODESC)
     (void) get_microdesc_cache(); /* Make sure it exists first. */
+  hot_was_current = node_hot_fields.generation == nodelist_generation;
+  generation = ++nodelist_generation;
 
   SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
                     node->rs = NULL);
 
-  SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
-    node_t *node = node_get_or_create(rs->identity_digest);
-    node->rs = rs;
-    if (ns->flavor == FLAV_MICRODESC) {
-      if (node->md == NULL ||
-          tor_memneq(node->md->digest,rs->descriptor_digest,DIGEST256_LEN)) {
-        if (node->md)
-          node->md->held_by_nodes--;
-        node->md = microdesc_cache_lookup_by_digest256(NULL,
-                                                       rs->descriptor_digest);
-        if (node->md)
-          node->md->held_by_nodes++;
-      }
-    }
-
-    node_set_country(node);
-
-    /* If we're not an authdir, believe others. */
-    if (!authdir) {
-      node->is_valid = rs->is_valid;
-      node->is_running = rs->is_flagged_running;
-      node->is_fast = rs->is_fast;
-      node->is_stable = rs->is_stable;
-      node->is_possible_guard = rs->is_possible_guard;
-      node->is_exit = rs->is_exit;
-      node->is_bad_directory = rs->is_bad_directory;
-      node->is_bad_exit = rs->is_bad_exit;
-      node->is_hs_dir = rs->is_hs_dir;
-    }
-
-  } SMARTLIST_FOREACH_END(rs);
+  if (old_ns && old_ns->flavor == flav) {
+    changed = smartlist_create();
+    SMARTLIST_FOREACH_JOIN(old_ns->routerstatus_list,
+                           const routerstatus_t *, rs_old,
+                           ns->routerstatus_list, routerstatus_t *, rs_new,
+                           tor_memcmp(rs_old->identity_digest,
+                                      rs_new->identity_digest, DIGEST_LEN),
+         smartlist_add(changed,
+                       nodelist_set_routerstatus(rs_new, flav, authdir, 1))) {
+      if (routerstatus_changed_for_node(rs_old, rs_new))
+        smartlist_add(changed,
+                      nodelist_set_routerstatus(rs_new, flav, authdir, 1));
+      else
+        nodelist_set_routerstatus(rs_new, flav, authdir, 0);
+    } SMARTLIST_FOREACH_JOIN_END(rs_old, rs_new);
+  } else {
+    SMARTLIST_FOREACH(ns->routerstatus_list, routerstatus_t *, rs,
+                      nodelist_set_routerstatus(rs, flav, authdir, 1));
+  }
 
   nodelist_purge();
 
@@ -233,9 +509,24 @@ nodelist_set_consensus(networkstatus_t *ns)
             node->is_possible_guard = node->is_exit =
             node->is_bad_exit = node->is_bad_directory = 0;
         }
+        if (changed)
+          smartlist_add(changed, node);
       }
     } SMARTLIST_FOREACH_END(node);
   }
+
+  if (!authdir) {
+    /* If no node came or went, every slot in the hot fields still belongs
+     * to the same node, and only the changed ones need a new value. */
+    if (changed && hot_was_current && generation == nodelist_generation) {
+      node_hot_fields.generation = nodelist_generation;
+      SMARTLIST_FOREACH(changed, const node_t *, node,
+                        nodelist_hot_fields_update_node(node));
+    } else {
+      nodelist_rebuild_hot_fields();
+    }
+  }
+  smartlist_free(changed);
 }
 
 /** Helper: return true iff a node has a usable amount of information*/
@@ -254,6 +545,7 @@ nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md)
   if (node && node->md == md) {
     node->md = NULL;
     md->held_by_nodes--;
+    nodelist_hot_fields_update_node(node);
   }
 }
 
@@ -267,6 +559,8 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
     if (! node_is_usable(node)) {
       nodelist_drop_node(node, 1);
       node_free(node);
+    } else {
+      nodelist_hot_fields_update_node(node);
     }
   }
 }
@@ -293,6 +587,7 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
     tmp->nodelist_idx = idx;
   }
   node->nodelist_idx = -1;
+  ++nodelist_generation;
 }
 
 /** Release storage held by <b>node</b>  */
@@ -353,6 +648,13 @@ nodelist_free_all(void)
   smartlist_free(the_nodelist->nodes);
 
   tor_free(the_nodelist);
+  ++nodelist_generation;
+
+  tor_free(node_hot_fields.flags);
+  tor_free(node_hot_fields.bandwidth);
+  tor_free(node_hot_fields.net16);
+  memset(&node_hot_fields, 0, sizeof(node_hot_fields));
+  exit_port_sets_free_all();
 }
 
 /** Check that the nodelist is internally consistent, and consistent with
@@ -494,7 +796,7 @@ node_get_by_nickname(const char *nickname, int warn_if_unnamed)
 
   /* Okay, so the name is not canonical for anybody. */
   {
-    smartlist_t *matches = smartlist_create();
+    SMARTLIST_DECLARE_LOCAL(matches, 4);
     const node_t *choice = NULL;
 
     SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
@@ -535,7 +837,7 @@ node_get_by_nickname(const char *nickname, int warn_if_unnamed)
     if (smartlist_len(matches))
       choice = smartlist_get(matches, 0);
 
-    smartlist_free(matches);
+    smartlist_free_local(matches);
     return choice;
   }
 }
@@ -657,7 +959,7 @@ node_exit_policy_rejects_all(const node_t *node)
 smartlist_t *
 node_get_all_orports(const node_t *node)
 {
-  smartlist_t *sl = smartlist_create();
+  smartlist_t *sl = smartlist_create_with_capacity(2);
 
   if (node->ri != NULL) {
     if (node->ri->addr != 0) {
@@ -784,7 +1086,7 @@ node_get_platform(const node_t *node)
    * the consensus lists it.  We don't, though, so this function just won't
    * work with microdescriptors. */
   if (node->ri)
-    return node->ri->platform;
+    return router_get_platform(node->ri);
   else
     return NULL;
 }
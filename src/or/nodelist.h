@@ -17,7 +17,8 @@ const node_t *node_get_by_id(const char *identity_digest);
 const node_t *node_get_by_hex_id(const char *identity_digest);
 node_t *nodelist_add_routerinfo(routerinfo_t *ri);
 node_t *nodelist_add_microdesc(microdesc_t *md);
-void nodelist_set_consensus(networkstatus_t *ns);
+void nodelist_set_consensus(networkstatus_t *ns,
+                            const networkstatus_t *old_ns);
 
 void nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md);
 void nodelist_remove_routerinfo(routerinfo_t *ri);
@@ -52,6 +53,52 @@ time_t node_get_published_on(const node_t *node);
 const smartlist_t *node_get_declared_family(const node_t *node);
 
 smartlist_t *nodelist_get_list(void);
+unsigned nodelist_get_generation(void);
+
+/** Flags for node_hot_fields_t.flags: each is true iff the node_t field or
+ * condition it's named for holds. */
+#define NODE_HOT_RUNNING      (1u<<0)
+#define NODE_HOT_VALID        (1u<<1)
+#define NODE_HOT_FAST         (1u<<2)
+#define NODE_HOT_STABLE       (1u<<3)
+#define NODE_HOT_GUARD        (1u<<4)
+#define NODE_HOT_EXIT         (1u<<5)
+#define NODE_HOT_BAD_EXIT     (1u<<6)
+/** As node_is_dir(). */
+#define NODE_HOT_DIR          (1u<<7)
+/** The node has a routerstatus in our consensus. */
+#define NODE_HOT_IN_CONSENSUS (1u<<8)
+/** The node's routerstatus lists a bandwidth. */
+#define NODE_HOT_HAS_BW       (1u<<9)
+/** The node has a routerinfo, or a routerstatus and a microdesc. */
+#define NODE_HOT_HAS_DESC     (1u<<10)
+/** The node has no routerinfo, or one with ROUTER_PURPOSE_GENERAL. */
+#define NODE_HOT_GENERAL      (1u<<11)
+/** node_get_addr() gives an IPv4 address. */
+#define NODE_HOT_HAS_IPV4     (1u<<12)
+
+/** Parallel arrays of the node fields that path selection checks on every
+ * candidate, indexed by nodelist_idx, so that filtering and weighting
+ * loops can scan them without following each node's rs, ri, and md
+ * pointers. */
+typedef struct node_hot_fields_t {
+  /** The nodelist generation these arrays match, or 0 if they're stale. */
+  unsigned generation;
+  int n; /**< How many nodes are in the arrays? */
+  int capacity; /**< How many nodes can the arrays hold? */
+  uint16_t *flags; /**< NODE_HOT_* flags for each node. */
+  /** The consensus bandwidth of each node, in kilobytes, or 0. */
+  uint32_t *bandwidth;
+  /** The top 16 bits of each node's IPv4 address, if it has one. */
+  uint16_t *net16;
+} node_hot_fields_t;
+
+const node_hot_fields_t *nodelist_get_hot_fields(void);
+void nodelist_hot_fields_update_node(const node_t *node);
+
+/** How many ports nodelist_get_exit_port_set() keeps sets for at once. */
+#define NODELIST_MAX_EXIT_PORT_SETS 32
+bitarray_t *nodelist_get_exit_port_set(uint16_t port);
 
 /* Temporary during transition to multiple addresses.  */
 void node_get_addr(const node_t *node, tor_addr_t *addr_out);
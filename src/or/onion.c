@@ -20,48 +20,164 @@
  * to process a waiting onion handshake. */
 typedef struct onion_queue_t {
   or_circuit_t *circ;
+  const onion_handshake_t *handshake; /**< Which handshake it's waiting on. */
   char *onionskin;
   time_t when_added;
+  /** The source whose queue this entry is on. */
+  struct onion_source_t *source;
   struct onion_queue_t *next;
+  struct onion_queue_t *prev;
 } onion_queue_t;
 
+/** The pending onionskins that arrived on a single OR connection, oldest
+ * first.  We hand onionskins to cpuworkers round-robin across sources, so
+ * that a few peers sending CREATE cells as fast as they can don't starve
+ * everybody else. */
+typedef struct onion_source_t {
+  /** Global identifier of the OR connection these onionskins came from. */
+  uint64_t conn_id;
+  onion_queue_t *head;
+  onion_queue_t *tail;
+  /** Length of the list from head to tail. */
+  int n;
+} onion_source_t;
+
 /** 5 seconds on the onion queue til we just send back a destroy */
 #define ONIONQUEUE_WAIT_CUTOFF 5
 
-/** First and last elements in the linked list of circuits waiting for CPU
- * workers, or NULL if the list is empty. */
-static onion_queue_t *ol_list=NULL;
-static onion_queue_t *ol_tail=NULL;
-/** Length of ol_list */
+/** Every onion_source_t that has at least one pending onionskin, in the
+ * order we serve them.  NULL until we first need it. */
+static smartlist_t *ol_sources = NULL;
+/** Index in ol_sources of the source to serve next. */
+static int ol_next_source = 0;
+/** Total number of onionskins pending across all sources */
 static int ol_length=0;
 
-/** Add <b>circ</b> to the end of ol_list and return 0, except
- * if ol_list is too long, in which case do nothing and return -1.
+/** How many onionskins have we queued since we started? */
+static uint64_t stats_n_onions_queued = 0;
+/** How many queued onionskins did we drop for being too old? */
+static uint64_t stats_n_onions_expired = 0;
+/** How many onionskins did we drop or refuse because the queue was full? */
+static uint64_t stats_n_onions_overflowed = 0;
+
+/** Return the onion_source_t for the OR connection with global identifier
+ * <b>conn_id</b>, creating it at the end of the service order if
+ * <b>create</b> is true and it doesn't exist yet. */
+static onion_source_t *
+onion_source_get(uint64_t conn_id, int create)
+{
+  onion_source_t *src;
+  if (!ol_sources)
+    ol_sources = smartlist_create();
+  SMARTLIST_FOREACH(ol_sources, onion_source_t *, s,
+                    if (s->conn_id == conn_id) return s);
+  if (!create)
+    return NULL;
+  src = tor_malloc_zero(sizeof(onion_source_t));
+  src->conn_id = conn_id;
+  /* Join the rotation just before whoever we're serving next, so that a
+   * new source waits for a full round like everybody else. */
+  if (ol_next_source < smartlist_len(ol_sources)) {
+    smartlist_insert(ol_sources, ol_next_source, src);
+    ++ol_next_source;
+  } else {
+    smartlist_add(ol_sources, src);
+  }
+  return src;
+}
+
+/** Unlink <b>victim</b> from its source's list, free the source if that
+ * leaves it empty, then free <b>victim</b> and its onionskin.  Leave the
+ * circuit itself alone. */
+static void
+onion_queue_entry_remove(onion_queue_t *victim)
+{
+  onion_source_t *src = victim->source;
+
+  if (victim->prev)
+    victim->prev->next = victim->next;
+  else
+    src->head = victim->next;
+  if (victim->next)
+    victim->next->prev = victim->prev;
+  else
+    src->tail = victim->prev;
+  --src->n;
+  --ol_length;
+
+  if (!src->n) {
+    int idx = -1;
+    SMARTLIST_FOREACH(ol_sources, onion_source_t *, s,
+                      if (s == src) { idx = s_sl_idx; break; });
+    tor_assert(idx >= 0);
+    smartlist_del_keeporder(ol_sources, idx);
+    if (idx < ol_next_source)
+      --ol_next_source;
+    if (ol_next_source >= smartlist_len(ol_sources))
+      ol_next_source = 0;
+    tor_free(src);
+  }
+
+  victim->circ->onionqueue_entry = NULL;
+  tor_free(victim->onionskin);
+  tor_free(victim);
+}
+
+/** Remove the oldest pending onionskin from <b>src</b> and close its
+ * circuit with <b>reason</b>. */
+static void
+onion_source_drop_oldest(onion_source_t *src, int reason)
+{
+  or_circuit_t *circ = src->head->circ;
+  onion_pending_remove(circ);
+  circuit_mark_for_close(TO_CIRCUIT(circ), reason);
+}
+
+/** Close every pending circuit that has been waiting for longer than
+ * ONIONQUEUE_WAIT_CUTOFF. */
+static void
+onion_pending_cull_expired(time_t now)
+{
+  int i;
+  /* Walk backwards, since culling can remove a source from the list. */
+  for (i = smartlist_len(ol_sources) - 1; i >= 0; --i) {
+    onion_source_t *src;
+    if (i >= smartlist_len(ol_sources))
+      continue;
+    src = smartlist_get(ol_sources, i);
+    while (src->head &&
+           (int)(now - src->head->when_added) >= ONIONQUEUE_WAIT_CUTOFF) {
+      int last = (src->n == 1);
+      /* cull elderly requests. */
+      log_info(LD_CIRC,
+             "Circuit create request is too old; canceling due to overload.");
+      ++stats_n_onions_expired;
+      onion_source_drop_oldest(src, END_CIRC_REASON_RESOURCELIMIT);
+      if (last)
+        break; /* src is freed. */
+    }
+  }
+}
+
+/** Add <b>circ</b> to the end of its OR connection's pending list and return
+ * 0, except if we already have too many onionskins pending, in which case
+ * return -1.  When we're full, a connection with fewer pending onionskins
+ * than the busiest one can still get in, by pushing out the busiest
+ * connection's oldest request.
  */
 int
-onion_pending_add(or_circuit_t *circ, char *onionskin)
+onion_pending_add(or_circuit_t *circ, const onion_handshake_t *handshake,
+                  char *onionskin)
 {
   onion_queue_t *tmp;
+  onion_source_t *src;
   time_t now = time(NULL);
 
-  tmp = tor_malloc_zero(sizeof(onion_queue_t));
-  tmp->circ = circ;
-  tmp->onionskin = onionskin;
-  tmp->when_added = now;
-
-  if (!ol_tail) {
-    tor_assert(!ol_list);
-    tor_assert(!ol_length);
-    ol_list = tmp;
-    ol_tail = tmp;
-    ol_length++;
-    return 0;
-  }
-
-  tor_assert(ol_list);
-  tor_assert(!ol_tail->next);
+  tor_assert(circ->p_conn);
+  tor_assert(!circ->onionqueue_entry);
 
-  if (ol_length >= get_options()->MaxOnionsPending) {
+  if (ol_length >= (int)get_options()->MaxOnionsPending) {
+    onion_source_t *busiest = NULL;
 #define WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL (60)
     static ratelim_t last_warned =
       RATELIM_INIT(WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL);
@@ -74,85 +190,222 @@ onion_pending_add(or_circuit_t *circ, char *onionskin)
                "restricted exit policy.%s",m);
       tor_free(m);
     }
-    tor_free(tmp);
-    return -1;
+    ++stats_n_onions_overflowed;
+
+    src = onion_source_get(circ->p_conn->_base.global_identifier, 0);
+    SMARTLIST_FOREACH(ol_sources, onion_source_t *, s,
+                      if (!busiest || s->n > busiest->n) busiest = s);
+    if (!busiest || busiest->n <= (src ? src->n : 0) + 1)
+      return -1;
+    log_info(LD_CIRC, "Too many create requests pending; dropping the "
+             "oldest one from the connection with the most.");
+    onion_source_drop_oldest(busiest, END_CIRC_REASON_RESOURCELIMIT);
   }
 
-  ol_length++;
-  ol_tail->next = tmp;
-  ol_tail = tmp;
-  while ((int)(now - ol_list->when_added) >= ONIONQUEUE_WAIT_CUTOFF) {
-    /* cull elderly requests. */
-    circ = ol_list->circ;
-    onion_pending_remove(ol_list->circ);
-    log_info(LD_CIRC,
-             "Circuit create request is too old; canceling due to overload.");
-    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
-  }
+  src = onion_source_get(circ->p_conn->_base.global_identifier, 1);
+
+  tmp = tor_malloc_zero(sizeof(onion_queue_t));
+  tmp->circ = circ;
+  tmp->handshake = handshake;
+  tmp->onionskin = onionskin;
+  tmp->when_added = now;
+  tmp->source = src;
+  tmp->prev = src->tail;
+  if (src->tail)
+    src->tail->next = tmp;
+  else
+    src->head = tmp;
+  src->tail = tmp;
+  ++src->n;
+  ++ol_length;
+  circ->onionqueue_entry = tmp;
+  ++stats_n_onions_queued;
+
+  onion_pending_cull_expired(now);
   return 0;
 }
 
-/** Remove the first item from ol_list and return it, or return
- * NULL if the list is empty.
+/** Remove the oldest onionskin from the next source in round-robin order
+ * and return its circuit, or return NULL if nothing is pending.  Set
+ * *<b>handshake_out</b> to the handshake the onionskin is for.
  */
 or_circuit_t *
-onion_next_task(char **onionskin_out)
+onion_next_task(const onion_handshake_t **handshake_out, char **onionskin_out)
 {
   or_circuit_t *circ;
+  onion_source_t *src;
+  onion_queue_t *head;
 
-  if (!ol_list)
+  if (!ol_length)
     return NULL; /* no onions pending, we're done */
 
-  tor_assert(ol_list->circ);
-  tor_assert(ol_list->circ->p_conn); /* make sure it's still valid */
-  tor_assert(ol_length > 0);
-  circ = ol_list->circ;
-  *onionskin_out = ol_list->onionskin;
-  ol_list->onionskin = NULL; /* prevent free. */
-  onion_pending_remove(ol_list->circ);
+  tor_assert(ol_next_source < smartlist_len(ol_sources));
+  src = smartlist_get(ol_sources, ol_next_source);
+  head = src->head;
+  tor_assert(head);
+  tor_assert(head->circ);
+  tor_assert(head->circ->p_conn); /* make sure it's still valid */
+  circ = head->circ;
+  *handshake_out = head->handshake;
+  *onionskin_out = head->onionskin;
+  head->onionskin = NULL; /* prevent free. */
+  /* Move on to the next source; if this was src's last onionskin,
+   * removing it already leaves ol_next_source pointing there. */
+  if (src->n > 1)
+    ol_next_source = (ol_next_source + 1) % smartlist_len(ol_sources);
+  onion_queue_entry_remove(head);
   return circ;
 }
 
-/** Go through ol_list, find the onion_queue_t element which points to
- * circ, remove and free that element. Leave circ itself alone.
+/** If <b>circ</b> is waiting for a cpuworker, remove it from the pending
+ * list and free that entry. Leave circ itself alone.
  */
 void
 onion_pending_remove(or_circuit_t *circ)
 {
-  onion_queue_t *tmpo, *victim;
-
-  if (!ol_list)
-    return; /* nothing here. */
-
-  /* first check to see if it's the first entry */
-  tmpo = ol_list;
-  if (tmpo->circ == circ) {
-    /* it's the first one. remove it from the list. */
-    ol_list = tmpo->next;
-    if (!ol_list)
-      ol_tail = NULL;
-    ol_length--;
-    victim = tmpo;
-  } else { /* we need to hunt through the rest of the list */
-    for ( ;tmpo->next && tmpo->next->circ != circ; tmpo=tmpo->next) ;
-    if (!tmpo->next) {
-      log_debug(LD_GENERAL,
-                "circ (p_circ_id %d) not in list, probably at cpuworker.",
-                circ->p_circ_id);
-      return;
-    }
-    /* now we know tmpo->next->circ == circ */
-    victim = tmpo->next;
-    tmpo->next = victim->next;
-    if (ol_tail == victim)
-      ol_tail = tmpo;
-    ol_length--;
+  if (!circ->onionqueue_entry) {
+    log_debug(LD_GENERAL,
+              "circ (p_circ_id %d) not in list, probably at cpuworker.",
+              circ->p_circ_id);
+    return;
   }
+  onion_queue_entry_remove(circ->onionqueue_entry);
+}
 
-  /* now victim points to the element that needs to be removed */
+/** Log how many onionskins are pending, from how many connections, and what
+ * has happened to the onionskins we've queued, at log level
+ * <b>severity</b>. */
+void
+dump_onion_pending_stats(int severity)
+{
+  log(severity, LD_OR,
+      "Onionskins pending: %d from %d connections. Since startup: "
+      U64_FORMAT" queued, "U64_FORMAT" expired, "U64_FORMAT" refused or "
+      "pushed out by a full queue.",
+      ol_length, ol_sources ? smartlist_len(ol_sources) : 0,
+      U64_PRINTF_ARG(stats_n_onions_queued),
+      U64_PRINTF_ARG(stats_n_onions_expired),
+      U64_PRINTF_ARG(stats_n_onions_overflowed));
+}
 
-  tor_free(victim->onionskin);
-  tor_free(victim);
+/** Return the number of onionskins waiting for a cpuworker. */
+int
+onion_pending_len(void)
+{
+  return ol_length;
+}
+
+/*----------------------------------------------------------------------*/
+
+/** How many pregenerated circuit DH keypairs do we keep around? */
+#define ONION_DH_POOL_SIZE 64
+
+/** Lock protecting dh_pool and dh_pool_len; NULL until onion_dh_pool_init()
+ * is called, in which case we don't pregenerate keys at all. */
+static tor_mutex_t *dh_pool_lock = NULL;
+/** Circuit DH keypairs whose public halves we've already generated, ready
+ * for onion_skin_server_handshake() to use. */
+static crypto_dh_env_t *dh_pool[ONION_DH_POOL_SIZE];
+/** How many entries of dh_pool are in use? */
+static int dh_pool_len = 0;
+
+/** Start keeping a pool of pregenerated DH keypairs for server-side onion
+ * handshakes.  Must be called from the main thread before any other thread
+ * uses the pool. */
+void
+onion_dh_pool_init(void)
+{
+  if (!dh_pool_lock)
+    dh_pool_lock = tor_mutex_new();
+}
+
+/** Return true iff the DH keypair pool has been set up and is full. */
+int
+onion_dh_pool_is_full(void)
+{
+  int full;
+  if (!dh_pool_lock)
+    return 1;
+  tor_mutex_acquire(dh_pool_lock);
+  full = (dh_pool_len == ONION_DH_POOL_SIZE);
+  tor_mutex_release(dh_pool_lock);
+  return full;
+}
+
+/** If the DH keypair pool isn't full, generate one more keypair for it.
+ * Safe to call from any thread once onion_dh_pool_init() has run.  Return
+ * 1 if we added a keypair, 0 if the pool was full, and -1 on error. */
+int
+onion_dh_pool_fill_one(void)
+{
+  crypto_dh_env_t *dh;
+  if (onion_dh_pool_is_full())
+    return 0;
+
+  /* Do the expensive part without holding the lock. */
+  dh = crypto_dh_new(DH_TYPE_CIRCUIT);
+  if (!dh || crypto_dh_generate_public(dh) < 0) {
+    if (dh)
+      crypto_dh_free(dh);
+    return -1;
+  }
+
+  tor_mutex_acquire(dh_pool_lock);
+  if (dh_pool_len < ONION_DH_POOL_SIZE) {
+    dh_pool[dh_pool_len++] = dh;
+    dh = NULL;
+  }
+  tor_mutex_release(dh_pool_lock);
+  if (dh) {
+    /* Somebody else filled the last slot first. */
+    crypto_dh_free(dh);
+    return 0;
+  }
+  return 1;
+}
+
+/** Return how many pregenerated DH keypairs are waiting in the pool. */
+int
+onion_dh_pool_len(void)
+{
+  int n;
+  if (!dh_pool_lock)
+    return 0;
+  tor_mutex_acquire(dh_pool_lock);
+  n = dh_pool_len;
+  tor_mutex_release(dh_pool_lock);
+  return n;
+}
+
+/** Remove and return a pregenerated circuit DH keypair from the pool, or
+ * return NULL if there are none. */
+static crypto_dh_env_t *
+onion_dh_pool_take(void)
+{
+  crypto_dh_env_t *dh = NULL;
+  if (!dh_pool_lock)
+    return NULL;
+  tor_mutex_acquire(dh_pool_lock);
+  if (dh_pool_len)
+    dh = dh_pool[--dh_pool_len];
+  tor_mutex_release(dh_pool_lock);
+  return dh;
+}
+
+/** Free every pregenerated DH keypair, and the pool's lock.  Only call this
+ * once no other thread can be using the pool: since we never join our pool
+ * cpuworkers, that means only from unit tests. */
+void
+onion_dh_pool_free_all(void)
+{
+  int i;
+  for (i = 0; i < dh_pool_len; ++i)
+    crypto_dh_free(dh_pool[i]);
+  dh_pool_len = 0;
+  if (dh_pool_lock) {
+    tor_mutex_free(dh_pool_lock);
+    dh_pool_lock = NULL;
+  }
 }
 
 /*----------------------------------------------------------------------*/
@@ -258,7 +511,11 @@ onion_skin_server_handshake(const char *onion_skin, /*ONIONSKIN_CHALLENGE_LEN*/
     goto err;
   }
 
-  dh = crypto_dh_new(DH_TYPE_CIRCUIT);
+  /* Use a keypair we made earlier if we have one; otherwise we'll generate
+   * one in crypto_dh_get_public(). */
+  dh = onion_dh_pool_take();
+  if (!dh)
+    dh = crypto_dh_new(DH_TYPE_CIRCUIT);
   if (!dh) {
     log_warn(LD_BUG, "Couldn't allocate DH key");
     goto err;
@@ -430,17 +687,63 @@ fast_client_handshake(const uint8_t *handshake_state,/*DIGEST_LEN bytes*/
   return r;
 }
 
+/** Helper for the onion_handshakes table: answer a CREATE_FAST cell. */
+static int
+fast_server_handshake_answer(const char *onionskin,
+                             crypto_pk_env_t *onion_key,
+                             crypto_pk_env_t *prev_onion_key,
+                             char *reply_out, char *keys_out,
+                             size_t keys_out_len)
+{
+  (void)onion_key;
+  (void)prev_onion_key;
+  return fast_server_handshake((const uint8_t*)onionskin,
+                               (uint8_t*)reply_out,
+                               (uint8_t*)keys_out, keys_out_len);
+}
+
+/** Every handshake we know how to answer as a relay. */
+static const onion_handshake_t onion_handshakes[] = {
+  { "TAP", CELL_CREATE, CELL_CREATED,
+    ONIONSKIN_CHALLENGE_LEN, ONIONSKIN_REPLY_LEN, DH_KEY_LEN,
+    ONIONSKIN_TYPE_CREATE, 1, 0, onion_skin_server_handshake },
+  { "CREATE_FAST", CELL_CREATE_FAST, CELL_CREATED_FAST,
+    DIGEST_LEN, DIGEST_LEN*2, DIGEST_LEN,
+    ONIONSKIN_TYPE_CREATE_FAST, 0, 1, fast_server_handshake_answer },
+};
+
+/** Return the handshake that a create cell with command <b>cell_type</b>
+ * starts, or NULL if there isn't one. */
+const onion_handshake_t *
+onion_handshake_by_create_cell(uint8_t cell_type)
+{
+  unsigned i;
+  for (i = 0; i < sizeof(onion_handshakes)/sizeof(onion_handshakes[0]); ++i) {
+    if (onion_handshakes[i].create_cell_type == cell_type)
+      return &onion_handshakes[i];
+  }
+  return NULL;
+}
+
 /** Remove all circuits from the pending list.  Called from tor_free_all. */
 void
 clear_pending_onions(void)
 {
-  while (ol_list) {
-    onion_queue_t *victim = ol_list;
-    ol_list = victim->next;
-    tor_free(victim->onionskin);
-    tor_free(victim);
+  if (ol_sources) {
+    SMARTLIST_FOREACH_BEGIN(ol_sources, onion_source_t *, src) {
+      while (src->head) {
+        onion_queue_t *victim = src->head;
+        src->head = victim->next;
+        victim->circ->onionqueue_entry = NULL;
+        tor_free(victim->onionskin);
+        tor_free(victim);
+      }
+      tor_free(src);
+    } SMARTLIST_FOREACH_END(src);
+    smartlist_free(ol_sources);
+    ol_sources = NULL;
   }
-  ol_list = ol_tail = NULL;
+  ol_next_source = 0;
   ol_length = 0;
 }
 
@@ -12,9 +12,59 @@
 #ifndef _TOR_ONION_H
 #define _TOR_ONION_H
 
-int onion_pending_add(or_circuit_t *circ, char *onionskin);
-or_circuit_t *onion_next_task(char **onionskin_out);
+/** The longest onionskin that any handshake in onion_handshake_t takes. */
+#define MAX_ONIONSKIN_CHALLENGE_LEN ONIONSKIN_CHALLENGE_LEN
+/** The longest reply that any handshake in onion_handshake_t sends. */
+#define MAX_ONIONSKIN_REPLY_LEN ONIONSKIN_REPLY_LEN
+
+/** How we answer, as a relay, one kind of circuit-creation handshake.  Each
+ * handshake has its own create cell type; command.c, cpuworker.c and
+ * onionskin_answer() look everything else up here, so adding a handshake
+ * means adding an entry to the table in onion.c. */
+typedef struct onion_handshake_t {
+  const char *name; /**< Name for log messages. */
+  uint8_t create_cell_type; /**< Cell command that starts this handshake. */
+  uint8_t created_cell_type; /**< Cell command that answers it. */
+  size_t onionskin_len; /**< How long is the client's onionskin? */
+  size_t reply_len; /**< How long is our reply? */
+  /** Where in the reply is the DIGEST_LEN-byte digest that we remember as
+   * the circuit's handshake_digest? */
+  size_t handshake_digest_offset;
+  onionskin_type_t stats_type; /**< Which statistics do we count it in? */
+  /** True iff this handshake is expensive enough that we should hand it to
+   * a cpuworker rather than answer it on the main thread. */
+  unsigned int use_cpuworker : 1;
+  /** True iff only clients use this handshake, and only for the first hop
+   * of a circuit. */
+  unsigned int first_hop_only : 1;
+  /** Answer the <b>onionskin_len</b>-byte <b>onionskin</b>: write a
+   * <b>reply_len</b>-byte reply into <b>reply_out</b> and
+   * <b>keys_out_len</b> bytes of key material into <b>keys_out</b>.  The
+   * onion keys are only provided when use_cpuworker is set; they are NULL
+   * otherwise.  Return 0 on success, -1 on failure. */
+  int (*server_handshake)(const char *onionskin,
+                          crypto_pk_env_t *onion_key,
+                          crypto_pk_env_t *prev_onion_key,
+                          char *reply_out,
+                          char *keys_out,
+                          size_t keys_out_len);
+} onion_handshake_t;
+
+const onion_handshake_t *onion_handshake_by_create_cell(uint8_t cell_type);
+
+int onion_pending_add(or_circuit_t *circ, const onion_handshake_t *handshake,
+                      char *onionskin);
+or_circuit_t *onion_next_task(const onion_handshake_t **handshake_out,
+                              char **onionskin_out);
 void onion_pending_remove(or_circuit_t *circ);
+void dump_onion_pending_stats(int severity);
+int onion_pending_len(void);
+
+void onion_dh_pool_init(void);
+int onion_dh_pool_is_full(void);
+int onion_dh_pool_fill_one(void);
+int onion_dh_pool_len(void);
+void onion_dh_pool_free_all(void);
 
 int onion_skin_create(crypto_pk_env_t *router_key,
                       crypto_dh_env_t **handshake_state_out,
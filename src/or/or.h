@@ -361,7 +361,10 @@ typedef enum {
 #define DIR_CONN_STATE_SERVER_COMMAND_WAIT 5
 /** State for connection at directory server: sending HTTP response. */
 #define DIR_CONN_STATE_SERVER_WRITING 6
-#define _DIR_CONN_STATE_MAX 6
+/** State for connection to directory server: done with one response, and
+ * waiting in case we want to make another request. */
+#define DIR_CONN_STATE_CLIENT_IDLE 7
+#define _DIR_CONN_STATE_MAX 7
 
 /** True iff the purpose of <b>conn</b> means that it's a server-side
  * directory connection. */
@@ -423,7 +426,10 @@ typedef enum {
 #define DIR_PURPOSE_FETCH_RENDDESC_V2 18
 /** A connection to a directory server: download a microdescriptor. */
 #define DIR_PURPOSE_FETCH_MICRODESC 19
-#define _DIR_PURPOSE_MAX 19
+/** A connection to a directory server that has finished its last request,
+ * and is waiting in case we make another. */
+#define DIR_PURPOSE_IDLE 20
+#define _DIR_PURPOSE_MAX 20
 
 /** True iff <b>p</b> is a purpose corresponding to uploading data to a
  * directory server. */
@@ -573,6 +579,10 @@ typedef enum {
 #define RELAY_COMMAND_RENDEZVOUS_ESTABLISHED 39
 #define RELAY_COMMAND_INTRODUCE_ACK 40
 
+/** Experimental: ask the other end to grow our window.  See
+ * AdaptiveFlowControl.  Tors that don't know it drop it. */
+#define RELAY_COMMAND_WINDOW_REQUEST 80
+
 /* Reasons why an OR connection is closed. */
 #define END_OR_CONN_REASON_DONE           1
 #define END_OR_CONN_REASON_REFUSED        2 /* connection refused */
@@ -797,6 +807,9 @@ typedef struct rend_data_t {
  * INTRODUCE2 cells.  Used only to avoid launching multiple
  * simultaneous attempts to connect to the same rendezvous point. */
 #define REND_REPLAY_TIME_INTERVAL (5 * 60)
+/** Most DH public keys from INTRODUCE2 cells that a hidden service will
+ * remember from any one REND_REPLAY_TIME_INTERVAL. */
+#define REND_REPLAY_MAX_DH_PARTS 32768
 
 /** Used to indicate which way a cell is going on a circuit. */
 typedef enum {
@@ -816,6 +829,33 @@ typedef enum {
 #define STREAMWINDOW_START 500
 /** Amount to increment a stream window when we get a stream SENDME. */
 #define STREAMWINDOW_INCREMENT 50
+/** Largest circuit deliver window that AdaptiveFlowControl will grow to. */
+#define CIRCWINDOW_ADAPTIVE_MAX 4000
+/** Largest stream deliver window that AdaptiveFlowControl will grow to. */
+#define STREAMWINDOW_ADAPTIVE_MAX 2000
+
+/** What one end of a circuit or stream knows about its flow control
+ * windows, for AdaptiveFlowControl.  All zero at the start. */
+typedef struct flow_control_t {
+  /** How large a deliver window have we agreed to give the other end?  0
+   * means the usual starting window. */
+  int deliver_target;
+  /** How many data cells have we packaged? */
+  uint32_t n_packaged;
+  /** How many SENDMEs have we received? */
+  uint32_t n_sendmes;
+  /** If nonzero, we're timing how long it takes to get the SENDME that
+   * acknowledges this many packaged cells. */
+  uint32_t probe_cell;
+  /** When did we package cell number probe_cell?  In msec, from
+   * approx_monotonic_msec(). */
+  uint64_t probe_sent_at;
+  /** Smoothed round-trip time from packaging a cell to getting the SENDME
+   * for it, in msec; 0 if we haven't measured it. */
+  uint32_t rtt_msec;
+  /** When did we last ask the other end for a bigger window? */
+  uint64_t last_request_at;
+} flow_control_t;
 
 /* Cell commands.  These values are defined in tor-spec.txt. */
 #define CELL_PADDING 0
@@ -905,6 +945,12 @@ typedef struct var_cell_t {
 typedef struct packed_cell_t {
   struct packed_cell_t *next; /**< Next cell queued on this circuit. */
   char body[CELL_NETWORK_SIZE]; /**< Cell as packed for network. */
+  uint32_t inserted_time; /**< Time (from approx_monotonic_msec(), with
+                           * high bits masked) at which this cell was
+                           * inserted into its queue. */
+  /** If we're tracing this cell's path through our queues, the ID of its
+   * trace; otherwise 0.  See celltrace.c. */
+  uint32_t trace_id;
 } packed_cell_t;
 
 /** Number of cells added to a circuit queue including their insertion
@@ -923,7 +969,9 @@ typedef struct insertion_time_queue_t {
 } insertion_time_queue_t;
 
 /** A queue of cells on a circuit, waiting to be added to the
- * or_connection_t's outbuf. */
+ * or_connection_t's outbuf.  Outside relay.c, only look at it through
+ * cell_queue_peek() and the other cell_queue_* functions, so that its
+ * representation can change. */
 typedef struct cell_queue_t {
   packed_cell_t *head; /**< The first cell, or NULL if the queue is empty. */
   packed_cell_t *tail; /**< The last cell, or NULL if the queue is empty. */
@@ -1015,6 +1063,12 @@ typedef struct connection_t {
   /** True iff we've called connection_close_immediate() on this linked
    * connection. */
   unsigned int linked_conn_is_closed:1;
+  /** True iff this connection is ready to read, and waiting in main.c's
+   * list of batched connections to be handled. */
+  unsigned int batched_read:1;
+  /** True iff this connection is ready to write, and waiting in main.c's
+   * list of batched connections to be handled. */
+  unsigned int batched_write:1;
 
   /** CONNECT/SOCKS proxy client handshake state (for outgoing connections). */
   unsigned int proxy_state:4;
@@ -1022,6 +1076,8 @@ typedef struct connection_t {
   /** Our socket; -1 if this connection is closed, or has no socket. */
   tor_socket_t s;
   int conn_array_index; /**< Index into the global connection array. */
+  /** Index into the list of connections of the same type in main.c. */
+  int conn_type_index;
 
   struct event *read_event; /**< Libevent event structure. */
   struct event *write_event; /**< Libevent event structure. */
@@ -1249,8 +1305,13 @@ typedef struct or_connection_t {
 #ifndef USE_BUFFEREVENTS
   int read_bucket; /**< When this hits 0, stop receiving. Every second we
                     * add 'bandwidthrate' to this, capping it at
-                    * bandwidthburst. (OPEN ORs only) */
+                    * bandwidthburst: connection.c does this whenever it
+                    * looks at the bucket. (OPEN ORs only) */
   int write_bucket; /**< When this hits 0, stop writing. Like read_bucket. */
+  /** How many milliseconds of refills had happened when we last brought
+   * read_bucket and write_bucket up to date?  See
+   * connection_or_buckets_update(). */
+  uint64_t buckets_refilled_at;
 #else
   /** DOCDOC */
   /* XXXX we could share this among all connections. */
@@ -1258,6 +1319,11 @@ typedef struct or_connection_t {
 #endif
   int n_circuits; /**< How many circuits use this connection as p_conn or
                    * n_conn ? */
+  /** Open-addressing hash table mapping circuit ID to each circuit that uses
+   * this connection as p_conn or n_conn; see circuitlist.c. */
+  struct circid_table_ent_t *circid_table;
+  unsigned circid_table_size; /**< Slots in circid_table: 0 or a power of 2. */
+  unsigned circid_table_used; /**< How many slots in circid_table are full? */
 
   /** Double-linked ring of circuits with queued cells waiting for room to
    * free up on this connection's outbuf.  Every time we pull cells from a
@@ -1274,6 +1340,29 @@ typedef struct or_connection_t {
   /** The tick on which the cell_ewma_ts in active_circuit_pqueue last had
    * their ewma values rescaled. */
   unsigned active_circuit_pqueue_last_recalibrated;
+  /** True iff this connection is waiting for the global circuit scheduler
+   * to give it cells. */
+  unsigned int sched_pending:1;
+  /** True iff this is an outgoing connection that we haven't called
+   * connect() for yet, because of MaxConcurrentORConnects or
+   * MaxORConnectsPerSecond. */
+  unsigned int connect_deferred:1;
+  /** This connection's position in the global circuit scheduler's heap, or
+   * -1 if it's not there. */
+  int sched_heap_idx;
+  /** The priority of this connection in the global circuit scheduler's
+   * heap: lower goes first. */
+  double sched_key;
+  /** Bytes read from this connection in the current connection-statistics
+   * interval; see rep_hist_note_or_conn_bytes(). */
+  size_t bidi_read;
+  /** Bytes written to this connection in the current connection-statistics
+   * interval. */
+  size_t bidi_written;
+  /** One more than this connection's index in rephist's list of connections
+   * with bytes in the current connection-statistics interval, or 0 if it's
+   * not there. */
+  int bidi_idxplus1;
   struct or_connection_t *next_with_same_id; /**< Next connection with same
                                               * identity digest as this one. */
 } or_connection_t;
@@ -1288,6 +1377,7 @@ typedef struct edge_connection_t {
   int package_window; /**< How many more relay cells can I send into the
                        * circuit? */
   int deliver_window; /**< How many more relay cells can end at me? */
+  flow_control_t flow; /**< Adaptive flow control state for this stream. */
 
   struct circuit_t *on_circuit; /**< The circuit (if any) that this edge
                                  * connection is using. */
@@ -1324,6 +1414,22 @@ typedef struct edge_connection_t {
   /** True iff we've blocked reading until the circuit has fewer queued
    * cells. */
   unsigned int edge_blocked_on_circ:1;
+  /** True iff we're holding back a partial cell's worth of data on this
+   * stream, waiting for more to arrive; see EdgeCoalesceDelay. */
+  unsigned int edge_coalesce_pending:1;
+  /** If edge_coalesce_pending, when we stop waiting and package whatever
+   * we have. */
+  struct timeval coalesce_deadline;
+
+  /** If this is an exit stream waiting for a DNS answer, the lookup it's
+   * waiting on.  Exit connections only. */
+  struct cached_resolve_t *dns_pending_resolve;
+  /** The next stream waiting on the same lookup as this one, if any. */
+  struct edge_connection_t *dns_pending_next;
+  /** The pointer that points to this stream in its lookup's list of
+   * waiting streams, or NULL if this stream isn't waiting on a lookup.
+   * Lets us unlink a stream without searching for it. */
+  struct edge_connection_t **dns_pending_prevp;
 
 } edge_connection_t;
 
@@ -1369,6 +1475,10 @@ typedef struct entry_connection_t {
   /** If this is a DNSPort connection, this field holds the pending DNS
    * request that we're going to try to answer.  */
   struct evdns_server_request *dns_server_request;
+  /** If this is a DNSPort connection, identical DNSPort requests that
+   * arrived while this one was in flight wait on this entry; they get the
+   * same answer.  */
+  struct dnsserv_pending_t *dns_pending;
 
 #define NUM_CIRCUITS_LAUNCHED_THRESHOLD 10
   /** Number of times we've launched a circuit to handle this stream. If
@@ -1403,8 +1513,17 @@ typedef struct entry_connection_t {
    */
   unsigned int may_use_optimistic_data : 1;
 
+  /** If this stream is waiting for a circuit, the bucket of the
+   * pending-stream index that holds it, or NULL if it isn't indexed. */
+  smartlist_t *pending_bucket;
+  /** Position of this stream within <b>pending_bucket</b>. */
+  int pending_bucket_idx;
+
 } entry_connection_t;
 
+/** Partially received directory response body; see directory.c. */
+typedef struct dir_body_stream_t dir_body_stream_t;
+
 /** Subtype of connection_t for an "directory connection" -- that is, an HTTP
  * connection to retrieve or serve directory material. */
 typedef struct dir_connection_t {
@@ -1418,6 +1537,28 @@ typedef struct dir_connection_t {
   **/
   char *requested_resource;
   unsigned int dirconn_direct:1; /**< Is this dirconn direct, or via Tor? */
+  /** True iff this connection should stay open for another request once
+   * the current response is done.  On the client side, we asked for that;
+   * on the server side, the client asked, and we can say where our
+   * response ends. */
+  unsigned int keep_alive:1;
+  /** Server side: true iff we've already answered a request on this
+   * connection. */
+  unsigned int answered_request:1;
+  /** Client side: true iff the response we're reading continues a
+   * consensus download that broke off earlier. */
+  unsigned int resumed_download:1;
+  /** Client side: when did we finish sending our current request? */
+  struct timeval request_sent;
+  /** Server side: the url_table entry (see directory.c) that matched the
+   * request we're answering, or NULL if we aren't answering one. */
+  const char *serving_endpoint;
+  /** Server side: when did we get the request we're answering? */
+  struct timeval request_received;
+  /** How many bytes have we queued for the response we're writing? */
+  uint64_t response_bytes;
+  /** Server side: is the response we're writing compressed? */
+  unsigned int response_compressed:1;
 
   /* Used only for server sides of some dir connections, to implement
    * "spooling" of directory material to the outbuf.  Otherwise, we'd have
@@ -1429,6 +1570,9 @@ typedef struct dir_connection_t {
     DIR_SPOOL_CACHED_DIR, DIR_SPOOL_NETWORKSTATUS,
     DIR_SPOOL_MICRODESC, /* NOTE: if we add another entry, add another bit. */
   } dir_spool_src : 3;
+  /** Server side: true iff this connection is counted among those that
+   * share the directory spool buffer budget (see dirserv.c). */
+  unsigned int counted_as_spooling:1;
   /** If we're fetching descriptors, what router purpose shall we assign
    * to them? */
   uint8_t router_purpose;
@@ -1440,6 +1584,13 @@ typedef struct dir_connection_t {
   off_t cached_dir_offset;
   /** The zlib object doing on-the-fly compression for spooled data. */
   tor_zlib_state_t *zlib_state;
+  /** How are we compressing the cached_dir_t bodies we spool?  Either
+   * LZMA_METHOD, or anything else for the usual zlib. */
+  compress_method_t spool_method;
+
+  /** Used only for client sides of consensus downloads: the response
+   * body we've taken off the inbuf so far. */
+  struct dir_body_stream_t *body_stream;
 
   /** What rendezvous service are we querying for? */
   rend_data_t *rend_data;
@@ -1462,6 +1613,31 @@ typedef struct control_connection_t {
    * connection. */
   unsigned int is_owning_control_connection:1;
 
+  /** How many events have we dropped on this connection because the
+   * controller wasn't reading them fast enough? */
+  uint64_t n_events_dropped;
+
+  /* Used to implement "spooling" of large GETINFO answers to the outbuf,
+   * so that we don't build them all in memory at once. */
+  /** What GETINFO answer are we spooling right now? */
+  enum {
+    CONTROL_SPOOL_NONE=0, CONTROL_SPOOL_NS, CONTROL_SPOOL_DESC,
+    CONTROL_SPOOL_DESC_EXTRAINFO,
+  } getinfo_spool_src : 2;
+  /** True iff we stopped reading commands while spooling, and need to look
+   * at the inbuf again. */
+  unsigned int getinfo_resume_pending:1;
+  /** Identity digests of the routers whose entries we have yet to spool,
+   * last one first. */
+  smartlist_t *getinfo_spool_stack;
+  /** The rest of the GETINFO reply, to send once the spool is empty. */
+  char *getinfo_spool_trailer;
+  /** Events that arrived while we were spooling, to send once we're
+   * done. */
+  smartlist_t *held_events;
+  /** Total length of the strings in held_events. */
+  size_t held_events_len;
+
   /** Amount of space allocated in incoming_cmd. */
   uint32_t incoming_cmd_len;
   /** Number of bytes currently stored in incoming_cmd. */
@@ -1608,6 +1784,9 @@ typedef struct addr_policy_t {
   uint16_t prt_max; /**< Highest port number to accept/reject. */
 } addr_policy_t;
 
+/** An address policy compiled for fast lookups; see policies.c. */
+typedef struct compiled_policy_t compiled_policy_t;
+
 /** A cached_dir_t represents a cacheable directory object, along with its
  * compressed form. */
 typedef struct cached_dir_t {
@@ -1615,6 +1794,10 @@ typedef struct cached_dir_t {
   char *dir_z; /**< Compressed contents of this object. */
   size_t dir_len; /**< Length of <b>dir</b> (not counting its NUL). */
   size_t dir_z_len; /**< Length of <b>dir_z</b>. */
+  /** Contents of this object compressed with LZMA, if anybody has asked for
+   * them that way yet. */
+  char *dir_lzma;
+  size_t dir_lzma_len; /**< Length of <b>dir_lzma</b>. */
   time_t published; /**< When was this object published. */
   digests_t digests; /**< Digests of this object (networkstatus only) */
   int refcnt; /**< Reference count for this cached_dir_t. */
@@ -1731,10 +1914,13 @@ typedef struct {
   tor_addr_t ipv6_addr;
   uint16_t ipv6_orport;
 
-  crypto_pk_env_t *onion_pkey; /**< Public RSA key for onions. */
+  /** Public RSA key for onions.  NULL if is_compact is set. */
+  crypto_pk_env_t *onion_pkey;
   crypto_pk_env_t *identity_pkey;  /**< Public RSA key for signing. */
 
-  char *platform; /**< What software/operating system is this OR using? */
+  /** What software/operating system is this OR using?  NULL if is_compact
+   * is set. */
+  char *platform;
 
   /* link info */
   uint32_t bandwidthrate; /**< How many bytes does this OR add to its token
@@ -1744,10 +1930,13 @@ typedef struct {
   uint32_t bandwidthcapacity;
   smartlist_t *exit_policy; /**< What streams will this OR permit
                              * to exit?  NULL for 'reject *:*'. */
+  /** Compiled form of exit_policy, built the first time we need it. */
+  compiled_policy_t *exit_policy_compiled;
   long uptime; /**< How many seconds the router claims to have been up */
   smartlist_t *declared_family; /**< Nicknames of router which this router
                                  * claims are its family. */
-  char *contact_info; /**< Declared contact info for this router. */
+  /** Declared contact info for this router.  NULL if is_compact is set. */
+  char *contact_info;
   unsigned int is_hibernating:1; /**< Whether the router claims to be
                                   * hibernating */
   unsigned int caches_extra_info:1; /**< Whether the router says it caches and
@@ -1764,6 +1953,11 @@ typedef struct {
   unsigned int needs_retest_if_added:1;
   /** True if ipv6_addr:ipv6_orport is preferred.  */
   unsigned int ipv6_preferred:1;
+  /** True iff we've dropped onion_pkey, platform, and contact_info to save
+   * memory.  Use router_get_onion_pkey() and friends to get them. */
+  unsigned int is_compact:1;
+  /** True iff exit_policy was too large to compile. */
+  unsigned int exit_policy_uncompilable:1;
 
 /** Tor can use this router for general positions in circuits; we got it
  * from a directory server as usual, or we're an authority and a server
@@ -1903,8 +2097,21 @@ typedef struct short_policy_entry_t {
   uint16_t min_port, max_port;
 } short_policy_entry_t;
 
-/** A short_poliy_t is the parsed version of a policy summary. */
+/** A short_poliy_t is the parsed version of a policy summary.  Identical
+ * summaries share a single short_policy_t. */
 typedef struct short_policy_t {
+  /** Hashtable node, used to share identical summaries. */
+  HT_ENTRY(short_policy_t) node;
+  /** Number of microdescriptors (or other holders) using this policy. */
+  int refcnt;
+  /** For each block of 256 ports, SHORT_POLICY_BLOCK_REJECT if every port
+   * in the block is rejected, SHORT_POLICY_BLOCK_ACCEPT if every port is
+   * accepted, or SHORT_POLICY_BLOCK_MIXED plus the index of the block's
+   * bits in <b>port_bits</b>. */
+  uint16_t port_block[256];
+  /** One bit per port, set if the port is accepted, for each mixed
+   * block. */
+  bitarray_t *port_bits;
   /** True if the members of 'entries' are port ranges to accept; false if
    * they are port ranges to reject */
   unsigned int is_accept : 1;
@@ -1917,6 +2124,12 @@ typedef struct short_policy_t {
   short_policy_entry_t entries[FLEXIBLE_ARRAY_MEMBER];
 } short_policy_t;
 
+/** Values for short_policy_t.port_block. @{ */
+#define SHORT_POLICY_BLOCK_REJECT 0
+#define SHORT_POLICY_BLOCK_ACCEPT 1
+#define SHORT_POLICY_BLOCK_MIXED 2
+/** @} */
+
 /** A microdescriptor is the smallest amount of information needed to build a
  * circuit through a router.  They are generated by the directory authorities,
  * using information from the uploaded routerinfo documents.  They are not
@@ -1938,6 +2151,9 @@ typedef struct microdesc_t {
   unsigned int no_save : 1;
   /** If true, this microdesc has an entry in the microdesc_map */
   unsigned int held_in_map : 1;
+  /** If true, this microdesc's body is in the shared cache file, not ours;
+   * saved_location is SAVED_IN_CACHE. */
+  unsigned int in_shared_cache : 1;
   /** Reference count: how many node_ts have a reference to this microdesc? */
   unsigned int held_by_nodes;
 
@@ -2258,6 +2474,9 @@ typedef struct desc_store_t {
   /** Total bytes dropped since last rebuild: this is space currently
    * used in the cache and the journal that could be freed by a rebuild. */
   size_t bytes_dropped;
+  /** If a cpuworker is rebuilding this store in the background, the
+   * snapshot it's working from; else NULL. */
+  struct store_rebuild_t *rebuild;
 } desc_store_t;
 
 /** Contents of a directory of onion routers. */
@@ -2267,6 +2486,15 @@ typedef struct {
   /** Map from server descriptor digest to a signed_descriptor_t from
    * routers or old_routers. */
   struct digest_sd_map_t *desc_digest_map;
+  /** If DescriptorDigestFilter is in effect, a Bloom filter holding every
+   * key of desc_digest_map, and maybe some keys it no longer has; else
+   * NULL.  Built when we first need it. */
+  digestset_t *desc_digest_filter;
+  /** How many digests have we added to desc_digest_filter? */
+  int desc_digest_filter_n;
+  /** How many digests can we add to desc_digest_filter before we should
+   * build a bigger one? */
+  int desc_digest_filter_max;
   /** Map from extra-info digest to an extrainfo_t.  Only exists for
    * routers in routers or old_routers. */
   struct digest_ei_map_t *extra_info_map;
@@ -2279,6 +2507,9 @@ typedef struct {
   /** List of signed_descriptor_t for older router descriptors we're
    * caching. */
   smartlist_t *old_routers;
+  /** Map from server identity digest to a smartlist of the members of
+   * old_routers with that identity, in no particular order. */
+  digestmap_t *old_routers_by_id;
   /** Store holding server descriptors.  If present, any router whose
    * cache_info.saved_location == SAVED_IN_CACHE is stored in this file
    * starting at cache_info.saved_offset */
@@ -2404,6 +2635,8 @@ typedef struct crypt_path_t {
                        * at this step? */
   int deliver_window; /**< How many cells are we willing to deliver originating
                        * at this step? */
+  /** Adaptive flow control state for our circuit windows at this step. */
+  flow_control_t flow;
 } crypt_path_t;
 
 #define CPATH_KEY_MATERIAL_LEN (20*2+16*2)
@@ -2414,6 +2647,14 @@ typedef struct crypt_path_t {
                                  DH_KEY_LEN)
 #define ONIONSKIN_REPLY_LEN (DH_KEY_LEN+DIGEST_LEN)
 
+/** Kinds of onionskin handshake that we answer as a relay, and keep separate
+ * statistics for. */
+typedef enum {
+  ONIONSKIN_TYPE_CREATE=0, ONIONSKIN_TYPE_CREATE_FAST=1,
+} onionskin_type_t;
+/** How many onionskin_type_t values are there? */
+#define ONIONSKIN_N_TYPES 2
+
 /** Information used to build a circuit. */
 typedef struct {
   /** Intended length of the final circuit. */
@@ -2521,6 +2762,8 @@ typedef struct circuit_t {
    * circuit-level sendme cells to indicate that we're willing to accept
    * more. */
   int deliver_window;
+  /** Adaptive flow control state for package_window and deliver_window. */
+  flow_control_t flow;
 
   /** For storage while n_conn is pending
     * (state CIRCUIT_STATE_OR_WAIT). When defined, it is always
@@ -2600,9 +2843,24 @@ typedef struct origin_circuit_t {
    * to the specification? */
   unsigned int remaining_relay_early_cells : 4;
 
+  /** Relay cell payload bytes received on this circuit since the last call
+   * to control_event_circuit_bandwidth_used(). */
+  uint32_t n_read_circ_bw;
+  /** Relay cell payload bytes sent on this circuit since the last call to
+   * control_event_circuit_bandwidth_used(). */
+  uint32_t n_written_circ_bw;
+
   /** Set if this circuit is insanely old and we already informed the user */
   unsigned int is_ancient : 1;
 
+  /** True iff this circuit is in one of the buckets that
+   * circuit_find_to_cannibalize() searches. */
+  unsigned int in_cannibalize_index : 1;
+  /** If in_cannibalize_index, which bucket holds this circuit, and where
+   * in that bucket it is. */
+  uint8_t cannibalize_bucket;
+  int cannibalize_idx;
+
   /** Set if this circuit has already been opened. Used to detect
    * cannibalized circuits. */
   unsigned int has_opened : 1;
@@ -2677,6 +2935,10 @@ typedef struct origin_circuit_t {
   uint64_t associated_isolated_stream_global_id;
   /**@}*/
 
+  /** Index of this circuit within the list returned by
+   * circuit_get_global_origin_circuit_list(). */
+  int global_origin_circuit_list_idx;
+
 } origin_circuit_t;
 
 /** An or_circuit_t holds information needed to implement a circuit at an
@@ -2724,6 +2986,11 @@ typedef struct or_circuit_t {
    * is not marked for close. */
   struct or_circuit_t *rend_splice;
 
+/** Values for or_circuit_t.rend_token_type. */
+#define REND_TOKEN_NONE 0
+#define REND_TOKEN_COOKIE 1
+#define REND_TOKEN_INTRO 2
+
 #if REND_COOKIE_LEN >= DIGEST_LEN
 #define REND_TOKEN_LEN REND_COOKIE_LEN
 #else
@@ -2736,6 +3003,9 @@ typedef struct or_circuit_t {
    * ???? move to a subtype or adjunct structure? Wastes 20 bytes. -NM
    */
   char rend_token[REND_TOKEN_LEN];
+  /** One of the REND_TOKEN_* values: which index in circuitlist.c, if any,
+   * holds this circuit under rend_token. */
+  uint8_t rend_token_type;
 
   /* ???? move to a subtype or adjunct structure? Wastes 20 bytes -NM */
   char handshake_digest[DIGEST_LEN]; /**< Stores KH for the handshake. */
@@ -2747,6 +3017,14 @@ typedef struct or_circuit_t {
   /** True iff this circuit was made with a CREATE_FAST cell. */
   unsigned int is_first_hop : 1;
 
+  /** If this is a first-hop circuit, the earliest time at which it could
+   * have been idle long enough for us to close it.  Since idle timestamps
+   * only move forward, this is a lower bound that we push back lazily. */
+  time_t idle_check_time;
+  /** Index of this circuit in the queue of first-hop circuits ordered by
+   * idle_check_time, or -1 if it isn't in the queue. */
+  int idle_check_idx;
+
   /** Number of cells that were removed from circuit queue; reset every
    * time when writing buffer stats to disk. */
   uint32_t processed_cells;
@@ -2759,6 +3037,10 @@ typedef struct or_circuit_t {
   /** The EWMA count for the number of cells flushed from the
    * p_conn_cells queue. */
   cell_ewma_t p_cell_ewma;
+
+  /** If this circuit's onionskin is waiting for a cpuworker, its entry in
+   * the pending onion queue; otherwise NULL. */
+  struct onion_queue_t *onionqueue_entry;
 } or_circuit_t;
 
 /** Convert a circuit subtype to a circuit_t. */
@@ -2850,6 +3132,9 @@ typedef struct port_cfg_t {
   unsigned int all_addrs : 1;
   unsigned int ipv4_only : 1;
   unsigned int ipv6_only : 1;
+  /** True iff other listeners may share this one's address and port, so
+   * that the kernel spreads incoming connections among them. */
+  unsigned int reuse_port : 1;
 
   /* Unix sockets only: */
   /** Path for an AF_UNIX address */
@@ -2900,6 +3185,8 @@ typedef struct {
 
   int LogMessageDomains; /**< Boolean: Should we log the domain(s) in which
                           * each log message occurs? */
+  int AsyncLogging; /**< Boolean: Should a separate thread write our file
+                     * and stream logs? */
 
   char *DebugLogFile; /**< Where to send verbose log messages. */
   char *DataDirectory; /**< OR only: where to store long-term data. */
@@ -2938,6 +3225,11 @@ typedef struct {
   invalid_router_usage_t _AllowInvalid;
   config_line_t *ExitPolicy; /**< Lists of exit policy components. */
   int ExitPolicyRejectPrivate; /**< Should we not exit to local addresses? */
+  /** If positive, for how many seconds after a destination refuses one of
+   * our exit connections do we refuse new streams to it without trying? */
+  int ExitConnectFailureCacheTime;
+  /** If true, ask the kernel to use TCP Fast Open for exit connections. */
+  int ExitTCPFastOpen;
   config_line_t *SocksPolicy; /**< Lists of socks policy components */
   config_line_t *DirPolicy; /**< Lists of dir policy components */
   /** Addresses to bind for listening for SOCKS connections. */
@@ -3023,6 +3315,9 @@ typedef struct {
   int AvoidDiskWrites; /**< Boolean: should we never cache things to disk?
                         * Not used yet. */
   int ClientOnly; /**< Boolean: should we never evolve into a server role? */
+  /** Boolean: should we gather queued data from several buffer chunks into
+   * each TLS record we write? */
+  int CoalesceTLSWrites;
   /** To what authority types do we publish our descriptor? Choices are
    * "v1", "v2", "v3", "bridge", or "". */
   smartlist_t *PublishServerDescriptor;
@@ -3035,6 +3330,9 @@ typedef struct {
   int FetchV2Networkstatus; /**< Do we fetch v2 networkstatus documents when
                              * we don't need to? */
   int HidServDirectoryV2; /**< Do we participate in the HS DHT? */
+  /** How many bytes of v2 hidden service descriptors may we cache as a
+   * hidden service directory?  0 for no limit. */
+  uint64_t HidServDirectoryCacheSize;
 
   int VoteOnHidServDirectoriesV2; /**< As a directory authority, vote on
                                    * assignment of the HSDir flag? */
@@ -3042,6 +3340,20 @@ typedef struct {
                                     * service directories after what time? */
 
   int FetchUselessDescriptors; /**< Do we fetch non-running descriptors too? */
+  /** Do we drop rarely used fields from the routerinfo_t objects in our
+   * routerlist, and parse them again from the descriptor when needed? */
+  int CompactRouterDescriptors;
+  /** A cached-microdescs file that we load microdescriptors from but never
+   * write, so that several Tor instances can share its pages; or NULL. */
+  char *SharedMicrodescCacheFile;
+  /** Do we keep a binary snapshot of each parsed consensus next to the
+   * cached copy, so that we can load it without parsing it again? */
+  int ConsensusSnapshot;
+  /** Do we put Bloom filters in front of our descriptor digest maps, so
+   * that lookups for descriptors we don't have are cheap?  -1 for "only
+   * if we're an authority". */
+  int DescriptorDigestFilter;
+  int FetchConsensusDiffs; /**< Do we ask for consensus updates as diffs? */
   int AllDirActionsPrivate; /**< Should every directory action be sent
                              * through a Tor circuit? */
 
@@ -3061,6 +3373,9 @@ typedef struct {
   config_line_t *ReachableDirAddresses; /**< IP:ports for Dir conns. */
 
   int ConstrainedSockets; /**< Shrink xmit and recv socket buffers. */
+  /** Boolean: should we set TCP options on each new socket according to
+   * the kind of connection it's for? */
+  int TuneSocketsByType;
   uint64_t ConstrainedSockSize; /**< Size of constrained buffers. */
 
   /** Whether we should drop exit streams from Tors that we don't know are
@@ -3117,12 +3432,29 @@ typedef struct {
                          * a new one? */
   int MaxCircuitDirtiness; /**< Never use circs that were first used more than
                                 this interval ago. */
+  /** If nonzero, keep up to this many clean exit circuits ready, sized by
+   * how quickly streams have been using them up. */
+  int PreemptiveCircuitPool;
   uint64_t BandwidthRate; /**< How much bandwidth, on average, are we willing
                            * to use in a second? */
   uint64_t BandwidthBurst; /**< How much bandwidth, at maximum, are we willing
                             * to use in a second? */
+  /** List of "class=weight" strings: how should we share BandwidthRate
+   * among kinds of traffic when we're rate limited? */
+  smartlist_t *BandwidthClassWeights;
   uint64_t MaxAdvertisedBandwidth; /**< How much bandwidth are we willing to
                                     * tell people we have? */
+  uint64_t MaxMemInQueues; /**< If we have more memory than this allocated
+                            * for cell queues and buffers, start killing
+                            * circuits. */
+  /** If nonzero, the most outgoing OR connections we let be connecting or
+   * handshaking at once. */
+  int MaxConcurrentORConnects;
+  /** If nonzero, the most outgoing OR connections we start each second. */
+  int MaxORConnectsPerSecond;
+  /** How many connections do we accept from a listener each time it's
+   * ready? */
+  int MaxAcceptsPerRead;
   uint64_t RelayBandwidthRate; /**< How much bandwidth, on average, are we
                                  * willing to use for all relayed conns? */
   uint64_t RelayBandwidthBurst; /**< How much bandwidth, at maximum, will we
@@ -3130,6 +3462,9 @@ typedef struct {
   uint64_t PerConnBWRate; /**< Long-term bw on a single TLS conn, if set. */
   uint64_t PerConnBWBurst; /**< Allowed burst on a single TLS conn, if set. */
   int NumCPUs; /**< How many CPUs should we try to use? */
+  /** If true, run only as many cpuworkers (up to NumCPUs) as our onionskin
+   * load needs. */
+  int AdaptiveCPUWorkers;
 //int RunTesting; /**< If true, create testing circuits to measure how well the
 //                 * other ORs are running. */
   config_line_t *RendConfigLines; /**< List of configuration lines
@@ -3141,6 +3476,10 @@ typedef struct {
   int HeartbeatPeriod; /**< Log heartbeat messages after this many seconds
                         * have passed. */
 
+  char *MetricsFile; /**< If set, periodically write machine-readable
+                      * status metrics to this file. */
+  int MetricsPeriod; /**< Rewrite MetricsFile after this many seconds. */
+
   char *HTTPProxy; /**< hostname[:port] to use as http proxy, if any. */
   tor_addr_t HTTPProxyAddr; /**< Parsed IPv4 addr for http proxy, if any. */
   uint16_t HTTPProxyPort; /**< Parsed port for http proxy, if any. */
@@ -3217,6 +3556,8 @@ typedef struct {
   uint64_t AccountingMax; /**< How many bytes do we allow per accounting
                            * interval before hibernation?  0 for "never
                            * hibernate." */
+  int AccountingPacing; /**< If true, lower our bandwidth rate to spread
+                         * AccountingMax over the whole interval. */
 
   /** Base64-encoded hash of accepted passwords for the control system. */
   config_line_t *HashedControlPassword;
@@ -3259,6 +3600,12 @@ typedef struct {
                       * acceleration where available? */
   /** Token Bucket Refill resolution in milliseconds. */
   int TokenBucketRefillInterval;
+  /** Boolean: should we resume TLS sessions with peers we reconnect to, and
+   * let them resume theirs with us? */
+  int TLSSessionCache;
+  /** Boolean: should we let the kernel encrypt and send TLS records on OR
+   * connections, where it can? */
+  int KernelTLS;
   char *AccelName; /**< Optional hardware acceleration engine name. */
   char *AccelDir; /**< Optional hardware acceleration engine search dir. */
   int UseEntryGuards; /**< Boolean: Do we try to enter from a smallish number
@@ -3281,6 +3628,13 @@ typedef struct {
                       * the local domains. */
   int ServerDNSDetectHijacking; /**< Boolean: If true, check for DNS failure
                                  * hijacking. */
+  /** How long do we cache the news that a hostname doesn't exist?  0 means
+   * not at all. */
+  int ServerDNSNegativeCacheTTL;
+  int ServerDNSPrefetch; /**< Boolean: If true, refresh popular cached DNS
+                          * answers shortly before they expire. */
+  int ServerDNSResolveIPv6; /**< Boolean: If true, look up and cache IPv6
+                             * addresses alongside IPv4 ones. */
   int ServerDNSRandomizeCase; /**< Boolean: Use the 0x20-hack to prevent
                                * DNS poisoning attacks. */
   char *ServerDNSResolvConfFile; /**< If provided, we configure our internal
@@ -3290,6 +3644,9 @@ typedef struct {
                     disclaimer. This allows a server administrator to show
                     that they're running Tor and anyone visiting their server
                     will know this without any specialized knowledge. */
+  /** How many bytes of spooled directory data may all our directory
+   * connections keep on their outbufs between them? */
+  uint64_t DirSpoolBufferLimit;
   int DisableDebuggerAttachment; /**< Currently Linux only specific attempt to
                                       disable ptrace; needs BSD testing. */
   /** Boolean: if set, we start even if our resolv.conf file is missing
@@ -3303,6 +3660,9 @@ typedef struct {
                                         * testing our DNS server. */
   int EnforceDistinctSubnets; /**< If true, don't allow multiple routers in the
                                * same network zone in the same circuit. */
+  /** If nonzero, how many msec may a bulk stream hold back less than a
+   * cell's worth of data while waiting for more to fill the cell? */
+  int EdgeCoalesceDelay;
   int TunnelDirConns; /**< If true, use BEGIN_DIR rather than BEGIN when
                        * possible. */
   int PreferTunneledDirConns; /**< If true, avoid dirservers that don't
@@ -3351,12 +3711,25 @@ typedef struct {
   /** If true, the user wants us to collect connection statistics. */
   int ConnDirectionStatistics;
 
+  /** If true, we grow our circuit and stream windows when they hold back
+   * our throughput, and grant bigger windows when asked. (Experimental.) */
+  int AdaptiveFlowControl;
+
   /** If true, the user wants us to collect cell statistics. */
   int CellStatistics;
 
+  /** If nonzero, trace the path through our queues of one in every this
+   * many cells we read from OR connections. */
+  int CellTraceSampleInterval;
+
   /** If true, the user wants us to collect statistics as entry node. */
   int EntryStatistics;
 
+  /** If true, count unique clients per country for bridge, entry, and
+   * directory request statistics with fixed-size sketches instead of
+   * remembering every client address. */
+  int ClientCountSketch;
+
   /** If true, include statistics file contents in extra-info documents. */
   int ExtraInfoStatistics;
 
@@ -3472,9 +3845,23 @@ typedef struct {
    * once. */
   int MaxClientCircuitsPending;
 
+  /** If true, choose which circuit's cells to send next across all OR
+   * connections, rather than separately for each connection. */
+  int GlobalCircuitScheduler;
+
+  /** If true, collect the connections that libevent says are ready, and
+   * handle them all together once per trip through the main loop. */
+  int BatchConnectionEvents;
+
   /** If 1, we always send optimistic data when it's supported.  If 0, we
    * never use it.  If -1, we do what the consensus says. */
   int OptimisticData;
+  /** If nonempty, the only application ports for which we send optimistic
+   * data. */
+  smartlist_t *OptimisticDataPorts;
+  /** Application ports for which we never send optimistic data, even if
+   * they appear in OptimisticDataPorts. */
+  smartlist_t *NoOptimisticDataPorts;
 
   /** If 1, and we are using IOCP, we set the kernel socket SNDBUF and RCVBUF
    * to 0 to try to save kernel memory and avoid the dread "Out of buffers"
@@ -3734,6 +4121,8 @@ typedef struct {
   int num_recent_circs;
   /** Index into circular array. */
   int after_firsthop_idx;
+  /** Number of slots in timeouts_after_firsthop that are currently 1. */
+  int num_timeouts_after_firsthop;
 } network_liveness_t;
 
 /** Structure for circuit build times history */
@@ -3744,6 +4133,23 @@ typedef struct {
   int build_times_idx;
   /** Total number of build times accumulated. Max CBT_NCIRCUITS_TO_OBSERVE */
   int total_build_times;
+  /** Histogram of the non-abandoned values in circuit_build_times, indexed
+   * by build time divided by CBT_BIN_WIDTH. Updated on every add so that
+   * we never have to rebuild it from the circular array. */
+  uint32_t *histogram;
+  /** Sum of tor_mathlog() of the build times counted in each histogram
+   * bin. Used to fit alpha without walking every observation. */
+  double *histogram_log_sum;
+  /** Number of bins allocated for histogram and histogram_log_sum. */
+  build_time_t histogram_len;
+  /** Number of CBT_BUILD_ABANDONED values in circuit_build_times. */
+  int abandoned_count;
+  /** Largest non-abandoned value in circuit_build_times. Only valid if
+   * max_build_time_is_stale is false. */
+  build_time_t max_build_time;
+  /** True if we evicted the largest build time and need to find the new
+   * maximum before using max_build_time. */
+  unsigned int max_build_time_is_stale : 1;
   /** Information about the state of our local network connection */
   network_liveness_t liveness;
   /** Last time we built a circuit. Used to decide to build new test circs */
@@ -4119,12 +4525,14 @@ typedef struct rend_intro_point_t {
    * intro point. */
   unsigned int rend_service_note_removing_intro_point_called : 1;
 
-  /** (Service side only) A digestmap recording the INTRODUCE2 cells
-   * this intro point's circuit has received.  Each key is the digest
-   * of the RSA-encrypted part of a received INTRODUCE2 cell; each
-   * value is a pointer to the time_t at which the cell was received.
-   * This digestmap is used to prevent replay attacks. */
-  digestmap_t *accepted_intro_rsa_parts;
+  /** (Service side only) A replay cache recording the digests of the
+   * RSA-encrypted parts of the INTRODUCE2 cells this intro point's
+   * circuit has received.  It is used to prevent replay attacks. */
+  struct replaycache_t *accepted_intro_rsa_parts;
+
+  /** (Service side only) The number of INTRODUCE2 cells this intro point's
+   * circuit has accepted. */
+  int accepted_introduce2_count;
 
   /** (Service side only) The time at which this intro point was first
    * published, or -1 if this intro point has not yet been
@@ -4173,6 +4581,13 @@ typedef struct rend_cache_entry_t {
   time_t received; /**< When was the descriptor received? */
   char *desc; /**< Service descriptor */
   rend_service_descriptor_t *parsed; /**< Parsed value of 'desc' */
+
+  /* The remaining fields are only used for entries in the hidden service
+   * directory cache. */
+  char desc_id[DIGEST_LEN]; /**< Key of this entry in the cache. */
+  int expiry_idx; /**< Position of this entry in the expiry priority queue. */
+  /** Previous and next entries in least-recently-used order. */
+  struct rend_cache_entry_t *lru_prev, *lru_next;
 } rend_cache_entry_t;
 
 /********************************* routerlist.c ***************************/
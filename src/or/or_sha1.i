@@ -0,0 +1,43 @@
+"713f820f98ff4387d92a9039f4e718326b91fbb0  tor_main.c\n"
+"bd518e991b8a0f76c31a046c093c7f6e06b84c5b  buffers.c\n"
+"91c1dfc6c27f190713c104775ed7fe23443646d0  celltrace.c\n"
+"0237f9f2d87e8c0750f61b132d1e7ccbcb64572f  circuitbuild.c\n"
+"bf773a8e475b69a0a5bdbcfe03be8a8ab105b62e  circuitlist.c\n"
+"cf773916981e936a942497df65d2942944cd368b  circuituse.c\n"
+"71e9fa4cb9dca34d42df653dfa84cb3316f95725  command.c\n"
+"d12bdc870e485edea2b946b95c2db4cde247a96f  config.c\n"
+"6c25e8fce98a2b439be22a0b49254a780a876f23  connection.c\n"
+"ba358c8870658262f2f45ad8633b13ee62f48361  connection_edge.c\n"
+"b4efacfa021aecc792846f26491dbe336481834f  connection_or.c\n"
+"6748db6395d9b11283274bf4171894cb570e03f2  consdiff.c\n"
+"16d7a72b792e95ced27abfb3d305fb6ba06e322d  control.c\n"
+"b968a37f828bc5826383c39a29ecee787ed6e897  cpuworker.c\n"
+"1d09bea5f4c09512b3261a13d552e94d935fd9bd  directory.c\n"
+"690c47da1a536c06132352efae64670ceaab7d8f  dirserv.c\n"
+"645de90922c0f7939e92e1efe9edc38c3dd7a4fe  dirvote.c\n"
+"52f01d8c00b6b2b331902fb1acf44e0b2f2d98c3  dns.c\n"
+"c4b20247a35046e602f3eb0ad3da9405fbbc2ee3  dnsserv.c\n"
+"5db3ab3cb7a7cca10f34b5f31dbb8fa01f536f0b  geoip.c\n"
+"161a142ed25c6fb27886b577c03248098eea003a  hibernate.c\n"
+"4a0de4973727072da0f6e04f37ec7d2e55ab09d8  main.c\n"
+"4472eb1047526d5137f5b1e9399a9cd4af26fdc2  microdesc.c\n"
+"2ec32ff8c75f63b48f7d1f582f6207dd68d80ed2  networkstatus.c\n"
+"bf9eb499e74264dad5ba5ae9ea60bfe320dd7bd1  nodelist.c\n"
+"6c69eec85f12d98a81d9e8bd0fa6fb3e6a156d19  onion.c\n"
+"11052fcfa432c3ce3ca55d82d01b3fb80c420767  transports.c\n"
+"259a0406674ae458d05c872a6995b229bf78bcc1  periodic.c\n"
+"199b9415236509a00bed97a3af70c29458280c67  policies.c\n"
+"9711f10c300fc115241097ef3df4d91571392493  reasons.c\n"
+"119ddd8c94a90aa0f5e784608f45f3a10f50617d  relay.c\n"
+"f98c1c135c8dec187aed151f45a74d88b754ced9  rendclient.c\n"
+"d01a42986b0447b411cb9b189d785df38f04c84e  rendcommon.c\n"
+"82af38d6d20b0844d5687fb0ac4410d1fbeb44b8  rendmid.c\n"
+"85af2e7ffc9e7860c3c970b806c75137921ecd70  rendservice.c\n"
+"7ae27890dd9acdc73053c13709e13f8065dabb9e  replaycache.c\n"
+"b55be690db7e92d89f25fbd12cabd93a1fad6143  rephist.c\n"
+"1c8a4b042b8cd664bb09b93b2b96ab679e7a088c  router.c\n"
+"d086bec8040a54b30ffa32eed4297a58b4b1f62c  routerlist.c\n"
+"75303960154f9e97da562dadc79d58441479ec43  routerparse.c\n"
+"b2f75012e2c120a8f9fc5e0041b1b0103d10a5a9  sigcache.c\n"
+"e11545a8184ed6a423c8e86fbce4677980ae5d26  status.c\n"
+"28087126d7fa0116bd51a8589f58ec990a7dcc78  config_codedigest.c\n"
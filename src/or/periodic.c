@@ -0,0 +1,124 @@
+/* Copyright (c) 2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file periodic.c
+ * \brief Run housekeeping tasks, each on its own schedule.
+ *
+ * Each periodic event is a callback that does a task and returns how many
+ * seconds we should wait before calling it again.  We keep one Libevent
+ * timer per event, so an event whose task is far off costs us nothing until
+ * then, and we keep track of how long each event takes to run.
+ **/
+
+#include "or.h"
+#include "config.h"
+#include "periodic.h"
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+/** Arrange for <b>event</b> to run again in <b>seconds</b> seconds. */
+static void
+periodic_event_set_interval(periodic_event_item_t *event, int seconds)
+{
+  struct timeval tv;
+  tv.tv_sec = seconds;
+  tv.tv_usec = 0;
+  event->next_action_time = approx_time() + seconds;
+  if (evtimer_add(event->ev, &tv) < 0) {
+    log_warn(LD_BUG, "Couldn't schedule periodic event %s", event->name);
+  }
+}
+
+/** Libevent callback: run the periodic event <b>data</b>, note how long it
+ * took, and schedule it to run again when it asks to. */
+static void
+periodic_event_dispatch(evutil_socket_t fd, short what, void *data)
+{
+  periodic_event_item_t *event = data;
+  time_t now = time(NULL);
+  struct timeval start, end;
+  int64_t usec;
+  int r;
+  (void)fd;
+  (void)what;
+
+  update_approx_time(now);
+  update_approx_monotonic_msec();
+
+  log_debug(LD_GENERAL, "Running periodic event %s", event->name);
+  tor_gettimeofday(&start);
+  r = event->fn(now, get_options());
+  tor_gettimeofday(&end);
+
+  usec = tv_udiff(&start, &end);
+  if (usec < 0)
+    usec = 0;
+  ++event->n_calls;
+  event->usec_total += (uint64_t)usec;
+  if (usec > event->usec_max)
+    event->usec_max = (uint32_t)MIN(usec, UINT32_MAX);
+  event->last_action_time = now;
+
+  if (!event->enabled)
+    return; /* The callback stopped this event. */
+  periodic_event_set_interval(event, r < 1 ? 1 : r);
+}
+
+/** Start running <b>event</b>, beginning one second from now. */
+void
+periodic_event_launch(periodic_event_item_t *event)
+{
+  if (event->enabled) {
+    log_warn(LD_BUG, "Tried to launch periodic event %s twice", event->name);
+    return;
+  }
+  if (!event->ev)
+    event->ev = tor_evtimer_new(tor_libevent_get_base(),
+                                periodic_event_dispatch, event);
+  tor_assert(event->ev);
+  event->enabled = 1;
+  periodic_event_set_interval(event, 1);
+}
+
+/** If <b>event</b> is running, make it run again one second from now,
+ * whatever it asked for.  We do this when something that the event's
+ * schedule depends on, such as our options, has changed. */
+void
+periodic_event_reschedule(periodic_event_item_t *event)
+{
+  if (!event->enabled)
+    return;
+  evtimer_del(event->ev);
+  periodic_event_set_interval(event, 1);
+}
+
+/** Stop running <b>event</b>, and release its timer. */
+void
+periodic_event_stop(periodic_event_item_t *event)
+{
+  if (event->ev) {
+    tor_event_free(event->ev);
+    event->ev = NULL;
+  }
+  event->enabled = 0;
+}
+
+/** Log how often <b>event</b> has run and how long it has taken, at
+ * <b>severity</b>. */
+void
+periodic_event_log_stats(const periodic_event_item_t *event, int severity)
+{
+  log(severity, LD_GENERAL,
+      "Periodic event %s: ran "U64_FORMAT" times, taking "U64_FORMAT
+      " msec in all (at most %u msec); next run in %ld seconds.",
+      event->name, U64_PRINTF_ARG(event->n_calls),
+      U64_PRINTF_ARG(event->usec_total / 1000),
+      (unsigned)(event->usec_max / 1000),
+      event->enabled ? (long)(event->next_action_time - approx_time()) : -1L);
+}
+
@@ -0,0 +1,46 @@
+/* Copyright (c) 2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file periodic.h
+ * \brief Header file for periodic.c.
+ **/
+
+#ifndef _TOR_PERIODIC_H
+#define _TOR_PERIODIC_H
+
+/** Callback function for a periodic event to take action.  The return value
+ * is the number of seconds until we should call it again; values below 1
+ * mean 1. */
+typedef int (*periodic_event_helper_t)(time_t now,
+                                       const or_options_t *options);
+
+struct event;
+
+/** A single item for the list of periodic events that we run. */
+typedef struct periodic_event_item_t {
+  periodic_event_helper_t fn; /**< The function to run the event. */
+  const char *name; /**< Name of the function, for logging. */
+  struct event *ev; /**< Libevent timer we use to run this event. */
+  /** True iff this event has been launched, and hasn't been stopped. */
+  unsigned int enabled:1;
+  time_t last_action_time; /**< When did we last run this event? */
+  time_t next_action_time; /**< When do we plan to run this event next? */
+  uint64_t n_calls; /**< How many times have we run this event? */
+  uint64_t usec_total; /**< How long have all those runs taken, in total? */
+  uint32_t usec_max; /**< How long did the longest run take? */
+} periodic_event_item_t;
+
+/** Refer to a periodic event whose callback is <b>fn</b>_callback(). */
+#define PERIODIC_EVENT(fn) { fn ## _callback, #fn, NULL, 0, 0, 0, 0, 0, 0 }
+/** Marks the end of an array of periodic_event_item_t. */
+#define END_OF_PERIODIC_EVENTS { NULL, NULL, NULL, 0, 0, 0, 0, 0, 0 }
+
+void periodic_event_launch(periodic_event_item_t *event);
+void periodic_event_reschedule(periodic_event_item_t *event);
+void periodic_event_stop(periodic_event_item_t *event);
+void periodic_event_log_stats(const periodic_event_item_t *event,
+                              int severity);
+
+#endif
+
@@ -521,11 +521,10 @@ policy_eq(policy_map_ent_t *a, policy_map_ent_t *b)
   return cmp_single_addr_policy(a->policy, b->policy) == 0;
 }
 
-/** Return a hashcode for <b>ent</b> */
+/** Return a hashcode for the address policy item <b>a</b>. */
 static unsigned int
-policy_hash(policy_map_ent_t *ent)
+single_addr_policy_hash(const addr_policy_t *a)
 {
-  addr_policy_t *a = ent->policy;
   unsigned int r;
   if (a->is_private)
     r = 0x1234abcd;
@@ -540,6 +539,13 @@ policy_hash(policy_map_ent_t *ent)
   return r;
 }
 
+/** Return a hashcode for <b>ent</b> */
+static unsigned int
+policy_hash(policy_map_ent_t *ent)
+{
+  return single_addr_policy_hash(ent->policy);
+}
+
 HT_PROTOTYPE(policy_map, policy_map_ent_t, node, policy_hash,
              policy_eq)
 HT_GENERATE(policy_map, policy_map_ent_t, node, policy_hash,
@@ -699,6 +705,332 @@ compare_tor_addr_to_addr_policy(const tor_addr_t *addr, uint16_t port,
   }
 }
 
+/** Largest policy that compiled_policy_get() will compile. */
+#define COMPILED_POLICY_MAX_ITEMS 512
+/** Largest total number of address ranges we'll keep for a compiled
+ * policy. */
+#define COMPILED_POLICY_MAX_ADDR_RANGES 65536
+
+/** An address policy compiled into a decision table, so that checking an
+ * IPv4 address and port against it takes two binary searches instead of a
+ * walk over the whole policy.  The port space is split into ranges over
+ * which the same policy items apply; each port range has its own sorted
+ * list of IPv4 address ranges over which the same item matches first.
+ * Compiled policies are shared between everyone with the same policy. */
+struct compiled_policy_t {
+  HT_ENTRY(compiled_policy_t) node;
+  /** The policy we compiled, as canonical entries. */
+  smartlist_t *policy;
+  /** Hash of <b>policy</b>. */
+  unsigned int hash;
+  /** Number of holders of this compiled policy. */
+  int refcnt;
+  /** Number of port ranges. */
+  int n_port_ranges;
+  /** Sorted list of the first port in each port range; the first is 0. */
+  uint16_t *port_start;
+  /** For each port range, the addr_policy_result_t for an unknown
+   * address. */
+  int8_t *noaddr_result;
+  /** For each port range i, its address ranges are at indices
+   * addr_idx[i] up to but not including addr_idx[i+1]. */
+  int *addr_idx;
+  /** Sorted within each port range: the first IPv4 address (host order) in
+   * each address range; the first for each port range is 0. */
+  uint32_t *addr_start;
+  /** For each address range, true iff it is rejected. */
+  uint8_t *addr_reject;
+};
+
+/** Return a hashcode for the address policy <b>policy</b>. */
+static unsigned int
+addr_policy_list_hash(const smartlist_t *policy)
+{
+  unsigned int r = 0;
+  SMARTLIST_FOREACH(policy, const addr_policy_t *, p,
+                    r = r * 31 + single_addr_policy_hash(p));
+  return r;
+}
+
+/** Return true iff <b>a</b> and <b>b</b> are compiled from equal
+ * policies. */
+static INLINE int
+compiled_policy_eq(compiled_policy_t *a, compiled_policy_t *b)
+{
+  return a->hash == b->hash && !cmp_addr_policies(a->policy, b->policy);
+}
+
+/** Return a hashcode for <b>cp</b>. */
+static INLINE unsigned int
+compiled_policy_hash(compiled_policy_t *cp)
+{
+  return cp->hash;
+}
+
+static HT_HEAD(compiled_policy_map, compiled_policy_t) compiled_policy_root =
+  HT_INITIALIZER();
+
+HT_PROTOTYPE(compiled_policy_map, compiled_policy_t, node,
+             compiled_policy_hash, compiled_policy_eq)
+HT_GENERATE(compiled_policy_map, compiled_policy_t, node,
+            compiled_policy_hash, compiled_policy_eq, 0.6, malloc, realloc,
+            free)
+
+/** Helper for qsort: compare two uint32_ts. */
+static int
+_compare_uint32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/** Sort the <b>n</b> values in <b>vals</b> and remove duplicates; return
+ * the number of values that remain. */
+static int
+sort_uniq_uint32(uint32_t *vals, int n)
+{
+  int i, out = 0;
+  qsort(vals, n, sizeof(uint32_t), _compare_uint32);
+  for (i = 0; i < n; ++i) {
+    if (!out || vals[out-1] != vals[i])
+      vals[out++] = vals[i];
+  }
+  return out;
+}
+
+/** Set *<b>lo_out</b> and *<b>hi_out</b> to the first and last IPv4
+ * addresses matched by the IPv4 policy item <b>p</b>. */
+static void
+addr_policy_get_ipv4_range(const addr_policy_t *p, uint32_t *lo_out,
+                           uint32_t *hi_out)
+{
+  int bits = p->maskbits > 32 ? 32 : p->maskbits;
+  uint32_t mask = bits ? (0xffffffffu << (32 - bits)) : 0;
+  *lo_out = tor_addr_to_ipv4h(&p->addr) & mask;
+  *hi_out = *lo_out | ~mask;
+}
+
+/** Release all storage held by the decision table in <b>cp</b>. */
+static void
+compiled_policy_free_tables(compiled_policy_t *cp)
+{
+  tor_free(cp->port_start);
+  tor_free(cp->noaddr_result);
+  tor_free(cp->addr_idx);
+  tor_free(cp->addr_start);
+  tor_free(cp->addr_reject);
+}
+
+/** Build the decision table for <b>cp</b>-&gt;policy.  Return 0 on success,
+ * or -1 if the policy is too large to be worth compiling. */
+static int
+compiled_policy_build(compiled_policy_t *cp)
+{
+  const smartlist_t *policy = cp->policy;
+  const int n = smartlist_len(policy);
+  uint32_t *ports, *addrs;
+  const addr_policy_t **applicable;
+  int n_ports = 0, i, j, k, n_out = 0, cap_out;
+
+  if (n > COMPILED_POLICY_MAX_ITEMS)
+    return -1;
+
+  /* Every port where some item starts or stops applying. */
+  ports = tor_malloc(sizeof(uint32_t) * (2*n + 1));
+  ports[n_ports++] = 0;
+  SMARTLIST_FOREACH_BEGIN(policy, const addr_policy_t *, p) {
+    ports[n_ports++] = p->prt_min;
+    if (p->prt_max < 65535)
+      ports[n_ports++] = p->prt_max + 1;
+  } SMARTLIST_FOREACH_END(p);
+  n_ports = sort_uniq_uint32(ports, n_ports);
+
+  addrs = tor_malloc(sizeof(uint32_t) * (2*n + 1));
+  applicable = tor_malloc(sizeof(addr_policy_t *) * (n + 1));
+  cap_out = 16;
+  cp->port_start = tor_malloc(sizeof(uint16_t) * n_ports);
+  cp->noaddr_result = tor_malloc(n_ports);
+  cp->addr_idx = tor_malloc(sizeof(int) * (n_ports + 1));
+  cp->addr_start = tor_malloc(sizeof(uint32_t) * cap_out);
+  cp->addr_reject = tor_malloc(cap_out);
+  cp->n_port_ranges = 0;
+
+  for (i = 0; i < n_ports; ++i) {
+    const uint16_t port = (uint16_t)ports[i];
+    int n_applicable = 0, n_addrs = 0, range_start = n_out;
+    int8_t noaddr;
+
+    /* Each item applies to all of this port range or to none of it. */
+    SMARTLIST_FOREACH_BEGIN(policy, const addr_policy_t *, p) {
+      if (p->prt_min <= port && port <= p->prt_max &&
+          tor_addr_family(&p->addr) == AF_INET)
+        applicable[n_applicable++] = p;
+    } SMARTLIST_FOREACH_END(p);
+    noaddr = port ? (int8_t)
+      compare_tor_addr_to_addr_policy(NULL, port, policy) :
+      ADDR_POLICY_PROBABLY_ACCEPTED;
+
+    /* Every address where some applicable item starts or stops matching;
+     * over each range between them, the same item matches first. */
+    addrs[n_addrs++] = 0;
+    for (j = 0; j < n_applicable; ++j) {
+      uint32_t lo, hi;
+      addr_policy_get_ipv4_range(applicable[j], &lo, &hi);
+      addrs[n_addrs++] = lo;
+      if (hi != 0xffffffffu)
+        addrs[n_addrs++] = hi + 1;
+    }
+    n_addrs = sort_uniq_uint32(addrs, n_addrs);
+    for (j = 0; j < n_addrs; ++j) {
+      uint8_t reject = 0;
+      for (k = 0; k < n_applicable; ++k) {
+        uint32_t lo, hi;
+        addr_policy_get_ipv4_range(applicable[k], &lo, &hi);
+        if (lo <= addrs[j] && addrs[j] <= hi) {
+          reject = applicable[k]->policy_type == ADDR_POLICY_REJECT;
+          break;
+        }
+      }
+      if (n_out > range_start && cp->addr_reject[n_out-1] == reject)
+        continue; /* Same as the previous range; merge them. */
+      if (n_out == cap_out) {
+        cap_out *= 2;
+        if (cap_out > COMPILED_POLICY_MAX_ADDR_RANGES)
+          goto too_big;
+        cp->addr_start = tor_realloc(cp->addr_start,
+                                     sizeof(uint32_t) * cap_out);
+        cp->addr_reject = tor_realloc(cp->addr_reject, cap_out);
+      }
+      cp->addr_start[n_out] = addrs[j];
+      cp->addr_reject[n_out] = reject;
+      ++n_out;
+    }
+
+    /* If this port range decides everything the same way as the previous
+     * one, merge them. */
+    if (cp->n_port_ranges) {
+      const int prev = cp->n_port_ranges - 1;
+      const int prev_len = cp->addr_idx[prev+1] - cp->addr_idx[prev];
+      if (cp->noaddr_result[prev] == noaddr &&
+          prev_len == n_out - range_start &&
+          !memcmp(&cp->addr_start[cp->addr_idx[prev]],
+                  &cp->addr_start[range_start],
+                  sizeof(uint32_t) * prev_len) &&
+          !memcmp(&cp->addr_reject[cp->addr_idx[prev]],
+                  &cp->addr_reject[range_start], prev_len)) {
+        n_out = range_start;
+        continue;
+      }
+    }
+    cp->port_start[cp->n_port_ranges] = port;
+    cp->noaddr_result[cp->n_port_ranges] = noaddr;
+    cp->addr_idx[cp->n_port_ranges] = range_start;
+    ++cp->n_port_ranges;
+    cp->addr_idx[cp->n_port_ranges] = n_out;
+  }
+
+  tor_free(ports);
+  tor_free(addrs);
+  tor_free(applicable);
+  return 0;
+ too_big:
+  tor_free(ports);
+  tor_free(addrs);
+  tor_free(applicable);
+  compiled_policy_free_tables(cp);
+  return -1;
+}
+
+/** Return a compiled form of the address policy <b>policy</b>, sharing one
+ * with any other holder of an equal policy.  The caller must release it with
+ * compiled_policy_release().  Return NULL if <b>policy</b> is NULL or too
+ * large to compile. */
+compiled_policy_t *
+compiled_policy_get(const smartlist_t *policy)
+{
+  compiled_policy_t search, *found;
+
+  if (!policy || smartlist_len(policy) > COMPILED_POLICY_MAX_ITEMS)
+    return NULL;
+
+  search.policy = (smartlist_t *)policy;
+  search.hash = addr_policy_list_hash(policy);
+  found = HT_FIND(compiled_policy_map, &compiled_policy_root, &search);
+  if (!found) {
+    found = tor_malloc_zero(sizeof(compiled_policy_t));
+    found->policy = smartlist_create();
+    SMARTLIST_FOREACH_BEGIN(policy, addr_policy_t *, p) {
+      addr_policy_t *c = addr_policy_get_canonical_entry(p);
+      if (c == p)
+        ++c->refcnt; /* Already canonical, so nobody counted us. */
+      smartlist_add(found->policy, c);
+    } SMARTLIST_FOREACH_END(p);
+    found->hash = search.hash;
+    if (compiled_policy_build(found) < 0) {
+      addr_policy_list_free(found->policy);
+      tor_free(found);
+      return NULL;
+    }
+    HT_INSERT(compiled_policy_map, &compiled_policy_root, found);
+  }
+  ++found->refcnt;
+  return found;
+}
+
+/** Release a reference to <b>cp</b>, freeing it if it was the last. */
+void
+compiled_policy_release(compiled_policy_t *cp)
+{
+  if (!cp)
+    return;
+  if (--cp->refcnt > 0)
+    return;
+  HT_REMOVE(compiled_policy_map, &compiled_policy_root, cp);
+  addr_policy_list_free(cp->policy);
+  compiled_policy_free_tables(cp);
+  tor_free(cp);
+}
+
+/** Return the index of the last element of the sorted array <b>vals</b>
+ * of <b>n</b> elements that is no greater than <b>key</b>.  The first
+ * element must be no greater than <b>key</b>. */
+#define LAST_LE_IDX(vals, n, key, out) STMT_BEGIN                 \
+    int lo_ = 0, hi_ = (n) - 1;                                   \
+    while (lo_ < hi_) {                                           \
+      int mid_ = (lo_ + hi_ + 1) / 2;                             \
+      if ((vals)[mid_] <= (key))                                  \
+        lo_ = mid_;                                               \
+      else                                                        \
+        hi_ = mid_ - 1;                                           \
+    }                                                             \
+    (out) = lo_;                                                  \
+  STMT_END
+
+/** As compare_tor_addr_to_addr_policy(), but use the compiled policy
+ * <b>cp</b>, which must be the compiled form of <b>policy</b>. */
+addr_policy_result_t
+compare_tor_addr_to_compiled_policy(const tor_addr_t *addr, uint16_t port,
+                                    const compiled_policy_t *cp,
+                                    const smartlist_t *policy)
+{
+  int pr, ar;
+  if (!port || (addr && tor_addr_family(addr) != AF_INET &&
+                !tor_addr_is_null(addr)))
+    return compare_tor_addr_to_addr_policy(addr, port, policy);
+
+  LAST_LE_IDX(cp->port_start, cp->n_port_ranges, port, pr);
+  if (addr == NULL || tor_addr_is_null(addr)) {
+    return (addr_policy_result_t)cp->noaddr_result[pr];
+  } else {
+    const uint32_t a = tor_addr_to_ipv4h(addr);
+    const int first = cp->addr_idx[pr];
+    LAST_LE_IDX(cp->addr_start + first, cp->addr_idx[pr+1] - first, a, ar);
+    return cp->addr_reject[first + ar] ?
+      ADDR_POLICY_REJECTED : ADDR_POLICY_ACCEPTED;
+  }
+}
+#undef LAST_LE_IDX
+
 /** Return true iff the address policy <b>a</b> covers every case that
  * would be covered by <b>b</b>, so that a,b is redundant. */
 static int
@@ -876,6 +1208,7 @@ void
 policies_set_node_exitpolicy_to_reject_all(node_t *node)
 {
   node->rejects_all = 1;
+  nodelist_hot_fields_update_node(node);
 }
 
 /** Return 1 if there is at least one /8 subnet in <b>policy</b> that
@@ -1299,8 +1632,107 @@ policy_summarize(smartlist_t *policy)
   return result;
 }
 
+/** Return true iff <b>a</b> and <b>b</b> are the same policy summary. */
+static INLINE int
+short_policy_eq(short_policy_t *a, short_policy_t *b)
+{
+  return a->is_accept == b->is_accept && a->n_entries == b->n_entries &&
+    !memcmp(a->entries, b->entries,
+            sizeof(short_policy_entry_t)*a->n_entries);
+}
+
+/** Return a hashcode for the policy summary <b>p</b>. */
+static INLINE unsigned int
+short_policy_hash(short_policy_t *p)
+{
+  unsigned int r = p->is_accept;
+  int i;
+  for (i = 0; i < p->n_entries; ++i)
+    r = r * 131 + ((p->entries[i].min_port << 16) ^ p->entries[i].max_port);
+  return r;
+}
+
+/** Map of all policy summaries we hold, so that identical summaries can
+ * share one short_policy_t and its port index. */
+static HT_HEAD(short_policy_map, short_policy_t) short_policy_root =
+  HT_INITIALIZER();
+
+HT_PROTOTYPE(short_policy_map, short_policy_t, node, short_policy_hash,
+             short_policy_eq)
+HT_GENERATE(short_policy_map, short_policy_t, node, short_policy_hash,
+            short_policy_eq, 0.6, malloc, realloc, free)
+
+/** Number of bitarray_t words covering one block of 256 ports. */
+#define PORT_BLOCK_WORDS (256 / (sizeof(bitarray_t)*8))
+
+/** Fill in the port index of the policy summary <b>policy</b>. */
+static void
+short_policy_build_port_index(short_policy_t *policy)
+{
+  bitarray_t *all = bitarray_init_zero(65536);
+  int i, block, n_mixed = 0;
+  unsigned w;
+
+  for (i = 0; i < policy->n_entries; ++i) {
+    int port;
+    for (port = policy->entries[i].min_port;
+         port <= policy->entries[i].max_port; ++port)
+      bitarray_set(all, port);
+  }
+  if (!policy->is_accept) {
+    for (w = 0; w < 65536 / (sizeof(bitarray_t)*8); ++w)
+      all[w] = ~all[w];
+  }
+  /* Port 0 is never looked up; treat it like port 1 so that it doesn't
+   * split the first block. */
+  if (bitarray_is_set(all, 1))
+    bitarray_set(all, 0);
+  else
+    bitarray_clear(all, 0);
+
+  for (block = 0; block < 256; ++block) {
+    const bitarray_t *words = all + block * PORT_BLOCK_WORDS;
+    int any_set = 0, any_clear = 0;
+    for (w = 0; w < PORT_BLOCK_WORDS; ++w) {
+      any_set |= words[w] != 0;
+      any_clear |= words[w] != ~(bitarray_t)0;
+    }
+    if (!any_set) {
+      policy->port_block[block] = SHORT_POLICY_BLOCK_REJECT;
+    } else if (!any_clear) {
+      policy->port_block[block] = SHORT_POLICY_BLOCK_ACCEPT;
+    } else {
+      /* Move the mixed block's bits down to their place in port_bits;
+       * n_mixed <= block, so this never overwrites a block we still need. */
+      memmove(all + n_mixed * PORT_BLOCK_WORDS, words,
+              PORT_BLOCK_WORDS * sizeof(bitarray_t));
+      policy->port_block[block] = SHORT_POLICY_BLOCK_MIXED + n_mixed;
+      ++n_mixed;
+    }
+  }
+
+  if (n_mixed) {
+    policy->port_bits = tor_memdup(all,
+                          n_mixed * PORT_BLOCK_WORDS * sizeof(bitarray_t));
+  }
+  bitarray_free(all);
+}
+
+/** Return true iff the policy summary <b>policy</b> accepts <b>port</b>. */
+static INLINE int
+short_policy_accepts_port(const short_policy_t *policy, uint16_t port)
+{
+  const uint16_t b = policy->port_block[port >> 8];
+  if (b < SHORT_POLICY_BLOCK_MIXED)
+    return b == SHORT_POLICY_BLOCK_ACCEPT;
+  return bitarray_is_set(policy->port_bits,
+                         ((b - SHORT_POLICY_BLOCK_MIXED) << 8) | (port & 0xff))
+    != 0;
+}
+
 /** Convert a summarized policy string into a short_policy_t.  Return NULL
- * if the string is not well-formed. */
+ * if the string is not well-formed.  Identical summaries share one
+ * short_policy_t; release it with short_policy_free(). */
 short_policy_t *
 parse_short_policy(const char *summary)
 {
@@ -1390,13 +1822,32 @@ parse_short_policy(const char *summary)
   result->is_accept = is_accept;
   result->n_entries = n_entries;
   memcpy(result->entries, entries, sizeof(short_policy_entry_t)*n_entries);
+
+  {
+    short_policy_t *found =
+      HT_FIND(short_policy_map, &short_policy_root, result);
+    if (found) {
+      tor_free(result);
+      ++found->refcnt;
+      return found;
+    }
+  }
+  short_policy_build_port_index(result);
+  result->refcnt = 1;
+  HT_INSERT(short_policy_map, &short_policy_root, result);
   return result;
 }
 
-/** Release all storage held in <b>policy</b>. */
+/** Release a reference to <b>policy</b>, freeing it if it was the last. */
 void
 short_policy_free(short_policy_t *policy)
 {
+  if (!policy)
+    return;
+  if (--policy->refcnt > 0)
+    return;
+  HT_REMOVE(short_policy_map, &short_policy_root, policy);
+  tor_free(policy->port_bits);
   tor_free(policy);
 }
 
@@ -1408,8 +1859,6 @@ addr_policy_result_t
 compare_tor_addr_to_short_policy(const tor_addr_t *addr, uint16_t port,
                                  const short_policy_t *policy)
 {
-  int i;
-  int found_match = 0;
   int accept;
   (void)addr;
 
@@ -1422,18 +1871,7 @@ compare_tor_addr_to_short_policy(const tor_addr_t *addr, uint16_t port,
                tor_addr_is_loopback(addr)))
     return ADDR_POLICY_REJECTED;
 
-  for (i=0; i < policy->n_entries; ++i) {
-    const short_policy_entry_t *e = &policy->entries[i];
-    if (e->min_port <= port && port <= e->max_port) {
-      found_match = 1;
-      break;
-    }
-  }
-
-  if (found_match)
-    accept = policy->is_accept;
-  else
-    accept = ! policy->is_accept;
+  accept = short_policy_accepts_port(policy, port);
 
   /* ???? are these right? */
   if (accept)
@@ -1467,9 +1905,20 @@ compare_tor_addr_to_node_policy(const tor_addr_t *addr, uint16_t port,
   if (node->rejects_all)
     return ADDR_POLICY_REJECTED;
 
-  if (node->ri)
-    return compare_tor_addr_to_addr_policy(addr, port, node->ri->exit_policy);
-  else if (node->md) {
+  if (node->ri) {
+    routerinfo_t *ri = node->ri;
+    if (!ri->exit_policy_compiled && !ri->exit_policy_uncompilable &&
+        ri->exit_policy) {
+      ri->exit_policy_compiled = compiled_policy_get(ri->exit_policy);
+      if (!ri->exit_policy_compiled)
+        ri->exit_policy_uncompilable = 1;
+    }
+    if (ri->exit_policy_compiled)
+      return compare_tor_addr_to_compiled_policy(addr, port,
+                                                 ri->exit_policy_compiled,
+                                                 ri->exit_policy);
+    return compare_tor_addr_to_addr_policy(addr, port, ri->exit_policy);
+  } else if (node->md) {
     if (node->md->exit_policy == NULL)
       return ADDR_POLICY_REJECTED;
     else
@@ -1546,6 +1995,33 @@ policies_free_all(void)
   addr_policy_list_free(authdir_badexit_policy);
   authdir_badexit_policy = NULL;
 
+  if (!HT_EMPTY(&compiled_policy_root)) {
+    compiled_policy_t **cp, *victim;
+    log_warn(LD_MM, "Still had %d compiled policies cached at shutdown.",
+             (int)HT_SIZE(&compiled_policy_root));
+    for (cp = HT_START(compiled_policy_map, &compiled_policy_root); cp; ) {
+      victim = *cp;
+      cp = HT_NEXT_RMV(compiled_policy_map, &compiled_policy_root, cp);
+      addr_policy_list_free(victim->policy);
+      compiled_policy_free_tables(victim);
+      tor_free(victim);
+    }
+  }
+  HT_CLEAR(compiled_policy_map, &compiled_policy_root);
+
+  if (!HT_EMPTY(&short_policy_root)) {
+    short_policy_t **sp, *victim;
+    log_warn(LD_MM, "Still had %d policy summaries cached at shutdown.",
+             (int)HT_SIZE(&short_policy_root));
+    for (sp = HT_START(short_policy_map, &short_policy_root); sp; ) {
+      victim = *sp;
+      sp = HT_NEXT_RMV(short_policy_map, &short_policy_root, sp);
+      tor_free(victim->port_bits);
+      tor_free(victim);
+    }
+  }
+  HT_CLEAR(short_policy_map, &short_policy_root);
+
   if (!HT_EMPTY(&policy_root)) {
     policy_map_ent_t **ent;
     int n = 0;
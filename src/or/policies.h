@@ -38,6 +38,13 @@ int cmp_addr_policies(smartlist_t *a, smartlist_t *b);
 addr_policy_result_t compare_tor_addr_to_addr_policy(const tor_addr_t *addr,
                               uint16_t port, const smartlist_t *policy);
 
+compiled_policy_t *compiled_policy_get(const smartlist_t *policy);
+void compiled_policy_release(compiled_policy_t *cp);
+addr_policy_result_t compare_tor_addr_to_compiled_policy(
+                              const tor_addr_t *addr, uint16_t port,
+                              const compiled_policy_t *cp,
+                              const smartlist_t *policy);
+
 addr_policy_result_t compare_tor_addr_to_node_policy(const tor_addr_t *addr,
                               uint16_t port, const node_t *node);
 
@@ -14,6 +14,7 @@
 #define RELAY_PRIVATE
 #include "or.h"
 #include "buffers.h"
+#include "celltrace.h"
 #include "circuitbuild.h"
 #include "circuitlist.h"
 #include "config.h"
@@ -34,6 +35,12 @@
 #include "routerlist.h"
 #include "routerparse.h"
 
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
 static edge_connection_t *relay_lookup_conn(circuit_t *circ, cell_t *cell,
                                             cell_direction_t cell_direction,
                                             crypt_path_t *layer_hint);
@@ -64,7 +71,9 @@ static struct timeval cached_time_hires = {0, 0};
  * cells. */
 #define CELL_QUEUE_LOWWATER_SIZE 64
 
-static void
+/** Set *<b>tv</b> to the current hi-res time, as cached since libevent
+ * last called us. */
+void
 tor_gettimeofday_cached(struct timeval *tv)
 {
   if (cached_time_hires.tv_sec == 0) {
@@ -117,9 +126,9 @@ relay_digest_matches(crypto_digest_env_t *digest, cell_t *cell)
 {
   char received_integrity[4], calculated_integrity[4];
   relay_header_t rh;
-  crypto_digest_env_t *backup_digest=NULL;
+  crypto_digest_checkpoint_t backup_digest;
 
-  backup_digest = crypto_digest_dup(digest);
+  crypto_digest_checkpoint(&backup_digest, digest);
 
   relay_header_unpack(&rh, cell->payload);
   memcpy(received_integrity, rh.integrity, 4);
@@ -137,14 +146,12 @@ relay_digest_matches(crypto_digest_env_t *digest, cell_t *cell)
 //    log_fn(LOG_INFO,"Recognized=0 but bad digest. Not recognizing.");
 // (%d vs %d).", received_integrity, calculated_integrity);
     /* restore digest to its old form */
-    crypto_digest_assign(digest, backup_digest);
+    crypto_digest_restore(digest, &backup_digest);
     /* restore the relay header */
     memcpy(rh.integrity, received_integrity, 4);
     relay_header_pack(cell->payload, &rh);
-    crypto_free_digest_env(backup_digest);
     return 0;
   }
-  crypto_free_digest_env(backup_digest);
   return 1;
 }
 
@@ -170,6 +177,39 @@ relay_crypt_one_payload(crypto_cipher_env_t *cipher, uint8_t *in,
   return 0;
 }
 
+/** How many payloads do we hand to the cipher at once in
+ * relay_crypt_payloads()? */
+#define RELAY_CRYPT_BATCH 32
+
+/** Apply <b>cipher</b> (in place) to the payloads of the <b>n_cells</b> cells
+ * in <b>cells</b>, in order, as relay_crypt_one_payload() would for each of
+ * them in turn.  All the cells must be for the same circuit and hop, since
+ * they share <b>cipher</b>'s keystream.
+ *
+ * Return -1 if the crypto fails, else return 0.
+ */
+int
+relay_crypt_payloads(crypto_cipher_env_t *cipher, cell_t **cells,
+                     int n_cells)
+{
+  char *bufs[RELAY_CRYPT_BATCH];
+  int i, n;
+
+  while (n_cells > 0) {
+    n = n_cells < RELAY_CRYPT_BATCH ? n_cells : RELAY_CRYPT_BATCH;
+    for (i = 0; i < n; ++i)
+      bufs[i] = (char*) cells[i]->payload;
+    if (crypto_cipher_crypt_inplace_multi(cipher, bufs, CELL_PAYLOAD_SIZE,
+                                          n)) {
+      log_warn(LD_BUG,"Error during relay encryption");
+      return -1;
+    }
+    cells += n;
+    n_cells -= n;
+  }
+  return 0;
+}
+
 /** Receive a relay cell:
  *  - Crypt it (encrypt if headed toward the origin or if we <b>are</b> the
  *    origin; decrypt if we're headed toward the exit).
@@ -198,6 +238,15 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
   if (circ->marked_for_close)
     return 0;
 
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    /* Count this cell for the controller's CIRC_BW event. */
+    origin_circuit_t *ocirc = TO_ORIGIN_CIRCUIT(circ);
+    if (PREDICT_LIKELY(UINT32_MAX - ocirc->n_read_circ_bw > CELL_PAYLOAD_SIZE))
+      ocirc->n_read_circ_bw += CELL_PAYLOAD_SIZE;
+    else
+      ocirc->n_read_circ_bw = UINT32_MAX;
+  }
+
   if (relay_crypt(circ, cell, cell_direction, &layer_hint, &recognized) < 0) {
     log_warn(LD_BUG,"relay crypt failed. Dropping connection.");
     return -END_CIRC_REASON_INTERNAL;
@@ -526,6 +575,7 @@ relay_command_to_string(uint8_t command)
     case RELAY_COMMAND_RENDEZVOUS_ESTABLISHED:
       return "RENDEZVOUS_ESTABLISHED";
     case RELAY_COMMAND_INTRODUCE_ACK: return "INTRODUCE_ACK";
+    case RELAY_COMMAND_WINDOW_REQUEST: return "WINDOW_REQUEST";
     default: return "(unrecognized)";
   }
 }
@@ -588,6 +638,11 @@ relay_send_command_from_edge(streamid_t stream_id, circuit_t *circ,
 
   if (cell_direction == CELL_DIRECTION_OUT) {
     origin_circuit_t *origin_circ = TO_ORIGIN_CIRCUIT(circ);
+    if (PREDICT_LIKELY(UINT32_MAX - origin_circ->n_written_circ_bw >
+                       CELL_PAYLOAD_SIZE))
+      origin_circ->n_written_circ_bw += CELL_PAYLOAD_SIZE;
+    else
+      origin_circ->n_written_circ_bw = UINT32_MAX;
     if (origin_circ->remaining_relay_early_cells > 0 &&
         (relay_command == RELAY_COMMAND_EXTEND ||
          cpath_layer != origin_circ->cpath)) {
@@ -1282,11 +1337,13 @@ connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
       if (!conn) {
         if (layer_hint) {
           layer_hint->package_window += CIRCWINDOW_INCREMENT;
+          flow_control_note_sendme(&layer_hint->flow, CIRCWINDOW_INCREMENT);
           log_debug(LD_APP,"circ-level sendme at origin, packagewindow %d.",
                     layer_hint->package_window);
           circuit_resume_edge_reading(circ, layer_hint);
         } else {
           circ->package_window += CIRCWINDOW_INCREMENT;
+          flow_control_note_sendme(&circ->flow, CIRCWINDOW_INCREMENT);
           log_debug(LD_APP,
                     "circ-level sendme at non-origin, packagewindow %d.",
                     circ->package_window);
@@ -1295,6 +1352,7 @@ connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
         return 0;
       }
       conn->package_window += STREAMWINDOW_INCREMENT;
+      flow_control_note_sendme(&conn->flow, STREAMWINDOW_INCREMENT);
       log_debug(domain,"stream-level sendme, packagewindow now %d.",
                 conn->package_window);
       if (circuit_queue_streams_are_blocked(circ)) {
@@ -1326,6 +1384,27 @@ connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
       }
       connection_exit_begin_resolve(cell, TO_OR_CIRCUIT(circ));
       return 0;
+    case RELAY_COMMAND_WINDOW_REQUEST:
+      if (!get_options()->AdaptiveFlowControl) {
+        log_info(domain, "Got a window request, but AdaptiveFlowControl is "
+                 "off. Dropping.");
+        return 0;
+      }
+      if (!conn) {
+        if (layer_hint) {
+          flow_control_grow(&layer_hint->flow, CIRCWINDOW_START,
+                            CIRCWINDOW_ADAPTIVE_MAX);
+        } else {
+          flow_control_grow(&circ->flow, CIRCWINDOW_START,
+                            CIRCWINDOW_ADAPTIVE_MAX);
+        }
+        circuit_consider_sending_sendme(circ, layer_hint);
+        return 0;
+      }
+      flow_control_grow(&conn->flow, STREAMWINDOW_START,
+                        STREAMWINDOW_ADAPTIVE_MAX);
+      connection_edge_consider_sending_sendme(conn);
+      return 0;
     case RELAY_COMMAND_RESOLVED:
       if (conn) {
         log_fn(LOG_PROTOCOL_WARN, domain,
@@ -1368,6 +1447,16 @@ uint64_t stats_n_data_cells_received = 0;
  * be RELAY_PAYLOAD_SIZE*stats_n_data_cells_packaged if every relay cell we
  * ever received were completely full of data. */
 uint64_t stats_n_data_bytes_received = 0;
+/** How many streams have sent data before their exit reported that they
+ * were connected? */
+uint64_t stats_n_optimistic_streams = 0;
+/** How many bytes have we sent optimistically, not counting retries? */
+uint64_t stats_n_optimistic_bytes = 0;
+/** How many times has a stream with optimistic data outstanding been
+ * refused and retried somewhere else? */
+uint64_t stats_n_optimistic_retries = 0;
+/** How many bytes of optimistic data have we re-sent after a retry? */
+uint64_t stats_n_optimistic_bytes_resent = 0;
 
 /** If <b>conn</b> has an entire relay payload of bytes on its inbuf (or
  * <b>package_partial</b> is true), and the appropriate package windows aren't
@@ -1459,6 +1548,7 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
      * previously-sent optimistic data in the same cell with data
      * from the inbuf. */
     generic_buffer_get(entry_conn->sending_optimistic_data, payload, length);
+    stats_n_optimistic_bytes_resent += length;
     if (!generic_buffer_len(entry_conn->sending_optimistic_data)) {
         generic_buffer_free(entry_conn->sending_optimistic_data);
         entry_conn->sending_optimistic_data = NULL;
@@ -1473,9 +1563,12 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
   if (sending_optimistically && !sending_from_optimistic) {
     /* This is new optimistic data; remember it in case we need to detach and
        retry */
-    if (!entry_conn->pending_optimistic_data)
+    if (!entry_conn->pending_optimistic_data) {
       entry_conn->pending_optimistic_data = generic_buffer_new();
+      ++stats_n_optimistic_streams;
+    }
     generic_buffer_add(entry_conn->pending_optimistic_data, payload, length);
+    stats_n_optimistic_bytes += length;
   }
 
   if (connection_edge_send_command(conn, RELAY_COMMAND_DATA,
@@ -1486,14 +1579,21 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
   if (!cpath_layer) { /* non-rendezvous exit */
     tor_assert(circ->package_window > 0);
     circ->package_window--;
+    flow_control_note_packaged(&circ->flow, CIRCWINDOW_INCREMENT);
   } else { /* we're an AP, or an exit on a rendezvous circ */
     tor_assert(cpath_layer->package_window > 0);
     cpath_layer->package_window--;
+    flow_control_note_packaged(&cpath_layer->flow, CIRCWINDOW_INCREMENT);
   }
+  flow_control_note_packaged(&conn->flow, STREAMWINDOW_INCREMENT);
 
   if (--conn->package_window <= 0) { /* is it 0 after decrement? */
     connection_stop_reading(TO_CONN(conn));
     log_debug(domain,"conn->package_window reached 0.");
+    if (flow_control_should_request(&conn->flow) &&
+        connection_edge_send_command(conn, RELAY_COMMAND_WINDOW_REQUEST,
+                                     NULL, 0) < 0)
+      return 0; /* the circuit's closed */
     circuit_consider_stop_edge_reading(circ, cpath_layer);
     return 0; /* don't process the inbuf any more */
   }
@@ -1520,6 +1620,7 @@ void
 connection_edge_consider_sending_sendme(edge_connection_t *conn)
 {
   circuit_t *circ;
+  int target;
 
   if (connection_outbuf_too_full(TO_CONN(conn)))
     return;
@@ -1532,7 +1633,8 @@ connection_edge_consider_sending_sendme(edge_connection_t *conn)
     return;
   }
 
-  while (conn->deliver_window <= STREAMWINDOW_START - STREAMWINDOW_INCREMENT) {
+  target = flow_control_deliver_target(&conn->flow, STREAMWINDOW_START);
+  while (conn->deliver_window <= target - STREAMWINDOW_INCREMENT) {
     log_debug(conn->_base.type == CONN_TYPE_AP ?LD_APP:LD_EXIT,
               "Outbuf %d, Queuing stream sendme.",
               (int)conn->_base.outbuf_flushlen);
@@ -1705,6 +1807,75 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
   return 0;
 }
 
+/** We just packaged a data cell under the window that <b>fc</b> tracks,
+ * whose SENDMEs each acknowledge <b>increment</b> cells.  If we aren't
+ * timing a SENDME yet, start timing the one for this cell. */
+void
+flow_control_note_packaged(flow_control_t *fc, int increment)
+{
+  ++fc->n_packaged;
+  if (!fc->probe_cell && fc->n_packaged % increment == 0) {
+    fc->probe_cell = fc->n_packaged;
+    fc->probe_sent_at = approx_monotonic_msec();
+  }
+}
+
+/** We just got a SENDME for the window that <b>fc</b> tracks, which
+ * acknowledges <b>increment</b> more cells.  If it's the one we were
+ * timing, update our round-trip time estimate. */
+void
+flow_control_note_sendme(flow_control_t *fc, int increment)
+{
+  ++fc->n_sendmes;
+  if (fc->probe_cell &&
+      (uint64_t)fc->n_sendmes * increment >= fc->probe_cell) {
+    uint64_t now = approx_monotonic_msec();
+    uint32_t sample = now > fc->probe_sent_at ?
+      (uint32_t)MIN(now - fc->probe_sent_at, UINT32_MAX) : 1;
+    fc->rtt_msec = fc->rtt_msec ? (fc->rtt_msec*7 + sample) / 8 : sample;
+    fc->probe_cell = 0;
+  }
+}
+
+/** The window that <b>fc</b> tracks just ran out, so it's what is holding
+ * back our throughput.  Return true iff we should ask the other end for a
+ * bigger window: that is, if AdaptiveFlowControl is on, we know the
+ * round-trip time, and we haven't asked within the last round trip (since
+ * until then we can't see whether asking helped). */
+int
+flow_control_should_request(flow_control_t *fc)
+{
+  uint64_t now;
+  if (PREDICT_LIKELY(!get_options()->AdaptiveFlowControl) || !fc->rtt_msec)
+    return 0;
+  now = approx_monotonic_msec();
+  if (fc->last_request_at && now - fc->last_request_at < fc->rtt_msec)
+    return 0;
+  fc->last_request_at = now;
+  /* Extra SENDMEs for a grant would throw off the SENDME we're timing. */
+  fc->probe_cell = 0;
+  return 1;
+}
+
+/** Return the deliver window that we've agreed to give the other end of
+ * the window that <b>fc</b> tracks, which starts at <b>start</b>. */
+int
+flow_control_deliver_target(const flow_control_t *fc, int start)
+{
+  return fc->deliver_target ? fc->deliver_target : start;
+}
+
+/** The other end of the window that <b>fc</b> tracks, which starts at
+ * <b>start</b>, asked for a bigger window: double it, up to <b>max</b>. */
+void
+flow_control_grow(flow_control_t *fc, int start, int max)
+{
+  int target = flow_control_deliver_target(fc, start);
+  fc->deliver_target = target * 2 < max ? target * 2 : max;
+  log_debug(LD_APP, "Growing deliver window from %d to %d.",
+            target, fc->deliver_target);
+}
+
 /** Check if the package window for <b>circ</b> is empty (at
  * hop <b>layer_hint</b> if it's defined).
  *
@@ -1725,6 +1896,9 @@ circuit_consider_stop_edge_reading(circuit_t *circ, crypt_path_t *layer_hint)
       log_debug(domain,"yes, not-at-origin. stopped.");
       for (conn = or_circ->n_streams; conn; conn=conn->next_stream)
         connection_stop_reading(TO_CONN(conn));
+      if (flow_control_should_request(&circ->flow))
+        relay_send_command_from_edge(0, circ, RELAY_COMMAND_WINDOW_REQUEST,
+                                     NULL, 0, NULL);
       return 1;
     }
     return 0;
@@ -1739,6 +1913,9 @@ circuit_consider_stop_edge_reading(circuit_t *circ, crypt_path_t *layer_hint)
       if (conn->cpath_layer == layer_hint)
         connection_stop_reading(TO_CONN(conn));
     }
+    if (flow_control_should_request(&layer_hint->flow))
+      relay_send_command_from_edge(0, circ, RELAY_COMMAND_WINDOW_REQUEST,
+                                   NULL, 0, layer_hint);
     return 1;
   }
   return 0;
@@ -1755,8 +1932,11 @@ circuit_consider_sending_sendme(circuit_t *circ, crypt_path_t *layer_hint)
 {
 //  log_fn(LOG_INFO,"Considering: layer_hint is %s",
 //         layer_hint ? "defined" : "null");
+  int target = flow_control_deliver_target(
+                   layer_hint ? &layer_hint->flow : &circ->flow,
+                   CIRCWINDOW_START);
   while ((layer_hint ? layer_hint->deliver_window : circ->deliver_window) <=
-          CIRCWINDOW_START - CIRCWINDOW_INCREMENT) {
+          target - CIRCWINDOW_INCREMENT) {
     log_debug(LD_CIRC,"Queuing circuit sendme.");
     if (layer_hint)
       layer_hint->deliver_window += CIRCWINDOW_INCREMENT;
@@ -1855,6 +2035,53 @@ dump_cell_pool_usage(int severity)
   mp_pool_log_status(cell_pool, severity);
 }
 
+/** Return the number of cells on all circuits' cell queues. */
+int
+cell_queues_get_n_cells(void)
+{
+  return total_cells_allocated;
+}
+
+/** Set *<b>stats_out</b> to a summary of the pool that queued cells come
+ * from. */
+void
+cell_pool_get_stats(struct mp_pool_stats_t *stats_out)
+{
+  if (cell_pool)
+    mp_pool_get_stats(cell_pool, stats_out);
+  else
+    memset(stats_out, 0, sizeof(*stats_out));
+}
+
+/** Return the number of bytes of memory that each queued cell costs. */
+size_t
+packed_cell_mem_cost(void)
+{
+  return sizeof(packed_cell_t) + MP_POOL_ITEM_OVERHEAD;
+}
+
+/** Return the total number of bytes used for cells on cell queues and for
+ * data on buffers. */
+size_t
+cell_queues_get_total_allocation(void)
+{
+  return total_cells_allocated * packed_cell_mem_cost() +
+    buf_get_total_allocation();
+}
+
+/** Check whether we've got too much memory allocated for cell queues and
+ * buffers.  If so, call the OOM handler and return 1.  Otherwise return 0. */
+static int
+cell_queues_check_size(void)
+{
+  size_t alloc = cell_queues_get_total_allocation();
+  if (PREDICT_UNLIKELY(alloc >= get_options()->MaxMemInQueues)) {
+    circuits_handle_oom(alloc);
+    return 1;
+  }
+  return 0;
+}
+
 /** Allocate a new copy of packed <b>cell</b>. */
 static INLINE packed_cell_t *
 packed_cell_copy(const cell_t *cell)
@@ -1862,6 +2089,7 @@ packed_cell_copy(const cell_t *cell)
   packed_cell_t *c = packed_cell_alloc();
   cell_pack(c, cell);
   c->next = NULL;
+  c->trace_id = 0;
   return c;
 }
 
@@ -1880,33 +2108,31 @@ cell_queue_append(cell_queue_t *queue, packed_cell_t *cell)
   ++queue->n;
 }
 
-/** Append a newly allocated copy of <b>cell</b> to the end of <b>queue</b> */
-void
-cell_queue_append_packed_copy(cell_queue_t *queue, const cell_t *cell)
+/** Remember that <b>n</b> cells were put in <b>queue</b> at <b>now</b>, if
+ * we're collecting cell statistics. */
+static void
+cell_queue_note_insertion(cell_queue_t *queue, const struct timeval *now,
+                          unsigned n)
 {
-  packed_cell_t *copy = packed_cell_copy(cell);
-  /* Remember the time when this cell was put in the queue. */
   if (get_options()->CellStatistics) {
-    struct timeval now;
     uint32_t added;
     insertion_time_queue_t *it_queue = queue->insertion_times;
     if (!it_pool)
       it_pool = mp_pool_new(sizeof(insertion_time_elem_t), 1024);
-    tor_gettimeofday_cached(&now);
 #define SECONDS_IN_A_DAY 86400L
-    added = (uint32_t)(((now.tv_sec % SECONDS_IN_A_DAY) * 100L)
-            + ((uint32_t)now.tv_usec / (uint32_t)10000L));
+    added = (uint32_t)(((now->tv_sec % SECONDS_IN_A_DAY) * 100L)
+            + ((uint32_t)now->tv_usec / (uint32_t)10000L));
     if (!it_queue) {
       it_queue = tor_malloc_zero(sizeof(insertion_time_queue_t));
       queue->insertion_times = it_queue;
     }
     if (it_queue->last && it_queue->last->insertion_time == added) {
-      it_queue->last->counter++;
+      it_queue->last->counter += n;
     } else {
       insertion_time_elem_t *elem = mp_pool_get(it_pool);
       elem->next = NULL;
       elem->insertion_time = added;
-      elem->counter = 1;
+      elem->counter = n;
       if (it_queue->last) {
         it_queue->last->next = elem;
         it_queue->last = elem;
@@ -1915,9 +2141,67 @@ cell_queue_append_packed_copy(cell_queue_t *queue, const cell_t *cell)
       }
     }
   }
+}
+
+/** Append a newly allocated copy of <b>cell</b> to the end of <b>queue</b> */
+void
+cell_queue_append_packed_copy(cell_queue_t *queue, const cell_t *cell)
+{
+  struct timeval now;
+  packed_cell_t *copy = packed_cell_copy(cell);
+  tor_gettimeofday_cached(&now);
+  copy->inserted_time = (uint32_t)approx_monotonic_msec();
+
+  /* Remember the time when this cell was put in the queue. */
+  cell_queue_note_insertion(queue, &now, 1);
   cell_queue_append(queue, copy);
 }
 
+/** Append newly allocated copies of the <b>n_cells</b> cells in
+ * <b>cells</b> to the end of <b>queue</b>, in order.  This is equivalent to
+ * calling cell_queue_append_packed_copy() on each of them, but it takes
+ * the time and updates the cell statistics only once, and links the copies
+ * to each other before touching the queue. */
+void
+cell_queue_append_packed_copies(cell_queue_t *queue, const cell_t *cells,
+                                int n_cells)
+{
+  struct timeval now;
+  uint32_t inserted_time;
+  packed_cell_t *first = NULL, *last = NULL;
+  int i;
+
+  tor_assert(n_cells >= 0);
+  if (!n_cells)
+    return;
+
+  tor_gettimeofday_cached(&now);
+  inserted_time = (uint32_t)approx_monotonic_msec();
+
+  /* Grab all the cells from the pool back-to-back, so that they're likely
+   * to end up next to each other in the same pool chunk. */
+  for (i = 0; i < n_cells; ++i) {
+    packed_cell_t *copy = packed_cell_copy(&cells[i]);
+    copy->inserted_time = inserted_time;
+    if (last)
+      last->next = copy;
+    else
+      first = copy;
+    last = copy;
+  }
+
+  cell_queue_note_insertion(queue, &now, (unsigned)n_cells);
+
+  if (queue->tail) {
+    tor_assert(!queue->tail->next);
+    queue->tail->next = first;
+  } else {
+    queue->head = first;
+  }
+  queue->tail = last;
+  queue->n += n_cells;
+}
+
 /** Remove and free every cell in <b>queue</b>. */
 void
 cell_queue_clear(cell_queue_t *queue)
@@ -1941,6 +2225,14 @@ cell_queue_clear(cell_queue_t *queue)
   }
 }
 
+/** Return the cell at the head of <b>queue</b> without removing it, or NULL
+ * if <b>queue</b> is empty. */
+const packed_cell_t *
+cell_queue_peek(const cell_queue_t *queue)
+{
+  return queue->head;
+}
+
 /** Extract and return the cell at the head of <b>queue</b>; return NULL if
  * <b>queue</b> is empty. */
 static INLINE packed_cell_t *
@@ -2046,11 +2338,28 @@ cell_ewma_to_circuit(cell_ewma_t *ewma)
    worth F^N, and a cell sent N seconds after the start of the current tick is
    worth F^-N.  This way we don't overflow, and we don't need to constantly
    rescale.
+
+   We go one step further, since rescaling every active circuit on a
+   connection each time the tick advances gets expensive on connections with
+   thousands of circuits.  Each connection keeps its counts relative to an
+   'epoch' tick (active_circuit_pqueue_last_recalibrated), and a cell sent N
+   seconds after the start of the epoch is worth F^-N.  Since every count on
+   the connection shares the same base, the heap order doesn't depend on
+   which base we pick, and the common case needs no rescaling at all.  Only
+   once the weight of a new cell would exceed EWMA_MAX_INCREMENT do we
+   rescale the whole connection to the current tick and start a new epoch.
  */
 
 /** How long does a tick last (seconds)? */
 #define EWMA_TICK_LEN 10
 
+/** Largest weight we're willing to give a single cell, relative to a
+ * connection's epoch, before we rescale all of that connection's circuits
+ * to a new epoch.  This keeps cell counts far from overflowing a double,
+ * while making rescaling rare: with a 30-second halflife, it happens about
+ * once every 80 minutes. */
+#define EWMA_MAX_INCREMENT 1e50
+
 /** The default per-tick scale factor, if it hasn't been overridden by a
  * consensus or a configuration setting.  zero means "disabled". */
 #define EWMA_DEFAULT_HALFLIFE 0.0
@@ -2395,12 +2704,15 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
     tor_gettimeofday_cached(&now_hires);
     tick = cell_ewma_tick_from_timeval(&now_hires, &fractional_tick);
 
-    if (tick != conn->active_circuit_pqueue_last_recalibrated) {
+    /* Weigh this cell relative to the connection's epoch, and only start a
+     * new epoch if that weight is getting too big. */
+    ewma_increment = pow(ewma_scale_factor, -fractional_tick) /
+      get_scale_factor(conn->active_circuit_pqueue_last_recalibrated, tick);
+    if (ewma_increment > EWMA_MAX_INCREMENT) {
       scale_active_circuits(conn, tick);
+      ewma_increment = pow(ewma_scale_factor, -fractional_tick);
     }
 
-    ewma_increment = pow(ewma_scale_factor, -fractional_tick);
-
     cell_ewma = smartlist_get(conn->active_circuit_pqueue, 0);
     circ = cell_ewma_to_circuit(cell_ewma);
   }
@@ -2414,7 +2726,7 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
   }
   tor_assert(*next_circ_on_conn_p(circ,conn));
 
-  for (n_flushed = 0; n_flushed < max && queue->head; ) {
+  for (n_flushed = 0; n_flushed < max && queue->n; ) {
     packed_cell_t *cell = cell_queue_pop(queue);
     tor_assert(*next_circ_on_conn_p(circ,conn));
 
@@ -2459,6 +2771,7 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
                                 DIRREQ_CIRC_QUEUE_FLUSHED);
 
     connection_write_to_buf(cell->body, CELL_NETWORK_SIZE, TO_CONN(conn));
+    cell_trace_note_flushed(cell);
 
     packed_cell_free_unchecked(cell);
     ++n_flushed;
@@ -2502,16 +2815,215 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
   return n_flushed;
 }
 
+/* ==== Global circuit scheduler ====
+
+   Ordinarily, each OR connection picks which of its own circuits to take
+   cells from once its outbuf has room, and circuits on different
+   connections never compete with one another.  When GlobalCircuitScheduler
+   is set, connections with room for more cells instead tell the scheduler
+   that they want cells; shortly afterwards, and whenever the token buckets
+   are refilled, the scheduler hands out cells one at a time to whichever
+   waiting connection has the quietest circuit (by EWMA, when that's
+   enabled), until the global write bucket is used up.
+ */
+
+/** List of or_connection_t that have active circuits and room on their
+ * outbufs, waiting for the global scheduler to give them cells. */
+static smartlist_t *sched_pending_conns = NULL;
+/** Event used to run the global scheduler once we get back to the main
+ * loop. */
+static struct event *sched_run_event = NULL;
+
+/** Helper for the global scheduler: sort or_connection_t by sched_key. */
+static int
+compare_sched_keys(const void *p1, const void *p2)
+{
+  const or_connection_t *c1 = p1, *c2 = p2;
+  if (c1->sched_key < c2->sched_key)
+    return -1;
+  else if (c1->sched_key > c2->sched_key)
+    return 1;
+  else
+    return 0;
+}
+
+/** Return true iff <b>conn</b> can't take any more cells from the global
+ * scheduler until it's told us it wants them again. */
+static int
+circuit_scheduler_conn_is_done(or_connection_t *conn)
+{
+  return conn->_base.marked_for_close ||
+    conn->_base.state != OR_CONN_STATE_OPEN ||
+    !conn->active_circuits ||
+    connection_get_outbuf_len(TO_CONN(conn)) >= OR_CONN_HIGHWATER;
+}
+
+/** Set the scheduling key for <b>conn</b>: the EWMA of its quietest active
+ * circuit, rebased to <b>tick</b>; or, if we aren't using EWMA, the number of
+ * cells it has been given so far on this run, <b>n_given</b>. */
+static void
+circuit_scheduler_set_key(or_connection_t *conn, unsigned tick, int n_given)
+{
+  if (ewma_enabled && smartlist_len(conn->active_circuit_pqueue)) {
+    cell_ewma_t *e = smartlist_get(conn->active_circuit_pqueue, 0);
+    conn->sched_key = e->cell_count *
+      get_scale_factor(conn->active_circuit_pqueue_last_recalibrated, tick);
+  } else {
+    conn->sched_key = n_given;
+  }
+}
+
+/** Run the global circuit scheduler: give cells to all pending connections
+ * in order of priority, until we run out of connections that want cells or
+ * of room in the global write bucket. */
+static void
+circuit_scheduler_run(void)
+{
+  smartlist_t *heap;
+  time_t now = approx_time();
+  ssize_t budget;
+  unsigned tick = 0;
+  int n_given = 0;
+
+  if (!sched_pending_conns || !smartlist_len(sched_pending_conns))
+    return;
+
+  if (ewma_enabled) {
+    struct timeval now_hires;
+    double fractional_tick;
+    tor_gettimeofday_cached(&now_hires);
+    tick = cell_ewma_tick_from_timeval(&now_hires, &fractional_tick);
+  }
+
+  /* Build a heap of the connections that can take cells right now.  The
+   * ones whose own buckets are empty stay pending for the next run. */
+  heap = smartlist_create();
+  SMARTLIST_FOREACH_BEGIN(sched_pending_conns, or_connection_t *, conn) {
+    if (circuit_scheduler_conn_is_done(conn)) {
+      conn->sched_pending = 0;
+      SMARTLIST_DEL_CURRENT(sched_pending_conns, conn);
+      continue;
+    }
+    if (connection_bucket_write_room(TO_CONN(conn), now) < CELL_NETWORK_SIZE)
+      continue;
+    circuit_scheduler_set_key(conn, tick, 0);
+    smartlist_pqueue_add(heap, compare_sched_keys,
+                         STRUCT_OFFSET(or_connection_t, sched_heap_idx),
+                         conn);
+  } SMARTLIST_FOREACH_END(conn);
+
+  budget = connection_bucket_global_write_room(now);
+  while (smartlist_len(heap) && budget >= CELL_NETWORK_SIZE) {
+    or_connection_t *conn = smartlist_pqueue_pop(heap, compare_sched_keys,
+                        STRUCT_OFFSET(or_connection_t, sched_heap_idx));
+    int flushed = connection_or_flush_from_first_active_circuit(conn, 1, now);
+    budget -= flushed * CELL_NETWORK_SIZE;
+    ++n_given;
+
+    if (!flushed || circuit_scheduler_conn_is_done(conn)) {
+      conn->sched_pending = 0;
+      smartlist_remove(sched_pending_conns, conn);
+    } else if (connection_bucket_write_room(TO_CONN(conn), now) >=
+               CELL_NETWORK_SIZE) {
+      circuit_scheduler_set_key(conn, tick, n_given);
+      smartlist_pqueue_add(heap, compare_sched_keys,
+                           STRUCT_OFFSET(or_connection_t, sched_heap_idx),
+                           conn);
+    }
+  }
+  smartlist_free(heap);
+}
+
+/** Libevent callback: run the global circuit scheduler. */
+static void
+circuit_scheduler_run_cb(evutil_socket_t fd, short events, void *arg)
+{
+  (void)fd;
+  (void)events;
+  (void)arg;
+  circuit_scheduler_run();
+}
+
+/** Arrange for the global circuit scheduler to run as soon as we get back
+ * to the main loop, if any connections are waiting for cells. */
+void
+circuit_scheduler_schedule(void)
+{
+  struct timeval timeout = { 0, 0 };
+  if (!sched_pending_conns || !smartlist_len(sched_pending_conns))
+    return;
+  if (!sched_run_event)
+    sched_run_event = tor_evtimer_new(tor_libevent_get_base(),
+                                      circuit_scheduler_run_cb, NULL);
+  if (evtimer_add(sched_run_event, &timeout)<0) {
+    log_warn(LD_BUG, "Couldn't add timer for the circuit scheduler");
+  }
+}
+
+/** Tell the global circuit scheduler that <b>conn</b> has active circuits
+ * and room on its outbuf for more cells. */
+void
+circuit_scheduler_conn_wants_cells(or_connection_t *conn)
+{
+  if (!conn->sched_pending) {
+    if (!sched_pending_conns)
+      sched_pending_conns = smartlist_create();
+    smartlist_add(sched_pending_conns, conn);
+    conn->sched_pending = 1;
+  }
+  circuit_scheduler_schedule();
+}
+
+/** Remove <b>conn</b> from the global circuit scheduler, if it's there; we
+ * call this when <b>conn</b> is about to be freed. */
+void
+circuit_scheduler_forget_conn(or_connection_t *conn)
+{
+  if (conn->sched_pending) {
+    smartlist_remove(sched_pending_conns, conn);
+    conn->sched_pending = 0;
+  }
+}
+
+/** Release all storage held by the global circuit scheduler. */
+void
+circuit_scheduler_free_all(void)
+{
+  if (sched_pending_conns) {
+    SMARTLIST_FOREACH(sched_pending_conns, or_connection_t *, conn,
+                      conn->sched_pending = 0);
+    smartlist_free(sched_pending_conns);
+    sched_pending_conns = NULL;
+  }
+  if (sched_run_event) {
+    tor_event_free(sched_run_event);
+    sched_run_event = NULL;
+  }
+}
+
 /** Add <b>cell</b> to the queue of <b>circ</b> writing to <b>orconn</b>
  * transmitting in <b>direction</b>. */
 void
 append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
                              cell_t *cell, cell_direction_t direction,
                              streamid_t fromstream)
+{
+  append_cells_to_circuit_queue(circ, orconn, cell, 1, direction, fromstream);
+}
+
+/** Add the <b>n_cells</b> cells in <b>cells</b>, in order, to the queue of
+ * <b>circ</b> writing to <b>orconn</b> transmitting in <b>direction</b>.
+ * The queue bookkeeping (blocking streams, activating the circuit, and
+ * priming the outbuf) happens once for the whole batch. */
+void
+append_cells_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
+                              cell_t *cells, int n_cells,
+                              cell_direction_t direction,
+                              streamid_t fromstream)
 {
   cell_queue_t *queue;
-  int streams_blocked;
-  if (circ->marked_for_close)
+  int streams_blocked, i, was_empty;
+  if (circ->marked_for_close || n_cells <= 0)
     return;
 
   if (direction == CELL_DIRECTION_OUT) {
@@ -2522,12 +3034,26 @@ append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
     queue = &orcirc->p_conn_cells;
     streams_blocked = circ->streams_blocked_on_p_conn;
   }
-  if (cell->command == CELL_RELAY_EARLY && orconn->link_proto < 2) {
-    /* V1 connections don't understand RELAY_EARLY. */
-    cell->command = CELL_RELAY;
+  if (orconn->link_proto < 2) {
+    for (i = 0; i < n_cells; ++i) {
+      /* V1 connections don't understand RELAY_EARLY. */
+      if (cells[i].command == CELL_RELAY_EARLY)
+        cells[i].command = CELL_RELAY;
+    }
   }
 
-  cell_queue_append_packed_copy(queue, cell);
+  was_empty = (queue->n == 0);
+  if (n_cells == 1)
+    cell_queue_append_packed_copy(queue, cells);
+  else
+    cell_queue_append_packed_copies(queue, cells, n_cells);
+  cell_trace_note_queued(queue->tail);
+
+  if (PREDICT_UNLIKELY(cell_queues_check_size())) {
+    /* We ran the OOM handler; maybe this circuit was one of its victims. */
+    if (circ->marked_for_close)
+      return;
+  }
 
   /* If we have too many cells on the circuit, we should stop reading from
    * the edge streams for a while. */
@@ -2539,8 +3065,8 @@ append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
     set_streams_blocked_on_circ(circ, orconn, 1, fromstream);
   }
 
-  if (queue->n == 1) {
-    /* This was the first cell added to the queue.  We need to make this
+  if (was_empty) {
+    /* These were the first cells added to the queue.  We need to make this
      * circuit active. */
     log_debug(LD_GENERAL, "Made a circuit active.");
     make_circuit_active_on_conn(circ, orconn);
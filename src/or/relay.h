@@ -35,19 +35,39 @@ extern uint64_t stats_n_data_cells_packaged;
 extern uint64_t stats_n_data_bytes_packaged;
 extern uint64_t stats_n_data_cells_received;
 extern uint64_t stats_n_data_bytes_received;
+extern uint64_t stats_n_optimistic_streams;
+extern uint64_t stats_n_optimistic_bytes;
+extern uint64_t stats_n_optimistic_retries;
+extern uint64_t stats_n_optimistic_bytes_resent;
 
 void init_cell_pool(void);
 void free_cell_pool(void);
 void clean_cell_pool(void);
 void dump_cell_pool_usage(int severity);
+struct mp_pool_stats_t;
+void cell_pool_get_stats(struct mp_pool_stats_t *stats_out);
+size_t packed_cell_mem_cost(void);
+size_t cell_queues_get_total_allocation(void);
+int cell_queues_get_n_cells(void);
 
 void cell_queue_clear(cell_queue_t *queue);
 void cell_queue_append(cell_queue_t *queue, packed_cell_t *cell);
+const packed_cell_t *cell_queue_peek(const cell_queue_t *queue);
 void cell_queue_append_packed_copy(cell_queue_t *queue, const cell_t *cell);
+void cell_queue_append_packed_copies(cell_queue_t *queue, const cell_t *cells,
+                                     int n_cells);
 
 void append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
                                   cell_t *cell, cell_direction_t direction,
                                   streamid_t fromstream);
+void append_cells_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
+                                   cell_t *cells, int n_cells,
+                                   cell_direction_t direction,
+                                   streamid_t fromstream);
+void circuit_scheduler_schedule(void);
+void circuit_scheduler_conn_wants_cells(or_connection_t *conn);
+void circuit_scheduler_forget_conn(or_connection_t *conn);
+void circuit_scheduler_free_all(void);
 void connection_or_unlink_all_active_circs(or_connection_t *conn);
 int connection_or_flush_from_first_active_circuit(or_connection_t *conn,
                                                   int max, time_t now);
@@ -64,11 +84,19 @@ void cell_ewma_set_scale_factor(const or_options_t *options,
                                 const networkstatus_t *consensus);
 void circuit_clear_cell_queue(circuit_t *circ, or_connection_t *orconn);
 
+void tor_gettimeofday_cached(struct timeval *tv);
 void tor_gettimeofday_cache_clear(void);
 
 #ifdef RELAY_PRIVATE
+int relay_crypt_payloads(crypto_cipher_env_t *cipher, cell_t **cells,
+                         int n_cells);
 int relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
                 crypt_path_t **layer_hint, char *recognized);
+void flow_control_note_packaged(flow_control_t *fc, int increment);
+void flow_control_note_sendme(flow_control_t *fc, int increment);
+int flow_control_should_request(flow_control_t *fc);
+int flow_control_deliver_target(const flow_control_t *fc, int start);
+void flow_control_grow(flow_control_t *fc, int start, int max);
 #endif
 
 #endif
@@ -36,6 +36,7 @@ rend_client_purge_state(void)
   rend_cache_purge();
   rend_client_cancel_descriptor_fetches();
   rend_client_purge_last_hid_serv_requests();
+  rend_client_purge_desc_fetches();
 }
 
 /** Called when we've established a circuit to an introduction point:
@@ -47,7 +48,7 @@ rend_client_introcirc_has_opened(origin_circuit_t *circ)
   tor_assert(circ->cpath);
 
   log_info(LD_REND,"introcirc is open");
-  connection_ap_attach_pending();
+  connection_ap_attach_pending_for_circ(circ);
 }
 
 /** Send the establish-rendezvous cell along a rendezvous circuit. if
@@ -197,9 +198,7 @@ rend_client_send_introduction(origin_circuit_t *introcirc,
   /* Initialize the pending_final_cpath and start the DH handshake. */
   cpath = rendcirc->build_state->pending_final_cpath;
   if (!cpath) {
-    cpath = rendcirc->build_state->pending_final_cpath =
-      tor_malloc_zero(sizeof(crypt_path_t));
-    cpath->magic = CRYPT_PATH_MAGIC;
+    cpath = rendcirc->build_state->pending_final_cpath = crypt_path_new();
     if (!(cpath->dh_handshake_state = crypto_dh_new(DH_TYPE_REND))) {
       log_warn(LD_BUG, "Internal error: couldn't allocate DH.");
       goto perm_err;
@@ -521,6 +520,121 @@ rend_client_purge_last_hid_serv_requests(void)
   }
 }
 
+/** How long do we wait for a descriptor fetch in progress before we stop
+ * assuming that it will tell us something, and launch another one? */
+#define REND_DESC_FETCH_MAX_AGE 120
+
+/** What we know about our fetches of one hidden service's descriptor. */
+typedef struct rend_desc_fetch_t {
+  /** When did we start the current lookup, or the last one? */
+  struct timeval lookup_started;
+  /** When did we launch the fetch in progress? */
+  time_t fetch_started;
+  /** True iff we're trying to find a descriptor for this service. */
+  unsigned int in_lookup : 1;
+  /** True iff we're waiting on a directory fetch for this service. */
+  unsigned int in_progress : 1;
+  /** How many directories have we asked during the current lookup? */
+  int n_dirs_tried;
+  /** How many lookups ended with a descriptor, and how many without? */
+  unsigned int n_succeeded, n_failed;
+  /** How many directories have we asked in all? */
+  unsigned int n_fetches;
+  /** Sum and maximum of the successful lookups' durations, in msec. */
+  uint64_t total_msec;
+  long max_msec;
+} rend_desc_fetch_t;
+
+/** Map from onion address to rend_desc_fetch_t, for every service whose
+ * descriptor we've tried to fetch since we last purged our state. */
+static strmap_t *rend_desc_fetches = NULL;
+
+/** Return the rend_desc_fetch_t for <b>onion_address</b>, or NULL if we
+ * have none and <b>create</b> is false. */
+static rend_desc_fetch_t *
+rend_desc_fetch_get(const char *onion_address, int create)
+{
+  rend_desc_fetch_t *fetch;
+  if (!rend_desc_fetches) {
+    if (!create)
+      return NULL;
+    rend_desc_fetches = strmap_new();
+  }
+  fetch = strmap_get_lc(rend_desc_fetches, onion_address);
+  if (!fetch && create) {
+    fetch = tor_malloc_zero(sizeof(rend_desc_fetch_t));
+    strmap_set_lc(rend_desc_fetches, onion_address, fetch);
+  }
+  return fetch;
+}
+
+/** Forget everything we know about our descriptor fetches. */
+void
+rend_client_purge_desc_fetches(void)
+{
+  strmap_free(rend_desc_fetches, _tor_free);
+  rend_desc_fetches = NULL;
+}
+
+/** Note that the lookup of the descriptor for <b>fetch</b> is over, and
+ * whether it <b>succeeded</b>. */
+static void
+rend_desc_fetch_end_lookup(rend_desc_fetch_t *fetch, int succeeded)
+{
+  if (!fetch->in_lookup)
+    return;
+  fetch->in_lookup = 0;
+  if (succeeded) {
+    struct timeval now;
+    long msec;
+    tor_gettimeofday(&now);
+    msec = tv_mdiff(&fetch->lookup_started, &now);
+    ++fetch->n_succeeded;
+    fetch->total_msec += msec;
+    if (msec > fetch->max_msec)
+      fetch->max_msec = msec;
+  } else {
+    ++fetch->n_failed;
+  }
+}
+
+/** Called when a directory connection fetching a v2 descriptor for
+ * <b>rend_query</b> is closing; <b>succeeded</b> is true iff it got us a
+ * descriptor. */
+void
+rend_client_desc_fetch_done(const rend_data_t *rend_query, int succeeded)
+{
+  rend_desc_fetch_t *fetch = rend_desc_fetch_get(rend_query->onion_address,
+                                                 0);
+  if (!fetch)
+    return;
+  fetch->in_progress = 0;
+  if (succeeded) {
+    rend_desc_fetch_end_lookup(fetch, 1);
+    log_info(LD_REND, "Fetched descriptor for %s after asking %d "
+             "directories.", safe_str_client(rend_query->onion_address),
+             fetch->n_dirs_tried);
+  }
+}
+
+/** Log how our descriptor fetches have gone, at log level
+ * <b>severity</b>. */
+void
+rend_client_dump_stats(int severity)
+{
+  if (!rend_desc_fetches)
+    return;
+  STRMAP_FOREACH(rend_desc_fetches, onion_address, rend_desc_fetch_t *,
+                 fetch) {
+    log(severity, LD_REND, "Descriptor lookups for %s: %u succeeded "
+        "(mean %ld msec, max %ld msec), %u failed, %u directories asked.",
+        safe_str_client(onion_address), fetch->n_succeeded,
+        fetch->n_succeeded ?
+          (long)(fetch->total_msec / fetch->n_succeeded) : 0L,
+        fetch->max_msec, fetch->n_failed, fetch->n_fetches);
+  } STRMAP_FOREACH_END;
+}
+
 /** Determine the responsible hidden service directories for <b>desc_id</b>
  * and fetch the descriptor with that ID from one of them. Only
  * send a request to a hidden service directory that we have not yet tried
@@ -619,6 +733,8 @@ rend_client_refetch_v2_renddesc(const rend_data_t *rend_query)
   int replicas_left_to_try[REND_NUMBER_OF_NON_CONSECUTIVE_REPLICAS];
   int i, tries_left;
   rend_cache_entry_t *e = NULL;
+  rend_desc_fetch_t *fetch;
+  time_t now = time(NULL);
   tor_assert(rend_query);
   /* Are we configured to fetch descriptors? */
   if (!get_options()->FetchHidServDescriptors) {
@@ -631,8 +747,28 @@ rend_client_refetch_v2_renddesc(const rend_data_t *rend_query)
       rend_client_any_intro_points_usable(e)) {
     log_info(LD_REND, "We would fetch a v2 rendezvous descriptor, but we "
                       "already have a usable descriptor here. Not fetching.");
+    fetch = rend_desc_fetch_get(rend_query->onion_address, 0);
+    if (fetch && !fetch->in_progress)
+      rend_desc_fetch_end_lookup(fetch, 1);
+    return;
+  }
+  /* If we're already fetching this descriptor, wait for that fetch: every
+   * stream that wants it will hear when it arrives, and if the fetch
+   * fails we'll try another directory then. */
+  fetch = rend_desc_fetch_get(rend_query->onion_address, 1);
+  if (fetch->in_progress &&
+      fetch->fetch_started + REND_DESC_FETCH_MAX_AGE > now) {
+    log_debug(LD_REND, "Already fetching v2 rendezvous descriptor for "
+              "service %s; not launching another fetch.",
+              safe_str_client(rend_query->onion_address));
     return;
   }
+  fetch->in_progress = 0;
+  if (!fetch->in_lookup) {
+    fetch->in_lookup = 1;
+    fetch->n_dirs_tried = 0;
+    tor_gettimeofday(&fetch->lookup_started);
+  }
   log_debug(LD_REND, "Fetching v2 rendezvous descriptor for service %s",
             safe_str_client(rend_query->onion_address));
   /* Randomly iterate over the replicas until a descriptor can be fetched
@@ -648,18 +784,29 @@ rend_client_refetch_v2_renddesc(const rend_data_t *rend_query)
     if (rend_compute_v2_desc_id(descriptor_id, rend_query->onion_address,
                                 rend_query->auth_type == REND_STEALTH_AUTH ?
                                     rend_query->descriptor_cookie : NULL,
-                                time(NULL), chosen_replica) < 0) {
+                                now, chosen_replica) < 0) {
       log_warn(LD_REND, "Internal error: Computing v2 rendezvous "
                         "descriptor ID did not succeed.");
       return;
     }
-    if (directory_get_from_hs_dir(descriptor_id, rend_query) != 0)
-      return; /* either success or failure, but we're done */
+    switch (directory_get_from_hs_dir(descriptor_id, rend_query)) {
+      case 0:
+        continue;
+      case 1:
+        fetch->in_progress = 1;
+        fetch->fetch_started = now;
+        ++fetch->n_dirs_tried;
+        ++fetch->n_fetches;
+        return;
+      default:
+        return; /* failure, but we're done */
+    }
   }
   /* If we come here, there are no hidden service directories left. */
   log_info(LD_REND, "Could not pick one of the responsible hidden "
                     "service directories to fetch descriptors, because "
                     "we already tried them all unsuccessfully.");
+  rend_desc_fetch_end_lookup(fetch, 0);
   /* Close pending connections. */
   rend_client_desc_trynow(rend_query->onion_address);
   return;
@@ -822,12 +969,9 @@ rend_client_rendezvous_acked(origin_circuit_t *circ, const uint8_t *request,
   /* Set timestamp_dirty, because circuit_expire_building expects it
    * to specify when a circuit entered the _C_REND_READY state. */
   circ->_base.timestamp_dirty = time(NULL);
-  /* XXXX023 This is a pretty brute-force approach. It'd be better to
-   * attach only the connections that are waiting on this circuit, rather
-   * than trying to attach them all. See comments bug 743. */
   /* If we already have the introduction circuit built, make sure we send
    * the INTRODUCE cell _now_ */
-  connection_ap_attach_pending();
+  connection_ap_attach_pending_for_circ(circ);
   return 0;
 }
 
@@ -22,6 +22,10 @@ int rend_client_introduction_acked(origin_circuit_t *circ,
 void rend_client_refetch_v2_renddesc(const rend_data_t *rend_query);
 void rend_client_cancel_descriptor_fetches(void);
 void rend_client_purge_last_hid_serv_requests(void);
+void rend_client_purge_desc_fetches(void);
+void rend_client_desc_fetch_done(const rend_data_t *rend_query,
+                                 int succeeded);
+void rend_client_dump_stats(int severity);
 
 #define INTRO_POINT_FAILURE_GENERIC 0
 #define INTRO_POINT_FAILURE_TIMEOUT 1
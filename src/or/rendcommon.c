@@ -11,10 +11,12 @@
 #include "or.h"
 #include "circuitbuild.h"
 #include "config.h"
+#include "networkstatus.h"
 #include "rendclient.h"
 #include "rendcommon.h"
 #include "rendmid.h"
 #include "rendservice.h"
+#include "replaycache.h"
 #include "rephist.h"
 #include "routerlist.h"
 #include "routerparse.h"
@@ -441,9 +443,7 @@ rend_intro_point_free(rend_intro_point_t *intro)
   extend_info_free(intro->extend_info);
   crypto_free_pk_env(intro->intro_key);
 
-  if (intro->accepted_intro_rsa_parts != NULL) {
-    digestmap_free(intro->accepted_intro_rsa_parts, _tor_free);
-  }
+  replaycache_free(intro->accepted_intro_rsa_parts);
 
   tor_free(intro);
 }
@@ -779,6 +779,19 @@ static strmap_t *rend_cache = NULL;
 /** Map from descriptor id to rend_cache_entry_t; only for hidden service
  * directories. */
 static digestmap_t *rend_cache_v2_dir = NULL;
+/** Priority queue of the entries in rend_cache_v2_dir, oldest descriptor
+ * timestamp first, so that we can expire them without walking the map. */
+static smartlist_t *rend_cache_v2_dir_expiry = NULL;
+/** The entries in rend_cache_v2_dir, least recently stored or requested
+ * first. */
+static rend_cache_entry_t *rend_cache_v2_dir_lru_head = NULL;
+/** The most recently stored or requested entry in rend_cache_v2_dir. */
+static rend_cache_entry_t *rend_cache_v2_dir_lru_tail = NULL;
+/** Approximately how many bytes do the entries in rend_cache_v2_dir take? */
+static size_t rend_cache_v2_dir_bytes = 0;
+/** The valid-after time of the consensus with which we last checked which
+ * descriptors in rend_cache_v2_dir we are responsible for. */
+static time_t rend_cache_v2_dir_checked_consensus = 0;
 
 /** Initializes the service descriptor cache.
  */
@@ -787,6 +800,7 @@ rend_cache_init(void)
 {
   rend_cache = strmap_new();
   rend_cache_v2_dir = digestmap_new();
+  rend_cache_v2_dir_expiry = smartlist_create();
 }
 
 /** Helper: free storage held by a single service descriptor cache entry. */
@@ -806,14 +820,112 @@ _rend_cache_entry_free(void *p)
   rend_cache_entry_free(p);
 }
 
+/** Helper for the expiry priority queue: compare two hidden service
+ * directory cache entries by descriptor timestamp. */
+static int
+_compare_rend_cache_entries_by_timestamp(const void *_a, const void *_b)
+{
+  const rend_cache_entry_t *a = _a, *b = _b;
+  if (a->parsed->timestamp < b->parsed->timestamp)
+    return -1;
+  else if (a->parsed->timestamp > b->parsed->timestamp)
+    return 1;
+  else
+    return 0;
+}
+
+/** Return roughly how much memory the hidden service directory cache entry
+ * <b>e</b> uses. */
+static size_t
+rend_cache_v2_dir_entry_size(const rend_cache_entry_t *e)
+{
+  return sizeof(rend_cache_entry_t) + sizeof(rend_service_descriptor_t) +
+    e->len;
+}
+
+/** Remove <b>e</b> from the hidden service directory cache's LRU list. */
+static void
+rend_cache_v2_dir_lru_unlink(rend_cache_entry_t *e)
+{
+  if (e->lru_prev)
+    e->lru_prev->lru_next = e->lru_next;
+  else
+    rend_cache_v2_dir_lru_head = e->lru_next;
+  if (e->lru_next)
+    e->lru_next->lru_prev = e->lru_prev;
+  else
+    rend_cache_v2_dir_lru_tail = e->lru_prev;
+  e->lru_prev = e->lru_next = NULL;
+}
+
+/** Make <b>e</b> the most recently used entry in the hidden service
+ * directory cache. */
+static void
+rend_cache_v2_dir_lru_touch(rend_cache_entry_t *e)
+{
+  if (e == rend_cache_v2_dir_lru_tail)
+    return;
+  if (e->lru_prev || e == rend_cache_v2_dir_lru_head)
+    rend_cache_v2_dir_lru_unlink(e);
+  e->lru_prev = rend_cache_v2_dir_lru_tail;
+  if (rend_cache_v2_dir_lru_tail)
+    rend_cache_v2_dir_lru_tail->lru_next = e;
+  else
+    rend_cache_v2_dir_lru_head = e;
+  rend_cache_v2_dir_lru_tail = e;
+}
+
+/** Remove <b>e</b> from the hidden service directory cache and its indices,
+ * and free it. */
+static void
+rend_cache_v2_dir_remove(rend_cache_entry_t *e)
+{
+  char key_base32[REND_DESC_ID_V2_LEN_BASE32 + 1];
+  base32_encode(key_base32, sizeof(key_base32), e->desc_id, DIGEST_LEN);
+  log_info(LD_REND, "Removing descriptor with ID '%s' from cache",
+           safe_str_client(key_base32));
+  digestmap_remove(rend_cache_v2_dir, e->desc_id);
+  smartlist_pqueue_remove(rend_cache_v2_dir_expiry,
+                          _compare_rend_cache_entries_by_timestamp,
+                          STRUCT_OFFSET(rend_cache_entry_t, expiry_idx), e);
+  rend_cache_v2_dir_lru_unlink(e);
+  rend_cache_v2_dir_bytes -= rend_cache_v2_dir_entry_size(e);
+  rend_cache_entry_free(e);
+}
+
+/** If the hidden service directory cache holds more than
+ * HidServDirectoryCacheSize bytes, drop the least recently used entries
+ * until it doesn't. */
+static void
+rend_cache_v2_dir_enforce_limit(void)
+{
+  uint64_t limit = get_options()->HidServDirectoryCacheSize;
+  int n_removed = 0;
+  if (!limit)
+    return;
+  while (rend_cache_v2_dir_bytes > limit && rend_cache_v2_dir_lru_head) {
+    rend_cache_v2_dir_remove(rend_cache_v2_dir_lru_head);
+    ++n_removed;
+  }
+  if (n_removed)
+    log_info(LD_REND, "Hidden service descriptor cache is full: dropped %d "
+             "least recently used descriptor%s.", n_removed,
+             n_removed == 1 ? "" : "s");
+}
+
 /** Free all storage held by the service descriptor cache. */
 void
 rend_cache_free_all(void)
 {
   strmap_free(rend_cache, _rend_cache_entry_free);
   digestmap_free(rend_cache_v2_dir, _rend_cache_entry_free);
+  smartlist_free(rend_cache_v2_dir_expiry);
   rend_cache = NULL;
   rend_cache_v2_dir = NULL;
+  rend_cache_v2_dir_expiry = NULL;
+  rend_cache_v2_dir_lru_head = rend_cache_v2_dir_lru_tail = NULL;
+  rend_cache_v2_dir_bytes = 0;
+  rend_cache_v2_dir_checked_consensus = 0;
 }
 
 /** Removes all old entries from the service descriptor cache.
@@ -851,30 +963,38 @@ rend_cache_purge(void)
 }
 
 /** Remove all old v2 descriptors and those for which this hidden service
- * directory is not responsible for any more. */
+ * directory is not responsible for any more.
+ *
+ * Old descriptors come off the front of the expiry queue.  Which
+ * descriptors we're responsible for only changes with the consensus, so we
+ * only check all of them when there's a new one. */
 void
 rend_cache_clean_v2_descs_as_dir(time_t now)
 {
-  digestmap_iter_t *iter;
   time_t cutoff = now - REND_CACHE_MAX_AGE - REND_CACHE_MAX_SKEW;
-  for (iter = digestmap_iter_init(rend_cache_v2_dir);
-       !digestmap_iter_done(iter); ) {
-    const char *key;
-    void *val;
-    rend_cache_entry_t *ent;
-    digestmap_iter_get(iter, &key, &val);
-    ent = val;
-    if (ent->parsed->timestamp < cutoff ||
-        !hid_serv_responsible_for_desc_id(key)) {
-      char key_base32[REND_DESC_ID_V2_LEN_BASE32 + 1];
-      base32_encode(key_base32, sizeof(key_base32), key, DIGEST_LEN);
-      log_info(LD_REND, "Removing descriptor with ID '%s' from cache",
-               safe_str_client(key_base32));
-      iter = digestmap_iter_next_rmv(rend_cache_v2_dir, iter);
-      rend_cache_entry_free(ent);
-    } else {
-      iter = digestmap_iter_next(rend_cache_v2_dir, iter);
-    }
+  networkstatus_t *consensus;
+
+  while (smartlist_len(rend_cache_v2_dir_expiry)) {
+    rend_cache_entry_t *ent = smartlist_get(rend_cache_v2_dir_expiry, 0);
+    if (ent->parsed->timestamp >= cutoff)
+      break;
+    rend_cache_v2_dir_remove(ent);
+  }
+
+  consensus = networkstatus_get_latest_consensus();
+  if (consensus &&
+      consensus->valid_after == rend_cache_v2_dir_checked_consensus)
+    return;
+  rend_cache_v2_dir_checked_consensus = consensus ? consensus->valid_after : 0;
+  {
+    smartlist_t *not_ours = smartlist_create();
+    DIGESTMAP_FOREACH(rend_cache_v2_dir, key, rend_cache_entry_t *, ent) {
+      if (!hid_serv_responsible_for_desc_id(key))
+        smartlist_add(not_ours, ent);
+    } DIGESTMAP_FOREACH_END;
+    SMARTLIST_FOREACH(not_ours, rend_cache_entry_t *, ent,
+                      rend_cache_v2_dir_remove(ent));
+    smartlist_free(not_ours);
   }
 }
 
@@ -997,6 +1117,7 @@ rend_cache_lookup_v2_desc_as_dir(const char *desc_id, const char **desc)
   /* Lookup descriptor and return. */
   e = digestmap_get(rend_cache_v2_dir, desc_id_digest);
   if (e) {
+    rend_cache_v2_dir_lru_touch(e);
     *desc = e->desc;
     return 1;
   }
@@ -1181,13 +1302,20 @@ rend_cache_store_v2_desc_as_dir(const char *desc)
       log_info(LD_REND, "We already have this service descriptor with desc "
                         "ID %s.", safe_str(desc_id_base32));
       e->received = time(NULL);
+      rend_cache_v2_dir_lru_touch(e);
       goto skip;
     }
     /* Store received descriptor. */
     if (!e) {
       e = tor_malloc_zero(sizeof(rend_cache_entry_t));
+      memcpy(e->desc_id, desc_id, DIGEST_LEN);
       digestmap_set(rend_cache_v2_dir, desc_id, e);
     } else {
+      smartlist_pqueue_remove(rend_cache_v2_dir_expiry,
+                              _compare_rend_cache_entries_by_timestamp,
+                              STRUCT_OFFSET(rend_cache_entry_t, expiry_idx),
+                              e);
+      rend_cache_v2_dir_bytes -= rend_cache_v2_dir_entry_size(e);
       rend_service_descriptor_free(e->parsed);
       tor_free(e->desc);
     }
@@ -1195,6 +1323,11 @@ rend_cache_store_v2_desc_as_dir(const char *desc)
     e->parsed = parsed;
     e->desc = tor_strndup(current_desc, encoded_size);
     e->len = encoded_size;
+    smartlist_pqueue_add(rend_cache_v2_dir_expiry,
+                         _compare_rend_cache_entries_by_timestamp,
+                         STRUCT_OFFSET(rend_cache_entry_t, expiry_idx), e);
+    rend_cache_v2_dir_bytes += rend_cache_v2_dir_entry_size(e);
+    rend_cache_v2_dir_lru_touch(e);
     log_info(LD_REND, "Successfully stored service descriptor with desc ID "
                       "'%s' and len %d.",
              safe_str(desc_id_base32), (int)encoded_size);
@@ -1216,6 +1349,7 @@ rend_cache_store_v2_desc_as_dir(const char *desc)
   }
   log_info(LD_REND, "Parsed %d and added %d descriptor%s.",
            number_parsed, number_stored, number_stored != 1 ? "s" : "");
+  rend_cache_v2_dir_enforce_limit();
   return number_stored;
 }
 
@@ -1460,6 +1594,26 @@ rend_cache_size(void)
   return strmap_size(rend_cache);
 }
 
+/** Set *<b>n_out</b> to the number of descriptors in our client-side and
+ * hidden service directory caches, and *<b>bytes_out</b> to an estimate of
+ * how much memory they take. */
+void
+rend_cache_get_usage(int *n_out, size_t *bytes_out)
+{
+  *n_out = 0;
+  *bytes_out = 0;
+  if (rend_cache) {
+    STRMAP_FOREACH(rend_cache, key, rend_cache_entry_t *, e) {
+      ++*n_out;
+      *bytes_out += sizeof(rend_cache_entry_t) + e->len;
+    } STRMAP_FOREACH_END;
+  }
+  if (rend_cache_v2_dir) {
+    *n_out += digestmap_size(rend_cache_v2_dir);
+    *bytes_out += rend_cache_v2_dir_bytes;
+  }
+}
+
 /** Allocate and return a new rend_data_t with the same
  * contents as <b>query</b>. */
 rend_data_t *
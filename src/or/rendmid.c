@@ -110,7 +110,7 @@ rend_mid_establish_intro(or_circuit_t *circ, const uint8_t *request,
 
   /* Now, set up this circuit. */
   circ->_base.purpose = CIRCUIT_PURPOSE_INTRO_POINT;
-  memcpy(circ->rend_token, pk_digest, DIGEST_LEN);
+  circuit_set_intro_point_digest(circ, pk_digest);
 
   log_info(LD_REND,
            "Established introduction point on circuit %d for service %s",
@@ -250,7 +250,7 @@ rend_mid_establish_rendezvous(or_circuit_t *circ, const uint8_t *request,
   }
 
   circ->_base.purpose = CIRCUIT_PURPOSE_REND_POINT_WAITING;
-  memcpy(circ->rend_token, request, REND_COOKIE_LEN);
+  circuit_set_rendezvous_cookie(circ, (const char*)request);
 
   base16_encode(hexid,9,(char*)request,4);
 
@@ -326,7 +326,7 @@ rend_mid_rendezvous(or_circuit_t *circ, const uint8_t *request,
 
   circ->_base.purpose = CIRCUIT_PURPOSE_REND_ESTABLISHED;
   rend_circ->_base.purpose = CIRCUIT_PURPOSE_REND_ESTABLISHED;
-  memset(circ->rend_token, 0, REND_COOKIE_LEN);
+  circuit_clear_rend_token(rend_circ);
 
   rend_circ->rend_splice = circ;
   circ->rend_splice = rend_circ;
@@ -12,12 +12,14 @@
 #include "circuitlist.h"
 #include "circuituse.h"
 #include "config.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "networkstatus.h"
 #include "nodelist.h"
 #include "rendclient.h"
 #include "rendcommon.h"
 #include "rendservice.h"
+#include "replaycache.h"
 #include "router.h"
 #include "relay.h"
 #include "rephist.h"
@@ -91,22 +93,56 @@ typedef struct rend_service_t {
                          * up-to-date. */
   time_t next_upload_time; /**< Scheduled next hidden service descriptor
                             * upload time. */
-  /** Map from digests of Diffie-Hellman values INTRODUCE2 to time_t
-   * of when they were received.  Clients may send INTRODUCE1 cells
-   * for the same rendezvous point through two or more different
-   * introduction points; when they do, this digestmap keeps us from
-   * launching multiple simultaneous attempts to connect to the same
-   * rend point. */
-  digestmap_t *accepted_intro_dh_parts;
-  /** Time at which we last removed expired values from
-   * accepted_intro_dh_parts. */
-  time_t last_cleaned_accepted_intro_dh_parts;
+  /** When should rend_services_introduce() next look at this service's
+   * intro points? */
+  time_t next_intro_check;
+  /** This service's position in rend_intro_check_queue, or -1. */
+  int intro_check_idx;
+  /** When should rend_consider_services_upload() next look at this
+   * service? */
+  time_t next_upload_check;
+  /** This service's position in rend_upload_check_queue, or -1. */
+  int upload_check_idx;
+  /** How many jobs to encode this service's descriptors haven't finished
+   * yet?  We don't start a new upload until they have. */
+  int n_pending_desc_encodings;
+  /** Identifies the most recent round of descriptor uploads we started for
+   * this service. */
+  unsigned int upload_serial;
+  /** Replay cache of digests of Diffie-Hellman values in INTRODUCE2
+   * cells.  Clients may send INTRODUCE1 cells for the same rendezvous
+   * point through two or more different introduction points; when they
+   * do, this cache keeps us from launching multiple simultaneous attempts
+   * to connect to the same rend point. */
+  replaycache_t *accepted_intro_dh_parts;
 } rend_service_t;
 
+static void rend_service_schedule_intro_check(rend_service_t *service,
+                                              time_t when);
+static void rend_service_reschedule_upload(rend_service_t *service);
+
 /** A list of rend_service_t's for services run on this OP.
  */
 static smartlist_t *rend_service_list = NULL;
 
+/** Map from the digests of our services' public keys to the services in
+ * rend_service_list that have keys.  Built on demand; NULL if we need to
+ * rebuild it. */
+static digestmap_t *rend_service_map = NULL;
+
+/** Most seconds we'll go without looking at a service's intro points, even
+ * if nothing we hear about suggests that they need attention. */
+#define REND_INTRO_CHECK_MAX_INTERVAL 60
+
+/** Priority queue of rend_service_t, ordered by next_intro_check. */
+static smartlist_t *rend_intro_check_queue = NULL;
+/** Priority queue of rend_service_t, ordered by next_upload_check.  Holds
+ * only services that aren't waiting for descriptor encodings. */
+static smartlist_t *rend_upload_check_queue = NULL;
+/** True if every service's intro points need a look, because our view of
+ * the network has changed. */
+static int rend_intro_check_all = 0;
+
 /** Return the number of rendezvous services we have configured. */
 int
 num_rend_services(void)
@@ -171,7 +207,7 @@ rend_service_free(rend_service_t *service)
       rend_authorized_client_free(c););
     smartlist_free(service->clients);
   }
-  digestmap_free(service->accepted_intro_dh_parts, _tor_free);
+  replaycache_free(service->accepted_intro_dh_parts);
   tor_free(service);
 }
 
@@ -187,6 +223,12 @@ rend_service_free_all(void)
                     rend_service_free(ptr));
   smartlist_free(rend_service_list);
   rend_service_list = NULL;
+  digestmap_free(rend_service_map, NULL);
+  rend_service_map = NULL;
+  smartlist_free(rend_intro_check_queue);
+  rend_intro_check_queue = NULL;
+  smartlist_free(rend_upload_check_queue);
+  rend_upload_check_queue = NULL;
 }
 
 /** Validate <b>service</b> and add it to rend_service_list if possible.
@@ -198,6 +240,7 @@ rend_add_service(rend_service_t *service)
   rend_service_port_config_t *p;
 
   service->intro_nodes = smartlist_create();
+  service->intro_check_idx = service->upload_check_idx = -1;
 
   if (service->auth_type != REND_NO_AUTH &&
       smartlist_len(service->clients) == 0) {
@@ -334,6 +377,15 @@ rend_config_services(const or_options_t *options, int validate_only)
   if (!validate_only) {
     old_service_list = rend_service_list;
     rend_service_list = smartlist_create();
+    digestmap_free(rend_service_map, NULL);
+    rend_service_map = NULL;
+    if (rend_intro_check_queue) {
+      smartlist_clear(rend_intro_check_queue);
+      smartlist_clear(rend_upload_check_queue);
+    } else {
+      rend_intro_check_queue = smartlist_create();
+      rend_upload_check_queue = smartlist_create();
+    }
   }
 
   for (line = options->RendConfigLines; line; line = line->next) {
@@ -494,22 +546,22 @@ rend_config_services(const or_options_t *options, int validate_only)
    * keep the introduction points that are still needed and close the
    * other ones. */
   if (old_service_list && !validate_only) {
-    smartlist_t *surviving_services = smartlist_create();
+    digestmap_t *surviving_services = digestmap_new();
+    strmap_t *old_by_directory = strmap_new();
     circuit_t *circ;
 
     /* Copy introduction points to new services. */
-    /* XXXX This is O(n^2), but it's only called on reconfigure, so it's
-     * probably ok? */
+    SMARTLIST_FOREACH(old_service_list, rend_service_t *, old,
+                      strmap_set(old_by_directory, old->directory, old));
     SMARTLIST_FOREACH(rend_service_list, rend_service_t *, new, {
-      SMARTLIST_FOREACH(old_service_list, rend_service_t *, old, {
-        if (!strcmp(old->directory, new->directory)) {
-          smartlist_add_all(new->intro_nodes, old->intro_nodes);
-          smartlist_clear(old->intro_nodes);
-          smartlist_add(surviving_services, old);
-          break;
-        }
-      });
+      rend_service_t *old = strmap_get(old_by_directory, new->directory);
+      if (old) {
+        smartlist_add_all(new->intro_nodes, old->intro_nodes);
+        smartlist_clear(old->intro_nodes);
+        digestmap_set(surviving_services, old->pk_digest, old);
+      }
     });
+    strmap_free(old_by_directory, NULL);
 
     /* Close introduction circuits of services we don't serve anymore. */
     /* XXXX it would be nicer if we had a nicer abstraction to use here,
@@ -521,16 +573,8 @@ rend_config_services(const or_options_t *options, int validate_only)
           (circ->purpose == CIRCUIT_PURPOSE_S_ESTABLISH_INTRO ||
            circ->purpose == CIRCUIT_PURPOSE_S_INTRO)) {
         origin_circuit_t *oc = TO_ORIGIN_CIRCUIT(circ);
-        int keep_it = 0;
         tor_assert(oc->rend_data);
-        SMARTLIST_FOREACH(surviving_services, rend_service_t *, ptr, {
-          if (tor_memeq(ptr->pk_digest, oc->rend_data->rend_pk_digest,
-                      DIGEST_LEN)) {
-            keep_it = 1;
-            break;
-          }
-        });
-        if (keep_it)
+        if (digestmap_get(surviving_services, oc->rend_data->rend_pk_digest))
           continue;
         log_info(LD_REND, "Closing intro point %s for service %s.",
                  safe_str_client(extend_info_describe(
@@ -540,12 +584,20 @@ rend_config_services(const or_options_t *options, int validate_only)
         /* XXXX Is there another reason we should use here? */
       }
     }
-    smartlist_free(surviving_services);
+    digestmap_free(surviving_services, NULL);
     SMARTLIST_FOREACH(old_service_list, rend_service_t *, ptr,
                       rend_service_free(ptr));
     smartlist_free(old_service_list);
   }
 
+  /* Look at every service as soon as we can. */
+  if (!validate_only) {
+    SMARTLIST_FOREACH(rend_service_list, rend_service_t *, ptr, {
+      rend_service_schedule_intro_check(ptr, 0);
+      rend_service_reschedule_upload(ptr);
+    });
+  }
+
   return 0;
 }
 
@@ -601,8 +653,10 @@ rend_service_update_descriptor(rend_service_t *service)
     if (intro_svc->time_published == -1) {
       /* We are publishing this intro point in a descriptor for the
        * first time -- note the current time in the service's copy of
-       * the intro point. */
+       * the intro point, and have another look at it soon so that we
+       * pick when it will expire. */
       intro_svc->time_published = time(NULL);
+      rend_service_schedule_intro_check(service, 0);
     }
   }
 }
@@ -618,6 +672,10 @@ rend_service_load_keys(void)
   char fname[512];
   char buf[1500];
 
+  /* We're about to learn new services' key digests. */
+  digestmap_free(rend_service_map, NULL);
+  rend_service_map = NULL;
+
   SMARTLIST_FOREACH_BEGIN(rend_service_list, rend_service_t *, s) {
     if (s->private_key)
       continue;
@@ -843,10 +901,105 @@ rend_service_load_keys(void)
 static rend_service_t *
 rend_service_get_by_pk_digest(const char* digest)
 {
-  SMARTLIST_FOREACH(rend_service_list, rend_service_t*, s,
-                    if (tor_memeq(s->pk_digest,digest,DIGEST_LEN))
-                        return s);
-  return NULL;
+  if (!rend_service_list)
+    return NULL;
+  if (!rend_service_map) {
+    rend_service_map = digestmap_new();
+    /* If two services share a key, the first one wins, as it always has. */
+    SMARTLIST_FOREACH(rend_service_list, rend_service_t *, s,
+                      if (s->private_key &&
+                          !digestmap_get(rend_service_map, s->pk_digest))
+                        digestmap_set(rend_service_map, s->pk_digest, s));
+  }
+  return digestmap_get(rend_service_map, digest);
+}
+
+/** Helper for rend_intro_check_queue: compare services by when we next
+ * need to look at their intro points. */
+static int
+_compare_services_by_next_intro_check(const void *_a, const void *_b)
+{
+  const rend_service_t *a = _a, *b = _b;
+  if (a->next_intro_check < b->next_intro_check)
+    return -1;
+  else if (a->next_intro_check > b->next_intro_check)
+    return 1;
+  return 0;
+}
+
+/** Helper for rend_upload_check_queue: compare services by when we next
+ * need to consider uploading their descriptors. */
+static int
+_compare_services_by_next_upload_check(const void *_a, const void *_b)
+{
+  const rend_service_t *a = _a, *b = _b;
+  if (a->next_upload_check < b->next_upload_check)
+    return -1;
+  else if (a->next_upload_check > b->next_upload_check)
+    return 1;
+  return 0;
+}
+
+/** Make sure that rend_services_introduce() looks at <b>service</b>'s intro
+ * points no later than <b>when</b>. */
+static void
+rend_service_schedule_intro_check(rend_service_t *service, time_t when)
+{
+  if (!rend_intro_check_queue)
+    return;
+  if (service->intro_check_idx >= 0) {
+    if (service->next_intro_check <= when)
+      return;
+    smartlist_pqueue_remove(rend_intro_check_queue,
+                            _compare_services_by_next_intro_check,
+                            STRUCT_OFFSET(rend_service_t, intro_check_idx),
+                            service);
+  }
+  service->next_intro_check = when;
+  smartlist_pqueue_add(rend_intro_check_queue,
+                       _compare_services_by_next_intro_check,
+                       STRUCT_OFFSET(rend_service_t, intro_check_idx),
+                       service);
+}
+
+/** Recompute when rend_consider_services_upload() next needs to look at
+ * <b>service</b>: when its next upload is due, or when its descriptor will
+ * have been dirty long enough.  Call this whenever those change. */
+static void
+rend_service_reschedule_upload(rend_service_t *service)
+{
+  if (!rend_upload_check_queue)
+    return;
+  if (service->upload_check_idx >= 0)
+    smartlist_pqueue_remove(rend_upload_check_queue,
+                            _compare_services_by_next_upload_check,
+                            STRUCT_OFFSET(rend_service_t, upload_check_idx),
+                            service);
+  if (service->n_pending_desc_encodings) {
+    /* rend_desc_encode_job_reply() will put it back. */
+    return;
+  }
+  /* These match the tests in rend_consider_services_upload(). */
+  service->next_upload_check = service->next_upload_time + 1;
+  if (service->desc_is_dirty &&
+      service->desc_is_dirty + 31 < service->next_upload_check)
+    service->next_upload_check = service->desc_is_dirty + 31;
+  smartlist_pqueue_add(rend_upload_check_queue,
+                       _compare_services_by_next_upload_check,
+                       STRUCT_OFFSET(rend_service_t, upload_check_idx),
+                       service);
+}
+
+/** Called when the introduction circuit <b>circ</b> is closing, so that
+ * its service notices soon that it needs a new intro point. */
+void
+rend_service_intro_circ_closed(origin_circuit_t *circ)
+{
+  rend_service_t *service;
+  tor_assert(circ->rend_data);
+  service = rend_service_get_by_pk_digest(circ->rend_data->rend_pk_digest);
+  if (service)
+    rend_service_schedule_intro_check(service, 0);
 }
 
 /** Return 1 if any virtual port in <b>service</b> wants a circuit
@@ -906,26 +1059,6 @@ rend_check_authorization(rend_service_t *service,
   return 1;
 }
 
-/** Remove elements from <b>service</b>'s replay cache that are old enough to
- * be noticed by timestamp checking. */
-static void
-clean_accepted_intro_dh_parts(rend_service_t *service, time_t now)
-{
-  const time_t cutoff = now - REND_REPLAY_TIME_INTERVAL;
-
-  service->last_cleaned_accepted_intro_dh_parts = now;
-  if (!service->accepted_intro_dh_parts)
-    return;
-
-  DIGESTMAP_FOREACH_MODIFY(service->accepted_intro_dh_parts, digest,
-                           time_t *, t) {
-    if (*t < cutoff) {
-      tor_free(t);
-      MAP_DEL_CURRENT(digest);
-    }
-  } DIGESTMAP_FOREACH_END;
-}
-
 /** Called when <b>intro</b> will soon be removed from
  * <b>service</b>'s list of intro points. */
 static void
@@ -1028,39 +1161,168 @@ rend_service_note_removing_intro_point(rend_service_t *service,
  * Handle cells
  ******/
 
+/** How many INTRODUCE2 cells may we have handed to the cpuworkers at once?
+ * When a service is this far behind, we drop new introductions rather
+ * than let them queue up without limit. */
+#define MAX_PENDING_INTRODUCTIONS 128
+
+/** An INTRODUCE2 cell that we've handed to the cpuworkers to decrypt and
+ * do the DH handshake for. */
+typedef struct rend_intro_job_t {
+  /** Global identifier of the introduction circuit it arrived on. */
+  uint32_t circ_id;
+  /** Our private key for that introduction point. */
+  crypto_pk_env_t *intro_key;
+  /** The PK-encrypted part of the cell. */
+  char *encrypted;
+  size_t encrypted_len;
+
+  /* Filled in by the cpuworker. */
+  /** Length of the decrypted part in <b>buf</b>, or -1 if decryption
+   * failed. */
+  int len;
+  char buf[RELAY_PAYLOAD_SIZE];
+  /** Our half of the DH handshake, or NULL if we couldn't do it. */
+  crypto_dh_env_t *dh;
+  /** Key material from the DH handshake. */
+  char keys[DIGEST_LEN+CPATH_KEY_MATERIAL_LEN];
+} rend_intro_job_t;
+
+/** How many rend_intro_job_t are the cpuworkers working on? */
+static int n_pending_introductions = 0;
+
+static int rend_service_introduce_finish(origin_circuit_t *circuit,
+                                         rend_service_t *service,
+                                         char *buf, size_t len,
+                                         crypto_dh_env_t *dh,
+                                         const char *precomputed_keys);
+
+/** Free all storage held by <b>job</b>. */
+static void
+rend_intro_job_free(rend_intro_job_t *job)
+{
+  if (!job)
+    return;
+  crypto_free_pk_env(job->intro_key);
+  if (job->dh)
+    crypto_dh_free(job->dh);
+  tor_free(job->encrypted);
+  memset(job, 0, sizeof(rend_intro_job_t));
+  tor_free(job);
+}
+
+/** Cpuworker function: decrypt the INTRODUCE2 cell in <b>arg</b>, and do
+ * our half of the DH handshake with the public value at its end.  If the
+ * cell turns out to be malformed, rend_service_introduce_finish() will
+ * notice and throw this work away. */
+static void
+rend_intro_job_run(void *arg)
+{
+  rend_intro_job_t *job = arg;
+  job->len = crypto_pk_private_hybrid_decrypt(
+       job->intro_key, job->buf, sizeof(job->buf),
+       job->encrypted, job->encrypted_len, PK_PKCS1_OAEP_PADDING, 1);
+  if (job->len < REND_COOKIE_LEN+DH_KEY_LEN)
+    return;
+  job->dh = crypto_dh_new(DH_TYPE_REND);
+  if (!job->dh || crypto_dh_generate_public(job->dh) < 0 ||
+      crypto_dh_compute_secret(LOG_INFO, job->dh,
+                               job->buf+job->len-DH_KEY_LEN, DH_KEY_LEN,
+                               job->keys, sizeof(job->keys)) < 0) {
+    if (job->dh)
+      crypto_dh_free(job->dh);
+    job->dh = NULL;
+  }
+}
+
+/** Main-thread callback: the cpuworkers are done with the INTRODUCE2 cell in
+ * <b>arg</b>.  If its circuit and service are still around, finish
+ * handling it. */
+static void
+rend_intro_job_reply(void *arg)
+{
+  rend_intro_job_t *job = arg;
+  origin_circuit_t *circuit;
+  rend_service_t *service = NULL;
+
+  --n_pending_introductions;
+  circuit = circuit_get_by_global_id(job->circ_id);
+  if (circuit && circuit->_base.purpose == CIRCUIT_PURPOSE_S_INTRO &&
+      circuit->rend_data)
+    service = rend_service_get_by_pk_digest(
+                                   circuit->rend_data->rend_pk_digest);
+  if (!service) {
+    log_info(LD_REND, "Introduction circuit closed while we were handling "
+             "an INTRODUCE2 cell on it. Dropping cell.");
+  } else if (job->len < 0) {
+    log_warn(LD_PROTOCOL, "Couldn't decrypt INTRODUCE2 cell.");
+  } else if (job->len >= REND_COOKIE_LEN+DH_KEY_LEN && !job->dh) {
+    log_warn(LD_BUG, "Internal error: couldn't complete DH handshake");
+  } else {
+    crypto_dh_env_t *dh = job->dh;
+    job->dh = NULL;
+    rend_service_introduce_finish(circuit, service, job->buf, job->len,
+                                  dh, job->keys);
+  }
+  rend_intro_job_free(job);
+}
+
+/** Try to hand the INTRODUCE2 cell <b>request</b>, which arrived on
+ * <b>circuit</b> for the introduction key <b>intro_key</b>, to the
+ * cpuworkers.  Return 0 if they have it, or if we've dropped it because
+ * they're too far behind; return -1 if the caller should handle it right
+ * away. */
+static int
+rend_service_queue_introduction(origin_circuit_t *circuit,
+                                crypto_pk_env_t *intro_key,
+                                const uint8_t *request, size_t request_len)
+{
+  rend_intro_job_t *job;
+  if (!cpuworker_can_queue_work())
+    return -1;
+  if (n_pending_introductions >= MAX_PENDING_INTRODUCTIONS) {
+    log_info(LD_REND, "Already handling %d INTRODUCE2 cells; dropping one "
+             "on circ %d.", n_pending_introductions,
+             circuit->_base.n_circ_id);
+    return 0;
+  }
+
+  job = tor_malloc_zero(sizeof(rend_intro_job_t));
+  job->circ_id = circuit->global_identifier;
+  job->intro_key = crypto_pk_dup_key(intro_key);
+  job->encrypted_len = request_len-DIGEST_LEN;
+  job->encrypted = tor_memdup(request+DIGEST_LEN, job->encrypted_len);
+  if (cpuworker_queue_work(rend_intro_job_run, rend_intro_job_reply,
+                           job) < 0) {
+    rend_intro_job_free(job);
+    return -1;
+  }
+  ++n_pending_introductions;
+  return 0;
+}
+
 /** Respond to an INTRODUCE2 cell by launching a circuit to the chosen
  * rendezvous point.
+ *
+ * We do the cheap checks, including the replay check on the PK-encrypted
+ * part, here.  If we can, we then hand the RSA decryption and the DH
+ * handshake to the cpuworkers, and finish up in
+ * rend_service_introduce_finish() once they're done; otherwise we do it
+ * all now.
  */
- /* XXX022 this function sure could use some organizing. -RD */
 int
 rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
                        size_t request_len)
 {
-  char *ptr, *r_cookie;
-  extend_info_t *extend_info = NULL;
   char buf[RELAY_PAYLOAD_SIZE];
-  char keys[DIGEST_LEN+CPATH_KEY_MATERIAL_LEN]; /* Holds KH, Df, Db, Kf, Kb */
   rend_service_t *service;
   rend_intro_point_t *intro_point;
-  int r, i, v3_shift = 0;
-  size_t len, keylen;
-  crypto_dh_env_t *dh = NULL;
-  origin_circuit_t *launched = NULL;
-  crypt_path_t *cpath = NULL;
+  int r;
+  size_t keylen;
   char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
-  char hexcookie[9];
-  int circ_needs_uptime;
-  int reason = END_CIRC_REASON_TORPROTOCOL;
   crypto_pk_env_t *intro_key;
   char intro_key_digest[DIGEST_LEN];
-  int auth_type;
-  size_t auth_len = 0;
-  char auth_data[REND_DESC_COOKIE_LEN];
-  crypto_digest_env_t *digest = NULL;
   time_t now = time(NULL);
-  char diffie_hellman_hash[DIGEST_LEN];
-  time_t *access_time;
-  const or_options_t *options = get_options();
 
 #ifndef NON_ANONYMOUS_MODE_ENABLED
   tor_assert(!(circuit->build_state->onehop_tunnel));
@@ -1125,32 +1387,41 @@ rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
     return -1;
   }
 
-  if (!service->accepted_intro_dh_parts)
-    service->accepted_intro_dh_parts = digestmap_new();
-
   if (!intro_point->accepted_intro_rsa_parts)
-    intro_point->accepted_intro_rsa_parts = digestmap_new();
+    intro_point->accepted_intro_rsa_parts =
+      replaycache_new(INTRO_POINT_LIFETIME_MAX_SECONDS,
+                      INTRO_POINT_LIFETIME_INTRODUCTIONS);
 
   {
     char pkpart_digest[DIGEST_LEN];
+    time_t elapsed;
     /* Check for replay of PK-encrypted portion. */
     crypto_digest(pkpart_digest, (char*)request+DIGEST_LEN, keylen);
-    access_time = digestmap_get(intro_point->accepted_intro_rsa_parts,
-                                pkpart_digest);
-    if (access_time != NULL) {
+    r = replaycache_add_and_test(intro_point->accepted_intro_rsa_parts,
+                                 pkpart_digest, now, &elapsed);
+    if (r > 0) {
       log_warn(LD_REND, "Possible replay detected! We received an "
                "INTRODUCE2 cell with same PK-encrypted part %d seconds ago. "
-               "Dropping cell.", (int)(now-*access_time));
+               "Dropping cell.", (int)elapsed);
+      return -1;
+    } else if (r < 0) {
+      /* We couldn't remember this one, so we couldn't catch a replay of
+       * it: drop it.  This intro point has long since expired anyway. */
+      log_info(LD_REND, "Intro point for service %s has received too many "
+               "INTRODUCE2 cells recently. Dropping cell.",
+               escaped(serviceid));
       return -1;
     }
-    access_time = tor_malloc(sizeof(time_t));
-    *access_time = now;
-    digestmap_set(intro_point->accepted_intro_rsa_parts,
-                  pkpart_digest, access_time);
+    if (++intro_point->accepted_introduce2_count ==
+        INTRO_POINT_LIFETIME_INTRODUCTIONS)
+      rend_service_schedule_intro_check(service, 0);
   }
 
   /* Next N bytes is encrypted with service key */
   note_crypto_pk_op(REND_SERVER);
+  if (rend_service_queue_introduction(circuit, intro_key,
+                                      request, request_len) == 0)
+    return 0;
   r = crypto_pk_private_hybrid_decrypt(
        intro_key,buf,sizeof(buf),
        (char*)(request+DIGEST_LEN),request_len-DIGEST_LEN,
@@ -1159,7 +1430,50 @@ rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
     log_warn(LD_PROTOCOL, "Couldn't decrypt INTRODUCE2 cell.");
     return -1;
   }
-  len = r;
+  r = rend_service_introduce_finish(circuit, service, buf, r, NULL, NULL);
+  memset(buf, 0, sizeof(buf));
+  return r;
+}
+
+/** Second half of rend_service_introduce(): <b>buf</b> holds the
+ * <b>len</b>-byte decrypted part of an INTRODUCE2 cell that arrived on
+ * <b>circuit</b> for <b>service</b>.  Check it and launch a circuit to the
+ * rendezvous point it names.  If <b>dh</b> is set, we've already done our
+ * half of the DH handshake with it, and <b>precomputed_keys</b> holds the
+ * resulting key material; we take ownership of <b>dh</b>.
+ */
+static int
+rend_service_introduce_finish(origin_circuit_t *circuit,
+                              rend_service_t *service, char *buf, size_t len,
+                              crypto_dh_env_t *dh,
+                              const char *precomputed_keys)
+{
+  char *ptr, *r_cookie;
+  extend_info_t *extend_info = NULL;
+  char keys[DIGEST_LEN+CPATH_KEY_MATERIAL_LEN]; /* Holds KH, Df, Db, Kf, Kb */
+  int i, v3_shift = 0;
+  origin_circuit_t *launched = NULL;
+  crypt_path_t *cpath = NULL;
+  rend_data_t *rend_data;
+  char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
+  char hexcookie[9];
+  int circ_needs_uptime;
+  int reason = END_CIRC_REASON_TORPROTOCOL;
+  int auth_type;
+  size_t auth_len = 0;
+  char auth_data[REND_DESC_COOKIE_LEN];
+  crypto_digest_env_t *digest = NULL;
+  time_t now = time(NULL);
+  char diffie_hellman_hash[DIGEST_LEN];
+  time_t elapsed;
+  const or_options_t *options = get_options();
+
+  base32_encode(serviceid, REND_SERVICE_ID_LEN_BASE32+1,
+                circuit->rend_data->rend_pk_digest, REND_SERVICE_ID_LEN);
+  if (!service->accepted_intro_dh_parts)
+    service->accepted_intro_dh_parts =
+      replaycache_new(REND_REPLAY_TIME_INTERVAL, REND_REPLAY_MAX_DH_PARTS);
+
   if (*buf == 3) {
     /* Version 3 INTRODUCE2 cell. */
     v3_shift = 1;
@@ -1172,7 +1486,7 @@ rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
         if (auth_len != REND_DESC_COOKIE_LEN) {
           log_info(LD_REND, "Wrong auth data size %d, should be %d.",
                    (int)auth_len, REND_DESC_COOKIE_LEN);
-          return -1;
+          goto err;
         }
         memcpy(auth_data, buf+4, sizeof(auth_data));
         v3_shift += 2+REND_DESC_COOKIE_LEN;
@@ -1233,12 +1547,12 @@ rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
     if (!ptr || ptr == rp_nickname) {
       log_warn(LD_PROTOCOL,
                "Couldn't find a nul-padded nickname in INTRODUCE2 cell.");
-      return -1;
+      goto err;
     }
     if ((version == 0 && !is_legal_nickname(rp_nickname)) ||
         (version == 1 && !is_legal_nickname_or_hexdigest(rp_nickname))) {
       log_warn(LD_PROTOCOL, "Bad nickname in INTRODUCE2 cell.");
-      return -1;
+      goto err;
     }
     /* Okay, now we know that a nickname is at the start of the buffer. */
     ptr = rp_nickname+nickname_field_len;
@@ -1282,10 +1596,11 @@ rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
   crypto_free_digest_env(digest);
 
   /* Check whether there is a past request with the same Diffie-Hellman,
-   * part 1. */
-  access_time = digestmap_get(service->accepted_intro_dh_parts,
-                              diffie_hellman_hash);
-  if (access_time != NULL) {
+   * part 1, and remember this one if not.  If the cache is too full to
+   * remember it, go ahead anyway: this check only saves us from duplicate
+   * rendezvous circuits. */
+  if (replaycache_add_and_test(service->accepted_intro_dh_parts,
+                               diffie_hellman_hash, now, &elapsed) > 0) {
     /* A Tor client will send a new INTRODUCE1 cell with the same rend
      * cookie and DH public key as its previous one if its intro circ
      * times out while in state CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT .
@@ -1297,21 +1612,10 @@ rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
              "INTRODUCE2 cell with same first part of "
              "Diffie-Hellman handshake %d seconds ago. Dropping "
              "cell.",
-             (int) (now - *access_time));
+             (int)elapsed);
     goto err;
   }
 
-  /* Add request to access history, including time and hash of Diffie-Hellman,
-   * part 1, and possibly remove requests from the history that are older than
-   * one hour. */
-  access_time = tor_malloc(sizeof(time_t));
-  *access_time = now;
-  digestmap_set(service->accepted_intro_dh_parts,
-                diffie_hellman_hash, access_time);
-  if (service->last_cleaned_accepted_intro_dh_parts + REND_REPLAY_TIME_INTERVAL
-      < now)
-    clean_accepted_intro_dh_parts(service, now);
-
   /* If the service performs client authorization, check included auth data. */
   if (service->clients) {
     if (auth_len > 0) {
@@ -1331,20 +1635,24 @@ rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
     }
   }
 
-  /* Try DH handshake... */
-  dh = crypto_dh_new(DH_TYPE_REND);
-  if (!dh || crypto_dh_generate_public(dh)<0) {
-    log_warn(LD_BUG,"Internal error: couldn't build DH state "
-             "or generate public key.");
-    reason = END_CIRC_REASON_INTERNAL;
-    goto err;
-  }
-  if (crypto_dh_compute_secret(LOG_PROTOCOL_WARN, dh, ptr+REND_COOKIE_LEN,
-                               DH_KEY_LEN, keys,
-                               DIGEST_LEN+CPATH_KEY_MATERIAL_LEN)<0) {
-    log_warn(LD_BUG, "Internal error: couldn't complete DH handshake");
-    reason = END_CIRC_REASON_INTERNAL;
-    goto err;
+  /* Try DH handshake, unless the cpuworkers already have. */
+  if (dh) {
+    memcpy(keys, precomputed_keys, sizeof(keys));
+  } else {
+    dh = crypto_dh_new(DH_TYPE_REND);
+    if (!dh || crypto_dh_generate_public(dh)<0) {
+      log_warn(LD_BUG,"Internal error: couldn't build DH state "
+               "or generate public key.");
+      reason = END_CIRC_REASON_INTERNAL;
+      goto err;
+    }
+    if (crypto_dh_compute_secret(LOG_PROTOCOL_WARN, dh, ptr+REND_COOKIE_LEN,
+                                 DH_KEY_LEN, keys,
+                                 DIGEST_LEN+CPATH_KEY_MATERIAL_LEN)<0) {
+      log_warn(LD_BUG, "Internal error: couldn't complete DH handshake");
+      reason = END_CIRC_REASON_INTERNAL;
+      goto err;
+    }
   }
 
   circ_needs_uptime = rend_service_requires_uptime(service);
@@ -1378,16 +1686,14 @@ rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
            hexcookie, serviceid);
   tor_assert(launched->build_state);
   /* Fill in the circuit's state. */
-  launched->rend_data = tor_malloc_zero(sizeof(rend_data_t));
-  memcpy(launched->rend_data->rend_pk_digest,
-         circuit->rend_data->rend_pk_digest,
+  rend_data = tor_malloc_zero(sizeof(rend_data_t));
+  memcpy(rend_data->rend_pk_digest, circuit->rend_data->rend_pk_digest,
          DIGEST_LEN);
-  memcpy(launched->rend_data->rend_cookie, r_cookie, REND_COOKIE_LEN);
-  strlcpy(launched->rend_data->onion_address, service->service_id,
-          sizeof(launched->rend_data->onion_address));
-  launched->build_state->pending_final_cpath = cpath =
-    tor_malloc_zero(sizeof(crypt_path_t));
-  cpath->magic = CRYPT_PATH_MAGIC;
+  memcpy(rend_data->rend_cookie, r_cookie, REND_COOKIE_LEN);
+  strlcpy(rend_data->onion_address, service->service_id,
+          sizeof(rend_data->onion_address));
+  circuit_set_rend_data(launched, rend_data);
+  launched->build_state->pending_final_cpath = cpath = crypt_path_new();
   launched->build_state->expiry_time = now + MAX_REND_TIMEOUT;
 
   cpath->dh_handshake_state = dh;
@@ -1459,7 +1765,7 @@ rend_service_relaunch_rendezvous(origin_circuit_t *oldcirc)
   newstate->pending_final_cpath = oldstate->pending_final_cpath;
   oldstate->pending_final_cpath = NULL;
 
-  newcirc->rend_data = rend_data_dup(oldcirc->rend_data);
+  circuit_set_rend_data(newcirc, rend_data_dup(oldcirc->rend_data));
 }
 
 /** Launch a circuit to serve as an introduction point for the service
@@ -1470,6 +1776,7 @@ rend_service_launch_establish_intro(rend_service_t *service,
                                     rend_intro_point_t *intro)
 {
   origin_circuit_t *launched;
+  rend_data_t *rend_data;
 
   log_info(LD_REND,
            "Launching circuit to introduction point %s for service %s",
@@ -1505,10 +1812,11 @@ rend_service_launch_establish_intro(rend_service_t *service,
     intro->extend_info = extend_info_dup(launched->build_state->chosen_exit);
   }
 
-  launched->rend_data = tor_malloc_zero(sizeof(rend_data_t));
-  strlcpy(launched->rend_data->onion_address, service->service_id,
-          sizeof(launched->rend_data->onion_address));
-  memcpy(launched->rend_data->rend_pk_digest, service->pk_digest, DIGEST_LEN);
+  rend_data = tor_malloc_zero(sizeof(rend_data_t));
+  strlcpy(rend_data->onion_address, service->service_id,
+          sizeof(rend_data->onion_address));
+  memcpy(rend_data->rend_pk_digest, service->pk_digest, DIGEST_LEN);
+  circuit_set_rend_data(launched, rend_data);
   launched->intro_key = crypto_pk_dup_key(intro->intro_key);
   if (launched->_base.state == CIRCUIT_STATE_OPEN)
     rend_service_intro_has_opened(launched);
@@ -1516,22 +1824,22 @@ rend_service_launch_establish_intro(rend_service_t *service,
 }
 
 /** Return the number of introduction points that are or have been
- * established for the given service address in <b>query</b>. */
+ * established for the service whose public key has the digest
+ * <b>pk_digest</b>. */
 static int
-count_established_intro_points(const char *query)
+count_established_intro_points(const char *pk_digest)
 {
   int num_ipos = 0;
-  circuit_t *circ;
-  for (circ = _circuit_get_global_list(); circ; circ = circ->next) {
-    if (!circ->marked_for_close &&
-        circ->state == CIRCUIT_STATE_OPEN &&
-        (circ->purpose == CIRCUIT_PURPOSE_S_ESTABLISH_INTRO ||
-         circ->purpose == CIRCUIT_PURPOSE_S_INTRO)) {
-      origin_circuit_t *oc = TO_ORIGIN_CIRCUIT(circ);
-      if (oc->rend_data &&
-          !rend_cmp_service_ids(query, oc->rend_data->onion_address))
-        num_ipos++;
-    }
+  origin_circuit_t *circ = NULL;
+  while ((circ = circuit_get_next_by_pk_and_purpose(circ, pk_digest,
+                                 CIRCUIT_PURPOSE_S_ESTABLISH_INTRO))) {
+    if (TO_CIRCUIT(circ)->state == CIRCUIT_STATE_OPEN)
+      num_ipos++;
+  }
+  while ((circ = circuit_get_next_by_pk_and_purpose(circ, pk_digest,
+                                 CIRCUIT_PURPOSE_S_INTRO))) {
+    if (TO_CIRCUIT(circ)->state == CIRCUIT_STATE_OPEN)
+      num_ipos++;
   }
   return num_ipos;
 }
@@ -1572,7 +1880,7 @@ rend_service_intro_has_opened(origin_circuit_t *circuit)
 
   /* If we already have enough introduction circuits for this service,
    * redefine this one as a general circuit or close it, depending. */
-  if (count_established_intro_points(serviceid) >
+  if (count_established_intro_points(circuit->rend_data->rend_pk_digest) >
       (int)service->n_intro_points_wanted) { /* XXX023 remove cast */
     const or_options_t *options = get_options();
     if (options->ExcludeNodes) {
@@ -1590,12 +1898,9 @@ rend_service_intro_has_opened(origin_circuit_t *circuit)
                "general; leaving as internal.");
 
       TO_CIRCUIT(circuit)->purpose = CIRCUIT_PURPOSE_C_GENERAL;
+      circuit_add_to_cannibalize_index(circuit);
 
-      {
-        rend_data_t *rend_data = circuit->rend_data;
-        circuit->rend_data = NULL;
-        rend_data_free(rend_data);
-      }
+      circuit_set_rend_data(circuit, NULL);
       {
         crypto_pk_env_t *intro_key = circuit->intro_key;
         circuit->intro_key = NULL;
@@ -1603,6 +1908,9 @@ rend_service_intro_has_opened(origin_circuit_t *circuit)
       }
 
       circuit_has_opened(circuit);
+      /* The service may be waiting on this circuit before it replaces an
+       * intro point. */
+      rend_service_schedule_intro_check(service, 0);
       return;
     }
   }
@@ -1681,6 +1989,7 @@ rend_service_intro_established(origin_circuit_t *circuit,
     goto err;
   }
   service->desc_is_dirty = time(NULL);
+  rend_service_reschedule_upload(service);
   circuit->_base.purpose = CIRCUIT_PURPOSE_S_INTRO;
 
   base32_encode(serviceid, REND_SERVICE_ID_LEN_BASE32 + 1,
@@ -1820,20 +2129,13 @@ find_intro_circuit(rend_intro_point_t *intro, const char *pk_digest)
 static rend_intro_point_t *
 find_intro_point(origin_circuit_t *circ)
 {
-  const char *serviceid;
-  rend_service_t *service = NULL;
+  rend_service_t *service;
 
   tor_assert(TO_CIRCUIT(circ)->purpose == CIRCUIT_PURPOSE_S_ESTABLISH_INTRO ||
              TO_CIRCUIT(circ)->purpose == CIRCUIT_PURPOSE_S_INTRO);
   tor_assert(circ->rend_data);
-  serviceid = circ->rend_data->onion_address;
-
-  SMARTLIST_FOREACH(rend_service_list, rend_service_t *, s,
-    if (tor_memeq(s->service_id, serviceid, REND_SERVICE_ID_LEN_BASE32)) {
-      service = s;
-      break;
-    });
 
+  service = rend_service_get_by_pk_digest(circ->rend_data->rend_pk_digest);
   if (service == NULL) return NULL;
 
   SMARTLIST_FOREACH(service->intro_nodes, rend_intro_point_t *, intro_point,
@@ -1935,107 +2237,247 @@ directory_post_to_hs_dir(rend_service_descriptor_t *renddesc,
   smartlist_free(successful_uploads);
 }
 
+/** Uploads that are due at the end of a RendPostPeriod happen up to
+ * 1/REND_POST_PERIOD_JITTER_DIVISOR of a period early, chosen at random,
+ * so that services which uploaded together drift apart. */
+#define REND_POST_PERIOD_JITTER_DIVISOR 10
+
+/** Most hidden services whose descriptors we'll start uploading in any one
+ * call to rend_consider_services_upload(); the rest wait for a later
+ * second. */
+#define MAX_REND_UPLOADS_PER_SECOND 8
+
+/** Descriptors for one service (and, with stealth authorization, one of its
+ * clients) that we're encoding and signing, perhaps in a cpuworker. */
+typedef struct rend_desc_encode_job_t {
+  /** Digest of the service's public key. */
+  char pk_digest[DIGEST_LEN];
+  /** Which round of uploads for that service is this part of? */
+  unsigned int upload_serial;
+  /** When did we start encoding? */
+  time_t now;
+  /** A private copy of the service's descriptor, so that the main thread
+   * can go on changing the original. */
+  rend_service_descriptor_t *desc;
+  /** Arguments for rend_encode_v2_descriptors(). */
+  rend_auth_type_t auth_type;
+  crypto_pk_env_t *client_key;
+  smartlist_t *client_cookies;
+
+  /* Filled in by rend_desc_encode_job_run(). */
+  /** Seconds the descriptors for the current period are valid, or -1 if we
+   * couldn't encode them. */
+  int seconds_valid;
+  /** Encoded descriptors for the current period. */
+  smartlist_t *descs;
+  /** As seconds_valid and descs, for the next period.  We only encode
+   * those if the current descriptors are about to expire. */
+  int next_seconds_valid;
+  smartlist_t *next_descs;
+} rend_desc_encode_job_t;
+
+/** Source of rend_service_t.upload_serial values. */
+static unsigned int next_upload_serial = 1;
+
+/** Return a copy of <b>desc</b> that holds everything
+ * rend_encode_v2_descriptors() looks at, and shares nothing but reference
+ * counted keys with it. */
+static rend_service_descriptor_t *
+rend_service_descriptor_copy(const rend_service_descriptor_t *desc)
+{
+  rend_service_descriptor_t *copy =
+    tor_malloc_zero(sizeof(rend_service_descriptor_t));
+  copy->pk = crypto_pk_dup_key(desc->pk);
+  copy->version = desc->version;
+  copy->timestamp = desc->timestamp;
+  copy->protocols = desc->protocols;
+  copy->intro_nodes = smartlist_create();
+  SMARTLIST_FOREACH_BEGIN(desc->intro_nodes, rend_intro_point_t *, intro) {
+    rend_intro_point_t *intro_copy = tor_malloc_zero(
+                                             sizeof(rend_intro_point_t));
+    intro_copy->extend_info = extend_info_dup(intro->extend_info);
+    if (intro->intro_key)
+      intro_copy->intro_key = crypto_pk_dup_key(intro->intro_key);
+    smartlist_add(copy->intro_nodes, intro_copy);
+  } SMARTLIST_FOREACH_END(intro);
+  return copy;
+}
+
+/** Free all storage held by <b>job</b>. */
+static void
+rend_desc_encode_job_free(rend_desc_encode_job_t *job)
+{
+  if (!job)
+    return;
+  rend_service_descriptor_free(job->desc);
+  if (job->client_key)
+    crypto_free_pk_env(job->client_key);
+  SMARTLIST_FOREACH(job->client_cookies, char *, c, tor_free(c));
+  smartlist_free(job->client_cookies);
+  SMARTLIST_FOREACH(job->descs, rend_encoded_v2_service_descriptor_t *, d,
+                    rend_encoded_v2_service_descriptor_free(d));
+  smartlist_free(job->descs);
+  SMARTLIST_FOREACH(job->next_descs, rend_encoded_v2_service_descriptor_t *,
+                    d, rend_encoded_v2_service_descriptor_free(d));
+  smartlist_free(job->next_descs);
+  tor_free(job);
+}
+
+/** Return a new job to encode <b>service</b>'s descriptor as of
+ * <b>now</b>.  With stealth authorization, encode the copy for the
+ * <b>client_idx</b>th client. */
+static rend_desc_encode_job_t *
+rend_desc_encode_job_new(rend_service_t *service, int client_idx,
+                         time_t now)
+{
+  rend_desc_encode_job_t *job = tor_malloc_zero(
+                                         sizeof(rend_desc_encode_job_t));
+  rend_authorized_client_t *client;
+
+  memcpy(job->pk_digest, service->pk_digest, DIGEST_LEN);
+  job->upload_serial = service->upload_serial;
+  job->now = now;
+  job->desc = rend_service_descriptor_copy(service->desc);
+  job->auth_type = service->auth_type;
+  job->client_cookies = smartlist_create();
+  job->descs = smartlist_create();
+  job->next_descs = smartlist_create();
+  switch (service->auth_type) {
+    case REND_NO_AUTH:
+      /* Do nothing here. */
+      break;
+    case REND_BASIC_AUTH:
+      SMARTLIST_FOREACH(service->clients, rend_authorized_client_t *, cl,
+          smartlist_add(job->client_cookies,
+                        tor_memdup(cl->descriptor_cookie,
+                                   REND_DESC_COOKIE_LEN)));
+      break;
+    case REND_STEALTH_AUTH:
+      client = smartlist_get(service->clients, client_idx);
+      job->client_key = crypto_pk_dup_key(client->client_key);
+      smartlist_add(job->client_cookies,
+                    tor_memdup(client->descriptor_cookie,
+                               REND_DESC_COOKIE_LEN));
+      break;
+  }
+  return job;
+}
+
+/** Encode and sign the descriptors for <b>arg</b>, a
+ * rend_desc_encode_job_t.  Safe to call from a cpuworker: it only touches
+ * the job. */
+static void
+rend_desc_encode_job_run(void *arg)
+{
+  rend_desc_encode_job_t *job = arg;
+  job->seconds_valid = rend_encode_v2_descriptors(job->descs, job->desc,
+                                                  job->now, 0,
+                                                  job->auth_type,
+                                                  job->client_key,
+                                                  job->client_cookies);
+  /* Encode the next descriptors too, if necessary. */
+  if (job->seconds_valid >= 0 &&
+      job->seconds_valid < REND_TIME_PERIOD_OVERLAPPING_V2_DESCS)
+    job->next_seconds_valid = rend_encode_v2_descriptors(job->next_descs,
+                                                         job->desc,
+                                                         job->now, 1,
+                                                         job->auth_type,
+                                                         job->client_key,
+                                                         job->client_cookies);
+}
+
+/** We're done encoding the descriptors in <b>arg</b>, a
+ * rend_desc_encode_job_t: if their service is still around, upload them
+ * to the responsible hidden service directories. */
+static void
+rend_desc_encode_job_reply(void *arg)
+{
+  rend_desc_encode_job_t *job = arg;
+  rend_service_t *service = rend_service_get_by_pk_digest(job->pk_digest);
+  char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
+  int rendpostperiod = get_options()->RendPostPeriod;
+  int seconds_valid = job->seconds_valid;
+  time_t now = job->now;
+
+  if (!service || service->upload_serial != job->upload_serial) {
+    /* We've reloaded our configuration since we started; the service's
+     * new incarnation will upload its own descriptors. */
+    goto done;
+  }
+  --service->n_pending_desc_encodings;
+  if (seconds_valid < 0) {
+    log_warn(LD_BUG, "Internal error: couldn't encode service "
+             "descriptor; not uploading.");
+    goto done;
+  }
+
+  /* Post the current descriptors to the hidden service directories. */
+  rend_get_service_id(service->desc->pk, serviceid);
+  log_info(LD_REND, "Sending publish request for hidden service %s",
+               serviceid);
+  directory_post_to_hs_dir(service->desc, job->descs, serviceid,
+                           seconds_valid);
+  /* Update next upload time. */
+  if (seconds_valid - REND_TIME_PERIOD_OVERLAPPING_V2_DESCS
+      > rendpostperiod)
+    service->next_upload_time = now + rendpostperiod -
+      crypto_rand_int(rendpostperiod/REND_POST_PERIOD_JITTER_DIVISOR + 1);
+  else if (seconds_valid < REND_TIME_PERIOD_OVERLAPPING_V2_DESCS)
+    service->next_upload_time = now + seconds_valid + 1;
+  else
+    service->next_upload_time = now + seconds_valid -
+        REND_TIME_PERIOD_OVERLAPPING_V2_DESCS + 1;
+  /* Post also the next descriptors, if necessary. */
+  if (job->next_seconds_valid < 0) {
+    log_warn(LD_BUG, "Internal error: couldn't encode service "
+             "descriptor; not uploading.");
+    goto done;
+  }
+  if (smartlist_len(job->next_descs))
+    directory_post_to_hs_dir(service->desc, job->next_descs, serviceid,
+                             job->next_seconds_valid);
+  log_info(LD_REND, "Successfully uploaded v2 rend descriptors!");
+
+ done:
+  if (service && service->upload_serial == job->upload_serial)
+    rend_service_reschedule_upload(service);
+  rend_desc_encode_job_free(job);
+}
+
 /** Encode and sign an up-to-date service descriptor for <b>service</b>,
- * and upload it/them to the responsible hidden service directories.
+ * and upload it/them to the responsible hidden service directories.  If we
+ * can, do the encoding in the cpuworkers, and upload once they're done.
  */
 static void
 upload_service_descriptor(rend_service_t *service)
 {
   time_t now = time(NULL);
-  int rendpostperiod;
-  char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
   int uploaded = 0;
 
-  rendpostperiod = get_options()->RendPostPeriod;
-
   /* Upload descriptor? */
   if (get_options()->PublishHidServDescriptors) {
     networkstatus_t *c = networkstatus_get_latest_consensus();
     if (c && smartlist_len(c->routerstatus_list) > 0) {
-      int seconds_valid, i, j, num_descs;
-      smartlist_t *descs = smartlist_create();
-      smartlist_t *client_cookies = smartlist_create();
+      int j, num_descs;
       /* Either upload a single descriptor (including replicas) or one
        * descriptor for each authorized client in case of authorization
        * type 'stealth'. */
       num_descs = service->auth_type == REND_STEALTH_AUTH ?
                       smartlist_len(service->clients) : 1;
+      service->upload_serial = next_upload_serial++;
+      /* If the encoding fails, try again in one minute. */
+      service->next_upload_time = now + 60;
       for (j = 0; j < num_descs; j++) {
-        crypto_pk_env_t *client_key = NULL;
-        rend_authorized_client_t *client = NULL;
-        smartlist_clear(client_cookies);
-        switch (service->auth_type) {
-          case REND_NO_AUTH:
-            /* Do nothing here. */
-            break;
-          case REND_BASIC_AUTH:
-            SMARTLIST_FOREACH(service->clients, rend_authorized_client_t *,
-                cl, smartlist_add(client_cookies, cl->descriptor_cookie));
-            break;
-          case REND_STEALTH_AUTH:
-            client = smartlist_get(service->clients, j);
-            client_key = client->client_key;
-            smartlist_add(client_cookies, client->descriptor_cookie);
-            break;
-        }
-        /* Encode the current descriptor. */
-        seconds_valid = rend_encode_v2_descriptors(descs, service->desc,
-                                                   now, 0,
-                                                   service->auth_type,
-                                                   client_key,
-                                                   client_cookies);
-        if (seconds_valid < 0) {
-          log_warn(LD_BUG, "Internal error: couldn't encode service "
-                   "descriptor; not uploading.");
-          smartlist_free(descs);
-          smartlist_free(client_cookies);
-          return;
-        }
-        /* Post the current descriptors to the hidden service directories. */
-        rend_get_service_id(service->desc->pk, serviceid);
-        log_info(LD_REND, "Sending publish request for hidden service %s",
-                     serviceid);
-        directory_post_to_hs_dir(service->desc, descs, serviceid,
-                                 seconds_valid);
-        /* Free memory for descriptors. */
-        for (i = 0; i < smartlist_len(descs); i++)
-          rend_encoded_v2_service_descriptor_free(smartlist_get(descs, i));
-        smartlist_clear(descs);
-        /* Update next upload time. */
-        if (seconds_valid - REND_TIME_PERIOD_OVERLAPPING_V2_DESCS
-            > rendpostperiod)
-          service->next_upload_time = now + rendpostperiod;
-        else if (seconds_valid < REND_TIME_PERIOD_OVERLAPPING_V2_DESCS)
-          service->next_upload_time = now + seconds_valid + 1;
-        else
-          service->next_upload_time = now + seconds_valid -
-              REND_TIME_PERIOD_OVERLAPPING_V2_DESCS + 1;
-        /* Post also the next descriptors, if necessary. */
-        if (seconds_valid < REND_TIME_PERIOD_OVERLAPPING_V2_DESCS) {
-          seconds_valid = rend_encode_v2_descriptors(descs, service->desc,
-                                                     now, 1,
-                                                     service->auth_type,
-                                                     client_key,
-                                                     client_cookies);
-          if (seconds_valid < 0) {
-            log_warn(LD_BUG, "Internal error: couldn't encode service "
-                     "descriptor; not uploading.");
-            smartlist_free(descs);
-            smartlist_free(client_cookies);
-            return;
-          }
-          directory_post_to_hs_dir(service->desc, descs, serviceid,
-                                   seconds_valid);
-          /* Free memory for descriptors. */
-          for (i = 0; i < smartlist_len(descs); i++)
-            rend_encoded_v2_service_descriptor_free(smartlist_get(descs, i));
-          smartlist_clear(descs);
+        rend_desc_encode_job_t *job =
+          rend_desc_encode_job_new(service, j, now);
+        ++service->n_pending_desc_encodings;
+        if (cpuworker_queue_work(rend_desc_encode_job_run,
+                                 rend_desc_encode_job_reply, job) < 0) {
+          rend_desc_encode_job_run(job);
+          rend_desc_encode_job_reply(job);
         }
       }
-      smartlist_free(descs);
-      smartlist_free(client_cookies);
       uploaded = 1;
-      log_info(LD_REND, "Successfully uploaded v2 rend descriptors!");
     }
   }
 
@@ -2045,6 +2487,7 @@ upload_service_descriptor(rend_service_t *service)
 
   /* Unmark dirty flag of this service. */
   service->desc_is_dirty = 0;
+  rend_service_reschedule_upload(service);
 }
 
 /** Return the number of INTRODUCE2 cells an intro point has
@@ -2052,11 +2495,7 @@ upload_service_descriptor(rend_service_t *service)
 static int
 intro_point_accepted_intro_count(rend_intro_point_t *intro)
 {
-  if (intro->accepted_intro_rsa_parts == NULL) {
-    return 0;
-  } else {
-    return digestmap_size(intro->accepted_intro_rsa_parts);
-  }
+  return intro->accepted_introduce2_count;
 }
 
 /** Return non-zero iff <b>intro</b> should 'expire' now (i.e. we
@@ -2105,212 +2544,262 @@ intro_point_should_expire_now(rend_intro_point_t *intro,
   return (now >= intro->time_to_expire);
 }
 
-/** For every service, check how many intro points it currently has, and:
+/** Check how many intro points <b>service</b> currently has, and:
  *  - Pick new intro points as necessary.
  *  - Launch circuits to any new intro points.
+ * <b>intro_nodes</b> is an empty list for scratch space.  Return the time
+ * by which we need to look at <b>service</b> again, unless something we
+ * hear about first makes us look sooner.
  */
-void
-rend_services_introduce(void)
+static time_t
+rend_service_check_intro_points(rend_service_t *service,
+                                smartlist_t *intro_nodes, time_t now)
 {
-  int i,j,r;
+  int j,r;
   const node_t *node;
-  rend_service_t *service;
   rend_intro_point_t *intro;
   int intro_point_set_changed, prev_intro_nodes;
   unsigned int n_intro_points_unexpired;
   unsigned int n_intro_points_to_open;
-  smartlist_t *intro_nodes;
-  time_t now;
+  time_t next_check = now + REND_INTRO_CHECK_MAX_INTERVAL;
   const or_options_t *options = get_options();
 
-  intro_nodes = smartlist_create();
-  now = time(NULL);
-
-  for (i=0; i < smartlist_len(rend_service_list); ++i) {
-    smartlist_clear(intro_nodes);
-    service = smartlist_get(rend_service_list, i);
-
-    tor_assert(service);
-
-    /* intro_point_set_changed becomes non-zero iff the set of intro
-     * points to be published in service's descriptor has changed. */
-    intro_point_set_changed = 0;
-
-    /* n_intro_points_unexpired collects the number of non-expiring
-     * intro points we have, so that we know how many new intro
-     * circuits we need to launch for this service. */
-    n_intro_points_unexpired = 0;
-
-    if (now > service->intro_period_started+INTRO_CIRC_RETRY_PERIOD) {
-      /* One period has elapsed; we can try building circuits again. */
-      service->intro_period_started = now;
-      service->n_intro_circuits_launched = 0;
-    } else if (service->n_intro_circuits_launched >=
-               MAX_INTRO_CIRCS_PER_PERIOD) {
-      /* We have failed too many times in this period; wait for the next
-       * one before we try again. */
+  /* intro_point_set_changed becomes non-zero iff the set of intro
+   * points to be published in service's descriptor has changed. */
+  intro_point_set_changed = 0;
+
+  /* n_intro_points_unexpired collects the number of non-expiring
+   * intro points we have, so that we know how many new intro
+   * circuits we need to launch for this service. */
+  n_intro_points_unexpired = 0;
+
+  if (now > service->intro_period_started+INTRO_CIRC_RETRY_PERIOD) {
+    /* One period has elapsed; we can try building circuits again. */
+    service->intro_period_started = now;
+    service->n_intro_circuits_launched = 0;
+  } else if (service->n_intro_circuits_launched >=
+             MAX_INTRO_CIRCS_PER_PERIOD) {
+    /* We have failed too many times in this period; wait for the next
+     * one before we try again. */
+    return service->intro_period_started + INTRO_CIRC_RETRY_PERIOD + 1;
+  }
+
+  /* Find out which introduction points we have in progress for this
+     service. */
+  SMARTLIST_FOREACH_BEGIN(service->intro_nodes, rend_intro_point_t *,
+                          intro) {
+    origin_circuit_t *intro_circ =
+      find_intro_circuit(intro, service->pk_digest);
+
+    if (intro->time_expiring + INTRO_POINT_EXPIRATION_GRACE_PERIOD > now) {
+      /* This intro point has completely expired.  Remove it, and
+       * mark the circuit for close if it's still alive. */
+      if (intro_circ != NULL) {
+        circuit_mark_for_close(TO_CIRCUIT(intro_circ),
+                               END_CIRC_REASON_FINISHED);
+      }
+      rend_intro_point_free(intro);
+      intro = NULL; /* SMARTLIST_DEL_CURRENT takes a name, not a value. */
+      SMARTLIST_DEL_CURRENT(service->intro_nodes, intro);
+      /* We don't need to set intro_point_set_changed here, because
+       * this intro point wouldn't have been published in a current
+       * descriptor anyway. */
       continue;
     }
 
-    /* Find out which introduction points we have in progress for this
-       service. */
-    SMARTLIST_FOREACH_BEGIN(service->intro_nodes, rend_intro_point_t *,
-                            intro) {
-      origin_circuit_t *intro_circ =
-        find_intro_circuit(intro, service->pk_digest);
-
-      if (intro->time_expiring + INTRO_POINT_EXPIRATION_GRACE_PERIOD > now) {
-        /* This intro point has completely expired.  Remove it, and
-         * mark the circuit for close if it's still alive. */
-        if (intro_circ != NULL) {
-          circuit_mark_for_close(TO_CIRCUIT(intro_circ),
-                                 END_CIRC_REASON_FINISHED);
-        }
-        rend_intro_point_free(intro);
-        intro = NULL; /* SMARTLIST_DEL_CURRENT takes a name, not a value. */
-        SMARTLIST_DEL_CURRENT(service->intro_nodes, intro);
-        /* We don't need to set intro_point_set_changed here, because
-         * this intro point wouldn't have been published in a current
-         * descriptor anyway. */
-        continue;
+    node = node_get_by_id(intro->extend_info->identity_digest);
+    if (!node || !intro_circ) {
+      int removing_this_intro_point_changes_the_intro_point_set = 1;
+      log_info(LD_REND, "Giving up on %s as intro point for %s"
+               " (circuit disappeared).",
+               safe_str_client(extend_info_describe(intro->extend_info)),
+               safe_str_client(service->service_id));
+      rend_service_note_removing_intro_point(service, intro);
+      if (intro->time_expiring != -1) {
+        log_info(LD_REND, "We were already expiring the intro point; "
+                 "no need to mark the HS descriptor as dirty over this.");
+        removing_this_intro_point_changes_the_intro_point_set = 0;
+      } else if (intro->listed_in_last_desc) {
+        log_info(LD_REND, "The intro point we are giving up on was "
+                 "included in the last published descriptor. "
+                 "Marking current descriptor as dirty.");
+        service->desc_is_dirty = now;
+        rend_service_reschedule_upload(service);
       }
+      rend_intro_point_free(intro);
+      intro = NULL; /* SMARTLIST_DEL_CURRENT takes a name, not a value. */
+      SMARTLIST_DEL_CURRENT(service->intro_nodes, intro);
+      if (removing_this_intro_point_changes_the_intro_point_set)
+        intro_point_set_changed = 1;
+    }
 
-      node = node_get_by_id(intro->extend_info->identity_digest);
-      if (!node || !intro_circ) {
-        int removing_this_intro_point_changes_the_intro_point_set = 1;
-        log_info(LD_REND, "Giving up on %s as intro point for %s"
-                 " (circuit disappeared).",
-                 safe_str_client(extend_info_describe(intro->extend_info)),
-                 safe_str_client(service->service_id));
-        rend_service_note_removing_intro_point(service, intro);
-        if (intro->time_expiring != -1) {
-          log_info(LD_REND, "We were already expiring the intro point; "
-                   "no need to mark the HS descriptor as dirty over this.");
-          removing_this_intro_point_changes_the_intro_point_set = 0;
-        } else if (intro->listed_in_last_desc) {
-          log_info(LD_REND, "The intro point we are giving up on was "
-                   "included in the last published descriptor. "
-                   "Marking current descriptor as dirty.");
-          service->desc_is_dirty = now;
-        }
-        rend_intro_point_free(intro);
-        intro = NULL; /* SMARTLIST_DEL_CURRENT takes a name, not a value. */
-        SMARTLIST_DEL_CURRENT(service->intro_nodes, intro);
-        if (removing_this_intro_point_changes_the_intro_point_set)
-          intro_point_set_changed = 1;
-      }
+    if (intro != NULL && intro_point_should_expire_now(intro, now)) {
+      log_info(LD_REND, "Expiring %s as intro point for %s.",
+               safe_str_client(extend_info_describe(intro->extend_info)),
+               safe_str_client(service->service_id));
 
-      if (intro != NULL && intro_point_should_expire_now(intro, now)) {
-        log_info(LD_REND, "Expiring %s as intro point for %s.",
-                 safe_str_client(extend_info_describe(intro->extend_info)),
-                 safe_str_client(service->service_id));
-
-        rend_service_note_removing_intro_point(service, intro);
-
-        /* The polite (and generally Right) way to expire an intro
-         * point is to establish a new one to replace it, publish a
-         * new descriptor that doesn't list any expiring intro points,
-         * and *then*, once our upload attempts for the new descriptor
-         * have ended (whether in success or failure), close the
-         * expiring intro points.
-         *
-         * Unfortunately, we can't find out when the new descriptor
-         * has actually been uploaded, so we'll have to settle for a
-         * five-minute timer.  Start it.  XXX023 This sucks. */
-        intro->time_expiring = now;
+      rend_service_note_removing_intro_point(service, intro);
 
-        intro_point_set_changed = 1;
-      }
+      /* The polite (and generally Right) way to expire an intro
+       * point is to establish a new one to replace it, publish a
+       * new descriptor that doesn't list any expiring intro points,
+       * and *then*, once our upload attempts for the new descriptor
+       * have ended (whether in success or failure), close the
+       * expiring intro points.
+       *
+       * Unfortunately, we can't find out when the new descriptor
+       * has actually been uploaded, so we'll have to settle for a
+       * five-minute timer.  Start it.  XXX023 This sucks. */
+      intro->time_expiring = now;
 
-      if (intro != NULL && intro->time_expiring == -1)
-        ++n_intro_points_unexpired;
+      intro_point_set_changed = 1;
+    }
 
-      if (node)
-        smartlist_add(intro_nodes, (void*)node);
-    } SMARTLIST_FOREACH_END(intro);
+    if (intro != NULL && intro->time_expiring == -1)
+      ++n_intro_points_unexpired;
 
-    if (!intro_point_set_changed &&
-        (n_intro_points_unexpired >= service->n_intro_points_wanted)) {
-      /* We have enough intro circuits in progress, and none of our
-       * intro circuits have died since the last call to
-       * rend_services_introduce!  Start a fresh period and reset the
-       * circuit count.
-       *
-       * XXXX WTF? */
-      service->intro_period_started = now;
-      service->n_intro_circuits_launched = 0;
-      continue;
+    /* When will this intro point need our attention next? */
+    if (intro != NULL) {
+      if (intro->time_expiring != -1)
+        next_check = now + 1;
+      else if (intro->time_to_expire != -1 &&
+               intro->time_to_expire < next_check)
+        next_check = intro->time_to_expire;
     }
 
-    /* Remember how many introduction circuits we started with.
-     *
-     * prev_intro_nodes serves a different purpose than
-     * n_intro_points_unexpired -- this variable tells us where our
-     * previously-created intro points end and our new ones begin in
-     * the intro-point list, so we don't have to launch the circuits
-     * at the same time as we create the intro points they correspond
-     * to.  XXXX This is daft. */
-    prev_intro_nodes = smartlist_len(service->intro_nodes);
-
-    /* We have enough directory information to start establishing our
-     * intro points. We want to end up with n_intro_points_wanted
-     * intro points, but if we're just starting, we launch two extra
-     * circuits and use the first n_intro_points_wanted that complete.
-     *
-     * The ones after the first three will be converted to 'general'
-     * internal circuits in rend_service_intro_has_opened(), and then
-     * we'll drop them from the list of intro points next time we
-     * go through the above "find out which introduction points we have
-     * in progress" loop. */
-    n_intro_points_to_open = (service->n_intro_points_wanted +
-                              (prev_intro_nodes == 0 ? 2 : 0));
-    for (j = (int)n_intro_points_unexpired;
-         j < (int)n_intro_points_to_open;
-         ++j) { /* XXXX remove casts */
-      router_crn_flags_t flags = CRN_NEED_UPTIME|CRN_NEED_DESC;
-      if (get_options()->_AllowInvalid & ALLOW_INVALID_INTRODUCTION)
-        flags |= CRN_ALLOW_INVALID;
-      node = router_choose_random_node(intro_nodes,
-                                       options->ExcludeNodes, flags);
-      if (!node) {
-        log_warn(LD_REND,
-                 "Could only establish %d introduction points for %s; "
-                 "wanted %u.",
-                 smartlist_len(service->intro_nodes), service->service_id,
-                 n_intro_points_to_open);
-        break;
-      }
-      intro_point_set_changed = 1;
+    if (node)
       smartlist_add(intro_nodes, (void*)node);
-      intro = tor_malloc_zero(sizeof(rend_intro_point_t));
-      intro->extend_info = extend_info_from_node(node, 0);
-      intro->intro_key = crypto_new_pk_env();
-      tor_assert(!crypto_pk_generate_key(intro->intro_key));
-      intro->time_published = -1;
-      intro->time_to_expire = -1;
-      intro->time_expiring = -1;
-      smartlist_add(service->intro_nodes, intro);
-      log_info(LD_REND, "Picked router %s as an intro point for %s.",
-               safe_str_client(node_describe(node)),
+  } SMARTLIST_FOREACH_END(intro);
+
+  if (!intro_point_set_changed &&
+      (n_intro_points_unexpired >= service->n_intro_points_wanted)) {
+    /* We have enough intro circuits in progress, and none of our
+     * intro circuits have died since the last call to
+     * rend_services_introduce!  Start a fresh period and reset the
+     * circuit count.
+     *
+     * XXXX WTF? */
+    service->intro_period_started = now;
+    service->n_intro_circuits_launched = 0;
+    return next_check;
+  }
+
+  /* Remember how many introduction circuits we started with.
+   *
+   * prev_intro_nodes serves a different purpose than
+   * n_intro_points_unexpired -- this variable tells us where our
+   * previously-created intro points end and our new ones begin in
+   * the intro-point list, so we don't have to launch the circuits
+   * at the same time as we create the intro points they correspond
+   * to.  XXXX This is daft. */
+  prev_intro_nodes = smartlist_len(service->intro_nodes);
+
+  /* We have enough directory information to start establishing our
+   * intro points. We want to end up with n_intro_points_wanted
+   * intro points, but if we're just starting, we launch two extra
+   * circuits and use the first n_intro_points_wanted that complete.
+   *
+   * The ones after the first three will be converted to 'general'
+   * internal circuits in rend_service_intro_has_opened(), and then
+   * we'll drop them from the list of intro points next time we
+   * go through the above "find out which introduction points we have
+   * in progress" loop. */
+  n_intro_points_to_open = (service->n_intro_points_wanted +
+                            (prev_intro_nodes == 0 ? 2 : 0));
+  for (j = (int)n_intro_points_unexpired;
+       j < (int)n_intro_points_to_open;
+       ++j) { /* XXXX remove casts */
+    router_crn_flags_t flags = CRN_NEED_UPTIME|CRN_NEED_DESC;
+    if (get_options()->_AllowInvalid & ALLOW_INVALID_INTRODUCTION)
+      flags |= CRN_ALLOW_INVALID;
+    node = router_choose_random_node(intro_nodes,
+                                     options->ExcludeNodes, flags);
+    if (!node) {
+      log_warn(LD_REND,
+               "Could only establish %d introduction points for %s; "
+               "wanted %u.",
+               smartlist_len(service->intro_nodes), service->service_id,
+               n_intro_points_to_open);
+      /* Try again in a second. */
+      next_check = now + 1;
+      break;
+    }
+    intro_point_set_changed = 1;
+    smartlist_add(intro_nodes, (void*)node);
+    intro = tor_malloc_zero(sizeof(rend_intro_point_t));
+    intro->extend_info = extend_info_from_node(node, 0);
+    intro->intro_key = crypto_new_pk_env();
+    tor_assert(!crypto_pk_generate_key(intro->intro_key));
+    intro->time_published = -1;
+    intro->time_to_expire = -1;
+    intro->time_expiring = -1;
+    smartlist_add(service->intro_nodes, intro);
+    log_info(LD_REND, "Picked router %s as an intro point for %s.",
+             safe_str_client(node_describe(node)),
+             safe_str_client(service->service_id));
+  }
+
+  /* If there's no need to launch new circuits, stop here. */
+  if (!intro_point_set_changed)
+    return next_check;
+
+  /* Establish new introduction points. */
+  for (j=prev_intro_nodes; j < smartlist_len(service->intro_nodes); ++j) {
+    intro = smartlist_get(service->intro_nodes, j);
+    r = rend_service_launch_establish_intro(service, intro);
+    if (r<0) {
+      log_warn(LD_REND, "Error launching circuit to node %s for service %s.",
+               safe_str_client(extend_info_describe(intro->extend_info)),
                safe_str_client(service->service_id));
     }
+  }
+  return next_check;
+}
 
-    /* If there's no need to launch new circuits, stop here. */
-    if (!intro_point_set_changed)
-      continue;
+/** For every service whose intro points need a look, check how many it
+ * currently has, and pick and launch circuits to new ones as necessary.
+ * We only look at a service when one of its intro circuits has closed,
+ * one of its intro points might be expiring, its descriptor has just been
+ * published, or our view of the network has changed; and at least every
+ * REND_INTRO_CHECK_MAX_INTERVAL seconds.
+ */
+void
+rend_services_introduce(void)
+{
+  smartlist_t *due, *intro_nodes;
+  time_t now = time(NULL);
 
-    /* Establish new introduction points. */
-    for (j=prev_intro_nodes; j < smartlist_len(service->intro_nodes); ++j) {
-      intro = smartlist_get(service->intro_nodes, j);
-      r = rend_service_launch_establish_intro(service, intro);
-      if (r<0) {
-        log_warn(LD_REND, "Error launching circuit to node %s for service %s.",
-                 safe_str_client(extend_info_describe(intro->extend_info)),
-                 safe_str_client(service->service_id));
-      }
+  if (!rend_intro_check_queue || !smartlist_len(rend_intro_check_queue))
+    return;
+
+  due = smartlist_create();
+  if (rend_intro_check_all) {
+    rend_intro_check_all = 0;
+    smartlist_add_all(due, rend_intro_check_queue);
+    SMARTLIST_FOREACH(due, rend_service_t *, service,
+                      service->intro_check_idx = -1);
+    smartlist_clear(rend_intro_check_queue);
+  } else {
+    while (smartlist_len(rend_intro_check_queue)) {
+      rend_service_t *service = smartlist_get(rend_intro_check_queue, 0);
+      if (service->next_intro_check > now)
+        break;
+      smartlist_pqueue_pop(rend_intro_check_queue,
+                           _compare_services_by_next_intro_check,
+                           STRUCT_OFFSET(rend_service_t, intro_check_idx));
+      smartlist_add(due, service);
     }
   }
+
+  intro_nodes = smartlist_create();
+  SMARTLIST_FOREACH_BEGIN(due, rend_service_t *, service) {
+    time_t next_check;
+    smartlist_clear(intro_nodes);
+    next_check = rend_service_check_intro_points(service, intro_nodes, now);
+    rend_service_schedule_intro_check(service, next_check);
+  } SMARTLIST_FOREACH_END(service);
   smartlist_free(intro_nodes);
+  smartlist_free(due);
 }
 
 /** Regenerate and upload rendezvous service descriptors for all
@@ -2319,20 +2808,24 @@ rend_services_introduce(void)
  * periodic timeout has expired.
  *
  * For the first upload, pick a random time between now and two periods
- * from now, and pick it independently for each service.
+ * from now, and pick it independently for each service.  Start at most
+ * MAX_REND_UPLOADS_PER_SECOND uploads per call.
  */
 void
 rend_consider_services_upload(time_t now)
 {
-  int i;
+  int n_uploads = 0;
   rend_service_t *service;
   int rendpostperiod = get_options()->RendPostPeriod;
 
-  if (!get_options()->PublishHidServDescriptors)
+  if (!get_options()->PublishHidServDescriptors || !rend_upload_check_queue)
     return;
 
-  for (i=0; i < smartlist_len(rend_service_list); ++i) {
-    service = smartlist_get(rend_service_list, i);
+  /* Services whose descriptors are being encoded aren't in the queue. */
+  while (smartlist_len(rend_upload_check_queue)) {
+    service = smartlist_get(rend_upload_check_queue, 0);
+    if (service->next_upload_check > now)
+      break;
     if (!service->next_upload_time) { /* never been uploaded yet */
       /* The fixed lower bound of 30 seconds ensures that the descriptor
        * is stable before being published. See comment below. */
@@ -2345,8 +2838,17 @@ rend_consider_services_upload(time_t now)
       /* if it's time, or if the directory servers have a wrong service
        * descriptor and ours has been stable for 30 seconds, upload a
        * new one of each format. */
+      if (n_uploads++ == MAX_REND_UPLOADS_PER_SECOND) {
+        /* Don't stall the main loop encoding lots of descriptors at
+         * once; we'll get to the rest in a second or so. */
+        break;
+      }
       rend_service_update_descriptor(service);
       upload_service_descriptor(service);
+    } else {
+      /* Not due yet after all, probably because we just picked its first
+       * upload time: look again when it is. */
+      rend_service_reschedule_upload(service);
     }
   }
 }
@@ -2363,6 +2865,8 @@ void
 rend_hsdir_routers_changed(void)
 {
   consider_republishing_rend_descriptors = 1;
+  /* We might be able to pick intro points we couldn't before. */
+  rend_intro_check_all = 1;
 }
 
 /** Consider republication of v2 rendezvous service descriptors that failed
@@ -2383,7 +2887,8 @@ rend_consider_descriptor_republication(void)
 
   for (i=0; i < smartlist_len(rend_service_list); ++i) {
     service = smartlist_get(rend_service_list, i);
-    if (service->desc && !service->desc->all_uploads_performed) {
+    if (service->desc && !service->desc->all_uploads_performed &&
+        !service->n_pending_desc_encodings) {
       /* If we failed in uploading a descriptor last time, try again *without*
        * updating the descriptor's contents. */
       upload_service_descriptor(service);
@@ -19,7 +19,6 @@
 #include "rephist.h"
 #include "router.h"
 #include "routerlist.h"
-#include "ht.h"
 
 static void bw_arrays_init(void);
 static void predicted_ports_init(void);
@@ -42,9 +41,16 @@ uint32_t rephist_total_num=0;
  * 20X as much as one that ended a month ago, and routers that have had no
  * uptime data for about half a year will get forgotten.) */
 
-/** History of an OR-\>OR link. */
+/** History of an OR-\>OR link.  These live inline in
+ * <b>link_history_table</b>, not in separately allocated nodes. */
 typedef struct link_history_t {
-  /** When did we start tracking this list? */
+  /** Identity digest of the OR we extended from. */
+  char from_id[DIGEST_LEN];
+  /** Identity digest of the OR we extended to. */
+  char to_id[DIGEST_LEN];
+  /** Combined 32-bit prefixes of from_id and to_id; see link_history_key. */
+  uint64_t key;
+  /** When did we start tracking this list?  Zero if this slot is empty. */
   time_t since;
   /** When did we most recently note a change to this link */
   time_t changed;
@@ -95,10 +101,6 @@ typedef struct or_history_t {
   time_t start_of_downtime;
   unsigned long weighted_uptime;
   unsigned long total_weighted_time;
-
-  /** Map from hex OR2 identity digest to a link_history_t for the link
-   * from this OR to OR2. */
-  digestmap_t *link_history_map;
 } or_history_t;
 
 /** When did we last multiply all routers' weighted_run_length and
@@ -111,6 +113,33 @@ static time_t started_tracking_stability = 0;
 /** Map from hex OR identity digest to or_history_t. */
 static digestmap_t *history_map = NULL;
 
+/** Open-addressing table (linear probing, power-of-two size) holding every
+ * link_history_t we know about. */
+static link_history_t *link_history_table = NULL;
+/** Number of slots in link_history_table. */
+static unsigned link_history_n_slots = 0;
+/** Number of occupied slots in link_history_table. */
+static unsigned link_history_n_used = 0;
+
+/** Smallest table we allocate. */
+#define LINK_HISTORY_MIN_SLOTS 256
+/** Most links we will remember at once.  Extend outcomes for further links
+ * are not recorded until rep_history_clean() has made room.  (Only the
+ * debugging dump reads link history, so there is no point in letting it
+ * grow with the square of the network size.) */
+#define MAX_LINK_HISTORY 32768
+
+/** Digests of the ORs that the current pass of rep_history_clean() has yet
+ * to examine, or NULL if no pass is underway. */
+static smartlist_t *or_history_clean_queue = NULL;
+/** Next slot of link_history_table for rep_history_clean() to examine. */
+static unsigned link_history_clean_pos = 0;
+/** How many ORs does one call to rep_history_clean() examine? */
+#define OR_HISTORY_CLEAN_BATCH 512
+/** How many link_history_table slots does one call to rep_history_clean()
+ * examine? */
+#define LINK_HISTORY_CLEAN_BATCH 4096
+
 /** Return the or_history_t for the OR with identity digest <b>id</b>,
  * creating it if necessary. */
 static or_history_t *
@@ -126,7 +155,6 @@ get_or_history(const char* id)
     hist = tor_malloc_zero(sizeof(or_history_t));
     rephist_total_alloc += sizeof(or_history_t);
     rephist_total_num++;
-    hist->link_history_map = digestmap_new();
     hist->since = hist->changed = time(NULL);
     tor_addr_make_unspec(&hist->last_reached_addr);
     digestmap_set(history_map, id, hist);
@@ -134,36 +162,118 @@ get_or_history(const char* id)
   return hist;
 }
 
+/** Return the 64-bit index key for the link from <b>from_id</b> to
+ * <b>to_id</b>: the first four bytes of each identity digest. */
+static INLINE uint64_t
+link_history_key(const char *from_id, const char *to_id)
+{
+  return (((uint64_t)get_uint32(from_id)) << 32) | get_uint32(to_id);
+}
+
+/** Return the slot at which a link with key <b>key</b> would ideally live
+ * in a link history table of <b>n_slots</b> slots. */
+static INLINE unsigned
+link_history_home(uint64_t key, unsigned n_slots)
+{
+  return (unsigned)((key * U64_LITERAL(0x9e3779b97f4a7c15)) >> 32) &
+    (n_slots - 1);
+}
+
+/** Insert a copy of <b>ent</b> into <b>table</b> of <b>n_slots</b> slots,
+ * which must have room for it, and return the copy. */
+static link_history_t *
+link_history_table_insert(link_history_t *table, unsigned n_slots,
+                          const link_history_t *ent)
+{
+  unsigned i = link_history_home(ent->key, n_slots);
+  while (table[i].since)
+    i = (i + 1) & (n_slots - 1);
+  memcpy(&table[i], ent, sizeof(link_history_t));
+  return &table[i];
+}
+
+/** Rebuild link_history_table with <b>n_slots</b> slots. */
+static void
+link_history_resize(unsigned n_slots)
+{
+  link_history_t *table = tor_malloc_zero(n_slots * sizeof(link_history_t));
+  unsigned i;
+  for (i = 0; i < link_history_n_slots; ++i) {
+    if (link_history_table[i].since)
+      link_history_table_insert(table, n_slots, &link_history_table[i]);
+  }
+  rephist_total_alloc -= link_history_n_slots * sizeof(link_history_t);
+  rephist_total_alloc += n_slots * sizeof(link_history_t);
+  tor_free(link_history_table);
+  link_history_table = table;
+  link_history_n_slots = n_slots;
+  link_history_clean_pos = 0;
+}
+
+/** Empty the slot at <b>idx</b> in link_history_table, moving later
+ * entries of its probe run back so that lookups stay correct. */
+static void
+link_history_remove_at(unsigned idx)
+{
+  const unsigned mask = link_history_n_slots - 1;
+  unsigned j = idx;
+  for (;;) {
+    unsigned home;
+    j = (j + 1) & mask;
+    if (!link_history_table[j].since)
+      break;
+    home = link_history_home(link_history_table[j].key, link_history_n_slots);
+    /* Can the entry at j move to idx without passing its home slot? */
+    if (((j - home) & mask) >= ((j - idx) & mask)) {
+      memcpy(&link_history_table[idx], &link_history_table[j],
+             sizeof(link_history_t));
+      idx = j;
+    }
+  }
+  memset(&link_history_table[idx], 0, sizeof(link_history_t));
+  --link_history_n_used;
+}
+
 /** Return the link_history_t for the link from the first named OR to
- * the second, creating it if necessary. (ORs are identified by
+ * the second, creating it if necessary and if we are not already
+ * remembering MAX_LINK_HISTORY links. (ORs are identified by
  * identity digest.)
  */
 static link_history_t *
 get_link_history(const char *from_id, const char *to_id)
 {
-  or_history_t *orhist;
-  link_history_t *lhist;
-  orhist = get_or_history(from_id);
-  if (!orhist)
+  link_history_t ent;
+  uint64_t key;
+  unsigned i;
+  if (!get_or_history(from_id))
     return NULL;
   if (tor_digest_is_zero(to_id))
     return NULL;
-  lhist = (link_history_t*) digestmap_get(orhist->link_history_map, to_id);
-  if (!lhist) {
-    lhist = tor_malloc_zero(sizeof(link_history_t));
-    rephist_total_alloc += sizeof(link_history_t);
-    lhist->since = lhist->changed = time(NULL);
-    digestmap_set(orhist->link_history_map, to_id, lhist);
+  key = link_history_key(from_id, to_id);
+  if (link_history_n_slots) {
+    i = link_history_home(key, link_history_n_slots);
+    while (link_history_table[i].since) {
+      link_history_t *lhist = &link_history_table[i];
+      if (lhist->key == key && tor_memeq(lhist->from_id, from_id, DIGEST_LEN)
+          && tor_memeq(lhist->to_id, to_id, DIGEST_LEN))
+        return lhist;
+      i = (i + 1) & (link_history_n_slots - 1);
+    }
   }
-  return lhist;
-}
-
-/** Helper: free storage held by a single link history entry. */
-static void
-_free_link_history(void *val)
-{
-  rephist_total_alloc -= sizeof(link_history_t);
-  tor_free(val);
+  if (link_history_n_used >= MAX_LINK_HISTORY)
+    return NULL;
+  /* Keep the load factor at or below one half. */
+  if ((link_history_n_used + 1) * 2 > link_history_n_slots)
+    link_history_resize(link_history_n_slots ?
+                        link_history_n_slots * 2 : LINK_HISTORY_MIN_SLOTS);
+  memset(&ent, 0, sizeof(ent));
+  memcpy(ent.from_id, from_id, DIGEST_LEN);
+  memcpy(ent.to_id, to_id, DIGEST_LEN);
+  ent.key = key;
+  ent.since = ent.changed = time(NULL);
+  ++link_history_n_used;
+  return link_history_table_insert(link_history_table, link_history_n_slots,
+                                   &ent);
 }
 
 /** Helper: free storage held by a single OR history entry. */
@@ -171,7 +281,6 @@ static void
 free_or_history(void *_hist)
 {
   or_history_t *hist = _hist;
-  digestmap_free(hist->link_history_map, _free_link_history);
   rephist_total_alloc -= sizeof(or_history_t);
   rephist_total_num--;
   tor_free(hist);
@@ -631,23 +740,39 @@ rep_hist_note_extend_failed(const char *from_id, const char *to_id)
 void
 rep_hist_dump_stats(time_t now, int severity)
 {
-  digestmap_iter_t *lhist_it;
   digestmap_iter_t *orhist_it;
-  const char *name1, *name2, *digest1, *digest2;
+  const char *name1, *name2, *digest1;
   char hexdigest1[HEX_DIGEST_LEN+1];
   char hexdigest2[HEX_DIGEST_LEN+1];
   or_history_t *or_history;
-  link_history_t *link_history;
-  void *or_history_p, *link_history_p;
+  void *or_history_p;
+  digestmap_t *links_by_from;
   double uptime;
   char buffer[2048];
   size_t len;
   int ret;
   unsigned long upt, downt;
+  unsigned i;
   const node_t *node;
 
   rep_history_clean(now - get_options()->RephistTrackTime);
 
+  /* Group the link table by source OR so we can print each OR's links
+   * without rescanning the table. */
+  links_by_from = digestmap_new();
+  for (i = 0; i < link_history_n_slots; ++i) {
+    link_history_t *lhist = &link_history_table[i];
+    smartlist_t *links;
+    if (!lhist->since)
+      continue;
+    links = digestmap_get(links_by_from, lhist->from_id);
+    if (!links) {
+      links = smartlist_create();
+      digestmap_set(links_by_from, lhist->from_id, links);
+    }
+    smartlist_add(links, lhist);
+  }
+
   log(severity, LD_HIST, "--------------- Dumping history information:");
 
   for (orhist_it = digestmap_iter_init(history_map);
@@ -655,6 +780,7 @@ rep_hist_dump_stats(time_t now, int severity)
        orhist_it = digestmap_iter_next(history_map,orhist_it)) {
     double s;
     long stability;
+    smartlist_t *links;
     digestmap_iter_get(orhist_it, &digest1, &or_history_p);
     or_history = (or_history_t*) or_history_p;
 
@@ -681,22 +807,19 @@ rep_hist_dump_stats(time_t now, int severity)
         upt, upt+downt, uptime*100.0,
         stability/3600, (stability/60)%60, stability%60);
 
-    if (!digestmap_isempty(or_history->link_history_map)) {
+    links = digestmap_get(links_by_from, digest1);
+    if (links) {
       strlcpy(buffer, "    Extend attempts: ", sizeof(buffer));
       len = strlen(buffer);
-      for (lhist_it = digestmap_iter_init(or_history->link_history_map);
-           !digestmap_iter_done(lhist_it);
-           lhist_it = digestmap_iter_next(or_history->link_history_map,
-                                          lhist_it)) {
-        digestmap_iter_get(lhist_it, &digest2, &link_history_p);
-        if ((node = node_get_by_id(digest2)) && node_get_nickname(node))
+      SMARTLIST_FOREACH_BEGIN(links, link_history_t *, link_history) {
+        if ((node = node_get_by_id(link_history->to_id)) &&
+            node_get_nickname(node))
           name2 = node_get_nickname(node);
         else
           name2 = "(unknown)";
 
-        link_history = (link_history_t*) link_history_p;
-
-        base16_encode(hexdigest2, sizeof(hexdigest2), digest2, DIGEST_LEN);
+        base16_encode(hexdigest2, sizeof(hexdigest2), link_history->to_id,
+                      DIGEST_LEN);
         ret = tor_snprintf(buffer+len, 2048-len, "%s [%s](%ld/%ld); ",
                         name2,
                         hexdigest2,
@@ -706,53 +829,73 @@ rep_hist_dump_stats(time_t now, int severity)
           break;
         else
           len += ret;
-      }
+      } SMARTLIST_FOREACH_END(link_history);
       log(severity, LD_HIST, "%s", buffer);
     }
   }
+
+  digestmap_free(links_by_from, (void(*)(void*))smartlist_free);
 }
 
 /** Remove history info for routers/links that haven't changed since
- * <b>before</b>.
+ * <b>before</b>.  To keep the main loop responsive on authorities, each
+ * call examines at most OR_HISTORY_CLEAN_BATCH ORs and
+ * LINK_HISTORY_CLEAN_BATCH link slots, resuming where the previous call
+ * left off.
  */
 void
 rep_history_clean(time_t before)
 {
   int authority = authdir_mode(get_options());
-  or_history_t *or_history;
-  link_history_t *link_history;
-  void *or_history_p, *link_history_p;
-  digestmap_iter_t *orhist_it, *lhist_it;
-  const char *d1, *d2;
-
-  orhist_it = digestmap_iter_init(history_map);
-  while (!digestmap_iter_done(orhist_it)) {
+  int n;
+
+  /* ORs: work through a snapshot of the digests in history_map, so that
+   * entries added or removed between calls can't confuse us. */
+  if (!or_history_clean_queue) {
+    or_history_clean_queue = smartlist_create();
+    DIGESTMAP_FOREACH(history_map, d, or_history_t *, or_history) {
+      (void)or_history;
+      smartlist_add(or_history_clean_queue, tor_memdup(d, DIGEST_LEN));
+    } DIGESTMAP_FOREACH_END;
+  }
+  for (n = 0; n < OR_HISTORY_CLEAN_BATCH &&
+         smartlist_len(or_history_clean_queue); ++n) {
+    char *d = smartlist_pop_last(or_history_clean_queue);
+    or_history_t *or_history = digestmap_get(history_map, d);
     int remove;
-    digestmap_iter_get(orhist_it, &d1, &or_history_p);
-    or_history = or_history_p;
-
-    remove = authority ? (or_history->total_run_weights < STABILITY_EPSILON &&
-                          !or_history->start_of_run)
-                       : (or_history->changed < before);
-    if (remove) {
-      orhist_it = digestmap_iter_next_rmv(history_map, orhist_it);
-      free_or_history(or_history);
-      continue;
-    }
-    for (lhist_it = digestmap_iter_init(or_history->link_history_map);
-         !digestmap_iter_done(lhist_it); ) {
-      digestmap_iter_get(lhist_it, &d2, &link_history_p);
-      link_history = link_history_p;
-      if (link_history->changed < before) {
-        lhist_it = digestmap_iter_next_rmv(or_history->link_history_map,
-                                           lhist_it);
-        rephist_total_alloc -= sizeof(link_history_t);
-        tor_free(link_history);
-        continue;
+    if (or_history) {
+      remove = authority ?
+        (or_history->total_run_weights < STABILITY_EPSILON &&
+         !or_history->start_of_run)
+        : (or_history->changed < before);
+      if (remove) {
+        digestmap_remove(history_map, d);
+        free_or_history(or_history);
       }
-      lhist_it = digestmap_iter_next(or_history->link_history_map,lhist_it);
     }
-    orhist_it = digestmap_iter_next(history_map, orhist_it);
+    tor_free(d);
+  }
+  if (!smartlist_len(or_history_clean_queue)) {
+    smartlist_free(or_history_clean_queue);
+    or_history_clean_queue = NULL;
+  }
+
+  /* Links: sweep a window of the table.  Removing an entry may pull a later
+   * one back into the current slot, so only advance past slots we keep. */
+  for (n = 0; n < LINK_HISTORY_CLEAN_BATCH &&
+         link_history_clean_pos < link_history_n_slots; ++n) {
+    link_history_t *lhist = &link_history_table[link_history_clean_pos];
+    if (lhist->since && lhist->changed < before)
+      link_history_remove_at(link_history_clean_pos);
+    else
+      ++link_history_clean_pos;
+  }
+  if (link_history_clean_pos >= link_history_n_slots) {
+    link_history_clean_pos = 0;
+    /* End of a pass: give back memory if the table is mostly empty. */
+    if (link_history_n_slots > LINK_HISTORY_MIN_SLOTS &&
+        link_history_n_used * 8 < link_history_n_slots)
+      link_history_resize(link_history_n_slots / 2);
   }
 }
 
@@ -1275,6 +1418,13 @@ typedef struct bw_array_t {
   /** Circular array of the total bandwidth usage for the last NUM_TOTALS
    * periods */
   uint64_t totals[NUM_TOTALS];
+
+  /** Bytes noted for second <b>pending_time</b> that we haven't yet added
+   * to obs.  We note bytes on every read and write, so we add them up here
+   * and only do the bookkeeping in add_obs() once per second. */
+  uint64_t pending_bytes;
+  /** The second that pending_bytes belongs to. */
+  time_t pending_time;
 } bw_array_t;
 
 /** Shift the current period of b forward by one. */
@@ -1344,6 +1494,31 @@ add_obs(bw_array_t *b, time_t when, uint64_t n)
   b->total_in_period += n;
 }
 
+/** Add any bytes we've accumulated for <b>b</b> to its observations. */
+static void
+flush_obs(bw_array_t *b)
+{
+  if (b->pending_bytes) {
+    add_obs(b, b->pending_time, b->pending_bytes);
+    b->pending_bytes = 0;
+  }
+}
+
+/** Note <b>n</b> bytes for <b>b</b> in second <b>when</b>.  Bytes for the
+ * same second are summed, and reach add_obs() when the second changes or
+ * when we flush. */
+static INLINE void
+note_obs(bw_array_t *b, time_t when, uint64_t n)
+{
+  if (PREDICT_LIKELY(when == b->pending_time)) {
+    b->pending_bytes += n;
+    return;
+  }
+  flush_obs(b);
+  b->pending_time = when;
+  b->pending_bytes = n;
+}
+
 /** Allocate, initialize, and return a new bw_array. */
 static bw_array_t *
 bw_array_new(void)
@@ -1402,7 +1577,7 @@ rep_hist_note_bytes_written(size_t num_bytes, time_t when)
  * seen over when-1 to when-1-NUM_SECS_ROLLING_MEASURE, and stick it
  * somewhere. See rep_hist_bandwidth_assess() below.
  */
-  add_obs(write_array, when, num_bytes);
+  note_obs(write_array, when, num_bytes);
 }
 
 /** Remember that we wrote <b>num_bytes</b> bytes in second <b>when</b>.
@@ -1412,7 +1587,7 @@ void
 rep_hist_note_bytes_read(size_t num_bytes, time_t when)
 {
 /* if we're smart, we can make this func and the one above share code */
-  add_obs(read_array, when, num_bytes);
+  note_obs(read_array, when, num_bytes);
 }
 
 /** Remember that we wrote <b>num_bytes</b> directory bytes in second
@@ -1421,7 +1596,7 @@ rep_hist_note_bytes_read(size_t num_bytes, time_t when)
 void
 rep_hist_note_dir_bytes_written(size_t num_bytes, time_t when)
 {
-  add_obs(dir_write_array, when, num_bytes);
+  note_obs(dir_write_array, when, num_bytes);
 }
 
 /** Remember that we read <b>num_bytes</b> directory bytes in second
@@ -1430,7 +1605,21 @@ rep_hist_note_dir_bytes_written(size_t num_bytes, time_t when)
 void
 rep_hist_note_dir_bytes_read(size_t num_bytes, time_t when)
 {
-  add_obs(dir_read_array, when, num_bytes);
+  note_obs(dir_read_array, when, num_bytes);
+}
+
+/** Add the bytes we've noted but not yet recorded in our bandwidth
+ * history arrays.  Called once a second, and before we look at the
+ * arrays. */
+void
+rep_hist_flush_bandwidth(void)
+{
+  if (!read_array)
+    return;
+  flush_obs(read_array);
+  flush_obs(write_array);
+  flush_obs(dir_read_array);
+  flush_obs(dir_write_array);
 }
 
 /** Helper: Return the largest value in b->maxima.  (This is equal to the
@@ -1460,6 +1649,7 @@ int
 rep_hist_bandwidth_assess(void)
 {
   uint64_t w,r;
+  rep_hist_flush_bandwidth();
   r = find_largest_max(read_array);
   w = find_largest_max(write_array);
   if (r>w)
@@ -1533,6 +1723,8 @@ rep_hist_get_bandwidth_lines(void)
   const char *desc = NULL;
   size_t len;
 
+  rep_hist_flush_bandwidth();
+
   /* opt [dirreq-](read|write)-history yyyy-mm-dd HH:MM:SS (n s) n,n,n... */
 /* The n,n,n part above. Largest representation of a uint64_t is 20 chars
  * long, plus the comma. */
@@ -1644,6 +1836,7 @@ rep_hist_update_bwhist_state_section(or_state_t *state,
 void
 rep_hist_update_state(or_state_t *state)
 {
+  rep_hist_flush_bandwidth();
 #define UPDATE(arrname,st) \
   rep_hist_update_bwhist_state_section(state,\
                                        (arrname),\
@@ -1919,6 +2112,63 @@ rep_hist_get_predicted_internal(time_t now, int *need_uptime,
   return 1;
 }
 
+/** How many one-minute buckets do we keep when estimating how quickly
+ * streams use up clean circuits? */
+#define CLEAN_CIRC_DEMAND_MINUTES 10
+
+/** Counts of clean exit circuits that streams started using, for streams
+ * that did ([1]) or didn't ([0]) need uptime, in each of the last
+ * CLEAN_CIRC_DEMAND_MINUTES minutes.  Indexed by minute modulo
+ * CLEAN_CIRC_DEMAND_MINUTES. */
+static int clean_circ_demand[2][CLEAN_CIRC_DEMAND_MINUTES];
+/** The minute (seconds since the epoch divided by 60) in which we last
+ * updated clean_circ_demand. */
+static time_t clean_circ_demand_minute = 0;
+
+/** Bring clean_circ_demand up to date with the minute containing
+ * <b>now</b>, zeroing the buckets for any minutes that passed without
+ * demand. */
+static void
+clean_circ_demand_advance(time_t now)
+{
+  time_t minute = now / 60;
+  if (minute <= clean_circ_demand_minute)
+    return;
+  if (minute - clean_circ_demand_minute >= CLEAN_CIRC_DEMAND_MINUTES) {
+    memset(clean_circ_demand, 0, sizeof(clean_circ_demand));
+  } else {
+    time_t m;
+    for (m = clean_circ_demand_minute + 1; m <= minute; ++m) {
+      clean_circ_demand[0][m % CLEAN_CIRC_DEMAND_MINUTES] = 0;
+      clean_circ_demand[1][m % CLEAN_CIRC_DEMAND_MINUTES] = 0;
+    }
+  }
+  clean_circ_demand_minute = minute;
+}
+
+/** Remember that at <b>now</b> a stream that does (if <b>need_uptime</b>)
+ * or doesn't need uptime started using a clean exit circuit. */
+void
+rep_hist_note_clean_circ_used(time_t now, int need_uptime)
+{
+  clean_circ_demand_advance(now);
+  ++clean_circ_demand[need_uptime ? 1 : 0]
+                     [(now / 60) % CLEAN_CIRC_DEMAND_MINUTES];
+}
+
+/** Return the recent rate, in circuits per second, at which streams that
+ * do (if <b>need_uptime</b>) or don't need uptime have used up clean exit
+ * circuits. */
+double
+rep_hist_get_clean_circ_rate(time_t now, int need_uptime)
+{
+  int i, total = 0;
+  clean_circ_demand_advance(now);
+  for (i = 0; i < CLEAN_CIRC_DEMAND_MINUTES; ++i)
+    total += clean_circ_demand[need_uptime ? 1 : 0][i];
+  return total / (CLEAN_CIRC_DEMAND_MINUTES * 60.0);
+}
+
 /** Any ports used lately? These are pre-seeded if we just started
  * up or if we're running a hidden service. */
 int
@@ -2044,6 +2294,415 @@ dump_pk_ops(int severity)
       pk_op_counts.n_rend_server_ops);
 }
 
+/*** Latency histograms ***/
+
+/** How many buckets does each latency histogram have?  Bucket 0 counts
+ * latencies under 2 microseconds; bucket <i>i</i> counts latencies from 2^i
+ * up to 2^(i+1) microseconds; the last bucket counts everything longer. */
+#define LATENCY_HIST_BUCKETS 22
+
+/** A histogram of how many microseconds something took. */
+typedef struct latency_hist_t {
+  uint64_t n; /**< How many samples? */
+  uint64_t total_usec; /**< Sum of all samples. */
+  uint64_t buckets[LATENCY_HIST_BUCKETS]; /**< Samples by size. */
+} latency_hist_t;
+
+/** Add a sample of <b>usec</b> microseconds to <b>hist</b>, unless
+ * <b>usec</b> is negative. */
+static void
+latency_hist_add(latency_hist_t *hist, int usec)
+{
+  int bucket;
+  if (usec < 0)
+    return;
+  bucket = usec ? tor_log2((uint64_t)usec) : 0;
+  if (bucket >= LATENCY_HIST_BUCKETS)
+    bucket = LATENCY_HIST_BUCKETS - 1;
+  ++hist->buckets[bucket];
+  ++hist->n;
+  hist->total_usec += usec;
+}
+
+/** Return a newly allocated string describing <b>hist</b>, in the form
+ * "count=N mean-usec=M buckets=C0,C1,...". */
+static char *
+latency_hist_format(const latency_hist_t *hist)
+{
+  smartlist_t *counts = smartlist_create();
+  char *buckets, *result;
+  int i;
+  for (i = 0; i < LATENCY_HIST_BUCKETS; ++i) {
+    char *cp;
+    tor_asprintf(&cp, U64_FORMAT, U64_PRINTF_ARG(hist->buckets[i]));
+    smartlist_add(counts, cp);
+  }
+  buckets = smartlist_join_strings(counts, ",", 0, NULL);
+  SMARTLIST_FOREACH(counts, char *, cp, tor_free(cp));
+  smartlist_free(counts);
+  tor_asprintf(&result, "count="U64_FORMAT" mean-usec="U64_FORMAT
+               " buckets=%s", U64_PRINTF_ARG(hist->n),
+               U64_PRINTF_ARG(hist->n ? hist->total_usec / hist->n : 0),
+               buckets);
+  tor_free(buckets);
+  return result;
+}
+
+/** Log each line of <b>s</b> at level <b>severity</b>, after
+ * <b>prefix</b>. */
+static void
+log_lines_with_prefix(int severity, const char *prefix, const char *s)
+{
+  smartlist_t *lines = smartlist_create();
+  smartlist_split_string(lines, s, "\n", SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK,
+                         0);
+  SMARTLIST_FOREACH(lines, char *, line, {
+      log(severity, LD_HIST, "%s: %s", prefix, line);
+      tor_free(line);
+    });
+  smartlist_free(lines);
+}
+
+/*** Onionskin handshake latency ***/
+
+/** The parts of an onionskin's life we measure. */
+typedef enum {
+  /** Waiting in the cpuworker job queue. */
+  ONIONSKIN_PHASE_QUEUE=0,
+  /** Doing the handshake crypto. */
+  ONIONSKIN_PHASE_CRYPTO=1,
+  /** Between the end of the crypto and the main thread sending the
+   * reply. */
+  ONIONSKIN_PHASE_REPLY=2,
+} onionskin_phase_t;
+/** How many onionskin_phase_t values are there? */
+#define ONIONSKIN_N_PHASES 3
+
+/** Latency histograms, by onionskin_type_t and onionskin_phase_t. */
+static latency_hist_t onionskin_hists[ONIONSKIN_N_TYPES][ONIONSKIN_N_PHASES];
+/** For each cpuworker, how many onionskins has it answered, and how long
+ * did they queue, and take, in total? */
+static struct {
+  uint64_t n;
+  uint64_t queue_usec;
+  uint64_t crypto_usec;
+} onionskin_worker_totals[ONIONSKIN_HIST_MAX_WORKERS];
+
+/** Names for onionskin_type_t values */
+static const char *onionskin_type_names[ONIONSKIN_N_TYPES] = {
+  "create", "create_fast"
+};
+/** Names for onionskin_phase_t values */
+static const char *onionskin_phase_names[ONIONSKIN_N_PHASES] = {
+  "queue", "crypto", "reply"
+};
+
+/** Remember that an onionskin handshake of kind <b>type</b> waited
+ * <b>queue_usec</b> microseconds for cpuworker number <b>worker</b>, took
+ * <b>crypto_usec</b> microseconds of crypto, and then waited
+ * <b>reply_usec</b> microseconds for us to answer the circuit.  Negative
+ * times mean "doesn't apply", as does a negative <b>worker</b>. */
+void
+rep_hist_note_onionskin_timing(onionskin_type_t type, int worker,
+                               int queue_usec, int crypto_usec,
+                               int reply_usec)
+{
+  tor_assert(type >= 0 && type < ONIONSKIN_N_TYPES);
+  latency_hist_add(&onionskin_hists[type][ONIONSKIN_PHASE_QUEUE],
+                     queue_usec);
+  latency_hist_add(&onionskin_hists[type][ONIONSKIN_PHASE_CRYPTO],
+                     crypto_usec);
+  latency_hist_add(&onionskin_hists[type][ONIONSKIN_PHASE_REPLY],
+                     reply_usec);
+  if (worker >= 0 && worker < ONIONSKIN_HIST_MAX_WORKERS) {
+    ++onionskin_worker_totals[worker].n;
+    if (queue_usec > 0)
+      onionskin_worker_totals[worker].queue_usec += queue_usec;
+    if (crypto_usec > 0)
+      onionskin_worker_totals[worker].crypto_usec += crypto_usec;
+  }
+}
+
+/** Return a newly allocated string describing our onionskin latency
+ * histograms, one line for each handshake type and phase that has any
+ * samples, in the form "<type> <phase> count=N mean-usec=M
+ * buckets=C0,C1,...", followed by a line "worker I count=N
+ * mean-queue-usec=M mean-crypto-usec=M" for each cpuworker that has done
+ * any work. */
+char *
+rep_hist_format_onionskin_latency(void)
+{
+  smartlist_t *lines = smartlist_create();
+  char *result;
+  int type, phase, i;
+
+  for (type = 0; type < ONIONSKIN_N_TYPES; ++type) {
+    for (phase = 0; phase < ONIONSKIN_N_PHASES; ++phase) {
+      const latency_hist_t *h = &onionskin_hists[type][phase];
+      char *hist, *line;
+      if (!h->n)
+        continue;
+      hist = latency_hist_format(h);
+      tor_asprintf(&line, "%s %s %s\n", onionskin_type_names[type],
+                   onionskin_phase_names[phase], hist);
+      tor_free(hist);
+      smartlist_add(lines, line);
+    }
+  }
+  for (i = 0; i < ONIONSKIN_HIST_MAX_WORKERS; ++i) {
+    char *line;
+    uint64_t n = onionskin_worker_totals[i].n;
+    if (!n)
+      continue;
+    tor_asprintf(&line, "worker %d count="U64_FORMAT" mean-queue-usec="
+                 U64_FORMAT" mean-crypto-usec="U64_FORMAT"\n", i,
+                 U64_PRINTF_ARG(n),
+                 U64_PRINTF_ARG(onionskin_worker_totals[i].queue_usec / n),
+                 U64_PRINTF_ARG(onionskin_worker_totals[i].crypto_usec / n));
+    smartlist_add(lines, line);
+  }
+
+  result = smartlist_join_strings(lines, "", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/** Log our onionskin latency histograms at level <b>severity</b>. */
+void
+rep_hist_dump_onionskin_latency(int severity)
+{
+  char *s = rep_hist_format_onionskin_latency();
+  log_lines_with_prefix(severity, "Onionskin latency", s);
+  tor_free(s);
+}
+
+/*** Main loop handler latency ***/
+
+/** Latency histograms, by handler_type_t. */
+static latency_hist_t handler_hists[HANDLER_N_TYPES];
+
+/** Names for handler_type_t values */
+static const char *handler_type_names[HANDLER_N_TYPES] = {
+  "conn_read", "conn_write", "second_elapsed", "refill", "or_cells",
+  "dir_command", "control_command"
+};
+
+/** Remember that a call to the handler <b>type</b>, which started at
+ * <b>start</b>, has just finished. */
+void
+rep_hist_note_handler_time(handler_type_t type, const struct timeval *start)
+{
+  struct timeval end;
+  long usec;
+  tor_assert(type >= 0 && type < HANDLER_N_TYPES);
+  tor_gettimeofday(&end);
+  usec = tv_udiff(start, &end);
+  latency_hist_add(&handler_hists[type],
+                   usec > INT_MAX ? INT_MAX : (int)usec);
+}
+
+/** Return a newly allocated string describing our main loop handler latency
+ * histograms, one line for each handler that has been called, in the form
+ * "<handler> count=N mean-usec=M buckets=C0,C1,...". */
+char *
+rep_hist_format_handler_latency(void)
+{
+  smartlist_t *lines = smartlist_create();
+  char *result;
+  int type;
+
+  for (type = 0; type < HANDLER_N_TYPES; ++type) {
+    char *hist, *line;
+    if (!handler_hists[type].n)
+      continue;
+    hist = latency_hist_format(&handler_hists[type]);
+    tor_asprintf(&line, "%s %s\n", handler_type_names[type], hist);
+    tor_free(hist);
+    smartlist_add(lines, line);
+  }
+
+  result = smartlist_join_strings(lines, "", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/** Log our main loop handler latency histograms at level <b>severity</b>. */
+void
+rep_hist_dump_handler_latency(int severity)
+{
+  char *s = rep_hist_format_handler_latency();
+  log_lines_with_prefix(severity, "Handler latency", s);
+  tor_free(s);
+}
+
+/*** Cell processing latency ***/
+
+/** How many cell commands do we keep histograms for?  That's every
+ * fixed-length command up to CELL_RELAY_EARLY, and every variable-length
+ * one from CELL_VPADDING to CELL_AUTHENTICATE. */
+#define CELL_COMMAND_N_HISTS 14
+
+/** Latency histograms, by cell_command_hist_idx(). */
+static latency_hist_t cell_command_hists[CELL_COMMAND_N_HISTS];
+
+/** Names for the entries in cell_command_hists. */
+static const char *cell_command_hist_names[CELL_COMMAND_N_HISTS] = {
+  "padding", "create", "created", "relay", "destroy", "create_fast",
+  "created_fast", "versions", "netinfo", "relay_early",
+  "vpadding", "certs", "auth_challenge", "authenticate"
+};
+
+/** Return the index in cell_command_hists for cells with command
+ * <b>command</b>, or -1 if we don't keep a histogram for it. */
+static int
+cell_command_hist_idx(uint8_t command)
+{
+  if (command <= CELL_RELAY_EARLY)
+    return command;
+  if (command >= CELL_VPADDING && command <= CELL_AUTHENTICATE)
+    return command - CELL_VPADDING + CELL_RELAY_EARLY + 1;
+  return -1;
+}
+
+/** Remember that we finished handling a cell with command <b>command</b>,
+ * which we started handling at <b>start</b>. */
+void
+rep_hist_note_cell_processing_time(uint8_t command,
+                                   const struct timeval *start)
+{
+  struct timeval end;
+  long usec;
+  int idx = cell_command_hist_idx(command);
+  if (idx < 0)
+    return;
+  tor_gettimeofday(&end);
+  usec = tv_udiff(start, &end);
+  latency_hist_add(&cell_command_hists[idx],
+                   usec > INT_MAX ? INT_MAX : (int)usec);
+}
+
+/** Return a newly allocated string describing how long we've taken to
+ * handle incoming cells, one line for each cell command we've seen, in the
+ * form "<command> count=N mean-usec=M buckets=C0,C1,...". */
+char *
+rep_hist_format_cell_processing_latency(void)
+{
+  smartlist_t *lines = smartlist_create();
+  char *result;
+  int idx;
+
+  for (idx = 0; idx < CELL_COMMAND_N_HISTS; ++idx) {
+    char *hist, *line;
+    if (!cell_command_hists[idx].n)
+      continue;
+    hist = latency_hist_format(&cell_command_hists[idx]);
+    tor_asprintf(&line, "%s %s\n", cell_command_hist_names[idx], hist);
+    tor_free(hist);
+    smartlist_add(lines, line);
+  }
+
+  result = smartlist_join_strings(lines, "", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/** Log our cell processing latency histograms at level <b>severity</b>. */
+void
+rep_hist_dump_cell_processing_latency(int severity)
+{
+  char *s = rep_hist_format_cell_processing_latency();
+  log_lines_with_prefix(severity, "Cell processing latency", s);
+  tor_free(s);
+}
+
+/*** Directory server endpoint statistics ***/
+
+/** What we've served for one kind of directory request. */
+typedef struct dir_endpoint_stats_t {
+  /** How many responses did we send without compression, and how many
+   * bytes did they take? */
+  uint64_t n_identity, identity_bytes;
+  /** How many compressed responses did we send, and how many bytes did
+   * they take? */
+  uint64_t n_compressed, compressed_bytes;
+  /** How long did it take from getting each request to flushing the last
+   * of its response? */
+  latency_hist_t latency;
+} dir_endpoint_stats_t;
+
+/** Map from directory URL or URL prefix (as in directory.c's url_table) to
+ * dir_endpoint_stats_t. */
+static strmap_t *dir_endpoint_stats = NULL;
+
+/** Remember that we finished answering a request for <b>endpoint</b>, with
+ * a response of <b>n_bytes</b> bytes that was <b>compressed</b> or not,
+ * <b>usec</b> microseconds after the request arrived. */
+void
+rep_hist_note_dir_response(const char *endpoint, int compressed,
+                           uint64_t n_bytes, long usec)
+{
+  dir_endpoint_stats_t *st;
+  if (!dir_endpoint_stats)
+    dir_endpoint_stats = strmap_new();
+  st = strmap_get(dir_endpoint_stats, endpoint);
+  if (!st) {
+    st = tor_malloc_zero(sizeof(dir_endpoint_stats_t));
+    strmap_set(dir_endpoint_stats, endpoint, st);
+  }
+  if (compressed) {
+    ++st->n_compressed;
+    st->compressed_bytes += n_bytes;
+  } else {
+    ++st->n_identity;
+    st->identity_bytes += n_bytes;
+  }
+  latency_hist_add(&st->latency, usec > INT_MAX ? INT_MAX : (int)usec);
+}
+
+/** Return a newly allocated string describing what our directory server
+ * has answered, one line per URL in the form "<url> requests=N bytes=B
+ * compressed=N compressed-bytes=B z-ratio=R count=N mean-usec=M
+ * buckets=C0,C1,...".  The z-ratio is the mean size of a compressed
+ * response over the mean size of an uncompressed one, or "?" if we haven't
+ * sent both kinds. */
+char *
+rep_hist_format_dir_endpoint_stats(void)
+{
+  smartlist_t *lines = smartlist_create();
+  char *result;
+
+  if (dir_endpoint_stats) {
+    STRMAP_FOREACH(dir_endpoint_stats, endpoint, dir_endpoint_stats_t *, st) {
+      char *hist, *line, ratio[32];
+      if (st->n_compressed && st->n_identity && st->identity_bytes)
+        tor_snprintf(ratio, sizeof(ratio), "%.3f",
+            (U64_TO_DBL(st->compressed_bytes) / U64_TO_DBL(st->n_compressed))
+          / (U64_TO_DBL(st->identity_bytes) / U64_TO_DBL(st->n_identity)));
+      else
+        strlcpy(ratio, "?", sizeof(ratio));
+      hist = latency_hist_format(&st->latency);
+      tor_asprintf(&line, "%s requests="U64_FORMAT" bytes="U64_FORMAT
+                   " compressed="U64_FORMAT" compressed-bytes="U64_FORMAT
+                   " z-ratio=%s %s\n", endpoint,
+                   U64_PRINTF_ARG(st->n_identity + st->n_compressed),
+                   U64_PRINTF_ARG(st->identity_bytes + st->compressed_bytes),
+                   U64_PRINTF_ARG(st->n_compressed),
+                   U64_PRINTF_ARG(st->compressed_bytes), ratio, hist);
+      tor_free(hist);
+      smartlist_add(lines, line);
+    } STRMAP_FOREACH_END;
+  }
+
+  smartlist_sort_strings(lines);
+  result = smartlist_join_strings(lines, "", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
 /*** Exit port statistics ***/
 
 /* Some constants */
@@ -2058,14 +2717,31 @@ dump_pk_ops(int severity)
 
 /* The following data structures are arrays and no fancy smartlists or maps,
  * so that all write operations can be done in constant time. This comes at
- * the price of some memory (1.25 MB) and linear complexity when writing
- * stats for measuring relays. */
+ * the price of some memory (1.3 MB).  We keep the totals and the top ports
+ * up to date as we go, so that formatting the stats doesn't need to look
+ * at every port. */
 /** Number of bytes read in current period by exit port */
 static uint64_t *exit_bytes_read = NULL;
 /** Number of bytes written in current period by exit port */
 static uint64_t *exit_bytes_written = NULL;
 /** Number of streams opened in current period by exit port */
 static uint32_t *exit_streams = NULL;
+/** For each exit port, one more than its index in exit_top_ports, or 0 if
+ * it's not there. */
+static uint8_t *exit_top_idxplus1 = NULL;
+/** The (up to) EXIT_STATS_TOP_N_PORTS ports that saw the most bytes read
+ * and written in the current period, in no particular order.  Ties go to
+ * the lower port number. */
+static uint16_t exit_top_ports[EXIT_STATS_TOP_N_PORTS];
+/** Number of entries in exit_top_ports. */
+static int exit_n_top_ports = 0;
+/** Index in exit_top_ports of the port that ranks lowest. */
+static int exit_top_min_idx = 0;
+/** Sums of exit_bytes_read and exit_bytes_written over all ports other
+ * than 0. */
+static uint64_t exit_total_read = 0, exit_total_written = 0;
+/** Sum of exit_streams over all ports other than 0. */
+static uint32_t exit_total_streams = 0;
 
 /** Start time of exit stats or 0 if we're not collecting exit stats. */
 static time_t start_of_exit_stats_interval;
@@ -2081,6 +2757,10 @@ rep_hist_exit_stats_init(time_t now)
                                        sizeof(uint64_t));
   exit_streams = tor_malloc_zero(EXIT_STATS_NUM_PORTS *
                                  sizeof(uint32_t));
+  exit_top_idxplus1 = tor_malloc_zero(EXIT_STATS_NUM_PORTS);
+  exit_n_top_ports = exit_top_min_idx = 0;
+  exit_total_read = exit_total_written = 0;
+  exit_total_streams = 0;
 }
 
 /** Reset counters for exit port statistics. */
@@ -2091,6 +2771,10 @@ rep_hist_reset_exit_stats(time_t now)
   memset(exit_bytes_read, 0, EXIT_STATS_NUM_PORTS * sizeof(uint64_t));
   memset(exit_bytes_written, 0, EXIT_STATS_NUM_PORTS * sizeof(uint64_t));
   memset(exit_streams, 0, EXIT_STATS_NUM_PORTS * sizeof(uint32_t));
+  memset(exit_top_idxplus1, 0, EXIT_STATS_NUM_PORTS);
+  exit_n_top_ports = exit_top_min_idx = 0;
+  exit_total_read = exit_total_written = 0;
+  exit_total_streams = 0;
 }
 
 /** Stop collecting exit port stats in a way that we can re-start doing
@@ -2102,6 +2786,59 @@ rep_hist_exit_stats_term(void)
   tor_free(exit_bytes_read);
   tor_free(exit_bytes_written);
   tor_free(exit_streams);
+  tor_free(exit_top_idxplus1);
+}
+
+/** Return true iff exit port <b>a</b> ranks higher than exit port <b>b</b>:
+ * it has seen more bytes, or as many bytes and it's a lower port. */
+static INLINE int
+exit_port_ranks_higher(int a, int b)
+{
+  uint64_t vol_a = exit_bytes_read[a] + exit_bytes_written[a];
+  uint64_t vol_b = exit_bytes_read[b] + exit_bytes_written[b];
+  return vol_a > vol_b || (vol_a == vol_b && a < b);
+}
+
+/** Set exit_top_min_idx to the lowest-ranked entry of exit_top_ports. */
+static void
+exit_top_ports_find_min(void)
+{
+  int j;
+  exit_top_min_idx = 0;
+  for (j = 1; j < exit_n_top_ports; j++) {
+    if (exit_port_ranks_higher(exit_top_ports[exit_top_min_idx],
+                               exit_top_ports[j]))
+      exit_top_min_idx = j;
+  }
+}
+
+/** Called after the byte counts for <b>port</b> have grown: make sure that
+ * exit_top_ports still holds the top ports.  Since counts only grow, a port
+ * can only enter the top list when its own count changes. */
+static void
+exit_top_ports_note(uint16_t port)
+{
+  int idx = exit_top_idxplus1[port] - 1;
+  if (idx >= 0) {
+    /* Already there; it may have stopped being the minimum. */
+    if (idx == exit_top_min_idx)
+      exit_top_ports_find_min();
+    return;
+  }
+  if (exit_bytes_read[port] + exit_bytes_written[port] == 0)
+    return;
+  if (exit_n_top_ports < EXIT_STATS_TOP_N_PORTS) {
+    idx = exit_n_top_ports++;
+  } else if (exit_port_ranks_higher(port,
+                                    exit_top_ports[exit_top_min_idx])) {
+    idx = exit_top_min_idx;
+    exit_top_idxplus1[exit_top_ports[idx]] = 0;
+  } else {
+    return;
+  }
+  exit_top_ports[idx] = port;
+  exit_top_idxplus1[port] = idx + 1;
+  exit_top_ports_find_min();
 }
 
 /** Helper for qsort: compare two ints.  Does not handle overflow properly,
@@ -2119,12 +2856,10 @@ _compare_int(const void *x, const void *y)
 char *
 rep_hist_format_exit_stats(time_t now)
 {
-  int i, j, top_elements = 0, cur_min_idx = 0, cur_port;
-  uint64_t top_bytes[EXIT_STATS_TOP_N_PORTS];
+  int j, top_elements, cur_port;
   int top_ports[EXIT_STATS_TOP_N_PORTS];
-  uint64_t cur_bytes = 0, other_read = 0, other_written = 0,
-           total_read = 0, total_written = 0;
-  uint32_t total_streams = 0, other_streams = 0;
+  uint64_t other_read = 0, other_written = 0;
+  uint32_t other_streams = 0;
   char *buf;
   smartlist_t *written_strings, *read_strings, *streams_strings;
   char *written_string, *read_string, *streams_string;
@@ -2136,66 +2871,19 @@ rep_hist_format_exit_stats(time_t now)
 
   tor_assert(now >= start_of_exit_stats_interval);
 
-  /* Go through all ports to find the n ports that saw most written and
-   * read bytes.
-   *
-   * Invariant: at the end of the loop for iteration i,
-   *    total_read is the sum of all exit_bytes_read[0..i]
-   *    total_written is the sum of all exit_bytes_written[0..i]
-   *    total_stream is the sum of all exit_streams[0..i]
-   *
-   *    top_elements = MAX(EXIT_STATS_TOP_N_PORTS,
-   *                  #{j | 0 <= j <= i && volume(i) > 0})
-   *
-   *    For all 0 <= j < top_elements,
-   *        top_bytes[j] > 0
-   *        0 <= top_ports[j] <= 65535
-   *        top_bytes[j] = volume(top_ports[j])
-   *
-   *    There is no j in 0..i and k in 0..top_elements such that:
-   *        volume(j) > top_bytes[k] AND j is not in top_ports[0..top_elements]
-   *
-   *    There is no j!=cur_min_idx in 0..top_elements such that:
-   *        top_bytes[j] < top_bytes[cur_min_idx]
-   *
-   * where volume(x) == exit_bytes_read[x]+exit_bytes_written[x]
-   *
-   * Worst case: O(EXIT_STATS_NUM_PORTS * EXIT_STATS_TOP_N_PORTS)
-   */
-  for (i = 1; i < EXIT_STATS_NUM_PORTS; i++) {
-    total_read += exit_bytes_read[i];
-    total_written += exit_bytes_written[i];
-    total_streams += exit_streams[i];
-    cur_bytes = exit_bytes_read[i] + exit_bytes_written[i];
-    if (cur_bytes == 0) {
-      continue;
-    }
-    if (top_elements < EXIT_STATS_TOP_N_PORTS) {
-      top_bytes[top_elements] = cur_bytes;
-      top_ports[top_elements++] = i;
-    } else if (cur_bytes > top_bytes[cur_min_idx]) {
-      top_bytes[cur_min_idx] = cur_bytes;
-      top_ports[cur_min_idx] = i;
-    } else {
-      continue;
-    }
-    cur_min_idx = 0;
-    for (j = 1; j < top_elements; j++) {
-      if (top_bytes[j] < top_bytes[cur_min_idx]) {
-        cur_min_idx = j;
-      }
-    }
-  }
+  /* The totals and the top ports are kept current by
+   * rep_hist_note_exit_bytes() and rep_hist_note_exit_stream_opened(). */
+  top_elements = exit_n_top_ports;
+  for (j = 0; j < top_elements; j++)
+    top_ports[j] = exit_top_ports[j];
 
   /* Add observations of top ports to smartlists. */
   written_strings = smartlist_create();
   read_strings = smartlist_create();
   streams_strings = smartlist_create();
-  other_read = total_read;
-  other_written = total_written;
-  other_streams = total_streams;
-  /* Sort the ports; this puts them out of sync with top_bytes, but we
-   * won't be using top_bytes again anyway */
+  other_read = exit_total_read;
+  other_written = exit_total_written;
+  other_streams = exit_total_streams;
   qsort(top_ports, top_elements, sizeof(int), _compare_int);
   for (j = 0; j < top_elements; j++) {
     cur_port = top_ports[j];
@@ -2305,7 +2993,7 @@ rep_hist_exit_stats_write(time_t now)
     goto done;
   }
   filename = get_datadir_fname2("stats", "exit-stats");
-  if (write_str_to_file(filename, str, 0) < 0)
+  if (write_str_to_file_async(filename, str, 0) < 0)
     log_warn(LD_HIST, "Unable to write exit port statistics to disk!");
 
  done:
@@ -2325,6 +3013,11 @@ rep_hist_note_exit_bytes(uint16_t port, size_t num_written,
     return; /* Not initialized. */
   exit_bytes_written[port] += num_written;
   exit_bytes_read[port] += num_read;
+  if (port) {
+    exit_total_written += num_written;
+    exit_total_read += num_read;
+    exit_top_ports_note(port);
+  }
   log_debug(LD_HIST, "Written %lu bytes and read %lu bytes to/from an "
             "exit connection to port %d.",
             (unsigned long)num_written, (unsigned long)num_read, port);
@@ -2337,6 +3030,8 @@ rep_hist_note_exit_stream_opened(uint16_t port)
   if (!start_of_exit_stats_interval)
     return; /* Not initialized. */
   exit_streams[port]++;
+  if (port)
+    exit_total_streams++;
   log_debug(LD_HIST, "Opened exit stream to port %d", port);
 }
 
@@ -2364,8 +3059,17 @@ typedef struct circ_buffer_stats_t {
   uint32_t processed_cells;
 } circ_buffer_stats_t;
 
-/** List of circ_buffer_stats_t. */
-static smartlist_t *circuits_for_buffer_stats = NULL;
+/** How many circuits' statistics do we keep for computing deciles?  Up to
+ * this many circuits the deciles are exact; beyond it they are computed
+ * from a uniform random sample of this size. */
+#define BUFFER_STATS_RESERVOIR_SIZE 8192
+
+/** Reservoir sample of the circuits seen in this interval, or NULL if we
+ * haven't allocated it yet. */
+static circ_buffer_stats_t *buffer_stats_reservoir = NULL;
+/** Number of circuits seen in this interval, including those that didn't
+ * make it into buffer_stats_reservoir. */
+static uint64_t buffer_stats_n_circuits = 0;
 
 /** Remember cell statistics <b>mean_num_cells_in_queue</b>,
  * <b>mean_time_cells_in_queue</b>, and <b>processed_cells</b> of a
@@ -2375,15 +3079,23 @@ rep_hist_add_buffer_stats(double mean_num_cells_in_queue,
     double mean_time_cells_in_queue, uint32_t processed_cells)
 {
   circ_buffer_stats_t *stat;
+  uint64_t idx;
   if (!start_of_buffer_stats_interval)
     return; /* Not initialized. */
-  stat = tor_malloc_zero(sizeof(circ_buffer_stats_t));
+  if (!buffer_stats_reservoir)
+    buffer_stats_reservoir = tor_malloc(BUFFER_STATS_RESERVOIR_SIZE *
+                                        sizeof(circ_buffer_stats_t));
+  /* Keep each of the circuits seen so far with equal probability. */
+  idx = buffer_stats_n_circuits++;
+  if (idx >= BUFFER_STATS_RESERVOIR_SIZE) {
+    idx = crypto_rand_uint64(buffer_stats_n_circuits);
+    if (idx >= BUFFER_STATS_RESERVOIR_SIZE)
+      return;
+  }
+  stat = &buffer_stats_reservoir[idx];
   stat->mean_num_cells_in_queue = mean_num_cells_in_queue;
   stat->mean_time_cells_in_queue = mean_time_cells_in_queue;
   stat->processed_cells = processed_cells;
-  if (!circuits_for_buffer_stats)
-    circuits_for_buffer_stats = smartlist_create();
-  smartlist_add(circuits_for_buffer_stats, stat);
 }
 
 /** Remember cell statistics for circuit <b>circ</b> at time
@@ -2426,9 +3138,9 @@ rep_hist_buffer_stats_add_circ(circuit_t *circ, time_t end_of_interval)
 /** Sorting helper: return -1, 1, or 0 based on comparison of two
  * circ_buffer_stats_t */
 static int
-_buffer_stats_compare_entries(const void **_a, const void **_b)
+_buffer_stats_compare_entries(const void *_a, const void *_b)
 {
-  const circ_buffer_stats_t *a = *_a, *b = *_b;
+  const circ_buffer_stats_t *a = _a, *b = _b;
   if (a->processed_cells < b->processed_cells)
     return 1;
   else if (a->processed_cells > b->processed_cells)
@@ -2450,11 +3162,7 @@ rep_hist_buffer_stats_term(void)
 void
 rep_hist_reset_buffer_stats(time_t now)
 {
-  if (!circuits_for_buffer_stats)
-    circuits_for_buffer_stats = smartlist_create();
-  SMARTLIST_FOREACH(circuits_for_buffer_stats, circ_buffer_stats_t *,
-      stat, tor_free(stat));
-  smartlist_clear(circuits_for_buffer_stats);
+  buffer_stats_n_circuits = 0;
   start_of_buffer_stats_interval = now;
 }
 
@@ -2466,7 +3174,7 @@ rep_hist_format_buffer_stats(time_t now)
 {
 #define SHARES 10
   int processed_cells[SHARES], circs_in_share[SHARES],
-      number_of_circuits, i;
+      number_of_samples, i;
   double queued_cells[SHARES], time_in_queue[SHARES];
   char *buf = NULL;
   smartlist_t *processed_cells_strings, *queued_cells_strings,
@@ -2486,23 +3194,21 @@ rep_hist_format_buffer_stats(time_t now)
   memset(circs_in_share, 0, SHARES * sizeof(int));
   memset(queued_cells, 0, SHARES * sizeof(double));
   memset(time_in_queue, 0, SHARES * sizeof(double));
-  if (!circuits_for_buffer_stats)
-    circuits_for_buffer_stats = smartlist_create();
-  number_of_circuits = smartlist_len(circuits_for_buffer_stats);
-  if (number_of_circuits > 0) {
-    smartlist_sort(circuits_for_buffer_stats,
-                   _buffer_stats_compare_entries);
-    i = 0;
-    SMARTLIST_FOREACH_BEGIN(circuits_for_buffer_stats,
-                            circ_buffer_stats_t *, stat)
-    {
-      int share = i++ * SHARES / number_of_circuits;
+  number_of_samples = (int)MIN(buffer_stats_n_circuits,
+                                BUFFER_STATS_RESERVOIR_SIZE);
+  if (number_of_samples > 0) {
+    /* The reservoir's order doesn't matter for sampling, so sort it in
+     * place. */
+    qsort(buffer_stats_reservoir, number_of_samples,
+          sizeof(circ_buffer_stats_t), _buffer_stats_compare_entries);
+    for (i = 0; i < number_of_samples; i++) {
+      const circ_buffer_stats_t *stat = &buffer_stats_reservoir[i];
+      int share = i * SHARES / number_of_samples;
       processed_cells[share] += stat->processed_cells;
       queued_cells[share] += stat->mean_num_cells_in_queue;
       time_in_queue[share] += stat->mean_time_cells_in_queue;
       circs_in_share[share]++;
     }
-    SMARTLIST_FOREACH_END(stat);
   }
 
   /* Write deciles to strings. */
@@ -2545,12 +3251,13 @@ rep_hist_format_buffer_stats(time_t now)
                "cell-processed-cells %s\n"
                "cell-queued-cells %s\n"
                "cell-time-in-queue %s\n"
-               "cell-circuits-per-decile %d\n",
+               "cell-circuits-per-decile "U64_FORMAT"\n",
                t, (unsigned) (now - start_of_buffer_stats_interval),
                processed_cells_string,
                queued_cells_string,
                time_in_queue_string,
-               (number_of_circuits + SHARES - 1) / SHARES);
+               U64_PRINTF_ARG((buffer_stats_n_circuits + SHARES - 1) /
+                              SHARES));
   tor_free(processed_cells_string);
   tor_free(queued_cells_string);
   tor_free(time_in_queue_string);
@@ -2592,7 +3299,7 @@ rep_hist_buffer_stats_write(time_t now)
     goto done;
   }
   filename = get_datadir_fname2("stats", "buffer-stats");
-  if (write_str_to_file(filename, str, 0) < 0)
+  if (write_str_to_file_async(filename, str, 0) < 0)
     log_warn(LD_HIST, "Unable to write buffer stats to disk!");
 
  done:
@@ -2796,47 +3503,60 @@ static uint32_t mostly_written = 0;
  * BIDI_INTERVAL seconds. */
 static uint32_t both_read_and_written = 0;
 
-/* Entry in a map from connection ID to the number of read and written
- * bytes on this connection in a BIDI_INTERVAL second interval. */
-typedef struct bidi_map_entry_t {
-  HT_ENTRY(bidi_map_entry_t) node;
-  uint64_t conn_id; /**< Connection ID */
-  size_t read; /**< Number of read bytes */
-  size_t written; /**< Number of written bytes */
-} bidi_map_entry_t;
-
-/** Map of OR connections together with the number of read and written
- * bytes in the current BIDI_INTERVAL second interval. */
-static HT_HEAD(bidimap, bidi_map_entry_t) bidi_map =
-     HT_INITIALIZER();
+/** OR connections that have read or written bytes in the current
+ * BIDI_INTERVAL second interval.  Their byte counts live in the connections
+ * themselves; see or_connection_t.bidi_read and .bidi_written. */
+static smartlist_t *bidi_conns = NULL;
 
-static int
-bidi_map_ent_eq(const bidi_map_entry_t *a, const bidi_map_entry_t *b)
+/** Count the bytes that <b>conn</b> read and wrote in the current
+ * BIDI_INTERVAL second interval toward the conn statistics, and take it
+ * off the list of connections with bytes in this interval.  If
+ * <b>count</b> is false, drop its bytes without counting them. */
+static void
+bidi_conn_finish(or_connection_t *conn, int count)
 {
-  return a->conn_id == b->conn_id;
+  int idx = conn->bidi_idxplus1 - 1;
+  if (idx < 0)
+    return;
+  if (count) {
+    if (conn->bidi_read + conn->bidi_written < BIDI_THRESHOLD)
+      below_threshold++;
+    else if (conn->bidi_read >= conn->bidi_written * BIDI_FACTOR)
+      mostly_read++;
+    else if (conn->bidi_written >= conn->bidi_read * BIDI_FACTOR)
+      mostly_written++;
+    else
+      both_read_and_written++;
+  }
+  conn->bidi_read = conn->bidi_written = 0;
+  conn->bidi_idxplus1 = 0;
+  smartlist_del(bidi_conns, idx);
+  if (idx < smartlist_len(bidi_conns)) {
+    or_connection_t *moved = smartlist_get(bidi_conns, idx);
+    moved->bidi_idxplus1 = idx + 1;
+  }
 }
 
-static unsigned
-bidi_map_ent_hash(const bidi_map_entry_t *entry)
+/** Forget the bytes of every connection with bytes in the current
+ * BIDI_INTERVAL second interval, counting them toward the conn statistics
+ * iff <b>count</b>. */
+static void
+bidi_conns_finish_all(int count)
 {
-  return (unsigned) entry->conn_id;
+  if (!bidi_conns)
+    return;
+  while (smartlist_len(bidi_conns))
+    bidi_conn_finish(smartlist_get(bidi_conns, smartlist_len(bidi_conns)-1),
+                     count);
 }
 
-HT_PROTOTYPE(bidimap, bidi_map_entry_t, node, bidi_map_ent_hash,
-             bidi_map_ent_eq);
-HT_GENERATE(bidimap, bidi_map_entry_t, node, bidi_map_ent_hash,
-            bidi_map_ent_eq, 0.6, malloc, realloc, free);
-
+/** Free the list of connections with bytes in the current interval. */
 static void
-bidi_map_free(void)
+bidi_conns_free(void)
 {
-  bidi_map_entry_t **ptr, **next, *ent;
-  for (ptr = HT_START(bidimap, &bidi_map); ptr; ptr = next) {
-    ent = *ptr;
-    next = HT_NEXT_RMV(bidimap, &bidi_map, ptr);
-    tor_free(ent);
-  }
-  HT_CLEAR(bidimap, &bidi_map);
+  bidi_conns_finish_all(0);
+  smartlist_free(bidi_conns);
+  bidi_conns = NULL;
 }
 
 /** Reset counters for conn statistics. */
@@ -2848,7 +3568,7 @@ rep_hist_reset_conn_stats(time_t now)
   mostly_read = 0;
   mostly_written = 0;
   both_read_and_written = 0;
-  bidi_map_free();
+  bidi_conns_finish_all(0);
 }
 
 /** Stop collecting connection stats in a way that we can re-start doing
@@ -2860,11 +3580,11 @@ rep_hist_conn_stats_term(void)
 }
 
 /** We read <b>num_read</b> bytes and wrote <b>num_written</b> from/to OR
- * connection <b>conn_id</b> in second <b>when</b>. If this is the first
+ * connection <b>conn</b> in second <b>when</b>. If this is the first
  * observation in a new interval, sum up the last observations. Add bytes
  * for this connection. */
 void
-rep_hist_note_or_conn_bytes(uint64_t conn_id, size_t num_read,
+rep_hist_note_or_conn_bytes(or_connection_t *conn, size_t num_read,
                             size_t num_written, time_t when)
 {
   if (!start_of_conn_stats_interval)
@@ -2874,20 +3594,7 @@ rep_hist_note_or_conn_bytes(uint64_t conn_id, size_t num_read,
     bidi_next_interval = when + BIDI_INTERVAL;
   /* Sum up last period's statistics */
   if (when >= bidi_next_interval) {
-    bidi_map_entry_t **ptr, **next, *ent;
-    for (ptr = HT_START(bidimap, &bidi_map); ptr; ptr = next) {
-      ent = *ptr;
-      if (ent->read + ent->written < BIDI_THRESHOLD)
-        below_threshold++;
-      else if (ent->read >= ent->written * BIDI_FACTOR)
-        mostly_read++;
-      else if (ent->written >= ent->read * BIDI_FACTOR)
-        mostly_written++;
-      else
-        both_read_and_written++;
-      next = HT_NEXT_RMV(bidimap, &bidi_map, ptr);
-      tor_free(ent);
-    }
+    bidi_conns_finish_all(1);
     while (when >= bidi_next_interval)
       bidi_next_interval += BIDI_INTERVAL;
     log_info(LD_GENERAL, "%d below threshold, %d mostly read, "
@@ -2897,22 +3604,26 @@ rep_hist_note_or_conn_bytes(uint64_t conn_id, size_t num_read,
   }
   /* Add this connection's bytes. */
   if (num_read > 0 || num_written > 0) {
-    bidi_map_entry_t *entry, lookup;
-    lookup.conn_id = conn_id;
-    entry = HT_FIND(bidimap, &bidi_map, &lookup);
-    if (entry) {
-      entry->written += num_written;
-      entry->read += num_read;
-    } else {
-      entry = tor_malloc_zero(sizeof(bidi_map_entry_t));
-      entry->conn_id = conn_id;
-      entry->written = num_written;
-      entry->read = num_read;
-      HT_INSERT(bidimap, &bidi_map, entry);
+    if (!conn->bidi_idxplus1) {
+      if (!bidi_conns)
+        bidi_conns = smartlist_create();
+      smartlist_add(bidi_conns, conn);
+      conn->bidi_idxplus1 = smartlist_len(bidi_conns);
     }
+    conn->bidi_written += num_written;
+    conn->bidi_read += num_read;
   }
 }
 
+/** Called when OR connection <b>conn</b> is about to be freed: count the
+ * bytes it has transferred in the current BIDI_INTERVAL second interval
+ * now, since we won't be able to at the end of the interval. */
+void
+rep_hist_note_or_conn_closed(or_connection_t *conn)
+{
+  bidi_conn_finish(conn, start_of_conn_stats_interval != 0);
+}
+
 /** Return a newly allocated string containing the connection statistics
  * until <b>now</b>, or NULL if we're not collecting conn stats. Caller must
  * ensure start_of_conn_stats_interval is in the past. */
@@ -2964,7 +3675,7 @@ rep_hist_conn_stats_write(time_t now)
     goto done;
   }
   filename = get_datadir_fname2("stats", "conn-stats");
-  if (write_str_to_file(filename, str, 0) < 0)
+  if (write_str_to_file_async(filename, str, 0) < 0)
     log_warn(LD_HIST, "Unable to write conn stats to disk!");
 
  done:
@@ -2980,6 +3691,14 @@ void
 rep_hist_free_all(void)
 {
   digestmap_free(history_map, free_or_history);
+  rephist_total_alloc -= link_history_n_slots * sizeof(link_history_t);
+  tor_free(link_history_table);
+  link_history_n_slots = link_history_n_used = link_history_clean_pos = 0;
+  if (or_history_clean_queue) {
+    SMARTLIST_FOREACH(or_history_clean_queue, char *, d, tor_free(d));
+    smartlist_free(or_history_clean_queue);
+    or_history_clean_queue = NULL;
+  }
   tor_free(read_array);
   tor_free(write_array);
   tor_free(last_stability_doc);
@@ -2988,15 +3707,19 @@ rep_hist_free_all(void)
   tor_free(exit_streams);
   built_last_stability_doc_at = 0;
   predicted_ports_free();
-  bidi_map_free();
+  bidi_conns_free();
 
-  if (circuits_for_buffer_stats) {
-    SMARTLIST_FOREACH(circuits_for_buffer_stats, circ_buffer_stats_t *, s,
-                      tor_free(s));
-    smartlist_free(circuits_for_buffer_stats);
-    circuits_for_buffer_stats = NULL;
-  }
+  tor_free(buffer_stats_reservoir);
+  buffer_stats_n_circuits = 0;
   rep_hist_desc_stats_term();
   total_descriptor_downloads = 0;
+  memset(onionskin_hists, 0, sizeof(onionskin_hists));
+  memset(onionskin_worker_totals, 0, sizeof(onionskin_worker_totals));
+  memset(handler_hists, 0, sizeof(handler_hists));
+  memset(cell_command_hists, 0, sizeof(cell_command_hists));
+  strmap_free(dir_endpoint_stats, _tor_free);
+  dir_endpoint_stats = NULL;
+  memset(clean_circ_demand, 0, sizeof(clean_circ_demand));
+  clean_circ_demand_minute = 0;
 }
 
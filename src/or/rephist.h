@@ -26,6 +26,7 @@ void rep_hist_note_bytes_written(size_t num_bytes, time_t when);
 
 void rep_hist_note_dir_bytes_read(size_t num_bytes, time_t when);
 void rep_hist_note_dir_bytes_written(size_t num_bytes, time_t when);
+void rep_hist_flush_bandwidth(void);
 
 int rep_hist_bandwidth_assess(void);
 char *rep_hist_get_bandwidth_lines(void);
@@ -55,12 +56,47 @@ void rep_hist_note_used_internal(time_t now, int need_uptime,
 int rep_hist_get_predicted_internal(time_t now, int *need_uptime,
                                     int *need_capacity);
 
+void rep_hist_note_clean_circ_used(time_t now, int need_uptime);
+double rep_hist_get_clean_circ_rate(time_t now, int need_uptime);
+
 int any_predicted_circuits(time_t now);
 int rep_hist_circbuilding_dormant(time_t now);
 
 void note_crypto_pk_op(pk_op_t operation);
 void dump_pk_ops(int severity);
 
+/** Largest number of cpuworkers we keep separate onionskin totals for. */
+#define ONIONSKIN_HIST_MAX_WORKERS 16
+
+void rep_hist_note_onionskin_timing(onionskin_type_t type, int worker,
+                                    int queue_usec, int crypto_usec,
+                                    int reply_usec);
+char *rep_hist_format_onionskin_latency(void);
+void rep_hist_dump_onionskin_latency(int severity);
+
+/** Main loop handlers whose latency we keep histograms of. */
+typedef enum {
+  HANDLER_CONN_READ=0, HANDLER_CONN_WRITE=1, HANDLER_SECOND_ELAPSED=2,
+  HANDLER_REFILL=3, HANDLER_OR_CELLS=4, HANDLER_DIR_COMMAND=5,
+  HANDLER_CONTROL_COMMAND=6,
+} handler_type_t;
+/** How many handler_type_t values are there? */
+#define HANDLER_N_TYPES 7
+
+void rep_hist_note_handler_time(handler_type_t type,
+                                const struct timeval *start);
+char *rep_hist_format_handler_latency(void);
+void rep_hist_dump_handler_latency(int severity);
+
+void rep_hist_note_cell_processing_time(uint8_t command,
+                                        const struct timeval *start);
+char *rep_hist_format_cell_processing_latency(void);
+void rep_hist_dump_cell_processing_latency(int severity);
+
+void rep_hist_note_dir_response(const char *endpoint, int compressed,
+                                uint64_t n_bytes, long usec);
+char *rep_hist_format_dir_endpoint_stats(void);
+
 void rep_hist_free_all(void);
 
 void rep_hist_exit_stats_init(time_t now);
@@ -88,8 +124,9 @@ void rep_hist_desc_stats_term(void);
 time_t rep_hist_desc_stats_write(time_t now);
 
 void rep_hist_conn_stats_init(time_t now);
-void rep_hist_note_or_conn_bytes(uint64_t conn_id, size_t num_read,
+void rep_hist_note_or_conn_bytes(or_connection_t *conn, size_t num_read,
                                  size_t num_written, time_t when);
+void rep_hist_note_or_conn_closed(or_connection_t *conn);
 void rep_hist_reset_conn_stats(time_t now);
 char *rep_hist_format_conn_stats(time_t now);
 time_t rep_hist_conn_stats_write(time_t now);
@@ -0,0 +1,213 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file replaycache.c
+ * \brief Remember which digests we have seen recently, in bounded memory.
+ *
+ * Hidden services use these caches to notice replayed INTRODUCE2 cells.  A
+ * cache holds two generations of entries: the current one, which new
+ * digests go into, and the one before it.  Once a generation is
+ * <b>interval</b> seconds old we drop the older generation wholesale, so
+ * we never have to walk the entries to expire them, and every digest stays
+ * in the cache for at least <b>interval</b> seconds.
+ *
+ * Each generation is an open-addressed hash table of fixed-size entries
+ * holding the whole digest, so that there are no false positives, and no
+ * per-entry allocations.  A generation holds at most <b>max_entries</b>
+ * entries.  When the current one is full, we start a new one early only if
+ * that wouldn't forget anything younger than <b>interval</b>; otherwise we
+ * refuse to add more, and leave it to the caller whether to fail open or
+ * closed.
+ **/
+
+#define REPLAYCACHE_PRIVATE
+
+#include "or.h"
+#include "replaycache.h"
+
+/** How many slots does a generation's table start with? */
+#define REPLAYCACHE_MIN_SLOTS 64
+
+/** One slot in a generation's table. */
+typedef struct replaycache_entry_t {
+  /** The digest we saw. */
+  char digest[DIGEST_LEN];
+  /** One more than the number of seconds after the start of the generation
+   * that we saw it, or 0 if this slot is empty. */
+  uint32_t when;
+} replaycache_entry_t;
+
+/** A set of digests we saw during one interval. */
+typedef struct replaycache_generation_t {
+  /** When did we start adding to this generation? */
+  time_t started;
+  /** Open-addressed hash table of entries, with linear probing. */
+  replaycache_entry_t *slots;
+  /** Number of elements in <b>slots</b>: a power of two, or 0. */
+  unsigned int n_slots;
+  /** Number of non-empty slots. */
+  int n_entries;
+} replaycache_generation_t;
+
+/** A replay cache. */
+struct replaycache_t {
+  /** Remember every digest for at least this many seconds. */
+  time_t interval;
+  /** Never hold more than this many entries in one generation. */
+  int max_entries;
+  /** The generation we're adding to. */
+  replaycache_generation_t cur;
+  /** The generation before <b>cur</b>. */
+  replaycache_generation_t prev;
+};
+
+/** Return a new replay cache that remembers each digest for at least
+ * <b>interval</b> seconds, and holds at most <b>max_entries</b> digests
+ * from any one interval. */
+replaycache_t *
+replaycache_new(time_t interval, int max_entries)
+{
+  replaycache_t *rc;
+  tor_assert(interval > 0);
+  tor_assert(max_entries > 0);
+  rc = tor_malloc_zero(sizeof(replaycache_t));
+  rc->interval = interval;
+  rc->max_entries = max_entries;
+  return rc;
+}
+
+/** Release all storage held by <b>rc</b>. */
+void
+replaycache_free(replaycache_t *rc)
+{
+  if (!rc)
+    return;
+  tor_free(rc->cur.slots);
+  tor_free(rc->prev.slots);
+  tor_free(rc);
+}
+
+/** Return the slot in <b>gen</b> that holds <b>digest</b>, or the empty
+ * slot where it would go.  Return NULL if <b>gen</b> has no table yet. */
+static replaycache_entry_t *
+generation_find(const replaycache_generation_t *gen, const char *digest)
+{
+  unsigned int mask, idx;
+  if (!gen->n_slots)
+    return NULL;
+  mask = gen->n_slots - 1;
+  idx = get_uint32(digest) & mask;
+  /* We keep the table at most half full, so this always terminates. */
+  while (gen->slots[idx].when &&
+         fast_memneq(gen->slots[idx].digest, digest, DIGEST_LEN))
+    idx = (idx + 1) & mask;
+  return &gen->slots[idx];
+}
+
+/** Double the size of <b>gen</b>'s table, or give it its first one. */
+static void
+generation_grow(replaycache_generation_t *gen)
+{
+  replaycache_generation_t bigger;
+  unsigned int i;
+
+  memcpy(&bigger, gen, sizeof(bigger));
+  bigger.n_slots = gen->n_slots ? gen->n_slots * 2 : REPLAYCACHE_MIN_SLOTS;
+  bigger.slots = tor_malloc_zero(bigger.n_slots *
+                                 sizeof(replaycache_entry_t));
+  for (i = 0; i < gen->n_slots; ++i) {
+    if (gen->slots[i].when)
+      memcpy(generation_find(&bigger, gen->slots[i].digest),
+             &gen->slots[i], sizeof(replaycache_entry_t));
+  }
+  tor_free(gen->slots);
+  memcpy(gen, &bigger, sizeof(bigger));
+}
+
+/** Forget the older generation of <b>rc</b>, and start a new one at
+ * <b>now</b>. */
+static void
+replaycache_rotate(replaycache_t *rc, time_t now)
+{
+  tor_free(rc->prev.slots);
+  memcpy(&rc->prev, &rc->cur, sizeof(replaycache_generation_t));
+  memset(&rc->cur, 0, sizeof(replaycache_generation_t));
+  rc->cur.started = now;
+}
+
+/** If the slot <b>ent</b> in <b>gen</b> holds a digest, set
+ * *<b>elapsed_out</b> (if provided) to how long before <b>now</b> we saw it,
+ * and return 1.  Otherwise return 0. */
+static int
+generation_check_entry(const replaycache_generation_t *gen,
+                       const replaycache_entry_t *ent, time_t now,
+                       time_t *elapsed_out)
+{
+  time_t seen_at;
+  if (!ent || !ent->when)
+    return 0;
+  if (elapsed_out) {
+    seen_at = gen->started + ent->when - 1;
+    *elapsed_out = now > seen_at ? now - seen_at : 0;
+  }
+  return 1;
+}
+
+/** Check whether we've seen the DIGEST_LEN-byte <b>digest</b> recently in
+ * <b>rc</b>.  If so, set *<b>elapsed_out</b> (if provided) to how long ago
+ * we first saw it, and return 1.  If not, remember it as of <b>now</b> and
+ * return 0.  If we haven't seen it but <b>rc</b> is too full to remember it
+ * without forgetting something recent, return -1. */
+int
+replaycache_add_and_test(replaycache_t *rc, const char *digest,
+                         time_t now, time_t *elapsed_out)
+{
+  replaycache_entry_t *ent;
+  tor_assert(rc);
+  tor_assert(digest);
+
+  if (rc->cur.started + rc->interval <= now)
+    replaycache_rotate(rc, now);
+
+  ent = generation_find(&rc->cur, digest);
+  if (generation_check_entry(&rc->cur, ent, now, elapsed_out))
+    return 1;
+  if (generation_check_entry(&rc->prev, generation_find(&rc->prev, digest),
+                             now, elapsed_out))
+    return 1;
+
+  if (rc->cur.n_entries >= rc->max_entries) {
+    /* Starting a new generation early is fine if the older one is empty;
+     * otherwise it would let a replay of something we saw recently
+     * through. */
+    if (rc->prev.n_entries)
+      return -1;
+    replaycache_rotate(rc, now);
+    ent = NULL;
+  }
+  if (!ent || (unsigned)(rc->cur.n_entries + 1) * 2 > rc->cur.n_slots) {
+    generation_grow(&rc->cur);
+    ent = generation_find(&rc->cur, digest);
+  }
+  memcpy(ent->digest, digest, DIGEST_LEN);
+  ent->when = now > rc->cur.started ?
+    (uint32_t)(now - rc->cur.started) + 1 : 1;
+  ++rc->cur.n_entries;
+  return 0;
+}
+
+/** Return the number of digests that <b>rc</b> remembers. */
+int
+replaycache_size(const replaycache_t *rc)
+{
+  return rc->cur.n_entries + rc->prev.n_entries;
+}
+
+/** Return the number of bytes allocated for <b>rc</b>'s tables. */
+size_t
+replaycache_bytes_allocated(const replaycache_t *rc)
+{
+  return (rc->cur.n_slots + rc->prev.n_slots) * sizeof(replaycache_entry_t);
+}
+
@@ -106,7 +106,8 @@ get_onion_key(void)
 }
 
 /** Store a full copy of the current onion key into *<b>key</b>, and a full
- * copy of the most recent onion key into *<b>last</b>.
+ * copy of the most recent onion key into *<b>last</b>.  If we have no onion
+ * key (because we're not a server), set both to NULL.
  */
 void
 dup_onion_keys(crypto_pk_env_t **key, crypto_pk_env_t **last)
@@ -114,7 +115,11 @@ dup_onion_keys(crypto_pk_env_t **key, crypto_pk_env_t **last)
   tor_assert(key);
   tor_assert(last);
   tor_mutex_acquire(key_lock);
-  tor_assert(onionkey);
+  if (!onionkey) {
+    *key = *last = NULL;
+    tor_mutex_release(key_lock);
+    return;
+  }
   *key = crypto_pk_copy_full(onionkey);
   if (lastonionkey)
     *last = crypto_pk_copy_full(lastonionkey);
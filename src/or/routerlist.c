@@ -11,11 +11,13 @@
  * servers.
  **/
 
+#define ROUTERLIST_PRIVATE
 #include "or.h"
 #include "circuitbuild.h"
 #include "config.h"
 #include "connection.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -33,6 +35,7 @@
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
+#include "sigcache.h"
 
 // #define DEBUG_ROUTERLIST
 
@@ -72,6 +75,61 @@ DECLARE_TYPED_DIGESTMAP_FNS(eimap_, digest_ei_map_t, extrainfo_t)
 
 /****************************************************************************/
 
+/** Return true iff we should put Bloom filters in front of our descriptor
+ * digest maps. */
+int
+should_use_desc_digest_filter(const or_options_t *options)
+{
+  if (options->DescriptorDigestFilter == -1)
+    return authdir_mode(options);
+  return options->DescriptorDigestFilter;
+}
+
+/** Set the value for <b>digest</b> in the desc_digest_map of <b>rl</b> to
+ * <b>sd</b>, and add <b>digest</b> to the Bloom filter in front of the map,
+ * if there is one.  Return the old value. */
+static signed_descriptor_t *
+desc_digest_map_set(routerlist_t *rl, const char *digest,
+                    signed_descriptor_t *sd)
+{
+  if (rl->desc_digest_filter) {
+    if (++rl->desc_digest_filter_n > rl->desc_digest_filter_max) {
+      /* It's getting too full to be much use: build a bigger one the next
+       * time we need it. */
+      digestset_free(rl->desc_digest_filter);
+      rl->desc_digest_filter = NULL;
+    } else {
+      digestset_add(rl->desc_digest_filter, digest);
+    }
+  }
+  return sdmap_set(rl->desc_digest_map, digest, sd);
+}
+
+/** Return false if <b>digest</b> is certainly not a key in the
+ * desc_digest_map of <b>rl</b>.  Return true if it may be. */
+static int
+desc_digest_map_may_contain(routerlist_t *rl, const char *digest)
+{
+  if (!should_use_desc_digest_filter(get_options())) {
+    digestset_free(rl->desc_digest_filter);
+    rl->desc_digest_filter = NULL;
+    return 1;
+  }
+  if (!rl->desc_digest_filter) {
+    /* Leave room for as many more digests as we have now, since removals
+     * don't take anything out of the filter. */
+    int n = sdmap_size(rl->desc_digest_map);
+    rl->desc_digest_filter_max = MAX(2*n, 1024);
+    rl->desc_digest_filter = digestset_new(rl->desc_digest_filter_max);
+    SDMAP_FOREACH(rl->desc_digest_map, d, sd) {
+      (void)sd;
+      digestset_add(rl->desc_digest_filter, d);
+    } DIGESTMAP_FOREACH_END;
+    rl->desc_digest_filter_n = n;
+  }
+  return digestset_isin(rl->desc_digest_filter, digest);
+}
+
 /** Global list of a trusted_dir_server_t object for each trusted directory
  * server. */
 static smartlist_t *trusted_dir_servers = NULL;
@@ -297,7 +355,7 @@ trusted_dirs_flush_certs_to_disk(void)
   } DIGESTMAP_FOREACH_END;
 
   filename = get_datadir_fname("cached-certs");
-  if (write_chunks_to_file(filename, chunks, 0)) {
+  if (write_chunks_to_file_async(filename, chunks, 0)) {
     log_warn(LD_FS, "Error writing certificates to disk.");
   }
   tor_free(filename);
@@ -649,6 +707,325 @@ _compare_signed_descriptors_by_age(const void **_a, const void **_b)
   return (int)(r1->published_on - r2->published_on);
 }
 
+/** Return a new smartlist of every signed_descriptor_t that belongs in
+ * <b>store</b>, oldest first.  We sort the descriptors by age to enhance
+ * locality on disk. */
+static smartlist_t *
+store_get_descriptors_by_age(desc_store_t *store)
+{
+  smartlist_t *signed_descriptors = smartlist_create();
+  if (store->type == EXTRAINFO_STORE) {
+    eimap_iter_t *iter;
+    for (iter = eimap_iter_init(routerlist->extra_info_map);
+         !eimap_iter_done(iter);
+         iter = eimap_iter_next(routerlist->extra_info_map, iter)) {
+      const char *key;
+      extrainfo_t *ei;
+      eimap_iter_get(iter, &key, &ei);
+      smartlist_add(signed_descriptors, &ei->cache_info);
+    }
+  } else {
+    SMARTLIST_FOREACH(routerlist->old_routers, signed_descriptor_t *, sd,
+                      smartlist_add(signed_descriptors, sd));
+    SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, ri,
+                      smartlist_add(signed_descriptors, &ri->cache_info));
+  }
+
+  cpuworker_sort_smartlist(signed_descriptors,
+                           _compare_signed_descriptors_by_age);
+  return signed_descriptors;
+}
+
+#ifdef TOR_HAVE_COND
+/** One descriptor in the snapshot that a background store rebuild writes
+ * out. */
+typedef struct store_rebuild_entry_t {
+  /** The descriptor's signed_descriptor_digest, so that we can find it
+   * again once the rebuild is done. */
+  char digest[DIGEST_LEN];
+  /** The annotations and body to write: either in the old mmap, which we
+   * keep around until the rebuild is done, or in <b>copy</b>. */
+  const char *body;
+  size_t len; /**< Length of <b>body</b>. */
+  size_t annotations_len; /**< How much of <b>body</b> is annotations? */
+  /** A copy of the body, for descriptors that we only held in RAM. */
+  char *copy;
+} store_rebuild_entry_t;
+
+/** A rebuild of a desc_store_t that a cpuworker is doing in the
+ * background.  Everything but <b>finished</b> and <b>failed</b> is fixed
+ * once we hand the rebuild to the cpuworker. */
+typedef struct store_rebuild_t {
+  /** The store we're rebuilding, or NULL if we gave up on this rebuild. */
+  desc_store_t *store;
+  /** The file the cpuworker writes the new store to. */
+  char *fname_tmp;
+  int n_entries; /**< How many entries are in <b>entries</b>? */
+  store_rebuild_entry_t *entries; /**< What to write, oldest first. */
+  /** How long was the journal when we took the snapshot?  Everything
+   * before this offset is in the snapshot. */
+  size_t journal_len;
+  /** How many bytes do we expect to write? */
+  size_t total_expected_len;
+
+  tor_mutex_t *lock; /**< Protects <b>finished</b> and <b>failed</b>. */
+  tor_cond_t *cond; /**< Signalled when <b>finished</b> becomes true. */
+  int finished; /**< True once the cpuworker is done with the snapshot. */
+  int failed; /**< True if the cpuworker couldn't write the new store. */
+} store_rebuild_t;
+
+/** Release all storage held by <b>rb</b>. */
+static void
+store_rebuild_free(store_rebuild_t *rb)
+{
+  int i;
+  for (i = 0; i < rb->n_entries; ++i)
+    tor_free(rb->entries[i].copy);
+  tor_free(rb->entries);
+  tor_free(rb->fname_tmp);
+  tor_mutex_free(rb->lock);
+  tor_cond_free(rb->cond);
+  tor_free(rb);
+}
+
+/** Runs in a cpuworker: write every entry of the store_rebuild_t in
+ * <b>arg</b> to its temporary file.  This touches nothing but the
+ * snapshot. */
+static void
+store_rebuild_run(void *arg)
+{
+  store_rebuild_t *rb = arg;
+  smartlist_t *chunk_list = smartlist_create();
+  sized_chunk_t *chunks;
+  int i, failed;
+
+  chunks = tor_malloc(sizeof(sized_chunk_t) * (rb->n_entries+1));
+  for (i = 0; i < rb->n_entries; ++i) {
+    chunks[i].bytes = rb->entries[i].body;
+    chunks[i].len = rb->entries[i].len;
+    smartlist_add(chunk_list, &chunks[i]);
+  }
+  failed = write_chunks_to_file(rb->fname_tmp, chunk_list, 1) < 0;
+  smartlist_free(chunk_list);
+  tor_free(chunks);
+
+  tor_mutex_acquire(rb->lock);
+  rb->failed = failed;
+  rb->finished = 1;
+  tor_cond_signal_all(rb->cond);
+  tor_mutex_release(rb->lock);
+}
+
+/** If a cpuworker is rebuilding <b>store</b>, wait for it to finish and
+ * then throw its work away, so that the caller may safely unmap or rewrite
+ * the store. */
+static void
+store_rebuild_abandon(desc_store_t *store)
+{
+  store_rebuild_t *rb = store->rebuild;
+  if (!rb)
+    return;
+  tor_mutex_acquire(rb->lock);
+  while (!rb->finished)
+    tor_cond_wait(rb->cond, rb->lock);
+  tor_mutex_release(rb->lock);
+  unlink(rb->fname_tmp);
+  /* store_rebuild_reply() frees rb once the cpuworker hands it back. */
+  rb->store = NULL;
+  store->rebuild = NULL;
+}
+
+/** Return the descriptor with signed_descriptor_digest <b>digest</b> in
+ * <b>store</b>, or NULL if we no longer have one. */
+static signed_descriptor_t *
+store_find_descriptor(desc_store_t *store, const char *digest)
+{
+  if (store->type == EXTRAINFO_STORE) {
+    extrainfo_t *ei = eimap_get(routerlist->extra_info_map, digest);
+    return ei ? &ei->cache_info : NULL;
+  } else {
+    return sdmap_get(routerlist->desc_digest_map, digest);
+  }
+}
+
+/** Runs in the main thread once a cpuworker is done with the
+ * store_rebuild_t in <b>arg</b>: move the new store into place, point
+ * every descriptor that's still around at it, and cut the part of the
+ * journal that the new store covers. */
+static void
+store_rebuild_reply(void *arg)
+{
+  store_rebuild_t *rb = arg;
+  desc_store_t *store = rb->store;
+  char *fname = NULL, *journal = NULL;
+  off_t offset = 0;
+  size_t dropped = 0;
+  struct stat st;
+  int i;
+
+  if (!store) {
+    /* Somebody abandoned this rebuild. */
+    goto done;
+  }
+  store->rebuild = NULL;
+  fname = get_datadir_fname(store->fname_base);
+  if (rb->failed) {
+    log_warn(LD_FS, "Error writing router store to disk.");
+    unlink(rb->fname_tmp);
+    goto done;
+  }
+
+  /* Our mmap is now invalid. */
+  if (store->mmap) {
+    tor_munmap_file(store->mmap);
+    store->mmap = NULL;
+  }
+  if (replace_file(rb->fname_tmp, fname)<0) {
+    log_warn(LD_FS, "Error replacing old router store: %s", strerror(errno));
+    /* The old file is still there, so map it again. */
+    store->mmap = tor_mmap_file_flags(fname, TOR_MMAP_RANDOM);
+    goto done;
+  }
+  errno = 0;
+  /* We only look at the bodies we're asked to serve. */
+  store->mmap = tor_mmap_file_flags(fname, TOR_MMAP_RANDOM);
+  if (!store->mmap && (errno != ERANGE || rb->total_expected_len)) {
+    log_warn(LD_FS, "Unable to mmap new descriptor file at '%s'.",fname);
+  }
+
+  log_info(LD_DIR, "Reconstructing pointers into rebuilt %s cache",
+           store->description);
+  for (i = 0; i < rb->n_entries; ++i) {
+    store_rebuild_entry_t *ent = &rb->entries[i];
+    signed_descriptor_t *sd = store_find_descriptor(store, ent->digest);
+    /* Skip descriptors that we dropped since the snapshot, and any that
+     * we dropped and then got again: those are back in the journal. */
+    if (!sd || sd->do_not_cache ||
+        sd->annotations_len != ent->annotations_len ||
+        sd->signed_descriptor_len + sd->annotations_len != ent->len ||
+        (sd->saved_location == SAVED_IN_JOURNAL &&
+         sd->saved_offset >= (off_t)rb->journal_len) ||
+        sd->saved_location == SAVED_NOWHERE) {
+      dropped += ent->len;
+    } else {
+      sd->saved_location = SAVED_IN_CACHE;
+      if (store->mmap) {
+        tor_free(sd->signed_descriptor_body); // sets it to null
+        sd->saved_offset = offset;
+      }
+      signed_descriptor_get_body(sd); /* reconstruct and assert */
+    }
+    offset += ent->len;
+  }
+
+  /* Keep whatever reached the journal after the snapshot. */
+  tor_free(fname);
+  fname = get_datadir_fname_suffix(store->fname_base, ".new");
+  if (store->journal_len > rb->journal_len)
+    journal = read_file_to_str(fname, RFTS_BIN|RFTS_IGNORE_MISSING, &st);
+  if (journal && (size_t)st.st_size == store->journal_len) {
+    write_bytes_to_file(fname, journal + rb->journal_len,
+                        store->journal_len - rb->journal_len, 1);
+  } else {
+    if (store->journal_len > rb->journal_len)
+      log_warn(LD_FS, "Couldn't read back the end of %s; clearing it.",
+               fname);
+    write_str_to_file(fname, "", 1);
+    store->journal_len = rb->journal_len;
+  }
+  if (store->type == EXTRAINFO_STORE) {
+    EIMAP_FOREACH(routerlist->extra_info_map, k, ei) {
+      (void)k;
+      if (ei->cache_info.saved_location == SAVED_IN_JOURNAL)
+        ei->cache_info.saved_offset -= rb->journal_len;
+    } DIGESTMAP_FOREACH_END;
+  } else {
+    SDMAP_FOREACH(routerlist->desc_digest_map, k, sd) {
+      (void)k;
+      if (sd->saved_location == SAVED_IN_JOURNAL)
+        sd->saved_offset -= rb->journal_len;
+    } DIGESTMAP_FOREACH_END;
+  }
+
+  store->store_len = (size_t) offset;
+  store->journal_len -= rb->journal_len;
+  store->bytes_dropped = dropped;
+  log_info(LD_DIR, "Done rebuilding %s cache in the background.",
+           store->description);
+ done:
+  tor_free(fname);
+  tor_free(journal);
+  store_rebuild_free(rb);
+}
+
+/** Start a rebuild of <b>store</b> from the descriptors in
+ * <b>signed_descriptors</b>, oldest first, on a cpuworker.  We copy out
+ * every body that isn't in the store's mmap, so the cpuworker never looks
+ * at anything the main thread can change.  Return 0 on success, or -1 if
+ * no cpuworker can take the job. */
+static int
+router_rebuild_store_in_background(desc_store_t *store,
+                                   smartlist_t *signed_descriptors)
+{
+  store_rebuild_t *rb;
+  int n = 0;
+
+  rb = tor_malloc_zero(sizeof(store_rebuild_t));
+  rb->entries = tor_malloc_zero(sizeof(store_rebuild_entry_t) *
+                                (smartlist_len(signed_descriptors)+1));
+  SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
+    store_rebuild_entry_t *ent;
+    const char *body;
+    if (sd->do_not_cache)
+      continue;
+    body = signed_descriptor_get_body_impl(sd, 1);
+    ent = &rb->entries[n++];
+    memcpy(ent->digest, sd->signed_descriptor_digest, DIGEST_LEN);
+    ent->len = sd->signed_descriptor_len + sd->annotations_len;
+    ent->annotations_len = sd->annotations_len;
+    if (sd->saved_location == SAVED_IN_CACHE && store->mmap) {
+      ent->body = body;
+    } else {
+      ent->copy = tor_memdup(body, ent->len);
+      ent->body = ent->copy;
+    }
+    rb->total_expected_len += ent->len;
+  } SMARTLIST_FOREACH_END(sd);
+  rb->n_entries = n;
+  rb->journal_len = store->journal_len;
+  rb->fname_tmp = get_datadir_fname_suffix(store->fname_base, ".rebuild");
+  rb->lock = tor_mutex_new();
+  rb->cond = tor_cond_new();
+  rb->store = store;
+
+  if (cpuworker_queue_work(store_rebuild_run, store_rebuild_reply, rb) < 0) {
+    store_rebuild_free(rb);
+    return -1;
+  }
+  store->rebuild = rb;
+  log_info(LD_DIR, "Rebuilding %s cache in the background (%d descriptors)",
+           store->description, n);
+  return 0;
+}
+#else
+/** Without condition variables, we never rebuild in the background. */
+static void
+store_rebuild_abandon(desc_store_t *store)
+{
+  (void)store;
+}
+
+/** Without condition variables, we can't rebuild in the background. */
+static int
+router_rebuild_store_in_background(desc_store_t *store,
+                                   smartlist_t *signed_descriptors)
+{
+  (void)store;
+  (void)signed_descriptors;
+  return -1;
+}
+#endif
+
 #define RRS_FORCE 1
 #define RRS_DONT_REMOVE_OLD 2
 
@@ -679,6 +1056,14 @@ router_rebuild_store(int flags, desc_store_t *store)
     r = 0;
     goto done;
   }
+  if (store->rebuild) {
+    if (!force) {
+      /* A cpuworker is already on it. */
+      r = 0;
+      goto done;
+    }
+    store_rebuild_abandon(store);
+  }
 
   if (store->type == EXTRAINFO_STORE)
     had_any = !eimap_isempty(routerlist->extra_info_map);
@@ -697,26 +1082,15 @@ router_rebuild_store(int flags, desc_store_t *store)
 
   chunk_list = smartlist_create();
 
-  /* We sort the routers by age to enhance locality on disk. */
-  signed_descriptors = smartlist_create();
-  if (store->type == EXTRAINFO_STORE) {
-    eimap_iter_t *iter;
-    for (iter = eimap_iter_init(routerlist->extra_info_map);
-         !eimap_iter_done(iter);
-         iter = eimap_iter_next(routerlist->extra_info_map, iter)) {
-      const char *key;
-      extrainfo_t *ei;
-      eimap_iter_get(iter, &key, &ei);
-      smartlist_add(signed_descriptors, &ei->cache_info);
-    }
-  } else {
-    SMARTLIST_FOREACH(routerlist->old_routers, signed_descriptor_t *, sd,
-                      smartlist_add(signed_descriptors, sd));
-    SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, ri,
-                      smartlist_add(signed_descriptors, &ri->cache_info));
-  }
+  signed_descriptors = store_get_descriptors_by_age(store);
 
-  smartlist_sort(signed_descriptors, _compare_signed_descriptors_by_age);
+  /* Unless we were told to rebuild right away, let a cpuworker write the
+   * new store while we keep serving from the old one. */
+  if (!force &&
+      router_rebuild_store_in_background(store, signed_descriptors) == 0) {
+    r = 0;
+    goto done;
+  }
 
   /* Now, add the appropriate members to chunk_list */
   SMARTLIST_FOREACH(signed_descriptors, signed_descriptor_t *, sd,
@@ -755,7 +1129,8 @@ router_rebuild_store(int flags, desc_store_t *store)
   }
 
   errno = 0;
-  store->mmap = tor_mmap_file(fname);
+  /* We only look at the bodies we're asked to serve. */
+  store->mmap = tor_mmap_file_flags(fname, TOR_MMAP_RANDOM);
   if (! store->mmap) {
     if (errno == ERANGE) {
       /* empty store.*/
@@ -825,6 +1200,7 @@ router_reload_router_list_impl(desc_store_t *store)
   if (store->fname_alt_base)
     altname = get_datadir_fname(store->fname_alt_base);
 
+  store_rebuild_abandon(store);
   if (store->mmap) /* get rid of it first */
     tor_munmap_file(store->mmap);
   store->mmap = NULL;
@@ -1313,8 +1689,10 @@ static void
 mark_all_trusteddirservers_up(void)
 {
   SMARTLIST_FOREACH(nodelist_get_list(), node_t *, node, {
-       if (router_digest_is_trusted_dir(node->identity))
+       if (router_digest_is_trusted_dir(node->identity)) {
          node->is_running = 1;
+         nodelist_hot_fields_update_node(node);
+       }
     });
   if (trusted_dir_servers) {
     SMARTLIST_FOREACH(trusted_dir_servers, trusted_dir_server_t *, dir,
@@ -1387,15 +1765,26 @@ nodelist_add_node_and_family(smartlist_t *sl, const node_t *node)
 
   /* First, add any nodes with similar network addresses. */
   if (options->EnforceDistinctSubnets) {
+    const node_hot_fields_t *hot = nodelist_get_hot_fields();
     tor_addr_t node_addr;
     node_get_addr(node, &node_addr);
 
-    SMARTLIST_FOREACH_BEGIN(all_nodes, const node_t *, node2) {
-      tor_addr_t a;
-      node_get_addr(node2, &a);
-      if (addrs_in_same_network_family(&a, &node_addr))
-        smartlist_add(sl, (void*)node2);
-    } SMARTLIST_FOREACH_END(node2);
+    if (hot && tor_addr_family(&node_addr) == AF_INET) {
+      /* Compare /16s straight out of the hot fields. */
+      uint16_t net16 = (uint16_t)(tor_addr_to_ipv4h(&node_addr) >> 16);
+      int i;
+      for (i = 0; i < hot->n; ++i) {
+        if (hot->net16[i] == net16 && (hot->flags[i] & NODE_HOT_HAS_IPV4))
+          smartlist_add(sl, smartlist_get(all_nodes, i));
+      }
+    } else {
+      SMARTLIST_FOREACH_BEGIN(all_nodes, const node_t *, node2) {
+        tor_addr_t a;
+        node_get_addr(node2, &a);
+        if (addrs_in_same_network_family(&a, &node_addr))
+          smartlist_add(sl, (void*)node2);
+      } SMARTLIST_FOREACH_END(node2);
+    }
   }
 
   /* Now, add all nodes in the declared_family of this node, if they
@@ -1535,6 +1924,28 @@ router_add_running_nodes_to_smartlist(smartlist_t *sl, int allow_invalid,
                                       int need_uptime, int need_capacity,
                                       int need_guard, int need_desc)
 { /* XXXX MOVE */
+  const node_hot_fields_t *hot = nodelist_get_hot_fields();
+  if (hot) {
+    smartlist_t *nodes = nodelist_get_list();
+    uint16_t mask = NODE_HOT_RUNNING | NODE_HOT_GENERAL;
+    int i;
+    if (!allow_invalid)
+      mask |= NODE_HOT_VALID;
+    if (need_desc)
+      mask |= NODE_HOT_HAS_DESC;
+    if (need_uptime)
+      mask |= NODE_HOT_STABLE;
+    if (need_capacity)
+      mask |= NODE_HOT_FAST;
+    if (need_guard)
+      mask |= NODE_HOT_GUARD;
+    for (i = 0; i < hot->n; ++i) {
+      if ((hot->flags[i] & mask) == mask)
+        smartlist_add(sl, smartlist_get(nodes, i));
+    }
+    return;
+  }
+
   SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), const node_t *, node) {
     if (!node->is_running ||
         (!node->is_valid && !allow_invalid))
@@ -1674,6 +2085,328 @@ kb_to_bytes(uint32_t bw)
   return (bw > (INT32_MAX/1000)) ? INT32_MAX : bw*1000;
 }
 
+/** The consensus bandwidth weights for one bandwidth_weight_rule_t, as
+ * fractions: how much to count guards, middles, exits, and guards that are
+ * also exits ("d"), and how much more to discount each of those when it is
+ * also a directory cache. */
+typedef struct bw_weights_t {
+  double Wg, Wm, We, Wd;
+  double Wgb, Wmb, Web, Wdb;
+} bw_weights_t;
+
+/** Set *<b>w</b> to the consensus bandwidth weights for <b>rule</b>.
+ * Return 0 on success, or -1 if the consensus doesn't give us usable
+ * weights, in which case we should use the old selection algorithm. */
+static int
+bw_weights_for_rule(bandwidth_weight_rule_t rule, bw_weights_t *w)
+{
+  int64_t weight_scale = circuit_build_times_get_bw_scale(NULL);
+
+  w->Wg = w->Wm = w->We = w->Wd = -1;
+  w->Wgb = w->Wmb = w->Web = w->Wdb = -1;
+
+  if (rule == WEIGHT_FOR_GUARD) {
+    w->Wg = networkstatus_get_bw_weight(NULL, "Wgg", -1);
+    w->Wm = networkstatus_get_bw_weight(NULL, "Wgm", -1); /* Bridges */
+    w->We = 0;
+    w->Wd = networkstatus_get_bw_weight(NULL, "Wgd", -1);
+
+    w->Wgb = networkstatus_get_bw_weight(NULL, "Wgb", -1);
+    w->Wmb = networkstatus_get_bw_weight(NULL, "Wmb", -1);
+    w->Web = networkstatus_get_bw_weight(NULL, "Web", -1);
+    w->Wdb = networkstatus_get_bw_weight(NULL, "Wdb", -1);
+  } else if (rule == WEIGHT_FOR_MID) {
+    w->Wg = networkstatus_get_bw_weight(NULL, "Wmg", -1);
+    w->Wm = networkstatus_get_bw_weight(NULL, "Wmm", -1);
+    w->We = networkstatus_get_bw_weight(NULL, "Wme", -1);
+    w->Wd = networkstatus_get_bw_weight(NULL, "Wmd", -1);
+
+    w->Wgb = networkstatus_get_bw_weight(NULL, "Wgb", -1);
+    w->Wmb = networkstatus_get_bw_weight(NULL, "Wmb", -1);
+    w->Web = networkstatus_get_bw_weight(NULL, "Web", -1);
+    w->Wdb = networkstatus_get_bw_weight(NULL, "Wdb", -1);
+  } else if (rule == WEIGHT_FOR_EXIT) {
+    // Guards CAN be exits if they have weird exit policies
+    // They are d then I guess...
+    w->We = networkstatus_get_bw_weight(NULL, "Wee", -1);
+    w->Wm = networkstatus_get_bw_weight(NULL, "Wem", -1); /* Odd exit pols */
+    w->Wd = networkstatus_get_bw_weight(NULL, "Wed", -1);
+    w->Wg = networkstatus_get_bw_weight(NULL, "Weg", -1); /* Odd exit pols */
+
+    w->Wgb = networkstatus_get_bw_weight(NULL, "Wgb", -1);
+    w->Wmb = networkstatus_get_bw_weight(NULL, "Wmb", -1);
+    w->Web = networkstatus_get_bw_weight(NULL, "Web", -1);
+    w->Wdb = networkstatus_get_bw_weight(NULL, "Wdb", -1);
+  } else if (rule == WEIGHT_FOR_DIR) {
+    w->We = networkstatus_get_bw_weight(NULL, "Wbe", -1);
+    w->Wm = networkstatus_get_bw_weight(NULL, "Wbm", -1);
+    w->Wd = networkstatus_get_bw_weight(NULL, "Wbd", -1);
+    w->Wg = networkstatus_get_bw_weight(NULL, "Wbg", -1);
+
+    w->Wgb = w->Wmb = w->Web = w->Wdb = weight_scale;
+  } else if (rule == NO_WEIGHTING) {
+    w->Wg = w->Wm = w->We = w->Wd = weight_scale;
+    w->Wgb = w->Wmb = w->Web = w->Wdb = weight_scale;
+  }
+
+  if (w->Wg < 0 || w->Wm < 0 || w->We < 0 || w->Wd < 0 || w->Wgb < 0 ||
+      w->Wmb < 0 || w->Wdb < 0 || w->Web < 0) {
+    log_debug(LD_CIRC,
+              "Got negative bandwidth weights. Defaulting to old selection"
+              " algorithm.");
+    return -1; // Use old algorithm.
+  }
+
+  w->Wg /= weight_scale;
+  w->Wm /= weight_scale;
+  w->We /= weight_scale;
+  w->Wd /= weight_scale;
+
+  w->Wgb /= weight_scale;
+  w->Wmb /= weight_scale;
+  w->Web /= weight_scale;
+  w->Wdb /= weight_scale;
+  return 0;
+}
+
+/** Return how much bandwidth to count under the weights <b>w</b> for a
+ * node that is or isn't a guard, an exit, and a directory cache. */
+static INLINE double
+bw_weight_for_roles(int is_guard, int is_exit, int is_dir,
+                    const bw_weights_t *w)
+{
+  if (is_guard && is_exit) {
+    return (is_dir ? w->Wdb*w->Wd : w->Wd);
+  } else if (is_guard) {
+    return (is_dir ? w->Wgb*w->Wg : w->Wg);
+  } else if (is_exit) {
+    return (is_dir ? w->Web*w->We : w->We);
+  } else { // middle
+    return (is_dir ? w->Wmb*w->Wm : w->Wm);
+  }
+}
+
+/** Return how much of <b>node</b>'s bandwidth to count under the weights
+ * <b>w</b>. */
+static INLINE double
+node_bw_weight(const node_t *node, const bw_weights_t *w)
+{
+  return bw_weight_for_roles(node->is_possible_guard,
+                             node->is_exit && ! node->is_bad_exit,
+                             node_is_dir(node), w);
+}
+
+/** As node_bw_weight(), for a node whose NODE_HOT_* flags are
+ * <b>flags</b>. */
+static INLINE double
+hot_flags_bw_weight(uint16_t flags, const bw_weights_t *w)
+{
+  return bw_weight_for_roles(
+                 (flags & NODE_HOT_GUARD) != 0,
+                 (flags & (NODE_HOT_EXIT|NODE_HOT_BAD_EXIT)) == NODE_HOT_EXIT,
+                 (flags & NODE_HOT_DIR) != 0, w);
+}
+
+/** Return the index of <b>node</b> in <b>hot</b>, or -1 if <b>hot</b> is
+ * NULL or doesn't cover <b>node</b>. */
+static INLINE int
+hot_fields_idx(const node_hot_fields_t *hot, const node_t *node)
+{
+  int idx = node->nodelist_idx;
+  if (!hot || idx < 0 || idx >= hot->n ||
+      smartlist_get(nodelist_get_list(), idx) != node)
+    return -1;
+  return idx;
+}
+
+/** Fill in the <b>n</b>-entry Walker alias table <b>prob</b> and
+ * <b>alias</b> for choosing index i with probability proportional to
+ * <b>weights</b>[i], whose sum must be positive: pick i uniformly, then
+ * keep it with probability prob[i], or else take alias[i]. */
+void
+bw_alias_table_build(const double *weights, int n,
+                     double *prob, int *alias)
+{
+  double *scaled = tor_malloc(sizeof(double)*n);
+  int *small = tor_malloc(sizeof(int)*n), *large = tor_malloc(sizeof(int)*n);
+  int n_small = 0, n_large = 0, i;
+  double total = 0;
+
+  for (i = 0; i < n; ++i)
+    total += weights[i];
+  tor_assert(total > 0);
+  for (i = 0; i < n; ++i) {
+    scaled[i] = weights[i] * n / total;
+    alias[i] = i;
+    if (scaled[i] < 1.0)
+      small[n_small++] = i;
+    else
+      large[n_large++] = i;
+  }
+  /* Pair each under-full slot with an over-full one that tops it up. */
+  while (n_small && n_large) {
+    int s = small[--n_small], l = large[n_large-1];
+    prob[s] = scaled[s];
+    alias[s] = l;
+    scaled[l] -= 1.0 - scaled[s];
+    if (scaled[l] < 1.0) {
+      --n_large;
+      small[n_small++] = l;
+    }
+  }
+  /* Whatever is left is full, up to round-off error. */
+  while (n_large)
+    prob[large[--n_large]] = 1.0;
+  while (n_small)
+    prob[small[--n_small]] = 1.0;
+
+  tor_free(scaled);
+  tor_free(small);
+  tor_free(large);
+}
+
+/** A Walker alias table for choosing among all the nodes in the consensus,
+ * weighted by bandwidth for one rule, in constant time. */
+typedef struct bw_alias_table_t {
+  /** The nodelist generation this table was built for, or 0 if never. */
+  unsigned generation;
+  /** True iff the consensus let us build this table. */
+  int usable;
+  /** How many nodes are in the table? */
+  int n;
+  /** The nodes in the table; only valid while generation is current. */
+  const node_t **nodes;
+  double *prob; /**< Walker probabilities for each slot. */
+  int *alias; /**< Walker alias for each slot. */
+} bw_alias_table_t;
+
+/** How many rules do we cache alias tables for? */
+#define N_BW_ALIAS_TABLES 3
+/** Cached alias tables for WEIGHT_FOR_GUARD, WEIGHT_FOR_MID and
+ * WEIGHT_FOR_EXIT: the rules we use for every hop of every circuit. */
+static bw_alias_table_t bw_alias_tables[N_BW_ALIAS_TABLES];
+
+/** Return the slot in bw_alias_tables for <b>rule</b>, or -1 if we don't
+ * cache a table for that rule. */
+static int
+bw_alias_table_idx(bandwidth_weight_rule_t rule)
+{
+  switch (rule) {
+    case WEIGHT_FOR_GUARD: return 0;
+    case WEIGHT_FOR_MID: return 1;
+    case WEIGHT_FOR_EXIT: return 2;
+    default: return -1;
+  }
+}
+
+/** Release all storage held by the alias table <b>t</b>. */
+static void
+bw_alias_table_clear(bw_alias_table_t *t)
+{
+  tor_free(t->nodes);
+  tor_free(t->prob);
+  tor_free(t->alias);
+  memset(t, 0, sizeof(*t));
+}
+
+/** Rebuild <b>t</b> for <b>rule</b> from the current nodelist. */
+static void
+bw_alias_table_rebuild(bw_alias_table_t *t, bandwidth_weight_rule_t rule)
+{
+  smartlist_t *nodes = nodelist_get_list();
+  const node_hot_fields_t *hot = nodelist_get_hot_fields();
+  bw_weights_t w;
+  double *weights = NULL, total = 0;
+  int n = 0, i;
+
+  bw_alias_table_clear(t);
+  t->generation = nodelist_get_generation();
+  if (!hot || !hot->n || bw_weights_for_rule(rule, &w) < 0)
+    return;
+
+  t->nodes = tor_malloc(sizeof(node_t *)*hot->n);
+  weights = tor_malloc(sizeof(double)*hot->n);
+  for (i = 0; i < hot->n; ++i) {
+    double bw;
+    uint16_t flags = hot->flags[i];
+    if (!(flags & NODE_HOT_IN_CONSENSUS))
+      continue;
+    if (!(flags & NODE_HOT_HAS_BW))
+      goto done; /* Let the slow path complain about this. */
+    bw = hot_flags_bw_weight(flags, &w) * kb_to_bytes(hot->bandwidth[i]);
+    if (bw <= 0)
+      continue;
+    t->nodes[n] = smartlist_get(nodes, i);
+    weights[n++] = bw;
+    total += bw;
+  }
+  if (total <= 0)
+    goto done;
+
+  t->prob = tor_malloc(sizeof(double)*n);
+  t->alias = tor_malloc(sizeof(int)*n);
+  bw_alias_table_build(weights, n, t->prob, t->alias);
+  t->n = n;
+  t->usable = 1;
+  log_debug(LD_CIRC, "Rebuilt node selection table for rule %s with %d "
+            "nodes.", bandwidth_weight_rule_to_string(rule), n);
+
+ done:
+  tor_free(weights);
+}
+
+/** Give up on the alias table for a choice after this many draws that
+ * weren't in the list we were choosing from. */
+#define BW_ALIAS_MAX_TRIES 16
+
+/** Helper for smartlist_choose_node_by_bandwidth_weights(): try to choose a
+ * node from <b>sl</b> for <b>rule</b> using a cached alias table over the
+ * whole consensus, redrawing whenever we get a node not in <b>sl</b>.
+ * That gives exactly the same distribution as the linear scan.  Return
+ * NULL if the caller should do the linear scan instead. */
+static const node_t *
+smartlist_choose_node_by_alias_table(smartlist_t *sl,
+                                     bandwidth_weight_rule_t rule)
+{
+  bw_alias_table_t *t;
+  bitarray_t *in_sl;
+  const node_t *chosen = NULL;
+  int idx = bw_alias_table_idx(rule), i;
+
+  /* Authorities set node flags themselves; don't trust the cache there. */
+  if (idx < 0 || authdir_mode(get_options()))
+    return NULL;
+  t = &bw_alias_tables[idx];
+  if (t->generation != nodelist_get_generation())
+    bw_alias_table_rebuild(t, rule);
+  /* If sl is a small part of the consensus, we'd mostly draw misses. */
+  if (!t->usable || smartlist_len(sl)*4 < t->n)
+    return NULL;
+
+  in_sl = bitarray_init_zero(smartlist_len(nodelist_get_list()));
+  SMARTLIST_FOREACH_BEGIN(sl, const node_t *, node) {
+    if (!node->rs || node->nodelist_idx < 0) {
+      /* Bridges and other nodes outside the consensus aren't in the
+       * table. */
+      bitarray_free(in_sl);
+      return NULL;
+    }
+    bitarray_set(in_sl, node->nodelist_idx);
+  } SMARTLIST_FOREACH_END(node);
+
+  for (i = 0; i < BW_ALIAS_MAX_TRIES; ++i) {
+    int slot = crypto_rand_int(t->n);
+    const node_t *node = (crypto_rand_double() < t->prob[slot]) ?
+      t->nodes[slot] : t->nodes[t->alias[slot]];
+    if (bitarray_is_set(in_sl, node->nodelist_idx)) {
+      chosen = node;
+      break;
+    }
+  }
+  bitarray_free(in_sl);
+  return chosen;
+}
+
 /** Helper function:
  * choose a random element of smartlist <b>sl</b> of nodes, weighted by
  * the advertised bandwidth of each element using the consensus
@@ -1692,15 +2425,15 @@ static const node_t *
 smartlist_choose_node_by_bandwidth_weights(smartlist_t *sl,
                                            bandwidth_weight_rule_t rule)
 {
-  int64_t weight_scale;
   int64_t rand_bw;
-  double Wg = -1, Wm = -1, We = -1, Wd = -1;
-  double Wgb = -1, Wmb = -1, Web = -1, Wdb = -1;
+  bw_weights_t w;
   double weighted_bw = 0;
   double *bandwidths;
   double tmp = 0;
   unsigned int i;
   int have_unknown = 0; /* true iff sl contains element not in consensus. */
+  const node_t *chosen;
+  const node_hot_fields_t *hot;
 
   /* Can't choose exit and guard at same time */
   tor_assert(rule == NO_WEIGHTING ||
@@ -1717,79 +2450,30 @@ smartlist_choose_node_by_bandwidth_weights(smartlist_t *sl,
     return NULL;
   }
 
-  weight_scale = circuit_build_times_get_bw_scale(NULL);
-
-  if (rule == WEIGHT_FOR_GUARD) {
-    Wg = networkstatus_get_bw_weight(NULL, "Wgg", -1);
-    Wm = networkstatus_get_bw_weight(NULL, "Wgm", -1); /* Bridges */
-    We = 0;
-    Wd = networkstatus_get_bw_weight(NULL, "Wgd", -1);
-
-    Wgb = networkstatus_get_bw_weight(NULL, "Wgb", -1);
-    Wmb = networkstatus_get_bw_weight(NULL, "Wmb", -1);
-    Web = networkstatus_get_bw_weight(NULL, "Web", -1);
-    Wdb = networkstatus_get_bw_weight(NULL, "Wdb", -1);
-  } else if (rule == WEIGHT_FOR_MID) {
-    Wg = networkstatus_get_bw_weight(NULL, "Wmg", -1);
-    Wm = networkstatus_get_bw_weight(NULL, "Wmm", -1);
-    We = networkstatus_get_bw_weight(NULL, "Wme", -1);
-    Wd = networkstatus_get_bw_weight(NULL, "Wmd", -1);
-
-    Wgb = networkstatus_get_bw_weight(NULL, "Wgb", -1);
-    Wmb = networkstatus_get_bw_weight(NULL, "Wmb", -1);
-    Web = networkstatus_get_bw_weight(NULL, "Web", -1);
-    Wdb = networkstatus_get_bw_weight(NULL, "Wdb", -1);
-  } else if (rule == WEIGHT_FOR_EXIT) {
-    // Guards CAN be exits if they have weird exit policies
-    // They are d then I guess...
-    We = networkstatus_get_bw_weight(NULL, "Wee", -1);
-    Wm = networkstatus_get_bw_weight(NULL, "Wem", -1); /* Odd exit policies */
-    Wd = networkstatus_get_bw_weight(NULL, "Wed", -1);
-    Wg = networkstatus_get_bw_weight(NULL, "Weg", -1); /* Odd exit policies */
-
-    Wgb = networkstatus_get_bw_weight(NULL, "Wgb", -1);
-    Wmb = networkstatus_get_bw_weight(NULL, "Wmb", -1);
-    Web = networkstatus_get_bw_weight(NULL, "Web", -1);
-    Wdb = networkstatus_get_bw_weight(NULL, "Wdb", -1);
-  } else if (rule == WEIGHT_FOR_DIR) {
-    We = networkstatus_get_bw_weight(NULL, "Wbe", -1);
-    Wm = networkstatus_get_bw_weight(NULL, "Wbm", -1);
-    Wd = networkstatus_get_bw_weight(NULL, "Wbd", -1);
-    Wg = networkstatus_get_bw_weight(NULL, "Wbg", -1);
-
-    Wgb = Wmb = Web = Wdb = weight_scale;
-  } else if (rule == NO_WEIGHTING) {
-    Wg = Wm = We = Wd = weight_scale;
-    Wgb = Wmb = Web = Wdb = weight_scale;
-  }
+  if ((chosen = smartlist_choose_node_by_alias_table(sl, rule)))
+    return chosen;
 
-  if (Wg < 0 || Wm < 0 || We < 0 || Wd < 0 || Wgb < 0 || Wmb < 0 || Wdb < 0
-      || Web < 0) {
-    log_debug(LD_CIRC,
-              "Got negative bandwidth weights. Defaulting to old selection"
-              " algorithm.");
+  if (bw_weights_for_rule(rule, &w) < 0)
     return NULL; // Use old algorithm.
-  }
-
-  Wg /= weight_scale;
-  Wm /= weight_scale;
-  We /= weight_scale;
-  Wd /= weight_scale;
-
-  Wgb /= weight_scale;
-  Wmb /= weight_scale;
-  Web /= weight_scale;
-  Wdb /= weight_scale;
 
   bandwidths = tor_malloc_zero(sizeof(double)*smartlist_len(sl));
+  hot = nodelist_get_hot_fields();
 
   // Cycle through smartlist and total the bandwidth.
   SMARTLIST_FOREACH_BEGIN(sl, const node_t *, node) {
-    int is_exit = 0, is_guard = 0, is_dir = 0, this_bw = 0, is_me = 0;
-    double weight = 1;
-    is_exit = node->is_exit && ! node->is_bad_exit;
-    is_guard = node->is_possible_guard;
-    is_dir = node_is_dir(node);
+    int this_bw = 0, is_me = 0;
+    double weight;
+    int idx = hot_fields_idx(hot, node);
+    if (idx >= 0 && (hot->flags[idx] & NODE_HOT_HAS_BW)) {
+      /* The common case: read everything from the hot fields. */
+      this_bw = kb_to_bytes(hot->bandwidth[idx]);
+      weight = hot_flags_bw_weight(hot->flags[idx], &w);
+      bandwidths[node_sl_idx] = weight*this_bw;
+      weighted_bw += weight*this_bw;
+      if (router_digest_is_me(node->identity))
+        sl_last_weighted_bw_of_me = weight*this_bw;
+      continue;
+    }
     if (node->rs) {
       if (!node->rs->has_bandwidth) {
         tor_free(bandwidths);
@@ -1811,15 +2495,7 @@ smartlist_choose_node_by_bandwidth_weights(smartlist_t *sl,
     }
     is_me = router_digest_is_me(node->identity);
 
-    if (is_guard && is_exit) {
-      weight = (is_dir ? Wdb*Wd : Wd);
-    } else if (is_guard) {
-      weight = (is_dir ? Wgb*Wg : Wg);
-    } else if (is_exit) {
-      weight = (is_dir ? Web*We : We);
-    } else { // middle
-      weight = (is_dir ? Wmb*Wm : Wm);
-    }
+    weight = node_bw_weight(node, &w);
 
     bandwidths[node_sl_idx] = weight*this_bw;
     weighted_bw += weight*this_bw;
@@ -1833,7 +2509,7 @@ smartlist_choose_node_by_bandwidth_weights(smartlist_t *sl,
   log_debug(LD_CIRC, "Choosing node for rule %s based on weights "
             "Wg=%f Wm=%f We=%f Wd=%f with total bw %f",
             bandwidth_weight_rule_to_string(rule),
-            Wg, Wm, We, Wd, weighted_bw);
+            w.Wg, w.Wm, w.We, w.Wd, weighted_bw);
 
   /* If there is no bandwidth, choose at random */
   if (DBL_TO_U64(weighted_bw) == 0) {
@@ -2135,6 +2811,49 @@ node_sl_choose_by_bandwidth(smartlist_t *sl,
   }
 }
 
+/** Add to <b>sl</b> every running node that router_choose_random_node()
+ * would consider for <b>flags</b>, leaving out nodes in
+ * <b>excludedsmartlist</b> or <b>excludedset</b>, this router, its family,
+ * and (if the user wants) relays that allow single hop exits.  Only the
+ * CRN_NEED_* and CRN_ALLOW_INVALID flags matter here.
+ */
+void
+router_add_random_node_candidates(smartlist_t *sl,
+                                  smartlist_t *excludedsmartlist,
+                                  routerset_t *excludedset,
+                                  router_crn_flags_t flags)
+{
+  const int need_uptime = (flags & CRN_NEED_UPTIME) != 0;
+  const int need_capacity = (flags & CRN_NEED_CAPACITY) != 0;
+  const int need_guard = (flags & CRN_NEED_GUARD) != 0;
+  const int allow_invalid = (flags & CRN_ALLOW_INVALID) != 0;
+  const int need_desc = (flags & CRN_NEED_DESC) != 0;
+  SMARTLIST_DECLARE_LOCAL(excludednodes, 16);
+  const routerinfo_t *r;
+
+  /* Exclude relays that allow single hop exit circuits, if the user
+   * wants to (such relays might be risky) */
+  if (get_options()->ExcludeSingleHopRelays) {
+    SMARTLIST_FOREACH(nodelist_get_list(), node_t *, node,
+      if (node_allows_single_hop_exits(node)) {
+        smartlist_add(excludednodes, node);
+      });
+  }
+
+  if ((r = routerlist_find_my_routerinfo()))
+    routerlist_add_node_and_family(excludednodes, r);
+
+  router_add_running_nodes_to_smartlist(sl, allow_invalid,
+                                        need_uptime, need_capacity,
+                                        need_guard, need_desc);
+  smartlist_subtract(sl,excludednodes);
+  if (excludedsmartlist)
+    smartlist_subtract(sl,excludedsmartlist);
+  if (excludedset)
+    routerset_subtract_nodes(sl,excludedset);
+  smartlist_free_local(excludednodes);
+}
+
 /** Return a random running node from the nodelist. Never
  * pick a node that is in
  * <b>excludedsmartlist</b>, or which matches <b>excludedset</b>,
@@ -2161,40 +2880,19 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
   const int need_uptime = (flags & CRN_NEED_UPTIME) != 0;
   const int need_capacity = (flags & CRN_NEED_CAPACITY) != 0;
   const int need_guard = (flags & CRN_NEED_GUARD) != 0;
-  const int allow_invalid = (flags & CRN_ALLOW_INVALID) != 0;
   const int weight_for_exit = (flags & CRN_WEIGHT_AS_EXIT) != 0;
-  const int need_desc = (flags & CRN_NEED_DESC) != 0;
 
-  smartlist_t *sl=smartlist_create(),
-    *excludednodes=smartlist_create();
+  smartlist_t *sl=smartlist_create_with_capacity(
+                                     smartlist_len(nodelist_get_list()));
   const node_t *choice = NULL;
-  const routerinfo_t *r;
   bandwidth_weight_rule_t rule;
 
   tor_assert(!(weight_for_exit && need_guard));
   rule = weight_for_exit ? WEIGHT_FOR_EXIT :
     (need_guard ? WEIGHT_FOR_GUARD : WEIGHT_FOR_MID);
 
-  /* Exclude relays that allow single hop exit circuits, if the user
-   * wants to (such relays might be risky) */
-  if (get_options()->ExcludeSingleHopRelays) {
-    SMARTLIST_FOREACH(nodelist_get_list(), node_t *, node,
-      if (node_allows_single_hop_exits(node)) {
-        smartlist_add(excludednodes, node);
-      });
-  }
-
-  if ((r = routerlist_find_my_routerinfo()))
-    routerlist_add_node_and_family(excludednodes, r);
-
-  router_add_running_nodes_to_smartlist(sl, allow_invalid,
-                                        need_uptime, need_capacity,
-                                        need_guard, need_desc);
-  smartlist_subtract(sl,excludednodes);
-  if (excludedsmartlist)
-    smartlist_subtract(sl,excludedsmartlist);
-  if (excludedset)
-    routerset_subtract_nodes(sl,excludedset);
+  router_add_random_node_candidates(sl, excludedsmartlist, excludedset,
+                                    flags);
 
   // Always weight by bandwidth
   choice = node_sl_choose_by_bandwidth(sl, rule);
@@ -2212,7 +2910,6 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
     choice = router_choose_random_node(
                      excludedsmartlist, excludedset, flags);
   }
-  smartlist_free(excludednodes);
   if (!choice) {
     log_warn(LD_CIRC,
              "No available nodes when trying to choose node. Failing.");
@@ -2547,6 +3244,8 @@ router_get_by_descriptor_digest(const char *digest)
   tor_assert(digest);
 
   if (!routerlist) return NULL;
+  if (!desc_digest_map_may_contain(routerlist, digest))
+    return NULL;
 
   return sdmap_get(routerlist->desc_digest_map, digest);
 }
@@ -2659,6 +3358,7 @@ router_get_routerlist(void)
     routerlist = tor_malloc_zero(sizeof(routerlist_t));
     routerlist->routers = smartlist_create();
     routerlist->old_routers = smartlist_create();
+    routerlist->old_routers_by_id = digestmap_new();
     routerlist->identity_map = rimap_new();
     routerlist->desc_digest_map = sdmap_new();
     routerlist->desc_by_eid_map = sdmap_new();
@@ -2697,6 +3397,7 @@ routerinfo_free(routerinfo_t *router)
     SMARTLIST_FOREACH(router->declared_family, char *, s, tor_free(s));
     smartlist_free(router->declared_family);
   }
+  compiled_policy_release(router->exit_policy_compiled);
   addr_policy_list_free(router->exit_policy);
 
   memset(router, 77, sizeof(routerinfo_t));
@@ -2704,6 +3405,106 @@ routerinfo_free(routerinfo_t *router)
   tor_free(router);
 }
 
+/** How many fully parsed copies of compact routerinfos do we keep? */
+#define FULL_ROUTERINFO_CACHE_SIZE 32
+/** Fully parsed copies of recently used compact routerinfos, least recently
+ * used first. */
+static smartlist_t *full_routerinfo_cache = NULL;
+
+/** If the CompactRouterDescriptors option is set, drop the fields of
+ * <b>ri</b> that we can parse again from its descriptor body and that we
+ * rarely need.  Authorities look at these fields all the time, so they
+ * never compact anything. */
+void
+routerinfo_compact(routerinfo_t *ri)
+{
+  const or_options_t *options = get_options();
+  if (!options->CompactRouterDescriptors || authdir_mode(options) ||
+      ri->is_compact)
+    return;
+  /* We can only drop what we could parse again. */
+  if (ri->cache_info.saved_location != SAVED_IN_CACHE &&
+      !ri->cache_info.signed_descriptor_body)
+    return;
+
+  if (ri->onion_pkey) {
+    crypto_free_pk_env(ri->onion_pkey);
+    ri->onion_pkey = NULL;
+  }
+  tor_free(ri->platform);
+  tor_free(ri->contact_info);
+  ri->is_compact = 1;
+}
+
+/** Return a routerinfo_t with every field of <b>ri</b> filled in: either
+ * <b>ri</b> itself, or if <b>ri</b> is compact, a copy parsed again from
+ * its descriptor body.  Copies live in a small LRU cache, so the result is
+ * only good until the next call to this function.  Return NULL if we can't
+ * parse the descriptor again. */
+static const routerinfo_t *
+routerinfo_get_full(const routerinfo_t *ri)
+{
+  routerinfo_t *full;
+  const char *body;
+
+  if (!ri->is_compact)
+    return ri;
+  if (!full_routerinfo_cache)
+    full_routerinfo_cache = smartlist_create();
+
+  SMARTLIST_FOREACH_BEGIN(full_routerinfo_cache, routerinfo_t *, r) {
+    if (tor_memeq(r->cache_info.signed_descriptor_digest,
+                  ri->cache_info.signed_descriptor_digest, DIGEST_LEN)) {
+      /* Move it to the most recently used end. */
+      SMARTLIST_DEL_CURRENT(full_routerinfo_cache, r);
+      smartlist_add(full_routerinfo_cache, r);
+      return r;
+    }
+  } SMARTLIST_FOREACH_END(r);
+
+  body = signed_descriptor_get_body(&ri->cache_info);
+  full = router_parse_entry_from_string(body,
+                                body+ri->cache_info.signed_descriptor_len,
+                                0, 0, NULL);
+  if (!full) {
+    log_warn(LD_BUG, "Couldn't parse a compact router descriptor again.");
+    return NULL;
+  }
+  if (smartlist_len(full_routerinfo_cache) >= FULL_ROUTERINFO_CACHE_SIZE) {
+    routerinfo_free(smartlist_get(full_routerinfo_cache, 0));
+    smartlist_del_keeporder(full_routerinfo_cache, 0);
+  }
+  smartlist_add(full_routerinfo_cache, full);
+  return full;
+}
+
+/** Return <b>router</b>'s onion key, parsing its descriptor again if
+ * necessary; or NULL if we can't. */
+crypto_pk_env_t *
+router_get_onion_pkey(const routerinfo_t *router)
+{
+  const routerinfo_t *full = routerinfo_get_full(router);
+  return full ? full->onion_pkey : NULL;
+}
+
+/** Return <b>router</b>'s platform string, parsing its descriptor again if
+ * necessary; or NULL if it has none or we can't. */
+const char *
+router_get_platform(const routerinfo_t *router)
+{
+  const routerinfo_t *full = routerinfo_get_full(router);
+  return full ? full->platform : NULL;
+}
+
+/** Return <b>router</b>'s contact info, parsing its descriptor again if
+ * necessary; or NULL if it has none or we can't. */
+const char *
+router_get_contact_info(const routerinfo_t *router)
+{
+  const routerinfo_t *full = routerinfo_get_full(router);
+  return full ? full->contact_info : NULL;
+}
+
 /** Release all storage held by <b>extrainfo</b> */
 void
 extrainfo_free(extrainfo_t *extrainfo)
@@ -2761,6 +3562,7 @@ routerlist_free(routerlist_t *rl)
     return;
   rimap_free(rl->identity_map, NULL);
   sdmap_free(rl->desc_digest_map, NULL);
+  digestset_free(rl->desc_digest_filter);
   sdmap_free(rl->desc_by_eid_map, NULL);
   eimap_free(rl->extra_info_map, _extrainfo_free);
   SMARTLIST_FOREACH(rl->routers, routerinfo_t *, r,
@@ -2769,6 +3571,9 @@ routerlist_free(routerlist_t *rl)
                     signed_descriptor_free(sd));
   smartlist_free(rl->routers);
   smartlist_free(rl->old_routers);
+  digestmap_free(rl->old_routers_by_id, (void (*)(void*))smartlist_free);
+  store_rebuild_abandon(&rl->desc_store);
+  store_rebuild_abandon(&rl->extrainfo_store);
   if (routerlist->desc_store.mmap)
     tor_munmap_file(routerlist->desc_store.mmap);
   if (routerlist->extrainfo_store.mmap)
@@ -2799,6 +3604,36 @@ dump_routerlist_mem_usage(int severity)
       smartlist_len(routerlist->old_routers), U64_PRINTF_ARG(olddescs));
 }
 
+/** Set *<b>n_out</b> to the number of router descriptors we hold, current
+ * and old, and *<b>heap_bytes_out</b> and *<b>mapped_bytes_out</b> to the
+ * number of bytes in their bodies that are on the heap and in our mmaped
+ * cache file respectively. */
+void
+routerlist_get_body_usage(int *n_out, uint64_t *heap_bytes_out,
+                          uint64_t *mapped_bytes_out)
+{
+  uint64_t heap = 0, mapped = 0;
+  *n_out = 0;
+  if (routerlist) {
+#define COUNT_BODY(sd) STMT_BEGIN                                       \
+      size_t len = (sd)->signed_descriptor_len + (sd)->annotations_len;  \
+      if ((sd)->saved_location == SAVED_IN_CACHE)                       \
+        mapped += len;                                                  \
+      else                                                              \
+        heap += len;                                                    \
+    STMT_END
+    SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, r,
+                      COUNT_BODY(&r->cache_info));
+    SMARTLIST_FOREACH(routerlist->old_routers, signed_descriptor_t *, sd,
+                      COUNT_BODY(sd));
+#undef COUNT_BODY
+    *n_out = smartlist_len(routerlist->routers) +
+      smartlist_len(routerlist->old_routers);
+  }
+  *heap_bytes_out = heap;
+  *mapped_bytes_out = mapped;
+}
+
 /** Debugging helper: If <b>idx</b> is nonnegative, assert that <b>ri</b> is
  * in <b>sl</b> at position <b>idx</b>. Otherwise, search <b>sl</b> for
  * <b>ri</b>.  Return the index of <b>ri</b> in <b>sl</b>, or -1 if <b>ri</b>
@@ -2839,7 +3674,7 @@ routerlist_insert(routerlist_t *rl, routerinfo_t *ri)
   ri_old = rimap_set(rl->identity_map, ri->cache_info.identity_digest, ri);
   tor_assert(!ri_old);
 
-  sd_old = sdmap_set(rl->desc_digest_map,
+  sd_old = desc_digest_map_set(rl,
                      ri->cache_info.signed_descriptor_digest,
                      &(ri->cache_info));
   if (sd_old) {
@@ -2854,6 +3689,7 @@ routerlist_insert(routerlist_t *rl, routerinfo_t *ri)
   smartlist_add(rl->routers, ri);
   ri->cache_info.routerlist_index = smartlist_len(rl->routers) - 1;
   nodelist_add_routerinfo(ri);
+  routerinfo_compact(ri);
   router_dir_info_changed();
 #ifdef DEBUG_ROUTERLIST
   routerlist_assert_ok(rl);
@@ -2912,6 +3748,21 @@ extrainfo_insert(routerlist_t *rl, extrainfo_t *ei)
 #define should_cache_old_descriptors() \
   directory_caches_dir_info(get_options())
 
+/** Append <b>sd</b> to <b>rl</b>-\>old_routers, and index it by identity.
+ */
+static void
+routerlist_add_old(routerlist_t *rl, signed_descriptor_t *sd)
+{
+  smartlist_t *same_id;
+  smartlist_add(rl->old_routers, sd);
+  sd->routerlist_index = smartlist_len(rl->old_routers)-1;
+  if (!(same_id = digestmap_get(rl->old_routers_by_id, sd->identity_digest))) {
+    same_id = smartlist_create();
+    digestmap_set(rl->old_routers_by_id, sd->identity_digest, same_id);
+  }
+  smartlist_add(same_id, sd);
+}
+
 /** If we're a directory cache and routerlist <b>rl</b> doesn't have
  * a copy of router <b>ri</b> yet, add it to the list of old (not
  * recommended but still served) descriptors. Else free it. */
@@ -2929,9 +3780,8 @@ routerlist_insert_old(routerlist_t *rl, routerinfo_t *ri)
       !sdmap_get(rl->desc_digest_map,
                  ri->cache_info.signed_descriptor_digest)) {
     signed_descriptor_t *sd = signed_descriptor_from_routerinfo(ri);
-    sdmap_set(rl->desc_digest_map, sd->signed_descriptor_digest, sd);
-    smartlist_add(rl->old_routers, sd);
-    sd->routerlist_index = smartlist_len(rl->old_routers)-1;
+    desc_digest_map_set(rl, sd->signed_descriptor_digest, sd);
+    routerlist_add_old(rl, sd);
     if (!tor_digest_is_zero(sd->extra_info_digest))
       sdmap_set(rl->desc_by_eid_map, sd->extra_info_digest, sd);
   } else {
@@ -2979,9 +3829,8 @@ routerlist_remove(routerlist_t *rl, routerinfo_t *ri, int make_old, time_t now)
       ri->purpose == ROUTER_PURPOSE_GENERAL) {
     signed_descriptor_t *sd;
     sd = signed_descriptor_from_routerinfo(ri);
-    smartlist_add(rl->old_routers, sd);
-    sd->routerlist_index = smartlist_len(rl->old_routers)-1;
-    sdmap_set(rl->desc_digest_map, sd->signed_descriptor_digest, sd);
+    routerlist_add_old(rl, sd);
+    desc_digest_map_set(rl, sd->signed_descriptor_digest, sd);
     if (!tor_digest_is_zero(sd->extra_info_digest))
       sdmap_set(rl->desc_by_eid_map, sd->extra_info_digest, sd);
   } else {
@@ -3015,6 +3864,7 @@ routerlist_remove_old(routerlist_t *rl, signed_descriptor_t *sd, int idx)
   signed_descriptor_t *sd_tmp;
   extrainfo_t *ei_tmp;
   desc_store_t *store;
+  smartlist_t *same_id;
   if (idx == -1) {
     idx = sd->routerlist_index;
   }
@@ -3031,6 +3881,13 @@ routerlist_remove_old(routerlist_t *rl, signed_descriptor_t *sd, int idx)
     signed_descriptor_t *d = smartlist_get(rl->old_routers, idx);
     d->routerlist_index = idx;
   }
+  same_id = digestmap_get(rl->old_routers_by_id, sd->identity_digest);
+  tor_assert(same_id);
+  smartlist_remove(same_id, sd);
+  if (!smartlist_len(same_id)) {
+    digestmap_remove(rl->old_routers_by_id, sd->identity_digest);
+    smartlist_free(same_id);
+  }
   sd_tmp = sdmap_remove(rl->desc_digest_map,
                         sd->signed_descriptor_digest);
   tor_assert(sd_tmp == sd);
@@ -3084,6 +3941,7 @@ routerlist_replace(routerlist_t *rl, routerinfo_t *ri_old,
 
   nodelist_remove_routerinfo(ri_old);
   nodelist_add_routerinfo(ri_new);
+  routerinfo_compact(ri_new);
 
   router_dir_info_changed();
   if (idx >= 0) {
@@ -3105,7 +3963,7 @@ routerlist_replace(routerlist_t *rl, routerinfo_t *ri_old,
   ri_tmp = rimap_set(rl->identity_map,
                      ri_new->cache_info.identity_digest, ri_new);
   tor_assert(!ri_tmp || ri_tmp == ri_old);
-  sdmap_set(rl->desc_digest_map,
+  desc_digest_map_set(rl,
             ri_new->cache_info.signed_descriptor_digest,
             &(ri_new->cache_info));
 
@@ -3124,9 +3982,8 @@ routerlist_replace(routerlist_t *rl, routerinfo_t *ri_old,
     /* ri_old is going to become a signed_descriptor_t and go into
      * old_routers */
     signed_descriptor_t *sd = signed_descriptor_from_routerinfo(ri_old);
-    smartlist_add(rl->old_routers, sd);
-    sd->routerlist_index = smartlist_len(rl->old_routers)-1;
-    sdmap_set(rl->desc_digest_map, sd->signed_descriptor_digest, sd);
+    routerlist_add_old(rl, sd);
+    desc_digest_map_set(rl, sd->signed_descriptor_digest, sd);
     if (!tor_digest_is_zero(sd->extra_info_digest))
       sdmap_set(rl->desc_by_eid_map, sd->extra_info_digest, sd);
   } else {
@@ -3188,8 +4045,18 @@ routerlist_reparse_old(routerlist_t *rl, signed_descriptor_t *sd)
 void
 routerlist_free_all(void)
 {
+  int i;
   routerlist_free(routerlist);
   routerlist = NULL;
+  if (full_routerinfo_cache) {
+    SMARTLIST_FOREACH(full_routerinfo_cache, routerinfo_t *, ri,
+                      routerinfo_free(ri));
+    smartlist_free(full_routerinfo_cache);
+    full_routerinfo_cache = NULL;
+  }
+  for (i = 0; i < N_BW_ALIAS_TABLES; ++i)
+    bw_alias_table_clear(&bw_alias_tables[i]);
+  router_descriptor_fetch_stats_clear();
   if (warned_nicknames) {
     SMARTLIST_FOREACH(warned_nicknames, char *, cp, tor_free(cp));
     smartlist_free(warned_nicknames);
@@ -3248,6 +4115,7 @@ router_set_status(const char *digest, int up)
       log_warn(LD_NET, "We just marked ourself as down. Are your external "
                "addresses reachable?");
     node->is_running = up;
+    nodelist_hot_fields_update_node(node);
   }
 
   router_dir_info_changed();
@@ -3297,8 +4165,10 @@ router_add_to_routerlist(routerinfo_t *router, const char **msg,
   old_router = router_get_mutable_by_digest(id_digest);
 
   /* Make sure that we haven't already got this exact descriptor. */
-  if (sdmap_get(routerlist->desc_digest_map,
-                router->cache_info.signed_descriptor_digest)) {
+  if (desc_digest_map_may_contain(routerlist,
+                                  router->cache_info.signed_descriptor_digest)
+      && sdmap_get(routerlist->desc_digest_map,
+                   router->cache_info.signed_descriptor_digest)) {
     /* If we have this descriptor already and the new descriptor is a bridge
      * descriptor, replace it. If we had a bridge descriptor before and the
      * new one is not a bridge descriptor, don't replace it. */
@@ -3482,16 +4352,15 @@ router_add_extrainfo_to_routerlist(extrainfo_t *ei, const char **msg,
 }
 
 /** Sorting helper: return &lt;0, 0, or &gt;0 depending on whether the
- * signed_descriptor_t* in *<b>a</b> has an identity digest preceding, equal
- * to, or later than that of *<b>b</b>. */
+ * signed_descriptor_t* in *<b>a</b> was published before, at the same time
+ * as, or after *<b>b</b>. */
 static int
-_compare_old_routers_by_identity(const void **_a, const void **_b)
+_compare_old_routers_by_published(const void **_a, const void **_b)
 {
-  int i;
   const signed_descriptor_t *r1 = *_a, *r2 = *_b;
-  if ((i = fast_memcmp(r1->identity_digest, r2->identity_digest, DIGEST_LEN)))
-    return i;
-  return (int)(r1->published_on - r2->published_on);
+  if (r1->published_on < r2->published_on)
+    return -1;
+  return r1->published_on > r2->published_on;
 }
 
 /** Internal type used to represent how long an old descriptor was valid,
@@ -3512,67 +4381,66 @@ _compare_duration_idx(const void *_d1, const void *_d2)
   return d1->duration - d2->duration;
 }
 
-/** The range <b>lo</b> through <b>hi</b> inclusive of routerlist->old_routers
- * must contain routerinfo_t with the same identity and with publication time
- * in ascending order.  Remove members from this range until there are no more
- * than max_descriptors_per_router() remaining.  Start by removing the oldest
- * members from before <b>cutoff</b>, then remove members which were current
- * for the lowest amount of time.  The order of members of old_routers at
- * indices <b>lo</b> or higher may be changed.
+/** <b>same_id</b> is the list of members of routerlist->old_routers that
+ * share an identity.  Remove members of it until there are no more than
+ * <b>max_descriptors</b> remaining.  Start by removing the oldest members
+ * from before <b>cutoff</b>, then remove members which were current for the
+ * lowest amount of time.
  */
 static void
 routerlist_remove_old_cached_routers_with_id(time_t now,
-                                             time_t cutoff, int lo, int hi,
+                                             time_t cutoff,
+                                             const smartlist_t *same_id,
+                                             int max_descriptors,
                                              digestset_t *retain)
 {
-  int i, n = hi-lo+1;
+  int i, n = smartlist_len(same_id);
   unsigned n_extra, n_rmv = 0;
   struct duration_idx_t *lifespans;
   uint8_t *rmv, *must_keep;
-  smartlist_t *lst = routerlist->old_routers;
+  smartlist_t *lst;
 #if 1
   const char *ident;
-  tor_assert(hi < smartlist_len(lst));
-  tor_assert(lo <= hi);
-  ident = ((signed_descriptor_t*)smartlist_get(lst, lo))->identity_digest;
-  for (i = lo+1; i <= hi; ++i) {
-    signed_descriptor_t *r = smartlist_get(lst, i);
-    tor_assert(tor_memeq(ident, r->identity_digest, DIGEST_LEN));
-  }
+  tor_assert(n > 0);
+  ident = ((signed_descriptor_t*)smartlist_get(same_id, 0))->identity_digest;
+  SMARTLIST_FOREACH(same_id, signed_descriptor_t *, r,
+    tor_assert(tor_memeq(ident, r->identity_digest, DIGEST_LEN)));
 #endif
   /* Check whether we need to do anything at all. */
-  {
-    int mdpr = directory_caches_dir_info(get_options()) ? 2 : 1;
-    if (n <= mdpr)
-      return;
-    n_extra = n - mdpr;
-  }
+  if (n <= max_descriptors)
+    return;
+  n_extra = n - max_descriptors;
+
+  /* Removing descriptors changes same_id, so work on a sorted copy. */
+  lst = smartlist_create();
+  smartlist_add_all(lst, same_id);
+  smartlist_sort(lst, _compare_old_routers_by_published);
 
   lifespans = tor_malloc_zero(sizeof(struct duration_idx_t)*n);
   rmv = tor_malloc_zero(sizeof(uint8_t)*n);
   must_keep = tor_malloc_zero(sizeof(uint8_t)*n);
   /* Set lifespans to contain the lifespan and index of each server. */
-  /* Set rmv[i-lo]=1 if we're going to remove a server for being too old. */
-  for (i = lo; i <= hi; ++i) {
+  /* Set rmv[i]=1 if we're going to remove a server for being too old. */
+  for (i = 0; i < n; ++i) {
     signed_descriptor_t *r = smartlist_get(lst, i);
     signed_descriptor_t *r_next;
-    lifespans[i-lo].idx = i;
+    lifespans[i].idx = i;
     if (r->last_listed_as_valid_until >= now ||
         (retain && digestset_isin(retain, r->signed_descriptor_digest))) {
-      must_keep[i-lo] = 1;
+      must_keep[i] = 1;
     }
-    if (i < hi) {
+    if (i < n-1) {
       r_next = smartlist_get(lst, i+1);
       tor_assert(r->published_on <= r_next->published_on);
-      lifespans[i-lo].duration = (int)(r_next->published_on - r->published_on);
+      lifespans[i].duration = (int)(r_next->published_on - r->published_on);
     } else {
       r_next = NULL;
-      lifespans[i-lo].duration = INT_MAX;
+      lifespans[i].duration = INT_MAX;
     }
-    if (!must_keep[i-lo] && r->published_on < cutoff && n_rmv < n_extra) {
+    if (!must_keep[i] && r->published_on < cutoff && n_rmv < n_extra) {
       ++n_rmv;
-      lifespans[i-lo].old = 1;
-      rmv[i-lo] = 1;
+      lifespans[i].old = 1;
+      rmv[i] = 1;
     }
   }
 
@@ -3584,18 +4452,18 @@ routerlist_remove_old_cached_routers_with_id(time_t now,
      **/
     qsort(lifespans, n, sizeof(struct duration_idx_t), _compare_duration_idx);
     for (i = 0; i < n && n_rmv < n_extra; ++i) {
-      if (!must_keep[lifespans[i].idx-lo] && !lifespans[i].old) {
-        rmv[lifespans[i].idx-lo] = 1;
+      if (!must_keep[lifespans[i].idx] && !lifespans[i].old) {
+        rmv[lifespans[i].idx] = 1;
         ++n_rmv;
       }
     }
   }
 
-  i = hi;
-  do {
-    if (rmv[i-lo])
-      routerlist_remove_old(routerlist, smartlist_get(lst, i), i);
-  } while (--i >= lo);
+  for (i = 0; i < n; ++i) {
+    if (rmv[i])
+      routerlist_remove_old(routerlist, smartlist_get(lst, i), -1);
+  }
+  smartlist_free(lst);
   tor_free(must_keep);
   tor_free(rmv);
   tor_free(lifespans);
@@ -3608,8 +4476,7 @@ routerlist_remove_old_cached_routers_with_id(time_t now,
 void
 routerlist_remove_old_routers(void)
 {
-  int i, hi=-1;
-  const char *cur_id = NULL;
+  int i;
   time_t now = time(NULL);
   time_t cutoff;
   routerinfo_t *router;
@@ -3733,31 +4600,22 @@ routerlist_remove_old_routers(void)
       smartlist_len(routerlist->routers))
     goto done;
 
-  /* Sort by identity, then fix indices. */
-  smartlist_sort(routerlist->old_routers, _compare_old_routers_by_identity);
-  /* Fix indices. */
-  for (i = 0; i < smartlist_len(routerlist->old_routers); ++i) {
-    signed_descriptor_t *r = smartlist_get(routerlist->old_routers, i);
-    r->routerlist_index = i;
-  }
-
-  /* Iterate through the list from back to front, so when we remove descriptors
-   * we don't mess up groups we haven't gotten to. */
-  for (i = smartlist_len(routerlist->old_routers)-1; i >= 0; --i) {
-    signed_descriptor_t *r = smartlist_get(routerlist->old_routers, i);
-    if (!cur_id) {
-      cur_id = r->identity_digest;
-      hi = i;
-    }
-    if (tor_memneq(cur_id, r->identity_digest, DIGEST_LEN)) {
-      routerlist_remove_old_cached_routers_with_id(now,
-                                                   cutoff, i+1, hi, retain);
-      cur_id = r->identity_digest;
-      hi = i;
-    }
+  /* Find the identities with too many old descriptors, and trim each one.
+   * Trimming never empties a list in old_routers_by_id, so we can collect
+   * the lists first and trim them afterwards. */
+  {
+    int max_descriptors = caches ? 2 : 1;
+    smartlist_t *overfull = smartlist_create();
+    DIGESTMAP_FOREACH(routerlist->old_routers_by_id, id,
+                      smartlist_t *, same_id) {
+      if (smartlist_len(same_id) > max_descriptors)
+        smartlist_add(overfull, same_id);
+    } DIGESTMAP_FOREACH_END;
+    SMARTLIST_FOREACH(overfull, smartlist_t *, same_id,
+      routerlist_remove_old_cached_routers_with_id(now, cutoff, same_id,
+                                                   max_descriptors, retain));
+    smartlist_free(overfull);
   }
-  if (hi>=0)
-    routerlist_remove_old_cached_routers_with_id(now, cutoff, 0, hi, retain);
   //routerlist_assert_ok(routerlist);
 
  done:
@@ -4352,6 +5210,134 @@ client_would_use_router(const routerstatus_t *rs, time_t now,
  * them until they have more, or until this amount of time has passed. */
 #define MAX_CLIENT_INTERVAL_WITHOUT_REQUEST (10*60)
 
+/** Try to size each descriptor request so that it takes about this many
+ * seconds, judging by how quickly recent requests have come back. */
+#define DESC_FETCH_TARGET_TIME 5
+/** Never have more than this many descriptor requests of one kind in
+ * flight at once; hold the rest back until some of those finish. */
+#define MAX_PARALLEL_DESC_FETCHES 16
+/** How much weight does each finished request get in our moving averages
+ * of descriptor fetch performance? */
+#define DESC_FETCH_EWMA_WEIGHT 0.25
+
+/** What we've learned from recent descriptor requests of one kind. */
+typedef struct desc_fetch_stats_t {
+  /** Moving average of how many bytes per second a single request got. */
+  double bytes_per_sec;
+  /** Moving average of how many bytes each descriptor took on the wire. */
+  double bytes_per_desc;
+  /** True iff the averages above are based on at least one request. */
+  unsigned int measured:1;
+  /** True iff we held back requests because too many were in flight. */
+  unsigned int deferred:1;
+} desc_fetch_stats_t;
+
+/** Descriptor fetch performance: index 0 for router descriptors, 1 for
+ * microdescriptors. */
+static desc_fetch_stats_t desc_fetch_stats[2];
+
+/** Return the desc_fetch_stats_t for the directory purpose
+ * <b>purpose</b>. */
+static desc_fetch_stats_t *
+get_desc_fetch_stats(int purpose)
+{
+  tor_assert(purpose == DIR_PURPOSE_FETCH_SERVERDESC ||
+             purpose == DIR_PURPOSE_FETCH_MICRODESC);
+  return &desc_fetch_stats[purpose == DIR_PURPOSE_FETCH_MICRODESC];
+}
+
+/** Note that a request with directory purpose <b>purpose</b> gave us
+ * <b>n_descs</b> descriptors in <b>n_bytes</b> bytes, <b>usec</b>
+ * microseconds after we sent it. */
+void
+router_note_descriptor_fetch(int purpose, int n_descs, size_t n_bytes,
+                             long usec)
+{
+  desc_fetch_stats_t *stats = get_desc_fetch_stats(purpose);
+  double rate, per_desc;
+  if (n_descs <= 0 || !n_bytes)
+    return;
+  /* Don't let one answer from a very close cache swamp the average. */
+  if (usec < 100000)
+    usec = 100000;
+  rate = n_bytes / (usec / 1000000.0);
+  per_desc = ((double)n_bytes) / n_descs;
+  if (stats->measured) {
+    stats->bytes_per_sec += DESC_FETCH_EWMA_WEIGHT *
+      (rate - stats->bytes_per_sec);
+    stats->bytes_per_desc += DESC_FETCH_EWMA_WEIGHT *
+      (per_desc - stats->bytes_per_desc);
+  } else {
+    stats->bytes_per_sec = rate;
+    stats->bytes_per_desc = per_desc;
+    stats->measured = 1;
+  }
+  log_debug(LD_DIR, "Descriptor fetch got %d in %lu bytes and %ld usec; "
+            "now expecting %.0f bytes/sec, %.0f bytes/descriptor.",
+            n_descs, (unsigned long)n_bytes, usec,
+            stats->bytes_per_sec, stats->bytes_per_desc);
+}
+
+/** Return how many bytes per second recent requests with directory purpose
+ * <b>purpose</b> have been getting, or 0 if we don't know yet. */
+double
+router_get_descriptor_fetch_rate(int purpose)
+{
+  const desc_fetch_stats_t *stats = get_desc_fetch_stats(purpose);
+  return stats->measured ? stats->bytes_per_sec : 0.0;
+}
+
+/** Return how many descriptors we should ask for in each request with
+ * directory purpose <b>purpose</b> so that it finishes in about
+ * DESC_FETCH_TARGET_TIME seconds, or 0 if we don't know yet. */
+int
+router_descriptor_fetch_batch_size(int purpose)
+{
+  const desc_fetch_stats_t *stats = get_desc_fetch_stats(purpose);
+  double n;
+  if (!stats->measured || stats->bytes_per_desc <= 0)
+    return 0;
+  n = stats->bytes_per_sec * DESC_FETCH_TARGET_TIME / stats->bytes_per_desc;
+  if (n >= INT_MAX)
+    return INT_MAX;
+  return n < 1 ? 1 : (int)n;
+}
+
+/** Forget everything we've learned about descriptor fetch performance. */
+void
+router_descriptor_fetch_stats_clear(void)
+{
+  memset(desc_fetch_stats, 0, sizeof(desc_fetch_stats));
+}
+
+/** Called when a request with directory purpose <b>purpose</b> is done,
+ * successfully or not.  If we held back requests for want of a free slot,
+ * try launching them now. */
+void
+router_descriptor_fetch_finished(int purpose)
+{
+  desc_fetch_stats_t *stats = get_desc_fetch_stats(purpose);
+  if (stats->deferred) {
+    stats->deferred = 0;
+    reschedule_descriptor_fetches();
+  }
+}
+
+/** Return the number of directory connections with purpose <b>purpose</b>
+ * that are still in progress. */
+static int
+count_descriptor_fetches_in_progress(int purpose)
+{
+  int n = 0;
+  smartlist_t *conns = get_connection_array();
+  SMARTLIST_FOREACH(conns, connection_t *, conn,
+    if (conn->type == CONN_TYPE_DIR &&
+        conn->purpose == purpose &&
+        !conn->marked_for_close)
+      ++n);
+  return n;
+}
+
 /** Given a <b>purpose</b> (FETCH_MICRODESC or FETCH_SERVERDESC) and a list of
  * router descriptor digests or microdescriptor digest256s in
  * <b>downloadable</b>, decide whether to delay fetching until we have more.
@@ -4426,7 +5412,13 @@ launch_descriptor_downloads(int purpose,
         PDS_NO_EXISTING_SERVERDESC_FETCH;
     }
 
+    int n_batch, n_slots, n_launched = 0;
+    desc_fetch_stats_t *stats = get_desc_fetch_stats(purpose);
     n_per_request = CEIL_DIV(n_downloadable, MIN_REQUESTS);
+    /* Don't ask for more than recent requests suggest we'll get soon. */
+    n_batch = router_descriptor_fetch_batch_size(purpose);
+    if (n_batch && n_per_request > n_batch)
+      n_per_request = n_batch;
     if (purpose == DIR_PURPOSE_FETCH_MICRODESC) {
       if (n_per_request > MAX_MICRODESC_DL_PER_REQUEST)
         n_per_request = MAX_MICRODESC_DL_PER_REQUEST;
@@ -4442,16 +5434,29 @@ launch_descriptor_downloads(int purpose,
     else if (n_downloadable > 1)
       rtr_plural = "s";
 
+    n_slots = MAX_PARALLEL_DESC_FETCHES -
+      count_descriptor_fetches_in_progress(purpose);
+    if (n_slots <= 0) {
+      log_info(LD_DIR, "Already fetching %ss from %d servers; waiting for "
+               "some of them to finish.", descname,
+               MAX_PARALLEL_DESC_FETCHES);
+      stats->deferred = 1;
+      return;
+    }
+
     log_info(LD_DIR,
              "Launching %d request%s for %d router%s, %d at a time",
-             CEIL_DIV(n_downloadable, n_per_request),
+             MIN(CEIL_DIV(n_downloadable, n_per_request), n_slots),
              req_plural, n_downloadable, rtr_plural, n_per_request);
     smartlist_sort_digests(downloadable);
-    for (i=0; i < n_downloadable; i += n_per_request) {
+    for (i=0; i < n_downloadable && n_launched < n_slots;
+         i += n_per_request, ++n_launched) {
       initiate_descriptor_downloads(source, purpose,
                                     downloadable, i, i+n_per_request,
                                     pds_flags);
     }
+    /* Whatever we didn't get to waits until a request finishes. */
+    stats->deferred = i < n_downloadable;
     last_descriptor_download_attempted = now;
   }
 }
@@ -5103,13 +6108,16 @@ router_differences_are_cosmetic(const routerinfo_t *r1, const routerinfo_t *r2)
       r1->or_port != r2->or_port ||
       r1->dir_port != r2->dir_port ||
       r1->purpose != r2->purpose ||
-      crypto_pk_cmp_keys(r1->onion_pkey, r2->onion_pkey) ||
+      crypto_pk_cmp_keys(router_get_onion_pkey(r1),
+                         router_get_onion_pkey(r2)) ||
       crypto_pk_cmp_keys(r1->identity_pkey, r2->identity_pkey) ||
-      strcasecmp(r1->platform, r2->platform) ||
-      (r1->contact_info && !r2->contact_info) || /* contact_info is optional */
-      (!r1->contact_info && r2->contact_info) ||
-      (r1->contact_info && r2->contact_info &&
-       strcasecmp(r1->contact_info, r2->contact_info)) ||
+      !router_get_platform(r1) || !router_get_platform(r2) ||
+      strcasecmp(router_get_platform(r1), router_get_platform(r2)) ||
+      /* contact_info is optional */
+      !router_get_contact_info(r1) != !router_get_contact_info(r2) ||
+      (router_get_contact_info(r1) &&
+       strcasecmp(router_get_contact_info(r1),
+                  router_get_contact_info(r2))) ||
       r1->is_hibernating != r2->is_hibernating ||
       cmp_addr_policies(r1->exit_policy, r2->exit_policy))
     return 0;
@@ -5193,7 +6201,13 @@ routerinfo_incompatible_with_extrainfo(const routerinfo_t *ri,
     goto err; /* different servers */
   }
 
-  if (ei->pending_sig) {
+  if (ei->pending_sig &&
+      sigcache_lookup(ei->cache_info.signed_descriptor_digest, DIGEST_LEN,
+                      ri->identity_pkey)) {
+    /* We've already seen this router sign this extra-info document. */
+    ei->cache_info.send_unencrypted = ri->cache_info.send_unencrypted;
+    tor_free(ei->pending_sig);
+  } else if (ei->pending_sig) {
     char signed_digest[128];
     if (crypto_pk_public_checksig(ri->identity_pkey,
                        signed_digest, sizeof(signed_digest),
@@ -5206,6 +6220,8 @@ routerinfo_incompatible_with_extrainfo(const routerinfo_t *ri,
       goto err; /* Bad signature, or no match. */
     }
 
+    sigcache_add(ei->cache_info.signed_descriptor_digest, DIGEST_LEN,
+                 ri->identity_pkey);
     ei->cache_info.send_unencrypted = ri->cache_info.send_unencrypted;
     tor_free(ei->pending_sig);
   }
@@ -5284,6 +6300,8 @@ routerlist_assert_ok(const routerlist_t *rl)
     sd2 = sdmap_get(rl->desc_digest_map, sd->signed_descriptor_digest);
     tor_assert(sd == sd2);
     tor_assert(sd->routerlist_index == sd_sl_idx);
+    tor_assert(smartlist_isin(digestmap_get(rl->old_routers_by_id,
+                                            sd->identity_digest), sd));
     /* XXXX see above.
     if (!tor_digest_is_zero(sd->extra_info_digest)) {
       signed_descriptor_t *sd3 =
@@ -5339,8 +6357,8 @@ esc_router_info(const routerinfo_t *router)
   if (!router)
     return NULL; /* we're exiting; just free the memory we use */
 
-  esc_contact = esc_for_log(router->contact_info);
-  esc_platform = esc_for_log(router->platform);
+  esc_contact = esc_for_log(router_get_contact_info(router));
+  esc_platform = esc_for_log(router_get_platform(router));
 
   len = strlen(esc_contact)+strlen(esc_platform)+32;
   info = tor_malloc(len);
@@ -5367,7 +6385,10 @@ _compare_routerinfo_by_id_digest(const void **a, const void **b)
 void
 routers_sort_by_identity(smartlist_t *routers)
 {
-  smartlist_sort(routers, _compare_routerinfo_by_id_digest);
+  smartlist_sort_by_digest(routers,
+                           STRUCT_OFFSET(routerinfo_t,
+                                         cache_info.identity_digest),
+                           _compare_routerinfo_by_id_digest);
 }
 
 /** A routerset specifies constraints on a set of possible routerinfos, based
@@ -5387,6 +6408,9 @@ struct routerset_t {
   /** An address policy for routers in the set.  For implementation reasons,
    * a router belongs to the set if it is _rejected_ by this policy. */
   smartlist_t *policies;
+  /** Compiled form of <b>policies</b>, or NULL if we couldn't compile
+   * it. */
+  compiled_policy_t *compiled_policies;
 
   /** A human-readable description of what this routerset is for.  Used in
    * log messages. */
@@ -5401,8 +6425,32 @@ struct routerset_t {
    * routerset_refresh_countries() whenever the geoip country list is
    * reloaded. */
   bitarray_t *countries;
+
+  /** Cached answers of routerset_contains_node() for nodes with a
+   * routerstatus, indexed by nodelist_idx: 0 if we haven't checked the node
+   * yet, else one more than the answer. */
+  uint8_t *node_membership;
+  /** Number of entries in <b>node_membership</b>. */
+  int node_membership_len;
+  /** The nodelist generation that <b>node_membership</b> matches. */
+  unsigned node_membership_generation;
+  /** The value of routerset_node_epoch that <b>node_membership</b>
+   * matches. */
+  unsigned node_membership_epoch;
 };
 
+/** Incremented whenever a node's country changes without a new nodelist
+ * generation, so that routersets know to forget which nodes they
+ * contain. */
+static unsigned routerset_node_epoch = 1;
+
+/** Forget every cached node membership answer in <b>set</b>. */
+static void
+routerset_forget_node_membership(routerset_t *set)
+{
+  set->node_membership_generation = 0;
+}
+
 /** Return a new empty routerset. */
 routerset_t *
 routerset_new(void)
@@ -5438,6 +6486,7 @@ void
 routerset_refresh_countries(routerset_t *target)
 {
   int cc;
+  routerset_forget_node_membership(target);
   bitarray_free(target->countries);
 
   if (!geoip_is_loaded()) {
@@ -5508,6 +6557,9 @@ routerset_parse(routerset_t *target, const char *s, const char *description)
   } SMARTLIST_FOREACH_END(nick);
   smartlist_add_all(target->list, list);
   smartlist_free(list);
+  compiled_policy_release(target->compiled_policies);
+  target->compiled_policies = compiled_policy_get(target->policies);
+  routerset_forget_node_membership(target);
   if (added_countries)
     routerset_refresh_countries(target);
   return r;
@@ -5591,9 +6643,15 @@ routerset_contains(const routerset_t *set, const tor_addr_t *addr,
     return 4;
   if (id_digest && digestmap_get(set->digests, id_digest))
     return 4;
-  if (addr && compare_tor_addr_to_addr_policy(addr, orport, set->policies)
-      == ADDR_POLICY_REJECTED)
-    return 3;
+  if (addr && smartlist_len(set->policies)) {
+    addr_policy_result_t r = set->compiled_policies ?
+      compare_tor_addr_to_compiled_policy(addr, orport,
+                                          set->compiled_policies,
+                                          set->policies) :
+      compare_tor_addr_to_addr_policy(addr, orport, set->policies);
+    if (r == ADDR_POLICY_REJECTED)
+      return 3;
+  }
   if (set->countries) {
     if (country < 0 && addr)
       country = geoip_get_country_by_ip(tor_addr_to_ipv4h(addr));
@@ -5650,13 +6708,39 @@ routerset_contains_routerstatus(const routerset_t *set,
                             country);
 }
 
-/** Return true iff <b>node</b> is in <b>set</b>. */
+/** Return true iff <b>node</b> is in <b>set</b>.  For nodes in the
+ * consensus, remember the answer until the nodelist changes. */
 int
 routerset_contains_node(const routerset_t *set, const node_t *node)
 {
-  if (node->rs)
-    return routerset_contains_routerstatus(set, node->rs, node->country);
-  else if (node->ri)
+  if (node->rs) {
+    /* The cache doesn't change what's in the set, so it's fine to update
+     * it through a const pointer. */
+    routerset_t *s = (routerset_t *)set;
+    const int idx = node->nodelist_idx;
+    int r;
+    if (!set || !set->list)
+      return 0;
+    if (s->node_membership_generation != nodelist_get_generation() ||
+        s->node_membership_epoch != routerset_node_epoch) {
+      int n = smartlist_len(nodelist_get_list());
+      if (n > s->node_membership_len) {
+        s->node_membership_len = n + n/8 + 16;
+        s->node_membership = tor_realloc(s->node_membership,
+                                         s->node_membership_len);
+      }
+      memset(s->node_membership, 0, s->node_membership_len);
+      s->node_membership_generation = nodelist_get_generation();
+      s->node_membership_epoch = routerset_node_epoch;
+    }
+    if (idx < 0 || idx >= s->node_membership_len)
+      return routerset_contains_routerstatus(set, node->rs, node->country);
+    if (s->node_membership[idx])
+      return s->node_membership[idx] - 1;
+    r = routerset_contains_routerstatus(set, node->rs, node->country);
+    s->node_membership[idx] = (uint8_t)(r + 1);
+    return r;
+  } else if (node->ri)
     return routerset_contains_router(set, node->ri, node->country);
   else
     return 0;
@@ -5798,9 +6882,12 @@ routerset_free(routerset_t *routerset)
   SMARTLIST_FOREACH(routerset->country_names, char *, cp, tor_free(cp));
   smartlist_free(routerset->country_names);
 
+  compiled_policy_release(routerset->compiled_policies);
+
   strmap_free(routerset->names, NULL);
   digestmap_free(routerset->digests, NULL);
   bitarray_free(routerset->countries);
+  tor_free(routerset->node_membership);
   tor_free(routerset);
 }
 
@@ -5809,12 +6896,15 @@ routerset_free(routerset_t *routerset)
 void
 node_set_country(node_t *node)
 {
+  country_t old_country = node->country;
   if (node->rs)
     node->country = geoip_get_country_by_ip(node->rs->addr);
   else if (node->ri)
     node->country = geoip_get_country_by_ip(node->ri->addr);
   else
     node->country = -1;
+  if (node->country != old_country)
+    ++routerset_node_epoch;
 }
 
 /** Set the country code of all routers in the routerlist. */
@@ -12,6 +12,7 @@
 #define _TOR_ROUTERLIST_H
 
 int get_n_authorities(dirinfo_type_t type);
+int should_use_desc_digest_filter(const or_options_t *options);
 int trusted_dirs_reload_certs(void);
 int trusted_dirs_load_certs_from_string(const char *contents, int from_store,
                                         int flush);
@@ -49,6 +50,10 @@ uint32_t router_get_advertised_bandwidth_capped(const routerinfo_t *router);
 const node_t *node_sl_choose_by_bandwidth(smartlist_t *sl,
                                           bandwidth_weight_rule_t rule);
 
+void router_add_random_node_candidates(smartlist_t *sl,
+                                       smartlist_t *excludedsmartlist,
+                                       struct routerset_t *excludedset,
+                                       router_crn_flags_t flags);
 const node_t *router_choose_random_node(smartlist_t *excludedsmartlist,
                                         struct routerset_t *excludedset,
                                         router_crn_flags_t flags);
@@ -73,9 +78,14 @@ const char *signed_descriptor_get_body(const signed_descriptor_t *desc);
 const char *signed_descriptor_get_annotations(const signed_descriptor_t *desc);
 routerlist_t *router_get_routerlist(void);
 void routerinfo_free(routerinfo_t *router);
+crypto_pk_env_t *router_get_onion_pkey(const routerinfo_t *router);
+const char *router_get_platform(const routerinfo_t *router);
+const char *router_get_contact_info(const routerinfo_t *router);
 void extrainfo_free(extrainfo_t *extrainfo);
 void routerlist_free(routerlist_t *rl);
 void dump_routerlist_mem_usage(int severity);
+void routerlist_get_body_usage(int *n_out, uint64_t *heap_bytes_out,
+                               uint64_t *mapped_bytes_out);
 void routerlist_remove(routerlist_t *rl, routerinfo_t *ri, int make_old,
                        time_t now);
 void routerlist_free_all(void);
@@ -206,11 +216,23 @@ void launch_descriptor_downloads(int purpose,
                                  smartlist_t *downloadable,
                                  const routerstatus_t *source,
                                  time_t now);
+void router_note_descriptor_fetch(int purpose, int n_descs, size_t n_bytes,
+                                  long usec);
+double router_get_descriptor_fetch_rate(int purpose);
+void router_descriptor_fetch_finished(int purpose);
 
 int hex_digest_nickname_decode(const char *hexdigest,
                                char *digest_out,
                                char *nickname_qualifier_out,
                                char *nickname_out);
 
+#ifdef ROUTERLIST_PRIVATE
+void bw_alias_table_build(const double *weights, int n,
+                          double *prob, int *alias);
+int router_descriptor_fetch_batch_size(int purpose);
+void router_descriptor_fetch_stats_clear(void);
+void routerinfo_compact(routerinfo_t *ri);
+#endif
+
 #endif
 
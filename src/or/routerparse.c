@@ -9,8 +9,10 @@
  * \brief Code to parse and validate router descriptors and directories.
  **/
 
+#define ROUTERPARSE_PRIVATE
 #include "or.h"
 #include "config.h"
+#include "cpuworker.h"
 #include "circuitbuild.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -23,6 +25,7 @@
 #include "networkstatus.h"
 #include "rephist.h"
 #include "routerparse.h"
+#include "sigcache.h"
 #undef log
 #include <math.h>
 
@@ -175,8 +178,14 @@ typedef struct directory_token_t {
   char **args;                 /**< Array of arguments from keyword line. */
 
   char *object_type;           /**< -----BEGIN [object_type]-----*/
-  size_t object_size;          /**< Bytes in object_body */
-  char *object_body;           /**< Contents of object, base64-decoded. */
+  /** Base64-encoded contents of the object, pointing into the string we
+   * tokenized.  Only valid as long as that string is. */
+  const char *object_text;
+  size_t object_text_len;      /**< Bytes in object_text */
+  size_t object_size;          /**< Bytes in the decoded object */
+  /** Contents of object, base64-decoded.  Heap-allocated on first use by
+   * token_get_object_body(); don't read it directly. */
+  char *object_body;
 
   crypto_pk_env_t *key;        /**< For public keys only.  Heap-allocated. */
 
@@ -543,6 +552,10 @@ static int router_get_hashes_impl(const char *s, size_t s_len,
                                   const char *start_str, const char *end_str,
                                   char end_char);
 static void token_clear(directory_token_t *tok);
+static const char *token_get_object_body(directory_token_t *tok);
+struct token_table_index_t;
+static const struct token_table_index_t *token_table_get_index(
+                                              const token_rule_t *table);
 static smartlist_t *find_all_by_keyword(smartlist_t *s, directory_keyword k);
 static smartlist_t *find_all_exitpolicy(smartlist_t *s);
 static directory_token_t *_find_by_keyword(smartlist_t *s,
@@ -1084,10 +1097,14 @@ check_signature_token(const char *digest,
     }
   }
 
+  /* If we've already seen this key sign this document, we're done. */
+  if (sigcache_lookup(digest, digest_len, pkey))
+    return 0;
+
   keysize = crypto_pk_keysize(pkey);
   signed_digest = tor_malloc(keysize);
   if (crypto_pk_public_checksig(pkey, signed_digest, keysize,
-                                tok->object_body, tok->object_size)
+                                token_get_object_body(tok), tok->object_size)
       < digest_len) {
     log_warn(LD_DIR, "Error reading %s: invalid signature.", doctype);
     tor_free(signed_digest);
@@ -1101,6 +1118,7 @@ check_signature_token(const char *digest,
     return -1;
   }
   tor_free(signed_digest);
+  sigcache_add(digest, digest_len, pkey);
   return 0;
 }
 
@@ -1231,6 +1249,130 @@ router_parse_list_from_string(const char **s, const char *eos,
   return 0;
 }
 
+/** Helper for router_check_uploaded_signatures(): find the first
+ * <b>keyword</b> line between <b>s</b> and <b>end</b> that is followed by an
+ * object of type <b>type</b>.  Set *<b>start_out</b> to the start of the
+ * object's BEGIN line, and *<b>end_out</b> to just after its END line.
+ * Return 0 on success, -1 if there is no such object. */
+static int
+find_keyword_object(const char *s, const char *end, const char *keyword,
+                    const char *type,
+                    const char **start_out, const char **end_out)
+{
+  char begin[64], finish[64];
+  const char *cp;
+
+  tor_snprintf(begin, sizeof(begin), "\n%s\n-----BEGIN %s-----\n",
+               keyword, type);
+  tor_snprintf(finish, sizeof(finish), "\n-----END %s-----\n", type);
+  if (!(cp = tor_memstr(s, end-s, begin)))
+    return -1;
+  cp += strlen(keyword) + 2;
+  *start_out = cp;
+  if (!(cp = tor_memstr(cp, end-cp, finish)))
+    return -1;
+  *end_out = cp + strlen(finish);
+  return 0;
+}
+
+/** Check the signatures on the router descriptors and extra-info documents
+ * in the <b>s_len</b>-byte string <b>s</b>, as uploaded to an authority.
+ * For each good signature, add the DIGEST_LEN-byte digest that it signs to
+ * <b>digests_out</b>, and a reference to the key that made it to
+ * <b>keys_out</b>.  An extra-info document is checked with the identity key
+ * of a router descriptor earlier in <b>s</b>, if one has the same identity.
+ *
+ * This doesn't touch any global state (not even the tokenizer's memarea
+ * freelist), and doesn't decide whether the documents are acceptable, so
+ * that a cpuworker can call it and leave the rest to
+ * router_parse_list_from_string().  At worst, a document that this
+ * misreads won't have its good signature remembered. */
+void
+router_check_uploaded_signatures(const char *s, size_t s_len,
+                                 smartlist_t *digests_out,
+                                 smartlist_t *keys_out)
+{
+  const char *eos = s + s_len, *end;
+  int is_extrainfo;
+  digestmap_t *identity_keys = digestmap_new();
+
+  while (find_start_of_next_router_or_extrainfo(&s, eos, &is_extrainfo) >= 0) {
+    char digest[DIGEST_LEN], id_digest[DIGEST_LEN];
+    char signature[DIROBJ_MAX_SIG_LEN], *signed_digest;
+    crypto_pk_env_t *key = NULL, *declared_key = NULL;
+    const char *obj_start, *obj_end, *cp;
+    int sig_len;
+    size_t keysize;
+
+    end = tor_memstr(s, eos-s, "\nrouter-signature");
+    if (end)
+      end = tor_memstr(end, eos-end, "\n-----END SIGNATURE-----\n");
+    if (!end)
+      break;
+    end += strlen("\n-----END SIGNATURE-----\n");
+
+    /* Uploaded documents can't have annotations, so we don't bother with
+     * annotated ones here. */
+    if (*s == '@')
+      goto next;
+    if (is_extrainfo) {
+      /* "extra-info" nickname fingerprint */
+      if (router_get_hash_impl(s, end-s, digest, "extra-info",
+                               "\nrouter-signature", '\n', DIGEST_SHA1) < 0)
+        goto next;
+      cp = s + strlen("extra-info ");
+      cp = memchr(cp, ' ', end-cp);
+      if (!cp || end-cp < HEX_DIGEST_LEN+2 ||
+          base16_decode(id_digest, DIGEST_LEN, cp+1, HEX_DIGEST_LEN))
+        goto next;
+      key = digestmap_get(identity_keys, id_digest);
+    } else {
+      if (router_get_router_hash(s, end-s, digest) < 0 ||
+          find_keyword_object(s, end, "signing-key", "RSA PUBLIC KEY",
+                              &obj_start, &obj_end) < 0)
+        goto next;
+      declared_key = crypto_new_pk_env();
+      if (crypto_pk_read_public_key_from_string(declared_key, obj_start,
+                                                obj_end-obj_start) < 0)
+        goto next;
+      key = declared_key;
+    }
+    if (!key ||
+        find_keyword_object(s, end, "router-signature", "SIGNATURE",
+                            &obj_start, &obj_end) < 0)
+      goto next;
+    obj_start += strlen("-----BEGIN SIGNATURE-----\n");
+    obj_end -= strlen("-----END SIGNATURE-----\n");
+    sig_len = base64_decode(signature, sizeof(signature), obj_start,
+                            obj_end-obj_start);
+    if (sig_len <= 0)
+      goto next;
+
+    keysize = crypto_pk_keysize(key);
+    signed_digest = tor_malloc(keysize);
+    if (crypto_pk_public_checksig(key, signed_digest, keysize,
+                                  signature, sig_len) >= DIGEST_LEN &&
+        tor_memeq(digest, signed_digest, DIGEST_LEN)) {
+      smartlist_add(digests_out, tor_memdup(digest, DIGEST_LEN));
+      smartlist_add(keys_out, crypto_pk_dup_key(key));
+      if (!is_extrainfo && !crypto_pk_get_digest(key, id_digest)) {
+        crypto_pk_env_t *old = digestmap_set(identity_keys, id_digest,
+                                             crypto_pk_dup_key(key));
+        if (old)
+          crypto_free_pk_env(old);
+      }
+    }
+    tor_free(signed_digest);
+
+  next:
+    if (declared_key)
+      crypto_free_pk_env(declared_key);
+    s = end;
+  }
+
+  digestmap_free(identity_keys, (void (*)(void*))crypto_free_pk_env);
+}
+
 /* For debugging: define to count every descriptor digest we've seen so we
  * know if we need to try harder to avoid duplicate verifies. */
 #undef COUNT_DISTINCT_DIGESTS
@@ -1298,7 +1440,8 @@ router_parse_entry_from_string(const char *s, const char *end,
     --end;
 
   area = memarea_new();
-  tokens = smartlist_create();
+  /* Exit policies alone usually take a few dozen tokens. */
+  tokens = smartlist_create_with_capacity(64);
   if (prepend_annotations) {
     if (tokenize_string(area,prepend_annotations,NULL,tokens,
                         routerdesc_token_table,TS_NOCHECK)) {
@@ -1716,7 +1859,7 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
       extrainfo->cache_info.send_unencrypted =
         router->cache_info.send_unencrypted;
   } else {
-    extrainfo->pending_sig = tor_memdup(tok->object_body,
+    extrainfo->pending_sig = tor_memdup(token_get_object_body(tok),
                                         tok->object_size);
     extrainfo->pending_sig_len = tok->object_size;
   }
@@ -1935,23 +2078,22 @@ authority_cert_parse_from_string(const char *s, const char **end_of_string)
 static INLINE const char *
 find_start_of_next_routerstatus(const char *s)
 {
-  const char *eos, *footer, *sig;
+  const char *eos, *cp;
   if ((eos = strstr(s, "\nr ")))
     ++eos;
   else
     eos = s + strlen(s);
 
-  footer = tor_memstr(s, eos-s, "\ndirectory-footer");
-  sig = tor_memstr(s, eos-s, "\ndirectory-signature");
-
-  if (footer && sig)
-    return MIN(footer, sig) + 1;
-  else if (footer)
-    return footer+1;
-  else if (sig)
-    return sig+1;
-  else
-    return eos;
+  /* Look for the first "directory-footer" or "directory-signature" line,
+   * in one pass over the text. */
+  cp = s;
+  while ((cp = tor_memstr(cp, eos-cp, "\ndirectory-"))) {
+    ++cp;
+    if (!strcmpstart(cp, "directory-footer") ||
+        !strcmpstart(cp, "directory-signature"))
+      return cp;
+  }
+  return eos;
 }
 
 /** Given a string at *<b>s</b>, containing a routerstatus object, and an
@@ -1967,6 +2109,12 @@ find_start_of_next_routerstatus(const char *s)
  * make that consensus.
  *
  * Parse according to the syntax used by the consensus flavor <b>flav</b>.
+ *
+ * If <b>quiet</b> is true, don't log or dump anything about a bad entry:
+ * escaped() and dump_desc() aren't safe to call outside the main thread.
+ * This function is otherwise safe to call from a cpuworker, so long as
+ * <b>area</b> came from memarea_new_unshared() and the token index for
+ * rtrstatus_token_table has already been built.
  **/
 static routerstatus_t *
 routerstatus_parse_entry_from_string(memarea_t *area,
@@ -1974,7 +2122,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
                                      networkstatus_t *vote,
                                      vote_routerstatus_t *vote_rs,
                                      int consensus_method,
-                                     consensus_flavor_t flav)
+                                     consensus_flavor_t flav, int quiet)
 {
   const char *eos, *s_dup = *s;
   routerstatus_t *rs = NULL;
@@ -1992,18 +2140,21 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   eos = find_start_of_next_routerstatus(*s);
 
   if (tokenize_string(area,*s, eos, tokens, rtrstatus_token_table,0)) {
-    log_warn(LD_DIR, "Error tokenizing router status");
+    if (!quiet)
+      log_warn(LD_DIR, "Error tokenizing router status");
     goto err;
   }
   if (smartlist_len(tokens) < 1) {
-    log_warn(LD_DIR, "Impossibly short router status");
+    if (!quiet)
+      log_warn(LD_DIR, "Impossibly short router status");
     goto err;
   }
   tok = find_by_keyword(tokens, K_R);
   tor_assert(tok->n_args >= 7); /* guaranteed by GE(7) in K_R setup */
   if (flav == FLAV_NS) {
     if (tok->n_args < 8) {
-      log_warn(LD_DIR, "Too few arguments to r");
+      if (!quiet)
+        log_warn(LD_DIR, "Too few arguments to r");
       goto err;
     }
   } else if (flav == FLAV_MICRODESC) {
@@ -2017,23 +2168,26 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   }
 
   if (!is_legal_nickname(tok->args[0])) {
-    log_warn(LD_DIR,
-             "Invalid nickname %s in router status; skipping.",
-             escaped(tok->args[0]));
+    if (!quiet)
+      log_warn(LD_DIR,
+               "Invalid nickname %s in router status; skipping.",
+               escaped(tok->args[0]));
     goto err;
   }
   strlcpy(rs->nickname, tok->args[0], sizeof(rs->nickname));
 
   if (digest_from_base64(rs->identity_digest, tok->args[1])) {
-    log_warn(LD_DIR, "Error decoding identity digest %s",
-             escaped(tok->args[1]));
+    if (!quiet)
+      log_warn(LD_DIR, "Error decoding identity digest %s",
+               escaped(tok->args[1]));
     goto err;
   }
 
   if (flav == FLAV_NS) {
     if (digest_from_base64(rs->descriptor_digest, tok->args[2])) {
-      log_warn(LD_DIR, "Error decoding descriptor digest %s",
-               escaped(tok->args[2]));
+      if (!quiet)
+        log_warn(LD_DIR, "Error decoding descriptor digest %s",
+                 escaped(tok->args[2]));
       goto err;
     }
   }
@@ -2041,15 +2195,17 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   if (tor_snprintf(timebuf, sizeof(timebuf), "%s %s",
                    tok->args[3+offset], tok->args[4+offset]) < 0 ||
       parse_iso_time(timebuf, &rs->published_on)<0) {
-    log_warn(LD_DIR, "Error parsing time '%s %s' [%d %d]",
-             tok->args[3+offset], tok->args[4+offset],
-             offset, (int)flav);
+    if (!quiet)
+      log_warn(LD_DIR, "Error parsing time '%s %s' [%d %d]",
+               tok->args[3+offset], tok->args[4+offset],
+               offset, (int)flav);
     goto err;
   }
 
   if (tor_inet_aton(tok->args[5+offset], &in) == 0) {
-    log_warn(LD_DIR, "Error parsing router address in network-status %s",
-             escaped(tok->args[5+offset]));
+    if (!quiet)
+      log_warn(LD_DIR, "Error parsing router address in network-status %s",
+               escaped(tok->args[5+offset]));
     goto err;
   }
   rs->addr = ntohl(in.s_addr);
@@ -2068,8 +2224,9 @@ routerstatus_parse_entry_from_string(memarea_t *area,
       if (p >= 0) {
         vote_rs->flags |= (1<<p);
       } else {
-        log_warn(LD_DIR, "Flags line had a flag %s not listed in known_flags.",
-                 escaped(tok->args[i]));
+        if (!quiet)
+          log_warn(LD_DIR, "Flags line had a flag %s not listed in "
+                   "known_flags.", escaped(tok->args[i]));
         goto err;
       }
     }
@@ -2151,7 +2308,8 @@ routerstatus_parse_entry_from_string(memarea_t *area,
                                                   10, 0, UINT32_MAX,
                                                   &ok, NULL);
         if (!ok) {
-          log_warn(LD_DIR, "Invalid Bandwidth %s", escaped(tok->args[i]));
+          if (!quiet)
+            log_warn(LD_DIR, "Invalid Bandwidth %s", escaped(tok->args[i]));
           goto err;
         }
         rs->has_bandwidth = 1;
@@ -2161,8 +2319,9 @@ routerstatus_parse_entry_from_string(memarea_t *area,
             (uint32_t)tor_parse_ulong(strchr(tok->args[i], '=')+1,
                                       10, 0, UINT32_MAX, &ok, NULL);
         if (!ok) {
-          log_warn(LD_DIR, "Invalid Measured Bandwidth %s",
-                   escaped(tok->args[i]));
+          if (!quiet)
+            log_warn(LD_DIR, "Invalid Measured Bandwidth %s",
+                     escaped(tok->args[i]));
           goto err;
         }
         rs->has_measured_bw = 1;
@@ -2175,8 +2334,9 @@ routerstatus_parse_entry_from_string(memarea_t *area,
     tor_assert(tok->n_args == 1);
     if (strcmpstart(tok->args[0], "accept ") &&
         strcmpstart(tok->args[0], "reject ")) {
-      log_warn(LD_DIR, "Unknown exit policy summary type %s.",
-               escaped(tok->args[0]));
+      if (!quiet)
+        log_warn(LD_DIR, "Unknown exit policy summary type %s.",
+                 escaped(tok->args[0]));
       goto err;
     }
     /* XXX weasel: parse this into ports and represent them somehow smart,
@@ -2202,8 +2362,9 @@ routerstatus_parse_entry_from_string(memarea_t *area,
     if (tok) {
       tor_assert(tok->n_args);
       if (digest256_from_base64(rs->descriptor_digest, tok->args[0])) {
-        log_warn(LD_DIR, "Error decoding microdescriptor digest %s",
-                 escaped(tok->args[0]));
+        if (!quiet)
+          log_warn(LD_DIR, "Error decoding microdescriptor digest %s",
+                   escaped(tok->args[0]));
         goto err;
       }
     }
@@ -2214,7 +2375,8 @@ routerstatus_parse_entry_from_string(memarea_t *area,
 
   goto done;
  err:
-  dump_desc(s_dup, "routerstatus entry");
+  if (!quiet)
+    dump_desc(s_dup, "routerstatus entry");
   if (rs && !vote_rs)
     routerstatus_free(rs);
   rs = NULL;
@@ -2230,6 +2392,229 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   return rs;
 }
 
+/** Parse the routerstatus entry at *<b>s</b> in the v3 networkstatus
+ * <b>ns</b> (whose routerstatus entries use the flavor <b>flav</b>), and
+ * advance *<b>s</b> past it.  Return a new vote_routerstatus_t if <b>ns</b>
+ * is a vote or opinion, a new routerstatus_t if it is a consensus, or NULL
+ * if the entry is bad.  <b>area</b>, <b>tokens</b>, and <b>quiet</b> are as
+ * for routerstatus_parse_entry_from_string(). */
+static void *
+routerstatus_parse_one_entry(networkstatus_t *ns, memarea_t *area,
+                             const char **s, smartlist_t *tokens,
+                             consensus_flavor_t flav, int quiet)
+{
+  if (ns->type != NS_TYPE_CONSENSUS) {
+    vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
+    if (routerstatus_parse_entry_from_string(area, s, tokens, ns, rs, 0, 0,
+                                             quiet))
+      return rs;
+    tor_free(rs->version);
+    tor_free(rs);
+    return NULL;
+  } else {
+    return routerstatus_parse_entry_from_string(area, s, tokens, NULL, NULL,
+                                                ns->consensus_method, flav,
+                                                quiet);
+  }
+}
+
+#ifdef TOR_HAVE_COND
+/** Don't parse routerstatus entries in parallel unless every thread would
+ * get at least this many. */
+#define RS_PARSE_MIN_CHUNK 256
+/** Never split a networkstatus into more than this many chunks. */
+#define RS_PARSE_MAX_CHUNKS 16
+
+struct rs_parse_batch_t;
+
+/** A run of consecutive routerstatus entries for one thread to parse. */
+typedef struct rs_parse_chunk_t {
+  struct rs_parse_batch_t *batch; /**< The batch this chunk is part of. */
+  int first; /**< Index of the first entry in this chunk. */
+  int n; /**< Number of entries in this chunk. */
+  /** True once some thread has started on this chunk.  Protected by
+   * batch-\>lock. */
+  int claimed;
+} rs_parse_chunk_t;
+
+/** The routerstatus entries of one networkstatus, split into chunks so
+ * that pool cpuworkers can parse some of them while the main thread parses
+ * the rest. */
+typedef struct rs_parse_batch_t {
+  tor_mutex_t *lock; /**< Protects claimed and n_unfinished. */
+  tor_cond_t *cond; /**< Signalled once n_unfinished reaches zero. */
+  int n_unfinished; /**< How many chunks haven't been parsed yet? */
+  /** How many references are there to this batch: one from the parser, and
+   * one from each job we queued.  Only the main thread touches this. */
+  int refcnt;
+  networkstatus_t *ns; /**< The networkstatus the entries belong to. */
+  consensus_flavor_t flav; /**< The flavor of the entries. */
+  const char **starts; /**< Where does each entry start? */
+  /** The parsed entries, in order, with NULL for each bad one. */
+  void **results;
+  int n_chunks; /**< How many members of chunks are in use? */
+  rs_parse_chunk_t chunks[RS_PARSE_MAX_CHUNKS]; /**< The chunks. */
+} rs_parse_batch_t;
+
+/** Parse the entries in <b>chunk</b> unless another thread has already
+ * started on them.  Safe to call from any thread. */
+static void
+rs_parse_chunk_run(void *arg)
+{
+  rs_parse_chunk_t *chunk = arg;
+  rs_parse_batch_t *batch = chunk->batch;
+  memarea_t *area;
+  smartlist_t *tokens;
+  int i;
+
+  tor_mutex_acquire(batch->lock);
+  if (chunk->claimed) {
+    tor_mutex_release(batch->lock);
+    return;
+  }
+  chunk->claimed = 1;
+  tor_mutex_release(batch->lock);
+
+  area = memarea_new_unshared();
+  tokens = smartlist_create();
+  for (i = chunk->first; i < chunk->first + chunk->n; ++i) {
+    const char *s = batch->starts[i];
+    batch->results[i] = routerstatus_parse_one_entry(batch->ns, area, &s,
+                                                     tokens, batch->flav, 1);
+  }
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+
+  tor_mutex_acquire(batch->lock);
+  if (--batch->n_unfinished == 0)
+    tor_cond_signal_all(batch->cond);
+  tor_mutex_release(batch->lock);
+}
+
+/** Drop a reference to <b>batch</b>, and free it if that was the last. */
+static void
+rs_parse_batch_decref(rs_parse_batch_t *batch)
+{
+  if (--batch->refcnt)
+    return;
+  tor_mutex_free(batch->lock);
+  tor_cond_free(batch->cond);
+  tor_free(batch);
+}
+
+/** Runs in the main thread once a cpuworker is done with the chunk in
+ * <b>arg</b>.  The parser may have finished long ago: all we do here is
+ * let go of the batch. */
+static void
+rs_parse_chunk_reply(void *arg)
+{
+  rs_parse_chunk_t *chunk = arg;
+  rs_parse_batch_decref(chunk->batch);
+}
+#endif
+
+/** Parse the routerstatus entries at *<b>s</b> for the v3 networkstatus
+ * <b>ns</b> in up to <b>n_threads</b> threads at once, by having pool
+ * cpuworkers take some runs of entries while we parse the others.  Add
+ * the good ones to ns-\>routerstatus_list in order, and advance *<b>s</b>
+ * past the last entry.  Bad entries are parsed once more here, with
+ * <b>area</b> and <b>tokens</b>, so that they get logged just as they
+ * would have been by a serial parse.
+ *
+ * Return 0 on success, or -1 if there are too few entries to be worth
+ * splitting up, in which case we haven't changed anything. */
+int
+routerstatus_parse_entries_parallel(networkstatus_t *ns, const char **s,
+                                    memarea_t *area, smartlist_t *tokens,
+                                    consensus_flavor_t flav, int n_threads)
+{
+#ifdef TOR_HAVE_COND
+  smartlist_t *starts;
+  rs_parse_batch_t *batch;
+  const char *cp;
+  int i, n_entries, n_chunks;
+
+  if (n_threads < 2)
+    return -1;
+
+  /* Find where each entry starts.  This is a lot cheaper than parsing
+   * them. */
+  starts = smartlist_create();
+  cp = *s;
+  while (!strcmpstart(cp, "r ")) {
+    smartlist_add(starts, (char*)cp);
+    cp = find_start_of_next_routerstatus(cp);
+  }
+  n_entries = smartlist_len(starts);
+  n_chunks = MIN(n_threads, n_entries / RS_PARSE_MIN_CHUNK);
+  n_chunks = MIN(n_chunks, RS_PARSE_MAX_CHUNKS);
+  if (n_chunks < 2) {
+    smartlist_free(starts);
+    return -1;
+  }
+
+  /* The cpuworkers will use the index for rtrstatus_token_table, so make
+   * sure it exists before they start. */
+  token_table_get_index(rtrstatus_token_table);
+
+  batch = tor_malloc_zero(sizeof(rs_parse_batch_t));
+  batch->lock = tor_mutex_new();
+  batch->cond = tor_cond_new();
+  batch->refcnt = 1;
+  batch->ns = ns;
+  batch->flav = flav;
+  batch->starts = (const char **)starts->list;
+  batch->results = tor_malloc_zero(sizeof(void*) * n_entries);
+  batch->n_chunks = batch->n_unfinished = n_chunks;
+  for (i = 0; i < n_chunks; ++i) {
+    rs_parse_chunk_t *chunk = &batch->chunks[i];
+    chunk->batch = batch;
+    chunk->first = (int)(((int64_t)n_entries * i) / n_chunks);
+    chunk->n = (int)(((int64_t)n_entries * (i+1)) / n_chunks) - chunk->first;
+  }
+
+  /* Hand every chunk but the first to the pool, then work through them
+   * ourselves, skipping any a cpuworker has already started. */
+  for (i = 1; i < n_chunks; ++i) {
+    if (cpuworker_queue_work(rs_parse_chunk_run, rs_parse_chunk_reply,
+                             &batch->chunks[i]) == 0)
+      ++batch->refcnt;
+  }
+  for (i = 0; i < n_chunks; ++i)
+    rs_parse_chunk_run(&batch->chunks[i]);
+  tor_mutex_acquire(batch->lock);
+  while (batch->n_unfinished)
+    tor_cond_wait(batch->cond, batch->lock);
+  tor_mutex_release(batch->lock);
+
+  for (i = 0; i < n_entries; ++i) {
+    void *rs = batch->results[i];
+    if (!rs) {
+      const char *entry = batch->starts[i];
+      rs = routerstatus_parse_one_entry(ns, area, &entry, tokens, flav, 0);
+    }
+    if (rs)
+      smartlist_add(ns->routerstatus_list, rs);
+  }
+  *s = cp;
+
+  tor_free(batch->results);
+  batch->starts = NULL;
+  batch->ns = NULL;
+  smartlist_free(starts);
+  rs_parse_batch_decref(batch);
+  return 0;
+#else
+  (void)ns;
+  (void)s;
+  (void)area;
+  (void)tokens;
+  (void)flav;
+  (void)n_threads;
+  return -1;
+#endif
+}
+
 /** Helper to sort a smartlist of pointers to routerstatus_t */
 int
 compare_routerstatus_entries(const void **_a, const void **_b)
@@ -2376,10 +2761,12 @@ networkstatus_v2_parse_from_string(const char *s)
   while (!strcmpstart(s, "r ")) {
     routerstatus_t *rs;
     if ((rs = routerstatus_parse_entry_from_string(area, &s, tokens,
-                                                   NULL, NULL, 0, 0)))
+                                                   NULL, NULL, 0, 0, 0)))
       smartlist_add(ns->entries, rs);
   }
-  smartlist_sort(ns->entries, compare_routerstatus_entries);
+  smartlist_sort_by_digest(ns->entries,
+                           STRUCT_OFFSET(routerstatus_t, identity_digest),
+                           compare_routerstatus_entries);
   smartlist_uniq(ns->entries, compare_routerstatus_entries,
                  _free_duplicate_routerstatus_entry);
 
@@ -2810,10 +3197,15 @@ networkstatus_verify_bw_weights(networkstatus_t *ns)
 }
 
 /** Parse a v3 networkstatus vote, opinion, or consensus (depending on
- * ns_type), from <b>s</b>, and return the result.  Return NULL on failure. */
-networkstatus_t *
-networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
-                                     networkstatus_type_t ns_type)
+ * ns_type), from <b>s</b>, and return the result.  Return NULL on failure.
+ * If <b>rs_list</b> is provided, it holds the routerstatus_t entries of
+ * the consensus in <b>s</b>, already parsed: skip over the entries in
+ * <b>s</b> and use it instead.  We take ownership of <b>rs_list</b> either
+ * way. */
+static networkstatus_t *
+networkstatus_parse_vote_impl(const char *s, const char **eos_out,
+                              networkstatus_type_t ns_type,
+                              smartlist_t *rs_list)
 {
   smartlist_t *tokens = smartlist_create();
   smartlist_t *rs_tokens = NULL, *footer_tokens = NULL;
@@ -3107,25 +3499,27 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   rs_tokens = smartlist_create();
   rs_area = memarea_new();
   s = end_of_header;
-  ns->routerstatus_list = smartlist_create();
-
-  while (!strcmpstart(s, "r ")) {
-    if (ns->type != NS_TYPE_CONSENSUS) {
-      vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
-      if (routerstatus_parse_entry_from_string(rs_area, &s, rs_tokens, ns,
-                                               rs, 0, 0))
-        smartlist_add(ns->routerstatus_list, rs);
-      else {
-        tor_free(rs->version);
-        tor_free(rs);
+  if (rs_list) {
+    const char *footer;
+    tor_assert(ns_type == NS_TYPE_CONSENSUS);
+    ns->routerstatus_list = rs_list;
+    rs_list = NULL;
+    if (!(footer = find_str_at_start_of_line(s, "directory-footer")) &&
+        !(footer = find_str_at_start_of_line(s, "directory-signature"))) {
+      log_warn(LD_DIR, "Couldn't find the footer of a consensus.");
+      goto err;
+    }
+    s = footer;
+  } else {
+    ns->routerstatus_list = smartlist_create();
+    if (routerstatus_parse_entries_parallel(ns, &s, rs_area, rs_tokens, flav,
+                                          cpuworker_n_pool_workers()+1) < 0) {
+      while (!strcmpstart(s, "r ")) {
+        void *rs = routerstatus_parse_one_entry(ns, rs_area, &s, rs_tokens,
+                                                flav, 0);
+        if (rs)
+          smartlist_add(ns->routerstatus_list, rs);
       }
-    } else {
-      routerstatus_t *rs;
-      if ((rs = routerstatus_parse_entry_from_string(rs_area, &s, rs_tokens,
-                                                     NULL, NULL,
-                                                     ns->consensus_method,
-                                                     flav)))
-        smartlist_add(ns->routerstatus_list, rs);
     }
   }
   for (i = 1; i < smartlist_len(ns->routerstatus_list); ++i) {
@@ -3290,7 +3684,8 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
         tor_free(sig);
         goto err;
       }
-      sig->signature = tor_memdup(tok->object_body, tok->object_size);
+      sig->signature = tor_memdup(token_get_object_body(tok),
+                                  tok->object_size);
       sig->signature_len = (int) tok->object_size;
     }
     smartlist_add(v->sigs, sig);
@@ -3316,6 +3711,10 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   networkstatus_vote_free(ns);
   ns = NULL;
  done:
+  if (rs_list) {
+    SMARTLIST_FOREACH(rs_list, routerstatus_t *, rs, routerstatus_free(rs));
+    smartlist_free(rs_list);
+  }
   if (tokens) {
     SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
     smartlist_free(tokens);
@@ -3349,6 +3748,27 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   return ns;
 }
 
+/** Parse a v3 networkstatus vote, opinion, or consensus (depending on
+ * ns_type), from <b>s</b>, and return the result.  Return NULL on failure. */
+networkstatus_t *
+networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
+                                     networkstatus_type_t ns_type)
+{
+  return networkstatus_parse_vote_impl(s, eos_out, ns_type, NULL);
+}
+
+/** Parse the consensus in <b>s</b> as networkstatus_parse_vote_from_string()
+ * would, but take its routerstatus_t entries from <b>rs_list</b> instead of
+ * parsing them again.  The caller must know that <b>rs_list</b> came from
+ * this very document.  We take ownership of <b>rs_list</b>, even on
+ * failure. */
+networkstatus_t *
+networkstatus_parse_consensus_with_routerstatuses(const char *s,
+                                                  smartlist_t *rs_list)
+{
+  return networkstatus_parse_vote_impl(s, NULL, NS_TYPE_CONSENSUS, rs_list);
+}
+
 /** Return the digests_t that holds the digests of the
  * <b>flavor_name</b>-flavored networkstatus according to the detached
  * signatures document <b>sigs</b>, allocating a new digests_t as neeeded. */
@@ -3559,7 +3979,7 @@ networkstatus_parse_detached_signatures(const char *s, const char *eos)
       tor_free(sig);
       goto err;
     }
-    sig->signature = tor_memdup(tok->object_body, tok->object_size);
+    sig->signature = tor_memdup(token_get_object_body(tok), tok->object_size);
     sig->signature_len = (int) tok->object_size;
 
     smartlist_add(siglist, sig);
@@ -3753,6 +4173,28 @@ token_clear(directory_token_t *tok)
 {
   if (tok->key)
     crypto_free_pk_env(tok->key);
+  tor_free(tok->object_body);
+}
+
+/** Return the base64-decoded contents of the object in <b>tok</b>, decoding
+ * it on first use.  The tokenizer has already checked that the object is
+ * well-formed and set tok-\>object_size, so most callers (for example,
+ * signature checks answered from the sigcache) never need the decoded bytes
+ * at all.  The result is freed by token_clear(). */
+static const char *
+token_get_object_body(directory_token_t *tok)
+{
+  size_t buflen;
+  int r;
+  if (tok->object_body || !tok->object_text)
+    return tok->object_body;
+  /* base64_decode() wants room for the worst case, not the exact size. */
+  buflen = (tok->object_text_len*3)/4 + 1;
+  tok->object_body = tor_malloc(buflen);
+  r = base64_decode(tok->object_body, buflen,
+                    tok->object_text, tok->object_text_len);
+  tor_assert(r >= 0 && (size_t)r == tok->object_size);
+  return tok->object_body;
 }
 
 #define ALLOC_ZERO(sz) memarea_alloc_zero(area,sz)
@@ -3782,7 +4224,7 @@ token_check_object(memarea_t *area, const char *kwd,
   switch (o_syn) {
     case NO_OBJ:
       /* No object is allowed for this token. */
-      if (tok->object_body) {
+      if (tok->object_text) {
         tor_snprintf(ebuf, sizeof(ebuf), "Unexpected object for %s", kwd);
         RET_ERR(ebuf);
       }
@@ -3793,7 +4235,7 @@ token_check_object(memarea_t *area, const char *kwd,
       break;
     case NEED_OBJ:
       /* There must be a (non-key) object. */
-      if (!tok->object_body) {
+      if (!tok->object_text) {
         tor_snprintf(ebuf, sizeof(ebuf), "Missing object for %s", kwd);
         RET_ERR(ebuf);
       }
@@ -3865,6 +4307,92 @@ get_token_arguments(memarea_t *area, directory_token_t *tok,
 #undef MAX_ARGS
 }
 
+/** Number of slots in a token_table_index_t.  Must be a power of two, and
+ * comfortably more than twice the size of any token table. */
+#define TOKEN_INDEX_SLOTS 128
+/** Most token tables we'll ever index. */
+#define MAX_TOKEN_TABLES 32
+
+/** A hash index over the keywords of one token table, so that
+ * get_next_token() can find the rule for a keyword without comparing it
+ * against every entry in the table. */
+typedef struct token_table_index_t {
+  /** The table that this index describes. */
+  const token_rule_t *table;
+  /** Open-addressed hash table of keywords: each slot holds 1 + the
+   * position of a rule in <b>table</b>, or 0 if the slot is empty. */
+  uint8_t slots[TOKEN_INDEX_SLOTS];
+} token_table_index_t;
+
+/** Indices for every token table we've tokenized with so far.  The tables
+ * are static, so we build each index once and keep it forever. */
+static token_table_index_t token_table_indices[MAX_TOKEN_TABLES];
+/** Number of entries used in token_table_indices. */
+static int n_token_table_indices = 0;
+
+/** Return a hash of the <b>len</b>-byte keyword at <b>s</b>. */
+static INLINE unsigned
+token_keyword_hash(const char *s, size_t len)
+{
+  unsigned h = (unsigned) len;
+  while (len--)
+    h = h*31 + (unsigned char) *s++;
+  return h;
+}
+
+/** Return the index for <b>table</b>, building it if this is the first time
+ * we've seen <b>table</b>. */
+static const token_table_index_t *
+token_table_get_index(const token_rule_t *table)
+{
+  token_table_index_t *idx;
+  int i;
+
+  for (i = 0; i < n_token_table_indices; ++i) {
+    if (token_table_indices[i].table == table)
+      return &token_table_indices[i];
+  }
+
+  tor_assert(n_token_table_indices < MAX_TOKEN_TABLES);
+  idx = &token_table_indices[n_token_table_indices++];
+  idx->table = table;
+  for (i = 0; table[i].t; ++i) {
+    size_t len = strlen(table[i].t);
+    unsigned h = token_keyword_hash(table[i].t, len);
+    tor_assert(i < TOKEN_INDEX_SLOTS/2);
+    for (;;) {
+      uint8_t slot = idx->slots[h & (TOKEN_INDEX_SLOTS-1)];
+      if (!slot) {
+        idx->slots[h & (TOKEN_INDEX_SLOTS-1)] = (uint8_t)(i+1);
+        break;
+      }
+      /* If a keyword appears twice, the first rule wins, as it did when we
+       * searched the table in order. */
+      if (!strcmp(table[slot-1].t, table[i].t))
+        break;
+      ++h;
+    }
+  }
+  return idx;
+}
+
+/** Return the rule in <b>table</b> for the <b>len</b>-byte keyword at
+ * <b>s</b>, or NULL if <b>table</b> has no such keyword. */
+static const token_rule_t *
+token_table_find(const token_rule_t *table, const char *s, size_t len)
+{
+  const token_table_index_t *idx = token_table_get_index(table);
+  unsigned h = token_keyword_hash(s, len);
+  uint8_t slot;
+
+  while ((slot = idx->slots[h & (TOKEN_INDEX_SLOTS-1)])) {
+    if (!strcmp_len(s, table[slot-1].t, len))
+      return &table[slot-1];
+    ++h;
+  }
+  return NULL;
+}
+
 /** Helper function: read the next token from *s, advance *s to the end of the
  * token, and return the parsed token.  Parse *<b>s</b> according to the list
  * of tokens in <b>table</b>.
@@ -3882,7 +4410,7 @@ get_next_token(memarea_t *area,
 
   const char *next, *eol, *obstart;
   size_t obname_len;
-  int i;
+  const token_rule_t *rule;
   directory_token_t *tok;
   obj_syntax o_syn = NO_OBJ;
   char ebuf[128];
@@ -3912,38 +4440,35 @@ get_next_token(memarea_t *area,
     RET_ERR("Unexpected EOF");
   }
 
-  /* Search the table for the appropriate entry.  (I tried a binary search
-   * instead, but it wasn't any faster.) */
-  for (i = 0; table[i].t ; ++i) {
-    if (!strcmp_len(*s, table[i].t, next-*s)) {
-      /* We've found the keyword. */
-      kwd = table[i].t;
-      tok->tp = table[i].v;
-      o_syn = table[i].os;
-      *s = eat_whitespace_eos_no_nl(next, eol);
-      /* We go ahead whether there are arguments or not, so that tok->args is
-       * always set if we want arguments. */
-      if (table[i].concat_args) {
-        /* The keyword takes the line as a single argument */
-        tok->args = ALLOC(sizeof(char*));
-        tok->args[0] = STRNDUP(*s,eol-*s); /* Grab everything on line */
-        tok->n_args = 1;
-      } else {
-        /* This keyword takes multiple arguments. */
-        if (get_token_arguments(area, tok, *s, eol)<0) {
-          tor_snprintf(ebuf, sizeof(ebuf),"Far too many arguments to %s", kwd);
-          RET_ERR(ebuf);
-        }
-        *s = eol;
-      }
-      if (tok->n_args < table[i].min_args) {
-        tor_snprintf(ebuf, sizeof(ebuf), "Too few arguments to %s", kwd);
-        RET_ERR(ebuf);
-      } else if (tok->n_args > table[i].max_args) {
-        tor_snprintf(ebuf, sizeof(ebuf), "Too many arguments to %s", kwd);
+  /* Look up the keyword in the table's hash index. */
+  rule = token_table_find(table, *s, next-*s);
+  if (rule) {
+    /* We've found the keyword. */
+    kwd = rule->t;
+    tok->tp = rule->v;
+    o_syn = rule->os;
+    *s = eat_whitespace_eos_no_nl(next, eol);
+    /* We go ahead whether there are arguments or not, so that tok->args is
+     * always set if we want arguments. */
+    if (rule->concat_args) {
+      /* The keyword takes the line as a single argument */
+      tok->args = ALLOC(sizeof(char*));
+      tok->args[0] = STRNDUP(*s,eol-*s); /* Grab everything on line */
+      tok->n_args = 1;
+    } else {
+      /* This keyword takes multiple arguments. */
+      if (get_token_arguments(area, tok, *s, eol)<0) {
+        tor_snprintf(ebuf, sizeof(ebuf),"Far too many arguments to %s", kwd);
         RET_ERR(ebuf);
       }
-      break;
+      *s = eol;
+    }
+    if (tok->n_args < rule->min_args) {
+      tor_snprintf(ebuf, sizeof(ebuf), "Too few arguments to %s", kwd);
+      RET_ERR(ebuf);
+    } else if (tok->n_args > rule->max_args) {
+      tor_snprintf(ebuf, sizeof(ebuf), "Too many arguments to %s", kwd);
+      RET_ERR(ebuf);
     }
   }
 
@@ -4005,12 +4530,14 @@ get_next_token(memarea_t *area,
     tok->key = crypto_new_pk_env();
     if (crypto_pk_read_private_key_from_string(tok->key, obstart, eol-obstart))
       RET_ERR("Couldn't parse private key.");
-  } else { /* If it's something else, try to base64-decode it */
-    int r;
-    tok->object_body = ALLOC(next-*s); /* really, this is too much RAM. */
-    r = base64_decode(tok->object_body, next-*s, *s, next-*s);
+  } else { /* If it's something else, make sure it's valid base64. */
+    /* We don't decode the object here: we only remember where it is, and
+     * token_get_object_body() decodes it if somebody asks. */
+    int r = base64_decoded_len(*s, next-*s);
     if (r<0)
       RET_ERR("Malformed object: bad base64-encoded data");
+    tok->object_text = *s;
+    tok->object_text_len = next-*s;
     tok->object_size = r;
   }
   *s = eol;
@@ -4411,12 +4938,12 @@ microdescs_parse_from_string(const char *s, const char *eos,
       md->exit_policy = parse_short_policy(tok->args[0]);
     }
 
-    crypto_digest256(md->digest, md->body, md->bodylen, DIGEST_SHA256);
-
     smartlist_add(result, md);
 
     md = NULL;
   next:
+    if (md && !copy_body)
+      md->body = NULL; /* It points into the caller's string. */
     microdesc_free(md);
     md = NULL;
 
@@ -4428,6 +4955,24 @@ microdescs_parse_from_string(const char *s, const char *eos,
   memarea_drop_all(area);
   smartlist_free(tokens);
 
+  /* Now that we know which ones parsed, hash them all in one batch. */
+  if (smartlist_len(result)) {
+    int i, n = smartlist_len(result);
+    char **digests = tor_malloc(sizeof(char*)*n);
+    const char **bodies = tor_malloc(sizeof(char*)*n);
+    size_t *lens = tor_malloc(sizeof(size_t)*n);
+    for (i = 0; i < n; ++i) {
+      microdesc_t *m = smartlist_get(result, i);
+      digests[i] = m->digest;
+      bodies[i] = m->body;
+      lens[i] = m->bodylen;
+    }
+    crypto_digest_multi(digests, bodies, lens, n, DIGEST_SHA256);
+    tor_free(digests);
+    tor_free(bodies);
+    tor_free(lens);
+  }
+
   return result;
 }
 
@@ -4800,7 +5345,7 @@ rend_parse_v2_service_descriptor(rend_service_descriptor_t **parsed_out,
                "type MESSAGE");
       goto err;
     }
-    *intro_points_encrypted_out = tor_memdup(tok->object_body,
+    *intro_points_encrypted_out = tor_memdup(token_get_object_body(tok),
                                              tok->object_size);
     *intro_points_encrypted_size_out = tok->object_size;
   } else {
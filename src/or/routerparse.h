@@ -31,6 +31,9 @@ int router_parse_list_from_string(const char **s, const char *eos,
                                   int is_extrainfo,
                                   int allow_annotations,
                                   const char *prepend_annotations);
+void router_check_uploaded_signatures(const char *s, size_t s_len,
+                                      smartlist_t *digests_out,
+                                      smartlist_t *keys_out);
 int router_parse_runningrouters(const char *str);
 int router_parse_directory(const char *str);
 
@@ -58,6 +61,9 @@ int networkstatus_verify_bw_weights(networkstatus_t *ns);
 networkstatus_t *networkstatus_parse_vote_from_string(const char *s,
                                                  const char **eos_out,
                                                  networkstatus_type_t ns_type);
+networkstatus_t *networkstatus_parse_consensus_with_routerstatuses(
+                                                 const char *s,
+                                                 smartlist_t *rs_list);
 ns_detached_signatures_t *networkstatus_parse_detached_signatures(
                                           const char *s, const char *eos);
 
@@ -83,5 +89,14 @@ int rend_parse_introduction_points(rend_service_descriptor_t *parsed,
                                    size_t intro_points_encoded_size);
 int rend_parse_client_keys(strmap_t *parsed_clients, const char *str);
 
+#ifdef ROUTERPARSE_PRIVATE
+struct memarea_t;
+int routerstatus_parse_entries_parallel(networkstatus_t *ns, const char **s,
+                                        struct memarea_t *area,
+                                        smartlist_t *tokens,
+                                        consensus_flavor_t flav,
+                                        int n_threads);
+#endif
+
 #endif
 
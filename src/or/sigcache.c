@@ -0,0 +1,219 @@
+/* Copyright (c) 2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file sigcache.c
+ * \brief Remember which directory document signatures we have already
+ * checked, so that we don't repeat the RSA operation every time we reparse
+ * the same document -- most notably when reloading our descriptor caches
+ * at startup.
+ *
+ * We key the cache on a digest of the signed document's digest and the
+ * digest of the key that signed it, and only ever record good signatures.
+ * Once we have seen some key sign a document, any later signature object
+ * by that key on the same document tells us nothing new, so it doesn't need
+ * to be part of the key.  The cache is saved in the data directory as a
+ * header line followed by raw DIGEST_LEN-byte entries.
+ **/
+
+#define SIGCACHE_PRIVATE
+
+#include "or.h"
+#include "config.h"
+#include "sigcache.h"
+
+/** Never hold more than this many entries. */
+#define SIGCACHE_MAX_ENTRIES 65536
+/** Don't rewrite the cache file more often than this, unless forced. */
+#define SIGCACHE_SAVE_INTERVAL (15*60)
+/** First line of the cache file. */
+#define SIGCACHE_HEADER "tor-sigcache-v1\n"
+
+/** Value of an entry that we loaded from disk but haven't used yet. */
+#define SIGCACHE_UNUSED ((void*)1)
+/** Value of an entry that we added or used since starting. */
+#define SIGCACHE_USED ((void*)2)
+
+/** Map from the digest of (document digest, signing key digest) to
+ * SIGCACHE_UNUSED or SIGCACHE_USED. */
+static digestmap_t *sigcache = NULL;
+/** Number of entries in sigcache. */
+static int sigcache_n_entries = 0;
+/** True iff sigcache has entries that aren't on disk yet. */
+static int sigcache_dirty = 0;
+/** When did we last write the cache to disk? */
+static time_t sigcache_last_saved = 0;
+
+/** Set <b>key_out</b> to the cache key for a signature by <b>pkey</b> on a
+ * document whose <b>digest_len</b>-byte digest is <b>digest</b>.  Return 0
+ * on success, -1 on failure. */
+static int
+sigcache_compute_key(char *key_out, const char *digest, size_t digest_len,
+                     crypto_pk_env_t *pkey)
+{
+  char buf[DIGEST256_LEN + DIGEST_LEN];
+  tor_assert(digest_len <= DIGEST256_LEN);
+  if (crypto_pk_get_digest(pkey, buf) < 0)
+    return -1;
+  memcpy(buf+DIGEST_LEN, digest, digest_len);
+  crypto_digest(key_out, buf, DIGEST_LEN + digest_len);
+  return 0;
+}
+
+/** Return true iff we have already seen a good signature by <b>pkey</b> on
+ * a document whose <b>digest_len</b>-byte digest is <b>digest</b>. */
+int
+sigcache_lookup(const char *digest, size_t digest_len,
+                crypto_pk_env_t *pkey)
+{
+  char key[DIGEST_LEN];
+  void *val;
+  if (!sigcache || sigcache_compute_key(key, digest, digest_len, pkey) < 0)
+    return 0;
+  val = digestmap_get(sigcache, key);
+  if (!val)
+    return 0;
+  if (val != SIGCACHE_USED)
+    digestmap_set(sigcache, key, SIGCACHE_USED);
+  return 1;
+}
+
+/** Drop every entry that we haven't used since we started. */
+static void
+sigcache_remove_unused(void)
+{
+  DIGESTMAP_FOREACH_MODIFY(sigcache, key, void *, val) {
+    if (val == SIGCACHE_UNUSED) {
+      MAP_DEL_CURRENT(key);
+      --sigcache_n_entries;
+      sigcache_dirty = 1;
+    }
+  } DIGESTMAP_FOREACH_END;
+}
+
+/** Add <b>key</b> to the cache with value <b>val</b>, making room if we
+ * need to. */
+static void
+sigcache_insert(const char *key, void *val)
+{
+  if (!sigcache)
+    sigcache = digestmap_new();
+  if (digestmap_get(sigcache, key))
+    return;
+  if (sigcache_n_entries >= SIGCACHE_MAX_ENTRIES) {
+    sigcache_remove_unused();
+    if (sigcache_n_entries >= SIGCACHE_MAX_ENTRIES) {
+      log_info(LD_DIR, "Signature cache is full; clearing it.");
+      digestmap_free(sigcache, NULL);
+      sigcache = digestmap_new();
+      sigcache_n_entries = 0;
+    }
+  }
+  digestmap_set(sigcache, key, val);
+  ++sigcache_n_entries;
+}
+
+/** Remember that we have checked a good signature by <b>pkey</b> on a
+ * document whose <b>digest_len</b>-byte digest is <b>digest</b>. */
+void
+sigcache_add(const char *digest, size_t digest_len, crypto_pk_env_t *pkey)
+{
+  char key[DIGEST_LEN];
+  if (sigcache_compute_key(key, digest, digest_len, pkey) < 0)
+    return;
+  sigcache_insert(key, SIGCACHE_USED);
+  sigcache_dirty = 1;
+}
+
+/** Load the signature cache from the data directory.  Return 0 on success
+ * or if there is no cache yet, and -1 if the cache file was corrupt. */
+int
+sigcache_load(void)
+{
+  char *fname = get_datadir_fname("cached-sigcache");
+  char *contents;
+  struct stat st;
+  const char *cp, *eos;
+
+  contents = read_file_to_str(fname, RFTS_BIN|RFTS_IGNORE_MISSING, &st);
+  tor_free(fname);
+  if (!contents)
+    return 0;
+
+  if (strcmpstart(contents, SIGCACHE_HEADER) ||
+      ((size_t)st.st_size - strlen(SIGCACHE_HEADER)) % DIGEST_LEN) {
+    log_warn(LD_DIR, "Signature cache file was corrupt; ignoring it.");
+    tor_free(contents);
+    return -1;
+  }
+  eos = contents + st.st_size;
+  for (cp = contents + strlen(SIGCACHE_HEADER); cp < eos; cp += DIGEST_LEN)
+    sigcache_insert(cp, SIGCACHE_UNUSED);
+  log_info(LD_DIR, "Loaded %d entries into the signature cache.",
+           sigcache_n_entries);
+  tor_free(contents);
+  sigcache_last_saved = time(NULL);
+  return 0;
+}
+
+/** If the signature cache has changed since we last saved it, and it's
+ * been a while or <b>force</b> is set, write it to the data directory.
+ * Return 0 on success or if there was nothing to do, -1 on failure. */
+int
+sigcache_save(time_t now, int force)
+{
+  smartlist_t *chunks;
+  sized_chunk_t *chunk;
+  char *fname;
+  int r;
+
+  if (!sigcache || !sigcache_dirty)
+    return 0;
+  if (!force && sigcache_last_saved + SIGCACHE_SAVE_INTERVAL > now)
+    return 0;
+
+  chunks = smartlist_create();
+  chunk = tor_malloc(sizeof(sized_chunk_t));
+  chunk->bytes = SIGCACHE_HEADER;
+  chunk->len = strlen(SIGCACHE_HEADER);
+  smartlist_add(chunks, chunk);
+  DIGESTMAP_FOREACH(sigcache, key, void *, val) {
+    (void)val;
+    chunk = tor_malloc(sizeof(sized_chunk_t));
+    chunk->bytes = key;
+    chunk->len = DIGEST_LEN;
+    smartlist_add(chunks, chunk);
+  } DIGESTMAP_FOREACH_END;
+
+  fname = get_datadir_fname("cached-sigcache");
+  r = write_chunks_to_file_async(fname, chunks, 1);
+  if (r < 0)
+    log_warn(LD_FS, "Couldn't write signature cache to \"%s\".", fname);
+  tor_free(fname);
+  SMARTLIST_FOREACH(chunks, sized_chunk_t *, c, tor_free(c));
+  smartlist_free(chunks);
+
+  sigcache_last_saved = now;
+  if (r == 0)
+    sigcache_dirty = 0;
+  return r;
+}
+
+/** Return the number of entries in the signature cache. */
+int
+sigcache_size(void)
+{
+  return sigcache_n_entries;
+}
+
+/** Release all storage held by the signature cache. */
+void
+sigcache_free_all(void)
+{
+  digestmap_free(sigcache, NULL);
+  sigcache = NULL;
+  sigcache_n_entries = 0;
+  sigcache_dirty = 0;
+  sigcache_last_saved = 0;
+}
+
@@ -0,0 +1,25 @@
+/* Copyright (c) 2011, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file sigcache.h
+ * \brief Header file for sigcache.c.
+ **/
+
+#ifndef _TOR_SIGCACHE_H
+#define _TOR_SIGCACHE_H
+
+int sigcache_lookup(const char *digest, size_t digest_len,
+                    crypto_pk_env_t *pkey);
+void sigcache_add(const char *digest, size_t digest_len,
+                  crypto_pk_env_t *pkey);
+int sigcache_load(void);
+int sigcache_save(time_t now, int force);
+void sigcache_free_all(void);
+
+#ifdef SIGCACHE_PRIVATE
+int sigcache_size(void);
+#endif
+
+#endif
+
@@ -12,7 +12,14 @@
 #include "nodelist.h"
 #include "router.h"
 #include "circuitlist.h"
+#include "dns.h"
 #include "main.h"
+#include "buffers.h"
+#include "command.h"
+#include "cpuworker.h"
+#include "onion.h"
+#include "relay.h"
+#include "rephist.h"
 
 /** Return the total number of circuits. */
 static int
@@ -74,6 +81,35 @@ bytes_to_usage(uint64_t bytes)
   return bw_string;
 }
 
+/** As an exit, log how quickly our DNS lookups for streams have been coming
+ * back, and how each nameserver has been doing. */
+static void
+log_dns_heartbeat(void)
+{
+  uint32_t p50, p90, p99;
+  uint64_t failed, transient, timed_out;
+  smartlist_t *nameservers;
+  int n;
+
+  n = dns_get_latency_percentiles(&p50, &p90, &p99);
+  dns_get_lookup_failure_counts(&failed, &transient, &timed_out);
+  if (n)
+    log_fn(LOG_NOTICE, LD_HEARTBEAT, "Heartbeat: Our last %d DNS lookups "
+           "took %lu/%lu/%lu msec (median/90th/99th percentile). "
+           U64_FORMAT" lookups have failed, "U64_FORMAT" transiently, and "
+           U64_FORMAT" timed out.", n,
+           (unsigned long)p50, (unsigned long)p90, (unsigned long)p99,
+           U64_PRINTF_ARG(failed), U64_PRINTF_ARG(transient),
+           U64_PRINTF_ARG(timed_out));
+
+  nameservers = dns_get_nameserver_stats();
+  SMARTLIST_FOREACH(nameservers, char *, line, {
+      log_fn(LOG_NOTICE, LD_HEARTBEAT, "Heartbeat: Nameserver %s", line);
+      tor_free(line);
+  });
+  smartlist_free(nameservers);
+}
+
 /** Log a "heartbeat" message describing Tor's status and history so that the
  * user can know that there is indeed a running Tor.  Return 0 on success and
  * -1 on failure. */
@@ -110,6 +146,153 @@ log_heartbeat(time_t now)
   tor_free(bw_sent);
   tor_free(bw_rcvd);
 
+  if (server_mode(options) && !router_my_exit_policy_is_reject_star())
+    log_dns_heartbeat();
+
   return 0;
 }
 
+
+/** Append a "<b>name</b> <b>value</b>" metrics line to <b>lines</b>. */
+static void
+add_metric_u64(smartlist_t *lines, const char *name, uint64_t value)
+{
+  char *line = NULL;
+  tor_asprintf(&line, "%s "U64_FORMAT"\n", name, U64_PRINTF_ARG(value));
+  smartlist_add(lines, line);
+}
+
+/** Append a "<b>name</b> <b>value</b>" metrics line to <b>lines</b>, with a
+ * fractional value. */
+static void
+add_metric_dbl(smartlist_t *lines, const char *name, double value)
+{
+  char *line = NULL;
+  tor_asprintf(&line, "%s %.2f\n", name, value);
+  smartlist_add(lines, line);
+}
+
+/** Counter values as of the last call to format_metrics(), so that we can
+ * report rates over the interval since then. */
+static time_t metrics_last_time = 0;
+static uint64_t metrics_last_bytes_read = 0;
+static uint64_t metrics_last_bytes_written = 0;
+static uint64_t metrics_last_cells_processed = 0;
+static uint64_t metrics_last_cells_relayed = 0;
+
+/** Return a newly allocated string describing Tor's current status for
+ * monitoring tools, one "name value" pair per line.  Rates are averaged
+ * over the time since the previous call.  Latency histograms take the form
+ * "onionskin-latency type phase count=N mean-usec=M buckets=...". */
+char *
+format_metrics(time_t now)
+{
+  smartlist_t *lines = smartlist_create();
+  uint64_t bytes_read = get_bytes_read(), bytes_written = get_bytes_written();
+  uint64_t cells_processed = stats_n_padding_cells_processed +
+    stats_n_create_cells_processed + stats_n_created_cells_processed +
+    stats_n_relay_cells_processed + stats_n_destroy_cells_processed;
+  uint64_t failed, transient, timed_out;
+  uint32_t p50, p90, p99;
+  char *onionskin, *result;
+  int n;
+
+  add_metric_u64(lines, "time", (uint64_t)now);
+  add_metric_u64(lines, "uptime", (uint64_t)get_uptime());
+
+  /* Throughput and cell rates. */
+  add_metric_u64(lines, "bytes-read", bytes_read);
+  add_metric_u64(lines, "bytes-written", bytes_written);
+  add_metric_u64(lines, "cells-processed", cells_processed);
+  add_metric_u64(lines, "relay-cells-relayed", stats_n_relay_cells_relayed);
+  add_metric_u64(lines, "relay-cells-delivered",
+                 stats_n_relay_cells_delivered);
+  add_metric_u64(lines, "create-cells-processed",
+                 stats_n_create_cells_processed);
+  if (metrics_last_time && now > metrics_last_time) {
+    double secs = (double)(now - metrics_last_time);
+    add_metric_dbl(lines, "bytes-read-per-second",
+                   U64_TO_DBL(bytes_read - metrics_last_bytes_read) / secs);
+    add_metric_dbl(lines, "bytes-written-per-second",
+          U64_TO_DBL(bytes_written - metrics_last_bytes_written) / secs);
+    add_metric_dbl(lines, "cells-processed-per-second",
+          U64_TO_DBL(cells_processed - metrics_last_cells_processed) / secs);
+    add_metric_dbl(lines, "relay-cells-relayed-per-second",
+          U64_TO_DBL(stats_n_relay_cells_relayed -
+                     metrics_last_cells_relayed) / secs);
+  }
+  metrics_last_time = now;
+  metrics_last_bytes_read = bytes_read;
+  metrics_last_bytes_written = bytes_written;
+  metrics_last_cells_processed = cells_processed;
+  metrics_last_cells_relayed = stats_n_relay_cells_relayed;
+
+  /* Queue depths and pool sizes. */
+  add_metric_u64(lines, "circuits", (uint64_t)count_circuits());
+  add_metric_u64(lines, "cells-queued", (uint64_t)cell_queues_get_n_cells());
+  add_metric_u64(lines, "onionskins-pending",
+                 (uint64_t)onion_pending_len());
+  add_metric_u64(lines, "cpuworker-pool-workers",
+                 (uint64_t)cpuworker_n_pool_workers());
+  add_metric_u64(lines, "dh-pool-keys", (uint64_t)onion_dh_pool_len());
+
+  /* Memory. */
+  add_metric_u64(lines, "mem-buffers", (uint64_t)buf_get_total_allocation());
+  add_metric_u64(lines, "mem-cell-queues",
+                 (uint64_t)cell_queues_get_total_allocation());
+
+  /* DNS. */
+  n = dns_get_latency_percentiles(&p50, &p90, &p99);
+  add_metric_u64(lines, "dns-latency-samples", (uint64_t)n);
+  if (n) {
+    add_metric_u64(lines, "dns-latency-msec-p50", p50);
+    add_metric_u64(lines, "dns-latency-msec-p90", p90);
+    add_metric_u64(lines, "dns-latency-msec-p99", p99);
+  }
+  dns_get_lookup_failure_counts(&failed, &transient, &timed_out);
+  add_metric_u64(lines, "dns-lookups-failed", failed);
+  add_metric_u64(lines, "dns-lookups-failed-transiently", transient);
+  add_metric_u64(lines, "dns-lookups-timed-out", timed_out);
+
+  /* Onionskin latency: one line per handshake type and phase. */
+  onionskin = rep_hist_format_onionskin_latency();
+  if (*onionskin) {
+    smartlist_t *onionskin_lines = smartlist_create();
+    smartlist_split_string(onionskin_lines, onionskin, "\n",
+                           SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+    SMARTLIST_FOREACH_BEGIN(onionskin_lines, char *, cp) {
+      char *line = NULL;
+      tor_asprintf(&line, "onionskin-latency %s\n", cp);
+      smartlist_add(lines, line);
+      tor_free(cp);
+    } SMARTLIST_FOREACH_END(cp);
+    smartlist_free(onionskin_lines);
+  }
+  tor_free(onionskin);
+
+  result = smartlist_join_strings(lines, "", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/** Write our current metrics to the file named by the MetricsFile option,
+ * replacing its old contents.  Return 0 on success and -1 on failure. */
+int
+write_metrics_file(time_t now)
+{
+  const or_options_t *options = get_options();
+  char *metrics;
+  int r;
+
+  if (!options->MetricsFile)
+    return 0;
+
+  metrics = format_metrics(now);
+  r = write_str_to_file_async(options->MetricsFile, metrics, 0);
+  if (r < 0)
+    log_warn(LD_FS, "Unable to write metrics to \"%s\".",
+             options->MetricsFile);
+  tor_free(metrics);
+  return r < 0 ? -1 : 0;
+}
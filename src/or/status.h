@@ -5,6 +5,8 @@
 #define _TOR_STATUS_H
 
 int log_heartbeat(time_t now);
+char *format_metrics(time_t now);
+int write_metrics_file(time_t now);
 
 #endif
 
@@ -15,10 +15,13 @@
  * In the ::managed_proxy_list there are ::unconfigured_proxies_n
  * managed proxies that are still unconfigured.
  *
- * In every run_scheduled_event() tick, we attempt to launch and then
- * configure the unconfiged managed proxies, using the configuration
- * protocol defined in the 180_pluggable_transport.txt proposal. A
- * managed proxy might need several ticks to get fully configured.
+ * As soon as we finish reading torrc, and then in every
+ * run_scheduled_event() tick, we attempt to launch and then configure
+ * the unconfiged managed proxies, using the configuration protocol
+ * defined in the 180_pluggable_transport.txt proposal. All of them
+ * get launched in the same pass, so they start up in parallel. Where
+ * we can, we then read each proxy's output as soon as libevent tells
+ * us it's there, rather than waiting for the next tick.
  *
  * When a managed proxy is fully configured, we register all its
  * transports to the circuitbuild.c subsystem. At that point the
@@ -91,6 +94,12 @@
 #include "util.h"
 #include "router.h"
 
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
 #ifdef MS_WINDOWS
 static void set_managed_proxy_environment(LPVOID *envp,
                                           const managed_proxy_t *mp);
@@ -106,6 +115,8 @@ static void managed_proxy_destroy(managed_proxy_t *mp,
 
 static void handle_finished_proxy(managed_proxy_t *mp);
 static void configure_proxy(managed_proxy_t *mp);
+static void managed_proxy_stop_watching_stdout(managed_proxy_t *mp);
+static void pt_configure_proxies_soon(void);
 
 static void parse_method_error(const char *line, int is_server_method);
 #define parse_server_method_error(l) parse_method_error(l, 1)
@@ -238,6 +249,7 @@ proxy_prepare_for_restart(managed_proxy_t *mp)
   tor_assert(mp->conf_state == PT_PROTO_COMPLETED);
 
   /* destroy the process handle and terminate the process. */
+  managed_proxy_stop_watching_stdout(mp);
   tor_process_handle_destroy(mp->process_handle, 1);
   mp->process_handle = NULL;
 
@@ -257,6 +269,56 @@ proxy_prepare_for_restart(managed_proxy_t *mp)
   mp->conf_state = PT_PROTO_INFANT;
 }
 
+#ifndef MS_WINDOWS
+/** Called by libevent when managed proxy <b>arg</b> has written
+ * something to its stdout: handle whatever it said right away. */
+static void
+managed_proxy_stdout_cb(evutil_socket_t fd, short events, void *arg)
+{
+  managed_proxy_t *mp = arg;
+  (void) fd;
+  (void) events;
+
+  if (!proxy_configuration_finished(mp))
+    configure_proxy(mp); /* may free mp */
+}
+
+/** Ask libevent to tell us whenever the just-launched managed proxy
+ * <b>mp</b> writes to its stdout, so that we don't have to wait for the
+ * next tick to read it.  If we can't, we still poll it once a second. */
+static void
+managed_proxy_watch_stdout(managed_proxy_t *mp)
+{
+  struct event_base *base = tor_libevent_get_base();
+  FILE *stdout_pipe = tor_process_get_stdout_pipe(mp->process_handle);
+
+  tor_assert(!mp->stdout_event);
+  if (!base || !stdout_pipe)
+    return;
+
+  mp->stdout_event = tor_event_new(base, fileno(stdout_pipe),
+                                   EV_READ|EV_PERSIST,
+                                   managed_proxy_stdout_cb, mp);
+  if (!mp->stdout_event || event_add(mp->stdout_event, NULL) < 0) {
+    log_info(LD_CONFIG, "Couldn't watch the output of managed proxy at "
+             "'%s'; will poll it instead.", mp->argv[0]);
+    if (mp->stdout_event)
+      tor_event_free(mp->stdout_event);
+    mp->stdout_event = NULL;
+  }
+}
+#endif
+
+/** Stop listening for output from managed proxy <b>mp</b>. */
+static void
+managed_proxy_stop_watching_stdout(managed_proxy_t *mp)
+{
+  if (mp->stdout_event) {
+    tor_event_free(mp->stdout_event);
+    mp->stdout_event = NULL;
+  }
+}
+
 /** Launch managed proxy <b>mp</b>. */
 static int
 launch_managed_proxy(managed_proxy_t *mp)
@@ -307,9 +369,47 @@ launch_managed_proxy(managed_proxy_t *mp)
 
   mp->conf_state = PT_PROTO_LAUNCHED;
 
+#ifndef MS_WINDOWS
+  managed_proxy_watch_stdout(mp);
+#endif
+
   return 0;
 }
 
+/** Timer that launches and configures pending managed proxies right
+ *  after we read our configuration. */
+static struct event *configure_proxies_event = NULL;
+
+/** Libevent callback: launch and configure pending managed proxies. */
+static void
+configure_proxies_cb(evutil_socket_t fd, short events, void *arg)
+{
+  (void) fd;
+  (void) events;
+  (void) arg;
+
+  if (!net_is_disabled() && pt_proxies_configuration_pending())
+    pt_configure_remaining_proxies();
+}
+
+/** Launch and configure pending managed proxies as soon as we get back
+ *  to the main loop, instead of waiting for the next tick of
+ *  run_scheduled_events(). */
+static void
+pt_configure_proxies_soon(void)
+{
+  struct timeval tv = { 0, 0 };
+  struct event_base *base = tor_libevent_get_base();
+
+  if (!base)
+    return;
+  if (!configure_proxies_event)
+    configure_proxies_event = tor_evtimer_new(base, configure_proxies_cb,
+                                              NULL);
+  if (evtimer_add(configure_proxies_event, &tv) < 0)
+    log_warn(LD_BUG, "Couldn't add timer for configuring managed proxies");
+}
+
 /** Check if any of the managed proxies we are currently trying to
  *  configure have anything new to say. This is called from
  *  run_scheduled_events(). */
@@ -549,6 +649,7 @@ managed_proxy_destroy(managed_proxy_t *mp,
   /* free the argv */
   free_execve_args(mp->argv);
 
+  managed_proxy_stop_watching_stdout(mp);
   tor_process_handle_destroy(mp->process_handle, also_terminate_process);
   mp->process_handle = NULL;
 
@@ -567,6 +668,7 @@ handle_finished_proxy(managed_proxy_t *mp)
     managed_proxy_destroy(mp, 0); /* destroy it but don't terminate */
     break;
   case PT_PROTO_CONFIGURED: /* if configured correctly: */
+    managed_proxy_stop_watching_stdout(mp); /* nothing more to read */
     register_proxy(mp); /* register its transports */
     mp->conf_state = PT_PROTO_COMPLETED; /* and mark it as completed. */
     break;
@@ -1232,12 +1334,20 @@ sweep_proxy_list(void)
       managed_proxy_destroy(mp, 1);
     }
   } SMARTLIST_FOREACH_END(mp);
+
+  if (pt_proxies_configuration_pending())
+    pt_configure_proxies_soon();
 }
 
 /** Release all storage held by the pluggable transports subsystem. */
 void
 pt_free_all(void)
 {
+  if (configure_proxies_event) {
+    tor_event_free(configure_proxies_event);
+    configure_proxies_event = NULL;
+  }
+
   if (managed_proxy_list) {
     /* If the proxy is in PT_PROTO_COMPLETED, it has registered its
        transports and it's the duty of the circuitbuild.c subsystem to
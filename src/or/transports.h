@@ -51,6 +51,10 @@ typedef struct {
   /* A pointer to the process handle of this managed proxy. */
   process_handle_t *process_handle;
 
+  /* Event that fires when the proxy writes to its stdout while we are
+     configuring it, or NULL if we only poll it once a second. */
+  struct event *stdout_event;
+
   int pid; /* The Process ID this managed proxy is using. */
 
   /** Boolean: We are re-parsing our config, and we are going to
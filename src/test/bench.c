@@ -14,10 +14,31 @@ const char tor_git_revision[] = "";
 
 #include "orconfig.h"
 
+#ifdef HAVE_MALLOC_H
+#ifndef OPENBSD
+#include <malloc.h>
+#endif
+#endif
+
+#define BUFFERS_PRIVATE
+#define CONFIG_PRIVATE
 #define RELAY_PRIVATE
 
 #include "or.h"
+#include "buffers.h"
+#include "circuitlist.h"
+#include "config.h"
+#include "connection.h"
+#include "connection_or.h"
+#include "dirvote.h"
+#include "hibernate.h"
+#include "microdesc.h"
+#include "networkstatus.h"
+#include "onion.h"
 #include "relay.h"
+#include "routerlist.h"
+#include "routerparse.h"
+#include "ht.h"
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -67,6 +88,310 @@ perftime(void)
 #define NANOCOUNT(start,end,iters) \
   ( ((double)((end)-(start))) / (iters) )
 
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+/** Defined iff we can read a cycle counter with bench_cycles(). */
+#define HAVE_BENCH_CYCLES
+/** Return the processor's time-stamp counter.  On recent x86 chips this
+ * ticks at a constant rate, so it only matches core clock cycles when
+ * frequency scaling is off. */
+static INLINE uint64_t
+bench_cycles(void)
+{
+  uint32_t lo, hi;
+  __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+  return (((uint64_t)hi) << 32) | lo;
+}
+#endif
+
+/** One number that benchmarks report, with the value it had in every run
+ * we recorded. */
+typedef struct bench_metric_t {
+  char *bench; /**< The benchmark that reports it. */
+  char *name; /**< What it measures, unique within <b>bench</b>. */
+  char *unit; /**< What it's measured in. */
+  double *values; /**< One value per recorded run. */
+  int n_values; /**< Number of elements used in <b>values</b>. */
+  int values_len; /**< Number of elements allocated for <b>values</b>. */
+} bench_metric_t;
+
+/** The benchmark that's running now. */
+static const char *bench_current = NULL;
+/** True iff we keep what benchmarks report; false during warmup runs. */
+static int bench_recording = 0;
+/** Every bench_metric_t reported so far, in the order first reported. */
+static smartlist_t *bench_metrics = NULL;
+/** Map from benchmark name, "/", and metric name to bench_metric_t. */
+static strmap_t *bench_metric_map = NULL;
+
+/** Benchmarks fold their results into this, so that the compiler can't
+ * optimize away the loops that compute them. */
+static volatile int bench_sink = 0;
+
+/** Record that in this run, the running benchmark measured <b>value</b>
+ * <b>unit</b>s for the metric whose name is the printf-style <b>fmt</b>. */
+static void
+bench_report(const char *unit, double value, const char *fmt, ...)
+  CHECK_PRINTF(3, 4);
+static void
+bench_report(const char *unit, double value, const char *fmt, ...)
+{
+  va_list ap;
+  char *name = NULL, *key = NULL;
+  bench_metric_t *m;
+
+  if (!bench_recording)
+    return;
+  va_start(ap, fmt);
+  tor_vasprintf(&name, fmt, ap);
+  va_end(ap);
+  tor_asprintf(&key, "%s/%s", bench_current, name);
+
+  if (!(m = strmap_get(bench_metric_map, key))) {
+    m = tor_malloc_zero(sizeof(bench_metric_t));
+    m->bench = tor_strdup(bench_current);
+    m->name = name;
+    name = NULL;
+    m->unit = tor_strdup(unit);
+    strmap_set(bench_metric_map, key, m);
+    smartlist_add(bench_metrics, m);
+  }
+  if (m->n_values == m->values_len) {
+    m->values_len = m->values_len ? m->values_len * 2 : 8;
+    m->values = tor_realloc(m->values, m->values_len * sizeof(double));
+  }
+  m->values[m->n_values++] = value;
+  tor_free(name);
+  tor_free(key);
+}
+
+/** Summary of the values of one bench_metric_t. */
+typedef struct bench_summary_t {
+  double median, p99, min, max, mean;
+} bench_summary_t;
+
+/** Helper: sort doubles in ascending order. */
+static int
+_bench_compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/** Set *<b>out</b> to a summary of the values of <b>m</b>.  Percentiles use
+ * the nearest rank, so with fewer than 100 runs the p99 is the maximum. */
+static void
+bench_summarize(const bench_metric_t *m, bench_summary_t *out)
+{
+  double *sorted = tor_memdup(m->values, m->n_values * sizeof(double));
+  double sum = 0;
+  int i, n = m->n_values;
+
+  tor_assert(n > 0);
+  qsort(sorted, n, sizeof(double), _bench_compare_doubles);
+  for (i = 0; i < n; ++i)
+    sum += sorted[i];
+  out->min = sorted[0];
+  out->max = sorted[n-1];
+  out->mean = sum / n;
+  out->median = (n % 2) ? sorted[n/2] : (sorted[n/2-1] + sorted[n/2]) / 2;
+  out->p99 = sorted[(int)((99 * (int64_t)n + 99) / 100) - 1];
+  tor_free(sorted);
+}
+
+/** What we could find out about the machine we're running on. */
+typedef struct bench_host_t {
+  char *cpu_model; /**< The processor's name, or NULL if unknown. */
+  double cpufreq_mhz; /**< Its current clock frequency, or 0 if unknown. */
+  double cycles_mhz; /**< How fast bench_cycles() ticks, or 0 if we have
+                      * no cycle counter. */
+} bench_host_t;
+
+/** Where Linux tells us the first processor's current frequency, in kHz. */
+#define BENCH_CPUFREQ_FILE \
+  "/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq"
+
+/** Find the first line in the file <b>fname</b> that starts with
+ * <b>prefix</b>, and copy it into the <b>len</b>-byte buffer <b>buf</b>.
+ * Return 0 on success, -1 if there's no such file or line.  (We can't use
+ * read_file_to_str() on /proc and /sys, since their files claim to be
+ * empty or a page long.) */
+static int
+bench_read_line(const char *fname, const char *prefix, char *buf,
+                size_t len)
+{
+  FILE *f = fopen(fname, "r");
+  int r = -1;
+  if (!f)
+    return -1;
+  while (fgets(buf, (int)len, f)) {
+    if (!strcmpstart(buf, prefix)) {
+      buf[strcspn(buf, "\n")] = '\0';
+      r = 0;
+      break;
+    }
+  }
+  fclose(f);
+  return r;
+}
+
+/** Fill in <b>host</b> with what we can learn about this machine. */
+static void
+bench_get_host_info(bench_host_t *host)
+{
+  char line[256];
+  memset(host, 0, sizeof(bench_host_t));
+
+  if (!bench_read_line("/proc/cpuinfo", "model name", line, sizeof(line))) {
+    const char *cp = strchr(line, ':');
+    if (cp)
+      host->cpu_model = tor_strdup(eat_whitespace_no_nl(cp+1));
+  }
+  if (!bench_read_line(BENCH_CPUFREQ_FILE, "", line, sizeof(line)))
+    host->cpufreq_mhz = atof(line) / 1000;
+#ifdef HAVE_BENCH_CYCLES
+  {
+    /* Count cycles across a tenth of a second of wall-clock time. */
+    struct timeval start, now;
+    uint64_t c_start, c_end;
+    tor_gettimeofday(&start);
+    c_start = bench_cycles();
+    do {
+      tor_gettimeofday(&now);
+    } while (tv_udiff(&start, &now) < 100000);
+    c_end = bench_cycles();
+    host->cycles_mhz = ((double)(c_end - c_start)) / tv_udiff(&start, &now);
+  }
+#endif
+}
+
+/** Run the benchmark <b>fn</b>, called <b>name</b>, <b>warmup</b> times
+ * without recording anything, and then <b>iterations</b> times recording
+ * what it reports, along with how long each run took. */
+static void
+bench_run(const char *name, void (*fn)(void), int warmup, int iterations)
+{
+  int i;
+  bench_current = name;
+  bench_recording = 0;
+  for (i = 0; i < warmup; ++i)
+    fn();
+  bench_recording = 1;
+  for (i = 0; i < iterations; ++i) {
+    struct timeval start, end;
+#ifdef HAVE_BENCH_CYCLES
+    uint64_t c_start, c_end;
+    c_start = bench_cycles();
+#endif
+    tor_gettimeofday(&start);
+    fn();
+    tor_gettimeofday(&end);
+#ifdef HAVE_BENCH_CYCLES
+    c_end = bench_cycles();
+    bench_report("Mcycles", ((double)(c_end - c_start)) / 1e6,
+                 "whole run, cycles");
+#endif
+    bench_report("msec", tv_udiff(&start, &end) / 1000.0,
+                 "whole run, wall clock");
+  }
+  bench_recording = 0;
+}
+
+/** Print every metric reported by the benchmark <b>name</b>. */
+static void
+bench_print_results(const char *name)
+{
+  SMARTLIST_FOREACH_BEGIN(bench_metrics, const bench_metric_t *, m) {
+    bench_summary_t s;
+    if (strcmp(m->bench, name))
+      continue;
+    bench_summarize(m, &s);
+    if (m->n_values == 1)
+      printf("%s: %.2f %s\n", m->name, s.median, m->unit);
+    else
+      printf("%s: median %.2f %s, p99 %.2f, min %.2f, max %.2f (%d runs)\n",
+             m->name, s.median, m->unit, s.p99, s.min, s.max, m->n_values);
+  } SMARTLIST_FOREACH_END(m);
+}
+
+/** Write <b>s</b> to <b>f</b> as a JSON string. */
+static void
+bench_json_string(FILE *f, const char *s)
+{
+  fputc('"', f);
+  for ( ; *s; ++s) {
+    if (*s == '"' || *s == '\\')
+      fprintf(f, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      fprintf(f, "\\u%04x", (unsigned char)*s);
+    else
+      fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+/** Write <b>x</b> to <b>f</b> as a JSON number, or as null if it's
+ * infinite or not a number, which JSON can't represent. */
+static void
+bench_json_number(FILE *f, double x)
+{
+  if (x == x && x - x == 0)
+    fprintf(f, "%g", x);
+  else
+    fprintf(f, "null");
+}
+
+/** Write everything we've recorded to <b>f</b> as a JSON object. */
+static void
+bench_write_json(FILE *f, const bench_host_t *host, int warmup,
+                 int iterations)
+{
+  int i, first = 1;
+
+  fprintf(f, "{\n  \"version\": ");
+  bench_json_string(f, VERSION);
+  fprintf(f, ",\n  \"host\": {\"cpu_model\": ");
+  if (host->cpu_model)
+    bench_json_string(f, host->cpu_model);
+  else
+    fprintf(f, "null");
+  fprintf(f, ", \"cpufreq_mhz\": ");
+  bench_json_number(f, host->cpufreq_mhz);
+  fprintf(f, ", \"cycles_mhz\": ");
+  bench_json_number(f, host->cycles_mhz);
+  fprintf(f, "},\n");
+  fprintf(f, "  \"warmup\": %d,\n  \"iterations\": %d,\n  \"results\": [",
+          warmup, iterations);
+  SMARTLIST_FOREACH_BEGIN(bench_metrics, const bench_metric_t *, m) {
+    bench_summary_t s;
+    bench_summarize(m, &s);
+    fprintf(f, "%s\n    {\"benchmark\": ", first ? "" : ",");
+    first = 0;
+    bench_json_string(f, m->bench);
+    fprintf(f, ", \"metric\": ");
+    bench_json_string(f, m->name);
+    fprintf(f, ", \"unit\": ");
+    bench_json_string(f, m->unit);
+    fprintf(f, ",\n     \"median\": ");
+    bench_json_number(f, s.median);
+    fprintf(f, ", \"p99\": ");
+    bench_json_number(f, s.p99);
+    fprintf(f, ", \"min\": ");
+    bench_json_number(f, s.min);
+    fprintf(f, ", \"max\": ");
+    bench_json_number(f, s.max);
+    fprintf(f, ", \"mean\": ");
+    bench_json_number(f, s.mean);
+    fprintf(f, ",\n     \"values\": [");
+    for (i = 0; i < m->n_values; ++i) {
+      if (i)
+        fprintf(f, ", ");
+      bench_json_number(f, m->values[i]);
+    }
+    fprintf(f, "]}");
+  } SMARTLIST_FOREACH_END(m);
+  fprintf(f, "\n  ]\n}\n");
+}
+
 /** Run AES performance benchmarks. */
 static void
 bench_aes(void)
@@ -91,8 +416,8 @@ bench_aes(void)
     end = perftime();
     tor_free(b1);
     tor_free(b2);
-    printf("%d bytes: %.2f nsec per byte\n", len,
-           NANOCOUNT(start, end, iters*len));
+    bench_report("nsec/byte", NANOCOUNT(start, end, iters*len),
+                 "%d bytes", len);
   }
   crypto_free_cipher_env(c);
 }
@@ -119,14 +444,117 @@ bench_cell_aes(void)
       crypto_cipher_crypt_inplace(c, b+misalign, len);
     }
     end = perftime();
-    printf("%d bytes, misaligned by %d: %.2f nsec per byte\n", len, misalign,
-           NANOCOUNT(start, end, iters*len));
+    bench_report("nsec/byte", NANOCOUNT(start, end, iters*len),
+                 "%d bytes, misaligned by %d", len, misalign);
   }
 
   crypto_free_cipher_env(c);
   tor_free(b);
 }
 
+/** Compare encrypting cells one at a time with encrypting them in
+ * batches. */
+static void
+bench_cell_aes_multi(void)
+{
+  uint64_t start, end;
+  const int len = 509;
+  const int iters = (1<<16);
+  char *b[32];
+  crypto_cipher_env_t *c;
+  int i, n_bufs;
+
+  for (i = 0; i < 32; ++i)
+    b[i] = tor_malloc_zero(len);
+  c = crypto_new_cipher_env();
+  crypto_cipher_generate_key(c);
+  crypto_cipher_encrypt_init_cipher(c);
+
+  reset_perftime();
+  for (n_bufs = 1; n_bufs <= 32; n_bufs *= 2) {
+    start = perftime();
+    for (i = 0; i < iters / n_bufs; ++i) {
+      crypto_cipher_crypt_inplace_multi(c, b, len, n_bufs);
+    }
+    end = perftime();
+    bench_report("nsec/byte",
+                 NANOCOUNT(start, end, (iters / n_bufs) * n_bufs * len),
+                 "%d cells at a time", n_bufs);
+  }
+
+  crypto_free_cipher_env(c);
+  for (i = 0; i < 32; ++i)
+    tor_free(b[i]);
+}
+
+/** An entry in a separately chained digest map, the way digestmap_t used to
+ * be implemented; bench_dmap() compares the two. */
+typedef struct chained_ent_t {
+  HT_ENTRY(chained_ent_t) node;
+  void *val;
+  char key[DIGEST_LEN];
+} chained_ent_t;
+
+static INLINE int
+chained_ents_eq(const chained_ent_t *a, const chained_ent_t *b)
+{
+  return tor_memeq(a->key, b->key, DIGEST_LEN);
+}
+
+static INLINE unsigned
+chained_ent_hash(const chained_ent_t *a)
+{
+  uint32_t p[5];
+  memcpy(p, a->key, sizeof(p));
+  return p[0] ^ p[1] ^ p[2] ^ p[3] ^ p[4];
+}
+
+static HT_HEAD(chained_map, chained_ent_t) chained_map =
+  HT_INITIALIZER();
+HT_PROTOTYPE(chained_map, chained_ent_t, node, chained_ent_hash,
+             chained_ents_eq)
+HT_GENERATE(chained_map, chained_ent_t, node, chained_ent_hash,
+            chained_ents_eq, 0.6, malloc, realloc, free)
+
+/** Set <b>key</b> to <b>val</b> in the chained benchmark map. */
+static void
+chained_map_set(const char *key, void *val)
+{
+  chained_ent_t search, *ent;
+  memcpy(search.key, key, DIGEST_LEN);
+  if ((ent = HT_FIND(chained_map, &chained_map, &search))) {
+    ent->val = val;
+    return;
+  }
+  ent = tor_malloc_zero(sizeof(chained_ent_t));
+  memcpy(ent->key, key, DIGEST_LEN);
+  ent->val = val;
+  HT_INSERT(chained_map, &chained_map, ent);
+}
+
+/** Return the value for <b>key</b> in the chained benchmark map. */
+static void *
+chained_map_get(const char *key)
+{
+  chained_ent_t search, *ent;
+  memcpy(search.key, key, DIGEST_LEN);
+  ent = HT_FIND(chained_map, &chained_map, &search);
+  return ent ? ent->val : NULL;
+}
+
+/** Empty the chained benchmark map. */
+static void
+chained_map_clear(void)
+{
+  chained_ent_t **ent, **next, *this;
+  for (ent = HT_START(chained_map, &chained_map); ent; ent = next) {
+    this = *ent;
+    next = HT_NEXT_RMV(chained_map, &chained_map, ent);
+    tor_free(this);
+  }
+  HT_CLEAR(chained_map, &chained_map);
+}
+
 /** Run digestmap_t performance benchmarks. */
 static void
 bench_dmap(void)
@@ -150,7 +578,6 @@ bench_dmap(void)
     crypto_rand(d, 20);
     smartlist_add(sl2, tor_memdup(d, 20));
   }
-  printf("nbits=%d\n", ds->mask+1);
 
   reset_perftime();
 
@@ -159,40 +586,57 @@ bench_dmap(void)
     SMARTLIST_FOREACH(sl, const char *, cp, digestmap_set(dm, cp, (void*)1));
   }
   pt2 = perftime();
-  printf("digestmap_set: %.2f ns per element\n",
-         NANOCOUNT(start, pt2, iters*elts));
+  bench_report("nsec/element", NANOCOUNT(start, pt2, iters*elts),
+               "digestmap_set");
 
   for (i = 0; i < iters; ++i) {
-    SMARTLIST_FOREACH(sl, const char *, cp, digestmap_get(dm, cp));
-    SMARTLIST_FOREACH(sl2, const char *, cp, digestmap_get(dm, cp));
+    SMARTLIST_FOREACH(sl, const char *, cp, n += !!digestmap_get(dm, cp));
+    SMARTLIST_FOREACH(sl2, const char *, cp, n += !!digestmap_get(dm, cp));
   }
   pt3 = perftime();
-  printf("digestmap_get: %.2f ns per element\n",
-         NANOCOUNT(pt2, pt3, iters*elts*2));
+  bench_report("nsec/element", NANOCOUNT(pt2, pt3, iters*elts*2),
+               "digestmap_get");
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    SMARTLIST_FOREACH(sl, const char *, cp, chained_map_set(cp, (void*)1));
+  }
+  pt2 = perftime();
+  bench_report("nsec/element", NANOCOUNT(start, pt2, iters*elts),
+               "chained map set");
+
+  for (i = 0; i < iters; ++i) {
+    SMARTLIST_FOREACH(sl, const char *, cp, n += !!chained_map_get(cp));
+    SMARTLIST_FOREACH(sl2, const char *, cp, n += !!chained_map_get(cp));
+  }
+  pt3 = perftime();
+  bench_report("nsec/element", NANOCOUNT(pt2, pt3, iters*elts*2),
+               "chained map get");
+  chained_map_clear();
 
   for (i = 0; i < iters; ++i) {
     SMARTLIST_FOREACH(sl, const char *, cp, digestset_add(ds, cp));
   }
   pt4 = perftime();
-  printf("digestset_add: %.2f ns per element\n",
-         NANOCOUNT(pt3, pt4, iters*elts));
+  bench_report("nsec/element", NANOCOUNT(pt3, pt4, iters*elts),
+               "digestset_add");
 
   for (i = 0; i < iters; ++i) {
     SMARTLIST_FOREACH(sl, const char *, cp, n += digestset_isin(ds, cp));
     SMARTLIST_FOREACH(sl2, const char *, cp, n += digestset_isin(ds, cp));
   }
   end = perftime();
-  printf("digestset_isin: %.2f ns per element.\n",
-         NANOCOUNT(pt4, end, iters*elts*2));
+  bench_report("nsec/element", NANOCOUNT(pt4, end, iters*elts*2),
+               "digestset_isin");
   /* We need to use this, or else the whole loop gets optimized out. */
-  printf("Hits == %d\n", n);
+  bench_sink += n;
 
   for (i = 0; i < fpostests; ++i) {
     crypto_rand(d, 20);
     if (digestset_isin(ds, d)) ++fp;
   }
-  printf("False positive rate on digestset: %.2f%%\n",
-         (fp/(double)fpostests)*100);
+  bench_report("%", (fp/(double)fpostests)*100,
+               "digestset false positive rate (%d bits)", ds->mask+1);
 
   digestmap_free(dm, NULL);
   digestset_free(ds);
@@ -202,6 +646,85 @@ bench_dmap(void)
   smartlist_free(sl2);
 }
 
+/** Run benchmarks for small requests to our random number generator, the
+ * way path selection makes them. */
+static void
+bench_rand(void)
+{
+  const int iters = 1<<20;
+  uint64_t start, end;
+  char buf[20];
+  int i, n = 0;
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    n += crypto_rand_int(1000);
+  end = perftime();
+  bench_report("nsec/call", NANOCOUNT(start, end, iters),
+               "crypto_rand_int");
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    crypto_rand(buf, sizeof(buf));
+  end = perftime();
+  bench_report("nsec/call", NANOCOUNT(start, end, iters),
+               "crypto_rand, %d bytes", (int)sizeof(buf));
+  /* We need to use this, or else the whole loop gets optimized out. */
+  bench_sink += n;
+}
+
+/** Run benchmarks for the data-independent comparison functions on
+ * digest-sized buffers. */
+static void
+bench_di_ops(void)
+{
+  const int iters = 1<<20;
+  static const size_t lens[] = { DIGEST_LEN, DIGEST256_LEN };
+  char a[DIGEST256_LEN], b[DIGEST256_LEN];
+  uint64_t start, end;
+  int i, j, n = 0;
+
+  crypto_rand(a, sizeof(a));
+  memcpy(b, a, sizeof(b));
+  reset_perftime();
+
+  for (j = 0; j < 2; ++j) {
+    const size_t len = lens[j];
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      b[i % len] ^= 1;
+      n += tor_memeq(a, b, len);
+      b[i % len] ^= 1;
+    }
+    end = perftime();
+    bench_report("nsec/call", NANOCOUNT(start, end, iters),
+                 "tor_memeq, %d bytes", (int)len);
+
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      b[i % len] ^= 1;
+      n += tor_memcmp(a, b, len) < 0;
+      b[i % len] ^= 1;
+    }
+    end = perftime();
+    bench_report("nsec/call", NANOCOUNT(start, end, iters),
+                 "tor_memcmp, %d bytes", (int)len);
+
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      b[i % len] ^= 1;
+      n += fast_memeq(a, b, len);
+      b[i % len] ^= 1;
+    }
+    end = perftime();
+    bench_report("nsec/call", NANOCOUNT(start, end, iters),
+                 "memcmp, %d bytes", (int)len);
+  }
+  /* We need to use this, or else the whole loop gets optimized out. */
+  bench_sink += n;
+}
+
 static void
 bench_cell_ops(void)
 {
@@ -241,10 +764,10 @@ bench_cell_ops(void)
       relay_crypt(TO_CIRCUIT(or_circ), cell, d, &layer_hint, &recognized);
     }
     end = perftime();
-    printf("%sbound cells: %.2f ns per cell. (%.2f ns per byte of payload)\n",
-           outbound?"Out":" In",
-           NANOCOUNT(start,end,iters),
-           NANOCOUNT(start,end,iters*CELL_PAYLOAD_SIZE));
+    bench_report("nsec/cell", NANOCOUNT(start,end,iters),
+                 "%sbound cells", outbound?"Out":"In");
+    bench_report("nsec/byte", NANOCOUNT(start,end,iters*CELL_PAYLOAD_SIZE),
+                 "%sbound cells, per byte of payload", outbound?"Out":"In");
   }
 
   crypto_free_digest_env(or_circ->p_digest);
@@ -255,6 +778,1113 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+/** Run the client and server halves of a CREATE/CREATED handshake
+ * <b>iters</b> times against <b>key</b>, or against a fresh copy of
+ * <b>key</b> each time if <b>cold</b> is true, and report how long each
+ * step takes. */
+static void
+bench_onion_skin_once(crypto_pk_env_t *key, int iters, int cold)
+{
+  char onionskin[ONIONSKIN_CHALLENGE_LEN];
+  char reply[ONIONSKIN_REPLY_LEN];
+  char s_keys[CPATH_KEY_MATERIAL_LEN], c_keys[CPATH_KEY_MATERIAL_LEN];
+  crypto_dh_env_t *dh = NULL;
+  uint64_t t_create = 0, t_server = 0, t_client = 0, t0, t1;
+  int i;
+
+  for (i = 0; i < iters; ++i) {
+    crypto_pk_env_t *k = cold ? crypto_pk_copy_full(key) : key;
+    t0 = perftime();
+    onion_skin_create(k, &dh, onionskin);
+    t1 = perftime();
+    t_create += t1 - t0;
+    t0 = t1;
+    onion_skin_server_handshake(onionskin, k, NULL, reply, s_keys,
+                                sizeof(s_keys));
+    t1 = perftime();
+    t_server += t1 - t0;
+    t0 = t1;
+    onion_skin_client_handshake(dh, reply, c_keys, sizeof(c_keys));
+    t1 = perftime();
+    t_client += t1 - t0;
+    tor_assert(tor_memeq(s_keys, c_keys, sizeof(s_keys)));
+    crypto_dh_free(dh);
+    if (cold)
+      crypto_free_pk_env(k);
+  }
+  bench_report("usec", NANOCOUNT(0, t_create, iters)/1000,
+               "%s keys: onion_skin_create", cold ? "Cold" : "Warm");
+  bench_report("usec", NANOCOUNT(0, t_server, iters)/1000,
+               "%s keys: server handshake", cold ? "Cold" : "Warm");
+  bench_report("ops/sec per core", 1e9 / NANOCOUNT(0, t_server, iters),
+               "%s keys: server handshakes", cold ? "Cold" : "Warm");
+  bench_report("usec", NANOCOUNT(0, t_client, iters)/1000,
+               "%s keys: client handshake", cold ? "Cold" : "Warm");
+}
+
+#ifdef TOR_HAVE_COND
+/** State shared between bench_onion_skin_roundtrip() and its worker
+ * thread, all protected by <b>lock</b>. */
+typedef struct bench_roundtrip_t {
+  tor_mutex_t *lock;
+  tor_cond_t *cond;
+  crypto_pk_env_t *key;
+  char onionskin[ONIONSKIN_CHALLENGE_LEN];
+  char reply[ONIONSKIN_REPLY_LEN];
+  char keys[CPATH_KEY_MATERIAL_LEN];
+  int have_question; /**< True iff onionskin is waiting for the worker. */
+  int have_answer; /**< True iff reply and keys are ready. */
+  int done; /**< True iff the worker should exit. */
+} bench_roundtrip_t;
+
+/** Worker thread for bench_onion_skin_roundtrip(): answer onionskins the
+ * way a pool cpuworker would. */
+static void
+bench_roundtrip_worker(void *arg)
+{
+  bench_roundtrip_t *rt = arg;
+  tor_mutex_acquire(rt->lock);
+  for (;;) {
+    while (!rt->have_question && !rt->done)
+      tor_cond_wait(rt->cond, rt->lock);
+    if (rt->done)
+      break;
+    rt->have_question = 0;
+    tor_mutex_release(rt->lock);
+    onion_skin_server_handshake(rt->onionskin, rt->key, NULL, rt->reply,
+                                rt->keys, sizeof(rt->keys));
+    tor_mutex_acquire(rt->lock);
+    rt->have_answer = 1;
+    tor_cond_signal_all(rt->cond);
+  }
+  rt->done = 0;
+  tor_cond_signal_all(rt->cond);
+  tor_mutex_release(rt->lock);
+  spawn_exit();
+}
+
+/** Time server handshakes done by another thread, including the hand-off
+ * to and from that thread, in wall-clock time. */
+static void
+bench_onion_skin_roundtrip(crypto_pk_env_t *key, int iters)
+{
+  bench_roundtrip_t rt;
+  crypto_dh_env_t *dh = NULL;
+  struct timeval start, end;
+  uint64_t usec_local = 0, usec_remote = 0;
+  int i, remote;
+  char keys[CPATH_KEY_MATERIAL_LEN];
+
+  memset(&rt, 0, sizeof(rt));
+  rt.lock = tor_mutex_new();
+  rt.cond = tor_cond_new();
+  rt.key = key;
+  spawn_func(bench_roundtrip_worker, &rt);
+
+  for (remote = 0; remote <= 1; ++remote) {
+    for (i = 0; i < iters; ++i) {
+      onion_skin_create(key, &dh, rt.onionskin);
+      tor_gettimeofday(&start);
+      if (remote) {
+        tor_mutex_acquire(rt.lock);
+        rt.have_question = 1;
+        tor_cond_signal_all(rt.cond);
+        while (!rt.have_answer)
+          tor_cond_wait(rt.cond, rt.lock);
+        rt.have_answer = 0;
+        tor_mutex_release(rt.lock);
+      } else {
+        onion_skin_server_handshake(rt.onionskin, key, NULL, rt.reply,
+                                    rt.keys, sizeof(rt.keys));
+      }
+      tor_gettimeofday(&end);
+      if (remote)
+        usec_remote += tv_udiff(&start, &end);
+      else
+        usec_local += tv_udiff(&start, &end);
+      onion_skin_client_handshake(dh, rt.reply, keys, sizeof(keys));
+      tor_assert(tor_memeq(keys, rt.keys, sizeof(keys)));
+      crypto_dh_free(dh);
+    }
+  }
+
+  tor_mutex_acquire(rt.lock);
+  rt.done = 1;
+  tor_cond_signal_all(rt.cond);
+  while (rt.done)
+    tor_cond_wait(rt.cond, rt.lock);
+  tor_mutex_release(rt.lock);
+  tor_cond_free(rt.cond);
+  tor_mutex_free(rt.lock);
+
+  bench_report("usec", ((double)usec_local) / iters,
+               "Server handshake in this thread, wall clock");
+  bench_report("usec", ((double)usec_remote) / iters,
+               "Server handshake through a worker thread, wall clock");
+}
+#endif
+
+/** Run benchmarks for the CREATE and CREATE_FAST handshakes. */
+static void
+bench_onion_handshakes(void)
+{
+  const int iters = 1<<10;
+  const int fast_iters = 1<<16;
+  crypto_pk_env_t *key = crypto_new_pk_env();
+  uint8_t fast_in[DIGEST_LEN], fast_reply[DIGEST_LEN*2];
+  uint8_t s_keys[CPATH_KEY_MATERIAL_LEN], c_keys[CPATH_KEY_MATERIAL_LEN];
+  uint64_t start, end;
+  int i;
+
+  crypto_pk_generate_key(key);
+
+  reset_perftime();
+  bench_onion_skin_once(key, iters, 0);
+  bench_onion_skin_once(key, iters, 1);
+#ifdef TOR_HAVE_COND
+  bench_onion_skin_roundtrip(key, iters);
+#endif
+
+  start = perftime();
+  for (i = 0; i < fast_iters; ++i) {
+    crypto_rand((char*)fast_in, sizeof(fast_in));
+    fast_server_handshake(fast_in, fast_reply, s_keys, sizeof(s_keys));
+    fast_client_handshake(fast_in, fast_reply, c_keys, sizeof(c_keys));
+  }
+  end = perftime();
+  tor_assert(tor_memeq(s_keys, c_keys, sizeof(s_keys)));
+  bench_report("usec", NANOCOUNT(start, end, fast_iters)/1000,
+               "CREATE_FAST handshake (both sides)");
+  bench_report("ops/sec per core", 1e9 / NANOCOUNT(start, end, fast_iters),
+               "CREATE_FAST handshakes (both sides)");
+
+  crypto_free_pk_env(key);
+}
+
+/** How many cells we push through the relay in each direction, for each
+ * number of circuits, in bench_relay_throughput(). */
+#define RELAY_BENCH_N_CELLS (1<<17)
+/** How many cells "arrive" on a connection at once: about what one read
+ * from a busy TLS connection gives us. */
+#define RELAY_BENCH_CELLS_PER_READ 32
+/** The ID of the <b>i</b>th circuit on the relay's connection to the next
+ * hop.  These must differ from the IDs on the client's connection, since
+ * the relay tells the directions apart by circuit ID. */
+#define RELAY_BENCH_N_CIRC_ID(i) ((circid_t)((1<<15) | ((i) + 1)))
+
+/** Return a new OR connection from 127.0.0.1 for
+ * bench_relay_throughput().  It has no socket and no TLS object: we put
+ * cells on its inbuf and take them off its outbuf by hand. */
+static or_connection_t *
+relay_bench_conn_new(void)
+{
+  or_connection_t *conn = or_connection_new(AF_INET);
+  tor_addr_from_ipv4h(&conn->_base.addr, 0x7f000001);
+  conn->_base.address = tor_strdup("127.0.0.1");
+  conn->_base.port = 9001;
+  conn->_base.state = OR_CONN_STATE_OPEN;
+  conn->link_proto = 3;
+  conn->circ_id_type = CIRC_ID_TYPE_NEITHER;
+  return conn;
+}
+
+/** Put <b>cell</b> on <b>conn</b>'s inbuf, as if we had just read it. */
+static void
+relay_bench_deliver(or_connection_t *conn, const cell_t *cell)
+{
+  packed_cell_t packed;
+  cell_pack(&packed, cell);
+  write_to_buf(packed.body, CELL_NETWORK_SIZE, conn->_base.inbuf);
+}
+
+/** Act as though the network had taken everything on <b>conn</b>'s outbuf,
+ * letting <b>conn</b> refill it from its circuits' queues, until it has
+ * nothing left to send.  Return the number of cells it sent. */
+static int
+relay_bench_drain(or_connection_t *conn)
+{
+  size_t total = 0, n;
+  while ((n = buf_datalen(conn->_base.outbuf))) {
+    total += n;
+    buf_clear(conn->_base.outbuf);
+    connection_or_flushed_some(conn);
+  }
+  tor_assert(total % CELL_NETWORK_SIZE == 0);
+  return (int)(total / CELL_NETWORK_SIZE);
+}
+
+/** Push RELAY_BENCH_N_CELLS relay cells through a relay's OR connections,
+ * over <b>n_circs</b> circuits built with CREATE_FAST, and report how many
+ * cells and bytes per second one core can move in each direction.
+ *
+ * Cells go through the same code they would in a running relay: from the
+ * inbuf through connection_or_process_inbuf(), command.c and relay.c
+ * (including the relay crypto) onto the circuit's cell queue, then onto
+ * the other connection's outbuf as it flushes.  We leave out only the
+ * sockets and TLS, which would swamp what we're trying to measure. */
+static void
+relay_bench_circuits(int n_circs)
+{
+  or_connection_t *p_conn = relay_bench_conn_new();
+  or_connection_t *n_conn = relay_bench_conn_new();
+  smartlist_t *circs = smartlist_create();
+  cell_t cell;
+  uint64_t start, end;
+  int i, outbound;
+
+  /* Build the circuits.  The next hop is attached directly, as though an
+   * EXTEND had already succeeded. */
+  for (i = 0; i < n_circs; ++i) {
+    circuit_t *circ;
+    memset(&cell, 0, sizeof(cell));
+    cell.command = CELL_CREATE_FAST;
+    cell.circ_id = i + 1;
+    crypto_rand((char*)cell.payload, DIGEST_LEN);
+    relay_bench_deliver(p_conn, &cell);
+    connection_or_process_inbuf(p_conn);
+    tor_assert(relay_bench_drain(p_conn) == 1); /* the CREATED_FAST */
+    circ = circuit_get_by_circid_orconn(cell.circ_id, p_conn);
+    tor_assert(circ);
+    circuit_set_n_circid_orconn(circ, RELAY_BENCH_N_CIRC_ID(i), n_conn);
+    smartlist_add(circs, circ);
+  }
+
+  /* The relay crypto makes these look different every time, so the relay
+   * never recognizes one: it just passes them on. */
+  memset(&cell, 0, sizeof(cell));
+  cell.command = CELL_RELAY;
+  crypto_rand((char*)cell.payload, sizeof(cell.payload));
+
+  reset_perftime();
+  for (outbound = 1; outbound >= 0; --outbound) {
+    or_connection_t *from = outbound ? p_conn : n_conn;
+    or_connection_t *to = outbound ? n_conn : p_conn;
+    int n_sent = 0, n_arrived = 0;
+    double nsec;
+
+    start = perftime();
+    while (n_sent < RELAY_BENCH_N_CELLS) {
+      for (i = 0; i < RELAY_BENCH_CELLS_PER_READ; ++i) {
+        int idx = n_sent++ % n_circs;
+        cell.circ_id = outbound ? idx + 1 : RELAY_BENCH_N_CIRC_ID(idx);
+        relay_bench_deliver(from, &cell);
+      }
+      connection_or_process_inbuf(from);
+      n_arrived += relay_bench_drain(to);
+    }
+    end = perftime();
+    tor_assert(n_arrived == n_sent);
+
+    nsec = NANOCOUNT(start, end, n_sent);
+    bench_report("cells/sec per core", 1e9 / nsec,
+                 "%sbound relay cells, %d circuit%s",
+                 outbound ? "Out" : "In", n_circs, n_circs == 1 ? "" : "s");
+    bench_report("MB/sec per core", 1e9 / nsec * CELL_PAYLOAD_SIZE / 1e6,
+                 "%sbound relay payload, %d circuit%s",
+                 outbound ? "Out" : "In", n_circs, n_circs == 1 ? "" : "s");
+  }
+
+  SMARTLIST_FOREACH(circs, circuit_t *, circ,
+                    circuit_mark_for_close(circ, END_CIRC_REASON_NONE));
+  circuit_close_all_marked();
+  smartlist_free(circs);
+  connection_free(TO_CONN(p_conn));
+  connection_free(TO_CONN(n_conn));
+}
+
+/** Measure relay cell throughput through a relay's OR connections, for a
+ * range of circuit counts. */
+static void
+bench_relay_throughput(void)
+{
+  or_options_t *options = get_options_mutable();
+  config_line_t *orport = tor_malloc_zero(sizeof(config_line_t));
+  config_line_t *old_orport = options->ORPort;
+
+  /* We only answer CREATE_FAST cells if we're a relay. */
+  orport->key = tor_strdup("ORPort");
+  orport->value = tor_strdup("9001");
+  options->ORPort = orport;
+  /* Nor if we think we're hibernating, as we do until the main loop first
+   * checks. */
+  consider_hibernation(time(NULL));
+  init_cell_pool();
+
+  relay_bench_circuits(1);
+  relay_bench_circuits(16);
+  relay_bench_circuits(256);
+
+  free_cell_pool();
+  options->ORPort = old_orport;
+  config_free_lines(orport);
+}
+
+/** Size of the message we digest and encode in bench_crypto(). */
+#define CRYPTO_BENCH_MSG_LEN 1000
+
+/** State shared by the operations timed in bench_crypto(). */
+typedef struct crypto_bench_t {
+  crypto_pk_env_t *key; /**< An RSA key with its private half. */
+  crypto_dh_env_t *dh; /**< Our half of a DH handshake. */
+  char dh_peer[DH_BYTES]; /**< The other half of the DH handshake. */
+  char msg[CRYPTO_BENCH_MSG_LEN]; /**< Random bytes to digest or encode. */
+  char sig[PK_BYTES]; /**< Signature on the digest of msg. */
+  int sig_len; /**< Length of sig. */
+  char hybrid[PK_BYTES*2]; /**< Hybrid encryption of part of msg. */
+  int hybrid_len; /**< Length of hybrid. */
+  char b64[CRYPTO_BENCH_MSG_LEN*2]; /**< Base64 encoding of msg. */
+  int b64_len; /**< Length of b64. */
+  char b32[CRYPTO_BENCH_MSG_LEN*2]; /**< Base32 encoding of msg. */
+  char b16[CRYPTO_BENCH_MSG_LEN*2+1]; /**< Base16 encoding of msg. */
+  char out[CRYPTO_BENCH_MSG_LEN*2+1]; /**< Scratch space for outputs. */
+} crypto_bench_t;
+
+static void
+crypto_bench_sign(crypto_bench_t *cb)
+{
+  crypto_pk_private_sign_digest(cb->key, cb->out, sizeof(cb->out),
+                                cb->msg, CRYPTO_BENCH_MSG_LEN);
+}
+static void
+crypto_bench_checksig(crypto_bench_t *cb)
+{
+  crypto_pk_public_checksig(cb->key, cb->out, sizeof(cb->out),
+                            cb->sig, cb->sig_len);
+}
+static void
+crypto_bench_hybrid_decrypt(crypto_bench_t *cb)
+{
+  crypto_pk_private_hybrid_decrypt(cb->key, cb->out, sizeof(cb->out),
+                                   cb->hybrid, cb->hybrid_len,
+                                   PK_PKCS1_OAEP_PADDING, 1);
+}
+static void
+crypto_bench_dh_generate(crypto_bench_t *cb)
+{
+  crypto_dh_env_t *dh = crypto_dh_new(DH_TYPE_CIRCUIT);
+  (void)cb;
+  crypto_dh_generate_public(dh);
+  crypto_dh_free(dh);
+}
+static void
+crypto_bench_dh_compute(crypto_bench_t *cb)
+{
+  crypto_dh_compute_secret(LOG_WARN, cb->dh, cb->dh_peer, DH_BYTES,
+                           cb->out, CPATH_KEY_MATERIAL_LEN);
+}
+static void
+crypto_bench_sha1(crypto_bench_t *cb)
+{
+  crypto_digest(cb->out, cb->msg, CRYPTO_BENCH_MSG_LEN);
+}
+static void
+crypto_bench_sha256(crypto_bench_t *cb)
+{
+  crypto_digest256(cb->out, cb->msg, CRYPTO_BENCH_MSG_LEN, DIGEST_SHA256);
+}
+static void
+crypto_bench_base64_encode(crypto_bench_t *cb)
+{
+  base64_encode(cb->out, sizeof(cb->out), cb->msg, CRYPTO_BENCH_MSG_LEN);
+}
+static void
+crypto_bench_base64_decode(crypto_bench_t *cb)
+{
+  base64_decode(cb->out, sizeof(cb->out), cb->b64, cb->b64_len);
+}
+static void
+crypto_bench_base32_encode(crypto_bench_t *cb)
+{
+  base32_encode(cb->out, sizeof(cb->out), cb->msg, CRYPTO_BENCH_MSG_LEN);
+}
+static void
+crypto_bench_base32_decode(crypto_bench_t *cb)
+{
+  base32_decode(cb->out, sizeof(cb->out), cb->b32, strlen(cb->b32));
+}
+static void
+crypto_bench_base16_encode(crypto_bench_t *cb)
+{
+  base16_encode(cb->out, sizeof(cb->out), cb->msg, CRYPTO_BENCH_MSG_LEN);
+}
+static void
+crypto_bench_base16_decode(crypto_bench_t *cb)
+{
+  base16_decode(cb->out, sizeof(cb->out), cb->b16, CRYPTO_BENCH_MSG_LEN*2);
+}
+
+/** One operation timed by bench_crypto(). */
+typedef struct crypto_bench_op_t {
+  const char *name;
+  void (*fn)(crypto_bench_t *cb);
+} crypto_bench_op_t;
+
+#define CRYPTO_OP(s) { #s, crypto_bench_##s }
+
+static const crypto_bench_op_t crypto_bench_ops[] = {
+  CRYPTO_OP(sign),
+  CRYPTO_OP(checksig),
+  CRYPTO_OP(hybrid_decrypt),
+  CRYPTO_OP(dh_generate),
+  CRYPTO_OP(dh_compute),
+  CRYPTO_OP(sha1),
+  CRYPTO_OP(sha256),
+  CRYPTO_OP(base64_encode),
+  CRYPTO_OP(base64_decode),
+  CRYPTO_OP(base32_encode),
+  CRYPTO_OP(base32_decode),
+  CRYPTO_OP(base16_encode),
+  CRYPTO_OP(base16_decode),
+  { NULL, NULL }
+};
+
+/** Spend at least this many nanoseconds of CPU time timing each operation
+ * in bench_crypto(). */
+#define CRYPTO_BENCH_MIN_NSEC (U64_LITERAL(250)*1000*1000)
+
+/** Time the public-key, key-agreement, digest and encoding operations that
+ * relays and authorities spend most of their CPU on.  Report operations per
+ * second and, where we have a cycle counter, cycles per operation, so that
+ * results from different OpenSSL builds or engines are easy to compare.
+ * Digests and encodings work on CRYPTO_BENCH_MSG_LEN bytes; RSA and DH use
+ * our usual 1024-bit sizes. */
+static void
+bench_crypto(void)
+{
+  crypto_bench_t *cb = tor_malloc_zero(sizeof(crypto_bench_t));
+  crypto_dh_env_t *peer;
+  const crypto_bench_op_t *op;
+
+  cb->key = crypto_new_pk_env();
+  crypto_pk_generate_key(cb->key);
+  crypto_rand(cb->msg, sizeof(cb->msg));
+  cb->sig_len = crypto_pk_private_sign_digest(cb->key, cb->sig,
+                        sizeof(cb->sig), cb->msg, CRYPTO_BENCH_MSG_LEN);
+  tor_assert(cb->sig_len > 0);
+  /* Long enough that it needs the symmetric part of the hybrid scheme. */
+  cb->hybrid_len = crypto_pk_public_hybrid_encrypt(cb->key, cb->hybrid,
+                        sizeof(cb->hybrid), cb->msg, PK_BYTES+50,
+                        PK_PKCS1_OAEP_PADDING, 0);
+  tor_assert(cb->hybrid_len > 0);
+  cb->dh = crypto_dh_new(DH_TYPE_CIRCUIT);
+  peer = crypto_dh_new(DH_TYPE_CIRCUIT);
+  crypto_dh_get_public(cb->dh, cb->out, DH_BYTES);
+  crypto_dh_get_public(peer, cb->dh_peer, DH_BYTES);
+  crypto_dh_free(peer);
+  cb->b64_len = base64_encode(cb->b64, sizeof(cb->b64), cb->msg,
+                              CRYPTO_BENCH_MSG_LEN);
+  tor_assert(cb->b64_len > 0);
+  base32_encode(cb->b32, sizeof(cb->b32), cb->msg, CRYPTO_BENCH_MSG_LEN);
+  base16_encode(cb->b16, sizeof(cb->b16), cb->msg, CRYPTO_BENCH_MSG_LEN);
+
+  reset_perftime();
+  for (op = crypto_bench_ops; op->name; ++op) {
+    uint64_t start, end;
+#ifdef HAVE_BENCH_CYCLES
+    uint64_t c_start, c_end;
+#endif
+    int iters, i;
+    for (iters = 16; ; iters *= 2) {
+      start = perftime();
+#ifdef HAVE_BENCH_CYCLES
+      c_start = bench_cycles();
+#endif
+      for (i = 0; i < iters; ++i)
+        op->fn(cb);
+#ifdef HAVE_BENCH_CYCLES
+      c_end = bench_cycles();
+#endif
+      end = perftime();
+      if (end - start >= CRYPTO_BENCH_MIN_NSEC || iters >= (1<<26))
+        break;
+    }
+    bench_report("ops/sec", 1e9 / NANOCOUNT(start, end, iters),
+                 "%s", op->name);
+#ifdef HAVE_BENCH_CYCLES
+    bench_report("cycles/op", ((double)(c_end - c_start)) / iters,
+                 "%s, cycles", op->name);
+#endif
+  }
+
+  crypto_dh_free(cb->dh);
+  crypto_free_pk_env(cb->key);
+  tor_free(cb);
+}
+
+/** How many authorities vote in bench_consensus()? */
+#define CONS_BENCH_N_VOTES 9
+/** The highest consensus method bench_consensus() tries. */
+#define CONS_BENCH_MAX_METHOD 12
+/** The lowest consensus method that has a microdesc flavor. */
+#define CONS_BENCH_MIN_MD_METHOD 8
+
+/** One synthetic relay for bench_consensus(): what every authority agrees
+ * on about it. */
+typedef struct cons_bench_relay_t {
+  char identity[DIGEST_LEN];
+  char descriptor[DIGEST_LEN];
+  char nickname[MAX_NICKNAME_LEN+1];
+  uint32_t addr;
+  uint32_t bandwidth;
+  uint64_t flags; /**< Bits in the order of cons_bench_flags. */
+  char *md_line; /**< The microdesc hash line every vote gives it. */
+} cons_bench_relay_t;
+
+/** The flags that every synthetic vote knows about, sorted. */
+static const char cons_bench_flags[] =
+  "Exit Fast Guard Running Stable V2Dir Valid";
+
+/** Helper: sort cons_bench_relay_t by identity. */
+static int
+_cons_bench_compare_relays(const void **a, const void **b)
+{
+  const cons_bench_relay_t *r1 = *a, *r2 = *b;
+  return fast_memcmp(r1->identity, r2->identity, DIGEST_LEN);
+}
+
+/** Return a newly allocated vote by authority <b>idx</b> on the relays in
+ * <b>relays</b>, supporting only consensus method <b>method</b>.  Use
+ * <b>id_key</b> as the identity of the first authority, so that we can
+ * sign the consensus as it.  Each
+ * authority leaves out a few relays and measures bandwidth a little
+ * differently, so the votes disagree the way real ones do. */
+static networkstatus_t *
+cons_bench_make_vote(int idx, const smartlist_t *relays, int method,
+                     crypto_pk_env_t *id_key, time_t now)
+{
+  networkstatus_t *v = tor_malloc_zero(sizeof(networkstatus_t));
+  networkstatus_voter_info_t *voter =
+    tor_malloc_zero(sizeof(networkstatus_voter_info_t));
+  char *method_str = NULL;
+
+  v->type = NS_TYPE_VOTE;
+  v->published = now;
+  v->valid_after = now;
+  v->fresh_until = now + 3600;
+  v->valid_until = now + 3*3600;
+  v->vote_seconds = v->dist_seconds = 300;
+  v->supported_methods = smartlist_create();
+  tor_asprintf(&method_str, "%d", method);
+  smartlist_add(v->supported_methods, method_str);
+  v->client_versions = tor_strdup("0.2.2.35,0.2.3.10-alpha");
+  v->server_versions = tor_strdup("0.2.2.35,0.2.3.10-alpha");
+  v->known_flags = smartlist_create();
+  smartlist_split_string(v->known_flags, cons_bench_flags, NULL, 0, -1);
+  v->net_params = smartlist_create();
+  smartlist_split_string(v->net_params, "bwweightscale=10000 circwindow=1000",
+                         NULL, 0, -1);
+
+  v->voters = smartlist_create();
+  tor_asprintf(&voter->nickname, "bench%d", idx);
+  voter->address = tor_strdup("10.0.0.1");
+  voter->addr = 0x0a000001 + idx;
+  voter->dir_port = 80;
+  voter->or_port = 443;
+  voter->contact = tor_strdup("bench@example.com");
+  if (idx == 0)
+    crypto_pk_get_digest(id_key, voter->identity_digest);
+  else
+    crypto_rand(voter->identity_digest, DIGEST_LEN);
+  crypto_rand(voter->vote_digest, DIGEST_LEN);
+  smartlist_add(v->voters, voter);
+
+  v->routerstatus_list = smartlist_create();
+  SMARTLIST_FOREACH_BEGIN(relays, const cons_bench_relay_t *, r) {
+    vote_routerstatus_t *vrs;
+    routerstatus_t *rs;
+    if (crypto_rand_int(20) == 0)
+      continue;
+    vrs = tor_malloc_zero(sizeof(vote_routerstatus_t));
+    rs = &vrs->status;
+    memcpy(rs->identity_digest, r->identity, DIGEST_LEN);
+    memcpy(rs->descriptor_digest, r->descriptor, DIGEST_LEN);
+    strlcpy(rs->nickname, r->nickname, sizeof(rs->nickname));
+    rs->published_on = now - 600;
+    rs->addr = r->addr;
+    rs->or_port = 9001;
+    rs->dir_port = (r->flags & (1<<5)) ? 9030 : 0;
+    rs->has_bandwidth = 1;
+    rs->bandwidth = r->bandwidth;
+    rs->has_measured_bw = 1;
+    rs->measured_bw = r->bandwidth + crypto_rand_int(r->bandwidth/4 + 1);
+    rs->has_exitsummary = 1;
+    rs->exitsummary = tor_strdup((r->flags & 1) ? "accept 80,443" :
+                                                  "reject 1-65535");
+    vrs->flags = r->flags;
+    vrs->version = tor_strdup("Tor 0.2.2.35");
+    vrs->microdesc = tor_malloc_zero(sizeof(vote_microdesc_hash_t));
+    vrs->microdesc->microdesc_hash_line = tor_strdup(r->md_line);
+    smartlist_add(v->routerstatus_list, vrs);
+  } SMARTLIST_FOREACH_END(r);
+
+  return v;
+}
+
+/** Run benchmarks for computing consensuses: for a few network sizes and
+ * every consensus method, time how long networkstatus_compute_consensus()
+ * takes to merge, format, and sign each flavor, and how long it takes to
+ * parse the result. */
+static void
+bench_consensus(void)
+{
+  static const int sizes[] = { 2000, 7000, 20000, 0 };
+  crypto_pk_env_t *id_key = crypto_new_pk_env();
+  crypto_pk_env_t *sign_key = crypto_new_pk_env();
+  time_t now = time(NULL);
+  int s, i, method;
+
+  crypto_pk_generate_key(id_key);
+  crypto_pk_generate_key(sign_key);
+  reset_perftime();
+
+  for (s = 0; sizes[s]; ++s) {
+    smartlist_t *relays = smartlist_create();
+    for (i = 0; i < sizes[s]; ++i) {
+      cons_bench_relay_t *r = tor_malloc_zero(sizeof(cons_bench_relay_t));
+      char md[DIGEST256_LEN], md64[BASE64_DIGEST256_LEN+1];
+      crypto_rand(r->identity, DIGEST_LEN);
+      crypto_rand(r->descriptor, DIGEST_LEN);
+      tor_snprintf(r->nickname, sizeof(r->nickname), "relay%d", i);
+      r->addr = 0x0b000000 + i;
+      r->bandwidth = 20 + crypto_rand_int(10000);
+      /* Everybody is Fast, Running, and Valid; about a third are Exits,
+       * Guards, Stable, or V2Dirs. */
+      r->flags = (1<<1) | (1<<3) | (1<<6);
+      if (crypto_rand_int(3) == 0) r->flags |= (1<<0);
+      if (crypto_rand_int(3) == 0) r->flags |= (1<<2);
+      if (crypto_rand_int(3) == 0) r->flags |= (1<<4);
+      if (crypto_rand_int(3) == 0) r->flags |= (1<<5);
+      crypto_rand(md, sizeof(md));
+      digest256_to_base64(md64, md);
+      tor_asprintf(&r->md_line, "8,9,10,11,12 sha256=%s", md64);
+      smartlist_add(relays, r);
+    }
+    smartlist_sort(relays, _cons_bench_compare_relays);
+
+    for (method = 1; method <= CONS_BENCH_MAX_METHOD; ++method) {
+      smartlist_t *votes = smartlist_create();
+      int flav;
+      for (i = 0; i < CONS_BENCH_N_VOTES; ++i)
+        smartlist_add(votes, cons_bench_make_vote(i, relays, method,
+                                                   id_key, now));
+
+      for (flav = FLAV_NS; flav <= FLAV_MICRODESC; ++flav) {
+        uint64_t start, mid, end;
+        char *text;
+        networkstatus_t *c;
+        if (flav == FLAV_MICRODESC && method < CONS_BENCH_MIN_MD_METHOD)
+          continue;
+        start = perftime();
+        text = networkstatus_compute_consensus(votes, CONS_BENCH_N_VOTES,
+                                               id_key, sign_key, NULL, NULL,
+                                               flav);
+        mid = perftime();
+        tor_assert(text);
+        c = networkstatus_parse_vote_from_string(text, NULL,
+                                                 NS_TYPE_CONSENSUS);
+        end = perftime();
+        tor_assert(c);
+        bench_report("msec", NANOCOUNT(start, mid, 1)/1e6,
+                     "%d relays, method %d, %s: compute", sizes[s], method,
+                     networkstatus_get_flavor_name(flav));
+        bench_report("msec", NANOCOUNT(mid, end, 1)/1e6,
+                     "%d relays, method %d, %s: parse", sizes[s], method,
+                     networkstatus_get_flavor_name(flav));
+        bench_report("bytes", (double)strlen(text),
+                     "%d relays, method %d, %s: size", sizes[s], method,
+                     networkstatus_get_flavor_name(flav));
+        networkstatus_vote_free(c);
+        tor_free(text);
+      }
+
+      SMARTLIST_FOREACH(votes, networkstatus_t *, v,
+                        networkstatus_vote_free(v));
+      smartlist_free(votes);
+    }
+
+    SMARTLIST_FOREACH(relays, cons_bench_relay_t *, r, {
+      tor_free(r->md_line);
+      tor_free(r);
+    });
+    smartlist_free(relays);
+  }
+
+  crypto_free_pk_env(id_key);
+  crypto_free_pk_env(sign_key);
+}
+
+/** How many bytes each case of bench_buffers() moves through buffers, for
+ * each size of write. */
+#define BUF_BENCH_TOTAL_BYTES (64<<20)
+/** About how many bytes each case of bench_buffers() puts on a buffer
+ * before taking them off again. */
+#define BUF_BENCH_ROUND_BYTES (1<<20)
+
+/** What bench_buffers() has measured so far for one kind of operation. */
+typedef struct buf_bench_acc_t {
+  uint64_t nsec; /**< Time spent in the operation. */
+  uint64_t n_bytes; /**< Bytes the operation handled. */
+  buf_stats_t stats; /**< Buffer work the operation did. */
+  buf_stats_t before; /**< Buffer totals when the operation last began. */
+  uint64_t start; /**< perftime() when the operation last began. */
+} buf_bench_acc_t;
+
+/** Note that we're starting an operation that <b>acc</b> measures. */
+static INLINE void
+buf_bench_start(buf_bench_acc_t *acc)
+{
+  buf_get_stats(&acc->before);
+  acc->start = perftime();
+}
+
+/** Note that the operation that <b>acc</b> measures has just handled
+ * <b>n_bytes</b> bytes. */
+static INLINE void
+buf_bench_stop(buf_bench_acc_t *acc, size_t n_bytes)
+{
+  uint64_t end = perftime();
+  buf_stats_t after;
+  buf_get_stats(&after);
+  acc->nsec += end - acc->start;
+  acc->n_bytes += n_bytes;
+  acc->stats.n_chunks_allocated +=
+    after.n_chunks_allocated - acc->before.n_chunks_allocated;
+  acc->stats.n_bytes_copied +=
+    after.n_bytes_copied - acc->before.n_bytes_copied;
+}
+
+/** Report what <b>acc</b> measured of <b>op</b> with <b>size</b>-byte
+ * units, and reset it. */
+static void
+buf_bench_report(buf_bench_acc_t *acc, const char *op, size_t size)
+{
+  double n = (double)acc->n_bytes;
+  tor_assert(acc->n_bytes);
+  bench_report("nsec/byte", acc->nsec / n, "%s, %lu-byte units", op,
+               (unsigned long)size);
+  bench_report("per MB", acc->stats.n_chunks_allocated * 1e6 / n,
+               "%s, %lu-byte units, chunk allocations", op,
+               (unsigned long)size);
+  bench_report("per byte", acc->stats.n_bytes_copied / n,
+               "%s, %lu-byte units, bytes copied", op, (unsigned long)size);
+  memset(acc, 0, sizeof(*acc));
+}
+
+/** Time the buffer operations that the rest of Tor leans on hardest, using
+ * <b>size</b>-byte units. */
+static void
+bench_buffers_at_size(size_t size)
+{
+  const int per_round = size < BUF_BENCH_ROUND_BYTES ?
+    (int)(BUF_BENCH_ROUND_BYTES / size) : 1;
+  const int n_rounds = (int)(BUF_BENCH_TOTAL_BYTES / (size * per_round));
+  char *data = tor_malloc(size), *out = tor_malloc(size);
+  buf_t *buf = buf_new(), *buf2 = buf_new();
+  buf_bench_acc_t acc, acc2;
+  char header[128];
+  size_t header_len;
+  int round, i;
+
+  memset(&acc, 0, sizeof(acc));
+  memset(&acc2, 0, sizeof(acc2));
+  crypto_rand(data, size);
+
+  /* Fill a buffer with write_to_buf() and empty it with fetch_from_buf(),
+   * as a connection does with its cells. */
+  for (round = 0; round < n_rounds; ++round) {
+    buf_bench_start(&acc);
+    for (i = 0; i < per_round; ++i)
+      write_to_buf(data, size, buf);
+    buf_bench_stop(&acc, size * per_round);
+    buf_bench_start(&acc2);
+    for (i = 0; i < per_round; ++i)
+      fetch_from_buf(out, size, buf);
+    buf_bench_stop(&acc2, size * per_round);
+  }
+  buf_bench_report(&acc, "write_to_buf", size);
+  buf_bench_report(&acc2, "fetch_from_buf", size);
+
+  /* Make the first unit on a buffer of cell-sized writes contiguous, as
+   * fetch_from_buf_http() does with headers. */
+  for (round = 0; round < n_rounds; ++round) {
+    for (i = 0; i < per_round; ++i) {
+      size_t off;
+      for (off = 0; off < size; off += CELL_NETWORK_SIZE)
+        write_to_buf(data+off, MIN(size-off, CELL_NETWORK_SIZE), buf);
+    }
+    buf_bench_start(&acc);
+    for (i = 0; i < per_round; ++i) {
+      buf_pullup(buf, size, 0);
+      buf_drain(buf, size);
+    }
+    buf_bench_stop(&acc, size * per_round);
+  }
+  buf_bench_report(&acc, "buf_pullup", size);
+
+  /* Move units from one buffer to another, as a linked connection does. */
+  for (round = 0; round < n_rounds; ++round) {
+    for (i = 0; i < per_round; ++i)
+      write_to_buf(data, size, buf);
+    buf_bench_start(&acc);
+    for (i = 0; i < per_round; ++i) {
+      size_t flushlen = size;
+      move_buf_to_buf(buf2, buf, &flushlen);
+    }
+    buf_bench_stop(&acc, size * per_round);
+    buf_clear(buf2);
+  }
+  buf_bench_report(&acc, "move_buf_to_buf", size);
+
+  /* Parse an HTTP response whose body is one unit, as it arrives in 16 KB
+   * TLS records, as a directory connection does. */
+  tor_snprintf(header, sizeof(header),
+               "HTTP/1.0 200 OK\r\nContent-Length: %lu\r\n"
+               "Content-Type: text/plain\r\n\r\n", (unsigned long)size);
+  header_len = strlen(header);
+  for (round = 0; round < n_rounds; ++round) {
+    buf_bench_start(&acc);
+    for (i = 0; i < per_round; ++i) {
+      char *headers = NULL, *body = NULL;
+      size_t body_used = 0, off;
+      int r = 0;
+      write_to_buf(header, header_len, buf);
+      for (off = 0; off < size && r == 0; off += 16384) {
+        write_to_buf(data+off, MIN(size-off, 16384), buf);
+        r = fetch_from_buf_http(buf, &headers, 8192, &body, &body_used,
+                                size+1, 0);
+      }
+      tor_assert(r == 1 && body_used == size);
+      tor_free(headers);
+      tor_free(body);
+    }
+    buf_bench_stop(&acc, size * per_round);
+  }
+  buf_bench_report(&acc, "fetch_from_buf_http", size);
+
+  /* Create, fill and free a buffer over and over, which is all chunk
+   * allocation: this is what the chunk freelists are for. */
+  for (round = 0; round < n_rounds; ++round) {
+    buf_bench_start(&acc);
+    for (i = 0; i < per_round; ++i) {
+      buf_t *b = buf_new();
+      write_to_buf(data, size, b);
+      buf_free(b);
+    }
+    buf_bench_stop(&acc, size * per_round);
+  }
+  buf_bench_report(&acc, "buf_new+write_to_buf+buf_free", size);
+
+  buf_free(buf);
+  buf_free(buf2);
+  tor_free(data);
+  tor_free(out);
+}
+
+/** Time buffer operations with cells, full TLS records, and directory
+ * bodies, and count how many chunks they allocate and bytes they copy. */
+static void
+bench_buffers(void)
+{
+  reset_perftime();
+  bench_buffers_at_size(CELL_NETWORK_SIZE);
+  bench_buffers_at_size(16384);
+  bench_buffers_at_size(1<<20);
+  buf_shrink_freelists(1);
+}
+
+/** Directory holding the cached-* files that the parse_* benchmarks read,
+ * as given with --dir-docs: usually some Tor's DataDirectory. */
+static const char *bench_docs_dir = NULL;
+
+/** Return how many bytes the heap has handed out and not had back, or 0 if
+ * we can't tell. */
+static size_t
+bench_heap_in_use(void)
+{
+#if defined(__GLIBC__) && \
+  (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  struct mallinfo2 mi = mallinfo2();
+  return mi.uordblks + mi.hblkhd;
+#elif defined(HAVE_MALLINFO)
+  struct mallinfo mi = mallinfo();
+  return (size_t)(unsigned)mi.uordblks + (size_t)(unsigned)mi.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+/** Read <b>fname</b> from bench_docs_dir into a newly allocated string, or
+ * say why we can't and return NULL. */
+static char *
+bench_read_doc(const char *fname)
+{
+  char *path, *body;
+  if (!bench_docs_dir) {
+    printf("No --dir-docs given; skipping %s.\n", fname);
+    return NULL;
+  }
+  tor_asprintf(&path, "%s"PATH_SEPARATOR"%s", bench_docs_dir, fname);
+  body = read_file_to_str(path, RFTS_IGNORE_MISSING, NULL);
+  if (!body)
+    printf("Couldn't read %s; skipping.\n", path);
+  tor_free(path);
+  return body;
+}
+
+/** Report how long it took, between <b>start</b> and <b>end</b>, to parse
+ * the <b>len</b> bytes of <b>fname</b> into <b>n_items</b> things called
+ * <b>item</b>, and how much more heap we were using afterwards than the
+ * <b>heap_before</b> bytes we were using before. */
+static void
+bench_report_parse(const char *fname, size_t len, int n_items,
+                   const char *item, uint64_t start, uint64_t end,
+                   size_t heap_before)
+{
+  size_t heap_after = bench_heap_in_use();
+  double nsec = NANOCOUNT(start, end, 1);
+
+  bench_report("MB/sec", len / (nsec / 1e9) / 1e6, "Parsing %s (%d %ss)",
+               fname, n_items, item);
+  if (n_items) {
+    bench_report("usec", nsec / n_items / 1000, "Parsing %s, per %s",
+                 fname, item);
+  }
+  if (heap_after > heap_before) {
+    bench_report("MB", (heap_after - heap_before) / 1e6,
+                 "Heap held by the %ss from %s", item, fname);
+    if (n_items) {
+      bench_report("bytes", ((double)(heap_after - heap_before)) / n_items,
+                   "Heap held per %s from %s", item, fname);
+    }
+  }
+}
+
+/** Time router_parse_list_from_string() on our cached-descriptors, with
+ * their annotations, checking every signature just as we would on
+ * startup. */
+static void
+bench_parse_descriptors(void)
+{
+  const char *fname = "cached-descriptors";
+  char *body = bench_read_doc(fname);
+  const char *s = body;
+  smartlist_t *routers;
+  uint64_t start, end;
+  size_t heap;
+
+  if (!body)
+    return;
+  routers = smartlist_create();
+  heap = bench_heap_in_use();
+  reset_perftime();
+  start = perftime();
+  router_parse_list_from_string(&s, NULL, routers, SAVED_NOWHERE, 0, 1, NULL);
+  end = perftime();
+  bench_report_parse(fname, strlen(body), smartlist_len(routers),
+                     "descriptor", start, end, heap);
+
+  SMARTLIST_FOREACH(routers, routerinfo_t *, ri, routerinfo_free(ri));
+  smartlist_free(routers);
+  tor_free(body);
+}
+
+/** Time networkstatus_parse_vote_from_string() on our cached consensus of
+ * each flavor. */
+static void
+bench_parse_consensus(void)
+{
+  static const char *fnames[] = {
+    "cached-consensus", "cached-microdesc-consensus", NULL
+  };
+  int i;
+
+  for (i = 0; fnames[i]; ++i) {
+    char *body = bench_read_doc(fnames[i]);
+    networkstatus_t *ns;
+    uint64_t start, end;
+    size_t heap;
+
+    if (!body)
+      continue;
+    heap = bench_heap_in_use();
+    reset_perftime();
+    start = perftime();
+    ns = networkstatus_parse_vote_from_string(body, NULL, NS_TYPE_CONSENSUS);
+    end = perftime();
+    if (ns) {
+      bench_report_parse(fnames[i], strlen(body),
+                         smartlist_len(ns->routerstatus_list),
+                         "router", start, end, heap);
+      networkstatus_vote_free(ns);
+    } else {
+      printf("Couldn't parse %s.\n", fnames[i]);
+    }
+    tor_free(body);
+  }
+}
+
+/** Time microdescs_parse_from_string() on our cached-microdescs, with their
+ * annotations, keeping a copy of each body as we do on startup. */
+static void
+bench_parse_microdescs(void)
+{
+  const char *fname = "cached-microdescs";
+  char *body = bench_read_doc(fname);
+  smartlist_t *mds;
+  size_t len;
+  uint64_t start, end;
+  size_t heap;
+
+  if (!body)
+    return;
+  len = strlen(body);
+  heap = bench_heap_in_use();
+  reset_perftime();
+  start = perftime();
+  mds = microdescs_parse_from_string(body, body+len, 1, 1);
+  end = perftime();
+  bench_report_parse(fname, len, smartlist_len(mds), "microdescriptor",
+                     start, end, heap);
+
+  SMARTLIST_FOREACH(mds, microdesc_t *, md, microdesc_free(md));
+  smartlist_free(mds);
+  tor_free(body);
+}
+
+/** Time authority_cert_parse_from_string() on every certificate in our
+ * cached-certs, the way trusted_dirs_load_certs_from_string() does. */
+static void
+bench_parse_certs(void)
+{
+  const char *fname = "cached-certs";
+  char *body = bench_read_doc(fname);
+  const char *s, *eos;
+  smartlist_t *certs;
+  uint64_t start, end;
+  size_t heap;
+
+  if (!body)
+    return;
+  certs = smartlist_create();
+  heap = bench_heap_in_use();
+  reset_perftime();
+  start = perftime();
+  for (s = body; *s; s = eos) {
+    authority_cert_t *cert = authority_cert_parse_from_string(s, &eos);
+    if (!cert)
+      break;
+    smartlist_add(certs, cert);
+  }
+  end = perftime();
+  bench_report_parse(fname, strlen(body), smartlist_len(certs),
+                     "certificate", start, end, heap);
+
+  SMARTLIST_FOREACH(certs, authority_cert_t *, cert,
+                    authority_cert_free(cert));
+  smartlist_free(certs);
+  tor_free(body);
+}
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -267,9 +1897,21 @@ typedef struct benchmark_t {
 
 static struct benchmark_t benchmarks[] = {
   ENT(dmap),
+  ENT(di_ops),
+  ENT(rand),
+  ENT(crypto),
   ENT(aes),
   ENT(cell_aes),
+  ENT(cell_aes_multi),
   ENT(cell_ops),
+  ENT(buffers),
+  ENT(onion_handshakes),
+  ENT(relay_throughput),
+  ENT(consensus),
+  ENT(parse_descriptors),
+  ENT(parse_consensus),
+  ENT(parse_microdescs),
+  ENT(parse_certs),
   {NULL,NULL,0}
 };
 
@@ -286,19 +1928,103 @@ find_benchmark(const char *name)
 }
 
 /** Main entry point for benchmark code: parse the command line, and run
- * some benchmarks. */
+ * some benchmarks.
+ *
+ * Name benchmarks to run only those, or use "--filter STR" to run those
+ * whose names contain STR; by default we run them all.  "--warmup N" runs
+ * each benchmark N times before we start recording, and "--iterations N"
+ * records N runs of each, reporting the median, 99th percentile and range
+ * of every number it measures.  "--json FILE" also writes every recorded
+ * value to FILE, along with what we know about the host, for tracking
+ * results across builds.  "--dir-docs DIR" names a directory, such as a
+ * DataDirectory, whose cached-* files the parse_* benchmarks should read. */
 int
 main(int argc, const char **argv)
 {
   int i;
   int list=0, n_enabled=0;
+  int use_accel = 0;
+  const char *accel_name = NULL, *accel_dir = NULL;
+  const char *json_fname = NULL;
+  int warmup = 0, iterations = 1;
   benchmark_t *b;
+  bench_host_t host;
+  or_options_t *options;
+  char *errmsg = NULL;
+  char data_dir[256];
+  int r, ok;
 
   tor_threads_init();
+  init_logging();
+
+  /* Some of the code we benchmark looks at our options, and setting them
+   * wants a private data directory. */
+#ifdef MS_WINDOWS
+  {
+    char buf[MAX_PATH];
+    const char *tmp = buf;
+    if (!GetTempPath(sizeof(buf),buf))
+      tmp = "c:\\windows\\temp";
+    tor_snprintf(data_dir, sizeof(data_dir),
+                 "%s\\tor_bench_%d", tmp, (int)getpid());
+    r = mkdir(data_dir);
+  }
+#else
+  tor_snprintf(data_dir, sizeof(data_dir), "/tmp/tor_bench_%d",
+               (int)getpid());
+  r = mkdir(data_dir, 0700);
+#endif
+  if (r) {
+    fprintf(stderr, "Can't create directory %s:", data_dir);
+    perror("");
+    return 1;
+  }
+  options = options_new();
+  options->command = CMD_RUN_UNITTESTS;
+  options_init(options);
+  options->DataDirectory = tor_strdup(data_dir);
+  if (set_options(options, &errmsg) < 0) {
+    printf("Failed to set initial options: %s\n", errmsg);
+    tor_free(errmsg);
+    rmdir(data_dir);
+    return 1;
+  }
 
   for (i = 1; i < argc; ++i) {
     if (!strcmp(argv[i], "--list")) {
       list = 1;
+    } else if (!strcmp(argv[i], "--accel")) {
+      use_accel = 1;
+    } else if (!strcmp(argv[i], "--accel-name") && i+1 < argc) {
+      use_accel = 1;
+      accel_name = argv[++i];
+    } else if (!strcmp(argv[i], "--accel-dir") && i+1 < argc) {
+      accel_dir = argv[++i];
+    } else if (!strcmp(argv[i], "--dir-docs") && i+1 < argc) {
+      bench_docs_dir = argv[++i];
+    } else if (!strcmp(argv[i], "--json") && i+1 < argc) {
+      json_fname = argv[++i];
+    } else if (!strcmp(argv[i], "--warmup") && i+1 < argc) {
+      warmup = (int)tor_parse_long(argv[++i], 10, 0, INT_MAX, &ok, NULL);
+      if (!ok) {
+        printf("Bad --warmup count %s\n", argv[i]);
+        rmdir(data_dir);
+        return 1;
+      }
+    } else if (!strcmp(argv[i], "--iterations") && i+1 < argc) {
+      iterations = (int)tor_parse_long(argv[++i], 10, 1, INT_MAX, &ok, NULL);
+      if (!ok) {
+        printf("Bad --iterations count %s\n", argv[i]);
+        rmdir(data_dir);
+        return 1;
+      }
+    } else if (!strcmp(argv[i], "--filter") && i+1 < argc) {
+      const char *pattern = argv[++i];
+      ++n_enabled;
+      for (b = benchmarks; b->name; ++b) {
+        if (strstr(b->name, pattern))
+          b->enabled = 1;
+      }
     } else {
       benchmark_t *b = find_benchmark(argv[i]);
       ++n_enabled;
@@ -312,16 +2038,67 @@ main(int argc, const char **argv)
 
   reset_perftime();
 
+  if (crypto_global_init(use_accel, accel_name, accel_dir)) {
+    printf("Can't initialize crypto subsystem; exiting.\n");
+    rmdir(data_dir);
+    return 1;
+  }
   crypto_seed_rng(1);
 
+  bench_metrics = smartlist_create();
+  bench_metric_map = strmap_new();
+  bench_get_host_info(&host);
+  if (!list) {
+    printf("# cpu: %s; cpufreq: ", host.cpu_model ? host.cpu_model : "?");
+    if (host.cpufreq_mhz > 0)
+      printf("%.0f MHz", host.cpufreq_mhz);
+    else
+      printf("?");
+    printf("; cycle counter: ");
+    if (host.cycles_mhz > 0)
+      printf("%.0f MHz\n", host.cycles_mhz);
+    else
+      printf("none\n");
+    printf("# warmup runs: %d; recorded runs: %d\n", warmup, iterations);
+  }
+
   for (b = benchmarks; b->name; ++b) {
     if (b->enabled || n_enabled == 0) {
       printf("===== %s =====\n", b->name);
-      if (!list)
-        b->fn();
+      if (!list) {
+        bench_run(b->name, b->fn, warmup, iterations);
+        bench_print_results(b->name);
+      }
     }
   }
 
-  return 0;
+  r = 0;
+  if (json_fname && !list) {
+    FILE *f = fopen(json_fname, "w");
+    if (f) {
+      bench_write_json(f, &host, warmup, iterations);
+      if (fclose(f))
+        f = NULL;
+    }
+    if (!f) {
+      fprintf(stderr, "Can't write results to %s:", json_fname);
+      perror("");
+      r = 1;
+    }
+  }
+
+  SMARTLIST_FOREACH(bench_metrics, bench_metric_t *, m, {
+    tor_free(m->bench);
+    tor_free(m->name);
+    tor_free(m->unit);
+    tor_free(m->values);
+    tor_free(m);
+  });
+  smartlist_free(bench_metrics);
+  strmap_free(bench_metric_map, NULL);
+  tor_free(host.cpu_model);
+
+  rmdir(data_dir);
+  return r;
 }
 
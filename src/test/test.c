@@ -33,6 +33,8 @@ const char tor_git_revision[] = "";
 #define GEOIP_PRIVATE
 #define ROUTER_PRIVATE
 #define CIRCUIT_PRIVATE
+#define RELAY_PRIVATE
+#define REPLAYCACHE_PRIVATE
 
 /*
  * Linux doesn't provide lround in math.h by default, but mac os does...
@@ -44,17 +46,25 @@ double fabs(double x);
 
 #include "or.h"
 #include "buffers.h"
+#include "celltrace.h"
 #include "circuitbuild.h"
+#include "circuitlist.h"
+#include "circuituse.h"
 #include "config.h"
+#include "connection.h"
 #include "connection_edge.h"
 #include "geoip.h"
+#include "main.h"
+#include "rendclient.h"
 #include "rendcommon.h"
+#include "replaycache.h"
 #include "test.h"
 #include "torgzip.h"
 #include "mempool.h"
 #include "memarea.h"
 #include "onion.h"
 #include "policies.h"
+#include "relay.h"
 #include "rephist.h"
 #include "routerparse.h"
 
@@ -634,6 +644,1231 @@ test_buffer_copy(void *arg)
     generic_buffer_free(buf2);
 }
 
+static void
+test_buffer_socket_io(void *arg)
+{
+  buf_t *buf=NULL, *buf2=NULL;
+  tor_socket_t fds[2] = { -1, -1 };
+  char b[1000], b2[1000];
+  size_t flushlen;
+  int i, r, eof = 0, err = 0, n_rounds = 0;
+  (void)arg;
+
+  tt_int_op(0, ==, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  set_socket_nonblocking(fds[0]);
+  set_socket_nonblocking(fds[1]);
+
+  for (i = 0; i < (int)sizeof(b); ++i)
+    b[i] = (char)(i*7);
+  /* Make a buffer that spans a good many chunks. */
+  buf = buf_new_with_capacity(1024);
+  buf2 = buf_new_with_capacity(1024);
+  for (i = 0; i < 100; ++i)
+    write_to_buf(b, sizeof(b), buf);
+  flushlen = buf_datalen(buf);
+
+  while (buf_datalen(buf2) < 100*sizeof(b)) {
+    tt_int_op(++n_rounds, <, 10000);
+    if (flushlen) {
+      r = flush_buf(fds[0], buf, flushlen, &flushlen);
+      tt_int_op(r, >=, 0);
+      assert_buf_ok(buf);
+      tt_int_op(buf_datalen(buf), ==, flushlen);
+    }
+    r = read_to_buf(fds[1], 3000, buf2, &eof, &err);
+    tt_int_op(r, >=, 0);
+    tt_int_op(r, <=, 3000);
+    tt_int_op(eof, ==, 0);
+    assert_buf_ok(buf2);
+  }
+  tt_int_op(buf_datalen(buf), ==, 0);
+  tt_int_op(buf_datalen(buf2), ==, 100*sizeof(b));
+  for (i = 0; i < 100; ++i) {
+    fetch_from_buf(b2, sizeof(b2), buf2);
+    test_memeq(b, b2, sizeof(b));
+  }
+
+  /* Nothing left to read: we should block. */
+  tt_int_op(0, ==, read_to_buf(fds[1], 3000, buf2, &eof, &err));
+  assert_buf_ok(buf2);
+  tt_int_op(buf_datalen(buf2), ==, 0);
+
+  /* Now make sure we notice EOF. */
+  tor_close_socket(fds[0]);
+  fds[0] = -1;
+  tt_int_op(0, ==, read_to_buf(fds[1], 3000, buf2, &eof, &err));
+  tt_int_op(eof, ==, 1);
+  assert_buf_ok(buf2);
+
+ done:
+  if (fds[0] >= 0)
+    tor_close_socket(fds[0]);
+  if (fds[1] >= 0)
+    tor_close_socket(fds[1]);
+  buf_free(buf);
+  buf_free(buf2);
+}
+
+static void
+test_buffer_ref_release(void *arg)
+{
+  ++*(int*)arg;
+}
+
+static void
+test_buffer_ref(void *arg)
+{
+  buf_t *buf = NULL;
+  char b[1000], b2[3000];
+  char *headers = NULL, *body = NULL;
+  size_t body_len = 0;
+  const char *req = "GET /tor/ HTTP/1.0\r\n\r\n";
+  int released = 0, i;
+  (void)arg;
+
+  for (i = 0; i < (int)sizeof(b); ++i)
+    b[i] = (char)(i*7);
+
+  /* Referenced bytes come out in order with copied ones, and are released
+   * once they have all been drained. */
+  buf = buf_new_with_capacity(1024);
+  write_to_buf("abc", 3, buf);
+  write_to_buf_ref(b, sizeof(b), buf, test_buffer_ref_release, &released);
+  write_to_buf("xyz", 3, buf);
+  assert_buf_ok(buf);
+  tt_int_op(buf_datalen(buf), ==, sizeof(b)+6);
+  fetch_from_buf(b2, 500, buf);
+  test_memeq(b2, "abc", 3);
+  test_memeq(b2+3, b, 497);
+  tt_int_op(released, ==, 0);
+  fetch_from_buf(b2, 506, buf);
+  test_memeq(b2, b+497, 503);
+  test_memeq(b2+503, "xyz", 3);
+  tt_int_op(released, ==, 1);
+  assert_buf_ok(buf);
+
+  /* Freeing the buffer releases anything still referenced; empty refs are
+   * released at once. */
+  write_to_buf_ref(b, sizeof(b), buf, test_buffer_ref_release, &released);
+  write_to_buf_ref(b, 0, buf, test_buffer_ref_release, &released);
+  tt_int_op(released, ==, 2);
+  buf_free(buf);
+  tt_int_op(released, ==, 3);
+
+  /* Parsing across a reference chunk copies it rather than writing into
+   * memory the buffer doesn't own. */
+  buf = buf_new_with_capacity(16);
+  write_to_buf_ref(req, 4, buf, test_buffer_ref_release, &released);
+  write_to_buf(req+4, strlen(req)-4, buf);
+  tt_int_op(1, ==, fetch_from_buf_http(buf, &headers, 1024,
+                                       &body, &body_len, 1024, 0));
+  test_streq(headers, req);
+  tt_int_op(released, ==, 4);
+  tt_int_op(buf_datalen(buf), ==, 0);
+
+ done:
+  buf_free(buf);
+  tor_free(headers);
+  tor_free(body);
+}
+
+static void
+test_buffer_http_incremental(void *arg)
+{
+  buf_t *buf = NULL;
+  char *headers = NULL, *body = NULL;
+  size_t body_len = 0, i;
+  const char *req2 = "GET /x HTTP/1.0\r\n\r\n";
+  const char *msg = "GET /tor/ HTTP/1.0\r\nContent-Length: 5\r\n\r\n"
+    "hello" "GET /x HTTP/1.0\r\n\r\n";
+  const size_t msglen = strlen(msg), len1 = msglen - strlen(req2);
+  (void)arg;
+
+  /* Feed the first request one byte at a time, as a slow client would. */
+  buf = buf_new_with_capacity(16);
+  for (i = 0; i < len1 - 1; ++i) {
+    write_to_buf(msg+i, 1, buf);
+    tt_int_op(0, ==, fetch_from_buf_http(buf, &headers, 1024,
+                                         &body, &body_len, 1024, 0));
+    tt_assert(!headers);
+  }
+  /* Everything else arrives at once; only the first request is taken. */
+  write_to_buf(msg+i, msglen-i, buf);
+  tt_int_op(1, ==, fetch_from_buf_http(buf, &headers, 1024,
+                                       &body, &body_len, 1024, 0));
+  test_streq(headers, "GET /tor/ HTTP/1.0\r\nContent-Length: 5\r\n\r\n");
+  tt_int_op(body_len, ==, 5);
+  test_streq(body, "hello");
+  tor_free(headers);
+  tor_free(body);
+
+  /* The saved scan state must not leak into the next request. */
+  tt_int_op(1, ==, fetch_from_buf_http(buf, &headers, 1024,
+                                       &body, &body_len, 1024, 0));
+  test_streq(headers, req2);
+  tt_int_op(body_len, ==, 0);
+  tt_int_op(buf_datalen(buf), ==, 0);
+
+  /* A header that's too long is rejected even when it arrives slowly. */
+  tor_free(headers);
+  tor_free(body);
+  for (i = 0; i < 64; ++i) {
+    write_to_buf("x", 1, buf);
+    tt_int_op(0, ==, fetch_from_buf_http(buf, &headers, 64,
+                                         &body, &body_len, 1024, 0));
+  }
+  write_to_buf("x", 1, buf);
+  tt_int_op(-1, ==, fetch_from_buf_http(buf, &headers, 64,
+                                        &body, &body_len, 1024, 0));
+
+ done:
+  tor_free(headers);
+  tor_free(body);
+  buf_free(buf);
+}
+
+static void
+test_cell_queue_batch(void *arg)
+{
+  cell_queue_t queue;
+  cell_t cells[5];
+  packed_cell_t *pc;
+  int i;
+  (void)arg;
+
+  init_cell_pool();
+  memset(&queue, 0, sizeof(queue));
+  memset(cells, 0, sizeof(cells));
+  for (i = 0; i < 5; ++i) {
+    cells[i].circ_id = 100;
+    cells[i].command = CELL_RELAY;
+    cells[i].payload[0] = (uint8_t)i;
+  }
+
+  cell_queue_append_packed_copies(&queue, cells, 0);
+  tt_int_op(queue.n, ==, 0);
+  tt_assert(!queue.head);
+
+  cell_queue_append_packed_copy(&queue, &cells[0]);
+  cell_queue_append_packed_copies(&queue, cells+1, 4);
+  tt_int_op(queue.n, ==, 5);
+  for (i = 0, pc = queue.head; pc; pc = pc->next, ++i) {
+    tt_int_op((uint8_t)pc->body[2], ==, CELL_RELAY);
+    tt_int_op((uint8_t)pc->body[3], ==, i);
+    if (!pc->next)
+      tt_ptr_op(pc, ==, queue.tail);
+  }
+  tt_int_op(i, ==, 5);
+
+  /* Appending to an empty queue sets both ends. */
+  cell_queue_clear(&queue);
+  tt_int_op(queue.n, ==, 0);
+  cell_queue_append_packed_copies(&queue, cells, 2);
+  tt_int_op(queue.n, ==, 2);
+  tt_ptr_op(queue.head->next, ==, queue.tail);
+  tt_assert(!queue.tail->next);
+
+ done:
+  cell_queue_clear(&queue);
+  free_cell_pool();
+}
+
+/** Check formatting of onionskin latency histograms. */
+static void
+test_onionskin_latency(void *arg)
+{
+  char *s = NULL;
+  (void)arg;
+
+  /* Nothing else in the unit tests records onionskin timings. */
+  s = rep_hist_format_onionskin_latency();
+  tt_str_op(s, ==, "");
+  tor_free(s);
+
+  rep_hist_note_onionskin_timing(ONIONSKIN_TYPE_CREATE, 2, 100, 3000, 1);
+  rep_hist_note_onionskin_timing(ONIONSKIN_TYPE_CREATE, 2, 300, 5000, 1);
+  rep_hist_note_onionskin_timing(ONIONSKIN_TYPE_CREATE_FAST, -1, -1, 4, -1);
+  s = rep_hist_format_onionskin_latency();
+  tt_str_op(s, ==,
+     "create queue count=2 mean-usec=200 buckets="
+       "0,0,0,0,0,0,1,0,1,0,0,0,0,0,0,0,0,0,0,0,0,0\n"
+     "create crypto count=2 mean-usec=4000 buckets="
+       "0,0,0,0,0,0,0,0,0,0,0,1,1,0,0,0,0,0,0,0,0,0\n"
+     "create reply count=2 mean-usec=1 buckets="
+       "2,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0\n"
+     "create_fast crypto count=1 mean-usec=4 buckets="
+       "0,0,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0\n"
+     "worker 2 count=2 mean-queue-usec=200 mean-crypto-usec=4000\n");
+
+ done:
+  tor_free(s);
+}
+
+/** Check formatting of main loop handler latency histograms. */
+static void
+test_handler_latency(void *arg)
+{
+  char *s = NULL;
+  struct timeval start;
+  (void)arg;
+
+  s = rep_hist_format_handler_latency();
+  tt_str_op(s, ==, "");
+  tor_free(s);
+
+  /* A handler that "started" a second ago lands in the 2^19 usec bucket. */
+  tor_gettimeofday(&start);
+  start.tv_sec -= 1;
+  rep_hist_note_handler_time(HANDLER_REFILL, &start);
+  s = rep_hist_format_handler_latency();
+  test_assert(!strcmpstart(s, "refill count=1 mean-usec=10"));
+  test_assert(!strcmpend(s, " buckets="
+                 "0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,0,0\n"));
+
+ done:
+  tor_free(s);
+}
+
+/** Check that cell processing latency is kept per cell command. */
+static void
+test_cell_latency(void *arg)
+{
+  char *s = NULL;
+  struct timeval start;
+  (void)arg;
+
+  s = rep_hist_format_cell_processing_latency();
+  tt_str_op(s, ==, "");
+  tor_free(s);
+
+  /* Commands we don't know about are ignored. */
+  tor_gettimeofday(&start);
+  rep_hist_note_cell_processing_time(100, &start);
+  rep_hist_note_cell_processing_time(CELL_AUTHENTICATE+1, &start);
+  s = rep_hist_format_cell_processing_latency();
+  tt_str_op(s, ==, "");
+  tor_free(s);
+
+  start.tv_sec -= 1;
+  rep_hist_note_cell_processing_time(CELL_CREATE_FAST, &start);
+  rep_hist_note_cell_processing_time(CELL_CERTS, &start);
+  s = rep_hist_format_cell_processing_latency();
+  test_assert(!strcmpstart(s, "create_fast count=1 mean-usec=10"));
+  test_assert(strstr(s, "\ncerts count=1 mean-usec=10"));
+  test_assert(!strstr(s, "created"));
+
+ done:
+  tor_free(s);
+}
+
+/** Check formatting of per-URL directory server statistics. */
+static void
+test_dir_endpoint_stats(void *arg)
+{
+  char *s = NULL;
+  (void)arg;
+
+  s = rep_hist_format_dir_endpoint_stats();
+  tt_str_op(s, ==, "");
+  tor_free(s);
+
+  rep_hist_note_dir_response("/tor/server/", 0, 1000, 3);
+  rep_hist_note_dir_response("/tor/server/", 0, 3000, 5);
+  rep_hist_note_dir_response("/tor/server/", 1, 500, 4);
+  rep_hist_note_dir_response("/tor/keys/", 1, 100, 0);
+  s = rep_hist_format_dir_endpoint_stats();
+  tt_str_op(s, ==,
+     "/tor/keys/ requests=1 bytes=100 compressed=1 compressed-bytes=100 "
+       "z-ratio=? count=1 mean-usec=0 buckets="
+       "1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0\n"
+     "/tor/server/ requests=3 bytes=4500 compressed=1 compressed-bytes=500 "
+       "z-ratio=0.250 count=3 mean-usec=4 buckets="
+       "0,1,2,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0\n");
+
+ done:
+  tor_free(s);
+}
+
+/** Check that the cell tracer samples cells and follows them through our
+ * queues. */
+static void
+test_cell_trace(void *arg)
+{
+  cell_t cell;
+  packed_cell_t queued1, queued2;
+  char *s = NULL;
+  const char *cp;
+  (void)arg;
+
+  memset(&cell, 0, sizeof(cell));
+  memset(&queued1, 0, sizeof(queued1));
+  memset(&queued2, 0, sizeof(queued2));
+  cell_trace_clear();
+
+  /* Tracing is off by default. */
+  cell_trace_note_read(&cell);
+  cell_trace_note_queued(&queued1);
+  cell_trace_done_processing();
+  test_eq(queued1.trace_id, 0);
+
+  get_options_mutable()->CellTraceSampleInterval = 2;
+  cell.circ_id = 5;
+  cell.command = CELL_RELAY;
+  /* Sampled: only the first cell we queue for it gets tagged. */
+  cell_trace_note_read(&cell);
+  cell_trace_note_queued(&queued1);
+  cell_trace_note_queued(&queued2);
+  cell_trace_done_processing();
+  test_eq(queued1.trace_id, 1);
+  test_eq(queued2.trace_id, 0);
+  /* Not sampled. */
+  cell_trace_note_read(&cell);
+  cell_trace_note_queued(&queued2);
+  cell_trace_done_processing();
+  test_eq(queued2.trace_id, 0);
+  /* Sampled, but never queued. */
+  cell.circ_id = 6;
+  cell_trace_note_read(&cell);
+  cell_trace_done_processing();
+
+  cell_trace_note_flushed(&queued1);
+  s = cell_trace_format();
+  test_assert(!strcmpstart(s, "id=1 circ=5 command=3 read="));
+  cp = strstr(s, " queued-usec=");
+  test_assert(cp);
+  test_assert(TOR_ISDIGIT(cp[strlen(" queued-usec=")]));
+  cp = strstr(s, " flushed-usec=");
+  test_assert(cp);
+  test_assert(TOR_ISDIGIT(cp[strlen(" flushed-usec=")]));
+  cp = strstr(s, "\nid=2 circ=6 command=3 read=");
+  test_assert(cp);
+  test_assert(!strcmpend(cp, " queued-usec=- flushed-usec=-\n"));
+
+ done:
+  get_options_mutable()->CellTraceSampleInterval = 0;
+  cell_trace_clear();
+  tor_free(s);
+}
+
+/** Check that the memory usage report has one line for each subsystem. */
+static void
+test_memory_usage_report(void *arg)
+{
+  static const char *prefixes[] = {
+    "buffers allocated=", "cell-queues cells=", "mempool/cells items=",
+    "mempool/buffer-chunks items=", "mempool/origin-circuits items=",
+    "mempool/or-circuits items=", "mempool/crypt-paths items=",
+    "memarea areas=", "routerlist descriptors=", "microdescs descriptors=",
+    "connections count=", "dns-cache entries=", "geoip-clients entries=",
+    "rend-cache entries=", "rephist routers=", NULL
+  };
+  smartlist_t *lines = smartlist_create();
+  char *s = NULL;
+  int i;
+  (void)arg;
+
+  s = format_memory_usage_report();
+  smartlist_split_string(lines, s, "\n", 0, 0);
+  for (i = 0; prefixes[i]; ++i) {
+    test_assert(i < smartlist_len(lines));
+    test_assert(!strcmpstart(smartlist_get(lines, i), prefixes[i]));
+  }
+  test_eq(smartlist_len(lines), i);
+
+ done:
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  tor_free(s);
+}
+
+/** Check that we estimate how quickly streams use up clean circuits. */
+static void
+test_clean_circ_demand(void *arg)
+{
+  time_t now = 1325376000; /* Start of a minute. */
+  double rate;
+  int i;
+  (void)arg;
+
+  test_assert(rep_hist_get_clean_circ_rate(now, 0) == 0.0);
+  for (i = 0; i < 60; ++i)
+    rep_hist_note_clean_circ_used(now + i, 0);
+  rep_hist_note_clean_circ_used(now, 1);
+  /* 60 circuits over a ten-minute window. */
+  rate = rep_hist_get_clean_circ_rate(now + 120, 0);
+  test_assert(rate > 0.0999 && rate < 0.1001);
+  test_assert(rep_hist_get_clean_circ_rate(now + 120, 1) > 0.0);
+  /* Demand ages out after ten minutes. */
+  test_assert(rep_hist_get_clean_circ_rate(now + 600, 0) == 0.0);
+  test_assert(rep_hist_get_clean_circ_rate(now + 600, 1) == 0.0);
+
+ done:
+  ;
+}
+
+/** Check that adaptive flow control times SENDMEs and grows windows. */
+static void
+test_flow_control(void *arg)
+{
+  flow_control_t fc;
+  int i;
+  (void)arg;
+
+  memset(&fc, 0, sizeof(fc));
+  test_eq(flow_control_deliver_target(&fc, STREAMWINDOW_START),
+          STREAMWINDOW_START);
+
+  /* We time the SENDME for the first full increment of cells. */
+  for (i = 0; i < STREAMWINDOW_INCREMENT; ++i)
+    flow_control_note_packaged(&fc, STREAMWINDOW_INCREMENT);
+  test_eq(fc.probe_cell, STREAMWINDOW_INCREMENT);
+  fc.probe_sent_at -= 200; /* Pretend we sent it 200 msec ago. */
+  flow_control_note_sendme(&fc, STREAMWINDOW_INCREMENT);
+  test_eq(fc.probe_cell, 0);
+  tt_int_op(fc.rtt_msec, >=, 200);
+  tt_int_op(fc.rtt_msec, <, 1000);
+
+  /* We only ask for a bigger window if we've been told to. */
+  test_eq(flow_control_should_request(&fc), 0);
+  get_options_mutable()->AdaptiveFlowControl = 1;
+  test_eq(flow_control_should_request(&fc), 1);
+  /* ... and no more than once per round trip. */
+  test_eq(flow_control_should_request(&fc), 0);
+
+  /* Grants double the window, up to the maximum. */
+  flow_control_grow(&fc, STREAMWINDOW_START, STREAMWINDOW_ADAPTIVE_MAX);
+  test_eq(flow_control_deliver_target(&fc, STREAMWINDOW_START),
+          2*STREAMWINDOW_START);
+  flow_control_grow(&fc, STREAMWINDOW_START, STREAMWINDOW_ADAPTIVE_MAX);
+  flow_control_grow(&fc, STREAMWINDOW_START, STREAMWINDOW_ADAPTIVE_MAX);
+  test_eq(flow_control_deliver_target(&fc, STREAMWINDOW_START),
+          STREAMWINDOW_ADAPTIVE_MAX);
+
+ done:
+  get_options_mutable()->AdaptiveFlowControl = 0;
+}
+
+/** Check that a replay cache catches repeats for as long as it should,
+ * forgets them after that, and stays within its size limit. */
+static void
+test_replaycache(void *arg)
+{
+  replaycache_t *rc = replaycache_new(100, 1000);
+  char d[DIGEST_LEN];
+  time_t now = 1000000, elapsed = -1;
+  int i;
+  (void)arg;
+
+  memset(d, 0, sizeof(d));
+  test_eq(replaycache_add_and_test(rc, d, now, &elapsed), 0);
+  test_eq(replaycache_add_and_test(rc, d, now+10, &elapsed), 1);
+  test_eq(elapsed, 10);
+  /* Still remembered one interval later, from the older generation... */
+  test_eq(replaycache_add_and_test(rc, d, now+150, &elapsed), 1);
+  test_eq(elapsed, 150);
+  /* ...but not two intervals later. */
+  test_eq(replaycache_add_and_test(rc, d, now+250, NULL), 0);
+  replaycache_free(rc);
+
+  /* Fill the current generation.  Since the older one is empty, we can
+   * start a new generation early. */
+  rc = replaycache_new(100, 1000);
+  for (i = 0; i < 1000; ++i) {
+    set_uint32(d, (uint32_t)i);
+    test_eq(replaycache_add_and_test(rc, d, now, NULL), 0);
+  }
+  test_eq(replaycache_size(rc), 1000);
+  set_uint32(d, 5000);
+  test_eq(replaycache_add_and_test(rc, d, now+1, NULL), 0);
+  for (i = 0; i < 1000; ++i) {
+    set_uint32(d, (uint32_t)i);
+    test_eq(replaycache_add_and_test(rc, d, now+1, NULL), 1);
+  }
+  for (i = 1; i < 1000; ++i) {
+    set_uint32(d, (uint32_t)(5000+i));
+    test_eq(replaycache_add_and_test(rc, d, now+1, NULL), 0);
+  }
+  /* Now both generations are full and recent: refuse new digests rather
+   * than forget recent ones. */
+  set_uint32(d, 9999);
+  test_eq(replaycache_add_and_test(rc, d, now+2, NULL), -1);
+  test_eq(replaycache_size(rc), 2000);
+  tt_int_op(replaycache_bytes_allocated(rc), <=, 2*2048*(DIGEST_LEN+4));
+  /* Once an interval has passed, there's room again. */
+  test_eq(replaycache_add_and_test(rc, d, now+101, NULL), 0);
+  set_uint32(d, 5);
+  test_eq(replaycache_add_and_test(rc, d, now+101, NULL), 0);
+
+ done:
+  replaycache_free(rc);
+}
+
+/** Check the per-connection circuit ID table through inserts, lookups,
+ * growth, and removals. */
+static void
+test_circid_table(void *arg)
+{
+  or_connection_t *conn = tor_malloc_zero(sizeof(or_connection_t));
+  circuit_t *circs[100];
+  int i;
+  (void)arg;
+
+  conn->_base.magic = OR_CONNECTION_MAGIC;
+  for (i = 0; i < 100; ++i) {
+    circs[i] = tor_malloc_zero(sizeof(circuit_t));
+    circs[i]->magic = ORIGIN_CIRCUIT_MAGIC;
+    /* Adjacent and colliding IDs, plus circuit ID 0. */
+    circuit_set_n_circid_orconn(circs[i], (circid_t)(i * 64), conn);
+  }
+  test_eq(conn->n_circuits, 100);
+  tt_int_op(conn->circid_table_size, >=, 200);
+  for (i = 0; i < 100; ++i)
+    test_eq_ptr(circuit_get_by_circid_orconn((circid_t)(i*64), conn),
+                circs[i]);
+  test_assert(!circuit_id_in_use_on_orconn(1, conn));
+
+  /* Remove every other circuit; the rest must still be reachable. */
+  for (i = 0; i < 100; i += 2)
+    circuit_set_n_circid_orconn(circs[i], 0, NULL);
+  test_eq(conn->n_circuits, 50);
+  for (i = 0; i < 100; ++i) {
+    if (i % 2)
+      test_eq_ptr(circuit_get_by_circid_orconn((circid_t)(i*64), conn),
+                  circs[i]);
+    else
+      test_assert(!circuit_id_in_use_on_orconn((circid_t)(i*64), conn));
+  }
+
+  /* Changing a circuit's ID moves its entry. */
+  circuit_set_n_circid_orconn(circs[1], 7, conn);
+  test_eq_ptr(circuit_get_by_circid_orconn(7, conn), circs[1]);
+  test_assert(!circuit_id_in_use_on_orconn(64, conn));
+
+  for (i = 1; i < 100; i += 2)
+    circuit_set_n_circid_orconn(circs[i], 0, NULL);
+  test_eq(conn->n_circuits, 0);
+  test_eq(conn->circid_table_size, 0);
+
+ done:
+  for (i = 0; i < 100; ++i)
+    tor_free(circs[i]);
+  circuit_free_circid_table(conn);
+  tor_free(conn);
+}
+
+/** Check that circuit_find_to_cannibalize() finds clean circuits through
+ * its bucketed index, and drops circuits that can no longer be used. */
+static void
+test_cannibalize_index(void *arg)
+{
+  origin_circuit_t *circs[3];
+  int i;
+  (void)arg;
+
+  for (i = 0; i < 3; ++i) {
+    circs[i] = tor_malloc_zero(sizeof(origin_circuit_t));
+    circs[i]->_base.magic = ORIGIN_CIRCUIT_MAGIC;
+    circs[i]->_base.purpose = CIRCUIT_PURPOSE_C_GENERAL;
+    circs[i]->_base.state = CIRCUIT_STATE_BUILDING;
+    circs[i]->remaining_relay_early_cells = 7;
+    circs[i]->build_state = tor_malloc_zero(sizeof(cpath_build_state_t));
+  }
+  circs[0]->build_state->need_uptime = 1;
+  circs[2]->build_state->is_internal = 1;
+  for (i = 0; i < 3; ++i)
+    circuit_set_state(TO_CIRCUIT(circs[i]), CIRCUIT_STATE_OPEN);
+
+  /* Prefer a circuit without uptime when we don't need it. */
+  test_eq_ptr(circuit_find_to_cannibalize(CIRCUIT_PURPOSE_C_GENERAL, NULL, 0),
+              circs[1]);
+  test_eq_ptr(circuit_find_to_cannibalize(CIRCUIT_PURPOSE_C_GENERAL, NULL,
+                                          CIRCLAUNCH_NEED_UPTIME), circs[0]);
+  test_eq_ptr(circuit_find_to_cannibalize(CIRCUIT_PURPOSE_C_GENERAL, NULL,
+                                          CIRCLAUNCH_IS_INTERNAL), circs[2]);
+  test_eq_ptr(circuit_find_to_cannibalize(CIRCUIT_PURPOSE_C_GENERAL, NULL,
+                                          CIRCLAUNCH_NEED_CAPACITY), NULL);
+
+  /* Dirty circuits fall out of the index; isolated ones are just skipped. */
+  circs[1]->_base.timestamp_dirty = time(NULL);
+  test_eq_ptr(circuit_find_to_cannibalize(CIRCUIT_PURPOSE_C_GENERAL, NULL, 0),
+              circs[0]);
+  test_assert(!circs[1]->in_cannibalize_index);
+  circs[0]->isolation_values_set = 1;
+  test_eq_ptr(circuit_find_to_cannibalize(CIRCUIT_PURPOSE_C_GENERAL, NULL, 0),
+              NULL);
+  test_assert(circs[0]->in_cannibalize_index);
+
+  /* Leaving the open state unindexes a circuit. */
+  circuit_set_state(TO_CIRCUIT(circs[2]), CIRCUIT_STATE_BUILDING);
+  test_assert(!circs[2]->in_cannibalize_index);
+  test_eq_ptr(circuit_find_to_cannibalize(CIRCUIT_PURPOSE_C_GENERAL, NULL,
+                                          CIRCLAUNCH_IS_INTERNAL), NULL);
+
+ done:
+  for (i = 0; i < 3; ++i) {
+    circuit_set_state(TO_CIRCUIT(circs[i]), CIRCUIT_STATE_BUILDING);
+    tor_free(circs[i]->build_state);
+    tor_free(circs[i]);
+  }
+}
+
+/** Check that first-hop circuits come out of the idle check queue in
+ * order once they're due, and that rescheduling moves them. */
+static void
+test_idle_check_queue(void *arg)
+{
+  or_circuit_t *circs[3];
+  int i;
+  (void)arg;
+
+  for (i = 0; i < 3; ++i) {
+    circs[i] = tor_malloc_zero(sizeof(or_circuit_t));
+    circs[i]->_base.magic = OR_CIRCUIT_MAGIC;
+    circs[i]->idle_check_idx = -1;
+  }
+  circuit_schedule_idle_check(circs[0], 300);
+  circuit_schedule_idle_check(circs[1], 100);
+  circuit_schedule_idle_check(circs[2], 200);
+
+  test_eq_ptr(circuit_pop_due_idle_check(99), NULL);
+  test_eq_ptr(circuit_pop_due_idle_check(100), circs[1]);
+  test_eq(circs[1]->idle_check_idx, -1);
+  test_eq_ptr(circuit_pop_due_idle_check(100), NULL);
+
+  /* Pushing a check back reorders the queue. */
+  circuit_schedule_idle_check(circs[2], 400);
+  test_eq_ptr(circuit_pop_due_idle_check(350), circs[0]);
+  test_eq_ptr(circuit_pop_due_idle_check(350), NULL);
+  test_eq_ptr(circuit_pop_due_idle_check(1000), circs[2]);
+  test_eq_ptr(circuit_pop_due_idle_check(1000), NULL);
+
+ done:
+  while (circuit_pop_due_idle_check(TIME_MAX))
+    ;
+  for (i = 0; i < 3; ++i)
+    tor_free(circs[i]);
+}
+
+/** Check that we find configured bridges by identity and by address and
+ * port, including after we learn an identity or sweep the list. */
+static void
+test_bridge_index(void *arg)
+{
+  tor_addr_t a, b, c;
+  const transport_t *t = NULL;
+  char id1[DIGEST_LEN], id2[DIGEST_LEN];
+  (void)arg;
+
+  memset(id1, 1, sizeof(id1));
+  memset(id2, 2, sizeof(id2));
+  tor_addr_parse(&a, "10.0.0.1");
+  tor_addr_parse(&b, "10.0.0.2");
+  tor_addr_parse(&c, "10.0.0.3");
+
+  /* None of these transports exist, so a matching bridge makes
+   * find_transport_by_bridge_addrport() fail. */
+  bridge_add_from_config(&a, 443, NULL, "nosuch1");
+  bridge_add_from_config(&b, 443, id1, "nosuch2");
+  test_eq(find_transport_by_bridge_addrport(&a, 443, &t), -1);
+  test_eq(find_transport_by_bridge_addrport(&a, 444, &t), 0);
+  test_eq(find_transport_by_bridge_addrport(&b, 443, &t), -1);
+  test_eq(find_transport_by_bridge_addrport(&c, 443, &t), 0);
+
+  /* Once we learn its identity, the first bridge is found by identity
+   * from any address, and no longer by its bare address. */
+  learned_router_identity(&a, 443, id2);
+  bridge_add_from_config(&c, 443, id2, "nosuch3");
+  test_eq(find_transport_by_bridge_addrport(&c, 443, &t), 0);
+  bridge_add_from_config(&a, 443, NULL, NULL);
+  test_eq(find_transport_by_bridge_addrport(&a, 443, &t), -1);
+
+  /* Sweeping drops exactly the bridges we didn't re-add. */
+  mark_bridge_list();
+  bridge_add_from_config(&b, 443, id1, "nosuch2");
+  bridge_add_from_config(&a, 443, NULL, NULL);
+  sweep_bridge_list();
+  test_eq(find_transport_by_bridge_addrport(&b, 443, &t), -1);
+  test_eq(find_transport_by_bridge_addrport(&a, 443, &t), 0);
+  bridge_add_from_config(&c, 443, id2, "nosuch3");
+  test_eq(find_transport_by_bridge_addrport(&c, 443, &t), -1);
+
+ done:
+  mark_bridge_list();
+  sweep_bridge_list();
+}
+
+/** Check that streams waiting for a circuit are filed in the right
+ * pending-stream buckets, and that removing one keeps the others findable. */
+static void
+test_pending_stream_index(void *arg)
+{
+  entry_connection_t *conns[4];
+  int i;
+  (void)arg;
+
+  for (i = 0; i < 4; ++i) {
+    conns[i] = tor_malloc_zero(sizeof(entry_connection_t));
+    conns[i]->socks_request = socks_request_new();
+    conns[i]->socks_request->command = SOCKS_COMMAND_CONNECT;
+    conns[i]->socks_request->port = 80;
+    ENTRY_TO_CONN(conns[i])->state = AP_CONN_STATE_CIRCUIT_WAIT;
+  }
+  conns[2]->socks_request->port = 443;
+  conns[3]->want_onehop = 1;
+  for (i = 0; i < 4; ++i)
+    connection_ap_mark_as_pending_circuit(conns[i]);
+
+  test_assert(conns[0]->pending_bucket);
+  test_eq_ptr(conns[0]->pending_bucket, conns[1]->pending_bucket);
+  test_neq_ptr(conns[0]->pending_bucket, conns[2]->pending_bucket);
+  test_neq_ptr(conns[0]->pending_bucket, conns[3]->pending_bucket);
+  test_eq(smartlist_len(conns[0]->pending_bucket), 2);
+
+  /* Re-marking is harmless; a changed port moves the stream. */
+  connection_ap_mark_as_pending_circuit(conns[1]);
+  test_eq(smartlist_len(conns[1]->pending_bucket), 2);
+  conns[0]->socks_request->port = 443;
+  connection_ap_mark_as_pending_circuit(conns[0]);
+  test_eq_ptr(conns[0]->pending_bucket, conns[2]->pending_bucket);
+  test_eq(smartlist_len(conns[1]->pending_bucket), 1);
+  test_eq_ptr(smartlist_get(conns[1]->pending_bucket,
+                            conns[1]->pending_bucket_idx), conns[1]);
+
+  /* Removing a stream keeps the positions of the others accurate. */
+  connection_ap_forget_pending(conns[2]);
+  test_assert(!conns[2]->pending_bucket);
+  test_eq_ptr(smartlist_get(conns[0]->pending_bucket,
+                            conns[0]->pending_bucket_idx), conns[0]);
+  connection_ap_forget_pending(conns[2]);
+
+ done:
+  for (i = 0; i < 4; ++i) {
+    connection_ap_forget_pending(conns[i]);
+    socks_request_free(conns[i]->socks_request);
+    tor_free(conns[i]);
+  }
+  connection_ap_pending_free_all();
+}
+
+/** Check the per-port policy for sending optimistic data. */
+static void
+test_optimistic_data_ports(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  smartlist_t *allow = smartlist_create(), *deny = smartlist_create();
+  smartlist_t *old_allow = options->OptimisticDataPorts;
+  smartlist_t *old_deny = options->NoOptimisticDataPorts;
+  (void)arg;
+
+  options->OptimisticDataPorts = allow;
+  options->NoOptimisticDataPorts = deny;
+  test_assert(optimistic_data_allowed_for_port(80));
+  test_assert(optimistic_data_allowed_for_port(22));
+
+  smartlist_add(deny, tor_strdup("22"));
+  test_assert(optimistic_data_allowed_for_port(80));
+  test_assert(!optimistic_data_allowed_for_port(22));
+
+  /* An allow list restricts us to its ports; the deny list still wins. */
+  smartlist_add(allow, tor_strdup("80"));
+  smartlist_add(allow, tor_strdup("22"));
+  test_assert(optimistic_data_allowed_for_port(80));
+  test_assert(!optimistic_data_allowed_for_port(443));
+  test_assert(!optimistic_data_allowed_for_port(22));
+
+ done:
+  options->OptimisticDataPorts = old_allow;
+  options->NoOptimisticDataPorts = old_deny;
+  SMARTLIST_FOREACH(allow, char *, cp, tor_free(cp));
+  SMARTLIST_FOREACH(deny, char *, cp, tor_free(cp));
+  smartlist_free(allow);
+  smartlist_free(deny);
+}
+
+/** Check the exit-side cache of destinations that refused us. */
+static void
+test_exit_connect_failures(void *arg)
+{
+  tor_addr_t addr;
+  time_t now = time(NULL);
+  (void)arg;
+
+  tor_addr_from_ipv4h(&addr, 0x01020304);
+  /* Disabled by default. */
+  connection_exit_note_connect_failed(&addr, 80,
+                                      END_STREAM_REASON_CONNECTREFUSED);
+  test_eq(connection_exit_connect_recently_failed(&addr, 80, now), 0);
+
+  get_options_mutable()->ExitConnectFailureCacheTime = 30;
+  connection_exit_note_connect_failed(&addr, 80,
+                                      END_STREAM_REASON_CONNECTREFUSED);
+  connection_exit_note_connect_failed(&addr, 443, END_STREAM_REASON_TIMEOUT);
+  test_eq(connection_exit_connect_recently_failed(&addr, 80, now),
+          END_STREAM_REASON_CONNECTREFUSED);
+  test_eq(connection_exit_connect_recently_failed(&addr, 443, now), 0);
+  test_eq(connection_exit_connect_recently_failed(&addr, 22, now), 0);
+  /* Entries expire. */
+  test_eq(connection_exit_connect_recently_failed(&addr, 80, now+60), 0);
+  test_eq(connection_exit_connect_recently_failed(&addr, 80, now), 0);
+
+ done:
+  get_options_mutable()->ExitConnectFailureCacheTime = 0;
+  connection_exit_connect_failures_free_all();
+}
+
+/** Check the indexes behind rendezvous and introduction circuit lookups. */
+static void
+test_rend_circ_index(void *arg)
+{
+  or_circuit_t *or1 = tor_malloc_zero(sizeof(or_circuit_t));
+  or_circuit_t *or2 = tor_malloc_zero(sizeof(or_circuit_t));
+  origin_circuit_t *oc1 = tor_malloc_zero(sizeof(origin_circuit_t));
+  origin_circuit_t *oc2 = tor_malloc_zero(sizeof(origin_circuit_t));
+  rend_data_t *rd;
+  char token[DIGEST_LEN];
+  (void)arg;
+
+  or1->_base.magic = or2->_base.magic = OR_CIRCUIT_MAGIC;
+  memset(token, 'x', sizeof(token));
+  or1->_base.purpose = CIRCUIT_PURPOSE_REND_POINT_WAITING;
+  circuit_set_rendezvous_cookie(or1, token);
+  test_eq_ptr(circuit_get_rendezvous(token), or1);
+  /* Cookies and intro digests live in separate indexes. */
+  test_eq_ptr(circuit_get_intro_point(token), NULL);
+  or2->_base.purpose = CIRCUIT_PURPOSE_INTRO_POINT;
+  circuit_set_intro_point_digest(or2, token);
+  test_eq_ptr(circuit_get_intro_point(token), or2);
+  test_eq_ptr(circuit_get_rendezvous(token), or1);
+  /* A purpose change hides the circuit; clearing unindexes it. */
+  or1->_base.purpose = CIRCUIT_PURPOSE_REND_ESTABLISHED;
+  test_eq_ptr(circuit_get_rendezvous(token), NULL);
+  circuit_clear_rend_token(or1);
+  test_assert(tor_digest_is_zero(or1->rend_token));
+  circuit_clear_rend_token(or2);
+  test_eq_ptr(circuit_get_intro_point(token), NULL);
+
+  oc1->_base.magic = oc2->_base.magic = ORIGIN_CIRCUIT_MAGIC;
+  oc1->_base.purpose = oc2->_base.purpose = CIRCUIT_PURPOSE_S_INTRO;
+  rd = tor_malloc_zero(sizeof(rend_data_t));
+  strlcpy(rd->onion_address, "abcdefghijklmnop", sizeof(rd->onion_address));
+  memcpy(rd->rend_pk_digest, token, DIGEST_LEN);
+  circuit_set_rend_data(oc1, rd);
+  circuit_set_rend_data(oc2, rend_data_dup(rd));
+  test_eq_ptr(circuit_get_by_rend_query_and_purpose("ABCDEFGHIJKLMNOP",
+                                       CIRCUIT_PURPOSE_S_INTRO), oc1);
+  test_eq_ptr(circuit_get_by_rend_query_and_purpose("abcdefghijklmnop",
+                                       CIRCUIT_PURPOSE_C_REND_READY), NULL);
+  test_eq_ptr(circuit_get_next_by_pk_and_purpose(NULL, token,
+                                       CIRCUIT_PURPOSE_S_INTRO), oc1);
+  test_eq_ptr(circuit_get_next_by_pk_and_purpose(oc1, token,
+                                       CIRCUIT_PURPOSE_S_INTRO), oc2);
+  test_eq_ptr(circuit_get_next_by_pk_and_purpose(oc2, token,
+                                       CIRCUIT_PURPOSE_S_INTRO), NULL);
+  circuit_set_rend_data(oc1, NULL);
+  test_eq_ptr(circuit_get_next_by_pk_and_purpose(NULL, token,
+                                       CIRCUIT_PURPOSE_S_INTRO), oc2);
+
+ done:
+  circuit_clear_rend_token(or1);
+  circuit_clear_rend_token(or2);
+  circuit_set_rend_data(oc1, NULL);
+  circuit_set_rend_data(oc2, NULL);
+  tor_free(or1);
+  tor_free(or2);
+  tor_free(oc1);
+  tor_free(oc2);
+}
+
+/** Check parsing of BandwidthClassWeights. */
+static void
+test_bw_class_weights(void *arg)
+{
+  smartlist_t *sl = smartlist_create();
+  int weights[N_BANDWIDTH_CLASSES];
+  char *msg = NULL;
+  (void)arg;
+
+  smartlist_split_string(sl, "dir=1,interactive=3,relay=6", ",", 0, 0);
+  test_eq(0, connection_bucket_parse_class_weights(sl, weights, &msg));
+  test_eq(weights[BW_CLASS_RELAY], 6);
+  test_eq(weights[BW_CLASS_DIR], 1);
+  test_eq(weights[BW_CLASS_EXIT], 0);
+  test_eq(weights[BW_CLASS_INTERACTIVE], 3);
+  SMARTLIST_FOREACH(sl, char *, cp, tor_free(cp));
+  smartlist_clear(sl);
+
+  smartlist_split_string(sl, "dirs=1", ",", 0, 0);
+  test_eq(-1, connection_bucket_parse_class_weights(sl, NULL, &msg));
+  test_assert(msg);
+  tor_free(msg);
+  SMARTLIST_FOREACH(sl, char *, cp, tor_free(cp));
+  smartlist_clear(sl);
+
+  smartlist_split_string(sl, "dir=0,exit=0", ",", 0, 0);
+  test_eq(-1, connection_bucket_parse_class_weights(sl, NULL, &msg));
+  tor_free(msg);
+  SMARTLIST_FOREACH(sl, char *, cp, tor_free(cp));
+  smartlist_clear(sl);
+
+  smartlist_split_string(sl, "exit", ",", 0, 0);
+  test_eq(-1, connection_bucket_parse_class_weights(sl, NULL, &msg));
+
+ done:
+  tor_free(msg);
+  SMARTLIST_FOREACH(sl, char *, cp, tor_free(cp));
+  smartlist_free(sl);
+}
+
+/** Helper: run the TLS handshake between <b>client</b> and <b>server</b>,
+ * which are on opposite ends of a socketpair, to completion.  Return 0 on
+ * success, -1 on failure. */
+static int
+tls_handshake_pair(tor_tls_t *client, tor_tls_t *server)
+{
+  int i, c_done = 0, s_done = 0;
+  for (i = 0; i < 100 && !(c_done && s_done); ++i) {
+    int r;
+    if (!c_done) {
+      r = tor_tls_handshake(client);
+      if (r == TOR_TLS_DONE)
+        c_done = 1;
+      else if (r != TOR_TLS_WANTREAD && r != TOR_TLS_WANTWRITE)
+        return -1;
+    }
+    if (!s_done) {
+      r = tor_tls_handshake(server);
+      if (r == TOR_TLS_DONE)
+        s_done = 1;
+      else if (r != TOR_TLS_WANTREAD && r != TOR_TLS_WANTWRITE)
+        return -1;
+    }
+  }
+  return (c_done && s_done) ? 0 : -1;
+}
+
+/** Check that with TLSSessionCache on, reconnecting to a peer resumes the
+ * TLS session from our last connection to it, and that rotating our link
+ * keys forgets it. */
+static void
+test_tls_session_resumption(void *arg)
+{
+  crypto_pk_env_t *id = NULL;
+  tor_tls_t *client = NULL, *server = NULL;
+  int fds[2] = { -1, -1 };
+  const char peer_id[DIGEST_LEN] = "this is a peer id!!";
+  int round;
+  (void)arg;
+
+  tor_tls_set_session_cache(1);
+  id = pk_generate(0);
+  tt_int_op(0, ==, tor_tls_context_init(1, NULL, id, 3600));
+
+  for (round = 0; round < 4; ++round) {
+    if (round == 3)
+      tt_int_op(0, ==, tor_tls_context_init(1, NULL, id, 3600));
+    tt_int_op(0, ==, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    set_socket_nonblocking(fds[0]);
+    set_socket_nonblocking(fds[1]);
+    client = tor_tls_new(fds[0], 0);
+    server = tor_tls_new(fds[1], 1);
+    tt_assert(client && server);
+    /* Only the second and third connections have a session to offer. */
+    tt_int_op(round == 1 || round == 2, ==,
+              tor_tls_resume_session(client, peer_id));
+    tt_int_op(0, ==, tls_handshake_pair(client, server));
+    tt_int_op(round == 1 || round == 2, ==,
+              tor_tls_session_was_resumed(client));
+    tt_int_op(round == 1 || round == 2, ==,
+              tor_tls_session_was_resumed(server));
+    if (round != 1)
+      tor_tls_remember_session(client, peer_id);
+    tor_tls_free(client);
+    tor_tls_free(server);
+    client = server = NULL;
+    tor_close_socket(fds[0]);
+    tor_close_socket(fds[1]);
+    fds[0] = fds[1] = -1;
+  }
+
+ done:
+  tor_tls_free(client);
+  tor_tls_free(server);
+  if (fds[0] >= 0)
+    tor_close_socket(fds[0]);
+  if (fds[1] >= 0)
+    tor_close_socket(fds[1]);
+  if (id)
+    crypto_free_pk_env(id);
+  tor_tls_free_all();
+}
+
+/** Check that with CoalesceTLSWrites set, data spread over many small
+ * buffer chunks still comes out the other end of a TLS connection intact,
+ * including when the socket fills up partway through. */
+static void
+test_buffer_tls_coalesce(void *arg)
+{
+  crypto_pk_env_t *id = NULL;
+  tor_tls_t *client = NULL, *server = NULL;
+  buf_t *buf = NULL, *buf2 = NULL;
+  int fds[2] = { -1, -1 };
+  char b[1000], b2[1000];
+  size_t flushlen;
+  int i, r, n_rounds = 0;
+  (void)arg;
+
+  get_options_mutable()->CoalesceTLSWrites = 1;
+  id = pk_generate(0);
+  tt_int_op(0, ==, tor_tls_context_init(1, NULL, id, 3600));
+  tt_int_op(0, ==, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  set_socket_nonblocking(fds[0]);
+  set_socket_nonblocking(fds[1]);
+  client = tor_tls_new(fds[0], 0);
+  server = tor_tls_new(fds[1], 1);
+  tt_assert(client && server);
+  tt_int_op(0, ==, tls_handshake_pair(client, server));
+
+  for (i = 0; i < (int)sizeof(b); ++i)
+    b[i] = (char)(i*13);
+  buf = buf_new_with_capacity(1024);
+  buf2 = buf_new();
+  for (i = 0; i < 300; ++i)
+    write_to_buf(b, sizeof(b), buf);
+  flushlen = buf_datalen(buf);
+
+  while (buf_datalen(buf2) < 300*sizeof(b)) {
+    tt_int_op(++n_rounds, <, 10000);
+    if (flushlen || tor_tls_get_forced_write_size(client)) {
+      r = flush_buf_tls(client, buf, flushlen, &flushlen);
+      tt_assert(r >= 0 || r == TOR_TLS_WANTWRITE);
+      assert_buf_ok(buf);
+    }
+    r = read_to_buf_tls(server, 20000, buf2);
+    tt_assert(r >= 0 || r == TOR_TLS_WANTREAD);
+  }
+  tt_int_op(buf_datalen(buf), ==, 0);
+  for (i = 0; i < 300; ++i) {
+    fetch_from_buf(b2, sizeof(b2), buf2);
+    test_memeq(b, b2, sizeof(b));
+  }
+
+ done:
+  get_options_mutable()->CoalesceTLSWrites = 0;
+  buf_free(buf);
+  buf_free(buf2);
+  tor_tls_free(client);
+  tor_tls_free(server);
+  if (fds[0] >= 0)
+    tor_close_socket(fds[0]);
+  if (fds[1] >= 0)
+    tor_close_socket(fds[1]);
+  if (id)
+    crypto_free_pk_env(id);
+  tor_tls_free_all();
+}
+
+/** Check that server-side onion handshakes use pregenerated DH keypairs
+ * when there are some, and still work once the pool runs dry. */
+static void
+test_onion_dh_pool(void *arg)
+{
+  crypto_dh_env_t *c_dh = NULL;
+  crypto_pk_env_t *pk = NULL;
+  char c_buf[ONIONSKIN_CHALLENGE_LEN], s_buf[ONIONSKIN_REPLY_LEN];
+  char c_keys[40], s_keys[40];
+  int i;
+  (void)arg;
+
+  /* Without a pool, there's nothing to fill. */
+  tt_int_op(0, ==, onion_dh_pool_fill_one());
+  tt_int_op(0, ==, onion_dh_pool_len());
+
+  onion_dh_pool_init();
+  tt_int_op(1, ==, onion_dh_pool_fill_one());
+  tt_int_op(1, ==, onion_dh_pool_fill_one());
+  tt_int_op(2, ==, onion_dh_pool_len());
+  tt_assert(!onion_dh_pool_is_full());
+
+  pk = pk_generate(0);
+  for (i = 0; i < 3; ++i) {
+    tt_int_op(0, ==, onion_skin_create(pk, &c_dh, c_buf));
+    tt_int_op(0, ==, onion_skin_server_handshake(c_buf, pk, NULL,
+                                                 s_buf, s_keys, 40));
+    tt_int_op(0, ==, onion_skin_client_handshake(c_dh, s_buf, c_keys, 40));
+    test_memeq(c_keys, s_keys, 40);
+    crypto_dh_free(c_dh);
+    c_dh = NULL;
+    tt_int_op(i < 2 ? 1-i : 0, ==, onion_dh_pool_len());
+  }
+
+ done:
+  if (c_dh)
+    crypto_dh_free(c_dh);
+  if (pk)
+    crypto_free_pk_env(pk);
+  onion_dh_pool_free_all();
+}
+
+/** Check that the pending onion queue serves OR connections round-robin,
+ * and that removing a circuit from the middle works. */
+static void
+test_onion_queue_fairness(void *arg)
+{
+  or_connection_t conns[3];
+  or_circuit_t circs[6];
+  /* Circuits 0, 1, 2 come from conn 0; 3 from conn 1; 4 and 5 from
+   * conn 2. */
+  static const int circ_conn[6] = { 0, 0, 0, 1, 2, 2 };
+  static const int expected[4] = { 0, 3, 4, 1 };
+  const onion_handshake_t *tap = onion_handshake_by_create_cell(CELL_CREATE);
+  const onion_handshake_t *hs = NULL;
+  char *onionskin = NULL;
+  int i;
+  (void)arg;
+
+  /* Only create cells that carry a handshake map to one. */
+  tt_assert(tap);
+  tt_int_op(tap->created_cell_type, ==, CELL_CREATED);
+  tt_assert(tap->use_cpuworker);
+  hs = onion_handshake_by_create_cell(CELL_CREATE_FAST);
+  tt_assert(hs);
+  tt_int_op(hs->created_cell_type, ==, CELL_CREATED_FAST);
+  tt_assert(hs->first_hop_only);
+  tt_ptr_op(onion_handshake_by_create_cell(CELL_RELAY), ==, NULL);
+  hs = NULL;
+
+  memset(conns, 0, sizeof(conns));
+  memset(circs, 0, sizeof(circs));
+  for (i = 0; i < 3; ++i)
+    conns[i]._base.global_identifier = 1000 + i;
+  for (i = 0; i < 6; ++i) {
+    circs[i].p_conn = &conns[circ_conn[i]];
+    circs[i].p_circ_id = i;
+    tt_int_op(0, ==, onion_pending_add(&circs[i], tap,
+                                           tor_strdup("skin")));
+    tt_assert(circs[i].onionqueue_entry);
+  }
+
+  /* Pull conn 2's second circuit out of the middle of the queue. */
+  onion_pending_remove(&circs[5]);
+  tt_assert(!circs[5].onionqueue_entry);
+
+  for (i = 0; i < 4; ++i) {
+    tt_ptr_op(onion_next_task(&hs, &onionskin), ==, &circs[expected[i]]);
+    tt_ptr_op(hs, ==, tap);
+    tt_str_op(onionskin, ==, "skin");
+    tt_assert(!circs[expected[i]].onionqueue_entry);
+    tor_free(onionskin);
+  }
+  tt_ptr_op(onion_next_task(&hs, &onionskin), ==, &circs[2]);
+  tor_free(onionskin);
+  tt_ptr_op(onion_next_task(&hs, &onionskin), ==, NULL);
+
+ done:
+  tor_free(onionskin);
+  clear_pending_onions();
+}
+
 /** Run unit tests for buffers.c */
 static void
 test_buffers(void)
@@ -783,6 +2018,46 @@ test_buffers(void)
   buf_free(buf2);
   buf = buf2 = NULL;
 
+  /* Move whole chunks from buf to buf, with a partial chunk at the end. */
+  buf = buf_new_with_capacity(4096);
+  buf2 = buf_new_with_capacity(4096);
+  write_to_buf(str, 100, buf2);
+  for (j=0;j<200;++j)
+    write_to_buf(str, 255, buf);
+  test_eq(buf_datalen(buf), 51000);
+  r = 50000;
+  test_eq(move_buf_to_buf(buf2, buf, &r), 50000);
+  test_eq(r, 0);
+  assert_buf_ok(buf);
+  assert_buf_ok(buf2);
+  test_eq(buf_datalen(buf), 1000);
+  test_eq(buf_datalen(buf2), 50100);
+  fetch_from_buf(str2, 100, buf2);
+  test_memeq(str2, str, 100);
+  for (j=0;j<196;++j) {
+    fetch_from_buf(str2, 255, buf2);
+    test_memeq(str2, str, 255);
+  }
+  fetch_from_buf(str2, 20, buf2);
+  test_memeq(str2, str, 20);
+  test_eq(buf_datalen(buf2), 0);
+  fetch_from_buf(str2, 235, buf);
+  test_memeq(str2, str+20, 235);
+  r = 5000;
+  test_eq(move_buf_to_buf(buf2, buf, &r), 765);
+  test_eq(r, 4235);
+  assert_buf_ok(buf);
+  assert_buf_ok(buf2);
+  test_eq(buf_datalen(buf), 0);
+  test_eq(buf_datalen(buf2), 765);
+  for (j=0;j<3;++j) {
+    fetch_from_buf(str2, 255, buf2);
+    test_memeq(str2, str, 255);
+  }
+  buf_free(buf);
+  buf_free(buf2);
+  buf = buf2 = NULL;
+
   buf = buf_new_with_capacity(5);
   cp = "Testing. This is a moderately long Testing string.";
   for (j = 0; cp[j]; j++)
@@ -800,6 +2075,29 @@ test_buffers(void)
   buf_free(buf);
   buf = NULL;
 
+  /* Peek at contiguous data, both within a chunk and across chunks. */
+  buf = buf_new_with_capacity(16);
+  for (j=0;j<32;++j)
+    write_to_buf(str+(j%16)*16, 16, buf);
+  memset(str2, 0, sizeof(str2));
+  cp = buf_peek_contiguous(buf, 200, str2);
+  test_assert(cp != str2);
+  test_memeq(cp, str, 200);
+  buf_drain(buf, 200);
+  test_eq(buf_datalen(buf), 312);
+  /* This one straddles at least two chunks. */
+  cp = buf_peek_contiguous(buf, 100, str2);
+  test_assert(cp == str2);
+  test_memeq(str2, str+200, 56);
+  test_memeq(str2+56, str, 44);
+  test_eq(buf_datalen(buf), 312);
+  buf_drain(buf, 100);
+  fetch_from_buf(str2, 10, buf);
+  test_memeq(str2, str+44, 10);
+  assert_buf_ok(buf);
+  buf_free(buf);
+  buf = NULL;
+
  done:
   if (buf)
     buf_free(buf);
@@ -909,6 +2207,20 @@ test_circuit_timeout(void)
 
   test_assert(estimate.total_build_times <= CBT_NCIRCUITS_TO_OBSERVE);
 
+  /* The incrementally kept histogram must agree with the raw times. */
+  {
+    int abandoned = 0, counted = 0;
+    build_time_t bin;
+    for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++) {
+      if (estimate.circuit_build_times[i] == CBT_BUILD_ABANDONED)
+        abandoned++;
+    }
+    for (bin = 0; bin < estimate.histogram_len; bin++)
+      counted += estimate.histogram[bin];
+    test_eq(abandoned, estimate.abandoned_count);
+    test_eq(counted + abandoned, estimate.total_build_times);
+  }
+
   circuit_build_times_update_state(&estimate, &state);
   test_assert(circuit_build_times_parse_state(&final, &state) == 0);
 
@@ -1013,7 +2325,8 @@ test_policy_summary_helper(const char *policy_str,
   smartlist_t *policy = smartlist_create();
   char *summary = NULL;
   int r;
-  short_policy_t *short_policy = NULL;
+  short_policy_t *short_policy = NULL, *short_policy2 = NULL;
+  int port;
 
   line.key = (char*)"foo";
   line.value = (char *)policy_str;
@@ -1029,11 +2342,29 @@ test_policy_summary_helper(const char *policy_str,
   short_policy = parse_short_policy(summary);
   tt_assert(short_policy);
 
+  /* The port index must agree with the summary's port ranges. */
+  for (port = 1; port <= 65535; ++port) {
+    int i, in_range = 0;
+    for (i = 0; i < short_policy->n_entries; ++i) {
+      if (short_policy->entries[i].min_port <= port &&
+          port <= short_policy->entries[i].max_port)
+        in_range = 1;
+    }
+    test_eq(in_range == (int)short_policy->is_accept ?
+              ADDR_POLICY_PROBABLY_ACCEPTED : ADDR_POLICY_REJECTED,
+            compare_tor_addr_to_short_policy(NULL, port, short_policy));
+  }
+
+  /* Identical summaries are shared. */
+  short_policy2 = parse_short_policy(summary);
+  test_eq_ptr(short_policy, short_policy2);
+
  done:
   tor_free(summary);
   if (policy)
     addr_policy_list_free(policy);
   short_policy_free(short_policy);
+  short_policy_free(short_policy2);
 }
 
 /** Run unit tests for generating summary lines of exit policies */
@@ -1152,6 +2483,46 @@ test_policies(void)
   test_assert(policy_is_reject_star(policy));
   test_assert(policy_is_reject_star(NULL));
 
+  /* compiled policies must agree with the linear scan. */
+  {
+    smartlist_t *policies[4];
+    static const uint32_t test_addrs[] = {
+      0x00000000u, 0x00ffffffu, 0x01000000u, 0x0a000001u, 0x0affffffu,
+      0x0b000000u, 0x2b030000u, 0x2b7fffffu, 0x2b800000u, 0x50befa59u,
+      0x50befa5au, 0x50befa5bu, 0x7f000001u, 0xa9fe0102u, 0xac100000u,
+      0xac1fffffu, 0xc0a80102u, 0xc0a90000u, 0xfffffffeu, 0xffffffffu,
+    };
+    static const uint16_t test_ports[] = {
+      1, 2, 22, 25, 79, 80, 81, 119, 443, 6667, 65534, 65535,
+    };
+    int j, k;
+    policies[0] = policy;
+    policies[1] = policy2;
+    policies[2] = policy5;
+    policies[3] = policy6;
+    for (i = 0; i < 4; ++i) {
+      compiled_policy_t *cp = compiled_policy_get(policies[i]);
+      compiled_policy_t *cp2 = compiled_policy_get(policies[i]);
+      test_assert(cp);
+      test_eq_ptr(cp, cp2);
+      compiled_policy_release(cp2);
+      for (j = 0; j < (int)(sizeof(test_ports)/sizeof(test_ports[0])); ++j) {
+        uint16_t port = test_ports[j];
+        tor_addr_make_unspec(&tar);
+        test_eq(compare_tor_addr_to_addr_policy(&tar, port, policies[i]),
+                compare_tor_addr_to_compiled_policy(&tar, port, cp,
+                                                    policies[i]));
+        for (k = 0; k < (int)(sizeof(test_addrs)/sizeof(test_addrs[0])); ++k) {
+          tor_addr_from_ipv4h(&tar, test_addrs[k]);
+          test_eq(compare_tor_addr_to_addr_policy(&tar, port, policies[i]),
+                  compare_tor_addr_to_compiled_policy(&tar, port, cp,
+                                                      policies[i]));
+        }
+      }
+      compiled_policy_release(cp);
+    }
+  }
+
   addr_policy_list_free(policy);
   policy = NULL;
 
@@ -1613,6 +2984,122 @@ test_geoip(void)
   tor_free(s);
 }
 
+/** Run unit tests for loading the GeoIP file and its compiled index. */
+static void
+test_geoip_index(void)
+{
+  char *fname = tor_strdup(get_fname("geoip"));
+  char *index_fname = tor_strdup(get_fname("cached-geoip-index"));
+  tor_addr_t addr;
+  int pass;
+  const char *geoip_file =
+    "# Comment\n"
+    "\n"
+    "167772160,167837695,AB\n"   /* 10.0.0.0 - 10.0.255.255 */
+    "167837696,167903231,XY\n"   /* 10.1.0.0 - 10.1.255.255 */
+    "3232235520,3232301055,ZZ\n" /* 192.168.0.0 - 192.168.255.255 */
+    "  \"3232301056\",\"3232366591\",\"zz\",\"ZZZ\",\"Zedland\"\r\n"
+    "2001:db8::,2001:db8:0:ffff:ffff:ffff:ffff:ffff,XY\n"
+    "2001:db8:1::,2001:db8:1:ffff:ffff:ffff:ffff:ffff,ZZ\n";
+
+  test_eq(0, write_str_to_file(fname, geoip_file, 0));
+  unlink(index_fname);
+
+  /* The first load parses the file and saves the index; the second one
+   * uses the saved index. */
+  for (pass = 0; pass < 2; ++pass) {
+    test_eq(0, geoip_load_file(fname, get_options()));
+    test_eq(FN_FILE, file_status(index_fname));
+    test_assert(geoip_is_loaded());
+    test_eq(4, geoip_get_n_countries());
+#define NAMEFOR(x) geoip_get_country_name(geoip_get_country_by_ip(x))
+    test_streq("??", NAMEFOR(167772159));
+    test_streq("ab", NAMEFOR(167772160));
+    test_streq("ab", NAMEFOR(167837695));
+    test_streq("xy", NAMEFOR(167837696));
+    test_streq("xy", NAMEFOR(167903231));
+    test_streq("??", NAMEFOR(167903232));
+    test_streq("zz", NAMEFOR(3232261121u));
+    test_streq("zz", NAMEFOR(3232366591u));
+    test_streq("??", NAMEFOR(0xffffffffu));
+#undef NAMEFOR
+#define NAMEFOR(x) (tor_addr_parse(&addr, (x)),                         \
+                    geoip_get_country_name(geoip_get_country_by_addr(&addr)))
+    test_streq("ab", NAMEFOR("10.0.3.4"));
+    test_streq("xy", NAMEFOR("2001:db8::1"));
+    test_streq("xy", NAMEFOR("2001:db8:0:ffff::"));
+    test_streq("zz", NAMEFOR("2001:db8:1:2::3"));
+    test_streq("??", NAMEFOR("2001:db8:2::"));
+    test_streq("??", NAMEFOR("::1"));
+#undef NAMEFOR
+  }
+
+  /* A changed file doesn't use the stale index. */
+  test_eq(0, write_str_to_file(fname, "167772160,167837695,CD\n", 0));
+  test_eq(0, geoip_load_file(fname, get_options()));
+  test_eq(2, geoip_get_n_countries());
+  test_streq("cd", geoip_get_country_name(geoip_get_country_by_ip(
+                                          167772161)));
+
+ done:
+  geoip_free_all();
+  tor_free(fname);
+  tor_free(index_fname);
+}
+
+/** Run unit tests for counting clients per country with sketches. */
+static void
+test_geoip_sketch(void)
+{
+  time_t now = 1281533250; /* 2010-08-11 13:27:30 UTC */
+  char *s = NULL;
+  unsigned ab = 0, xy = 0;
+  uint32_t i;
+  int j;
+
+  test_eq(0, geoip_parse_entry("1,1000000,AB"));
+  test_eq(0, geoip_parse_entry("1000001,2000000,XY"));
+  get_options_mutable()->BridgeRelay = 1;
+  get_options_mutable()->BridgeRecordUsageByCountry = 1;
+  get_options_mutable()->ClientCountSketch = 1;
+
+  /* 3000 clients from AB two hours ago, and 300 from XY, each seen three
+   * times, just now. */
+  for (i = 0; i < 3000; ++i)
+    geoip_note_client_seen(GEOIP_CLIENT_CONNECT, 1 + i*37, now-7200);
+  for (j = 0; j < 3; ++j)
+    for (i = 0; i < 300; ++i)
+      geoip_note_client_seen(GEOIP_CLIENT_CONNECT, 1000001 + i*11, now);
+
+  s = geoip_get_client_history(GEOIP_CLIENT_CONNECT);
+  test_assert(s);
+  test_eq(2, tor_sscanf(s, "ab=%u,xy=%u", &ab, &xy));
+  test_assert(ab > 3000/2 && ab < 3000*3/2);
+  test_assert(xy > 300/2 && xy < 300*3/2);
+  tor_free(s);
+
+  /* Forgetting the old clients forgets AB entirely. */
+  geoip_remove_old_clients(now-6000);
+  s = geoip_get_client_history(GEOIP_CLIENT_CONNECT);
+  test_assert(s);
+  test_eq(1, tor_sscanf(s, "xy=%u", &xy));
+  test_assert(xy > 300/2 && xy < 300*3/2);
+  test_assert(!strstr(s, "ab="));
+  tor_free(s);
+
+  /* Stopping bridge stats forgets everybody. */
+  geoip_bridge_stats_term();
+  s = geoip_get_client_history(GEOIP_CLIENT_CONNECT);
+  test_assert(!s);
+
+ done:
+  get_options_mutable()->BridgeRelay = 0;
+  get_options_mutable()->BridgeRecordUsageByCountry = 0;
+  get_options_mutable()->ClientCountSketch = 0;
+  geoip_free_all();
+  tor_free(s);
+}
+
 /** Run unit tests for stats code. */
 static void
 test_stats(void)
@@ -1620,6 +3107,10 @@ test_stats(void)
   time_t now = 1281533250; /* 2010-08-11 13:27:30 UTC */
   char *s = NULL;
   int i;
+  or_connection_t conn1, conn2;
+
+  memset(&conn1, 0, sizeof(conn1));
+  memset(&conn2, 0, sizeof(conn2));
 
   /* Start with testing exit port statistics; we shouldn't collect exit
    * stats without initializing them. */
@@ -1659,6 +3150,19 @@ test_stats(void)
              "59=4,80=4,443=4,other=4\n", s);
   tor_free(s);
 
+  /* Grow a port that had dropped out of the top 10 and make sure it
+   * displaces the lowest-ranked one. */
+  rep_hist_note_exit_bytes(50, 1998, 1998);
+  s = rep_hist_format_exit_stats(now + 86400);
+  test_streq("exit-stats-end 2010-08-12 13:27:30 (86400 s)\n"
+             "exit-kibibytes-written 50=2,53=1,54=1,55=1,56=1,57=1,58=1,"
+             "59=1,80=1,443=1,other=1\n"
+             "exit-kibibytes-read 50=2,53=1,54=1,55=1,56=1,57=1,58=1,"
+             "59=1,80=10,443=20,other=1\n"
+             "exit-streams-opened 50=4,53=4,54=4,55=4,56=4,57=4,58=4,"
+             "59=4,80=4,443=4,other=4\n", s);
+  tor_free(s);
+
   /* Stop collecting stats, add some bytes, and ensure we don't generate
    * a history string. */
   rep_hist_exit_stats_term();
@@ -1681,34 +3185,45 @@ test_stats(void)
 
   /* Continue with testing connection statistics; we shouldn't collect
    * conn stats without initializing them. */
-  rep_hist_note_or_conn_bytes(1, 20, 400, now);
+  rep_hist_note_or_conn_bytes(&conn1, 20, 400, now);
   s = rep_hist_format_conn_stats(now + 86400);
   test_assert(!s);
 
   /* Initialize stats, note bytes, and generate history string. */
   rep_hist_conn_stats_init(now);
-  rep_hist_note_or_conn_bytes(1, 30000, 400000, now);
-  rep_hist_note_or_conn_bytes(1, 30000, 400000, now + 5);
-  rep_hist_note_or_conn_bytes(2, 400000, 30000, now + 10);
-  rep_hist_note_or_conn_bytes(2, 400000, 30000, now + 15);
+  rep_hist_note_or_conn_bytes(&conn1, 30000, 400000, now);
+  rep_hist_note_or_conn_bytes(&conn1, 30000, 400000, now + 5);
+  rep_hist_note_or_conn_bytes(&conn2, 400000, 30000, now + 10);
+  rep_hist_note_or_conn_bytes(&conn2, 400000, 30000, now + 15);
   s = rep_hist_format_conn_stats(now + 86400);
   test_streq("conn-bi-direct 2010-08-12 13:27:30 (86400 s) 0,0,1,0\n", s);
   tor_free(s);
 
+  /* Close a connection before its interval is over and make sure its bytes
+   * still count. */
+  rep_hist_note_or_conn_closed(&conn2);
+  s = rep_hist_format_conn_stats(now + 86400);
+  test_streq("conn-bi-direct 2010-08-12 13:27:30 (86400 s) 0,1,1,0\n", s);
+  tor_free(s);
+  rep_hist_note_or_conn_closed(&conn2);
+  s = rep_hist_format_conn_stats(now + 86400);
+  test_streq("conn-bi-direct 2010-08-12 13:27:30 (86400 s) 0,1,1,0\n", s);
+  tor_free(s);
+
   /* Stop collecting stats, add some bytes, and ensure we don't generate
    * a history string. */
   rep_hist_conn_stats_term();
-  rep_hist_note_or_conn_bytes(2, 400000, 30000, now + 15);
+  rep_hist_note_or_conn_bytes(&conn2, 400000, 30000, now + 15);
   s = rep_hist_format_conn_stats(now + 86400);
   test_assert(!s);
 
   /* Re-start stats, add some bytes, reset stats, and see what history we
    * get when observing no bytes at all. */
   rep_hist_conn_stats_init(now);
-  rep_hist_note_or_conn_bytes(1, 30000, 400000, now);
-  rep_hist_note_or_conn_bytes(1, 30000, 400000, now + 5);
-  rep_hist_note_or_conn_bytes(2, 400000, 30000, now + 10);
-  rep_hist_note_or_conn_bytes(2, 400000, 30000, now + 15);
+  rep_hist_note_or_conn_bytes(&conn1, 30000, 400000, now);
+  rep_hist_note_or_conn_bytes(&conn1, 30000, 400000, now + 5);
+  rep_hist_note_or_conn_bytes(&conn2, 400000, 30000, now + 10);
+  rep_hist_note_or_conn_bytes(&conn2, 400000, 30000, now + 15);
   rep_hist_reset_conn_stats(now);
   s = rep_hist_format_conn_stats(now + 86400);
   test_streq("conn-bi-direct 2010-08-12 13:27:30 (86400 s) 0,0,0,0\n", s);
@@ -1748,6 +3263,20 @@ test_stats(void)
              "cell-circuits-per-decile 2\n", s);
   tor_free(s);
 
+  /* Add more circuits than we keep samples for; the deciles come from the
+   * sample, but the per-decile count still covers every circuit. */
+  rep_hist_reset_buffer_stats(now);
+  for (i = 0; i < 100000; i++)
+    rep_hist_add_buffer_stats(1.0, 1.0, 10);
+  s = rep_hist_format_buffer_stats(now + 86400);
+  test_streq("cell-stats-end 2010-08-12 13:27:30 (86400 s)\n"
+             "cell-processed-cells 10,10,10,10,10,10,10,10,10,10\n"
+             "cell-queued-cells 1.00,1.00,1.00,1.00,1.00,1.00,1.00,1.00,"
+                               "1.00,1.00\n"
+             "cell-time-in-queue 1,1,1,1,1,1,1,1,1,1\n"
+             "cell-circuits-per-decile 10000\n", s);
+  tor_free(s);
+
   /* Stop collecting stats, add statistics for one circuit, and ensure we
    * don't generate a history string. */
   rep_hist_buffer_stats_term();
@@ -1810,11 +3339,40 @@ const struct testcase_setup_t legacy_setup = {
 static struct testcase_t test_array[] = {
   ENT(buffers),
   { "buffer_copy", test_buffer_copy, 0, NULL, NULL },
+  { "buffer_socket_io", test_buffer_socket_io, 0, NULL, NULL },
+  { "buffer_ref", test_buffer_ref, 0, NULL, NULL },
+  { "buffer_http_incremental", test_buffer_http_incremental, 0, NULL, NULL },
+  { "cell_queue_batch", test_cell_queue_batch, 0, NULL, NULL },
+  { "onion_queue_fairness", test_onion_queue_fairness, 0, NULL, NULL },
+  { "onion_dh_pool", test_onion_dh_pool, 0, NULL, NULL },
+  { "onionskin_latency", test_onionskin_latency, 0, NULL, NULL },
+  { "handler_latency", test_handler_latency, 0, NULL, NULL },
+  { "cell_latency", test_cell_latency, 0, NULL, NULL },
+  { "dir_endpoint_stats", test_dir_endpoint_stats, 0, NULL, NULL },
+  { "cell_trace", test_cell_trace, 0, NULL, NULL },
+  { "memory_usage_report", test_memory_usage_report, 0, NULL, NULL },
+  { "bw_class_weights", test_bw_class_weights, 0, NULL, NULL },
+  { "clean_circ_demand", test_clean_circ_demand, 0, NULL, NULL },
+  { "flow_control", test_flow_control, 0, NULL, NULL },
+  { "replaycache", test_replaycache, 0, NULL, NULL },
+  { "circid_table", test_circid_table, 0, NULL, NULL },
+  { "rend_circ_index", test_rend_circ_index, 0, NULL, NULL },
+  { "cannibalize_index", test_cannibalize_index, 0, NULL, NULL },
+  { "idle_check_queue", test_idle_check_queue, 0, NULL, NULL },
+  { "bridge_index", test_bridge_index, 0, NULL, NULL },
+  { "pending_stream_index", test_pending_stream_index, 0, NULL, NULL },
+  { "optimistic_data_ports", test_optimistic_data_ports, 0, NULL, NULL },
+  { "exit_connect_failures", test_exit_connect_failures, 0, NULL, NULL },
+  { "tls_session_resumption", test_tls_session_resumption, TT_FORK,
+    NULL, NULL },
+  { "buffer_tls_coalesce", test_buffer_tls_coalesce, TT_FORK, NULL, NULL },
   ENT(onion_handshake),
   ENT(circuit_timeout),
   ENT(policies),
   ENT(rend_fns),
   ENT(geoip),
+  ENT(geoip_index),
+  ENT(geoip_sketch),
   FORK(stats),
 
   END_OF_TESTCASES
@@ -160,11 +160,128 @@ test_config_addressmap(void *arg)
   ;
 }
 
+static void
+test_config_addressmap_expiry(void *arg)
+{
+  char address[256];
+  time_t expires = TIME_MAX;
+  time_t now = time(NULL);
+  (void)arg;
+
+  addressmap_clear_configured();
+  addressmap_clear_transient();
+  addressmap_register("later.example.com", tor_strdup("1.2.3.4"), now+100,
+                      ADDRMAPSRC_DNS, 0, 0);
+  addressmap_register("sooner.example.com", tor_strdup("5.6.7.8"), now+50,
+                      ADDRMAPSRC_DNS, 0, 0);
+  addressmap_register("never.example.com", tor_strdup("9.9.9.9"), 0,
+                      ADDRMAPSRC_TORRC, 0, 0);
+  /* Pushing the expiry time back moves the entry in the queue. */
+  addressmap_register("sooner.example.com", NULL, 0, ADDRMAPSRC_DNS, 0, 0);
+  addressmap_register("sooner.example.com", tor_strdup("5.6.7.8"), now+150,
+                      ADDRMAPSRC_DNS, 0, 0);
+
+  addressmap_clean(now+99);
+  strlcpy(address, "later.example.com", sizeof(address));
+  test_assert(addressmap_rewrite(address, sizeof(address), &expires));
+  test_eq(expires, now+100);
+
+  addressmap_clean(now+100);
+  strlcpy(address, "later.example.com", sizeof(address));
+  test_assert(!addressmap_rewrite(address, sizeof(address), &expires));
+  strlcpy(address, "sooner.example.com", sizeof(address));
+  test_assert(addressmap_rewrite(address, sizeof(address), &expires));
+
+  addressmap_clean(now+1000);
+  strlcpy(address, "sooner.example.com", sizeof(address));
+  test_assert(!addressmap_rewrite(address, sizeof(address), &expires));
+  strlcpy(address, "never.example.com", sizeof(address));
+  test_assert(addressmap_rewrite(address, sizeof(address), &expires));
+  test_streq(address, "9.9.9.9");
+
+ done:
+  addressmap_clear_configured();
+}
+
+static void
+test_config_addressmap_virtual(void *arg)
+{
+  char name[64];
+  char *first = NULL;
+  const char *addr;
+  int i;
+  strmap_t *seen = strmap_new();
+  (void)arg;
+
+  /* A /16 holds 65024 usable addresses.  Take some, give one back, and
+   * make sure the allocator never repeats itself or hands out a .0 or .255
+   * address. */
+  test_eq(0, parse_virtual_addr_network("127.200.0.0/16", 0, NULL));
+  for (i = 0; i < 1000; ++i) {
+    struct in_addr in;
+    uint32_t a;
+    tor_snprintf(name, sizeof(name), "host%d.example.com", i);
+    addr = addressmap_register_virtual_address(RESOLVED_TYPE_IPV4,
+                                               tor_strdup(name));
+    test_assert(addr);
+    test_assert(tor_inet_aton(addr, &in));
+    a = ntohl(in.s_addr);
+    test_eq(a >> 16, 0x7fc8);
+    test_assert((a & 0xff) != 0 && (a & 0xff) != 0xff);
+    test_assert(!strmap_get(seen, addr));
+    strmap_set(seen, addr, (void*)1);
+    if (i == 0)
+      first = tor_strdup(addr);
+  }
+
+  /* Unmapping an address makes it available again once we wrap around. */
+  addressmap_register(first, NULL, 0, ADDRMAPSRC_DNS, 0, 0);
+  for (i = 1000; i <= 65024; ++i) {
+    tor_snprintf(name, sizeof(name), "host%d.example.com", i);
+    addr = addressmap_register_virtual_address(RESOLVED_TYPE_IPV4,
+                                               tor_strdup(name));
+    test_assert(addr);
+    test_assert(!strmap_get(seen, addr) || !strcmp(addr, first));
+  }
+  /* Now every address is taken. */
+  test_assert(!addressmap_register_virtual_address(RESOLVED_TYPE_IPV4,
+                                         tor_strdup("one.too.many.com")));
+
+ done:
+  tor_free(first);
+  strmap_free(seen, NULL);
+  addressmap_free_all();
+  addressmap_init();
+  parse_virtual_addr_network("127.192.0.0/10", 0, NULL);
+}
+
+/** Check that option names are found case-insensitively, and that unique
+ * prefixes still work. */
+static void
+test_config_find_option(void *arg)
+{
+  (void)arg;
+  test_streq(option_get_canonical_name("socksport"), "SocksPort");
+  test_streq(option_get_canonical_name("TUNESOCKETSBYTYPE"),
+             "TuneSocketsByType");
+  test_streq(option_get_canonical_name("ConstrainedSockS"),
+             "ConstrainedSockSize");
+  test_assert(option_is_recognized("LOG"));
+  test_assert(!option_is_recognized("NoSuchOptionAnywhere"));
+  test_assert(!option_is_recognized(""));
+
+ done:
+  ;
+}
+
 #define CONFIG_TEST(name, flags)                          \
   { #name, test_config_ ## name, flags, NULL, NULL }
 
 struct testcase_t config_tests[] = {
   CONFIG_TEST(addressmap, 0),
+  CONFIG_TEST(addressmap_expiry, 0),
+  CONFIG_TEST(addressmap_virtual, 0),
+  CONFIG_TEST(find_option, 0),
   END_OF_TESTCASES
 };
 
@@ -6,6 +6,7 @@
 #include "orconfig.h"
 #include "or.h"
 #include "test.h"
+#include "ht.h"
 
 /** Helper: return a tristate based on comparing the strings in *<b>a</b> and
  * *<b>b</b>. */
@@ -64,6 +65,42 @@ test_container_smartlist_basic(void)
   smartlist_free(sl);
 }
 
+/** Run unit tests for smartlists with embedded or stack storage. */
+static void
+test_container_smartlist_storage(void)
+{
+  SMARTLIST_DECLARE_LOCAL(local, 4);
+  smartlist_t *sl = smartlist_create_with_capacity(3);
+  int i;
+
+  test_assert(local->list_is_embedded);
+  test_eq(local->capacity, 4);
+  for (i = 0; i < 4; ++i)
+    smartlist_add(local, (void*)(intptr_t)(i+1));
+  test_assert(local->list_is_embedded);
+  /* Growing past the stack buffer moves the list to the heap intact. */
+  smartlist_add(local, (void*)5);
+  test_assert(!local->list_is_embedded);
+  test_eq(smartlist_len(local), 5);
+  for (i = 0; i < 5; ++i)
+    test_eq_ptr(smartlist_get(local, i), (void*)(intptr_t)(i+1));
+
+  test_assert(sl->list_is_embedded);
+  test_eq(sl->capacity, 3);
+  smartlist_add_all(sl, local);
+  test_assert(!sl->list_is_embedded);
+  test_eq(smartlist_len(sl), 5);
+  test_eq_ptr(smartlist_get(sl, 4), (void*)5);
+  smartlist_ensure_capacity(sl, 100);
+  test_assert(sl->capacity >= 100);
+  test_eq(smartlist_len(sl), 5);
+  test_eq_ptr(smartlist_get(sl, 0), (void*)1);
+
+ done:
+  smartlist_free_local(local);
+  smartlist_free(sl);
+}
+
 /** Run unit tests for smartlist-of-strings functionality. */
 static void
 test_container_smartlist_strings(void)
@@ -352,6 +389,7 @@ static void
 test_container_smartlist_digests(void)
 {
   smartlist_t *sl = smartlist_create();
+  int i;
 
   /* digest_isin. */
   smartlist_add(sl, tor_memdup("AAAAAAAAAAAAAAAAAAAA", DIGEST_LEN));
@@ -375,6 +413,30 @@ test_container_smartlist_digests(void)
   test_memeq(smartlist_get(sl, 0), "\00090AAB2AAAAaasdAAAAA", DIGEST_LEN);
   test_memeq(smartlist_get(sl, 1), "AAAAAAAAAAAAAAAAAAAA", DIGEST_LEN);
 
+  /* A list long enough to be radix-sorted, where some digests share their
+   * first 32 bits and some are duplicates. */
+  SMARTLIST_FOREACH(sl, char *, cp, tor_free(cp));
+  smartlist_clear(sl);
+  for (i = 0; i < 1000; ++i) {
+    char d[DIGEST_LEN];
+    crypto_rand(d, sizeof(d));
+    if (i % 3 == 0)
+      memcpy(d, "\xff\x00\x01\x02", 4);
+    smartlist_add(sl, tor_memdup(d, DIGEST_LEN));
+    if (i % 10 == 0)
+      smartlist_add(sl, tor_memdup(d, DIGEST_LEN));
+  }
+  smartlist_sort_digests(sl);
+  test_eq(smartlist_len(sl), 1100);
+  for (i = 1; i < smartlist_len(sl); ++i)
+    test_assert(tor_memcmp(smartlist_get(sl, i-1), smartlist_get(sl, i),
+                           DIGEST_LEN) <= 0);
+  smartlist_uniq_digests(sl);
+  test_eq(smartlist_len(sl), 1000);
+  for (i = 1; i < smartlist_len(sl); ++i)
+    test_assert(tor_memcmp(smartlist_get(sl, i-1), smartlist_get(sl, i),
+                           DIGEST_LEN) < 0);
+
  done:
   SMARTLIST_FOREACH(sl, char *, cp, tor_free(cp));
   smartlist_free(sl);
@@ -618,6 +680,23 @@ test_container_pqueue(void)
   test_eq(smartlist_len(sl), 0);
   OK();
 
+  /* Removing an item can move the last one above its new parent. */
+  smartlist_pqueue_add(sl, cmp, offset, &apples);
+  smartlist_pqueue_add(sl, cmp, offset, &squid);
+  smartlist_pqueue_add(sl, cmp, offset, &cows);
+  smartlist_pqueue_add(sl, cmp, offset, &weissbier);
+  smartlist_pqueue_add(sl, cmp, offset, &zebras);
+  smartlist_pqueue_add(sl, cmp, offset, &daschunds);
+  OK();
+  smartlist_pqueue_remove(sl, cmp, offset, &weissbier);
+  OK();
+  test_eq_ptr(smartlist_pqueue_pop(sl, cmp, offset), &apples);
+  test_eq_ptr(smartlist_pqueue_pop(sl, cmp, offset), &cows);
+  test_eq_ptr(smartlist_pqueue_pop(sl, cmp, offset), &daschunds);
+  test_eq_ptr(smartlist_pqueue_pop(sl, cmp, offset), &squid);
+  test_eq_ptr(smartlist_pqueue_pop(sl, cmp, offset), &zebras);
+  OK();
+
 #undef OK
 
  done:
@@ -716,6 +795,149 @@ test_container_strmap(void)
   tor_free(visited);
 }
 
+/** Run unit tests for digest-to-void* maps as they grow and shrink. */
+static void
+test_container_digestmap(void)
+{
+  digestmap_t *map;
+  digestmap_iter_t *iter;
+  const char *k;
+  void *v;
+  char d[DIGEST_LEN];
+  int i, n_visited = 0;
+  const int n = 2000;
+
+  map = digestmap_new();
+  test_assert(digestmap_isempty(map));
+  for (i = 0; i < n; ++i) {
+    /* Keys that share their hash with many others make long probes. */
+    memset(d, 0, sizeof(d));
+    set_uint32(d, (uint32_t)(i % 17));
+    set_uint32(d+16, (uint32_t)(i / 17));
+    test_eq_ptr(digestmap_set(map, d, (void*)(intptr_t)(i+1)), NULL);
+  }
+  test_eq(digestmap_size(map), n);
+  digestmap_assert_ok(map);
+
+  /* Remove the odd values while iterating; we should see each key once. */
+  for (iter = digestmap_iter_init(map); !digestmap_iter_done(iter); ) {
+    digestmap_iter_get(iter, &k, &v);
+    ++n_visited;
+    if (((intptr_t)v) & 1)
+      iter = digestmap_iter_next_rmv(map, iter);
+    else
+      iter = digestmap_iter_next(map, iter);
+  }
+  test_eq(n_visited, n);
+  test_eq(digestmap_size(map), n/2);
+  digestmap_assert_ok(map);
+
+  for (i = 0; i < n; ++i) {
+    memset(d, 0, sizeof(d));
+    set_uint32(d, (uint32_t)(i % 17));
+    set_uint32(d+16, (uint32_t)(i / 17));
+    if ((i+1) & 1)
+      test_eq_ptr(digestmap_get(map, d), NULL);
+    else
+      test_eq_ptr(digestmap_remove(map, d), (void*)(intptr_t)(i+1));
+  }
+  test_assert(digestmap_isempty(map));
+  digestmap_assert_ok(map);
+
+ done:
+  digestmap_free(map, NULL);
+}
+
+/** An element of the hash table in test_container_ht_incremental(). */
+typedef struct test_ht_ent_t {
+  HT_ENTRY(test_ht_ent_t) node;
+  unsigned key;
+} test_ht_ent_t;
+
+static INLINE unsigned
+test_ht_ent_hash(const test_ht_ent_t *e)
+{
+  return e->key;
+}
+
+static INLINE int
+test_ht_ents_eq(const test_ht_ent_t *a, const test_ht_ent_t *b)
+{
+  return a->key == b->key;
+}
+
+HT_HEAD(test_ht_map, test_ht_ent_t);
+HT_PROTOTYPE(test_ht_map, test_ht_ent_t, node, test_ht_ent_hash,
+             test_ht_ents_eq)
+HT_GENERATE_INCREMENTAL(test_ht_map, test_ht_ent_t, node, test_ht_ent_hash,
+                        test_ht_ents_eq, 0.6, malloc, realloc, free)
+
+/** Run unit tests for hash tables that resize a few buckets at a time. */
+static void
+test_container_ht_incremental(void)
+{
+  struct test_ht_map map = HT_INITIALIZER();
+  test_ht_ent_t *ents = NULL, search, **ptr, **next;
+  const unsigned n = 20000;
+  unsigned i, n_visited = 0;
+  int saw_migration = 0, removed_during_migration = 0;
+
+  ents = tor_malloc_zero(sizeof(test_ht_ent_t)*n);
+  for (i = 0; i < n; ++i) {
+    ents[i].key = i * 7;
+    HT_INSERT(test_ht_map, &map, &ents[i]);
+    if (map.hth_old_table)
+      saw_migration = 1;
+    if (i % 97 == 0) {
+      test_eq(_test_ht_map_HT_REP_IS_BAD(&map), 0);
+      search.key = (i / 2) * 7;
+      test_eq_ptr(HT_FIND(test_ht_map, &map, &search), &ents[i/2]);
+    }
+  }
+  test_assert(saw_migration);
+  test_eq(HT_SIZE(&map), n);
+  test_eq(_test_ht_map_HT_REP_IS_BAD(&map), 0);
+
+  /* Make sure a resize is in progress, then iterate over both tables,
+   * removing every odd element. */
+  while (!map.hth_old_table) {
+    test_ht_ent_t *e = tor_malloc_zero(sizeof(test_ht_ent_t));
+    e->key = n * 7 + i++;
+    HT_INSERT(test_ht_map, &map, e);
+  }
+  for (ptr = HT_START(test_ht_map, &map); ptr; ptr = next) {
+    test_ht_ent_t *e = *ptr;
+    ++n_visited;
+    if (e->key % 2) {
+      next = HT_NEXT_RMV(test_ht_map, &map, ptr);
+      if (map.hth_old_table)
+        removed_during_migration = 1;
+      if (e < ents || e >= ents + n)
+        tor_free(e);
+    } else {
+      next = HT_NEXT(test_ht_map, &map, ptr);
+    }
+  }
+  test_assert(removed_during_migration);
+  test_eq(n_visited, i);
+  test_eq(_test_ht_map_HT_REP_IS_BAD(&map), 0);
+  for (i = 0; i < n; ++i) {
+    search.key = i * 7;
+    test_eq_ptr(HT_FIND(test_ht_map, &map, &search),
+                (i % 2) ? NULL : &ents[i]);
+  }
+
+ done:
+  for (ptr = HT_START(test_ht_map, &map); ptr; ptr = next) {
+    test_ht_ent_t *e = *ptr;
+    next = HT_NEXT_RMV(test_ht_map, &map, ptr);
+    if (e < ents || e >= ents + n)
+      tor_free(e);
+  }
+  HT_CLEAR(test_ht_map, &map);
+  tor_free(ents);
+}
+
 /** Run unit tests for getting the median of a list. */
 static void
 test_container_order_functions(void)
@@ -751,6 +973,7 @@ test_container_order_functions(void)
 
 struct testcase_t container_tests[] = {
   CONTAINER_LEGACY(smartlist_basic),
+  CONTAINER_LEGACY(smartlist_storage),
   CONTAINER_LEGACY(smartlist_strings),
   CONTAINER_LEGACY(smartlist_overlap),
   CONTAINER_LEGACY(smartlist_digests),
@@ -758,6 +981,8 @@ struct testcase_t container_tests[] = {
   CONTAINER_LEGACY(bitarray),
   CONTAINER_LEGACY(digestset),
   CONTAINER_LEGACY(strmap),
+  CONTAINER_LEGACY(digestmap),
+  CONTAINER_LEGACY(ht_incremental),
   CONTAINER_LEGACY(pqueue),
   CONTAINER_LEGACY(order_functions),
   END_OF_TESTCASES
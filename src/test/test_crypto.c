@@ -252,6 +252,22 @@ test_crypto_sha(void)
                        "96177A9CB410FF61F20015AD");
   tt_int_op(i, ==, 0);
 
+  /* The multi-buffer interface should agree with the one-shot ones. */
+  {
+    const char *ms[] = { "abc", "", "abcdefghijkl" };
+    const size_t lens[] = { 3, 0, 12 };
+    char out[3][DIGEST256_LEN];
+    char *outs[] = { out[0], out[1], out[2] };
+    tt_int_op(0, ==, crypto_digest_multi(outs, ms, lens, 3, DIGEST_SHA256));
+    test_memeq_hex(out[0], "BA7816BF8F01CFEA414140DE5DAE2223B00361A3"
+                           "96177A9CB410FF61F20015AD");
+    crypto_digest256(d_out2, "abcdefghijkl", 12, DIGEST_SHA256);
+    test_memeq(out[2], d_out2, DIGEST256_LEN);
+    tt_int_op(0, ==, crypto_digest_multi(outs, ms, lens, 3, DIGEST_SHA1));
+    test_memeq_hex(out[0], "A9993E364706816ABA3E25717850C26C9CD0D89D");
+    test_memeq_hex(out[1], "DA39A3EE5E6B4B0D3255BFEF95601890AFD80709");
+  }
+
   /* Test HMAC-SHA-1 with test cases from RFC2202. */
 
   /* Case 1. */
@@ -367,6 +383,17 @@ test_crypto_sha(void)
   crypto_digest_get_digest(d1, d_out1, sizeof(d_out1));
   crypto_digest(d_out2, "abcdef", 6);
   test_memeq(d_out1, d_out2, DIGEST_LEN);
+  /* Save a checkpoint, wander off, and come back. */
+  {
+    crypto_digest_checkpoint_t cp;
+    crypto_digest_checkpoint(&cp, d1);
+    crypto_digest_add_bytes(d1, "xyz", 3);
+    crypto_digest_restore(d1, &cp);
+    crypto_digest_add_bytes(d1, "mno", 3);
+    crypto_digest_get_digest(d1, d_out1, sizeof(d_out1));
+    crypto_digest(d_out2, "abcdefmno", 9);
+    test_memeq(d_out1, d_out2, DIGEST_LEN);
+  }
   crypto_free_digest_env(d1);
   crypto_free_digest_env(d2);
 
@@ -420,6 +447,11 @@ test_crypto_pk(void)
   test_eq(128, crypto_pk_keysize(pk2));
   test_eq(1024, crypto_pk_num_bits(pk2));
 
+  /* Preparing only works for private keys, and doesn't change the key. */
+  test_eq(0, crypto_pk_prepare_private_key(pk1));
+  test_eq(-1, crypto_pk_prepare_private_key(pk2));
+  test_eq(0, crypto_pk_cmp_keys(pk1, pk2));
+
   test_eq(128, crypto_pk_public_encrypt(pk2, data1, sizeof(data1),
                                         "Hello whirled.", 15,
                                         PK_PKCS1_OAEP_PADDING));
@@ -538,7 +570,14 @@ test_crypto_formats(void)
     j = base64_decode(data3, 1024, data2, i);
     test_eq(j,idx);
     test_memeq(data3, data1, idx);
+    test_eq(base64_decoded_len(data2, i), idx);
   }
+  /* base64_decoded_len() rejects exactly what base64_decode() rejects. */
+  test_eq(base64_decoded_len("QUJD\nREVG\n", 10), 6);
+  test_eq(base64_decoded_len("QUJDRA==", 8), 4);
+  test_eq(base64_decoded_len("QUJDR", 5), -1);
+  test_eq(base64_decoded_len("QU#D", 4), -1);
+  test_eq(base64_decoded_len("", 0), 0);
 
   strlcpy(data1, "Test string that contains 35 chars.", 1024);
   strlcat(data1, " 2nd string that contains 35 chars.", 1024);
@@ -550,6 +589,17 @@ test_crypto_formats(void)
   test_streq(data3, data1);
   test_assert(data2[i] == '\0');
 
+  /* We break lines after 64 characters, as OpenSSL does. */
+  memset(data1, 0xff, 50);
+  i = base64_encode(data2, 1024, data1, 50);
+  test_eq(i, 64+1+4+1);
+  test_eq(data2[64], '\n');
+  test_streq(data2+65, "//8=\n");
+  /* Whitespace and padding anywhere in a group are fine. */
+  test_eq(base64_decode(data3, 1024, "QU JD\nRA=\n=", 12), 4);
+  test_memeq(data3, "ABCD", 4);
+  test_eq(base64_decode(data3, 1024, "QUJDREVG*", 9), -1);
+
   crypto_rand(data1, DIGEST_LEN);
   memset(data2, 100, 1024);
   digest_to_base64(data2, data1);
@@ -586,6 +636,11 @@ test_crypto_formats(void)
   base32_encode(data2, 30, data1, 10);
   test_streq(data2, "772w2rfobvomsywe");
 
+  /* Decoding accepts either case, and rejects non-base32 characters. */
+  test_eq(base32_decode(data3, 10, "772W2RFOBVOMSYWE", 16), 0);
+  test_memeq(data3, data1, 10);
+  test_eq(base32_decode(data3, 10, "772w2rfobvomsyw1", 16), -1);
+
   /* Base16 tests */
   strlcpy(data1, "6chrs\xff", 1024);
   base16_encode(data2, 13, data1, 6);
@@ -823,6 +878,195 @@ test_crypto_aes_iv(void *arg)
     crypto_free_cipher_env(cipher);
 }
 
+/** Make sure that crypto_cipher_crypt_inplace_multi gives the same results
+ * as encrypting its buffers one at a time. */
+static void
+test_crypto_aes_multi(void *arg)
+{
+  crypto_cipher_env_t *env1 = NULL, *env2 = NULL;
+  char *bufs1[40], *bufs2[40];
+  char prefix1[7], prefix2[7];
+  const size_t lens[] = { 509, 16, 3 };
+  int i, j, n_bufs;
+
+  int use_evp = !strcmp(arg,"evp");
+  evaluate_evp_for_aes(use_evp);
+
+  memset(bufs1, 0, sizeof(bufs1));
+  memset(bufs2, 0, sizeof(bufs2));
+  for (i = 0; i < 40; ++i) {
+    bufs1[i] = tor_malloc(509);
+    bufs2[i] = tor_malloc(509);
+  }
+
+  for (j = 0; j < 3; ++j) {
+    env1 = crypto_new_cipher_env();
+    env2 = crypto_new_cipher_env();
+    crypto_cipher_generate_key(env1);
+    crypto_cipher_set_key(env2, crypto_cipher_get_key(env1));
+    crypto_cipher_encrypt_init_cipher(env1);
+    crypto_cipher_encrypt_init_cipher(env2);
+
+    /* Start partway through a block, to exercise the unaligned case. */
+    memset(prefix1, 'x', sizeof(prefix1));
+    memset(prefix2, 'x', sizeof(prefix2));
+    crypto_cipher_crypt_inplace(env1, prefix1, sizeof(prefix1));
+    crypto_cipher_crypt_inplace(env2, prefix2, sizeof(prefix2));
+    test_memeq(prefix1, prefix2, sizeof(prefix1));
+
+    n_bufs = (j == 2) ? 5 : 40;
+    for (i = 0; i < n_bufs; ++i) {
+      crypto_rand(bufs1[i], lens[j]);
+      memcpy(bufs2[i], bufs1[i], lens[j]);
+      crypto_cipher_crypt_inplace(env1, bufs1[i], lens[j]);
+    }
+    test_eq(0, crypto_cipher_crypt_inplace_multi(env2, bufs2, lens[j],
+                                                 n_bufs));
+    for (i = 0; i < n_bufs; ++i)
+      test_memeq(bufs1[i], bufs2[i], lens[j]);
+
+    /* Both ciphers should end up at the same stream position. */
+    crypto_cipher_crypt_inplace(env1, prefix1, sizeof(prefix1));
+    crypto_cipher_crypt_inplace(env2, prefix2, sizeof(prefix2));
+    test_memeq(prefix1, prefix2, sizeof(prefix1));
+
+    crypto_free_cipher_env(env1);
+    crypto_free_cipher_env(env2);
+    env1 = env2 = NULL;
+  }
+
+ done:
+  for (i = 0; i < 40; ++i) {
+    tor_free(bufs1[i]);
+    tor_free(bufs2[i]);
+  }
+  if (env1)
+    crypto_free_cipher_env(env1);
+  if (env2)
+    crypto_free_cipher_env(env2);
+}
+
+/** Make sure that a cipher with a precomputed keystream buffer produces the
+ * same stream as one without, whatever sizes we feed it. */
+static void
+test_crypto_aes_keystream_buffer(void *arg)
+{
+  crypto_cipher_env_t *env1 = NULL, *env2 = NULL;
+  char *data1 = NULL, *data2 = NULL;
+  char *bufs[4];
+  const size_t lens[] = { 1, 15, 509, 7, 512, 1024, 33, 3000 };
+  size_t i, off = 0, total = 0;
+  int r;
+
+  int use_evp = !strcmp(arg,"evp");
+  evaluate_evp_for_aes(use_evp);
+
+  for (i = 0; i < sizeof(lens)/sizeof(lens[0]); ++i)
+    total += lens[i];
+  data1 = tor_malloc(total + 4*509);
+  data2 = tor_malloc(total + 4*509);
+  crypto_rand(data1, total + 4*509);
+  memcpy(data2, data1, total + 4*509);
+
+  env1 = crypto_new_cipher_env();
+  env2 = crypto_new_cipher_env();
+  crypto_cipher_generate_key(env1);
+  crypto_cipher_set_key(env2, crypto_cipher_get_key(env1));
+  crypto_cipher_encrypt_init_cipher(env1);
+  crypto_cipher_encrypt_init_cipher(env2);
+  r = crypto_cipher_enable_keystream_buffer(env2);
+  /* We only bother buffering when EVP can batch the blocks. */
+  test_eq(r, use_evp ? 0 : -1);
+
+  for (i = 0; i < sizeof(lens)/sizeof(lens[0]); ++i) {
+    crypto_cipher_crypt_inplace(env1, data1+off, lens[i]);
+    crypto_cipher_crypt_inplace(env2, data2+off, lens[i]);
+    off += lens[i];
+  }
+  test_memeq(data1, data2, total);
+
+  /* The multi-buffer interface has to agree with the buffer too. */
+  for (i = 0; i < 4; ++i)
+    bufs[i] = data2 + total + 509*i;
+  crypto_cipher_crypt_inplace(env1, data1+total, 4*509);
+  test_eq(0, crypto_cipher_crypt_inplace_multi(env2, bufs, 509, 4));
+  test_memeq(data1+total, data2+total, 4*509);
+
+ done:
+  tor_free(data1);
+  tor_free(data2);
+  if (env1)
+    crypto_free_cipher_env(env1);
+  if (env2)
+    crypto_free_cipher_env(env2);
+}
+
+/** Check the buffered random number generator behind crypto_rand(): it
+ * must not repeat itself across refills, reseeds, or forks. */
+static void
+test_crypto_rng_buffered(void *arg)
+{
+  char *data1 = NULL, *data2 = NULL;
+  const size_t lens[] = { 1, 7, 1000, 3, 1024, 2048, 16, 900 };
+  size_t i, off = 0, total = 0;
+#ifndef MS_WINDOWS
+  tor_socket_t fds[2] = { -1, -1 };
+  char parent[32], child[32];
+  pid_t pid;
+  int status;
+#endif
+  (void)arg;
+
+  for (i = 0; i < sizeof(lens)/sizeof(lens[0]); ++i)
+    total += lens[i];
+  data1 = tor_malloc_zero(total);
+  data2 = tor_malloc_zero(total);
+
+  /* Requests of all sizes, crossing buffer refills. */
+  for (i = 0; i < sizeof(lens)/sizeof(lens[0]); ++i) {
+    test_eq(0, crypto_rand(data1+off, lens[i]));
+    off += lens[i];
+  }
+  test_eq(0, crypto_rand(data2, total));
+  test_memneq(data1, data2, total);
+  for (off = 0; off + 32 <= total; off += 32)
+    test_memneq(data1+off, data2+off, 32);
+
+  /* Reseeding throws away whatever was buffered. */
+  test_eq(0, crypto_rand(data1, 16));
+  test_assert(! crypto_seed_rng(0));
+  test_eq(0, crypto_rand(data2, 16));
+  test_memneq(data1, data2, 16);
+
+#ifndef MS_WINDOWS
+  /* After a fork, parent and child must not hand out the same bytes, even
+   * though the parent had keystream buffered when it forked. */
+  test_eq(0, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  test_eq(0, crypto_rand(parent, 1));
+  pid = fork();
+  test_assert(pid >= 0);
+  if (pid == 0) {
+    crypto_rand(child, sizeof(child));
+    write_all(fds[1], child, sizeof(child), 1);
+    _exit(0);
+  }
+  test_eq(0, crypto_rand(parent, sizeof(parent)));
+  test_eq(sizeof(child), read_all(fds[0], child, sizeof(child), 1));
+  test_eq(pid, waitpid(pid, &status, 0));
+  test_memneq(parent, child, sizeof(parent));
+#endif
+
+ done:
+#ifndef MS_WINDOWS
+  if (fds[0] >= 0)
+    tor_close_socket(fds[0]);
+  if (fds[1] >= 0)
+    tor_close_socket(fds[1]);
+#endif
+  tor_free(data1);
+  tor_free(data2);
+}
+
 /** Test base32 decoding. */
 static void
 test_crypto_base32_decode(void)
@@ -880,6 +1124,7 @@ static const struct testcase_setup_t pass_data = {
 struct testcase_t crypto_tests[] = {
   CRYPTO_LEGACY(formats),
   CRYPTO_LEGACY(rng),
+  { "rng_buffered", test_crypto_rng_buffered, TT_FORK, NULL, NULL },
   { "aes_AES", test_crypto_aes, TT_FORK, &pass_data, (void*)"aes" },
   { "aes_EVP", test_crypto_aes, TT_FORK, &pass_data, (void*)"evp" },
   CRYPTO_LEGACY(sha),
@@ -888,6 +1133,14 @@ struct testcase_t crypto_tests[] = {
   CRYPTO_LEGACY(s2k),
   { "aes_iv_AES", test_crypto_aes_iv, TT_FORK, &pass_data, (void*)"aes" },
   { "aes_iv_EVP", test_crypto_aes_iv, TT_FORK, &pass_data, (void*)"evp" },
+  { "aes_multi_AES", test_crypto_aes_multi, TT_FORK, &pass_data,
+    (void*)"aes" },
+  { "aes_multi_EVP", test_crypto_aes_multi, TT_FORK, &pass_data,
+    (void*)"evp" },
+  { "aes_keystream_buffer_AES", test_crypto_aes_keystream_buffer, TT_FORK,
+    &pass_data, (void*)"aes" },
+  { "aes_keystream_buffer_EVP", test_crypto_aes_keystream_buffer, TT_FORK,
+    &pass_data, (void*)"evp" },
   CRYPTO_LEGACY(base32_decode),
   END_OF_TESTCASES
 };
@@ -4,19 +4,29 @@
 /* See LICENSE for licensing information */
 
 #include "orconfig.h"
+#define DIRECTORY_PRIVATE
 #define DIRSERV_PRIVATE
 #define DIRVOTE_PRIVATE
 #define ROUTER_PRIVATE
 #define HIBERNATE_PRIVATE
+#define ROUTERLIST_PRIVATE
+#define ROUTERPARSE_PRIVATE
+#define SIGCACHE_PRIVATE
+#define NETWORKSTATUS_PRIVATE
 #include "or.h"
+#include "config.h"
+#include "consdiff.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
 #include "hibernate.h"
+#include "memarea.h"
 #include "networkstatus.h"
+#include "nodelist.h"
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
+#include "sigcache.h"
 #include "test.h"
 
 static void
@@ -182,6 +192,20 @@ test_dir_formats(void)
   test_assert(crypto_pk_cmp_keys(rp1->identity_pkey, pk2) == 0);
   //test_assert(rp1->exit_policy == NULL);
 
+  /* A compact routerinfo parses its descriptor again for what it dropped. */
+  routerinfo_compact(rp1);
+  test_assert(!rp1->is_compact);
+  get_options_mutable()->CompactRouterDescriptors = 1;
+  routerinfo_compact(rp1);
+  get_options_mutable()->CompactRouterDescriptors = 0;
+  test_assert(rp1->is_compact);
+  test_assert(!rp1->onion_pkey);
+  test_assert(!rp1->platform);
+  test_assert(crypto_pk_cmp_keys(router_get_onion_pkey(rp1), pk1) == 0);
+  test_streq(router_get_platform(rp1), r1->platform);
+  test_assert(!router_get_contact_info(rp1));
+  test_streq(rp1->address, r1->address);
+
 #if 0
   /* XXX Once we have exit policies, test this again. XXX */
   strlcpy(buf2, "router tor.tor.tor 9005 0 0 3000\n", sizeof(buf2));
@@ -1091,6 +1115,25 @@ test_dir_v3_networkstatus(void)
   con = networkstatus_parse_vote_from_string(consensus_text, NULL,
                                              NS_TYPE_CONSENSUS);
   test_assert(con);
+  {
+    /* Parsing it again with the entries from a snapshot gets us the same
+     * thing. */
+    networkstatus_t *con2;
+    char d[DIGEST256_LEN], *snap;
+    size_t snap_len;
+    memset(d, 0, sizeof(d));
+    snap = networkstatus_snapshot_encode(con->routerstatus_list, FLAV_NS, d,
+                                         &snap_len);
+    con2 = networkstatus_parse_consensus_with_routerstatuses(consensus_text,
+              networkstatus_snapshot_decode(snap, snap_len, FLAV_NS, d));
+    tor_free(snap);
+    test_assert(con2);
+    test_eq(smartlist_len(con2->routerstatus_list),
+            smartlist_len(con->routerstatus_list));
+    test_memeq(&con2->digests, &con->digests, sizeof(con->digests));
+    test_eq(smartlist_len(con2->voters), smartlist_len(con->voters));
+    networkstatus_vote_free(con2);
+  }
   //log_notice(LD_GENERAL, "<<%s>>\n<<%s>>\n<<%s>>\n",
   //           v1_text, v2_text, v3_text);
   consensus_text_md = networkstatus_compute_consensus(votes, 3,
@@ -1377,21 +1420,956 @@ test_dir_v3_networkstatus(void)
     ns_detached_signatures_free(dsig2);
 }
 
+/** Check that the signature cache remembers exactly the (document, key)
+ * pairs we tell it about, and that it survives a save and reload. */
+static void
+test_dir_sigcache(void *arg)
+{
+  crypto_pk_env_t *pk1 = NULL, *pk2 = NULL;
+  char d1[DIGEST_LEN], d2[DIGEST256_LEN];
+  char *fname = NULL;
+  (void)arg;
+
+  /* Start from nothing, whatever earlier tests have verified. */
+  sigcache_free_all();
+  pk1 = pk_generate(0);
+  pk2 = pk_generate(1);
+  crypto_rand(d1, sizeof(d1));
+  crypto_rand(d2, sizeof(d2));
+
+  test_eq(0, sigcache_lookup(d1, DIGEST_LEN, pk1));
+  sigcache_add(d1, DIGEST_LEN, pk1);
+  test_eq(1, sigcache_lookup(d1, DIGEST_LEN, pk1));
+  /* Another key, or another document, isn't in the cache. */
+  test_eq(0, sigcache_lookup(d1, DIGEST_LEN, pk2));
+  test_eq(0, sigcache_lookup(d2, DIGEST_LEN, pk1));
+  sigcache_add(d2, DIGEST256_LEN, pk2);
+  test_eq(1, sigcache_lookup(d2, DIGEST256_LEN, pk2));
+  test_eq(0, sigcache_lookup(d2, DIGEST_LEN, pk2));
+  test_eq(2, sigcache_size());
+
+  /* Save it, forget it, and get it back. */
+  test_eq(0, sigcache_save(time(NULL), 1));
+  sigcache_free_all();
+  test_eq(0, sigcache_lookup(d1, DIGEST_LEN, pk1));
+  test_eq(0, sigcache_load());
+  test_eq(2, sigcache_size());
+  test_eq(1, sigcache_lookup(d1, DIGEST_LEN, pk1));
+  test_eq(1, sigcache_lookup(d2, DIGEST256_LEN, pk2));
+  test_eq(0, sigcache_lookup(d1, DIGEST_LEN, pk2));
+
+  /* A damaged cache file gets ignored. */
+  sigcache_free_all();
+  fname = get_datadir_fname("cached-sigcache");
+  test_eq(0, write_str_to_file(fname, "tor-sigcache-v1\nshort", 1));
+  test_eq(-1, sigcache_load());
+  test_eq(0, sigcache_size());
+
+ done:
+  sigcache_free_all();
+  tor_free(fname);
+  if (pk1)
+    crypto_free_pk_env(pk1);
+  if (pk2)
+    crypto_free_pk_env(pk2);
+}
+
+/** Check that router_check_uploaded_signatures() finds the good signatures
+ * on an uploaded router descriptor and its extra-info document, and only
+ * those. */
+static void
+test_dir_upload_sigs(void *arg)
+{
+  crypto_pk_env_t *pk1 = NULL, *pk2 = NULL;
+  routerinfo_t *r1 = NULL;
+  extrainfo_t *ei = NULL;
+  char buf[8192], digest[DIGEST_LEN];
+  char *ei_str = NULL, *body = NULL, *cp;
+  smartlist_t *digests = smartlist_create(), *keys = smartlist_create();
+  (void)arg;
+
+  pk1 = pk_generate(0);
+  pk2 = pk_generate(1);
+  hibernate_set_state_for_testing_(HIBERNATE_STATE_LIVE);
+
+  r1 = tor_malloc_zero(sizeof(routerinfo_t));
+  r1->address = tor_strdup("18.244.0.1");
+  r1->addr = 0xc0a80001u; /* 192.168.0.1 */
+  r1->cache_info.published_on = time(NULL);
+  r1->or_port = 9000;
+  r1->onion_pkey = crypto_pk_dup_key(pk1);
+  r1->identity_pkey = crypto_pk_dup_key(pk2);
+  r1->bandwidthrate = 1000;
+  r1->bandwidthburst = 5000;
+  r1->bandwidthcapacity = 10000;
+  r1->nickname = tor_strdup("Magri");
+  r1->platform = tor_strdup("Tor "VERSION);
+  test_assert(router_dump_router_to_string(buf, sizeof(buf), r1, pk2) > 0);
+
+  ei = tor_malloc_zero(sizeof(extrainfo_t));
+  strlcpy(ei->nickname, "Magri", sizeof(ei->nickname));
+  crypto_pk_get_digest(pk2, ei->cache_info.identity_digest);
+  ei->cache_info.published_on = r1->cache_info.published_on;
+  test_eq(0, extrainfo_dump_to_string(&ei_str, ei, pk2));
+  tor_asprintf(&body, "%s%s", buf, ei_str);
+
+  /* Both signatures are good, and made by pk2. */
+  router_check_uploaded_signatures(body, strlen(body), digests, keys);
+  test_eq(2, smartlist_len(digests));
+  test_eq(2, smartlist_len(keys));
+  test_eq(0, router_get_router_hash(buf, strlen(buf), digest));
+  test_memeq(digest, smartlist_get(digests, 0), DIGEST_LEN);
+  test_eq(0, router_get_extrainfo_hash(ei_str, digest));
+  test_memeq(digest, smartlist_get(digests, 1), DIGEST_LEN);
+  test_eq(0, crypto_pk_cmp_keys(pk2, smartlist_get(keys, 0)));
+  test_eq(0, crypto_pk_cmp_keys(pk2, smartlist_get(keys, 1)));
+  SMARTLIST_FOREACH(digests, char *, d, tor_free(d));
+  SMARTLIST_FOREACH(keys, crypto_pk_env_t *, k, crypto_free_pk_env(k));
+  smartlist_clear(digests);
+  smartlist_clear(keys);
+
+  /* Without its router descriptor, we have no key for the extra-info. */
+  router_check_uploaded_signatures(ei_str, strlen(ei_str), digests, keys);
+  test_eq(0, smartlist_len(digests));
+
+  /* A changed descriptor isn't good, and can't vouch for its extra-info. */
+  cp = strstr(body, "bandwidth 1000");
+  test_assert(cp);
+  cp[strlen("bandwidth ")] = '2';
+  router_check_uploaded_signatures(body, strlen(body), digests, keys);
+  test_eq(0, smartlist_len(digests));
+  test_eq(0, smartlist_len(keys));
+
+ done:
+  SMARTLIST_FOREACH(digests, char *, d, tor_free(d));
+  SMARTLIST_FOREACH(keys, crypto_pk_env_t *, k, crypto_free_pk_env(k));
+  smartlist_free(digests);
+  smartlist_free(keys);
+  if (r1)
+    routerinfo_free(r1);
+  if (ei)
+    extrainfo_free(ei);
+  tor_free(ei_str);
+  tor_free(body);
+  if (pk1)
+    crypto_free_pk_env(pk1);
+  if (pk2)
+    crypto_free_pk_env(pk2);
+}
+
+/** Check that a Walker alias table gives each index its share of the
+ * weight. */
+static void
+test_dir_alias_table(void *arg)
+{
+  double weights[] = { 1, 2, 3, 4, 0, 10 };
+  double prob[6], share[6];
+  int alias[6], i;
+  (void)arg;
+
+  bw_alias_table_build(weights, 6, prob, alias);
+  for (i = 0; i < 6; ++i)
+    share[i] = 0;
+  for (i = 0; i < 6; ++i) {
+    tt_assert(prob[i] >= 0 && prob[i] <= 1.0);
+    share[i] += prob[i] / 6;
+    share[alias[i]] += (1.0 - prob[i]) / 6;
+  }
+  for (i = 0; i < 6; ++i) {
+    tt_assert(share[i] > weights[i]/20 - 1e-9);
+    tt_assert(share[i] < weights[i]/20 + 1e-9);
+  }
+
+ done:
+  ;
+}
+
+/** Check that descriptor requests get sized by how quickly recent ones
+ * came back. */
+static void
+test_dir_desc_fetch_stats(void *arg)
+{
+  int md = DIR_PURPOSE_FETCH_MICRODESC, sd = DIR_PURPOSE_FETCH_SERVERDESC;
+  int fast_batch, i;
+  (void)arg;
+
+  router_descriptor_fetch_stats_clear();
+  tt_int_op(router_descriptor_fetch_batch_size(md), ==, 0);
+  tt_assert(router_get_descriptor_fetch_rate(md) == 0.0);
+
+  /* 50 descriptors, 20000 bytes, 2 seconds: 10000 bytes/sec and 400
+   * bytes each, so 5 seconds' worth is 125 descriptors. */
+  router_note_descriptor_fetch(md, 50, 20000, 2000000);
+  tt_int_op(router_descriptor_fetch_batch_size(md), ==, 125);
+  tt_assert(router_get_descriptor_fetch_rate(md) == 10000.0);
+  /* The other kind hasn't learned anything. */
+  tt_int_op(router_descriptor_fetch_batch_size(sd), ==, 0);
+
+  /* Fetches that get nothing teach us nothing. */
+  router_note_descriptor_fetch(md, 0, 20000, 2000000);
+  tt_int_op(router_descriptor_fetch_batch_size(md), ==, 125);
+
+  /* Slow answers shrink the batches, but never below one. */
+  fast_batch = router_descriptor_fetch_batch_size(md);
+  router_note_descriptor_fetch(md, 50, 20000, 20000000);
+  tt_int_op(router_descriptor_fetch_batch_size(md), <, fast_batch);
+  for (i = 0; i < 50; ++i)
+    router_note_descriptor_fetch(md, 1, 400, 600000000);
+  tt_int_op(router_descriptor_fetch_batch_size(md), ==, 1);
+
+  router_descriptor_fetch_stats_clear();
+  tt_int_op(router_descriptor_fetch_batch_size(md), ==, 0);
+
+ done:
+  router_descriptor_fetch_stats_clear();
+}
+
+/** Check that we recognize our consensus digests in If-None-Match
+ * headers. */
+static void
+test_dir_etag_match(void *arg)
+{
+  char digest[DIGEST256_LEN], hex[HEX_DIGEST256_LEN+1], *hdr = NULL;
+  (void)arg;
+
+  crypto_digest256(digest, "abc", 3, DIGEST_SHA256);
+  base16_encode(hex, sizeof(hex), digest, DIGEST256_LEN);
+
+  tor_asprintf(&hdr, "\"%s\"", hex);
+  tt_assert(http_etag_list_matches(hdr, digest));
+  tor_free(hdr);
+  tor_asprintf(&hdr, "\"%s\", W/\"%s\"", "0123", hex);
+  tt_assert(http_etag_list_matches(hdr, digest));
+  tor_free(hdr);
+  /* Unquoted and truncated tags don't count. */
+  tt_assert(!http_etag_list_matches(hex, digest));
+  tor_asprintf(&hdr, "\"%.*s\"", HEX_DIGEST256_LEN-2, hex);
+  tt_assert(!http_etag_list_matches(hdr, digest));
+  tor_free(hdr);
+  tt_assert(!http_etag_list_matches("", digest));
+  tt_assert(http_etag_list_matches(" * ", digest));
+
+  digest[0] ^= 1;
+  tor_asprintf(&hdr, "\"%s\"", hex);
+  tt_assert(!http_etag_list_matches(hdr, digest));
+
+ done:
+  tor_free(hdr);
+}
+
+/** Helper: return a newly allocated consensus-like document with a router
+ * entry for every i in [0,n) where skip is false, whose bandwidth is
+ * i+<b>bw_offset</b>, and a signature line ending in <b>sig</b>. */
+static char *
+make_fake_consensus(const char *valid_after, int n, int skip_mod,
+                    int bw_offset, const char *sig)
+{
+  smartlist_t *chunks = smartlist_create();
+  char *result, *cp;
+  int i;
+  tor_asprintf(&cp, "network-status-version 3\nvote-status consensus\n"
+               "valid-after %s\nknown-flags Fast Running Valid\n", valid_after);
+  smartlist_add(chunks, cp);
+  for (i = 0; i < n; ++i) {
+    if (skip_mod && i % skip_mod == 0)
+      continue;
+    tor_asprintf(&cp, "r router%d AAAAAAAAAAAAAAAAAAAA%04d x 2011-01-01 "
+                 "00:00:00 10.0.0.1 9001 0\ns Fast Running%s\n"
+                 "v Tor 0.2.3.1\nw Bandwidth=%d\n", i, i,
+                 (i%3) ? " Valid" : "", i+bw_offset);
+    smartlist_add(chunks, cp);
+  }
+  tor_asprintf(&cp, "directory-footer\ndirectory-signature A B\n"
+               "-----BEGIN SIGNATURE-----\n%s\n-----END SIGNATURE-----\n",
+               sig);
+  smartlist_add(chunks, cp);
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, c, tor_free(c));
+  smartlist_free(chunks);
+  return result;
+}
+
+static void
+test_dir_consdiff(void *arg)
+{
+  char *base = NULL, *base2 = NULL, *target = NULL;
+  char *diff = NULL, *applied = NULL, *cp;
+  (void)arg;
+
+  /* Some routers leave, some arrive, and a few change bandwidth. */
+  base = make_fake_consensus("2011-01-01 00:00:00", 500, 7, 0, "sig1");
+  target = make_fake_consensus("2011-01-01 01:00:00", 520, 11, 0, "sig2");
+  cp = strstr(target, "Bandwidth=100\n");
+  tt_assert(cp);
+  memcpy(cp, "Bandwidth=999", strlen("Bandwidth=999"));
+
+  diff = consdiff_gen_diff(base, target);
+  tt_assert(diff);
+  tt_assert(consdiff_is_diff(diff));
+  tt_assert(!consdiff_is_diff(target));
+  tt_int_op(strlen(diff), <, strlen(target)/4);
+  applied = consdiff_apply_diff(base, diff);
+  test_streq(applied, target);
+  tor_free(applied);
+
+  /* The base's signatures don't matter... */
+  base2 = make_fake_consensus("2011-01-01 00:00:00", 500, 7, 0, "other");
+  applied = consdiff_apply_diff(base2, diff);
+  test_streq(applied, target);
+  tor_free(applied);
+  tor_free(base2);
+
+  /* ...but the rest of it does. */
+  base2 = make_fake_consensus("2011-01-01 00:00:00", 500, 7, 1, "sig1");
+  tt_assert(!consdiff_apply_diff(base2, diff));
+  tt_assert(!consdiff_apply_diff(target, diff));
+
+  /* A diff that has been tampered with gets caught. */
+  cp = strstr(diff, "Bandwidth=999");
+  tt_assert(cp);
+  cp[strlen("Bandwidth=")] = '8';
+  tt_assert(!consdiff_apply_diff(base, diff));
+  tor_free(diff);
+
+  /* Everything changes at once. */
+  tor_free(base2);
+  base2 = make_fake_consensus("2011-01-01 02:00:00", 300, 0, 5, "sig3");
+  diff = consdiff_gen_diff(base, base2);
+  tt_assert(diff);
+  applied = consdiff_apply_diff(base, diff);
+  test_streq(applied, base2);
+  tor_free(applied);
+
+  /* Garbage is not a diff. */
+  tt_assert(!consdiff_apply_diff(base, "network-status-diff-version 1\n"
+                                 "hash 00 11\n"));
+  tt_assert(!consdiff_gen_diff("not a consensus\n", base));
+
+ done:
+  tor_free(base);
+  tor_free(base2);
+  tor_free(target);
+  tor_free(diff);
+  tor_free(applied);
+}
+
+static void
+test_dir_body_stream(void *arg)
+{
+  const char *ok_hdr = "HTTP/1.0 200 OK\r\nContent-Encoding: deflate\r\n\r\n";
+  char *doc = NULL, *z = NULL, *headers = NULL, *body = NULL;
+  size_t doc_len, z_len, body_len, raw_len, i;
+  int decompressed = 0;
+  dir_body_stream_t *stream = NULL;
+  (void)arg;
+
+  doc = make_fake_consensus("2011-01-01 00:00:00", 200, 0, 0, "sig1");
+  doc_len = strlen(doc);
+  tt_assert(!tor_gzip_compress(&z, &z_len, doc, doc_len, ZLIB_METHOD));
+
+  /* A compressed body that trickles in a byte at a time. */
+  stream = dir_body_stream_new(tor_strdup(ok_hdr), 1);
+  for (i = 0; i < z_len; ++i)
+    tt_int_op(0, ==, dir_body_stream_add(stream, z+i, 1));
+  tt_int_op(0, ==, dir_body_stream_finish(stream, &headers, &body, &body_len,
+                                          &raw_len, &decompressed));
+  stream = NULL;
+  test_streq(headers, ok_hdr);
+  tt_int_op(body_len, ==, doc_len);
+  test_streq(body, doc);
+  tt_int_op(raw_len, ==, z_len);
+  tt_int_op(decompressed, ==, 1);
+  tor_free(headers);
+  tor_free(body);
+
+  /* A body that claims to be compressed but isn't gets kept verbatim. */
+  stream = dir_body_stream_new(tor_strdup(ok_hdr), 1);
+  tt_int_op(0, ==, dir_body_stream_add(stream, doc, 1000));
+  tt_int_op(0, ==, dir_body_stream_add(stream, doc+1000, doc_len-1000));
+  tt_int_op(0, ==, dir_body_stream_finish(stream, &headers, &body, &body_len,
+                                          &raw_len, &decompressed));
+  stream = NULL;
+  test_streq(body, doc);
+  tt_int_op(decompressed, ==, 0);
+  tor_free(headers);
+  tor_free(body);
+
+  /* So does an error response, and a very short body. */
+  stream = dir_body_stream_new(tor_strdup("HTTP/1.0 404 Not found\r\n"
+                                          "Content-Encoding: deflate\r\n"
+                                          "\r\n"), 1);
+  tt_int_op(0, ==, dir_body_stream_add(stream, z, 3));
+  tt_int_op(0, ==, dir_body_stream_finish(stream, &headers, &body, &body_len,
+                                          &raw_len, &decompressed));
+  stream = NULL;
+  tt_int_op(body_len, ==, 3);
+  test_memeq(body, z, 3);
+  tt_int_op(decompressed, ==, 0);
+  tor_free(headers);
+  tor_free(body);
+
+  /* A truncated compressed body is an error. */
+  stream = dir_body_stream_new(tor_strdup(ok_hdr), 1);
+  tt_int_op(0, ==, dir_body_stream_add(stream, z, z_len/2));
+  tt_int_op(-1, ==, dir_body_stream_finish(stream, &headers, &body,
+                                           &body_len, &raw_len,
+                                           &decompressed));
+  stream = NULL;
+  tt_assert(!headers);
+  tt_assert(!body);
+
+  /* A kept-open response is complete once Content-Length bytes are in. */
+  tor_asprintf(&headers, "HTTP/1.0 200 OK\r\nContent-Length: %d\r\n"
+               "Connection: keep-alive\r\n\r\n", (int)z_len);
+  stream = dir_body_stream_new(headers, 0);
+  headers = NULL;
+  tt_assert(!dir_body_stream_is_complete(stream));
+  tt_int_op(0, ==, dir_body_stream_add(stream, z, z_len-1));
+  tt_assert(!dir_body_stream_is_complete(stream));
+  tt_int_op(0, ==, dir_body_stream_add(stream, z+z_len-1, 1));
+  tt_assert(dir_body_stream_is_complete(stream));
+  tt_int_op(0, ==, dir_body_stream_finish(stream, &headers, &body, &body_len,
+                                          &raw_len, &decompressed));
+  stream = NULL;
+  tt_int_op(body_len, ==, z_len);
+  tt_int_op(decompressed, ==, 0);
+  tor_free(headers);
+  tor_free(body);
+
+  /* So is an empty one; but without keep-alive we read until EOF. */
+  stream = dir_body_stream_new(tor_strdup("HTTP/1.0 304 Not modified\r\n"
+                                          "Connection: keep-alive\r\n"
+                                          "Content-Length: 0\r\n\r\n"), 1);
+  tt_assert(dir_body_stream_is_complete(stream));
+  dir_body_stream_free(stream);
+  stream = dir_body_stream_new(tor_strdup("HTTP/1.0 304 Not modified\r\n"
+                                          "Content-Length: 0\r\n\r\n"), 1);
+  tt_assert(!dir_body_stream_is_complete(stream));
+
+ done:
+  dir_body_stream_free(stream);
+  tor_free(doc);
+  tor_free(z);
+  tor_free(headers);
+  tor_free(body);
+}
+
+/** Helper: pretend that a download of the "ns" consensus whose compressed
+ * form is the <b>z_len</b> bytes at <b>z</b> broke off at <b>now</b> after
+ * <b>n</b> bytes.  Return what dir_partial_download_save() says. */
+static int
+save_partial_download(const char *z, size_t z_len, size_t n, time_t now)
+{
+  char *hdr = NULL;
+  dir_body_stream_t *stream;
+  int r;
+  tor_asprintf(&hdr, "HTTP/1.0 200 OK\r\nContent-Encoding: deflate\r\n"
+               "ETag: \"abcd\"\r\nContent-Length: %lu\r\n\r\n",
+               (unsigned long)z_len);
+  stream = dir_body_stream_new(hdr, 1);
+  if (dir_body_stream_add(stream, z, n) < 0)
+    r = -1;
+  else
+    r = dir_partial_download_save("ns", stream, now);
+  if (r != 1)
+    dir_body_stream_free(stream);
+  return r;
+}
+
+/** Helper: return a newly allocated 206 response header for bytes
+ * <b>start</b> onward of the <b>total</b>-byte document tagged
+ * <b>etag</b>. */
+static char *
+partial_response_header(const char *etag, size_t start, size_t total)
+{
+  char *hdr = NULL;
+  tor_asprintf(&hdr, "HTTP/1.0 206 Partial Content\r\n"
+               "Content-Encoding: deflate\r\nETag: \"%s\"\r\n"
+               "Content-Range: bytes %lu-%lu/%lu\r\n\r\n", etag,
+               (unsigned long)start, (unsigned long)total-1,
+               (unsigned long)total);
+  return hdr;
+}
+
+/** Check that a consensus download that breaks off partway can pick up
+ * where it left off, and only when the rest is really the rest. */
+static void
+test_dir_range_resume(void *arg)
+{
+  char *doc = NULL, *z = NULL, *headers = NULL, *body = NULL, *hdr = NULL;
+  size_t doc_len, z_len, body_len, raw_len, start, end, total, half;
+  int decompressed = 0;
+  dir_body_stream_t *stream = NULL;
+  time_t now = time(NULL);
+  (void)arg;
+
+  /* What we serve, and what we understand. */
+  tt_int_op(0, ==, http_parse_range_start("bytes=1234-", &start));
+  tt_int_op(start, ==, 1234);
+  tt_int_op(-1, ==, http_parse_range_start("bytes=1234-2000", &start));
+  tt_int_op(-1, ==, http_parse_range_start("bytes=-500", &start));
+  tt_int_op(-1, ==, http_parse_range_start("bytes=1-,5-", &start));
+  tt_int_op(-1, ==, http_parse_range_start("lines=3-", &start));
+  tt_int_op(0, ==, http_parse_content_range("bytes 10-99/100",
+                                            &start, &end, &total));
+  tt_int_op(start, ==, 10);
+  tt_int_op(end, ==, 100);
+  tt_int_op(total, ==, 100);
+  tt_int_op(-1, ==, http_parse_content_range("bytes 10-99/99",
+                                             &start, &end, &total));
+  tt_int_op(-1, ==, http_parse_content_range("bytes 10-9/100",
+                                             &start, &end, &total));
+  tt_int_op(-1, ==, http_parse_content_range("bytes */100",
+                                             &start, &end, &total));
+  tt_int_op(-1, ==, http_parse_content_range("bytes 0-9/100 x",
+                                             &start, &end, &total));
+
+  doc = make_fake_consensus("2011-01-01 00:00:00", 10000, 0, 0, "sig1");
+  doc_len = strlen(doc);
+  tt_assert(!tor_gzip_compress(&z, &z_len, doc, doc_len, ZLIB_METHOD));
+  half = z_len / 2;
+  tt_int_op(half, >, 32768);
+
+  /* Too little isn't worth keeping. */
+  tt_int_op(0, ==, save_partial_download(z, z_len, 1000, now));
+
+  /* A full response to a later request makes us forget what we kept. */
+  tt_int_op(1, ==, save_partial_download(z, z_len, half, now));
+  hdr = tor_strdup("HTTP/1.0 200 OK\r\n\r\n");
+  tt_ptr_op(NULL, ==, dir_partial_download_resume("ns", hdr, now));
+  tor_free(hdr);
+  hdr = partial_response_header("abcd", half, z_len);
+  tt_ptr_op(NULL, ==, dir_partial_download_resume("ns", hdr, now));
+  tor_free(hdr);
+
+  /* So does the wrong part, or part of the wrong document. */
+  tt_int_op(1, ==, save_partial_download(z, z_len, half, now));
+  hdr = partial_response_header("abcd", half+1, z_len);
+  tt_ptr_op(NULL, ==, dir_partial_download_resume("ns", hdr, now));
+  tor_free(hdr);
+  tt_int_op(1, ==, save_partial_download(z, z_len, half, now));
+  hdr = partial_response_header("abce", half, z_len);
+  tt_ptr_op(NULL, ==, dir_partial_download_resume("ns", hdr, now));
+  tor_free(hdr);
+
+  /* We only resume the same flavor, and not once it's stale. */
+  tt_int_op(1, ==, save_partial_download(z, z_len, half, now));
+  hdr = partial_response_header("abcd", half, z_len);
+  tt_ptr_op(NULL, ==, dir_partial_download_resume("microdesc", hdr, now));
+  tt_ptr_op(NULL, ==, dir_partial_download_resume("ns", hdr,
+                                                  now + 24*60*60));
+
+  /* The right part of the right document picks up where we left off. */
+  tt_int_op(1, ==, save_partial_download(z, z_len, half, now));
+  stream = dir_partial_download_resume("ns", hdr, now);
+  tt_assert(stream);
+  hdr = NULL;
+  tt_int_op(0, ==, dir_body_stream_add(stream, z+half, z_len-half));
+  tt_int_op(0, ==, dir_body_stream_finish(stream, &headers, &body, &body_len,
+                                          &raw_len, &decompressed));
+  stream = NULL;
+  tt_assert(!strcmpstart(headers, "HTTP/1.0 206"));
+  tt_int_op(body_len, ==, doc_len);
+  test_streq(body, doc);
+  tt_int_op(raw_len, ==, z_len);
+  tt_int_op(decompressed, ==, 1);
+  /* Once we've used it, it's gone. */
+  tt_ptr_op(NULL, ==, dir_partial_download_resume("ns", headers, now));
+
+ done:
+  directory_free_all();
+  dir_body_stream_free(stream);
+  tor_free(doc);
+  tor_free(z);
+  tor_free(hdr);
+  tor_free(headers);
+  tor_free(body);
+}
+
+/** Check that spooling connections share the spool buffer budget. */
+static void
+test_dir_spool_budget(void *arg)
+{
+  dir_connection_t *conns[40];
+  uint64_t old_limit = get_options()->DirSpoolBufferLimit;
+  int i;
+  (void)arg;
+
+  memset(conns, 0, sizeof(conns));
+  get_options_mutable()->DirSpoolBufferLimit = 128*1024;
+  tt_int_op(dirserv_spool_buffer_target(), ==, 16384);
+  tt_assert(!dirserv_spool_is_congested());
+
+  for (i = 0; i < 40; ++i) {
+    conns[i] = tor_malloc_zero(sizeof(dir_connection_t));
+    conns[i]->dir_spool_src = DIR_SPOOL_CACHED_DIR;
+    connection_dirserv_count_spooling(conns[i]);
+    /* Counting a connection twice does nothing. */
+    connection_dirserv_count_spooling(conns[i]);
+    if (i == 7) {
+      /* Eight connections fit in the budget... */
+      tt_int_op(dirserv_spool_buffer_target(), ==, 16384);
+    } else if (i == 15) {
+      /* ... but sixteen have to share it ... */
+      tt_int_op(dirserv_spool_buffer_target(), ==, 8192);
+      tt_assert(dirserv_spool_is_congested());
+    }
+  }
+  /* ... and however many there are, each gets a little. */
+  tt_int_op(dirserv_spool_buffer_target(), ==, 4096);
+
+  /* Connections stop counting when they're done or closed. */
+  for (i = 0; i < 20; ++i) {
+    conns[i]->dir_spool_src = DIR_SPOOL_NONE;
+    connection_dirserv_count_spooling(conns[i]);
+  }
+  for (i = 20; i < 32; ++i)
+    connection_dirserv_stop_spooling(conns[i]);
+  tt_int_op(dirserv_spool_buffer_target(), ==, 16384);
+  tt_assert(!dirserv_spool_is_congested());
+
+ done:
+  for (i = 0; i < 40; ++i) {
+    if (conns[i])
+      connection_dirserv_stop_spooling(conns[i]);
+    tor_free(conns[i]);
+  }
+  get_options_mutable()->DirSpoolBufferLimit = old_limit;
+}
+
+/** Check that splitting routerstatus entries into chunks gives the same
+ * entries, in the same order, as parsing them one by one. */
+static void
+test_dir_parallel_routerstatus(void *arg)
+{
+  networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+  smartlist_t *chunks = smartlist_create(), *tokens = smartlist_create();
+  memarea_t *area = memarea_new();
+  char *body = NULL, *cp;
+  const char *s;
+  char id[DIGEST_LEN], id64[BASE64_DIGEST_LEN+1];
+  int i;
+  (void)arg;
+
+  ns->type = NS_TYPE_CONSENSUS;
+  ns->consensus_method = 11;
+  ns->routerstatus_list = smartlist_create();
+  for (i = 0; i < 1200; ++i) {
+    memset(id, 0, sizeof(id));
+    set_uint32(id, htonl(i));
+    digest_to_base64(id64, id);
+    /* Entry 500 has a bad address, and should be dropped. */
+    tor_asprintf(&cp, "r relay%d %s %s 2011-10-01 00:00:00 %s 9001 0\n"
+                 "s Fast Running\n", i, id64, id64,
+                 i == 500 ? "1.2.3" : "10.0.0.1");
+    smartlist_add(chunks, cp);
+  }
+  smartlist_add(chunks, tor_strdup("directory-footer\n"));
+  body = smartlist_join_strings(chunks, "", 0, NULL);
+
+  /* With one thread, or too few entries, we don't split anything. */
+  s = body;
+  tt_int_op(-1, ==, routerstatus_parse_entries_parallel(ns, &s, area, tokens,
+                                                        FLAV_NS, 1));
+  tt_ptr_op(s, ==, body);
+  s = strstr(body, "r relay1000 ");
+  tt_int_op(-1, ==, routerstatus_parse_entries_parallel(ns, &s, area, tokens,
+                                                        FLAV_NS, 4));
+  tt_int_op(0, ==, smartlist_len(ns->routerstatus_list));
+
+  /* We have no cpuworkers here, so we parse every chunk ourselves. */
+  s = body;
+  tt_int_op(0, ==, routerstatus_parse_entries_parallel(ns, &s, area, tokens,
+                                                       FLAV_NS, 4));
+  tt_str_op(s, ==, "directory-footer\n");
+  tt_int_op(1199, ==, smartlist_len(ns->routerstatus_list));
+  for (i = 0; i < 1199; ++i) {
+    routerstatus_t *rs = smartlist_get(ns->routerstatus_list, i);
+    char nickname[MAX_NICKNAME_LEN+1];
+    tor_snprintf(nickname, sizeof(nickname), "relay%d", i < 500 ? i : i+1);
+    tt_str_op(rs->nickname, ==, nickname);
+    tt_int_op(rs->addr, ==, 0x0a000001);
+    tt_assert(rs->is_fast);
+  }
+
+ done:
+  SMARTLIST_FOREACH(chunks, char *, c, tor_free(c));
+  smartlist_free(chunks);
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+  networkstatus_vote_free(ns);
+  tor_free(body);
+}
+
+/** Check that consensus snapshots round-trip, and that we refuse any that
+ * doesn't match the consensus we ask about. */
+static void
+test_dir_consensus_snapshot(void *arg)
+{
+  smartlist_t *rs_list = smartlist_create(), *got = NULL;
+  char digest[DIGEST256_LEN], other[DIGEST256_LEN];
+  char *body = NULL;
+  size_t len = 0;
+  int i;
+  (void)arg;
+
+  memset(digest, 0x11, sizeof(digest));
+  memset(other, 0x22, sizeof(other));
+  for (i = 0; i < 10; ++i) {
+    routerstatus_t *rs = tor_malloc_zero(sizeof(routerstatus_t));
+    tor_snprintf(rs->nickname, sizeof(rs->nickname), "relay%d", i);
+    memset(rs->identity_digest, i, DIGEST_LEN);
+    rs->addr = 0x0a000000 + i;
+    rs->or_port = 9001;
+    rs->is_fast = i % 2;
+    rs->bandwidth = 100 * i;
+    rs->last_dir_503_at = 12345;
+    if (i % 3 == 0) {
+      rs->has_exitsummary = 1;
+      tor_asprintf(&rs->exitsummary, "accept %d", i);
+    }
+    smartlist_add(rs_list, rs);
+  }
+
+  body = networkstatus_snapshot_encode(rs_list, FLAV_NS, digest, &len);
+  tt_assert(body);
+
+  /* Wrong digest, wrong flavor, or a truncated snapshot: no luck. */
+  tt_ptr_op(NULL, ==, networkstatus_snapshot_decode(body, len, FLAV_NS,
+                                                    other));
+  tt_ptr_op(NULL, ==, networkstatus_snapshot_decode(body, len,
+                                                    FLAV_MICRODESC, digest));
+  tt_ptr_op(NULL, ==, networkstatus_snapshot_decode(body, len-1, FLAV_NS,
+                                                    digest));
+  tt_ptr_op(NULL, ==, networkstatus_snapshot_decode(body, 10, FLAV_NS,
+                                                    digest));
+
+  got = networkstatus_snapshot_decode(body, len, FLAV_NS, digest);
+  tt_assert(got);
+  tt_int_op(10, ==, smartlist_len(got));
+  for (i = 0; i < 10; ++i) {
+    routerstatus_t *a = smartlist_get(rs_list, i);
+    routerstatus_t *b = smartlist_get(got, i);
+    tt_str_op(a->nickname, ==, b->nickname);
+    test_memeq(a->identity_digest, b->identity_digest, DIGEST_LEN);
+    tt_int_op(a->addr, ==, b->addr);
+    tt_int_op(a->or_port, ==, b->or_port);
+    tt_int_op(a->is_fast, ==, b->is_fast);
+    tt_int_op(a->bandwidth, ==, b->bandwidth);
+    tt_int_op(0, ==, b->last_dir_503_at);
+    if (a->exitsummary)
+      tt_str_op(a->exitsummary, ==, b->exitsummary);
+    else
+      tt_ptr_op(NULL, ==, b->exitsummary);
+  }
+
+ done:
+  SMARTLIST_FOREACH(rs_list, routerstatus_t *, rs, routerstatus_free(rs));
+  smartlist_free(rs_list);
+  if (got) {
+    SMARTLIST_FOREACH(got, routerstatus_t *, rs, routerstatus_free(rs));
+    smartlist_free(got);
+  }
+  tor_free(body);
+}
+
+static void
+test_dir_measured_bw_cache(void *arg)
+{
+  smartlist_t *rs_list = smartlist_create();
+  routerstatus_t *rs[3];
+  char hex1[HEX_DIGEST_LEN+1], hex2[HEX_DIGEST_LEN+1];
+  char hex3[HEX_DIGEST_LEN+1];
+  char *body = NULL;
+  const char *fname = get_fname("v3bw");
+  time_t now = time(NULL);
+  int i;
+  (void)arg;
+
+  for (i = 0; i < 3; ++i) {
+    rs[i] = tor_malloc_zero(sizeof(routerstatus_t));
+    memset(rs[i]->identity_digest, i+1, DIGEST_LEN);
+    smartlist_add(rs_list, rs[i]);
+  }
+  base16_encode(hex1, sizeof(hex1), rs[0]->identity_digest, DIGEST_LEN);
+  base16_encode(hex2, sizeof(hex2), rs[1]->identity_digest, DIGEST_LEN);
+  base16_encode(hex3, sizeof(hex3), rs[2]->identity_digest, DIGEST_LEN);
+
+  /* No file, no measurements. */
+  unlink(fname);
+  tt_int_op(-1, ==, dirserv_read_measured_bandwidths(fname, rs_list));
+
+  tor_asprintf(&body, "%ld\nnode_id=$%s bw=100\nbogus line\n"
+               "node_id=$%s bw=300\n", (long)now, hex1, hex3);
+  tt_int_op(0, ==, write_str_to_file(fname, body, 0));
+  tor_free(body);
+  tt_int_op(0, ==, dirserv_read_measured_bandwidths(fname, rs_list));
+  tt_assert(rs[0]->has_measured_bw);
+  tt_int_op(rs[0]->measured_bw, ==, 100);
+  tt_assert(!rs[1]->has_measured_bw);
+  tt_assert(rs[2]->has_measured_bw);
+  tt_int_op(rs[2]->measured_bw, ==, 300);
+
+  /* A changed file gets read again, even within the same second. */
+  for (i = 0; i < 3; ++i)
+    rs[i]->has_measured_bw = rs[i]->measured_bw = 0;
+  tor_asprintf(&body, "%ld\nnode_id=$%s bw=20000\n", (long)now, hex2);
+  tt_int_op(0, ==, write_str_to_file(fname, body, 0));
+  tor_free(body);
+  tt_int_op(0, ==, dirserv_read_measured_bandwidths(fname, rs_list));
+  tt_assert(!rs[0]->has_measured_bw);
+  tt_assert(rs[1]->has_measured_bw);
+  tt_int_op(rs[1]->measured_bw, ==, 20000);
+  tt_assert(!rs[2]->has_measured_bw);
+
+  /* Stale measurements don't get used. */
+  rs[1]->has_measured_bw = rs[1]->measured_bw = 0;
+  tor_asprintf(&body, "%ld\nnode_id=$%s bw=5\n", (long)(now - 4*86400),
+               hex2);
+  tt_int_op(0, ==, write_str_to_file(fname, body, 0));
+  tor_free(body);
+  tt_int_op(-1, ==, dirserv_read_measured_bandwidths(fname, rs_list));
+  tt_assert(!rs[1]->has_measured_bw);
+
+ done:
+  tor_free(body);
+  SMARTLIST_FOREACH(rs_list, routerstatus_t *, r, tor_free(r));
+  smartlist_free(rs_list);
+  dirserv_free_all();
+}
+
+static void
+test_dir_sybil_list(void *arg)
+{
+  smartlist_t *routers = smartlist_create();
+  digestmap_t *omit = NULL;
+  char *line = NULL;
+  int i;
+  (void)arg;
+
+  get_options_mutable()->AuthDirMaxServersPerAddr = 2;
+  /* Four routers on one address, with rising bandwidth, and one router on
+   * an address of its own. */
+  for (i = 0; i < 5; ++i) {
+    routerinfo_t *ri = tor_malloc_zero(sizeof(routerinfo_t));
+    memset(ri->cache_info.identity_digest, i+1, DIGEST_LEN);
+    ri->addr = (i == 4) ? 0x05060708 : 0x01020304;
+    ri->bandwidthrate = ri->bandwidthcapacity = 100 * (i+1);
+    smartlist_add(routers, ri);
+  }
+  /* Add them in an order that the address sort has to fix. */
+  smartlist_swap(routers, 0, 4);
+
+  omit = get_possible_sybil_list(routers);
+  tt_int_op(digestmap_size(omit), ==, 2);
+  SMARTLIST_FOREACH(routers, routerinfo_t *, ri, {
+    int omitted = digestmap_get(omit, ri->cache_info.identity_digest) != NULL;
+    /* The two slowest routers on the crowded address go. */
+    tt_int_op(omitted, ==, ri->addr == 0x01020304 &&
+                           ri->bandwidthrate <= 200);
+  });
+  digestmap_free(omit, NULL);
+
+  /* With no limit, nobody gets left out. */
+  get_options_mutable()->AuthDirMaxServersPerAddr = 0;
+  omit = get_possible_sybil_list(routers);
+  tt_int_op(digestmap_size(omit), ==, 0);
+
+  line = dirserv_get_flag_thresholds_line();
+  tt_assert(!strcmpstart(line, "stable-uptime="));
+  tt_assert(strstr(line, " guard-bw-exc-exits="));
+
+ done:
+  get_options_mutable()->AuthDirMaxServersPerAddr = 2;
+  digestmap_free(omit, NULL);
+  tor_free(line);
+  SMARTLIST_FOREACH(routers, routerinfo_t *, ri, tor_free(ri));
+  smartlist_free(routers);
+}
+
 #define DIR_LEGACY(name)                                                   \
   { #name, legacy_test_helper, TT_FORK, &legacy_setup, test_dir_ ## name }
 
 #define DIR(name)                               \
   { #name, test_dir_##name, 0, NULL, NULL }
 
+/** Check that the nodelist's hot fields track the nodes they describe. */
+static void
+test_dir_node_hot_fields(void *arg)
+{
+  routerinfo_t *ri[3];
+  node_t *node[3];
+  const node_hot_fields_t *hot;
+  smartlist_t *sl = smartlist_create();
+  const uint32_t addrs[3] = { 0x0a010001, 0x0a01c802, 0x0a020001 };
+  int i;
+  (void)arg;
+
+  for (i = 0; i < 3; ++i) {
+    ri[i] = tor_malloc_zero(sizeof(routerinfo_t));
+    memset(ri[i]->cache_info.identity_digest, 'a'+i, DIGEST_LEN);
+    ri[i]->addr = addrs[i];
+    ri[i]->or_port = 9001;
+    ri[i]->dir_port = i == 2 ? 9030 : 0;
+    ri[i]->purpose = i == 1 ? ROUTER_PURPOSE_BRIDGE : ROUTER_PURPOSE_GENERAL;
+    node[i] = nodelist_add_routerinfo(ri[i]);
+  }
+  node[0]->is_running = node[0]->is_fast = 1;
+  nodelist_hot_fields_update_node(node[0]);
+
+  hot = nodelist_get_hot_fields();
+  tt_assert(hot);
+  tt_int_op(hot->n, ==, 3);
+  tt_int_op(hot->flags[0], ==, NODE_HOT_RUNNING|NODE_HOT_FAST|
+            NODE_HOT_HAS_DESC|NODE_HOT_GENERAL|NODE_HOT_HAS_IPV4);
+  tt_int_op(hot->flags[1], ==, NODE_HOT_HAS_DESC|NODE_HOT_HAS_IPV4);
+  tt_int_op(hot->flags[2], ==, NODE_HOT_DIR|NODE_HOT_HAS_DESC|
+            NODE_HOT_GENERAL|NODE_HOT_HAS_IPV4);
+  tt_int_op(hot->net16[1], ==, 0x0a01);
+  tt_int_op(hot->bandwidth[0], ==, 0);
+
+  /* A change we're told about shows up right away. */
+  node[2]->is_running = 1;
+  nodelist_hot_fields_update_node(node[2]);
+  tt_assert(hot->flags[2] & NODE_HOT_RUNNING);
+
+  /* Nodes 0 and 1 share a /16; node 2 doesn't. */
+  get_options_mutable()->EnforceDistinctSubnets = 1;
+  nodelist_add_node_and_family(sl, node[0]);
+  tt_assert(smartlist_isin(sl, node[0]));
+  tt_assert(smartlist_isin(sl, node[1]));
+  tt_assert(!smartlist_isin(sl, node[2]));
+
+ done:
+  smartlist_free(sl);
+  nodelist_free_all();
+  for (i = 0; i < 3; ++i)
+    routerinfo_free(ri[i]);
+}
+
 struct testcase_t dir_tests[] = {
   DIR_LEGACY(nicknames),
   DIR_LEGACY(formats),
   DIR_LEGACY(versions),
   DIR_LEGACY(fp_pairs),
   DIR(split_fps),
+  DIR(alias_table),
+  DIR(desc_fetch_stats),
   DIR_LEGACY(measured_bw),
+  DIR(measured_bw_cache),
+  DIR(sybil_list),
   DIR_LEGACY(param_voting),
   DIR_LEGACY(v3_networkstatus),
+  { "sigcache", test_dir_sigcache, TT_FORK, NULL, NULL },
+  { "upload_sigs", test_dir_upload_sigs, TT_FORK, NULL, NULL },
+  DIR(consdiff),
+  DIR(body_stream),
+  DIR(etag_match),
+  DIR(range_resume),
+  DIR(spool_budget),
+  DIR(parallel_routerstatus),
+  DIR(consensus_snapshot),
+  DIR(node_hot_fields),
   END_OF_TESTCASES
 };
 
@@ -2,10 +2,13 @@
 /* See LICENSE for licensing information */
 
 #include "orconfig.h"
+#define MICRODESC_PRIVATE
 #include "or.h"
 
 #include "config.h"
+#include "dirserv.h"
 #include "microdesc.h"
+#include "torgzip.h"
 
 #include "test.h"
 
@@ -213,6 +216,33 @@ test_md_cache(void *data)
   tt_ptr_op(md2, ==, microdesc_cache_lookup_by_digest256(mc, d2));
   tt_ptr_op(NULL, ==, microdesc_cache_lookup_by_digest256(mc, d3));
 
+  /* A compressed batch holds the microdescs we have, in spooling order,
+   * and is shared between requests for the same batch. */
+  {
+    smartlist_t *fps = smartlist_create();
+    cached_dir_t *batch, *batch2;
+    char *out = NULL;
+    size_t out_len = 0;
+    smartlist_add(fps, d1);
+    smartlist_add(fps, d3);
+    smartlist_add(fps, d2);
+    batch = dirserv_get_compressed_spool_batch(DIR_SPOOL_MICRODESC, fps, 1);
+    batch2 = dirserv_get_compressed_spool_batch(DIR_SPOOL_MICRODESC, fps, 1);
+    smartlist_free(fps);
+    tt_assert(batch);
+    tt_ptr_op(batch, ==, batch2);
+    tt_int_op(0, ==, tor_gzip_uncompress(&out, &out_len, batch->dir_z,
+                                         batch->dir_z_len, ZLIB_METHOD, 1,
+                                         LOG_WARN));
+    tt_int_op(out_len, ==, md1->bodylen + md2->bodylen);
+    test_mem_op(out, ==, md2->body, md2->bodylen);
+    test_mem_op(out + md2->bodylen, ==, md1->body, md1->bodylen);
+    tor_free(out);
+    cached_dir_decref(batch);
+    cached_dir_decref(batch2);
+    dirserv_free_all();
+  }
+
  done:
   if (options)
     tor_free(options->DataDirectory);
@@ -226,8 +256,242 @@ test_md_cache(void *data)
   tor_free(fn);
 }
 
+/** Check that we take microdescriptors from a shared cache file without
+ * writing them to our own, and keep any that vanish from the shared file. */
+static void
+test_md_shared_cache(void *data)
+{
+  or_options_t *options = get_options_mutable();
+  microdesc_cache_t *mc = NULL;
+  microdesc_t *md1, *md2, *md3;
+  char d1[DIGEST256_LEN], d2[DIGEST256_LEN], d3[DIGEST256_LEN];
+  const char *test_md3_noannotation = strchr(test_md3, '\n')+1;
+  char *shared_fn = NULL, *fn = NULL, *s = NULL;
+  (void)data;
+
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("md_shared_datadir_test"));
+#ifdef MS_WINDOWS
+  tt_int_op(0, ==, mkdir(options->DataDirectory));
+#else
+  tt_int_op(0, ==, mkdir(options->DataDirectory, 0700));
+#endif
+  crypto_digest256(d1, test_md1, strlen(test_md1), DIGEST_SHA256);
+  crypto_digest256(d2, test_md2, strlen(test_md2), DIGEST_SHA256);
+  crypto_digest256(d3, test_md3_noannotation, strlen(test_md3_noannotation),
+                   DIGEST_SHA256);
+
+  /* The shared file has md1 and md2; our own cache has md2 and md3. */
+  shared_fn = tor_strdup(get_fname("md_shared_cache"));
+  tor_asprintf(&s, "%s%s", test_md1, test_md2);
+  tt_int_op(0, ==, write_str_to_file(shared_fn, s, 1));
+  tor_free(s);
+  tor_asprintf(&fn, "%s"PATH_SEPARATOR"cached-microdescs",
+               options->DataDirectory);
+  tor_asprintf(&s, "%s@last-listed 2011-10-01 00:00:00\n%s", test_md2,
+               test_md3_noannotation);
+  tt_int_op(0, ==, write_str_to_file(fn, s, 1));
+  tor_free(s);
+  options->SharedMicrodescCacheFile = tor_strdup(shared_fn);
+
+  mc = get_microdesc_cache();
+  md1 = microdesc_cache_lookup_by_digest256(mc, d1);
+  md2 = microdesc_cache_lookup_by_digest256(mc, d2);
+  md3 = microdesc_cache_lookup_by_digest256(mc, d3);
+  tt_assert(md1);
+  tt_assert(md2);
+  tt_assert(md3);
+  tt_assert(md1->in_shared_cache);
+  tt_assert(md2->in_shared_cache);
+  tt_assert(!md3->in_shared_cache);
+  tt_int_op(md2->off, ==, strlen(test_md1));
+
+  /* Rebuilding our own cache leaves out what the shared file holds. */
+  tt_int_op(microdesc_cache_rebuild(mc, 1), ==, 0);
+  s = read_file_to_str(fn, RFTS_BIN, NULL);
+  tt_assert(s);
+  tt_assert(!strstr(s, test_md1));
+  tt_assert(!strstr(s, test_md2));
+  tt_assert(strstr(s, test_md3_noannotation));
+  tor_free(s);
+  test_mem_op(md3->body, ==, test_md3_noannotation, md3->bodylen);
+
+  /* When md2 leaves the shared file, we save it ourselves. */
+  tt_int_op(0, ==, write_str_to_file(shared_fn, test_md1, 1));
+  tt_int_op(microdesc_cache_rebuild(mc, 0), ==, 0);
+  tt_ptr_op(md2, ==, microdesc_cache_lookup_by_digest256(mc, d2));
+  tt_assert(md1->in_shared_cache);
+  tt_assert(!md2->in_shared_cache);
+  tt_int_op(md2->saved_location, ==, SAVED_IN_CACHE);
+  test_mem_op(md1->body, ==, test_md1, md1->bodylen);
+  test_mem_op(md2->body, ==, test_md2, md2->bodylen);
+  s = read_file_to_str(fn, RFTS_BIN, NULL);
+  tt_assert(s);
+  tt_assert(!strstr(s, test_md1));
+  tt_assert(strstr(s, test_md2));
+  tt_assert(strstr(s, test_md3_noannotation));
+
+ done:
+  microdesc_free_all();
+  tor_free(options->DataDirectory);
+  tor_free(options->SharedMicrodescCacheFile);
+  tor_free(shared_fn);
+  tor_free(fn);
+  tor_free(s);
+}
+
+/** Check that sealing the journal turns it into a segment we reload,
+ * that last-listed times survive without rewriting annotations, and that
+ * merging folds the segments back into the cache file. */
+static void
+test_md_segments(void *data)
+{
+  or_options_t *options = get_options_mutable();
+  microdesc_cache_t *mc = NULL;
+  smartlist_t *added = NULL;
+  microdesc_t *md1, *md2;
+  char d1[DIGEST256_LEN], d2[DIGEST256_LEN];
+  time_t time1 = 1317427200; /* 2011-10-01 00:00:00 */
+  time_t time2 = time1 + 3600;
+  char *fn = NULL, *seg_fn = NULL, *s = NULL;
+  (void)data;
+
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("md_segments_datadir_test"));
+#ifdef MS_WINDOWS
+  tt_int_op(0, ==, mkdir(options->DataDirectory));
+#else
+  tt_int_op(0, ==, mkdir(options->DataDirectory, 0700));
+#endif
+  crypto_digest256(d1, test_md1, strlen(test_md1), DIGEST_SHA256);
+  crypto_digest256(d2, test_md2, strlen(test_md2), DIGEST_SHA256);
+  tor_asprintf(&fn, "%s"PATH_SEPARATOR"cached-microdescs",
+               options->DataDirectory);
+  tor_asprintf(&seg_fn, "%s.seg1", fn);
+
+  /* md1 is in the cache file; md2 goes to the journal. */
+  tor_asprintf(&s, "@last-listed 2011-10-01 00:00:00\n%s", test_md1);
+  tt_int_op(0, ==, write_str_to_file(fn, s, 1));
+  tor_free(s);
+  mc = get_microdesc_cache();
+  added = microdescs_add_to_cache(mc, test_md2, NULL, SAVED_NOWHERE, 0,
+                                  time1, NULL);
+  tt_int_op(1, ==, smartlist_len(added));
+  smartlist_free(added);
+  added = NULL;
+  md1 = microdesc_cache_lookup_by_digest256(mc, d1);
+  md2 = microdesc_cache_lookup_by_digest256(mc, d2);
+  tt_assert(md1);
+  tt_assert(md2);
+  tt_int_op(md2->saved_location, ==, SAVED_IN_JOURNAL);
+
+  /* Sealing moves md2 into an mmap'd segment without copying it. */
+  md1->last_listed = time2;
+  tt_int_op(0, ==, microdesc_cache_seal_journal(mc));
+  tt_int_op(md2->saved_location, ==, SAVED_IN_CACHE);
+  test_mem_op(md2->body, ==, test_md2, md2->bodylen);
+  tt_int_op(FN_FILE, ==, file_status(seg_fn));
+  s = read_file_to_str(fn, RFTS_BIN, NULL);
+  tt_assert(s);
+  tt_assert(!strstr(s, test_md2));
+  tor_free(s);
+
+  /* After a reload, both are back, and md1 is newer than its annotation. */
+  microdesc_free_all();
+  mc = get_microdesc_cache();
+  md1 = microdesc_cache_lookup_by_digest256(mc, d1);
+  md2 = microdesc_cache_lookup_by_digest256(mc, d2);
+  tt_assert(md1);
+  tt_assert(md2);
+  tt_int_op(md1->last_listed, ==, time2);
+  tt_int_op(md2->last_listed, ==, time1);
+  test_mem_op(md2->body, ==, test_md2, md2->bodylen);
+
+  /* Merging puts everything back into the cache file. */
+  tt_int_op(0, ==, microdesc_cache_rebuild(mc, 1));
+  tt_int_op(FN_NOENT, ==, file_status(seg_fn));
+  s = read_file_to_str(fn, RFTS_BIN, NULL);
+  tt_assert(s);
+  tt_assert(strstr(s, test_md1));
+  tt_assert(strstr(s, test_md2));
+  tt_assert(strstr(s, "@last-listed 2011-10-01 01:00:00\n"));
+  test_mem_op(md1->body, ==, test_md1, md1->bodylen);
+  test_mem_op(md2->body, ==, test_md2, md2->bodylen);
+
+ done:
+  if (added)
+    smartlist_free(added);
+  microdesc_free_all();
+  tor_free(options->DataDirectory);
+  tor_free(fn);
+  tor_free(seg_fn);
+  tor_free(s);
+}
+
+/** Check that the Bloom filter in front of the microdescriptor map never
+ * hides a microdescriptor we have. */
+static void
+test_md_digest_filter(void *data)
+{
+  or_options_t *options = get_options_mutable();
+  microdesc_cache_t *mc = NULL;
+  smartlist_t *added = NULL;
+  char d1[DIGEST256_LEN], d2[DIGEST256_LEN], d3[DIGEST256_LEN];
+  const char *test_md3_noannotation = strchr(test_md3, '\n')+1;
+  (void)data;
+
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("md_filter_datadir_test"));
+#ifdef MS_WINDOWS
+  tt_int_op(0, ==, mkdir(options->DataDirectory));
+#else
+  tt_int_op(0, ==, mkdir(options->DataDirectory, 0700));
+#endif
+  options->DescriptorDigestFilter = 1;
+  crypto_digest256(d1, test_md1, strlen(test_md1), DIGEST_SHA256);
+  crypto_digest256(d2, test_md2, strlen(test_md2), DIGEST_SHA256);
+  crypto_digest256(d3, test_md3_noannotation, strlen(test_md3_noannotation),
+                   DIGEST_SHA256);
+
+  mc = get_microdesc_cache();
+  added = microdescs_add_to_cache(mc, test_md1, NULL, SAVED_NOWHERE, 0,
+                                  time(NULL), NULL);
+  tt_int_op(1, ==, smartlist_len(added));
+  smartlist_free(added);
+  added = NULL;
+
+  /* The first lookup builds the filter. */
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d1));
+  tt_ptr_op(NULL, ==, microdesc_cache_lookup_by_digest256(mc, d2));
+
+  /* Anything we add afterwards goes into the filter too. */
+  added = microdescs_add_to_cache(mc, test_md2, NULL, SAVED_NOWHERE, 0,
+                                  time(NULL), NULL);
+  tt_int_op(1, ==, smartlist_len(added));
+  smartlist_free(added);
+  added = NULL;
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d1));
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d2));
+  tt_ptr_op(NULL, ==, microdesc_cache_lookup_by_digest256(mc, d3));
+
+  /* Turning the filter off changes nothing we can see. */
+  options->DescriptorDigestFilter = 0;
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d2));
+  tt_ptr_op(NULL, ==, microdesc_cache_lookup_by_digest256(mc, d3));
+
+ done:
+  if (added)
+    smartlist_free(added);
+  options->DescriptorDigestFilter = -1;
+  microdesc_free_all();
+  tor_free(options->DataDirectory);
+}
+
 struct testcase_t microdesc_tests[] = {
   { "cache", test_md_cache, TT_FORK, NULL, NULL },
+  { "shared_cache", test_md_shared_cache, TT_FORK, NULL, NULL },
+  { "segments", test_md_segments, TT_FORK, NULL, NULL },
+  { "digest_filter", test_md_digest_filter, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
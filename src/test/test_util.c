@@ -658,11 +658,12 @@ test_util_gzip(void)
                                  ZLIB_METHOD, 1, LOG_INFO));
   tt_assert(!buf3);
 
-  /* Now, try streaming compression. */
+  /* Now, try streaming compression, with the smallest compressor; the
+   * usual decompressor has to handle what it makes. */
   tor_free(buf1);
   tor_free(buf2);
   tor_free(buf3);
-  state = tor_zlib_new(1, ZLIB_METHOD);
+  state = tor_zlib_new(1, ZLIB_METHOD, LOW_COMPRESSION);
   tt_assert(state);
   cp1 = buf1 = tor_malloc(1024);
   len1 = 1024;
@@ -692,6 +693,87 @@ test_util_gzip(void)
   tor_free(buf1);
 }
 
+/** Run unit tests for LZMA compression and compression method names. */
+static void
+test_util_lzma(void)
+{
+  char *buf1=NULL, *buf2=NULL, *buf3=NULL, *cp1, *cp2;
+  const char *ccp2;
+  size_t len1, len2;
+  tor_zlib_state_t *state = NULL;
+
+  test_eq(compression_method_get_by_name("deflate"), ZLIB_METHOD);
+  test_eq(compression_method_get_by_name("x-gzip"), GZIP_METHOD);
+  test_eq(compression_method_get_by_name("x-tor-lzma"), LZMA_METHOD);
+  test_eq(compression_method_get_by_name("identity"), NO_METHOD);
+  test_eq(compression_method_get_by_name("lz4"), UNKNOWN_METHOD);
+  test_streq(compression_method_get_name(ZLIB_METHOD), "deflate");
+  test_streq(compression_method_get_name(LZMA_METHOD), "x-tor-lzma");
+  test_assert(tor_compress_supports_method(ZLIB_METHOD));
+  test_assert(!tor_compress_supports_method(UNKNOWN_METHOD));
+
+  if (!tor_compress_supports_method(LZMA_METHOD)) {
+    test_assert(tor_gzip_compress(&buf2, &len1, "x", 1, LZMA_METHOD));
+    test_assert(!tor_zlib_new(1, LZMA_METHOD, HIGH_COMPRESSION));
+    goto done;
+  }
+
+  buf1 = tor_strdup("AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAZAAAAAAAAAAAAAAAAAAAZ");
+  test_assert(!tor_gzip_compress(&buf2, &len1, buf1, strlen(buf1)+1,
+                                 LZMA_METHOD));
+  test_assert(buf2);
+  test_assert(detect_compression_method(buf2, len1) == LZMA_METHOD);
+  test_assert(!tor_gzip_uncompress(&buf3, &len2, buf2, len1,
+                                   LZMA_METHOD, 1, LOG_INFO));
+  test_eq(len2, strlen(buf1)+1);
+  test_streq(buf1, buf3);
+
+  /* Truncated input is rejected when we require complete output. */
+  tor_free(buf3);
+  test_assert(tor_gzip_uncompress(&buf3, &len2, buf2, len1-8,
+                                  LZMA_METHOD, 1, LOG_INFO));
+  test_assert(!buf3);
+
+  /* Now, try streaming compression. */
+  tor_free(buf1);
+  tor_free(buf2);
+  state = tor_zlib_new(1, LZMA_METHOD, HIGH_COMPRESSION);
+  tt_assert(state);
+  cp1 = buf1 = tor_malloc(1024);
+  len1 = 1024;
+  ccp2 = "ABCDEFGHIJABCDEFGHIJ";
+  len2 = 21;
+  test_assert(tor_zlib_process(state, &cp1, &len1, &ccp2, &len2, 0)
+              == TOR_ZLIB_OK);
+  test_eq(len2, 0);
+  len2 = 0;
+  cp2 = cp1;
+  test_assert(tor_zlib_process(state, &cp1, &len1, &ccp2, &len2, 1)
+              == TOR_ZLIB_DONE);
+  test_assert(cp1 > cp2);
+  tor_zlib_free(state);
+  state = NULL;
+
+  /* ...and streaming decompression. */
+  state = tor_zlib_new(0, LZMA_METHOD, HIGH_COMPRESSION);
+  tt_assert(state);
+  cp2 = buf2 = tor_malloc(1024);
+  len2 = 1024;
+  ccp2 = buf1;
+  len1 = 1024 - len1;
+  test_assert(tor_zlib_process(state, &cp2, &len2, &ccp2, &len1, 1)
+              == TOR_ZLIB_DONE);
+  test_eq(1024-len2, 21);
+  test_streq(buf2, "ABCDEFGHIJABCDEFGHIJ");
+
+ done:
+  if (state)
+    tor_zlib_free(state);
+  tor_free(buf2);
+  tor_free(buf3);
+  tor_free(buf1);
+}
+
 /** Run unit tests for mmap() wrapper functionality. */
 static void
 test_util_mmap(void)
@@ -755,6 +837,17 @@ test_util_mmap(void)
   tor_munmap_file(mapping);
   mapping = NULL;
 
+  /* Access hints don't change what we see. */
+  mapping = tor_mmap_file_flags(fname2, TOR_MMAP_SEQUENTIAL|TOR_MMAP_POPULATE);
+  test_assert(mapping);
+  test_eq(mapping->size, buflen);
+  test_memeq(mapping->data, buf, buflen);
+  tor_mmap_advise(mapping, TOR_MMAP_RANDOM);
+  test_memeq(mapping->data, buf, buflen);
+  tor_mmap_advise(mapping, 0);
+  tor_munmap_file(mapping);
+  mapping = NULL;
+
  done:
   unlink(fname1);
   unlink(fname2);
@@ -892,6 +985,7 @@ static void
 test_util_mempool(void)
 {
   mp_pool_t *pool = NULL;
+  mp_pool_stats_t stats;
   smartlist_t *allocated = NULL;
   int i;
 
@@ -932,6 +1026,27 @@ test_util_mempool(void)
       mp_pool_assert_ok(pool);
   }
 
+  /* Now make sure that we respect a limit on empty chunks. */
+  SMARTLIST_FOREACH(allocated, void *, m, mp_pool_release(m));
+  smartlist_clear(allocated);
+  mp_pool_clean(pool, 0, 0);
+  mp_pool_set_max_empty_chunks(pool, 1);
+  for (i = 0; i < pool->new_chunk_capacity * 4; ++i)
+    smartlist_add(allocated, mp_pool_get(pool));
+  mp_pool_get_stats(pool, &stats);
+  test_eq(stats.n_items_used, pool->new_chunk_capacity * 4);
+  test_eq(stats.n_full_chunks, 4);
+  test_eq(stats.n_empty_chunks, 0);
+  test_eq(stats.bytes_used, stats.bytes_allocated);
+  SMARTLIST_FOREACH(allocated, void *, m, mp_pool_release(m));
+  smartlist_clear(allocated);
+  mp_pool_assert_ok(pool);
+  mp_pool_get_stats(pool, &stats);
+  test_eq(stats.n_items_used, 0);
+  test_eq(stats.n_empty_chunks, 1);
+  test_eq(stats.n_used_chunks + stats.n_full_chunks, 0);
+  test_eq(stats.bytes_used, 0);
+
  done:
   if (allocated) {
     SMARTLIST_FOREACH(allocated, void *, m, mp_pool_release(m));
@@ -945,6 +1060,99 @@ test_util_mempool(void)
     mp_pool_destroy(pool);
 }
 
+/** Pool shared by the threads in test_util_mempool_threads(). */
+static mp_pool_t *_mp_thread_test_pool = NULL;
+/** Protects _mp_thread_test_done and _mp_thread_test_failed. */
+static tor_mutex_t *_mp_thread_test_mutex = NULL;
+/** Number of threads that have finished test_util_mempool_threads(). */
+static int _mp_thread_test_done = 0;
+/** Set if any thread found its items overwritten. */
+static int _mp_thread_test_failed = 0;
+
+/** Helper: body of each thread in test_util_mempool_threads(). */
+static void
+_mp_thread_test_func(void *_tag)
+{
+  unsigned char tag = (unsigned char)(uintptr_t)_tag;
+  unsigned char *items[100];
+  int i, j, failed = 0;
+
+  for (i = 0; i < 500; ++i) {
+    for (j = 0; j < 100; ++j) {
+      items[j] = mp_pool_get(_mp_thread_test_pool);
+      memset(items[j], tag, 64);
+    }
+    for (j = 0; j < 100; ++j) {
+      if (items[j][0] != tag || items[j][63] != tag)
+        failed = 1;
+      mp_pool_release(items[j]);
+    }
+  }
+  mp_pool_thread_cleanup();
+
+  tor_mutex_acquire(_mp_thread_test_mutex);
+  ++_mp_thread_test_done;
+  _mp_thread_test_failed |= failed;
+  tor_mutex_release(_mp_thread_test_mutex);
+  spawn_exit();
+}
+
+/** Run unit tests for using a memory pool from several threads. */
+static void
+test_util_mempool_threads(void)
+{
+  mp_pool_stats_t stats;
+  int done = 0;
+  time_t started;
+  void *item;
+#ifndef MS_WINDOWS
+  struct timeval tv;
+  tv.tv_sec=0;
+  tv.tv_usec=1000;
+#endif
+#ifndef TOR_IS_MULTITHREADED
+  if (1)
+    return;
+#endif
+  _mp_thread_test_pool = mp_pool_new(64, 4096);
+  test_eq(mp_pool_enable_threads(_mp_thread_test_pool), 0);
+  _mp_thread_test_mutex = tor_mutex_new();
+  _mp_thread_test_done = _mp_thread_test_failed = 0;
+
+  /* The main thread uses the pool while the others do. */
+  item = mp_pool_get(_mp_thread_test_pool);
+  spawn_func(_mp_thread_test_func, (void*)(uintptr_t)1);
+  spawn_func(_mp_thread_test_func, (void*)(uintptr_t)2);
+  spawn_func(_mp_thread_test_func, (void*)(uintptr_t)3);
+  started = time(NULL);
+  while (!done) {
+    tor_mutex_acquire(_mp_thread_test_mutex);
+    done = _mp_thread_test_done == 3 || time(NULL) > started + 25;
+    tor_mutex_release(_mp_thread_test_mutex);
+#ifndef MS_WINDOWS
+    select(0, NULL, NULL, NULL, &tv);
+#endif
+  }
+  test_eq(_mp_thread_test_done, 3);
+  test_eq(_mp_thread_test_failed, 0);
+
+  /* Everything the other threads used is back in the pool; only our item
+   * and our magazine are still out. */
+  mp_pool_release(item);
+  mp_pool_assert_ok(_mp_thread_test_pool);
+  mp_pool_thread_cleanup();
+  mp_pool_get_stats(_mp_thread_test_pool, &stats);
+  test_eq(stats.n_items_used, 0);
+
+ done:
+  if (_mp_thread_test_mutex)
+    tor_mutex_free(_mp_thread_test_mutex);
+  _mp_thread_test_mutex = NULL;
+  if (_mp_thread_test_pool)
+    mp_pool_destroy(_mp_thread_test_pool);
+  _mp_thread_test_pool = NULL;
+}
+
 /** Run unittests for memory area allocator */
 static void
 test_util_memarea(void)
@@ -1036,6 +1244,38 @@ test_util_memarea(void)
   test_assert(memarea_owns_ptr(area, p1));
   test_assert(memarea_owns_ptr(area, p2));
 
+  /* Chunks grow as an area fills, and return to per-size freelists. */
+  {
+    memarea_totals_t before, after;
+    size_t allocated, used;
+    memarea_t *area2;
+    memarea_clear_freelist();
+    memarea_get_totals(&before);
+    area2 = memarea_new();
+    for (i = 0; i < 1000; ++i)
+      memarea_alloc(area2, 100);
+    memarea_get_stats(area2, &allocated, &used);
+    test_assert(used >= 100000);
+    memarea_get_totals(&after);
+    test_eq(after.n_live_areas, before.n_live_areas + 1);
+    /* 4K, 8K, 16K, 32K, 64K: not 25 chunks of 4K. */
+    test_eq(after.n_chunk_allocs - before.n_chunk_allocs, 5);
+    memarea_drop_all(area2);
+    memarea_get_totals(&before);
+    test_eq(before.freelist_chunks, 5);
+    test_eq(before.live_bytes + allocated, after.live_bytes);
+
+    area2 = memarea_new();
+    for (i = 0; i < 1000; ++i)
+      memarea_alloc(area2, 100);
+    memarea_get_totals(&after);
+    test_eq(after.n_chunk_allocs, before.n_chunk_allocs);
+    test_eq(after.n_chunk_reuses - before.n_chunk_reuses, 5);
+    test_eq(after.freelist_chunks, 0);
+    memarea_drop_all(area2);
+    memarea_clear_freelist();
+  }
+
  done:
   memarea_drop_all(area);
   tor_free(malloced_ptr);
@@ -1114,6 +1354,10 @@ test_util_find_str_at_start_of_line(void *ptr)
   const char *long_string =
     "hello world. hello world. hello hello. howdy.\n"
     "hello hello world\n";
+#define LONG_NEEDLE \
+  "a needle that is too long to copy into a small buffer on the stack, " \
+  "even with a newline in front of it"
+  const char *long_haystack = "x\n" LONG_NEEDLE "\n";
 
   (void)ptr;
 
@@ -1130,6 +1374,15 @@ test_util_find_str_at_start_of_line(void *ptr)
   /* start-of-line case */
   tt_assert(strchr(long_string,'\n')+1 ==
             find_str_at_start_of_line(long_string, "hello hello"));
+
+  /* A match in mid-line doesn't count. */
+  tt_assert(! find_str_at_start_of_line(long_string, "howdy"));
+
+  /* Needles too long for our fast path still work. */
+  tt_assert(! find_str_at_start_of_line(long_string, LONG_NEEDLE));
+  tt_assert(long_haystack + 2 ==
+            find_str_at_start_of_line(long_haystack, LONG_NEEDLE));
+#undef LONG_NEEDLE
  done:
   ;
 }
@@ -1212,6 +1465,61 @@ test_util_listdir(void *ptr)
   }
 }
 
+static void
+test_util_file_writer(void *ptr)
+{
+  char *fname1=NULL, *fname2=NULL, *cp=NULL;
+  smartlist_t *chunks = smartlist_create();
+  sized_chunk_t c1 = { "abc", 3 }, c2 = { "def\n", 4 };
+  (void)ptr;
+
+  fname1 = tor_strdup(get_fname("async_1"));
+  fname2 = tor_strdup(get_fname("async_2"));
+  smartlist_add(chunks, &c1);
+  smartlist_add(chunks, &c2);
+
+  /* Without a writer thread, we write synchronously. */
+  tt_int_op(write_str_to_file_async(fname1, "sync\n", 0), ==, 0);
+  cp = read_file_to_str(fname1, 0, NULL);
+  tt_str_op(cp, ==, "sync\n");
+  tor_free(cp);
+
+#ifdef TOR_HAVE_COND
+  tt_int_op(file_writer_start(), ==, 0);
+#endif
+  /* Repeated writes coalesce; reading waits for the newest contents. */
+  tt_int_op(write_str_to_file_async(fname1, "one\n", 0), ==, 0);
+  tt_int_op(write_str_to_file_async(fname1, "two\n", 0), ==, 0);
+  tt_int_op(write_chunks_to_file_async(fname2, chunks, 0), ==, 0);
+  tt_int_op(write_str_to_file_async(fname1, "three\n", 0), ==, 0);
+  cp = read_file_to_str(fname1, 0, NULL);
+  tt_str_op(cp, ==, "three\n");
+  tor_free(cp);
+
+  /* A synchronous write lands after anything queued before it. */
+  tt_int_op(write_str_to_file_async(fname1, "four\n", 0), ==, 0);
+  tt_int_op(write_str_to_file(fname1, "five\n", 0), ==, 0);
+  file_writer_flush();
+  cp = read_file_to_str(fname1, 0, NULL);
+  tt_str_op(cp, ==, "five\n");
+  tor_free(cp);
+
+  tt_int_op(write_str_to_file_async(fname1, "six\n", 0), ==, 0);
+  file_writer_shutdown();
+  cp = read_file_to_str(fname1, 0, NULL);
+  tt_str_op(cp, ==, "six\n");
+  tor_free(cp);
+  cp = read_file_to_str(fname2, 0, NULL);
+  tt_str_op(cp, ==, "abcdef\n");
+
+ done:
+  file_writer_shutdown();
+  tor_free(fname1);
+  tor_free(fname2);
+  tor_free(cp);
+  smartlist_free(chunks);
+}
+
 static void
 test_util_parent_dir(void *ptr)
 {
@@ -1747,6 +2055,26 @@ test_util_di_ops(void)
     test_eq(neq1, !eq1);
   }
 
+  /* tor_memeq works a word at a time where it can: flip each bit of
+   * buffers of assorted lengths and alignments, and make sure it always
+   * notices. */
+  {
+    char buf1[48], buf2[48];
+    size_t off, len, bit;
+    crypto_rand(buf1, sizeof(buf1));
+    for (len = 0; len <= 40; ++len) {
+      for (off = 0; off < 8; off += 3) {
+        memcpy(buf2, buf1, sizeof(buf2));
+        test_eq(1, tor_memeq(buf1+off, buf2+off, len));
+        for (bit = 0; bit < len*8; ++bit) {
+          buf2[off + bit/8] ^= (char)(1 << (bit%8));
+          test_eq(0, tor_memeq(buf1+off, buf2+off, len));
+          buf2[off + bit/8] ^= (char)(1 << (bit%8));
+        }
+      }
+    }
+  }
+
  done:
   ;
 }
@@ -1837,6 +2165,32 @@ test_util_eat_whitespace(void *ptr)
   ;
 }
 
+/** Make sure that the monotonic clock and its cached copy never go
+ * backwards, and that the cached copy only moves when we update it. */
+static void
+test_util_monotonic_msec(void *arg)
+{
+  uint64_t t1, t2, cached1, cached2;
+  (void)arg;
+
+  t1 = tor_get_monotonic_msec();
+  update_approx_monotonic_msec();
+  cached1 = approx_monotonic_msec();
+  tt_assert(cached1 >= t1);
+  /* Wait for the clock to tick. */
+  do {
+    t2 = tor_get_monotonic_msec();
+  } while (t2 == cached1);
+  tt_assert(t2 > cached1);
+  tt_assert(approx_monotonic_msec() == cached1);
+  update_approx_monotonic_msec();
+  cached2 = approx_monotonic_msec();
+  tt_assert(cached2 >= t2);
+
+ done:
+  ;
+}
+
 #define UTIL_LEGACY(name)                                               \
   { #name, legacy_test_helper, 0, &legacy_setup, test_util_ ## name }
 
@@ -1849,8 +2203,10 @@ struct testcase_t util_tests[] = {
   UTIL_LEGACY(strmisc),
   UTIL_LEGACY(pow2),
   UTIL_LEGACY(gzip),
+  UTIL_LEGACY(lzma),
   UTIL_LEGACY(datadir),
   UTIL_LEGACY(mempool),
+  UTIL_LEGACY(mempool_threads),
   UTIL_LEGACY(memarea),
   UTIL_LEGACY(control_formats),
   UTIL_LEGACY(mmap),
@@ -1861,6 +2217,7 @@ struct testcase_t util_tests[] = {
   UTIL_TEST(find_str_at_start_of_line, 0),
   UTIL_TEST(asprintf, 0),
   UTIL_TEST(listdir, 0),
+  UTIL_TEST(file_writer, 0),
   UTIL_TEST(parent_dir, 0),
 #ifdef MS_WINDOWS
   UTIL_TEST(load_win_lib, 0),
@@ -1876,6 +2233,7 @@ struct testcase_t util_tests[] = {
   UTIL_TEST(split_lines, 0),
   UTIL_TEST(n_bits_set, 0),
   UTIL_TEST(eat_whitespace, 0),
+  UTIL_TEST(monotonic_msec, 0),
   END_OF_TESTCASES
 };
 
@@ -8,6 +8,7 @@
 #include "compat.h"
 #include "../common/util.h"
 #include "address.h"
+#include "container.h"
 #include "../common/torlog.h"
 
 #include <stdio.h>
@@ -31,6 +32,9 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h> /* for select() */
+#endif
 
 #ifdef MS_WINDOWS
 #if defined(_MSC_VER) && (_MSC_VER <= 1300)
@@ -42,6 +46,13 @@
 #endif
 
 #define RESPONSE_LEN_4 8
+/** Longest SOCKS5 resolve reply we need to read: a header, a length byte, a
+ * hostname, and a port. */
+#define RESPONSE_LEN_5_MAX (4+1+255+2)
+/** In batch mode, how many resolves do we keep in flight by default? */
+#define DEFAULT_BATCH_PARALLELISM 32
+/** In batch mode, never keep more than this many resolves in flight. */
+#define MAX_BATCH_PARALLELISM 512
 #define log_sock_error(act, _s)                                         \
   STMT_BEGIN log_fn(LOG_ERR, LD_NET, "Error while %s: %s", act,         \
               tor_socket_strerror(tor_socket_errno(_s))); STMT_END
@@ -304,12 +315,369 @@ do_resolve(const char *hostname, uint32_t sockshost, uint16_t socksport,
   return 0;
 }
 
+/** Given the first <b>len</b> bytes of a SOCKS5 resolve reply in
+ * <b>response</b>, return 1 if we need more bytes to parse it.  Otherwise,
+ * store the address it contains (in host order) into *<b>addr_out</b>, or
+ * the hostname it contains into a newly allocated *<b>hostname_out</b>, and
+ * return 0; or return -1 on error. */
+static int
+parse_socks5_resolve_response(const char *hostname,
+                              const char *response, size_t len,
+                              uint32_t *addr_out, char **hostname_out)
+{
+  size_t result_len;
+  tor_assert(response);
+  tor_assert(addr_out);
+  tor_assert(hostname_out);
+
+  if (len < 4)
+    return 1;
+  if (response[0] != 5) {
+    log_warn(LD_PROTOCOL, "Bad SOCKS5 reply version.");
+    return -1;
+  }
+  if (response[1] != 0) {
+    log_warn(LD_NET, "Got SOCKS5 status response '%u' for %s: %s",
+             (unsigned)response[1], hostname,
+             socks5_reason_to_string(response[1]));
+    return -1;
+  }
+  if (response[3] == 1) {
+    /* IPv4 address */
+    if (len < 8)
+      return 1;
+    *addr_out = ntohl(get_uint32(response+4));
+    return 0;
+  } else if (response[3] == 3) {
+    if (len < 5)
+      return 1;
+    result_len = *(uint8_t*)(response+4);
+    if (len < 5 + result_len)
+      return 1;
+    *hostname_out = tor_strndup(response+5, result_len);
+    return 0;
+  } else {
+    log_warn(LD_PROTOCOL, "Unsupported address type %u in SOCKS5 reply "
+             "for %s.", (unsigned)response[3], hostname);
+    return -1;
+  }
+}
+
+/** Possible states for a resolve request in batch mode. */
+typedef enum {
+  /** Connecting to the SOCKS server, or sending something to it. */
+  BATCH_WRITING,
+  /** Waiting for the SOCKS5 method selection reply. */
+  BATCH_READING_METHOD,
+  /** Waiting for the answer to our resolve request. */
+  BATCH_READING_REPLY
+} batch_resolve_state_t;
+
+/** A single resolve request that batch mode has in flight. */
+typedef struct batch_resolve_t {
+  /** Our socket to the SOCKS server. */
+  tor_socket_t s;
+  /** The name or address we're resolving. */
+  char *hostname;
+  batch_resolve_state_t state;
+  /** The SOCKS resolve request to send. */
+  char *request;
+  size_t request_len;
+  /** True iff we've queued <b>request</b> for sending. */
+  unsigned int sent_request : 1;
+  /** What we're sending now, how long it is, and how much of it we've
+   * sent. */
+  const char *out;
+  size_t out_len, out_pos;
+  /** What we've received so far in the current state. */
+  char in[RESPONSE_LEN_5_MAX];
+  size_t in_len;
+} batch_resolve_t;
+
+/** Release all storage held by <b>br</b>, and close its socket. */
+static void
+batch_resolve_free(batch_resolve_t *br)
+{
+  if (!br)
+    return;
+  if (br->s >= 0)
+    tor_close_socket(br->s);
+  tor_free(br->hostname);
+  tor_free(br->request);
+  tor_free(br);
+}
+
+/** Start resolving <b>hostname</b> through the SOCKS server at
+ * <b>sockshost</b>:<b>socksport</b> without blocking.  Return a new
+ * batch_resolve_t on success, or NULL on failure. */
+static batch_resolve_t *
+batch_resolve_launch(const char *hostname,
+                     uint32_t sockshost, uint16_t socksport,
+                     int reverse, int version)
+{
+  batch_resolve_t *br;
+  struct sockaddr_in socksaddr;
+  ssize_t len;
+
+  br = tor_malloc_zero(sizeof(batch_resolve_t));
+  br->s = -1;
+  br->hostname = tor_strdup(hostname);
+  if ((len = build_socks_resolve_request(&br->request, "", hostname,
+                                         reverse, version)) < 0) {
+    batch_resolve_free(br);
+    return NULL;
+  }
+  br->request_len = len;
+
+  br->s = tor_open_socket(PF_INET,SOCK_STREAM,IPPROTO_TCP);
+  if (br->s < 0) {
+    log_sock_error("creating_socket", -1);
+    batch_resolve_free(br);
+    return NULL;
+  }
+#ifndef MS_WINDOWS
+  if (br->s >= FD_SETSIZE) {
+    log_warn(LD_NET, "Too many sockets open; try a smaller -n.");
+    batch_resolve_free(br);
+    return NULL;
+  }
+#endif
+  set_socket_nonblocking(br->s);
+
+  memset(&socksaddr, 0, sizeof(socksaddr));
+  socksaddr.sin_family = AF_INET;
+  socksaddr.sin_port = htons(socksport);
+  socksaddr.sin_addr.s_addr = htonl(sockshost);
+  if (connect(br->s, (struct sockaddr*)&socksaddr, sizeof(socksaddr)) &&
+      !ERRNO_IS_CONN_EINPROGRESS(tor_socket_errno(br->s))) {
+    log_sock_error("connecting to SOCKS host", br->s);
+    batch_resolve_free(br);
+    return NULL;
+  }
+
+  br->state = BATCH_WRITING;
+  if (version == 5) {
+    br->out = "\x05\x01\x00";
+    br->out_len = 3;
+  } else {
+    br->out = br->request;
+    br->out_len = br->request_len;
+    br->sent_request = 1;
+  }
+  return br;
+}
+
+/** Print the answer we got for <b>br</b>. */
+static void
+batch_resolve_print_result(const batch_resolve_t *br, uint32_t result,
+                           const char *result_hostname)
+{
+  char buf[INET_NTOA_BUF_LEN];
+  struct in_addr a;
+  if (result_hostname) {
+    printf("%s %s\n", br->hostname, result_hostname);
+  } else {
+    a.s_addr = htonl(result);
+    tor_inet_ntoa(&a, buf, sizeof(buf));
+    printf("%s %s\n", br->hostname, buf);
+  }
+}
+
+/** Our socket for <b>br</b> is writable: send as much as we can.  Return 0
+ * if <b>br</b> is still in progress, or -1 if it failed. */
+static int
+batch_resolve_handle_write(batch_resolve_t *br)
+{
+  int n;
+  tor_assert(br->state == BATCH_WRITING);
+
+  n = (int)send(br->s, br->out + br->out_pos,
+                (int)(br->out_len - br->out_pos), 0);
+  if (n < 0) {
+    if (ERRNO_IS_EAGAIN(tor_socket_errno(br->s)))
+      return 0;
+    log_sock_error("sending SOCKS request", br->s);
+    return -1;
+  }
+  br->out_pos += n;
+  if (br->out_pos == br->out_len) {
+    br->state = br->sent_request ? BATCH_READING_REPLY : BATCH_READING_METHOD;
+    br->in_len = 0;
+  }
+  return 0;
+}
+
+/** Our socket for <b>br</b> is readable: read and handle what we can.
+ * Return 0 if <b>br</b> is still in progress, 1 if it finished, or -1 if
+ * it failed. */
+static int
+batch_resolve_handle_read(batch_resolve_t *br, int version)
+{
+  int n, r;
+  uint32_t result = 0;
+  char *result_hostname = NULL;
+  tor_assert(br->state != BATCH_WRITING);
+
+  n = (int)recv(br->s, br->in + br->in_len,
+                (int)(sizeof(br->in) - br->in_len), 0);
+  if (n < 0) {
+    if (ERRNO_IS_EAGAIN(tor_socket_errno(br->s)))
+      return 0;
+    log_sock_error("reading SOCKS response", br->s);
+    return -1;
+  } else if (n == 0) {
+    log_warn(LD_NET, "SOCKS server closed the connection while "
+             "resolving %s.", br->hostname);
+    return -1;
+  }
+  br->in_len += n;
+
+  if (br->state == BATCH_READING_METHOD) {
+    if (br->in_len < 2)
+      return 0;
+    if (br->in[0] != '\x05' || br->in[1] != '\x00') {
+      log_warn(LD_NET, "Unrecognized SOCKS5 method reply: %u %u",
+               (unsigned)br->in[0], (unsigned)br->in[1]);
+      return -1;
+    }
+    br->state = BATCH_WRITING;
+    br->out = br->request;
+    br->out_len = br->request_len;
+    br->out_pos = 0;
+    br->sent_request = 1;
+    return 0;
+  }
+
+  if (version == 4) {
+    if (br->in_len < RESPONSE_LEN_4)
+      return 0;
+    r = parse_socks4a_resolve_response(br->hostname, br->in, br->in_len,
+                                       &result);
+  } else {
+    r = parse_socks5_resolve_response(br->hostname, br->in, br->in_len,
+                                      &result, &result_hostname);
+    if (r == 1)
+      return 0;
+  }
+  if (r < 0)
+    return -1;
+
+  batch_resolve_print_result(br, result, result_hostname);
+  tor_free(result_hostname);
+  return 1;
+}
+
+/** Read hostnames from <b>in</b>, one per line, and resolve them through
+ * the SOCKS server at <b>sockshost</b>:<b>socksport</b>, keeping up to
+ * <b>parallelism</b> requests in flight at once.  Tor only answers one
+ * resolve per SOCKS connection, so each request gets its own connection.
+ * Print each answer as soon as it arrives.  Return 0 if every resolve
+ * succeeded, and -1 otherwise. */
+static int
+do_batch_resolve(FILE *in, uint32_t sockshost, uint16_t socksport,
+                 int reverse, int version, int parallelism)
+{
+  smartlist_t *active = smartlist_create();
+  char line[512];
+  int at_eof = 0, n_failed = 0;
+  tor_assert(version == 4 || version == 5);
+
+  while (!at_eof || smartlist_len(active)) {
+    fd_set readfds, writefds;
+    tor_socket_t max_fd = -1;
+
+    /* Top up the requests in flight from our input. */
+    while (!at_eof && smartlist_len(active) < parallelism) {
+      batch_resolve_t *br;
+      char *hostname;
+      size_t len;
+      if (!fgets(line, sizeof(line), in)) {
+        at_eof = 1;
+        break;
+      }
+      len = strlen(line);
+      if (len && line[len-1] != '\n' && !feof(in)) {
+        int c;
+        log_warn(LD_GENERAL, "Skipping overlong input line.");
+        while ((c = getc(in)) != EOF && c != '\n')
+          ;
+        ++n_failed;
+        continue;
+      }
+      hostname = (char*)eat_whitespace(line);
+      len = strlen(hostname);
+      while (len && TOR_ISSPACE(hostname[len-1]))
+        hostname[--len] = '\0';
+      if (!len || *hostname == '#')
+        continue;
+      if (len > 255) {
+        log_warn(LD_GENERAL, "Hostname \"%s\" is too long.", hostname);
+        ++n_failed;
+        continue;
+      }
+      br = batch_resolve_launch(hostname, sockshost, socksport,
+                                reverse, version);
+      if (br)
+        smartlist_add(active, br);
+      else
+        ++n_failed;
+    }
+    if (!smartlist_len(active))
+      continue;
+
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    SMARTLIST_FOREACH_BEGIN(active, batch_resolve_t *, br) {
+      if (br->state == BATCH_WRITING)
+        FD_SET(br->s, &writefds);
+      else
+        FD_SET(br->s, &readfds);
+      if (br->s > max_fd)
+        max_fd = br->s;
+    } SMARTLIST_FOREACH_END(br);
+
+    if (select((int)max_fd+1, &readfds, &writefds, NULL, NULL) < 0) {
+      int e = tor_socket_errno(-1);
+      if (e == EINTR)
+        continue;
+      log_err(LD_NET, "select() failed: %s", tor_socket_strerror(e));
+      n_failed += smartlist_len(active);
+      SMARTLIST_FOREACH(active, batch_resolve_t *, br,
+                        batch_resolve_free(br));
+      smartlist_clear(active);
+      break;
+    }
+
+    SMARTLIST_FOREACH_BEGIN(active, batch_resolve_t *, br) {
+      int r = 0;
+      if (FD_ISSET(br->s, &writefds))
+        r = batch_resolve_handle_write(br);
+      else if (FD_ISSET(br->s, &readfds))
+        r = batch_resolve_handle_read(br, version);
+      if (r) {
+        if (r < 0)
+          ++n_failed;
+        SMARTLIST_DEL_CURRENT(active, br);
+        batch_resolve_free(br);
+      }
+    } SMARTLIST_FOREACH_END(br);
+
+    /* Let whoever is reading our output see answers as they arrive. */
+    fflush(stdout);
+  }
+
+  smartlist_free(active);
+  return n_failed ? -1 : 0;
+}
+
 /** Print a usage message and exit. */
 static void
 usage(void)
 {
   puts("Syntax: tor-resolve [-4] [-v] [-x] [-F] [-p port] "
-       "hostname [sockshost:socksport]");
+       "hostname [sockshost:socksport]\n"
+       "        tor-resolve -b [-n count] [-4] [-v] [-x] [-p port] "
+       "[sockshost:socksport]");
   exit(1);
 }
 
@@ -319,7 +687,9 @@ main(int argc, char **argv)
 {
   uint32_t sockshost;
   uint16_t socksport = 0, port_option = 0;
-  int isSocks4 = 0, isVerbose = 0, isReverse = 0;
+  int isSocks4 = 0, isVerbose = 0, isReverse = 0, isBatch = 0;
+  int parallelism = DEFAULT_BATCH_PARALLELISM;
+  const char *hostname = NULL, *socks_arg = NULL;
   char **arg;
   int n_args;
   struct in_addr a;
@@ -349,6 +719,22 @@ main(int argc, char **argv)
       isSocks4 = 0;
     else if (!strcmp("-x", arg[0]))
       isReverse = 1;
+    else if (!strcmp("-b", arg[0]))
+      isBatch = 1;
+    else if (!strcmp("-n", arg[0])) {
+      if (n_args < 2) {
+        fprintf(stderr, "No arguments given to -n\n");
+        usage();
+      }
+      parallelism = atoi(arg[1]);
+      if (parallelism < 1 || parallelism > MAX_BATCH_PARALLELISM) {
+        fprintf(stderr, "-n requires a number between 1 and %d\n",
+                MAX_BATCH_PARALLELISM);
+        usage();
+      }
+      ++arg; /* skip the count */
+      --n_args;
+    }
     else if (!strcmp("-p", arg[0])) {
       int p;
       if (n_args < 2) {
@@ -382,7 +768,18 @@ main(int argc, char **argv)
     set_log_severity_config(LOG_WARN, LOG_ERR, s);
   add_stream_log(s, "<stderr>", fileno(stderr));
 
-  if (n_args == 1) {
+  if (isBatch) {
+    if (n_args > 1)
+      usage();
+    socks_arg = n_args ? arg[0] : NULL;
+  } else {
+    if (n_args < 1 || n_args > 2)
+      usage();
+    hostname = arg[0];
+    socks_arg = n_args == 2 ? arg[1] : NULL;
+  }
+
+  if (!socks_arg) {
     log_debug(LD_CONFIG, "defaulting to localhost");
     sockshost = 0x7f000001u; /* localhost */
     if (port_option) {
@@ -392,9 +789,10 @@ main(int argc, char **argv)
       log_debug(LD_CONFIG, "defaulting to port 9050");
       socksport = 9050; /* 9050 */
     }
-  } else if (n_args == 2) {
-    if (addr_port_lookup(LOG_WARN, arg[1], NULL, &sockshost, &socksport)<0) {
-      fprintf(stderr, "Couldn't parse/resolve address %s", arg[1]);
+  } else {
+    if (addr_port_lookup(LOG_WARN, socks_arg, NULL,
+                         &sockshost, &socksport)<0) {
+      fprintf(stderr, "Couldn't parse/resolve address %s", socks_arg);
       return 1;
     }
     if (socksport && port_option && socksport != port_option) {
@@ -406,8 +804,6 @@ main(int argc, char **argv)
       log_debug(LD_CONFIG, "defaulting to port 9050");
       socksport = 9050;
     }
-  } else {
-    usage();
   }
 
   if (network_init()<0) {
@@ -415,7 +811,11 @@ main(int argc, char **argv)
     return 1;
   }
 
-  if (do_resolve(arg[0], sockshost, socksport, isReverse,
+  if (isBatch)
+    return do_batch_resolve(stdin, sockshost, socksport, isReverse,
+                            isSocks4 ? 4 : 5, parallelism) < 0 ? 1 : 0;
+
+  if (do_resolve(hostname, sockshost, socksport, isReverse,
                  isSocks4 ? 4 : 5, &result,
                  &result_hostname))
     return 1;